@@ -0,0 +1,173 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bitops.h"
+
+#include <absl/base/internal/endian.h>
+#include <absl/numeric/bits.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <cstring>
+
+namespace dfly {
+
+namespace {
+
+inline uint64_t LoadWord(const uint8_t* p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+inline void StoreWord(uint64_t w, uint8_t* p) {
+  memcpy(p, &w, sizeof(w));
+}
+
+template <BitOp op> inline uint64_t Apply(uint64_t dest, uint64_t src) {
+  switch (op) {
+    case BitOp::AND:
+      return dest & src;
+    case BitOp::OR:
+      return dest | src;
+    case BitOp::XOR:
+      return dest ^ src;
+    case BitOp::NOT:
+      return ~src;
+  }
+  return 0;
+}
+
+#if defined(__AVX2__)
+template <BitOp op> inline __m256i Apply(__m256i dest, __m256i src) {
+  switch (op) {
+    case BitOp::AND:
+      return _mm256_and_si256(dest, src);
+    case BitOp::OR:
+      return _mm256_or_si256(dest, src);
+    case BitOp::XOR:
+      return _mm256_xor_si256(dest, src);
+    case BitOp::NOT:
+      return _mm256_xor_si256(src, _mm256_set1_epi8(-1));
+  }
+  return src;
+}
+#endif
+
+template <BitOp op> void ApplyT(const uint8_t* src, size_t len, uint8_t* dest) {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  // 4 vectors per iteration keep both load ports busy.
+  for (; i + 128 <= len; i += 128) {
+    for (unsigned j = 0; j < 128; j += 32) {
+      __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + j));
+      __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest + i + j));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i + j), Apply<op>(d, s));
+    }
+  }
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    StoreWord(Apply<op>(LoadWord(dest + i), LoadWord(src + i)), dest + i);
+  }
+
+  for (; i < len; ++i) {
+    dest[i] = Apply<op>(dest[i], src[i]);
+  }
+}
+
+}  // namespace
+
+uint64_t CountBits(const uint8_t* data, size_t len) {
+  uint64_t res = 0;
+  size_t i = 0;
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  __m512i acc = _mm512_setzero_si512();
+  for (; i + 64 <= len; i += 64) {
+    __m512i v = _mm512_loadu_si512(data + i);
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+  }
+  res += _mm512_reduce_add_epi64(acc);
+#elif defined(__AVX2__)
+  // Counts the bits of each nibble with a lookup table in a register and sums the bytes of each
+  // quadword with sad.
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                                          2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i cnt =
+        _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+
+  res += uint64_t(_mm256_extract_epi64(acc, 0)) + uint64_t(_mm256_extract_epi64(acc, 1)) +
+         uint64_t(_mm256_extract_epi64(acc, 2)) + uint64_t(_mm256_extract_epi64(acc, 3));
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    res += absl::popcount(LoadWord(data + i));
+  }
+
+  for (; i < len; ++i) {
+    res += absl::popcount(data[i]);
+  }
+
+  return res;
+}
+
+int64_t FindFirstBit(const uint8_t* data, size_t len, bool bit) {
+  // The bytes that do not have the bit.
+  const uint8_t skip = bit ? 0 : 0xff;
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i skip_v = _mm256_set1_epi8(skip);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    if (uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, skip_v))) != UINT32_MAX)
+      break;
+  }
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w = absl::big_endian::Load64(data + i);
+    if (!bit)
+      w = ~w;
+    if (w)
+      return int64_t(i * 8 + absl::countl_zero(w));
+  }
+
+  for (; i < len; ++i) {
+    if (data[i] != skip) {
+      uint8_t b = bit ? data[i] : static_cast<uint8_t>(~data[i]);
+      return int64_t(i * 8 + absl::countl_zero(b));
+    }
+  }
+
+  return -1;
+}
+
+void ApplyBitOp(BitOp op, const uint8_t* src, size_t len, uint8_t* dest) {
+  switch (op) {
+    case BitOp::AND:
+      return ApplyT<BitOp::AND>(src, len, dest);
+    case BitOp::OR:
+      return ApplyT<BitOp::OR>(src, len, dest);
+    case BitOp::XOR:
+      return ApplyT<BitOp::XOR>(src, len, dest);
+    case BitOp::NOT:
+      return ApplyT<BitOp::NOT>(src, len, dest);
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,28 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dfly {
+
+// Kernels of the bitmap commands. Like in redis, the bits of a byte array are numbered from the
+// most significant bit of its first byte. The kernels use AVX2 or AVX-512 when the build
+// targets them.
+
+enum class BitOp : uint8_t { AND, OR, XOR, NOT };
+
+// Returns the number of the set bits in the first len bytes of data.
+uint64_t CountBits(const uint8_t* data, size_t len);
+
+// Returns the position of the first bit that equals bit or -1 if there is none.
+int64_t FindFirstBit(const uint8_t* data, size_t len, bool bit);
+
+// Stores dest[i] = dest[i] op src[i] for the first len bytes, NOT stores ~src[i].
+// src may be dest.
+void ApplyBitOp(BitOp op, const uint8_t* src, size_t len, uint8_t* dest);
+
+}  // namespace dfly
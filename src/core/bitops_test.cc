@@ -0,0 +1,88 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bitops.h"
+
+#include <random>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class BitOpsTest : public ::testing::Test {
+ protected:
+  static bool GetBit(const vector<uint8_t>& v, size_t pos) {
+    return v[pos / 8] & (0x80 >> (pos % 8));
+  }
+
+  vector<uint8_t> Random(size_t len) {
+    vector<uint8_t> res(len);
+    for (auto& b : res)
+      b = gen_();
+    return res;
+  }
+
+  mt19937 gen_{42};
+};
+
+// The lengths cover the vector loops and their tails.
+TEST_F(BitOpsTest, CountBits) {
+  for (size_t len : {0, 1, 7, 8, 31, 32, 63, 64, 100, 129, 1000}) {
+    vector<uint8_t> v = Random(len);
+    uint64_t expected = 0;
+    for (size_t i = 0; i < len * 8; ++i)
+      expected += GetBit(v, i);
+
+    EXPECT_EQ(expected, CountBits(v.data(), len)) << len;
+  }
+}
+
+TEST_F(BitOpsTest, FindFirstBit) {
+  EXPECT_EQ(-1, FindFirstBit(nullptr, 0, true));
+
+  for (size_t len : {1, 9, 33, 100, 1000}) {
+    for (size_t pos : {size_t(0), len * 4, len * 8 - 1}) {
+      vector<uint8_t> zeros(len, 0), ones(len, 0xff);
+      zeros[pos / 8] |= 0x80 >> (pos % 8);
+      ones[pos / 8] &= ~(0x80 >> (pos % 8));
+
+      EXPECT_EQ(int64_t(pos), FindFirstBit(zeros.data(), len, true)) << len;
+      EXPECT_EQ(int64_t(pos), FindFirstBit(ones.data(), len, false)) << len;
+    }
+
+    vector<uint8_t> ones(len, 0xff);
+    EXPECT_EQ(-1, FindFirstBit(ones.data(), len, false));
+    EXPECT_EQ(0, FindFirstBit(ones.data(), len, true));
+  }
+}
+
+TEST_F(BitOpsTest, ApplyBitOp) {
+  for (size_t len : {3, 64, 200, 1000}) {
+    vector<uint8_t> src = Random(len), dest = Random(len);
+
+    for (BitOp op : {BitOp::AND, BitOp::OR, BitOp::XOR, BitOp::NOT}) {
+      vector<uint8_t> res = dest;
+      ApplyBitOp(op, src.data(), len, res.data());
+
+      for (size_t i = 0; i < len; ++i) {
+        uint8_t expected = op == BitOp::AND   ? dest[i] & src[i]
+                           : op == BitOp::OR  ? dest[i] | src[i]
+                           : op == BitOp::XOR ? dest[i] ^ src[i]
+                                              : uint8_t(~src[i]);
+        ASSERT_EQ(expected, res[i]) << len << " " << i;
+      }
+    }
+  }
+
+  // In place.
+  vector<uint8_t> v(100, 0x0f);
+  ApplyBitOp(BitOp::NOT, v.data(), v.size(), v.data());
+  EXPECT_EQ(vector<uint8_t>(100, 0xf0), v);
+}
+
+}  // namespace dfly
@@ -0,0 +1,243 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom.h"
+
+#include <absl/numeric/int128.h>
+#include <xxhash.h>
+
+#include <cmath>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kBlockBits = Bloom::kBlockBytes * 8;
+
+// The error rate of each new filter is tighter by this ratio than of the previous one.
+constexpr double kTighteningRatio = 0.5;
+
+// Items of the batched calls that are hashed and prefetched ahead of the filter accesses.
+constexpr size_t kBatchLen = 16;
+
+// The error rate of a blocked filter with bits_per_item bits and hash_cnt hashes per item.
+// The blocks are loaded unevenly: the number of the items of a block follows the Poisson
+// distribution with the mean of the items per block.
+double BlockedFpRate(double bits_per_item, unsigned hash_cnt) {
+  double lambda = kBlockBits / bits_per_item;
+  unsigned limit = lambda + 10 * sqrt(lambda) + 10;
+  double log_pmf = -lambda;  // of 0 items.
+  double res = 0;
+
+  for (unsigned i = 0; i <= limit; ++i) {
+    if (i > 0)
+      log_pmf += log(lambda) - log(i);
+    double block_fp = pow(1 - pow(1 - 1.0 / kBlockBits, double(hash_cnt) * i), hash_cnt);
+    res += exp(log_pmf) * block_fp;
+  }
+
+  return res;
+}
+
+// Produces the bits of an item within its block. Double hashing is not used because a block
+// has few distinct probe sequences, so that the items that share all their bits would dominate
+// the error rate. Instead, the hash and then the words of a splitmix64 sequence seeded by it are
+// consumed 9 bits at a time.
+class BitSequence {
+ public:
+  explicit BitSequence(uint64_t hash) : state_(hash), word_(hash) {
+  }
+
+  unsigned Next() {
+    static_assert(kBlockBits == 1 << 9);
+    if (left_ < 9) {
+      state_ += 0x9e3779b97f4a7c15ULL;
+      word_ = (state_ ^ (state_ >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      word_ = (word_ ^ (word_ >> 27)) * 0x94d049bb133111ebULL;
+      word_ ^= word_ >> 31;
+      left_ = 64;
+    }
+    unsigned res = word_ % kBlockBits;
+    word_ >>= 9;
+    left_ -= 9;
+    return res;
+  }
+
+ private:
+  uint64_t state_;
+  uint64_t word_;
+  unsigned left_ = 64;
+};
+
+}  // namespace
+
+auto Bloom::Hash(string_view item) -> Fingerprint {
+  XXH128_hash_t hash = XXH3_128bits(item.data(), item.size());
+  return Fingerprint{hash.low64, hash.high64};
+}
+
+pair<size_t, unsigned> Bloom::Params(size_t capacity, double fp_prob) {
+  DCHECK(fp_prob > 0 && fp_prob < 1);
+
+  unsigned hash_cnt = max(1.0, ceil(-log2(fp_prob)));
+
+  // The bits per item of a classic filter, then those a blocked one needs for the same error.
+  double bits_per_item = -log(fp_prob) / (M_LN2 * M_LN2);
+  for (unsigned i = 0; i < 100 && BlockedFpRate(bits_per_item, hash_cnt) > fp_prob; ++i) {
+    bits_per_item *= 1.05;
+  }
+
+  size_t blocks = max<size_t>(1, ceil(capacity * bits_per_item / kBlockBits));
+  return {blocks * kBlockBytes, hash_cnt};
+}
+
+uint8_t* Bloom::Block(const Fingerprint& fp) const {
+  // Maps the hash onto the blocks without the division of a modulo.
+  uint64_t index = absl::Uint128High64(absl::uint128(fp.block_hash) * (len_ / kBlockBytes));
+  return blob_ + index * kBlockBytes;
+}
+
+bool Bloom::Add(const Fingerprint& fp) {
+  uint64_t* block = reinterpret_cast<uint64_t*>(Block(fp));
+  BitSequence bits(fp.bits_hash);
+
+  uint64_t changed = 0;
+  for (unsigned i = 0; i < hash_cnt_; ++i) {
+    unsigned bit = bits.Next();
+    uint64_t mask = 1ULL << (bit % 64);
+    changed |= ~block[bit / 64] & mask;
+    block[bit / 64] |= mask;
+  }
+
+  return changed != 0;
+}
+
+bool Bloom::Exists(const Fingerprint& fp) const {
+  const uint64_t* block = reinterpret_cast<const uint64_t*>(Block(fp));
+  BitSequence bits(fp.bits_hash);
+
+  for (unsigned i = 0; i < hash_cnt_; ++i) {
+    unsigned bit = bits.Next();
+    if ((block[bit / 64] & (1ULL << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
+
+SBF::SBF(size_t initial_capacity, double fp_prob, double grow_factor, pmr::memory_resource* mr)
+    : SBF(grow_factor, fp_prob, max<size_t>(1, initial_capacity), 0, 0, mr) {
+  NewFilter(max_capacity_, fp_prob_);
+}
+
+SBF::SBF(double grow_factor, double fp_prob, size_t max_capacity, size_t prev_size,
+         size_t current_size, pmr::memory_resource* mr)
+    : mr_(mr), filters_(mr), grow_factor_(grow_factor), fp_prob_(fp_prob),
+      max_capacity_(max_capacity), prev_size_(prev_size), current_size_(current_size) {
+  DCHECK_GT(grow_factor, 1);
+}
+
+SBF::~SBF() {
+  for (const Bloom& bloom : filters_) {
+    mr_->deallocate(bloom.blob(), bloom.data().size(), Bloom::kBlockBytes);
+  }
+}
+
+void SBF::AddFilter(string_view blob, unsigned hash_cnt) {
+  DCHECK_EQ(0u, blob.size() % Bloom::kBlockBytes);
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(mr_->allocate(blob.size(), Bloom::kBlockBytes));
+  memcpy(ptr, blob.data(), blob.size());
+  filters_.emplace_back(ptr, blob.size(), hash_cnt);
+}
+
+void SBF::NewFilter(size_t capacity, double fp_prob) {
+  auto [len, hash_cnt] = Bloom::Params(capacity, fp_prob);
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(mr_->allocate(len, Bloom::kBlockBytes));
+  memset(ptr, 0, len);
+  filters_.emplace_back(ptr, len, hash_cnt);
+}
+
+bool SBF::ExistsHashed(const Bloom::Fingerprint& fp) const {
+  // The last filter is the biggest one, hence it most likely holds the item.
+  for (auto it = filters_.rbegin(); it != filters_.rend(); ++it) {
+    if (it->Exists(fp))
+      return true;
+  }
+  return false;
+}
+
+bool SBF::AddHashed(const Bloom::Fingerprint& fp) {
+  if (ExistsHashed(fp))
+    return false;
+
+  if (current_size_ >= max_capacity_) {
+    prev_size_ += current_size_;
+    current_size_ = 0;
+    max_capacity_ = max<size_t>(max_capacity_ + 1, max_capacity_ * grow_factor_);
+    fp_prob_ *= kTighteningRatio;
+    NewFilter(max_capacity_, fp_prob_);
+  }
+
+  filters_.back().Add(fp);
+  ++current_size_;
+  return true;
+}
+
+bool SBF::Add(string_view item) {
+  return AddHashed(Bloom::Hash(item));
+}
+
+bool SBF::Exists(string_view item) const {
+  return ExistsHashed(Bloom::Hash(item));
+}
+
+void SBF::AddMany(absl::Span<const string_view> items, absl::Span<bool> res) {
+  DCHECK_EQ(items.size(), res.size());
+  Bloom::Fingerprint fps[kBatchLen];
+
+  for (size_t start = 0; start < items.size(); start += kBatchLen) {
+    size_t len = min(kBatchLen, items.size() - start);
+    for (size_t i = 0; i < len; ++i) {
+      fps[i] = Bloom::Hash(items[start + i]);
+      for (const Bloom& bloom : filters_)
+        bloom.Prefetch(fps[i]);
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+      res[start + i] = AddHashed(fps[i]);
+    }
+  }
+}
+
+void SBF::ExistsMany(absl::Span<const string_view> items, absl::Span<bool> res) const {
+  DCHECK_EQ(items.size(), res.size());
+  Bloom::Fingerprint fps[kBatchLen];
+
+  for (size_t start = 0; start < items.size(); start += kBatchLen) {
+    size_t len = min(kBatchLen, items.size() - start);
+    for (size_t i = 0; i < len; ++i) {
+      fps[i] = Bloom::Hash(items[start + i]);
+      for (const Bloom& bloom : filters_)
+        bloom.Prefetch(fps[i]);
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+      res[start + i] = ExistsHashed(fps[i]);
+    }
+  }
+}
+
+size_t SBF::MallocUsed() const {
+  size_t res = sizeof(SBF) + filters_.capacity() * sizeof(Bloom);
+  for (const Bloom& bloom : filters_) {
+    res += bloom.data().size();
+  }
+  return res;
+}
+
+}  // namespace dfly
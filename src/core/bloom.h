@@ -0,0 +1,151 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// A blocked bloom filter, see Putze, Sanders and Singler, "Cache-, Hash- and Space-Efficient
+// Bloom Filters". The bits of an item reside in a single block of a cache line, hence a lookup
+// misses the cache at most once, for the price of a slightly higher error rate than a classic
+// filter of the same size has. The filter does not own its memory.
+class Bloom {
+ public:
+  static constexpr unsigned kBlockBytes = 64;
+
+  // The item hashes: the first selects the block, the second the bits within it.
+  struct Fingerprint {
+    uint64_t block_hash;
+    uint64_t bits_hash;
+  };
+
+  static Fingerprint Hash(std::string_view item);
+
+  // Returns the number of the bytes and of the hash functions of a filter that holds capacity
+  // items with the error rate fp_prob.
+  static std::pair<size_t, unsigned> Params(size_t capacity, double fp_prob);
+
+  // blob consists of len bytes, a multiple of kBlockBytes, aligned to kBlockBytes.
+  Bloom(uint8_t* blob, size_t len, unsigned hash_cnt)
+      : blob_(blob), len_(len), hash_cnt_(hash_cnt) {
+  }
+
+  // Returns true if the item was added, i.e. it may not have been there before.
+  bool Add(const Fingerprint& fp);
+  bool Exists(const Fingerprint& fp) const;
+
+  void Prefetch(const Fingerprint& fp) const {
+    __builtin_prefetch(Block(fp));
+  }
+
+  unsigned hash_cnt() const {
+    return hash_cnt_;
+  }
+
+  std::string_view data() const {
+    return std::string_view{reinterpret_cast<const char*>(blob_), len_};
+  }
+
+  uint8_t* blob() const {
+    return blob_;
+  }
+
+ private:
+  uint8_t* Block(const Fingerprint& fp) const;
+
+  uint8_t* blob_;
+  size_t len_;
+  unsigned hash_cnt_;
+};
+
+// A scalable bloom filter, see Almeida et al., "Scalable Bloom Filters". Once a filter reaches
+// its capacity, a filter grow_factor times bigger is added, with half the error rate of the
+// previous one, so that the total error rate stays bounded by about twice the initial one.
+// Not thread-safe.
+class SBF {
+ public:
+  SBF(size_t initial_capacity, double fp_prob, double grow_factor, std::pmr::memory_resource* mr);
+
+  // Creates a filter without the underlying filters, which are then restored with AddFilter.
+  // prev_size is the number of the items in all but the last filter.
+  SBF(double grow_factor, double fp_prob, size_t max_capacity, size_t prev_size,
+      size_t current_size, std::pmr::memory_resource* mr);
+
+  ~SBF();
+
+  SBF(const SBF&) = delete;
+  SBF& operator=(const SBF&) = delete;
+
+  // Restores a filter that was serialized from Bloom::data().
+  void AddFilter(std::string_view blob, unsigned hash_cnt);
+
+  // Returns true if the item was added, false if it probably has been added before.
+  bool Add(std::string_view item);
+  bool Exists(std::string_view item) const;
+
+  // Batched variants, which hash all the items before they touch the filters, so that the
+  // cache misses of the items overlap. res has an entry per item.
+  void AddMany(absl::Span<const std::string_view> items, absl::Span<bool> res);
+  void ExistsMany(absl::Span<const std::string_view> items, absl::Span<bool> res) const;
+
+  // Number of the added items.
+  size_t GetSize() const {
+    return prev_size_ + current_size_;
+  }
+
+  size_t MallocUsed() const;
+
+  size_t num_filters() const {
+    return filters_.size();
+  }
+
+  const Bloom& filter(size_t i) const {
+    return filters_[i];
+  }
+
+  double grow_factor() const {
+    return grow_factor_;
+  }
+
+  double fp_probability() const {
+    return fp_prob_;
+  }
+
+  size_t max_capacity() const {
+    return max_capacity_;
+  }
+
+  size_t prev_size() const {
+    return prev_size_;
+  }
+
+  size_t current_size() const {
+    return current_size_;
+  }
+
+ private:
+  // Allocates a zeroed filter that holds capacity items with the error rate fp_prob.
+  void NewFilter(size_t capacity, double fp_prob);
+
+  bool AddHashed(const Bloom::Fingerprint& fp);
+  bool ExistsHashed(const Bloom::Fingerprint& fp) const;
+
+  std::pmr::memory_resource* mr_;
+  std::pmr::vector<Bloom> filters_;
+
+  double grow_factor_;
+  double fp_prob_;  // of the last filter.
+
+  size_t max_capacity_;  // of the last filter.
+  size_t prev_size_ = 0;
+  size_t current_size_ = 0;  // items in the last filter.
+};
+
+}  // namespace dfly
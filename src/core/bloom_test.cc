@@ -0,0 +1,120 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class BloomTest : public ::testing::Test {
+ protected:
+  pmr::memory_resource* mr_ = pmr::get_default_resource();
+};
+
+TEST_F(BloomTest, Params) {
+  auto [len, hash_cnt] = Bloom::Params(1000, 0.01);
+  EXPECT_EQ(7u, hash_cnt);
+  EXPECT_EQ(0u, len % Bloom::kBlockBytes);
+
+  // A blocked filter needs more bits than the 9.6 bits per item of a classic one.
+  EXPECT_GT(len * 8, 9600u);
+  EXPECT_LT(len * 8, 12000u);
+
+  EXPECT_EQ(Bloom::kBlockBytes, Bloom::Params(1, 0.01).first);
+}
+
+TEST_F(BloomTest, Basic) {
+  SBF sbf(100, 0.01, 2, mr_);
+  EXPECT_FALSE(sbf.Exists("a"));
+  EXPECT_TRUE(sbf.Add("a"));
+  EXPECT_FALSE(sbf.Add("a"));
+  EXPECT_TRUE(sbf.Exists("a"));
+  EXPECT_EQ(1u, sbf.GetSize());
+  EXPECT_EQ(1u, sbf.num_filters());
+  EXPECT_GT(sbf.MallocUsed(), sbf.filter(0).data().size());
+}
+
+TEST_F(BloomTest, Scale) {
+  constexpr unsigned kItems = 10000;
+  constexpr double kFpProb = 0.01;
+  SBF sbf(100, kFpProb, 2, mr_);
+
+  unsigned added = 0;
+  for (unsigned i = 0; i < kItems; ++i) {
+    added += sbf.Add(absl::StrCat("item:", i));
+  }
+
+  // 100 + ... + 3200 < 10000 <= 100 + ... + 6400.
+  EXPECT_EQ(7u, sbf.num_filters());
+  // An item is not added if it is a false positive of the filters so far.
+  EXPECT_GE(added, kItems * (1 - 2 * kFpProb));
+  EXPECT_EQ(added, sbf.GetSize());
+
+  for (unsigned i = 0; i < kItems; ++i) {
+    ASSERT_TRUE(sbf.Exists(absl::StrCat("item:", i))) << i;
+  }
+
+  // The tightening error rates keep the total one bounded.
+  unsigned false_positives = 0;
+  for (unsigned i = 0; i < kItems; ++i) {
+    false_positives += sbf.Exists(absl::StrCat("other:", i));
+  }
+  EXPECT_LT(false_positives, kItems * kFpProb * 2);
+}
+
+TEST_F(BloomTest, Batched) {
+  SBF sbf(10, 0.01, 2, mr_);
+  vector<string> storage;
+  for (unsigned i = 0; i < 50; ++i) {
+    storage.push_back(absl::StrCat(i % 40));
+  }
+  vector<string_view> items(storage.begin(), storage.end());
+
+  bool res[50];
+  sbf.AddMany(items, absl::MakeSpan(res));
+  for (unsigned i = 0; i < 50; ++i) {
+    EXPECT_EQ(i < 40, res[i]) << i;
+  }
+  EXPECT_EQ(40u, sbf.GetSize());
+
+  items.push_back("missing");
+  bool exists[51];
+  sbf.ExistsMany(items, absl::MakeSpan(exists));
+  for (unsigned i = 0; i < 50; ++i) {
+    EXPECT_TRUE(exists[i]);
+  }
+  EXPECT_FALSE(exists[50]);
+}
+
+TEST_F(BloomTest, Restore) {
+  SBF sbf(10, 0.01, 2, mr_);
+  for (unsigned i = 0; i < 30; ++i) {
+    sbf.Add(absl::StrCat(i));
+  }
+
+  SBF copy(sbf.grow_factor(), sbf.fp_probability(), sbf.max_capacity(), sbf.prev_size(),
+           sbf.current_size(), mr_);
+  for (size_t i = 0; i < sbf.num_filters(); ++i) {
+    copy.AddFilter(sbf.filter(i).data(), sbf.filter(i).hash_cnt());
+  }
+
+  EXPECT_EQ(sbf.GetSize(), copy.GetSize());
+  for (unsigned i = 0; i < 30; ++i) {
+    EXPECT_TRUE(copy.Exists(absl::StrCat(i)));
+  }
+
+  // The restored filter keeps growing the same way.
+  for (unsigned i = 30; i < 100; ++i) {
+    EXPECT_EQ(sbf.Add(absl::StrCat(i)), copy.Add(absl::StrCat(i)));
+  }
+  EXPECT_EQ(sbf.num_filters(), copy.num_filters());
+}
+
+}  // namespace dfly
@@ -21,6 +21,15 @@ extern "C" {
 
 #include "base/logging.h"
 #include "base/pod_array.h"
+#include "core/bloom.h"
+#include "core/json.h"
+#include "core/page_usage.h"
+#include "core/roaring_set.h"
+#include "core/sorted_map.h"
+#include "core/str_compressor.h"
+#include "core/str_dedup.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 
 #if defined(__aarch64__)
 #include "base/sse2neon.h"
@@ -41,23 +50,37 @@ size_t QlMAllocSize(quicklist* ql) {
   return res + ql->count * 16;  // we account for each member 16 bytes.
 }
 
-// Approximated dictionary size.
-size_t DictMallocSize(dict* d) {
-  size_t res = zmalloc_usable_size(d->ht_table[0]) + zmalloc_usable_size(d->ht_table[1]) +
-               znallocx(sizeof(dict));
+// Moves the members of a set dict into a StringSet and releases the dict.
+StringSet* DictToStringSet(dict* d) {
+  StringSet* ss = new StringSet;
+  ss->Reserve(dictSize(d));
 
-  return res + dictSize(d) * 16;  // approximation.
+  dictIterator* di = dictGetIterator(d);
+  while (dictEntry* de = dictNext(di)) {
+    sds ele = (sds)de->key;
+    ss->Add(string_view{ele, sdslen(ele)});
+  }
+  dictReleaseIterator(di);
+  dictRelease(d);
+
+  return ss;
 }
 
 inline void FreeObjSet(unsigned encoding, void* ptr, pmr::memory_resource* mr) {
   switch (encoding) {
     case kEncodingStrMap: {
-      dictRelease((dict*)ptr);
+      delete (StringSet*)ptr;
       break;
     }
     case kEncodingIntSet:
       zfree((void*)ptr);
       break;
+    case kEncodingListPack:
+      lpFree((uint8_t*)ptr);
+      break;
+    case kEncodingRoaring:
+      delete (RoaringSet*)ptr;
+      break;
     default:
       LOG(FATAL) << "Unknown set encoding type";
   }
@@ -66,9 +89,13 @@ inline void FreeObjSet(unsigned encoding, void* ptr, pmr::memory_resource* mr) {
 size_t MallocUsedSet(unsigned encoding, void* ptr) {
   switch (encoding) {
     case kEncodingStrMap /*OBJ_ENCODING_HT*/:
-      return 0;  // TODO
+      return ((StringSet*)ptr)->MallocUsed() + sizeof(StringSet);
     case kEncodingIntSet:
       return intsetBlobLen((intset*)ptr);
+    case kEncodingListPack:
+      return lpBytes((uint8_t*)ptr);
+    case kEncodingRoaring:
+      return ((RoaringSet*)ptr)->MallocUsed() + sizeof(RoaringSet);
   }
 
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
@@ -80,7 +107,7 @@ size_t MallocUsedHSet(unsigned encoding, void* ptr) {
     case OBJ_ENCODING_LISTPACK:
       return lpBytes(reinterpret_cast<uint8_t*>(ptr));
     case OBJ_ENCODING_HT:
-      return DictMallocSize((dict*)ptr);
+      return ((StringMap*)ptr)->MallocUsed() + sizeof(StringMap);
   }
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
   return 0;
@@ -90,10 +117,8 @@ size_t MallocUsedZSet(unsigned encoding, void* ptr) {
   switch (encoding) {
     case OBJ_ENCODING_LISTPACK:
       return lpBytes(reinterpret_cast<uint8_t*>(ptr));
-    case OBJ_ENCODING_SKIPLIST: {
-      zset* zs = (zset*)ptr;
-      return DictMallocSize(zs->dict);
-    }
+    case OBJ_ENCODING_SKIPLIST:
+      return ((SortedMap*)ptr)->MallocUsed() + sizeof(SortedMap);
   }
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
   return 0;
@@ -107,7 +132,7 @@ size_t MallocUsedStream(unsigned encoding, void* streamv) {
 inline void FreeObjHash(unsigned encoding, void* ptr) {
   switch (encoding) {
     case OBJ_ENCODING_HT:
-      dictRelease((dict*)ptr);
+      delete (StringMap*)ptr;
       break;
     case OBJ_ENCODING_LISTPACK:
       lpFree((uint8_t*)ptr);
@@ -118,13 +143,9 @@ inline void FreeObjHash(unsigned encoding, void* ptr) {
 }
 
 inline void FreeObjZset(unsigned encoding, void* ptr) {
-  zset* zs = (zset*)ptr;
   switch (encoding) {
     case OBJ_ENCODING_SKIPLIST:
-      zs = (zset*)ptr;
-      dictRelease(zs->dict);
-      zslFree(zs->zsl);
-      zfree(zs);
+      delete (SortedMap*)ptr;
       break;
     case OBJ_ENCODING_LISTPACK:
       zfree(ptr);
@@ -134,6 +155,23 @@ inline void FreeObjZset(unsigned encoding, void* ptr) {
   }
 }
 
+// Moves a zmalloc-ed blob into a fuller page. Returns null if the blob was not moved.
+void* DefragBlob(void* ptr, const PageUsage& page_usage) {
+  if (!page_usage.IsUnderutilized(ptr))
+    return nullptr;
+
+  size_t size = zmalloc_usable_size(ptr);
+  void* newp = zmalloc(size);
+  if (!page_usage.IsBetterPage(ptr, newp)) {
+    zfree(newp);
+    return nullptr;
+  }
+
+  memcpy(newp, ptr, size);
+  zfree(ptr);
+  return newp;
+}
+
 inline void FreeObjStream(void* ptr) {
   freeStream((stream*)ptr);
 }
@@ -199,6 +237,11 @@ struct TL {
   size_t small_str_bytes;
   base::PODArray<uint8_t> tmp_buf;
   string tmp_str;
+
+  unique_ptr<StrCompressor> compressor;
+  string compress_buf;
+
+  unique_ptr<StrDedup> dedup;
 };
 
 thread_local TL tl;
@@ -254,10 +297,12 @@ size_t RobjWrapper::Size() const {
           intset* is = (intset*)inner_obj_;
           return intsetLen(is);
         }
-        case kEncodingStrMap: {
-          dict* d = (dict*)inner_obj_;
-          return dictSize(d);
-        }
+        case kEncodingStrMap:
+          return ((StringSet*)inner_obj_)->Size();
+        case kEncodingListPack:
+          return lpLength((uint8_t*)inner_obj_);
+        case kEncodingRoaring:
+          return ((RoaringSet*)inner_obj_)->Size();
         default:
           LOG(FATAL) << "Unexpected encoding " << encoding_;
       }
@@ -338,6 +383,48 @@ bool RobjWrapper::Equal(string_view sv) const {
   return AsView() == sv;
 }
 
+bool RobjWrapper::DefragIfNeeded(const PageUsage& page_usage, pmr::memory_resource* mr) {
+  if (!inner_obj_)
+    return false;
+
+  void* newp = nullptr;
+  switch (type_) {
+    case OBJ_STRING: {
+      if (!page_usage.IsUnderutilized(inner_obj_))
+        return false;
+
+      size_t cap = InnerObjMallocUsed();
+      newp = mr->allocate(cap, 8);
+      if (!page_usage.IsBetterPage(inner_obj_, newp)) {
+        mr->deallocate(newp, cap, 8);
+        return false;
+      }
+      memcpy(newp, inner_obj_, sz_);
+      mr->deallocate(inner_obj_, cap, 8);
+      break;
+    }
+    case OBJ_SET:
+      if (encoding_ == kEncodingStrMap || encoding_ == kEncodingRoaring)
+        return false;
+      newp = DefragBlob(inner_obj_, page_usage);
+      break;
+    case OBJ_HASH:
+    case OBJ_ZSET:
+      if (encoding_ != OBJ_ENCODING_LISTPACK)
+        return false;
+      newp = DefragBlob(inner_obj_, page_usage);
+      break;
+    default:
+      return false;
+  }
+
+  if (!newp)
+    return false;
+
+  inner_obj_ = newp;
+  return true;
+}
+
 void RobjWrapper::SetString(string_view s, pmr::memory_resource* mr) {
   type_ = OBJ_STRING;
   encoding_ = OBJ_ENCODING_RAW;
@@ -352,6 +439,20 @@ void RobjWrapper::SetString(string_view s, pmr::memory_resource* mr) {
   }
 }
 
+uint8_t* RobjWrapper::ReserveString(size_t len, pmr::memory_resource* mr) {
+  type_ = OBJ_STRING;
+  encoding_ = OBJ_ENCODING_RAW;
+
+  if (len > sz_) {
+    size_t cur_cap = InnerObjMallocUsed();
+    if (len > cur_cap) {
+      MakeInnerRoom(cur_cap, len, mr);
+    }
+  }
+  sz_ = len;
+  return reinterpret_cast<uint8_t*>(inner_obj_);
+}
+
 void RobjWrapper::Init(unsigned type, unsigned encoding, void* inner) {
   type_ = type;
   encoding_ = encoding;
@@ -386,17 +487,49 @@ void RobjWrapper::MakeInnerRoom(size_t current_cap, size_t desired, pmr::memory_
   #pragma GCC optimize("Ofast")
 #endif
 
+constexpr uint64_t kPackedMask = 0x00FFFFFFFFFFFFFFULL;
+
+// Each 8 ascii chars are packed into 7 bytes as a little-endian stream of 7-bit codes,
+// i.e. char i occupies bits [7i, 7i + 7). We compute a whole block in a 64-bit register
+// by folding the lanes pairwise: 8x8 bits -> 4x14 -> 2x28 -> 1x56.
+// Assumes a little-endian host, like the rest of the encoding code.
+inline uint64_t pack_block(uint64_t x) {
+  x = ((x & 0x7F007F007F007F00ULL) >> 1) | (x & 0x007F007F007F007FULL);
+  x = ((x & 0x3FFF00003FFF0000ULL) >> 2) | (x & 0x00003FFF00003FFFULL);
+  x = ((x & 0x0FFFFFFF00000000ULL) >> 4) | (x & 0x000000000FFFFFFFULL);
+  return x;
+}
+
+// The inverse of pack_block.
+inline uint64_t unpack_block(uint64_t x) {
+  x = ((x << 4) & 0x0FFFFFFF00000000ULL) | (x & 0x000000000FFFFFFFULL);
+  x = ((x << 2) & 0x3FFF00003FFF0000ULL) | (x & 0x00003FFF00003FFFULL);
+  x = ((x << 1) & 0x7F007F007F007F00ULL) | (x & 0x007F007F007F007FULL);
+  return x;
+}
+
 // len must be at least 16
 void ascii_pack(const char* ascii, size_t len, uint8_t* bin) {
   const char* end = ascii + len;
 
-  unsigned i = 0;
-  while (ascii + 8 <= end) {
-    for (i = 0; i < 7; ++i) {
-      *bin++ = (ascii[0] >> i) | (ascii[1] << (7 - i));
-      ++ascii;
-    }
-    ++ascii;
+  // While at least 16 chars are left we can store the whole register - its last byte is
+  // overwritten by the next block.
+  while (ascii + 16 <= end) {
+    uint64_t val;
+    memcpy(&val, ascii, 8);
+    val = pack_block(val);
+    memcpy(bin, &val, 8);
+    ascii += 8;
+    bin += 7;
+  }
+
+  if (ascii + 8 <= end) {
+    uint64_t val;
+    memcpy(&val, ascii, 8);
+    val = pack_block(val);
+    memcpy(bin, &val, 7);
+    ascii += 8;
+    bin += 7;
   }
 
   // epilog - we do not pack since we have less than 8 bytes.
@@ -411,55 +544,61 @@ void ascii_pack(const char* ascii, size_t len, uint8_t* bin) {
 // however, if binary data is positioned on the right of the ascii buffer with empty space on the
 // left than we can unpack inplace.
 void ascii_unpack(const uint8_t* bin, size_t ascii_len, char* ascii) {
-  constexpr uint8_t kM = 0x7F;
-  uint8_t p = 0;
-  unsigned i = 0;
-
-  while (ascii_len >= 8) {
-    for (i = 0; i < 7; ++i) {
-      uint8_t src = *bin;  // keep on stack in case we unpack inplace.
-      *ascii++ = (p >> (8 - i)) | ((src << i) & kM);
-      p = src;
-      ++bin;
-    }
+  // Blocks are read before they are written, so unpacking inplace is safe.
+  // While at least 16 chars are left, the packed source has at least 14 bytes and we can load
+  // the whole register.
+  while (ascii_len >= 16) {
+    uint64_t val;
+    memcpy(&val, bin, 8);
+    val = unpack_block(val & kPackedMask);
+    memcpy(ascii, &val, 8);
+    bin += 7;
+    ascii += 8;
+    ascii_len -= 8;
+  }
 
+  if (ascii_len >= 8) {
+    uint64_t val = 0;
+    memcpy(&val, bin, 7);
+    val = unpack_block(val);
+    memcpy(ascii, &val, 8);
+    bin += 7;
+    ascii += 8;
     ascii_len -= 8;
-    *ascii++ = p >> 1;
   }
 
-  DCHECK_LT(ascii_len, 8u);
-  for (i = 0; i < ascii_len; ++i) {
+  for (unsigned i = 0; i < ascii_len; ++i) {
     *ascii++ = *bin++;
   }
 }
 
 // compares packed and unpacked strings. packed must be of length = binpacked_len(ascii_len).
 bool compare_packed(const uint8_t* packed, const char* ascii, size_t ascii_len) {
-  unsigned i = 0;
-  bool res = true;
   const char* end = ascii + ascii_len;
 
-  while (ascii + 8 <= end) {
-    for (i = 0; i < 7; ++i) {
-      uint8_t conv = (ascii[0] >> i) | (ascii[1] << (7 - i));
-      res &= (conv == *packed);
-      ++ascii;
-      ++packed;
-    }
-
-    if (!res)
+  while (ascii + 16 <= end) {
+    uint64_t val, expected;
+    memcpy(&val, ascii, 8);
+    memcpy(&expected, packed, 8);
+    if (pack_block(val) != (expected & kPackedMask))
       return false;
 
-    ++ascii;
+    ascii += 8;
+    packed += 7;
   }
 
-  while (ascii < end) {
-    if (*ascii++ != *packed++) {
+  if (ascii + 8 <= end) {
+    uint64_t val, expected = 0;
+    memcpy(&val, ascii, 8);
+    memcpy(&expected, packed, 7);
+    if (pack_block(val) != expected)
       return false;
-    }
+
+    ascii += 8;
+    packed += 7;
   }
 
-  return true;
+  return memcmp(ascii, packed, end - ascii) == 0;
 }
 
 #if defined(__GNUC__) && !defined(__clang__)
@@ -473,6 +612,17 @@ using namespace std;
 auto CompactObj::GetStats() -> Stats {
   Stats res;
   res.small_string_bytes = tl.small_str_bytes;
+  if (tl.compressor) {
+    res.compressed_strings = tl.compressor->stats().live_blobs;
+    res.compression_dict_bytes = tl.compressor->stats().dict_bytes;
+  }
+  if (tl.dedup) {
+    StrDedup::Stats stats = tl.dedup->stats();
+    res.dedup_strings = stats.blobs;
+    res.dedup_bytes = stats.blob_bytes;
+    res.dedup_saved_bytes = stats.saved_bytes;
+    res.dedup_index_bytes = stats.index_bytes;
+  }
 
   return res;
 }
@@ -493,10 +643,12 @@ CompactObj& CompactObj::operator=(CompactObj&& o) noexcept {
 
   SetMeta(o.taglen_, o.mask_);  // Frees underlying resources if needed.
   memcpy(&u_, &o.u_, sizeof(u_));
+  age_ = o.age_;
 
   // SetMeta deallocates the object and we only want reset it.
   o.taglen_ = 0;
   o.mask_ = 0;
+  o.age_ = 0;
 
   return *this;
 }
@@ -517,19 +669,53 @@ size_t CompactObj::Size() const {
         break;
       }
       case EXTERNAL_TAG:
-        raw_size = u_.ext_ptr.size;
+        raw_size = u_.ext_ptr.raw_size ? u_.ext_ptr.raw_size : u_.ext_ptr.size;
         break;
       case ROBJ_TAG:
         raw_size = u_.r_obj.Size();
         break;
+      case SBF_TAG:
+        raw_size = u_.sbf->GetSize();
+        break;
+      case JSON_TAG:
+        raw_size = u_.json->root()->len;
+        break;
+      case DEDUP_TAG:
+        raw_size = u_.dedup_ptr.blob->len;
+        break;
       default:
         LOG(DFATAL) << "Should not reach " << int(taglen_);
     }
   }
   uint8_t encoded = (mask_ & kEncMask);
+  if (encoded == kZstdEnc)
+    return StrCompressor::DecodedLen(u_.r_obj.AsView());
+
   return encoded ? DecodedLen(raw_size) : raw_size;
 }
 
+void CompactObj::Prefetch() const {
+  switch (taglen_) {
+    case SMALL_TAG:
+      u_.small_str.Prefetch();
+      break;
+    case ROBJ_TAG:
+      __builtin_prefetch(u_.r_obj.inner_obj());
+      break;
+    case SBF_TAG:
+      __builtin_prefetch(u_.sbf);
+      break;
+    case JSON_TAG:
+      __builtin_prefetch(u_.json);
+      break;
+    case DEDUP_TAG:
+      __builtin_prefetch(u_.dedup_ptr.blob);
+      break;
+    default:  // inline or external.
+      break;
+  }
+}
+
 uint64_t CompactObj::HashCode() const {
   uint8_t encoded = (mask_ & kEncMask);
 
@@ -557,6 +743,10 @@ uint64_t CompactObj::HashCode() const {
       absl::AlphaNum an(u_.ival);
       return XXH3_64bits_withSeed(an.data(), an.size(), kHashSeed);
     }
+    case DEDUP_TAG: {
+      string_view view = u_.dedup_ptr.blob->View();
+      return XXH3_64bits_withSeed(view.data(), view.size(), kHashSeed);
+    }
   }
   // We need hash only for keys.
   LOG(DFATAL) << "Should not reach " << int(taglen_);
@@ -569,12 +759,21 @@ uint64_t CompactObj::HashCode(string_view str) {
 }
 
 unsigned CompactObj::ObjType() const {
-  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || taglen_ == EXTERNAL_TAG)
+  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || taglen_ == DEDUP_TAG)
     return OBJ_STRING;
 
+  if (taglen_ == EXTERNAL_TAG)
+    return u_.ext_ptr.obj_type;
+
   if (taglen_ == ROBJ_TAG)
     return u_.r_obj.type();
 
+  if (taglen_ == SBF_TAG)
+    return OBJ_SBF;
+
+  if (taglen_ == JSON_TAG)
+    return OBJ_JSON;
+
   LOG(FATAL) << "TBD " << int(taglen_);
   return 0;
 }
@@ -607,8 +806,11 @@ void CompactObj::ImportRObj(robj* o) {
     if (o->type == OBJ_SET) {
       if (o->encoding == OBJ_ENCODING_INTSET) {
         enc = kEncodingIntSet;
+      } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        enc = kEncodingListPack;
       } else {
         enc = kEncodingStrMap;
+        o->ptr = DictToStringSet((dict*)o->ptr);
       }
     }
     u_.r_obj.Init(type, enc, o->ptr);
@@ -640,6 +842,31 @@ void CompactObj::InitRobj(unsigned type, unsigned encoding, void* obj) {
   u_.r_obj.Init(type, encoding, obj);
 }
 
+void CompactObj::SetSBF(uint64_t initial_capacity, double fp_prob, double grow_factor) {
+  void* ptr = tl.local_mr->allocate(sizeof(SBF), alignof(SBF));
+  SetSBF(new (ptr) SBF(initial_capacity, fp_prob, grow_factor, tl.local_mr));
+}
+
+void CompactObj::SetSBF(SBF* sbf) {
+  SetMeta(SBF_TAG, mask_ & ~kEncMask);
+  u_.sbf = sbf;
+}
+
+SBF* CompactObj::GetSBF() const {
+  DCHECK_EQ(SBF_TAG, taglen_);
+  return u_.sbf;
+}
+
+void CompactObj::SetJson(JsonDoc* doc) {
+  SetMeta(JSON_TAG, mask_ & ~kEncMask);
+  u_.json = doc;
+}
+
+JsonDoc* CompactObj::GetJson() const {
+  DCHECK_EQ(JSON_TAG, taglen_);
+  return u_.json;
+}
+
 void CompactObj::SyncRObj() {
   robj* obj = &tl.tmp_robj;
 
@@ -694,6 +921,10 @@ void CompactObj::SetString(std::string_view str) {
 
   string_view encoded = str;
   bool is_ascii = kUseAsciiEncoding && validate_ascii_fast(str.data(), str.size());
+  auto fits_small_str = [this](size_t len) {
+    return kUseSmallStrings && ((taglen_ == 0 && len < (1 << 15)) ||
+                                (taglen_ == SMALL_TAG && len <= u_.small_str.size()));
+  };
 
   if (is_ascii) {
     size_t encode_len = binpacked_len(str.size());
@@ -707,37 +938,68 @@ void CompactObj::SetString(std::string_view str) {
       mask |= ASCII1_ENC_BIT;
     }
 
-    tl.tmp_buf.resize(encode_len);
-    detail::ascii_pack(str.data(), str.size(), tl.tmp_buf.data());
-    encoded = string_view{reinterpret_cast<char*>(tl.tmp_buf.data()), encode_len};
-
-    if (encoded.size() <= kInlineLen) {
-      SetMeta(encoded.size(), mask);
+    if (encode_len <= kInlineLen) {
+      SetMeta(encode_len, mask);
       detail::ascii_pack(str.data(), str.size(), reinterpret_cast<uint8_t*>(u_.inline_str));
 
       return;
     }
-  }
 
-  if (kUseSmallStrings) {
-    if ((taglen_ == 0 && encoded.size() < (1 << 15))) {
-      SetMeta(SMALL_TAG, mask);
-      tl.small_str_bytes += u_.small_str.Assign(encoded);
+    // A big value is packed straight into its allocation. Packing it into tmp_buf would copy the
+    // value once more and would grow tmp_buf to the largest value that the thread has seen.
+    if (!fits_small_str(encode_len)) {
+      SetMeta(ROBJ_TAG, mask);
+      uint8_t* dest = u_.r_obj.ReserveString(encode_len, tl.local_mr);
+      detail::ascii_pack(str.data(), str.size(), dest);
       return;
     }
 
-    if (taglen_ == SMALL_TAG && encoded.size() <= u_.small_str.size()) {
-      mask_ = mask;
-      tl.small_str_bytes -= u_.small_str.MallocUsed();
+    tl.tmp_buf.resize(encode_len);
+    detail::ascii_pack(str.data(), str.size(), tl.tmp_buf.data());
+    encoded = string_view{reinterpret_cast<char*>(tl.tmp_buf.data()), encode_len};
+  }
+
+  if (fits_small_str(encoded.size())) {
+    if (taglen_ == 0) {
+      SetMeta(SMALL_TAG, mask);
       tl.small_str_bytes += u_.small_str.Assign(encoded);
       return;
     }
+
+    mask_ = mask;
+    tl.small_str_bytes -= u_.small_str.MallocUsed();
+    tl.small_str_bytes += u_.small_str.Assign(encoded);
+    return;
   }
 
   SetMeta(ROBJ_TAG, mask);
   u_.r_obj.SetString(encoded, tl.local_mr);
 }
 
+void CompactObj::SetValueString(std::string_view str) {
+  if (tl.dedup && str.size() >= tl.dedup->min_len()) {
+    bool created;
+    if (DedupBlob* blob = tl.dedup->Acquire(str, &created); blob) {
+      // Acquired before SetMeta releases the current string, which may be the same blob.
+      SetMeta(DEDUP_TAG, mask_ & ~kEncMask);
+      u_.dedup_ptr.blob = blob;
+      return;
+    }
+  }
+
+  bool compress = tl.compressor && str.size() >= StrCompressor::kMinLen &&
+                  str.size() <= StrCompressor::kMaxLen;
+
+  string& blob = tl.compress_buf;
+  if (!compress || !tl.compressor->Compress(str, &blob)) {
+    SetString(str);
+    return;
+  }
+
+  SetMeta(ROBJ_TAG, (mask_ & ~kEncMask) | kZstdEnc);
+  u_.r_obj.SetString(blob, tl.local_mr);
+}
+
 string_view CompactObj::GetSlice(string* scratch) const {
   uint8_t is_encoded = mask_ & kEncMask;
 
@@ -764,6 +1026,14 @@ string_view CompactObj::GetSlice(string* scratch) const {
     return *scratch;
   }
 
+  if (is_encoded == kZstdEnc) {
+    DCHECK_EQ(ROBJ_TAG, taglen_);
+    string_view blob = u_.r_obj.AsView();
+    scratch->resize(StrCompressor::DecodedLen(blob));
+    tl.compressor->Decompress(blob, scratch->data());
+    return *scratch;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -798,6 +1068,10 @@ string_view CompactObj::GetSlice(string* scratch) const {
     return u_.r_obj.AsView();
   }
 
+  if (taglen_ == DEDUP_TAG) {
+    return u_.dedup_ptr.blob->View();
+  }
+
   if (taglen_ == SMALL_TAG) {
     u_.small_str.Get(scratch);
     return *scratch;
@@ -813,7 +1087,8 @@ bool CompactObj::HasAllocated() const {
       (taglen_ == ROBJ_TAG && u_.r_obj.inner_obj() == nullptr))
     return false;
 
-  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG);
+  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG || taglen_ == SBF_TAG ||
+         taglen_ == DEDUP_TAG || taglen_ == JSON_TAG);
   return true;
 }
 
@@ -847,6 +1122,12 @@ void CompactObj::GetString(char* dest) const {
     return;
   }
 
+  if (is_encoded == kZstdEnc) {
+    DCHECK_EQ(ROBJ_TAG, taglen_);
+    tl.compressor->Decompress(u_.r_obj.AsView(), dest);
+    return;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -881,6 +1162,12 @@ void CompactObj::GetString(char* dest) const {
     return;
   }
 
+  if (taglen_ == DEDUP_TAG) {
+    string_view view = u_.dedup_ptr.blob->View();
+    memcpy(dest, view.data(), view.size());
+    return;
+  }
+
   if (taglen_ == SMALL_TAG) {
     string_view slices[2];
     unsigned num = u_.small_str.GetV(slices);
@@ -894,11 +1181,20 @@ void CompactObj::GetString(char* dest) const {
   LOG(FATAL) << "Bad tag " << int(taglen_);
 }
 
-void CompactObj::SetExternal(size_t offset, size_t sz) {
+void CompactObj::SetExternal(size_t offset, size_t sz, size_t raw_sz) {
+  DCHECK_LE(raw_sz, UINT16_MAX);
+  unsigned obj_type = ObjType();
   SetMeta(EXTERNAL_TAG, mask_ & ~kEncMask);
 
   u_.ext_ptr.offset = offset;
   u_.ext_ptr.size = sz;
+  u_.ext_ptr.obj_type = obj_type;
+  u_.ext_ptr.raw_size = raw_sz;
+}
+
+void CompactObj::ImportExternal(unsigned obj_type, size_t offset, size_t sz, size_t raw_sz) {
+  SetExternal(offset, sz, raw_sz);
+  u_.ext_ptr.obj_type = obj_type;
 }
 
 std::pair<size_t, size_t> CompactObj::GetExternalPtr() const {
@@ -906,23 +1202,80 @@ std::pair<size_t, size_t> CompactObj::GetExternalPtr() const {
   return pair<size_t, size_t>(size_t(u_.ext_ptr.offset), size_t(u_.ext_ptr.size));
 }
 
+bool CompactObj::SetInlineExpire(uint32_t val) {
+  if (SpareLen() < kInlineLen - kInlineExpireOffs || IsRef())
+    return false;
+
+  memcpy(u_.inline_str + kInlineExpireOffs, &val, sizeof(val));
+  mask_ |= EXPIRE_BIT;
+  return true;
+}
+
+uint32_t CompactObj::InlineExpire() const {
+  DCHECK(HasInlineExpire());
+
+  uint32_t res;
+  memcpy(&res, u_.inline_str + kInlineExpireOffs, sizeof(res));
+  return res;
+}
+
+bool CompactObj::SetInlineFlag(uint32_t val) {
+  if (SpareLen() < kInlineLen - kInlineFlagOffs || IsRef())
+    return false;
+
+  memcpy(u_.inline_str + kInlineFlagOffs, &val, sizeof(val));
+  mask_ |= FLAG_BIT;
+  return true;
+}
+
+uint32_t CompactObj::InlineFlag() const {
+  DCHECK(HasInlineFlag());
+
+  uint32_t res;
+  memcpy(&res, u_.inline_str + kInlineFlagOffs, sizeof(res));
+  return res;
+}
+
 void CompactObj::Reset() {
   if (HasAllocated()) {
     Free();
   }
   taglen_ = 0;
   mask_ = 0;
+  age_ = 0;
 }
 
 // Frees all resources if owns.
+bool CompactObj::DefragIfNeeded(const PageUsage& page_usage) {
+  switch (taglen_) {
+    case SMALL_TAG:
+      return u_.small_str.DefragIfNeeded(page_usage);
+    case ROBJ_TAG:
+      return u_.r_obj.DefragIfNeeded(page_usage, tl.local_mr);
+    default:
+      return false;
+  }
+}
+
 void CompactObj::Free() {
   DCHECK(HasAllocated());
 
   if (taglen_ == ROBJ_TAG) {
+    if ((mask_ & kEncMask) == kZstdEnc) {
+      tl.compressor->Release(u_.r_obj.AsView());
+    }
     u_.r_obj.Free(tl.local_mr);
   } else if (taglen_ == SMALL_TAG) {
     tl.small_str_bytes -= u_.small_str.MallocUsed();
     u_.small_str.Free();
+  } else if (taglen_ == SBF_TAG) {
+    u_.sbf->~SBF();
+    tl.local_mr->deallocate(u_.sbf, sizeof(SBF), alignof(SBF));
+  } else if (taglen_ == JSON_TAG) {
+    u_.json->~JsonDoc();
+    tl.local_mr->deallocate(u_.json, sizeof(JsonDoc), alignof(JsonDoc));
+  } else if (taglen_ == DEDUP_TAG) {
+    tl.dedup->Release(u_.dedup_ptr.blob);
   } else {
     LOG(FATAL) << "Unsupported tag " << int(taglen_);
   }
@@ -942,6 +1295,20 @@ size_t CompactObj::MallocUsed() const {
     return u_.small_str.MallocUsed();
   }
 
+  if (taglen_ == SBF_TAG) {
+    return u_.sbf->MallocUsed();
+  }
+
+  if (taglen_ == JSON_TAG) {
+    return sizeof(JsonDoc) + u_.json->MallocUsed();
+  }
+
+  // The blob outlives the value that allocated it as long as it has other references, hence
+  // none of them is charged for it.
+  if (taglen_ == DEDUP_TAG) {
+    return 0;
+  }
+
   LOG(DFATAL) << "should not reach";
   return 0;
 }
@@ -952,6 +1319,19 @@ bool CompactObj::operator==(const CompactObj& o) const {
   if (m1 != m2)
     return false;
 
+  // Equal strings may be compressed with different dictionaries.
+  if (m1 == kZstdEnc || (o.mask_ & kEncMask) == kZstdEnc) {
+    string tmp1, tmp2;
+    return GetSlice(&tmp1) == o.GetSlice(&tmp2);
+  }
+
+  if (taglen_ == DEDUP_TAG || o.taglen_ == DEDUP_TAG) {
+    if (taglen_ == o.taglen_ && u_.dedup_ptr.blob == o.u_.dedup_ptr.blob)
+      return true;
+    string tmp1, tmp2;
+    return GetSlice(&tmp1) == o.GetSlice(&tmp2);
+  }
+
   if (taglen_ == ROBJ_TAG || o.taglen_ == ROBJ_TAG) {
     if (o.taglen_ != taglen_)
       return false;
@@ -983,6 +1363,8 @@ bool CompactObj::EqualNonInline(std::string_view sv) const {
       return u_.r_obj.Equal(sv);
     case SMALL_TAG:
       return u_.small_str.Equal(sv);
+    case DEDUP_TAG:
+      return u_.dedup_ptr.blob->View() == sv;
     default:
       break;
   }
@@ -990,16 +1372,25 @@ bool CompactObj::EqualNonInline(std::string_view sv) const {
 }
 
 bool CompactObj::CmpEncoded(string_view sv) const {
+  if ((mask_ & kEncMask) == kZstdEnc) {
+    if (Size() != sv.size())
+      return false;
+
+    GetString(&tl.tmp_str);
+    return sv == tl.tmp_str;
+  }
+
   size_t encode_len = binpacked_len(sv.size());
 
   if (IsInline()) {
     if (encode_len != taglen_)
       return false;
 
-    char buf[kInlineLen * 2];
-    detail::ascii_unpack(to_byte(u_.inline_str), sv.size(), buf);
+    // Pack sv on the fly instead of decoding the inline string.
+    if (!validate_ascii_fast(sv.data(), sv.size()))
+      return false;
 
-    return sv == string_view(buf, sv.size());
+    return detail::compare_packed(to_byte(u_.inline_str), sv.data(), sv.size());
   }
 
   if (taglen_ == ROBJ_TAG) {
@@ -1068,4 +1459,30 @@ pmr::memory_resource* CompactObj::memory_resource() {
   return tl.local_mr;
 }
 
+void CompactObj::EnableCompression(bool enable) {
+  if (enable) {
+    if (!tl.compressor)
+      tl.compressor.reset(new StrCompressor);
+  } else {
+    tl.compressor.reset();
+  }
+}
+
+StrCompressor* CompactObj::compressor() {
+  return tl.compressor.get();
+}
+
+void CompactObj::EnableDedup(size_t min_len) {
+  if (min_len > 0) {
+    if (!tl.dedup)
+      tl.dedup.reset(new StrDedup(min_len, tl.local_mr));
+  } else {
+    tl.dedup.reset();
+  }
+}
+
+StrDedup* CompactObj::dedup() {
+  return tl.dedup.get();
+}
+
 }  // namespace dfly
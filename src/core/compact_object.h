@@ -15,8 +15,21 @@ typedef struct redisObject robj;
 
 namespace dfly {
 
+class JsonDoc;
+class PageUsage;
+class SBF;
+class StrCompressor;
+class StrDedup;
+struct DedupBlob;
+
 constexpr unsigned kEncodingIntSet = 0;
-constexpr unsigned kEncodingStrMap = 1;  // for set/map encodings of strings
+constexpr unsigned kEncodingStrMap = 1;    // for set/map encodings of strings
+constexpr unsigned kEncodingListPack = 2;  // for small sets of strings
+constexpr unsigned kEncodingRoaring = 3;   // for large sets of integers, see core/roaring_set.h
+
+// The types that redis does not have, numbered after the OBJ_ types of redis/object.h.
+constexpr unsigned OBJ_SBF = 7;   // scalable bloom filter, see core/bloom.h
+constexpr unsigned OBJ_JSON = 8;  // parsed json document, see core/json.h
 
 namespace detail {
 
@@ -33,7 +46,15 @@ class RobjWrapper {
   size_t Size() const;
   void Free(std::pmr::memory_resource* mr);
 
+  // Moves the blob into a fuller page if it resides in an underutilized one.
+  // Only single-blob encodings are moved. Returns true if the blob was moved.
+  bool DefragIfNeeded(const PageUsage& page_usage, std::pmr::memory_resource* mr);
+
   void SetString(std::string_view s, std::pmr::memory_resource* mr);
+
+  // Makes the object a raw string of len bytes and returns its buffer, which the caller fills.
+  uint8_t* ReserveString(size_t len, std::pmr::memory_resource* mr);
+
   void Init(unsigned type, unsigned encoding, void* inner);
 
   unsigned type() const {
@@ -80,6 +101,9 @@ void ascii_unpack(const uint8_t* bin, size_t ascii_len, char* ascii);
 // packs ascii string (does not verify) into binary form saving 1 bit per byte on average (12.5%).
 void ascii_pack(const char* ascii, size_t len, uint8_t* bin);
 
+// compares packed and unpacked strings. packed must be of length = binpacked_len(ascii_len).
+bool compare_packed(const uint8_t* packed, const char* ascii, size_t ascii_len);
+
 }  // namespace detail
 
 class CompactObj {
@@ -94,11 +118,20 @@ class CompactObj {
     SMALL_TAG = 18,
     ROBJ_TAG = 19,
     EXTERNAL_TAG = 20,
+    SBF_TAG = 21,
+    DEDUP_TAG = 22,  // a string that is shared with the identical values, see StrDedup.
+    JSON_TAG = 23,
   };
 
   enum MaskBit {
     REF_BIT = 1,
+
+    // For values - the entry has an expiry. For keys - the inline expiry is set,
+    // see SetInlineExpire.
     EXPIRE_BIT = 2,
+
+    // For values - the entry has a memcached flag. For keys - the inline flag is set,
+    // see SetInlineFlag.
     FLAG_BIT = 4,
 
     // ascii encoding is not an injective function. it compresses 8 bytes to 7 but also 7 to 7.
@@ -112,21 +145,29 @@ class CompactObj {
 
   static constexpr uint8_t kEncMask = ASCII1_ENC_BIT | ASCII2_ENC_BIT;
 
+  // The ascii encoding never sets both bits. We use this combination for strings compressed
+  // with the thread-local dictionary, see SetValueString.
+  static constexpr uint8_t kZstdEnc = ASCII1_ENC_BIT | ASCII2_ENC_BIT;
+
+  // The 2 most significant bits of mask_ hold the access frequency counter.
+  static constexpr unsigned kFreqShift = 6;
+  static constexpr uint8_t kFreqMask = 3 << kFreqShift;
+
  public:
   using PrefixArray = std::vector<std::string_view>;
 
-  CompactObj() {  // By default - empty string.
+  CompactObj() : taglen_(0), age_(0) {  // By default - empty string.
   }
 
-  explicit CompactObj(robj* o) {
+  explicit CompactObj(robj* o) : CompactObj() {
     ImportRObj(o);
   }
 
-  explicit CompactObj(std::string_view str) {
+  explicit CompactObj(std::string_view str) : CompactObj() {
     SetString(str);
   }
 
-  CompactObj(CompactObj&& cs) noexcept {
+  CompactObj(CompactObj&& cs) noexcept : CompactObj() {
     operator=(std::move(cs));
   };
 
@@ -146,6 +187,7 @@ class CompactObj {
     memcpy(&res.u_, &u_, sizeof(u_));
     res.taglen_ = taglen_;
     res.mask_ = mask_ | REF_BIT;
+    res.age_ = age_;
 
     return res;
   }
@@ -154,6 +196,14 @@ class CompactObj {
     return mask_ & REF_BIT;
   }
 
+  // Returns true if AsRef() of this object can be read from other threads as long as the object
+  // is neither mutated nor freed. SmallString resolves its pointers via a thread-local
+  // translation table, external objects reside in the tiered storage of their shard and
+  // compressed strings are decoded with the dictionaries of their thread.
+  bool IsThreadSafeRef() const {
+    return taglen_ != SMALL_TAG && taglen_ != EXTERNAL_TAG && (mask_ & kEncMask) != kZstdEnc;
+  }
+
   std::string_view GetSlice(std::string* scratch) const;
 
   std::string ToString() const {
@@ -165,6 +215,9 @@ class CompactObj {
   uint64_t HashCode() const;
   static uint64_t HashCode(std::string_view str);
 
+  // Prefetches the heap part of the object, e.g. before a pass over many objects reads them.
+  void Prefetch() const;
+
   bool operator==(const CompactObj& o) const;
 
   bool operator==(std::string_view sl) const;
@@ -213,6 +266,64 @@ class CompactObj {
     }
   }
 
+  // Keys do not change after they are inserted, therefore some of their encodings
+  // (short inline strings and integers) leave the tail of u_ unused for good. DbSlice keeps there
+  // a copy of the key expiry, so that reads do not need to look into the expire table.
+  // Requires 4 spare bytes. Returns false if there is no room for it in this object.
+  bool SetInlineExpire(uint32_t val);
+
+  bool HasInlineExpire() const {
+    return mask_ & EXPIRE_BIT;
+  }
+
+  // Requires: HasInlineExpire() is true.
+  uint32_t InlineExpire() const;
+
+  void ClearInlineExpire() {
+    mask_ &= ~EXPIRE_BIT;
+  }
+
+  // Same as SetInlineExpire but for the memcached flag of the key. Requires 8 spare bytes,
+  // i.e. integer keys and inline keys of upto 8 bytes, so both can be set together.
+  bool SetInlineFlag(uint32_t val);
+
+  bool HasInlineFlag() const {
+    return mask_ & FLAG_BIT;
+  }
+
+  // Requires: HasInlineFlag() is true.
+  uint32_t InlineFlag() const;
+
+  void ClearInlineFlag() {
+    mask_ &= ~FLAG_BIT;
+  }
+
+  static constexpr unsigned kMaxFreq = kFreqMask >> kFreqShift;
+
+  // Access frequency counter used by the lfu cache policy. The object does not interpret it,
+  // the policy decides how it grows and decays. Can be updated via const references,
+  // similarly to the other metadata bits it lives with.
+  unsigned Freq() const {
+    return mask_ >> kFreqShift;
+  }
+
+  void SetFreq(unsigned freq) const {
+    mask_ = (mask_ & ~kFreqMask) | (freq << kFreqShift);
+  }
+
+  static constexpr unsigned kMaxAge = 7;
+
+  // Access age of a key, reset by the lookups and advanced by the background passes, see
+  // DbSlice::AgeKeysStep. Lives in the bits of the tag that the tag values do not use and,
+  // like the frequency counter, is not interpreted by the object.
+  unsigned Age() const {
+    return age_;
+  }
+
+  void SetAge(unsigned age) const {
+    age_ = age;
+  }
+
   unsigned Encoding() const;
   unsigned ObjType() const;
 
@@ -245,19 +356,64 @@ class CompactObj {
   void SetString(std::string_view str);
   void GetString(std::string* res) const;
 
+  // Like SetString but shares long strings with the identical values if deduplication is
+  // enabled in this thread, otherwise compresses mid-sized strings if compression is enabled.
+  // Meant for values since such strings are slower to hash and to compare.
+  void SetValueString(std::string_view str);
+
+  // True if the string is shared with the identical values of the thread. Mutations replace
+  // the string, hence the other values are not affected by them.
+  bool IsDedup() const {
+    return taglen_ == DEDUP_TAG;
+  }
+
   // dest must have at least Size() bytes available
   void GetString(char* dest) const;
 
   bool IsExternal() const {
     return taglen_ == EXTERNAL_TAG;
   }
-  void SetExternal(size_t offset, size_t sz);
+  // Replaces the value with its location in the tiered storage. ObjType() keeps returning the
+  // type of the value, so the collections are recognized before they are loaded back.
+  // raw_sz is the length of a string that is stored compressed in sz bytes, 0 otherwise.
+  void SetExternal(size_t offset, size_t sz, size_t raw_sz = 0);
+
+  // Restores an external value of obj_type, e.g. from a reference in a snapshot.
+  void ImportExternal(unsigned obj_type, size_t offset, size_t sz, size_t raw_sz);
+
+  // Creates an empty scalable bloom filter of type OBJ_SBF.
+  void SetSBF(uint64_t initial_capacity, double fp_prob, double grow_factor);
+
+  // Takes ownership over sbf, which must have been allocated with memory_resource().
+  void SetSBF(SBF* sbf);
+
+  // Requires: ObjType() is OBJ_SBF.
+  SBF* GetSBF() const;
+
+  // Takes ownership over doc, which must have been allocated with memory_resource(), and sets
+  // the type to OBJ_JSON.
+  void SetJson(JsonDoc* doc);
+
+  // Requires: ObjType() is OBJ_JSON.
+  JsonDoc* GetJson() const;
+
+  // Returns the extent of the value in the tiered storage.
   std::pair<size_t, size_t> GetExternalPtr() const;
 
+  bool IsExternalCompressed() const {
+    return taglen_ == EXTERNAL_TAG && u_.ext_ptr.raw_size != 0;
+  }
+
   // In case this object a single blob, returns number of bytes allocated on heap
-  // for that blob. Otherwise returns 0.
+  // for that blob. Otherwise returns 0. Shared strings return 0, their blobs are accounted
+  // once per thread, see Stats::dedup_bytes.
   size_t MallocUsed() const;
 
+  // Moves the heap blob of this object into a fuller page if it resides in an underutilized
+  // page of the thread-local heap. Invalidates previously returned slices and references.
+  // Returns true if the object was moved.
+  bool DefragIfNeeded(const PageUsage& page_usage);
+
   // Resets the object to empty state.
   void Reset();
 
@@ -271,6 +427,12 @@ class CompactObj {
 
   struct Stats {
     size_t small_string_bytes = 0;
+    size_t compressed_strings = 0;
+    size_t compression_dict_bytes = 0;
+    size_t dedup_strings = 0;      // distinct shared strings.
+    size_t dedup_bytes = 0;        // allocated by the shared strings.
+    size_t dedup_saved_bytes = 0;  // that the duplicates would have allocated.
+    size_t dedup_index_bytes = 0;
   };
 
   static Stats GetStats();
@@ -278,6 +440,16 @@ class CompactObj {
   static void InitThreadLocal(std::pmr::memory_resource* mr);
   static std::pmr::memory_resource* memory_resource();  // thread-local.
 
+  // Enables compression of values in the calling thread. Must not be disabled while
+  // compressed values exist.
+  static void EnableCompression(bool enable);
+  static StrCompressor* compressor();  // thread-local, null if compression is disabled.
+
+  // Enables the deduplication of the values of at least min_len bytes in the calling thread,
+  // 0 disables it. Must not be disabled while shared values exist.
+  static void EnableDedup(size_t min_len);
+  static StrDedup* dedup();  // thread-local, null if deduplication is disabled.
+
  private:
   size_t DecodedLen(size_t sz) const;
 
@@ -290,6 +462,17 @@ class CompactObj {
 
   bool CmpEncoded(std::string_view sv) const;
 
+  // Returns number of unused bytes at the end of u_.
+  unsigned SpareLen() const {
+    if (taglen_ == INT_TAG)
+      return kInlineLen - sizeof(u_.ival);
+    return IsInline() ? kInlineLen - taglen_ : 0;
+  }
+
+  // Offsets of the inline metadata within u_. See SetInlineExpire.
+  static constexpr unsigned kInlineExpireOffs = kInlineLen - 4;
+  static constexpr unsigned kInlineFlagOffs = kInlineLen - 8;
+
   void SetMeta(uint8_t taglen, uint8_t mask = 0) {
     if (HasAllocated()) {
       Free();
@@ -303,7 +486,13 @@ class CompactObj {
   struct ExternalPtr {
     size_t offset;
     uint32_t size;
-    uint32_t unneeded;
+    uint16_t obj_type;
+    uint16_t raw_size;
+  } __attribute__((packed));
+
+  struct DedupPtr {
+    DedupBlob* blob;
+    uint64_t unused;
   } __attribute__((packed));
 
   // My main data structure. Union of representations.
@@ -317,6 +506,9 @@ class CompactObj {
     detail::RobjWrapper r_obj;
     int64_t ival __attribute__((packed));
     ExternalPtr ext_ptr;
+    SBF* sbf __attribute__((packed));
+    JsonDoc* json __attribute__((packed));
+    DedupPtr dedup_ptr;
 
     U() : r_obj() {
     }
@@ -328,7 +520,10 @@ class CompactObj {
   // Maybe it's possible to merge those 2 together and gain another byte
   // but lets postpone it to 2023.
   mutable uint8_t mask_ = 0;
-  uint8_t taglen_ = 0;
+
+  // The tags take 5 bits.
+  uint8_t taglen_ : 5;
+  mutable uint8_t age_ : 3;
 };
 
 inline bool CompactObj::operator==(std::string_view sv) const {
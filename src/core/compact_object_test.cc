@@ -5,16 +5,25 @@
 
 #include <mimalloc.h>
 #include <xxhash.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 
+#include <thread>
+
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "core/bloom.h"
 #include "core/flat_set.h"
 #include "core/mi_memory_resource.h"
+#include "core/str_compressor.h"
+#include "core/str_dedup.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 
 extern "C" {
 #include "redis/dict.h"
 #include "redis/intset.h"
+#include "redis/listpack.h"
 #include "redis/object.h"
 #include "redis/redis_aux.h"
 #include "redis/stream.h"
@@ -110,6 +119,104 @@ TEST_F(CompactObjectTest, InlineAsciiEncoded) {
   EXPECT_EQ(s.size(), obj.Size());
 }
 
+TEST_F(CompactObjectTest, Freq) {
+  string s = "key:0000000000000";
+  CompactObj obj{s};
+  uint64_t hc = obj.HashCode();
+  EXPECT_EQ(0, obj.Freq());
+
+  obj.SetFreq(CompactObj::kMaxFreq);
+  obj.SetExpire(true);
+  EXPECT_EQ(CompactObj::kMaxFreq, obj.Freq());
+  EXPECT_EQ(s, obj);
+  EXPECT_EQ(hc, obj.HashCode());
+
+  obj.SetFreq(1);
+  EXPECT_EQ(1, obj.Freq());
+  EXPECT_TRUE(obj.HasExpire());
+
+  CompactObj moved{std::move(obj)};
+  EXPECT_EQ(1, moved.Freq());
+  EXPECT_EQ(s, moved);
+
+  moved.SetString("foo");
+  EXPECT_EQ(1, moved.Freq());
+  moved.SetInt(42);
+  EXPECT_EQ(1, moved.Freq());
+}
+
+TEST_F(CompactObjectTest, Age) {
+  for (string_view s : {"key:1", "key:0000000000000", "key:00000000000000000000"}) {
+    CompactObj obj{s};
+    EXPECT_EQ(0, obj.Age());
+    uint64_t hc = obj.HashCode();
+
+    obj.SetAge(CompactObj::kMaxAge);
+    obj.SetFreq(CompactObj::kMaxFreq);
+    EXPECT_EQ(CompactObj::kMaxAge, obj.Age());
+    EXPECT_EQ(s, obj);
+    EXPECT_EQ(s.size(), obj.Size());
+    EXPECT_EQ(hc, obj.HashCode());
+
+    CompactObj moved{std::move(obj)};
+    EXPECT_EQ(CompactObj::kMaxAge, moved.Age());
+    EXPECT_EQ(0, obj.Age());
+    EXPECT_EQ(s, moved);
+
+    moved.Reset();
+    EXPECT_EQ(0, moved.Age());
+  }
+}
+
+TEST_F(CompactObjectTest, InlineExpire) {
+  CompactObj key{"key:12345678"};
+  uint64_t hc = key.HashCode();
+  ASSERT_TRUE(key.SetInlineExpire(123456));
+  EXPECT_TRUE(key.HasInlineExpire());
+  EXPECT_EQ(123456, key.InlineExpire());
+  EXPECT_EQ("key:12345678", key);
+  EXPECT_EQ(hc, key.HashCode());
+  EXPECT_TRUE(key == key.AsRef());
+
+  CompactObj ikey{"1234567"};
+  ASSERT_TRUE(ikey.SetInlineExpire(UINT32_MAX));
+  EXPECT_EQ(UINT32_MAX, ikey.InlineExpire());
+  EXPECT_EQ("1234567", ikey);
+
+  key.ClearInlineExpire();
+  EXPECT_FALSE(key.HasInlineExpire());
+
+  CompactObj long_key{string(13, 'a')};
+  EXPECT_FALSE(long_key.SetInlineExpire(1));
+  EXPECT_FALSE(long_key.HasInlineExpire());
+  CompactObj small_key{string(40, 'a')};
+  EXPECT_FALSE(small_key.SetInlineExpire(1));
+}
+
+TEST_F(CompactObjectTest, InlineFlag) {
+  CompactObj key{"key:1234"};
+  ASSERT_TRUE(key.SetInlineFlag(42));
+  ASSERT_TRUE(key.SetInlineExpire(7));
+  EXPECT_EQ(42, key.InlineFlag());
+  EXPECT_EQ(7, key.InlineExpire());
+  EXPECT_EQ("key:1234", key);
+
+  CompactObj ikey{"123456789"};
+  ASSERT_TRUE(ikey.SetInlineFlag(UINT32_MAX));
+  ASSERT_TRUE(ikey.SetInlineExpire(1));
+  EXPECT_EQ(UINT32_MAX, ikey.InlineFlag());
+  EXPECT_EQ(123456789, *ikey.TryGetInt());
+
+  ikey.ClearInlineFlag();
+  EXPECT_FALSE(ikey.HasInlineFlag());
+  EXPECT_TRUE(ikey.HasInlineExpire());
+
+  // Only room for the expiry.
+  CompactObj mid_key{"key:12345"};
+  EXPECT_FALSE(mid_key.SetInlineFlag(1));
+  EXPECT_FALSE(mid_key.HasInlineFlag());
+  EXPECT_TRUE(mid_key.SetInlineExpire(1));
+}
 
 TEST_F(CompactObjectTest, Int) {
   cobj_.SetString("0");
@@ -142,6 +249,25 @@ TEST_F(CompactObjectTest, MediumString) {
   EXPECT_EQ(27463, cobj_.Size());
 }
 
+TEST_F(CompactObjectTest, BigAsciiString) {
+  string tmp(1 << 20, 'a');
+  for (size_t i = 0; i < tmp.size(); i += 7)
+    tmp[i] = 'a' + i % 26;
+
+  cobj_.SetString(tmp);
+  EXPECT_EQ(tmp.size(), cobj_.Size());
+  EXPECT_EQ(tmp, cobj_.ToString());
+  EXPECT_LT(cobj_.MallocUsed(), tmp.size());
+
+  tmp.resize(100000);
+  cobj_.SetString(tmp);
+  EXPECT_EQ(tmp, cobj_.ToString());
+
+  tmp.back() = '\xff';
+  cobj_.SetString(tmp);
+  EXPECT_EQ(tmp, cobj_.ToString());
+}
+
 TEST_F(CompactObjectTest, AsciiUtil) {
   std::string_view data{"aaaaaabb"};
   uint8_t buf[32];
@@ -155,6 +281,161 @@ TEST_F(CompactObjectTest, AsciiUtil) {
   ASSERT_EQ(data.substr(0, 7), actual);
 }
 
+TEST_F(CompactObjectTest, AsciiRoundtrip) {
+  uint8_t buf[128];
+  char ascii[128];
+  string str;
+
+  for (unsigned len = 0; len <= 100; ++len) {
+    str.resize(len);
+    for (unsigned i = 0; i < len; ++i) {
+      str[i] = 32 + (i * 37 + len) % 95;
+    }
+
+    size_t packed_len = (len * 7 + 7) / 8;
+    memset(buf, 0xFF, sizeof(buf));
+    detail::ascii_pack(str.data(), len, buf);
+    ASSERT_EQ(0xFF, buf[packed_len]) << len;  // no overrun.
+
+    detail::ascii_unpack(buf, len, ascii);
+    ASSERT_EQ(str, string_view(ascii, len));
+    ASSERT_TRUE(detail::compare_packed(buf, str.data(), len));
+
+    if (len > 0) {
+      str[len / 2] ^= 1;
+      ASSERT_FALSE(detail::compare_packed(buf, str.data(), len)) << len;
+    }
+  }
+}
+
+TEST_F(CompactObjectTest, CmpEncoded) {
+  for (unsigned len = 1; len <= 40; ++len) {
+    string str(len, 'a');
+    for (unsigned i = 0; i < len; ++i) {
+      str[i] += i % 26;
+    }
+
+    cobj_.SetString(str);
+    EXPECT_EQ(cobj_, str) << len;
+
+    string other = str;
+    other.back() = 'Z';
+    EXPECT_FALSE(cobj_ == other) << len;
+
+    other.back() = char(0x80 | str.back());  // non-ascii with the same 7 low bits.
+    EXPECT_FALSE(cobj_ == other) << len;
+  }
+}
+
+TEST_F(CompactObjectTest, CompressedValue) {
+  CompactObj::EnableCompression(true);
+  StrCompressor* compressor = CompactObj::compressor();
+
+  auto make_value = [](unsigned i) {
+    return absl::StrCat(R"({"id": )", i, R"(, "user": {"name": "user_)", i * 7,
+                        R"(", "email": "user)", i % 1000, R"(@example.com", "country": ")",
+                        i % 2 ? "US" : "DE", R"("}, "status": ")", i % 3 ? "shipped" : "pending",
+                        R"(", "created_at": "2022-05-)", 10 + i % 20, R"(T10:00:00Z"})");
+  };
+
+  // Until the dictionary is trained, values are stored as is.
+  unsigned i = 0;
+  while (!compressor->HasDict()) {
+    cobj_.SetValueString(make_value(i));
+    ASSERT_EQ(0u, compressor->stats().live_blobs);
+    compressor->Poll();
+
+    if (++i % 1024 == 0)
+      this_thread::sleep_for(1ms);
+    ASSERT_LT(i, 1u << 22);
+  }
+
+  string val = make_value(i);
+  cobj_.SetValueString(val);
+  EXPECT_EQ(1u, compressor->stats().live_blobs);
+  EXPECT_GT(compressor->stats().dict_bytes, 0u);
+
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(val.size(), cobj_.Size());
+  EXPECT_EQ(val, cobj_.ToString());
+  EXPECT_LT(cobj_.MallocUsed(), val.size() / 2);
+  EXPECT_EQ(CompactObj::HashCode(val), cobj_.HashCode());
+  EXPECT_FALSE(cobj_.IsThreadSafeRef());
+
+  EXPECT_TRUE(cobj_ == val);
+  EXPECT_FALSE(cobj_ == make_value(i + 1));
+
+  CompactObj plain;
+  plain.SetString(val);
+  EXPECT_TRUE(cobj_ == plain);
+
+  // Keys are never compressed.
+  CompactObj key{val};
+  EXPECT_EQ(1u, compressor->stats().live_blobs);
+
+  cobj_.SetString("foo");
+  EXPECT_EQ(0u, compressor->stats().live_blobs);
+  CompactObj::EnableCompression(false);
+}
+
+TEST_F(CompactObjectTest, DedupValue) {
+  CompactObj::EnableDedup(128);
+  StrDedup* dedup = CompactObj::dedup();
+
+  string val(1000, 'x');
+  val[500] = '\xff';  // not ascii.
+  CompactObj a, b, c;
+  a.SetValueString(val);
+  b.SetValueString(val);
+  c.SetValueString(string(100, 'y'));  // too short.
+  EXPECT_EQ(1u, dedup->stats().blobs);
+  EXPECT_TRUE(a.IsDedup());
+  EXPECT_TRUE(b.IsDedup());
+  EXPECT_FALSE(c.IsDedup());
+
+  // The blob is accounted by the stats of the thread rather than by its references.
+  EXPECT_EQ(0u, a.MallocUsed());
+  EXPECT_EQ(0u, b.MallocUsed());
+  EXPECT_GT(dedup->stats().blob_bytes, val.size());
+  EXPECT_EQ(dedup->stats().blob_bytes, dedup->stats().saved_bytes);
+
+  EXPECT_EQ(OBJ_STRING, b.ObjType());
+  EXPECT_EQ(val.size(), b.Size());
+  EXPECT_EQ(val, b.ToString());
+  EXPECT_EQ(CompactObj::HashCode(val), b.HashCode());
+  EXPECT_TRUE(b.IsThreadSafeRef());
+  EXPECT_TRUE(a == b);
+  EXPECT_TRUE(b == val);
+
+  CompactObj plain;
+  plain.SetString(val);
+  EXPECT_TRUE(plain == b);
+
+  // Mutating a value replaces its string, the other holders keep the original.
+  string appended = val + "z";
+  b.SetValueString(appended);
+  EXPECT_EQ(2u, dedup->stats().blobs);
+  EXPECT_EQ(0u, dedup->stats().saved_bytes);
+  EXPECT_EQ(val, a.ToString());
+  EXPECT_EQ(appended, b.ToString());
+  EXPECT_FALSE(a == b);
+
+  a.SetString("foo");
+  EXPECT_EQ(1u, dedup->stats().blobs);
+
+  // Refs do not release the string.
+  {
+    CompactObj ref = b.AsRef();
+    EXPECT_EQ(appended, ref.ToString());
+  }
+  EXPECT_EQ(1u, dedup->stats().blobs);
+
+  b.Reset();
+  EXPECT_EQ(0u, dedup->stats().blobs);
+  EXPECT_EQ(0u, dedup->stats().blob_bytes);
+  CompactObj::EnableDedup(0);
+}
+
 TEST_F(CompactObjectTest, IntSet) {
   robj* src = createIntsetObject();
   cobj_.ImportRObj(src);
@@ -259,4 +540,182 @@ TEST_F(CompactObjectTest, StreamObj) {
   EXPECT_FALSE(cobj_.IsInline());
 }
 
+TEST_F(CompactObjectTest, SBF) {
+  cobj_.SetExpire(true);
+  cobj_.SetSBF(100, 0.01, 2);
+  EXPECT_EQ(OBJ_SBF, cobj_.ObjType());
+  EXPECT_TRUE(cobj_.HasExpire());
+  EXPECT_TRUE(cobj_.GetSBF()->Add("a"));
+  EXPECT_EQ(1u, cobj_.Size());
+  EXPECT_GT(cobj_.MallocUsed(), 0u);
+
+  CompactObj moved = std::move(cobj_);
+  EXPECT_TRUE(moved.GetSBF()->Exists("a"));
+  moved.Reset();
+}
+
+static void BM_AsciiPack(benchmark::State& state) {
+  string str(state.range(0), 'a');
+  for (size_t i = 0; i < str.size(); ++i) {
+    str[i] += i % 26;
+  }
+  vector<uint8_t> buf(str.size());
+
+  while (state.KeepRunning()) {
+    detail::ascii_pack(str.data(), str.size(), buf.data());
+    benchmark::DoNotOptimize(buf.data());
+  }
+}
+BENCHMARK(BM_AsciiPack)->Arg(18)->Arg(64)->Arg(1024);
+
+static void BM_AsciiUnpack(benchmark::State& state) {
+  string str(state.range(0), 'a');
+  for (size_t i = 0; i < str.size(); ++i) {
+    str[i] += i % 26;
+  }
+  vector<uint8_t> buf(str.size());
+  detail::ascii_pack(str.data(), str.size(), buf.data());
+
+  while (state.KeepRunning()) {
+    detail::ascii_unpack(buf.data(), str.size(), str.data());
+    benchmark::DoNotOptimize(str.data());
+  }
+}
+BENCHMARK(BM_AsciiUnpack)->Arg(18)->Arg(64)->Arg(1024);
+
+static void BM_CmpEncoded(benchmark::State& state) {
+  string str(state.range(0), 'a');
+  for (size_t i = 0; i < str.size(); ++i) {
+    str[i] += i % 26;
+  }
+  CompactObj cobj;
+  cobj.SetString(str);
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(cobj == str);
+  }
+}
+BENCHMARK(BM_CmpEncoded)->Arg(16)->Arg(64)->Arg(1024);
+
+// The strings of the encodings that the benchmarks below compare, by range(0):
+// 0 - int, 1 - inline, 2 - ascii packed, 3 - raw heap string.
+static string EncodingBenchStr(int64_t kind) {
+  switch (kind) {
+    case 0:
+      return "1234567890";
+    case 1:
+      return "\xff-inline-key";
+    case 2:
+      return "user:0000000000000000:session";
+    default:
+      return string(64, '\xfe');
+  }
+}
+
+// Reports the bytes that the value allocates as the counter malloc_used.
+static void BM_SetString(benchmark::State& state) {
+  string str = EncodingBenchStr(state.range(0));
+  CompactObj obj;
+
+  while (state.KeepRunning()) {
+    obj.SetString(str);
+    benchmark::DoNotOptimize(obj);
+  }
+  state.counters["malloc_used"] = obj.MallocUsed();
+  state.counters["bytes_per_obj"] = sizeof(CompactObj) + obj.MallocUsed();
+}
+BENCHMARK(BM_SetString)->DenseRange(0, 3);
+
+static void BM_GetString(benchmark::State& state) {
+  CompactObj obj{EncodingBenchStr(state.range(0))};
+  string res;
+
+  while (state.KeepRunning()) {
+    obj.GetString(&res);
+    benchmark::DoNotOptimize(res.data());
+  }
+}
+BENCHMARK(BM_GetString)->DenseRange(0, 3);
+
+static void BM_HashCode(benchmark::State& state) {
+  CompactObj obj{EncodingBenchStr(state.range(0))};
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(obj.HashCode());
+  }
+}
+BENCHMARK(BM_HashCode)->DenseRange(0, 3);
+
+static void BM_EqualEncoded(benchmark::State& state) {
+  string str = EncodingBenchStr(state.range(0));
+  CompactObj obj{str};
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(obj == str);
+  }
+}
+BENCHMARK(BM_EqualEncoded)->DenseRange(0, 3);
+
+// Converts an intset of range(0) members to a StringSet, like SetFamily does once the set
+// outgrows its intset. The counters are the bytes before and after the conversion.
+static void BM_IntSetToStringSet(benchmark::State& state) {
+  intset* is = intsetNew();
+  uint8_t success = 0;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    is = intsetAdd(is, i * 7, &success);
+  }
+  size_t set_bytes = 0;
+
+  while (state.KeepRunning()) {
+    StringSet ss;
+    int64_t intele;
+    char buf[32];
+
+    ss.Reserve(intsetLen(is));
+    for (int ii = 0; intsetGet(is, ii, &intele); ++ii) {
+      char* next = absl::numbers_internal::FastIntToBuffer(intele, buf);
+      ss.Add(string_view{buf, size_t(next - buf)});
+    }
+    set_bytes = ss.MallocUsed();
+  }
+  state.counters["src_bytes"] = intsetBlobLen(is);
+  state.counters["dest_bytes"] = set_bytes;
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  zfree(is);
+}
+BENCHMARK(BM_IntSetToStringSet)->Arg(128)->Arg(512);
+
+// Converts a listpack hash of range(0) fields to a StringMap, like HSetFamily does.
+static void BM_ListpackToStringMap(benchmark::State& state) {
+  uint8_t* lp = lpNew(0);
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    string field = absl::StrCat("field:", i), val = absl::StrCat("value:", i);
+    lp = lpAppend(lp, reinterpret_cast<const uint8_t*>(field.data()), field.size());
+    lp = lpAppend(lp, reinterpret_cast<const uint8_t*>(val.data()), val.size());
+  }
+  size_t map_bytes = 0;
+
+  while (state.KeepRunning()) {
+    StringMap sm;
+    uint8_t fbuf[LP_INTBUF_SIZE], vbuf[LP_INTBUF_SIZE];
+    int64_t flen, vlen;
+
+    sm.Reserve(lpLength(lp) / 2);
+    for (uint8_t* fptr = lpFirst(lp); fptr;) {
+      uint8_t* vptr = lpNext(lp, fptr);
+      uint8_t* field = lpGet(fptr, &flen, fbuf);
+      uint8_t* val = lpGet(vptr, &vlen, vbuf);
+      sm.Set(string_view{reinterpret_cast<char*>(field), size_t(flen)},
+             string_view{reinterpret_cast<char*>(val), size_t(vlen)});
+      fptr = lpNext(lp, vptr);
+    }
+    map_bytes = sm.MallocUsed();
+  }
+  state.counters["src_bytes"] = lpBytes(lp);
+  state.counters["dest_bytes"] = map_bytes;
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  lpFree(lp);
+}
+BENCHMARK(BM_ListpackToStringMap)->Arg(128)->Arg(512);
+
 }  // namespace dfly
@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <memory_resource>
 #include <vector>
 
@@ -40,6 +42,11 @@ class DashTable : public detail::DashTableBase {
     static constexpr bool USE_VERSION = Policy::kUseVersion;
   };
 
+  // Same geometry as SegmentPolicy, used to simulate insertions during Merge.
+  struct ShadowPolicy : public SegmentPolicy {
+    static constexpr bool USE_VERSION = false;
+  };
+
   using Base = detail::DashTableBase;
   using SegmentType = detail::Segment<_Key, _Value, SegmentPolicy>;
   using SegmentIterator = typename SegmentType::Iterator;
@@ -130,6 +137,8 @@ class DashTable : public detail::DashTableBase {
             std::pmr::memory_resource* mr = std::pmr::get_default_resource());
   ~DashTable();
 
+  // Allocates the segments for size entries. Splitting them while they are empty is cheap,
+  // otherwise each split moves half of the entries of a full segment.
   void Reserve(size_t size);
 
   // false for duplicate, true if inserted.
@@ -146,6 +155,15 @@ class DashTable : public detail::DashTableBase {
   template <typename U> const_iterator Find(U&& key) const;
   template <typename U> iterator Find(U&& key);
 
+  // Looks up keys[0..keys.size()) and stores the results in dest, which must have room for
+  // keys.size() iterators. The lookup is done in chunks of kFindBatchSize keys: first we hash
+  // the keys of the chunk and prefetch their buckets, then we resolve them. This way the cache
+  // misses of different keys overlap instead of being serialized.
+  template <typename KeyRange> void FindBatch(const KeyRange& keys, iterator* dest);
+
+  // Roughly the number of outstanding L1 misses a core can sustain.
+  static constexpr unsigned kFindBatchSize = 16;
+
   // it must be valid.
   void Erase(iterator it);
 
@@ -206,7 +224,38 @@ class DashTable : public detail::DashTableBase {
   // during the traversal, then Traverse() will eventually reach it even when the
   // table shrinks or grows.
   // Returns: cursor that is guaranteed to be less than 2^40.
-  template <typename Cb> cursor Traverse(cursor curs, Cb&& cb);
+  template <typename Cb> cursor Traverse(cursor curs, Cb&& cb) {
+    return TraverseInternal<false>(curs, [](iterator) {}, std::forward<Cb>(cb));
+  }
+
+  // Same as Traverse but overlaps the cache misses of the full table passes, like snapshotting
+  // or scanning. While a segment is visited the bucket of the next one is prefetched, and
+  // pf(iterator) is called for all the entries of the logical bucket before cb is called for any
+  // of them, so that pf could prefetch the payloads the entries point to. pf must not mutate
+  // the table.
+  template <typename PrefetchCb, typename Cb>
+  cursor TraversePrefetch(cursor curs, PrefetchCb&& pf, Cb&& cb) {
+    return TraverseInternal<true>(curs, std::forward<PrefetchCb>(pf), std::forward<Cb>(cb));
+  }
+
+  // Tries to merge the segment at directory index seg_id with its buddy, i.e. to undo their
+  // split. Succeeds only if both segments have the same local depth, which is larger than the
+  // initial depth, and together they fill at most half of a segment so that the merged segment
+  // won't split right away. Shrinks the directory once no segment requires the current global
+  // depth. Returns the directory index to continue from or 0 if all the segments were visited.
+  // Invalidates all the iterators but cursors stay valid.
+  uint32_t MergeStep(uint32_t seg_id);
+
+  // Destroys the entries of the segment at directory index seg_id, so that a big table could be
+  // cleared in bounded steps. Returns the directory index to continue from or 0 if all the
+  // segments were visited. The segments themselves are freed by Clear() or the destructor.
+  // Invalidates the iterators that point to the cleared segment.
+  uint32_t ClearStep(uint32_t seg_id);
+
+  // Calls cb(iterator) for every entry of the logical bucket that hosts keys with hash key_hash,
+  // i.e. those in its home bucket, those that probed into the neighbour bucket and the stashed
+  // ones. These are not necessarily the keys with that hash. cb may erase the entry it gets.
+  template <typename Cb> void TraverseHashBucket(uint64_t key_hash, Cb&& cb);
 
   // Takes an iterator pointing to an entry in a dash bucket and traverses all bucket's entries by
   // calling cb(iterator) for every non-empty slot. The iteration goes over a physical bucket.
@@ -259,9 +308,19 @@ class DashTable : public detail::DashTableBase {
   template <typename U, typename V, typename EvictionPolicy>
   std::pair<iterator, bool> InsertInternal(U&& key, V&& value, EvictionPolicy& policy);
 
+  template <bool kPrefetch, typename PrefetchCb, typename Cb>
+  cursor TraverseInternal(cursor curs, PrefetchCb&& pf, Cb&& cb);
+
   void IncreaseDepth(unsigned new_depth);
   void Split(uint32_t seg_id);
 
+  // Merges the segments hosted at [start_idx, start_idx + 2 * chunk_size) directory range.
+  // Returns false if the merge is not possible.
+  bool Merge(size_t start_idx, size_t chunk_size);
+
+  // Halves the directory as long as all the segments have local depth below the global one.
+  void ShrinkDirectory();
+
   // Segment directory contains multiple segment pointers, some of them pointing to
   // the same object. IterateDistinct goes over all distinct segments in the table.
   template <typename Cb> void IterateDistinct(Cb&& cb);
@@ -651,6 +710,30 @@ auto DashTable<_Key, _Value, Policy>::Find(U&& key) -> iterator {
   return iterator{};
 }
 
+template <typename _Key, typename _Value, typename Policy>
+template <typename KeyRange>
+void DashTable<_Key, _Value, Policy>::FindBatch(const KeyRange& keys, iterator* dest) {
+  uint64_t hashes[kFindBatchSize];
+  const size_t num_keys = keys.size();
+
+  for (size_t start = 0; start < num_keys; start += kFindBatchSize) {
+    const size_t end = std::min<size_t>(num_keys, start + kFindBatchSize);
+
+    for (size_t i = start; i < end; ++i) {
+      uint64_t key_hash = DoHash(keys[i]);
+      hashes[i - start] = key_hash;
+      segment_[SegmentId(key_hash)]->Prefetch(key_hash);
+    }
+
+    for (size_t i = start; i < end; ++i) {
+      uint64_t key_hash = hashes[i - start];
+      uint32_t seg_id = SegmentId(key_hash);
+      auto seg_it = segment_[seg_id]->FindIt(keys[i], key_hash, EqPred());
+      dest[i] = seg_it.found() ? iterator{this, seg_id, seg_it.index, seg_it.slot} : iterator{};
+    }
+  }
+}
+
 template <typename _Key, typename _Value, typename Policy>
 size_t DashTable<_Key, _Value, Policy>::Erase(const Key_t& key) {
   uint64_t key_hash = DoHash(key);
@@ -687,13 +770,21 @@ void DashTable<_Key, _Value, Policy>::Reserve(size_t size) {
     return;
 
   size_t sg_floor = (size - 1) / SegmentType::capacity();
-  if (sg_floor < segment_.size()) {
+  if (sg_floor < unique_segments_) {
     return;
   }
-  assert(sg_floor > 1u);
   unsigned new_depth = 1 + (63 ^ __builtin_clzll(sg_floor));
-
-  IncreaseDepth(new_depth);
+  if (new_depth > global_depth_)
+    IncreaseDepth(new_depth);
+
+  for (size_t i = 0; i < segment_.size();) {
+    SegmentType* seg = segment_[i];
+    if (seg->local_depth() < new_depth) {
+      Split(i);  // the same index may need another split.
+    } else {
+      i += 1u << (global_depth_ - seg->local_depth());
+    }
+  }
 }
 
 template <typename _Key, typename _Value, typename Policy>
@@ -837,14 +928,147 @@ void DashTable<_Key, _Value, Policy>::Split(uint32_t seg_id) {
 }
 
 template <typename _Key, typename _Value, typename Policy>
-template <typename Cb>
-auto DashTable<_Key, _Value, Policy>::Traverse(cursor curs, Cb&& cb) -> cursor {
+uint32_t DashTable<_Key, _Value, Policy>::MergeStep(uint32_t seg_id) {
+  if (seg_id >= segment_.size())
+    return 0;
+
+  SegmentType* seg = segment_[seg_id];
+  size_t chunk_size = 1u << (global_depth_ - seg->local_depth());
+  size_t next_id = (seg_id & ~(chunk_size - 1)) + chunk_size;
+
+  if (seg->local_depth() > initial_depth_) {
+    // Buddies reside in the same range of 2 * chunk_size entries, the left one has 0 in the
+    // last bit of its local depth prefix.
+    size_t start_idx = seg_id & ~(2 * chunk_size - 1);
+    if (Merge(start_idx, chunk_size)) {
+      next_id = start_idx + 2 * chunk_size;
+
+      unsigned prev_depth = global_depth_;
+      ShrinkDirectory();
+      next_id >>= (prev_depth - global_depth_);
+    }
+  }
+
+  return next_id < segment_.size() ? next_id : 0;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+uint32_t DashTable<_Key, _Value, Policy>::ClearStep(uint32_t seg_id) {
+  if (seg_id >= segment_.size())
+    return 0;
+
+  SegmentType* seg = segment_[seg_id];
+  size_t removed = 0;
+  seg->TraverseAll([&](const SegmentIterator& it) {
+    policy_.DestroyKey(seg->Key(it.index, it.slot));
+    policy_.DestroyValue(seg->Value(it.index, it.slot));
+    ++removed;
+  });
+  seg->Clear();
+  size_ -= removed;
+
+  size_t next_id = NextSeg(seg_id);
+  return next_id < segment_.size() ? next_id : 0;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+bool DashTable<_Key, _Value, Policy>::Merge(size_t start_idx, size_t chunk_size) {
+  SegmentType* left = segment_[start_idx];
+  SegmentType* right = segment_[start_idx + chunk_size];
+  if (left->local_depth() != right->local_depth())  // the buddy has been split further.
+    return false;
+
+  assert(left != right && left->local_depth() > 0);
+
+  size_t left_size = left->SlowSize();
+  size_t total = left_size + right->SlowSize();
+  if (total > SegmentType::capacity() / 2)
+    return false;
+
+  std::vector<uint64_t> hashes;
+  hashes.reserve(total);
+  auto collect = [&](SegmentType* seg) {
+    seg->TraverseAll([&](const SegmentIterator& it) {
+      hashes.push_back(policy_.HashFn(seg->Key(it.index, it.slot)));
+    });
+  };
+  collect(left);
+  collect(right);
+
+  // Entries placement depends only on their hashes and on the insertion order. Therefore we can
+  // verify that the merge succeeds by inserting just the hashes into a lightweight segment
+  // with the same geometry. Otherwise we would not be able to roll back a failed merge.
+  using ShadowSegment = detail::Segment<uint8_t, uint8_t, ShadowPolicy>;
+
+  std::unique_ptr<ShadowSegment> shadow(new ShadowSegment(0));
+  for (uint64_t hash : hashes) {
+    if (!shadow->InsertUniq(uint8_t(0), uint8_t(0), hash).found())
+      return false;
+  }
+  shadow.reset();
+
+  std::pmr::polymorphic_allocator<SegmentType> alloc(segment_.get_allocator().resource());
+  using alloc_traits = std::allocator_traits<decltype(alloc)>;
+
+  SegmentType* target = alloc.allocate(1);
+  alloc.construct(target, left->local_depth() - 1);
+  target->MoveFrom(hashes.data(), left);
+  target->MoveFrom(hashes.data() + left_size, right);
+
+  for (size_t i = start_idx; i < start_idx + 2 * chunk_size; ++i) {
+    segment_[i] = target;
+  }
+
+  for (SegmentType* seg : {left, right}) {
+    alloc_traits::destroy(alloc, seg);
+    alloc_traits::deallocate(alloc, seg, 1);
+  }
+  --unique_segments_;
+
+  return true;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::ShrinkDirectory() {
+  size_t prev_size = segment_.size();
+
+  while (global_depth_ > initial_depth_) {
+    bool at_global_depth = false;
+    IterateDistinct([&](SegmentType* seg) {
+      at_global_depth = seg->local_depth() == global_depth_;
+      return at_global_depth;
+    });
+
+    if (at_global_depth)
+      break;
+
+    // Every segment occupies at least 2 entries, so we keep every other one.
+    size_t new_size = segment_.size() / 2;
+    for (size_t i = 0; i < new_size; ++i) {
+      segment_[i] = segment_[2 * i];
+    }
+    segment_.resize(new_size);
+    --global_depth_;
+  }
+
+  if (segment_.size() < prev_size)
+    segment_.shrink_to_fit();
+}
+
+template <typename _Key, typename _Value, typename Policy>
+template <bool kPrefetch, typename PrefetchCb, typename Cb>
+auto DashTable<_Key, _Value, Policy>::TraverseInternal(cursor curs, PrefetchCb&& pf, Cb&& cb)
+    -> cursor {
   if (curs.bucket_id() >= kLogicalBucketNum)  // sanity.
     return 0;
 
   uint32_t sid = curs.segment_id(global_depth_);
   uint8_t bid = curs.bucket_id();
 
+  // If segments were merged since the cursor was created, sid may point to the middle of the
+  // merged segment range. By aligning it we may visit some entries twice but never miss any.
+  sid &= ~((1u << (global_depth_ - segment_[sid]->local_depth())) - 1);
+
   auto hash_fun = [this](const auto& k) { return policy_.HashFn(k); };
 
   bool fetched = false;
@@ -856,6 +1080,18 @@ auto DashTable<_Key, _Value, Policy>::Traverse(cursor curs, Cb&& cb) -> cursor {
 
     auto dt_cb = [&](const SegmentIterator& it) { cb(iterator{this, sid, it.index, it.slot}); };
 
+    if constexpr (kPrefetch) {
+      size_t next = NextSeg(sid);
+      if (next < segment_.size()) {
+        segment_[next]->PrefetchLogicalBucket(bid);
+      } else if (bid + 1 < kLogicalBucketNum) {
+        segment_[0]->PrefetchLogicalBucket(bid + 1);
+      }
+
+      auto pf_cb = [&](const SegmentIterator& it) { pf(iterator{this, sid, it.index, it.slot}); };
+      s->TraverseLogicalBucket(bid, hash_fun, std::move(pf_cb));
+    }
+
     fetched = s->TraverseLogicalBucket(bid, hash_fun, std::move(dt_cb));
     sid = NextSeg(sid);
     if (sid >= segment_.size()) {
@@ -870,6 +1106,18 @@ auto DashTable<_Key, _Value, Policy>::Traverse(cursor curs, Cb&& cb) -> cursor {
   return cursor{global_depth_, sid, bid};
 }
 
+template <typename _Key, typename _Value, typename Policy>
+template <typename Cb>
+void DashTable<_Key, _Value, Policy>::TraverseHashBucket(uint64_t key_hash, Cb&& cb) {
+  uint32_t sid = SegmentId(key_hash);
+  uint8_t bid = SegmentType::BucketIndex(key_hash);
+
+  auto hash_fun = [this](const auto& k) { return policy_.HashFn(k); };
+  auto dt_cb = [&](const SegmentIterator& it) { cb(iterator{this, sid, it.index, it.slot}); };
+
+  segment_[sid]->TraverseLogicalBucket(bid, hash_fun, std::move(dt_cb));
+}
+
 template <typename _Key, typename _Value, typename Policy>
 template <typename Cb>
 void DashTable<_Key, _Value, Policy>::TraverseBucket(const_iterator it, Cb&& cb) {
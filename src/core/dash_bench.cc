@@ -2,12 +2,25 @@
 // See LICENSE for licensing terms.
 //
 
+#define ENABLE_DASH_STATS
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/random/random.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 #include <mimalloc.h>
 
+#include <memory_resource>
+#include <string>
+#include <vector>
+
 #include "base/hash.h"
 #include "base/histogram.h"
 #include "base/init.h"
 #include "core/dash.h"
+#include "core/mi_memory_resource.h"
+#include "core/small_string.h"
+#include "server/detail/table.h"
 
 extern "C" {
 #include "redis/dict.h"
@@ -16,16 +29,27 @@ extern "C" {
 }
 
 ABSL_FLAG(uint32_t, n, 100000, "num items");
-ABSL_FLAG(bool, dash, true, "");
-ABSL_FLAG(bool, sds, true, "");
+ABSL_FLAG(std::string, impl, "dash_u64,dash_sds,dash_prime,absl_u64,absl_str,dict_u64,dict_sds",
+          "comma separated list of table implementations to benchmark");
+ABSL_FLAG(std::string, workload, "insert,find_hit,find_miss,traverse,mixed,erase",
+          "comma separated list of workloads to run, in this order, on the same table");
+ABSL_FLAG(double, read_ratio, 0.8,
+          "fraction of lookups in the mixed workload, the rest are split evenly between "
+          "inserts of new keys and erases of random keys");
+ABSL_FLAG(bool, hist, true, "If true, prints latency histograms for each workload");
 
 namespace dfly {
 
-static uint64_t dictSdsHash(const void* key) {
+using namespace std;
+using absl::GetFlag;
+
+namespace {
+
+uint64_t dictSdsHash(const void* key) {
   return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
-static int dictSdsKeyCompare(dict*, const void* key1, const void* key2) {
+int dictSdsKeyCompare(dict*, const void* key1, const void* key2) {
   int l1, l2;
 
   l1 = sdslen((sds)key1);
@@ -35,17 +59,26 @@ static int dictSdsKeyCompare(dict*, const void* key1, const void* key2) {
   return memcmp(key1, key2, l1) == 0;
 }
 
-static dictType SdsDict = {
+void dictSdsDestructor(dict*, void* val) {
+  sdsfree((sds)val);
+}
+
+dictType SdsDict = {
     dictSdsHash,       /* hash function */
     NULL,              /* key dup */
     NULL,              /* val dup */
     dictSdsKeyCompare, /* key compare */
-    NULL,
-    // dictSdsDestructor, /* key destructor */
-    NULL, /* val destructor */
+    dictSdsDestructor, /* key destructor */
+    NULL,              /* val destructor */
     NULL,
 };
 
+uint64_t callbackHash(const void* key) {
+  return XXH64(&key, sizeof(key), 0);
+}
+
+dictType IntDict = {callbackHash, NULL, NULL, NULL, NULL, NULL, NULL};
+
 struct UInt64Policy : public BasicDashPolicy {
   static uint64_t HashFn(uint64_t v) {
     return XXH3_64bits(&v, sizeof(v));
@@ -60,7 +93,7 @@ struct SdsDashPolicy {
     return XXH3_64bits(reinterpret_cast<const uint8_t*>(u), sdslen(u));
   }
 
-  static uint64_t HashFn(std::string_view u) {
+  static uint64_t HashFn(string_view u) {
     return XXH3_64bits(u.data(), u.size());
   }
 
@@ -72,119 +105,488 @@ struct SdsDashPolicy {
   }
 
   static bool Equal(sds u1, sds u2) {
-    return dictSdsKeyCompare(nullptr, u1, u2) == 0;
+    return dictSdsKeyCompare(nullptr, u1, u2) != 0;
   }
 
-  static bool Equal(sds u1, std::string_view u2) {
-    return u2 == std::string_view{u1, sdslen(u1)};
+  static bool Equal(sds u1, string_view u2) {
+    return u2 == string_view{u1, sdslen(u1)};
   }
 };
 
-using Dash64 = DashTable<uint64_t, uint64_t, UInt64Policy>;
-using DashSds = DashTable<sds, uint64_t, SdsDashPolicy>;
+// String keys are prepared in advance so that we won't measure their construction.
+// Keys [0, n) are inserted by the insert workload, keys [n, 2n) are inserted only by the mixed
+// workload.
+vector<string> str_keys;
 
-using absl::GetFlag;
-
-void Sample(int64_t start, int64_t end, base::Histogram* hist) {
-  hist->Add((end - start) / 1000);
+void InitStrKeys(uint64_t num) {
+  str_keys.resize(num);
+  for (uint64_t i = 0; i < num; ++i) {
+    str_keys[i] = absl::StrCat("key:", i);
+  }
 }
 
-Dash64 udt;
-DashSds sds_dt;
-base::Histogram hist;
+// Every implementation accounts its memory separately, either via its own memory resource or
+// via zmalloc thread-local counter for redis objects.
+class Impl {
+ public:
+  virtual ~Impl() {
+  }
 
-void BenchDash(time_t start) {
-  uint64_t num = GetFlag(FLAGS_n);
+  virtual bool Insert(uint64_t i) = 0;
+  virtual bool Find(uint64_t i) = 0;
+  virtual void Erase(uint64_t i) = 0;
 
-  for (uint64_t i = 0; i < num; ++i) {
-    udt.Insert(i, 0);
-    time_t end = absl::GetCurrentTimeNanos();
-    Sample(start, end, &hist);
-    start = end;
+  // Returns number of visited items.
+  virtual size_t Traverse() = 0;
+
+  virtual size_t Size() const = 0;
+
+  // Bytes allocated by the table and its items.
+  virtual size_t MemUsage() const = 0;
+
+  // Changes whenever the table grows. Allows to tell apart the inserts that caused a growth.
+  virtual size_t GrowthMark() const = 0;
+
+  // Implementation specific stats, printed after each workload.
+  virtual string Stats() {
+    return string{};
   }
-}
 
-inline sds Prefix() {
-  return sdsnew("xxxxxxxxxxxxxxxxxxxxxxx");
-}
+ protected:
+  MiMemoryResource mr_{mi_heap_get_backing()};
+};
 
-void BenchDashSds(time_t start) {
-  uint64_t num = GetFlag(FLAGS_n);
+template <typename K, typename V, typename Policy> class DashImplBase : public Impl {
+ protected:
+  using Table = DashTable<K, V, Policy>;
 
-  sds key = sdscatsds(Prefix(), sdsfromlonglong(0));
+ public:
+  DashImplBase() : table_(1, Policy{}, &mr_) {
+  }
 
-  for (uint64_t i = 0; i < num; ++i) {
-    sds_dt.Insert(key, 0);
-    time_t end = absl::GetCurrentTimeNanos();
-    Sample(start, end, &hist);
+  size_t Traverse() final {
+    size_t res = 0;
+    typename Table::cursor cursor;
+    do {
+      cursor = table_.Traverse(cursor, [&](typename Table::iterator) { ++res; });
+    } while (cursor);
+    return res;
+  }
 
-    key = sdscatsds(Prefix(), sdsfromlonglong(i + 1));
-    start = absl::GetCurrentTimeNanos();
+  size_t Size() const final {
+    return table_.size();
   }
-}
 
-static uint64_t callbackHash(const void* key) {
-  return XXH64(&key, sizeof(key), 0);
-}
+  size_t GrowthMark() const final {
+    return table_.unique_segments();
+  }
 
-static dictType IntDict = {callbackHash, NULL, NULL, NULL, NULL, NULL, NULL};
+  // Reports the probing counters accumulated since the last call and resets them.
+  string Stats() final {
+    typename Table::Segment_t::Stats st;
+
+    // Directory may contain multiple pointers to the same segment.
+    for (size_t sid = 0; sid < (1u << table_.depth());) {
+      auto* seg = table_.GetSegment(sid);
+      st.neighbour_probes += seg->stats.neighbour_probes;
+      st.stash_probes += seg->stats.stash_probes;
+      st.stash_overflow_probes += seg->stats.stash_overflow_probes;
+      seg->stats = {};
+      sid += 1u << (table_.depth() - seg->local_depth());
+    }
 
-dict* redis_dict = nullptr;
+    return absl::StrCat("segments: ", table_.unique_segments(),
+                        ", load factor: ", table_.load_factor(),
+                        ", neighbour probes: ", st.neighbour_probes,
+                        ", stash probes: ", st.stash_probes,
+                        ", stash overflow probes: ", st.stash_overflow_probes);
+  }
 
-void BenchDict(time_t start) {
-  uint64_t num = GetFlag(FLAGS_n);
+ protected:
+  Table table_;
+};
 
-  redis_dict = dictCreate(&IntDict);
-  for (uint64_t i = 0; i < num; ++i) {
-    dictAdd(redis_dict, (void*)i, nullptr);
-    time_t end = absl::GetCurrentTimeNanos();
-    Sample(start, end, &hist);
-    start = end;
+class DashU64Impl final : public DashImplBase<uint64_t, uint64_t, UInt64Policy> {
+ public:
+  bool Insert(uint64_t i) final {
+    return table_.Insert(i, i).second;
+  }
+
+  bool Find(uint64_t i) final {
+    return !table_.Find(i).is_done();
+  }
+
+  void Erase(uint64_t i) final {
+    table_.Erase(i);
+  }
+
+  size_t MemUsage() const final {
+    return mr_.used();
+  }
+};
+
+class DashSdsImpl final : public DashImplBase<sds, uint64_t, SdsDashPolicy> {
+ public:
+  DashSdsImpl() : zmalloc_base_(zmalloc_used_memory_tl) {
+  }
+
+  bool Insert(uint64_t i) final {
+    const string& key = str_keys[i];
+    if (!table_.Find(string_view{key}).is_done())
+      return false;
+
+    return table_.Insert(sdsnewlen(key.data(), key.size()), i).second;
+  }
+
+  bool Find(uint64_t i) final {
+    return !table_.Find(string_view{str_keys[i]}).is_done();
+  }
+
+  void Erase(uint64_t i) final {
+    auto it = table_.Find(string_view{str_keys[i]});
+    if (!it.is_done())
+      table_.Erase(it);
+  }
+
+  size_t MemUsage() const final {
+    return mr_.used() + (zmalloc_used_memory_tl - zmalloc_base_);
+  }
+
+ private:
+  ssize_t zmalloc_base_;
+};
+
+// Uses the same key/value types and table policy as the PrimeTable in the server.
+class DashPrimeImpl final
+    : public DashImplBase<detail::PrimeKey, detail::PrimeValue, detail::PrimeTablePolicy> {
+ public:
+  DashPrimeImpl() {
+    CompactObj::InitThreadLocal(&mr_);
+  }
+
+  bool Insert(uint64_t i) final {
+    string_view key = str_keys[i];
+    if (!table_.Find(key).is_done())
+      return false;
+
+    detail::PrimeValue pv;
+    pv.SetInt(i);
+    return table_.Insert(detail::PrimeKey{key}, std::move(pv)).second;
+  }
+
+  bool Find(uint64_t i) final {
+    return !table_.Find(string_view{str_keys[i]}).is_done();
+  }
+
+  void Erase(uint64_t i) final {
+    auto it = table_.Find(string_view{str_keys[i]});
+    if (!it.is_done())
+      table_.Erase(it);
+  }
+
+  size_t MemUsage() const final {
+    return mr_.used();
+  }
+};
+
+template <typename K> class AbslImpl final : public Impl {
+  using Alloc = pmr::polymorphic_allocator<pair<const K, uint64_t>>;
+  using Map = absl::flat_hash_map<K, uint64_t, absl::Hash<K>, equal_to<K>, Alloc>;
+
+ public:
+  AbslImpl() : map_(0, absl::Hash<K>{}, equal_to<K>{}, Alloc{&mr_}) {
+  }
+
+  bool Insert(uint64_t i) final {
+    return map_.emplace(Key(i), i).second;
+  }
+
+  bool Find(uint64_t i) final {
+    return map_.find(Key(i)) != map_.end();
   }
+
+  void Erase(uint64_t i) final {
+    map_.erase(Key(i));
+  }
+
+  size_t Traverse() final {
+    size_t res = 0;
+    for (const auto& k_v : map_) {
+      res += (k_v.second != UINT64_MAX);
+    }
+    return res;
+  }
+
+  size_t Size() const final {
+    return map_.size();
+  }
+
+  // Short keys are stored inline by std::string, hence they are accounted as well.
+  size_t MemUsage() const final {
+    return mr_.used();
+  }
+
+  size_t GrowthMark() const final {
+    return map_.bucket_count();
+  }
+
+ private:
+  static const K& Key(const uint64_t& i) {
+    if constexpr (is_same_v<K, string>) {
+      return str_keys[i];
+    } else {
+      return i;
+    }
+  }
+
+  Map map_;
+};
+
+class DictImpl final : public Impl {
+ public:
+  explicit DictImpl(bool is_sds)
+      : is_sds_(is_sds), zmalloc_base_(zmalloc_used_memory_tl),
+        dict_(dictCreate(is_sds ? &SdsDict : &IntDict)) {
+  }
+
+  ~DictImpl() {
+    dictRelease(dict_);
+    sdsfree(tmp_);
+  }
+
+  bool Insert(uint64_t i) final {
+    if (!is_sds_)
+      return dictAdd(dict_, (void*)i, nullptr) == DICT_OK;
+
+    const string& key = str_keys[i];
+    sds s = sdsnewlen(key.data(), key.size());
+    if (dictAdd(dict_, s, nullptr) == DICT_OK)
+      return true;
+    sdsfree(s);
+    return false;
+  }
+
+  bool Find(uint64_t i) final {
+    return dictFind(dict_, Key(i)) != nullptr;
+  }
+
+  void Erase(uint64_t i) final {
+    dictDelete(dict_, Key(i));
+  }
+
+  size_t Traverse() final {
+    size_t res = 0;
+    unsigned long cursor = 0;
+    auto scan_cb = [](void* privdata, const dictEntry* de) {
+      ++*reinterpret_cast<size_t*>(privdata);
+    };
+
+    do {
+      cursor = dictScan(dict_, cursor, scan_cb, nullptr, &res);
+    } while (cursor);
+    return res;
+  }
+
+  size_t Size() const final {
+    return dictSize(dict_);
+  }
+
+  size_t MemUsage() const final {
+    return zmalloc_used_memory_tl - zmalloc_base_;
+  }
+
+  size_t GrowthMark() const final {
+    return DICTHT_SIZE(dict_->ht_size_exp[0]) + DICTHT_SIZE(dict_->ht_size_exp[1]);
+  }
+
+ private:
+  // Lookups by sds key require a temporary sds, we reuse one to avoid allocations.
+  void* Key(uint64_t i) {
+    if (!is_sds_)
+      return (void*)i;
+
+    const string& key = str_keys[i];
+    tmp_ = sdscpylen(tmp_, key.data(), key.size());
+    return tmp_;
+  }
+
+  bool is_sds_;
+  ssize_t zmalloc_base_;
+  dict* dict_;
+  sds tmp_ = sdsempty();
+};
+
+unique_ptr<Impl> CreateImpl(string_view name) {
+  if (name == "dash_u64")
+    return make_unique<DashU64Impl>();
+  if (name == "dash_sds")
+    return make_unique<DashSdsImpl>();
+  if (name == "dash_prime")
+    return make_unique<DashPrimeImpl>();
+  if (name == "absl_u64")
+    return make_unique<AbslImpl<uint64_t>>();
+  if (name == "absl_str")
+    return make_unique<AbslImpl<string>>();
+  if (name == "dict_u64")
+    return make_unique<DictImpl>(false);
+  if (name == "dict_sds")
+    return make_unique<DictImpl>(true);
+  return nullptr;
 }
 
-void BenchDictSds(time_t start) {
-  uint64_t num = GetFlag(FLAGS_n);
+struct OpTimer {
+  base::Histogram* hist;
+  uint64_t start = absl::GetCurrentTimeNanos();
 
-  sds key = sdscat(Prefix(), sdsfromlonglong(0));
-  redis_dict = dictCreate(&SdsDict);
+  uint64_t Stop() {
+    uint64_t delta = absl::GetCurrentTimeNanos() - start;
+    hist->Add(delta);
+    return delta;
+  }
+};
 
-  for (uint64_t i = 0; i < num; ++i) {
-    dictAdd(redis_dict, key, nullptr);
-    time_t end = absl::GetCurrentTimeNanos();
-    Sample(start, end, &hist);
-    key = sdscatsds(Prefix(), sdsfromlonglong(i + 1));
-    start = absl::GetCurrentTimeNanos();
+void PrintResult(string_view impl, string_view workload, uint64_t ops, uint64_t start,
+                 const base::Histogram& hist) {
+  uint64_t total_ns = absl::GetCurrentTimeNanos() - start;
+  CONSOLE_INFO << impl << " " << workload << ": " << ops << " ops, "
+               << double(total_ns) / max<uint64_t>(ops, 1) << " ns/op";
+  if (GetFlag(FLAGS_hist)) {
+    CONSOLE_INFO << workload << " latency histogram (ns):\n" << hist.ToString();
   }
 }
 
+// Runs the workload and returns false if its name is unknown. Per-op latencies include
+// the overhead of reading the clock, ns/op are derived from the total time.
+bool RunWorkload(string_view impl_name, string_view workload, Impl* impl) {
+  const uint64_t num = GetFlag(FLAGS_n);
+  base::Histogram hist;
+  uint64_t found = 0;
+  uint64_t start = absl::GetCurrentTimeNanos();
+
+  if (workload == "insert") {
+    base::Histogram growth_hist;
+    uint64_t growth_cnt = 0;
+
+    for (uint64_t i = 0; i < num; ++i) {
+      size_t mark = impl->GrowthMark();
+      OpTimer timer{&hist};
+      impl->Insert(i);
+      uint64_t delta = timer.Stop();
+      if (impl->GrowthMark() != mark) {
+        growth_hist.Add(delta);
+        ++growth_cnt;
+      }
+    }
+
+    PrintResult(impl_name, workload, num, start, hist);
+    CONSOLE_INFO << "inserts that grew the table: " << growth_cnt;
+    if (GetFlag(FLAGS_hist) && growth_cnt) {
+      CONSOLE_INFO << "growth latency histogram (ns):\n" << growth_hist.ToString();
+    }
+    CONSOLE_INFO << "bytes per item: " << double(impl->MemUsage()) / max<size_t>(impl->Size(), 1);
+  } else if (workload == "find_hit" || workload == "find_miss") {
+    uint64_t offset = workload == "find_hit" ? 0 : num;
+    for (uint64_t i = 0; i < num; ++i) {
+      OpTimer timer{&hist};
+      found += impl->Find(offset + i);
+      timer.Stop();
+    }
+
+    PrintResult(impl_name, workload, num, start, hist);
+    CONSOLE_INFO << "found " << found << "/" << num;
+  } else if (workload == "erase") {
+    for (uint64_t i = 0; i < num * 2; ++i) {
+      OpTimer timer{&hist};
+      impl->Erase(i);
+      timer.Stop();
+    }
+
+    PrintResult(impl_name, workload, num * 2, start, hist);
+    CONSOLE_INFO << "items left: " << impl->Size() << ", bytes left: " << impl->MemUsage();
+  } else if (workload == "mixed") {
+    absl::BitGen gen;
+    const double read_ratio = GetFlag(FLAGS_read_ratio);
+    uint64_t next_insert = num;
+    base::Histogram write_hist;
+
+    for (uint64_t i = 0; i < num; ++i) {
+      double dice = absl::Uniform(gen, 0.0, 1.0);
+      uint64_t key = absl::Uniform<uint64_t>(gen, 0, next_insert);
+      if (dice < read_ratio) {
+        OpTimer timer{&hist};
+        found += impl->Find(key);
+        timer.Stop();
+      } else if (dice < (1 + read_ratio) / 2 && next_insert < num * 2) {
+        OpTimer timer{&write_hist};
+        impl->Insert(next_insert++);
+        timer.Stop();
+      } else {
+        OpTimer timer{&write_hist};
+        impl->Erase(key);
+        timer.Stop();
+      }
+    }
+
+    PrintResult(impl_name, workload, num, start, hist);
+    if (GetFlag(FLAGS_hist)) {
+      CONSOLE_INFO << "mixed write latency histogram (ns):\n" << write_hist.ToString();
+    }
+    CONSOLE_INFO << "lookups found: " << found << ", items: " << impl->Size();
+  } else if (workload == "traverse") {
+    size_t visited = impl->Traverse();
+    uint64_t delta = absl::GetCurrentTimeNanos() - start;
+    CONSOLE_INFO << impl_name << " " << workload << ": " << visited << " items, "
+                 << double(delta) / max<uint64_t>(visited, 1) << " ns/item";
+  } else {
+    return false;
+  }
+
+  string stats = impl->Stats();
+  if (!stats.empty()) {
+    CONSOLE_INFO << workload << " stats: " << stats;
+  }
+
+  return true;
+}
+
+}  // namespace
+
 }  // namespace dfly
 
 using namespace dfly;
 int main(int argc, char* argv[]) {
   MainInitGuard guard(&argc, &argv);
 
-  init_zmalloc_threadlocal(mi_heap_get_backing());
+  mi_heap_t* heap = mi_heap_get_backing();
+  init_zmalloc_threadlocal(heap);
+  SmallString::InitThreadLocal(heap);
 
-  bool is_dash = GetFlag(FLAGS_dash);
-  bool is_sds = GetFlag(FLAGS_sds);
-  uint64_t start = absl::GetCurrentTimeNanos();
-  if (is_dash) {
-    if (is_sds) {
-      BenchDashSds(start);
-    } else {
-      BenchDash(start);
+  uint64_t num = GetFlag(FLAGS_n);
+  InitStrKeys(num * 2);
+
+  vector<string> workloads = absl::StrSplit(GetFlag(FLAGS_workload), ',', absl::SkipEmpty());
+  vector<string> impls = absl::StrSplit(GetFlag(FLAGS_impl), ',', absl::SkipEmpty());
+
+  for (const string& impl_name : impls) {
+    unique_ptr<Impl> impl = CreateImpl(impl_name);
+    if (!impl) {
+      CONSOLE_INFO << "Unknown implementation " << impl_name;
+      return 1;
     }
-  } else {
-    if (is_sds) {
-      BenchDictSds(start);
-    } else {
-      BenchDict(start);
+
+    CONSOLE_INFO << "-------- " << impl_name << " --------";
+    uint64_t start = absl::GetCurrentTimeNanos();
+
+    for (const string& workload : workloads) {
+      if (!RunWorkload(impl_name, workload, impl.get())) {
+        CONSOLE_INFO << "Unknown workload " << workload;
+        return 1;
+      }
     }
+
+    uint64_t delta = (absl::GetCurrentTimeNanos() - start) / 1000000;
+    CONSOLE_INFO << impl_name << " took " << delta << " ms";
   }
-  CONSOLE_INFO << "latencies histogram (usec):\n" << hist.ToString();
-  uint64_t delta = (absl::GetCurrentTimeNanos() - start) / 1000000;
-  CONSOLE_INFO << "Took " << delta << " ms";
 
   return 0;
 }
@@ -17,6 +17,9 @@
 #include "base/sse2neon.h"
 #else
 #include <emmintrin.h>
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+#include <immintrin.h>
+#endif
 #endif
 
 namespace dfly {
@@ -222,6 +225,10 @@ template <unsigned NUM_SLOTS, unsigned NUM_STASH_FPS> class BucketBase {
 
  protected:
   uint32_t CompareFP(uint8_t fp) const;
+
+  // Returns the mask of stash fingerprints that are equal to fp, kStashFpLen bits are used.
+  // Does not take busy or probe bits into account.
+  uint32_t CompareStashFP(uint8_t fp) const;
   bool ShiftRight();
 
   // Returns true if stash_pos was stored, false overwise
@@ -404,6 +411,11 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename HashFn> void Split(HashFn&& hfunc, Segment* dest);
 
+  // The reverse of Split: moves all the entries of src into this segment.
+  // hashes must hold the hashes of src entries in TraverseAll order.
+  // Requires: the insertion of all the entries must succeed, see DashTable::Merge.
+  void MoveFrom(const Hash_t* hashes, Segment* src);
+
   void Delete(const Iterator& it, Hash_t key_hash);
 
   void Clear();  // clears the segment.
@@ -439,6 +451,11 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   template <typename Cb, typename HashFn>
   bool TraverseLogicalBucket(uint8_t bid, HashFn&& hfun, Cb&& cb) const;
 
+  // The home bucket of key_hash.
+  static unsigned BucketIndex(Hash_t hash) {
+    return (hash >> kFingerBits) % kNumBuckets;
+  }
+
   // Cb  accepts (const Iterator&).
   template <typename Cb> void TraverseAll(Cb&& cb) const;
 
@@ -486,6 +503,20 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename U, typename Pred> Iterator FindIt(U&& key, Hash_t key_hash, Pred&& cf) const;
 
+  // Prefetches the home bucket of key_hash. Used to overlap cache misses of multiple lookups.
+  void Prefetch(Hash_t key_hash) const {
+    __builtin_prefetch(&bucket_[BucketIndex(key_hash)]);
+  }
+
+  // Prefetches the entries of bucket bid and the metadata of its neighbour, i.e. what
+  // TraverseLogicalBucket(bid) reads unless the bucket has stashed entries.
+  void PrefetchLogicalBucket(uint8_t bid) const {
+    const char* b = reinterpret_cast<const char*>(&bucket_[bid]);
+    for (size_t offs = 0; offs < sizeof(Bucket); offs += 64)
+      __builtin_prefetch(b + offs);
+    __builtin_prefetch(&bucket_[NextBid(bid)]);
+  }
+
   // Returns valid iterator if succeeded or invalid if not (it's full).
   // Requires: key should be not present in the segment.
   template <typename U, typename V> Iterator InsertUniq(U&& key, V&& value, Hash_t key_hash);
@@ -533,10 +564,6 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
  private:
   static_assert(sizeof(Iterator) == 2);
 
-  static unsigned BucketIndex(Hash_t hash) {
-    return (hash >> kFingerBits) % kNumBuckets;
-  }
-
   static uint8_t NextBid(uint8_t bid) {
     return bid < kNumBuckets - 1 ? bid + 1 : 0;
   }
@@ -883,14 +910,34 @@ uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareFP(uint8_t fp) const {
   // Loads 16 bytes of src into seg_data.
   __m128i seg_data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(finger_arr_.data()));
 
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+  // Compares and collapses the result into a bitmask in one instruction.
+  return _mm_cmpeq_epi8_mask(seg_data, key_data);
+#else
   // compare 16-byte vectors seg_data and key_data, dst[i] := ( a[i] == b[i] ) ? 0xFF : 0.
   __m128i rv_mask = _mm_cmpeq_epi8(seg_data, key_data);
 
   // collapses 16 msb bits from each byte in rv_mask into mask.
   int mask = _mm_movemask_epi8(rv_mask);
 
-  // Note: Last 2 operations can be combined in skylake with _mm_cmpeq_epi8_mask.
   return mask;
+#endif
+}
+
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareStashFP(uint8_t fp) const {
+  static_assert(StashFpArray{}.size() <= 4);
+
+  // Loads all stash fingerprints into the lower 32 bits of a vector register and
+  // compares them with a single instruction, similarly to CompareFP.
+  int32_t stash_fps = 0;
+  memcpy(&stash_fps, stash_arr_.data(), stash_arr_.size());
+
+  __m128i seg_data = _mm_cvtsi32_si128(stash_fps);
+  __m128i rv_mask = _mm_cmpeq_epi8(seg_data, _mm_set1_epi8(fp));
+
+  // Upper bytes are zeroed and may match fp == 0, hence we must mask them out.
+  return _mm_movemask_epi8(rv_mask) & ((1u << kStashFpLen) - 1);
 }
 
 // Bucket slot array goes from left to right: [x, x, ...]
@@ -913,18 +960,18 @@ template <typename F>
 auto BucketBase<NUM_SLOTS, NUM_OVR>::IterateStash(uint8_t fp, bool is_probe, F&& func) const
     -> ::std::pair<unsigned, SlotId> {
   unsigned om = is_probe ? stash_probe_mask_ : ~stash_probe_mask_;
-  unsigned ob = stash_busy_;
-
-  for (unsigned i = 0; i < kStashFpLen; ++i) {
-    if ((ob & 1) && (stash_arr_[i] == fp) && (om & 1)) {
-      unsigned pos = (stash_pos_ >> (i * 2)) & 3;
-      auto sid = func(i, pos);
-      if (sid != BucketBase::kNanSlot) {
-        return std::pair<unsigned, SlotId>(pos, sid);
-      }
+
+  // CompareStashFP returns only kStashFpLen bits, so kStashPresentBit is filtered out.
+  unsigned mask = CompareStashFP(fp) & stash_busy_ & om;
+
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    unsigned pos = (stash_pos_ >> (i * 2)) & 3;
+    auto sid = func(i, pos);
+    if (sid != BucketBase::kNanSlot) {
+      return std::pair<unsigned, SlotId>(pos, sid);
     }
-    ob >>= 1;
-    om >>= 1;
+    mask &= mask - 1;
   }
   return std::pair<unsigned, SlotId>(0, BucketBase::kNanSlot);
 }
@@ -965,17 +1012,15 @@ template <typename U, typename Pred>
 auto Segment<Key, Value, Policy>::Bucket::FindByFp(uint8_t fp_hash, bool probe, U&& k,
                                                    Pred&& pred) const -> SlotId {
   unsigned mask = this->Find(fp_hash, probe);
-  if (!mask)
-    return kNanSlot;
 
-  unsigned delta = __builtin_ctz(mask);
-  mask >>= delta;
-  for (unsigned i = delta; i < NUM_SLOTS; ++i) {
-    if ((mask & 1) && pred(key[i], k)) {
+  // Visit only the slots whose fingerprints matched, the full key comparison is expensive.
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    if (pred(key[i], k)) {
       return i;
     }
-    mask >>= 1;
-  };
+    mask &= mask - 1;
+  }
 
   return kNanSlot;
 }
@@ -1234,6 +1279,28 @@ void Segment<Key, Value, Policy>::Split(HFunc&& hfn, Segment* dest_right) {
   }
 }
 
+template <typename Key, typename Value, typename Policy>
+void Segment<Key, Value, Policy>::MoveFrom(const Hash_t* hashes, Segment* src) {
+  size_t index = 0;
+
+  src->TraverseAll([&](const Iterator& src_it) {
+    auto it = InsertUniq(std::forward<Key_t>(src->Key(src_it.index, src_it.slot)),
+                         std::forward<Value_t>(src->Value(src_it.index, src_it.slot)),
+                         hashes[index++]);
+    assert(it.found());
+
+    if constexpr (USE_VERSION) {
+      // We never decrease the version of the entry.
+      uint64_t ver = src->bucket_[src_it.index].GetVersion();
+      if (bucket_[it.index].GetVersion() < ver) {
+        bucket_[it.index].SetVersion(ver);
+      }
+    }
+  });
+
+  src->Clear();
+}
+
 template <typename Key, typename Value, typename Policy>
 int Segment<Key, Value, Policy>::MoveToOther(bool own_items, unsigned from_bid, unsigned to_bid) {
   auto& src = bucket_[from_bid];
@@ -16,6 +16,7 @@
 #include "base/hash.h"
 #include "base/logging.h"
 #include "base/zipf_gen.h"
+#include "core/huge_page_resource.h"
 
 extern "C" {
 #include "redis/dict.h"
@@ -395,6 +396,28 @@ TEST_F(DashTest, InsertOOM) {
       bad_alloc);
 }
 
+TEST_F(DashTest, HugePageSegments) {
+  HugePageResource resource(HugePageResource::THP, {Dash64::kSegBytes},
+                            pmr::get_default_resource());
+  {
+    Dash64 dt{1, UInt64Policy{}, &resource};
+    for (uint64_t i = 0; i < 100000; ++i) {
+      dt.Insert(i, i);
+    }
+
+    for (uint64_t i = 0; i < 100000; ++i) {
+      auto it = dt.Find(i);
+      ASSERT_TRUE(it != dt.end());
+      ASSERT_EQ(i, it->second);
+    }
+
+    // The directory is allocated from the upstream resource.
+    EXPECT_EQ(dt.unique_segments() * ((Dash64::kSegBytes + 63) / 64 * 64), resource.used());
+    EXPECT_GE(resource.reserved(), resource.used());
+  }
+  EXPECT_EQ(0u, resource.used());
+}
+
 struct Item {
   char buf[24];
 };
@@ -432,6 +455,14 @@ TEST_F(DashTest, Reserve) {
     dt_.Reserve(i);
     ASSERT_GE((1 << dt_.depth()) * Dash64::kSegCapacity, i);
   }
+
+  // The reserved segments are allocated, so the inserts do not split them.
+  size_t segments = dt_.unique_segments();
+  EXPECT_EQ(1u << dt_.depth(), segments);
+  for (unsigned i = 0; i < bc / 2; ++i) {
+    dt_.Insert(i, i);
+  }
+  EXPECT_EQ(segments, dt_.unique_segments());
 }
 
 TEST_F(DashTest, Insert) {
@@ -473,6 +504,115 @@ TEST_F(DashTest, Insert) {
   ASSERT_TRUE(dt_.Find(some_val).is_done());
 }
 
+TEST_F(DashTest, FindBatch) {
+  constexpr size_t kNumItems = 1000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+
+  // Keys above kNumItems are missing, the batch size is not a multiple of kFindBatchSize.
+  vector<uint64_t> keys;
+  for (size_t i = 0; i < 2 * kNumItems + 7; ++i) {
+    keys.push_back(i);
+  }
+
+  vector<Dash64::iterator> res(keys.size());
+  dt_.FindBatch(keys, res.data());
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (i < kNumItems) {
+      ASSERT_FALSE(res[i].is_done()) << i;
+      EXPECT_EQ(i, res[i]->second);
+    } else {
+      EXPECT_TRUE(res[i].is_done()) << i;
+    }
+  }
+}
+
+TEST_F(DashTest, Merge) {
+  constexpr size_t kNumItems = 100000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  unsigned max_depth = dt_.depth();
+  size_t max_segments = dt_.unique_segments();
+
+  // Start the traversal before the merge and finish it afterwards.
+  Dash64::cursor cursor;
+  vector<bool> seen(kNumItems);
+  auto tr_cb = [&](Dash64::iterator it) { seen[it->first] = true; };
+  for (unsigned i = 0; i < Dash64::kLogicalBucketNum * max_segments / 3; ++i) {
+    cursor = dt_.Traverse(cursor, tr_cb);
+  }
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    if (i % 64)
+      dt_.Erase(i);
+  }
+
+  // Every pass over the directory merges each buddy pair at most once.
+  size_t prev_segments;
+  do {
+    prev_segments = dt_.unique_segments();
+    uint32_t seg_id = 0;
+    do {
+      seg_id = dt_.MergeStep(seg_id);
+    } while (seg_id);
+  } while (dt_.unique_segments() < prev_segments);
+
+  EXPECT_LT(dt_.depth(), max_depth);
+  EXPECT_LT(dt_.unique_segments(), max_segments / 16);
+  EXPECT_EQ(kNumItems / 64 + 1, dt_.size());
+
+  do {
+    cursor = dt_.Traverse(cursor, tr_cb);
+  } while (cursor);
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    auto it = dt_.Find(i);
+    if (i % 64) {
+      ASSERT_TRUE(it.is_done()) << i;
+    } else {
+      ASSERT_FALSE(it.is_done()) << i;
+      ASSERT_EQ(i, it->second);
+      ASSERT_TRUE(seen[i]) << i;
+    }
+  }
+
+  // The table grows back as usual.
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  EXPECT_EQ(kNumItems, dt_.size());
+}
+
+TEST_F(DashTest, ClearStep) {
+  constexpr size_t kNumItems = 10000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  size_t segments = dt_.unique_segments();
+
+  uint32_t seg_id = dt_.ClearStep(0);
+  EXPECT_GT(dt_.size(), 0u);
+  EXPECT_LT(dt_.size(), kNumItems);
+
+  unsigned steps = 1;
+  while (seg_id) {
+    seg_id = dt_.ClearStep(seg_id);
+    ++steps;
+  }
+
+  EXPECT_EQ(segments, steps);
+  EXPECT_EQ(0u, dt_.size());
+  EXPECT_TRUE(dt_.begin().is_done());
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  EXPECT_EQ(kNumItems, dt_.size());
+}
+
 TEST_F(DashTest, Traverse) {
   constexpr auto kNumItems = 50;
   for (size_t i = 0; i < kNumItems; ++i) {
@@ -496,6 +636,64 @@ TEST_F(DashTest, Traverse) {
   EXPECT_EQ(kNumItems - 1, nums.back());
 }
 
+TEST_F(DashTest, TraversePrefetch) {
+  constexpr auto kNumItems = 5000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+
+  Dash64::cursor cursor;
+  vector<uint64_t> prefetched, visited, nums;
+  do {
+    prefetched.clear();
+    visited.clear();
+
+    // All the entries of the step are prefetched before the first of them is visited.
+    cursor = dt_.TraversePrefetch(
+        cursor,
+        [&](Dash64::iterator it) {
+          ASSERT_TRUE(visited.empty());
+          prefetched.push_back(it->first);
+        },
+        [&](Dash64::iterator it) { visited.push_back(it->first); });
+
+    ASSERT_EQ(prefetched, visited);
+    nums.insert(nums.end(), visited.begin(), visited.end());
+  } while (cursor);
+
+  sort(nums.begin(), nums.end());
+  nums.resize(unique(nums.begin(), nums.end()) - nums.begin());
+  ASSERT_EQ(kNumItems, nums.size());
+}
+
+TEST_F(DashTest, TraverseHashBucket) {
+  constexpr auto kNumItems = 5000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    bool found = false;
+    dt_.TraverseHashBucket(UInt64Policy::HashFn(i), [&](Dash64::iterator it) {
+      found |= (it->first == i);
+    });
+    ASSERT_TRUE(found) << i;
+  }
+
+  // Erase the even keys by traversing the buckets of their hashes.
+  for (size_t i = 0; i < kNumItems; i += 2) {
+    dt_.TraverseHashBucket(UInt64Policy::HashFn(i), [&](Dash64::iterator it) {
+      if (it->first % 2 == 0)
+        dt_.Erase(it);
+    });
+  }
+
+  ASSERT_EQ(kNumItems / 2, dt_.size());
+  for (size_t i = 0; i < kNumItems; ++i) {
+    EXPECT_EQ(i % 2 == 1, dt_.Find(i) != dt_.end()) << i;
+  }
+}
+
 TEST_F(DashTest, Bucket) {
   constexpr auto kNumItems = 250;
   for (size_t i = 0; i < kNumItems; ++i) {
@@ -0,0 +1,93 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/btree_map.h>
+
+#include <memory_resource>
+#include <vector>
+
+namespace dfly {
+
+// Bucketed index of deadlines. Groups 64-bit payloads (key hashes for example) by the time
+// bucket of their deadline, so that the due ones can be fetched without looking at the rest.
+// Buckets span 2^resolution_log ms and a bucket becomes due once its end has passed,
+// therefore payloads are popped at most 2^resolution_log ms late.
+// Payloads are not deduplicated and can not be removed before they are due, the consumers
+// must tolerate stale ones.
+class DeadlineIndex {
+  using Bucket = std::pmr::vector<uint64_t>;
+  using BucketMap = absl::btree_map<uint64_t, Bucket, std::less<uint64_t>,
+                                    std::pmr::polymorphic_allocator<std::pair<const uint64_t, Bucket>>>;
+
+ public:
+  DeadlineIndex(unsigned resolution_log, std::pmr::memory_resource* mr)
+      : buckets_(mr), resolution_log_(resolution_log) {
+  }
+
+  void Add(uint64_t deadline_ms, uint64_t payload) {
+    buckets_[deadline_ms >> resolution_log_].push_back(payload);
+    ++size_;
+  }
+
+  // Pops up to limit payloads whose buckets are due at now_ms, the earliest buckets first,
+  // and calls cb(payload) for each one of them. cb may call Add.
+  // Returns number of popped payloads.
+  template <typename Cb> unsigned PopDue(uint64_t now_ms, unsigned limit, Cb&& cb);
+
+  // Returns the time at which the earliest bucket becomes due or UINT64_MAX if the index is empty.
+  uint64_t NextDue() const {
+    return buckets_.empty() ? UINT64_MAX : (buckets_.begin()->first + 1) << resolution_log_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t bucket_count() const {
+    return buckets_.size();
+  }
+
+  // Approximate, does not account for the capacity slack of the buckets.
+  size_t mem_usage() const {
+    return size_ * sizeof(uint64_t) + buckets_.size() * sizeof(BucketMap::value_type);
+  }
+
+  void Clear() {
+    buckets_.clear();
+    size_ = 0;
+  }
+
+ private:
+  BucketMap buckets_;
+  size_t size_ = 0;
+  unsigned resolution_log_;
+};
+
+template <typename Cb> unsigned DeadlineIndex::PopDue(uint64_t now_ms, unsigned limit, Cb&& cb) {
+  unsigned res = 0;
+
+  // We take one payload at a time and re-fetch the first bucket, because cb may add payloads
+  // to the index and thus invalidate the btree iterators.
+  while (res < limit && NextDue() <= now_ms) {
+    auto it = buckets_.begin();
+    uint64_t payload = it->second.back();
+    it->second.pop_back();
+    if (it->second.empty())
+      buckets_.erase(it);
+    --size_;
+    ++res;
+
+    cb(payload);
+  }
+
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,87 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/deadline_index.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class DeadlineIndexTest : public ::testing::Test {
+ protected:
+  DeadlineIndexTest() : index_(4, pmr::get_default_resource()) {
+  }
+
+  vector<uint64_t> PopDue(uint64_t now, unsigned limit = UINT32_MAX) {
+    vector<uint64_t> res;
+    index_.PopDue(now, limit, [&](uint64_t p) { res.push_back(p); });
+    sort(res.begin(), res.end());
+    return res;
+  }
+
+  DeadlineIndex index_;  // 16ms buckets.
+};
+
+TEST_F(DeadlineIndexTest, Basic) {
+  EXPECT_EQ(UINT64_MAX, index_.NextDue());
+  EXPECT_TRUE(PopDue(1000).empty());
+
+  index_.Add(100, 1);
+  index_.Add(105, 2);
+  index_.Add(130, 3);
+  index_.Add(100, 1);
+  EXPECT_EQ(4, index_.size());
+  EXPECT_EQ(2, index_.bucket_count());
+
+  // 100 and 105 share the bucket [96, 112).
+  EXPECT_EQ(112, index_.NextDue());
+  EXPECT_TRUE(PopDue(111).empty());
+  EXPECT_THAT(PopDue(112), testing::ElementsAre(1, 1, 2));
+  EXPECT_EQ(1, index_.size());
+
+  EXPECT_EQ(144, index_.NextDue());
+  EXPECT_THAT(PopDue(1000), testing::ElementsAre(3));
+  EXPECT_TRUE(index_.empty());
+  EXPECT_EQ(0, index_.bucket_count());
+}
+
+TEST_F(DeadlineIndexTest, Limit) {
+  for (uint64_t i = 0; i < 100; ++i) {
+    index_.Add(i * 10, i);
+  }
+
+  vector<uint64_t> all;
+  while (!index_.empty()) {
+    vector<uint64_t> vals = PopDue(2000, 7);
+    ASSERT_LE(vals.size(), 7);
+    ASSERT_FALSE(vals.empty());
+    all.insert(all.end(), vals.begin(), vals.end());
+  }
+
+  sort(all.begin(), all.end());
+  ASSERT_EQ(100, all.size());
+  for (uint64_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, all[i]);
+  }
+}
+
+TEST_F(DeadlineIndexTest, AddWhilePopping) {
+  index_.Add(10, 1);
+  index_.Add(20, 2);
+
+  // Reschedules every payload once into the future.
+  unsigned popped = index_.PopDue(100, 100, [&](uint64_t p) {
+    if (p < 10)
+      index_.Add(500, p + 10);
+  });
+
+  EXPECT_EQ(2, popped);
+  EXPECT_EQ(2, index_.size());
+  EXPECT_THAT(PopDue(1000), testing::ElementsAre(11, 12));
+}
+
+}  // namespace dfly
@@ -55,4 +55,16 @@ TEST_F(IntentLockTest, Basic) {
   ASSERT_TRUE(lk_.Check(IntentLock::EXCLUSIVE));
 }
 
+TEST_F(IntentLockTest, CheckOwned) {
+  ASSERT_TRUE(lk_.Acquire(IntentLock::EXCLUSIVE));
+  ASSERT_TRUE(lk_.CheckOwned(IntentLock::EXCLUSIVE));
+  ASSERT_FALSE(lk_.Acquire(IntentLock::SHARED));
+  ASSERT_FALSE(lk_.CheckOwned(IntentLock::EXCLUSIVE));
+
+  // The reader waits for the writer, and may run once the writer is gone.
+  ASSERT_FALSE(lk_.CheckOwned(IntentLock::SHARED));
+  lk_.Release(IntentLock::EXCLUSIVE);
+  ASSERT_TRUE(lk_.CheckOwned(IntentLock::SHARED));
+}
+
 }  // namespace dfly
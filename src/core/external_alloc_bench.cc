@@ -0,0 +1,358 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/random/random.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "core/external_alloc.h"
+#include "core/extent_tree.h"
+
+ABSL_FLAG(uint32_t, n, 2000000, "number of allocations in the trace");
+ABSL_FLAG(std::string, impl, "alloc,extent",
+          "comma separated list of implementations to replay the trace against: "
+          "alloc - ExternalAllocator, extent - ExtentTree::GetRange");
+ABSL_FLAG(std::string, sizes, "512:20,4096:30,16384:20,65536:15,262144:10,1048576:5",
+          "comma separated list of size:weight pairs. The sizes of a pair are distributed "
+          "uniformly between the size of the previous pair and its size");
+ABSL_FLAG(uint32_t, max_lifetime, 1000000,
+          "maximal lifetime of an item, in allocations. The lifetimes are Zipf distributed");
+ABSL_FLAG(double, lifetime_zipf, 1.1, "Zipf exponent of the lifetimes, must be above 1");
+ABSL_FLAG(double, permanent_ratio, 0.01,
+          "fraction of the items that are never freed during the trace and pin their pages");
+ABSL_FLAG(uint32_t, extent_align, 4096, "alignment of the ranges of the extent implementation");
+ABSL_FLAG(uint32_t, report_interval, 200000, "prints the stats every that many allocations");
+ABSL_FLAG(uint32_t, seed, 42, "seed of the trace, every implementation replays the same trace");
+
+namespace dfly {
+
+using namespace std;
+using absl::GetFlag;
+
+namespace {
+
+constexpr size_t kSegmentSize = ExternalAllocator::kExtAlignment;
+
+// ExternalAllocator::Free does not support the blocks of the LARGE class.
+constexpr size_t kMaxAllocSize = 1_MB;
+
+struct SizeClass {
+  size_t min_size;
+  size_t max_size;
+};
+
+// The state under test. Offsets are returned into the storage the implementation added itself.
+class Impl {
+ public:
+  virtual ~Impl() {
+  }
+
+  // Returns the offset of the allocated range. Adds storage if needed.
+  virtual size_t Malloc(size_t sz) = 0;
+  virtual void Free(size_t offset, size_t sz) = 0;
+
+  virtual size_t capacity() const = 0;
+
+  // Bytes reserved for the live items, including the rounding of their sizes.
+  virtual size_t allocated() const = 0;
+
+  // Implementation specific stats.
+  virtual string Stats() const {
+    return string{};
+  }
+};
+
+class AllocImpl final : public Impl {
+ public:
+  size_t Malloc(size_t sz) final {
+    int64_t res = alloc_.Malloc(sz);
+    while (res < 0) {
+      alloc_.AddStorage(alloc_.capacity(), -res);
+      ++grow_cnt_;
+      res = alloc_.Malloc(sz);
+    }
+    return res;
+  }
+
+  void Free(size_t offset, size_t sz) final {
+    alloc_.Free(offset, sz);
+  }
+
+  size_t capacity() const final {
+    return alloc_.capacity();
+  }
+
+  size_t allocated() const final {
+    return alloc_.allocated_bytes();
+  }
+
+  string Stats() const final {
+    return absl::StrCat("storage grew: ", grow_cnt_);
+  }
+
+ private:
+  ExternalAllocator alloc_;
+  uint64_t grow_cnt_ = 0;
+};
+
+// Allocates every item directly from the free ranges, like ExternalAllocator does for the large
+// blocks.
+class ExtentImpl final : public Impl {
+ public:
+  explicit ExtentImpl(size_t align) : align_(align) {
+  }
+
+  size_t Malloc(size_t sz) final {
+    size_t len = AlignUp(sz);
+    while (true) {
+      auto range = tree_.GetRange(len, align_);
+      if (range) {
+        allocated_ += len;
+        return range->first;
+      }
+
+      // The free bytes would suffice if they were contiguous.
+      if (capacity_ - allocated_ >= len)
+        ++frag_misses_;
+      tree_.Add(capacity_, kSegmentSize);
+      capacity_ += kSegmentSize;
+    }
+  }
+
+  void Free(size_t offset, size_t sz) final {
+    size_t len = AlignUp(sz);
+    tree_.Add(offset, len);
+    allocated_ -= len;
+  }
+
+  size_t capacity() const final {
+    return capacity_;
+  }
+
+  size_t allocated() const final {
+    return allocated_;
+  }
+
+  string Stats() const final {
+    return absl::StrCat("misses with enough free bytes: ", frag_misses_);
+  }
+
+ private:
+  size_t AlignUp(size_t sz) const {
+    return (sz + align_ - 1) & ~(align_ - 1);
+  }
+
+  ExtentTree tree_;
+  size_t align_;
+  size_t capacity_ = 0;
+  size_t allocated_ = 0;
+  uint64_t frag_misses_ = 0;
+};
+
+unique_ptr<Impl> CreateImpl(string_view name) {
+  if (name == "alloc")
+    return make_unique<AllocImpl>();
+  if (name == "extent") {
+    uint32_t align = GetFlag(FLAGS_extent_align);
+    CHECK(align && (align & (align - 1)) == 0) << "extent_align must be a power of 2";
+    return make_unique<ExtentImpl>(align);
+  }
+  return nullptr;
+}
+
+bool ParseSizes(string_view spec, vector<SizeClass>* classes, vector<double>* weights) {
+  size_t prev = 0;
+  for (string_view pair : absl::StrSplit(spec, ',', absl::SkipEmpty())) {
+    vector<string_view> parts = absl::StrSplit(pair, ':');
+    SizeClass sc;
+    double weight;
+    if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &sc.max_size) ||
+        !absl::SimpleAtod(parts[1], &weight) || sc.max_size <= prev || weight < 0) {
+      return false;
+    }
+    sc.min_size = prev + 1;
+    prev = sc.max_size;
+    classes->push_back(sc);
+    weights->push_back(weight);
+  }
+  return !classes->empty();
+}
+
+struct Item {
+  uint64_t death;  // the allocation number after which the item is freed.
+  size_t offset;
+  size_t size;
+
+  bool operator>(const Item& o) const {
+    return death > o.death;
+  }
+};
+
+// The trace is generated on the fly from the seed, so that it does not take memory, and is the
+// same for every implementation.
+class Replay {
+ public:
+  Replay(Impl* impl, const vector<SizeClass>& classes, const vector<double>& weights)
+      : impl_(impl), classes_(classes), class_dist_(weights.begin(), weights.end()),
+        gen_(GetFlag(FLAGS_seed)) {
+  }
+
+  void Run(string_view impl_name);
+
+ private:
+  size_t NextSize() {
+    const SizeClass& sc = classes_[class_dist_(gen_)];
+    return absl::Uniform<size_t>(absl::IntervalClosed, gen_, sc.min_size, sc.max_size);
+  }
+
+  void FreeDead(uint64_t now);
+  void Report(uint64_t allocs, uint64_t start, uint64_t interval_start, uint64_t interval_ops);
+
+  Impl* impl_;
+  const vector<SizeClass>& classes_;
+  std::discrete_distribution<size_t> class_dist_;
+  mt19937_64 gen_;
+
+  priority_queue<Item, vector<Item>, greater<Item>> live_;
+  vector<Item> permanent_;
+
+  uint64_t ops_ = 0;  // mallocs and frees.
+  size_t live_bytes_ = 0;
+  size_t peak_live_bytes_ = 0;
+};
+
+void Replay::FreeDead(uint64_t now) {
+  while (!live_.empty() && live_.top().death <= now) {
+    const Item& item = live_.top();
+    impl_->Free(item.offset, item.size);
+    live_bytes_ -= item.size;
+    ++ops_;
+    live_.pop();
+  }
+}
+
+void Replay::Report(uint64_t allocs, uint64_t start, uint64_t interval_start,
+                    uint64_t interval_ops) {
+  uint64_t now = absl::GetCurrentTimeNanos();
+  size_t capacity = impl_->capacity();
+  size_t allocated = impl_->allocated();
+
+  // Utilization is the fraction of the storage that holds the data. The rest is lost either to
+  // the rounding of the sizes (internal) or to the free space that is not reused (external).
+  double util = capacity ? double(live_bytes_) / capacity : 0;
+  double internal = allocated ? 1 - double(live_bytes_) / allocated : 0;
+  double external = capacity ? 1 - double(allocated) / capacity : 0;
+
+  CONSOLE_INFO << absl::StrCat(
+      allocs, " allocs, ", (now - start) / 1000000, " ms: ",
+      uint64_t(interval_ops * 1e9 / max<uint64_t>(now - interval_start, 1)), " ops/s, items ",
+      live_.size() + permanent_.size(), ", live MB ", live_bytes_ >> 20, ", capacity MB ",
+      capacity >> 20, ", utilization ", util, ", internal frag ", internal, ", external frag ",
+      external);
+}
+
+void Replay::Run(string_view impl_name) {
+  const uint64_t num = GetFlag(FLAGS_n);
+  const uint64_t max_lifetime = GetFlag(FLAGS_max_lifetime);
+  const double zipf = GetFlag(FLAGS_lifetime_zipf);
+  const double permanent_ratio = GetFlag(FLAGS_permanent_ratio);
+  const uint64_t interval = max<uint32_t>(GetFlag(FLAGS_report_interval), 1);
+
+  uint64_t start = absl::GetCurrentTimeNanos();
+  uint64_t interval_start = start;
+  uint64_t interval_base = 0;
+
+  for (uint64_t i = 0; i < num; ++i) {
+    FreeDead(i);
+
+    size_t sz = NextSize();
+    Item item{0, impl_->Malloc(sz), sz};
+    ++ops_;
+    live_bytes_ += sz;
+    peak_live_bytes_ = max(peak_live_bytes_, live_bytes_);
+
+    if (absl::Bernoulli(gen_, permanent_ratio)) {
+      permanent_.push_back(item);
+    } else {
+      // Most of the items die young, few live long.
+      item.death = i + 1 + absl::Zipf<uint64_t>(gen_, max_lifetime, zipf);
+      live_.push(item);
+    }
+
+    if ((i + 1) % interval == 0) {
+      Report(i + 1, start, interval_start, ops_ - interval_base);
+      interval_start = absl::GetCurrentTimeNanos();
+      interval_base = ops_;
+    }
+  }
+
+  uint64_t delta = absl::GetCurrentTimeNanos() - start;
+  CONSOLE_INFO << impl_name << ": " << ops_ << " ops, " << double(delta) / max<uint64_t>(ops_, 1)
+               << " ns/op, peak live MB " << (peak_live_bytes_ >> 20) << ", capacity MB "
+               << (impl_->capacity() >> 20) << ", peak utilization "
+               << double(peak_live_bytes_) / max<size_t>(impl_->capacity(), 1);
+
+  string stats = impl_->Stats();
+  if (!stats.empty()) {
+    CONSOLE_INFO << impl_name << " stats: " << stats;
+  }
+
+  // Dropping all the items must return all the bytes.
+  FreeDead(UINT64_MAX);
+  for (const Item& item : permanent_) {
+    impl_->Free(item.offset, item.size);
+  }
+  permanent_.clear();
+  CHECK_EQ(0u, impl_->allocated());
+}
+
+}  // namespace
+
+}  // namespace dfly
+
+using namespace dfly;
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  vector<SizeClass> classes;
+  vector<double> weights;
+  if (!ParseSizes(GetFlag(FLAGS_sizes), &classes, &weights)) {
+    CONSOLE_INFO << "Invalid sizes " << GetFlag(FLAGS_sizes);
+    return 1;
+  }
+
+  if (GetFlag(FLAGS_lifetime_zipf) <= 1) {
+    CONSOLE_INFO << "lifetime_zipf must be above 1";
+    return 1;
+  }
+
+  vector<string> impls = absl::StrSplit(GetFlag(FLAGS_impl), ',', absl::SkipEmpty());
+  for (const string& impl_name : impls) {
+    unique_ptr<Impl> impl = CreateImpl(impl_name);
+    if (!impl) {
+      CONSOLE_INFO << "Unknown implementation " << impl_name;
+      return 1;
+    }
+
+    if (impl_name == "alloc" && classes.back().max_size > kMaxAllocSize) {
+      CONSOLE_INFO << "alloc supports sizes up to " << kMaxAllocSize;
+      return 1;
+    }
+
+    CONSOLE_INFO << "-------- " << impl_name << " --------";
+    Replay replay(impl.get(), classes, weights);
+    replay.Run(impl_name);
+  }
+
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846264338327950288;
+constexpr char kBase32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+inline double DegToRad(double deg) {
+  return deg * (kPi / 180.0);
+}
+
+inline double RadToDeg(double rad) {
+  return rad / (kPi / 180.0);
+}
+
+// Spreads the bits of v into the even bits of the result.
+uint64_t Spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+// The inverse of Spread, which drops the odd bits of x.
+uint32_t Squash(uint64_t x) {
+  x &= 0x5555555555555555ULL;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return x;
+}
+
+inline uint64_t Interleave(uint32_t lon_cell, uint32_t lat_cell) {
+  return Spread(lat_cell) | (Spread(lon_cell) << 1);
+}
+
+// Returns the cell of v in the grid of 2^step cells over [min, max]. Scaling by a power of two
+// is exact, so the cell of a coarser step is the prefix of the cell of a finer one.
+uint32_t CellOf(double v, double min, double max, unsigned step) {
+  double offset = (v - min) / (max - min) * double(1ULL << step);
+  double last = double((1ULL << step) - 1);
+  if (offset <= 0)
+    return 0;
+  return offset >= last ? uint32_t(last) : uint32_t(offset);
+}
+
+// Returns the center of the cell of the grid of 2^step cells over [min, max], like redis does.
+double CenterOf(uint32_t cell, double min, double max, unsigned step) {
+  double cells = double(1ULL << step);
+  double lo = min + (cell / cells) * (max - min);
+  double hi = min + ((cell + 1) / cells) * (max - min);
+  return std::clamp((lo + hi) / 2, min, max);
+}
+
+}  // namespace
+
+bool GeoHash::IsValid(const GeoPoint& p) {
+  return p.lon >= kLonMin && p.lon <= kLonMax && p.lat >= kLatMin && p.lat <= kLatMax;
+}
+
+uint64_t GeoHash::Encode(const GeoPoint& p) {
+  return Interleave(CellOf(p.lon, kLonMin, kLonMax, kMaxStep),
+                    CellOf(p.lat, kLatMin, kLatMax, kMaxStep));
+}
+
+GeoPoint GeoHash::Decode(uint64_t hash) {
+  GeoPoint res;
+  res.lon = CenterOf(Squash(hash >> 1), kLonMin, kLonMax, kMaxStep);
+  res.lat = CenterOf(Squash(hash), kLatMin, kLatMax, kMaxStep);
+  return res;
+}
+
+string GeoHash::ToBase32(uint64_t hash) {
+  GeoPoint p = Decode(hash);
+  uint64_t bits =
+      Interleave(CellOf(p.lon, -180, 180, kMaxStep), CellOf(p.lat, -90, 90, kMaxStep));
+
+  // 11 characters hold 55 bits, the last one is padded with zeroes.
+  string res(11, '0');
+  for (unsigned i = 0; i < 10; ++i) {
+    res[i] = kBase32[(bits >> (kMaxStep * 2 - (i + 1) * 5)) & 0x1f];
+  }
+  return res;
+}
+
+double GeoHash::Distance(const GeoPoint& a, const GeoPoint& b) {
+  double lat1 = DegToRad(a.lat), lat2 = DegToRad(b.lat);
+  double v = sin((DegToRad(b.lon) - DegToRad(a.lon)) / 2);
+
+  // The points on the same meridian need no trigonometry.
+  if (v == 0.0)
+    return LatDistance(a.lat, b.lat);
+
+  double u = sin((lat2 - lat1) / 2);
+  double h = u * u + cos(lat1) * cos(lat2) * v * v;
+  return 2.0 * kEarthRadius * asin(sqrt(h));
+}
+
+double GeoHash::LatDistance(double lat1, double lat2) {
+  return kEarthRadius * fabs(DegToRad(lat2) - DegToRad(lat1));
+}
+
+vector<GeoHash::Range> GeoHash::CoverBox(const GeoPoint& center, double width, double height) {
+  double lat_delta = RadToDeg(height / 2 / kEarthRadius);
+  double lat_lo = max(center.lat - lat_delta, kLatMin);
+  double lat_hi = min(center.lat + lat_delta, kLatMax);
+
+  // The degrees of longitude are the shortest at the edge of the box that is closer to the pole,
+  // so the width is measured there. A box that crosses the antimeridian has two ranges.
+  double edge = max(fabs(center.lat - lat_delta), fabs(center.lat + lat_delta));
+  double lon_delta = edge < 90 ? RadToDeg(width / 2 / kEarthRadius / cos(DegToRad(edge))) : 360;
+
+  vector<pair<double, double>> lons;
+  if (lon_delta >= 180) {
+    lons.emplace_back(kLonMin, kLonMax);
+  } else {
+    double lo = center.lon - lon_delta, hi = center.lon + lon_delta;
+    if (lo < kLonMin) {
+      lons.emplace_back(kLonMin, hi);
+      lons.emplace_back(lo + 360, kLonMax);
+    } else if (hi > kLonMax) {
+      lons.emplace_back(lo, kLonMax);
+      lons.emplace_back(kLonMin, hi - 360);
+    } else {
+      lons.emplace_back(lo, hi);
+    }
+  }
+
+  // The finest grid that covers the box with at most 9 cells.
+  unsigned step = kMaxStep;
+  for (; step > 1; --step) {
+    uint64_t lat_cells =
+        CellOf(lat_hi, kLatMin, kLatMax, step) - CellOf(lat_lo, kLatMin, kLatMax, step) + 1;
+    uint64_t lon_cells = 0;
+    for (const auto& [lo, hi] : lons) {
+      lon_cells +=
+          CellOf(hi, kLonMin, kLonMax, step) - CellOf(lo, kLonMin, kLonMax, step) + 1;
+    }
+    if (lat_cells * lon_cells <= 9)
+      break;
+  }
+
+  vector<Range> cells;
+  unsigned shift = 2 * (kMaxStep - step);
+  uint32_t lat_end = CellOf(lat_hi, kLatMin, kLatMax, step);
+  for (uint32_t lat = CellOf(lat_lo, kLatMin, kLatMax, step); lat <= lat_end; ++lat) {
+    for (const auto& [lo, hi] : lons) {
+      uint32_t lon_end = CellOf(hi, kLonMin, kLonMax, step);
+      for (uint32_t lon = CellOf(lo, kLonMin, kLonMax, step); lon <= lon_end; ++lon) {
+        uint64_t hash = Interleave(lon, lat);
+        cells.push_back(Range{hash << shift, (hash + 1) << shift});
+      }
+    }
+  }
+
+  // The adjacent cells are scanned as a single range.
+  sort(cells.begin(), cells.end(), [](const Range& a, const Range& b) { return a.min < b.min; });
+  vector<Range> res;
+  for (const Range& cell : cells) {
+    if (!res.empty() && cell.min <= res.back().max) {
+      res.back().max = max(res.back().max, cell.max);
+    } else {
+      res.push_back(cell);
+    }
+  }
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,59 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dfly {
+
+struct GeoPoint {
+  double lon;
+  double lat;
+};
+
+// The geohashes of the GEO commands, which are the scores of the members of their sorted sets.
+// A geohash interleaves the 26-bit offsets of the longitude and of the latitude of a point into
+// 52 bits, the longitude bit being the higher one of each pair. Its 2 * step highest bits are a
+// cell of the grid of 2^step by 2^step cells, so the points of a cell are a range of scores.
+// Like redis, the latitudes are limited to those of the web mercator projection.
+class GeoHash {
+ public:
+  static constexpr double kLonMin = -180, kLonMax = 180;
+  static constexpr double kLatMin = -85.05112878, kLatMax = 85.05112878;
+  static constexpr unsigned kMaxStep = 26;
+  static constexpr double kEarthRadius = 6372797.560856;  // in meters, as in redis.
+
+  // A half-open range of geohashes.
+  struct Range {
+    uint64_t min;
+    uint64_t max;
+  };
+
+  static bool IsValid(const GeoPoint& p);
+
+  // Requires: IsValid(p).
+  static uint64_t Encode(const GeoPoint& p);
+
+  // Returns the center of the cell of the geohash.
+  static GeoPoint Decode(uint64_t hash);
+
+  // Returns the standard 11-character geohash of the point of hash, which places it within the
+  // latitudes [-90, 90] rather than those of the mercator projection.
+  static std::string ToBase32(uint64_t hash);
+
+  // The haversine distance between a and b in meters.
+  static double Distance(const GeoPoint& a, const GeoPoint& b);
+
+  // The distance along the meridian between the latitudes, in meters.
+  static double LatDistance(double lat1, double lat2);
+
+  // Returns the sorted disjoint ranges of the cells that cover the box of width by height meters
+  // around center, at least 1 and at most 9 cells of the finest grid that allows that.
+  static std::vector<Range> CoverBox(const GeoPoint& center, double width, double height);
+};
+
+}  // namespace dfly
@@ -0,0 +1,73 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class GeoHashTest : public ::testing::Test {
+ protected:
+  static bool Covers(const vector<GeoHash::Range>& ranges, uint64_t hash) {
+    for (const auto& r : ranges) {
+      if (hash >= r.min && hash < r.max)
+        return true;
+    }
+    return false;
+  }
+};
+
+TEST_F(GeoHashTest, EncodeDecode) {
+  GeoPoint palermo{13.361389, 38.115556}, catania{15.087269, 37.502669};
+
+  // The scores and the hashes of redis.
+  uint64_t ph = GeoHash::Encode(palermo), ch = GeoHash::Encode(catania);
+  EXPECT_EQ(3479099956230698u, ph);
+  EXPECT_EQ(3479447370796909u, ch);
+  EXPECT_EQ("sqc8b49rny0", GeoHash::ToBase32(ph));
+  EXPECT_EQ("sqdtr74hyu0", GeoHash::ToBase32(ch));
+
+  GeoPoint p = GeoHash::Decode(ph);
+  EXPECT_NEAR(palermo.lon, p.lon, 1e-5);
+  EXPECT_NEAR(palermo.lat, p.lat, 1e-5);
+  EXPECT_NEAR(166274.1516, GeoHash::Distance(p, GeoHash::Decode(ch)), 1e-4);
+
+  EXPECT_FALSE(GeoHash::IsValid(GeoPoint{181, 0}));
+  EXPECT_FALSE(GeoHash::IsValid(GeoPoint{0, 86}));
+  EXPECT_LT(GeoHash::Encode(GeoPoint{180, GeoHash::kLatMax}), 1ULL << 52);
+}
+
+TEST_F(GeoHashTest, CoverBox) {
+  default_random_engine rand(7);
+  uniform_real_distribution<double> lon(-180, 180), lat(-85, 85), offset(-1, 1);
+
+  for (unsigned i = 0; i < 500; ++i) {
+    GeoPoint center{lon(rand), lat(rand)};
+    double radius = 1e6 * (i % 10 + 1) / (1 << (i % 20));
+    vector<GeoHash::Range> ranges = GeoHash::CoverBox(center, radius * 2, radius * 2);
+    ASSERT_FALSE(ranges.empty());
+    ASSERT_LE(ranges.size(), 9u);
+
+    // The points within the radius are in the ranges, also across the antimeridian.
+    double delta = radius / 111000 * 2;
+    for (unsigned j = 0; j < 100; ++j) {
+      GeoPoint p{center.lon + offset(rand) * delta, center.lat + offset(rand) * delta};
+      p.lon += p.lon > 180 ? -360 : (p.lon < -180 ? 360 : 0);
+      if (!GeoHash::IsValid(p))
+        continue;
+      uint64_t hash = GeoHash::Encode(p);
+      if (GeoHash::Distance(center, GeoHash::Decode(hash)) <= radius) {
+        ASSERT_TRUE(Covers(ranges, hash)) << center.lon << "," << center.lat << " " << radius;
+      }
+    }
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,61 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/heap_stats.h"
+
+#include <absl/container/btree_map.h>
+
+namespace dfly {
+using namespace std;
+
+namespace {
+
+struct VisitState {
+  HeapStats* stats;
+  absl::btree_map<size_t, HeapStats::SizeClass> classes;
+};
+
+bool VisitArea(const mi_heap_t* heap, const mi_heap_area_t* area, void* block,
+               size_t block_size, void* arg) {
+  VisitState* state = reinterpret_cast<VisitState*>(arg);
+  HeapStats* stats = state->stats;
+
+  // mimalloc exports used in blocks instead of bytes.
+  size_t used = area->used * block_size;
+  stats->used += used;
+  stats->committed += area->committed;
+  ++stats->pages;
+
+  if (block_size > HeapStats::kLargeBlockSize) {
+    stats->large_objects += area->used;
+    stats->large_bytes += used;
+    return true;
+  }
+
+  HeapStats::SizeClass& sc = state->classes[block_size];
+  sc.block_size = block_size;
+  ++sc.pages;
+  sc.used += used;
+  sc.committed += area->committed;
+
+  return true;  // continue iteration
+}
+
+}  // namespace
+
+HeapStats HeapStats::Collect(const mi_heap_t* heap) {
+  HeapStats res;
+  VisitState state{&res, {}};
+
+  mi_heap_visit_blocks(heap, false /* visit only areas */, &VisitArea, &state);
+
+  res.size_classes.reserve(state.classes.size());
+  for (const auto& k_v : state.classes) {
+    res.size_classes.push_back(k_v.second);
+  }
+
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,39 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <mimalloc.h>
+
+#include <vector>
+
+namespace dfly {
+
+// Breakdown of the pages of a mimalloc heap by their block sizes. Unlike the mimalloc stats,
+// it is collected per heap, hence it shows how well each shard heap utilizes its pages.
+struct HeapStats {
+  // mimalloc allocates blocks above this size in pages of their own.
+  static constexpr size_t kLargeBlockSize = 128 << 10;
+
+  struct SizeClass {
+    size_t block_size = 0;
+    size_t pages = 0;
+    size_t used = 0;       // by the allocated blocks.
+    size_t committed = 0;  // by the pages.
+  };
+
+  size_t committed = 0;
+  size_t used = 0;
+  size_t pages = 0;
+  size_t large_objects = 0;
+  size_t large_bytes = 0;
+
+  std::vector<SizeClass> size_classes;  // sorted by block size, without the large objects.
+
+  // Visits the pages, not the blocks, of the heap, hence takes time proportional to the number
+  // of its pages.
+  static HeapStats Collect(const mi_heap_t* heap);
+};
+
+}  // namespace dfly
@@ -0,0 +1,66 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/heap_stats.h"
+
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+class HeapStatsTest : public ::testing::Test {
+ protected:
+  void SetUp() final {
+    heap_ = mi_heap_new();
+  }
+
+  void TearDown() final {
+    mi_heap_destroy(heap_);
+  }
+
+  mi_heap_t* heap_;
+};
+
+TEST_F(HeapStatsTest, SizeClasses) {
+  HeapStats stats = HeapStats::Collect(heap_);
+  EXPECT_EQ(0u, stats.pages);
+  EXPECT_EQ(0u, stats.used);
+
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    mi_heap_malloc(heap_, 64);
+    mi_heap_malloc(heap_, 1000);
+  }
+  void* large = mi_heap_malloc(heap_, 1 << 20);
+
+  stats = HeapStats::Collect(heap_);
+  EXPECT_GE(stats.committed, stats.used);
+  EXPECT_EQ(1u, stats.large_objects);
+  EXPECT_GE(stats.large_bytes, 1u << 20);
+
+  ASSERT_GE(stats.size_classes.size(), 2u);
+  size_t sum = stats.large_bytes;
+  for (size_t i = 0; i < stats.size_classes.size(); ++i) {
+    const HeapStats::SizeClass& sc = stats.size_classes[i];
+    if (i > 0) {
+      EXPECT_LT(stats.size_classes[i - 1].block_size, sc.block_size);
+    }
+    EXPECT_GT(sc.pages, 0u);
+    sum += sc.used;
+  }
+  EXPECT_EQ(sum, stats.used);
+
+  EXPECT_EQ(64u, stats.size_classes.front().block_size);
+  EXPECT_EQ(64u * kNum, stats.size_classes.front().used);
+
+  mi_free(large);
+  mi_heap_collect(heap_, true);
+  stats = HeapStats::Collect(heap_);
+  EXPECT_EQ(0u, stats.large_objects);
+}
+
+}  // namespace dfly
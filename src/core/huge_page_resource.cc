@@ -0,0 +1,164 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/huge_page_resource.h"
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+namespace {
+
+// Blocks are aligned by cache line.
+constexpr size_t kBlockAlign = 64;
+constexpr size_t k2MB = 1ULL << 21;
+constexpr size_t k1GB = 1ULL << 30;
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+inline size_t AlignUp(size_t sz, size_t align) {
+  return (sz + align - 1) & ~(align - 1);
+}
+
+size_t ArenaSize(HugePageResource::PageMode mode) {
+  return mode == HugePageResource::HUGE_1GB ? k1GB : k2MB;
+}
+
+// Maps a 2MB aligned region so that THP could back it entirely.
+void* MapTHP(size_t size) {
+  void* ptr = mmap(nullptr, size + k2MB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  uintptr_t start = uintptr_t(ptr);
+  uintptr_t aligned = AlignUp(start, k2MB);
+  if (aligned > start)
+    munmap(ptr, aligned - start);
+
+  size_t tail = k2MB - (aligned - start);
+  if (tail)
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+
+  ptr = reinterpret_cast<void*>(aligned);
+  if (madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "madvise(MADV_HUGEPAGE) failed: " << strerror(errno);
+  }
+
+  return ptr;
+}
+
+}  // namespace
+
+HugePageResource::HugePageResource(PageMode mode, initializer_list<size_t> block_sizes,
+                                   pmr::memory_resource* upstream)
+    : mode_(mode), upstream_(upstream) {
+  for (size_t sz : block_sizes) {
+    CHECK_GE(sz, sizeof(void*));
+    CHECK_LE(sz, k2MB);
+
+    if (!FindList(sz))
+      free_lists_.push_back(FreeList{sz, AlignUp(sz, kBlockAlign)});
+  }
+}
+
+HugePageResource::~HugePageResource() {
+  LOG_IF(DFATAL, used_) << "Destroying resource with " << used_ << " used bytes";
+
+  for (const auto& [ptr, size] : arenas_) {
+    munmap(ptr, size);
+  }
+}
+
+void* HugePageResource::do_allocate(size_t size, size_t align) {
+  FreeList* fl = FindList(size);
+  if (!fl)
+    return upstream_->allocate(size, align);
+
+  DCHECK_LE(align, kBlockAlign);
+
+  used_ += fl->block_size;
+
+  if (fl->head) {
+    void* res = fl->head;
+    fl->head = *reinterpret_cast<void**>(res);
+    return res;
+  }
+
+  if (size_t(end_ - next_) < fl->block_size) {
+    MapArena();
+  }
+
+  void* res = next_;
+  next_ += fl->block_size;
+
+  return res;
+}
+
+void HugePageResource::do_deallocate(void* ptr, size_t size, size_t align) {
+  FreeList* fl = FindList(size);
+  if (!fl) {
+    upstream_->deallocate(ptr, size, align);
+    return;
+  }
+
+  DCHECK_GE(used_, fl->block_size);
+  used_ -= fl->block_size;
+
+  *reinterpret_cast<void**>(ptr) = fl->head;
+  fl->head = ptr;
+}
+
+auto HugePageResource::FindList(size_t size) -> FreeList* {
+  // We have only few block sizes.
+  for (auto& fl : free_lists_) {
+    if (fl.size == size)
+      return &fl;
+  }
+  return nullptr;
+}
+
+void HugePageResource::MapArena() {
+  size_t size = ArenaSize(mode_);
+  void* ptr = nullptr;
+
+  if (mode_ != THP) {
+    int page_shift = mode_ == HUGE_1GB ? 30 : 21;
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+
+    if (ptr == MAP_FAILED) {
+      // Hugetlb pages must be reserved upfront via /proc/sys/vm/nr_hugepages.
+      LOG(WARNING) << "Could not map " << size << " bytes of hugetlb pages: " << strerror(errno)
+                   << ", falling back to transparent huge pages";
+      mode_ = THP;
+      size = ArenaSize(mode_);
+      ptr = nullptr;
+    }
+  }
+
+  if (mode_ == THP) {
+    ptr = MapTHP(size);
+  }
+
+  if (!ptr)
+    throw bad_alloc{};
+
+  arenas_.emplace_back(ptr, size);
+  reserved_ += size;
+
+  // The tail of the previous arena is too short for the requested block and is lost.
+  next_ = reinterpret_cast<char*>(ptr);
+  end_ = next_ + size;
+}
+
+}  // namespace dfly
@@ -0,0 +1,80 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <initializer_list>
+#include <memory_resource>
+#include <vector>
+
+namespace dfly {
+
+// Serves fixed-size blocks, i.e. DashTable segments, out of huge pages.
+// Keeps the blocks apart from the small objects of the shard heap, so that short-lived
+// allocations do not fragment the huge pages and the table probes need fewer TLB entries.
+//
+// Only the sizes passed in the constructor are served, other allocations are passed to
+// the upstream resource. Freed blocks are reused by allocations of the same size and are
+// not returned to the OS. Not thread-safe.
+class HugePageResource : public std::pmr::memory_resource {
+ public:
+  enum PageMode {
+    THP,       // regular pages with madvise(MADV_HUGEPAGE).
+    HUGE_2MB,  // MAP_HUGETLB with 2MB pages. Falls back to THP if no pages are reserved.
+    HUGE_1GB,  // MAP_HUGETLB with 1GB pages. Falls back to THP if no pages are reserved.
+  };
+
+  HugePageResource(PageMode mode, std::initializer_list<size_t> block_sizes,
+                   std::pmr::memory_resource* upstream);
+  ~HugePageResource();
+
+  PageMode mode() const {
+    return mode_;
+  }
+
+  // Bytes that are held by the allocated blocks.
+  size_t used() const {
+    return used_;
+  }
+
+  // Bytes that are mapped from the OS.
+  size_t reserved() const {
+    return reserved_;
+  }
+
+ private:
+  struct FreeList {
+    size_t size;        // requested size.
+    size_t block_size;  // size rounded up to the block alignment.
+    void* head = nullptr;
+  };
+
+  void* do_allocate(std::size_t size, std::size_t align) final;
+
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
+
+  bool do_is_equal(const std::pmr::memory_resource& o) const noexcept {
+    return this == &o;
+  }
+
+  FreeList* FindList(size_t size);
+
+  // Maps a new arena and makes it the current one. Throws bad_alloc if the OS is out of memory.
+  void MapArena();
+
+  PageMode mode_;
+  std::pmr::memory_resource* upstream_;
+
+  std::vector<FreeList> free_lists_;
+  std::vector<std::pair<void*, size_t>> arenas_;
+
+  // The unused part of the current arena.
+  char* next_ = nullptr;
+  char* end_ = nullptr;
+
+  size_t used_ = 0;
+  size_t reserved_ = 0;
+};
+
+}  // namespace dfly
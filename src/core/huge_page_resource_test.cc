@@ -0,0 +1,75 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/huge_page_resource.h"
+
+#include <cstring>
+#include <set>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class HugePageResourceTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kBlockSize = 25000;
+};
+
+TEST_F(HugePageResourceTest, Basic) {
+  HugePageResource resource(HugePageResource::THP, {kBlockSize, 1000},
+                            pmr::get_default_resource());
+  EXPECT_EQ(0u, resource.reserved());
+
+  set<void*> blocks;
+  for (unsigned i = 0; i < 200; ++i) {
+    void* ptr = resource.allocate(kBlockSize, 8);
+    ASSERT_EQ(0u, uintptr_t(ptr) % 64);
+    memset(ptr, i, kBlockSize);
+    ASSERT_TRUE(blocks.insert(ptr).second);
+  }
+
+  size_t block_used = resource.used() / 200;
+  EXPECT_GE(block_used, kBlockSize);
+  EXPECT_LT(block_used, kBlockSize + 64);
+  EXPECT_GE(resource.reserved(), resource.used());
+  EXPECT_EQ(0u, resource.reserved() % (1 << 21));
+
+  void* small = resource.allocate(1000, 8);
+  EXPECT_EQ(200 * block_used + 1024, resource.used());
+
+  // Freed blocks are reused.
+  void* ptr = *blocks.begin();
+  resource.deallocate(ptr, kBlockSize, 8);
+  EXPECT_EQ(ptr, resource.allocate(kBlockSize, 8));
+
+  // Other sizes are served by the upstream resource.
+  size_t used = resource.used();
+  void* other = resource.allocate(kBlockSize + 1, 8);
+  EXPECT_EQ(used, resource.used());
+  resource.deallocate(other, kBlockSize + 1, 8);
+
+  resource.deallocate(small, 1000, 8);
+  for (void* ptr : blocks) {
+    resource.deallocate(ptr, kBlockSize, 8);
+  }
+  EXPECT_EQ(0u, resource.used());
+}
+
+TEST_F(HugePageResourceTest, HugeTlb) {
+  // Falls back to THP if the host does not reserve hugetlb pages.
+  HugePageResource resource(HugePageResource::HUGE_2MB, {kBlockSize},
+                            pmr::get_default_resource());
+
+  void* ptr = resource.allocate(kBlockSize, 8);
+  memset(ptr, 0, kBlockSize);
+  EXPECT_EQ(size_t(1 << 21), resource.reserved());
+  LOG(INFO) << "mode " << resource.mode();
+
+  resource.deallocate(ptr, kBlockSize, 8);
+}
+
+}  // namespace dfly
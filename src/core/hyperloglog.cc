@@ -0,0 +1,403 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hyperloglog.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <cmath>
+#include <cstring>
+
+#include "base/logging.h"
+
+#if defined(__aarch64__)
+#include "base/sse2neon.h"
+#else
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#endif
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kP = 14;
+constexpr unsigned kQ = 64 - kP;
+constexpr unsigned kBits = 6;
+constexpr uint8_t kRegisterMax = (1 << kBits) - 1;
+constexpr double kAlphaInf = 0.721347520444481703680;  // 0.5 / ln(2)
+
+constexpr size_t kHdrSize = 16;
+constexpr size_t kDenseBytes = (kHllRegisters * kBits + 7) / 8;
+constexpr size_t kDenseSize = kHdrSize + kDenseBytes;
+
+constexpr uint8_t kDense = 0;
+constexpr uint8_t kSparse = 1;
+
+// Sparse opcodes: ZERO 00xxxxxx, XZERO 01xxxxxx yyyyyyyy and VAL 1vvvvvxx.
+constexpr uint8_t kXZeroBit = 0x40;
+constexpr uint8_t kValBit = 0x80;
+constexpr unsigned kZeroMaxLen = 64;
+constexpr unsigned kXZeroMaxLen = 16384;
+constexpr unsigned kValMaxValue = 32;
+constexpr unsigned kValMaxLen = 4;
+
+constexpr size_t kEncodingPos = 4;
+constexpr size_t kCardPos = 8;
+
+// MurmurHash64A with the seed of redis, the elements must land in the same registers.
+uint64_t MurmurHash64A(string_view key) {
+  constexpr uint64_t m = 0xc6a4a7935bd1e995;
+  constexpr int r = 47;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(key.data());
+  const size_t len = key.size();
+  const uint8_t* end = data + (len - (len & 7));
+  uint64_t h = 0xadc83b19ULL ^ (len * m);
+
+  for (; data != end; data += 8) {
+    uint64_t k = absl::little_endian::Load64(data);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7:
+      h ^= uint64_t(data[6]) << 48;
+      [[fallthrough]];
+    case 6:
+      h ^= uint64_t(data[5]) << 40;
+      [[fallthrough]];
+    case 5:
+      h ^= uint64_t(data[4]) << 32;
+      [[fallthrough]];
+    case 4:
+      h ^= uint64_t(data[3]) << 24;
+      [[fallthrough]];
+    case 3:
+      h ^= uint64_t(data[2]) << 16;
+      [[fallthrough]];
+    case 2:
+      h ^= uint64_t(data[1]) << 8;
+      [[fallthrough]];
+    case 1:
+      h ^= uint64_t(data[0]);
+      h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// Returns the register of the element and the length of the 000..1 pattern of its hash.
+pair<unsigned, uint8_t> PatLen(string_view element) {
+  uint64_t hash = MurmurHash64A(element);
+  unsigned index = hash & (kHllRegisters - 1);
+  hash >>= kP;
+  hash |= uint64_t(1) << kQ;  // count <= kQ + 1
+
+  return {index, uint8_t(__builtin_ctzll(hash) + 1)};
+}
+
+inline uint8_t* Registers(string* hll) {
+  return reinterpret_cast<uint8_t*>(hll->data()) + kHdrSize;
+}
+
+inline const uint8_t* Registers(string_view hll) {
+  return reinterpret_cast<const uint8_t*>(hll.data()) + kHdrSize;
+}
+
+// The registers are packed from the lsb of the first byte, so a register may span 2 bytes.
+uint8_t GetDense(const uint8_t* p, unsigned regnum) {
+  size_t byte = regnum * kBits / 8;
+  unsigned fb = regnum * kBits & 7;
+  unsigned res = p[byte] >> fb;
+  if (fb > 8 - kBits)
+    res |= unsigned(p[byte + 1]) << (8 - fb);
+  return res & kRegisterMax;
+}
+
+void SetDense(uint8_t* p, unsigned regnum, uint8_t val) {
+  size_t byte = regnum * kBits / 8;
+  unsigned fb = regnum * kBits & 7;
+  p[byte] &= ~(kRegisterMax << fb);
+  p[byte] |= val << fb;
+  if (fb > 8 - kBits) {
+    p[byte + 1] &= ~(kRegisterMax >> (8 - fb));
+    p[byte + 1] |= val >> (8 - fb);
+  }
+}
+
+// Every 3 bytes hold 4 registers.
+void UnpackDense(const uint8_t* src, uint8_t* dest) {
+  for (unsigned i = 0; i < kHllRegisters; i += 4, src += 3) {
+    uint32_t w = src[0] | (uint32_t(src[1]) << 8) | (uint32_t(src[2]) << 16);
+    dest[i] = w & kRegisterMax;
+    dest[i + 1] = (w >> 6) & kRegisterMax;
+    dest[i + 2] = (w >> 12) & kRegisterMax;
+    dest[i + 3] = (w >> 18) & kRegisterMax;
+  }
+}
+
+void PackDense(const uint8_t* src, uint8_t* dest) {
+  for (unsigned i = 0; i < kHllRegisters; i += 4, dest += 3) {
+    uint32_t w = src[i] | (uint32_t(src[i + 1]) << 6) | (uint32_t(src[i + 2]) << 12) |
+                 (uint32_t(src[i + 3]) << 18);
+    dest[0] = w;
+    dest[1] = w >> 8;
+    dest[2] = w >> 16;
+  }
+}
+
+// Merges the sparse registers into regs. Returns false if the encoding does not cover exactly
+// kHllRegisters registers.
+bool MergeSparse(const uint8_t* p, const uint8_t* end, uint8_t* regs) {
+  size_t idx = 0;
+
+  while (p < end) {
+    uint8_t op = *p;
+    if ((op & 0xc0) == 0) {
+      idx += (op & 0x3f) + 1;
+      ++p;
+    } else if ((op & 0xc0) == kXZeroBit) {
+      if (p + 1 == end)
+        return false;
+      idx += (((op & 0x3f) << 8) | p[1]) + 1;
+      p += 2;
+    } else {
+      uint8_t val = ((op >> 2) & 0x1f) + 1;
+      unsigned len = (op & 0x3) + 1;
+      if (idx + len > kHllRegisters)
+        return false;
+      for (unsigned j = 0; j < len; ++j, ++idx) {
+        regs[idx] = max(regs[idx], val);
+      }
+      ++p;
+    }
+  }
+
+  return idx == kHllRegisters;
+}
+
+void AppendHeader(bool dense, string* dest) {
+  dest->append("HYLL");
+  dest->push_back(dense ? kDense : kSparse);
+  dest->append(3 + 8, '\0');
+}
+
+inline void InvalidateCache(string* hll) {
+  (*hll)[kCardPos + 7] = char(0x80);
+}
+
+// Returns false if some register does not fit the sparse encoding or it is too long.
+bool EncodeSparse(const uint8_t* regs, string* dest) {
+  AppendHeader(false, dest);
+
+  for (unsigned i = 0; i < kHllRegisters;) {
+    uint8_t val = regs[i];
+    unsigned run = 1;
+    while (i + run < kHllRegisters && regs[i + run] == val)
+      ++run;
+    i += run;
+
+    if (val == 0) {
+      while (run > 0) {
+        unsigned len = min(run, kXZeroMaxLen);
+        if (len > kZeroMaxLen) {
+          dest->push_back(kXZeroBit | ((len - 1) >> 8));
+          dest->push_back((len - 1) & 0xff);
+        } else {
+          dest->push_back(len - 1);
+        }
+        run -= len;
+      }
+    } else {
+      if (val > kValMaxValue)
+        return false;
+      while (run > 0) {
+        unsigned len = min(run, kValMaxLen);
+        dest->push_back(kValBit | ((val - 1) << 2) | (len - 1));
+        run -= len;
+      }
+    }
+
+    if (dest->size() > kHllSparseMaxBytes)
+      return false;
+  }
+
+  return true;
+}
+
+double Sigma(double x) {
+  if (x == 1.)
+    return INFINITY;
+
+  double z_prime, y = 1, z = x;
+  do {
+    x *= x;
+    z_prime = z;
+    z += x * y;
+    y += y;
+  } while (z_prime != z);
+  return z;
+}
+
+double Tau(double x) {
+  if (x == 0. || x == 1.)
+    return 0.;
+
+  double z_prime, y = 1.0, z = 1 - x;
+  do {
+    x = sqrt(x);
+    z_prime = z;
+    y *= 0.5;
+    z -= pow(1 - x, 2) * y;
+  } while (z_prime != z);
+  return z / 3;
+}
+
+}  // namespace
+
+bool IsValidHll(string_view hll) {
+  if (hll.size() < kHdrSize || hll.substr(0, 4) != "HYLL")
+    return false;
+
+  uint8_t encoding = hll[kEncodingPos];
+  return encoding == kSparse || (encoding == kDense && hll.size() == kDenseSize);
+}
+
+bool IsDenseHll(string_view hll) {
+  return hll[kEncodingPos] == kDense;
+}
+
+string NewHll() {
+  string res;
+  AppendHeader(false, &res);
+
+  // A single XZERO opcode covers all the registers.
+  for (unsigned left = kHllRegisters; left > 0; left -= kXZeroMaxLen) {
+    res.push_back(kXZeroBit | ((kXZeroMaxLen - 1) >> 8));
+    res.push_back((kXZeroMaxLen - 1) & 0xff);
+  }
+  return res;
+}
+
+int HllAdd(const vector<string_view>& elements, string* hll) {
+  bool updated = false;
+
+  if (IsDenseHll(*hll)) {
+    uint8_t* p = Registers(hll);
+    for (string_view elem : elements) {
+      auto [index, count] = PatLen(elem);
+      if (count > GetDense(p, index)) {
+        SetDense(p, index, count);
+        updated = true;
+      }
+    }
+  } else {
+    HllRegisters regs(kHllRegisters);
+    if (!HllMerge(*hll, &regs))
+      return -1;
+
+    for (string_view elem : elements) {
+      auto [index, count] = PatLen(elem);
+      if (count > regs[index]) {
+        regs[index] = count;
+        updated = true;
+      }
+    }
+
+    if (updated)
+      *hll = HllEncode(regs, false);
+  }
+
+  if (updated)
+    InvalidateCache(hll);
+  return updated ? 1 : 0;
+}
+
+bool HllMerge(string_view hll, HllRegisters* regs) {
+  DCHECK_EQ(kHllRegisters, regs->size());
+
+  if (IsDenseHll(hll)) {
+    thread_local HllRegisters tmp(kHllRegisters);
+    UnpackDense(Registers(hll), tmp.data());
+    MaxRegisters(tmp, regs);
+    return true;
+  }
+
+  const uint8_t* p = Registers(hll);
+  return MergeSparse(p, p + hll.size() - kHdrSize, regs->data());
+}
+
+void MaxRegisters(const HllRegisters& src, HllRegisters* dest) {
+  const uint8_t* s = src.data();
+  uint8_t* d = dest->data();
+
+#if defined(__AVX2__)
+  for (unsigned i = 0; i < kHllRegisters; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_max_epu8(a, b));
+  }
+#else
+  for (unsigned i = 0; i < kHllRegisters; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_max_epu8(a, b));
+  }
+#endif
+}
+
+// The estimator of "New cardinality estimation algorithms for HyperLogLog sketches" by Ertl,
+// the same that redis uses.
+uint64_t HllCount(const HllRegisters& regs) {
+  unsigned histo[64] = {0};
+  for (uint8_t reg : regs) {
+    ++histo[reg & kRegisterMax];
+  }
+
+  double m = kHllRegisters;
+  double z = m * Tau((m - histo[kQ + 1]) / m);
+  for (unsigned j = kQ; j >= 1; --j) {
+    z += histo[j];
+    z *= 0.5;
+  }
+  z += m * Sigma(histo[0] / m);
+
+  return llroundl(kAlphaInf * m * m / z);
+}
+
+optional<uint64_t> HllCachedCount(string_view hll) {
+  if (uint8_t(hll[kCardPos + 7]) & 0x80)
+    return nullopt;
+  return absl::little_endian::Load64(hll.data() + kCardPos);
+}
+
+string HllEncode(const HllRegisters& regs, bool dense) {
+  string res;
+  if (!dense) {
+    if (EncodeSparse(regs.data(), &res)) {
+      InvalidateCache(&res);
+      return res;
+    }
+    res.clear();
+  }
+
+  AppendHeader(true, &res);
+  res.resize(kDenseSize);
+  PackDense(regs.data(), Registers(&res));
+  InvalidateCache(&res);
+  return res;
+}
+
+}  // namespace dfly
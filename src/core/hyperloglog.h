@@ -0,0 +1,61 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// HyperLogLog strings with the layout of redis, so they are interchangeable with redis
+// via RDB files or DUMP/RESTORE. A string starts with a 16 byte header: "HYLL", the encoding,
+// 3 unused bytes and the little-endian cached cardinality whose msb marks it as invalid.
+// It is followed either by 16384 packed 6-bit registers (dense) or by a run-length encoding of
+// the registers (sparse) that is used while the registers are small and few.
+//
+// The computations run over raw registers, one register per byte, where merging is a
+// register-wise max that uses SIMD when the build targets AVX2.
+
+constexpr unsigned kHllRegisters = 1 << 14;
+
+// The sparse encoding is converted to the dense one past this size, like in redis.
+constexpr unsigned kHllSparseMaxBytes = 3000;
+
+// Raw registers, holds kHllRegisters bytes.
+using HllRegisters = std::vector<uint8_t>;
+
+// Returns true if hll has a valid header and its size matches its encoding.
+bool IsValidHll(std::string_view hll);
+
+bool IsDenseHll(std::string_view hll);
+
+// Returns an empty sparse HyperLogLog.
+std::string NewHll();
+
+// Adds the elements to the valid hll. Returns 1 if some register was updated, 0 if none was
+// and -1 if the sparse encoding of hll is corrupted.
+int HllAdd(const std::vector<std::string_view>& elements, std::string* hll);
+
+// Sets regs to the register-wise max of regs and the registers of the valid hll.
+// Returns false if its sparse encoding is corrupted.
+bool HllMerge(std::string_view hll, HllRegisters* regs);
+
+// dest[i] = max(dest[i], src[i]) for all the registers.
+void MaxRegisters(const HllRegisters& src, HllRegisters* dest);
+
+// Estimates the cardinality of the registers.
+uint64_t HllCount(const HllRegisters& regs);
+
+// Returns the cached cardinality of the valid hll if the cache is valid.
+std::optional<uint64_t> HllCachedCount(std::string_view hll);
+
+// Encodes the registers into a HyperLogLog string with an invalid cache. The sparse encoding
+// is used unless dense is set or the registers do not fit it.
+std::string HllEncode(const HllRegisters& regs, bool dense);
+
+}  // namespace dfly
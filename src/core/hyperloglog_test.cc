@@ -0,0 +1,115 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hyperloglog.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class HyperLogLogTest : public ::testing::Test {
+ protected:
+  static uint64_t Count(string_view hll) {
+    HllRegisters regs(kHllRegisters);
+    CHECK(HllMerge(hll, &regs));
+    return HllCount(regs);
+  }
+
+  // Adds the elements [start, end) in batches.
+  static void Add(unsigned start, unsigned end, string* hll) {
+    vector<string> strs;
+    for (unsigned i = start; i < end; ++i)
+      strs.push_back(absl::StrCat("elem:", i));
+
+    vector<string_view> elems(strs.begin(), strs.end());
+    ASSERT_GE(HllAdd(elems, hll), 0);
+  }
+};
+
+TEST_F(HyperLogLogTest, Empty) {
+  string hll = NewHll();
+  EXPECT_TRUE(IsValidHll(hll));
+  EXPECT_FALSE(IsDenseHll(hll));
+  EXPECT_EQ(0u, HllCachedCount(hll).value_or(1));
+  EXPECT_EQ(0u, Count(hll));
+
+  EXPECT_FALSE(IsValidHll("HYLL"));
+  EXPECT_FALSE(IsValidHll(string(20, 'a')));
+}
+
+TEST_F(HyperLogLogTest, Add) {
+  string hll = NewHll();
+  EXPECT_EQ(1, HllAdd({"a", "b", "c"}, &hll));
+  EXPECT_EQ(0, HllAdd({"a", "b"}, &hll));
+  EXPECT_FALSE(HllCachedCount(hll));
+  EXPECT_FALSE(IsDenseHll(hll));
+  EXPECT_EQ(3u, Count(hll));
+
+  EXPECT_EQ(1, HllAdd({"foo", "bar", "zap", "d", "e"}, &hll));
+  EXPECT_EQ(8u, Count(hll));
+}
+
+// The sparse encoding is promoted to the dense one once it grows, the estimate stays within
+// the standard error of 0.81%.
+TEST_F(HyperLogLogTest, Promote) {
+  string hll = NewHll();
+  Add(0, 1000, &hll);
+  EXPECT_FALSE(IsDenseHll(hll));
+  EXPECT_NEAR(1000, Count(hll), 30);
+
+  Add(1000, 100000, &hll);
+  EXPECT_TRUE(IsDenseHll(hll));
+  EXPECT_TRUE(IsValidHll(hll));
+  EXPECT_NEAR(100000, Count(hll), 2500);
+
+  // Dense and sparse encodings of the same registers.
+  HllRegisters regs(kHllRegisters);
+  ASSERT_TRUE(HllMerge(hll, &regs));
+  string dense = HllEncode(regs, true);
+  EXPECT_EQ(hll.substr(16), dense.substr(16));
+}
+
+TEST_F(HyperLogLogTest, Merge) {
+  string a = NewHll(), b = NewHll(), c = NewHll();
+  Add(0, 30000, &a);
+  Add(20000, 50000, &b);
+  Add(45000, 45100, &c);
+
+  HllRegisters regs(kHllRegisters);
+  for (const string* hll : {&a, &b, &c}) {
+    ASSERT_TRUE(HllMerge(*hll, &regs));
+  }
+  EXPECT_NEAR(50000, HllCount(regs), 1250);
+
+  // Merging is a register-wise max.
+  HllRegisters ra(kHllRegisters), rc(kHllRegisters);
+  ASSERT_TRUE(HllMerge(a, &ra));
+  ASSERT_TRUE(HllMerge(c, &rc));
+  HllRegisters expected = ra;
+  for (unsigned i = 0; i < kHllRegisters; ++i)
+    expected[i] = max(ra[i], rc[i]);
+  MaxRegisters(rc, &ra);
+  EXPECT_EQ(expected, ra);
+
+  string sparse = HllEncode(rc, false);
+  EXPECT_FALSE(IsDenseHll(sparse));
+  EXPECT_EQ(100u, Count(sparse));
+}
+
+TEST_F(HyperLogLogTest, Corrupted) {
+  string hll = NewHll();
+  hll.pop_back();  // The XZERO opcode no longer covers all the registers.
+  EXPECT_TRUE(IsValidHll(hll));
+  EXPECT_EQ(-1, HllAdd({"a"}, &hll));
+
+  HllRegisters regs(kHllRegisters);
+  EXPECT_FALSE(HllMerge(hll, &regs));
+}
+
+}  // namespace dfly
@@ -31,6 +31,13 @@ class IntentLock {
     return (m == SHARED) ? true : IsFree();
   }
 
+  // Same as Check, for a holder whose own intent of mode m is already recorded.
+  bool CheckOwned(Mode m) const {
+    if (m == SHARED)
+      return cnt_[EXCLUSIVE] == 0;
+    return cnt_[EXCLUSIVE] == 1 && cnt_[SHARED] == 0;
+  }
+
   void Release(Mode m, unsigned val = 1) {
     assert(cnt_[m] >= val);
 
@@ -5,6 +5,7 @@
 #include "core/interpreter.h"
 
 #include <absl/strings/str_cat.h>
+#include <mimalloc.h>
 #include <openssl/evp.h>
 
 #include <cstring>
@@ -25,6 +26,14 @@ using namespace std;
 
 namespace {
 
+thread_local size_t used_memory_tl = 0;
+
+// Upper bound of a number argument of redis.call formatted with %.17g, or of an integer.
+constexpr size_t kMaxNumberLen = 32;
+
+// The argument buffer of redis.call is released after a call that needed more.
+constexpr size_t kMaxArgBufLen = 1 << 16;
+
 // EVP_Q_digest is not present in the older versions of OpenSSL.
 int EVPDigest(const void* data, size_t datalen, unsigned char* md, size_t* mdlen) {
   unsigned int temp = 0;
@@ -116,7 +125,7 @@ void RedisTranslator::OnError(std::string_view str) {
 
 void RedisTranslator::OnArrayStart(unsigned len) {
   ArrayPre();
-  lua_newtable(lua_);
+  lua_createtable(lua_, len, 0);
   array_index_.push_back(1);
 }
 
@@ -319,7 +328,12 @@ int RedisStatusReplyCommand(lua_State* lua) {
 }  // namespace
 
 Interpreter::Interpreter() {
-  lua_ = luaL_newstate();
+  heap_ = mi_heap_new();
+  lua_ = lua_newstate(LuaAlloc, this);
+  lua_atpanic(lua_, [](lua_State* lua) {
+    LOG(FATAL) << "Unprotected lua error " << lua_tostring(lua, -1);
+    return 0;
+  });
   InitLua(lua_);
   void** ptr = static_cast<void**>(lua_getextraspace(lua_));
   *ptr = this;
@@ -357,6 +371,42 @@ Interpreter::Interpreter() {
 
 Interpreter::~Interpreter() {
   lua_close(lua_);
+  DCHECK_EQ(0u, used_memory_);
+  mi_heap_delete(heap_);
+}
+
+size_t Interpreter::UsedThreadLocal() {
+  return used_memory_tl;
+}
+
+void* Interpreter::LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  Interpreter* self = static_cast<Interpreter*>(ud);
+  size_t old_size = ptr ? osize : 0;  // osize is the type of a new object otherwise.
+
+  if (nsize == 0) {
+    mi_free(ptr);
+    self->used_memory_ -= old_size;
+    used_memory_tl -= old_size;
+    return nullptr;
+  }
+
+  // Lua raises a memory error once it failed to allocate even after a full collection. The
+  // limit does not apply within redis.call since the error would unwind the C++ frames of the
+  // command.
+  if (nsize > old_size && self->memory_limit_ && self->cmd_depth_ == 0 &&
+      self->used_memory_ + nsize - old_size > self->memory_limit_) {
+    self->memory_exceeded_ = true;
+    return nullptr;
+  }
+
+  void* res = mi_heap_realloc(self->heap_, ptr, nsize);
+  if (res) {
+    if (nsize > old_size)
+      self->run_stats_.allocated_bytes += nsize - old_size;
+    self->used_memory_ += nsize - old_size;
+    used_memory_tl += nsize - old_size;
+  }
+  return res;
 }
 
 void Interpreter::FuncSha1(string_view body, char* fp) {
@@ -421,11 +471,19 @@ auto Interpreter::RunFunction(string_view sha, std::string* error) -> RunResult
 
   // At this point lua stack has 2 globals.
 
+  run_stats_ = RunStats{};
+  memory_exceeded_ = false;
+  memory_limit_ = memory_budget_ ? used_memory_ + memory_budget_ : 0;
+
   /* We have zero arguments and expect
    * a single return value. */
   int err = lua_pcall(lua_, 0, 1, -2);
+  memory_limit_ = 0;
 
-  if (err) {
+  if (err == LUA_ERRMEM && memory_exceeded_) {
+    *error = absl::StrCat("script exceeded the memory limit of ", memory_budget_, " bytes");
+    lua_gc(lua_, LUA_GCCOLLECT);
+  } else if (err) {
     *error = lua_tostring(lua_, -1);
   }
 
@@ -605,6 +663,7 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
   }
 
   cmd_depth_++;
+  run_stats_.redis_calls++;
   int argc = lua_gettop(lua_);
 
   /* Require at least one argument */
@@ -615,20 +674,13 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
     return raise_error ? RaiseError(lua_) : 1;
   }
 
+  // Numbers are formatted once, directly into the buffer, hence they reserve their upper bound.
   size_t blob_len = 0;
-  char tmpbuf[64];
-
-  for (int j = 0; j < argc; j++) {
-    unsigned idx = j + 1;
-    if (lua_isinteger(lua_, idx)) {
-      absl::AlphaNum an(lua_tointeger(lua_, idx));
-      blob_len += an.size();
-    } else if (lua_isnumber(lua_, idx)) {
-      // fmt_len does not include '\0'.
-      int fmt_len = absl::SNPrintF(tmpbuf, sizeof(tmpbuf), "%.17g", lua_tonumber(lua_, idx));
-      CHECK_GT(fmt_len, 0);
-      blob_len += fmt_len;
-    } else if (lua_isstring(lua_, idx)) {
+  for (int idx = 1; idx <= argc; ++idx) {
+    int type = lua_type(lua_, idx);
+    if (type == LUA_TNUMBER) {
+      blob_len += kMaxNumberLen;
+    } else if (type == LUA_TSTRING) {
       blob_len += lua_rawlen(lua_, idx);  // lua_rawlen does not include '\0'.
     } else {
       PushError(lua_, "Lua redis() command arguments must be strings or integers");
@@ -637,28 +689,31 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
     }
   }
 
-  // backing storage.
-  unique_ptr<char[]> blob(new char[blob_len + 8]);  // 8 safety.
-  vector<absl::Span<char>> cmdargs;
-  char* cur = blob.get();
-  char* end = cur + blob_len;
+  // The arguments are copied since the commands may modify them, unlike the lua strings.
+  if (blob_len >= arg_buf_len_) {
+    arg_buf_len_ = blob_len + 1;
+    arg_buf_.reset(new char[arg_buf_len_]);
+  }
+  cmd_args_.clear();
+  char* cur = arg_buf_.get();
 
-  for (int j = 0; j < argc; j++) {
-    unsigned idx = j + 1;
+  for (int idx = 1; idx <= argc; ++idx) {
     size_t len = 0;
-    if (lua_isinteger(lua_, idx)) {
-      char* next = absl::numbers_internal::FastIntToBuffer(lua_tointeger(lua_, idx), cur);
-      len = next - cur;
-    } else if (lua_isnumber(lua_, idx)) {
-      int fmt_len = absl::SNPrintF(cur, end - cur, "%.17g", lua_tonumber(lua_, idx));
-      CHECK_GT(fmt_len, 0);
-      len = fmt_len;
-    } else if (lua_isstring(lua_, idx)) {
-      len = lua_rawlen(lua_, idx);
-      memcpy(cur, lua_tostring(lua_, idx), len);  // copy \0 as well.
+    if (lua_type(lua_, idx) == LUA_TNUMBER) {
+      if (lua_isinteger(lua_, idx)) {
+        char* next = absl::numbers_internal::FastIntToBuffer(lua_tointeger(lua_, idx), cur);
+        len = next - cur;
+      } else {
+        int fmt_len = absl::SNPrintF(cur, kMaxNumberLen, "%.17g", lua_tonumber(lua_, idx));
+        CHECK_GT(fmt_len, 0);
+        len = fmt_len;
+      }
+    } else {
+      const char* str = lua_tolstring(lua_, idx, &len);
+      memcpy(cur, str, len);
     }
 
-    cmdargs.emplace_back(cur, len);
+    cmd_args_.emplace_back(cur, len);
     cur += len;
   }
 
@@ -666,9 +721,15 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
    * and this way we guaranty we will have room on the stack for the result. */
   lua_pop(lua_, argc);
   RedisTranslator translator(lua_);
-  redis_func_(MutSliceSpan{cmdargs}, &translator);
+  redis_func_(MutSliceSpan{cmd_args_}, &translator);
   DCHECK_EQ(1, lua_gettop(lua_));
 
+  // Does not hold on to the buffer of an exceptionally big call.
+  if (arg_buf_len_ > kMaxArgBufLen) {
+    arg_buf_.reset();
+    arg_buf_len_ = 0;
+  }
+
   cmd_depth_--;
 
   return 1;
@@ -684,4 +745,30 @@ int Interpreter::RedisPCallCommand(lua_State* lua) {
   return reinterpret_cast<Interpreter*>(*ptr)->RedisGenericCommand(false);
 }
 
+Interpreter* InterpreterManager::Get() {
+  std::unique_lock lk(mu_);
+  if (available_.empty() && storage_.size() < max_size_)
+    available_.push_back(storage_.emplace_back(new Interpreter).get());
+
+  cv_.wait(lk, [this] { return !available_.empty(); });
+  Interpreter* ir = available_.back();
+  available_.pop_back();
+  return ir;
+}
+
+void InterpreterManager::Return(Interpreter* ir) {
+  {
+    std::lock_guard lk(mu_);
+    available_.push_back(ir);
+  }
+  cv_.notify_one();
+}
+
+Interpreter& InterpreterManager::Any() {
+  std::lock_guard lk(mu_);
+  if (storage_.empty())
+    available_.push_back(storage_.emplace_back(new Interpreter).get());
+  return *storage_.front();
+}
+
 }  // namespace dfly
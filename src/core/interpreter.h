@@ -4,12 +4,17 @@
 
 #pragma once
 
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/mutex.hpp>
 #include <functional>
+#include <memory>
 #include <string_view>
+#include <vector>
 
 #include "core/core_types.h"
 
+typedef struct mi_heap_s mi_heap_t;
+
 typedef struct lua_State lua_State;
 
 namespace dfly {
@@ -90,8 +95,8 @@ class Interpreter {
     redis_func_ = std::forward<U>(u);
   }
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
+  // An interpreter that is not borrowed from an InterpreterManager is shared by the fibers of
+  // its thread. Since we might preempt into different fibers when operating on interpreter
   // we must lock it until we finish using it per request.
   // Only RunFunction with companions require locking since other functions perform atomically
   // without preemptions.
@@ -99,7 +104,33 @@ class Interpreter {
     return std::lock_guard<::boost::fibers::mutex>{mu_};
   }
 
+  // Limits the memory that RunFunction may add to the state to bytes, 0 for no limit.
+  // A script that exceeds it fails with an error, its garbage is collected.
+  void SetMemoryBudget(size_t bytes) {
+    memory_budget_ = bytes;
+  }
+
+  // Bytes allocated by the lua state, which resides in its own mimalloc heap.
+  size_t used_memory() const {
+    return used_memory_;
+  }
+
+  // Bytes allocated by the interpreters of this thread.
+  static size_t UsedThreadLocal();
+
+  // Counters of the last RunFunction.
+  struct RunStats {
+    uint64_t redis_calls = 0;
+    uint64_t allocated_bytes = 0;  // not net of the frees.
+  };
+
+  const RunStats& last_run_stats() const {
+    return run_stats_;
+  }
+
  private:
+  static void* LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
   // Returns true if function was successfully added,
   // otherwise returns false and sets the error.
   bool AddInternal(const char* f_id, std::string_view body, std::string* error);
@@ -110,14 +141,54 @@ class Interpreter {
   static int RedisCallCommand(lua_State* lua);
   static int RedisPCallCommand(lua_State* lua);
 
+  mi_heap_t* heap_;
+  size_t used_memory_ = 0;
+  size_t memory_budget_ = 0;
+  size_t memory_limit_ = 0;  // of the running script, 0 if not limited.
+  bool memory_exceeded_ = false;
+  RunStats run_stats_;
+
   lua_State* lua_;
   unsigned cmd_depth_ = 0;
   RedisFunc redis_func_;
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
-  // we must lock it until we finish using it per request.
+  // The arguments of redis.call, reused across the calls.
+  std::unique_ptr<char[]> arg_buf_;
+  size_t arg_buf_len_ = 0;
+  std::vector<MutableSlice> cmd_args_;
+
+  // See Lock().
+  ::boost::fibers::mutex mu_;
+};
+
+// The interpreters of a thread. A script borrows an interpreter for the whole run, so that a
+// script that waits on a hop of redis.call does not hold back the other scripts of the thread.
+// The interpreters are created on demand up to the size of the pool, and each of them compiles
+// a script the first time it runs it. Get waits while all of them are borrowed.
+class InterpreterManager {
+ public:
+  explicit InterpreterManager(unsigned max_size) : max_size_(max_size) {
+  }
+
+  Interpreter* Get();
+  void Return(Interpreter* ir);
+
+  // Any interpreter, borrowed or not, for the calls that do not preempt, e.g. AddFunction.
+  Interpreter& Any();
+
+  // Calls cb for each interpreter that was created.
+  template <typename F> void ForEach(F&& cb) {
+    for (auto& ir : storage_)
+      cb(ir.get());
+  }
+
+ private:
+  unsigned max_size_;
+  std::vector<std::unique_ptr<Interpreter>> storage_;
+  std::vector<Interpreter*> available_;
+
   ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
 };
 
 }  // namespace dfly
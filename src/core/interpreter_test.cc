@@ -12,6 +12,9 @@ extern "C" {
 #include <absl/strings/str_cat.h>
 #include <gmock/gmock.h>
 
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/operations.hpp>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 
@@ -292,6 +295,54 @@ TEST_F(InterpreterTest, CallArray) {
   EXPECT_EQ("[str(table) [[[bool(0) str(s2)]] i(42)]]", ser_.res);
 }
 
+TEST_F(InterpreterTest, CallArgs) {
+  string args;
+  auto cb = [&](MutSliceSpan span, ObjectExplorer* reply) {
+    args.clear();
+    for (const auto& arg : span) {
+      absl::StrAppend(&args, string_view{arg.data(), arg.size()}, ",");
+    }
+    reply->OnInt(span.size());
+  };
+
+  intptr_.SetRedisFunc(cb);
+  EXPECT_TRUE(Execute("return redis.call('set', 'key', '007', 42, 1.5, '')"));
+  EXPECT_EQ("i(6)", ser_.res);
+  // Numeric strings are passed as is.
+  EXPECT_EQ("set,key,007,42,1.5,,", args);
+  EXPECT_EQ(1u, intptr_.last_run_stats().redis_calls);
+
+  // The buffer of the arguments is reused by a smaller call, and released after a big one.
+  EXPECT_TRUE(Execute("return redis.call('get', 'k')"));
+  EXPECT_EQ("get,k,", args);
+  EXPECT_TRUE(Execute("return redis.call('set', 'k', string.rep('x', 100000))"));
+  EXPECT_EQ(100008u, args.size());
+  EXPECT_TRUE(Execute("return redis.call('get', 'k')"));
+  EXPECT_EQ("get,k,", args);
+
+  EXPECT_FALSE(Execute("return redis.call('set', {})"));
+  EXPECT_THAT(error_, testing::HasSubstr("must be strings or integers"));
+}
+
+TEST_F(InterpreterTest, Memory) {
+  EXPECT_GT(intptr_.used_memory(), 0u);
+  EXPECT_EQ(intptr_.used_memory(), Interpreter::UsedThreadLocal());
+
+  intptr_.SetMemoryBudget(1 << 20);
+  EXPECT_FALSE(Execute("local t = {} for i = 1, 1000000 do t[i] = tostring(i) end return 1"));
+  EXPECT_THAT(error_, testing::HasSubstr("exceeded the memory limit"));
+  EXPECT_LT(intptr_.used_memory(), 1u << 20);
+
+  // The garbage of the failed script was collected.
+  EXPECT_TRUE(Execute("local t = {} for i = 1, 1000 do t[i] = tostring(i) end return #t"));
+  EXPECT_EQ("i(1000)", ser_.res);
+
+  intptr_.SetMemoryBudget(0);
+  EXPECT_TRUE(Execute("local t = {} for i = 1, 100000 do t[i] = tostring(i) end return #t"));
+  EXPECT_EQ("i(100000)", ser_.res);
+  EXPECT_GT(intptr_.last_run_stats().allocated_bytes, 100000u * 16);
+}
+
 TEST_F(InterpreterTest, ArgKeys) {
   vector<string> vec_arr{};
   vector<MutableSlice> slices;
@@ -301,4 +352,29 @@ TEST_F(InterpreterTest, ArgKeys) {
   EXPECT_EQ("[str(foo) str(key1) str(key2)]", ser_.res);
 }
 
+TEST(InterpreterManagerTest, Borrow) {
+  InterpreterManager mgr{2};
+  Interpreter* ir1 = mgr.Get();
+  Interpreter* ir2 = mgr.Get();
+  EXPECT_NE(ir1, ir2);
+  EXPECT_TRUE(&mgr.Any() == ir1 || &mgr.Any() == ir2);
+
+  // The pool is exhausted, so the fiber waits until an interpreter is returned.
+  Interpreter* ir3 = nullptr;
+  boost::fibers::fiber fb([&] { ir3 = mgr.Get(); });
+  boost::this_fiber::yield();
+  EXPECT_EQ(nullptr, ir3);
+
+  mgr.Return(ir2);
+  fb.join();
+  EXPECT_EQ(ir2, ir3);
+
+  unsigned count = 0;
+  mgr.ForEach([&](Interpreter*) { ++count; });
+  EXPECT_EQ(2u, count);
+
+  mgr.Return(ir1);
+  mgr.Return(ir3);
+}
+
 }  // namespace dfly
@@ -0,0 +1,730 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/json.h"
+
+#include <absl/strings/numbers.h>
+#include <double-conversion/double-to-string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr uint32_t kMinCapacity = 4;
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+void AppendUtf8(uint32_t cp, string* dest) {
+  if (cp < 0x80) {
+    dest->push_back(cp);
+  } else if (cp < 0x800) {
+    dest->push_back(0xC0 | (cp >> 6));
+    dest->push_back(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    dest->push_back(0xE0 | (cp >> 12));
+    dest->push_back(0x80 | ((cp >> 6) & 0x3F));
+    dest->push_back(0x80 | (cp & 0x3F));
+  } else {
+    dest->push_back(0xF0 | (cp >> 18));
+    dest->push_back(0x80 | ((cp >> 12) & 0x3F));
+    dest->push_back(0x80 | ((cp >> 6) & 0x3F));
+    dest->push_back(0x80 | (cp & 0x3F));
+  }
+}
+
+void AppendString(string_view str, string* dest) {
+  static const char kHex[] = "0123456789abcdef";
+
+  dest->push_back('"');
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        dest->append("\\\"");
+        break;
+      case '\\':
+        dest->append("\\\\");
+        break;
+      case '\b':
+        dest->append("\\b");
+        break;
+      case '\f':
+        dest->append("\\f");
+        break;
+      case '\n':
+        dest->append("\\n");
+        break;
+      case '\r':
+        dest->append("\\r");
+        break;
+      case '\t':
+        dest->append("\\t");
+        break;
+      default:
+        if (uint8_t(c) < 0x20) {
+          dest->append("\\u00");
+          dest->push_back(kHex[uint8_t(c) >> 4]);
+          dest->push_back(kHex[c & 0xF]);
+        } else {
+          dest->push_back(c);
+        }
+    }
+  }
+  dest->push_back('"');
+}
+
+// The shortest text that parses back into val. An integral value keeps a fraction, so that it
+// parses back into a double rather than into an integer.
+void AppendDouble(double val, string* dest) {
+  using double_conversion::DoubleToStringConverter;
+  using double_conversion::StringBuilder;
+
+  char buf[64];
+  StringBuilder sb(buf, sizeof(buf));
+  DoubleToStringConverter::EcmaScriptConverter().ToShortest(val, &sb);
+  int len = sb.position();
+  sb.Finalize();
+
+  string_view text{buf, size_t(len)};
+  dest->append(text);
+  if (text.find_first_of(".e") == string_view::npos)
+    dest->append(".0");
+}
+
+}  // namespace
+
+class JsonDoc::Parser {
+ public:
+  Parser(JsonDoc* doc, string_view text) : doc_(doc), text_(text) {
+  }
+
+  bool ParseValue(Node* dest, unsigned depth);
+
+  bool AtEnd() {
+    SkipSpace();
+    return pos_ == text_.size();
+  }
+
+ private:
+  void SkipSpace() {
+    while (pos_ < text_.size() && IsSpace(text_[pos_]))
+      ++pos_;
+  }
+
+  bool Consume(char c) {
+    SkipSpace();
+    if (pos_ < text_.size() && text_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  bool ParseLiteral(string_view literal) {
+    if (text_.substr(pos_, literal.size()) != literal)
+      return false;
+    pos_ += literal.size();
+    return true;
+  }
+
+  bool ParseHex4(uint32_t* dest);
+  bool ParseString(string* dest);
+  bool ParseNumber(Node* dest);
+  bool ParseArray(Node* dest, unsigned depth);
+  bool ParseObject(Node* dest, unsigned depth);
+
+  JsonDoc* doc_;
+  string_view text_;
+  size_t pos_ = 0;
+};
+
+bool JsonDoc::Parser::ParseValue(Node* dest, unsigned depth) {
+  SkipSpace();
+  if (pos_ == text_.size() || depth > kMaxDepth)
+    return false;
+
+  switch (text_[pos_]) {
+    case 'n':
+      return ParseLiteral("null");
+    case 't':
+      if (!ParseLiteral("true"))
+        return false;
+      dest->type = BOOL;
+      dest->bval = true;
+      return true;
+    case 'f':
+      if (!ParseLiteral("false"))
+        return false;
+      dest->type = BOOL;
+      dest->bval = false;
+      return true;
+    case '"': {
+      string str;
+      if (!ParseString(&str))
+        return false;
+      doc_->SetString(str, dest);
+      return true;
+    }
+    case '[':
+      return ParseArray(dest, depth);
+    case '{':
+      return ParseObject(dest, depth);
+  }
+  return ParseNumber(dest);
+}
+
+bool JsonDoc::Parser::ParseHex4(uint32_t* dest) {
+  if (text_.size() - pos_ < 4)
+    return false;
+
+  uint32_t res = 0;
+  for (unsigned i = 0; i < 4; ++i) {
+    char c = text_[pos_++];
+    res <<= 4;
+    if (IsDigit(c))
+      res |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      res |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      res |= c - 'A' + 10;
+    else
+      return false;
+  }
+  *dest = res;
+  return true;
+}
+
+bool JsonDoc::Parser::ParseString(string* dest) {
+  ++pos_;  // the opening quote.
+
+  while (true) {
+    size_t end = text_.find_first_of("\"\\", pos_);
+    if (end == string_view::npos)
+      return false;
+
+    string_view chunk = text_.substr(pos_, end - pos_);
+    if (any_of(chunk.begin(), chunk.end(), [](char c) { return uint8_t(c) < 0x20; }))
+      return false;
+    dest->append(chunk);
+    pos_ = end + 1;
+
+    if (text_[end] == '"')
+      return true;
+
+    if (pos_ == text_.size())
+      return false;
+
+    char c = text_[pos_++];
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        dest->push_back(c);
+        break;
+      case 'b':
+        dest->push_back('\b');
+        break;
+      case 'f':
+        dest->push_back('\f');
+        break;
+      case 'n':
+        dest->push_back('\n');
+        break;
+      case 'r':
+        dest->push_back('\r');
+        break;
+      case 't':
+        dest->push_back('\t');
+        break;
+      case 'u': {
+        uint32_t cp;
+        if (!ParseHex4(&cp))
+          return false;
+
+        if (cp >= 0xD800 && cp < 0xDC00) {  // a high surrogate, followed by a low one.
+          uint32_t low;
+          if (!ParseLiteral("\\u") || !ParseHex4(&low) || low < 0xDC00 || low >= 0xE000)
+            return false;
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        } else if (cp >= 0xDC00 && cp < 0xE000) {
+          return false;
+        }
+        AppendUtf8(cp, dest);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+}
+
+bool JsonDoc::Parser::ParseNumber(Node* dest) {
+  size_t start = pos_;
+  bool is_int = true;
+
+  auto skip_digits = [this] {
+    size_t begin = pos_;
+    while (pos_ < text_.size() && IsDigit(text_[pos_]))
+      ++pos_;
+    return pos_ > begin;
+  };
+
+  if (pos_ < text_.size() && text_[pos_] == '-')
+    ++pos_;
+
+  // No leading zeroes, as in the json grammar.
+  if (pos_ < text_.size() && text_[pos_] == '0') {
+    ++pos_;
+  } else if (!skip_digits()) {
+    return false;
+  }
+
+  if (pos_ < text_.size() && text_[pos_] == '.') {
+    ++pos_;
+    is_int = false;
+    if (!skip_digits())
+      return false;
+  }
+
+  if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+    ++pos_;
+    is_int = false;
+    if (pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-'))
+      ++pos_;
+    if (!skip_digits())
+      return false;
+  }
+
+  string_view num = text_.substr(start, pos_ - start);
+  if (is_int && absl::SimpleAtoi(num, &dest->ival)) {
+    dest->type = INT;
+    return true;
+  }
+
+  // The integers that overflow int64 become doubles.
+  double dval;
+  if (!absl::SimpleAtod(num, &dval) || !isfinite(dval))
+    return false;
+  dest->type = DOUBLE;
+  dest->dval = dval;
+  return true;
+}
+
+bool JsonDoc::Parser::ParseArray(Node* dest, unsigned depth) {
+  ++pos_;
+  dest->type = ARRAY;
+
+  if (!Consume(']')) {
+    do {
+      if (!ParseValue(doc_->AddItem(dest), depth + 1))
+        return false;
+    } while (Consume(','));
+
+    if (!Consume(']'))
+      return false;
+  }
+
+  doc_->Fit(dest, sizeof(Node));
+  return true;
+}
+
+bool JsonDoc::Parser::ParseObject(Node* dest, unsigned depth) {
+  ++pos_;
+  dest->type = OBJECT;
+
+  if (!Consume('}')) {
+    string key;
+    do {
+      SkipSpace();
+      key.clear();
+      if (pos_ == text_.size() || text_[pos_] != '"' || !ParseString(&key) || !Consume(':'))
+        return false;
+
+      // The last of the duplicate members wins.
+      Node* value = FindMember(*dest, key);
+      if (value)
+        doc_->Reset(value);
+      else
+        value = doc_->AddMember(dest, key);
+
+      if (!ParseValue(value, depth + 1))
+        return false;
+    } while (Consume(','));
+
+    if (!Consume('}'))
+      return false;
+  }
+
+  doc_->Fit(dest, sizeof(Member));
+  return true;
+}
+
+JsonDoc::~JsonDoc() {
+  Reset(&root_);
+  DCHECK_EQ(0u, malloc_used_);
+}
+
+bool JsonDoc::Parse(string_view text, Node* dest) {
+  DCHECK_EQ(NUL, dest->type);
+
+  Parser parser(this, text);
+  if (parser.ParseValue(dest, 0) && parser.AtEnd())
+    return true;
+
+  Reset(dest);
+  return false;
+}
+
+void JsonDoc::Reset(Node* node) {
+  switch (node->type) {
+    case STRING:
+      if (node->len)
+        Deallocate(node->str, node->len);
+      break;
+    case ARRAY:
+      for (uint32_t i = 0; i < node->len; ++i)
+        Reset(&node->items[i]);
+      if (node->capacity)
+        Deallocate(node->items, node->capacity * sizeof(Node));
+      break;
+    case OBJECT:
+      for (uint32_t i = 0; i < node->len; ++i) {
+        Member& member = node->members[i];
+        if (member.key_len)
+          Deallocate(member.key, member.key_len);
+        Reset(&member.value);
+      }
+      if (node->capacity)
+        Deallocate(node->members, node->capacity * sizeof(Member));
+      break;
+    default:
+      break;
+  }
+  *node = Node{};
+}
+
+auto JsonDoc::AddMember(Node* obj, string_view key) -> Node* {
+  DCHECK_EQ(OBJECT, obj->type);
+  DCHECK(FindMember(*obj, key) == nullptr);
+
+  Grow(obj, sizeof(Member));
+  Member* member = &obj->members[obj->len++];
+  member->key_len = key.size();
+  member->key = nullptr;
+  if (!key.empty()) {
+    member->key = (char*)Allocate(key.size());
+    memcpy(member->key, key.data(), key.size());
+  }
+  new (&member->value) Node{};
+  return &member->value;
+}
+
+auto JsonDoc::AddItem(Node* arr) -> Node* {
+  DCHECK_EQ(ARRAY, arr->type);
+
+  Grow(arr, sizeof(Node));
+  Node* item = &arr->items[arr->len++];
+  new (item) Node{};
+  return item;
+}
+
+auto JsonDoc::FindMember(const Node& obj, string_view key) -> Node* {
+  DCHECK_EQ(OBJECT, obj.type);
+
+  for (uint32_t i = 0; i < obj.len; ++i) {
+    if (obj.members[i].Key() == key)
+      return &obj.members[i].value;
+  }
+  return nullptr;
+}
+
+void JsonDoc::Serialize(const Node& node, string* dest) {
+  switch (node.type) {
+    case NUL:
+      dest->append("null");
+      break;
+    case BOOL:
+      dest->append(node.bval ? "true" : "false");
+      break;
+    case INT:
+      dest->append(to_string(node.ival));
+      break;
+    case DOUBLE:
+      AppendDouble(node.dval, dest);
+      break;
+    case STRING:
+      AppendString(node.Str(), dest);
+      break;
+    case ARRAY:
+      dest->push_back('[');
+      for (uint32_t i = 0; i < node.len; ++i) {
+        if (i)
+          dest->push_back(',');
+        Serialize(node.items[i], dest);
+      }
+      dest->push_back(']');
+      break;
+    case OBJECT:
+      dest->push_back('{');
+      for (uint32_t i = 0; i < node.len; ++i) {
+        if (i)
+          dest->push_back(',');
+        AppendString(node.members[i].Key(), dest);
+        dest->push_back(':');
+        Serialize(node.members[i].value, dest);
+      }
+      dest->push_back('}');
+      break;
+  }
+}
+
+void JsonDoc::SerializeString(string_view str, string* dest) {
+  AppendString(str, dest);
+}
+
+void* JsonDoc::Allocate(size_t size) {
+  malloc_used_ += size;
+  return mr_->allocate(size, alignof(Member));
+}
+
+void JsonDoc::Deallocate(void* ptr, size_t size) {
+  malloc_used_ -= size;
+  mr_->deallocate(ptr, size, alignof(Member));
+}
+
+void JsonDoc::Grow(Node* node, size_t elem_size) {
+  if (node->len < node->capacity)
+    return;
+
+  uint32_t capacity = max(kMinCapacity, node->capacity * 2);
+  void* ptr = Allocate(capacity * elem_size);
+  if (node->capacity) {
+    memcpy(ptr, node->items, node->len * elem_size);
+    Deallocate(node->items, node->capacity * elem_size);
+  }
+  node->items = (Node*)ptr;
+  node->capacity = capacity;
+}
+
+void JsonDoc::Fit(Node* node, size_t elem_size) {
+  if (node->len == node->capacity)
+    return;
+
+  void* ptr = nullptr;
+  if (node->len) {
+    ptr = Allocate(node->len * elem_size);
+    memcpy(ptr, node->items, node->len * elem_size);
+  }
+  Deallocate(node->items, node->capacity * elem_size);
+  node->items = (Node*)ptr;
+  node->capacity = node->len;
+}
+
+void JsonDoc::SetString(string_view str, Node* dest) {
+  dest->type = STRING;
+  dest->len = str.size();
+  dest->str = nullptr;
+  if (!str.empty()) {
+    dest->str = (char*)Allocate(str.size());
+    memcpy(dest->str, str.data(), str.size());
+  }
+}
+
+bool JsonPath::Parse(string_view path) {
+  segments_.clear();
+  legacy_ = path.empty() || path[0] != '$';
+
+  size_t pos = legacy_ ? 0 : 1;
+  if (legacy_) {
+    if (path.empty())
+      return false;
+    if (path == ".")
+      return true;
+  }
+
+  // Reads a member name that is not quoted, which ends with the next segment.
+  auto read_name = [&](string* dest) {
+    size_t end = min(path.find_first_of(".[", pos), path.size());
+    if (end == pos)
+      return false;
+    dest->assign(path.substr(pos, end - pos));
+    pos = end;
+    return true;
+  };
+
+  // Reads a bracketed segment, where pos is after the opening bracket.
+  auto read_bracket = [&](Segment* dest) {
+    if (pos == path.size())
+      return false;
+
+    char c = path[pos];
+    if (c == '\'' || c == '"') {
+      dest->type = MEMBER;
+      for (++pos; pos < path.size() && path[pos] != c; ++pos) {
+        if (path[pos] == '\\' && pos + 1 < path.size())
+          ++pos;
+        dest->name.push_back(path[pos]);
+      }
+      if (pos == path.size())
+        return false;
+      ++pos;
+    } else if (c == '*') {
+      dest->type = WILDCARD;
+      ++pos;
+    } else {
+      size_t end = path.find(']', pos);
+      if (end == string_view::npos || !absl::SimpleAtoi(path.substr(pos, end - pos), &dest->index))
+        return false;
+      dest->type = INDEX;
+      pos = end;
+    }
+
+    if (pos == path.size() || path[pos] != ']')
+      return false;
+    ++pos;
+    return true;
+  };
+
+  // A legacy path may omit the dot of its first member.
+  if (legacy_ && path[0] != '.' && path[0] != '[') {
+    Segment& segment = segments_.emplace_back();
+    segment.type = MEMBER;
+    if (!read_name(&segment.name))
+      return false;
+  }
+
+  while (pos < path.size()) {
+    Segment& segment = segments_.emplace_back();
+    char c = path[pos++];
+
+    if (c == '[') {
+      if (!read_bracket(&segment))
+        return false;
+      continue;
+    }
+
+    if (c != '.' || pos == path.size())
+      return false;
+
+    bool descent = path[pos] == '.';
+    if (descent && ++pos == path.size())
+      return false;
+
+    if (path[pos] == '*') {
+      segment.type = WILDCARD;
+      ++pos;
+    } else if (descent && path[pos] == '[') {
+      ++pos;
+      if (!read_bracket(&segment) || segment.type == INDEX)
+        return false;
+    } else {
+      segment.type = MEMBER;
+      if (!read_name(&segment.name))
+        return false;
+    }
+
+    if (descent)
+      segment.type = segment.type == MEMBER ? DESCENT_MEMBER : DESCENT_WILDCARD;
+  }
+  return true;
+}
+
+auto JsonPath::Evaluate(JsonDoc::Node* root) const -> vector<Match> {
+  vector<Match> matches{Match{root, 0}}, next;
+
+  for (const Segment& segment : segments_) {
+    next.clear();
+    for (const Match& match : matches) {
+      if (segment.type == DESCENT_MEMBER || segment.type == DESCENT_WILDCARD)
+        MatchDescent(segment, match.node, match.depth, &next);
+      else
+        MatchChildren(segment, match.node, match.depth, &next);
+    }
+
+    matches.swap(next);
+    if (matches.empty())
+      break;
+  }
+  return matches;
+}
+
+vector<size_t> JsonPath::SortByDepth(const vector<Match>& matches) {
+  vector<size_t> res(matches.size());
+  iota(res.begin(), res.end(), 0);
+  stable_sort(res.begin(), res.end(),
+              [&](size_t a, size_t b) { return matches[a].depth > matches[b].depth; });
+  return res;
+}
+
+bool JsonPath::SplitLastMember(JsonPath* parent, string* name) const {
+  if (segments_.empty() || segments_.back().type != MEMBER)
+    return false;
+
+  parent->segments_.assign(segments_.begin(), segments_.end() - 1);
+  parent->legacy_ = legacy_;
+  *name = segments_.back().name;
+  return true;
+}
+
+void JsonPath::MatchChildren(const Segment& segment, JsonDoc::Node* node, unsigned depth,
+                             vector<Match>* dest) {
+  using Node = JsonDoc::Node;
+
+  switch (segment.type) {
+    case MEMBER:
+    case DESCENT_MEMBER:
+      if (node->type == JsonDoc::OBJECT) {
+        Node* value = JsonDoc::FindMember(*node, segment.name);
+        if (value)
+          dest->push_back(Match{value, depth + 1});
+      }
+      break;
+    case INDEX:
+      if (node->type == JsonDoc::ARRAY) {
+        int64_t index = segment.index < 0 ? segment.index + node->len : segment.index;
+        if (index >= 0 && index < node->len)
+          dest->push_back(Match{&node->items[index], depth + 1});
+      }
+      break;
+    case WILDCARD:
+    case DESCENT_WILDCARD:
+      if (node->type == JsonDoc::ARRAY) {
+        for (uint32_t i = 0; i < node->len; ++i)
+          dest->push_back(Match{&node->items[i], depth + 1});
+      } else if (node->type == JsonDoc::OBJECT) {
+        for (uint32_t i = 0; i < node->len; ++i)
+          dest->push_back(Match{&node->members[i].value, depth + 1});
+      }
+      break;
+  }
+}
+
+void JsonPath::MatchDescent(const Segment& segment, JsonDoc::Node* node, unsigned depth,
+                            vector<Match>* dest) {
+  MatchChildren(segment, node, depth, dest);
+
+  if (node->type == JsonDoc::ARRAY) {
+    for (uint32_t i = 0; i < node->len; ++i)
+      MatchDescent(segment, &node->items[i], depth + 1, dest);
+  } else if (node->type == JsonDoc::OBJECT) {
+    for (uint32_t i = 0; i < node->len; ++i)
+      MatchDescent(segment, &node->members[i].value, depth + 1, dest);
+  }
+}
+
+}  // namespace dfly
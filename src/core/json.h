@@ -0,0 +1,184 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// A parsed json document, the value of the OBJ_JSON type. A value of the document is a node of
+// 24 bytes, whose string, array or object is a separate allocation of the memory resource of the
+// document. The members of an object keep their insertion order and are looked up linearly, as
+// the objects of the documents are usually small. The document is updated in place, so that a
+// change of a value touches neither the rest of the document nor its text.
+//
+// Not thread-safe.
+class JsonDoc {
+ public:
+  enum Type : uint8_t { NUL, BOOL, INT, DOUBLE, STRING, ARRAY, OBJECT };
+
+  struct Member;
+
+  struct Node {
+    Type type = NUL;
+    uint32_t len = 0;       // of a string, an array or an object.
+    uint32_t capacity = 0;  // of an array or an object.
+    union {
+      bool bval;
+      int64_t ival;
+      double dval;
+      char* str;
+      Node* items;
+      Member* members;
+    };
+
+    Node() : ival(0) {
+    }
+
+    std::string_view Str() const {
+      return std::string_view{str, len};
+    }
+
+    bool IsNumber() const {
+      return type == INT || type == DOUBLE;
+    }
+  };
+
+  struct Member {
+    char* key;
+    uint32_t key_len;
+    Node value;
+
+    std::string_view Key() const {
+      return std::string_view{key, key_len};
+    }
+  };
+
+  // The nesting limit of the parser, which is recursive.
+  static constexpr unsigned kMaxDepth = 128;
+
+  explicit JsonDoc(std::pmr::memory_resource* mr) : mr_(mr) {
+  }
+
+  ~JsonDoc();
+
+  JsonDoc(const JsonDoc&) = delete;
+  void operator=(const JsonDoc&) = delete;
+
+  Node* root() {
+    return &root_;
+  }
+
+  const Node* root() const {
+    return &root_;
+  }
+
+  // Parses text into dest, a null node of the document. Returns false if text is not a single
+  // json value, in which case dest stays null.
+  bool Parse(std::string_view text, Node* dest);
+
+  // Frees the memory of node, which becomes null.
+  void Reset(Node* node);
+
+  // Returns the value of the new member key of obj, a null node. Invalidates the pointers to the
+  // other members of obj. Requires: obj is an object without the member key.
+  Node* AddMember(Node* obj, std::string_view key);
+
+  // Returns the new last item of arr, a null node. Invalidates the pointers to the other items.
+  Node* AddItem(Node* arr);
+
+  // Returns the value of the member key of obj or nullptr. Requires: obj is an object.
+  static Node* FindMember(const Node& obj, std::string_view key);
+
+  // Appends the compact text of node to dest.
+  static void Serialize(const Node& node, std::string* dest);
+
+  // Appends str as a quoted json string to dest.
+  static void SerializeString(std::string_view str, std::string* dest);
+
+  // The bytes allocated by the document.
+  size_t MallocUsed() const {
+    return malloc_used_;
+  }
+
+ private:
+  class Parser;
+
+  void* Allocate(size_t size);
+  void Deallocate(void* ptr, size_t size);
+
+  // Makes room for one more item or member of node.
+  void Grow(Node* node, size_t elem_size);
+
+  // Releases the unused capacity of an array or an object.
+  void Fit(Node* node, size_t elem_size);
+
+  void SetString(std::string_view str, Node* dest);
+
+  std::pmr::memory_resource* mr_;
+  Node root_;
+  size_t malloc_used_ = 0;
+};
+
+// A path into a json document: either a JSONPath, which starts with $ and may match any number of
+// values, or a legacy path of RedisJSON v1, e.g. ".a.b[0]" or "a", which is expected to match a
+// single value. Supports the child members .name and ['name'], the indices [i], which are counted
+// from the end when negative, the wildcards .* and [*] and the recursive descent ..name and ..*.
+class JsonPath {
+ public:
+  struct Match {
+    JsonDoc::Node* node;
+    unsigned depth;  // of the node in the document, the root is 0.
+  };
+
+  // Returns false if path is not a valid path.
+  bool Parse(std::string_view path);
+
+  bool legacy() const {
+    return legacy_;
+  }
+
+  bool IsRoot() const {
+    return segments_.empty();
+  }
+
+  // Returns the values that the path matches, in the order of the path. A write that changes the
+  // layout of a node, e.g. appends to an array, should go over the matches from the deepest ones,
+  // see SortByDepth, so that it does not move the matches that it has yet to visit.
+  std::vector<Match> Evaluate(JsonDoc::Node* root) const;
+
+  // Stable sorts the indices of matches from the deepest match.
+  static std::vector<size_t> SortByDepth(const std::vector<Match>& matches);
+
+  // If the last segment of the path is a member name, returns true and sets parent to the rest of
+  // the path and name to the member, which a write creates in the parents that miss it.
+  bool SplitLastMember(JsonPath* parent, std::string* name) const;
+
+ private:
+  enum SegmentType : uint8_t { MEMBER, INDEX, WILDCARD, DESCENT_MEMBER, DESCENT_WILDCARD };
+
+  struct Segment {
+    SegmentType type;
+    int64_t index = 0;
+    std::string name;
+  };
+
+  // Appends the children of node that the segment matches to dest, which are of depth + 1.
+  static void MatchChildren(const Segment& segment, JsonDoc::Node* node, unsigned depth,
+                            std::vector<Match>* dest);
+
+  // Applies the segment to node and to all of its descendants, in the document order.
+  static void MatchDescent(const Segment& segment, JsonDoc::Node* node, unsigned depth,
+                           std::vector<Match>* dest);
+
+  std::vector<Segment> segments_;
+  bool legacy_ = false;
+};
+
+}  // namespace dfly
@@ -0,0 +1,136 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/json.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class JsonTest : public ::testing::Test {
+ protected:
+  // Returns the compact text of the parsed text, or "error".
+  string Reformat(string_view text) {
+    JsonDoc doc(mr_);
+    if (!doc.Parse(text, doc.root()))
+      return "error";
+    string res;
+    JsonDoc::Serialize(*doc.root(), &res);
+    return res;
+  }
+
+  // Returns the compact texts of the matches of path in doc_.
+  vector<string> Get(string_view path) {
+    JsonPath jp;
+    if (!jp.Parse(path))
+      return {"error"};
+
+    vector<string> res;
+    for (const JsonPath::Match& match : jp.Evaluate(doc_.root())) {
+      JsonDoc::Serialize(*match.node, &res.emplace_back());
+    }
+    return res;
+  }
+
+  pmr::memory_resource* mr_ = pmr::get_default_resource();
+  JsonDoc doc_{mr_};
+};
+
+TEST_F(JsonTest, Parse) {
+  EXPECT_EQ("null", Reformat(" null "));
+  EXPECT_EQ("[true,false,null]", Reformat("[ true , false,null ]"));
+  EXPECT_EQ("{\"a\":1,\"b\":[],\"c\":{}}", Reformat("{\"a\": 1, \"b\": [], \"c\": {}}"));
+  EXPECT_EQ("-12", Reformat("-12"));
+  EXPECT_EQ("1.5", Reformat("1.5"));
+  EXPECT_EQ("2.0", Reformat("2.0"));
+  EXPECT_EQ("0.1", Reformat("1e-1"));
+  EXPECT_EQ("1e+21", Reformat("1e21"));
+  EXPECT_EQ("9223372036854775807", Reformat("9223372036854775807"));
+  EXPECT_EQ("9223372036854776000.0", Reformat("9223372036854775808"));
+
+  // The insertion order of the members is kept, the last of the duplicates wins.
+  EXPECT_EQ("{\"z\":3,\"a\":2}", Reformat("{\"z\":1,\"a\":2,\"z\":3}"));
+
+  EXPECT_EQ("\"a\\\"b\\\\c\\n\\u0001\"", Reformat("\"a\\\"b\\\\c\\n\\u0001\""));
+  EXPECT_EQ("\"\xc3\xa9\xf0\x9f\x98\x80/\"", Reformat("\"\\u00e9\\ud83d\\ude00\\/\""));
+
+  for (string_view bad : {"", "nul", "[1,]", "{\"a\"}", "{a:1}", "01", "1.", "-", "\"abc",
+                          "\"\\x\"", "\"\\ud83d\"", "[1] 2", "1e400", "\"a\nb\""}) {
+    EXPECT_EQ("error", Reformat(bad)) << bad;
+  }
+
+  string deep(JsonDoc::kMaxDepth + 2, '[');
+  deep.append(JsonDoc::kMaxDepth + 2, ']');
+  EXPECT_EQ("error", Reformat(deep));
+}
+
+TEST_F(JsonTest, Memory) {
+  ASSERT_TRUE(doc_.Parse("{\"name\":\"a long enough name\",\"arr\":[1,2,3]}", doc_.root()));
+  size_t used = doc_.MallocUsed();
+  EXPECT_EQ(2 * sizeof(JsonDoc::Member) + 3 * sizeof(JsonDoc::Node) + 4 + 18 + 3, used);
+
+  JsonDoc::Node* arr = JsonDoc::FindMember(*doc_.root(), "arr");
+  ASSERT_TRUE(arr);
+  JsonDoc::Node* item = doc_.AddItem(arr);
+  item->type = JsonDoc::INT;
+  item->ival = 4;
+  EXPECT_GT(doc_.MallocUsed(), used);
+
+  string text;
+  JsonDoc::Serialize(*doc_.root(), &text);
+  EXPECT_EQ("{\"name\":\"a long enough name\",\"arr\":[1,2,3,4]}", text);
+
+  doc_.Reset(doc_.root());
+  EXPECT_EQ(0u, doc_.MallocUsed());
+}
+
+TEST_F(JsonTest, Path) {
+  ASSERT_TRUE(doc_.Parse(R"({"a":{"b":1,"c":[1,2,3]},"b":{"b":[true]},"d":"x"})", doc_.root()));
+
+  EXPECT_THAT(Get("$"),
+              testing::ElementsAre(R"({"a":{"b":1,"c":[1,2,3]},"b":{"b":[true]},"d":"x"})"));
+  EXPECT_THAT(Get("$.a.b"), testing::ElementsAre("1"));
+  EXPECT_THAT(Get("$['a'][\"c\"][1]"), testing::ElementsAre("2"));
+  EXPECT_THAT(Get("$.a.c[-1]"), testing::ElementsAre("3"));
+  EXPECT_THAT(Get("$.a.c[3]"), testing::ElementsAre());
+  EXPECT_THAT(Get("$.a.c[*]"), testing::ElementsAre("1", "2", "3"));
+  EXPECT_THAT(Get("$.*.b"), testing::ElementsAre("1", "[true]"));
+  EXPECT_THAT(Get("$..b"), testing::ElementsAre(R"({"b":[true]})", "1", "[true]"));
+  EXPECT_THAT(Get("$.d.e"), testing::ElementsAre());
+  EXPECT_THAT(Get("$..[*]"), testing::SizeIs(10));
+
+  // The legacy paths.
+  EXPECT_THAT(Get("."), testing::SizeIs(1));
+  EXPECT_THAT(Get(".a.c[0]"), testing::ElementsAre("1"));
+  EXPECT_THAT(Get("a.b"), testing::ElementsAre("1"));
+
+  for (string_view bad : {"", "$.", "$a", "$[", "$[x]", "$['a'", "$..", "$..[0]", "a..", "$.a["}) {
+    EXPECT_THAT(Get(bad), testing::ElementsAre("error")) << bad;
+  }
+}
+
+TEST_F(JsonTest, SortByDepth) {
+  ASSERT_TRUE(doc_.Parse(R"({"a":{"a":{"a":1}},"b":{"a":2}})", doc_.root()));
+
+  JsonPath jp;
+  ASSERT_TRUE(jp.Parse("$..a"));
+  vector<JsonPath::Match> matches = jp.Evaluate(doc_.root());
+  ASSERT_EQ(4u, matches.size());
+  EXPECT_THAT(JsonPath::SortByDepth(matches), testing::ElementsAre(2, 1, 3, 0));
+
+  JsonPath parent;
+  string name;
+  ASSERT_TRUE(jp.Parse("$.b.c"));
+  ASSERT_TRUE(jp.SplitLastMember(&parent, &name));
+  EXPECT_EQ("c", name);
+  EXPECT_EQ(1u, parent.Evaluate(doc_.root()).size());
+
+  ASSERT_TRUE(jp.Parse("$.b[0]"));
+  EXPECT_FALSE(jp.SplitLastMember(&parent, &name));
+}
+
+}  // namespace dfly
@@ -0,0 +1,122 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/lazy_free.h"
+
+extern "C" {
+#include "redis/object.h"
+#include "redis/quicklist.h"
+}
+
+#include <limits>
+
+#include "base/logging.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
+
+namespace dfly {
+using namespace std;
+
+LazyFree::~LazyFree() {
+  size_t budget = numeric_limits<size_t>::max();
+  for (Item& item : items_) {
+    ReleaseSome(&item, &budget);
+  }
+}
+
+size_t LazyFree::FreeCost(const CompactObj& obj) {
+  if (obj.ObjType() == OBJ_STRING || !obj.RObjPtr())
+    return 0;
+
+  return FreeCost(obj.ObjType(), obj.Encoding(), obj.RObjPtr());
+}
+
+size_t LazyFree::FreeCost(unsigned type, unsigned encoding, void* ptr) {
+  switch (type) {
+    case OBJ_LIST:
+      return ((quicklist*)ptr)->len;
+    case OBJ_SET:
+      return encoding == kEncodingStrMap ? ((StringSet*)ptr)->Size() : 0;
+    case OBJ_HASH:
+      return encoding == OBJ_ENCODING_HT ? ((StringMap*)ptr)->Size() : 0;
+    case OBJ_ZSET:
+      return encoding == OBJ_ENCODING_SKIPLIST ? ((SortedMap*)ptr)->Size() : 0;
+  }
+
+  return 0;
+}
+
+void LazyFree::Add(CompactObj* obj) {
+  DCHECK_GT(FreeCost(*obj), 0u);
+
+  Item item{obj->ObjType(), obj->Encoding(), obj->RObjPtr()};
+  pending_cost_ += FreeCost(item.type, item.encoding, item.ptr);
+  items_.push_back(item);
+
+  // The wrapper does not free the detached object.
+  obj->SetRObjPtr(nullptr);
+}
+
+void LazyFree::Step(size_t budget) {
+  while (!items_.empty() && budget > 0) {
+    size_t start = budget;
+    bool done = ReleaseSome(&items_.front(), &budget);
+    pending_cost_ -= min(pending_cost_, start - budget);
+
+    if (!done)
+      break;
+
+    items_.pop_front();
+  }
+
+  if (items_.empty())
+    pending_cost_ = 0;
+}
+
+bool LazyFree::ReleaseSome(Item* item, size_t* budget) {
+  switch (item->type) {
+    case OBJ_LIST: {
+      quicklist* ql = (quicklist*)item->ptr;
+      for (; ql->len > 1 && *budget > 0; --*budget) {
+        quicklistDelRange(ql, 0, ql->head->count);
+      }
+      if (ql->len > 1)
+        return false;
+
+      quicklistRelease(ql);
+      break;
+    }
+    case OBJ_SET: {
+      StringSet* ss = (StringSet*)item->ptr;
+      if (!ss->ClearStep(&item->cursor, budget))
+        return false;
+
+      delete ss;
+      break;
+    }
+    case OBJ_HASH: {
+      StringMap* sm = (StringMap*)item->ptr;
+      if (!sm->ClearStep(&item->cursor, budget))
+        return false;
+
+      delete sm;
+      break;
+    }
+    case OBJ_ZSET: {
+      SortedMap* sm = (SortedMap*)item->ptr;
+      if (!sm->ClearStep(&item->cursor, budget))
+        return false;
+
+      delete sm;
+      break;
+    }
+    default:
+      LOG(DFATAL) << "Unexpected type " << item->type;
+  }
+
+  return true;
+}
+
+}  // namespace dfly
@@ -0,0 +1,65 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+
+#include "core/compact_object.h"
+
+namespace dfly {
+
+// Releases big containers in bounded steps on behalf of the thread that owns them, so that
+// deleting a set of millions of members does not stall the other requests of that thread.
+// Only the encodings that consist of many allocations are released incrementally:
+// lists and large sets, hashes and sorted sets. Not thread-safe.
+class LazyFree {
+ public:
+  LazyFree() = default;
+  LazyFree(const LazyFree&) = delete;
+  void operator=(const LazyFree&) = delete;
+
+  // Releases the pending objects at once.
+  ~LazyFree();
+
+  // Returns the number of allocations that releasing the value of obj takes, i.e. the number of
+  // its elements for incrementally released encodings and 0 for the rest.
+  static size_t FreeCost(const CompactObj& obj);
+
+  // Detaches the inner object of obj and queues it for the release. obj keeps its metadata and
+  // can be overwritten or destroyed right away.
+  // Requires: FreeCost(*obj) > 0.
+  void Add(CompactObj* obj);
+
+  // Releases about budget elements of the queued objects.
+  void Step(size_t budget);
+
+  size_t pending_objects() const {
+    return items_.size();
+  }
+
+  // Number of elements of the queued objects that are not released yet.
+  size_t pending_cost() const {
+    return pending_cost_;
+  }
+
+ private:
+  struct Item {
+    unsigned type;
+    unsigned encoding;
+    void* ptr;
+    unsigned long cursor = 0;
+  };
+
+  static size_t FreeCost(unsigned type, unsigned encoding, void* ptr);
+
+  // Releases up to *budget elements of item and decreases it accordingly.
+  // Returns true if the item was released entirely.
+  static bool ReleaseSome(Item* item, size_t* budget);
+
+  std::deque<Item> items_;
+  size_t pending_cost_ = 0;
+};
+
+}  // namespace dfly
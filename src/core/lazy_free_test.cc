@@ -0,0 +1,123 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/lazy_free.h"
+
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "core/mi_memory_resource.h"
+#include "core/sorted_map.h"
+#include "core/string_set.h"
+
+extern "C" {
+#include "redis/dict.h"
+#include "redis/object.h"
+#include "redis/quicklist.h"
+#include "redis/redis_aux.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+using namespace std;
+
+class LazyFreeTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    InitRedisTables();  // to initialize server struct.
+
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+    SmallString::InitThreadLocal(tlh);
+    CompactObj::InitThreadLocal(pmr::get_default_resource());
+  }
+
+  // Releases the queued objects by steps of the given budget. Returns the number of steps.
+  unsigned ReleaseAll(size_t budget) {
+    unsigned steps = 0;
+    while (lazy_free_.pending_objects() > 0) {
+      lazy_free_.Step(budget);
+      ++steps;
+    }
+    return steps;
+  }
+
+  LazyFree lazy_free_;
+};
+
+constexpr unsigned kNum = 1000;
+
+TEST_F(LazyFreeTest, Set) {
+  StringSet* ss = new StringSet;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss->Add(absl::StrCat("member", i));
+  }
+
+  CompactObj cobj;
+  cobj.InitRobj(OBJ_SET, kEncodingStrMap, ss);
+  cobj.SetExpire(true);
+  ASSERT_EQ(kNum, LazyFree::FreeCost(cobj));
+
+  lazy_free_.Add(&cobj);
+  EXPECT_EQ(nullptr, cobj.RObjPtr());
+  EXPECT_TRUE(cobj.HasExpire());
+  EXPECT_EQ(1u, lazy_free_.pending_objects());
+  EXPECT_EQ(kNum, lazy_free_.pending_cost());
+
+  lazy_free_.Step(100);
+  EXPECT_EQ(1u, lazy_free_.pending_objects());
+  EXPECT_EQ(kNum - 100, lazy_free_.pending_cost());
+
+  EXPECT_GT(ReleaseAll(100), 1u);
+  EXPECT_EQ(0u, lazy_free_.pending_cost());
+}
+
+TEST_F(LazyFreeTest, List) {
+  quicklist* ql = quicklistCreate();
+  quicklistSetOptions(ql, 2, 0);  // 2 entries per node.
+  for (unsigned i = 0; i < kNum; ++i) {
+    string val = "val" + to_string(i);
+    quicklistPushTail(ql, val.data(), val.size());
+  }
+
+  CompactObj cobj;
+  cobj.InitRobj(OBJ_LIST, OBJ_ENCODING_QUICKLIST, ql);
+  size_t cost = LazyFree::FreeCost(cobj);
+  EXPECT_EQ(ql->len, cost);
+  EXPECT_GT(cost, 1u);
+
+  lazy_free_.Add(&cobj);
+  EXPECT_GT(ReleaseAll(10), 1u);
+}
+
+TEST_F(LazyFreeTest, Zset) {
+  SortedMap* sm = new SortedMap;
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm->Insert(i, absl::StrCat("member", i));
+  }
+
+  CompactObj cobj;
+  cobj.InitRobj(OBJ_ZSET, OBJ_ENCODING_SKIPLIST, sm);
+  ASSERT_EQ(kNum, LazyFree::FreeCost(cobj));
+
+  lazy_free_.Add(&cobj);
+  lazy_free_.Step(100);  // releases the tree and the first entries.
+  EXPECT_EQ(1u, lazy_free_.pending_objects());
+  EXPECT_EQ(kNum - 100, lazy_free_.pending_cost());
+  EXPECT_GT(ReleaseAll(100), 1u);
+}
+
+TEST_F(LazyFreeTest, SmallEncodings) {
+  CompactObj cobj;
+  cobj.SetString("val");
+  EXPECT_EQ(0u, LazyFree::FreeCost(cobj));
+
+  robj* obj = createIntsetObject();
+  cobj.ImportRObj(obj);
+  EXPECT_EQ(0u, LazyFree::FreeCost(cobj));
+}
+
+}  // namespace dfly
@@ -0,0 +1,70 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/page_usage.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+void PageUsage::Build(const mi_heap_t* heap, float threshold) {
+  pages_.clear();
+  threshold_ = threshold;
+  committed_ = used_ = 0;
+
+  mi_heap_visit_blocks(heap, false /* visit only areas */, &PageUsage::VisitArea, this);
+
+  sort(pages_.begin(), pages_.end(),
+       [](const Page& l, const Page& r) { return l.start < r.start; });
+
+  DVLOG(1) << "PageUsage: " << pages_.size() << " underutilized pages, committed " << committed_
+           << ", used " << used_;
+}
+
+bool PageUsage::VisitArea(const mi_heap_t* heap, const mi_heap_area_t* area, void* block,
+                          size_t block_size, void* arg) {
+  PageUsage* me = reinterpret_cast<PageUsage*>(arg);
+
+  // mimalloc exports used in blocks instead of bytes.
+  size_t used = area->used * block_size;
+  me->used_ += used;
+  me->committed_ += area->committed;
+
+  // Pages of a single block are either full or freed.
+  if (area->reserved < block_size * 2 || area->used == 0)
+    return true;
+
+  float utilization = float(used) / area->reserved;
+  if (utilization < me->threshold_) {
+    uintptr_t start = reinterpret_cast<uintptr_t>(area->blocks);
+    me->pages_.push_back(Page{start, start + area->reserved, utilization});
+  }
+
+  return true;  // continue iteration
+}
+
+auto PageUsage::Find(const void* p) const -> const Page* {
+  uintptr_t ptr = reinterpret_cast<uintptr_t>(p);
+  auto it = upper_bound(pages_.begin(), pages_.end(), ptr,
+                        [](uintptr_t val, const Page& page) { return val < page.start; });
+  if (it == pages_.begin())
+    return nullptr;
+
+  --it;
+  return ptr < it->end ? &*it : nullptr;
+}
+
+bool PageUsage::IsBetterPage(const void* from, const void* to) const {
+  const Page* dest = Find(to);
+  if (!dest)
+    return true;
+
+  const Page* src = Find(from);
+  return src && src != dest && dest->utilization > src->utilization;
+}
+
+}  // namespace dfly
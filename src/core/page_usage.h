@@ -0,0 +1,66 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <mimalloc.h>
+
+#include <vector>
+
+namespace dfly {
+
+// Snapshot of the mimalloc pages of a heap that are utilized below a given ratio.
+// Used by the active defragmentation: a block that resides in such a page is moved if the
+// newly allocated block lands in a fuller page. Once all the blocks of a sparse page are moved
+// away, mimalloc returns that page.
+//
+// The snapshot is not updated by allocations, hence it becomes stale over time and should be
+// rebuilt on each defragmentation cycle. Stale data affects only the efficiency of the moves.
+class PageUsage {
+ public:
+  // Visits all the pages of the heap. Takes time proportional to the number of pages.
+  void Build(const mi_heap_t* heap, float threshold);
+
+  // Returns true if p resides in one of the underutilized pages.
+  bool IsUnderutilized(const void* p) const {
+    return Find(p) != nullptr;
+  }
+
+  // Returns true if moving the block from to the block to improves the utilization,
+  // i.e. to does not reside in an underutilized page or its page is fuller than the page of from.
+  bool IsBetterPage(const void* from, const void* to) const;
+
+  // Memory that is committed by the pages of the heap.
+  size_t committed() const {
+    return committed_;
+  }
+
+  // Memory that is used by the allocated blocks of the heap.
+  size_t used() const {
+    return used_;
+  }
+
+  size_t underutilized_pages() const {
+    return pages_.size();
+  }
+
+ private:
+  struct Page {
+    uintptr_t start;
+    uintptr_t end;
+    float utilization;
+  };
+
+  const Page* Find(const void* p) const;
+
+  static bool VisitArea(const mi_heap_t* heap, const mi_heap_area_t* area, void* block,
+                        size_t block_size, void* arg);
+
+  std::vector<Page> pages_;  // sorted by start.
+  float threshold_ = 0;
+  size_t committed_ = 0;
+  size_t used_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,70 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/page_usage.h"
+
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+class PageUsageTest : public ::testing::Test {
+ protected:
+  void SetUp() final {
+    heap_ = mi_heap_new();
+  }
+
+  void TearDown() final {
+    mi_heap_destroy(heap_);
+  }
+
+  mi_heap_t* heap_;
+  PageUsage page_usage_;
+};
+
+TEST_F(PageUsageTest, Sparse) {
+  constexpr unsigned kNum = 100000;
+  vector<void*> blocks(kNum);
+  for (unsigned i = 0; i < kNum; ++i) {
+    blocks[i] = mi_heap_malloc(heap_, 64);
+  }
+
+  page_usage_.Build(heap_, 0.5);
+  EXPECT_GE(page_usage_.used(), kNum * 64);
+  EXPECT_GE(page_usage_.committed(), page_usage_.used());
+
+  // Full pages are not underutilized.
+  EXPECT_FALSE(page_usage_.IsUnderutilized(blocks[kNum / 2]));
+
+  // Leave every 8th block.
+  for (unsigned i = 0; i < kNum; ++i) {
+    if (i % 8) {
+      mi_free(blocks[i]);
+      blocks[i] = nullptr;
+    }
+  }
+
+  page_usage_.Build(heap_, 0.5);
+  EXPECT_GT(page_usage_.underutilized_pages(), 0u);
+  EXPECT_GT(page_usage_.committed(), page_usage_.used() * 4);
+
+  void* sparse = blocks[kNum / 2];
+  EXPECT_TRUE(page_usage_.IsUnderutilized(sparse));
+
+  // Blocks outside of the snapshot are better than the sparse ones.
+  void* other = mi_malloc(64);
+  EXPECT_FALSE(page_usage_.IsUnderutilized(other));
+  EXPECT_TRUE(page_usage_.IsBetterPage(sparse, other));
+  EXPECT_FALSE(page_usage_.IsBetterPage(sparse, sparse));
+  mi_free(other);
+
+  for (void* p : blocks) {
+    mi_free(p);
+  }
+}
+
+}  // namespace dfly
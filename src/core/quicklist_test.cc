@@ -0,0 +1,134 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include <deque>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/quicklist.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class QuickListTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    init_zmalloc_threadlocal(mi_heap_get_backing());
+  }
+
+  void SetUp() override {
+    ql_ = quicklistNew(4, 0);  // 4 entries per node.
+  }
+
+  void TearDown() override {
+    quicklistRelease(ql_);
+  }
+
+  void Push(string_view val, bool head) {
+    if (head) {
+      quicklistPushHead(ql_, (void*)val.data(), val.size());
+      ref_.emplace_front(val);
+    } else {
+      quicklistPushTail(ql_, (void*)val.data(), val.size());
+      ref_.emplace_back(val);
+    }
+  }
+
+  string Get(long index) {
+    quicklistEntry entry;
+    quicklistIter* iter = quicklistGetIteratorEntryAtIdx(ql_, index, &entry);
+    CHECK(iter);
+    quicklistReleaseIterator(iter);
+    if (entry.value)
+      return string(reinterpret_cast<char*>(entry.value), entry.sz);
+    return absl::StrCat(entry.longval);
+  }
+
+  // Checks all the elements by index from both ends.
+  void Verify() {
+    ASSERT_EQ(ref_.size(), quicklistCount(ql_));
+    for (size_t i = 0; i < ref_.size(); ++i) {
+      ASSERT_EQ(ref_[i], Get(i)) << i;
+      ASSERT_EQ(ref_[ref_.size() - 1 - i], Get(-long(i) - 1)) << i;
+    }
+  }
+
+  quicklist* ql_;
+  deque<string> ref_;
+};
+
+TEST_F(QuickListTest, Index) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    Push(absl::StrCat("v", i), i % 3 == 0);
+  }
+  EXPECT_GT(ql_->len, 64u);
+  Verify();
+
+  // Ring buffer: the pops and pushes at the ends keep the index.
+  for (unsigned i = 0; i < kNum * 2; ++i) {
+    Push(absl::StrCat("r", i), false);
+    quicklistDelRange(ql_, 0, 1);
+    ref_.pop_front();
+    ASSERT_EQ(ref_[kNum / 2], Get(kNum / 2));
+  }
+  EXPECT_TRUE(ql_->index);
+  Verify();
+
+  ASSERT_TRUE(quicklistReplaceAtIndex(ql_, 500, "replaced", 8));
+  ref_[500] = "replaced";
+  quicklistDelRange(ql_, 100, 50);
+  ref_.erase(ref_.begin() + 100, ref_.begin() + 150);
+  Verify();
+}
+
+TEST_F(QuickListTest, Random) {
+  mt19937 gen(42);
+  for (unsigned i = 0; i < 500; ++i) {
+    Push(absl::StrCat(i), false);
+  }
+
+  for (unsigned i = 0; i < 5000; ++i) {
+    unsigned op = gen() % 6;
+    if (op < 2 || ref_.size() < 100) {
+      Push(absl::StrCat("p", i), op == 0);
+    } else if (op == 2) {
+      bool head = gen() % 2;
+      quicklistDelRange(ql_, head ? 0 : -1, 1);
+      if (head)
+        ref_.pop_front();
+      else
+        ref_.pop_back();
+    } else if (op == 3) {
+      // Insert in the middle.
+      size_t pos = gen() % ref_.size();
+      quicklistEntry entry;
+      quicklistIter* iter = quicklistGetIteratorEntryAtIdx(ql_, pos, &entry);
+      string val = absl::StrCat("i", i);
+      quicklistInsertBefore(iter, &entry, val.data(), val.size());
+      quicklistReleaseIterator(iter);
+      ref_.insert(ref_.begin() + pos, val);
+    } else if (op == 4) {
+      size_t pos = gen() % ref_.size();
+      long len = gen() % 10 + 1;
+      quicklistDelRange(ql_, pos, len);
+      ref_.erase(ref_.begin() + pos, ref_.begin() + min(ref_.size(), pos + len));
+    } else {
+      size_t pos = gen() % ref_.size();
+      ASSERT_EQ(ref_[pos], Get(pos)) << i;
+    }
+  }
+  Verify();
+}
+
+}  // namespace dfly
@@ -0,0 +1,378 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/roaring_set.h"
+
+#include <cstring>
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+RoaringSet::~RoaringSet() {
+  for (uint32_t i = 0; i < len_; ++i)
+    FreeData(&containers_[i]);
+  zfree(containers_);
+}
+
+bool RoaringSet::Add(int64_t val) {
+  uint64_t enc = Encode(val);
+  uint64_t key = enc >> 16;
+  uint32_t pos = LowerBound(key);
+
+  Container* c = nullptr;
+  if (pos < len_ && containers_[pos].key == key)
+    c = &containers_[pos];
+  else
+    c = InsertContainer(pos, key);
+
+  if (!ContainerAdd(c, uint16_t(enc)))
+    return false;
+
+  ++size_;
+  return true;
+}
+
+bool RoaringSet::Remove(int64_t val) {
+  uint64_t enc = Encode(val);
+  uint32_t pos = LowerBound(enc >> 16);
+  if (pos == len_ || containers_[pos].key != enc >> 16)
+    return false;
+
+  Container* c = &containers_[pos];
+  if (!ContainerRemove(c, uint16_t(enc)))
+    return false;
+
+  --size_;
+  if (c->card == 0)
+    EraseContainer(pos);
+  return true;
+}
+
+bool RoaringSet::Contains(int64_t val) const {
+  uint64_t enc = Encode(val);
+  uint32_t pos = LowerBound(enc >> 16);
+  return pos < len_ && containers_[pos].key == enc >> 16 &&
+         ContainerContains(containers_[pos], uint16_t(enc));
+}
+
+int64_t RoaringSet::Select(size_t rank) const {
+  DCHECK_LT(rank, size_);
+
+  uint32_t i = 0;
+  for (; rank >= containers_[i].card; ++i)
+    rank -= containers_[i].card;
+
+  const Container& c = containers_[i];
+  uint64_t high = c.key << 16;
+  if (c.capacity)
+    return Decode(high | c.array[rank]);
+
+  for (uint32_t w = 0;; ++w) {
+    uint64_t word = c.bitmap[w];
+    unsigned cnt = __builtin_popcountll(word);
+    if (rank >= cnt) {
+      rank -= cnt;
+      continue;
+    }
+
+    for (; rank > 0; --rank)
+      word &= word - 1;
+    return Decode(high | (w * 64 + __builtin_ctzll(word)));
+  }
+}
+
+void RoaringSet::IntersectWith(const RoaringSet& other) {
+  uint32_t out = 0, j = 0;
+  size_ = 0;
+
+  for (uint32_t i = 0; i < len_; ++i) {
+    Container& c = containers_[i];
+    while (j < other.len_ && other.containers_[j].key < c.key)
+      ++j;
+
+    if (j < other.len_ && other.containers_[j].key == c.key)
+      IntersectContainer(&c, other.containers_[j]);
+    else
+      c.card = 0;
+
+    if (c.card == 0) {
+      FreeData(&c);
+      continue;
+    }
+
+    size_ += c.card;
+    containers_[out++] = c;
+  }
+  len_ = out;
+}
+
+void RoaringSet::UnionWith(const RoaringSet& other) {
+  for (uint32_t j = 0; j < other.len_; ++j) {
+    const Container& oc = other.containers_[j];
+    uint32_t pos = LowerBound(oc.key);
+
+    Container* c = nullptr;
+    if (pos < len_ && containers_[pos].key == oc.key)
+      c = &containers_[pos];
+    else
+      c = InsertContainer(pos, oc.key);
+
+    size_ -= c->card;
+    UnionContainer(c, oc);
+    size_ += c->card;
+  }
+}
+
+size_t RoaringSet::MallocUsed() const {
+  size_t res = data_malloc_used_;
+  if (containers_)
+    res += zmalloc_usable_size(containers_);
+  return res;
+}
+
+uint64_t RoaringSet::Scan(uint64_t cursor, size_t count,
+                          const function<void(int64_t)>& cb) const {
+  DCHECK_GT(count, 0u);
+
+  uint64_t next = 0;
+  for (uint32_t i = LowerBound(cursor >> 16); i < len_; ++i) {
+    const Container& c = containers_[i];
+    uint64_t high = c.key << 16;
+    uint32_t from = (c.key == cursor >> 16) ? uint16_t(cursor) : 0;
+
+    bool done = !IterateContainer(c, from, [&](uint16_t low) {
+      if (count == 0) {
+        next = high | low;
+        return false;
+      }
+      cb(Decode(high | low));
+      --count;
+      return true;
+    });
+
+    if (done)
+      return next;
+  }
+  return 0;
+}
+
+bool RoaringSet::ContainerContains(const Container& c, uint16_t low) {
+  if (c.capacity == 0)
+    return (c.bitmap[low / 64] >> (low % 64)) & 1;
+
+  return binary_search(c.array, c.array + c.card, low);
+}
+
+uint32_t RoaringSet::LowerBound(uint64_t key) const {
+  auto it = lower_bound(containers_, containers_ + len_, key,
+                        [](const Container& c, uint64_t key) { return c.key < key; });
+  return it - containers_;
+}
+
+auto RoaringSet::InsertContainer(uint32_t pos, uint64_t key) -> Container* {
+  if (len_ == capacity_) {
+    capacity_ = max(4u, capacity_ * 2);
+    containers_ = (Container*)zrealloc(containers_, capacity_ * sizeof(Container));
+  }
+
+  memmove(containers_ + pos + 1, containers_ + pos, (len_ - pos) * sizeof(Container));
+  ++len_;
+
+  Container* c = &containers_[pos];
+  c->key = key;
+  c->card = 0;
+  c->capacity = 4;
+  c->array = AllocArray(c->capacity);
+  return c;
+}
+
+void RoaringSet::EraseContainer(uint32_t pos) {
+  FreeData(&containers_[pos]);
+  memmove(containers_ + pos, containers_ + pos + 1, (len_ - pos - 1) * sizeof(Container));
+  --len_;
+
+  // Shrinks the array of the containers once it is mostly empty.
+  if (len_ == 0) {
+    zfree(containers_);
+    containers_ = nullptr;
+    capacity_ = 0;
+  } else if (capacity_ > 16 && len_ < capacity_ / 4) {
+    capacity_ /= 2;
+    containers_ = (Container*)zrealloc(containers_, capacity_ * sizeof(Container));
+  }
+}
+
+bool RoaringSet::ContainerAdd(Container* c, uint16_t low) {
+  if (c->capacity == 0) {
+    uint64_t mask = 1ULL << (low % 64);
+    if (c->bitmap[low / 64] & mask)
+      return false;
+    c->bitmap[low / 64] |= mask;
+    ++c->card;
+    return true;
+  }
+
+  uint16_t* it = lower_bound(c->array, c->array + c->card, low);
+  if (it != c->array + c->card && *it == low)
+    return false;
+
+  if (c->card == kMaxArrayLen) {
+    ToBitmap(c);
+    return ContainerAdd(c, low);
+  }
+
+  if (c->card == c->capacity) {
+    size_t index = it - c->array;
+    uint32_t capacity = min(c->capacity * 2, kMaxArrayLen);
+    data_malloc_used_ -= zmalloc_usable_size(c->array);
+    c->array = (uint16_t*)zrealloc(c->array, capacity * sizeof(uint16_t));
+    data_malloc_used_ += zmalloc_usable_size(c->array);
+    c->capacity = capacity;
+    it = c->array + index;
+  }
+
+  memmove(it + 1, it, (c->array + c->card - it) * sizeof(uint16_t));
+  *it = low;
+  ++c->card;
+  return true;
+}
+
+bool RoaringSet::ContainerRemove(Container* c, uint16_t low) {
+  if (c->capacity == 0) {
+    uint64_t mask = 1ULL << (low % 64);
+    if ((c->bitmap[low / 64] & mask) == 0)
+      return false;
+    c->bitmap[low / 64] &= ~mask;
+    if (--c->card <= kMaxArrayLen / 2)
+      ToArray(c);
+    return true;
+  }
+
+  uint16_t* end = c->array + c->card;
+  uint16_t* it = lower_bound(c->array, end, low);
+  if (it == end || *it != low)
+    return false;
+
+  memmove(it, it + 1, (end - it - 1) * sizeof(uint16_t));
+  --c->card;
+  return true;
+}
+
+void RoaringSet::IntersectContainer(Container* c, const Container& other) {
+  if (c->capacity) {
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < c->card; ++i) {
+      if (ContainerContains(other, c->array[i]))
+        c->array[out++] = c->array[i];
+    }
+    c->card = out;
+    return;
+  }
+
+  if (other.capacity) {
+    // The intersection is at most as large as the array.
+    uint16_t* array = AllocArray(max(other.card, 1u));
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < other.card; ++i) {
+      if (ContainerContains(*c, other.array[i]))
+        array[out++] = other.array[i];
+    }
+    FreeData(c);
+    c->array = array;
+    c->capacity = max(other.card, 1u);
+    c->card = out;
+    return;
+  }
+
+  uint32_t card = 0;
+  for (uint32_t w = 0; w < kBitmapWords; ++w) {
+    c->bitmap[w] &= other.bitmap[w];
+    card += __builtin_popcountll(c->bitmap[w]);
+  }
+  c->card = card;
+  if (card > 0 && card <= kMaxArrayLen / 2)
+    ToArray(c);
+}
+
+void RoaringSet::UnionContainer(Container* c, const Container& other) {
+  if (c->capacity && other.capacity && c->card + other.card <= kMaxArrayLen) {
+    uint32_t capacity = max(c->card + other.card, 4u);
+    uint16_t* array = AllocArray(capacity);
+    uint16_t* end = set_union(c->array, c->array + c->card, other.array,
+                              other.array + other.card, array);
+    FreeData(c);
+    c->array = array;
+    c->capacity = capacity;
+    c->card = end - array;
+    return;
+  }
+
+  if (c->capacity)
+    ToBitmap(c);
+
+  if (other.capacity) {
+    for (uint32_t i = 0; i < other.card; ++i) {
+      uint16_t low = other.array[i];
+      c->bitmap[low / 64] |= 1ULL << (low % 64);
+    }
+  } else {
+    for (uint32_t w = 0; w < kBitmapWords; ++w)
+      c->bitmap[w] |= other.bitmap[w];
+  }
+
+  uint32_t card = 0;
+  for (uint32_t w = 0; w < kBitmapWords; ++w)
+    card += __builtin_popcountll(c->bitmap[w]);
+  c->card = card;
+}
+
+void RoaringSet::ToBitmap(Container* c) {
+  uint64_t* bitmap = AllocBitmap();
+  for (uint32_t i = 0; i < c->card; ++i)
+    bitmap[c->array[i] / 64] |= 1ULL << (c->array[i] % 64);
+
+  FreeData(c);
+  c->bitmap = bitmap;
+  c->capacity = 0;
+}
+
+void RoaringSet::ToArray(Container* c) {
+  uint16_t* array = AllocArray(c->card);
+  uint32_t i = 0;
+  IterateContainer(*c, 0, [&](uint16_t low) {
+    array[i++] = low;
+    return true;
+  });
+
+  FreeData(c);
+  c->array = array;
+  c->capacity = i;
+}
+
+uint16_t* RoaringSet::AllocArray(uint32_t capacity) {
+  uint16_t* res = (uint16_t*)zmalloc(capacity * sizeof(uint16_t));
+  data_malloc_used_ += zmalloc_usable_size(res);
+  return res;
+}
+
+uint64_t* RoaringSet::AllocBitmap() {
+  uint64_t* res = (uint64_t*)zcalloc(kBitmapWords * sizeof(uint64_t));
+  data_malloc_used_ += zmalloc_usable_size(res);
+  return res;
+}
+
+void RoaringSet::FreeData(Container* c) {
+  void* ptr = c->capacity ? (void*)c->array : (void*)c->bitmap;
+  data_malloc_used_ -= zmalloc_usable_size(ptr);
+  zfree(ptr);
+}
+
+}  // namespace dfly
@@ -0,0 +1,166 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+
+namespace dfly {
+
+// The set of the large sets of integers, i.e. of the kEncodingRoaring encoding: a roaring bitmap
+// of 64-bit integers. The members are partitioned by their upper 48 bits into containers of
+// their lower 16 bits, sorted by the upper bits. A container is a sorted array of up to
+// kMaxArrayLen members and a bitmap of 8KB once it grows larger, so that a member takes at most
+// 2 bytes besides its container. A bitmap turns back into an array when it shrinks to half of
+// kMaxArrayLen, so that a container on the boundary is not converted back and forth.
+//
+// The members are visited in ascending order. Not thread-safe. Allocates with zmalloc, so that
+// the memory is accounted with the rest of the values.
+class RoaringSet {
+ public:
+  static constexpr uint32_t kMaxArrayLen = 4096;
+
+  // A sparse set takes more memory than a hash table of its members, see IsDense.
+  static constexpr uint32_t kMinContainerFill = 4;
+
+  RoaringSet() = default;
+  ~RoaringSet();
+
+  RoaringSet(const RoaringSet&) = delete;
+  void operator=(const RoaringSet&) = delete;
+
+  size_t Size() const {
+    return size_;
+  }
+
+  bool Empty() const {
+    return size_ == 0;
+  }
+
+  // Returns true if the member was added, false if it was already in the set.
+  bool Add(int64_t val);
+
+  // Returns true if the member was removed.
+  bool Remove(int64_t val);
+
+  bool Contains(int64_t val) const;
+
+  // Returns the member preceded by rank smaller members. Linear in the number of containers.
+  // Requires: rank < Size().
+  int64_t Select(size_t rank) const;
+
+  // Keep the members that are also in other and add the members of other, respectively. The
+  // containers are combined as a whole, e.g. two bitmaps word by word.
+  void IntersectWith(const RoaringSet& other);
+  void UnionWith(const RoaringSet& other);
+
+  // Whether the containers hold at least kMinContainerFill members on average.
+  bool IsDense() const {
+    return size_ >= size_t(len_) * kMinContainerFill;
+  }
+
+  // The bytes allocated by the set and its containers.
+  size_t MallocUsed() const;
+
+  // Calls f for every member until it returns false. Returns false if f stopped the iteration.
+  template <typename F> bool Iterate(F&& f) const;
+
+  // Calls cb for up to count members, starting from cursor, which starts at 0, and returns the
+  // cursor of the next call, 0 once all the members were visited. The cursor is the next member,
+  // so that the members that stay in the set during the scan are visited exactly once.
+  // Requires: count > 0.
+  uint64_t Scan(uint64_t cursor, size_t count, const std::function<void(int64_t)>& cb) const;
+
+ private:
+  static constexpr uint32_t kBitmapWords = (1 << 16) / 64;
+
+  struct Container {
+    uint64_t key;       // the upper 48 bits of the members.
+    uint32_t card;      // the number of the members.
+    uint32_t capacity;  // of the array, 0 for a bitmap.
+    union {
+      uint16_t* array;
+      uint64_t* bitmap;
+    };
+  };
+
+  // The members are stored with their sign bit flipped, so that the unsigned order of the
+  // containers is the order of the members.
+  static uint64_t Encode(int64_t val) {
+    return uint64_t(val) ^ (1ULL << 63);
+  }
+
+  static int64_t Decode(uint64_t enc) {
+    return int64_t(enc ^ (1ULL << 63));
+  }
+
+  // Calls f for the lower bits of the members of c that are at least from.
+  template <typename F> static bool IterateContainer(const Container& c, uint32_t from, F&& f);
+
+  static bool ContainerContains(const Container& c, uint16_t low);
+
+  // The index of the first container whose key is at least key.
+  uint32_t LowerBound(uint64_t key) const;
+
+  // Inserts an empty array container at pos.
+  Container* InsertContainer(uint32_t pos, uint64_t key);
+  void EraseContainer(uint32_t pos);
+
+  bool ContainerAdd(Container* c, uint16_t low);
+  bool ContainerRemove(Container* c, uint16_t low);
+  void IntersectContainer(Container* c, const Container& other);
+  void UnionContainer(Container* c, const Container& other);
+
+  void ToBitmap(Container* c);
+  void ToArray(Container* c);
+
+  uint16_t* AllocArray(uint32_t capacity);
+  uint64_t* AllocBitmap();
+  void FreeData(Container* c);
+
+  Container* containers_ = nullptr;
+  uint32_t len_ = 0;
+  uint32_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t data_malloc_used_ = 0;  // of the arrays and the bitmaps.
+};
+
+template <typename F> bool RoaringSet::Iterate(F&& f) const {
+  for (uint32_t i = 0; i < len_; ++i) {
+    uint64_t high = containers_[i].key << 16;
+    if (!IterateContainer(containers_[i], 0, [&](uint16_t low) { return f(Decode(high | low)); }))
+      return false;
+  }
+  return true;
+}
+
+template <typename F>
+bool RoaringSet::IterateContainer(const Container& c, uint32_t from, F&& f) {
+  if (c.capacity) {
+    const uint16_t* begin = c.array;
+    const uint16_t* end = begin + c.card;
+    for (const uint16_t* it = std::lower_bound(begin, end, from); it != end; ++it) {
+      if (!f(*it))
+        return false;
+    }
+    return true;
+  }
+
+  for (uint32_t w = from / 64; w < kBitmapWords; ++w) {
+    uint64_t word = c.bitmap[w];
+    if (w == from / 64)
+      word &= ~0ULL << (from % 64);
+
+    while (word) {
+      if (!f(uint16_t(w * 64 + __builtin_ctzll(word))))
+        return false;
+      word &= word - 1;
+    }
+  }
+  return true;
+}
+
+}  // namespace dfly
@@ -0,0 +1,152 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/roaring_set.h"
+
+#include <mimalloc.h>
+
+#include <random>
+#include <set>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class RoaringSetTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    init_zmalloc_threadlocal(mi_heap_get_backing());
+  }
+
+  static vector<int64_t> Members(const RoaringSet& rs) {
+    vector<int64_t> res;
+    rs.Iterate([&res](int64_t val) {
+      res.push_back(val);
+      return true;
+    });
+    return res;
+  }
+
+  RoaringSet rs_;
+};
+
+TEST_F(RoaringSetTest, Basic) {
+  EXPECT_TRUE(rs_.Empty());
+  EXPECT_FALSE(rs_.Contains(1));
+
+  for (int64_t val : {1l, -1l, 0l, INT64_MIN, INT64_MAX, 1l << 20, 65535l, 65536l}) {
+    EXPECT_TRUE(rs_.Add(val));
+    EXPECT_FALSE(rs_.Add(val));
+    EXPECT_TRUE(rs_.Contains(val));
+  }
+  EXPECT_EQ(8u, rs_.Size());
+  EXPECT_FALSE(rs_.Contains(2));
+
+  vector<int64_t> expected{INT64_MIN, -1, 0, 1, 65535, 65536, 1l << 20, INT64_MAX};
+  EXPECT_EQ(expected, Members(rs_));
+  for (size_t i = 0; i < expected.size(); ++i)
+    EXPECT_EQ(expected[i], rs_.Select(i));
+
+  EXPECT_TRUE(rs_.Remove(0));
+  EXPECT_FALSE(rs_.Remove(0));
+  EXPECT_FALSE(rs_.Contains(0));
+  EXPECT_EQ(7u, rs_.Size());
+
+  for (int64_t val : expected)
+    rs_.Remove(val);
+  EXPECT_TRUE(rs_.Empty());
+  EXPECT_EQ(0u, rs_.MallocUsed());
+}
+
+TEST_F(RoaringSetTest, Bitmap) {
+  // Fills a container past the array limit and shrinks it back.
+  for (int64_t i = 0; i < 3 * RoaringSet::kMaxArrayLen; ++i)
+    EXPECT_TRUE(rs_.Add(i * 2));
+  EXPECT_EQ(3 * RoaringSet::kMaxArrayLen, rs_.Size());
+  EXPECT_TRUE(rs_.IsDense());
+  EXPECT_GE(rs_.MallocUsed(), 8192u);
+
+  EXPECT_TRUE(rs_.Contains(100));
+  EXPECT_FALSE(rs_.Contains(101));
+  EXPECT_EQ(200, rs_.Select(100));
+
+  vector<int64_t> members = Members(rs_);
+  ASSERT_EQ(rs_.Size(), members.size());
+  EXPECT_TRUE(is_sorted(members.begin(), members.end()));
+
+  for (int64_t i = 0; i < 3 * RoaringSet::kMaxArrayLen - 10; ++i)
+    EXPECT_TRUE(rs_.Remove(i * 2));
+  EXPECT_EQ(10u, rs_.Size());
+  EXPECT_LT(rs_.MallocUsed(), 8192u);
+  EXPECT_EQ(int64_t(2 * (3 * RoaringSet::kMaxArrayLen - 10)), rs_.Select(0));
+}
+
+TEST_F(RoaringSetTest, SetOps) {
+  mt19937_64 gen(1);
+  set<int64_t> a, b;
+  RoaringSet ra, rb;
+
+  // Dense and sparse ranges, so that all the kinds of containers meet.
+  for (int i = 0; i < 20000; ++i) {
+    int64_t val = gen() % 200000;
+    a.insert(val);
+    ra.Add(val);
+    val = gen() % 100000;
+    b.insert(val);
+    rb.Add(val);
+  }
+  for (int i = 0; i < 100; ++i) {
+    int64_t val = int64_t(gen() % 100) << 40;
+    a.insert(val);
+    ra.Add(val);
+  }
+
+  RoaringSet runion;
+  runion.UnionWith(ra);
+  runion.UnionWith(rb);
+  set<int64_t> expected = a;
+  expected.insert(b.begin(), b.end());
+  EXPECT_EQ(vector<int64_t>(expected.begin(), expected.end()), Members(runion));
+  EXPECT_EQ(expected.size(), runion.Size());
+
+  RoaringSet rinter;
+  rinter.UnionWith(ra);
+  rinter.IntersectWith(rb);
+  expected.clear();
+  set_intersection(a.begin(), a.end(), b.begin(), b.end(), inserter(expected, expected.end()));
+  EXPECT_EQ(vector<int64_t>(expected.begin(), expected.end()), Members(rinter));
+  EXPECT_EQ(expected.size(), rinter.Size());
+}
+
+TEST_F(RoaringSetTest, Scan) {
+  for (int64_t i = -5000; i < 5000; i += 3)
+    rs_.Add(i);
+
+  vector<int64_t> scanned;
+  uint64_t cursor = 0;
+  do {
+    cursor = rs_.Scan(cursor, 100, [&scanned](int64_t val) { scanned.push_back(val); });
+  } while (cursor);
+
+  EXPECT_EQ(Members(rs_), scanned);
+}
+
+TEST_F(RoaringSetTest, Sparse) {
+  for (int64_t i = 0; i < 100; ++i)
+    rs_.Add(i << 32);
+  EXPECT_FALSE(rs_.IsDense());
+
+  for (int64_t i = 0; i < 1000; ++i)
+    rs_.Add(i);
+  EXPECT_TRUE(rs_.IsDense());
+}
+
+}  // namespace dfly
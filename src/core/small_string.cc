@@ -9,6 +9,7 @@
 #include <memory>
 
 #include "base/logging.h"
+#include "core/page_usage.h"
 #include "core/segment_allocator.h"
 
 namespace dfly {
@@ -91,6 +92,27 @@ void SmallString::Free() {
   size_ = 0;
 }
 
+bool SmallString::DefragIfNeeded(const PageUsage& page_usage) {
+  if (size_ <= kPrefLen)
+    return false;
+
+  uint8_t* cur = tl.seg_alloc->Translate(small_ptr_);
+  if (!page_usage.IsUnderutilized(cur))
+    return false;
+
+  auto [sp, rp] = tl.seg_alloc->Allocate(size_ - kPrefLen);
+  if (!page_usage.IsBetterPage(cur, rp)) {
+    tl.seg_alloc->Free(sp);
+    return false;
+  }
+
+  memcpy(rp, cur, size_ - kPrefLen);
+  tl.seg_alloc->Free(small_ptr_);
+  small_ptr_ = sp;
+
+  return true;
+}
+
 uint16_t SmallString::MallocUsed() const {
   if (size_ <= kPrefLen)
     return 0;
@@ -154,6 +176,11 @@ void SmallString::Get(std::string* dest) const {
   }
 }
 
+void SmallString::Prefetch() const {
+  if (size_ > kPrefLen)
+    __builtin_prefetch(tl.seg_alloc->Translate(small_ptr_));
+}
+
 unsigned SmallString::GetV(string_view dest[2]) const {
   if (size_ <= kPrefLen) {
     dest[0] = string_view{prefix_, size_};
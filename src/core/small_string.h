@@ -9,6 +9,8 @@
 
 namespace dfly {
 
+class PageUsage;
+
 // blob strings of upto ~64KB. Small sizes are probably predominant
 // for in-memory workloads, especially for keys.
 // Please note that this class does not have automatic constructors and destructors, therefore
@@ -29,6 +31,10 @@ class SmallString {
   size_t Assign(std::string_view s);
   void Free();
 
+  // Moves the string into a fuller page if it resides in an underutilized one.
+  // Returns true if the string was moved.
+  bool DefragIfNeeded(const PageUsage& page_usage);
+
   bool Equal(std::string_view o) const;
   bool Equal(const SmallString& mps) const;
 
@@ -43,6 +49,9 @@ class SmallString {
 
   void Get(std::string* dest) const;
 
+  // Prefetches the part of the string that is not in the prefix.
+  void Prefetch() const;
+
   // returns 1 or 2 slices representing this small string.
   // Guarantees zero copy, i.e. dest will not point to any of external buffers.
   // With current implementation, it will return 2 slices for a non-empty string.
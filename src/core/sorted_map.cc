@@ -0,0 +1,637 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sorted_map.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+namespace {
+
+// A node fits the 512-byte size class of the allocator.
+constexpr size_t kNodeBytes = 512;
+
+// Like zslLexValueGteMin and zslLexValueLteMax but for a member that is not an sds.
+bool LexValueGteMin(string_view value, const zlexrangespec& spec) {
+  if (spec.min == cminstring)
+    return true;
+  if (spec.min == cmaxstring)
+    return false;
+
+  int cmp = value.compare(string_view{spec.min, sdslen(spec.min)});
+  return spec.minex ? cmp > 0 : cmp >= 0;
+}
+
+bool LexValueLteMax(string_view value, const zlexrangespec& spec) {
+  if (spec.max == cmaxstring)
+    return true;
+  if (spec.max == cminstring)
+    return false;
+
+  int cmp = value.compare(string_view{spec.max, sdslen(spec.max)});
+  return spec.maxex ? cmp < 0 : cmp <= 0;
+}
+
+}  // namespace
+
+struct SortedMap::Node {
+  uint16_t num = 0;  // the items of a leaf or the children of an inner node.
+  bool leaf;
+
+  explicit Node(bool is_leaf) : leaf(is_leaf) {
+  }
+
+  // The number of items under the node.
+  size_t Count() const;
+
+  // The node is merged or rebalanced when it has fewer entries.
+  unsigned MinEntries() const;
+
+  const Item& First() const;
+};
+
+struct SortedMap::Leaf : public Node {
+  static constexpr unsigned kCapacity = (kNodeBytes - 24) / sizeof(Item);
+
+  Leaf* prev = nullptr;
+  Leaf* next = nullptr;
+  Item items[kCapacity];
+
+  Leaf() : Node(true) {
+  }
+};
+
+struct SortedMap::Inner : public Node {
+  static constexpr unsigned kCapacity = (kNodeBytes - 8 + sizeof(Item)) / (sizeof(Item) + 16);
+
+  // keys[i] is the first item under children[i + 1]. The keys are compared with the items, so
+  // they must not point to the removed entries.
+  Item keys[kCapacity - 1];
+  Node* children[kCapacity];
+  size_t counts[kCapacity];  // the number of items under each child.
+
+  Inner() : Node(false) {
+  }
+
+  size_t SubtreeCount() const {
+    return accumulate(counts, counts + num, size_t(0));
+  }
+
+  // Inserts the child with its key at index, which is not 0.
+  void InsertChild(unsigned index, const Item& key, Node* child, size_t count) {
+    DCHECK(index > 0 && index <= num && num < kCapacity);
+    copy_backward(keys + index - 1, keys + num - 1, keys + num);
+    copy_backward(children + index, children + num, children + num + 1);
+    copy_backward(counts + index, counts + num, counts + num + 1);
+    keys[index - 1] = key;
+    children[index] = child;
+    counts[index] = count;
+    ++num;
+  }
+
+  // Removes the child at index, which is not 0, with its key.
+  void RemoveChild(unsigned index) {
+    DCHECK(index > 0 && index < num);
+    copy(keys + index, keys + num - 1, keys + index - 1);
+    copy(children + index + 1, children + num, children + index);
+    copy(counts + index + 1, counts + num, counts + index);
+    --num;
+  }
+};
+
+size_t SortedMap::Node::Count() const {
+  return leaf ? num : static_cast<const Inner*>(this)->SubtreeCount();
+}
+
+unsigned SortedMap::Node::MinEntries() const {
+  return (leaf ? Leaf::kCapacity : Inner::kCapacity) / 2;
+}
+
+auto SortedMap::Node::First() const -> const Item& {
+  const Node* node = this;
+  while (!node->leaf) {
+    node = static_cast<const Inner*>(node)->children[0];
+  }
+  return static_cast<const Leaf*>(node)->items[0];
+}
+
+SortedMap::~SortedMap() {
+  size_t budget = numeric_limits<size_t>::max();
+  FreeTree(&budget);
+}
+
+bool SortedMap::Add(double score, string_view member, int in_flags, int* out_flags,
+                    double* newscore) {
+  bool incr = (in_flags & ZADD_IN_INCR) != 0;
+  bool nx = (in_flags & ZADD_IN_NX) != 0;
+  bool xx = (in_flags & ZADD_IN_XX) != 0;
+  bool gt = (in_flags & ZADD_IN_GT) != 0;
+  bool lt = (in_flags & ZADD_IN_LT) != 0;
+
+  *out_flags = 0;
+  if (isnan(score)) {
+    *out_flags = ZADD_OUT_NAN;
+    return false;
+  }
+
+  Key key = MakeKey(member, false);
+  const uint64_t* found = FindSlot(key);
+  if (!found) {
+    if (xx) {
+      *out_flags |= ZADD_OUT_NOP;
+      return true;
+    }
+
+    AddNew(key, score);
+    *out_flags |= ZADD_OUT_ADDED;
+    if (newscore)
+      *newscore = score;
+    return true;
+  }
+
+  if (nx) {
+    *out_flags |= ZADD_OUT_NOP;
+    return true;
+  }
+
+  uint64_t slot = *found;
+  double curscore = ScoreOf(slot);
+  if (incr) {
+    score += curscore;
+    if (isnan(score)) {
+      *out_flags |= ZADD_OUT_NAN;
+      return false;
+    }
+  }
+
+  if ((lt && score >= curscore) || (gt && score <= curscore)) {
+    *out_flags |= ZADD_OUT_NOP;
+    return true;
+  }
+
+  if (newscore)
+    *newscore = score;
+
+  // The entry stays in the table, only its item moves in the tree.
+  if (score != curscore) {
+    TreeErase(Item{curscore, slot});
+    SetScore(slot, score);
+    TreeInsert(Item{score, slot});
+    *out_flags |= ZADD_OUT_UPDATED;
+  }
+
+  return true;
+}
+
+bool SortedMap::Insert(double score, string_view member) {
+  DCHECK(!isnan(score));
+
+  Key key = MakeKey(member, false);
+  if (FindSlot(key))
+    return false;
+
+  AddNew(key, score);
+  return true;
+}
+
+bool SortedMap::Delete(string_view member) {
+  Key key = MakeKey(member, false);
+  const uint64_t* slot = FindSlot(key);
+  if (!slot)
+    return false;
+
+  // The tree compares the members, so the entry is freed last.
+  TreeErase(Item{ScoreOf(*slot), *slot});
+  Erase(key);
+
+  return true;
+}
+
+optional<double> SortedMap::GetScore(string_view member) const {
+  const uint64_t* slot = FindSlot(MakeKey(member, false));
+  if (!slot)
+    return nullopt;
+
+  return ScoreOf(*slot);
+}
+
+optional<size_t> SortedMap::GetRank(string_view member, bool reverse) const {
+  const uint64_t* slot = FindSlot(MakeKey(member, false));
+  if (!slot)
+    return nullopt;
+
+  Item item{ScoreOf(*slot), *slot};
+  size_t rank = CountBefore([&item](const Item& other) { return Less(other, item); });
+
+  return reverse ? Size() - 1 - rank : rank;
+}
+
+pair<size_t, size_t> SortedMap::GetRankRange(const zrangespec& range) const {
+  size_t first =
+      CountBefore([&range](const Item& item) { return !zslValueGteMin(item.score, &range); });
+  size_t last =
+      CountBefore([&range](const Item& item) { return zslValueLteMax(item.score, &range); });
+
+  return {first, max(first, last)};
+}
+
+pair<size_t, size_t> SortedMap::GetRankRange(const zlexrangespec& range) const {
+  size_t first =
+      CountBefore([&range](const Item& item) { return !LexValueGteMin(View(item.slot), range); });
+  size_t last =
+      CountBefore([&range](const Item& item) { return LexValueLteMax(View(item.slot), range); });
+
+  return {first, max(first, last)};
+}
+
+size_t SortedMap::DeleteRange(size_t start, size_t end) {
+  end = min(end, Size());
+  if (start >= end)
+    return 0;
+
+  vector<Item> items;
+  items.reserve(end - start);
+  IterateItems(start, end - start, false, [&items](const Item& item) { items.push_back(item); });
+
+  for (const Item& item : items) {
+    TreeErase(item);
+    Erase(MakeKey(View(item.slot), false));
+  }
+
+  return items.size();
+}
+
+void SortedMap::Iterate(size_t start, size_t len, bool reverse, const Callback& cb) const {
+  IterateItems(start, len, reverse, [&cb](const Item& item) { cb(View(item.slot), item.score); });
+}
+
+bool SortedMap::ClearStep(uint64_t* cursor, size_t* budget) {
+  // The items of the tree point to the entries of the table.
+  FreeTree(budget);
+  if (root_)
+    return false;
+
+  return StringTable::ClearStep(cursor, budget);
+}
+
+double SortedMap::ScoreOf(uint64_t slot) {
+  string_view value = ValueOf(slot);
+  DCHECK_EQ(sizeof(double), value.size());
+
+  double score;
+  memcpy(&score, value.data(), sizeof(score));
+  return score;
+}
+
+void SortedMap::SetScore(uint64_t slot, double score) {
+  // The entry is allocated by the table, only its view is const.
+  memcpy(const_cast<char*>(ValueOf(slot).data()), &score, sizeof(score));
+}
+
+bool SortedMap::Less(const Item& a, const Item& b) {
+  if (a.score != b.score)
+    return a.score < b.score;
+
+  return a.slot != b.slot && View(a.slot) < View(b.slot);
+}
+
+template <typename Pred> size_t SortedMap::CountBefore(Pred&& before) const {
+  if (!root_)
+    return 0;
+
+  // The keys of a node are ordered like the items, so before holds for all the items under the
+  // children before the first key for which it does not hold, and for none after it.
+  size_t res = 0;
+  const Node* node = root_;
+  while (!node->leaf) {
+    const Inner* inner = static_cast<const Inner*>(node);
+    unsigned i = partition_point(inner->keys, inner->keys + inner->num - 1, before) - inner->keys;
+    res = accumulate(inner->counts, inner->counts + i, res);
+    node = inner->children[i];
+  }
+
+  const Leaf* leaf = static_cast<const Leaf*>(node);
+  return res + (partition_point(leaf->items, leaf->items + leaf->num, before) - leaf->items);
+}
+
+template <typename F>
+void SortedMap::IterateItems(size_t start, size_t len, bool reverse, F&& f) const {
+  DCHECK_LT(start, Size());
+
+  const Node* node = root_;
+  size_t pos = start;
+  while (!node->leaf) {
+    const Inner* inner = static_cast<const Inner*>(node);
+    unsigned i = 0;
+    for (; pos >= inner->counts[i]; ++i) {
+      pos -= inner->counts[i];
+    }
+    node = inner->children[i];
+  }
+
+  const Leaf* leaf = static_cast<const Leaf*>(node);
+  for (; len > 0 && leaf; --len) {
+    f(leaf->items[pos]);
+
+    if (reverse) {
+      if (pos-- == 0) {
+        leaf = leaf->prev;
+        pos = leaf ? leaf->num - 1 : 0;
+      }
+    } else if (++pos == leaf->num) {
+      leaf = leaf->next;
+      pos = 0;
+    }
+  }
+}
+
+void SortedMap::AddNew(const Key& key, double score) {
+  string_view value{reinterpret_cast<const char*>(&score), sizeof(score)};
+  uint64_t slot = MakeSlot(key, &value);
+  AddSlot(slot, key.hash);
+  TreeInsert(Item{score, slot});
+}
+
+template <typename T> T* SortedMap::NewNode() {
+  static_assert(sizeof(T) <= kNodeBytes);
+
+  void* ptr = zmalloc(sizeof(T));
+  tree_malloc_used_ += zmalloc_usable_size(ptr);
+  return new (ptr) T;
+}
+
+void SortedMap::FreeNode(Node* node) {
+  tree_malloc_used_ -= zmalloc_usable_size(node);
+  zfree(node);
+}
+
+void SortedMap::FreeTree(size_t* budget) {
+  if (root_ && !root_->leaf) {
+    Node* first = root_;
+    while (!first->leaf) {
+      first = static_cast<Inner*>(first)->children[0];
+    }
+
+    // There are tens of leaves per inner node, they are freed incrementally.
+    FreeInner(static_cast<Inner*>(root_));
+    root_ = first;
+  }
+
+  for (; root_ && *budget > 0; --*budget) {
+    Leaf* next = static_cast<Leaf*>(root_)->next;
+    FreeNode(root_);
+    root_ = next;
+  }
+}
+
+void SortedMap::FreeInner(Inner* inner) {
+  if (!inner->children[0]->leaf) {
+    for (unsigned i = 0; i < inner->num; ++i) {
+      FreeInner(static_cast<Inner*>(inner->children[i]));
+    }
+  }
+  FreeNode(inner);
+}
+
+void SortedMap::TreeInsert(const Item& item) {
+  if (!root_)
+    root_ = NewNode<Leaf>();
+
+  Item sep;
+  Node* right = InsertRec(root_, item, &sep);
+  if (!right)
+    return;
+
+  Inner* root = NewNode<Inner>();
+  root->num = 2;
+  root->keys[0] = sep;
+  root->children[0] = root_;
+  root->children[1] = right;
+  root->counts[0] = root_->Count();
+  root->counts[1] = right->Count();
+  root_ = root;
+}
+
+auto SortedMap::InsertRec(Node* node, const Item& item, Item* sep) -> Node* {
+  if (node->leaf) {
+    Leaf* leaf = static_cast<Leaf*>(node);
+    unsigned pos = lower_bound(leaf->items, leaf->items + leaf->num, item, Less) - leaf->items;
+
+    Leaf* dest = leaf;
+    Leaf* right = nullptr;
+    if (leaf->num == Leaf::kCapacity) {
+      constexpr unsigned kHalf = Leaf::kCapacity / 2;
+
+      right = NewNode<Leaf>();
+      copy(leaf->items + kHalf, leaf->items + leaf->num, right->items);
+      right->num = leaf->num - kHalf;
+      leaf->num = kHalf;
+
+      right->prev = leaf;
+      right->next = leaf->next;
+      if (right->next)
+        right->next->prev = right;
+      leaf->next = right;
+
+      if (pos > kHalf) {
+        dest = right;
+        pos -= kHalf;
+      }
+    }
+
+    copy_backward(dest->items + pos, dest->items + dest->num, dest->items + dest->num + 1);
+    dest->items[pos] = item;
+    ++dest->num;
+
+    if (right)
+      *sep = right->items[0];
+    return right;
+  }
+
+  Inner* inner = static_cast<Inner*>(node);
+  unsigned i = upper_bound(inner->keys, inner->keys + inner->num - 1, item, Less) - inner->keys;
+
+  Item child_sep;
+  Node* child_right = InsertRec(inner->children[i], item, &child_sep);
+  if (!child_right) {
+    ++inner->counts[i];
+    return nullptr;
+  }
+
+  size_t right_count = child_right->Count();
+  inner->counts[i] = inner->children[i]->Count();
+
+  if (inner->num < Inner::kCapacity) {
+    inner->InsertChild(i + 1, child_sep, child_right, right_count);
+    return nullptr;
+  }
+
+  // The left half keeps kHalf children, the key between the halves moves to the parent.
+  constexpr unsigned kHalf = Inner::kCapacity / 2;
+
+  Inner* right = NewNode<Inner>();
+  copy(inner->keys + kHalf, inner->keys + inner->num - 1, right->keys);
+  copy(inner->children + kHalf, inner->children + inner->num, right->children);
+  copy(inner->counts + kHalf, inner->counts + inner->num, right->counts);
+  right->num = inner->num - kHalf;
+  inner->num = kHalf;
+  *sep = inner->keys[kHalf - 1];
+
+  if (i < kHalf) {
+    inner->InsertChild(i + 1, child_sep, child_right, right_count);
+  } else {
+    right->InsertChild(i + 1 - kHalf, child_sep, child_right, right_count);
+  }
+
+  return right;
+}
+
+void SortedMap::TreeErase(const Item& item) {
+  DCHECK(root_);
+
+  EraseRec(root_, item);
+  if (root_->leaf) {
+    if (root_->num == 0) {
+      FreeNode(root_);
+      root_ = nullptr;
+    }
+  } else if (root_->num == 1) {
+    Node* child = static_cast<Inner*>(root_)->children[0];
+    FreeNode(root_);
+    root_ = child;
+  }
+}
+
+void SortedMap::EraseRec(Node* node, const Item& item) {
+  if (node->leaf) {
+    Leaf* leaf = static_cast<Leaf*>(node);
+    Item* it = lower_bound(leaf->items, leaf->items + leaf->num, item, Less);
+    DCHECK(it != leaf->items + leaf->num && it->slot == item.slot);
+
+    copy(it + 1, leaf->items + leaf->num, it);
+    --leaf->num;
+    return;
+  }
+
+  Inner* inner = static_cast<Inner*>(node);
+  unsigned i = upper_bound(inner->keys, inner->keys + inner->num - 1, item, Less) - inner->keys;
+  Node* child = inner->children[i];
+
+  EraseRec(child, item);
+  --inner->counts[i];
+
+  // There is at most one key for the item, the other keys of the path point to other entries.
+  if (i > 0 && inner->keys[i - 1].slot == item.slot)
+    inner->keys[i - 1] = child->First();
+
+  if (child->num < child->MinEntries())
+    Rebalance(inner, i);
+}
+
+void SortedMap::Rebalance(Inner* parent, unsigned index) {
+  // Pairs the child with its left sibling, if it has one.
+  unsigned li = index > 0 ? index - 1 : 0;
+  Node* left = parent->children[li];
+  Node* right = parent->children[li + 1];
+
+  if (left->leaf) {
+    Leaf* a = static_cast<Leaf*>(left);
+    Leaf* b = static_cast<Leaf*>(right);
+
+    if (a->num + b->num <= Leaf::kCapacity) {
+      copy(b->items, b->items + b->num, a->items + a->num);
+      a->num += b->num;
+      a->next = b->next;
+      if (a->next)
+        a->next->prev = a;
+
+      parent->counts[li] += parent->counts[li + 1];
+      parent->RemoveChild(li + 1);
+      FreeNode(b);
+      return;
+    }
+
+    unsigned half = (a->num + b->num) / 2;
+    if (a->num < half) {
+      unsigned n = half - a->num;
+      copy(b->items, b->items + n, a->items + a->num);
+      copy(b->items + n, b->items + b->num, b->items);
+      a->num += n;
+      b->num -= n;
+    } else {
+      unsigned n = a->num - half;
+      copy_backward(b->items, b->items + b->num, b->items + b->num + n);
+      copy(a->items + half, a->items + a->num, b->items);
+      a->num -= n;
+      b->num += n;
+    }
+
+    parent->keys[li] = b->items[0];
+    parent->counts[li] = a->num;
+    parent->counts[li + 1] = b->num;
+    return;
+  }
+
+  Inner* a = static_cast<Inner*>(left);
+  Inner* b = static_cast<Inner*>(right);
+
+  if (a->num + b->num <= Inner::kCapacity) {
+    // The key of the parent goes between the children of a and b.
+    a->keys[a->num - 1] = parent->keys[li];
+    copy(b->keys, b->keys + b->num - 1, a->keys + a->num);
+    copy(b->children, b->children + b->num, a->children + a->num);
+    copy(b->counts, b->counts + b->num, a->counts + a->num);
+    a->num += b->num;
+
+    parent->counts[li] += parent->counts[li + 1];
+    parent->RemoveChild(li + 1);
+    FreeNode(b);
+    return;
+  }
+
+  // Rotates the children through the key of the parent one at a time.
+  while (a->num + 1 < b->num) {
+    a->keys[a->num - 1] = parent->keys[li];
+    a->children[a->num] = b->children[0];
+    a->counts[a->num] = b->counts[0];
+    ++a->num;
+
+    parent->keys[li] = b->keys[0];
+    copy(b->keys + 1, b->keys + b->num - 1, b->keys);
+    copy(b->children + 1, b->children + b->num, b->children);
+    copy(b->counts + 1, b->counts + b->num, b->counts);
+    --b->num;
+  }
+
+  while (b->num + 1 < a->num) {
+    copy_backward(b->keys, b->keys + b->num - 1, b->keys + b->num);
+    copy_backward(b->children, b->children + b->num, b->children + b->num + 1);
+    copy_backward(b->counts, b->counts + b->num, b->counts + b->num + 1);
+    b->keys[0] = parent->keys[li];
+    b->children[0] = a->children[a->num - 1];
+    b->counts[0] = a->counts[a->num - 1];
+    ++b->num;
+
+    parent->keys[li] = a->keys[a->num - 2];
+    --a->num;
+  }
+
+  parent->counts[li] = a->SubtreeCount();
+  parent->counts[li + 1] = b->SubtreeCount();
+}
+
+}  // namespace dfly
@@ -0,0 +1,128 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <optional>
+#include <utility>
+
+#include "core/string_table.h"
+
+extern "C" {
+#include "redis/zset.h"
+}
+
+namespace dfly {
+
+// The members of the large sorted sets, i.e. of OBJ_ENCODING_SKIPLIST. Replaces the redis
+// skiplist and dict, which take a skiplist node, a dictEntry and an sds per member.
+//
+// Every member is stored with its score in a single allocation of a StringTable, which finds the
+// score of a member. The members are ordered by a B+ tree of (score, slot) items. Its nodes hold
+// tens of items in an array, so that a range is read sequentially and most of the comparisons
+// do not touch the members. The inner nodes keep the sizes of their subtrees, which gives the
+// rank of a member in O(log n).
+//
+// The ranks are 0-based, from the lowest score. The ranges of ranks are half-open.
+class SortedMap : private StringTable {
+ public:
+  using Callback = std::function<void(std::string_view member, double score)>;
+
+  SortedMap() = default;
+  ~SortedMap();
+
+  using StringTable::Empty;
+  using StringTable::Size;
+
+  // Adds the member or updates its score like zsetAdd does for the skiplist: in_flags is a mask
+  // of ZADD_IN_* and *out_flags is set to a mask of ZADD_OUT_*. Returns false if the resulting
+  // score is NaN, in which case the map is not changed.
+  bool Add(double score, std::string_view member, int in_flags, int* out_flags, double* newscore);
+
+  // Adds a member that is not in the map. Returns false if it is.
+  bool Insert(double score, std::string_view member);
+
+  // Returns true if the member was removed.
+  bool Delete(std::string_view member);
+
+  std::optional<double> GetScore(std::string_view member) const;
+
+  // Returns the rank of the member, counted from the highest score if reverse.
+  std::optional<size_t> GetRank(std::string_view member, bool reverse) const;
+
+  // Returns the ranks of the members in the range. The lex ranges assume that all the scores
+  // are equal, like redis does.
+  std::pair<size_t, size_t> GetRankRange(const zrangespec& range) const;
+  std::pair<size_t, size_t> GetRankRange(const zlexrangespec& range) const;
+
+  // Removes the members of the ranks [start, end). Returns how many were removed.
+  size_t DeleteRange(size_t start, size_t end);
+
+  // Calls cb for up to len members starting at the rank start, towards the lower ranks if
+  // reverse. The map must not be changed by cb.
+  // Requires: start < Size().
+  void Iterate(size_t start, size_t len, bool reverse, const Callback& cb) const;
+
+  // Calls cb for the members of a few buckets of the table and returns the cursor of the next
+  // call, 0 once all the buckets were visited. See StringTable::ScanSlots for the guarantees.
+  uint64_t Scan(uint64_t cursor, const Callback& cb) const {
+    return ScanSlots(cursor, [&cb](const uint64_t& slot) { cb(View(slot), ScoreOf(slot)); });
+  }
+
+  using StringTable::Reserve;
+
+  // Like StringTable::ClearStep, it frees the tree first.
+  bool ClearStep(uint64_t* cursor, size_t* budget);
+
+  // The bytes allocated by the table, its entries and the tree.
+  size_t MallocUsed() const {
+    return StringTable::MallocUsed() + tree_malloc_used_;
+  }
+
+ private:
+  struct Item {
+    double score;
+    uint64_t slot;
+  };
+
+  struct Node;
+  struct Leaf;
+  struct Inner;
+
+  static double ScoreOf(uint64_t slot);
+  static void SetScore(uint64_t slot, double score);
+
+  // By score and then by member.
+  static bool Less(const Item& a, const Item& b);
+
+  // Returns the number of items for which before holds. It must hold for a prefix of the items.
+  template <typename Pred> size_t CountBefore(Pred&& before) const;
+
+  template <typename F> void IterateItems(size_t start, size_t len, bool reverse, F&& f) const;
+
+  void AddNew(const Key& key, double score);
+
+  template <typename T> T* NewNode();
+  void FreeNode(Node* node);
+
+  // Frees the inner nodes and then up to *budget leaves. Decreases the budget accordingly.
+  void FreeTree(size_t* budget);
+  void FreeInner(Inner* inner);
+
+  void TreeInsert(const Item& item);
+
+  // Returns the new right sibling of node if it was split, with its first item in *sep.
+  Node* InsertRec(Node* node, const Item& item, Item* sep);
+
+  void TreeErase(const Item& item);
+  void EraseRec(Node* node, const Item& item);
+
+  // Merges or rebalances the child of the parent that has too few entries with its sibling.
+  void Rebalance(Inner* parent, unsigned index);
+
+  Node* root_ = nullptr;
+  size_t tree_malloc_used_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,216 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sorted_map.h"
+
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include <random>
+#include <set>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/object.h"
+#include "redis/redis_aux.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class SortedMapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    InitRedisTables();  // to initialize server struct.
+    init_zmalloc_threadlocal(mi_heap_get_backing());
+  }
+
+  // Returns the members of the ranks [start, start + len) in the order of the iteration.
+  vector<string> Members(size_t start, size_t len, bool reverse) const {
+    vector<string> res;
+    sm_.Iterate(start, len, reverse,
+                [&res](string_view member, double) { res.emplace_back(member); });
+    return res;
+  }
+
+  SortedMap sm_;
+};
+
+TEST_F(SortedMapTest, Basic) {
+  EXPECT_TRUE(sm_.Empty());
+  EXPECT_FALSE(sm_.GetScore("a"));
+
+  EXPECT_TRUE(sm_.Insert(2, "b"));
+  EXPECT_TRUE(sm_.Insert(1, "a"));
+  EXPECT_TRUE(sm_.Insert(2, "c"));
+  EXPECT_FALSE(sm_.Insert(5, "a"));
+  EXPECT_EQ(3u, sm_.Size());
+  EXPECT_EQ(1, sm_.GetScore("a"));
+
+  EXPECT_EQ(0u, sm_.GetRank("a", false));
+  EXPECT_EQ(2u, sm_.GetRank("c", false));
+  EXPECT_EQ(0u, sm_.GetRank("c", true));
+  EXPECT_THAT(Members(0, 10, false), ::testing::ElementsAre("a", "b", "c"));
+  EXPECT_THAT(Members(1, 10, true), ::testing::ElementsAre("b", "a"));
+
+  EXPECT_TRUE(sm_.Delete("b"));
+  EXPECT_FALSE(sm_.Delete("b"));
+  EXPECT_FALSE(sm_.GetRank("b", false));
+  EXPECT_EQ(1u, sm_.GetRank("c", false));
+}
+
+TEST_F(SortedMapTest, Add) {
+  int out_flags;
+  double score;
+  EXPECT_TRUE(sm_.Add(1, "a", ZADD_IN_NONE, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_ADDED, out_flags);
+
+  EXPECT_TRUE(sm_.Add(2, "a", ZADD_IN_NX, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+  EXPECT_TRUE(sm_.Add(2, "b", ZADD_IN_XX, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+  EXPECT_TRUE(sm_.Add(0, "a", ZADD_IN_GT, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+
+  EXPECT_TRUE(sm_.Add(2.5, "a", ZADD_IN_INCR, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_UPDATED, out_flags);
+  EXPECT_EQ(3.5, score);
+  EXPECT_EQ(3.5, sm_.GetScore("a"));
+
+  EXPECT_TRUE(sm_.Add(-INFINITY, "b", ZADD_IN_NONE, &out_flags, &score));
+  EXPECT_EQ(0u, sm_.GetRank("b", false));
+  EXPECT_FALSE(sm_.Add(INFINITY, "b", ZADD_IN_INCR, &out_flags, &score));
+  EXPECT_EQ(ZADD_OUT_NAN, out_flags);
+  EXPECT_EQ(-INFINITY, sm_.GetScore("b"));
+}
+
+// Compares the tree with a std::set through enough inserts and deletes to split and merge the
+// nodes on several levels.
+TEST_F(SortedMapTest, Ranks) {
+  constexpr unsigned kNum = 20000;
+  set<pair<double, string>> ref;
+  mt19937 gen(42);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    double score = gen() % 1000;
+    string member = absl::StrCat("m", gen() % (kNum * 2));
+    if (sm_.Insert(score, member)) {
+      ref.emplace(score, member);
+    }
+  }
+  ASSERT_EQ(ref.size(), sm_.Size());
+
+  for (unsigned i = 0; i < kNum / 2; ++i) {
+    string member = absl::StrCat("m", gen() % (kNum * 2));
+    auto score = sm_.GetScore(member);
+    if (score) {
+      ASSERT_TRUE(sm_.Delete(member));
+      ref.erase({*score, member});
+    }
+  }
+  ASSERT_EQ(ref.size(), sm_.Size());
+
+  size_t rank = 0;
+  for (const auto& [score, member] : ref) {
+    ASSERT_EQ(rank, sm_.GetRank(member, false)) << member;
+    ++rank;
+  }
+
+  vector<string> members = Members(0, ref.size(), false);
+  ASSERT_EQ(ref.size(), members.size());
+  EXPECT_TRUE(equal(members.begin(), members.end(), ref.begin(),
+                    [](const string& m, const auto& p) { return m == p.second; }));
+
+  members = Members(ref.size() - 1, ref.size(), true);
+  EXPECT_TRUE(equal(members.begin(), members.end(), ref.rbegin(),
+                    [](const string& m, const auto& p) { return m == p.second; }));
+}
+
+TEST_F(SortedMapTest, Ranges) {
+  for (unsigned i = 0; i < 1000; ++i) {
+    sm_.Insert(i / 10, absl::StrCat(i));
+  }
+
+  zrangespec range{.min = 10, .max = 20, .minex = 0, .maxex = 1};
+  EXPECT_EQ(make_pair(100ul, 200ul), sm_.GetRankRange(range));
+  range.minex = 1;
+  range.maxex = 0;
+  EXPECT_EQ(make_pair(110ul, 210ul), sm_.GetRankRange(range));
+  range.min = 200;
+  range.max = 100;
+  EXPECT_EQ(make_pair(1000ul, 1000ul), sm_.GetRankRange(range));
+
+  EXPECT_EQ(100u, sm_.DeleteRange(100, 200));
+  EXPECT_EQ(900u, sm_.Size());
+  EXPECT_FALSE(sm_.GetScore("150"));
+  EXPECT_EQ(100u, sm_.GetRank("200", false));
+  EXPECT_EQ(0u, sm_.DeleteRange(900, 1000));
+}
+
+TEST_F(SortedMapTest, LexRanges) {
+  for (char c = 'a'; c <= 'z'; ++c) {
+    sm_.Insert(0, string(1, c));
+  }
+
+  zlexrangespec range;
+  range.min = sdsnew("c");
+  range.max = sdsnew("f");
+  range.minex = 0;
+  range.maxex = 1;
+  EXPECT_EQ(make_pair(2ul, 5ul), sm_.GetRankRange(range));
+  zslFreeLexRange(&range);
+
+  range.min = cminstring;
+  range.max = cmaxstring;
+  EXPECT_EQ(make_pair(0ul, 26ul), sm_.GetRankRange(range));
+}
+
+TEST_F(SortedMapTest, ClearStep) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_.Insert(i, absl::StrCat("member", i));
+  }
+  EXPECT_GT(sm_.MallocUsed(), 0u);
+
+  uint64_t cursor = 0;
+  unsigned steps = 0;
+  while (true) {
+    size_t budget = 100;
+    ++steps;
+    if (sm_.ClearStep(&cursor, &budget))
+      break;
+  }
+  EXPECT_GT(steps, 1u);
+}
+
+TEST_F(SortedMapTest, MemoryVsZset) {
+  constexpr unsigned kNum = 10000;
+
+  size_t allocated1, resident1, active1;
+  size_t allocated2, resident2, active2;
+  zmalloc_get_allocator_info(&allocated1, &active1, &resident1);
+
+  robj* zobj = createZsetObject();
+  for (unsigned i = 0; i < kNum; ++i) {
+    int out_flags;
+    sds member = sdscatfmt(sdsempty(), "member:%u", i);
+    zsetAdd(zobj, i, member, ZADD_IN_NONE, &out_flags, nullptr);
+    sdsfree(member);
+  }
+  zmalloc_get_allocator_info(&allocated2, &active2, &resident2);
+  size_t zset_used = allocated2 - allocated1;
+  decrRefCount(zobj);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_.Insert(i, absl::StrCat("member:", i));
+  }
+  LOG(INFO) << "zset used: " << zset_used << " sorted map used: " << sm_.MallocUsed();
+  EXPECT_LT(sm_.MallocUsed() + 16 * kNum, zset_used);
+}
+
+}  // namespace dfly
@@ -0,0 +1,66 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+
+namespace dfly {
+
+// Bounded lock-free queue with a single producer thread and a single consumer thread.
+// T must be default constructible and copy assignable.
+template <typename T> class SpscQueue {
+ public:
+  // capacity is rounded up to the power of 2.
+  explicit SpscQueue(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity)
+      cap <<= 1;
+    mask_ = cap - 1;
+    items_.reset(new T[cap]);
+  }
+
+  // Called by the producer. Returns false if the queue is full.
+  bool TryPush(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_)
+      return false;
+
+    items_[tail & mask_] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called by the consumer. Returns false if the queue is empty.
+  bool TryPop(T* dest) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+
+    *dest = items_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Can be called by both threads, the result is approximate.
+  bool Empty() const {
+    return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed);
+  }
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+ private:
+  std::unique_ptr<T[]> items_;
+  size_t mask_;
+
+  // Written by different threads, hence reside in different cache lines.
+  alignas(64) std::atomic_size_t head_{0};
+  alignas(64) std::atomic_size_t tail_{0};
+};
+
+}  // namespace dfly
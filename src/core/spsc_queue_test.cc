@@ -0,0 +1,69 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/spsc_queue.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+class SpscQueueTest : public ::testing::Test {
+ protected:
+};
+
+TEST_F(SpscQueueTest, Basic) {
+  SpscQueue<int> q(3);
+  ASSERT_EQ(4u, q.capacity());
+  EXPECT_TRUE(q.Empty());
+
+  int val = 0;
+  EXPECT_FALSE(q.TryPop(&val));
+
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(q.TryPush(i));
+  }
+  EXPECT_FALSE(q.TryPush(4));
+
+  EXPECT_TRUE(q.TryPop(&val));
+  EXPECT_EQ(0, val);
+  EXPECT_TRUE(q.TryPush(4));
+
+  for (int i = 1; i < 5; ++i) {
+    ASSERT_TRUE(q.TryPop(&val));
+    EXPECT_EQ(i, val);
+  }
+  EXPECT_TRUE(q.Empty());
+}
+
+TEST_F(SpscQueueTest, Threads) {
+  constexpr uint64_t kNum = 100000;
+  SpscQueue<uint64_t> q(64);
+
+  thread producer([&] {
+    for (uint64_t i = 0; i < kNum;) {
+      if (q.TryPush(i))
+        ++i;
+      else
+        this_thread::yield();
+    }
+  });
+
+  uint64_t expected = 0, val;
+  while (expected < kNum) {
+    if (q.TryPop(&val)) {
+      ASSERT_EQ(expected, val);
+      ++expected;
+    } else {
+      this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(q.Empty());
+}
+
+}  // namespace dfly
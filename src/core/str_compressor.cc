@@ -0,0 +1,248 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/str_compressor.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+namespace {
+
+// Blob layout: dictionary slot (1 byte), decoded length (2 bytes), zstd frame.
+constexpr size_t kHeaderLen = 3;
+static_assert(StrCompressor::kMaxLen <= UINT16_MAX);
+
+// Training starts once we have collected that many bytes. zstd recommends ~100x of the
+// dictionary size.
+constexpr size_t kSampleBytes = 1 << 20;
+constexpr size_t kDictCapacity = 1 << 14;
+
+// Once we have a dictionary, we sample one of kResampleRate strings to check whether the data
+// has drifted away from it.
+constexpr uint64_t kResampleRate = 128;
+
+// A retrained dictionary replaces the current one only if it compresses the samples at least
+// by 1/kMinGain better.
+constexpr size_t kMinGain = 16;
+
+size_t CompressedSize(ZSTD_CCtx* cctx, const ZSTD_CDict* cdict, string_view samples,
+                      const vector<size_t>& sizes) {
+  string dest(ZSTD_compressBound(StrCompressor::kMaxLen), '\0');
+  size_t total = 0;
+  const char* next = samples.data();
+
+  for (size_t sz : sizes) {
+    size_t res = ZSTD_compress_usingCDict(cctx, dest.data(), dest.size(), next, sz, cdict);
+    total += ZSTD_isError(res) ? sz : res;
+    next += sz;
+  }
+  return total;
+}
+
+}  // namespace
+
+StrCompressor::StrCompressor(int level) : level_(level) {
+  cctx_ = ZSTD_createCCtx();
+  dctx_ = ZSTD_createDCtx();
+  CHECK(cctx_ && dctx_);
+
+  // We store the decoded length ourselves and do not need the checksum and the dictionary id
+  // since the dictionary is referenced by the blob header.
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_contentSizeFlag, 0);
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_checksumFlag, 0);
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_dictIDFlag, 0);
+}
+
+StrCompressor::~StrCompressor() {
+  if (training_.valid()) {
+    Trained trained = training_.get();
+    ZSTD_freeCDict(trained.cdict);
+    ZSTD_freeDDict(trained.ddict);
+  }
+
+  for (unsigned i = 0; i < kMaxDicts; ++i) {
+    if (dicts_[i].cdict) {
+      LOG_IF(DFATAL, dicts_[i].refcount) << "Dictionary " << i << " is still referenced";
+      FreeDict(i);
+    }
+  }
+
+  ZSTD_freeCCtx(cctx_);
+  ZSTD_freeDCtx(dctx_);
+}
+
+bool StrCompressor::Compress(string_view src, string* dest) {
+  DCHECK(src.size() >= kMinLen && src.size() <= kMaxLen);
+
+  // We do not sample while training to keep the samples consistent with the dictionary
+  // they are compared against.
+  if (!training_.valid() && (active_ < 0 || sample_cnt_++ % kResampleRate == 0)) {
+    samples_.append(src);
+    sample_sizes_.push_back(src.size());
+  }
+
+  if (active_ < 0)
+    return false;
+
+  size_t bound = ZSTD_compressBound(src.size());
+  dest->resize(kHeaderLen + bound);
+
+  size_t res = ZSTD_compress2(cctx_, dest->data() + kHeaderLen, bound, src.data(), src.size());
+  if (ZSTD_isError(res)) {
+    LOG(DFATAL) << "Compression failed " << ZSTD_getErrorName(res);
+    return false;
+  }
+
+  // The ascii encoding saves 1/8 anyway, so that's the minimum to beat.
+  if (kHeaderLen + res > src.size() - src.size() / 8)
+    return false;
+
+  dest->resize(kHeaderLen + res);
+
+  uint16_t len = src.size();
+  (*dest)[0] = active_;
+  memcpy(dest->data() + 1, &len, sizeof(len));
+
+  ++dicts_[active_].refcount;
+  ++stats_.live_blobs;
+
+  return true;
+}
+
+void StrCompressor::Decompress(string_view blob, char* dest) {
+  DCHECK_GT(blob.size(), kHeaderLen);
+
+  uint8_t slot = blob[0];
+  DCHECK_LT(slot, kMaxDicts);
+  DCHECK(dicts_[slot].ddict);
+
+  size_t len = DecodedLen(blob);
+  size_t res = ZSTD_decompress_usingDDict(dctx_, dest, len, blob.data() + kHeaderLen,
+                                          blob.size() - kHeaderLen, dicts_[slot].ddict);
+  CHECK_EQ(res, len) << ZSTD_getErrorName(res);
+}
+
+void StrCompressor::Release(string_view blob) {
+  uint8_t slot = blob[0];
+  DCHECK_LT(slot, kMaxDicts);
+  DCHECK_GT(dicts_[slot].refcount, 0u);
+
+  --stats_.live_blobs;
+  if (--dicts_[slot].refcount == 0 && int(slot) != active_) {
+    FreeDict(slot);
+  }
+}
+
+void StrCompressor::Poll() {
+  if (training_.valid()) {
+    if (training_.wait_for(chrono::seconds(0)) == future_status::ready) {
+      Install(training_.get());
+    }
+    return;
+  }
+
+  if (samples_.size() < kSampleBytes)
+    return;
+
+  const ZSTD_CDict* current = active_ >= 0 ? dicts_[active_].cdict : nullptr;
+
+  // Install() runs on this thread once the training finishes, hence current stays valid.
+  training_ = async(launch::async, &StrCompressor::Train, std::move(samples_),
+                    std::move(sample_sizes_), level_, current);
+  samples_.clear();
+  sample_sizes_.clear();
+}
+
+size_t StrCompressor::DecodedLen(string_view blob) {
+  uint16_t len;
+  memcpy(&len, blob.data() + 1, sizeof(len));
+  return len;
+}
+
+// Runs in a background thread.
+auto StrCompressor::Train(string samples, vector<size_t> sizes, int level,
+                          const ZSTD_CDict* current) -> Trained {
+  string dict(kDictCapacity, '\0');
+  size_t res =
+      ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(), sizes.data(), sizes.size());
+  if (ZDICT_isError(res)) {
+    LOG(WARNING) << "Could not train a dictionary: " << ZDICT_getErrorName(res);
+    return Trained{};
+  }
+
+  Trained trained;
+  trained.cdict = ZSTD_createCDict(dict.data(), res, level);
+
+  if (current) {
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    size_t cur_size = CompressedSize(cctx, current, samples, sizes);
+    size_t new_size = CompressedSize(cctx, trained.cdict, samples, sizes);
+    ZSTD_freeCCtx(cctx);
+
+    VLOG(1) << "Retrained dictionary: " << cur_size << " vs " << new_size << " bytes";
+    if (new_size + cur_size / kMinGain > cur_size) {
+      ZSTD_freeCDict(trained.cdict);
+      return Trained{};
+    }
+  }
+
+  trained.ddict = ZSTD_createDDict(dict.data(), res);
+
+  return trained;
+}
+
+void StrCompressor::Install(Trained trained) {
+  if (!trained.cdict)
+    return;
+
+  // The current dictionary can be reused if nothing references it.
+  if (active_ >= 0 && dicts_[active_].refcount == 0) {
+    ZSTD_CCtx_refCDict(cctx_, nullptr);
+    FreeDict(active_);
+    active_ = -1;
+  }
+
+  unsigned slot = 0;
+  while (slot < kMaxDicts && dicts_[slot].cdict)
+    ++slot;
+
+  if (slot == kMaxDicts) {
+    LOG(WARNING) << "All dictionaries are referenced, dropping the retrained one";
+    ZSTD_freeCDict(trained.cdict);
+    ZSTD_freeDDict(trained.ddict);
+    return;
+  }
+
+  dicts_[slot].cdict = trained.cdict;
+  dicts_[slot].ddict = trained.ddict;
+  DCHECK_EQ(0u, dicts_[slot].refcount);
+
+  size_t res = ZSTD_CCtx_refCDict(cctx_, trained.cdict);
+  CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+
+  stats_.dict_bytes += ZSTD_sizeof_CDict(trained.cdict) + ZSTD_sizeof_DDict(trained.ddict);
+  ++stats_.trainings;
+
+  // The previous dictionary is freed when its last blob is released.
+  active_ = slot;
+}
+
+void StrCompressor::FreeDict(unsigned slot) {
+  Dict& dict = dicts_[slot];
+  stats_.dict_bytes -= ZSTD_sizeof_CDict(dict.cdict) + ZSTD_sizeof_DDict(dict.ddict);
+
+  ZSTD_freeCDict(dict.cdict);
+  ZSTD_freeDDict(dict.ddict);
+  dict = Dict{};
+}
+
+}  // namespace dfly
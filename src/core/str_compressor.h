@@ -0,0 +1,106 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <future>
+#include <string>
+#include <string_view>
+#include <vector>
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
+
+namespace dfly {
+
+// Compresses mid-sized strings with a zstd dictionary that is trained on the strings
+// it has seen. Dragonfly workloads often hold millions of similar blobs (i.e. json documents)
+// that are too short to be compressed on their own but compress very well with a dictionary.
+//
+// Not thread-safe. Blobs can only be decoded by the instance that produced them.
+// Each blob references the dictionary it has been compressed with, so that retraining
+// does not invalidate existing blobs. A dictionary is freed once no blob references it.
+// Training runs in a background thread, see Poll().
+class StrCompressor {
+ public:
+  // Strings outside of this range are not compressed.
+  static constexpr size_t kMinLen = 128;
+  static constexpr size_t kMaxLen = 16384;
+
+  struct Stats {
+    size_t dict_bytes = 0;    // memory used by the live dictionaries.
+    uint64_t trainings = 0;   // how many dictionaries were installed.
+    uint64_t live_blobs = 0;  // how many blobs are referenced.
+  };
+
+  explicit StrCompressor(int level = 3);
+  ~StrCompressor();
+
+  StrCompressor(const StrCompressor&) = delete;
+  void operator=(const StrCompressor&) = delete;
+
+  // Samples src for the next training and compresses it into dest.
+  // Returns false if there is no dictionary yet or if compression does not save enough.
+  // If it returns true, the resulting blob must be eventually released via Release().
+  bool Compress(std::string_view src, std::string* dest);
+
+  // Decompresses blob into dest that must have room for DecodedLen(blob) bytes.
+  void Decompress(std::string_view blob, char* dest);
+
+  // Drops the reference of blob to its dictionary.
+  void Release(std::string_view blob);
+
+  // Installs a dictionary if the background training has finished or starts a new training
+  // if enough samples were collected. Should be called periodically.
+  void Poll();
+
+  bool HasDict() const {
+    return active_ >= 0;
+  }
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+  static size_t DecodedLen(std::string_view blob);
+
+ private:
+  struct Dict {
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+    uint64_t refcount = 0;
+  };
+
+  struct Trained {
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+  };
+
+  static Trained Train(std::string samples, std::vector<size_t> sizes, int level,
+                       const ZSTD_CDict* current);
+
+  void Install(Trained trained);
+  void FreeDict(unsigned slot);
+
+  // Number of dictionaries that can be referenced at the same time.
+  static constexpr unsigned kMaxDicts = 4;
+
+  Dict dicts_[kMaxDicts];
+  int active_ = -1;
+  int level_;
+
+  ZSTD_CCtx* cctx_;
+  ZSTD_DCtx* dctx_;
+
+  std::string samples_;
+  std::vector<size_t> sample_sizes_;
+  uint64_t sample_cnt_ = 0;
+  std::future<Trained> training_;
+
+  Stats stats_;
+};
+
+}  // namespace dfly
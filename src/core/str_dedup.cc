@@ -0,0 +1,74 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/str_dedup.h"
+
+#include <xxhash.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+StrDedup::StrDedup(size_t min_len, pmr::memory_resource* mr)
+    : mr_(mr), min_len_(max(min_len, kMinLen)) {
+}
+
+StrDedup::~StrDedup() {
+  DCHECK(index_.empty()) << "blobs are still referenced";
+}
+
+auto StrDedup::Acquire(string_view str, bool* created) -> Blob* {
+  *created = false;
+  if (str.size() < min_len_ || str.size() > UINT32_MAX)
+    return nullptr;
+
+  uint64_t hash = XXH3_64bits(str.data(), str.size());
+  auto [it, inserted] = index_.emplace(hash, nullptr);
+  if (!inserted) {
+    Blob* blob = it->second;
+    if (blob->View() != str)
+      return nullptr;
+
+    ++blob->refcount;
+    stats_.saved_bytes += MallocUsed(blob);
+    return blob;
+  }
+
+  void* ptr = mr_->allocate(sizeof(Blob) + str.size(), alignof(Blob));
+  Blob* blob = new (ptr) Blob{hash, 1, uint32_t(str.size())};
+  memcpy(blob + 1, str.data(), str.size());
+  it->second = blob;
+
+  ++stats_.blobs;
+  stats_.blob_bytes += MallocUsed(blob);
+  *created = true;
+
+  return blob;
+}
+
+void StrDedup::Release(Blob* blob) {
+  DCHECK_GT(blob->refcount, 0u);
+
+  size_t sz = MallocUsed(blob);
+  if (--blob->refcount > 0) {
+    stats_.saved_bytes -= sz;
+    return;
+  }
+
+  index_.erase(blob->hash);
+  --stats_.blobs;
+  stats_.blob_bytes -= sz;
+  mr_->deallocate(blob, sz, alignof(Blob));
+}
+
+auto StrDedup::stats() const -> Stats {
+  Stats res = stats_;
+  res.index_bytes = index_.capacity() * (sizeof(decltype(index_)::value_type) + 1);
+  return res;
+}
+
+}  // namespace dfly
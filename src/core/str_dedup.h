@@ -0,0 +1,77 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory_resource>
+#include <string_view>
+
+namespace dfly {
+
+// Immutable string that is shared by the values with the same contents, see StrDedup.
+struct DedupBlob {
+  uint64_t hash;
+  uint32_t refcount;
+  uint32_t len;
+
+  std::string_view View() const {
+    return std::string_view{reinterpret_cast<const char*>(this + 1), len};
+  }
+};
+
+// Shares a single copy of identical long strings, i.e. default configs or cached responses
+// that are stored under many keys. Strings are addressed by their 64 bit hash, a string whose
+// hash collides with a different one is not deduplicated.
+//
+// Not thread-safe. Blobs must be released by the instance that produced them, but they are
+// immutable and can be read from other threads as long as they are referenced.
+class StrDedup {
+ public:
+  // Shorter strings are not worth the blob header and the index entry.
+  static constexpr size_t kMinLen = 64;
+
+  using Blob = DedupBlob;
+
+  struct Stats {
+    size_t blobs = 0;        // live blobs.
+    size_t blob_bytes = 0;   // allocated by the live blobs.
+    size_t saved_bytes = 0;  // that the duplicates would have allocated otherwise.
+    size_t index_bytes = 0;  // allocated by the index of the blobs.
+  };
+
+  // Strings shorter than min_len are not deduplicated.
+  StrDedup(size_t min_len, std::pmr::memory_resource* mr);
+  ~StrDedup();
+
+  StrDedup(const StrDedup&) = delete;
+  void operator=(const StrDedup&) = delete;
+
+  size_t min_len() const {
+    return min_len_;
+  }
+
+  // Returns the blob holding str and references it. Sets created to true if the blob was
+  // allocated by this call. Returns null if str is too short or its hash collides.
+  Blob* Acquire(std::string_view str, bool* created);
+
+  // Drops the reference and frees the blob once it's not referenced anymore.
+  void Release(Blob* blob);
+
+  // Bytes allocated for the blob.
+  static size_t MallocUsed(const Blob* blob) {
+    return sizeof(Blob) + blob->len;
+  }
+
+  Stats stats() const;
+
+ private:
+  absl::flat_hash_map<uint64_t, Blob*> index_;
+  std::pmr::memory_resource* mr_;
+  size_t min_len_;
+  Stats stats_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,103 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include <string>
+#include <vector>
+
+namespace dfly {
+using namespace std;
+
+bool StringMap::Set(string_view field, string_view value, bool skip_if_exists) {
+  Key key = MakeKey(field, false);
+  uint64_t* slot = FindSlot(key);
+  if (!slot) {
+    AddSlot(MakeSlot(key, &value), key.hash);
+    return true;
+  }
+
+  if (!skip_if_exists) {
+    // The entry keeps its place, only the allocation changes.
+    uint64_t prev = *slot;
+    *slot = MakeSlot(key, &value);
+    FreeSlot(prev);
+  }
+
+  return false;
+}
+
+bool StringMap::Update(string_view field, string_view value) {
+  Key key = MakeKey(field, false);
+  uint64_t* slot = FindSlot(key);
+  if (!slot)
+    return false;
+
+  uint64_t prev = *slot;
+  *slot = MakeSlot(key, &value, ExpiryOf(prev));
+  FreeSlot(prev);
+  return true;
+}
+
+bool StringMap::SetExpiry(string_view field, uint32_t expire_at) {
+  Key key = MakeKey(field, false);
+  uint64_t* slot = FindSlot(key);
+  if (!slot)
+    return false;
+
+  if (ExpiryOf(*slot) != expire_at) {
+    // The value is copied out of the previous entry before it is freed.
+    uint64_t prev = *slot;
+    string_view value = ValueOf(prev);
+    *slot = MakeSlot(key, &value, expire_at);
+    FreeSlot(prev);
+  }
+
+  if (expire_at && (next_expiry_ == 0 || expire_at < next_expiry_))
+    next_expiry_ = expire_at;
+  return true;
+}
+
+optional<uint32_t> StringMap::FindExpiry(string_view field) const {
+  const uint64_t* slot = FindSlot(MakeKey(field, false));
+  if (!slot)
+    return nullopt;
+
+  return ExpiryOf(*slot);
+}
+
+size_t StringMap::ExpireFields(uint32_t now) {
+  // The slots can not be erased while they are iterated.
+  vector<string> expired;
+  uint32_t next = 0;
+  IterateSlots([&](const uint64_t& slot) {
+    uint32_t expire_at = ExpiryOf(slot);
+    if (expire_at == 0)
+      return true;
+
+    if (expire_at <= now) {
+      expired.emplace_back(View(slot));
+    } else if (next == 0 || expire_at < next) {
+      next = expire_at;
+    }
+    return true;
+  });
+
+  for (const string& field : expired) {
+    Remove(field);
+  }
+  next_expiry_ = next;
+
+  return expired.size();
+}
+
+optional<string_view> StringMap::Find(string_view field) const {
+  const uint64_t* slot = FindSlot(MakeKey(field, false));
+  if (!slot)
+    return nullopt;
+
+  return ValueOf(*slot);
+}
+
+}  // namespace dfly
@@ -0,0 +1,95 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <optional>
+#include <utility>
+
+#include "core/string_table.h"
+
+namespace dfly {
+
+// The field/value map of the large hashes, i.e. of OBJ_ENCODING_HT. Replaces the redis dict,
+// which takes a dictEntry and two sds per field. Every field is stored with its value in a
+// single allocation, see StringTable. The views returned by the accessors are valid until the
+// map is changed.
+//
+// A field may have a deadline in seconds since the epoch, see HEXPIRE. The map does not check
+// the clock: the fields stay visible until ExpireFields removes them.
+class StringMap : public StringTable {
+ public:
+  StringMap() = default;
+
+  // Returns true if the field was added. Otherwise replaces its value unless skip_if_exists,
+  // and the field loses its deadline.
+  bool Set(std::string_view field, std::string_view value, bool skip_if_exists = false);
+
+  // Replaces the value of an existing field and keeps its deadline. Returns false if there is
+  // no such field.
+  bool Update(std::string_view field, std::string_view value);
+
+  // Sets the deadline of the field, 0 removes it. Returns false if there is no such field.
+  bool SetExpiry(std::string_view field, uint32_t expire_at);
+
+  // Returns the deadline of the field, 0 if it has none, or nullopt if there is no such field.
+  std::optional<uint32_t> FindExpiry(std::string_view field) const;
+
+  // Removes the fields whose deadlines are not after now and returns their number.
+  size_t ExpireFields(uint32_t now);
+
+  // A lower bound of the deadlines of the fields, 0 if none has one. Exact after ExpireFields.
+  uint32_t next_expiry() const {
+    return next_expiry_;
+  }
+
+  // Returns true if ExpireFields(now) may remove some fields.
+  bool HasExpired(uint32_t now) const {
+    return next_expiry_ != 0 && next_expiry_ <= now;
+  }
+
+  // Returns true if the field was removed.
+  bool Remove(std::string_view field) {
+    return Erase(MakeKey(field, false));
+  }
+
+  std::optional<std::string_view> Find(std::string_view field) const;
+
+  bool Contains(std::string_view field) const {
+    return FindSlot(MakeKey(field, false)) != nullptr;
+  }
+
+  // Returns a pseudo-random pair, rnd is a uniformly distributed number.
+  // Requires: !Empty().
+  std::pair<std::string_view, std::string_view> RandomPair(uint64_t rnd) const {
+    uint64_t slot = RandomSlot(rnd);
+    return {View(slot), ValueOf(slot)};
+  }
+
+  // Calls cb(field, value) for count distinct pseudo-random pairs, see StringTable::SampleSlots.
+  void Sample(size_t count, const std::function<uint64_t()>& rnd,
+              const std::function<void(std::string_view, std::string_view)>& cb) const {
+    SampleSlots(count, rnd, [&cb](const uint64_t& slot) { cb(View(slot), ValueOf(slot)); });
+  }
+
+  using StringTable::Reserve;
+
+  // Calls f(field, value) for every pair until it returns false. Returns false if f stopped the
+  // iteration. The map must not be changed during the iteration.
+  template <typename F> bool Iterate(F&& f) const {
+    return IterateSlots([&f](const uint64_t& slot) { return f(View(slot), ValueOf(slot)); });
+  }
+
+  // Calls cb(field, value) for the pairs of a few buckets and returns the cursor of the next
+  // call, 0 once all the buckets were visited. See StringTable::ScanSlots for the guarantees.
+  uint64_t Scan(uint64_t cursor,
+                const std::function<void(std::string_view, std::string_view)>& cb) const {
+    return ScanSlots(cursor, [&cb](const uint64_t& slot) { cb(View(slot), ValueOf(slot)); });
+  }
+
+ private:
+  uint32_t next_expiry_ = 0;
+};
+
+}  // namespace dfly
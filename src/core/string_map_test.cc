@@ -0,0 +1,204 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/dict.h"
+#include "redis/redis_aux.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class StringMapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    InitRedisTables();  // to initialize server struct.
+    init_zmalloc_threadlocal(mi_heap_get_backing());
+  }
+
+  StringMap sm_;
+};
+
+TEST_F(StringMapTest, Basic) {
+  EXPECT_TRUE(sm_.Empty());
+  EXPECT_FALSE(sm_.Find("foo"));
+
+  EXPECT_TRUE(sm_.Set("foo", "bar"));
+  EXPECT_TRUE(sm_.Set("", ""));
+  EXPECT_EQ(2u, sm_.Size());
+  EXPECT_EQ("bar", sm_.Find("foo"));
+  EXPECT_EQ("", sm_.Find(""));
+  EXPECT_TRUE(sm_.Contains("foo"));
+
+  EXPECT_FALSE(sm_.Set("foo", "baz", true));
+  EXPECT_EQ("bar", sm_.Find("foo"));
+  EXPECT_FALSE(sm_.Set("foo", string(300, 'x')));
+  EXPECT_EQ(string(300, 'x'), sm_.Find("foo"));
+  EXPECT_EQ(2u, sm_.Size());
+
+  EXPECT_TRUE(sm_.Remove("foo"));
+  EXPECT_FALSE(sm_.Remove("foo"));
+  EXPECT_FALSE(sm_.Contains("foo"));
+  EXPECT_EQ(1u, sm_.Size());
+}
+
+TEST_F(StringMapTest, Resize) {
+  constexpr unsigned kNum = 10000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(sm_.Set(absl::StrCat("field", i), absl::StrCat("value", i)));
+  }
+  EXPECT_EQ(kNum, sm_.Size());
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    if (i % 10 != 0)
+      ASSERT_TRUE(sm_.Remove(absl::StrCat("field", i)));
+  }
+  EXPECT_EQ(kNum / 10, sm_.Size());
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    auto val = sm_.Find(absl::StrCat("field", i));
+    if (i % 10 == 0) {
+      ASSERT_EQ(absl::StrCat("value", i), val) << i;
+    } else {
+      ASSERT_FALSE(val) << i;
+    }
+  }
+
+  auto [field, val] = sm_.RandomPair(12345);
+  EXPECT_EQ(sm_.Find(field), val);
+}
+
+TEST_F(StringMapTest, Expiry) {
+  EXPECT_FALSE(sm_.SetExpiry("foo", 100));
+  EXPECT_FALSE(sm_.FindExpiry("foo"));
+
+  EXPECT_TRUE(sm_.Set("foo", "bar"));
+  EXPECT_TRUE(sm_.Set("long", string(300, 'x')));
+  EXPECT_TRUE(sm_.Set("keep", "1"));
+  EXPECT_EQ(0u, sm_.FindExpiry("foo"));
+  EXPECT_EQ(0u, sm_.next_expiry());
+
+  EXPECT_TRUE(sm_.SetExpiry("foo", 100));
+  EXPECT_TRUE(sm_.SetExpiry("long", 50));
+  EXPECT_EQ(100u, sm_.FindExpiry("foo"));
+  EXPECT_EQ("bar", sm_.Find("foo"));
+  EXPECT_EQ(string(300, 'x'), sm_.Find("long"));
+  EXPECT_EQ(50u, sm_.next_expiry());
+
+  // Update keeps the deadline, Set drops it.
+  EXPECT_TRUE(sm_.Update("foo", "baz"));
+  EXPECT_EQ(100u, sm_.FindExpiry("foo"));
+  EXPECT_EQ("baz", sm_.Find("foo"));
+  EXPECT_FALSE(sm_.Update("missing", "1"));
+
+  EXPECT_FALSE(sm_.HasExpired(49));
+  EXPECT_TRUE(sm_.HasExpired(50));
+  EXPECT_EQ(1u, sm_.ExpireFields(60));
+  EXPECT_FALSE(sm_.Contains("long"));
+  EXPECT_EQ(100u, sm_.next_expiry());
+
+  EXPECT_FALSE(sm_.Set("foo", "bar"));
+  EXPECT_EQ(0u, sm_.FindExpiry("foo"));
+  EXPECT_EQ(0u, sm_.ExpireFields(1000));
+  EXPECT_EQ(0u, sm_.next_expiry());
+  EXPECT_EQ(2u, sm_.Size());
+
+  // The entries with deadlines are rehashed and freed like the rest.
+  for (unsigned i = 0; i < 1000; ++i) {
+    string field = absl::StrCat("f", i);
+    ASSERT_TRUE(sm_.Set(field, field));
+    ASSERT_TRUE(sm_.SetExpiry(field, 200 + i % 2));
+  }
+  EXPECT_EQ(500u, sm_.ExpireFields(200));
+  EXPECT_EQ(502u, sm_.Size());
+  EXPECT_EQ("f1", sm_.Find("f1"));
+  EXPECT_EQ(201u, sm_.FindExpiry("f1"));
+  EXPECT_TRUE(sm_.SetExpiry("f1", 0));
+  EXPECT_EQ(0u, sm_.FindExpiry("f1"));
+  EXPECT_EQ(499u, sm_.ExpireFields(201));
+  EXPECT_EQ(3u, sm_.Size());
+}
+
+TEST_F(StringMapTest, Sample) {
+  constexpr unsigned kNum = 100;
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_.Set(absl::StrCat("field:", i), absl::StrCat(i));
+  }
+
+  mt19937_64 gen(42);
+  absl::flat_hash_map<string, string> sampled;
+  sm_.Sample(30, [&gen] { return gen(); }, [&](string_view field, string_view value) {
+    EXPECT_EQ(sm_.Find(field), value);
+    EXPECT_TRUE(sampled.emplace(field, value).second);
+  });
+  EXPECT_EQ(30u, sampled.size());
+
+  sampled.clear();
+  sm_.Sample(kNum, [&gen] { return gen(); },
+             [&](string_view field, string_view value) { sampled.emplace(field, value); });
+  EXPECT_EQ(kNum, sampled.size());
+}
+
+TEST_F(StringMapTest, Scan) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_.Set(absl::StrCat(i), absl::StrCat("v", i));
+  }
+
+  // The pairs that stay during the scan are returned even though the map is resized.
+  absl::flat_hash_map<string, string> seen;
+  uint64_t cursor = 0;
+  unsigned next = kNum;
+  do {
+    cursor = sm_.Scan(cursor, [&](string_view field, string_view val) {
+      seen.emplace(field, val);
+    });
+    for (unsigned j = 0; j < 10; ++j, ++next) {
+      sm_.Set(absl::StrCat(next), "new");
+    }
+  } while (cursor);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    EXPECT_EQ(absl::StrCat("v", i), seen[absl::StrCat(i)]) << i;
+  }
+}
+
+TEST_F(StringMapTest, MemoryVsDict) {
+  constexpr unsigned kNum = 10000;
+
+  size_t allocated1, resident1, active1;
+  size_t allocated2, resident2, active2;
+  zmalloc_get_allocator_info(&allocated1, &active1, &resident1);
+
+  dict* d = dictCreate(&hashDictType);
+  for (unsigned i = 0; i < kNum; ++i) {
+    sds field = sdscatfmt(sdsempty(), "field:%u", i);
+    sds val = sdscatfmt(sdsempty(), "value:%u", i);
+    dictAdd(d, field, val);
+  }
+  zmalloc_get_allocator_info(&allocated2, &active2, &resident2);
+  size_t dict_used = allocated2 - allocated1;
+  dictRelease(d);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_.Set(absl::StrCat("field:", i), absl::StrCat("value:", i));
+  }
+  LOG(INFO) << "dict used: " << dict_used << " string map used: " << sm_.MallocUsed();
+  EXPECT_LT(sm_.MallocUsed() + 8 * kNum, dict_used);
+}
+
+}  // namespace dfly
@@ -0,0 +1,27 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_set.h"
+
+namespace dfly {
+using namespace std;
+
+bool StringSet::Add(string_view member) {
+  Key key = MakeKey(member, true);
+  if (FindSlot(key))
+    return false;
+
+  AddSlot(MakeSlot(key, nullptr), key.hash);
+  return true;
+}
+
+string StringSet::Pop() {
+  uint64_t slot = PopSlot();
+  string res{View(slot)};
+  FreeSlot(slot);
+
+  return res;
+}
+
+}  // namespace dfly
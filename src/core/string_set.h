@@ -0,0 +1,63 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+
+#include "core/string_table.h"
+
+namespace dfly {
+
+// The set of strings of the large sets, i.e. of the kEncodingStrMap encoding. Replaces the redis
+// dict, which takes a dictEntry and an sds per member. The members of up to 7 bytes are stored
+// inside their slots, the longer ones in a single allocation, see StringTable.
+class StringSet : public StringTable {
+ public:
+  StringSet() = default;
+
+  // Returns true if the member was added, false if it was already in the set.
+  bool Add(std::string_view member);
+
+  // Returns true if the member was removed.
+  bool Remove(std::string_view member) {
+    return Erase(MakeKey(member, true));
+  }
+
+  bool Contains(std::string_view member) const {
+    return FindSlot(MakeKey(member, true)) != nullptr;
+  }
+
+  // Removes and returns an arbitrary member.
+  // Requires: !Empty().
+  std::string Pop();
+
+  // Returns a pseudo-random member, rnd is a uniformly distributed number.
+  // Requires: !Empty().
+  std::string_view RandomMember(uint64_t rnd) const {
+    return View(RandomSlot(rnd));
+  }
+
+  // Calls cb for count distinct pseudo-random members, see StringTable::SampleSlots.
+  void Sample(size_t count, const std::function<uint64_t()>& rnd,
+              const std::function<void(std::string_view)>& cb) const {
+    SampleSlots(count, rnd, [&cb](const uint64_t& slot) { cb(View(slot)); });
+  }
+
+  using StringTable::Reserve;
+
+  // Calls f for every member until it returns false. Returns false if f stopped the iteration.
+  // The members must not be changed during the iteration.
+  template <typename F> bool Iterate(F&& f) const {
+    return IterateSlots([&f](const uint64_t& slot) { return f(View(slot)); });
+  }
+
+  // Calls cb for the members of a few buckets and returns the cursor of the next call, 0 once
+  // all the buckets were visited. See StringTable::ScanSlots for the guarantees.
+  uint64_t Scan(uint64_t cursor, const std::function<void(std::string_view)>& cb) const {
+    return ScanSlots(cursor, [&cb](const uint64_t& slot) { cb(View(slot)); });
+  }
+};
+
+}  // namespace dfly
@@ -0,0 +1,213 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_set.h"
+
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/dict.h"
+#include "redis/redis_aux.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class StringSetTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    InitRedisTables();  // to initialize server struct.
+    init_zmalloc_threadlocal(mi_heap_get_backing());
+  }
+
+  StringSet ss_;
+};
+
+TEST_F(StringSetTest, Basic) {
+  EXPECT_TRUE(ss_.Empty());
+  EXPECT_FALSE(ss_.Contains("foo"));
+
+  EXPECT_TRUE(ss_.Add("foo"));
+  EXPECT_FALSE(ss_.Add("foo"));
+  EXPECT_TRUE(ss_.Add(""));
+  EXPECT_TRUE(ss_.Add("a long member that is allocated"));
+  EXPECT_EQ(3u, ss_.Size());
+
+  EXPECT_TRUE(ss_.Contains("foo"));
+  EXPECT_TRUE(ss_.Contains(""));
+  EXPECT_TRUE(ss_.Contains("a long member that is allocated"));
+  EXPECT_FALSE(ss_.Contains("fo"));
+
+  EXPECT_TRUE(ss_.Remove("foo"));
+  EXPECT_FALSE(ss_.Remove("foo"));
+  EXPECT_FALSE(ss_.Contains("foo"));
+  EXPECT_EQ(2u, ss_.Size());
+}
+
+TEST_F(StringSetTest, Lengths) {
+  // Around the inline limit and the long length header.
+  vector<string> members;
+  for (size_t len : {0, 1, 6, 7, 8, 9, 254, 255, 256, 100000}) {
+    members.push_back(string(len, 'x'));
+    members.push_back(string(len, 'y'));
+  }
+
+  for (const string& m : members) {
+    EXPECT_TRUE(ss_.Add(m)) << m.size();
+  }
+
+  for (const string& m : members) {
+    EXPECT_TRUE(ss_.Contains(m)) << m.size();
+    EXPECT_FALSE(ss_.Add(m)) << m.size();
+  }
+
+  absl::flat_hash_set<string> seen;
+  ss_.Iterate([&](string_view member) {
+    seen.emplace(member);
+    return true;
+  });
+  EXPECT_EQ(members.size(), seen.size());
+  for (const string& m : members) {
+    EXPECT_TRUE(seen.contains(m)) << m.size();
+  }
+}
+
+TEST_F(StringSetTest, Resize) {
+  constexpr unsigned kNum = 10000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(ss_.Add(absl::StrCat("member", i)));
+    ASSERT_EQ(i + 1, ss_.Size());
+  }
+  size_t used = ss_.MallocUsed();
+
+  // Removes most of the members, the array shrinks on the way.
+  for (unsigned i = 0; i < kNum; ++i) {
+    if (i % 10 != 0)
+      ASSERT_TRUE(ss_.Remove(absl::StrCat("member", i)));
+  }
+  EXPECT_EQ(kNum / 10, ss_.Size());
+  EXPECT_LT(ss_.MallocUsed(), used / 2);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_EQ(i % 10 == 0, ss_.Contains(absl::StrCat("member", i))) << i;
+  }
+}
+
+TEST_F(StringSetTest, Pop) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss_.Add(absl::StrCat("member:", i));
+  }
+
+  absl::flat_hash_set<string> popped;
+  while (!ss_.Empty()) {
+    string member = ss_.Pop();
+    EXPECT_FALSE(ss_.Contains(member));
+    EXPECT_TRUE(popped.insert(member).second);
+  }
+  EXPECT_EQ(kNum, popped.size());
+  EXPECT_TRUE(popped.contains("member:0"));
+}
+
+TEST_F(StringSetTest, Sample) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss_.Add(absl::StrCat("member:", i));
+  }
+
+  mt19937_64 gen(42);
+  auto rnd = [&gen] { return gen(); };
+
+  // Both the drawing and the single pass, the members are distinct.
+  for (size_t count : {1, 10, 500, 501, 999, 1000}) {
+    absl::flat_hash_set<string> sampled;
+    ss_.Sample(count, rnd, [&](string_view member) {
+      EXPECT_TRUE(ss_.Contains(member));
+      EXPECT_TRUE(sampled.emplace(member).second);
+    });
+    EXPECT_EQ(count, sampled.size());
+  }
+
+  // Every member is reachable.
+  absl::flat_hash_set<string> seen;
+  for (unsigned i = 0; i < 100; ++i) {
+    ss_.Sample(100, rnd, [&](string_view member) { seen.emplace(member); });
+  }
+  EXPECT_EQ(kNum, seen.size());
+  EXPECT_TRUE(ss_.Contains(ss_.RandomMember(gen())));
+}
+
+TEST_F(StringSetTest, Scan) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss_.Add(absl::StrCat(i));
+  }
+
+  // The members that stay during the scan are returned even though the set is resized.
+  absl::flat_hash_set<string> seen;
+  uint64_t cursor = 0;
+  unsigned next = kNum;
+  do {
+    cursor = ss_.Scan(cursor, [&](string_view member) { seen.emplace(member); });
+    for (unsigned j = 0; j < 10; ++j) {
+      ss_.Add(absl::StrCat(next++));
+    }
+  } while (cursor);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    EXPECT_TRUE(seen.contains(absl::StrCat(i))) << i;
+  }
+}
+
+TEST_F(StringSetTest, ClearStep) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss_.Add(absl::StrCat("a member that is not inline ", i));
+  }
+
+  uint64_t cursor = 0;
+  size_t budget = 100;
+  EXPECT_FALSE(ss_.ClearStep(&cursor, &budget));
+  EXPECT_EQ(0u, budget);
+  EXPECT_EQ(kNum - 100, ss_.Size());
+
+  do {
+    budget = 100;
+  } while (!ss_.ClearStep(&cursor, &budget));
+  EXPECT_TRUE(ss_.Empty());
+}
+
+TEST_F(StringSetTest, MemoryVsDict) {
+  constexpr unsigned kNum = 10000;
+
+  size_t allocated1, resident1, active1;
+  size_t allocated2, resident2, active2;
+  zmalloc_get_allocator_info(&allocated1, &active1, &resident1);
+
+  dict* d = dictCreate(&setDictType);
+  for (unsigned i = 0; i < kNum; ++i) {
+    sds key = sdscatfmt(sdsempty(), "key:%u", i);
+    dictAdd(d, key, nullptr);
+  }
+  zmalloc_get_allocator_info(&allocated2, &active2, &resident2);
+  size_t dict_used = allocated2 - allocated1;
+  dictRelease(d);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    ss_.Add(absl::StrCat("key:", i));
+  }
+  LOG(INFO) << "dict used: " << dict_used << " string set used: " << ss_.MallocUsed();
+  EXPECT_LT(ss_.MallocUsed() + 8 * kNum, dict_used);
+}
+
+}  // namespace dfly
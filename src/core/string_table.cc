@@ -0,0 +1,512 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_table.h"
+
+#include <absl/container/flat_hash_set.h>
+#include <xxhash.h>
+
+#include <cstring>
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+#include "base/logging.h"
+
+namespace dfly {
+using namespace std;
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "the inline keys are stored in the upper bytes of the slots");
+
+namespace {
+
+constexpr uint64_t kHashSeed = 24061983;
+constexpr size_t kNotFound = size_t(-1);
+
+constexpr size_t kMaxInlineLen = 7;
+constexpr unsigned kTagShift = 48;
+constexpr uint64_t kPtrMask = (1ULL << kTagShift) - 1;
+
+// The strings of an entry are prefixed with their length, or with 0xFF followed by a 4-byte
+// length.
+constexpr uint8_t kLongLenMarker = 0xFF;
+
+inline bool IsInline(uint64_t slot) {
+  return slot & 1;
+}
+
+// The entries are aligned to 8 bytes, so the pointer slots have a spare bit, which marks
+// the entries that start with a deadline.
+constexpr uint64_t kExpiryBit = 2;
+
+inline uint8_t* AllocOf(uint64_t slot) {
+  return reinterpret_cast<uint8_t*>(slot & kPtrMask & ~kExpiryBit);
+}
+
+// Returns the start of the key of the entry.
+inline const uint8_t* EntryOf(uint64_t slot) {
+  return AllocOf(slot) + ((slot & kExpiryBit) ? sizeof(uint32_t) : 0);
+}
+
+inline size_t LenHeaderSize(size_t len) {
+  return len < kLongLenMarker ? 1 : 5;
+}
+
+uint8_t* WriteStr(string_view str, uint8_t* dest) {
+  if (str.size() < kLongLenMarker) {
+    *dest++ = str.size();
+  } else {
+    uint32_t len = str.size();
+    *dest++ = kLongLenMarker;
+    memcpy(dest, &len, sizeof(len));
+    dest += sizeof(len);
+  }
+  memcpy(dest, str.data(), str.size());
+  return dest + str.size();
+}
+
+string_view ReadStr(const uint8_t* src) {
+  if (src[0] != kLongLenMarker)
+    return string_view{reinterpret_cast<const char*>(src + 1), src[0]};
+
+  uint32_t len;
+  memcpy(&len, src + 1, sizeof(len));
+  return string_view{reinterpret_cast<const char*>(src + 5), len};
+}
+
+constexpr unsigned kRandomTries = 32;
+
+// The splitmix64 step, derives another random number from rnd.
+uint64_t MixRnd(uint64_t rnd) {
+  rnd += 0x9E3779B97F4A7C15ULL;
+  rnd = (rnd ^ (rnd >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  rnd = (rnd ^ (rnd >> 27)) * 0x94D049BB133111EBULL;
+  return rnd ^ (rnd >> 31);
+}
+
+// Reverses the bits, for the cursor of ScanSlots. See rev() in dict.c.
+uint64_t Rev(uint64_t v) {
+  unsigned s = 64;
+  uint64_t mask = ~0ULL;
+  while ((s >>= 1) > 0) {
+    mask ^= (mask << s);
+    v = ((v >> s) & mask) | ((v << s) & ~mask);
+  }
+  return v;
+}
+
+}  // namespace
+
+StringTable::~StringTable() {
+  for (Table* table : {&old_, &cur_}) {
+    for (size_t i = 0; i < table->capacity; ++i) {
+      if (table->slots[i])
+        FreeSlot(table->slots[i]);
+    }
+    zfree(table->slots);
+  }
+}
+
+bool StringTable::ClearStep(uint64_t* cursor, size_t* budget) {
+  size_t total = old_.capacity + cur_.capacity;
+  for (; *cursor < total && *budget > 0; ++*cursor) {
+    bool in_old = *cursor < old_.capacity;
+    Table* table = in_old ? &old_ : &cur_;
+    uint64_t& slot = table->slots[in_old ? *cursor : *cursor - old_.capacity];
+    if (slot) {
+      FreeSlot(slot);
+      slot = 0;
+      --table->size;
+      --*budget;
+    }
+  }
+
+  return *cursor >= total;
+}
+
+size_t StringTable::MallocUsed() const {
+  size_t res = obj_malloc_used_;
+  if (cur_.slots)
+    res += zmalloc_usable_size(cur_.slots);
+  if (old_.slots)
+    res += zmalloc_usable_size(old_.slots);
+  return res;
+}
+
+auto StringTable::MakeKey(string_view str, bool allow_inline) -> Key {
+  Key key{str, Hash(str), 0};
+  if (allow_inline && str.size() <= kMaxInlineLen) {
+    key.inline_slot = (str.size() << 1) | 1;
+    memcpy(reinterpret_cast<char*>(&key.inline_slot) + 1, str.data(), str.size());
+  }
+  return key;
+}
+
+string_view StringTable::View(const uint64_t& slot) {
+  DCHECK(slot);
+
+  if (IsInline(slot))
+    return string_view{reinterpret_cast<const char*>(&slot) + 1, (slot & 0xFF) >> 1};
+
+  return ReadStr(EntryOf(slot));
+}
+
+string_view StringTable::ValueOf(uint64_t slot) {
+  DCHECK(slot && !IsInline(slot));
+
+  string_view key = ReadStr(EntryOf(slot));
+  return ReadStr(reinterpret_cast<const uint8_t*>(key.data() + key.size()));
+}
+
+uint64_t* StringTable::FindSlot(const Key& key) {
+  return const_cast<uint64_t*>(static_cast<const StringTable*>(this)->FindSlot(key));
+}
+
+const uint64_t* StringTable::FindSlot(const Key& key) const {
+  for (const Table* table : {&cur_, &old_}) {
+    size_t index = Find(*table, key);
+    if (index != kNotFound)
+      return &table->slots[index];
+  }
+  return nullptr;
+}
+
+uint32_t StringTable::ExpiryOf(uint64_t slot) {
+  if (IsInline(slot) || !(slot & kExpiryBit))
+    return 0;
+
+  uint32_t res;
+  memcpy(&res, AllocOf(slot), sizeof(res));
+  return res;
+}
+
+uint64_t StringTable::MakeSlot(const Key& key, const string_view* value, uint32_t expire_at) {
+  if (key.inline_slot && !value && !expire_at)
+    return key.inline_slot;
+
+  size_t len = LenHeaderSize(key.str.size()) + key.str.size();
+  if (value)
+    len += LenHeaderSize(value->size()) + value->size();
+  if (expire_at)
+    len += sizeof(expire_at);
+
+  uint8_t* ptr = (uint8_t*)zmalloc(len);
+  uint8_t* next = ptr;
+  if (expire_at) {
+    memcpy(next, &expire_at, sizeof(expire_at));
+    next += sizeof(expire_at);
+  }
+  next = WriteStr(key.str, next);
+  if (value)
+    WriteStr(*value, next);
+  obj_malloc_used_ += zmalloc_usable_size(ptr);
+
+  uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+  DCHECK_EQ(0u, addr >> kTagShift);
+  DCHECK_EQ(0u, addr & (kExpiryBit | 1));
+
+  if (expire_at)
+    addr |= kExpiryBit;
+  return addr | ((key.hash >> kTagShift) << kTagShift);
+}
+
+void StringTable::FreeSlot(uint64_t slot) {
+  if (IsInline(slot))
+    return;
+
+  void* ptr = AllocOf(slot);
+  obj_malloc_used_ -= zmalloc_usable_size(ptr);
+  zfree(ptr);
+}
+
+void StringTable::AddSlot(uint64_t slot, uint64_t hash) {
+  if ((Size() + 1) * 4 > cur_.capacity * 3)
+    Grow();
+
+  Insert(&cur_, slot, hash);
+  RehashStep();
+}
+
+bool StringTable::Erase(const Key& key) {
+  Table* table = &cur_;
+  size_t index = Find(cur_, key);
+  if (index == kNotFound) {
+    table = &old_;
+    index = Find(old_, key);
+    if (index == kNotFound)
+      return false;
+  }
+
+  FreeSlot(table->slots[index]);
+  EraseAt(table, index);
+  RehashStep();
+  Shrink();
+
+  return true;
+}
+
+uint64_t StringTable::PopSlot() {
+  DCHECK(!Empty());
+
+  RehashStep();
+
+  // The slots of old_ before rehash_pos_ are empty.
+  Table* table = &old_;
+  size_t index = rehash_pos_;
+  if (old_.size == 0) {
+    table = &cur_;
+    index = pop_pos_ & cur_.mask();
+  }
+
+  while (!table->slots[index]) {
+    index = (index + 1) & table->mask();
+  }
+
+  uint64_t slot = table->slots[index];
+  EraseAt(table, index);
+
+  // The slots before the popped one were empty, the next call continues from there.
+  if (table == &cur_)
+    pop_pos_ = index;
+  Shrink();
+
+  return slot;
+}
+
+const uint64_t& StringTable::RandomSlot(uint64_t rnd) const {
+  DCHECK(!Empty());
+
+  const Table& table = (rnd >> 32) % Size() < old_.size ? old_ : cur_;
+
+  // Probing for the next full slot would favor the slots that follow long runs of empty ones,
+  // so a few random slots are tried first. The table is at least 1/8 full unless it is being
+  // resized.
+  size_t index = rnd & table.mask();
+  for (unsigned i = 0; i < kRandomTries && !table.slots[index]; ++i) {
+    rnd = MixRnd(rnd);
+    index = rnd & table.mask();
+  }
+
+  while (!table.slots[index]) {
+    index = (index + 1) & table.mask();
+  }
+
+  return table.slots[index];
+}
+
+void StringTable::SampleSlots(size_t count, const std::function<uint64_t()>& rnd,
+                              const std::function<void(const uint64_t&)>& cb) const {
+  DCHECK_LE(count, Size());
+
+  if (count * 2 <= Size()) {
+    absl::flat_hash_set<const uint64_t*> picked;
+    picked.reserve(count);
+    while (picked.size() < count) {
+      const uint64_t& slot = RandomSlot(rnd());
+      if (picked.insert(&slot).second)
+        cb(slot);
+    }
+    return;
+  }
+
+  // Selection sampling: every slot is picked with the probability of the slots still needed
+  // out of the slots not visited yet.
+  size_t remaining = Size();
+  IterateSlots([&](const uint64_t& slot) {
+    if (rnd() % remaining-- < count) {
+      cb(slot);
+      --count;
+    }
+    return count > 0;
+  });
+}
+
+uint64_t StringTable::ScanSlots(uint64_t cursor,
+                                const std::function<void(const uint64_t&)>& cb) const {
+  if (Empty())
+    return 0;
+
+  uint64_t v = cursor;
+  if (!old_.slots) {
+    uint64_t m0 = cur_.mask();
+    ScanBucket(cur_, v & m0, cb);
+
+    // Increments the reversed cursor, see dictScan.
+    v |= ~m0;
+    v = Rev(v);
+    ++v;
+    return Rev(v);
+  }
+
+  // Visits the bucket of the smaller array and all its expansions in the larger one.
+  const Table* t0 = &cur_;
+  const Table* t1 = &old_;
+  if (t0->capacity > t1->capacity)
+    swap(t0, t1);
+
+  uint64_t m0 = t0->mask();
+  uint64_t m1 = t1->mask();
+  ScanBucket(*t0, v & m0, cb);
+
+  do {
+    ScanBucket(*t1, v & m1, cb);
+
+    v |= ~m1;
+    v = Rev(v);
+    ++v;
+    v = Rev(v);
+  } while (v & (m0 ^ m1));
+
+  return v;
+}
+
+void StringTable::Reserve(size_t n) {
+  DCHECK(Empty());
+
+  size_t capacity = kMinCapacity;
+  while (capacity * 3 < n * 4) {
+    capacity *= 2;
+  }
+
+  if (capacity <= cur_.capacity)
+    return;
+
+  zfree(cur_.slots);
+  cur_ = Table{};
+  cur_.slots = (uint64_t*)zcalloc(capacity * sizeof(uint64_t));
+  cur_.capacity = capacity;
+}
+
+uint64_t StringTable::Hash(string_view str) {
+  return XXH3_64bits_withSeed(str.data(), str.size(), kHashSeed);
+}
+
+bool StringTable::Matches(uint64_t slot, const Key& key) {
+  if (key.inline_slot)
+    return slot == key.inline_slot;
+
+  if (IsInline(slot) || (slot >> kTagShift) != (key.hash >> kTagShift))
+    return false;
+
+  return View(slot) == key.str;
+}
+
+size_t StringTable::Find(const Table& table, const Key& key) {
+  if (table.size == 0)
+    return kNotFound;
+
+  size_t mask = table.mask();
+  for (size_t i = key.hash & mask; table.slots[i]; i = (i + 1) & mask) {
+    if (Matches(table.slots[i], key))
+      return i;
+  }
+
+  return kNotFound;
+}
+
+void StringTable::Insert(Table* table, uint64_t slot, uint64_t hash) {
+  size_t mask = table->mask();
+  size_t i = hash & mask;
+  while (table->slots[i]) {
+    i = (i + 1) & mask;
+  }
+
+  table->slots[i] = slot;
+  ++table->size;
+}
+
+// Backward shift deletion: moves the following slots of the cluster into the hole unless that
+// would put them before their home slot.
+void StringTable::EraseAt(Table* table, size_t index) {
+  size_t mask = table->mask();
+  size_t hole = index;
+
+  for (size_t i = (index + 1) & mask; table->slots[i]; i = (i + 1) & mask) {
+    size_t home = Hash(View(table->slots[i])) & mask;
+
+    // The slot stays if its home is cyclically in (hole, i].
+    bool stays = hole < i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (!stays) {
+      table->slots[hole] = table->slots[i];
+      hole = i;
+    }
+  }
+
+  table->slots[hole] = 0;
+  --table->size;
+}
+
+void StringTable::ScanBucket(const Table& table, size_t bucket,
+                             const std::function<void(const uint64_t&)>& cb) {
+  if (table.size == 0)
+    return;
+
+  // The keys of a bucket are in the cluster that follows its slot.
+  size_t mask = table.mask();
+  for (size_t i = bucket; table.slots[i]; i = (i + 1) & mask) {
+    if ((Hash(View(table.slots[i])) & mask) == bucket)
+      cb(table.slots[i]);
+  }
+}
+
+void StringTable::Grow() {
+  StartResize(cur_.capacity ? cur_.capacity * 2 : kMinCapacity);
+}
+
+void StringTable::Shrink() {
+  if (!old_.slots && cur_.capacity > kMinCapacity && cur_.size * 8 < cur_.capacity)
+    StartResize(cur_.capacity / 2);
+}
+
+void StringTable::StartResize(size_t capacity) {
+  while (old_.slots) {
+    RehashStep();
+  }
+
+  old_ = cur_;
+  cur_ = Table{};
+  cur_.slots = (uint64_t*)zcalloc(capacity * sizeof(uint64_t));
+  cur_.capacity = capacity;
+  pop_pos_ = 0;
+
+  if (old_.size == 0) {
+    zfree(old_.slots);
+    old_ = Table{};
+    return;
+  }
+
+  // The slots are moved by whole clusters, so that the rest of old_ can still be probed.
+  rehash_pos_ = 0;
+  while (old_.slots[rehash_pos_]) {
+    ++rehash_pos_;
+  }
+}
+
+void StringTable::RehashStep() {
+  if (!old_.slots)
+    return;
+
+  size_t mask = old_.mask();
+  for (size_t n = 0; old_.size > 0; ++n, rehash_pos_ = (rehash_pos_ + 1) & mask) {
+    uint64_t& slot = old_.slots[rehash_pos_];
+    if (!slot) {
+      if (n >= kRehashSlots)
+        break;
+      continue;
+    }
+
+    Insert(&cur_, slot, Hash(View(slot)));
+    slot = 0;
+    --old_.size;
+  }
+
+  if (old_.size == 0) {
+    zfree(old_.slots);
+    old_ = Table{};
+  }
+}
+
+}  // namespace dfly
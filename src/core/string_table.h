@@ -0,0 +1,163 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+namespace dfly {
+
+// The hash table of StringSet and StringMap: a flat array of 8-byte slots using open addressing
+// with linear probing. A slot is either empty (0), an inline key of up to 7 bytes or a pointer
+// to an entry, which starts with the length of the key followed by the key. StringMap stores
+// the value right after the key, in the same allocation. The upper 16 bits of a pointer slot
+// hold the upper bits of the hash of its key, so that most of the mismatching slots are skipped
+// without touching the entry. The entries of the pointer slots with bit 1 set start with a 4-byte
+// deadline, see StringMap::SetExpiry, so that the entries without one pay nothing for it.
+//
+// The array grows when it is 3/4 full and shrinks when it is less than 1/8 full. The slots are
+// moved to the new array incrementally by the mutating operations, like the dict does.
+//
+// Not thread-safe. Allocates with zmalloc, so that the memory is accounted with the rest of the
+// values.
+class StringTable {
+ public:
+  StringTable(const StringTable&) = delete;
+  void operator=(const StringTable&) = delete;
+
+  size_t Size() const {
+    return cur_.size + old_.size;
+  }
+
+  bool Empty() const {
+    return Size() == 0;
+  }
+
+  // Frees up to *budget entries starting from *cursor, which starts at 0, and decreases the
+  // budget accordingly. Returns true once all the entries are freed. Only the destructor may
+  // be called afterwards. Used by LazyFree.
+  bool ClearStep(uint64_t* cursor, size_t* budget);
+
+  // The bytes allocated by the table and its entries.
+  size_t MallocUsed() const;
+
+ protected:
+  // A key about to be looked up, with its hash and the slot it would have if it is inline.
+  struct Key {
+    std::string_view str;
+    uint64_t hash;
+    uint64_t inline_slot;  // 0 if the key is not inline.
+  };
+
+  StringTable() = default;
+  ~StringTable();
+
+  static Key MakeKey(std::string_view str, bool allow_inline);
+
+  // Returns the key of the slot, which must not be empty. Inline keys point into the slot.
+  static std::string_view View(const uint64_t& slot);
+
+  // Returns the string that follows the key in the entry of a pointer slot.
+  static std::string_view ValueOf(uint64_t slot);
+
+  // Returns the deadline of the entry of the slot, 0 if it has none.
+  static uint32_t ExpiryOf(uint64_t slot);
+
+  // Returns the slot of the key or null.
+  uint64_t* FindSlot(const Key& key);
+  const uint64_t* FindSlot(const Key& key) const;
+
+  // Creates the entry of the key, with the value if it is not null and with the deadline if it
+  // is not 0, and returns its slot. Inline keys without a deadline do not allocate.
+  uint64_t MakeSlot(const Key& key, const std::string_view* value, uint32_t expire_at = 0);
+  void FreeSlot(uint64_t slot);
+
+  // Adds the slot of a key that is not in the table.
+  void AddSlot(uint64_t slot, uint64_t hash);
+
+  // Removes the slot of the key and frees it. Returns false if the key is not in the table.
+  bool Erase(const Key& key);
+
+  // Removes an arbitrary slot without freeing it.
+  // Requires: !Empty().
+  uint64_t PopSlot();
+
+  // Returns a pseudo-random slot, rnd is a uniformly distributed number.
+  // Requires: !Empty().
+  const uint64_t& RandomSlot(uint64_t rnd) const;
+
+  // Calls cb for count distinct pseudo-random slots, count must not exceed Size(). rnd returns
+  // uniformly distributed numbers. Takes O(count) expected time: while count is at most half of
+  // the table, random slots are drawn until count distinct ones are found, otherwise the slots
+  // are selected in a single pass over the table.
+  void SampleSlots(size_t count, const std::function<uint64_t()>& rnd,
+                   const std::function<void(const uint64_t&)>& cb) const;
+
+  // Calls f for every slot until it returns false. Returns false if f stopped the iteration.
+  template <typename F> bool IterateSlots(F&& f) const {
+    return IterateTable(old_, f) && IterateTable(cur_, f);
+  }
+
+  // Calls cb for the slots of a few buckets and returns the cursor of the next call, 0 once
+  // all the buckets were visited. Has the guarantees of dictScan: a key that is in the table
+  // for the whole scan is returned at least once, even if the table is resized between the calls.
+  uint64_t ScanSlots(uint64_t cursor, const std::function<void(const uint64_t&)>& cb) const;
+
+  // Sizes the array for n entries, so that adding them does not resize it.
+  // Requires: Empty().
+  void Reserve(size_t n);
+
+ private:
+  struct Table {
+    uint64_t* slots = nullptr;
+    size_t capacity = 0;  // 0 or a power of 2.
+    size_t size = 0;
+
+    size_t mask() const {
+      return capacity - 1;
+    }
+  };
+
+  static constexpr size_t kMinCapacity = 16;
+  static constexpr size_t kRehashSlots = 16;
+
+  static uint64_t Hash(std::string_view str);
+  static bool Matches(uint64_t slot, const Key& key);
+
+  static size_t Find(const Table& table, const Key& key);
+  static void Insert(Table* table, uint64_t slot, uint64_t hash);
+  static void EraseAt(Table* table, size_t index);
+
+  template <typename F> static bool IterateTable(const Table& table, F&& f) {
+    for (size_t i = 0; i < table.capacity; ++i) {
+      if (table.slots[i] && !f(table.slots[i]))
+        return false;
+    }
+    return true;
+  }
+
+  // Calls cb for the slots of table that belong to the bucket.
+  static void ScanBucket(const Table& table, size_t bucket,
+                         const std::function<void(const uint64_t&)>& cb);
+
+  void Grow();
+  void Shrink();
+
+  // Moves the slots into a new array of the given capacity.
+  void StartResize(size_t capacity);
+
+  // Moves about kRehashSlots slots of the old array into the new one.
+  void RehashStep();
+
+  Table cur_;
+  Table old_;  // the array that is being moved into cur_, if any.
+
+  size_t rehash_pos_ = 0;       // the next slot of old_ to move.
+  size_t pop_pos_ = 0;          // where PopSlot starts looking for a slot in cur_.
+  size_t obj_malloc_used_ = 0;  // of the entries of the pointer slots.
+};
+
+}  // namespace dfly
@@ -0,0 +1,90 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <xxhash.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+TopKeys::TopKeys(unsigned k, unsigned width, unsigned depth)
+    : k_(k), width_(width), depth_(depth), counters_(size_t(width) * depth) {
+  DCHECK_GT(k, 0u);
+  DCHECK_GT(width, 0u);
+  DCHECK_GT(depth, 0u);
+  top_.reserve(k);
+}
+
+void TopKeys::Touch(string_view key, uint32_t weight) {
+  // The rows are indexed by two halves of a single hash, see Kirsch and Mitzenmacher,
+  // "Less Hashing, Same Performance".
+  uint64_t hash = XXH3_64bits(key.data(), key.size());
+  uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+  auto cell = [&](unsigned row) -> uint32_t& {
+    return counters_[size_t(row) * width_ + (h1 + row * h2) % width_];
+  };
+
+  uint32_t est = UINT32_MAX;
+  for (unsigned i = 0; i < depth_; ++i) {
+    est = min(est, cell(i));
+  }
+
+  // Conservative update: the counters are raised only up to the new estimate, which reduces
+  // the overestimation of the infrequent keys that share them.
+  est = est > UINT32_MAX - weight ? UINT32_MAX : est + weight;
+  for (unsigned i = 0; i < depth_; ++i) {
+    uint32_t& counter = cell(i);
+    counter = max(counter, est);
+  }
+
+  for (Candidate& c : top_) {
+    if (c.key == key) {
+      c.count = est;
+      return;
+    }
+  }
+
+  if (top_.size() < k_) {
+    top_.push_back(Candidate{string(key), est});
+    return;
+  }
+
+  auto min_it = min_element(top_.begin(), top_.end(),
+                            [](const Candidate& l, const Candidate& r) { return l.count < r.count; });
+  if (min_it->count < est) {
+    min_it->key.assign(key);
+    min_it->count = est;
+  }
+}
+
+vector<pair<string, uint64_t>> TopKeys::GetTop() const {
+  vector<pair<string, uint64_t>> res;
+  res.reserve(top_.size());
+  for (const Candidate& c : top_) {
+    res.emplace_back(c.key, c.count);
+  }
+
+  sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.second > r.second; });
+  return res;
+}
+
+void TopKeys::Decay() {
+  for (uint32_t& counter : counters_) {
+    counter /= 2;
+  }
+
+  for (Candidate& c : top_) {
+    c.count /= 2;
+  }
+  top_.erase(remove_if(top_.begin(), top_.end(), [](const Candidate& c) { return c.count == 0; }),
+             top_.end());
+}
+
+}  // namespace dfly
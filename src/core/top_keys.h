@@ -0,0 +1,42 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Finds the most frequent keys of a stream in a fixed memory. The frequencies are estimated
+// with a count-min sketch, which overestimates only, and the keys with the highest estimates are
+// kept as the candidates. Not thread-safe.
+class TopKeys {
+ public:
+  // Keeps up to k candidates. The sketch consists of depth rows of width counters.
+  explicit TopKeys(unsigned k, unsigned width = 1024, unsigned depth = 4);
+
+  void Touch(std::string_view key, uint32_t weight = 1);
+
+  // Returns the candidates with their estimated frequencies, the most frequent first.
+  std::vector<std::pair<std::string, uint64_t>> GetTop() const;
+
+  // Halves the frequencies, so that the estimates favor the recent keys.
+  void Decay();
+
+ private:
+  struct Candidate {
+    std::string key;
+    uint64_t count;
+  };
+
+  unsigned k_;
+  unsigned width_;
+  unsigned depth_;
+  std::vector<uint32_t> counters_;  // depth_ rows of width_ counters.
+  std::vector<Candidate> top_;      // unsorted, up to k_ entries.
+};
+
+}  // namespace dfly
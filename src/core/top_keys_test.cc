@@ -0,0 +1,63 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+using testing::ElementsAre;
+using testing::Pair;
+
+class TopKeysTest : public ::testing::Test {};
+
+TEST_F(TopKeysTest, Basic) {
+  TopKeys top(2);
+  EXPECT_TRUE(top.GetTop().empty());
+
+  top.Touch("a", 3);
+  top.Touch("b");
+  top.Touch("a");
+  EXPECT_THAT(top.GetTop(), ElementsAre(Pair("a", 4), Pair("b", 1)));
+
+  // c replaces the least frequent candidate once its estimate exceeds it.
+  top.Touch("c");
+  EXPECT_THAT(top.GetTop(), ElementsAre(Pair("a", 4), Pair("b", 1)));
+  top.Touch("c");
+  EXPECT_THAT(top.GetTop(), ElementsAre(Pair("a", 4), Pair("c", 2)));
+
+  top.Decay();
+  EXPECT_THAT(top.GetTop(), ElementsAre(Pair("a", 2), Pair("c", 1)));
+  top.Decay();
+  EXPECT_THAT(top.GetTop(), ElementsAre(Pair("a", 1)));
+}
+
+// The heavy hitters are found among many infrequent keys.
+TEST_F(TopKeysTest, HeavyHitters) {
+  TopKeys top(4);
+  for (unsigned i = 0; i < 100000; ++i) {
+    top.Touch(absl::StrCat("key:", i));
+    if (i % 10 == 0)
+      top.Touch("hot1");
+    if (i % 20 == 0)
+      top.Touch("hot2");
+  }
+
+  auto res = top.GetTop();
+  ASSERT_GE(res.size(), 2u);
+  EXPECT_EQ("hot1", res[0].first);
+  EXPECT_EQ("hot2", res[1].first);
+
+  // The estimates are never lower than the true counts.
+  EXPECT_GE(res[0].second, 10000u);
+  EXPECT_LE(res[0].second, 10000u + 1000);
+  EXPECT_GE(res[1].second, 5000u);
+}
+
+}  // namespace dfly
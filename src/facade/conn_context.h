@@ -51,6 +51,13 @@ class ConnectionContext {
   bool authenticated: 1;
   bool force_dispatch: 1;   // whether we should route all requests to the dispatch fiber.
 
+  // Time spent on parsing the currently dispatched request, 0 if it is not known.
+  uint64_t parse_ns = 0;
+
+  // The trace of the currently dispatched request if it is sampled, 0 otherwise.
+  // See RequestTracer.
+  uint64_t trace_id = 0;
+
   virtual void OnClose() {}
 
   virtual std::string GetContextInfo() const { return std::string{}; }
@@ -5,20 +5,27 @@
 #include "facade/dragonfly_connection.h"
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 #include <mimalloc.h>
+#include <sys/un.h>
 
 #include <boost/fiber/operations.hpp>
+#include <optional>
 
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/conn_context.h"
 #include "facade/memcache_parser.h"
 #include "facade/redis_parser.h"
+#include "facade/request_tracer.h"
 #include "facade/service_interface.h"
 #include "util/fiber_sched_algo.h"
 
 #ifdef DFLY_USE_SSL
+#include "facade/tls_offload.h"
+#include "facade/tls_session.h"
 #include "util/tls/tls_socket.h"
 #endif
 
@@ -26,7 +33,32 @@
 
 ABSL_FLAG(bool, tcp_nodelay, false,
           "Configures dragonfly connections with socket option TCP_NODELAY");
+ABSL_FLAG(bool, tcp_cork, false,
+          "If true, pipelined replies are written right away with TCP_CORK set on the socket "
+          "instead of being batched in memory. The kernel sends full packets while the pipeline "
+          "is processed and the tail once it is drained. Overrides tcp_nodelay while corked");
+ABSL_FLAG(uint32_t, reply_batch_bytes, 32768,
+          "Batched replies of pipelined commands are written out once they reach that size. "
+          "0 - unlimited");
+ABSL_FLAG(uint32_t, reply_batch_count, 0,
+          "Batched replies of pipelined commands are written out once there are that many of "
+          "them. 0 - unlimited");
+ABSL_FLAG(uint32_t, reply_batch_usec, 0,
+          "Batched replies of pipelined commands are written out once the first of them waits "
+          "that long. 0 - unlimited");
 ABSL_FLAG(bool, http_admin_console, true, "If true allows accessing http console on main TCP port");
+ABSL_FLAG(uint32_t, pipeline_squash, 0,
+          "If greater than 1, dispatches up to that many consecutive pipelined commands together, "
+          "so that single-shard commands run with a single hop per shard. 0 - disabled.");
+ABSL_FLAG(uint32_t, conn_buf_idle_sec, 30,
+          "A drained connection keeps the read buffer and the argument vectors that it has "
+          "grown until it stays idle for that many seconds, 0 releases them once it is drained");
+ABSL_FLAG(uint64_t, pipeline_queue_bytes, 64ULL << 20,
+          "A connection stops reading its socket while its pipelined requests that wait for "
+          "execution take that much memory. 0 - unlimited");
+ABSL_FLAG(uint64_t, pipeline_thread_queue_bytes, 512ULL << 20,
+          "Connections of a thread stop reading their sockets while the pipelined requests of "
+          "all of them take that much memory. 0 - unlimited");
 
 using namespace util;
 using namespace std;
@@ -37,7 +69,22 @@ namespace fibers = boost::fibers;
 namespace facade {
 namespace {
 
-void SendProtocolError(RedisParser::Result pres, FiberSocketBase* peer) {
+bool IsUnixSocket(int fd) {
+  int domain = 0;
+  socklen_t len = sizeof(domain);
+  return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
+// The accepted end of a unix socket has the path of the listener, the client end is unnamed.
+string UnixSocketPath(int fd) {
+  sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, (sockaddr*)&addr, &len) != 0 || len <= offsetof(sockaddr_un, sun_path))
+    return string{};
+  return string{addr.sun_path, strnlen(addr.sun_path, len - offsetof(sockaddr_un, sun_path))};
+}
+
+void SendProtocolError(RedisParser::Result pres, SinkReplyBuilder* builder) {
   string res("-ERR Protocol error: ");
   if (pres == RedisParser::BAD_BULKLEN) {
     res.append("invalid bulk length\r\n");
@@ -46,10 +93,7 @@ void SendProtocolError(RedisParser::Result pres, FiberSocketBase* peer) {
     res.append("invalid multibulk length\r\n");
   }
 
-  error_code ec = peer->Write(::io::Buffer(res));
-  if (ec) {
-    LOG(WARNING) << "Error " << ec;
-  }
+  builder->SendRaw(res);
 }
 
 void FetchBuilderStats(ConnectionStats* stats, SinkReplyBuilder* builder) {
@@ -72,13 +116,37 @@ bool MatchHttp11Line(string_view line) {
 constexpr size_t kMinReadSize = 256;
 constexpr size_t kMaxReadSize = 32_KB;
 
+// Upper bound of the keys of pipelined memcache gets that are looked up together.
+constexpr size_t kMaxCoalescedKeys = 1024;
+
 struct AsyncMsg {
   Connection::PubMessage pub_msg;
   fibers_ext::BlockingCounter bc;
 
+  // Set for the messages of the server channels, e.g. the client tracking invalidations or
+  // the change feed. They own their items and are not waited for.
+  std::string_view owned_channel;
+  std::vector<std::string> items;
+
+  // Keeps the views of pub_msg alive instead of bc, e.g. for the keyspace notifications.
+  std::shared_ptr<const void> holder;
+
   AsyncMsg(const Connection::PubMessage& pmsg, fibers_ext::BlockingCounter b)
       : pub_msg(pmsg), bc(move(b)) {
   }
+
+  AsyncMsg(const Connection::PubMessage& pmsg, std::shared_ptr<const void> h)
+      : pub_msg(pmsg), bc(0), holder(move(h)) {
+  }
+
+  // Whether the publisher waits for the message to be written.
+  bool waited() const {
+    return owned_channel.empty() && !holder;
+  }
+
+  AsyncMsg(std::string_view channel, std::vector<std::string> i)
+      : bc(0), owned_channel(channel), items(move(i)) {
+  }
 };
 
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
@@ -87,6 +155,31 @@ constexpr size_t kReqStorageSize = 88;
 constexpr size_t kReqStorageSize = 120;
 #endif
 
+// Parsed arguments vectors longer than that are released once the connection is idle.
+constexpr size_t kMaxKeptArgs = 64;
+
+// The tls sockets may hold decrypted input that polling the socket does not show, so their
+// buffers are released after that many consecutive reads that fit into kMinReadSize.
+constexpr unsigned kMaxSmallReads = 64;
+
+// Blocks of the released requests are kept per thread, so that pipelined commands do not
+// go through the allocator for their Request.
+constexpr size_t kMaxPooledRequests = 512;
+
+struct RequestPool {
+  vector<void*> blocks;
+
+  ~RequestPool() {
+    for (void* ptr : blocks)
+      mi_free(ptr);
+  }
+};
+
+thread_local RequestPool tl_request_pool;
+
+// Notified when the dispatch queues of the thread shrink, wakes up the throttled connections.
+thread_local fibers_ext::EventCount tl_queue_drained;
+
 }  // namespace
 
 struct Connection::Shutdown {
@@ -112,9 +205,18 @@ struct Connection::Request {
   absl::FixedArray<char, kReqStorageSize, mi_stl_allocator<char>> storage;
   AsyncMsg* async_msg = nullptr;  // allocated and released via mi_malloc.
 
+  // Set for the sampled requests, see RequestTracer.
+  uint64_t trace_id = 0;
+  uint64_t enqueue_ns = 0;
+
   Request(size_t nargs, size_t capacity) : args(nargs), storage(capacity) {
   }
 
+  // The storage is allocated separately only when it does not fit inline.
+  size_t MemUsage() const {
+    return sizeof(Request) + (storage.size() > kReqStorageSize ? storage.size() : 0);
+  }
+
   Request(const Request&) = delete;
 };
 
@@ -158,6 +260,11 @@ void Connection::OnShutdown() {
   }
 }
 
+void Connection::ShutdownSocket() {
+  if (socket_)
+    socket_->Shutdown(SHUT_RDWR);
+}
+
 auto Connection::RegisterShutdownHook(ShutdownCb cb) -> ShutdownHandle {
   if (!shutdown_) {
     shutdown_ = make_unique<Shutdown>();
@@ -178,20 +285,28 @@ void Connection::HandleRequests() {
 
   LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
 
-  if (absl::GetFlag(FLAGS_tcp_nodelay)) {
+  is_unix_ = IsUnixSocket(lsb->native_handle());
+  if (absl::GetFlag(FLAGS_tcp_nodelay) && !is_unix_) {
     int val = 1;
     CHECK_EQ(0, setsockopt(lsb->native_handle(), SOL_TCP, TCP_NODELAY, &val, sizeof(val)));
   }
 
-  auto remote_ep = lsb->RemoteEndpoint();
+  string remote_ep = RemoteEndpointStr();
 
 #ifdef DFLY_USE_SSL
   unique_ptr<tls::TlsSocket> tls_sock;
+  unique_ptr<TlsTxOffload> tx_offload;
   if (ctx_) {
+    if (TlsTxOffload::IsEnabled(ctx_))
+      tx_offload.reset(new TlsTxOffload);
+
     tls_sock.reset(new tls::TlsSocket(socket_.get()));
     tls_sock->InitSSL(ctx_);
 
+    optional<TlsSession::HandshakeGuard> guard;
+    guard.emplace();
     FiberSocketBase::AcceptResult aresult = tls_sock->Accept();
+    guard.reset();
     if (!aresult) {
       LOG(WARNING) << "Error handshaking " << aresult.error().message();
       return;
@@ -219,7 +334,23 @@ void Connection::HandleRequests() {
       }
       http_conn.ReleaseSocket();
     } else {
-      cc_.reset(service_->CreateContext(peer, this));
+      // Replies go to the plain socket once the kernel encrypts them, the input is still read
+      // via peer.
+      FiberSocketBase* sink = peer;
+#ifdef DFLY_USE_SSL
+      if (tx_offload && tx_offload->Install(lsb->native_handle())) {
+        VLOG(1) << "TLS transmit path is offloaded to the kernel";
+        sink = socket_.get();
+      }
+      tx_offload.reset();
+#endif
+      cc_.reset(service_->CreateContext(sink, this));
+
+      SinkReplyBuilder::BatchLimits limits;
+      limits.max_bytes = absl::GetFlag(FLAGS_reply_batch_bytes);
+      limits.max_replies = absl::GetFlag(FLAGS_reply_batch_count);
+      limits.max_delay_ns = uint64_t(absl::GetFlag(FLAGS_reply_batch_usec)) * 1000;
+      cc_->reply_builder()->SetBatchLimits(limits);
 
       bool should_disarm_poller = false;
       // TODO: to move this interface to LinuxSocketBase so we won't need to cast.
@@ -252,6 +383,81 @@ void Connection::HandleRequests() {
   VLOG(1) << "Closed connection for peer " << remote_ep;
 }
 
+bool Connection::HoldsGrownBuffers() const {
+  return io_buf_.Capacity() > kMinReadSize || parse_args_.capacity() > kMaxKeptArgs ||
+         cmd_vec_.capacity() > kMaxKeptArgs;
+}
+
+void Connection::AwaitInput(util::FiberSocketBase* peer, ConnectionStats* stats) {
+  uint32_t idle_sec = absl::GetFlag(FLAGS_conn_buf_idle_sec);
+  if (idle_sec == 0) {
+    ShrinkReadBuffer(stats);
+    return;
+  }
+
+  if (peer != socket_.get()) {
+    if (small_reads_ >= kMaxSmallReads)
+      ShrinkReadBuffer(stats);
+    return;
+  }
+
+  // The poll is armed only while the buffers are grown, the recv that follows it does not
+  // block once it fires.
+  SetPhase("idle");
+  uring::UringSocket* us = static_cast<uring::UringSocket*>(socket_.get());
+  fibers_ext::EventCount ready_ec;
+  bool ready = false;
+  uint32_t poll_id = us->PollEvent(POLLIN | POLLERR | POLLHUP, [&](int32_t mask) {
+    ready = true;
+    ready_ec.notify();
+  });
+
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(idle_sec);
+  ready_ec.await_until([&] { return ready; }, deadline);
+  if (!ready) {
+    us->CancelPoll(poll_id);
+    ShrinkReadBuffer(stats);
+  }
+  SetPhase("readsock");
+}
+
+void Connection::ShrinkReadBuffer(ConnectionStats* stats) {
+  if (io_buf_.InputLen() > 0)
+    return;
+  small_reads_ = 0;
+
+  // Commands with many arguments leave big vectors behind.
+  if (parse_args_.capacity() > kMaxKeptArgs) {
+    RespVec{}.swap(parse_args_);
+  }
+  if (cmd_vec_.capacity() > kMaxKeptArgs) {
+    CmdArgVec{}.swap(cmd_vec_);
+  }
+
+  size_t capacity = io_buf_.Capacity();
+  if (capacity <= kMinReadSize)
+    return;
+
+  // IoBuf can not shrink in place, hence we replace it with a new one.
+  io_buf_.~IoBuf();
+  new (&io_buf_) base::IoBuf(kMinReadSize);
+
+  DVLOG(1) << "Shrinking io_buf from " << capacity << " to " << io_buf_.Capacity();
+  stats->read_buf_capacity -= (capacity - io_buf_.Capacity());
+}
+
+void Connection::SetCork(bool cork) {
+  LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
+  int val = cork;
+
+  // Fails for non-tcp sockets, we just do not cork them.
+  if (setsockopt(lsb->native_handle(), IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Could not set TCP_CORK: " << strerror(errno);
+    return;
+  }
+  corked_ = cork;
+}
+
 void Connection::RegisterOnBreak(BreakerCb breaker_cb) {
   breaker_cb_ = breaker_cb;
 }
@@ -268,8 +474,49 @@ void Connection::SendMsgVecAsync(const PubMessage& pub_msg,
   void* ptr = mi_malloc(sizeof(AsyncMsg));
   AsyncMsg* amsg = new (ptr) AsyncMsg(pub_msg, move(bc));
 
-  ptr = mi_malloc(sizeof(Request));
-  Request* req = new (ptr) Request(0, 0);
+  Request* req = AllocRequest(0, 0, mi_heap_get_backing());
+  req->async_msg = amsg;
+  dispatch_q_.push_back(req);
+  if (dispatch_q_.size() == 1) {
+    evc_.notify();
+  }
+}
+
+void Connection::SendMsgAsync(const PubMessage& pub_msg, shared_ptr<const void> holder) {
+  DCHECK(cc_);
+
+  if (cc_->conn_closing)
+    return;
+
+  void* ptr = mi_malloc(sizeof(AsyncMsg));
+  AsyncMsg* amsg = new (ptr) AsyncMsg(pub_msg, move(holder));
+
+  Request* req = AllocRequest(0, 0, mi_heap_get_backing());
+  req->async_msg = amsg;
+  dispatch_q_.push_back(req);
+  if (dispatch_q_.size() == 1) {
+    evc_.notify();
+  }
+}
+
+void Connection::SendInvalidationAsync(vector<string> keys) {
+  SendOwnedMsgAsync(kInvalidationChannel, move(keys));
+}
+
+void Connection::SendChangesAsync(vector<string> records) {
+  SendOwnedMsgAsync(kChangesChannel, move(records));
+}
+
+void Connection::SendOwnedMsgAsync(string_view channel, vector<string> items) {
+  DCHECK(cc_);
+
+  if (cc_->conn_closing)
+    return;
+
+  void* ptr = mi_malloc(sizeof(AsyncMsg));
+  AsyncMsg* amsg = new (ptr) AsyncMsg(channel, move(items));
+
+  Request* req = AllocRequest(0, 0, mi_heap_get_backing());
   req->async_msg = amsg;
   dispatch_q_.push_back(req);
   if (dispatch_q_.size() == 1) {
@@ -281,15 +528,32 @@ string Connection::GetClientInfo() const {
   LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
 
   string res;
-  auto le = lsb->LocalEndpoint();
-  auto re = lsb->RemoteEndpoint();
   time_t now = time(nullptr);
 
-  absl::StrAppend(&res, "id=", id_, " addr=", re.address().to_string(), ":", re.port());
-  absl::StrAppend(&res, " laddr=", le.address().to_string(), ":", le.port());
+  // Memory held by the connection, not counting the socket and the reply builder.
+  size_t args_mem = parse_args_.capacity() * sizeof(RespExpr) +
+                    cmd_vec_.capacity() * sizeof(MutableSlice);
+  size_t dispatch_mem = 0;
+  for (const Request* req : dispatch_q_) {
+    dispatch_mem += req->MemUsage();
+  }
+  size_t tot_mem = sizeof(*this) + io_buf_.Capacity() + args_mem + dispatch_mem;
+
+  // Like redis, the unix sockets are listed with their path and port 0.
+  if (is_unix_) {
+    string path = UnixSocketPath(lsb->native_handle());
+    absl::StrAppend(&res, "id=", id_, " addr=", path, ":0 laddr=", path, ":0");
+  } else {
+    auto le = lsb->LocalEndpoint();
+    auto re = lsb->RemoteEndpoint();
+    absl::StrAppend(&res, "id=", id_, " addr=", re.address().to_string(), ":", re.port());
+    absl::StrAppend(&res, " laddr=", le.address().to_string(), ":", le.port());
+  }
   absl::StrAppend(&res, " fd=", lsb->native_handle(), " name=", name_);
   absl::StrAppend(&res, " age=", now - creation_time_, " idle=", now - last_interaction_);
-  absl::StrAppend(&res, " phase=", phase_, " ");
+  absl::StrAppend(&res, " qbuf=", io_buf_.InputLen(), " qbuf-free=", io_buf_.AppendLen());
+  absl::StrAppend(&res, " argv-mem=", args_mem, " qdispatch=", dispatch_q_.size());
+  absl::StrAppend(&res, " tot-mem=", tot_mem, " phase=", phase_, " ");
   if (cc_) {
     absl::StrAppend(&res, cc_->GetContextInfo());
   }
@@ -297,6 +561,28 @@ string Connection::GetClientInfo() const {
   return res;
 }
 
+string Connection::RemoteEndpointStr() const {
+  if (!socket_)
+    return string{};
+
+  LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
+  if (is_unix_)
+    return absl::StrCat(UnixSocketPath(lsb->native_handle()), ":0");
+
+  auto re = lsb->RemoteEndpoint();
+  return absl::StrCat(re.address().to_string(), ":", re.port());
+}
+
+string Connection::LocalBindAddress() const {
+  // A unix socket has no address that the other hosts could connect to.
+  if (!socket_ || is_unix_)
+    return string{};
+
+  LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
+  auto le = lsb->LocalEndpoint();
+  return le.address().to_string();
+}
+
 uint32 Connection::GetClientId() const {
   return id_;
 }
@@ -380,15 +666,17 @@ void Connection::ConnectionFlow(FiberSocketBase* peer) {
     VLOG(1) << "Error parser status " << parser_error_;
     ++stats->parser_err_cnt;
 
+    // Written via the reply builder since the kernel may encrypt its socket.
+    SinkReplyBuilder* builder = cc_->reply_builder();
+    builder->SetBatchMode(false);
     if (redis_parser_) {
-      SendProtocolError(RedisParser::Result(parser_error_), peer);
+      SendProtocolError(RedisParser::Result(parser_error_), builder);
     } else {
-      string_view sv{"CLIENT_ERROR bad command line format\r\n"};
-      error_code ec2 = peer->Write(::io::Buffer(sv));
-      if (ec2) {
-        LOG(WARNING) << "Error " << ec2;
-        ec = ec;
-      }
+      builder->SendRaw("CLIENT_ERROR bad command line format\r\n");
+    }
+    error_code ec2 = builder->GetError();
+    if (ec2) {
+      LOG(WARNING) << "Error " << ec2;
     }
     peer->Shutdown(SHUT_RDWR);
   }
@@ -405,9 +693,11 @@ auto Connection::ParseRedis() -> ParserStatus {
 
   RedisParser::Result result = RedisParser::OK;
   SinkReplyBuilder* builder = cc_->reply_builder();
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
   mi_heap_t* tlh = mi_heap_get_backing();
 
   do {
+    uint64_t parse_start = ProactorBase::GetMonotonicTimeNs();
     result = redis_parser_->Parse(io_buf_.InputBuffer(), &consumed, &parse_args_);
 
     if (result == RedisParser::OK && !parse_args_.empty()) {
@@ -420,17 +710,33 @@ auto Connection::ParseRedis() -> ParserStatus {
       // We use ASYNC_DISPATCH as a lock to avoid out-of-order replies when the
       // dispatch fiber pulls the last record but is still processing the command and then this
       // fiber enters the condition below and executes out of order.
+      uint64_t trace_id = RequestTracer::Sample();
+      uint64_t parse_end = 0;
+      if (trace_id) {
+        parse_end = ProactorBase::GetMonotonicTimeNs();
+        // The time that the request waited in io_buf_ behind the preceding pipelined ones.
+        if (read_ns_ && read_ns_ <= parse_start)
+          RequestTracer::Record(trace_id, "read", read_ns_, parse_start);
+        RequestTracer::Record(trace_id, "parse", parse_start, parse_end,
+                              first.type == RespExpr::STRING ? ToSV(first.GetBuf()) : string_view{});
+      }
+
       bool is_sync_dispatch = !cc_->async_dispatch && !cc_->force_dispatch;
       if (dispatch_q_.empty() && is_sync_dispatch && consumed >= io_buf_.InputLen()) {
         RespToArgList(parse_args_, &cmd_vec_);
         CmdArgList cmd_list{cmd_vec_.data(), cmd_vec_.size()};
-        service_->DispatchCommand(cmd_list, cc_.get());
+        cc_->parse_ns = ProactorBase::GetMonotonicTimeNs() - parse_start;
+        DispatchTraced(cmd_list, trace_id);
+        cc_->parse_ns = 0;
         last_interaction_ = time(nullptr);
       } else {
         VLOG(2) << "Dispatch async";
 
         // Dispatch via queue to speedup input reading.
-        Request* req = FromArgs(std::move(parse_args_), tlh);
+        Request* req = FromArgs(parse_args_, tlh);
+        req->trace_id = trace_id;
+        req->enqueue_ns = parse_end;
+        AddQueuedRequest(req, stats);
 
         dispatch_q_.push_back(req);
         if (dispatch_q_.size() == 1) {
@@ -453,12 +759,28 @@ auto Connection::ParseRedis() -> ParserStatus {
   return ERROR;
 }
 
+void Connection::DispatchTraced(CmdArgList args, uint64_t trace_id) {
+  if (trace_id == 0)
+    return service_->DispatchCommand(args, cc_.get());
+
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  cc_->trace_id = trace_id;
+  cc_->reply_builder()->set_trace_id(trace_id);
+  service_->DispatchCommand(args, cc_.get());
+  cc_->trace_id = 0;
+
+  string_view cmd{args.front().data(), args.front().size()};
+  RequestTracer::Record(trace_id, "dispatch", start_ns, ProactorBase::GetMonotonicTimeNs(), cmd);
+}
+
 auto Connection::ParseMemcache() -> ParserStatus {
   MemcacheParser::Result result = MemcacheParser::OK;
   uint32_t consumed = 0;
   MemcacheParser::Command cmd;
+  MemcacheParser::Command next_cmd;
   string_view value;
   MCReplyBuilder* builder = static_cast<MCReplyBuilder*>(cc_->reply_builder());
+  absl::InlinedVector<uint32_t, 16> get_groups;
 
   do {
     string_view str = ToSV(io_buf_.InputBuffer());
@@ -480,6 +802,33 @@ auto Connection::ParseMemcache() -> ParserStatus {
       }
     }
 
+    // Consecutive gets are coalesced into a single multi-key lookup, each of them is still
+    // terminated by its own END. The keys point to io_buf_, hence the input is consumed only
+    // after the dispatch.
+    get_groups.clear();
+    if (cmd.type == MemcacheParser::GET && !cmd.meta) {
+      get_groups.push_back(1 + cmd.keys_ext.size());
+      size_t num_keys = get_groups.back();
+
+      while (num_keys < kMaxCoalescedKeys) {
+        uint32_t next_consumed = 0;
+        auto next_res = memcache_parser_->Parse(str.substr(total_len), &next_consumed, &next_cmd);
+        if (next_res != MemcacheParser::OK || next_cmd.type != MemcacheParser::GET ||
+            next_cmd.meta)
+          break;
+
+        cmd.keys_ext.push_back(next_cmd.key);
+        cmd.keys_ext.insert(cmd.keys_ext.end(), next_cmd.keys_ext.begin(),
+                            next_cmd.keys_ext.end());
+        get_groups.push_back(1 + next_cmd.keys_ext.size());
+        num_keys += get_groups.back();
+        total_len += next_consumed;
+      }
+
+      if (get_groups.size() > 1)
+        builder->SetMGetGroups(absl::MakeSpan(get_groups));
+    }
+
     // An optimization to skip dispatch_q_ if no pipelining is identified.
     // We use ASYNC_DISPATCH as a lock to avoid out-of-order replies when the
     // dispatch fiber pulls the last record but is still processing the command and then this
@@ -488,6 +837,7 @@ auto Connection::ParseMemcache() -> ParserStatus {
     if (dispatch_q_.empty() && is_sync_dispatch) {
       service_->DispatchMC(cmd, value, cc_.get());
     }
+    builder->SetMGetGroups({});
     io_buf_.ConsumeInput(total_len);
   } while (!builder->GetError());
 
@@ -514,12 +864,58 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
   error_code ec;
   ParserStatus parse_status = OK;
 
+  const size_t conn_limit = absl::GetFlag(FLAGS_pipeline_queue_bytes);
+  const size_t thread_limit = absl::GetFlag(FLAGS_pipeline_thread_queue_bytes);
+
+  // Leaving the data in the socket lets TCP slow down the client instead of buffering its
+  // requests. A connection with an empty queue is never throttled, so that the thread keeps
+  // making progress while others are over the limit.
+  auto is_throttled = [&] {
+    if (queued_bytes_ == 0 || cc_->conn_closing)
+      return false;
+    return (conn_limit && queued_bytes_ >= conn_limit) ||
+           (thread_limit && stats->dispatch_queue_bytes >= thread_limit);
+  };
+
   do {
     FetchBuilderStats(stats, builder);
 
-    io::MutableBytes append_buf = io_buf_.AppendBuffer();
+    if (is_throttled()) {
+      SetPhase("throttled");
+      ++stats->pipeline_throttle_cnt;
+      ++stats->num_throttled_conns;
+      tl_queue_drained.await([&] { return !is_throttled(); });
+      --stats->num_throttled_conns;
+    }
+
     SetPhase("readsock");
 
+    // Big bulk strings are read straight into their parser buffer, bypassing io_buf_.
+    if (redis_parser_ && io_buf_.InputLen() == 0) {
+      RespExpr::Buffer bulk_buf = redis_parser_->BulkBuffer();
+      if (!bulk_buf.empty()) {
+        ::io::Result<size_t> recv_sz = peer->Recv(bulk_buf);
+        last_interaction_ = time(nullptr);
+
+        if (!recv_sz) {
+          ec = recv_sz.error();
+          break;
+        }
+
+        if (RequestTracer::IsActive())
+          read_ns_ = ProactorBase::GetMonotonicTimeNs();
+        redis_parser_->CommitBulk(*recv_sz);
+        stats->io_read_bytes += *recv_sz;
+        ++stats->io_read_cnt;
+        continue;
+      }
+    }
+
+    if (io_buf_.InputLen() == 0 && HoldsGrownBuffers())
+      AwaitInput(peer, stats);
+
+    io::MutableBytes append_buf = io_buf_.AppendBuffer();
+
     ::io::Result<size_t> recv_sz = peer->Recv(append_buf);
     last_interaction_ = time(nullptr);
 
@@ -529,6 +925,8 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
       break;
     }
 
+    if (RequestTracer::IsActive())
+      read_ns_ = ProactorBase::GetMonotonicTimeNs();
     io_buf_.CommitWrite(*recv_sz);
     stats->io_read_bytes += *recv_sz;
     ++stats->io_read_cnt;
@@ -564,6 +962,8 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
       }
     } else if (parse_status != OK) {
       break;
+    } else if (io_buf_.InputLen() == 0) {
+      small_reads_ = *recv_sz <= kMinReadSize ? small_reads_ + 1 : 0;
     }
     ec = builder->GetError();
   } while (peer->IsOpen() && !ec);
@@ -585,6 +985,20 @@ void Connection::DispatchFiber(util::FiberSocketBase* peer) {
 
   ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
   SinkReplyBuilder* builder = cc_->reply_builder();
+  const size_t squash_limit = absl::GetFlag(FLAGS_pipeline_squash);
+  const bool use_cork = absl::GetFlag(FLAGS_tcp_cork) && !is_unix_;
+
+  // Replies are either batched in memory or written to the corked socket while more
+  // commands are pending.
+  auto update_batch_mode = [&] {
+    bool pending = !dispatch_q_.empty();
+    if (use_cork) {
+      if (pending && !corked_)
+        SetCork(true);
+    } else {
+      builder->SetBatchMode(pending);
+    }
+  };
 
   while (!builder->GetError()) {
     evc_.await([this] { return cc_->conn_closing || !dispatch_q_.empty(); });
@@ -601,34 +1015,94 @@ void Connection::DispatchFiber(util::FiberSocketBase* peer) {
       const PubMessage& pub_msg = req->async_msg->pub_msg;
       string_view arr[4];
 
-      if (pub_msg.pattern.empty()) {
-        arr[0] = "message";
+      if (!req->async_msg->owned_channel.empty()) {
+        const auto& items = req->async_msg->items;
+        rbuilder->StartArray(3);
+        rbuilder->SendBulkString("message");
+        rbuilder->SendBulkString(req->async_msg->owned_channel);
+        if (items.empty())
+          rbuilder->SendNullArray();
+        else
+          rbuilder->SendStringArr(items);
+      } else if (pub_msg.pattern.empty()) {
+        arr[0] = pub_msg.sharded ? "smessage" : "message";
         arr[1] = pub_msg.channel;
         arr[2] = pub_msg.message;
         rbuilder->SendStringArr(absl::Span<string_view>{arr, 3});
+        if (req->async_msg->waited())
+          req->async_msg->bc.Dec();
       } else {
         arr[0] = "pmessage";
         arr[1] = pub_msg.pattern;
         arr[2] = pub_msg.channel;
         arr[3] = pub_msg.message;
         rbuilder->SendStringArr(absl::Span<string_view>{arr, 4});
+        if (req->async_msg->waited())
+          req->async_msg->bc.Dec();
       }
 
-      req->async_msg->bc.Dec();
-
       req->async_msg->~AsyncMsg();
       mi_free(req->async_msg);
+    } else if (squash_limit > 1 && protocol_ == Protocol::REDIS && !dispatch_q_.empty() &&
+               !dispatch_q_.front()->async_msg) {
+      absl::InlinedVector<Request*, 16> batch{req};
+      while (batch.size() < squash_limit && !dispatch_q_.empty() &&
+             !dispatch_q_.front()->async_msg) {
+        batch.push_back(dispatch_q_.front());
+        dispatch_q_.pop_front();
+      }
+      uint64_t now = 0, trace_id = 0;
+      for (Request* r : batch) {
+        RemoveQueuedRequest(r, stats);
+        if (r->trace_id) {
+          now = now ? now : ProactorBase::GetMonotonicTimeNs();
+          RequestTracer::Record(r->trace_id, "queue", r->enqueue_ns, now);
+          trace_id = trace_id ? trace_id : r->trace_id;
+        }
+      }
+
+      absl::InlinedVector<CmdArgList, 16> args_list;
+      for (Request* r : batch) {
+        args_list.emplace_back(r->args.data(), r->args.size());
+      }
+      stats->pipelined_cmd_cnt += batch.size();
+
+      update_batch_mode();
+      cc_->async_dispatch = true;
+      // The squashed commands are traced as a whole, by the first sampled one of them.
+      if (trace_id)
+        builder->set_trace_id(trace_id);
+      service_->DispatchManyCommands(absl::MakeSpan(args_list), cc_.get());
+      if (trace_id) {
+        RequestTracer::Record(trace_id, "dispatch", now, ProactorBase::GetMonotonicTimeNs(),
+                              absl::StrCat("squashed ", batch.size()));
+      }
+      last_interaction_ = time(nullptr);
+      cc_->async_dispatch = false;
+
+      // req is released below.
+      for (size_t i = 1; i < batch.size(); ++i) {
+        FreeRequest(batch[i]);
+      }
     } else {
       ++stats->pipelined_cmd_cnt;
+      RemoveQueuedRequest(req, stats);
+      if (req->trace_id) {
+        RequestTracer::Record(req->trace_id, "queue", req->enqueue_ns,
+                              ProactorBase::GetMonotonicTimeNs());
+      }
 
-      builder->SetBatchMode(!dispatch_q_.empty());
+      update_batch_mode();
       cc_->async_dispatch = true;
-      service_->DispatchCommand(CmdArgList{req->args.data(), req->args.size()}, cc_.get());
+      DispatchTraced(CmdArgList{req->args.data(), req->args.size()}, req->trace_id);
       last_interaction_ = time(nullptr);
       cc_->async_dispatch = false;
     }
-    req->~Request();
-    mi_free(req);
+    FreeRequest(req);
+
+    // Uncorking sends the tail of the replies.
+    if (corked_ && dispatch_q_.empty())
+      SetCork(false);
   }
 
   cc_->conn_closing = true;
@@ -639,16 +1113,62 @@ void Connection::DispatchFiber(util::FiberSocketBase* peer) {
     dispatch_q_.pop_front();
 
     if (req->async_msg) {
-      req->async_msg->bc.Dec();
+      if (req->async_msg->waited())
+        req->async_msg->bc.Dec();
       req->async_msg->~AsyncMsg();
       mi_free(req->async_msg);
+    } else {
+      RemoveQueuedRequest(req, stats);
     }
-    req->~Request();
+    FreeRequest(req);
+  }
+}
+
+auto Connection::AllocRequest(size_t nargs, size_t capacity, mi_heap_t* heap) -> Request* {
+  constexpr auto kReqSz = sizeof(Request);
+  static_assert(kReqSz < MI_SMALL_SIZE_MAX);
+  static_assert(alignof(Request) == 8);
+
+  void* ptr;
+  auto& blocks = tl_request_pool.blocks;
+  if (blocks.empty()) {
+    ptr = mi_heap_malloc_small(heap, kReqSz);
+  } else {
+    ptr = blocks.back();
+    blocks.pop_back();
+  }
+
+  return new (ptr) Request{nargs, capacity};
+}
+
+void Connection::FreeRequest(Request* req) {
+  req->~Request();
+
+  auto& blocks = tl_request_pool.blocks;
+  if (blocks.size() < kMaxPooledRequests) {
+    blocks.push_back(req);
+  } else {
     mi_free(req);
   }
 }
 
-auto Connection::FromArgs(RespVec args, mi_heap_t* heap) -> Request* {
+void Connection::AddQueuedRequest(const Request* req, ConnectionStats* stats) {
+  size_t bytes = req->MemUsage();
+  queued_bytes_ += bytes;
+  stats->dispatch_queue_bytes += bytes;
+}
+
+void Connection::RemoveQueuedRequest(const Request* req, ConnectionStats* stats) {
+  size_t bytes = req->MemUsage();
+  DCHECK_GE(queued_bytes_, bytes);
+  queued_bytes_ -= bytes;
+  stats->dispatch_queue_bytes -= bytes;
+
+  if (stats->num_throttled_conns)
+    tl_queue_drained.notifyAll();
+}
+
+auto Connection::FromArgs(const RespVec& args, mi_heap_t* heap) -> Request* {
   DCHECK(!args.empty());
   size_t backed_sz = 0;
   for (const auto& arg : args) {
@@ -657,12 +1177,7 @@ auto Connection::FromArgs(RespVec args, mi_heap_t* heap) -> Request* {
   }
   DCHECK(backed_sz);
 
-  constexpr auto kReqSz = sizeof(Request);
-  static_assert(kReqSz < MI_SMALL_SIZE_MAX);
-  static_assert(alignof(Request) == 8);
-  void* ptr = mi_heap_malloc_small(heap, kReqSz);
-
-  Request* req = new (ptr) Request{args.size(), backed_sz};
+  Request* req = AllocRequest(args.size(), backed_sz, heap);
 
   auto* next = req->storage.data();
   for (size_t i = 0; i < args.size(); ++i) {
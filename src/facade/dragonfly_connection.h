@@ -7,7 +7,10 @@
 #include <absl/container/fixed_array.h>
 
 #include <deque>
+#include <memory>
+#include <string>
 #include <variant>
+#include <vector>
 
 #include "base/io_buf.h"
 #include "facade/facade_types.h"
@@ -57,21 +60,53 @@ class Connection : public util::Connection {
     std::string_view pattern;
     std::string_view channel;
     std::string_view message;
+    bool sharded = false;  // smessage of SPUBLISH.
   };
 
   virtual void SendMsgVecAsync(const PubMessage& pub_msg, util::fibers_ext::BlockingCounter bc);
 
+  // Same as SendMsgVecAsync but the message is not waited for, holder keeps its views alive
+  // until it is written.
+  virtual void SendMsgAsync(const PubMessage& pub_msg, std::shared_ptr<const void> holder);
+
+  // Client tracking invalidations are published on this channel.
+  static constexpr std::string_view kInvalidationChannel = "__redis__:invalidate";
+
+  // Sends the invalidated keys as a message of kInvalidationChannel. Empty keys invalidate
+  // all the keys, i.e. the message is null.
+  virtual void SendInvalidationAsync(std::vector<std::string> keys);
+
+  // The changes of the keyspace are published on this channel, see dfly::ChangeFeed.
+  static constexpr std::string_view kChangesChannel = "__changes__";
+
+  // Sends the records of the change feed as a message of kChangesChannel.
+  virtual void SendChangesAsync(std::vector<std::string> records);
+
   void SetName(std::string_view name) {
     CopyCharBuf(name, sizeof(name_), name_);
   }
 
+  std::string_view GetName() const {
+    return name_;
+  }
+
   void SetPhase(std::string_view phase) {
     CopyCharBuf(phase, sizeof(phase_), phase_);
   }
 
   std::string GetClientInfo() const;
+
+  // Returns "ip:port" of the peer, empty if the connection has no socket.
+  std::string RemoteEndpointStr() const;
+
+  // Returns the local address that the peer connected to, empty if the connection has no socket.
+  std::string LocalBindAddress() const;
   uint32 GetClientId() const;
 
+  // Shuts the socket down, so that the connection stops once it reads from the socket next.
+  // Called in the thread of the connection.
+  void ShutdownSocket();
+
  protected:
   void OnShutdown() override;
 
@@ -95,9 +130,29 @@ class Connection : public util::Connection {
 
   void DispatchFiber(util::FiberSocketBase* peer);
 
+  // Queues a message of the server channel that owns its items, see SendInvalidationAsync.
+  void SendOwnedMsgAsync(std::string_view channel, std::vector<std::string> items);
+
   ParserStatus ParseRedis();
   ParserStatus ParseMemcache();
 
+  // Dispatches the command, trace_id is that of the request if it is sampled.
+  void DispatchTraced(CmdArgList args, uint64_t trace_id);
+
+  bool HoldsGrownBuffers() const;
+
+  // Called before a read of a drained connection that holds grown buffers. Waits for the input
+  // and shrinks the buffers if the connection stays idle for FLAGS_conn_buf_idle_sec, so that
+  // the idle connections do not hold the memory of the biggest request they have seen while
+  // the busy ones keep it.
+  void AwaitInput(util::FiberSocketBase* peer, ConnectionStats* stats);
+
+  // Returns io_buf_ and the argument vectors to their initial size.
+  void ShrinkReadBuffer(ConnectionStats* stats);
+
+  // Sets TCP_CORK on the socket, see FLAGS_tcp_cork.
+  void SetCork(bool cork);
+
   base::IoBuf io_buf_;
   std::unique_ptr<RedisParser> redis_parser_;
   std::unique_ptr<MemcacheParser> memcache_parser_;
@@ -105,6 +160,7 @@ class Connection : public util::Connection {
   SSL_CTX* ctx_;
   ServiceInterface* service_;
   time_t creation_time_, last_interaction_;
+  uint64_t read_ns_ = 0;  // when the last read completed, updated only while tracing.
   char name_[16];
   char phase_[16];
 
@@ -112,17 +168,29 @@ class Connection : public util::Connection {
 
   struct Request;
 
-  // args are passed deliberately by value - to pass the ownership.
-  static Request* FromArgs(RespVec args, mi_heap_t* heap);
+  // Copies args into a new request, args keep their capacity for the next command.
+  static Request* FromArgs(const RespVec& args, mi_heap_t* heap);
+
+  // Requests are recycled via a thread local pool.
+  static Request* AllocRequest(size_t nargs, size_t capacity, mi_heap_t* heap);
+  static void FreeRequest(Request* req);
+
+  // Accounts the parsed requests of dispatch_q_ towards the pipeline_queue_bytes limits.
+  void AddQueuedRequest(const Request* req, ConnectionStats* stats);
+  void RemoveQueuedRequest(const Request* req, ConnectionStats* stats);
 
   std::deque<Request*> dispatch_q_;  // coordinated via evc_.
   util::fibers_ext::EventCount evc_;
+  size_t queued_bytes_ = 0;  // memory of the parsed requests in dispatch_q_.
 
   RespVec parse_args_;
   CmdArgVec cmd_vec_;
 
   unsigned parser_error_ = 0;
+  unsigned small_reads_ = 0;  // consecutive reads that drained the input and fit kMinReadSize.
   uint32_t id_;
+  bool corked_ = false;
+  bool is_unix_ = false;  // accepted by the unix socket listener, TCP options do not apply.
 
   Protocol protocol_;
 
@@ -4,6 +4,11 @@
 
 #include "facade/dragonfly_listener.h"
 
+#include <linux/filter.h>
+#include <sched.h>
+
+#include <algorithm>
+
 #ifdef DFLY_USE_SSL
 #include <openssl/ssl.h>
 #endif
@@ -11,9 +16,15 @@
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
+#include "facade/numa.h"
 #include "facade/service_interface.h"
 #include "util/proactor_pool.h"
 
+#ifdef DFLY_USE_SSL
+#include "facade/tls_offload.h"
+#include "facade/tls_session.h"
+#endif
+
 using namespace std;
 
 ABSL_FLAG(uint32_t, conn_threads, 0, "Number of threads used for handing server connections");
@@ -21,9 +32,18 @@ ABSL_FLAG(bool, tls, false, "");
 ABSL_FLAG(bool, conn_use_incoming_cpu, false,
           "If true uses incoming cpu of a socket in order to distribute"
           " incoming connections");
+ABSL_FLAG(bool, conn_reuseport, false,
+          "If true, every connection thread accepts on its own SO_REUSEPORT socket of the port "
+          "and keeps its connections, rather than a single acceptor that spreads them. With "
+          "conn_use_incoming_cpu the kernel steers a connection to the socket of the thread on "
+          "the cpu that received it");
 
 ABSL_FLAG(string, tls_client_cert_file, "", "cert file for tls connections");
 ABSL_FLAG(string, tls_client_key_file, "", "key file for tls connections");
+ABSL_FLAG(bool, tls_ktls, false,
+          "If true, replies of tls connections are encrypted by the kernel (kTLS) instead of "
+          "OpenSSL. Requires the tls kernel module and an AES-GCM cipher, other connections "
+          "stay in user space");
 
 #if 0
 enum TlsClientAuth {
@@ -92,6 +112,12 @@ static SSL_CTX* CreateSslCntx() {
 
   CHECK_EQ(1, SSL_CTX_set_dh_auto(ctx, 1));
 
+  TlsSession::Setup(ctx);
+
+  if (GetFlag(FLAGS_tls_ktls)) {
+    TlsTxOffload::Setup(ctx);
+  }
+
   return ctx;
 }
 #endif
@@ -123,9 +149,76 @@ bool ConfigureKeepAlive(int fd, unsigned interval_sec) {
   return true;
 }
 
+// Returns the cpu to which the calling thread is pinned, -1 if it may run on several cpus.
+int PinnedCpu() {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0 || CPU_COUNT(&cpus) != 1)
+    return -1;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus))
+      return cpu;
+  }
+  return -1;
+}
+
+// Attaches a classic bpf program to the reuseport group of fd that returns the index of the
+// thread on the cpu that received the connection. The kernel falls back to the hash of the
+// connection if the index is out of the group, i.e. for the cpus without a thread.
+bool AttachSteeringProgram(int fd, const vector<int>& cpus) {
+  vector<sock_filter> code;
+  code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU));
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i] < 0)
+      continue;
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, uint32_t(cpus[i]), 0, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, uint32_t(i)));
+  }
+  code.push_back(BPF_STMT(BPF_RET | BPF_K, UINT32_MAX));
+
+  if (code.size() > BPF_MAXINSNS)
+    return false;
+
+  sock_fprog prog{uint16_t(code.size()), code.data()};
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
 }  // namespace
 
-Listener::Listener(Protocol protocol, ServiceInterface* si) : service_(si), protocol_(protocol) {
+vector<Listener*> Listener::CreateReusePort(Protocol protocol, ServiceInterface* si,
+                                            ProactorPool* pp) {
+  if (!GetFlag(FLAGS_conn_reuseport))
+    return {};
+
+  uint32_t total = GetFlag(FLAGS_conn_threads);
+  if (total == 0 || total > pp->size()) {
+    total = pp->size();
+  }
+
+  vector<Listener*> res(total);
+  for (unsigned i = 0; i < total; ++i) {
+    res[i] = new Listener{protocol, si};
+    res[i]->reuseport_thread_ = i;
+  }
+
+  if (GetFlag(FLAGS_conn_use_incoming_cpu)) {
+    vector<int> cpus(total, -1);
+    pp->Await([&](unsigned index, ProactorBase*) {
+      if (index < total)
+        cpus[index] = PinnedCpu();
+    });
+
+    if (count(cpus.begin(), cpus.end(), -1) == int(total)) {
+      LOG(WARNING) << "The threads are not pinned to cpus, the connections are not steered";
+    } else {
+      res[0]->steering_cpus_ = std::move(cpus);
+    }
+  }
+
+  return res;
+}
+Protocol protocol, ServiceInterface* si) : service_(si), protocol_(protocol) {
 
 #ifdef DFLY_USE_SSL
   if (GetFlag(FLAGS_tls)) {
@@ -153,9 +246,26 @@ error_code Listener::ConfigureServerSocket(int fd) {
   int val = 1;
   constexpr int kInterval = 300;  // 300 seconds is ok to start checking for liveness.
 
+  // The options below are of TCP, a unix socket listener needs none of them.
+  int domain = 0;
+  socklen_t len = sizeof(domain);
+  if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX) {
+    return error_code{};
+  }
+
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0) {
     LOG(WARNING) << "Could not set reuse addr on socket " << detail::SafeErrorMessage(errno);
   }
+
+  // Called before the bind, so that the socket joins the reuseport group of the port.
+  if (reuseport_thread_ >= 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+      return error_code{errno, system_category()};
+    }
+    if (!steering_cpus_.empty() && !AttachSteeringProgram(fd, steering_cpus_)) {
+      LOG(WARNING) << "Could not attach the steering program " << detail::SafeErrorMessage(errno);
+    }
+  }
   bool success = ConfigureKeepAlive(fd, kInterval);
 
   LOG_IF(WARNING, !success) << "Could not configure keep alive " << detail::SafeErrorMessage(errno);
@@ -172,6 +282,12 @@ void Listener::PostShutdown() {
 // We can limit number of threads handling dragonfly connections.
 ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
   util::ProactorPool* pp = pool();
+
+  // The socket of the thread accepted the connection, possibly in another thread.
+  if (reuseport_thread_ >= 0) {
+    return pp->at(reuseport_thread_);
+  }
+
   uint32_t total = GetFlag(FLAGS_conn_threads);
   uint32_t id = kuint32max;
 
@@ -189,9 +305,17 @@ ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
     CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len));
     VLOG(1) << "CPU/NAPI for connection " << fd << " is " << cpu << "/" << napi_id;
 
-    vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
-    if (!ids.empty()) {
-      id = ids.front();
+    // With numa_bind the threads are pinned by numa::BindThread rather than by the pool,
+    // a connection whose cpu has no thread stays at least on the socket of its NIC queue.
+    if (int numa_id = numa::PickThread(cpu, total, next_id_.load(memory_order_relaxed));
+        numa_id >= 0) {
+      next_id_.fetch_add(1, memory_order_relaxed);
+      id = numa_id;
+    } else {
+      vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
+      if (!ids.empty()) {
+        id = ids.front();
+      }
     }
   }
 
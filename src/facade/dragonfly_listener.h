@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "facade/facade_types.h"
 #include "util/http/http_handler.h"
 #include "util/listener_interface.h"
@@ -19,6 +21,13 @@ class Listener : public util::ListenerInterface {
   Listener(Protocol protocol, ServiceInterface*);
   ~Listener();
 
+  // Returns a listener per connection thread if FLAGS_conn_reuseport is set, each accepts on
+  // its own SO_REUSEPORT socket of the port. They must be added to the AcceptServer in order,
+  // so that the index of a socket in the reuseport group is the index of its thread. Returns
+  // an empty vector if the flag is not set.
+  static std::vector<Listener*> CreateReusePort(Protocol protocol, ServiceInterface* si,
+                                                util::ProactorPool* pp);
+
   std::error_code ConfigureServerSocket(int fd) final;
 
  private:
@@ -36,6 +45,13 @@ class Listener : public util::ListenerInterface {
   std::atomic_uint32_t next_id_{0};
   Protocol protocol_;
   SSL_CTX* ctx_ = nullptr;
+
+  // The thread of the connections of a reuseport listener, -1 otherwise.
+  int reuseport_thread_ = -1;
+
+  // Set for the first reuseport listener of a port if FLAGS_conn_use_incoming_cpu is set, the
+  // cpu of every thread or -1 if the thread is not pinned. Its socket steers the connections.
+  std::vector<int> steering_cpus_;
 };
 
 }  // namespace facade
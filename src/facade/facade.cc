@@ -21,7 +21,7 @@ constexpr size_t kSizeConnStats = sizeof(ConnectionStats);
 
 ConnectionStats& ConnectionStats::operator+=(const ConnectionStats& o) {
   // To break this code deliberately if we add/remove a field to this struct.
-  static_assert(kSizeConnStats == 168);
+  static_assert(kSizeConnStats == 184);
 
   ADD(read_buf_capacity);
   ADD(io_read_cnt);
@@ -32,10 +32,13 @@ ConnectionStats& ConnectionStats::operator+=(const ConnectionStats& o) {
   ADD(pipelined_cmd_cnt);
   ADD(parser_err_cnt);
   ADD(async_writes_cnt);
+  ADD(dispatch_queue_bytes);
+  ADD(pipeline_throttle_cnt);
 
   ADD(num_conns);
   ADD(num_replicas);
   ADD(num_blocked_clients);
+  ADD(num_throttled_conns);
 
   for (const auto& k_v : o.err_count_map) {
     err_count_map[k_v.first] += k_v.second;
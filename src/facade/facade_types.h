@@ -40,9 +40,16 @@ struct ConnectionStats {
   // Writes count that happenned via SendRawMessageAsync call.
   size_t async_writes_cnt = 0;
 
+  // Memory held by the pipelined requests waiting in the dispatch queues.
+  size_t dispatch_queue_bytes = 0;
+
+  // How many times connections stopped reading their sockets due to the dispatch queue limits.
+  size_t pipeline_throttle_cnt = 0;
+
   uint32_t num_conns = 0;
   uint32_t num_replicas = 0;
   uint32_t num_blocked_clients = 0;
+  uint32_t num_throttled_conns = 0;
 
   ConnectionStats& operator+=(const ConnectionStats& o);
 };
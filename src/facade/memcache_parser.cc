@@ -99,11 +99,130 @@ MP::Result ParseValueless(const std::string_view* tokens, unsigned num_tokens, M
   return MP::OK;
 }
 
+// mg <key> <flag>*
+// ms <key> <datalen> <flag>*
+// md <key> <flag>*
+// mn
+MP::Result ParseMeta(const std::string_view* tokens, unsigned num_tokens, MP::Command* res) {
+  string_view name = tokens[0];
+  res->meta = true;
+
+  if (name == "mn") {
+    res->type = MP::META_NOOP;
+    return num_tokens == 1 ? MP::OK : MP::PARSE_ERROR;
+  }
+
+  if (num_tokens < 2 || tokens[1].size() > 250)
+    return MP::PARSE_ERROR;
+
+  res->key = tokens[1];
+  unsigned pos = 2;
+
+  if (name == "mg") {
+    res->type = MP::GET;
+  } else if (name == "md") {
+    res->type = MP::DELETE;
+  } else if (name == "ms") {
+    res->type = MP::SET;
+    if (num_tokens < 3)
+      return MP::PARSE_ERROR;
+    if (!absl::SimpleAtoi(tokens[2], &res->bytes_len))
+      return MP::BAD_INT;
+    pos = 3;
+  } else {
+    return MP::UNKNOWN_CMD;
+  }
+
+  bool is_get = res->type == MP::GET;
+  bool is_store = res->type == MP::SET;
+
+  for (; pos < num_tokens; ++pos) {
+    string_view flag = tokens[pos];
+    string_view arg = flag.substr(1);
+    uint16_t get_flag = 0;
+
+    switch (flag[0]) {
+      case 'q':
+        res->meta_flags |= MP::META_QUIET;
+        break;
+      case 'k':
+        res->meta_flags |= MP::META_KEY;
+        break;
+      case 'O':
+        if (arg.size() > 32)
+          return MP::PARSE_ERROR;
+        res->opaque = arg;
+        break;
+      case 'v':
+        get_flag = MP::META_VALUE;
+        break;
+      case 't':
+        get_flag = MP::META_TTL;
+        break;
+      case 'f':
+        get_flag = MP::META_FLAGS;
+        break;
+      case 'c':
+        get_flag = MP::META_CAS;
+        break;
+      case 's':
+        get_flag = MP::META_SIZE;
+        break;
+      case 'T':
+        if (!is_store)
+          return MP::PARSE_ERROR;
+        if (!absl::SimpleAtoi(arg, &res->expire_ts))
+          return MP::BAD_INT;
+        break;
+      case 'F':
+        if (!is_store)
+          return MP::PARSE_ERROR;
+        if (!absl::SimpleAtoi(arg, &res->flags))
+          return MP::BAD_INT;
+        break;
+      case 'M':
+        if (!is_store || arg.size() != 1)
+          return MP::PARSE_ERROR;
+        switch (absl::ascii_toupper(arg[0])) {
+          case 'S':
+            res->type = MP::SET;
+            break;
+          case 'E':
+            res->type = MP::ADD;
+            break;
+          case 'R':
+            res->type = MP::REPLACE;
+            break;
+          case 'A':
+            res->type = MP::APPEND;
+            break;
+          case 'P':
+            res->type = MP::PREPEND;
+            break;
+          default:
+            return MP::PARSE_ERROR;
+        }
+        break;
+      default:
+        return MP::PARSE_ERROR;  // not supported.
+    }
+
+    if (get_flag) {
+      if (!is_get || !arg.empty())
+        return MP::PARSE_ERROR;
+      res->meta_flags |= get_flag;
+    }
+  }
+
+  return MP::OK;
+}
+
 }  // namespace
 
 auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
   auto pos = str.find('\n');
   *consumed = 0;
+  *cmd = Command{};
   if (pos == string_view::npos) {
     // TODO: it's over simplified since we may process GET/GAT command that is not limited to
     // 300 characters.
@@ -117,7 +236,7 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
 
   // cas <key> <flags> <exptime> <bytes> <cas unique> [noreply]\r\n
   // get <key>*\r\n
-  string_view tokens[8];
+  string_view tokens[16];
   unsigned num_tokens = 0;
   uint32_t cur = 0;
 
@@ -148,6 +267,10 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
     ++cur;
   }
 
+  if (tokens[0].size() == 2 && tokens[0][0] == 'm') {
+    return ParseMeta(tokens, num_tokens, cmd);
+  }
+
   cmd->type = From(tokens[0]);
   if (cmd->type == INVALID) {
     return UNKNOWN_CMD;
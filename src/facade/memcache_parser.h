@@ -32,6 +32,7 @@ class MemcacheParser {
 
     QUIT = 20,
     VERSION = 21,
+    META_NOOP = 22,  // mn
 
     // The rest of write commands.
     DELETE = 31,
@@ -40,7 +41,20 @@ class MemcacheParser {
     FLUSHALL = 34,
   };
 
+  // Flags of the meta commands, see https://github.com/memcached/memcached/wiki/MetaCommands
+  enum MetaFlag : uint16_t {
+    META_QUIET = 1,       // q: omits the replies of hits of stores/deletes and of get misses.
+    META_VALUE = 1 << 1,  // v: returns the value.
+    META_TTL = 1 << 2,    // t: returns the remaining ttl in seconds, -1 if none.
+    META_FLAGS = 1 << 3,  // f: returns the client flags.
+    META_CAS = 1 << 4,    // c: returns the cas version.
+    META_SIZE = 1 << 5,   // s: returns the value size.
+    META_KEY = 1 << 6,    // k: returns the key.
+  };
+
   // According to https://github.com/memcached/memcached/wiki/Commands#standard-protocol
+  // Meta commands mg, ms and md are mapped to GET, SET (ADD, REPLACE etc. according to their
+  // mode) and DELETE with meta set.
   struct Command {
     CmdType type = INVALID;
     std::string_view key;
@@ -55,6 +69,10 @@ class MemcacheParser {
     uint32_t bytes_len = 0;
     uint32_t flags = 0;
     bool no_reply = false;
+
+    bool meta = false;
+    uint16_t meta_flags = 0;  // MetaFlag mask.
+    std::string_view opaque;  // O flag, returned as is.
   };
 
   enum Result {
@@ -78,4 +78,85 @@ TEST_F(MCParserTest, Stats) {
   EXPECT_EQ(MemcacheParser::PARSE_ERROR, st);
 }
 
-}  // namespace facade
\ No newline at end of file
+TEST_F(MCParserTest, Meta) {
+  using MP = MemcacheParser;
+
+  MP::Result st = parser_.Parse("mg foo v t q Oop\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MP::OK, st);
+  EXPECT_EQ(MP::GET, cmd_.type);
+  EXPECT_TRUE(cmd_.meta);
+  EXPECT_EQ("foo", cmd_.key);
+  EXPECT_EQ(MP::META_VALUE | MP::META_TTL | MP::META_QUIET, cmd_.meta_flags);
+  EXPECT_EQ("op", cmd_.opaque);
+
+  st = parser_.Parse("ms foo 5 T10 F3 MA\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MP::OK, st);
+  EXPECT_EQ(MP::APPEND, cmd_.type);
+  EXPECT_EQ(5, cmd_.bytes_len);
+  EXPECT_EQ(10, cmd_.expire_ts);
+  EXPECT_EQ(3, cmd_.flags);
+  EXPECT_EQ(0, cmd_.meta_flags);
+  EXPECT_EQ("", cmd_.opaque);
+
+  st = parser_.Parse("md foo q\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MP::OK, st);
+  EXPECT_EQ(MP::DELETE, cmd_.type);
+  EXPECT_EQ(MP::META_QUIET, cmd_.meta_flags);
+
+  st = parser_.Parse("mn\r\n", &consumed_, &cmd_);
+  EXPECT_EQ(MP::OK, st);
+  EXPECT_EQ(MP::META_NOOP, cmd_.type);
+
+  // Get flags are not allowed for stores and store flags for gets.
+  EXPECT_EQ(MP::PARSE_ERROR, parser_.Parse("ms foo 5 v\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MP::PARSE_ERROR, parser_.Parse("mg foo T10\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MP::BAD_INT, parser_.Parse("ms foo bar\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MP::UNKNOWN_CMD, parser_.Parse("ma foo\r\n", &consumed_, &cmd_));
+}
+
+// A multi-get of range(0) keys.
+static void BM_MCParseMultiGet(benchmark::State& state) {
+  string cmd = "get";
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    absl::StrAppend(&cmd, " key:", i);
+  }
+  cmd.append("\r\n");
+  MemcacheParser parser;
+  MemcacheParser::Command mc_cmd;
+  uint32_t consumed = 0;
+
+  while (state.KeepRunning()) {
+    mc_cmd.keys_ext.clear();
+    CHECK_EQ(MemcacheParser::OK, parser.Parse(cmd, &consumed, &mc_cmd));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * cmd.size());
+}
+BENCHMARK(BM_MCParseMultiGet)->Arg(1)->Arg(16)->Arg(100);
+
+// A pipeline of 64 store commands with values of range(0) bytes. The values are skipped
+// like the connection does, the parser sees only the command lines.
+static void BM_MCParseStore(benchmark::State& state) {
+  constexpr unsigned kNumCmds = 64;
+  string value(state.range(0), 'x');
+  string buf;
+  for (unsigned i = 0; i < kNumCmds; ++i) {
+    absl::StrAppend(&buf, "set key:", i, " 0 0 ", value.size(), "\r\n", value, "\r\n");
+  }
+  MemcacheParser parser;
+  MemcacheParser::Command mc_cmd;
+  uint32_t consumed = 0;
+
+  while (state.KeepRunning()) {
+    string_view input = buf;
+    while (!input.empty()) {
+      CHECK_EQ(MemcacheParser::OK, parser.Parse(input, &consumed, &mc_cmd));
+      input.remove_prefix(consumed + mc_cmd.bytes_len + 2);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kNumCmds);
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_MCParseStore)->Arg(32)->Arg(1024);
+
+}  // namespace facade
@@ -0,0 +1,176 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "base/logging.h"
+
+namespace facade {
+namespace numa {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kMaxNodes = 1024;
+
+vector<int> cpu_node;    // indexed by cpu.
+vector<int> thread_cpu;  // indexed by the proactor index, -1 if not pinned.
+
+bool ReadFile(const string& path, string* contents) {
+  ifstream is(path);
+  if (!is)
+    return false;
+  getline(is, *contents);
+  return bool(is);
+}
+
+}  // namespace
+
+bool ParseCpuList(string_view list, vector<unsigned>* cpus) {
+  list = absl::StripAsciiWhitespace(list);
+  if (list.empty())
+    return true;
+
+  for (string_view range : absl::StrSplit(list, ',')) {
+    pair<string_view, string_view> p = absl::StrSplit(range, absl::MaxSplits('-', 1));
+    unsigned first, last;
+    if (!absl::SimpleAtoi(p.first, &first))
+      return false;
+    last = first;
+    if (!p.second.empty() && !absl::SimpleAtoi(p.second, &last))
+      return false;
+    if (last < first)
+      return false;
+
+    for (unsigned cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+  }
+
+  return true;
+}
+
+vector<vector<unsigned>> ReadNodes() {
+  vector<vector<unsigned>> nodes;
+  string online;
+  if (!ReadFile("/sys/devices/system/node/online", &online))
+    return nodes;
+
+  vector<unsigned> node_ids;
+  if (!ParseCpuList(online, &node_ids) || node_ids.empty() || node_ids.back() >= kMaxNodes)
+    return nodes;
+
+  nodes.resize(node_ids.back() + 1);
+  for (unsigned id : node_ids) {
+    string cpulist;
+    string path = absl::StrCat("/sys/devices/system/node/node", id, "/cpulist");
+    if (!ReadFile(path, &cpulist) || !ParseCpuList(cpulist, &nodes[id])) {
+      LOG(WARNING) << "Could not parse " << path;
+      return {};
+    }
+  }
+
+  return nodes;
+}
+
+vector<CpuSlot> InterleaveCpus(const vector<vector<unsigned>>& nodes) {
+  vector<CpuSlot> res;
+  for (size_t i = 0;; ++i) {
+    size_t prev = res.size();
+    for (size_t node = 0; node < nodes.size(); ++node) {
+      if (i < nodes[node].size())
+        res.push_back(CpuSlot{nodes[node][i], int(node)});
+    }
+    if (res.size() == prev)
+      break;
+  }
+  return res;
+}
+
+void SetTopology(const vector<vector<unsigned>>& nodes, unsigned num_threads) {
+  cpu_node.clear();
+  for (size_t node = 0; node < nodes.size(); ++node) {
+    for (unsigned cpu : nodes[node]) {
+      if (cpu >= cpu_node.size())
+        cpu_node.resize(cpu + 1, -1);
+      cpu_node[cpu] = node;
+    }
+  }
+  thread_cpu.assign(num_threads, -1);
+}
+
+bool BindThread(unsigned thread_index, const CpuSlot& slot) {
+  DCHECK_LT(thread_index, thread_cpu.size());
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(slot.cpu, &cpus);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (err) {
+    LOG(WARNING) << "Could not pin thread " << thread_index << " to cpu " << slot.cpu << ": "
+                 << strerror(err);
+    return false;
+  }
+  thread_cpu[thread_index] = slot.cpu;
+
+  // Preferred rather than bound, an exhausted node falls back to the other ones instead of
+  // failing the allocations. We call the syscall directly to avoid depending on libnuma.
+  unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {0};
+  mask[slot.node / (8 * sizeof(unsigned long))] |= 1UL << (slot.node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, kMaxNodes) != 0) {
+    LOG(WARNING) << "Could not set the memory policy of thread " << thread_index << ": "
+                 << strerror(errno);
+  }
+
+  return true;
+}
+
+int CpuNode(unsigned cpu) {
+  if (cpu >= cpu_node.size() || thread_cpu.empty())
+    return -1;
+  return cpu_node[cpu];
+}
+
+int PickThread(unsigned cpu, uint32_t total, uint32_t seq) {
+  int node = CpuNode(cpu);
+  if (node < 0)
+    return -1;
+
+  total = min<uint32_t>(total, thread_cpu.size());
+  unsigned local = 0;
+  for (unsigned i = 0; i < total; ++i) {
+    if (thread_cpu[i] == int(cpu))
+      return i;
+    if (thread_cpu[i] >= 0 && cpu_node[thread_cpu[i]] == node)
+      ++local;
+  }
+
+  if (local == 0)
+    return -1;
+
+  seq %= local;
+  for (unsigned i = 0; i < total; ++i) {
+    if (thread_cpu[i] >= 0 && cpu_node[thread_cpu[i]] == node && seq-- == 0)
+      return i;
+  }
+  return -1;
+}
+
+}  // namespace numa
+}  // namespace facade
@@ -0,0 +1,51 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace facade {
+
+// Placement of the proactor threads on the NUMA nodes of the host. The threads are pinned
+// once at startup, before the shards allocate their data, so that the pages of each shard
+// heap come from the node of its thread. The placement is read-only afterwards.
+namespace numa {
+
+struct CpuSlot {
+  unsigned cpu;
+  int node;
+};
+
+// Parses the cpu list format of sysfs, e.g. "0-3,8,10-11". Returns false if it's malformed.
+bool ParseCpuList(std::string_view list, std::vector<unsigned>* cpus);
+
+// Returns the cpus of each node, indexed by the node id, as described by
+// /sys/devices/system/node. Empty if the topology is not available.
+std::vector<std::vector<unsigned>> ReadNodes();
+
+// Orders the cpus so that consecutive threads alternate between the nodes, hence a pool
+// smaller than the host is still spread evenly over the sockets.
+std::vector<CpuSlot> InterleaveCpus(const std::vector<std::vector<unsigned>>& nodes);
+
+// Records the topology before the threads are bound. Not thread-safe.
+void SetTopology(const std::vector<std::vector<unsigned>>& nodes, unsigned num_threads);
+
+// Pins the calling thread to slot.cpu and makes slot.node the preferred node of its
+// allocations. Must be called in the proactor thread with the given index, after
+// SetTopology. Returns false if the thread could not be pinned.
+bool BindThread(unsigned thread_index, const CpuSlot& slot);
+
+// Returns the node of the cpu, -1 if the proactor threads are not bound.
+int CpuNode(unsigned cpu);
+
+// Returns a thread among the first total ones that is pinned to cpu, otherwise the
+// seq-th of those pinned to the node of cpu. Returns -1 if there are none or the threads
+// are not bound.
+int PickThread(unsigned cpu, uint32_t total, uint32_t seq);
+
+}  // namespace numa
+}  // namespace facade
@@ -0,0 +1,64 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include <gmock/gmock.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+namespace numa {
+
+TEST(NumaTest, ParseCpuList) {
+  vector<unsigned> cpus;
+  ASSERT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_THAT(cpus, ElementsAre(0, 1, 2, 3, 8, 10, 11));
+
+  cpus.clear();
+  ASSERT_TRUE(ParseCpuList("", &cpus));
+  EXPECT_THAT(cpus, IsEmpty());
+
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("a-b", &cpus));
+  EXPECT_FALSE(ParseCpuList("1,,2", &cpus));
+}
+
+TEST(NumaTest, Interleave) {
+  vector<CpuSlot> slots = InterleaveCpus({{0, 1, 2}, {4, 5}});
+  ASSERT_EQ(5u, slots.size());
+
+  vector<pair<unsigned, int>> res;
+  for (const auto& s : slots)
+    res.emplace_back(s.cpu, s.node);
+  EXPECT_THAT(res, ElementsAre(Pair(0, 0), Pair(4, 1), Pair(1, 0), Pair(5, 1), Pair(2, 0)));
+}
+
+TEST(NumaTest, PickThread) {
+  EXPECT_EQ(-1, PickThread(0, 4, 0));
+
+  // Binds the test thread in place of 3 proactor threads, the last one on node 1.
+  SetTopology({{0, 1}, {2}}, 3);
+  if (!BindThread(0, CpuSlot{0, 0}) || !BindThread(1, CpuSlot{0, 0}) ||
+      !BindThread(2, CpuSlot{2, 1})) {
+    GTEST_SKIP() << "the host has less than 3 cpus";
+  }
+
+  EXPECT_EQ(0, CpuNode(1));
+  EXPECT_EQ(1, CpuNode(2));
+  EXPECT_EQ(-1, CpuNode(3));
+
+  EXPECT_EQ(0, PickThread(0, 3, 1));  // pinned to the cpu.
+  EXPECT_EQ(2, PickThread(2, 3, 0));
+  EXPECT_EQ(0, PickThread(1, 3, 0));  // round robin over node 0.
+  EXPECT_EQ(1, PickThread(1, 3, 1));
+  EXPECT_EQ(-1, PickThread(2, 2, 0));  // thread 2 is not among the first 2.
+}
+
+}  // namespace numa
+}  // namespace facade
@@ -2,35 +2,73 @@
 // See LICENSE for licensing terms.
 //
 
+// A server that answers the redis and memcached commands through the facade stack without
+// executing them. Run side by side with dragonfly under the same load, it shows the cost of
+// the parsers, the connections and the reply builders apart from the transactions and the
+// storage. The connection flags of dragonfly, e.g. tls, conn_threads, pipeline_squash or
+// reply_batch_bytes, apply to it as well.
+
+#include <absl/container/inlined_vector.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/str_cat.h>
+
+#include <iostream>
+
 #include "base/init.h"
+#include "base/logging.h"
 #include "facade/conn_context.h"
 #include "facade/dragonfly_listener.h"
+#include "facade/reply_builder.h"
 #include "facade/service_interface.h"
 #include "util/accept_server.h"
 #include "util/uring/uring_pool.h"
 
 ABSL_FLAG(uint32_t, port, 6379, "server port");
+ABSL_FLAG(uint32_t, memcache_port, 0, "memcached port, 0 disables it");
+ABSL_FLAG(std::string, reply, "echo",
+          "'echo' replies with the arguments of the command, 'ok' with OK and 'bulk' with a "
+          "string of reply_size bytes. A memcached get returns the key, or the string with "
+          "'bulk', as the value");
+ABSL_FLAG(uint32_t, reply_size, 32, "The size of the replies with reply=bulk");
+ABSL_FLAG(uint32_t, stats_interval, 10,
+          "If positive, every thread prints its stats every stats_interval seconds");
 
 using namespace util;
 using namespace std;
 using absl::GetFlag;
+using absl::StrCat;
 
 namespace facade {
 
 namespace {
 
+enum class ReplyMode : uint8_t { ECHO, OK, BULK };
+
 thread_local ConnectionStats tl_stats;
 
 class OkService : public ServiceInterface {
  public:
+  OkService(ReplyMode mode, uint32_t reply_size) : mode_(mode), bulk_(reply_size, 'x') {
+  }
+
   void DispatchCommand(CmdArgList args, ConnectionContext* cntx) final {
-    (*cntx)->SendOk();
+    ++tl_stats.command_cnt;
+    switch (mode_) {
+      case ReplyMode::ECHO: {
+        absl::InlinedVector<string_view, 8> arr(args.size());
+        for (size_t i = 0; i < args.size(); ++i)
+          arr[i] = ArgS(args, i);
+        return (*cntx)->SendStringArr(absl::MakeConstSpan(arr));
+      }
+      case ReplyMode::OK:
+        return (*cntx)->SendOk();
+      case ReplyMode::BULK:
+        return (*cntx)->SendBulkString(bulk_);
+    }
   }
 
   void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
-                  ConnectionContext* cntx) final {
-    cntx->reply_builder()->SendError("");
-  }
+                  ConnectionContext* cntx) final;
 
   ConnectionContext* CreateContext(util::FiberSocketBase* peer, Connection* owner) final {
     return new ConnectionContext{peer, owner};
@@ -39,15 +77,150 @@ class OkService : public ServiceInterface {
   ConnectionStats* GetThreadLocalConnectionStats() final {
     return &tl_stats;
   }
+
+ private:
+  ReplyMode mode_;
+  string bulk_;
 };
 
-void RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
-  OkService service;
+void OkService::DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
+                           ConnectionContext* cntx) {
+  ++tl_stats.command_cnt;
+  MCReplyBuilder* builder = static_cast<MCReplyBuilder*>(cntx->reply_builder());
+  if (cmd.meta)
+    builder->SetMetaCommand(&cmd);
+  builder->SetNoReply(cmd.no_reply);
+
+  switch (cmd.type) {
+    case MemcacheParser::SET:
+    case MemcacheParser::ADD:
+    case MemcacheParser::REPLACE:
+    case MemcacheParser::APPEND:
+    case MemcacheParser::PREPEND:
+    case MemcacheParser::CAS:
+      builder->SendStored();
+      break;
+    case MemcacheParser::GET:
+    case MemcacheParser::GETS:
+    case MemcacheParser::GAT:
+    case MemcacheParser::GATS: {
+      // The coalesced gets have the keys of all of them, see Connection::ParseMemcache.
+      absl::InlinedVector<SinkReplyBuilder::OptResp, 8> resp(1 + cmd.keys_ext.size());
+      for (size_t i = 0; i < resp.size(); ++i) {
+        string_view key = i == 0 ? cmd.key : cmd.keys_ext[i - 1];
+        resp[i].emplace();
+        resp[i]->key = key;
+        resp[i]->value = mode_ == ReplyMode::BULK ? bulk_ : string{key};
+      }
+      builder->SendMGetResponse(resp.data(), resp.size());
+      break;
+    }
+    case MemcacheParser::DELETE:
+      builder->SendDeleted();
+      break;
+    case MemcacheParser::INCR:
+    case MemcacheParser::DECR:
+      builder->SendLong(cmd.delta);
+      break;
+    case MemcacheParser::FLUSHALL:
+      builder->SendOk();
+      break;
+    case MemcacheParser::VERSION:
+      builder->SendSimpleString("VERSION ok_backend");
+      break;
+    case MemcacheParser::META_NOOP:
+      builder->SendSimpleString("MN");
+      break;
+    case MemcacheParser::QUIT:
+      cntx->conn_closing = true;
+      break;
+    default:
+      builder->SendClientError("bad command line format");
+  }
+
+  builder->SetMetaCommand(nullptr);
+  builder->SetNoReply(false);
+}
+
+string FormatStats(const ConnectionStats& stats) {
+  return StrCat("conns=", stats.num_conns, ",commands=", stats.command_cnt,
+                ",pipelined=", stats.pipelined_cmd_cnt, ",read_bytes=", stats.io_read_bytes,
+                ",reads=", stats.io_read_cnt, ",written_bytes=", stats.io_write_bytes,
+                ",writes=", stats.io_write_cnt, ",parser_errors=", stats.parser_err_cnt);
+}
+
+// Prints the stats of the thread and the commands per second since the previous call.
+void PrintThreadStats(unsigned index, uint32_t interval) {
+  static thread_local size_t prev_commands = 0;
+  size_t commands = tl_stats.command_cnt;
+  cout << StrCat("thread ", index, ": ", (commands - prev_commands) / interval, " commands/s, ",
+                 FormatStats(tl_stats), "\n")
+       << flush;
+  prev_commands = commands;
+}
+
+bool ParseReplyMode(ReplyMode* mode) {
+  const string& reply = GetFlag(FLAGS_reply);
+  if (reply == "echo") {
+    *mode = ReplyMode::ECHO;
+  } else if (reply == "ok") {
+    *mode = ReplyMode::OK;
+  } else if (reply == "bulk") {
+    *mode = ReplyMode::BULK;
+  } else {
+    LOG(ERROR) << "Unknown reply " << reply;
+    return false;
+  }
+  return true;
+}
+
+void RunEngine(ProactorPool* pool, AcceptServer* acceptor, ReplyMode mode) {
+  OkService service(mode, GetFlag(FLAGS_reply_size));
+
+  vector<Listener*> listeners = Listener::CreateReusePort(Protocol::REDIS, &service, pool);
+  if (listeners.empty())
+    listeners.push_back(new Listener{Protocol::REDIS, &service});
+  for (Listener* listener : listeners) {
+    error_code ec = acceptor->AddListener(GetFlag(FLAGS_port), listener);
+    LOG_IF(FATAL, ec) << "Could not open port " << GetFlag(FLAGS_port) << ": " << ec.message();
+  }
 
-  acceptor->AddListener(GetFlag(FLAGS_port), new Listener{Protocol::REDIS, &service});
+  if (uint32_t mc_port = GetFlag(FLAGS_memcache_port); mc_port > 0) {
+    vector<Listener*> mc_listeners =
+        Listener::CreateReusePort(Protocol::MEMCACHE, &service, pool);
+    if (mc_listeners.empty())
+      mc_listeners.push_back(new Listener{Protocol::MEMCACHE, &service});
+    for (Listener* listener : mc_listeners) {
+      error_code ec = acceptor->AddListener(mc_port, listener);
+      LOG_IF(FATAL, ec) << "Could not open port " << mc_port << ": " << ec.message();
+    }
+  }
+
+  uint32_t interval = GetFlag(FLAGS_stats_interval);
+  vector<uint32_t> stats_tasks(pool->size());
+  if (interval > 0) {
+    pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+      auto cb = [index, interval] { PrintThreadStats(index, interval); };
+      stats_tasks[index] = pb->AddPeriodic(interval * 1000, std::move(cb));
+    });
+  }
 
   acceptor->Run();
   acceptor->Wait();
+
+  vector<ConnectionStats> thread_stats(pool->size());
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    if (interval > 0)
+      pb->CancelPeriodic(stats_tasks[index]);
+    thread_stats[index] = tl_stats;
+  });
+
+  ConnectionStats total;
+  for (unsigned i = 0; i < thread_stats.size(); ++i) {
+    cout << "thread " << i << ": " << FormatStats(thread_stats[i]) << "\n";
+    total += thread_stats[i];
+  }
+  cout << "total: " << FormatStats(total) << endl;
 }
 
 }  // namespace
@@ -55,15 +228,24 @@ void RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
 }  // namespace facade
 
 int main(int argc, char* argv[]) {
+  absl::SetProgramUsageMessage(
+      R"(a server that answers the commands without executing them, see ok_main.cc.
+
+Usage: ok_backend [FLAGS]
+)");
   MainInitGuard guard(&argc, &argv);
 
   CHECK_GT(GetFlag(FLAGS_port), 0u);
 
+  facade::ReplyMode mode;
+  if (!facade::ParseReplyMode(&mode))
+    return 1;
+
   uring::UringPool pp{1024};
   pp.Run();
 
   AcceptServer acceptor(&pp);
-  facade::RunEngine(&pp, &acceptor);
+  facade::RunEngine(&pp, &acceptor, mode);
 
   pp.Stop();
 
@@ -16,6 +16,9 @@ namespace {
 constexpr int kMaxArrayLen = 65536;
 constexpr int64_t kMaxBulkLen = 64 * (1ul << 20);  // 64MB.
 
+// Smaller remainders are not worth a separate read.
+constexpr uint32_t kMinDirectBulkLen = 4096;
+
 }  // namespace
 
 auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> Result {
@@ -406,6 +409,23 @@ auto RedisParser::ConsumeBulk(Buffer str) -> Result {
   return INPUT_PENDING;
 }
 
+auto RedisParser::BulkBuffer() const -> Buffer {
+  // The stashed blob is allocated for the whole string once it is broken, see ConsumeBulk.
+  if (state_ != BULK_STR_S || !is_broken_token_ || bulk_len_ < kMinDirectBulkLen)
+    return Buffer{};
+
+  const Buffer& bulk_str = get<Buffer>(cached_expr_->back().u);
+  return Buffer{bulk_str.end(), bulk_len_};
+}
+
+void RedisParser::CommitBulk(size_t len) {
+  DCHECK_LE(len, BulkBuffer().size());
+
+  auto& bulk_str = get<Buffer>(cached_expr_->back().u);
+  bulk_str = Buffer{bulk_str.data(), bulk_str.size() + len};
+  bulk_len_ -= len;
+}
+
 void RedisParser::HandleFinishArg() {
   state_ = PARSE_ARG_S;
   DCHECK(!parse_stack_.empty());
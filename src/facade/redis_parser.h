@@ -47,6 +47,17 @@ class RedisParser {
     return bulk_len_;
   }
 
+  /**
+   * @brief Returns the buffer for the rest of the big bulk string that is being parsed, or an
+   * empty buffer if there is none. The caller may fill it directly, e.g. by reading the socket
+   * into it, and call CommitBulk instead of passing those bytes to Parse. This avoids copying
+   * big values from the io buffer into the stash. The trailing CRLF must be passed to Parse.
+   */
+  Buffer BulkBuffer() const;
+
+  // Marks len bytes of BulkBuffer() as filled.
+  void CommitBulk(size_t len);
+
   size_t stash_size() const {
     return stash_.size();
   }
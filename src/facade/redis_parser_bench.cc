@@ -0,0 +1,91 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/strings/str_cat.h>
+#include <absl/time/clock.h>
+
+#include <cstring>
+#include <string>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "facade/redis_parser.h"
+
+ABSL_FLAG(uint32_t, n, 100000, "number of commands to parse");
+ABSL_FLAG(uint32_t, value_size, 32768, "size of the SET payload");
+ABSL_FLAG(uint32_t, read_size, 16384,
+          "bytes that are passed to the parser at once, emulates the size of the socket reads");
+ABSL_FLAG(bool, direct_bulk, true,
+          "If true, big bulk strings are filled via BulkBuffer like the connection does");
+
+namespace facade {
+
+using namespace std;
+using absl::GetFlag;
+
+// Feeds the commands to the parser in chunks of read_size bytes, the same way
+// Connection::IoLoop does with its io buffer. Returns the number of parsed commands.
+uint64_t RunParser(const string& cmd, uint64_t num) {
+  RedisParser parser;
+  RespVec args;
+  uint32_t consumed = 0;
+  uint64_t parsed = 0;
+  size_t read_size = GetFlag(FLAGS_read_size);
+  bool direct_bulk = GetFlag(FLAGS_direct_bulk);
+  string io_buf;
+
+  for (uint64_t i = 0; i < num; ++i) {
+    size_t pos = 0;
+    while (pos < cmd.size()) {
+      RedisParser::Buffer bulk_buf = direct_bulk ? parser.BulkBuffer() : RedisParser::Buffer{};
+      if (io_buf.empty() && !bulk_buf.empty()) {
+        size_t len = min({read_size, bulk_buf.size(), cmd.size() - pos});
+        memcpy(bulk_buf.data(), cmd.data() + pos, len);
+        parser.CommitBulk(len);
+        pos += len;
+        continue;
+      }
+
+      size_t len = min(read_size, cmd.size() - pos);
+      io_buf.append(cmd, pos, len);
+      pos += len;
+
+      while (!io_buf.empty()) {
+        RedisParser::Buffer buf{reinterpret_cast<uint8_t*>(io_buf.data()), io_buf.size()};
+        RedisParser::Result res = parser.Parse(buf, &consumed, &args);
+        io_buf.erase(0, consumed);
+        if (res == RedisParser::OK) {
+          ++parsed;
+        } else {
+          CHECK_EQ(RedisParser::INPUT_PENDING, res);
+          break;
+        }
+      }
+    }
+  }
+
+  return parsed;
+}
+
+}  // namespace facade
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  std::string value(absl::GetFlag(FLAGS_value_size), 'x');
+  std::string cmd = absl::StrCat("*3\r\n$3\r\nSET\r\n$8\r\nkey:0001\r\n$", value.size(), "\r\n",
+                                 value, "\r\n");
+
+  uint64_t num = absl::GetFlag(FLAGS_n);
+  uint64_t start = absl::GetCurrentTimeNanos();
+  uint64_t parsed = facade::RunParser(cmd, num);
+  uint64_t delta = absl::GetCurrentTimeNanos() - start;
+
+  CHECK_EQ(num, parsed);
+  CONSOLE_INFO << "Parsed " << parsed << " commands of " << cmd.size() << " bytes in "
+               << delta / 1000000 << "ms, " << double(delta) / parsed << "ns per command, "
+               << double(cmd.size()) * parsed * 1000 / delta << " MB/s";
+
+  return 0;
+}
@@ -191,4 +191,114 @@ TEST_F(RedisParserTest, LargeBulk) {
   ASSERT_EQ(RedisParser::OK, Parse("\r\n"));
 }
 
+TEST_F(RedisParserTest, DirectBulk) {
+  string val(32768, 'a');
+  val[100] = 'b';
+  string part1 = absl::StrCat("*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$32768\r\n", val.substr(0, 1000));
+
+  ASSERT_EQ(RedisParser::INPUT_PENDING, Parse(part1));
+  ASSERT_EQ(part1.size(), consumed_);
+
+  // The rest of the value is filled in place instead of being parsed.
+  RedisParser::Buffer buf = parser_.BulkBuffer();
+  ASSERT_EQ(val.size() - 1000, buf.size());
+  memcpy(buf.data(), val.data() + 1000, 20000);
+  parser_.CommitBulk(20000);
+
+  buf = parser_.BulkBuffer();
+  ASSERT_EQ(val.size() - 21000, buf.size());
+  memcpy(buf.data(), val.data() + 21000, buf.size());
+  parser_.CommitBulk(buf.size());
+  EXPECT_TRUE(parser_.BulkBuffer().empty());
+
+  ASSERT_EQ(RedisParser::OK, Parse("\r\n"));
+  ASSERT_THAT(args_, ElementsAre("SET", "k", val));
+  EXPECT_TRUE(parser_.BulkBuffer().empty());
+}
+
+// Parses buf with the commands one after another, returns the number of parsed commands.
+static uint64_t ParseAll(RedisParser* parser, string_view buf, RespVec* args) {
+  uint64_t parsed = 0;
+  uint32_t consumed = 0;
+  while (!buf.empty()) {
+    RedisParser::Buffer input{reinterpret_cast<const uint8_t*>(buf.data()), buf.size()};
+    RedisParser::Result res = parser->Parse(input, &consumed, args);
+    buf.remove_prefix(consumed);
+    if (res != RedisParser::OK) {
+      CHECK_EQ(RedisParser::INPUT_PENDING, res);
+      break;
+    }
+    ++parsed;
+  }
+  return parsed;
+}
+
+// range(0) is 0 for the RESP array form of the command and 1 for the inline one.
+static void BM_ParseSmall(benchmark::State& state) {
+  string cmd = state.range(0) ? "GET key:0001\r\n" : "*2\r\n$3\r\nGET\r\n$8\r\nkey:0001\r\n";
+  RedisParser parser;
+  RespVec args;
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(ParseAll(&parser, cmd, &args));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * cmd.size());
+}
+BENCHMARK(BM_ParseSmall)->Arg(0)->Arg(1);
+
+// A pipeline of range(0) commands that arrives in a single read.
+static void BM_ParsePipeline(benchmark::State& state) {
+  string buf;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    absl::StrAppend(&buf, "*3\r\n$3\r\nSET\r\n$8\r\nkey:", absl::Dec(i % 10000, absl::kZeroPad4),
+                    "\r\n$5\r\nvalue\r\n");
+  }
+  RedisParser parser;
+  RespVec args;
+
+  while (state.KeepRunning()) {
+    CHECK_EQ(uint64_t(state.range(0)), ParseAll(&parser, buf, &args));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_ParsePipeline)->Arg(16)->Arg(128)->Arg(1024);
+
+// A SET with a value of range(0) bytes, which arrives in reads of 16KB. The bulk string spans
+// over the read boundaries.
+static void BM_ParseBulkSplit(benchmark::State& state) {
+  constexpr size_t kReadSize = 16384;
+  string value(state.range(0), 'x');
+  string cmd = absl::StrCat("*3\r\n$3\r\nSET\r\n$8\r\nkey:0001\r\n$", value.size(), "\r\n",
+                            value, "\r\n");
+  RedisParser parser;
+  RespVec args;
+  string io_buf;
+
+  while (state.KeepRunning()) {
+    uint64_t parsed = 0;
+    for (size_t pos = 0; pos < cmd.size(); pos += kReadSize) {
+      io_buf.append(cmd, pos, kReadSize);
+
+      // What the parser did not consume stays in the buffer until the next read.
+      while (!io_buf.empty()) {
+        RedisParser::Buffer input{reinterpret_cast<uint8_t*>(io_buf.data()), io_buf.size()};
+        uint32_t consumed = 0;
+        RedisParser::Result res = parser.Parse(input, &consumed, &args);
+        io_buf.erase(0, consumed);
+        if (res != RedisParser::OK) {
+          CHECK_EQ(RedisParser::INPUT_PENDING, res);
+          break;
+        }
+        ++parsed;
+      }
+    }
+    CHECK_EQ(1u, parsed);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * cmd.size());
+}
+BENCHMARK(BM_ParseBulkSplit)->Arg(1024)->Arg(65536)->Arg(1 << 20);
+
 }  // namespace facade
@@ -8,8 +8,13 @@
 #include <absl/strings/str_cat.h>
 #include <double-conversion/double-to-string.h>
 
+#include <charconv>
+#include <numeric>
+
 #include "base/logging.h"
 #include "facade/error.h"
+#include "facade/request_tracer.h"
+#include "util/proactor_base.h"
 
 using namespace std;
 using absl::StrAppend;
@@ -24,6 +29,10 @@ inline iovec constexpr IoVec(std::string_view s) {
   return r;
 }
 
+// Parts of at least that size are written by reference even in batch mode, since copying them
+// costs more than a syscall.
+constexpr size_t kMinRefPartLen = 4096;
+
 constexpr char kCRLF[] = "\r\n";
 constexpr char kErrPref[] = "-ERR ";
 constexpr char kSimplePref[] = "+";
@@ -33,6 +42,8 @@ constexpr unsigned kConvFlags =
 
 DoubleToStringConverter dfly_conv(kConvFlags, "inf", "nan", 'e', -6, 21, 6, 0);
 
+constexpr double kMaxExactInt = 9007199254740992.0;  // 2^53
+
 }  // namespace
 
 SinkReplyBuilder::SinkReplyBuilder(::io::Sink* sink) : sink_(sink) {
@@ -47,17 +58,34 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   DCHECK(sink_);
 
   if (should_batch_) {
-    // TODO: to introduce flushing when too much data is batched.
+    // Big parts are not copied: the batch is written together with them in a single vectored
+    // write, so that only the small headers and replies are copied.
+    bool has_big_part = false;
     for (unsigned i = 0; i < len; ++i) {
-      std::string_view src((char*)v[i].iov_base, v[i].iov_len);
-      DVLOG(2) << "Appending to stream " << sink_ << " " << src;
-      batch_.append(src.data(), src.size());
+      has_big_part |= v[i].iov_len >= kMinRefPartLen;
+    }
+
+    if (!has_big_part) {
+      if (batch_.empty() && batch_limits_.max_delay_ns) {
+        batch_start_ns_ = util::ProactorBase::GetMonotonicTimeNs();
+      }
+
+      for (unsigned i = 0; i < len; ++i) {
+        std::string_view src((char*)v[i].iov_base, v[i].iov_len);
+        DVLOG(2) << "Appending to stream " << sink_ << " " << src;
+        batch_.append(src.data(), src.size());
+      }
+      ++batch_replies_;
+
+      if (BatchLimitReached())
+        FlushBatch();
+      return;
     }
-    return;
   }
 
   error_code ec;
   ++io_write_cnt_;
+  uint64_t start_ns = util::ProactorBase::GetMonotonicTimeNs();
 
   for (unsigned i = 0; i < len; ++i) {
     io_write_bytes_ += v[i].iov_len;
@@ -76,6 +104,13 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
     copy(v, v + len, tmp + 1);
     ec = sink_->Write(tmp, len + 1);
     batch_.clear();
+    batch_replies_ = 0;
+  }
+  uint64_t end_ns = util::ProactorBase::GetMonotonicTimeNs();
+  send_ns_ += end_ns - start_ns;
+  if (trace_id_) {
+    RequestTracer::Record(trace_id_, "write", start_ns, end_ns);
+    trace_id_ = 0;
   }
 
   if (ec) {
@@ -83,6 +118,29 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   }
 }
 
+void SinkReplyBuilder::FlushBatch() {
+  if (batch_.empty())
+    return;
+
+  // Send writes the batch ahead of the passed parts.
+  bool should_batch = should_batch_;
+  should_batch_ = false;
+  Send(nullptr, 0);
+  should_batch_ = should_batch;
+}
+
+bool SinkReplyBuilder::BatchLimitReached() const {
+  const BatchLimits& bl = batch_limits_;
+  if (bl.max_bytes && batch_.size() >= bl.max_bytes)
+    return true;
+
+  if (bl.max_replies && batch_replies_ >= bl.max_replies)
+    return true;
+
+  return bl.max_delay_ns &&
+         util::ProactorBase::GetMonotonicTimeNs() - batch_start_ns_ >= bl.max_delay_ns;
+}
+
 void SinkReplyBuilder::SendRaw(std::string_view raw) {
   iovec v = {IoVec(raw)};
 
@@ -103,12 +161,20 @@ MCReplyBuilder::MCReplyBuilder(::io::Sink* sink) : SinkReplyBuilder(sink) {
 }
 
 void MCReplyBuilder::SendSimpleString(std::string_view str) {
+  if (noreply_)
+    return;
+
   iovec v[2] = {IoVec(str), IoVec(kCRLF)};
 
   Send(v, ABSL_ARRAYSIZE(v));
 }
 
 void MCReplyBuilder::SendStored() {
+  if (meta_cmd_) {
+    if (!IsQuiet())
+      SendMeta("HD");
+    return;
+  }
   SendSimpleString("STORED");
 }
 
@@ -119,8 +185,34 @@ void MCReplyBuilder::SendLong(long val) {
 }
 
 void MCReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
+  if (noreply_)
+    return;
+
+  if (meta_cmd_) {
+    DCHECK_EQ(1u, count);
+
+    if (!resp[0]) {
+      if (!IsQuiet())
+        SendMeta("EN");
+    } else if (meta_cmd_->meta_flags & MemcacheParser::META_VALUE) {
+      SendMeta(absl::StrCat("VA ", resp[0]->value.size()), &*resp[0]);
+    } else {
+      SendMeta("HD", &*resp[0]);
+    }
+    return;
+  }
+
   string header;
+  auto group = mget_groups_.begin();
+  uint32_t group_end = mget_groups_.empty() ? count : *group;
+  DCHECK(mget_groups_.empty() || count == accumulate(group, mget_groups_.end(), 0u));
+
   for (unsigned i = 0; i < count; ++i) {
+    if (i == group_end) {
+      SendSimpleString("END");
+      group_end += *++group;
+    }
+
     if (resp[i]) {
       const auto& src = *resp[i];
       absl::StrAppend(&header, "VALUE ", src.key, " ", src.mc_flag, " ", src.value.size());
@@ -142,19 +234,87 @@ void MCReplyBuilder::SendError(string_view str, std::string_view type) {
 }
 
 void MCReplyBuilder::SendClientError(string_view str) {
+  if (noreply_)
+    return;
+
   iovec v[] = {IoVec("CLIENT_ERROR "), IoVec(str), IoVec(kCRLF)};
   Send(v, ABSL_ARRAYSIZE(v));
 }
 
 void MCReplyBuilder::SendSetSkipped() {
+  if (meta_cmd_)
+    return SendMeta("NS");
   SendSimpleString("NOT_STORED");
 }
 
 void MCReplyBuilder::SendNotFound() {
+  if (meta_cmd_)
+    return SendMeta("NF");
   SendSimpleString("NOT_FOUND");
 }
 
+void MCReplyBuilder::SendExists() {
+  if (meta_cmd_)
+    return SendMeta("EX");
+  SendSimpleString("EXISTS");
+}
+
+void MCReplyBuilder::SendDeleted() {
+  if (meta_cmd_) {
+    if (!IsQuiet())
+      SendMeta("HD");
+    return;
+  }
+  SendSimpleString("DELETED");
+}
+
+void MCReplyBuilder::SendMeta(string_view status, const ResponseValue* val) {
+  if (noreply_)
+    return;
+
+  using MP = MemcacheParser;
+  uint16_t flags = meta_cmd_->meta_flags;
+  string line(status);
+
+  if (val) {
+    if (flags & MP::META_FLAGS)
+      absl::StrAppend(&line, " f", val->mc_flag);
+    if (flags & MP::META_CAS)
+      absl::StrAppend(&line, " c", val->mc_ver);
+    if (flags & MP::META_TTL)
+      absl::StrAppend(&line, " t", val->mc_ttl);
+    if (flags & MP::META_SIZE)
+      absl::StrAppend(&line, " s", val->value.size());
+  }
+
+  if (flags & MP::META_KEY)
+    absl::StrAppend(&line, " k", meta_cmd_->key);
+  if (!meta_cmd_->opaque.empty())
+    absl::StrAppend(&line, " O", meta_cmd_->opaque);
+  line.append(kCRLF);
+
+  if (val && (flags & MP::META_VALUE)) {
+    iovec v[] = {IoVec(line), IoVec(val->value), IoVec(kCRLF)};
+    Send(v, ABSL_ARRAYSIZE(v));
+  } else {
+    iovec v = IoVec(line);
+    Send(&v, 1);
+  }
+}
+
 char* RedisReplyBuilder::FormatDouble(double val, char* dest, unsigned dest_len) {
+  // The integral values below 2^53 are exact and their shortest representation is the integer
+  // itself, which is how ToShortest prints them below 1e21. -0 is printed as 0 with UNIQUE_ZERO.
+  if (val > -kMaxExactInt && val < kMaxExactInt) {
+    int64_t ival = static_cast<int64_t>(val);
+    if (ival == val) {
+      auto [end, ec] = std::to_chars(dest, dest + dest_len - 1, ival);
+      CHECK(ec == std::errc{});
+      *end = '\0';
+      return dest;
+    }
+  }
+
   StringBuilder sb(dest, dest_len);
   CHECK(dfly_conv.ToShortest(val, &sb));
   return sb.Finalize();
@@ -261,11 +421,7 @@ void RedisReplyBuilder::SendLong(long num) {
 
 void RedisReplyBuilder::SendDouble(double val) {
   char buf[64];
-
-  StringBuilder sb(buf, sizeof(buf));
-  CHECK(dfly_conv.ToShortest(val, &sb));
-
-  SendBulkString(sb.Finalize());
+  SendBulkString(FormatDouble(val, buf, sizeof(buf)));
 }
 
 void RedisReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
@@ -319,7 +475,13 @@ void RedisReplyBuilder::SendStringArr(absl::Span<const string> arr) {
 }
 
 void RedisReplyBuilder::StartArray(unsigned len) {
-  SendRaw(absl::StrCat("*", len, kCRLF));
+  char tmp[absl::numbers_internal::kFastToBufferSize + 3];
+  tmp[0] = '*';
+  char* next = absl::numbers_internal::FastIntToBuffer(len, tmp + 1);
+  *next++ = '\r';
+  *next++ = '\n';
+
+  SendRaw(string_view{tmp, size_t(next - tmp)});
 }
 
 void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len) {
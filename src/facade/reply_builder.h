@@ -2,10 +2,12 @@
 // See LICENSE for licensing terms.
 //
 #include <absl/container/flat_hash_map.h>
+#include <absl/types/span.h>
 
 #include <optional>
 #include <string_view>
 
+#include "facade/memcache_parser.h"
 #include "facade/op_status.h"
 #include "io/io.h"
 
@@ -28,6 +30,21 @@ class SinkReplyBuilder {
     should_batch_ = batch;
   }
 
+  // Limits of the batching, 0 means unlimited. Once the batched replies exceed any of them they
+  // are written out even though more replies follow.
+  struct BatchLimits {
+    size_t max_bytes = 0;
+    uint32_t max_replies = 0;    // the number of Send calls, i.e. replies or their parts.
+    uint64_t max_delay_ns = 0;   // since the first batched reply.
+  };
+
+  void SetBatchLimits(const BatchLimits& limits) {
+    batch_limits_ = limits;
+  }
+
+  // Writes the batched replies, if any.
+  void FlushBatch();
+
   // Used for QUIT - > should move to conn_context?
   void CloseConnection();
 
@@ -43,6 +60,17 @@ class SinkReplyBuilder {
     return io_write_bytes_;
   }
 
+  // Total time in nanoseconds spent on writing into the sink.
+  uint64_t send_ns() const {
+    return send_ns_;
+  }
+
+  // The replies of the sampled request are being built, the write that carries them out, which
+  // may come later in the batch mode, is recorded as its "write" stage. See RequestTracer.
+  void set_trace_id(uint64_t trace_id) {
+    trace_id_ = trace_id;
+  }
+
   void reset_io_stats() {
     io_write_cnt_ = 0;
     io_write_bytes_ = 0;
@@ -70,6 +98,7 @@ class SinkReplyBuilder {
     std::string_view key;
     std::string value;
     uint64_t mc_ver = 0;  // 0 means we do not output it (i.e has not been requested).
+    int64_t mc_ttl = -1;  // in seconds, -1 if the key does not expire or ttl was not requested.
     uint32_t mc_flag = 0;
   };
 
@@ -85,12 +114,20 @@ class SinkReplyBuilder {
  protected:
   void Send(const iovec* v, uint32_t len);
 
+  bool BatchLimitReached() const;
+
   std::string batch_;
   ::io::Sink* sink_;
   std::error_code ec_;
 
+  BatchLimits batch_limits_;
+  uint32_t batch_replies_ = 0;
+  uint64_t batch_start_ns_ = 0;
+
   size_t io_write_cnt_ = 0;
   size_t io_write_bytes_ = 0;
+  uint64_t send_ns_ = 0;
+  uint64_t trace_id_ = 0;
   absl::flat_hash_map<std::string, uint64_t> err_count_;
 
   bool should_batch_ = false;
@@ -111,7 +148,39 @@ class MCReplyBuilder : public SinkReplyBuilder {
 
   void SendClientError(std::string_view str);
   void SendNotFound();
+  void SendExists();
+  void SendDeleted();
   void SendSimpleString(std::string_view str) final;
+
+  // Replies of the following command are sent in the meta protocol format according to the
+  // flags of cmd, which must outlive the command. nullptr switches back to the classic format.
+  void SetMetaCommand(const MemcacheParser::Command* cmd) {
+    meta_cmd_ = cmd;
+  }
+
+  // Splits the reply of the following multi-key get into several get replies, each one with
+  // the given number of keys and its own END. Used for coalesced pipelined gets.
+  void SetMGetGroups(absl::Span<const uint32_t> groups) {
+    mget_groups_ = groups;
+  }
+
+  // Suppresses all the replies while set, used for commands with noreply.
+  void SetNoReply(bool noreply) {
+    noreply_ = noreply;
+  }
+
+ private:
+  // Sends the meta status line with the return flags that were requested by the command.
+  // The value is sent as well if val is set and the v flag was requested.
+  void SendMeta(std::string_view status, const ResponseValue* val = nullptr);
+
+  bool IsQuiet() const {
+    return meta_cmd_->meta_flags & MemcacheParser::META_QUIET;
+  }
+
+  const MemcacheParser::Command* meta_cmd_ = nullptr;
+  absl::Span<const uint32_t> mget_groups_;
+  bool noreply_ = false;
 };
 
 class RedisReplyBuilder : public SinkReplyBuilder {
@@ -140,6 +209,8 @@ class RedisReplyBuilder : public SinkReplyBuilder {
 
   virtual void StartArray(unsigned len);
 
+  // Formats the shortest representation that parses back to val, e.g. "3.14" or "1e+30".
+  // Returns dest.
   static char* FormatDouble(double val, char* dest, unsigned dest_len);
 
  private:
@@ -0,0 +1,86 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/time/clock.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "facade/reply_builder.h"
+#include "io/io.h"
+
+ABSL_FLAG(uint32_t, n, 1000, "number of the scores in a reply, like a ZRANGE WITHSCORES");
+ABSL_FLAG(uint32_t, replies, 10000, "number of the replies");
+ABSL_FLAG(double, integral_ratio, 0.5, "share of the integral scores, e.g. counters");
+
+namespace facade {
+
+using namespace std;
+using absl::GetFlag;
+
+vector<double> MakeScores(uint32_t num, double integral_ratio) {
+  mt19937_64 gen(42);
+  uniform_real_distribution<double> dist(0, 1e6);
+  bernoulli_distribution integral(integral_ratio);
+
+  vector<double> res(num);
+  for (double& score : res) {
+    score = integral(gen) ? double(uint64_t(dist(gen))) : dist(gen);
+  }
+  return res;
+}
+
+// Sends the scores as a reply into a string sink, which is cleared after every reply.
+// Returns the number of the bytes of a reply.
+size_t RunReplies(const vector<double>& scores, uint32_t num_replies) {
+  ::io::StringSink sink;
+  RedisReplyBuilder builder(&sink);
+  size_t reply_size = 0;
+
+  for (uint32_t i = 0; i < num_replies; ++i) {
+    builder.StartArray(scores.size());
+    for (double score : scores) {
+      builder.SendDouble(score);
+    }
+    reply_size = sink.str().size();
+    sink.Clear();
+  }
+
+  return reply_size;
+}
+
+}  // namespace facade
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  std::vector<double> scores =
+      facade::MakeScores(absl::GetFlag(FLAGS_n), absl::GetFlag(FLAGS_integral_ratio));
+
+  char buf[64];
+  uint32_t num_replies = absl::GetFlag(FLAGS_replies);
+  uint64_t start = absl::GetCurrentTimeNanos();
+  size_t total_len = 0;
+  for (uint32_t i = 0; i < num_replies; ++i) {
+    for (double score : scores) {
+      total_len += strlen(facade::RedisReplyBuilder::FormatDouble(score, buf, sizeof(buf)));
+    }
+  }
+  uint64_t delta = absl::GetCurrentTimeNanos() - start;
+  uint64_t num_formatted = uint64_t(num_replies) * scores.size();
+  CONSOLE_INFO << "Formatted " << num_formatted << " scores of " << total_len / num_formatted
+               << " chars on average in " << delta / 1000000 << "ms, "
+               << double(delta) / num_formatted << "ns per score";
+
+  start = absl::GetCurrentTimeNanos();
+  size_t reply_size = facade::RunReplies(scores, num_replies);
+  delta = absl::GetCurrentTimeNanos() - start;
+  CONSOLE_INFO << "Sent " << num_replies << " replies of " << reply_size << " bytes in "
+               << delta / 1000000 << "ms, " << double(delta) / num_replies << "ns per reply";
+
+  return 0;
+}
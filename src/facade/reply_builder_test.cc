@@ -0,0 +1,137 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/reply_builder.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+using absl::StrCat;
+
+namespace facade {
+
+class RedisReplyBuilderTest : public testing::Test {
+ protected:
+  RedisReplyBuilderTest() : builder_(&sink_) {
+  }
+
+  ::io::StringSink sink_;
+  RedisReplyBuilder builder_;
+};
+
+TEST_F(RedisReplyBuilderTest, Batch) {
+  builder_.SetBatchMode(true);
+  builder_.SendBulkString("foo");
+  builder_.SendLong(5);
+  EXPECT_EQ(0u, builder_.io_write_cnt());
+  EXPECT_EQ("", sink_.str());
+
+  // Big values are written along with the batched replies without being copied.
+  string big(100000, 'x');
+  builder_.SendBulkString(big);
+  EXPECT_EQ(1u, builder_.io_write_cnt());
+  EXPECT_EQ(StrCat("$3\r\nfoo\r\n:5\r\n$100000\r\n", big, "\r\n"), sink_.str());
+
+  builder_.SendNull();
+  EXPECT_EQ(1u, builder_.io_write_cnt());
+
+  builder_.SetBatchMode(false);
+  builder_.SendOk();
+  EXPECT_EQ(2u, builder_.io_write_cnt());
+  EXPECT_EQ(StrCat("$3\r\nfoo\r\n:5\r\n$100000\r\n", big, "\r\n$-1\r\n+OK\r\n"), sink_.str());
+}
+
+TEST_F(RedisReplyBuilderTest, BatchLimits) {
+  SinkReplyBuilder::BatchLimits limits;
+  limits.max_replies = 3;
+  limits.max_bytes = 100;
+  builder_.SetBatchLimits(limits);
+  builder_.SetBatchMode(true);
+
+  builder_.SendLong(1);
+  builder_.SendLong(2);
+  EXPECT_EQ(0u, builder_.io_write_cnt());
+  builder_.SendLong(3);
+  EXPECT_EQ(1u, builder_.io_write_cnt());
+  EXPECT_EQ(":1\r\n:2\r\n:3\r\n", sink_.str());
+
+  // 100 bytes are batched before the count limit is reached.
+  builder_.SendBulkString(string(96, 'a'));
+  EXPECT_EQ(2u, builder_.io_write_cnt());
+
+  builder_.SendOk();
+  EXPECT_EQ(2u, builder_.io_write_cnt());
+  builder_.FlushBatch();
+  EXPECT_EQ(3u, builder_.io_write_cnt());
+  EXPECT_EQ(StrCat(":1\r\n:2\r\n:3\r\n$96\r\n", string(96, 'a'), "\r\n+OK\r\n"), sink_.str());
+
+  builder_.FlushBatch();
+  EXPECT_EQ(3u, builder_.io_write_cnt());
+}
+
+class MCReplyBuilderTest : public testing::Test {
+ protected:
+  MCReplyBuilderTest() : builder_(&sink_) {
+  }
+
+  ::io::StringSink sink_;
+  MCReplyBuilder builder_;
+};
+
+TEST_F(RedisReplyBuilderTest, FormatDouble) {
+  char buf[64];
+  auto format = [&](double val) {
+    return string{RedisReplyBuilder::FormatDouble(val, buf, sizeof(buf))};
+  };
+
+  EXPECT_EQ("0", format(0));
+  EXPECT_EQ("0", format(-0.0));
+  EXPECT_EQ("42", format(42));
+  EXPECT_EQ("-17", format(-17));
+  EXPECT_EQ("1000000000000000", format(1e15));
+  EXPECT_EQ("9007199254740991", format(9007199254740991.0));
+  EXPECT_EQ("9007199254740992", format(9007199254740992.0));
+  EXPECT_EQ("100000000000000000000", format(1e20));
+  EXPECT_EQ("1e+21", format(1e21));
+  EXPECT_EQ("3.14", format(3.14));
+  EXPECT_EQ("-0.1", format(-0.1));
+  EXPECT_EQ("1e-7", format(1e-7));
+  EXPECT_EQ("inf", format(numeric_limits<double>::infinity()));
+  EXPECT_EQ("-inf", format(-numeric_limits<double>::infinity()));
+  EXPECT_EQ("nan", format(numeric_limits<double>::quiet_NaN()));
+
+  builder_.SendDouble(12);
+  builder_.SendDouble(1.5);
+  EXPECT_EQ("$2\r\n12\r\n$3\r\n1.5\r\n", sink_.str());
+}
+
+TEST_F(MCReplyBuilderTest, MGetGroups) {
+  SinkReplyBuilder::OptResp resp[3];
+  resp[0].emplace().key = "a";
+  resp[0]->value = "1";
+  resp[2].emplace().key = "c";
+  resp[2]->value = "3";
+
+  uint32_t groups[] = {1, 2};
+  builder_.SetMGetGroups(groups);
+  builder_.SendMGetResponse(resp, 3);
+  EXPECT_EQ("VALUE a 0 1\r\n1\r\nEND\r\nVALUE c 0 1\r\n3\r\nEND\r\n", sink_.str());
+}
+
+TEST_F(MCReplyBuilderTest, NoReply) {
+  builder_.SetNoReply(true);
+  builder_.SendStored();
+  builder_.SendNotFound();
+  EXPECT_EQ("", sink_.str());
+
+  builder_.SetNoReply(false);
+  builder_.SendStored();
+  EXPECT_EQ("STORED\r\n", sink_.str());
+}
+
+}  // namespace facade
@@ -0,0 +1,190 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/request_tracer.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "util/proactor_base.h"
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+// Bounds the memory of a forgotten trace, about 4MB per thread.
+constexpr size_t kMaxEventsPerThread = 1 << 16;
+
+struct TraceEvent {
+  uint64_t trace_id;
+  const char* name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  string detail;
+};
+
+struct ThreadBuffer {
+  mutex mu;  // taken by the owning thread per event and by Export.
+  vector<TraceEvent> events;
+  size_t dropped = 0;
+  uint64_t sampled = 0;  // the commands seen while sampling, accessed only by the owner.
+
+  unsigned tid;
+  string name;
+};
+
+// The buffers outlive their threads, so that the events of a stopped pool can still be exported.
+mutex registry_mu;
+vector<unique_ptr<ThreadBuffer>> registry;  // guarded by registry_mu
+
+atomic_uint64_t next_trace_id{1};
+
+thread_local ThreadBuffer* tl_buffer = nullptr;
+
+ThreadBuffer* LocalBuffer() {
+  if (tl_buffer)
+    return tl_buffer;
+
+  auto buf = make_unique<ThreadBuffer>();
+  int index = util::ProactorBase::GetIndex();
+  buf->name = index >= 0 ? absl::StrCat("proactor", index) : "thread";
+
+  lock_guard lk(registry_mu);
+  buf->tid = registry.size();
+  tl_buffer = buf.get();
+  registry.push_back(move(buf));
+
+  return tl_buffer;
+}
+
+void AppendEscaped(string_view src, string* dest) {
+  for (char c : src) {
+    if (c == '"' || c == '\\') {
+      dest->push_back('\\');
+      dest->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      absl::StrAppend(dest, "\\u00", absl::Hex(static_cast<unsigned char>(c), absl::kZeroPad2));
+    } else {
+      dest->push_back(c);
+    }
+  }
+}
+
+// Chrome traces are in microseconds, fractions keep the resolution.
+string Usec(uint64_t ns) {
+  return absl::StrCat(ns / 1000, ".", absl::Dec(ns % 1000, absl::kZeroPad3));
+}
+
+}  // namespace
+
+atomic_uint32_t RequestTracer::rate_{0};
+
+void RequestTracer::Start(uint32_t rate) {
+  Stop();
+
+  {
+    lock_guard lk(registry_mu);
+    for (auto& buf : registry) {
+      lock_guard buf_lk(buf->mu);
+      buf->events.clear();
+      buf->dropped = 0;
+    }
+  }
+
+  rate_.store(max(rate, 1u), memory_order_relaxed);
+}
+
+void RequestTracer::Stop() {
+  rate_.store(0, memory_order_relaxed);
+}
+
+uint64_t RequestTracer::SampleSlow() {
+  ThreadBuffer* buf = LocalBuffer();
+  uint32_t rate = rate_.load(memory_order_relaxed);
+  if (rate == 0 || ++buf->sampled % rate != 0)
+    return 0;
+
+  return next_trace_id.fetch_add(1, memory_order_relaxed);
+}
+
+void RequestTracer::Record(uint64_t trace_id, const char* name, uint64_t start_ns,
+                           uint64_t end_ns, string_view detail) {
+  if (trace_id == 0)
+    return;
+
+  ThreadBuffer* buf = LocalBuffer();
+  lock_guard lk(buf->mu);
+  if (buf->events.size() >= kMaxEventsPerThread) {
+    ++buf->dropped;
+    return;
+  }
+
+  buf->events.push_back(
+      TraceEvent{trace_id, name, start_ns, max(start_ns, end_ns), string{detail}});
+}
+
+string RequestTracer::Export() {
+  string res = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  auto append_sep = [&] {
+    if (!first)
+      res.push_back(',');
+    first = false;
+  };
+
+  lock_guard lk(registry_mu);
+  for (auto& buf : registry) {
+    lock_guard buf_lk(buf->mu);
+    if (buf->events.empty())
+      continue;
+
+    append_sep();
+    absl::StrAppend(&res, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":", buf->tid,
+                    ",\"args\":{\"name\":\"", buf->name, "\"}}");
+
+    for (const TraceEvent& ev : buf->events) {
+      append_sep();
+      absl::StrAppend(&res, "{\"name\":\"", ev.name, "\",\"ph\":\"X\",\"pid\":0,\"tid\":",
+                      buf->tid, ",\"ts\":", Usec(ev.start_ns),
+                      ",\"dur\":", Usec(ev.end_ns - ev.start_ns),
+                      ",\"args\":{\"trace\":", ev.trace_id);
+      if (!ev.detail.empty()) {
+        res.append(",\"detail\":\"");
+        AppendEscaped(ev.detail, &res);
+        res.push_back('"');
+      }
+      res.append("}}");
+    }
+  }
+  res.append("]}");
+
+  return res;
+}
+
+size_t RequestTracer::NumEvents() {
+  size_t res = 0;
+  lock_guard lk(registry_mu);
+  for (auto& buf : registry) {
+    lock_guard buf_lk(buf->mu);
+    res += buf->events.size();
+  }
+  return res;
+}
+
+size_t RequestTracer::NumDropped() {
+  size_t res = 0;
+  lock_guard lk(registry_mu);
+  for (auto& buf : registry) {
+    lock_guard buf_lk(buf->mu);
+    res += buf->dropped;
+  }
+  return res;
+}
+
+}  // namespace facade
@@ -0,0 +1,56 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace facade {
+
+// Traces the sampled commands through the threads they pass, see DEBUG TRACE.
+// Every stage of a traced command, e.g. its parsing or the hop of its transaction in a shard, is
+// recorded as a span of the monotonic clock into the buffer of the thread that ran it. The
+// buffers are exported in the Chrome trace event format that chrome://tracing and Perfetto open.
+//
+// The checks on the hot paths are a relaxed load while the tracing is stopped, the sampled
+// commands take a lock of their thread buffer per stage.
+class RequestTracer {
+ public:
+  // Discards the recorded events and samples one of every rate commands of each thread.
+  static void Start(uint32_t rate);
+
+  // Stops sampling, the recorded events are kept for Export.
+  static void Stop();
+
+  static bool IsActive() {
+    return rate_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Called for each command. Returns the trace id of the command if it is sampled, 0 otherwise.
+  static uint64_t Sample() {
+    return IsActive() ? SampleSlow() : 0;
+  }
+
+  // Records the stage name of the trace that spanned [start_ns, end_ns] in the calling thread.
+  // name must be a literal, detail is copied. A no-op for trace_id 0.
+  static void Record(uint64_t trace_id, const char* name, uint64_t start_ns, uint64_t end_ns,
+                     std::string_view detail = {});
+
+  // Returns the recorded events of all the threads as a Chrome trace JSON object.
+  static std::string Export();
+
+  // The number of the recorded events and of those dropped since the buffers were full.
+  static size_t NumEvents();
+  static size_t NumDropped();
+
+ private:
+  static uint64_t SampleSlow();
+
+  static std::atomic_uint32_t rate_;
+};
+
+}  // namespace facade
@@ -0,0 +1,57 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/request_tracer.h"
+
+#include <gmock/gmock.h>
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+TEST(RequestTracerTest, Sample) {
+  EXPECT_EQ(0u, RequestTracer::Sample());
+
+  RequestTracer::Start(4);
+  unsigned sampled = 0;
+  for (unsigned i = 0; i < 100; ++i) {
+    sampled += RequestTracer::Sample() != 0;
+  }
+  EXPECT_EQ(25u, sampled);
+
+  RequestTracer::Stop();
+  EXPECT_EQ(0u, RequestTracer::Sample());
+}
+
+TEST(RequestTracerTest, Export) {
+  RequestTracer::Start(1);
+  uint64_t id = RequestTracer::Sample();
+  ASSERT_NE(0u, id);
+
+  RequestTracer::Record(id, "parse", 1000, 2500, "GET");
+  RequestTracer::Record(0, "ignored", 1000, 2000);
+  thread([id] { RequestTracer::Record(id, "exec", 3000, 4000, "a\"b"); }).join();
+  RequestTracer::Stop();
+
+  EXPECT_EQ(2u, RequestTracer::NumEvents());
+  string json = RequestTracer::Export();
+  EXPECT_THAT(json, StartsWith("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+  EXPECT_THAT(json, HasSubstr("\"name\":\"parse\",\"ph\":\"X\""));
+  EXPECT_THAT(json, HasSubstr("\"ts\":1.000,\"dur\":1.500"));
+  EXPECT_THAT(json, HasSubstr("\"detail\":\"a\\\"b\""));
+  EXPECT_THAT(json, Not(HasSubstr("ignored")));
+
+  // Starting again discards the previous trace.
+  RequestTracer::Start(1);
+  EXPECT_EQ(0u, RequestTracer::NumEvents());
+  RequestTracer::Stop();
+}
+
+}  // namespace facade
@@ -24,6 +24,15 @@ class ServiceInterface {
   }
 
   virtual void DispatchCommand(CmdArgList args, ConnectionContext* cntx) = 0;
+
+  // Dispatches consecutive pipelined commands. Implementations may execute them together
+  // as long as the replies are sent in the order of the commands.
+  virtual void DispatchManyCommands(absl::Span<CmdArgList> args_list, ConnectionContext* cntx) {
+    for (CmdArgList args : args_list) {
+      DispatchCommand(args, cntx);
+    }
+  }
+
   virtual void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                           ConnectionContext* cntx) = 0;
 
@@ -0,0 +1,244 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/tls_offload.h"
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <sys/socket.h>
+
+#include <boost/fiber/fss.hpp>
+#include <cstring>
+#include <vector>
+
+#include "base/logging.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+namespace facade {
+using namespace std;
+
+namespace {
+
+constexpr size_t kSaltSize = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+constexpr size_t kIvSize = TLS_CIPHER_AES_GCM_128_IV_SIZE;
+constexpr size_t kMaxKeySize = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+
+static_assert(kSaltSize == TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+static_assert(kIvSize == TLS_CIPHER_AES_GCM_256_IV_SIZE);
+
+void NoCleanup(TlsTxOffload*) {
+}
+
+// The offload of the handshake that runs in the current fiber.
+boost::fibers::fiber_specific_ptr<TlsTxOffload> fb_offload(&NoCleanup);
+
+const uint8_t* U8(string_view s) {
+  return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+// HKDF-Expand-Label with an empty context, RFC 8446 section 7.1.
+bool HkdfExpandLabel(const EVP_MD* md, string_view secret, string_view label, size_t len,
+                     uint8_t* dest) {
+  string full_label = absl::StrCat("tls13 ", label);
+  string info;
+  info.push_back(char(len >> 8));
+  info.push_back(char(len & 0xFF));
+  info.push_back(char(full_label.size()));
+  info.append(full_label);
+  info.push_back(0);  // context length.
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool res = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, U8(secret), secret.size()) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, U8(info), info.size()) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+
+  return res;
+}
+
+// TLS 1.2 key block, RFC 5246 section 6.3.
+bool Tls12KeyBlock(const EVP_MD* md, string_view master, const SSL* ssl, size_t len,
+                   uint8_t* dest) {
+  uint8_t client_random[SSL3_RANDOM_SIZE];
+  uint8_t server_random[SSL3_RANDOM_SIZE];
+  SSL_get_client_random(ssl, client_random, sizeof(client_random));
+  SSL_get_server_random(ssl, server_random, sizeof(server_random));
+  string_view label = "key expansion";
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+  bool res = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, U8(master), master.size()) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, U8(label), label.size()) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof(server_random)) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof(client_random)) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+
+  return res;
+}
+
+}  // namespace
+
+void TlsTxOffload::Setup(SSL_CTX* ctx) {
+  SSL_CTX_set_keylog_callback(ctx, &KeylogCb);
+  SSL_CTX_set_num_tickets(ctx, 0);
+}
+
+bool TlsTxOffload::IsEnabled(const SSL_CTX* ctx) {
+  return SSL_CTX_get_keylog_callback(ctx) == &KeylogCb;
+}
+
+TlsTxOffload::TlsTxOffload() {
+  fb_offload.reset(this);
+}
+
+TlsTxOffload::~TlsTxOffload() {
+  fb_offload.reset(nullptr);
+  OPENSSL_cleanse(secret_.data(), secret_.size());
+}
+
+void TlsTxOffload::KeylogCb(const SSL* ssl, const char* line) {
+  TlsTxOffload* me = fb_offload.get();
+  if (!me)
+    return;
+
+  // <label> <client random> <secret> in hex.
+  vector<string_view> parts = absl::StrSplit(line, ' ');
+  if (parts.size() != 3)
+    return;
+
+  if (parts[0] == "CLIENT_RANDOM" || parts[0] == "SERVER_TRAFFIC_SECRET_0") {
+    me->ssl_ = const_cast<SSL*>(ssl);
+    me->secret_ = absl::HexStringToBytes(parts[2]);
+  }
+}
+
+bool TlsTxOffload::Install(int fd) {
+  if (!ssl_ || secret_.empty())
+    return false;
+
+  const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl_);
+  int version = SSL_version(ssl_);
+  if (!cipher || (version != TLS1_2_VERSION && version != TLS1_3_VERSION))
+    return false;
+
+  size_t key_len;
+  uint16_t cipher_type;
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm:
+      key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+      cipher_type = TLS_CIPHER_AES_GCM_128;
+      break;
+    case NID_aes_256_gcm:
+      key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+      cipher_type = TLS_CIPHER_AES_GCM_256;
+      break;
+    default:
+      VLOG(1) << "Cipher " << SSL_CIPHER_get_name(cipher) << " can not be offloaded";
+      return false;
+  }
+
+  const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+  bool is_tls13 = version == TLS1_3_VERSION;
+  uint8_t key[kMaxKeySize];
+  uint8_t salt[kSaltSize];
+  uint8_t iv[kIvSize];
+  uint8_t rec_seq[TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE] = {0};
+  bool derived;
+
+  if (is_tls13) {
+    // The nonce is salt|iv xor-ed with the record sequence, which starts with the application
+    // data since no session tickets are sent.
+    uint8_t full_iv[kSaltSize + kIvSize];
+    derived = HkdfExpandLabel(md, secret_, "key", key_len, key) &&
+              HkdfExpandLabel(md, secret_, "iv", sizeof(full_iv), full_iv);
+    memcpy(salt, full_iv, kSaltSize);
+    memcpy(iv, full_iv + kSaltSize, kIvSize);
+  } else {
+    // client key, server key, client salt, server salt. AEAD ciphers have no mac keys.
+    uint8_t key_block[2 * kMaxKeySize + 2 * kSaltSize];
+    derived = Tls12KeyBlock(md, secret_, ssl_, 2 * (key_len + kSaltSize), key_block);
+    memcpy(key, key_block + key_len, key_len);
+    memcpy(salt, key_block + 2 * key_len + kSaltSize, kSaltSize);
+    OPENSSL_cleanse(key_block, sizeof(key_block));
+
+    // Finished was the first record under the new keys. The explicit nonce is sent with
+    // each record, the kernel increments it starting from the sequence.
+    rec_seq[sizeof(rec_seq) - 1] = 1;
+    memcpy(iv, rec_seq, kIvSize);
+  }
+
+  if (!derived) {
+    LOG_FIRST_N(WARNING, 1) << "Could not derive TLS keys for the kernel offload";
+    return false;
+  }
+
+  // Fails if the tls kernel module is not loaded.
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Could not enable kernel TLS: " << strerror(errno);
+    OPENSSL_cleanse(key, sizeof(key));
+    return false;
+  }
+
+  union {
+    tls12_crypto_info_aes_gcm_128 gcm128;
+    tls12_crypto_info_aes_gcm_256 gcm256;
+  } crypto_info;
+  memset(&crypto_info, 0, sizeof(crypto_info));
+
+  // Both crypto infos have the same layout besides the key size.
+  size_t info_len;
+  tls_crypto_info* info = &crypto_info.gcm128.info;
+  info->version = is_tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+  info->cipher_type = cipher_type;
+
+  if (cipher_type == TLS_CIPHER_AES_GCM_128) {
+    auto& dest = crypto_info.gcm128;
+    memcpy(dest.key, key, sizeof(dest.key));
+    memcpy(dest.salt, salt, sizeof(dest.salt));
+    memcpy(dest.iv, iv, sizeof(dest.iv));
+    memcpy(dest.rec_seq, rec_seq, sizeof(dest.rec_seq));
+    info_len = sizeof(dest);
+  } else {
+    auto& dest = crypto_info.gcm256;
+    memcpy(dest.key, key, sizeof(dest.key));
+    memcpy(dest.salt, salt, sizeof(dest.salt));
+    memcpy(dest.iv, iv, sizeof(dest.iv));
+    memcpy(dest.rec_seq, rec_seq, sizeof(dest.rec_seq));
+    info_len = sizeof(dest);
+  }
+
+  int res = setsockopt(fd, SOL_TLS, TLS_TX, &crypto_info, info_len);
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+
+  // Without TLS_TX the socket still passes the data as is.
+  if (res != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Could not install kernel TLS keys: " << strerror(errno);
+    return false;
+  }
+
+  // OpenSSL must not write the close notify in user space anymore.
+  SSL_set_quiet_shutdown(ssl_, 1);
+
+  return true;
+}
+
+}  // namespace facade
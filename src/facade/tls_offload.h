@@ -0,0 +1,48 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+#include <string>
+
+namespace facade {
+
+// Kernel TLS (kTLS) offload of the transmit path. OpenSSL performs the handshake and keeps
+// decrypting the input, while the replies are written to the plain socket and encrypted by the
+// kernel, or by the NIC if it supports TLS offload.
+//
+// The session keys are captured by the keylog callback during the handshake. Only AES-GCM
+// sessions of TLS 1.2 and 1.3 are offloaded, other sessions stay in user space.
+class TlsTxOffload {
+ public:
+  // Enables the capture of the session keys on ctx. Also disables TLS 1.3 session tickets,
+  // since they are written after the handshake and would shift the record sequence.
+  static void Setup(SSL_CTX* ctx);
+
+  static bool IsEnabled(const SSL_CTX* ctx);
+
+  // Captures the keys of the handshake that runs in the current fiber while the object is alive.
+  TlsTxOffload();
+  ~TlsTxOffload();
+
+  TlsTxOffload(const TlsTxOffload&) = delete;
+  void operator=(const TlsTxOffload&) = delete;
+
+  // Installs the transmit keys of the completed handshake on the socket. Returns false if the
+  // session can not be offloaded, in which case all the writes must go through OpenSSL.
+  // Once installed, OpenSSL must not write to the socket anymore.
+  bool Install(int fd);
+
+ private:
+  static void KeylogCb(const SSL* ssl, const char* line);
+
+  SSL* ssl_ = nullptr;
+
+  // TLS 1.2 master secret or TLS 1.3 server application traffic secret.
+  std::string secret_;
+};
+
+}  // namespace facade
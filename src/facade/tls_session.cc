@@ -0,0 +1,167 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/tls_session.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#if OPENSSL_VERSION_MAJOR >= 3
+#include <openssl/core_names.h>
+#endif
+
+#include <cstring>
+#include <ctime>
+#include <mutex>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "util/fibers/event_count.h"
+
+ABSL_FLAG(uint32_t, tls_session_cache_size, 20480,
+          "Number of the tls sessions that are kept for resumption, 0 disables the session cache "
+          "and the session tickets");
+ABSL_FLAG(uint32_t, tls_session_timeout_sec, 3600, "Lifetime of the resumable tls sessions");
+ABSL_FLAG(uint32_t, tls_ticket_key_rotation_sec, 3600,
+          "Age of the tls session ticket key after which it is rotated. The tickets of the "
+          "previous key are still accepted. Note that tls_ktls disables the tickets of TLS 1.3");
+ABSL_FLAG(uint32_t, tls_max_handshakes, 16,
+          "Maximal number of the tls handshakes that run concurrently in a connection thread, "
+          "the other accepted connections wait for them. 0 means no limit");
+
+namespace facade {
+
+using namespace std;
+using absl::GetFlag;
+
+namespace {
+
+constexpr unsigned char kSessionIdContext[] = "dragonfly";
+
+struct TicketKey {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+  time_t created_at = 0;
+};
+
+// The current key encrypts the new tickets, the previous one only decrypts.
+struct TicketKeys {
+  mutex mu;
+  TicketKey current, previous;
+} ticket_keys;
+
+void Rotate(time_t now) {
+  ticket_keys.previous = ticket_keys.current;
+
+  TicketKey& key = ticket_keys.current;
+  CHECK_EQ(1, RAND_bytes(key.name, sizeof(key.name)));
+  CHECK_EQ(1, RAND_bytes(key.aes_key, sizeof(key.aes_key)));
+  CHECK_EQ(1, RAND_bytes(key.hmac_key, sizeof(key.hmac_key)));
+  key.created_at = now;
+  VLOG(1) << "Rotated the tls ticket key";
+}
+
+// Finds the key of the ticket and copies it to dest. Returns 1 for the current key, 2 for the
+// previous one, which renews the ticket, and 0 if the key is unknown.
+// For a new ticket, rotates the keys if needed and copies the current one.
+int PickKey(unsigned char* name, bool encrypt, TicketKey* dest) {
+  lock_guard lk(ticket_keys.mu);
+
+  if (encrypt) {
+    time_t now = time(nullptr);
+    if (now - ticket_keys.current.created_at >= GetFlag(FLAGS_tls_ticket_key_rotation_sec))
+      Rotate(now);
+
+    *dest = ticket_keys.current;
+    memcpy(name, dest->name, sizeof(dest->name));
+    return 1;
+  }
+
+  for (const TicketKey* key : {&ticket_keys.current, &ticket_keys.previous}) {
+    if (key->created_at && memcmp(name, key->name, sizeof(key->name)) == 0) {
+      *dest = *key;
+      return key == &ticket_keys.current ? 1 : 2;
+    }
+  }
+  return 0;
+}
+
+#if OPENSSL_VERSION_MAJOR >= 3
+using HmacCtx = EVP_MAC_CTX;
+
+bool InitHmac(HmacCtx* hctx, const TicketKey& key) {
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                         OSSL_PARAM_construct_end()};
+  return EVP_MAC_init(hctx, key.hmac_key, sizeof(key.hmac_key), params) == 1;
+}
+#else
+using HmacCtx = HMAC_CTX;
+
+bool InitHmac(HmacCtx* hctx, const TicketKey& key) {
+  return HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), nullptr) == 1;
+}
+#endif
+
+int TicketKeyCb(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx,
+                HmacCtx* hctx, int enc) {
+  TicketKey key;
+  int res = PickKey(name, enc == 1, &key);
+  if (res == 0)
+    return 0;  // a full handshake.
+
+  bool ok;
+  if (enc == 1) {
+    ok = RAND_bytes(iv, EVP_MAX_IV_LENGTH) == 1 &&
+         EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) == 1;
+  } else {
+    ok = EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) == 1;
+  }
+  ok = ok && InitHmac(hctx, key);
+
+  OPENSSL_cleanse(&key, sizeof(key));
+  return ok ? res : -1;
+}
+
+// The handshakes of the thread and the fibers that wait for them.
+thread_local unsigned handshakes = 0;
+thread_local util::fibers_ext::EventCount handshake_ec;
+
+}  // namespace
+
+void TlsSession::Setup(SSL_CTX* ctx) {
+  uint32_t cache_size = GetFlag(FLAGS_tls_session_cache_size);
+  if (cache_size == 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    return;
+  }
+
+  CHECK_EQ(1, SSL_CTX_set_session_id_context(ctx, kSessionIdContext, sizeof(kSessionIdContext)));
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, cache_size);
+  SSL_CTX_set_timeout(ctx, GetFlag(FLAGS_tls_session_timeout_sec));
+
+#if OPENSSL_VERSION_MAJOR >= 3
+  CHECK_EQ(1, SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TicketKeyCb));
+#else
+  CHECK_EQ(1, SSL_CTX_set_tlsext_ticket_key_cb(ctx, &TicketKeyCb));
+#endif
+}
+
+TlsSession::HandshakeGuard::HandshakeGuard() {
+  uint32_t limit = GetFlag(FLAGS_tls_max_handshakes);
+  if (limit)
+    handshake_ec.await([limit] { return handshakes < limit; });
+  ++handshakes;
+}
+
+TlsSession::HandshakeGuard::~HandshakeGuard() {
+  --handshakes;
+  handshake_ec.notify();
+}
+
+}  // namespace facade
@@ -0,0 +1,35 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+namespace facade {
+
+// Session resumption of the tls connections, so that the clients that reconnect at once, e.g.
+// after a failover, skip the asymmetric crypto of the full handshakes.
+//
+// The sessions are kept in the server cache of the SSL_CTX, which is shared by all the threads,
+// and are also resumed from the session tickets. The ticket keys are rotated by the handshakes
+// of the new sessions once the current key is older than --tls_ticket_key_rotation_sec, the
+// tickets of the previous key are still accepted and replaced by the tickets of the new key.
+class TlsSession {
+ public:
+  // Enables the session cache and the session tickets on ctx.
+  static void Setup(SSL_CTX* ctx);
+
+  // Bounds the number of the handshakes that run concurrently in the thread, see
+  // --tls_max_handshakes. Waits until the handshake may start.
+  class HandshakeGuard {
+   public:
+    HandshakeGuard();
+    ~HandshakeGuard();
+
+    HandshakeGuard(const HandshakeGuard&) = delete;
+    void operator=(const HandshakeGuard&) = delete;
+  };
+};
+
+}  // namespace facade
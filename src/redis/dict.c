@@ -506,6 +506,37 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
+/* Frees the entries of the buckets starting from 'cursor' until at least 'count' entries
+ * were freed, the buckets of the second table follow those of the first one. Returns the
+ * cursor to continue from. Once dictSize(d) is 0, dictRelease() takes O(1).
+ * Dragonfly addition, used to release big dicts incrementally. */
+unsigned long dictClearStep(dict *d, unsigned long cursor, unsigned long count) {
+    unsigned long base = 0;
+
+    for (int htidx = 0; htidx < 2; htidx++) {
+        unsigned long size = DICTHT_SIZE(d->ht_size_exp[htidx]);
+
+        for (; cursor < base + size && d->ht_used[htidx] > 0; cursor++) {
+            if (count == 0) return cursor;
+
+            dictEntry *he = d->ht_table[htidx][cursor - base];
+            while (he) {
+                dictEntry *nextHe = he->next;
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+                d->ht_used[htidx]--;
+                if (count) count--;
+                he = nextHe;
+            }
+            d->ht_table[htidx][cursor - base] = NULL;
+        }
+        base += size;
+        if (cursor < base) cursor = base; /* the table was drained before its end */
+    }
+    return cursor;
+}
+
 dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
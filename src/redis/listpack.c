@@ -851,22 +851,34 @@ unsigned char *lpInsert(unsigned char *lp, const unsigned char *elestr, unsigned
 
     unsigned char *dst = lp + poff; /* May be updated after reallocation. */
 
-    /* Realloc before: we need more room. */
+    /* Realloc before: we need more room. A replaced element, e.g. a counter
+     * of a hash, tends to grow again, so the room for its growth is reserved
+     * upfront rather than reallocating on every update. The shrinks below
+     * keep the allocation of mimalloc while it is at least half used. */
     if (new_listpack_bytes > old_listpack_bytes &&
         new_listpack_bytes > zmalloc_size(lp)) {
-        if ((lp = zrealloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        size_t alloc_bytes = new_listpack_bytes;
+        if (where == LP_REPLACE && !delete) {
+            uint64_t reserve = new_listpack_bytes / 8;
+            alloc_bytes += reserve < 256 ? reserve : 256;
+            if (alloc_bytes > UINT32_MAX) alloc_bytes = new_listpack_bytes;
+        }
+        if ((lp = zrealloc(lp,alloc_bytes)) == NULL) return NULL;
         dst = lp + poff;
     }
 
     /* Setup the listpack relocating the elements to make the exact room
-     * we need to store the new one. */
+     * we need to store the new one. An element replaced by one of the same
+     * encoded size is overwritten in place. */
     if (where == LP_BEFORE) {
         memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
     } else { /* LP_REPLACE. */
         long lendiff = (enclen+backlen_size)-replaced_len;
-        memmove(dst+replaced_len+lendiff,
-                dst+replaced_len,
-                old_listpack_bytes-poff-replaced_len);
+        if (lendiff != 0) {
+            memmove(dst+replaced_len+lendiff,
+                    dst+replaced_len,
+                    old_listpack_bytes-poff-replaced_len);
+        }
     }
 
     /* Realloc after: we need to free space. */
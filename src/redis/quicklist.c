@@ -103,6 +103,127 @@ int quicklistisSetPackedThreshold(size_t sz) {
 static quicklistBookmark *_quicklistBookmarkFindByNode(quicklist *ql, quicklistNode *node);
 static void _quicklistBookmarkDelete(quicklist *ql, quicklistBookmark *bm);
 
+/* Lists of at least that many nodes find the nodes by index with a binary search
+ * instead of walking them. */
+#define QUICKLIST_INDEX_MIN_NODES 64
+
+/* The index holds the nodes of the list in order with their virtual positions:
+ * nodes[i] holds the elements [pos[i], pos[i + 1]) and the list starts at pos[first].
+ * Pushes and pops at the ends of the list update only the end slots, so the ring
+ * buffer patterns keep their index. Any other change of the nodes drops the index
+ * and the next lookup by index rebuilds it. The slots are centered on a rebuild so
+ * both ends have room to grow. */
+struct quicklistIndex {
+    quicklistNode **nodes;
+    long long *pos;
+    unsigned long first; /* first used slot */
+    unsigned long len;   /* number of used slots */
+    unsigned long cap;
+};
+
+static void quicklistIndexDrop(quicklist *ql) {
+    if (!ql->index)
+        return;
+    zfree(ql->index->nodes);
+    zfree(ql->index->pos);
+    zfree(ql->index);
+    ql->index = NULL;
+}
+
+static quicklistIndex *quicklistIndexBuild(const quicklist *ql) {
+    quicklistIndex *qi = zmalloc(sizeof(*qi));
+    qi->cap = ql->len * 2;
+    qi->first = ql->len / 2;
+    qi->len = ql->len;
+    qi->nodes = zmalloc(qi->cap * sizeof(*qi->nodes));
+    qi->pos = zmalloc(qi->cap * sizeof(*qi->pos));
+
+    unsigned long i = qi->first;
+    long long pos = 0;
+    for (quicklistNode *n = ql->head; n; n = n->next, ++i) {
+        qi->nodes[i] = n;
+        qi->pos[i] = pos;
+        pos += n->count;
+    }
+    return qi;
+}
+
+/* Called after 'node' was linked into the list. */
+static void quicklistIndexNodeInserted(quicklist *ql, quicklistNode *node) {
+    quicklistIndex *qi = ql->index;
+    if (!qi)
+        return;
+
+    if (node == ql->head && node->next && qi->first > 0) {
+        qi->first--;
+        qi->len++;
+        qi->nodes[qi->first] = node;
+        qi->pos[qi->first] = qi->pos[qi->first + 1] - node->count;
+    } else if (node == ql->tail && node->prev && qi->first + qi->len < qi->cap) {
+        unsigned long last = qi->first + qi->len - 1;
+        qi->nodes[last + 1] = node;
+        qi->pos[last + 1] = qi->pos[last] + node->prev->count;
+        qi->len++;
+    } else {
+        quicklistIndexDrop(ql);
+    }
+}
+
+/* Called before 'node' is unlinked from the list. */
+static void quicklistIndexNodeDeleted(quicklist *ql, quicklistNode *node) {
+    quicklistIndex *qi = ql->index;
+    if (!qi)
+        return;
+
+    if (node == ql->head && node != ql->tail) {
+        qi->first++;
+        qi->len--;
+    } else if (node == ql->tail && node != ql->head) {
+        qi->len--;
+    } else {
+        quicklistIndexDrop(ql);
+    }
+}
+
+/* Called after the count of the linked 'node' changed by 'delta'. */
+static void quicklistIndexCountChanged(quicklist *ql, quicklistNode *node, long delta) {
+    quicklistIndex *qi = ql->index;
+    if (!qi || node == ql->tail)
+        return;
+
+    /* A change of the head moves its start, the other nodes keep their positions. */
+    if (node == ql->head) {
+        qi->pos[qi->first] -= delta;
+    } else {
+        quicklistIndexDrop(ql);
+    }
+}
+
+/* Returns the node of the element 'index' counted from the head and sets 'accum' to
+ * the number of the elements before the node. */
+static quicklistNode *quicklistIndexFind(quicklist *ql, unsigned long long index,
+                                         unsigned long long *accum) {
+    if (!ql->index)
+        ql->index = quicklistIndexBuild(ql);
+
+    const quicklistIndex *qi = ql->index;
+    const long long *pos = qi->pos + qi->first;
+    long long target = pos[0] + (long long)index;
+
+    /* The last node that starts at or before the target. */
+    unsigned long lo = 0, hi = qi->len;
+    while (hi - lo > 1) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if (pos[mid] <= target)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *accum = pos[lo] - pos[0];
+    return qi->nodes[qi->first + lo];
+}
+
 static void quicklistBookmarksClear(quicklist *ql) {
     while (ql->bookmark_count)
         zfree(ql->bookmarks[--ql->bookmark_count].name);
@@ -138,6 +259,7 @@ quicklist *quicklistCreate(void) {
     quicklist->head = quicklist->tail = NULL;
     quicklist->len = 0;
     quicklist->count = 0;
+    quicklist->index = NULL;
     quicklist->compress = 0;
     quicklist->fill = -2;
     quicklist->bookmark_count = 0;
@@ -210,6 +332,7 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    quicklistIndexDrop(quicklist);
     quicklistBookmarksClear(quicklist);
     zfree(quicklist);
 }
@@ -435,6 +558,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
 
     /* Update len first, so in __quicklistCompress we know exactly len */
     quicklist->len++;
+    quicklistIndexNodeInserted(quicklist, new_node);
 
     if (old_node)
         quicklistCompress(quicklist, old_node);
@@ -571,6 +695,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     }
     quicklist->count++;
     quicklist->head->count++;
+    quicklistIndexCountChanged(quicklist, quicklist->head, 1);
     return (orig_head != quicklist->head);
 }
 
@@ -598,6 +723,7 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     }
     quicklist->count++;
     quicklist->tail->count++;
+    quicklistIndexCountChanged(quicklist, quicklist->tail, 1);
     return (orig_tail != quicklist->tail);
 }
 
@@ -650,6 +776,8 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
             _quicklistBookmarkDelete(quicklist, bm);
     }
 
+    quicklistIndexNodeDeleted(quicklist, node);
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -693,6 +821,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
     }
     node->entry = lpDelete(node->entry, *p, p);
     node->count--;
+    quicklistIndexCountChanged(quicklist, node, -1);
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
@@ -813,6 +942,7 @@ REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
     quicklistDecompressNode(a);
     quicklistDecompressNode(b);
     if ((lpMerge(&a->entry, &b->entry))) {
+        quicklistIndexDrop(quicklist);
         /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
         if (!a->entry) {
@@ -996,6 +1126,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
             __quicklistInsertPlainNode(quicklist, node, value, sz, after);
         } else {
             quicklistDecompressNodeForUse(node);
+            quicklistIndexDrop(quicklist);
             new_node = _quicklistSplitNode(node, entry->offset, after);
             quicklistNode *entry_node = __quicklistCreatePlainNode(value, sz);
             __quicklistInsertNode(quicklist, node, entry_node, after);
@@ -1011,6 +1142,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
         quicklistDecompressNodeForUse(node);
         node->entry = lpInsertString(node->entry, value, sz, entry->zi, LP_AFTER, NULL);
         node->count++;
+        quicklistIndexCountChanged(quicklist, node, 1);
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(node);
     } else if (!full && !after) {
@@ -1018,6 +1150,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
         quicklistDecompressNodeForUse(node);
         node->entry = lpInsertString(node->entry, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
+        quicklistIndexCountChanged(quicklist, node, 1);
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(node);
     } else if (full && at_tail && avail_next && after) {
@@ -1028,6 +1161,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
         quicklistDecompressNodeForUse(new_node);
         new_node->entry = lpPrepend(new_node->entry, value, sz);
         new_node->count++;
+        quicklistIndexCountChanged(quicklist, new_node, 1);
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(new_node);
     } else if (full && at_head && avail_prev && !after) {
@@ -1038,6 +1172,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
         quicklistDecompressNodeForUse(new_node);
         new_node->entry = lpAppend(new_node->entry, value, sz);
         new_node->count++;
+        quicklistIndexCountChanged(quicklist, new_node, 1);
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(new_node);
     } else if (full && ((at_tail && !avail_next && after) ||
@@ -1055,6 +1190,7 @@ REDIS_STATIC void _quicklistInsert(quicklistIter *iter, quicklistEntry *entry,
         /* covers both after and !after cases */
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
+        quicklistIndexDrop(quicklist);
         new_node = _quicklistSplitNode(node, entry->offset, after);
         if (after)
             new_node->entry = lpPrepend(new_node->entry, value, sz);
@@ -1161,6 +1297,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             node->entry = lpDeleteRange(node->entry, offset, del);
             quicklistNodeUpdateSz(node);
             node->count -= del;
+            quicklistIndexCountChanged(quicklist, node, -(long)del);
             quicklist->count -= del;
             quicklistDeleteIfEmpty(quicklist, node);
             if (node)
@@ -1230,23 +1367,30 @@ quicklistIter *quicklistGetIteratorAtIdx(quicklist *quicklist,
         seek_index = quicklist->count - 1 - index;
     }
 
-    n = seek_forward ? quicklist->head : quicklist->tail;
-    while (likely(n)) {
-        if ((accum + n->count) > seek_index) {
-            break;
+    if (quicklist->len >= QUICKLIST_INDEX_MIN_NODES) {
+        /* The index counts from the head. */
+        n = quicklistIndexFind(quicklist, forward ? index : quicklist->count - 1 - index,
+                               &accum);
+        if (!forward) accum = quicklist->count - n->count - accum;
     } else {
-            D("Skipping over (%p) %u at accum %lld", (void *)n, n->count,
-              accum);
-            accum += n->count;
-            n = seek_forward ? n->next : n->prev;
+        n = seek_forward ? quicklist->head : quicklist->tail;
+        while (likely(n)) {
+            if ((accum + n->count) > seek_index) {
+                break;
+            } else {
+                D("Skipping over (%p) %u at accum %lld", (void *)n, n->count,
+                  accum);
+                accum += n->count;
+                n = seek_forward ? n->next : n->prev;
+            }
         }
-    }
 
-    if (!n)
-        return NULL;
+        if (!n)
+            return NULL;
 
-    /* Fix accum so it looks like we seeked in the other direction. */
-    if (seek_forward != forward) accum = quicklist->count - n->count - accum;
+        /* Fix accum so it looks like we seeked in the other direction. */
+        if (seek_forward != forward) accum = quicklist->count - n->count - accum;
+    }
 
     D("Found node: %p at accum %llu, idx %llu, sub+ %llu, sub- %llu", (void *)n,
       accum, index, index - accum, (-index) - 1 + accum);
@@ -1433,6 +1577,7 @@ quicklistIter *quicklistGetIteratorEntryAtIdx(quicklist *quicklist, const long l
 }
 
 static void quicklistRotatePlain(quicklist *quicklist) {
+    quicklistIndexDrop(quicklist);
     quicklistNode *new_head = quicklist->tail;
     quicklistNode *new_tail = quicklist->tail->prev;
     quicklist->head->prev = new_head;
@@ -673,30 +673,6 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     return C_OK;
 }
 
-typedef struct {
-    /* XADD options */
-    streamID id; /* User-provided ID, for XADD only. */
-    int id_given; /* Was an ID different than "*" specified? for XADD only. */
-    int seq_given; /* Was an ID different than "ms-*" specified? for XADD only. */
-    int no_mkstream; /* if set to 1 do not create new stream */
-
-    /* XADD + XTRIM common options */
-    int trim_strategy; /* TRIM_STRATEGY_* */
-    int trim_strategy_arg_idx; /* Index of the count in MAXLEN/MINID, for rewriting. */
-    int approx_trim; /* If 1 only delete whole radix tree nodes, so
-                      * the trim argument is not applied verbatim. */
-    long long limit; /* Maximum amount of entries to trim. If 0, no limitation
-                      * on the amount of trimming work is enforced. */
-    /* TRIM_STRATEGY_MAXLEN options */
-    long long maxlen; /* After trimming, leave stream at this length . */
-    /* TRIM_STRATEGY_MINID options */
-    streamID minid; /* Trim by ID (No stream entries with ID < 'minid' will remain) */
-} streamAddTrimArgs;
-
-#define TRIM_STRATEGY_NONE 0
-#define TRIM_STRATEGY_MAXLEN 1
-#define TRIM_STRATEGY_MINID 2
-
 /* Trim the stream 's' according to args->trim_strategy, and return the
  * number of elements removed from the stream. The 'approx' option, if non-zero,
  * specifies that the trimming must be performed in a approximated way in
@@ -903,6 +879,94 @@ int64_t streamTrimByID(stream *s, streamID minid, int approx) {
     return streamTrim(s, &args);
 }
 
+/* A node is worth compacting once most of its entries are deleted, which is the
+ * garbage collection condition that streamTrim leaves as a TODO. */
+static int lpIsSparse(unsigned char *lp) {
+    unsigned char *p = lpFirst(lp);
+    int64_t entries = lpGetInteger(p);
+    int64_t deleted = lpGetInteger(lpNext(lp, p));
+    return entries + deleted > 10 && deleted > entries/2;
+}
+
+static unsigned char *lpAppendCopy(unsigned char *lp, unsigned char *p) {
+    unsigned int slen;
+    long long lval;
+    unsigned char *vstr = lpGetValue(p, &slen, &lval);
+    return vstr ? lpAppend(lp, vstr, slen) : lpAppendInteger(lp, lval);
+}
+
+/* Returns 1 if the node that holds 'id' is mostly deleted entries, setting
+ * 'master_id' to the ID of the node, and 0 otherwise. */
+int streamNodeIsSparse(stream *s, streamID *id, streamID *master_id) {
+    unsigned char key[sizeof(streamID)];
+    streamEncodeID(key, id);
+
+    raxIterator ri;
+    raxStart(&ri, s->rax_tree);
+    raxSeek(&ri, "<=", key, sizeof(key));
+    int sparse = 0;
+    if (raxNext(&ri) && lpIsSparse(ri.data)) {
+        streamDecodeID(ri.key, master_id);
+        sparse = 1;
+    }
+    raxStop(&ri);
+    return sparse;
+}
+
+/* Rewrites the node of 'master_id' without its deleted entries if it is mostly
+ * deleted entries, see streamNodeIsSparse. The remaining entries keep their
+ * deltas, which are relative to the master entry that is copied as is.
+ * Returns the number of deleted entries that were dropped. */
+int64_t streamCompactNode(stream *s, streamID *master_id) {
+    unsigned char key[sizeof(streamID)];
+    streamEncodeID(key, master_id);
+    unsigned char *lp = raxFind(s->rax_tree, key, sizeof(key));
+    if (lp == raxNotFound || !lpIsSparse(lp))
+        return 0;
+
+    unsigned char *p = lpFirst(lp);
+    int64_t entries = lpGetInteger(p);
+    p = lpNext(lp, p);
+    int64_t deleted = lpGetInteger(p);
+    p = lpNext(lp, p);
+    int64_t master_fields_count = lpGetInteger(p);
+
+    unsigned char *dst = lpNew(lpBytes(lp));
+    dst = lpAppendInteger(dst, entries);
+    dst = lpAppendInteger(dst, 0);
+
+    /* Copy the num-of-fields, the fields and the zero terminator of the master entry. */
+    for (int64_t j = 0; j < master_fields_count + 2; j++) {
+        dst = lpAppendCopy(dst, p);
+        p = lpNext(lp, p);
+    }
+
+    /* 'p' is now pointing to the flags of the first entry. An entry is its flags,
+     * the ID deltas, the num-fields unless it has the master fields, its fields and
+     * values, and the final lp-count field. */
+    while (p) {
+        int64_t flags = lpGetInteger(p);
+        int64_t elements;
+        if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+            elements = 4 + master_fields_count;
+        } else {
+            unsigned char *num_fields = lpNext(lp, lpNext(lp, lpNext(lp, p)));
+            elements = 5 + 2 * lpGetInteger(num_fields);
+        }
+
+        for (int64_t j = 0; j < elements; j++) {
+            if (!(flags & STREAM_ITEM_FLAG_DELETED))
+                dst = lpAppendCopy(dst, p);
+            p = lpNext(lp, p);
+        }
+    }
+
+    dst = lpShrinkToFit(dst);
+    raxInsert(s->rax_tree, key, sizeof(key), dst, NULL);
+    lpFree(lp);
+    return deleted;
+}
+
 #if ROMAN_ENABLE
 /* Parse the arguments of XADD/XTRIM.
  *
@@ -1058,6 +1058,39 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
     return zl;
 }
 
+/* Returns 1 if the (element,score) pair at 'eptr' stays sorted when its score
+ * becomes 'score', i.e. it is still between its neighbours. */
+static int zzlKeepsPosition(unsigned char *zl, unsigned char *eptr, sds ele, double score) {
+    unsigned char *sptr = lpNext(zl,eptr);
+    unsigned char *pptr = lpPrev(zl,eptr); /* The score of the previous pair. */
+    unsigned char *nptr = lpNext(zl,sptr); /* The element of the next pair. */
+    double s;
+
+    if (pptr != NULL) {
+        s = zzlGetScore(pptr);
+        if (s > score || (s == score &&
+            zzlCompareElements(lpPrev(zl,pptr),(unsigned char*)ele,sdslen(ele)) > 0))
+            return 0;
+    }
+    if (nptr != NULL) {
+        s = zzlGetScore(lpNext(zl,nptr));
+        if (s < score || (s == score &&
+            zzlCompareElements(nptr,(unsigned char*)ele,sdslen(ele)) < 0))
+            return 0;
+    }
+    return 1;
+}
+
+/* Replaces the score of the pair at 'eptr', which is overwritten in place
+ * when its encoded size stays the same. */
+static unsigned char *zzlReplaceScore(unsigned char *zl, unsigned char *eptr, double score) {
+    unsigned char *sptr = lpNext(zl,eptr);
+    char scorebuf[128];
+    int scorelen = d2string(scorebuf,sizeof(scorebuf),score);
+
+    return lpReplace(zl,&sptr,(unsigned char*)scorebuf,scorelen);
+}
+
 unsigned char *zzlDeleteRangeByScore(unsigned char *zl, const zrangespec *range, unsigned long *deleted) {
     unsigned char *eptr, *sptr;
     double score;
@@ -1330,10 +1363,15 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
 
             if (newscore) *newscore = score;
 
-            /* Remove and re-insert when score changed. */
+            /* Update the score in place when the element keeps its
+             * position, otherwise remove and re-insert. */
             if (score != curscore) {
-                zobj->ptr = zzlDelete(zobj->ptr,eptr);
-                zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+                if (zzlKeepsPosition(zobj->ptr,eptr,ele,score)) {
+                    zobj->ptr = zzlReplaceScore(zobj->ptr,eptr,score);
+                } else {
+                    zobj->ptr = zzlDelete(zobj->ptr,eptr);
+                    zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+                }
                 *out_flags |= ZADD_OUT_UPDATED;
             }
             return 1;
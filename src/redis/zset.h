@@ -63,6 +63,7 @@ zskiplist* zslCreate(void);
 void zslFree(zskiplist* zsl);
 zskiplistNode* zslInsert(zskiplist* zsl, double score, sds ele);
 unsigned char* zzlInsert(unsigned char* zl, sds ele, double score);
+unsigned char* zzlInsertAt(unsigned char* zl, unsigned char* eptr, sds ele, double score);
 // int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
 zskiplistNode* zslFirstInRange(zskiplist* zsl, const zrangespec* range);
 zskiplistNode* zslLastInRange(zskiplist* zsl, const zrangespec* range);
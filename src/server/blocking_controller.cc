@@ -106,30 +106,56 @@ void BlockingController::RunStep(Transaction* completed_t) {
     }
   }
 
-  for (DbIndex index : awakened_indices_) {
-    auto dbit = watched_dbs_.find(index);
-    if (dbit == watched_dbs_.end())
-      continue;
+  // The consumers may push into the watched keys, like BLMOVE does, which awakens them in turn.
+  while (!awakened_indices_.empty()) {
+    auto indices = std::move(awakened_indices_);
+    awakened_indices_.clear();
+
+    for (DbIndex index : indices) {
+      auto dbit = watched_dbs_.find(index);
+      if (dbit == watched_dbs_.end())
+        continue;
 
-    DbWatchTable& wt = *dbit->second;
-    for (auto key : wt.awakened_keys) {
-      string_view sv_key = static_cast<string_view>(key);
-      DVLOG(1) << "Processing awakened key " << sv_key;
+      // The keys are copied because serving them may remove their entries from the watch table.
+      vector<string> keys(dbit->second->awakened_keys.begin(), dbit->second->awakened_keys.end());
+      dbit->second->awakened_keys.clear();
+
+      for (const string& key : keys) {
+        DVLOG(1) << "Processing awakened key " << key;
+        dbit = watched_dbs_.find(index);
+        if (dbit == watched_dbs_.end())
+          break;
+
+        DbWatchTable& wt = *dbit->second;
+        auto w_it = wt.queue_map.find(key);
+        if (w_it == wt.queue_map.end())
+          continue;  // the consumed transactions were the only ones that watched the key.
+
+        // Double verify we still got the item.
+        auto [it, exp_it] = owner_->db_slice().FindExt(index, key);
+        if (!IsValid(it)) {
+          // The queue waits for the next write into the key.
+          w_it->second->Suspend();
+          continue;
+        }
 
-      // Double verify we still got the item.
-      auto [it, exp_it] = owner_->db_slice().FindExt(index, sv_key);
-      if (!IsValid(it) || it->second.ObjType() != OBJ_LIST)  // Only LIST is allowed to block.
-        continue;
+        NotifyWatchQueue(index, key, it, &wt);
 
-      NotifyWatchQueue(sv_key, &wt.queue_map);
-    }
-    wt.awakened_keys.clear();
+        // The consumed transactions are notified only after they leave the watch queues,
+        // since their coordinators may release them right away.
+        for (Transaction* trans : consumed_transactions_) {
+          RemoveWatched(trans);
+          trans->NotifyConsumed(owner_);
+        }
+        consumed_transactions_.clear();
+      }
 
-    if (wt.queue_map.empty()) {
-      watched_dbs_.erase(dbit);
+      dbit = watched_dbs_.find(index);
+      if (dbit != watched_dbs_.end() && dbit->second->queue_map.empty()) {
+        watched_dbs_.erase(dbit);
+      }
     }
   }
-  awakened_indices_.clear();
 }
 
 void BlockingController::AddWatched(Transaction* trans) {
@@ -143,6 +169,7 @@ void BlockingController::AddWatched(Transaction* trans) {
   DbWatchTable& wt = *dbit->second;
 
   auto args = trans->ShardArgsInShard(owner_->shard_id());
+  blocked_transactions_.insert(trans);
   for (auto key : args) {
     auto [res, inserted] = wt.queue_map.emplace(key, nullptr);
     if (inserted) {
@@ -165,6 +192,7 @@ void BlockingController::AddWatched(Transaction* trans) {
 // Runs in O(N) complexity in the worst case.
 void BlockingController::RemoveWatched(Transaction* trans) {
   VLOG(1) << "RemoveWatched [" << owner_->shard_id() << "] " << trans->DebugId();
+  blocked_transactions_.erase(trans);
 
   auto dbit = watched_dbs_.find(trans->db_index());
   if (dbit == watched_dbs_.end())
@@ -217,34 +245,56 @@ void BlockingController::AwakeWatched(DbIndex db_index, string_view db_key) {
 }
 
 // Internal function called from RunStep().
-// Marks the queue as active and notifies the first transaction in the queue.
-void BlockingController::NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm) {
-  auto w_it = wqm->find(key);
-  CHECK(w_it != wqm->end());
+// Serves the transactions in the queue that are ready for the key, in order. The transactions
+// with consumers complete right here, so a single step hands the elements of a push to as many
+// waiters as there are elements. The first ready transaction without a consumer is notified
+// instead, and the queue stays active until it finishes running. The transactions that are not
+// ready, like stream readers whose cursors are ahead of the stream, keep their places.
+void BlockingController::NotifyWatchQueue(DbIndex db_index, std::string_view key, PrimeIterator pit,
+                                          DbWatchTable* wt) {
+  auto w_it = wt->queue_map.find(key);
+  CHECK(w_it != wt->queue_map.end());
   DVLOG(1) << "Notify WQ: [" << owner_->shard_id() << "] " << key;
   WatchQueue* wq = w_it->second.get();
 
-  wq->state = WatchQueue::ACTIVE;
-
   auto& queue = wq->items;
   ShardId sid = owner_->shard_id();
+  wq->Suspend();
 
-  do {
-    WatchItem& wi = queue.front();
-    Transaction* head = wi.get();
-    DVLOG(2) << "Pop " << head << " from key " << key;
+  for (auto it = queue.begin(); it != queue.end();) {
+    Transaction* trans = it->get();
+    const Transaction::KeyReadyChecker& krc = trans->key_ready_checker();
 
-    queue.pop_front();
+    if (!(krc ? krc(key, pit->second) : pit->second.ObjType() == OBJ_LIST)) {
+      ++it;
+      continue;
+    }
+
+    DVLOG(2) << "Pop " << trans << " from key " << key;
+    it = queue.erase(it);
 
-    if (head->NotifySuspended(owner_->committed_txid(), sid)) {
+    if (trans->ConsumeOnWatch(owner_, key, pit)) {
+      consumed_transactions_.push_back(trans);
+      ++num_awakened_;
+
+      // The consumer could delete the key or move it within the table.
+      pit = owner_->db_slice().FindExt(db_index, key).first;
+      if (!IsValid(pit))
+        break;
+      continue;
+    }
+
+    if (trans->NotifySuspended(owner_->committed_txid(), sid)) {
+      wq->state = WatchQueue::ACTIVE;
       wq->notify_txid = owner_->committed_txid();
-      awakened_transactions_.insert(head);
+      awakened_transactions_.insert(trans);
+      ++num_awakened_;
       break;
     }
-  } while (!queue.empty());
+  }
 
   if (wq->items.empty()) {
-    wqm->erase(w_it);
+    wt->RemoveEntry(w_it);
   }
 }
 
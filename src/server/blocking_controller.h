@@ -10,6 +10,7 @@
 
 #include "base/string_view_sso.h"
 #include "server/common.h"
+#include "server/table.h"
 
 namespace dfly {
 
@@ -32,6 +33,8 @@ class BlockingController {
   // 2: if t is awaked and finished running - to remove it from the head
   //    of the queue and notify the next one.
   //    If t is null then second part is omitted.
+  // The transactions with key consumers complete within the step, so all of the waiters that
+  // a single write can serve are served at once.
   void RunStep(Transaction* t);
 
   // Blocking API
@@ -44,6 +47,16 @@ class BlockingController {
   // Called from operations that create keys like lpush, rename etc.
   void AwakeWatched(DbIndex db_index, std::string_view db_key);
 
+  // The transactions that wait for the watched keys.
+  size_t NumBlocked() const {
+    return blocked_transactions_.size();
+  }
+
+  // How many times the blocked transactions were notified that their keys are ready.
+  uint64_t num_awakened() const {
+    return num_awakened_;
+  }
+
   // Used in tests and debugging functions.
   size_t NumWatched(DbIndex db_indx) const;
   std::vector<std::string> GetWatchedKeys(DbIndex db_indx) const;
@@ -54,7 +67,8 @@ class BlockingController {
 
   using WatchQueueMap = absl::flat_hash_map<std::string, std::unique_ptr<WatchQueue>>;
 
-  void NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm);
+  void NotifyWatchQueue(DbIndex db_index, std::string_view key, PrimeIterator it,
+                        DbWatchTable* wt);
 
   // void NotifyConvergence(Transaction* tx);
 
@@ -71,6 +85,14 @@ class BlockingController {
   // could awaken arbitrary number of keys.
   absl::flat_hash_set<Transaction*> awakened_transactions_;
 
+  // The transactions that NotifyWatchQueue() has completed with their key consumers, flushed by
+  // RunStep().
+  std::vector<Transaction*> consumed_transactions_;
+
+  // The transactions between AddWatched and RemoveWatched.
+  absl::flat_hash_set<Transaction*> blocked_transactions_;
+  uint64_t num_awakened_ = 0;
+
   // absl::btree_multimap<TxId, Transaction*> waiting_convergence_;
 };
 }  // namespace dfly
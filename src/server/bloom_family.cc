@@ -0,0 +1,192 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+#include <absl/strings/numbers.h>
+
+#include "base/logging.h"
+#include "core/bloom.h"
+#include "facade/error.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace facade;
+using namespace std;
+
+namespace {
+
+using CI = CommandId;
+
+// The parameters of the filters that BF.ADD and BF.MADD create, as in RedisBloom.
+constexpr double kDefaultFpProb = 0.01;
+constexpr uint64_t kDefaultCapacity = 100;
+constexpr double kDefaultGrowFactor = 2;
+
+struct SbfParams {
+  double fp_prob = kDefaultFpProb;
+  uint64_t capacity = kDefaultCapacity;
+  double grow_factor = kDefaultGrowFactor;
+};
+
+OpStatus OpReserve(const OpArgs& op_args, string_view key, const SbfParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  it->second.SetSBF(params.capacity, params.fp_prob, params.grow_factor);
+  db_slice.PostUpdate(op_args.db_ind, it);
+  return OpStatus::OK;
+}
+
+// Adds the items to the filter of key, which is created with the default parameters if missing.
+OpResult<vector<bool>> OpAdd(const OpArgs& op_args, string_view key, ArgSlice items) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+
+  if (added) {
+    it->second.SetSBF(kDefaultCapacity, kDefaultFpProb, kDefaultGrowFactor);
+  } else {
+    if (it->second.ObjType() != OBJ_SBF)
+      return OpStatus::WRONG_TYPE;
+    db_slice.PreUpdate(op_args.db_ind, it);
+  }
+
+  unique_ptr<bool[]> res(new bool[items.size()]);
+  it->second.GetSBF()->AddMany(items, absl::MakeSpan(res.get(), items.size()));
+  db_slice.PostUpdate(op_args.db_ind, it);
+
+  return vector<bool>(res.get(), res.get() + items.size());
+}
+
+OpResult<vector<bool>> OpExists(const OpArgs& op_args, string_view key, ArgSlice items) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_SBF);
+  if (it_res == OpStatus::KEY_NOTFOUND)
+    return vector<bool>(items.size(), false);
+  if (!it_res)
+    return it_res.status();
+
+  unique_ptr<bool[]> res(new bool[items.size()]);
+  it_res.value()->second.GetSBF()->ExistsMany(items, absl::MakeSpan(res.get(), items.size()));
+  return vector<bool>(res.get(), res.get() + items.size());
+}
+
+vector<string_view> ItemArgs(CmdArgList args) {
+  vector<string_view> items(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i) {
+    items[i - 2] = ArgS(args, i);
+  }
+  return items;
+}
+
+// Replies with a single integer for BF.ADD and BF.EXISTS, with an array for the multi variants.
+void SendResults(const OpResult<vector<bool>>& result, bool multi, ConnectionContext* cntx) {
+  if (!result)
+    return (*cntx)->SendError(result.status());
+
+  if (!multi)
+    return (*cntx)->SendLong(result->front());
+
+  (*cntx)->StartArray(result->size());
+  for (bool res : *result) {
+    (*cntx)->SendLong(res);
+  }
+}
+
+void AddItems(CmdArgList args, bool multi, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(OpArgs{shard, t->db_index()}, key, items);
+  };
+
+  SendResults(cntx->transaction->ScheduleSingleHopT(std::move(cb)), multi, cntx);
+}
+
+void CheckItems(CmdArgList args, bool multi, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpExists(OpArgs{shard, t->db_index()}, key, items);
+  };
+
+  SendResults(cntx->transaction->ScheduleSingleHopT(std::move(cb)), multi, cntx);
+}
+
+}  // namespace
+
+// BF.RESERVE key error_rate capacity [EXPANSION expansion]
+void BloomFamily::Reserve(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  SbfParams params;
+
+  if (!absl::SimpleAtod(ArgS(args, 2), &params.fp_prob))
+    return (*cntx)->SendError(kInvalidFloatErr);
+  if (!(params.fp_prob > 0 && params.fp_prob < 1))
+    return (*cntx)->SendError("(0 < error rate range < 1)");
+
+  if (!absl::SimpleAtoi(ArgS(args, 3), &params.capacity))
+    return (*cntx)->SendError(kInvalidIntErr);
+  if (params.capacity == 0)
+    return (*cntx)->SendError("(capacity should be larger than 0)");
+
+  for (size_t i = 4; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) == "EXPANSION" && i + 1 < args.size()) {
+      uint32_t expansion;
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &expansion) || expansion < 2)
+        return (*cntx)->SendError("expansion should be an integer greater than 1");
+      params.grow_factor = expansion;
+      ++i;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpReserve(OpArgs{shard, t->db_index()}, key, params);
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status == OpStatus::KEY_EXISTS)
+    return (*cntx)->SendError("item exists");
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+  (*cntx)->SendOk();
+}
+
+void BloomFamily::Add(CmdArgList args, ConnectionContext* cntx) {
+  AddItems(args, false, cntx);
+}
+
+void BloomFamily::MAdd(CmdArgList args, ConnectionContext* cntx) {
+  AddItems(args, true, cntx);
+}
+
+void BloomFamily::Exists(CmdArgList args, ConnectionContext* cntx) {
+  CheckItems(args, false, cntx);
+}
+
+void BloomFamily::MExists(CmdArgList args, ConnectionContext* cntx) {
+  CheckItems(args, true, cntx);
+}
+
+#define HFUNC(x) SetHandler(&BloomFamily::x)
+
+void BloomFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"BF.RESERVE", CO::WRITE | CO::DENYOOM | CO::FAST, -4, 1, 1, 1}.HFUNC(Reserve)
+            << CI{"BF.ADD", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(Add)
+            << CI{"BF.MADD", CO::WRITE | CO::DENYOOM | CO::FAST, -3, 1, 1, 1}.HFUNC(MAdd)
+            << CI{"BF.EXISTS", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(Exists)
+            << CI{"BF.MEXISTS", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(MExists);
+}
+
+}  // namespace dfly
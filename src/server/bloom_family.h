@@ -0,0 +1,27 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "server/common.h"
+
+namespace dfly {
+
+class CommandRegistry;
+class ConnectionContext;
+
+// The bloom filter commands of RedisBloom, backed by the scalable filters of core/bloom.h.
+class BloomFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+
+ private:
+  static void Reserve(CmdArgList args, ConnectionContext* cntx);
+  static void Add(CmdArgList args, ConnectionContext* cntx);
+  static void MAdd(CmdArgList args, ConnectionContext* cntx);
+  static void Exists(CmdArgList args, ConnectionContext* cntx);
+  static void MExists(CmdArgList args, ConnectionContext* cntx);
+};
+
+}  // namespace dfly
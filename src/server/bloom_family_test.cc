@@ -0,0 +1,73 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using namespace facade;
+
+namespace dfly {
+
+class BloomFamilyTest : public BaseFamilyTest {};
+
+TEST_F(BloomFamilyTest, Basic) {
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "bf", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "bf", "b"}));
+  EXPECT_EQ(Run({"type", "bf"}), "MBbloom--");
+
+  auto resp = Run({"bf.madd", "bf", "a", "b", "c", "b"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(1), IntArg(1), IntArg(0)));
+  resp = Run({"bf.mexists", "bf", "a", "d", "c"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0), IntArg(1)));
+  resp = Run({"bf.mexists", "nokey", "a", "b"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(0)));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"bf.add", "str", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.exists", "str", "a"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(BloomFamilyTest, Reserve) {
+  EXPECT_EQ(Run({"bf.reserve", "bf", "0.001", "1000"}), "OK");
+  EXPECT_THAT(Run({"bf.reserve", "bf", "0.001", "1000"}), ErrArg("item exists"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "1.5", "1000"}), ErrArg("error rate"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "0"}), ErrArg("capacity"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "10", "expansion", "1"}), ErrArg("expansion"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "10", "foo"}), ErrArg("syntax error"));
+  EXPECT_EQ(Run({"bf.reserve", "bf2", "0.01", "10", "expansion", "4"}), "OK");
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"bf.reserve", "str", "0.01", "10"}), ErrArg("item exists"));
+}
+
+TEST_F(BloomFamilyTest, Scale) {
+  Run({"bf.reserve", "bf", "0.01", "10"});
+
+  constexpr unsigned kItems = 2000;
+  for (unsigned i = 0; i < kItems; ++i) {
+    Run({"bf.add", "bf", absl::StrCat("item:", i)});
+  }
+
+  unsigned missing = 0, false_positives = 0;
+  for (unsigned i = 0; i < kItems; ++i) {
+    missing += 1 - CheckedInt({"bf.exists", "bf", absl::StrCat("item:", i)});
+    false_positives += CheckedInt({"bf.exists", "bf", absl::StrCat("other:", i)});
+  }
+  EXPECT_EQ(0u, missing);
+  EXPECT_LT(false_positives, kItems * 0.02);
+}
+
+}  // namespace dfly
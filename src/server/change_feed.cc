@@ -0,0 +1,183 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/change_feed.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/str_cat.h>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/engine_shard_set.h"
+#include "server/server_state.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(bool, change_feed_values, false,
+          "If true, the records of the change feed carry the values of the changed strings.");
+
+ABSL_FLAG(uint32_t, change_feed_max_pending, 16384,
+          "Maximum number of changed keys a shard keeps for the change feed until it sends them. "
+          "The changes of other keys are dropped and accounted in change_feed_dropped.");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+
+namespace {
+
+string_view OpName(ChangeFeed::Op op) {
+  switch (op) {
+    case ChangeFeed::Op::SET:
+      return "set";
+    case ChangeFeed::Op::DEL:
+      return "del";
+    case ChangeFeed::Op::EXPIRED:
+      return "expired";
+  }
+  return "";
+}
+
+}  // namespace
+
+void ChangeFeed::AddSubscriber(uint32_t thread_id) {
+  if (subscribers_.size() <= thread_id)
+    subscribers_.resize(thread_id + 1);
+  ++subscribers_[thread_id];
+  ++num_subscribers_;
+}
+
+void ChangeFeed::RemoveSubscriber(uint32_t thread_id) {
+  DCHECK_LT(thread_id, subscribers_.size());
+  DCHECK_GT(subscribers_[thread_id], 0u);
+
+  --subscribers_[thread_id];
+  if (--num_subscribers_ == 0) {
+    flushes_.clear();
+    pending_.clear();
+    pending_keys_ = 0;
+  }
+}
+
+void ChangeFeed::Record(DbIndex db_ind, string_view key, Op op) {
+  if (!active())
+    return;
+
+  if (pending_.size() <= db_ind)
+    pending_.resize(db_ind + 1);
+
+  // Only the last change of a key is sent, its value is read when the batch is sent.
+  auto& keys = pending_[db_ind];
+  auto it = keys.find(key);
+  if (it != keys.end()) {
+    it->second = op;
+    return;
+  }
+
+  if (pending_keys_ >= GetFlag(FLAGS_change_feed_max_pending)) {
+    ++dropped_records_;
+    return;
+  }
+
+  keys.emplace(key, op);
+  ++pending_keys_;
+  ScheduleFlush();
+}
+
+void ChangeFeed::RecordFlush(DbIndex db_ind) {
+  if (!active())
+    return;
+
+  // The pending keys of the flushed dbs are gone.
+  for (DbIndex i = 0; i < pending_.size(); ++i) {
+    if (db_ind == DbSlice::kDbAll || db_ind == i) {
+      pending_keys_ -= pending_[i].size();
+      pending_[i].clear();
+    }
+  }
+
+  string db = db_ind == DbSlice::kDbAll ? "all" : absl::StrCat(db_ind);
+  AddRecord("flush", db, "", "", &flushes_);
+  ScheduleFlush();
+}
+
+void ChangeFeed::AddRecord(string_view op, string_view db, string_view key, string_view value,
+                           Batch* dest) {
+  dest->emplace_back(op);
+  dest->emplace_back(db);
+  dest->emplace_back(key);
+  dest->emplace_back(value);
+}
+
+void ChangeFeed::ScheduleFlush() {
+  if (flush_scheduled_)
+    return;
+
+  flush_scheduled_ = true;
+
+  // Runs after the current task of the shard thread, like the client tracking invalidations.
+  ProactorBase::me()->DispatchBrief([] {
+    EngineShard* shard = EngineShard::tlocal();
+    if (shard)
+      shard->db_slice().change_feed().Flush();
+  });
+}
+
+void ChangeFeed::Flush() {
+  flush_scheduled_ = false;
+  if (!active())
+    return;
+
+  auto batch = make_shared<Batch>(std::move(flushes_));
+  flushes_.clear();
+
+  bool with_values = GetFlag(FLAGS_change_feed_values);
+  DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+  string value;
+
+  for (DbIndex db_ind = 0; db_ind < pending_.size(); ++db_ind) {
+    auto& keys = pending_[db_ind];
+    if (keys.empty())
+      continue;
+
+    PrimeTable* prime = db_slice.IsDbValid(db_ind) ? db_slice.GetTables(db_ind).first : nullptr;
+    string db = absl::StrCat(db_ind);
+
+    for (const auto& [key, op] : keys) {
+      value.clear();
+
+      // Not FindExt, it would expire the keys while we read them.
+      if (with_values && op == Op::SET && prime) {
+        PrimeIterator it = prime->Find(key);
+        if (IsValid(it) && it->second.ObjType() == OBJ_STRING && !it->second.IsExternal())
+          it->second.GetString(&value);
+      }
+      AddRecord(OpName(op), db, key, value, batch.get());
+    }
+    keys.clear();
+  }
+  pending_keys_ = 0;
+
+  if (batch->empty())
+    return;
+
+  sent_records_ += batch->size() / 4;
+  for (uint32_t thread_id = 0; thread_id < subscribers_.size(); ++thread_id) {
+    if (subscribers_[thread_id] > 0)
+      shard_set->pool()->at(thread_id)->DispatchBrief([batch] { Deliver(*batch); });
+  }
+}
+
+void ChangeFeed::Deliver(const Batch& batch) {
+  for (const auto& [client_id, conn] : ServerState::tlocal()->change_feed_targets) {
+    conn->SendChangesAsync(batch);
+  }
+}
+
+}  // namespace dfly
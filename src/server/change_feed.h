@@ -0,0 +1,79 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// The change data capture feed of a shard, delivered to the connections that are subscribed to
+// the __changes__ channel, see facade::Connection::kChangesChannel.
+//
+// Like the journal the feed records the keys that the writes touch. Once the running shard task
+// finishes, the pending changes are sent as a single batch to each thread with subscribers, so
+// that a burst of writes produces one message per subscriber and a single record per key.
+// A batch is an array of records of 4 strings: the op ("set", "del", "expired" or "flush"), the
+// db index, the key and its value. The value is set only for the strings with
+// --change_feed_values, a flush has an empty key and the db "all" for FLUSHALL.
+//
+// The pending keys are bounded by --change_feed_max_pending, the changes that do not fit are
+// dropped and accounted, so that the consumers know they have to rescan.
+class ChangeFeed {
+ public:
+  enum class Op : uint8_t { SET, DEL, EXPIRED };
+
+  bool active() const {
+    return num_subscribers_ > 0;
+  }
+
+  // The subscribers of the feed by the threads of their connections.
+  void AddSubscriber(uint32_t thread_id);
+  void RemoveSubscriber(uint32_t thread_id);
+
+  // Called when the key is changed or deleted.
+  void Record(DbIndex db_ind, std::string_view key, Op op);
+
+  // Called when the db is flushed, DbSlice::kDbAll for all of them.
+  void RecordFlush(DbIndex db_ind);
+
+  uint64_t sent_records() const {
+    return sent_records_;
+  }
+
+  uint64_t dropped_records() const {
+    return dropped_records_;
+  }
+
+ private:
+  using Batch = std::vector<std::string>;
+
+  static void AddRecord(std::string_view op, std::string_view db, std::string_view key,
+                        std::string_view value, Batch* dest);
+  void ScheduleFlush();
+  void Flush();
+
+  // Runs in the thread of the subscribers.
+  static void Deliver(const Batch& batch);
+
+  std::vector<uint32_t> subscribers_;  // by thread id.
+  uint32_t num_subscribers_ = 0;
+
+  // The flushes precede the pending keys, which are recorded after them.
+  Batch flushes_;
+  std::vector<absl::flat_hash_map<std::string, Op>> pending_;  // by db index.
+  size_t pending_keys_ = 0;
+  bool flush_scheduled_ = false;
+
+  uint64_t sent_records_ = 0;
+  uint64_t dropped_records_ = 0;
+};
+
+}  // namespace dfly
@@ -13,81 +13,245 @@ extern "C" {
 namespace dfly {
 using namespace std;
 
+namespace {
+
+// Returns true if pattern can be indexed by the prefix trie. Sets is_prefix if it ends with '*'.
+bool IsTriePattern(string_view pattern, bool* is_prefix) {
+  *is_prefix = !pattern.empty() && pattern.back() == '*';
+  if (*is_prefix)
+    pattern.remove_suffix(1);
+
+  return pattern.find_first_of("*?[\\") == string_view::npos;
+}
+
+}  // namespace
+
 ChannelSlice::Subscriber::Subscriber(ConnectionContext* cntx, uint32_t tid)
     : conn_cntx(cntx), borrow_token(cntx->conn_state.subscribe_info->borrow_token), thread_id(tid) {
 }
 
-void ChannelSlice::AddSubscription(string_view channel, ConnectionContext* me, uint32_t thread_id) {
-  auto [it, added] = channels_.emplace(channel, nullptr);
+ChannelSlice::SubscriberList::~SubscriberList() {
+  for (auto& s : subscribers) {
+    s.borrow_token.Dec();
+  }
+}
+
+auto ChannelSlice::SubscriberList::ThreadRange(uint32_t tid) const -> absl::Span<const Subscriber> {
+  if (tid + 1 >= thread_offsets.size())
+    return {};
+
+  uint32_t start = thread_offsets[tid];
+  return absl::MakeConstSpan(subscribers).subspan(start, thread_offsets[tid + 1] - start);
+}
+
+void ChannelSlice::AddSubscriber(string_view channel, ConnectionContext* me, uint32_t thread_id,
+                                 ChannelMap* dest) {
+  auto [it, added] = dest->emplace(channel, nullptr);
   if (added) {
     it->second.reset(new Channel);
   }
   it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
+  it->second->snapshot.reset();
 }
 
-void ChannelSlice::RemoveSubscription(string_view channel, ConnectionContext* me) {
-  auto it = channels_.find(channel);
-  if (it != channels_.end()) {
+void ChannelSlice::RemoveSubscriber(string_view channel, ConnectionContext* me, ChannelMap* dest) {
+  auto it = dest->find(channel);
+  if (it != dest->end()) {
     it->second->subscribers.erase(me);
+    it->second->snapshot.reset();
     if (it->second->subscribers.empty())
-      channels_.erase(it);
+      dest->erase(it);
   }
 }
 
+void ChannelSlice::AddSubscription(string_view channel, ConnectionContext* me, uint32_t thread_id) {
+  AddSubscriber(channel, me, thread_id, &channels_);
+}
+
+void ChannelSlice::RemoveSubscription(string_view channel, ConnectionContext* me) {
+  RemoveSubscriber(channel, me, &channels_);
+}
+
+void ChannelSlice::AddShardSubscription(string_view channel, ConnectionContext* me,
+                                        uint32_t thread_id) {
+  AddSubscriber(channel, me, thread_id, &shard_channels_);
+}
+
+void ChannelSlice::RemoveShardSubscription(string_view channel, ConnectionContext* me) {
+  RemoveSubscriber(channel, me, &shard_channels_);
+}
+
 void ChannelSlice::AddGlobPattern(string_view pattern, ConnectionContext* me, uint32_t thread_id) {
   auto [it, added] = patterns_.emplace(pattern, nullptr);
   if (added) {
     it->second.reset(new Channel);
+    IndexPattern(pattern, it->second.get());
   }
   it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
+  it->second->snapshot.reset();
 }
 
 void ChannelSlice::RemoveGlobPattern(string_view pattern, ConnectionContext* me) {
   auto it = patterns_.find(pattern);
   if (it != patterns_.end()) {
     it->second->subscribers.erase(me);
-    if (it->second->subscribers.empty())
+    it->second->snapshot.reset();
+    if (it->second->subscribers.empty()) {
+      UnindexPattern(pattern);
       patterns_.erase(it);
+    }
   }
 }
 
-auto ChannelSlice::FetchSubscribers(string_view channel) -> vector<Subscriber> {
-  vector<Subscriber> res;
+auto ChannelSlice::FetchSubscribers(string_view channel) -> vector<SubscriberListPtr> {
+  vector<SubscriberListPtr> res;
 
   auto it = channels_.find(channel);
   if (it != channels_.end()) {
-    res.reserve(it->second->subscribers.size());
-    CopySubscribers(it->second->subscribers, string{}, &res);
+    res.push_back(Snapshot(string{}, it->second.get()));
   }
 
-  for (const auto& k_v : patterns_) {
+  // The patterns of the trie are rebuilt from the channel only if their snapshot is missing.
+  auto add_trie_pattern = [&](Channel* pchannel, size_t len, bool is_prefix) {
+    if (pchannel->snapshot) {
+      res.push_back(pchannel->snapshot);
+    } else {
+      string pat{channel.substr(0, len)};
+      if (is_prefix)
+        pat.push_back('*');
+      res.push_back(Snapshot(pat, pchannel));
+    }
+  };
+
+  const TrieNode* node = &pattern_trie_;
+  for (size_t i = 0; node; ++i) {
+    if (node->prefix)
+      add_trie_pattern(node->prefix, i, true);
+
+    if (i == channel.size()) {
+      if (node->exact)
+        add_trie_pattern(node->exact, i, false);
+      break;
+    }
+
+    auto child = node->children.find(channel[i]);
+    node = child == node->children.end() ? nullptr : child->second.get();
+  }
+
+  for (const auto& k_v : glob_patterns_) {
     const string& pat = k_v.first;
     // 1 - match
     if (stringmatchlen(pat.data(), pat.size(), channel.data(), channel.size(), 0) == 1) {
-      CopySubscribers(k_v.second->subscribers, pat, &res);
+      res.push_back(Snapshot(pat, k_v.second));
     }
   }
 
   return res;
 }
 
-void ChannelSlice::CopySubscribers(const SubscribeMap& src, const std::string& pattern,
-                                   vector<Subscriber>* dest) {
-  for (const auto& sub : src) {
+auto ChannelSlice::FetchShardSubscribers(string_view channel) -> SubscriberListPtr {
+  auto it = shard_channels_.find(channel);
+  if (it == shard_channels_.end())
+    return nullptr;
+  return Snapshot(string{}, it->second.get());
+}
+
+void ChannelSlice::IndexPattern(string_view pattern, Channel* channel) {
+  bool is_prefix;
+  if (!IsTriePattern(pattern, &is_prefix)) {
+    glob_patterns_.emplace(pattern, channel);
+    return;
+  }
+
+  if (is_prefix)
+    pattern.remove_suffix(1);
+
+  TrieNode* node = &pattern_trie_;
+  for (char c : pattern) {
+    auto& child = node->children[c];
+    if (!child)
+      child.reset(new TrieNode);
+    node = child.get();
+  }
+
+  (is_prefix ? node->prefix : node->exact) = channel;
+}
+
+void ChannelSlice::UnindexPattern(string_view pattern) {
+  bool is_prefix;
+  if (!IsTriePattern(pattern, &is_prefix)) {
+    glob_patterns_.erase(pattern);
+    return;
+  }
+
+  if (is_prefix)
+    pattern.remove_suffix(1);
+
+  // Remember the path to prune the nodes that are left empty.
+  vector<TrieNode*> path{&pattern_trie_};
+  for (char c : pattern) {
+    auto it = path.back()->children.find(c);
+    DCHECK(it != path.back()->children.end());
+    path.push_back(it->second.get());
+  }
+
+  TrieNode* node = path.back();
+  (is_prefix ? node->prefix : node->exact) = nullptr;
+
+  for (size_t i = pattern.size(); i > 0; --i) {
+    node = path[i];
+    if (node->prefix || node->exact || !node->children.empty())
+      break;
+    path[i - 1]->children.erase(pattern[i - 1]);
+  }
+}
+
+auto ChannelSlice::Snapshot(string_view pattern, Channel* channel) -> SubscriberListPtr {
+  if (channel->snapshot)
+    return channel->snapshot;
+
+  auto list = make_shared<SubscriberList>();
+  list->pattern = pattern;
+  list->subscribers.reserve(channel->subscribers.size());
+
+  for (const auto& sub : channel->subscribers) {
     ConnectionContext* cntx = sub.first;
     CHECK(cntx->conn_state.subscribe_info);
 
     Subscriber s(cntx, sub.second.thread_id);
-    s.pattern = pattern;
     s.borrow_token.Inc();
 
-    dest->push_back(std::move(s));
+    list->subscribers.push_back(std::move(s));
   }
+
+  auto& subs = list->subscribers;
+  sort(subs.begin(), subs.end(),
+       [](const auto& left, const auto& right) { return left.thread_id < right.thread_id; });
+
+  uint32_t num_threads = subs.empty() ? 0 : subs.back().thread_id + 1;
+  list->thread_offsets.resize(num_threads + 1, 0);
+  for (const auto& s : subs) {
+    ++list->thread_offsets[s.thread_id + 1];
+  }
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    list->thread_offsets[i + 1] += list->thread_offsets[i];
+  }
+
+  channel->snapshot = std::move(list);
+  return channel->snapshot;
 }
 
 vector<string> ChannelSlice::ListChannels(const string_view pattern) const {
+  return ListMatching(channels_, pattern);
+}
+
+vector<string> ChannelSlice::ListShardChannels(const string_view pattern) const {
+  return ListMatching(shard_channels_, pattern);
+}
+
+vector<string> ChannelSlice::ListMatching(const ChannelMap& channels, string_view pattern) {
   vector<string> res;
-  for (const auto& k_v : channels_) {
+  for (const auto& k_v : channels) {
     const string& channel = k_v.first;
 
     if (pattern.empty() || stringmatchlen(pattern.data(), pattern.size(), channel.data(), channel.size(), 0) == 1) {
@@ -4,7 +4,9 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/types/span.h>
 
+#include <memory>
 #include <string_view>
 
 #include "server/conn_context.h"
@@ -19,9 +21,6 @@ class ChannelSlice {
     util::fibers_ext::BlockingCounter borrow_token;
     uint32_t thread_id;
 
-    // non-empty if was registered via psubscribe
-    std::string pattern;
-
     Subscriber(ConnectionContext* cntx, uint32_t tid);
     // Subscriber() : borrow_token(0) {}
 
@@ -32,15 +31,40 @@ class ChannelSlice {
     void operator=(const Subscriber&) = delete;
   };
 
-  std::vector<Subscriber> FetchSubscribers(std::string_view channel);
+  // Immutable snapshot of the subscribers of a channel or a pattern, shared by the concurrent
+  // publishers. It is rebuilt by the next publish after the subscribers change. Holds a borrow
+  // token of each subscriber until destroyed, so that the subscribed connections do not close
+  // while a publish uses it.
+  struct SubscriberList {
+    std::vector<Subscriber> subscribers;  // sorted by thread_id.
+    std::vector<uint32_t> thread_offsets;  // subscribers of thread i start at thread_offsets[i].
+    std::string pattern;                   // non-empty if registered via psubscribe.
+
+    ~SubscriberList();
+
+    absl::Span<const Subscriber> ThreadRange(uint32_t tid) const;
+  };
+
+  using SubscriberListPtr = std::shared_ptr<const SubscriberList>;
+
+  // Returns the snapshots of the channel and of the patterns that match it.
+  std::vector<SubscriberListPtr> FetchSubscribers(std::string_view channel);
+
+  // Returns the snapshot of the SSUBSCRIBE subscribers of the channel or null. The sharded
+  // channels live only in the shard of the channel and are not matched against the patterns.
+  SubscriberListPtr FetchShardSubscribers(std::string_view channel);
 
   void AddSubscription(std::string_view channel, ConnectionContext* me, uint32_t thread_id);
   void RemoveSubscription(std::string_view channel, ConnectionContext* me);
 
+  void AddShardSubscription(std::string_view channel, ConnectionContext* me, uint32_t thread_id);
+  void RemoveShardSubscription(std::string_view channel, ConnectionContext* me);
+
   void AddGlobPattern(std::string_view pattern, ConnectionContext* me, uint32_t thread_id);
   void RemoveGlobPattern(std::string_view pattern, ConnectionContext* me);
 
   std::vector<std::string> ListChannels(const std::string_view pattern) const;
+  std::vector<std::string> ListShardChannels(const std::string_view pattern) const;
   size_t PatternCount() const;
 
  private:
@@ -53,15 +77,40 @@ class ChannelSlice {
 
   using SubscribeMap = absl::flat_hash_map<ConnectionContext*, SubscriberInternal>;
 
-  static void CopySubscribers(const SubscribeMap& src, const std::string& pattern,
-                             std::vector<Subscriber>* dest);
-
   struct Channel {
     SubscribeMap subscribers;
+    SubscriberListPtr snapshot;  // reset when subscribers change.
   };
 
-  absl::flat_hash_map<std::string, std::unique_ptr<Channel>> channels_;
-  absl::flat_hash_map<std::string, std::unique_ptr<Channel>> patterns_;
+  // Prefix trie of the patterns that are either literals or literals followed by a single '*'.
+  // Matching a channel against them takes time proportional to the channel length.
+  struct TrieNode {
+    absl::flat_hash_map<char, std::unique_ptr<TrieNode>> children;
+    Channel* prefix = nullptr;  // pattern "<path>*".
+    Channel* exact = nullptr;   // pattern "<path>".
+  };
+
+  using ChannelMap = absl::flat_hash_map<std::string, std::unique_ptr<Channel>>;
+
+  static SubscriberListPtr Snapshot(std::string_view pattern, Channel* channel);
+
+  static void AddSubscriber(std::string_view channel, ConnectionContext* me, uint32_t thread_id,
+                            ChannelMap* dest);
+  static void RemoveSubscriber(std::string_view channel, ConnectionContext* me, ChannelMap* dest);
+  static std::vector<std::string> ListMatching(const ChannelMap& channels,
+                                               std::string_view pattern);
+
+  void IndexPattern(std::string_view pattern, Channel* channel);
+  void UnindexPattern(std::string_view pattern);
+
+  ChannelMap channels_;
+  ChannelMap shard_channels_;
+  ChannelMap patterns_;
+
+  TrieNode pattern_trie_;
+
+  // Patterns that can not be indexed by the trie, matched against each channel one by one.
+  absl::flat_hash_map<std::string, Channel*> glob_patterns_;
 };
 
 }  // namespace dfly
@@ -0,0 +1,190 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_config.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <array>
+
+#include "base/logging.h"
+#include "server/engine_shard_set.h"  // for KeyHashTag
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// CRC16-CCITT (XMODEM), the checksum of the Redis Cluster key slots.
+constexpr array<uint16_t, 256> MakeCrc16Table() {
+  array<uint16_t, 256> table{};
+  for (unsigned i = 0; i < 256; ++i) {
+    uint16_t crc = i << 8;
+    for (unsigned j = 0; j < 8; ++j) {
+      crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+constexpr array<uint16_t, 256> kCrc16Table = MakeCrc16Table();
+
+uint16_t Crc16(string_view buf) {
+  uint16_t crc = 0;
+  for (unsigned char c : buf) {
+    crc = uint16_t(crc << 8) ^ kCrc16Table[((crc >> 8) ^ c) & 0xff];
+  }
+  return crc;
+}
+
+}  // namespace
+
+auto ClusterConfig::KeySlot(string_view key) -> SlotId {
+  return Crc16(KeyHashTag(key)) & kMaxSlotNum;
+}
+
+bool ClusterConfig::ParseSlotRanges(string_view str, vector<SlotRange>* ranges) {
+  for (string_view part : absl::StrSplit(str, ',', absl::SkipEmpty())) {
+    pair<string_view, string_view> p = absl::StrSplit(part, absl::MaxSplits('-', 1));
+    uint32_t start, end;
+    if (!absl::SimpleAtoi(p.first, &start))
+      return false;
+    end = start;
+    if (!p.second.empty() && !absl::SimpleAtoi(p.second, &end))
+      return false;
+    if (start > end || end > kMaxSlotNum)
+      return false;
+
+    ranges->push_back(SlotRange{SlotId(start), SlotId(end)});
+  }
+
+  return true;
+}
+
+unique_ptr<ClusterConfig> ClusterConfig::Create(vector<ClusterShard> shards, string* error) {
+  if (shards.size() >= kNoOwner) {
+    *error = "too many shards";
+    return nullptr;
+  }
+
+  unique_ptr<ClusterConfig> res{new ClusterConfig};
+  res->shards_ = std::move(shards);
+  res->owners_.assign(kNumSlots, kNoOwner);
+
+  for (size_t i = 0; i < res->shards_.size(); ++i) {
+    for (const SlotRange& range : res->shards_[i].slot_ranges) {
+      for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+        if (res->owners_[slot] != kNoOwner) {
+          *error = absl::StrCat("slot ", slot, " is assigned more than once");
+          return nullptr;
+        }
+        res->owners_[slot] = i;
+        ++res->assigned_slots_;
+      }
+    }
+  }
+
+  return res;
+}
+
+auto ClusterConfig::SlotOwner(SlotId slot) const -> const Node* {
+  DCHECK_LE(slot, kMaxSlotNum);
+  uint16_t owner = owners_[slot];
+  return owner == kNoOwner ? nullptr : &shards_[owner].master;
+}
+
+auto ClusterConfig::FindNode(string_view id) const -> const Node* {
+  for (const auto& shard : shards_) {
+    if (shard.master.id == id)
+      return &shard.master;
+  }
+  return nullptr;
+}
+
+auto ClusterConfig::FindMigration(SlotId slot) const -> const Migration* {
+  auto it = migrations_.find(slot);
+  return it == migrations_.end() ? nullptr : &it->second;
+}
+
+unique_ptr<ClusterConfig> ClusterConfig::WithMigration(const vector<SlotRange>& ranges,
+                                                       const Migration& migration) const {
+  unique_ptr<ClusterConfig> res{new ClusterConfig(*this)};
+  for (const SlotRange& range : ranges) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+      if (migration.state == SlotState::STABLE) {
+        res->migrations_.erase(slot);
+      } else {
+        res->migrations_[slot] = migration;
+      }
+    }
+  }
+  return res;
+}
+
+unique_ptr<ClusterConfig> ClusterConfig::WithSlotOwner(const vector<SlotRange>& ranges,
+                                                       string_view node_id) const {
+  unique_ptr<ClusterConfig> res{new ClusterConfig(*this)};
+
+  uint16_t owner = kNoOwner;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[i].master.id == node_id)
+      owner = i;
+  }
+  CHECK_NE(owner, kNoOwner);
+
+  for (const SlotRange& range : ranges) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+      if (res->owners_[slot] == kNoOwner)
+        ++res->assigned_slots_;
+      res->owners_[slot] = owner;
+      res->migrations_.erase(slot);
+    }
+  }
+
+  // Rebuilds the ranges of the shards from the owners.
+  for (auto& shard : res->shards_) {
+    shard.slot_ranges.clear();
+  }
+  for (uint32_t start = 0; start < kNumSlots;) {
+    uint16_t cur = res->owners_[start];
+    uint32_t end = start;
+    while (end + 1 < kNumSlots && res->owners_[end + 1] == cur)
+      ++end;
+    if (cur != kNoOwner)
+      res->shards_[cur].slot_ranges.push_back(SlotRange{SlotId(start), SlotId(end)});
+    start = end + 1;
+  }
+
+  return res;
+}
+
+bool ClusterConfig::OwnsAll(const vector<SlotRange>& ranges, string_view node_id) const {
+  for (const SlotRange& range : ranges) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+      const Node* owner = SlotOwner(slot);
+      if (!owner || owner->id != node_id)
+        return false;
+    }
+  }
+  return true;
+}
+
+string ClusterConfig::SlotRangesStr(const vector<SlotRange>& ranges) {
+  string res;
+  for (const SlotRange& range : ranges) {
+    if (!res.empty())
+      res.push_back(',');
+    if (range.start == range.end)
+      absl::StrAppend(&res, range.start);
+    else
+      absl::StrAppend(&res, range.start, "-", range.end);
+  }
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,107 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// The topology of a Redis Cluster: which node serves each of the 16384 hash slots. Slots are
+// independent from the in-process sharding, a node still spreads the keys of its slots over
+// its shards with Shard().
+//
+// Immutable once built, ClusterFamily replaces the whole config upon changes.
+class ClusterConfig {
+ public:
+  using SlotId = uint16_t;
+
+  static constexpr SlotId kMaxSlotNum = 0x3FFF;
+  static constexpr SlotId kNumSlots = kMaxSlotNum + 1;
+
+  struct Node {
+    std::string id;
+    std::string ip;
+    uint16_t port = 0;
+  };
+
+  struct SlotRange {
+    SlotId start = 0;
+    SlotId end = 0;  // inclusive.
+  };
+
+  // A master with the slots it serves.
+  struct ClusterShard {
+    Node master;
+    std::vector<SlotRange> slot_ranges;
+  };
+
+  // Returns the slot of the key, computed by CRC16 of its hash tag like in Redis Cluster.
+  static SlotId KeySlot(std::string_view key);
+
+  // Parses a list of slots and ranges like "0-5460,5465". Returns false if it's malformed.
+  static bool ParseSlotRanges(std::string_view str, std::vector<SlotRange>* ranges);
+
+  // Builds the config from the shards. Fails if a slot is assigned twice.
+  static std::unique_ptr<ClusterConfig> Create(std::vector<ClusterShard> shards,
+                                               std::string* error);
+
+  // Returns the master of the slot, null if the slot is not served.
+  const Node* SlotOwner(SlotId slot) const;
+  const Node* FindNode(std::string_view id) const;
+
+  const std::vector<ClusterShard>& shards() const {
+    return shards_;
+  }
+
+  size_t assigned_slots() const {
+    return assigned_slots_;
+  }
+
+  // The migrations of the slots, see CLUSTER SETSLOT. Unlike the owners, they are not
+  // distributed across the cluster, each node tracks only its own side.
+  // FINISHING slots are moved to another node by a SlotMigration, the commands on them are
+  // retried until the cutover is done.
+  enum class SlotState : uint8_t { STABLE, MIGRATING, IMPORTING, FINISHING };
+
+  struct Migration {
+    SlotState state = SlotState::STABLE;
+    std::string node_id;  // the target of a migrating slot or the source of an importing one.
+  };
+
+  const Migration* FindMigration(SlotId slot) const;
+
+  // Returns a copy of this config with the migration state of the slots replaced.
+  std::unique_ptr<ClusterConfig> WithMigration(const std::vector<SlotRange>& ranges,
+                                               const Migration& migration) const;
+
+  // Returns a copy of this config with the slots moved to the node, as CLUSTER SETSLOT NODE
+  // does once the migration is over. The node must exist in the config.
+  std::unique_ptr<ClusterConfig> WithSlotOwner(const std::vector<SlotRange>& ranges,
+                                               std::string_view node_id) const;
+
+  // Returns true if this node serves all the slots.
+  bool OwnsAll(const std::vector<SlotRange>& ranges, std::string_view node_id) const;
+
+  // Returns the slot ranges in the format of ParseSlotRanges.
+  static std::string SlotRangesStr(const std::vector<SlotRange>& ranges);
+
+ private:
+  ClusterConfig() = default;
+
+  static constexpr uint16_t kNoOwner = UINT16_MAX;
+
+  std::vector<ClusterShard> shards_;
+  std::vector<uint16_t> owners_;  // index into shards_, by slot.
+  size_t assigned_slots_ = 0;
+  absl::flat_hash_map<SlotId, Migration> migrations_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,593 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_family.h"
+
+#include <absl/random/random.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "facade/error.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/slot_migration.h"
+#include "server/transaction.h"
+
+ABSL_FLAG(std::string, cluster_mode, "",
+          "Cluster mode: empty to disable, 'emulated' for a cluster of a single node that serves "
+          "all the slots, 'yes' for a cluster configured with DFLYCLUSTER CONFIG.");
+ABSL_FLAG(std::string, cluster_announce_ip, "",
+          "The ip that the emulated cluster advertises, the local address of the connection "
+          "by default.");
+
+ABSL_DECLARE_FLAG(uint32_t, port);
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using absl::GetFlag;
+
+using SlotId = ClusterConfig::SlotId;
+using SlotState = ClusterConfig::SlotState;
+
+namespace {
+
+using CI = CommandId;
+using EngineFunc = void (ClusterFamily::*)(CmdArgList args, ConnectionContext* cntx);
+
+inline CommandId::Handler HandlerFunc(ClusterFamily* se, EngineFunc f) {
+  return [=](CmdArgList args, ConnectionContext* cntx) { return (se->*f)(args, cntx); };
+}
+
+constexpr char kClusterDisabled[] = "This instance has cluster support disabled";
+constexpr char kCrossSlotErr[] = "-CROSSSLOT Keys in request don't hash to the same slot";
+constexpr char kClusterDownErr[] = "-CLUSTERDOWN Hash slot not served";
+constexpr char kTryAgainErr[] = "-TRYAGAIN The migration of the slot is finishing";
+
+string RandomNodeId() {
+  absl::BitGen gen;
+  string res;
+  for (unsigned i = 0; i < 5; ++i)
+    absl::StrAppend(&res, absl::Hex(absl::Uniform<uint32_t>(gen), absl::kZeroPad8));
+  return res;
+}
+
+string Redirect(string_view kind, SlotId slot, const ClusterConfig::Node& node) {
+  return absl::StrCat("-", kind, " ", slot, " ", node.ip, ":", node.port);
+}
+
+// Returns true if all the keys of the command reside in this node.
+bool KeysExist(DbIndex db, CmdArgList args, const KeyIndex& key_index) {
+  auto exists = [&](unsigned i) {
+    string_view key = ArgS(args, i);
+    return shard_set->Await(Shard(key, shard_set->size()), [db, key] {
+      return IsValid(EngineShard::tlocal()->db_slice().FindExt(db, key).first);
+    });
+  };
+
+  if (key_index.bonus && !exists(key_index.bonus))
+    return false;
+  for (unsigned i = key_index.start; i < key_index.end; i += key_index.step) {
+    if (!exists(i))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+ClusterFamily::ClusterFamily() {
+  string mode = GetFlag(FLAGS_cluster_mode);
+  if (mode == "emulated") {
+    mode_ = Mode::EMULATED;
+  } else if (mode == "yes") {
+    mode_ = Mode::MANAGED;
+  } else if (!mode.empty()) {
+    LOG(ERROR) << "Invalid cluster_mode " << mode << ", the cluster mode is disabled";
+  }
+
+  my_id_ = RandomNodeId();
+}
+
+ClusterFamily::~ClusterFamily() {
+  DCHECK(!migration_ || !migration_->IsRunning());
+}
+
+void ClusterFamily::Shutdown() {
+  lock_guard lk(migration_mu_);
+  if (migration_)
+    migration_->Cancel();
+}
+
+string ClusterFamily::CheckKeys(const CommandId* cid, CmdArgList args, ConnectionContext* cntx) {
+  DCHECK(IsEnabled());
+
+  string_view name{cid->name()};
+  bool asking = name != "ASKING" && exchange(cntx->conn_state.cluster_asking, false);
+
+  if (cid->first_key_pos() <= 0 || (cid->opt_mask() & CO::GLOBAL_TRANS))
+    return {};
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)  // reported by the regular flow.
+    return {};
+
+  optional<SlotId> slot;
+  auto add_key = [&](unsigned i) {
+    SlotId key_slot = ClusterConfig::KeySlot(ArgS(args, i));
+    if (slot && *slot != key_slot)
+      return false;
+    slot = key_slot;
+    return true;
+  };
+
+  if (key_index->bonus && !add_key(key_index->bonus))
+    return kCrossSlotErr;
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+    if (!add_key(i))
+      return kCrossSlotErr;
+  }
+
+  if (!slot || mode_ == Mode::EMULATED)
+    return {};
+
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config)
+    return kClusterDownErr;
+
+  const ClusterConfig::Node* owner = config->SlotOwner(*slot);
+  const ClusterConfig::Migration* migration = config->FindMigration(*slot);
+
+  if (owner && owner->id == my_id_) {
+    // The keys that are missing here were possibly moved to the target already.
+    if (migration && migration->state == SlotState::MIGRATING &&
+        !KeysExist(cntx->conn_state.db_index, args, *key_index)) {
+      if (const ClusterConfig::Node* target = config->FindNode(migration->node_id))
+        return Redirect("ASK", *slot, *target);
+    }
+    // DFLYCLUSTER MIGRATE is sending the last changes of the slot.
+    if (migration && migration->state == SlotState::FINISHING)
+      return kTryAgainErr;
+    return {};
+  }
+
+  if (asking && migration && migration->state == SlotState::IMPORTING)
+    return {};
+
+  if (!owner)
+    return kClusterDownErr;
+
+  return Redirect("MOVED", *slot, *owner);
+}
+
+bool ClusterFamily::IsKeyServed(string_view key) const {
+  if (mode_ != Mode::MANAGED)
+    return true;
+
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config)
+    return false;
+
+  SlotId slot = ClusterConfig::KeySlot(key);
+  const ClusterConfig::Node* owner = config->SlotOwner(slot);
+  return owner && owner->id == my_id_ && !config->FindMigration(slot);
+}
+
+bool ClusterFamily::BeginCutover(const vector<ClusterConfig::SlotRange>& ranges,
+                                 const string& target_id) {
+  lock_guard lk(config_mu_);
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config || !config->OwnsAll(ranges, my_id_) || !config->FindNode(target_id))
+    return false;
+
+  atomic_store(&config_, config->WithMigration(ranges, {SlotState::FINISHING, target_id}));
+  return true;
+}
+
+shared_ptr<const ClusterConfig> ClusterFamily::MovedConfig(
+    const vector<ClusterConfig::SlotRange>& ranges, const string& target_id) const {
+  lock_guard lk(config_mu_);
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config || !config->OwnsAll(ranges, my_id_) || !config->FindNode(target_id))
+    return nullptr;
+
+  for (const auto& range : ranges) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+      const ClusterConfig::Migration* migration = config->FindMigration(slot);
+      if (!migration || migration->state != SlotState::FINISHING)
+        return nullptr;
+    }
+  }
+
+  return config->WithSlotOwner(ranges, target_id);
+}
+
+void ClusterFamily::EndCutover(const vector<ClusterConfig::SlotRange>& ranges,
+                               const string& target_id, bool moved) {
+  lock_guard lk(config_mu_);
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config)
+    return;
+
+  if (moved && config->FindNode(target_id)) {
+    atomic_store(&config_, config->WithSlotOwner(ranges, target_id));
+  } else if (config->OwnsAll(ranges, my_id_)) {
+    atomic_store(&config_, config->WithMigration(ranges, {}));
+  }
+}
+
+shared_ptr<const ClusterConfig> ClusterFamily::GetConfig(ConnectionContext* cntx) const {
+  if (mode_ == Mode::MANAGED)
+    return atomic_load(&config_);
+
+  ClusterConfig::ClusterShard shard;
+  shard.master.id = my_id_;
+  shard.master.ip = GetFlag(FLAGS_cluster_announce_ip);
+  if (shard.master.ip.empty() && cntx->owner())
+    shard.master.ip = cntx->owner()->LocalBindAddress();
+  shard.master.port = GetFlag(FLAGS_port);
+  shard.slot_ranges.push_back({0, ClusterConfig::kMaxSlotNum});
+
+  string error;
+  shared_ptr<const ClusterConfig> res = ClusterConfig::Create({std::move(shard)}, &error);
+  CHECK(res) << error;
+  return res;
+}
+
+void ClusterFamily::Cluster(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "HELP") {
+    string_view kHelp[] = {
+        "CLUSTER <subcommand> [<arg> [value] [opt] ...]",
+        "Subcommands are:",
+        "SLOTS",
+        "   Return the slot ranges and the nodes that serve them.",
+        "SHARDS",
+        "   Return the shards of the cluster with their slots and nodes.",
+        "NODES",
+        "   Return the nodes of the cluster in the format of nodes.conf.",
+        "INFO",
+        "   Return the state of the cluster.",
+        "KEYSLOT <key>",
+        "   Return the hash slot of the key.",
+        "MYID",
+        "   Return the id of this node.",
+        "SETSLOT <slot> (IMPORTING <node-id>|MIGRATING <node-id>|STABLE|NODE <node-id>)",
+        "   Set the migration state of the slot or its owner.",
+        "HELP",
+        "   Prints this help."};
+    return (*cntx)->SendSimpleStrArr(kHelp, ABSL_ARRAYSIZE(kHelp));
+  }
+
+  if (sub_cmd == "KEYSLOT" && args.size() == 3) {
+    return (*cntx)->SendLong(ClusterConfig::KeySlot(ArgS(args, 2)));
+  }
+
+  if (!IsEnabled()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+
+  if (sub_cmd == "MYID" && args.size() == 2) {
+    return (*cntx)->SendBulkString(my_id_);
+  }
+
+  if (sub_cmd == "SETSLOT") {
+    return SetSlot(args, cntx);
+  }
+
+  if (args.size() == 2 && (sub_cmd == "SLOTS" || sub_cmd == "SHARDS" || sub_cmd == "NODES" ||
+                           sub_cmd == "INFO")) {
+    shared_ptr<const ClusterConfig> config = GetConfig(cntx);
+    if (!config && sub_cmd != "INFO")
+      return (*cntx)->SendError(kClusterDownErr);
+
+    if (sub_cmd == "SLOTS")
+      return ClusterSlots(*config, cntx);
+    if (sub_cmd == "SHARDS")
+      return ClusterShards(*config, cntx);
+    if (sub_cmd == "NODES")
+      return ClusterNodes(*config, cntx);
+
+    if (!config) {
+      string info = "cluster_enabled:1\r\ncluster_state:fail\r\ncluster_slots_assigned:0\r\n";
+      return (*cntx)->SendBulkString(info);
+    }
+    return ClusterInfo(*config, cntx);
+  }
+
+  (*cntx)->SendError(UnknownSubCmd(sub_cmd, "CLUSTER"), kSyntaxErrType);
+}
+
+void ClusterFamily::ClusterSlots(const ClusterConfig& config, ConnectionContext* cntx) {
+  size_t num_ranges = 0;
+  for (const auto& shard : config.shards()) {
+    num_ranges += shard.slot_ranges.size();
+  }
+
+  (*cntx)->StartArray(num_ranges);
+  for (const auto& shard : config.shards()) {
+    for (const auto& range : shard.slot_ranges) {
+      (*cntx)->StartArray(3);
+      (*cntx)->SendLong(range.start);
+      (*cntx)->SendLong(range.end);
+      (*cntx)->StartArray(3);
+      (*cntx)->SendBulkString(shard.master.ip);
+      (*cntx)->SendLong(shard.master.port);
+      (*cntx)->SendBulkString(shard.master.id);
+    }
+  }
+}
+
+void ClusterFamily::ClusterShards(const ClusterConfig& config, ConnectionContext* cntx) {
+  (*cntx)->StartArray(config.shards().size());
+  for (const auto& shard : config.shards()) {
+    (*cntx)->StartArray(4);
+    (*cntx)->SendBulkString("slots");
+    (*cntx)->StartArray(shard.slot_ranges.size() * 2);
+    for (const auto& range : shard.slot_ranges) {
+      (*cntx)->SendLong(range.start);
+      (*cntx)->SendLong(range.end);
+    }
+
+    (*cntx)->SendBulkString("nodes");
+    (*cntx)->StartArray(1);
+    (*cntx)->StartArray(14);
+    (*cntx)->SendBulkString("id");
+    (*cntx)->SendBulkString(shard.master.id);
+    (*cntx)->SendBulkString("port");
+    (*cntx)->SendLong(shard.master.port);
+    (*cntx)->SendBulkString("ip");
+    (*cntx)->SendBulkString(shard.master.ip);
+    (*cntx)->SendBulkString("endpoint");
+    (*cntx)->SendBulkString(shard.master.ip);
+    (*cntx)->SendBulkString("role");
+    (*cntx)->SendBulkString("master");
+    (*cntx)->SendBulkString("replication-offset");
+    (*cntx)->SendLong(0);
+    (*cntx)->SendBulkString("health");
+    (*cntx)->SendBulkString("online");
+  }
+}
+
+void ClusterFamily::ClusterNodes(const ClusterConfig& config, ConnectionContext* cntx) {
+  string res;
+  for (const auto& shard : config.shards()) {
+    const auto& node = shard.master;
+    absl::StrAppend(&res, node.id, " ", node.ip, ":", node.port, "@", node.port, " ",
+                    node.id == my_id_ ? "myself,master" : "master", " - 0 0 0 connected");
+    for (const auto& range : shard.slot_ranges) {
+      if (range.start == range.end)
+        absl::StrAppend(&res, " ", range.start);
+      else
+        absl::StrAppend(&res, " ", range.start, "-", range.end);
+    }
+    absl::StrAppend(&res, "\r\n");
+  }
+  (*cntx)->SendBulkString(res);
+}
+
+void ClusterFamily::ClusterInfo(const ClusterConfig& config, ConnectionContext* cntx) {
+  bool full = config.assigned_slots() == ClusterConfig::kNumSlots;
+
+  string res;
+  auto append = [&res](string_view name, absl::AlphaNum value) {
+    absl::StrAppend(&res, name, ":", value, "\r\n");
+  };
+
+  append("cluster_enabled", 1);
+  append("cluster_state", full ? "ok" : "fail");
+  append("cluster_slots_assigned", config.assigned_slots());
+  append("cluster_slots_ok", config.assigned_slots());
+  append("cluster_slots_pfail", 0);
+  append("cluster_slots_fail", 0);
+  append("cluster_known_nodes", config.shards().size());
+  append("cluster_size", config.shards().size());
+  append("cluster_current_epoch", 1);
+  append("cluster_my_epoch", 1);
+  (*cntx)->SendBulkString(res);
+}
+
+void ClusterFamily::SetSlot(CmdArgList args, ConnectionContext* cntx) {
+  if (mode_ != Mode::MANAGED) {
+    return (*cntx)->SendError("CLUSTER SETSLOT requires cluster_mode=yes");
+  }
+  if (args.size() < 4) {
+    return (*cntx)->SendError(WrongNumArgsError("CLUSTER SETSLOT"), kSyntaxErrType);
+  }
+
+  uint32_t slot;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &slot) || slot > ClusterConfig::kMaxSlotNum) {
+    return (*cntx)->SendError("Invalid or out of range slot");
+  }
+
+  ToUpper(&args[3]);
+  string_view action = ArgS(args, 3);
+
+  ClusterConfig::Migration migration;
+  if (action == "MIGRATING" || action == "IMPORTING" || action == "NODE") {
+    if (args.size() != 5)
+      return (*cntx)->SendError(kSyntaxErr);
+    migration.node_id = ArgS(args, 4);
+    migration.state = action == "MIGRATING" ? SlotState::MIGRATING : SlotState::IMPORTING;
+  } else if (action != "STABLE" || args.size() != 4) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  lock_guard lk(config_mu_);
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config) {
+    return (*cntx)->SendError(kClusterDownErr);
+  }
+
+  if (!migration.node_id.empty() && !config->FindNode(migration.node_id)) {
+    return (*cntx)->SendError(absl::StrCat("I don't know about node ", migration.node_id));
+  }
+
+  const ClusterConfig::Node* owner = config->SlotOwner(slot);
+  bool owned = owner && owner->id == my_id_;
+  if (action == "MIGRATING" && !owned) {
+    return (*cntx)->SendError(absl::StrCat("I'm not the owner of hash slot ", slot));
+  }
+  if (action == "IMPORTING" && owned) {
+    return (*cntx)->SendError(absl::StrCat("I'm already the owner of hash slot ", slot));
+  }
+
+  vector<ClusterConfig::SlotRange> ranges{{SlotId(slot), SlotId(slot)}};
+  shared_ptr<const ClusterConfig> next;
+  if (action == "NODE") {
+    next = config->WithSlotOwner(ranges, migration.node_id);
+  } else {
+    next = config->WithMigration(ranges, std::move(migration));
+  }
+  atomic_store(&config_, std::move(next));
+
+  (*cntx)->SendOk();
+}
+
+void ClusterFamily::Asking(CmdArgList args, ConnectionContext* cntx) {
+  if (!IsEnabled()) {
+    return (*cntx)->SendError(kClusterDisabled);
+  }
+  cntx->conn_state.cluster_asking = true;
+  (*cntx)->SendOk();
+}
+
+// DFLYCLUSTER MIGRATE <node-id> <slot-ranges>
+void ClusterFamily::Migrate(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() != 4) {
+    return (*cntx)->SendError(WrongNumArgsError("DFLYCLUSTER MIGRATE"), kSyntaxErrType);
+  }
+
+  string_view target_id = ArgS(args, 2);
+  vector<ClusterConfig::SlotRange> ranges;
+  if (!ClusterConfig::ParseSlotRanges(ArgS(args, 3), &ranges)) {
+    return (*cntx)->SendError(absl::StrCat("Invalid slot ranges ", ArgS(args, 3)));
+  }
+
+  shared_ptr<const ClusterConfig> config = atomic_load(&config_);
+  if (!config) {
+    return (*cntx)->SendError(kClusterDownErr);
+  }
+
+  const ClusterConfig::Node* target = config->FindNode(target_id);
+  if (!target || target_id == my_id_) {
+    return (*cntx)->SendError(absl::StrCat("Can't migrate to node ", target_id));
+  }
+  if (!config->OwnsAll(ranges, my_id_)) {
+    return (*cntx)->SendError("I'm not the owner of all the slots");
+  }
+  for (const auto& range : ranges) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot) {
+      if (config->FindMigration(slot))
+        return (*cntx)->SendError(absl::StrCat("Hash slot ", slot, " is migrating"));
+    }
+  }
+
+  lock_guard lk(migration_mu_);
+  if (migration_ && migration_->IsRunning()) {
+    return (*cntx)->SendError("A migration is in progress");
+  }
+  if (migration_)
+    migration_->Cancel();  // joins its fiber.
+
+  migration_.reset(new SlotMigration(*target, std::move(ranges), this, dflycluster_cid_));
+  migration_->Start();
+  (*cntx)->SendOk();
+}
+
+void ClusterFamily::MigrationStatus(ConnectionContext* cntx) {
+  lock_guard lk(migration_mu_);
+  if (!migration_) {
+    return (*cntx)->SendNull();
+  }
+
+  SlotMigration::Info info = migration_->GetInfo();
+  (*cntx)->StartArray(14);
+  (*cntx)->SendBulkString("target");
+  (*cntx)->SendBulkString(info.target_id);
+  (*cntx)->SendBulkString("slots");
+  (*cntx)->SendBulkString(info.slots);
+  (*cntx)->SendBulkString("state");
+  (*cntx)->SendBulkString(SlotMigration::StateName(info.state));
+  (*cntx)->SendBulkString("error");
+  (*cntx)->SendBulkString(info.error);
+  (*cntx)->SendBulkString("keys_sent");
+  (*cntx)->SendLong(info.keys_sent);
+  (*cntx)->SendBulkString("bytes_sent");
+  (*cntx)->SendLong(info.bytes_sent);
+  (*cntx)->SendBulkString("rounds");
+  (*cntx)->SendLong(info.rounds);
+}
+
+// DFLYCLUSTER CONFIG <node-id> <ip> <port> <slot-ranges> [<node-id> <ip> <port> <slot-ranges>...]
+// DFLYCLUSTER MIGRATE <node-id> <slot-ranges>
+// DFLYCLUSTER MIGRATION-STATUS
+void ClusterFamily::DflyCluster(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (mode_ != Mode::MANAGED) {
+    return (*cntx)->SendError("DFLYCLUSTER requires cluster_mode=yes");
+  }
+
+  if (sub_cmd == "MIGRATE") {
+    return Migrate(args, cntx);
+  }
+
+  if (sub_cmd == "MIGRATION-STATUS" && args.size() == 2) {
+    return MigrationStatus(cntx);
+  }
+
+  if (sub_cmd != "CONFIG") {
+    return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "DFLYCLUSTER"), kSyntaxErrType);
+  }
+
+  if (args.size() < 6 || (args.size() - 2) % 4 != 0) {
+    return (*cntx)->SendError(WrongNumArgsError("DFLYCLUSTER CONFIG"), kSyntaxErrType);
+  }
+
+  vector<ClusterConfig::ClusterShard> shards;
+  for (size_t i = 2; i < args.size(); i += 4) {
+    ClusterConfig::ClusterShard shard;
+    shard.master.id = ArgS(args, i);
+    shard.master.ip = ArgS(args, i + 1);
+    if (!absl::SimpleAtoi(ArgS(args, i + 2), &shard.master.port)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+    if (!ClusterConfig::ParseSlotRanges(ArgS(args, i + 3), &shard.slot_ranges)) {
+      return (*cntx)->SendError(absl::StrCat("Invalid slot ranges ", ArgS(args, i + 3)));
+    }
+    shards.push_back(std::move(shard));
+  }
+
+  string error;
+  shared_ptr<const ClusterConfig> config = ClusterConfig::Create(std::move(shards), &error);
+  if (!config) {
+    return (*cntx)->SendError(error);
+  }
+
+  lock_guard lk(config_mu_);
+  atomic_store(&config_, std::move(config));
+  (*cntx)->SendOk();
+}
+
+#define HFUNC(x) SetHandler(HandlerFunc(this, &ClusterFamily::x))
+
+void ClusterFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"CLUSTER", CO::READONLY | CO::LOADING, -2, 0, 0, 0}.HFUNC(Cluster)
+            << CI{"ASKING", CO::READONLY | CO::FAST, 1, 0, 0, 0}.HFUNC(Asking)
+            << CI{"DFLYCLUSTER", CO::ADMIN | CO::NOSCRIPT | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(
+                   DflyCluster);
+
+  dflycluster_cid_ = registry->Find("DFLYCLUSTER");
+}
+
+}  // namespace dfly
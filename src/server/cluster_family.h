@@ -0,0 +1,98 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <boost/fiber/mutex.hpp>
+#include <memory>
+#include <string>
+
+#include "server/cluster_config.h"
+#include "server/common.h"
+
+namespace dfly {
+
+class CommandId;
+class CommandRegistry;
+class ConnectionContext;
+class SlotMigration;
+
+// The commands of Redis Cluster, see FLAGS_cluster_mode.
+//
+// In the emulated mode the instance is a cluster of a single node that serves all the slots.
+// Otherwise the topology is pushed to every node with DFLYCLUSTER CONFIG, there is no gossip
+// between the nodes.
+class ClusterFamily {
+ public:
+  ClusterFamily();
+  ~ClusterFamily();
+
+  void Register(CommandRegistry* registry);
+
+  // Cancels the slot migration. Called before the shards shut down.
+  void Shutdown();
+
+  bool IsEnabled() const {
+    return mode_ != Mode::DISABLED;
+  }
+
+  // Returns an empty string if this node may run the command with the keys of args.
+  // Otherwise returns the error to reply with: CROSSSLOT, MOVED, ASK or CLUSTERDOWN.
+  // Called for every command in the cluster mode, resets the ASKING flag of the connection.
+  std::string CheckKeys(const CommandId* cid, CmdArgList args, ConnectionContext* cntx);
+
+  // Returns true if the slot of the key is served by this node and is not migrating, i.e.
+  // a command on it would run without checking for the presence of the key.
+  bool IsKeyServed(std::string_view key) const;
+
+  const std::string& my_id() const {
+    return my_id_;
+  }
+
+  // Called by SlotMigration. Marks the slots FINISHING if this node still serves them.
+  bool BeginCutover(const std::vector<ClusterConfig::SlotRange>& ranges,
+                    const std::string& target_id);
+
+  // Returns the config with the slots moved to the target, null if the slots are not
+  // FINISHING anymore.
+  std::shared_ptr<const ClusterConfig> MovedConfig(
+      const std::vector<ClusterConfig::SlotRange>& ranges, const std::string& target_id) const;
+
+  // Moves the slots to the target or, if the migration failed, makes them STABLE again.
+  void EndCutover(const std::vector<ClusterConfig::SlotRange>& ranges,
+                  const std::string& target_id, bool moved);
+
+ private:
+  enum class Mode : uint8_t { DISABLED, EMULATED, MANAGED };
+
+  void Cluster(CmdArgList args, ConnectionContext* cntx);
+  void Asking(CmdArgList args, ConnectionContext* cntx);
+  void DflyCluster(CmdArgList args, ConnectionContext* cntx);
+
+  void ClusterSlots(const ClusterConfig& config, ConnectionContext* cntx);
+  void ClusterShards(const ClusterConfig& config, ConnectionContext* cntx);
+  void ClusterNodes(const ClusterConfig& config, ConnectionContext* cntx);
+  void ClusterInfo(const ClusterConfig& config, ConnectionContext* cntx);
+  void SetSlot(CmdArgList args, ConnectionContext* cntx);
+  void Migrate(CmdArgList args, ConnectionContext* cntx);
+  void MigrationStatus(ConnectionContext* cntx);
+
+  // Returns the current config, in the emulated mode it's built for the connection.
+  std::shared_ptr<const ClusterConfig> GetConfig(ConnectionContext* cntx) const;
+
+  Mode mode_ = Mode::DISABLED;
+  std::string my_id_;
+
+  // Accessed via std::atomic_load/atomic_store, null until DFLYCLUSTER CONFIG.
+  std::shared_ptr<const ClusterConfig> config_;
+  mutable ::boost::fibers::mutex config_mu_;  // serializes the updates of config_.
+
+  const CommandId* dflycluster_cid_ = nullptr;  // of the transactions of the migrations.
+
+  // The last slot migration that this node started, there is one at a time.
+  ::boost::fibers::mutex migration_mu_;
+  std::unique_ptr<SlotMigration> migration_;  // guarded by migration_mu_
+};
+
+}  // namespace dfly
@@ -0,0 +1,186 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/test_utils.h"
+
+ABSL_DECLARE_FLAG(std::string, cluster_mode);
+ABSL_DECLARE_FLAG(std::string, cluster_announce_ip);
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using namespace facade;
+namespace this_fiber = boost::this_fiber;
+
+namespace dfly {
+
+TEST(ClusterConfigTest, KeySlot) {
+  EXPECT_EQ(12182, ClusterConfig::KeySlot("foo"));
+  EXPECT_EQ(5061, ClusterConfig::KeySlot("bar"));
+  EXPECT_EQ(12739, ClusterConfig::KeySlot("123456789"));
+  EXPECT_EQ(ClusterConfig::KeySlot("user"), ClusterConfig::KeySlot("{user}.name"));
+
+  vector<ClusterConfig::SlotRange> ranges;
+  EXPECT_TRUE(ClusterConfig::ParseSlotRanges("0-100,200", &ranges));
+  ASSERT_EQ(2u, ranges.size());
+  EXPECT_EQ(100, ranges[0].end);
+  EXPECT_EQ(200, ranges[1].start);
+  EXPECT_FALSE(ClusterConfig::ParseSlotRanges("5-1", &ranges));
+  EXPECT_FALSE(ClusterConfig::ParseSlotRanges("16384", &ranges));
+}
+
+TEST(ClusterConfigTest, MoveRanges) {
+  vector<ClusterConfig::ClusterShard> shards(2);
+  shards[0].master = {"a", "10.0.0.1", 6379};
+  shards[0].slot_ranges = {{0, 8191}};
+  shards[1].master = {"b", "10.0.0.2", 6379};
+  shards[1].slot_ranges = {{8192, ClusterConfig::kMaxSlotNum}};
+  string error;
+  shared_ptr<const ClusterConfig> config = ClusterConfig::Create(std::move(shards), &error);
+  ASSERT_TRUE(config) << error;
+
+  vector<ClusterConfig::SlotRange> ranges{{0, 10}, {100, 200}};
+  EXPECT_TRUE(config->OwnsAll(ranges, "a"));
+  EXPECT_FALSE(config->OwnsAll(ranges, "b"));
+
+  auto moved = config->WithSlotOwner(ranges, "b");
+  EXPECT_TRUE(moved->OwnsAll(ranges, "b"));
+  EXPECT_EQ("11-99,201-8191", ClusterConfig::SlotRangesStr(moved->shards()[0].slot_ranges));
+  EXPECT_EQ("0-10,100-200,8192-16383",
+            ClusterConfig::SlotRangesStr(moved->shards()[1].slot_ranges));
+}
+
+class ClusterFamilyTest : public BaseFamilyTest {};
+
+TEST_F(ClusterFamilyTest, Disabled) {
+  EXPECT_EQ(12182, CheckedInt({"cluster", "keyslot", "foo"}));
+  EXPECT_THAT(Run({"cluster", "slots"}), ErrArg("cluster support disabled"));
+  EXPECT_THAT(Run({"mget", "foo", "bar"}), ArrLen(2));
+}
+
+class EmulatedClusterTest : public BaseFamilyTest {
+ protected:
+  EmulatedClusterTest() {
+    absl::SetFlag(&FLAGS_cluster_mode, "emulated");
+    absl::SetFlag(&FLAGS_cluster_announce_ip, "10.0.0.1");
+  }
+
+  ~EmulatedClusterTest() {
+    absl::SetFlag(&FLAGS_cluster_mode, "");
+    absl::SetFlag(&FLAGS_cluster_announce_ip, "");
+  }
+};
+
+TEST_F(EmulatedClusterTest, Slots) {
+  auto resp = Run({"cluster", "slots"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(0));
+  EXPECT_THAT(resp.GetVec()[1], IntArg(ClusterConfig::kMaxSlotNum));
+  ASSERT_THAT(resp.GetVec()[2], ArrLen(3));
+  EXPECT_EQ(resp.GetVec()[2].GetVec()[0], "10.0.0.1");
+
+  resp = Run({"cluster", "info"});
+  EXPECT_THAT(resp.GetString(), HasSubstr("cluster_state:ok"));
+  EXPECT_THAT(Run({"cluster", "nodes"}).GetString(), HasSubstr("myself,master"));
+
+  EXPECT_THAT(Run({"mget", "foo", "bar"}), ErrArg("CROSSSLOT"));
+  EXPECT_THAT(Run({"mget", "{user}a", "{user}b"}), ArrLen(2));
+  EXPECT_EQ(Run({"set", "foo", "1"}), "OK");
+  EXPECT_THAT(Run({"select", "1"}), ErrArg("not allowed in cluster mode"));
+}
+
+class ManagedClusterTest : public BaseFamilyTest {
+ protected:
+  ManagedClusterTest() {
+    absl::SetFlag(&FLAGS_cluster_mode, "yes");
+  }
+
+  ~ManagedClusterTest() {
+    absl::SetFlag(&FLAGS_cluster_mode, "");
+  }
+
+  // This node serves the lower half of the slots, "other" the upper.
+  void Configure() {
+    string my_id = Run({"cluster", "myid"}).GetString();
+    EXPECT_EQ(Run({"dflycluster", "config", my_id, "10.0.0.1", "6379", "0-8191", "other",
+                   "10.0.0.2", "7000", "8192-16383"}),
+              "OK");
+  }
+};
+
+TEST_F(ManagedClusterTest, Moved) {
+  EXPECT_THAT(Run({"get", "bar"}), ErrArg("CLUSTERDOWN"));
+  Configure();
+
+  EXPECT_THAT(Run({"get", "foo"}), ErrArg("MOVED 12182 10.0.0.2:7000"));
+  EXPECT_EQ(Run({"set", "bar", "1"}), "OK");
+  EXPECT_EQ(Run({"get", "bar"}), "1");
+  EXPECT_THAT(Run({"cluster", "slots"}), ArrLen(2));
+  EXPECT_THAT(Run({"dflycluster", "config", "a", "1.1.1.1", "1", "0-10", "b", "1.1.1.2", "1",
+                   "5"}),
+              ErrArg("assigned more than once"));
+}
+
+TEST_F(ManagedClusterTest, Migration) {
+  Configure();
+  string my_id = Run({"cluster", "myid"}).GetString();
+
+  Run({"set", "bar", "1"});
+  EXPECT_EQ(Run({"cluster", "setslot", "5061", "migrating", "other"}), "OK");
+  EXPECT_EQ(Run({"get", "bar"}), "1");
+  Run({"del", "bar"});
+  EXPECT_THAT(Run({"get", "bar"}), ErrArg("ASK 5061 10.0.0.2:7000"));
+  EXPECT_EQ(Run({"cluster", "setslot", "5061", "node", "other"}), "OK");
+  EXPECT_THAT(Run({"get", "bar"}), ErrArg("MOVED 5061"));
+
+  EXPECT_EQ(Run({"cluster", "setslot", "12182", "importing", "other"}), "OK");
+  EXPECT_THAT(Run({"get", "foo"}), ErrArg("MOVED"));
+  EXPECT_EQ(Run({"asking"}), "OK");
+  EXPECT_THAT(Run({"get", "foo"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"get", "foo"}), ErrArg("MOVED"));
+
+  EXPECT_EQ(Run({"cluster", "setslot", "12182", "node", my_id}), "OK");
+  EXPECT_THAT(Run({"get", "foo"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"cluster", "slots"}), ArrLen(6));
+}
+
+TEST_F(ManagedClusterTest, MigrateFails) {
+  string my_id = Run({"cluster", "myid"}).GetString();
+  EXPECT_EQ(Run({"dflycluster", "config", my_id, "127.0.0.1", "6379", "0-8191", "other",
+                 "127.0.0.1", "1", "8192-16383"}),
+            "OK");
+
+  EXPECT_THAT(Run({"dflycluster", "migrate", "unknown", "0-10"}), ErrArg("Can't migrate"));
+  EXPECT_THAT(Run({"dflycluster", "migrate", "other", "9000"}), ErrArg("not the owner"));
+  EXPECT_THAT(Run({"dflycluster", "migration-status"}), ArgType(RespExpr::NIL));
+
+  Run({"set", "bar", "1"});
+  EXPECT_EQ(Run({"dflycluster", "migrate", "other", "5000-5100"}), "OK");
+
+  // Nothing listens on the port of the target.
+  RespExpr resp;
+  for (unsigned i = 0; i < 100; ++i) {
+    resp = Run({"dflycluster", "migration-status"});
+    ASSERT_THAT(resp, ArrLen(14));
+    if (resp.GetVec()[5] == "failed")
+      break;
+    this_fiber::sleep_for(10ms);
+  }
+  EXPECT_EQ(resp.GetVec()[5], "failed");
+  EXPECT_EQ(resp.GetVec()[3], "5000-5100");
+  EXPECT_THAT(resp.GetVec()[7].GetString(), HasSubstr("could not connect"));
+
+  // The slots stay with this node.
+  EXPECT_EQ(Run({"get", "bar"}), "1");
+  EXPECT_THAT(Run({"cluster", "slots"}), ArrLen(2));
+}
+
+}  // namespace dfly
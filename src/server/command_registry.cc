@@ -4,6 +4,9 @@
 
 #include "server/command_registry.h"
 
+#include <algorithm>
+
+#include "absl/numeric/bits.h"
 #include "absl/strings/str_cat.h"
 #include "base/bits.h"
 #include "base/logging.h"
@@ -37,8 +40,7 @@ CommandRegistry::CommandRegistry() {
 
   cd.SetHandler([this](const auto& args, auto* cntx) { return Command(args, cntx); });
 
-  const char* nm = cd.name();
-  cmd_map_.emplace(nm, std::move(cd));
+  *this << std::move(cd);
 }
 
 void CommandRegistry::Command(CmdArgList args, ConnectionContext* cntx) {
@@ -46,17 +48,16 @@ void CommandRegistry::Command(CmdArgList args, ConnectionContext* cntx) {
     ToUpper(&args[1]);
     string_view subcmd = ArgS(args, 1);
     if (subcmd == "COUNT") {
-      return (*cntx)->SendLong(cmd_map_.size());
+      return (*cntx)->SendLong(cmds_.size());
     } else {
       return (*cntx)->SendError(kSyntaxErr, kSyntaxErrType);
     }
   }
-  size_t len = cmd_map_.size();
+  size_t len = cmds_.size();
 
   (*cntx)->StartArray(len);
 
-  for (const auto& val : cmd_map_) {
-    const CommandId& cd = val.second;
+  for (const CommandId& cd : cmds_) {
     (*cntx)->StartArray(6);
     (*cntx)->SendSimpleString(cd.name());
     (*cntx)->SendLong(cd.arity());
@@ -78,11 +79,61 @@ void CommandRegistry::Command(CmdArgList args, ConnectionContext* cntx) {
 
 CommandRegistry& CommandRegistry::operator<<(CommandId cmd) {
   string_view k = cmd.name();
-  CHECK(cmd_map_.emplace(k, std::move(cmd)).second) << k;
+  CHECK(Find(k) == nullptr) << k;
+  CHECK_LT(cmds_.size(), kEmptySlot);
+
+  cmds_.push_back(std::move(cmd));
+  BuildIndex();
 
   return *this;
 }
 
+// Hash and displace: the buckets are placed from the largest one, every bucket tries the seeds
+// until all its names fall into free slots. With 2 slots per name and 4 names per bucket on
+// average, a few seeds per bucket are enough.
+void CommandRegistry::BuildIndex() {
+  size_t num_slots = absl::bit_ceil(cmds_.size() * 2);
+  size_t num_buckets = std::max<size_t>(1, num_slots / 8);
+
+  vector<vector<uint16_t>> buckets(num_buckets);
+  for (uint16_t i = 0; i < cmds_.size(); ++i) {
+    buckets[Hash(cmds_[i].name(), 0) & (num_buckets - 1)].push_back(i);
+  }
+
+  vector<uint32_t> order(num_buckets);
+  for (uint32_t i = 0; i < num_buckets; ++i)
+    order[i] = i;
+  sort(order.begin(), order.end(),
+       [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+  seeds_.assign(num_buckets, 0);
+  slots_.assign(num_slots, kEmptySlot);
+
+  vector<uint32_t> taken;
+  for (uint32_t b : order) {
+    const auto& bucket = buckets[b];
+    if (bucket.empty())
+      break;
+
+    for (uint32_t seed = 1;; ++seed) {
+      taken.clear();
+      for (uint16_t index : bucket) {
+        uint32_t slot = Hash(cmds_[index].name(), seed) & (num_slots - 1);
+        if (slots_[slot] != kEmptySlot || find(taken.begin(), taken.end(), slot) != taken.end())
+          break;
+        taken.push_back(slot);
+      }
+
+      if (taken.size() == bucket.size()) {
+        for (size_t j = 0; j < bucket.size(); ++j)
+          slots_[taken[j]] = bucket[j];
+        seeds_[b] = seed;
+        break;
+      }
+    }
+  }
+}
+
 namespace CO {
 
 const char* OptName(CO::CommandOpt fl) {
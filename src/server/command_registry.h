@@ -5,9 +5,11 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/strings/match.h>
 #include <absl/types/span.h>
 
 #include <functional>
+#include <vector>
 
 #include "base/function2.hpp"
 #include "server/common.h"
@@ -134,34 +136,67 @@ class CommandId {
 };
 
 class CommandRegistry {
-  absl::flat_hash_map<std::string_view, CommandId> cmd_map_;
-
  public:
   CommandRegistry();
 
   CommandRegistry& operator<<(CommandId cmd);
 
+  // The lookup ignores the case of cmd.
   const CommandId* Find(std::string_view cmd) const {
-    auto it = cmd_map_.find(cmd);
-    return it == cmd_map_.end() ? nullptr : &it->second;
+    uint32_t index = FindIndex(cmd);
+    return index == kNotFound ? nullptr : &cmds_[index];
   }
 
   CommandId* Find(std::string_view cmd) {
-    auto it = cmd_map_.find(cmd);
-    return it == cmd_map_.end() ? nullptr : &it->second;
+    uint32_t index = FindIndex(cmd);
+    return index == kNotFound ? nullptr : &cmds_[index];
   }
 
   using TraverseCb = std::function<void(std::string_view, const CommandId&)>;
 
   void Traverse(TraverseCb cb) {
-    for (const auto& k_v : cmd_map_) {
-      cb(k_v.first, k_v.second);
+    for (const auto& cid : cmds_) {
+      cb(cid.name(), cid);
     }
   }
 
  private:
+  static constexpr uint32_t kNotFound = UINT32_MAX;
+  static constexpr uint16_t kEmptySlot = UINT16_MAX;
+
+  // FNV-1a over the bytes folded to lower case, which is exact for the letters and keeps the
+  // names that differ only in their case in the same slot.
+  static uint32_t Hash(std::string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name) {
+      h = (h ^ (uint8_t(c) | 0x20)) * 16777619u;
+    }
+    return h ^ (h >> 15);
+  }
+
+  uint32_t FindIndex(std::string_view cmd) const {
+    if (slots_.empty())
+      return kNotFound;
+
+    uint32_t seed = seeds_[Hash(cmd, 0) & (seeds_.size() - 1)];
+    uint16_t index = slots_[Hash(cmd, seed) & (slots_.size() - 1)];
+    if (index == kEmptySlot || !absl::EqualsIgnoreCase(cmds_[index].name(), cmd))
+      return kNotFound;
+    return index;
+  }
+
+  // Rebuilds the perfect hash of the names of cmds_.
+  void BuildIndex();
+
   // Implements COMMAND functionality.
   void Command(CmdArgList args, ConnectionContext* cntx);
+
+  std::vector<CommandId> cmds_;  // in the order of their registration.
+
+  // The names are hashed into buckets and every bucket has a seed that maps its names into
+  // distinct slots, which hold the indices of the commands in cmds_, see FindIndex.
+  std::vector<uint32_t> seeds_;
+  std::vector<uint16_t> slots_;
 };
 
 }  // namespace dfly
@@ -4,8 +4,11 @@
 
 #include "server/common.h"
 
+#include <absl/flags/flag.h>
 #include <absl/strings/str_cat.h>
+#include <arpa/inet.h>
 #include <mimalloc.h>
+#include <netdb.h>
 
 extern "C" {
 #include "redis/object.h"
@@ -14,9 +17,13 @@ extern "C" {
 }
 
 #include "base/logging.h"
+#include "core/compact_object.h"
 #include "server/error.h"
+#include "server/rdb_extensions.h"
 #include "server/server_state.h"
 
+ABSL_DECLARE_FLAG(uint32_t, interpreter_per_thread);
+
 namespace dfly {
 
 using namespace std;
@@ -45,15 +52,57 @@ void ServerState::Init() {
 
 void ServerState::Shutdown() {
   gstate_ = GlobalState::SHUTTING_DOWN;
-  interpreter_.reset();
+  interpreters_.reset();
+}
+
+InterpreterManager& ServerState::interpreters() {
+  if (!interpreters_) {
+    interpreters_.emplace(max(absl::GetFlag(FLAGS_interpreter_per_thread), 1u));
+  }
+
+  return interpreters_.value();
+}
+
+Interpreter* ServerState::BorrowInterpreter() {
+  return interpreters().Get();
+}
+
+void ServerState::ReturnInterpreter(Interpreter* ir) {
+  interpreters().Return(ir);
 }
 
 Interpreter& ServerState::GetInterpreter() {
-  if (!interpreter_) {
-    interpreter_.emplace();
+  return interpreters().Any();
+}
+
+Interpreter& ServerState::GetShardInterpreter() {
+  if (!shard_interpreter_) {
+    shard_interpreter_.emplace();
   }
 
-  return interpreter_.value();
+  return shard_interpreter_.value();
+}
+
+ScriptStats& ScriptStats::operator+=(const ScriptStats& o) {
+  calls += o.calls;
+  total_usec += o.total_usec;
+  max_usec = max(max_usec, o.max_usec);
+  redis_calls += o.redis_calls;
+  shards += o.shards;
+  allocated_bytes += o.allocated_bytes;
+  return *this;
+}
+
+void ServerState::PreloadScript(string_view body) {
+  if (gstate_ == GlobalState::SHUTTING_DOWN)
+    return;
+
+  // The interpreters are not locked since adding a function does not preempt.
+  string res;
+  GetInterpreter();  // the thread has at least one interpreter that is ready to run it.
+  interpreters_->ForEach([&](Interpreter* ir) { ir->AddFunction(body, &res); });
+  if (shard_interpreter_)
+    shard_interpreter_->AddFunction(body, &res);
 }
 
 const char* GlobalStateName(GlobalState s) {
@@ -84,6 +133,10 @@ const char* ObjTypeName(int type) {
       return "hash";
     case OBJ_STREAM:
       return "stream";
+    case OBJ_SBF:
+      return "MBbloom--";
+    case OBJ_JSON:
+      return "ReJSON-RL";
     default:
       LOG(ERROR) << "Unsupported type " << type;
   }
@@ -104,10 +157,46 @@ const char* RdbTypeName(unsigned type) {
       return "hash";
     case RDB_TYPE_STREAM_LISTPACKS:
       return "stream";
+    case RDB_TYPE_SBF:
+      return "sbf";
+    case RDB_TYPE_JSON:
+      return "json";
   }
   return "other";
 }
 
+int ResolveDns(std::string_view host, char* dest) {
+  struct addrinfo hints, *servinfo;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = AI_ALL;
+
+  int res = getaddrinfo(host.data(), NULL, &hints, &servinfo);
+  if (res != 0)
+    return res;
+
+  static_assert(INET_ADDRSTRLEN < INET6_ADDRSTRLEN, "");
+
+  res = EAI_FAMILY;
+  for (addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
+    if (p->ai_family == AF_INET) {
+      struct sockaddr_in* ipv4 = (struct sockaddr_in*)p->ai_addr;
+      const char* inet_res = inet_ntop(p->ai_family, &ipv4->sin_addr, dest, INET6_ADDRSTRLEN);
+      CHECK_NOTNULL(inet_res);
+      res = 0;
+      break;
+    }
+    LOG(WARNING) << "Only IPv4 is supported";
+  }
+
+  freeaddrinfo(servinfo);
+
+  return res;
+}
+
 bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes) {
   if (str.empty())
     return false;
@@ -166,10 +255,14 @@ bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes) {
 #define ADD(x) (x) += o.x
 
 TieredStats& TieredStats::operator+=(const TieredStats& o) {
-  static_assert(sizeof(TieredStats) == 32);
+  static_assert(sizeof(TieredStats) == 64);
 
   ADD(external_reads);
+  ADD(external_reads_coalesced);
+  ADD(external_reads_merged);
   ADD(external_writes);
+  ADD(external_promotions);
+  ADD(external_compacted);
   ADD(storage_capacity);
   ADD(storage_reserved);
   return *this;
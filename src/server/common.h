@@ -75,7 +75,11 @@ struct OpArgs {
 
 struct TieredStats {
   size_t external_reads = 0;
+  size_t external_reads_coalesced = 0;  // served by the io of another read of the page.
+  size_t external_reads_merged = 0;     // reads of adjacent pages merged into another io.
   size_t external_writes = 0;
+  size_t external_promotions = 0;  // values that were read often and moved back into memory.
+  size_t external_compacted = 0;    // values rewritten out of sparse batches.
 
   size_t storage_capacity = 0;
 
@@ -109,6 +113,10 @@ const char* ObjTypeName(int type);
 
 const char* RdbTypeName(unsigned type);
 
+// Resolves the ipv4 address of host into dest of INET6_ADDRSTRLEN bytes. Returns 0 or the
+// error code of getaddrinfo.
+int ResolveDns(std::string_view host, char* dest);
+
 // Cached values, updated frequently to represent the correct state of the system.
 extern std::atomic_uint64_t used_mem_peak;
 extern std::atomic_uint64_t used_mem_current;
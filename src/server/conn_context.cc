@@ -5,7 +5,9 @@
 #include "server/conn_context.h"
 
 #include "base/logging.h"
+#include "facade/dragonfly_connection.h"
 #include "server/engine_shard_set.h"
+#include "server/server_state.h"
 #include "util/proactor_base.h"
 
 namespace dfly {
@@ -27,6 +29,9 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
       this->force_dispatch = true;
     }
 
+    bool change_feed = false;
+    int32_t keyspace_subs = 0;
+
     // Gather all the channels we need to subscribe to / remove.
     for (size_t i = 0; i < args.size(); ++i) {
       bool res = false;
@@ -43,6 +48,29 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
       if (res) {
         ShardId sid = Shard(channel, shard_set->size());
         channels.emplace_back(sid, channel);
+
+        // Only subscribed connections can receive the invalidations of the client tracking.
+        if (channel == facade::Connection::kInvalidationChannel) {
+          auto& targets = ServerState::tlocal()->tracking_targets;
+          uint32_t client_id = owner()->GetClientId();
+          if (to_add)
+            targets.emplace(client_id, owner());
+          else
+            targets.erase(client_id);
+        }
+
+        if (channel == facade::Connection::kChangesChannel) {
+          auto& targets = ServerState::tlocal()->change_feed_targets;
+          uint32_t client_id = owner()->GetClientId();
+          if (to_add)
+            targets.emplace(client_id, owner());
+          else
+            targets.erase(client_id);
+          change_feed = true;
+        }
+
+        if (KeyspaceEvents::IsKeyspaceChannel(channel, false))
+          keyspace_subs += to_add ? 1 : -1;
       }
     }
 
@@ -86,6 +114,21 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
     shard_set->RunBriefInParallel(move(cb),
                                   [&](ShardId sid) { return shard_idx[sid + 1] > shard_idx[sid]; });
 
+    // Every shard sends its changes and its keyspace events only while they have subscribers.
+    if (change_feed || keyspace_subs) {
+      shard_set->RunBriefInParallel([&](EngineShard* shard) {
+        if (change_feed) {
+          ChangeFeed& feed = shard->db_slice().change_feed();
+          if (to_add)
+            feed.AddSubscriber(tid);
+          else
+            feed.RemoveSubscriber(tid);
+        }
+        if (keyspace_subs)
+          shard->db_slice().keyspace_events().AddSubscribers(keyspace_subs);
+      });
+    }
+
     // It's important to reset
     if (!to_add && conn_state.subscribe_info->IsEmpty()) {
       conn_state.subscribe_info.reset();
@@ -114,6 +157,7 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
   if (to_add || conn_state.subscribe_info) {
     std::vector<string_view> patterns;
     patterns.reserve(args.size());
+    int32_t keyspace_subs = 0;
 
     if (!conn_state.subscribe_info) {
       DCHECK(to_add);
@@ -137,6 +181,8 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
 
       if (res) {
         patterns.emplace_back(pattern);
+        if (KeyspaceEvents::IsKeyspaceChannel(pattern, true))
+          keyspace_subs += to_add ? 1 : -1;
       }
     }
 
@@ -153,6 +199,8 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
           cs.RemoveGlobPattern(pattern, this);
         }
       }
+      if (keyspace_subs)
+        shard->db_slice().keyspace_events().AddSubscribers(keyspace_subs);
     };
 
     // Update pattern subscription. Run on all shards.
@@ -177,6 +225,81 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
     }
   }
 }
+void ConnectionContext::ChangeShardSubscription(bool to_add, bool to_reply, CmdArgList args) {
+  vector<unsigned> result(to_reply ? args.size() : 0, 0);
+
+  if (to_add || conn_state.subscribe_info) {
+    if (!conn_state.subscribe_info) {
+      DCHECK(to_add);
+
+      conn_state.subscribe_info.reset(new ConnectionState::SubscribeInfo);
+      this->force_dispatch = true;
+    }
+
+    vector<vector<string_view>> channels(shard_set->size());
+    for (size_t i = 0; i < args.size(); ++i) {
+      bool res = false;
+      string_view channel = ArgS(args, i);
+      auto& shard_channels = conn_state.subscribe_info->shard_channels;
+      if (to_add) {
+        res = shard_channels.emplace(channel).second;
+      } else {
+        res = shard_channels.erase(channel) > 0;
+      }
+
+      if (to_reply)
+        result[i] = shard_channels.size();
+
+      if (res)
+        channels[Shard(channel, shard_set->size())].push_back(channel);
+    }
+
+    int32_t tid = util::ProactorBase::GetIndex();
+    DCHECK_GE(tid, 0);
+
+    auto cb = [&](EngineShard* shard) {
+      ChannelSlice& cs = shard->channel_slice();
+      for (string_view channel : channels[shard->shard_id()]) {
+        if (to_add) {
+          cs.AddShardSubscription(channel, this, tid);
+        } else {
+          cs.RemoveShardSubscription(channel, this);
+        }
+      }
+    };
+
+    shard_set->RunBriefInParallel(move(cb), [&](ShardId sid) { return !channels[sid].empty(); });
+
+    if (!to_add && conn_state.subscribe_info->IsEmpty()) {
+      conn_state.subscribe_info.reset();
+      force_dispatch = false;
+    }
+  }
+
+  if (to_reply) {
+    const char* action[2] = {"sunsubscribe", "ssubscribe"};
+    if (result.size() == 0) {
+      return SendSubscriptionChangedResponse(action[to_add], std::nullopt, 0);
+    }
+
+    for (size_t i = 0; i < result.size(); ++i) {
+      SendSubscriptionChangedResponse(action[to_add], ArgS(args, i), result[i]);
+    }
+  }
+}
+
+void ConnectionContext::SUnsubscribeAll(bool to_reply) {
+  if (to_reply &&
+      (!conn_state.subscribe_info || conn_state.subscribe_info->shard_channels.empty())) {
+    return SendSubscriptionChangedResponse("sunsubscribe", std::nullopt, 0);
+  }
+
+  StringVec channels(conn_state.subscribe_info->shard_channels.begin(),
+                     conn_state.subscribe_info->shard_channels.end());
+  CmdArgVec arg_vec(channels.begin(), channels.end());
+  ChangeShardSubscription(false, to_reply, CmdArgList{arg_vec});
+}
+
 void ConnectionContext::UnsubscribeAll(bool to_reply) {
   if (to_reply && (!conn_state.subscribe_info || conn_state.subscribe_info->channels.empty())) {
     return SendSubscriptionChangedResponse("unsubscribe", std::nullopt, 0);
@@ -211,25 +334,70 @@ void ConnectionContext::SendSubscriptionChangedResponse(string_view action,
   (*this)->SendLong(count);
 }
 
+void ConnectionContext::DisableTracking() {
+  auto& info = conn_state.tracking_info;
+  if (!info)
+    return;
+
+  if (info->bcast) {
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      shard->db_slice().tracking().RemovePrefixes(info->prefixes, info->target);
+    });
+  }
+
+  info.reset();
+}
+
 void ConnectionContext::OnClose() {
+  if (replica_stream)
+    replica_stream->Stop();
+
+  if (sync_session)
+    sync_session->Cancel();
+
+  DisableTracking();
+
   if (!conn_state.subscribe_info)
     return;
 
-  if (!conn_state.subscribe_info->channels.empty()) {
-    auto token = conn_state.subscribe_info->borrow_token;
+  // The snapshots of the subscribers hold the token until they are dropped. A snapshot of a
+  // pattern or a channel is dropped only once the connection leaves it, so all the subscriptions
+  // are removed before the wait.
+  auto token = conn_state.subscribe_info->borrow_token;
+  if (!conn_state.subscribe_info->shard_channels.empty())
+    SUnsubscribeAll(false);
+
+  if (conn_state.subscribe_info && !conn_state.subscribe_info->channels.empty())
     UnsubscribeAll(false);
-    // Check that all borrowers finished processing
-    token.Wait();
-  }
 
   if (conn_state.subscribe_info) {
     DCHECK(!conn_state.subscribe_info->patterns.empty());
-    auto token = conn_state.subscribe_info->borrow_token;
     PUnsubscribeAll(false);
-    // Check that all borrowers finished processing
-    token.Wait();
-    DCHECK(!conn_state.subscribe_info);
   }
+  DCHECK(!conn_state.subscribe_info);
+
+  // Check that all borrowers finished processing
+  token.Wait();
+}
+
+void ConnectionContext::ShardAffinity::Record(ShardId sid, bool is_local) {
+  if (sid >= counts.size())
+    counts.resize(sid + 1);
+  ++counts[sid];
+  ++total;
+  local += is_local;
+}
+
+ShardId ConnectionContext::ShardAffinity::Dominant() const {
+  ShardId res = kInvalidSid;
+  uint64_t max_cnt = 0;
+  for (ShardId i = 0; i < counts.size(); ++i) {
+    if (counts[i] > max_cnt) {
+      max_cnt = counts[i];
+      res = i;
+    }
+  }
+  return res;
 }
 
 string ConnectionContext::GetContextInfo() const {
@@ -241,7 +409,18 @@ string ConnectionContext::GetContextInfo() const {
   if (conn_closing)
     buf[index++] = 't';
 
-  return index ? absl::StrCat("flags:", buf) : string();
+  string res = index ? absl::StrCat("flags:", buf) : string();
+
+  ShardId dominant = shard_affinity.Dominant();
+  if (dominant != kInvalidSid) {
+    // Percent of the single shard commands that target the dominant shard and that run locally.
+    uint64_t total = shard_affinity.total;
+    absl::StrAppend(&res, res.empty() ? "" : " ", "shard=", dominant,
+                    " affinity=", shard_affinity.counts[dominant] * 100 / total,
+                    " local=", shard_affinity.local * 100 / total);
+  }
+
+  return res;
 }
 
 }  // namespace dfly
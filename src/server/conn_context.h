@@ -6,8 +6,12 @@
 
 #include <absl/container/flat_hash_set.h>
 
+#include <optional>
+
 #include "facade/conn_context.h"
 #include "server/common.h"
+#include "server/replica_stream.h"
+#include "server/tracking_table.h"
 #include "util/fibers/fibers_ext.h"
 
 namespace dfly {
@@ -30,8 +34,19 @@ struct ConnectionState {
   ExecState exec_state = EXEC_INACTIVE;
   std::vector<StoredCmd> exec_body;
 
+  // A key of WATCH, with the version of its bucket at the time. EXEC fails if the state of any of
+  // the watched keys has changed, see GetWatchedKey.
+  struct WatchedKey {
+    DbIndex db_index;
+    std::string key;
+    bool exists;
+    uint64_t version;
+  };
+  std::vector<WatchedKey> watched_keys;
+
   enum MCGetMask {
     FETCH_CAS_VER = 1,
+    FETCH_TTL = 2,
   };
 
   // used for memcache set/get commands.
@@ -39,10 +54,19 @@ struct ConnectionState {
   // For get op - we use it as a mask of MCGetMask values.
   uint32_t memcache_flag = 0;
 
+  // The unique of the memcached cas command, see DbSlice::CasUnique.
+  std::optional<uint64_t> memcache_cas;
+
+  // Set by ASKING, allows the next command to access an importing slot, see ClusterFamily.
+  bool cluster_asking = false;
+
   // Lua-script related data.
   struct Script {
     bool is_write = true;
 
+    // If false, every call of the script runs its own transaction, see ScriptMgr::ScriptParams.
+    bool atomic = true;
+
     absl::flat_hash_set<std::string_view> keys;
   };
   std::optional<Script> script_info;
@@ -51,11 +75,12 @@ struct ConnectionState {
     // TODO: to provide unique_strings across service. This will allow us to use string_view here.
     absl::flat_hash_set<std::string> channels;
     absl::flat_hash_set<std::string> patterns;
+    absl::flat_hash_set<std::string> shard_channels;  // of SSUBSCRIBE.
 
     util::fibers_ext::BlockingCounter borrow_token;
 
     bool IsEmpty() const {
-      return channels.empty() && patterns.empty();
+      return channels.empty() && patterns.empty() && shard_channels.empty();
     }
 
     unsigned SubscriptionCount() const {
@@ -67,6 +92,17 @@ struct ConnectionState {
   };
 
   std::unique_ptr<SubscribeInfo> subscribe_info;
+
+  // CLIENT TRACKING settings, set while tracking is enabled.
+  struct TrackingInfo {
+    TrackingTable::Target target;  // the connection that receives the invalidations.
+    bool bcast = false;
+
+    // Broadcasting mode prefixes, the empty prefix matches all the keys.
+    std::vector<std::string> prefixes;
+  };
+
+  std::unique_ptr<TrackingInfo> tracking_info;
 };
 
 class ConnectionContext : public facade::ConnectionContext {
@@ -85,6 +121,22 @@ class ConnectionContext : public facade::ConnectionContext {
 
   DebugInfo last_command_debug;
 
+  // Tracks the shards that are targeted by the single shard commands of the connection.
+  // Commands that target the shard of the connection thread run locally, the rest hop to
+  // the shard thread.
+  struct ShardAffinity {
+    std::vector<uint64_t> counts;  // indexed by shard id.
+    uint64_t total = 0;
+    uint64_t local = 0;
+
+    void Record(ShardId sid, bool is_local);
+
+    // Returns the shard that is targeted by most of the commands or kInvalidSid.
+    ShardId Dominant() const;
+  };
+
+  ShardAffinity shard_affinity;
+
   // TODO: to introduce proper accessors.
   Transaction* transaction = nullptr;
   const CommandId* cid = nullptr;
@@ -99,8 +151,22 @@ class ConnectionContext : public facade::ConnectionContext {
   void UnsubscribeAll(bool to_reply);
   void PUnsubscribeAll(bool to_reply);
 
+  // SSUBSCRIBE and SUNSUBSCRIBE, the channels are registered only in their shards.
+  void ChangeShardSubscription(bool to_add, bool to_reply, CmdArgList args);
+  void SUnsubscribeAll(bool to_reply);
+
+  // Unregisters the broadcasting prefixes from all the shards. Keys tracked in the default mode
+  // are dropped once they are invalidated.
+  void DisableTracking();
+
   bool is_replicating = false;
 
+  // Set on the connection of a replica once its full sync has been sent.
+  std::unique_ptr<ReplicaStream> replica_stream;
+
+  // Set on the main connection of a Dragonfly replica, see REPLCONF CAPA dragonfly.
+  std::shared_ptr<SyncSession> sync_session;
+
   std::string GetContextInfo() const override;
 
  private:
@@ -0,0 +1,201 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/counter_combiner.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/flags/flag.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_split.h>
+
+#include "base/logging.h"
+#include "server/engine_shard_set.h"
+#include "server/journal.h"
+#include "server/string_family.h"
+
+ABSL_FLAG(std::string, combined_counters, "",
+          "Comma separated list of the counters whose INCRBY, INCR, DECRBY and DECR are combined "
+          "in the connection threads and applied to the shard in batches, see "
+          "combined_counters_flush_ms. A name that ends with * matches the keys that start "
+          "with the rest of it. The replies and reads of such counters may lag behind the "
+          "increments of the other threads");
+
+ABSL_FLAG(uint32_t, combined_counters_flush_ms, 5,
+          "How often each thread applies the combined increments to the shards");
+
+namespace dfly {
+
+using namespace std;
+using facade::OpStatus;
+
+namespace {
+
+struct Patterns {
+  absl::flat_hash_set<string> keys;
+  vector<string> prefixes;
+};
+
+// Set by Init before the threads serve the connections.
+Patterns patterns;
+
+struct Counter {
+  int64_t value = 0;    // as of the last fold or SetValue.
+  int64_t pending = 0;  // the increments of this thread, which are yet to be folded.
+  bool touched = true;  // since the previous Flush.
+};
+
+// The counters of this thread by db and key.
+thread_local absl::flat_hash_map<pair<DbIndex, string>, Counter> tl_counters;
+thread_local bool tl_flushing = false;
+
+struct Fold {
+  DbIndex db;
+  string key;
+  int64_t delta;
+  OpResult<int64_t> result;
+};
+
+// Applies the folds that belong to shard. The writes run outside of the transactions, like the
+// expiry in the heartbeat, hence the keys that the transactions lock are left for the next time.
+void ApplyFolds(EngineShard* shard, vector<Fold*>* folds) {
+  DbSlice& db_slice = shard->db_slice();
+  bool changed = false;
+  for (Fold* fold : *folds) {
+    db_slice.ActivateDb(fold->db);
+    if (db_slice.IsLocked(fold->db, PrimeKey{fold->key})) {
+      fold->result = OpStatus::SKIPPED;
+      continue;
+    }
+
+    fold->result = StringFamily::OpIncrBy(OpArgs{shard, fold->db}, fold->key, fold->delta, false);
+    changed |= bool(fold->result);
+  }
+
+  if (changed) {
+    shard->IncWriteEpoch();
+    db_slice.keyspace_events().Commit(&db_slice);
+    shard->journal()->Commit();
+  }
+}
+
+}  // namespace
+
+void CounterCombiner::Init() {
+  patterns = Patterns{};
+  string flag = absl::GetFlag(FLAGS_combined_counters);
+  for (string_view name : absl::StrSplit(flag, ',', absl::SkipWhitespace())) {
+    if (absl::EndsWith(name, "*")) {
+      name.remove_suffix(1);
+      patterns.prefixes.emplace_back(name);
+    } else {
+      patterns.keys.emplace(name);
+    }
+  }
+}
+
+bool CounterCombiner::Enabled() {
+  return !patterns.keys.empty() || !patterns.prefixes.empty();
+}
+
+uint32_t CounterCombiner::FlushPeriodMs() {
+  return max(absl::GetFlag(FLAGS_combined_counters_flush_ms), 1u);
+}
+
+bool CounterCombiner::IsCombined(string_view key) {
+  if (patterns.keys.contains(key))
+    return true;
+
+  for (const string& prefix : patterns.prefixes) {
+    if (absl::StartsWith(key, prefix))
+      return true;
+  }
+  return false;
+}
+
+optional<int64_t> CounterCombiner::TryAdd(DbIndex db, string_view key, int64_t delta) {
+  auto it = tl_counters.find(pair{db, string{key}});
+  if (it == tl_counters.end())
+    return nullopt;
+
+  Counter& counter = it->second;
+  int64_t pending, value;
+  if (__builtin_add_overflow(counter.pending, delta, &pending) ||
+      __builtin_add_overflow(counter.value, pending, &value)) {
+    return nullopt;
+  }
+
+  counter.pending = pending;
+  counter.touched = true;
+  return value;
+}
+
+void CounterCombiner::SetValue(DbIndex db, string_view key, int64_t value) {
+  Counter& counter = tl_counters[pair{db, string{key}}];
+  counter.value = value;
+  counter.touched = true;
+}
+
+void CounterCombiner::Flush() {
+  if (tl_flushing || tl_counters.empty())
+    return;
+  tl_flushing = true;
+
+  // The counters may change while the fiber waits for the shards, so the folds own their keys.
+  vector<Fold> folds;
+  for (auto it = tl_counters.begin(); it != tl_counters.end();) {
+    Counter& counter = it->second;
+    if (counter.pending != 0) {
+      folds.push_back(Fold{it->first.first, it->first.second, counter.pending, OpStatus::OK});
+      counter.pending = 0;
+    } else if (!counter.touched) {
+      tl_counters.erase(it++);
+      continue;
+    }
+    counter.touched = false;
+    ++it;
+  }
+
+  if (!folds.empty()) {
+    vector<vector<Fold*>> by_shard(shard_set->size());
+    for (Fold& fold : folds) {
+      by_shard[Shard(fold.key, shard_set->size())].push_back(&fold);
+    }
+
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* shard) { ApplyFolds(shard, &by_shard[shard->shard_id()]); },
+        [&](ShardId sid) { return !by_shard[sid].empty(); });
+  }
+
+  for (Fold& fold : folds) {
+    auto it = tl_counters.find(pair{fold.db, fold.key});
+    if (fold.result) {
+      if (it != tl_counters.end())
+        it->second.value = fold.result.value();
+      continue;
+    }
+
+    // The key was locked, so the increment is retried by the next Flush.
+    if (fold.result == OpStatus::SKIPPED) {
+      if (it == tl_counters.end())
+        it = tl_counters.emplace(pair{fold.db, fold.key}, Counter{}).first;
+
+      int64_t pending;
+      if (!__builtin_add_overflow(it->second.pending, fold.delta, &pending)) {
+        it->second.pending = pending;
+        continue;
+      }
+    }
+
+    // The next increment runs in the shard and replies with the error.
+    LOG_EVERY_N(WARNING, 1000) << "Dropped the combined increment of " << fold.key << ": "
+                               << fold.result.status();
+    if (it != tl_counters.end())
+      tl_counters.erase(it);
+  }
+
+  tl_flushing = false;
+}
+
+}  // namespace dfly
@@ -0,0 +1,54 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// Write-combining of the increments of the counters of --combined_counters, e.g. global request
+// totals that all the connections increment. Such a key resides in a single shard, so without
+// combining its shard thread runs all of the increments. Instead, every thread adds up the
+// increments of its connections and folds the sums into the owner shards every
+// combined_counters_flush_ms, see Flush.
+//
+// The combined increments are not atomic with the rest of the dataset: a thread replies to
+// INCRBY with the value that it last saw in the shard plus the increments that it has yet to
+// fold, and GET returns the value in the shard, i.e. without the pending increments. An increment
+// that fails once folded, e.g. since the key no longer holds an integer, is dropped.
+//
+// All the methods but Init are called in the thread of the connection.
+class CounterCombiner {
+ public:
+  // Reads --combined_counters. Called before the threads serve the connections.
+  static void Init();
+
+  // True if --combined_counters is set.
+  static bool Enabled();
+
+  // How often Flush should run, in milliseconds.
+  static uint32_t FlushPeriodMs();
+
+  // True if the increments of key are combined.
+  static bool IsCombined(std::string_view key);
+
+  // Adds delta to the pending increment of the key and returns the value to reply with. Returns
+  // nullopt if the increment should run as usual: the thread has not seen the value of the key
+  // yet, see SetValue, or the sum would overflow.
+  static std::optional<int64_t> TryAdd(DbIndex db, std::string_view key, int64_t delta);
+
+  // Records the value of the key after an increment that ran in the shard, from which on this
+  // thread combines the increments of the key.
+  static void SetValue(DbIndex db, std::string_view key, int64_t value);
+
+  // Folds the pending increments of this thread into the owner shards. Blocks the calling fiber.
+  // Forgets the keys that were not incremented since the previous call.
+  static void Flush();
+};
+
+}  // namespace dfly
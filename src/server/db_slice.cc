@@ -6,22 +6,52 @@
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/stream.h"
 }
 
+#include <absl/flags/flag.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+
 #include <boost/fiber/fiber.hpp>
 #include <boost/fiber/operations.hpp>
 
 #include "base/logging.h"
+#include "core/string_map.h"
 #include "server/engine_shard_set.h"
+#include "server/journal.h"
+#include "server/mapped_snapshot.h"
+#include "server/server_state.h"
 #include "server/tiered_storage.h"
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(std::string, cache_policy, "lru",
+          "Eviction policy in cache_mode. 'lru' - evicts from the tail of the stash buckets "
+          "and bumps up recently read entries, 'lfu' - evicts the entry with the lowest "
+          "access frequency out of the buckets the new key could be inserted into, 'gdsf' - "
+          "like 'lfu' but weighs the frequency of an entry by its memory usage, so that "
+          "large cold entries are evicted before small cold ones");
+
+ABSL_FLAG(std::string, maxmemory_policy, "noeviction",
+          "How a shard frees memory once it uses up its share of maxmemory. 'noeviction' - "
+          "rejects the writes that may add memory, 'allkeys-lru', 'allkeys-lfu' - evicts the least "
+          "recently or the least frequently used keys, 'volatile-lru', 'volatile-lfu', "
+          "'volatile-ttl' - evicts only the keys with an expiry, the last one those that expire "
+          "the soonest. Independent of the eviction of cache_mode.");
+
+ABSL_FLAG(std::string, db_maxmemory, "",
+          "Memory quotas of the dbs as a comma separated list of <db>:<bytes> pairs, e.g. "
+          "\"1:1G,2:512M\". Every shard enforces its share of a quota and the writes "
+          "of the db that exceeds it fail or evict the keys of that db only, depending on "
+          "maxmemory_policy. Can be changed with CONFIG SET db-maxmemory.");
+
 namespace dfly {
 
 using namespace std;
 using namespace util;
 using facade::OpStatus;
+using absl::GetFlag;
 
 namespace {
 
@@ -36,6 +66,19 @@ static_assert(kPrimeSegmentSize == 32288);
 // 24576
 static_assert(kExpireSegmentSize == 23528);
 
+// Removes the memcached flag of the entry from wherever it is kept.
+void EraseMCFlag(PrimeIterator it, DbTable* db) {
+  if (!it->second.HasFlag())
+    return;
+
+  if (it->first.HasInlineFlag()) {
+    it->first.ClearInlineFlag();
+  } else {
+    CHECK_EQ(1u, db->mcflag.Erase(it->first));
+  }
+  it->second.SetFlag(false);
+}
+
 void UpdateStatsOnDeletion(PrimeIterator it, DbTableStats* stats) {
   size_t value_heap_size = it->second.MallocUsed();
   stats->inline_keys -= it->first.IsInline();
@@ -44,13 +87,98 @@ void UpdateStatsOnDeletion(PrimeIterator it, DbTableStats* stats) {
     stats->strval_memory_usage -= value_heap_size;
 }
 
+// The inline expiry is 32 bits wide: periods below 2^31 ms are kept as is, longer periods are kept
+// in seconds with the msb set. Periods that can not be represented exactly are kept only
+// in the expire table.
+constexpr uint32_t kInlineSecBit = 1u << 31;
+
+bool PackInlineExpire(ExpirePeriod period, uint32_t* dest) {
+  uint64_t ms = period.duration_ms();
+  if (ms < kInlineSecBit) {
+    *dest = ms;
+    return true;
+  }
+
+  if (ms % 1000 || ms / 1000 >= kInlineSecBit)
+    return false;
+
+  *dest = (ms / 1000) | kInlineSecBit;
+  return true;
+}
+
+uint64_t UnpackInlineExpire(uint32_t val) {
+  return (val & kInlineSecBit) ? uint64_t(val & ~kInlineSecBit) * 1000 : val;
+}
+
+// Keeps the inline copy of the expiry in the key in sync with the expire table.
+void SyncInlineExpire(ExpirePeriod period, PrimeKey* key) {
+  uint32_t packed;
+  if (!PackInlineExpire(period, &packed) || !key->SetInlineExpire(packed))
+    key->ClearInlineExpire();
+}
+
+// Collections are loaded back on the first access, see TieredStorage::LoadCollection.
+bool IsExternalCollection(const PrimeValue& pv) {
+  return pv.IsExternal() && pv.ObjType() != OBJ_STRING;
+}
+
+// The lfu counter is only 2 bits wide so new keys start above 0. Otherwise they would be less
+// valuable than any key that was read once, and would be the first to go.
+constexpr unsigned kLfuInitFreq = 1;
+constexpr unsigned kLfuLogFactor = 4;
+
+// Increments the counter with probability 1/(freq * kLfuLogFactor + 1), similarly to redis
+// LFULogIncr. With kLfuLogFactor = 4 it takes ~5 reads to reach freq 2 and ~9 more to reach 3.
+void LfuTouch(const PrimeKey& key) {
+  unsigned freq = key.Freq();
+  if (freq == PrimeKey::kMaxFreq)
+    return;
+
+  // xorshift64, the slice is thread-local so there is no need in anything stronger.
+  thread_local uint64_t rnd = 0x9E3779B97F4A7C15ULL;
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 7;
+  rnd ^= rnd << 17;
+
+  if (rnd % (freq * kLfuLogFactor + 1) == 0)
+    key.SetFreq(freq + 1);
+}
+
+// The lookups reset the access age of the key, see DbSlice::AgeKeysStep. The age is written
+// only if it changes, so that the reads do not dirty the entries needlessly.
+inline void ResetAge(const PrimeKey& key) {
+  if (key.Age() != 0)
+    key.SetAge(0);
+}
+
+constexpr string_view kEvictionPolicyNames[] = {"noeviction",   "allkeys-lru",  "allkeys-lfu",
+                                                 "volatile-lru", "volatile-lfu", "volatile-ttl"};
+static_assert(ABSL_ARRAYSIZE(kEvictionPolicyNames) == size_t(EvictionPolicy::NUM_POLICIES));
+
+bool IsVolatilePolicy(EvictionPolicy policy) {
+  return policy >= EvictionPolicy::VOLATILE_LRU;
+}
+
+bool IsLfuPolicy(EvictionPolicy policy) {
+  return policy == EvictionPolicy::ALLKEYS_LFU || policy == EvictionPolicy::VOLATILE_LFU;
+}
+
+// The free memory below which EvictionStep starts evicting: 2% of the share of the shard in
+// maxmemory, so that the tables can keep growing meanwhile.
+ssize_t EvictionReserve() {
+  ssize_t share = max_memory_limit / shard_set->size();
+  return max<ssize_t>(share / 50, 2 * PrimeTable::kSegBytes);
+}
+
 class PrimeEvictionPolicy {
  public:
   static constexpr bool can_evict = true;  // we implement eviction functionality.
   static constexpr bool can_gc = true;
 
-  PrimeEvictionPolicy(DbIndex db_indx, bool can_evict, DbSlice* db_slice, int64_t mem_budget)
-      : db_slice_(db_slice), mem_budget_(mem_budget), db_indx_(db_indx), can_evict_(can_evict) {
+  PrimeEvictionPolicy(DbIndex db_indx, bool can_evict, bool lfu, bool size_aware,
+                      DbSlice* db_slice, int64_t mem_budget)
+      : db_slice_(db_slice), mem_budget_(mem_budget), db_indx_(db_indx), can_evict_(can_evict),
+        lfu_(lfu), size_aware_(size_aware) {
   }
 
   void RecordSplit(PrimeTable::Segment_t* segment) {
@@ -78,6 +206,8 @@ class PrimeEvictionPolicy {
   }
 
  private:
+  unsigned EvictLfu(const PrimeTable::HotspotBuckets& eb, PrimeTable* me);
+
   DbSlice* db_slice_;
   int64_t mem_budget_;
   unsigned evicted_ = 0;
@@ -87,6 +217,8 @@ class PrimeEvictionPolicy {
   // unlike static constexpr can_evict, this parameter tells whether we can evict
   // items in runtime.
   const bool can_evict_;
+  const bool lfu_;
+  const bool size_aware_;  // cache_policy=gdsf, see EvictLfu.
 };
 
 
@@ -103,7 +235,7 @@ unsigned PrimeEvictionPolicy::GarbageCollect(const PrimeTable::HotspotBuckets& e
     for (; !bucket_it.is_done(); ++bucket_it) {
       if (bucket_it->second.HasExpire()) {
         ++checked_;
-        auto [prime_it, exp_it] = db_slice_->ExpireIfNeeded(db_indx_, bucket_it);
+        auto prime_it = db_slice_->ExpirePrimeIfNeeded(db_indx_, bucket_it);
         if (prime_it.is_done())
           ++res;
       }
@@ -117,6 +249,9 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
   if (!can_evict_)
     return 0;
 
+  if (lfu_)
+    return EvictLfu(eb, me);
+
   constexpr size_t kNumStashBuckets = ABSL_ARRAYSIZE(eb.probes.by_type.stash_buckets);
 
   // choose "randomly" a stash bucket to evict an item.
@@ -124,6 +259,9 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
   auto last_slot_it = bucket_it;
   last_slot_it += (PrimeTable::kBucketWidth - 1);
   if (!last_slot_it.is_done()) {
+    // Locked entries may be read by reference from other threads, see StringFamily::Get.
+    if (db_slice_->IsLocked(db_indx_, last_slot_it->first) || last_slot_it->second.HasIoPending())
+      return 0;
     UpdateStatsOnDeletion(last_slot_it, db_slice_->MutableStats(db_indx_));
   }
   CHECK(me->ShiftRight(bucket_it));
@@ -132,13 +270,91 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
   return 1;
 }
 
+unsigned PrimeEvictionPolicy::EvictLfu(const PrimeTable::HotspotBuckets& eb, PrimeTable* me) {
+  constexpr size_t kNumStashBuckets = ABSL_ARRAYSIZE(eb.probes.by_type.stash_buckets);
+
+  // A free slot in the home bucket, its neighbour or in any of the stash buckets guarantees
+  // that the pending insertion succeeds, so we choose the victim only among those.
+  PrimeTable::bucket_iterator candidates[2 + kNumStashBuckets];
+  candidates[0] = eb.probes.by_type.regular_buckets[1];
+  candidates[1] = eb.probes.by_type.regular_buckets[2];
+  std::copy_n(eb.probes.by_type.stash_buckets, kNumStashBuckets, candidates + 2);
+
+  PrimeTable::bucket_iterator victim;
+  unsigned min_freq = UINT_MAX;
+
+  // With size_aware_ the victim is the entry with the lowest (freq + 1) / size, the priority of
+  // GreedyDual-Size-Frequency with a uniform cost, so that a cold large entry goes before a cold
+  // small one, which frees much less memory. Instead of the inflation value of GDSF, the
+  // frequencies are aged below, hence the cross-multiplied comparison of the current ones.
+  uint64_t victim_freq = 0, victim_size = 1;
+
+  for (auto bucket_it : candidates) {
+    for (; !bucket_it.is_done(); ++bucket_it) {
+      if (bucket_it->second.HasIoPending() || db_slice_->IsLocked(db_indx_, bucket_it->first))
+        continue;
+
+      unsigned freq = bucket_it->first.Freq();
+      min_freq = std::min(min_freq, freq);
+
+      // Ties are broken in favor of the later slots, i.e. stash buckets are preferred.
+      uint64_t size = 1;
+      if (size_aware_) {
+        size = sizeof(PrimeKey) + sizeof(PrimeValue) + bucket_it->first.MallocUsed() +
+               bucket_it->second.MallocUsed();
+      }
+      if (victim.is_done() || (freq + 1) * victim_size <= (victim_freq + 1) * size) {
+        victim_freq = freq;
+        victim_size = size;
+        victim = bucket_it;
+      }
+    }
+  }
+
+  if (victim.is_done())
+    return 0;
+
+  // There were no cold candidates, so we age them all. This way keys that were hot in the past
+  // but are not accessed anymore lose their advantage over time. The decay rate is therefore
+  // proportional to the eviction pressure in this part of the table.
+  if (min_freq > 0) {
+    for (auto bucket_it : candidates) {
+      for (; !bucket_it.is_done(); ++bucket_it) {
+        unsigned freq = bucket_it->first.Freq();
+        if (freq > 0)
+          bucket_it->first.SetFreq(freq - 1);
+      }
+    }
+  }
+
+  CHECK(db_slice_->Del(db_indx_, victim));
+  db_slice_->keyspace_events().MarkEvicted();
+  ++evicted_;
+
+  return 1;
+}
+
 }  // namespace
 
+bool ParseEvictionPolicy(string_view name, EvictionPolicy* policy) {
+  for (size_t i = 0; i < ABSL_ARRAYSIZE(kEvictionPolicyNames); ++i) {
+    if (name == kEvictionPolicyNames[i]) {
+      *policy = EvictionPolicy(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+string_view EvictionPolicyName(EvictionPolicy policy) {
+  return kEvictionPolicyNames[size_t(policy)];
+}
+
 #define ADD(x) (x) += o.x
 
 DbStats& DbStats::operator+=(const DbStats& o) {
   constexpr size_t kDbSz = sizeof(DbStats);
-  static_assert(kDbSz == 88);
+  static_assert(kDbSz == 112);
 
   DbTableStats::operator+=(o);
 
@@ -146,12 +362,15 @@ DbStats& DbStats::operator+=(const DbStats& o) {
   ADD(expire_count);
   ADD(bucket_count);
   ADD(table_mem_usage);
+  ADD(quota);
+  ADD(quota_evicted);
+  ADD(quota_rejected);
 
   return *this;
 }
 
 SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
-  static_assert(sizeof(SliceEvents) == 48, "You should update this function with new fields");
+  static_assert(sizeof(SliceEvents) == 144, "You should update this function with new fields");
 
   ADD(evicted_keys);
   ADD(expired_keys);
@@ -159,6 +378,15 @@ SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
   ADD(stash_unloaded);
   ADD(bumpups);
   ADD(garbage_checked);
+  ADD(active_expired_keys);
+  ADD(active_expire_lag_ms);
+  ADD(expired_fields);
+  ADD(stream_compacted_entries);
+  ADD(change_feed_records);
+  ADD(change_feed_dropped);
+
+  for (size_t i = 0; i < policy_evicted_keys.size(); ++i)
+    ADD(policy_evicted_keys[i]);
 
   return *this;
 }
@@ -167,6 +395,23 @@ SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
 
 DbSlice::DbSlice(uint32_t index, bool caching_mode, EngineShard* owner)
     : shard_id_(index), caching_mode_(caching_mode), owner_(owner) {
+  string cache_policy = GetFlag(FLAGS_cache_policy);
+  CHECK(cache_policy == "lru" || cache_policy == "lfu" || cache_policy == "gdsf")
+      << "Unknown cache_policy " << cache_policy;
+
+  // gdsf tracks the frequencies the same way as lfu.
+  gdsf_mode_ = (cache_policy == "gdsf");
+  lfu_mode_ = (cache_policy == "lfu") || gdsf_mode_;
+
+  string maxmemory_policy = GetFlag(FLAGS_maxmemory_policy);
+  CHECK(ParseEvictionPolicy(maxmemory_policy, &eviction_policy_))
+      << "Unknown maxmemory_policy " << maxmemory_policy;
+
+  string db_maxmemory = GetFlag(FLAGS_db_maxmemory);
+  vector<size_t> quotas;
+  CHECK(ParseDbQuotas(db_maxmemory, &quotas)) << "Invalid db_maxmemory " << db_maxmemory;
+  SetDbQuotas(quotas);
+
   db_arr_.emplace_back();
   CreateDb(0);
   expire_base_[0] = expire_base_[1] = 0;
@@ -186,6 +431,8 @@ DbSlice::~DbSlice() {
 auto DbSlice::GetStats() const -> Stats {
   Stats s;
   s.events = events_;
+  s.events.change_feed_records = change_feed_.sent_records();
+  s.events.change_feed_dropped = change_feed_.dropped_records();
   s.db_stats.resize(db_arr_.size());
 
   for (size_t i = 0; i < db_arr_.size(); ++i) {
@@ -197,29 +444,65 @@ auto DbSlice::GetStats() const -> Stats {
     stats.key_count = db_wrap.prime.size();
     stats.bucket_count = db_wrap.prime.bucket_count();
     stats.expire_count = db_wrap.expire.size();
-    stats.table_mem_usage = (db_wrap.prime.mem_usage() + db_wrap.expire.mem_usage());
+    stats.table_mem_usage = (db_wrap.prime.mem_usage() + db_wrap.expire.mem_usage() +
+                             db_wrap.expire_index.mem_usage() +
+                             db_wrap.field_expire_index.mem_usage() +
+                             db_wrap.sparse_stream_nodes.capacity() * sizeof(SparseStreamNode));
+  }
+
+  for (size_t i = 0; i < min(db_quotas_.size(), db_arr_.size()); ++i) {
+    DbStats& stats = s.db_stats[i];
+    stats.quota = db_quotas_[i].limit;
+    stats.quota_evicted = db_quotas_[i].evicted;
+    stats.quota_rejected = db_quotas_[i].rejected;
   }
-  s.small_string_bytes = CompactObj::GetStats().small_string_bytes;
+  CompactObj::Stats cobj_stats = CompactObj::GetStats();
+  s.small_string_bytes = cobj_stats.small_string_bytes;
+  s.compressed_strings = cobj_stats.compressed_strings;
+  s.compression_dict_bytes = cobj_stats.compression_dict_bytes;
+  s.dedup_strings = cobj_stats.dedup_strings;
+  s.dedup_bytes = cobj_stats.dedup_bytes;
+  s.dedup_saved_bytes = cobj_stats.dedup_saved_bytes;
 
   return s;
 }
 
-void DbSlice::Reserve(DbIndex db_ind, size_t key_size) {
+void DbSlice::Reserve(DbIndex db_ind, size_t key_size, size_t expire_size) {
   ActivateDb(db_ind);
 
   auto& db = db_arr_[db_ind];
   DCHECK(db);
 
-  db->prime.Reserve(key_size);
+  db->prime.Reserve(db->prime.size() + key_size);
+  if (expire_size)
+    db->expire.Reserve(db->expire.size() + expire_size);
 }
 
 auto DbSlice::Find(DbIndex db_index, string_view key, unsigned req_obj_type) const
     -> OpResult<PrimeIterator> {
-  auto it = FindExt(db_index, key).first;
+  if (!IsDbValid(db_index))
+    return OpStatus::KEY_NOTFOUND;
+
+  owner_->key_analyzer()->RecordOp(key);
+
+  // Same as FindExt but we do not need the expire iterator here.
+  auto it = db_arr_[db_index]->prime.Find(key);
+  if (IsValid(it) && IsExternalCollection(it->second)) {
+    owner_->tiered_storage()->LoadCollection(db_index, key);
+    it = db_arr_[db_index]->prime.Find(key);
+  }
+  if (IsValid(it) && it->second.HasExpire())
+    it = ExpirePrimeIfNeeded(db_index, it);
 
   if (!IsValid(it))
     return OpStatus::KEY_NOTFOUND;
 
+  ResetAge(it->first);
+  if (caching_mode_)
+    it = BumpUp(db_index, it);
+  else if (IsFreqTracked())
+    LfuTouch(it->first);  // the tiering unloads the values that are not read first.
+
   if (it->second.ObjType() != req_obj_type) {
     return OpStatus::WRONG_TYPE;
   }
@@ -233,6 +516,8 @@ pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(DbIndex db_ind, string_view
   if (!IsDbValid(db_ind))
     return res;
 
+  owner_->key_analyzer()->RecordOp(key);
+
   auto& db = *db_arr_[db_ind];
   res.first = db.prime.Find(key);
 
@@ -240,28 +525,77 @@ pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(DbIndex db_ind, string_view
     return res;
   }
 
+  // The iterators may be invalidated while the collection is read, so we look it up anew.
+  if (IsExternalCollection(res.first->second)) {
+    owner_->tiered_storage()->LoadCollection(db_ind, key);
+    return FindExt(db_ind, key);
+  }
+
   if (res.first->second.HasExpire()) {  // check expiry state
     res = ExpireIfNeeded(db_ind, res.first);
   }
 
-  if (caching_mode_ && IsValid(res.first)) {
-    if (!change_cb_.empty()) {
-      auto bump_cb = [&](PrimeTable::bucket_iterator bit) {
-        for (const auto& ccb : change_cb_) {
-          ccb.second(db_ind, bit);
-        }
-      };
-
-      db.prime.CVCUponBump(change_cb_.front().first, res.first, bump_cb);
-    }
+  if (!IsValid(res.first))
+    return res;
 
-    res.first = db.prime.BumpUp(res.first);
-    ++events_.bumpups;
+  ResetAge(res.first->first);
+  if (caching_mode_) {
+    res.first = BumpUp(db_ind, res.first);
+  } else if (IsFreqTracked()) {
+    LfuTouch(res.first->first);
   }
 
   return res;
 }
 
+void DbSlice::FindMany(DbIndex db_ind, ArgSlice keys, const FindManyCb& cb) const {
+  if (!IsDbValid(db_ind)) {
+    for (unsigned i = 0; i < keys.size(); ++i)
+      cb(i, PrimeIterator{});
+    return;
+  }
+
+  auto& db = *db_arr_[db_ind];
+  PrimeIterator batch[PrimeTable::kFindBatchSize];
+
+  for (size_t start = 0; start < keys.size(); start += PrimeTable::kFindBatchSize) {
+    ArgSlice chunk = keys.subspan(start, PrimeTable::kFindBatchSize);
+    db.prime.FindBatch(chunk, batch);
+
+    // Expiry and bumping move or erase entries, after that the remaining iterators in the batch
+    // may be stale, e.g. with repeated keys. We fall back to regular lookups in that case.
+    // The memory is already prefetched by then.
+    bool changed = false;
+    for (size_t j = 0; j < chunk.size(); ++j) {
+      owner_->key_analyzer()->RecordOp(chunk[j]);
+      PrimeIterator it = changed ? db.prime.Find(chunk[j]) : batch[j];
+
+      if (IsValid(it) && IsExternalCollection(it->second)) {
+        owner_->tiered_storage()->LoadCollection(db_ind, chunk[j]);
+        it = db.prime.Find(chunk[j]);
+        changed = true;
+      }
+
+      if (IsValid(it) && it->second.HasExpire()) {
+        it = ExpirePrimeIfNeeded(db_ind, it);
+        changed |= !IsValid(it);
+      }
+
+      if (IsValid(it))
+        ResetAge(it->first);
+
+      if (caching_mode_ && IsValid(it)) {
+        it = BumpUp(db_ind, it);
+        changed |= !lfu_mode_;  // lfu does not move the entries.
+      } else if (IsValid(it) && IsFreqTracked()) {
+        LfuTouch(it->first);
+      }
+
+      cb(start + j, it);
+    }
+  }
+}
+
 OpResult<pair<PrimeIterator, unsigned>> DbSlice::FindFirst(DbIndex db_index, ArgSlice args) {
   DCHECK(!args.empty());
 
@@ -301,10 +635,26 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
     for (const auto& ccb : change_cb_) {
       ccb.second(db_index, key);
     }
+  } else {
+    owner_->key_analyzer()->RecordOp(key);  // FindExt counts the lookup above.
   }
 
-  PrimeEvictionPolicy evp{db_index, bool(caching_mode_), this,
-                          int64_t(memory_budget_ - key.size())};
+  // Only the new keys are charged to the quota, hence the lookup, which is needed only once
+  // the db exceeds it.
+  if (IsOverQuota(db_index)) {
+    if (eviction_policy_ == EvictionPolicy::NO_EVICTION) {
+      auto res = FindExt(db_index, key);
+      if (IsValid(res.first))
+        return tuple_cat(res, make_tuple(false));
+
+      ++db_quotas_[db_index].rejected;
+      throw bad_alloc{};
+    }
+    eviction_pending_ = true;
+  }
+
+  PrimeEvictionPolicy evp{db_index, bool(caching_mode_), bool(lfu_mode_), bool(gdsf_mode_),
+                          this, int64_t(memory_budget() - key.size())};
 
   // Fast-path if change_cb_ is empty so we Find or Add using
   // the insert operation: twice more efficient.
@@ -312,6 +662,10 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
   PrimeIterator it;
   bool inserted;
 
+  // The insertion is a spike only if it split a segment or evicted to make room.
+  LatencyMonitor::Timer timer{nullptr};
+  int64_t budget_before = evp.mem_budget();
+
   // I try/catch just for sake of having a convenient place to set a breakpoint.
   try {
     tie(it, inserted) = db->prime.Insert(std::move(co_key), PrimeValue{}, evp);
@@ -319,7 +673,14 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
     throw e;
   }
 
+  if (evp.mem_budget() < budget_before)
+    timer.set_event("dash-split");
+  else if (evp.evicted() > 0)
+    timer.set_event("eviction-cycle");
+
   if (inserted) {  // new entry
+    if (lfu_mode_ || IsLfuPolicy(eviction_policy_))
+      it->first.SetFreq(kLfuInitFreq);
     db->stats.inline_keys += it->first.IsInline();
     db->stats.obj_memory_usage += it->first.MallocUsed();
 
@@ -329,7 +690,12 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
     events_.garbage_checked += evp.checked();
 
     it.SetVersion(NextVersion());
-    memory_budget_ = evp.mem_budget();
+    if (eviction_policy_ != EvictionPolicy::NO_EVICTION && evp.mem_budget() < EvictionReserve())
+      eviction_pending_ = true;
+    InvalidateTracking(it->first);
+    JournalKey(db_index, it->first);
+    FeedChange(db_index, it->first, ChangeFeed::Op::SET);
+    NotifyKeyspace(db_index, it->first, nullptr, 0);
 
     return make_tuple(it, ExpireIterator{}, true);
   }
@@ -337,6 +703,7 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
   auto& existing = it;
 
   DCHECK(IsValid(existing));
+  ResetAge(existing->first);
 
   ExpireIterator expire_it;
   if (existing->second.HasExpire()) {
@@ -349,10 +716,8 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
 
     if (expire_it->second.duration_ms() <= delta_ms) {
       db->expire.Erase(expire_it);
-
-      if (existing->second.HasFlag()) {
-        db->mcflag.Erase(existing->first);
-      }
+      existing->first.ClearInlineExpire();
+      EraseMCFlag(existing, db.get());
 
       // Keep the entry but reset the object.
       size_t value_heap_size = existing->second.MallocUsed();
@@ -362,6 +727,11 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(DbIndex db_index,
 
       existing->second.Reset();
       events_.expired_keys++;
+      InvalidateTracking(existing->first);
+      JournalKey(db_index, existing->first);
+      FeedChange(db_index, existing->first, ChangeFeed::Op::SET);
+      NotifyKeyspace(db_index, existing->first, "expired", KeyspaceEvents::EXPIRED);
+      NotifyKeyspace(db_index, existing->first, nullptr, 0);
 
       return make_tuple(existing, ExpireIterator{}, true);
     }
@@ -379,76 +749,231 @@ void DbSlice::ActivateDb(DbIndex db_ind) {
 void DbSlice::CreateDb(DbIndex index) {
   auto& db = db_arr_[index];
   if (!db) {
-    db.reset(new DbTable{owner_->memory_resource()});
+    db.reset(new DbTable{owner_->memory_resource(), owner_->table_memory_resource()});
+  }
+}
+
+PrimeIterator DbSlice::BumpUp(DbIndex db_ind, PrimeIterator it) const {
+  if (lfu_mode_) {
+    LfuTouch(it->first);
+    return it;
+  }
+
+  auto& db = *db_arr_[db_ind];
+  if (!change_cb_.empty()) {
+    auto bump_cb = [&](PrimeTable::bucket_iterator bit) {
+      for (const auto& ccb : change_cb_) {
+        ccb.second(db_ind, bit);
+      }
+    };
+
+    db.prime.CVCUponBump(change_cb_.front().first, it, bump_cb);
   }
+
+  ++events_.bumpups;
+  return db.prime.BumpUp(it);
 }
 
-bool DbSlice::Del(DbIndex db_ind, PrimeIterator it) {
+bool DbSlice::Del(DbIndex db_ind, PrimeIterator it, bool force_lazy) {
   if (!IsValid(it)) {
     return false;
   }
 
+  // The deletion changes the bucket, the snapshots save it before and the migrations forward it.
+  for (const auto& ccb : change_cb_) {
+    ccb.second(db_ind, ChangeReq{it});
+  }
+
   auto& db = db_arr_[db_ind];
   if (it->second.HasExpire()) {
     CHECK_EQ(1u, db->expire.Erase(it->first));
   }
+  if (it->second.HasIoPending())
+    owner_->tiered_storage()->CancelIo(db_ind, it);
 
-  if (it->second.HasFlag()) {
-    CHECK_EQ(1u, db->mcflag.Erase(it->first));
-  }
+  EraseMCFlag(it, db.get());
+  InvalidateTracking(it->first);
+  LogDeletion(db_ind, it->first);
+  JournalKey(db_ind, it->first);
+  FeedChange(db_ind, it->first, ChangeFeed::Op::DEL);
+  NotifyKeyspace(db_ind, it->first, "del", KeyspaceEvents::GENERIC);
 
   UpdateStatsOnDeletion(it, &db->stats);
+
+  // Values of many allocations that are not released lazily are freed by the erase.
+  LatencyMonitor::Timer timer{nullptr};
+  if (!owner_->LazyFreeIfNeeded(&it->second, force_lazy) &&
+      LazyFree::FreeCost(it->second) > 1) {
+    timer.set_event("large-free");
+  }
   db->prime.Erase(it);
 
   return true;
 }
 
-void DbSlice::FlushDb(DbIndex db_ind) {
-  // TODO: to add preeemptiveness by yielding inside clear.
+void DbSlice::FlushDb(DbIndex db_ind, bool async) {
+  DbTableArray flushed;
+  tracking_.InvalidateAll();
+  if (TieredStorage* tiered = owner_->tiered_storage())
+    tiered->CancelIo(db_ind);
+  if (Journal* journal = owner_->journal())
+    journal->RecordFlush(db_ind);
+
+  // The keys that are still in the mapped snapshot belong to the current tables.
+  if (MappedSnapshot* mapped = owner_->mapped_snapshot(); mapped && !shadow_swapped_)
+    mapped->Drop(db_ind);
+  change_feed_.RecordFlush(db_ind);
+
+  if (log_deltas_) {
+    delta_log_.resize(db_arr_.size());
+    for (size_t i = 0; i < delta_log_.size(); ++i) {
+      if (db_ind == kDbAll || db_ind == i) {
+        delta_log_[i].deleted_keys.clear();
+        delta_log_[i].flushed = true;
+      }
+    }
+  }
 
   if (db_ind != kDbAll) {
     auto& db = db_arr_[db_ind];
-    auto db_ptr = std::move(db);
+    flushed.push_back(std::move(db));
     DCHECK(!db);
     CreateDb(db_ind);
-    db_arr_[db_ind]->trans_locks.swap(db_ptr->trans_locks);
+    db_arr_[db_ind]->trans_locks.swap(flushed.back()->trans_locks);
+  } else {
+    flushed = std::move(db_arr_);
+    db_arr_.resize(flushed.size());
+    for (size_t i = 0; i < db_arr_.size(); ++i) {
+      if (flushed[i]) {
+        CreateDb(i);
+        db_arr_[i]->trans_locks.swap(flushed[i]->trans_locks);
+      }
+    }
+  }
 
-    boost::fibers::fiber([db_ptr = std::move(db_ptr)]() mutable { db_ptr.reset(); }).detach();
+  if (!async)
+    return;  // flushed tables are released when going out of scope.
 
-    return;
+  for (auto& db : flushed) {
+    if (db && db->prime.size() + db->expire.size() + db->mcflag.size() > 0)
+      flushed_tables_.push_back(std::move(db));
   }
+}
 
-  auto all_dbs = std::move(db_arr_);
-  db_arr_.resize(all_dbs.size());
+void DbSlice::CreateShadow() {
+  DCHECK(!has_shadow_);
+  shadow_arr_.resize(db_arr_.size());
   for (size_t i = 0; i < db_arr_.size(); ++i) {
-    if (all_dbs[i]) {
-      CreateDb(i);
-      db_arr_[i]->trans_locks.swap(all_dbs[i]->trans_locks);
-    }
+    if (db_arr_[i])
+      shadow_arr_[i].reset(new DbTable{owner_->memory_resource(), owner_->table_memory_resource()});
   }
+  has_shadow_ = true;
+}
 
-  boost::fibers::fiber([all_dbs = std::move(all_dbs)]() mutable {
-    for (auto& db : all_dbs) {
-      db.reset();
+void DbSlice::CommitShadow() {
+  DCHECK(has_shadow_ && !shadow_swapped_);
+  tracking_.InvalidateAll();
+  if (TieredStorage* tiered = owner_->tiered_storage())
+    tiered->CancelIo(kDbAll);
+  if (MappedSnapshot* mapped = owner_->mapped_snapshot())
+    mapped->Drop(kDbAll);
+  change_feed_.RecordFlush(kDbAll);
+
+  if (log_deltas_) {
+    delta_log_.resize(db_arr_.size());
+    for (DeltaLog& log : delta_log_) {
+      log.deleted_keys.clear();
+      log.flushed = true;
     }
-  }).detach();
+  }
+
+  // The locks of the running transactions move to the new tables, like in FlushDb.
+  if (shadow_arr_.size() < db_arr_.size())
+    shadow_arr_.resize(db_arr_.size());
+  for (size_t i = 0; i < db_arr_.size(); ++i) {
+    if (!db_arr_[i])
+      continue;
+    if (!shadow_arr_[i])
+      shadow_arr_[i].reset(new DbTable{owner_->memory_resource(), owner_->table_memory_resource()});
+    shadow_arr_[i]->trans_locks.swap(db_arr_[i]->trans_locks);
+  }
+
+  // The previous tables are released as the shadow ones.
+  db_arr_.swap(shadow_arr_);
+  DropShadow();
+}
+
+void DbSlice::DropShadow() {
+  DCHECK(!shadow_swapped_);
+  for (auto& db : shadow_arr_) {
+    if (db && db->prime.size() + db->expire.size() + db->mcflag.size() > 0)
+      flushed_tables_.push_back(std::move(db));
+  }
+  shadow_arr_.clear();
+  has_shadow_ = false;
+}
+
+void DbSlice::SwapShadow() {
+  db_arr_.swap(shadow_arr_);
+  change_cb_.swap(stashed_change_cb_);
+  shadow_swapped_ = !shadow_swapped_;
+}
+
+DbSlice::ShadowScope::ShadowScope(DbSlice* slice, bool active) : slice_(slice) {
+  if (active && slice->has_shadow_) {
+    slice->SwapShadow();
+    swapped_ = true;
+  }
+}
+
+DbSlice::ShadowScope::~ShadowScope() {
+  if (swapped_)
+    slice_->SwapShadow();
+}
+
+bool DbSlice::ReleaseFlushedStep(unsigned count) {
+  if (flushed_tables_.empty())
+    return false;
+
+  // A snapshot may still serialize the flushed table, then it is released by the snapshot.
+  auto& db = flushed_tables_.front();
+  if (db->use_count() > 1 || !db->ClearStep(count)) {
+    flushed_tables_.pop_front();
+  }
+
+  return !flushed_tables_.empty();
+}
+
+size_t DbSlice::flush_pending_keys() const {
+  size_t res = 0;
+  for (const auto& db : flushed_tables_) {
+    res += db->prime.size();
+  }
+
+  return res;
 }
 
 // Returns true if a state has changed, false otherwise.
 bool DbSlice::UpdateExpire(DbIndex db_ind, PrimeIterator it, uint64_t at) {
   auto& db = *db_arr_[db_ind];
   if (at == 0 && it->second.HasExpire()) {
+    BumpVersion(db_ind, it);
     CHECK_EQ(1u, db.expire.Erase(it->first));
     it->second.SetExpire(false);
+    it->first.ClearInlineExpire();
 
     return true;
   }
 
   if (!it->second.HasExpire() && at) {
+    BumpVersion(db_ind, it);
     uint64_t delta = at - expire_base_[0];  // TODO: employ multigen expire updates.
+    ExpirePeriod period(delta);
 
-    CHECK(db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta)).second);
+    CHECK(db.expire.Insert(it->first.AsRef(), period).second);
     it->second.SetExpire(true);
+    SyncInlineExpire(period, &it->first);
+    db.expire_index.Add(at, it->first.HashCode());
 
     return true;
   }
@@ -456,21 +981,48 @@ bool DbSlice::UpdateExpire(DbIndex db_ind, PrimeIterator it, uint64_t at) {
   return false;
 }
 
-void DbSlice::SetMCFlag(DbIndex db_ind, PrimeKey key, uint32_t flag) {
+void DbSlice::UpdateExpireTime(DbIndex db_ind, PrimeIterator it, ExpireIterator exp_it,
+                               uint64_t at) {
+  DCHECK(it->second.HasExpire());
+  BumpVersion(db_ind, it);
+
+  uint64_t prev_at = ExpireTime(exp_it);
+  exp_it->second = FromAbsoluteTime(at);
+  SyncInlineExpire(exp_it->second, &it->first);
+
+  // Postponed deadlines are rescheduled lazily once the indexed one is due, see DeleteExpired.
+  // This way refreshing a ttl does not bloat the index.
+  if (at < prev_at)
+    db_arr_[db_ind]->expire_index.Add(at, it->first.HashCode());
+}
+
+void DbSlice::SetMCFlag(DbIndex db_ind, PrimeIterator it, uint32_t flag) {
   auto& db = *db_arr_[db_ind];
   if (flag == 0) {
-    db.mcflag.Erase(key);
-  } else {
-    auto [it, inserted] = db.mcflag.Insert(std::move(key), flag);
+    EraseMCFlag(it, &db);
+    return;
+  }
+
+  // Keys do not change after insertion, so a key either always has room for the inline flag
+  // or always keeps it in the table.
+  if (!it->first.SetInlineFlag(flag)) {
+    auto [flag_it, inserted] = db.mcflag.Insert(it->first.AsRef(), flag);
     if (!inserted)
-      it->second = flag;
+      flag_it->second = flag;
   }
+  it->second.SetFlag(true);
 }
 
-uint32_t DbSlice::GetMCFlag(DbIndex db_ind, const PrimeKey& key) const {
+uint32_t DbSlice::GetMCFlag(DbIndex db_ind, PrimeIterator it) const {
+  if (!it->second.HasFlag())
+    return 0;
+
+  if (it->first.HasInlineFlag())
+    return it->first.InlineFlag();
+
   auto& db = *db_arr_[db_ind];
-  auto it = db.mcflag.Find(key);
-  return it.is_done() ? 0 : it->second;
+  auto flag_it = db.mcflag.Find(it->first);
+  return flag_it.is_done() ? 0 : flag_it->second;
 }
 
 PrimeIterator DbSlice::AddNew(DbIndex db_ind, string_view key, PrimeValue obj,
@@ -499,7 +1051,10 @@ pair<PrimeIterator, bool> DbSlice::AddOrFind(DbIndex db_ind, string_view key, Pr
   if (expire_at_ms) {
     it->second.SetExpire(true);
     uint64_t delta = expire_at_ms - expire_base_[0];
-    CHECK(db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta)).second);
+    ExpirePeriod period(delta);
+    CHECK(db.expire.Insert(it->first.AsRef(), period).second);
+    SyncInlineExpire(period, &it->first);
+    db.expire_index.Add(expire_at_ms, it->first.HashCode());
   }
 
   return res;
@@ -522,14 +1077,14 @@ bool DbSlice::Acquire(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
   bool lock_acquired = true;
 
   if (lock_args.args.size() == 1) {
-    lock_acquired = lt[lock_args.args.front()].Acquire(mode);
+    lock_acquired = lt[KeyLockFp(lock_args.args.front())].Acquire(mode);
   } else {
     uniq_keys_.clear();
 
     for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
       auto s = lock_args.args[i];
       if (uniq_keys_.insert(s).second) {
-        bool res = lt[s].Acquire(mode);
+        bool res = lt[KeyLockFp(s)].Acquire(mode);
         lock_acquired &= res;
       }
     }
@@ -553,7 +1108,7 @@ void DbSlice::Release(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
     for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
       auto s = lock_args.args[i];
       if (uniq_keys_.insert(s).second) {
-        auto it = lt.find(s);
+        auto it = lt.find(KeyLockFp(s));
         CHECK(it != lt.end());
         it->second.Release(mode);
         if (it->second.IsFree()) {
@@ -569,8 +1124,7 @@ bool DbSlice::CheckLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) con
 
   const auto& lt = db_arr_[lock_args.db_index]->trans_locks;
   for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-    auto s = lock_args.args[i];
-    auto it = lt.find(s);
+    auto it = lt.find(KeyLockFp(lock_args.args[i]));
     if (it != lt.end() && !it->second.Check(mode)) {
       return false;
     }
@@ -578,6 +1132,20 @@ bool DbSlice::CheckLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) con
   return true;
 }
 
+bool DbSlice::CheckOwnLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) const {
+  DCHECK(!lock_args.args.empty());
+
+  const auto& lt = db_arr_[lock_args.db_index]->trans_locks;
+  for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
+    auto it = lt.find(KeyLockFp(lock_args.args[i]));
+    DCHECK(it != lt.end());
+    if (it == lt.end() || !it->second.CheckOwned(mode)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
   auto& db = db_arr_[db_ind];
   for (const auto& ccb : change_cb_) {
@@ -585,6 +1153,8 @@ void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
   }
   size_t value_heap_size = it->second.MallocUsed();
   db->stats.obj_memory_usage -= value_heap_size;
+  if (it->second.HasIoPending())
+    shard_owner()->tiered_storage()->CancelIo(db_ind, it);
 
   if (it->second.ObjType() == OBJ_STRING) {
     db->stats.strval_memory_usage -= value_heap_size;
@@ -605,6 +1175,15 @@ void DbSlice::PostUpdate(DbIndex db_ind, PrimeIterator it) {
   db->stats.obj_memory_usage += value_heap_size;
   if (it->second.ObjType() == OBJ_STRING)
     db->stats.strval_memory_usage += value_heap_size;
+
+  // The values that grow past the quota are evicted with the other keys of the db.
+  if (eviction_policy_ != EvictionPolicy::NO_EVICTION && IsOverQuota(db_ind))
+    eviction_pending_ = true;
+
+  InvalidateTracking(it->first);
+  JournalKey(db_ind, it->first);
+  FeedChange(db_ind, it->first, ChangeFeed::Op::SET);
+  NotifyKeyspace(db_ind, it->first, nullptr, 0);
 }
 
 pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(DbIndex db_ind,
@@ -622,7 +1201,19 @@ pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(DbIndex db_ind,
   if (now_ms_ < expire_time)
     return make_pair(it, expire_it);
 
+  for (const auto& ccb : change_cb_) {
+    ccb.second(db_ind, ChangeReq{it});
+  }
+
   db->expire.Erase(expire_it);
+  if (it->second.HasIoPending())
+    owner_->tiered_storage()->CancelIo(db_ind, it);
+  EraseMCFlag(it, db.get());
+  InvalidateTracking(it->first);
+  LogDeletion(db_ind, it->first);
+  JournalKey(db_ind, it->first);
+  FeedChange(db_ind, it->first, ChangeFeed::Op::EXPIRED);
+  NotifyKeyspace(db_ind, it->first, "expired", KeyspaceEvents::EXPIRED);
   UpdateStatsOnDeletion(it, &db->stats);
   db->prime.Erase(it);
   ++events_.expired_keys;
@@ -630,6 +1221,103 @@ pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(DbIndex db_ind,
   return make_pair(PrimeIterator{}, ExpireIterator{});
 }
 
+PrimeIterator DbSlice::ExpirePrimeIfNeeded(DbIndex db_ind, PrimeIterator it) const {
+  DCHECK(it->second.HasExpire());
+
+  if (it->first.HasInlineExpire()) {
+    time_t expire_time = expire_base_[0] + UnpackInlineExpire(it->first.InlineExpire());
+    DCHECK_EQ(expire_time, ExpireTime(db_arr_[db_ind]->expire.Find(it->first)));
+
+    if (now_ms_ < expire_time)
+      return it;
+  }
+
+  return ExpireIfNeeded(db_ind, it).first;
+}
+
+bool DbSlice::ExpireFieldsIfNeeded(DbIndex db_ind, PrimeIterator it) {
+  const PrimeValue& pv = it->second;
+  if (pv.ObjType() != OBJ_HASH || pv.Encoding() != OBJ_ENCODING_HT)
+    return true;
+
+  StringMap* sm = (StringMap*)pv.RObjPtr();
+  uint32_t now_sec = now_ms_ / 1000;
+  if (!sm->HasExpired(now_sec))
+    return true;
+
+  PreUpdate(db_ind, it);
+  events_.expired_fields += sm->ExpireFields(now_sec);
+  PostUpdate(db_ind, it);
+
+  if (sm->Empty()) {
+    Del(db_ind, it);
+    return false;
+  }
+  return true;
+}
+
+void DbSlice::InvalidateTracking(const PrimeKey& key) const {
+  if (tracking_.empty())
+    return;
+
+  string tmp;
+  tracking_.Invalidate(key.GetSlice(&tmp));
+}
+
+void DbSlice::LogDeletion(DbIndex db_ind, const PrimeKey& key) const {
+  if (!log_deltas_ || shadow_swapped_)
+    return;
+
+  if (delta_log_.size() <= db_ind)
+    delta_log_.resize(db_ind + 1);
+  delta_log_[db_ind].deleted_keys.insert(key.ToString());
+}
+
+void DbSlice::JournalKey(DbIndex db_ind, const PrimeKey& key) const {
+  Journal* journal = owner_->journal();
+  if (!journal || !journal->IsActive() || shadow_swapped_)
+    return;
+
+  string tmp;
+  journal->Touch(db_ind, key.GetSlice(&tmp));
+}
+
+void DbSlice::FeedChange(DbIndex db_ind, const PrimeKey& key, ChangeFeed::Op op) const {
+  if (!change_feed_.active() || shadow_swapped_)
+    return;
+
+  string tmp;
+  change_feed_.Record(db_ind, key.GetSlice(&tmp), op);
+}
+
+void DbSlice::NotifyKeyspace(DbIndex db_ind, const PrimeKey& key, const char* event,
+                             uint32_t event_class) const {
+  if (!keyspace_events_.active())
+    return;
+
+  string tmp;
+  keyspace_events_.Record(db_ind, key.GetSlice(&tmp), event, event_class);
+}
+
+void DbSlice::BumpVersion(DbIndex db_ind, PrimeIterator it) {
+  // The running snapshots save the bucket before it gets a version they skip.
+  for (const auto& ccb : change_cb_) {
+    ccb.second(db_ind, ChangeReq{it});
+  }
+  it.SetVersion(NextVersion());
+  JournalKey(db_ind, it->first);
+  FeedChange(db_ind, it->first, ChangeFeed::Op::SET);
+  NotifyKeyspace(db_ind, it->first, nullptr, 0);
+}
+
+auto DbSlice::TakeDeltaLog() -> vector<DeltaLog> {
+  log_deltas_ = true;
+  vector<DeltaLog> res = std::move(delta_log_);
+  delta_log_.clear();
+
+  return res;
+}
+
 uint64_t DbSlice::RegisterOnChange(ChangeCallback cb) {
   uint64_t ver = NextVersion();
   change_cb_.emplace_back(ver, std::move(cb));
@@ -651,32 +1339,362 @@ auto DbSlice::DeleteExpired(DbIndex db_ind, unsigned count) -> DeleteExpiredStat
   auto& db = *db_arr_[db_ind];
   DeleteExpiredStats result;
 
-  auto cb = [&](ExpireIterator it) {
-    result.traversed++;
-    time_t ttl = ExpireTime(it) - Now();
-    if (ttl <= 0) {
-      auto prime_it = db.prime.Find(it->first);
-      CHECK(!prime_it.is_done());
-      ExpireIfNeeded(db_ind, prime_it);
-      ++result.deleted;
-    } else {
-      result.survivor_ttl_sum += ttl;
+  // Each index entry is a hash of a key that was due at the time it was indexed. We check its
+  // logical bucket in the expire table, which also catches other due keys living there.
+  auto cb = [&](uint64_t key_hash) {
+    db.expire.TraverseHashBucket(key_hash, [&](ExpireIterator it) {
+      result.traversed++;
+      time_t expire_time = ExpireTime(it);
+      if (expire_time <= now_ms_) {
+        auto prime_it = db.prime.Find(it->first);
+        CHECK(!prime_it.is_done());
+        ExpireIfNeeded(db_ind, prime_it);
+        ++result.deleted;
+        result.lag_ms_sum += now_ms_ - expire_time;
+      } else if (it->first.HashCode() == key_hash) {
+        // The deadline of the indexed key has been postponed since, see UpdateExpireTime.
+        db.expire_index.Add(expire_time, key_hash);
+      }
+    });
+  };
+
+  result.popped = db.expire_index.PopDue(now_ms_, count, cb);
+
+  events_.active_expired_keys += result.deleted;
+  events_.active_expire_lag_ms += result.lag_ms_sum;
+
+  return result;
+}
+
+auto DbSlice::DeleteExpiredFields(DbIndex db_ind, unsigned count) -> DeleteExpiredStats {
+  auto& db = *db_arr_[db_ind];
+  DeleteExpiredStats result;
+  size_t expired_before = events_.expired_fields;
+
+  // The hash is found in the logical bucket of the indexed key hash, like in DeleteExpired.
+  // It is expired after the traversal, which must not delete the entries.
+  auto cb = [&](uint64_t key_hash) {
+    PrimeIterator hash_it;
+    db.prime.TraverseHashBucket(key_hash, [&](PrimeIterator it) {
+      ++result.traversed;
+      if (it->first.HashCode() == key_hash && it->second.ObjType() == OBJ_HASH)
+        hash_it = it;
+    });
+
+    // The key was deleted or its value replaced since it was indexed.
+    if (!IsValid(hash_it) || hash_it->second.Encoding() != OBJ_ENCODING_HT)
+      return;
+
+    const StringMap* sm = (const StringMap*)hash_it->second.RObjPtr();
+    if (ExpireFieldsIfNeeded(db_ind, hash_it) && sm->next_expiry() != 0) {
+      // The deadlines that remain, or that were postponed since the key was indexed.
+      db.field_expire_index.Add(sm->next_expiry() * 1000ULL, key_hash);
+    }
+  };
+
+  result.popped = db.field_expire_index.PopDue(now_ms_, count, cb);
+  result.deleted = events_.expired_fields - expired_before;
+
+  return result;
+}
+
+void DbSlice::MarkSparseStreamNode(DbIndex db_ind, const PrimeKey& key, uint64_t ms,
+                                   uint64_t seq) {
+  // 24 bytes per mark, so the queue of a db takes at most 1.5MB.
+  constexpr size_t kMaxSparseStreamNodes = 1 << 16;
+
+  auto& nodes = db_arr_[db_ind]->sparse_stream_nodes;
+  uint64_t key_hash = key.HashCode();
+  if (!nodes.empty()) {
+    const SparseStreamNode& last = nodes.back();
+    if (last.key_hash == key_hash && last.ms == ms && last.seq == seq)
+      return;
+  }
+
+  if (nodes.size() < kMaxSparseStreamNodes)
+    nodes.push_back(SparseStreamNode{key_hash, ms, seq});
+}
+
+unsigned DbSlice::CompactStreams(DbIndex db_ind, unsigned count) {
+  // The snapshots may serialize a stream across preemptions, so its nodes stay in place until
+  // they are done. The marks wait for them in the queue.
+  if (!change_cb_.empty())
+    return 0;
+
+  auto& db = *db_arr_[db_ind];
+  auto& nodes = db.sparse_stream_nodes;
+  unsigned popped = 0;
+  vector<SparseStreamNode> locked;
+
+  for (; popped < count && !nodes.empty(); ++popped) {
+    SparseStreamNode node = nodes.back();
+    nodes.pop_back();
+
+    // The stream is found in the logical bucket of the key hash, like in DeleteExpired.
+    PrimeIterator stream_it;
+    db.prime.TraverseHashBucket(node.key_hash, [&](PrimeIterator it) {
+      if (it->first.HashCode() == node.key_hash && it->second.ObjType() == OBJ_STREAM)
+        stream_it = it;
+    });
+
+    // The key was deleted or its value replaced since it was marked.
+    if (!IsValid(stream_it))
+      continue;
+
+    // The compaction runs outside of the transactions, which may hold pointers into the nodes
+    // of the streams they lock, e.g. the blocked readers.
+    if (IsLocked(db_ind, stream_it->first)) {
+      locked.push_back(node);
+      continue;
     }
+
+    streamID master_id{node.ms, node.seq};
+    events_.stream_compacted_entries +=
+        streamCompactNode((stream*)stream_it->second.RObjPtr(), &master_id);
+  }
+
+  nodes.insert(nodes.begin(), locked.begin(), locked.end());
+  return popped;
+}
+
+unsigned DbSlice::ShrinkTables(DbIndex db_ind, unsigned count) {
+  // Merging moves entries across buckets and breaks the versioning used by snapshots.
+  // The tables that are reserved for a load are sparse until it is done.
+  if (!change_cb_.empty() || ServerState::tlocal()->gstate() == GlobalState::LOADING)
+    return 0;
+
+  auto& db = *db_arr_[db_ind];
+  unsigned merged = 0;
+
+  auto shrink = [&](auto& table, uint32_t* cursor) {
+    // Merge requires two buddy segments to be at most half full together,
+    // so there is no point to try if the table is loaded above that.
+    if (table.size() * 4 > table.bucket_count())
+      return;
+
+    unsigned prev_segments = table.unique_segments();
+    for (unsigned i = 0; i < count; ++i) {
+      *cursor = table.MergeStep(*cursor);
+      if (*cursor == 0)
+        break;
+    }
+    merged += prev_segments - table.unique_segments();
+  };
+
+  shrink(db.prime, &db.prime_merge_cursor);
+  shrink(db.expire, &db.expire_merge_cursor);
+
+  return merged;
+}
+
+void DbSlice::AgeKeysStep(uint64_t period_ms, unsigned budget) {
+  if (!aging_.active) {
+    if (uint64_t(now_ms_) < aging_.next_pass_ms)
+      return;
+
+    aging_.next_pass_ms = now_ms_ + period_ms;
+    aging_.db_indx = 0;
+    aging_.cursor = PrimeTable::cursor{};
+    aging_.active = true;
+  }
+
+  uint64_t pass = aging_.passes + 1;
+  auto cb = [pass](PrimeIterator it) {
+    unsigned age = it->first.Age();
+    if (age < PrimeKey::kMaxAge && pass % (1u << age) == 0)
+      it->first.SetAge(age + 1);
   };
 
-  unsigned i = 0;
-  for (; i < count / 3; ++i) {
-    db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+  unsigned iters = 0;
+  while (aging_.db_indx < db_arr_.size()) {
+    if (!IsDbValid(aging_.db_indx)) {
+      ++aging_.db_indx;
+      continue;
+    }
+
+    if (iters++ == budget)
+      return;
+
+    aging_.cursor = db_arr_[aging_.db_indx]->prime.Traverse(aging_.cursor, cb);
+    if (!aging_.cursor) {
+      ++aging_.db_indx;
+    }
   }
 
-  // continue traversing only if we had strong deletion rate based on the first sample.
-  if (result.deleted * 4 > result.traversed) {
-    for (; i < count; ++i) {
-      db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+  aging_.active = false;
+  aging_.passes = pass;
+  aging_.pass_end_ms[pass % AgingState::kPassesKept] = now_ms_;
+}
+
+uint64_t DbSlice::IdleTimeMs(const PrimeKey& key) const {
+  unsigned age = key.Age();
+  if (age == 0 || aging_.passes == 0)
+    return 0;
+
+  // A key of age a was looked up before the pass that aged it to 1, about 2^(a-1) passes ago.
+  uint64_t back = min<uint64_t>(1ULL << (age - 1), aging_.passes);
+  uint64_t end_ms = aging_.pass_end_ms[(aging_.passes - back + 1) % AgingState::kPassesKept];
+
+  return uint64_t(now_ms_) > end_ms ? now_ms_ - end_ms : 0;
+}
+
+void DbSlice::SetDbQuotas(const vector<size_t>& quotas) {
+  db_quotas_.resize(max(db_quotas_.size(), quotas.size()));
+  has_quotas_ = false;
+  for (size_t i = 0; i < db_quotas_.size(); ++i) {
+    size_t quota = i < quotas.size() ? quotas[i] : 0;
+    db_quotas_[i].limit = quota ? max<size_t>(quota / shard_set->size(), 1) : 0;
+    has_quotas_ |= quota > 0;
+  }
+}
+
+bool DbSlice::ParseDbQuotas(string_view spec, vector<size_t>* quotas) {
+  vector<size_t> res;
+  for (string_view item : absl::StrSplit(spec, ',', absl::SkipWhitespace())) {
+    pair<string_view, string_view> db_quota = absl::StrSplit(item, absl::MaxSplits(':', 1));
+    uint32_t db_ind = 0;
+    int64_t bytes = 0;
+    if (!absl::SimpleAtoi(db_quota.first, &db_ind) || db_ind >= kDbAll ||
+        !ParseHumanReadableBytes(db_quota.second, &bytes) || bytes < 0) {
+      return false;
     }
+    if (res.size() <= db_ind)
+      res.resize(db_ind + 1);
+    res[db_ind] = bytes;
   }
 
-  return result;
+  *quotas = std::move(res);
+  return true;
+}
+
+size_t DbSlice::DbMemoryUsage(DbIndex db_ind) const {
+  if (!IsDbValid(db_ind))
+    return 0;
+
+  const DbTable& db = *db_arr_[db_ind];
+  return db.prime.mem_usage() + db.expire.mem_usage() + db.expire_index.mem_usage() +
+         db.field_expire_index.mem_usage() + db.stats.obj_memory_usage;
+}
+
+void DbSlice::SetMemoryBudget(int64_t budget) {
+  memory_budget_ = budget;
+  budget_used_memory_ = owner_->UsedMemory();
+}
+
+ssize_t DbSlice::memory_budget() const {
+  if (memory_budget_ == SSIZE_MAX)
+    return SSIZE_MAX;
+
+  return memory_budget_ - (ssize_t(owner_->UsedMemory()) - ssize_t(budget_used_memory_));
+}
+
+bool DbSlice::IsFreqTracked() const {
+  // See Find and BumpUp.
+  if (caching_mode_)
+    return lfu_mode_;
+  return owner_->tiered_storage() != nullptr || IsLfuPolicy(eviction_policy_);
+}
+
+PrimeIterator DbSlice::PickEvictionVictim(DbIndex db_ind, PrimeTable::cursor* cursor) {
+  // Returns true if the candidate l is a better victim than r.
+  auto better = [&](PrimeIterator l, PrimeIterator r) {
+    switch (eviction_policy_) {
+      case EvictionPolicy::ALLKEYS_LRU:
+      case EvictionPolicy::VOLATILE_LRU:
+        return l->first.Age() > r->first.Age();
+      case EvictionPolicy::ALLKEYS_LFU:
+      case EvictionPolicy::VOLATILE_LFU:
+        return l->first.Freq() < r->first.Freq();
+      default:
+        return ExpireTime(db_arr_[db_ind]->expire.Find(l->first)) <
+               ExpireTime(db_arr_[db_ind]->expire.Find(r->first));
+    }
+  };
+
+  bool is_volatile = IsVolatilePolicy(eviction_policy_);
+  PrimeIterator victim;
+  auto cb = [&](PrimeIterator it) {
+    if ((is_volatile && !it->second.HasExpire()) || it->second.IsExternal() ||
+        it->second.HasIoPending() || IsLocked(db_ind, it->first)) {
+      return;
+    }
+    if (victim.is_done() || better(it, victim))
+      victim = it;
+  };
+
+  *cursor = db_arr_[db_ind]->prime.Traverse(*cursor, cb);
+  return victim;
+}
+
+unsigned DbSlice::EvictionStep(unsigned max_buckets) {
+  eviction_pending_ = false;
+  if (eviction_policy_ == EvictionPolicy::NO_EVICTION)
+    return 0;
+
+  bool below_reserve = memory_budget() < EvictionReserve();
+  if (!below_reserve && !has_quotas_)
+    return 0;
+
+  // The master propagates its evictions to the replicas, the snapshot being loaded is complete.
+  const ServerState& ss = *ServerState::tlocal();
+  if (!ss.is_master || ss.gstate() == GlobalState::LOADING)
+    return 0;
+
+  LatencyMonitor::Timer timer{"eviction-cycle"};
+
+  bool is_volatile = IsVolatilePolicy(eviction_policy_);
+  unsigned evicted = 0;
+  unsigned iters = 0;
+
+  while (below_reserve && iters < max_buckets && memory_budget() < EvictionReserve()) {
+    if (evict_db_indx_ >= db_arr_.size()) {
+      evict_db_indx_ = 0;
+      if (iters == 0)
+        break;  // no valid databases.
+    }
+
+    DbIndex db_ind = evict_db_indx_;
+    if (!IsDbValid(db_ind) || (is_volatile && db_arr_[db_ind]->expire.size() == 0)) {
+      ++evict_db_indx_;
+      evict_cursor_ = PrimeTable::cursor{};
+      continue;
+    }
+
+    ++iters;
+    PrimeIterator victim = PickEvictionVictim(db_ind, &evict_cursor_);
+    if (!evict_cursor_)
+      ++evict_db_indx_;
+
+    if (victim.is_done())
+      continue;
+
+    Del(db_ind, victim);
+    keyspace_events_.MarkEvicted();
+    ++evicted;
+  }
+
+  // The dbs over their quotas evict only their own keys.
+  for (DbIndex db_ind = 0; has_quotas_ && db_ind < db_quotas_.size(); ++db_ind) {
+    DbQuota& quota = db_quotas_[db_ind];
+    if (!IsDbValid(db_ind) || (is_volatile && db_arr_[db_ind]->expire.size() == 0))
+      continue;
+
+    for (iters = 0; iters < max_buckets && IsOverQuota(db_ind); ++iters) {
+      PrimeIterator victim = PickEvictionVictim(db_ind, &quota.cursor);
+      if (victim.is_done())
+        continue;
+
+      Del(db_ind, victim);
+      keyspace_events_.MarkEvicted();
+      ++quota.evicted;
+      ++evicted;
+    }
+  }
+
+  events_.evicted_keys += evicted;
+  events_.policy_evicted_keys[size_t(eviction_policy_)] += evicted;
+
+  return evicted;
 }
 
 }  // namespace dfly
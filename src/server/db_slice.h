@@ -6,9 +6,15 @@
 
 #include <absl/container/flat_hash_set.h>
 
+#include <array>
+#include <deque>
+
 #include "facade/op_status.h"
+#include "server/change_feed.h"
 #include "server/common.h"
+#include "server/keyspace_events.h"
 #include "server/table.h"
+#include "server/tracking_table.h"
 
 namespace util {
 class ProactorBase;
@@ -31,21 +37,62 @@ struct DbStats : public DbTableStats {
   // Memory used by dictionaries.
   size_t table_mem_usage = 0;
 
+  // The memory quota of the db, 0 if unlimited, see --db_maxmemory. The keys evicted and the
+  // insertions rejected because the db exceeded its quota.
+  size_t quota = 0;
+  size_t quota_evicted = 0;
+  size_t quota_rejected = 0;
+
   using DbTableStats::operator+=;
   using DbTableStats::operator=;
 
   DbStats& operator+=(const DbStats& o);
 };
 
+// Frees the memory of a shard by evicting keys once it exhausts its share of maxmemory,
+// see FLAGS_maxmemory_policy.
+enum class EvictionPolicy : uint8_t {
+  NO_EVICTION = 0,
+  ALLKEYS_LRU,
+  ALLKEYS_LFU,
+  VOLATILE_LRU,
+  VOLATILE_LFU,
+  VOLATILE_TTL,
+  NUM_POLICIES,
+};
+
+// Returns false if name is not a policy, e.g. "allkeys-lru".
+bool ParseEvictionPolicy(std::string_view name, EvictionPolicy* policy);
+std::string_view EvictionPolicyName(EvictionPolicy policy);
+
 struct SliceEvents {
   // Number of eviction events.
   size_t evicted_keys = 0;
+
+  // The keys that DbSlice::EvictionStep evicted, by EvictionPolicy. They are a part of
+  // evicted_keys.
+  std::array<size_t, size_t(EvictionPolicy::NUM_POLICIES)> policy_evicted_keys{};
+
   size_t expired_keys = 0;
   size_t garbage_checked = 0;
   size_t garbage_collected = 0;
   size_t stash_unloaded = 0;
   size_t bumpups = 0;  // how many bump-upds we did.
 
+  // Keys deleted by active expiry and the total time they stayed past their deadlines.
+  size_t active_expired_keys = 0;
+  size_t active_expire_lag_ms = 0;
+
+  // Fields of the hashes deleted by their deadlines, see HEXPIRE.
+  size_t expired_fields = 0;
+
+  // Deleted entries of the streams dropped by DbSlice::CompactStreams.
+  size_t stream_compacted_entries = 0;
+
+  // Records sent to the subscribers of the change feed and those dropped, see ChangeFeed.
+  size_t change_feed_records = 0;
+  size_t change_feed_dropped = 0;
+
   SliceEvents& operator+=(const SliceEvents& o);
 };
 
@@ -59,11 +106,17 @@ class DbSlice {
     std::vector<DbStats> db_stats;
     SliceEvents events;
     size_t small_string_bytes = 0;
+    size_t compressed_strings = 0;
+    size_t compression_dict_bytes = 0;
+    size_t dedup_strings = 0;
+    size_t dedup_bytes = 0;
+    size_t dedup_saved_bytes = 0;
   };
 
   // ChangeReq - describes the change to the table.
   struct ChangeReq {
-    // If iterator is set then it's an update to the existing bucket.
+    // If iterator is set then it's an update to the existing bucket, including the deletion of
+    // one of its keys.
     // Otherwise (string_view is set) then it's a new key that is going to be added to the table.
     std::variant<PrimeTable::bucket_iterator, std::string_view> change;
 
@@ -81,7 +134,8 @@ class DbSlice {
   ~DbSlice();
 
   // Activates `db_ind` database if it does not exist (see ActivateDb below).
-  void Reserve(DbIndex db_ind, size_t key_size);
+  // Reserves room for key_size more keys, expire_size of them with the expiry.
+  void Reserve(DbIndex db_ind, size_t key_size, size_t expire_size = 0);
 
   Stats GetStats() const;
 
@@ -95,8 +149,38 @@ class DbSlice {
     expire_base_[generation & 1] = now;
   }
 
-  void SetMemoryBudget(int64_t budget) {
-    memory_budget_ = budget;
+  // The memory budget follows the used memory of the shard until the next call, so that
+  // the bursts of writes between the calls are accounted precisely.
+  void SetMemoryBudget(int64_t budget);
+
+  ssize_t memory_budget() const;
+
+  EvictionPolicy eviction_policy() const {
+    return eviction_policy_;
+  }
+
+  // Evicts the keys by the eviction policy while the memory budget is below the reserve of the
+  // slice. Traverses up to max_buckets buckets and evicts the best candidate of each, so that
+  // the keys of a bucket serve as the sample. The keys that are locked by transactions are not
+  // evicted. Then evicts the keys of the dbs that exceed their quotas, up to max_buckets
+  // buckets of each, from those dbs only. Returns the number of evicted keys.
+  unsigned EvictionStep(unsigned max_buckets);
+
+  // Sets the memory quotas of the dbs by db index, 0 - unlimited. Every shard enforces its share
+  // of the quota: with noeviction the insertions of new keys into a db over its quota fail,
+  // otherwise they succeed and EvictionStep evicts the keys of that db.
+  void SetDbQuotas(const std::vector<size_t>& quotas);
+
+  // Parses the quotas as a comma separated list of <db>:<bytes> pairs, e.g. "1:1G,2:512M".
+  static bool ParseDbQuotas(std::string_view spec, std::vector<size_t>* quotas);
+
+  // The memory of the tables and the values of the db, which is charged to its quota.
+  size_t DbMemoryUsage(DbIndex db_ind) const;
+
+  // True if an insertion dropped the memory budget below the reserve or a db exceeded its
+  // quota, so that the shard should call EvictionStep once the running callback is done.
+  bool eviction_pending() const {
+    return eviction_pending_;
   }
 
   // returns absolute time of the expiration.
@@ -118,6 +202,13 @@ class DbSlice {
   // Returns (value, expire) dict entries if key exists, null if it does not exist or has expired.
   std::pair<PrimeIterator, ExpireIterator> FindExt(DbIndex db_ind, std::string_view key) const;
 
+  using FindManyCb = std::function<void(unsigned index, PrimeIterator it)>;
+
+  // Looks up all the keys with the same semantics as FindExt but prefetches them in batches
+  // to hide memory latency. Calls cb(index, it) for each key in order, 'it' is invalid if the key
+  // does not exist. 'it' is valid only during the callback and cb must not change the table.
+  void FindMany(DbIndex db_ind, ArgSlice keys, const FindManyCb& cb) const;
+
   // Returns (iterator, args-index) if found, KEY_NOTFOUND otherwise.
   // If multiple keys are found, returns the first index in the ArgSlice.
   OpResult<std::pair<PrimeIterator, unsigned>> FindFirst(DbIndex db_index, ArgSlice args);
@@ -139,8 +230,14 @@ class DbSlice {
   // Does not change expiry if at != 0 and expiry already exists.
   bool UpdateExpire(DbIndex db_ind, PrimeIterator main_it, uint64_t at);
 
-  void SetMCFlag(DbIndex db_ind, PrimeKey key, uint32_t flag);
-  uint32_t GetMCFlag(DbIndex db_ind, const PrimeKey& key) const;
+  // Changes the expiry of an entry that already has one. exp_it must be its expire table entry.
+  void UpdateExpireTime(DbIndex db_ind, PrimeIterator main_it, ExpireIterator exp_it,
+                        uint64_t at);
+
+  // Sets the memcached flag of the entry, flag == 0 removes it. The flag is kept inline in the key
+  // if it has room for it, otherwise in the mcflag table.
+  void SetMCFlag(DbIndex db_ind, PrimeIterator it, uint32_t flag);
+  uint32_t GetMCFlag(DbIndex db_ind, PrimeIterator it) const;
 
   // Adds a new entry. Requires: key does not exist in this slice.
   // Returns the iterator to the newly added entry.
@@ -151,16 +248,52 @@ class DbSlice {
   // Creates a database with index `db_ind`. If such database exists does nothing.
   void ActivateDb(DbIndex db_ind);
 
-  bool Del(DbIndex db_ind, PrimeIterator it);
+  // If force_lazy is true, a big container value is released in the background regardless of
+  // its size, see EngineShard::LazyFreeIfNeeded.
+  bool Del(DbIndex db_ind, PrimeIterator it, bool force_lazy = false);
 
   constexpr static DbIndex kDbAll = 0xFFFF;
 
   /**
    * @brief Flushes the database of index db_ind. If kDbAll is passed then flushes all the
-   * databases.
-   *
+   * databases. The flushed tables are replaced with empty ones right away. If async is true,
+   * the old tables are released in bounded steps by ReleaseFlushedStep(), otherwise
+   * they are released inline.
    */
-  void FlushDb(DbIndex db_ind);
+  void FlushDb(DbIndex db_ind, bool async = true);
+
+  // Releases up to count segments of the tables that were flushed asynchronously.
+  // Called periodically by the shard.
+  // Returns true if flushed tables remain to be released.
+  bool ReleaseFlushedStep(unsigned count);
+
+  // Number of entries of the flushed tables that have not been released yet.
+  size_t flush_pending_keys() const;
+
+  // The shadow tables of a replica that serves its previous data during a full sync, see
+  // FLAGS_replica_stale_reads. The sync loads into the shadow tables within ShadowScope while
+  // the other commands use the current tables. CommitShadow replaces the current tables with
+  // the shadow ones and releases them like FlushDb, DropShadow releases the shadow tables.
+  void CreateShadow();
+  void CommitShadow();
+  void DropShadow();
+
+  bool has_shadow() const {
+    return has_shadow_;
+  }
+
+  // Makes the shadow tables current for the scope if active is true and the slice has them.
+  // The running snapshots and the journal do not see the changes within the scope, so it must
+  // not preempt.
+  class ShadowScope {
+   public:
+    ShadowScope(DbSlice* slice, bool active);
+    ~ShadowScope();
+
+   private:
+    DbSlice* slice_;
+    bool swapped_ = false;
+  };
 
   EngineShard* shard_owner() {
     return owner_;
@@ -181,6 +314,15 @@ class DbSlice {
   // Returns true if all keys can be locked under m. Does not lock them though.
   bool CheckLock(IntentLock::Mode m, const KeyLockArgs& lock_args) const;
 
+  // Same as CheckLock, for a transaction that already recorded its intents on the keys.
+  bool CheckOwnLock(IntentLock::Mode m, const KeyLockArgs& lock_args) const;
+
+  // Returns true if some transaction holds or waits for a lock on the key.
+  bool IsLocked(DbIndex db_ind, const PrimeKey& key) const {
+    const auto& lt = db_arr_[db_ind]->trans_locks;
+    return !lt.empty() && lt.contains(key.HashCode());
+  }
+
   size_t db_array_size() const {
     return db_arr_.size();
   }
@@ -208,12 +350,41 @@ class DbSlice {
   // from both tables and return PrimeIterator{}.
   std::pair<PrimeIterator, ExpireIterator> ExpireIfNeeded(DbIndex db_ind, PrimeIterator it) const;
 
+  // Same as ExpireIfNeeded but does not resolve the expire iterator. This allows skipping
+  // the expire table lookup for keys that keep a copy of their expiry inline.
+  PrimeIterator ExpirePrimeIfNeeded(DbIndex db_ind, PrimeIterator it) const;
+
+  // Deletes the expired fields of the hash of it, see HEXPIRE, and the key as well once no field
+  // is left. Returns false if the key was deleted. Does nothing for the other values.
+  bool ExpireFieldsIfNeeded(DbIndex db_ind, PrimeIterator it);
+
+  // Schedules the active expiry of the fields of the hash of key for expire_at, in seconds since
+  // the epoch, see DeleteExpiredFields.
+  void IndexFieldExpiry(DbIndex db_ind, const PrimeKey& key, uint32_t expire_at) {
+    db_arr_[db_ind]->field_expire_index.Add(expire_at * 1000ULL, key.HashCode());
+  }
+
+  // Queues the node with the master id ms-seq of the stream of key for CompactStreams. The marks
+  // of the same node in a row are merged and the queue is bounded, since the next deletion from
+  // a node that stays sparse marks it again.
+  void MarkSparseStreamNode(DbIndex db_ind, const PrimeKey& key, uint64_t ms, uint64_t seq);
+
   // Current version of this slice.
   // We maintain a shared versioning scheme for all databases in the slice.
   uint64_t version() const {
     return version_;
   }
 
+  // Returns the memcached cas unique of the entry, which costs no storage since it is made of
+  // the version of its bucket and of its slot. A write to the entry bumps the version of its
+  // bucket above any version that the bucket had, and the entries move only to the buckets
+  // with greater versions, so a stale unique never matches again. A write to a neighbour of the
+  // entry changes its unique as well, which fails the cas spuriously.
+  static uint64_t CasUnique(PrimeIterator it) {
+    static_assert(PrimeTable::kBucketWidth <= 16);
+    return (it.GetVersion() << 4) | it.slot_id();
+  }
+
   using ChangeCallback = std::function<void(DbIndex, const ChangeReq&)>;
 
   //! Registers the callback to be called for each change.
@@ -224,28 +395,115 @@ class DbSlice {
   //! Unregisters the callback.
   void UnregisterOnChange(uint64_t id);
 
+  // Changes that the bucket versions do not reflect, written by the next delta snapshot.
+  struct DeltaLog {
+    absl::flat_hash_set<std::string> deleted_keys;
+    bool flushed = false;
+  };
+
+  // Returns the changes logged since the previous call by db index and starts logging anew.
+  // Nothing is logged before the first call.
+  std::vector<DeltaLog> TakeDeltaLog();
+
   struct DeleteExpiredStats {
-    uint32_t deleted = 0;         // number of deleted items due to expiry (less than traversed).
-    uint32_t traversed = 0;       // number of traversed items that have ttl bit
-    size_t survivor_ttl_sum = 0;  // total sum of ttl of survivors (traversed - deleted).
+    uint32_t deleted = 0;    // number of deleted items due to expiry (less than traversed).
+    uint32_t traversed = 0;  // number of traversed items that have ttl bit
+    uint32_t popped = 0;     // number of processed index entries, less than count if no more due.
+    size_t lag_ms_sum = 0;   // total sum of how late the deleted items were collected.
   };
 
-  // Deletes some amount of possible expired items.
+  // Deletes the items that are due according to the expire index. Processes at most 'count'
+  // index entries.
   DeleteExpiredStats DeleteExpired(DbIndex db_indx, unsigned count);
 
+  // Deletes the expired fields of the hashes that are due according to the field expire index,
+  // see IndexFieldExpiry. Processes at most 'count' index entries, deleted counts the fields.
+  DeleteExpiredStats DeleteExpiredFields(DbIndex db_indx, unsigned count);
+
+  // Rewrites the stream nodes queued by MarkSparseStreamNode without their deleted entries.
+  // Processes at most 'count' marks and returns how many were processed.
+  unsigned CompactStreams(DbIndex db_ind, unsigned count);
+
+  // Merges sparse segments and shrinks the directories of the db tables in order to return
+  // memory after mass deletions. Does at most 'count' merge steps per table and continues
+  // from where the previous call stopped. Returns number of merged segments.
+  unsigned ShrinkTables(DbIndex db_ind, unsigned count);
+
+  // Advances the access ages of the keys, see CompactObj::Age. The lookups reset the age of
+  // a key, while every 2^age-th pass over the keys increments it, so that the age grows with
+  // the log of the passes since the last lookup. A pass starts at most every period_ms and
+  // each step traverses up to budget buckets.
+  void AgeKeysStep(uint64_t period_ms, unsigned budget);
+
+  // Estimates the time since the last lookup of the key from its age and the completion times
+  // of the passes, hence the precision halves with each age. Keys of the maximal age report
+  // the time since the oldest pass that is remembered.
+  uint64_t IdleTimeMs(const PrimeKey& key) const;
+
+  // Whether the lookups maintain the frequency counters of the keys, see CompactObj::Freq.
+  bool IsFreqTracked() const;
+
   const DbTableArray& databases() const {
     return db_arr_;
   }
 
+  TrackingTable& tracking() {
+    return tracking_;
+  }
+
+  ChangeFeed& change_feed() {
+    return change_feed_;
+  }
+
+  KeyspaceEvents& keyspace_events() {
+    return keyspace_events_;
+  }
+
  private:
   void CreateDb(DbIndex index);
 
+  // Applies the caching mode logic to the found entry. Returns the new position of the entry.
+  PrimeIterator BumpUp(DbIndex db_ind, PrimeIterator it) const;
+
+  // Sends the invalidation of the key to the clients that track it.
+  void InvalidateTracking(const PrimeKey& key) const;
+
+  void LogDeletion(DbIndex db_ind, const PrimeKey& key) const;
+
+  // Passes the changed key to the journal of the shard, if it is enabled.
+  void JournalKey(DbIndex db_ind, const PrimeKey& key) const;
+
+  // Passes the changed key to the change feed of the shard, if it has subscribers.
+  void FeedChange(DbIndex db_ind, const PrimeKey& key, ChangeFeed::Op op) const;
+
+  // Passes the event of the key to the keyspace notifications, if they have subscribers.
+  void NotifyKeyspace(DbIndex db_ind, const PrimeKey& key, const char* event,
+                      uint32_t event_class) const;
+
+  // Exchanges the current tables with the shadow ones, see ShadowScope.
+  void SwapShadow();
+
+  // Marks the bucket of `it` as changed for the snapshots, for changes that do not go through
+  // PreUpdate.
+  void BumpVersion(DbIndex db_ind, PrimeIterator it);
+
+  bool IsOverQuota(DbIndex db_ind) const {
+    return has_quotas_ && db_ind < db_quotas_.size() && db_quotas_[db_ind].limit > 0 &&
+           DbMemoryUsage(db_ind) > db_quotas_[db_ind].limit;
+  }
+
+  // Traverses a bucket of the db from cursor and returns the best candidate for the eviction,
+  // if any.
+  PrimeIterator PickEvictionVictim(DbIndex db_ind, PrimeTable::cursor* cursor);
+
   uint64_t NextVersion() {
     return version_++;
   }
 
   ShardId shard_id_;
   uint8_t caching_mode_ : 1;
+  uint8_t lfu_mode_ : 1;   // cache_policy=lfu or gdsf, relevant only in caching mode.
+  uint8_t gdsf_mode_ : 1;  // cache_policy=gdsf.
 
   EngineShard* owner_;
 
@@ -253,16 +511,65 @@ class DbSlice {
   time_t expire_base_[2];  // Used for expire logic, represents a real clock.
 
   uint64_t version_ = 1;  // Used to version entries in the PrimeTable.
-  ssize_t memory_budget_ = SSIZE_MAX;
+  ssize_t memory_budget_ = SSIZE_MAX;  // as of the last SetMemoryBudget, SSIZE_MAX - unlimited.
+  size_t budget_used_memory_ = 0;       // EngineShard::UsedMemory at the last SetMemoryBudget.
+
+  EvictionPolicy eviction_policy_ = EvictionPolicy::NO_EVICTION;
+  bool eviction_pending_ = false;
 
   mutable SliceEvents events_;  // we may change this even for const operations.
 
   DbTableArray db_arr_;
 
+  // Tables that were flushed asynchronously and are being released, see ReleaseFlushedStep.
+  std::deque<boost::intrusive_ptr<DbTable>> flushed_tables_;
+
+  // The current tables while the shadow ones are swapped in, otherwise the shadow tables.
+  DbTableArray shadow_arr_;
+  bool has_shadow_ = false;
+  bool shadow_swapped_ = false;
+
   // Used in temporary computations in Acquire/Release.
   absl::flat_hash_set<std::string_view> uniq_keys_;
 
   std::vector<std::pair<uint64_t, ChangeCallback>> change_cb_;
+  std::vector<std::pair<uint64_t, ChangeCallback>> stashed_change_cb_;  // see SwapShadow.
+
+  mutable TrackingTable tracking_;  // keys are expired by const operations.
+  mutable ChangeFeed change_feed_;
+  mutable KeyspaceEvents keyspace_events_;
+
+  // By db index, see TakeDeltaLog.
+  mutable std::vector<DeltaLog> delta_log_;
+  bool log_deltas_ = false;
+
+  // See AgeKeysStep.
+  struct AgingState {
+    static constexpr unsigned kPassesKept = 1u << (PrimeKey::kMaxAge - 1);
+
+    DbIndex db_indx = 0;
+    PrimeTable::cursor cursor;
+    bool active = false;
+    uint64_t passes = 0;  // completed passes.
+    uint64_t next_pass_ms = 0;
+    std::array<uint64_t, kPassesKept> pass_end_ms{};  // by pass number modulo kPassesKept.
+  };
+
+  AgingState aging_;
+
+  // Where EvictionStep continues from.
+  DbIndex evict_db_indx_ = 0;
+  PrimeTable::cursor evict_cursor_;
+
+  struct DbQuota {
+    size_t limit = 0;  // the share of the shard, 0 - unlimited.
+    size_t evicted = 0;
+    size_t rejected = 0;
+    PrimeTable::cursor cursor;  // where EvictionStep continues the eviction of the db from.
+  };
+
+  std::vector<DbQuota> db_quotas_;  // by db index.
+  bool has_quotas_ = false;
 };
 
 }  // namespace dfly
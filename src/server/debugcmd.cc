@@ -4,20 +4,27 @@
 #include "server/debugcmd.h"
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <xxhash.h>
 
 #include <boost/fiber/operations.hpp>
 #include <filesystem>
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "facade/request_tracer.h"
 #include "server/blocking_controller.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/hset_family.h"
+#include "server/list_family.h"
 #include "server/main_service.h"
 #include "server/rdb_load.h"
 #include "server/server_state.h"
+#include "server/set_family.h"
 #include "server/string_family.h"
+#include "server/zset_family.h"
 #include "server/transaction.h"
 #include "util/uring/uring_fiber_algo.h"
 
@@ -37,9 +44,24 @@ namespace fs = std::filesystem;
 using absl::StrAppend;
 using absl::GetFlag;
 
+struct PopulateOptions {
+  enum Type : uint8_t { STRING, HASH, SET, ZSET, LIST };
+
+  string_view prefix{"key"};
+  uint32_t val_size = 0;
+  uint32_t max_val_size = 0;  // the sizes are uniform in [val_size, max_val_size] if greater.
+  Type type = STRING;
+  uint32_t elements = 16;  // of each container.
+  uint32_t expire_percent = 0;
+  uint32_t expire_max_sec = 0;
+};
+
+// The keys are generated in batches of the same shard, which inserts them in a single task.
+constexpr unsigned kPopulateBatchLen = 256;
+
 struct PopulateBatch {
   DbIndex dbid;
-  uint64_t index[32];
+  uint64_t index[kPopulateBatchLen];
   uint64_t sz = 0;
 
   PopulateBatch(DbIndex id) : dbid(id) {
@@ -58,21 +80,121 @@ struct ObjInfo {
   bool found = false;
 };
 
-void DoPopulateBatch(std::string_view prefix, size_t val_size, const SetCmd::SetParams& params,
-                     const PopulateBatch& batch) {
-  SetCmd sg(&EngineShard::tlocal()->db_slice());
+// Pads the generated value with 'x' up to size, its prefix keeps the values distinct.
+void PadValue(size_t size, string* val) {
+  if (val->size() < size) {
+    val->resize(size, 'x');
+  }
+}
+
+// The sizes and the expiry of a key follow from its index, so that the datasets are reproducible.
+size_t PopulateValueSize(const PopulateOptions& opts, uint64_t index, unsigned elem) {
+  if (opts.max_val_size <= opts.val_size)
+    return opts.val_size;
+
+  uint64_t hash = XXH3_64bits_withSeed(&index, sizeof(index), elem);
+  return opts.val_size + hash % (opts.max_val_size - opts.val_size + 1);
+}
+
+uint64_t PopulateTtlMs(const PopulateOptions& opts, uint64_t index) {
+  if (opts.expire_percent == 0)
+    return 0;
 
+  uint64_t hash = XXH3_64bits(&index, sizeof(index));
+  if (hash % 100 >= opts.expire_percent)
+    return 0;
+  return (1 + (hash >> 8) % opts.expire_max_sec) * 1000;
+}
+
+// Inserts the batch directly into the shard, without going through the transactions.
+void DoPopulateBatch(const PopulateOptions& opts, const PopulateBatch& batch) {
+  EngineShard* shard = EngineShard::tlocal();
+  DbSlice& db_slice = shard->db_slice();
+  OpArgs op_args{shard, batch.dbid};
+  SetCmd sg(&db_slice);
+  SetCmd::SetParams params{batch.dbid};
+
+  vector<string> elems;
   for (unsigned i = 0; i < batch.sz; ++i) {
-    string key = absl::StrCat(prefix, ":", batch.index[i]);
-    string val = absl::StrCat("value:", batch.index[i]);
+    uint64_t index = batch.index[i];
+    string key = absl::StrCat(opts.prefix, ":", index);
+    uint64_t ttl_ms = PopulateTtlMs(opts, index);
+
+    if (opts.type == PopulateOptions::STRING) {
+      string val = absl::StrCat("value:", index);
+      PadValue(PopulateValueSize(opts, index, 0), &val);
+      params.expire_after_ms = ttl_ms;
+      sg.Set(params, key, val);
+      continue;
+    }
+
+    bool is_member = opts.type == PopulateOptions::SET || opts.type == PopulateOptions::ZSET;
+    elems.clear();
+    for (unsigned j = 0; j < opts.elements; ++j) {
+      if (opts.type == PopulateOptions::HASH)
+        elems.push_back(absl::StrCat("field:", j));
 
-    if (val.size() < val_size) {
-      val.resize(val_size, 'x');
+      string& elem = elems.emplace_back(absl::StrCat(is_member ? "member:" : "value:", j));
+      PadValue(PopulateValueSize(opts, index, j), &elem);
+    }
+
+    OpStatus status = OpStatus::OK;
+    switch (opts.type) {
+      case PopulateOptions::HASH: {
+        vector<MutableSlice> field_values;
+        for (string& elem : elems)
+          field_values.emplace_back(elem.data(), elem.size());
+        status = HSetFamily::OpAddFields(op_args, key, absl::MakeSpan(field_values)).status();
+        break;
+      }
+      case PopulateOptions::SET: {
+        vector<string_view> members(elems.begin(), elems.end());
+        status = SetFamily::OpAddMembers(op_args, key, members).status();
+        break;
+      }
+      case PopulateOptions::ZSET: {
+        vector<ZSetFamily::ScoredMemberView> members;
+        for (unsigned j = 0; j < elems.size(); ++j)
+          members.emplace_back(j, elems[j]);
+        status = ZSetFamily::OpAddMembers(op_args, key, absl::MakeSpan(members)).status();
+        break;
+      }
+      case PopulateOptions::LIST: {
+        vector<string_view> values(elems.begin(), elems.end());
+        status = ListFamily::OpPushBack(op_args, key, absl::MakeSpan(values)).status();
+        break;
+      }
+      case PopulateOptions::STRING:
+        break;
     }
-    sg.Set(params, key, val);
+
+    // E.g. an existing key of another type is left as is.
+    if (status != OpStatus::OK || ttl_ms == 0)
+      continue;
+
+    PrimeIterator it = db_slice.FindExt(batch.dbid, key).first;
+    if (IsValid(it))
+      db_slice.UpdateExpire(batch.dbid, it, db_slice.Now() + ttl_ms);
   }
 }
 
+// Runs a complete pass of the key analyzer in each shard and merges the reports.
+KeyAnalyzer::Report RunKeyAnalysis() {
+  KeyAnalyzer::Report report;
+  boost::fibers::mutex mu;
+
+  auto cb = [&](EngineShard* shard) {
+    shard->key_analyzer()->RunFull(&shard->db_slice());
+    auto shard_report = shard->key_analyzer()->report();
+
+    lock_guard lk(mu);
+    report += *shard_report;
+  };
+
+  shard_set->RunBlockingInParallel(cb);
+  return report;
+}
+
 DebugCmd::DebugCmd(ServerFamily* owner, ConnectionContext* cntx) : sf_(*owner), cntx_(cntx) {
 }
 
@@ -91,9 +213,26 @@ void DebugCmd::Run(CmdArgList args) {
         "    * DEBUG RELOAD NOSAVE: replace the current database with the contents of an",
         "      existing RDB file.",
         "WATCHED",
-        "POPULATE <count> [<prefix>] [<size>]",
+        "TXSTATS",
+        "    Show the latency breakdown of the commands and the tx queue stats of the shards.",
+        "KEYSTATS",
+        "    Traverse all the keys and break down their memory and lookups by key prefixes and",
+        "    by encodings, see --key_analyzer_prefixes.",
+        "HOTKEYS",
+        "    Show the estimated lookups of the most frequently read or written keys.",
+        "BIGKEYS",
+        "    Traverse all the keys and show the keys that use the most memory.",
+        "TRACE START <rate> | STOP | DUMP",
+        "    Sample one of every <rate> commands of each thread and record the timestamps of",
+        "    their stages across the threads. DUMP returns them as a Chrome trace JSON, which",
+        "    chrome://tracing and Perfetto open.",
+        "POPULATE <count> [<prefix>] [<size>] [TYPE <type>] [ELEMENTS <n>] [MAXSIZE <max>]",
+        "         [EXPIRE <percent> <seconds>]",
         "    Create <count> string keys named key:<num>. If <prefix> is specified then",
-        "    it is used instead of the 'key' prefix.",
+        "    it is used instead of the 'key' prefix. The values are padded to <size> bytes.",
+        "    TYPE hash, set, zset or list creates containers of <n> elements (16 by default)",
+        "    of that size instead. MAXSIZE draws the sizes uniformly from [<size>, <max>].",
+        "    EXPIRE sets a ttl of up to <seconds> on <percent> of the keys.",
         "HELP",
         "    Prints this help.",
     };
@@ -113,6 +252,26 @@ void DebugCmd::Run(CmdArgList args) {
     return Watched();
   }
 
+  if (subcmd == "TXSTATS") {
+    return TxStats();
+  }
+
+  if (subcmd == "KEYSTATS") {
+    return KeyStats();
+  }
+
+  if (subcmd == "HOTKEYS") {
+    return HotKeys();
+  }
+
+  if (subcmd == "BIGKEYS") {
+    return BigKeys();
+  }
+
+  if (subcmd == "TRACE" && args.size() >= 3) {
+    return Trace(args);
+  }
+
   if (subcmd == "LOAD" && args.size() == 3) {
     return Load(ArgS(args, 2));
   }
@@ -147,7 +306,7 @@ void DebugCmd::Reload(CmdArgList args) {
     string err_details;
     const CommandId* cid = sf_.service().FindCmd("SAVE");
     CHECK_NOTNULL(cid);
-    intrusive_ptr<Transaction> trans(new Transaction{cid});
+    intrusive_ptr<Transaction> trans(Transaction::New(cid));
     trans->InitByArgs(0, {});
     VLOG(1) << "Performing save";
     ec = sf_.DoSave(trans.get(), &err_details);
@@ -172,7 +331,7 @@ void DebugCmd::Load(string_view filename) {
   };
 
   const CommandId* cid = sf_.service().FindCmd("FLUSHALL");
-  intrusive_ptr<Transaction> flush_trans(new Transaction{cid});
+  intrusive_ptr<Transaction> flush_trans(Transaction::New(cid));
   flush_trans->InitByArgs(0, {});
   VLOG(1) << "Performing flush";
   error_code ec = sf_.DoFlush(flush_trans.get(), DbSlice::kDbAll);
@@ -200,25 +359,77 @@ void DebugCmd::Load(string_view filename) {
 }
 
 void DebugCmd::Populate(CmdArgList args) {
-  if (args.size() < 3 || args.size() > 5) {
+  if (args.size() < 3) {
     return (*cntx_)->SendError(UnknownSubCmd("populate", "DEBUG"));
   }
 
   uint64_t total_count = 0;
   if (!absl::SimpleAtoi(ArgS(args, 2), &total_count))
     return (*cntx_)->SendError(kUintErr);
-  std::string_view prefix{"key"};
 
-  if (args.size() > 3) {
-    prefix = ArgS(args, 3);
+  auto is_option = [](string_view arg) {
+    return absl::EqualsIgnoreCase(arg, "TYPE") || absl::EqualsIgnoreCase(arg, "ELEMENTS") ||
+           absl::EqualsIgnoreCase(arg, "MAXSIZE") || absl::EqualsIgnoreCase(arg, "EXPIRE");
+  };
+
+  PopulateOptions opts;
+  size_t pos = 3;
+  if (pos < args.size() && !is_option(ArgS(args, pos))) {
+    opts.prefix = ArgS(args, pos++);
   }
-  uint32_t val_size = 0;
-  if (args.size() > 4) {
-    std::string_view str = ArgS(args, 4);
-    if (!absl::SimpleAtoi(str, &val_size))
+
+  if (pos < args.size() && !is_option(ArgS(args, pos))) {
+    if (!absl::SimpleAtoi(ArgS(args, pos++), &opts.val_size))
       return (*cntx_)->SendError(kUintErr);
   }
 
+  for (; pos < args.size(); ++pos) {
+    ToUpper(&args[pos]);
+    string_view opt = ArgS(args, pos);
+    size_t left = args.size() - pos - 1;
+
+    if (opt == "TYPE" && left >= 1) {
+      ToLower(&args[++pos]);
+      string_view type = ArgS(args, pos);
+      if (type == "string") {
+        opts.type = PopulateOptions::STRING;
+      } else if (type == "hash") {
+        opts.type = PopulateOptions::HASH;
+      } else if (type == "set") {
+        opts.type = PopulateOptions::SET;
+      } else if (type == "zset") {
+        opts.type = PopulateOptions::ZSET;
+      } else if (type == "list") {
+        opts.type = PopulateOptions::LIST;
+      } else {
+        return (*cntx_)->SendError(kSyntaxErr);
+      }
+    } else if (opt == "ELEMENTS" && left >= 1) {
+      if (!absl::SimpleAtoi(ArgS(args, ++pos), &opts.elements) || opts.elements == 0)
+        return (*cntx_)->SendError(kUintErr);
+    } else if (opt == "MAXSIZE" && left >= 1) {
+      if (!absl::SimpleAtoi(ArgS(args, ++pos), &opts.max_val_size))
+        return (*cntx_)->SendError(kUintErr);
+    } else if (opt == "EXPIRE" && left >= 2) {
+      if (!absl::SimpleAtoi(ArgS(args, pos + 1), &opts.expire_percent) ||
+          !absl::SimpleAtoi(ArgS(args, pos + 2), &opts.expire_max_sec) ||
+          opts.expire_percent > 100 || opts.expire_max_sec == 0) {
+        return (*cntx_)->SendError(kInvalidIntErr);
+      }
+      pos += 2;
+    } else {
+      return (*cntx_)->SendError(kSyntaxErr);
+    }
+  }
+
+  // The tables grow once up front instead of splitting their segments along the way.
+  DbIndex db_indx = cntx_->db_index();
+  size_t shard_keys = total_count / shard_set->size() + 1;
+  size_t shard_expire_keys = shard_keys * opts.expire_percent / 100;
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard->db_slice().Reserve(db_indx, shard_keys, shard_expire_keys);
+  });
+
   ProactorPool& pp = sf_.service().proactor_pool();
   size_t runners_count = pp.size();
   vector<pair<uint64_t, uint64_t>> ranges(runners_count - 1);
@@ -236,8 +447,8 @@ void DebugCmd::Populate(CmdArgList args) {
     auto range = ranges[i];
 
     // whatever we do, we should not capture i by reference.
-    fb_arr[i] = pp.at(i)->LaunchFiber([range, prefix, val_size, this] {
-      this->PopulateRangeFiber(range.first, range.second, prefix, val_size);
+    fb_arr[i] = pp.at(i)->LaunchFiber([range, &opts, this] {
+      this->PopulateRangeFiber(range.first, range.second, opts);
     });
   }
   for (auto& fb : fb_arr)
@@ -246,18 +457,17 @@ void DebugCmd::Populate(CmdArgList args) {
   (*cntx_)->SendOk();
 }
 
-void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix,
-                                  unsigned value_len) {
+void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, const PopulateOptions& opts) {
   this_fiber::properties<FiberProps>().set_name("populate_range");
   VLOG(1) << "PopulateRange: " << from << "-" << (from + len - 1);
 
-  string key = absl::StrCat(prefix, ":");
+  string key = absl::StrCat(opts.prefix, ":");
   size_t prefsize = key.size();
   DbIndex db_indx = cntx_->db_index();
   EngineShardSet& ess = *shard_set;
   std::vector<PopulateBatch> ps(ess.size(), PopulateBatch{db_indx});
-  SetCmd::SetParams params{db_indx};
 
+  // The producers only hash the keys, the shards format and insert them in parallel.
   for (uint64_t i = from; i < from + len; ++i) {
     StrAppend(&key, i);
     ShardId sid = Shard(key, ess.size());
@@ -265,12 +475,10 @@ void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view
 
     auto& shard_batch = ps[sid];
     shard_batch.index[shard_batch.sz++] = i;
-    if (shard_batch.sz == 32) {
-      ess.Add(sid, [=] {
-        DoPopulateBatch(prefix, value_len, params, shard_batch);
-        if (i % 50 == 0) {
-          this_fiber::yield();
-        }
+    if (shard_batch.sz == kPopulateBatchLen) {
+      ess.Add(sid, [&opts, shard_batch] {
+        DoPopulateBatch(opts, shard_batch);
+        this_fiber::yield();
       });
 
       // we capture shard_batch by value so we can override it here.
@@ -279,7 +487,7 @@ void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view
   }
 
   ess.RunBlockingInParallel([&](EngineShard* shard) {
-    DoPopulateBatch(prefix, value_len, params, ps[shard->shard_id()]);
+    DoPopulateBatch(opts, ps[shard->shard_id()]);
   });
 }
 
@@ -355,4 +563,90 @@ void DebugCmd::Watched() {
   (*cntx_)->SendStringArr(watched_keys);
 }
 
+void DebugCmd::TxStats() {
+  vector<string> res;
+  for (const auto& [name, value] : GetTxStats(sf_.GetMetrics())) {
+    res.push_back(absl::StrCat(name, ":", value));
+  }
+
+  (*cntx_)->SendStringArr(res);
+}
+
+void DebugCmd::Trace(CmdArgList args) {
+  ToUpper(&args[2]);
+  string_view action = ArgS(args, 2);
+
+  if (action == "START" && args.size() == 4) {
+    uint32_t rate;
+    if (!absl::SimpleAtoi(ArgS(args, 3), &rate) || rate == 0)
+      return (*cntx_)->SendError(kInvalidIntErr);
+
+    RequestTracer::Start(rate);
+    return (*cntx_)->SendOk();
+  }
+
+  if (action == "STOP" && args.size() == 3) {
+    RequestTracer::Stop();
+    return (*cntx_)->SendOk();
+  }
+
+  if (action == "DUMP" && args.size() == 3) {
+    return (*cntx_)->SendBulkString(RequestTracer::Export());
+  }
+
+  return (*cntx_)->SendError(UnknownSubCmd(action, "DEBUG TRACE"), kSyntaxErrType);
+}
+
+// Unlike MEMORY STATS, which reports the last background passes, runs a pass in each shard
+// right away. The shards are blocked for the duration of their passes.
+void DebugCmd::KeyStats() {
+  vector<string> res;
+  for (const auto& [name, value] : RunKeyAnalysis().Items()) {
+    res.push_back(absl::StrCat(name, ":", value));
+  }
+
+  (*cntx_)->SendStringArr(res);
+}
+
+// Replies with [key, lookups] pairs. The lookups are sampled, hence only the keys that take a
+// sizable part of the traffic of their shards are found.
+void DebugCmd::HotKeys() {
+  KeyAnalyzer::Report report;
+  bool enabled = true;
+  boost::fibers::mutex mu;
+
+  auto cb = [&](EngineShard* shard) {
+    KeyAnalyzer::Report shard_report;
+    shard_report.hot_keys = shard->key_analyzer()->GetHotKeys();
+
+    lock_guard lk(mu);
+    enabled &= shard->key_analyzer()->track_ops();
+    report += shard_report;
+  };
+
+  shard_set->RunBlockingInParallel(cb);
+  if (!enabled)
+    return (*cntx_)->SendError("hot keys are not tracked, see --key_analyzer_buckets");
+
+  (*cntx_)->StartArray(report.hot_keys.size());
+  for (const auto& [key, lookups] : report.hot_keys) {
+    (*cntx_)->StartArray(2);
+    (*cntx_)->SendBulkString(key);
+    (*cntx_)->SendLong(lookups);
+  }
+}
+
+// Runs a pass in each shard like KEYSTATS and replies with [key, type, bytes] triples.
+void DebugCmd::BigKeys() {
+  KeyAnalyzer::Report report = RunKeyAnalysis();
+
+  (*cntx_)->StartArray(report.big_keys.size());
+  for (const auto& big_key : report.big_keys) {
+    (*cntx_)->StartArray(3);
+    (*cntx_)->SendBulkString(big_key.key);
+    (*cntx_)->SendBulkString(big_key.type);
+    (*cntx_)->SendLong(big_key.bytes);
+  }
+}
+
 }  // namespace dfly
@@ -10,6 +10,7 @@ namespace dfly {
 
 class EngineShardSet;
 class ServerFamily;
+struct PopulateOptions;
 
 class DebugCmd {
  public:
@@ -19,11 +20,16 @@ class DebugCmd {
 
  private:
   void Populate(CmdArgList args);
-  void PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix, unsigned value_len);
+  void PopulateRangeFiber(uint64_t from, uint64_t len, const PopulateOptions& opts);
   void Reload(CmdArgList args);
   void Load(std::string_view filename);
   void Inspect(std::string_view key);
   void Watched();
+  void TxStats();
+  void Trace(CmdArgList args);
+  void KeyStats();
+  void HotKeys();
+  void BigKeys();
 
   ServerFamily& sf_;
   ConnectionContext* cntx_;
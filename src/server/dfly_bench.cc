@@ -0,0 +1,456 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// A load generator for dragonfly and memcached that runs on the same fibers and io_uring
+// proactors as the server, so that it is not the bottleneck of the benchmark.
+
+#include <absl/flags/usage.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <atomic>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/operations.hpp>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#include "base/init.h"
+#include "base/io_buf.h"
+#include "base/logging.h"
+#include "facade/redis_parser.h"
+#include "server/error.h"
+#include "server/tx_stats.h"
+#include "util/uring/uring_pool.h"
+
+ABSL_FLAG(std::string, h, "127.0.0.1", "The address of the server");
+ABSL_FLAG(uint32_t, p, 6379, "The port of the server");
+ABSL_FLAG(std::string, protocol, "redis", "'redis' or 'memcache'");
+ABSL_FLAG(uint32_t, c, 20, "Connections per thread");
+ABSL_FLAG(uint32_t, pipeline, 1, "The commands that a connection sends before it reads replies");
+ABSL_FLAG(uint64_t, n, 10000, "The requests per connection, unless test_time is positive");
+ABSL_FLAG(uint32_t, test_time, 0, "If positive, the duration of the run in seconds");
+ABSL_FLAG(std::string, ratio, "1:10", "The ratio of SET to GET commands, e.g. '1:10'");
+ABSL_FLAG(std::string, key_prefix, "key:", "The prefix of the keys");
+ABSL_FLAG(uint64_t, key_minimum, 0, "The smallest key index");
+ABSL_FLAG(uint64_t, key_maximum, 10000000, "The largest key index");
+ABSL_FLAG(std::string, key_dist, "uniform", "The distribution of the keys: 'uniform' or 'zipf'");
+ABSL_FLAG(double, zipf_alpha, 0.99, "The skew of the zipf distribution, below 1");
+ABSL_FLAG(uint32_t, d, 32, "The size of the values of SET");
+ABSL_FLAG(uint32_t, d_max, 0,
+          "If larger than d, the sizes of the values are uniformly random in [d, d_max]");
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using absl::StrCat;
+namespace fibers = ::boost::fibers;
+namespace this_fiber = ::boost::this_fiber;
+
+namespace dfly {
+namespace {
+
+using Clock = chrono::steady_clock;
+
+enum class Protocol : uint8_t { REDIS, MEMCACHE };
+
+// Zipfian generator of Gray et al., "Quickly generating billion-record synthetic databases",
+// like the one of YCSB. The zeta constant is computed once for the key range.
+class ZipfGen {
+ public:
+  ZipfGen(uint64_t num_items, double alpha);
+
+  // u is uniform in [0, 1). Returns an item in [0, num_items), 0 being the most popular.
+  uint64_t Next(double u) const;
+
+ private:
+  uint64_t num_items_;
+  double alpha_, zetan_, eta_, theta_half_;
+};
+
+ZipfGen::ZipfGen(uint64_t num_items, double alpha) : num_items_(num_items), alpha_(alpha) {
+  zetan_ = 0;
+  for (uint64_t i = 1; i <= num_items; ++i)
+    zetan_ += 1 / pow(double(i), alpha);
+
+  double zeta2 = 1 + 1 / pow(2.0, alpha);
+  eta_ = (1 - pow(2.0 / num_items, 1 - alpha)) / (1 - zeta2 / zetan_);
+  theta_half_ = 1 + pow(0.5, alpha);
+}
+
+uint64_t ZipfGen::Next(double u) const {
+  double uz = u * zetan_;
+  if (uz < 1)
+    return 0;
+  if (uz < theta_half_)
+    return 1;
+
+  uint64_t res = num_items_ * pow(eta_ * u - eta_ + 1, 1 / (1 - alpha_));
+  return min(res, num_items_ - 1);
+}
+
+struct BenchConfig {
+  Protocol protocol = Protocol::REDIS;
+  boost::asio::ip::tcp::endpoint endpoint;
+  uint32_t pipeline = 1;
+  uint64_t num_requests = 0;
+  Clock::time_point deadline;  // the end of the run if there is no request limit.
+  uint32_t set_ratio = 1, get_ratio = 10;
+  string key_prefix;
+  uint64_t key_min = 0, key_max = 0;
+  unique_ptr<ZipfGen> zipf;  // null for the uniform distribution.
+  uint32_t val_min = 0, val_max = 0;
+  string value;  // of val_max bytes, SET sends its prefix.
+};
+
+struct ConnStats {
+  HdrHistogram latency;
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+
+  ConnStats& operator+=(const ConnStats& o) {
+    latency += o.latency;
+    requests += o.requests;
+    errors += o.errors;
+    return *this;
+  }
+};
+
+atomic_uint64_t total_requests{0};
+atomic_bool stop_run{false};
+
+// Runs the requests of a single connection, a batch of config.pipeline at a time.
+class BenchConnection {
+ public:
+  BenchConnection(const BenchConfig& config, ProactorBase* pb, uint64_t seed)
+      : config_(config), pb_(pb), rand_(seed) {
+  }
+
+  error_code Run(ConnStats* stats);
+
+ private:
+  void AppendCommand(string* dest);
+  string NextKey();
+
+  error_code Recv();
+
+  // Reads the replies of the batch that was sent at the given time point.
+  error_code ReadReplies(uint32_t count, Clock::time_point sent, ConnStats* stats);
+
+  // Returns the length of the memcache reply at the start of buf, 0 if it is incomplete.
+  size_t ParseMemcacheReply(string_view buf, bool* error) const;
+
+  const BenchConfig& config_;
+  ProactorBase* pb_;
+  mt19937_64 rand_;
+  unique_ptr<LinuxSocketBase> sock_;
+  base::IoBuf io_buf_{1 << 16};
+  facade::RedisParser parser_{false};  // client mode
+};
+
+string BenchConnection::NextKey() {
+  uint64_t range = config_.key_max - config_.key_min + 1;
+  uint64_t index;
+  if (config_.zipf) {
+    index = config_.zipf->Next(uniform_real_distribution<double>{0, 1}(rand_));
+  } else {
+    index = uniform_int_distribution<uint64_t>{0, range - 1}(rand_);
+  }
+  return StrCat(config_.key_prefix, config_.key_min + index);
+}
+
+void BenchConnection::AppendCommand(string* dest) {
+  uint32_t pick = uniform_int_distribution<uint32_t>{
+      1, config_.set_ratio + config_.get_ratio}(rand_);
+  string key = NextKey();
+
+  if (pick > config_.set_ratio) {
+    if (config_.protocol == Protocol::REDIS) {
+      absl::StrAppend(dest, "*2\r\n$3\r\nGET\r\n$", key.size(), "\r\n", key, "\r\n");
+    } else {
+      absl::StrAppend(dest, "get ", key, "\r\n");
+    }
+    return;
+  }
+
+  uint32_t len = uniform_int_distribution<uint32_t>{config_.val_min, config_.val_max}(rand_);
+  string_view value{config_.value.data(), len};
+  if (config_.protocol == Protocol::REDIS) {
+    absl::StrAppend(dest, "*3\r\n$3\r\nSET\r\n$", key.size(), "\r\n", key, "\r\n$", len, "\r\n",
+                    value, "\r\n");
+  } else {
+    absl::StrAppend(dest, "set ", key, " 0 0 ", len, "\r\n", value, "\r\n");
+  }
+}
+
+error_code BenchConnection::Recv() {
+  auto buf = io_buf_.AppendBuffer();
+  if (buf.empty()) {
+    io_buf_.Reserve(io_buf_.Capacity() * 2);
+    buf = io_buf_.AppendBuffer();
+  }
+
+  io::Result<size_t> res = sock_->Recv(buf);
+  if (!res)
+    return res.error();
+  if (*res == 0)
+    return make_error_code(errc::connection_aborted);
+
+  io_buf_.CommitWrite(*res);
+  return error_code{};
+}
+
+size_t BenchConnection::ParseMemcacheReply(string_view buf, bool* error) const {
+  size_t eol = buf.find("\r\n");
+  if (eol == string_view::npos)
+    return 0;
+
+  string_view line = buf.substr(0, eol);
+  if (line == "STORED" || line == "END")
+    return eol + 2;
+
+  if (absl::StartsWith(line, "VALUE ")) {
+    // VALUE <key> <flags> <bytes>\r\n<data>\r\nEND\r\n
+    vector<string_view> parts = absl::StrSplit(line, ' ');
+    uint64_t bytes = 0;
+    if (parts.size() < 4 || !absl::SimpleAtoi(parts[3], &bytes)) {
+      *error = true;
+      return eol + 2;
+    }
+    size_t len = eol + 2 + bytes + 2 + 5;
+    return buf.size() < len ? 0 : len;
+  }
+
+  *error = true;
+  return eol + 2;
+}
+
+error_code BenchConnection::ReadReplies(uint32_t count, Clock::time_point sent,
+                                        ConnStats* stats) {
+  facade::RespVec args;
+
+  while (count > 0) {
+    bool progress = false;
+    while (count > 0 && io_buf_.InputLen() > 0) {
+      bool error = false;
+      size_t consumed = 0;
+
+      if (config_.protocol == Protocol::REDIS) {
+        uint32_t parsed = 0;
+        facade::RedisParser::Result res = parser_.Parse(io_buf_.InputBuffer(), &parsed, &args);
+        consumed = parsed;
+        if (res == facade::RedisParser::INPUT_PENDING) {
+          io_buf_.ConsumeInput(consumed);
+          break;
+        }
+        if (res != facade::RedisParser::OK)
+          return make_error_code(errc::bad_message);
+        error = !args.empty() && args.front().type == facade::RespExpr::ERROR;
+      } else {
+        string_view buf{reinterpret_cast<const char*>(io_buf_.InputBuffer().data()),
+                        io_buf_.InputLen()};
+        consumed = ParseMemcacheReply(buf, &error);
+        if (consumed == 0)
+          break;
+      }
+
+      io_buf_.ConsumeInput(consumed);
+      auto usec = chrono::duration_cast<chrono::microseconds>(Clock::now() - sent).count();
+      stats->latency.Add(usec);
+      stats->errors += error;
+      --count;
+      progress = true;
+    }
+
+    if (count > 0 && !progress) {
+      RETURN_ON_ERR(Recv());
+    }
+  }
+
+  return error_code{};
+}
+
+error_code BenchConnection::Run(ConnStats* stats) {
+  sock_.reset(pb_->CreateSocket());
+  RETURN_ON_ERR(sock_->Connect(config_.endpoint));
+
+  string batch;
+  while (!stop_run.load(memory_order_relaxed)) {
+    uint32_t count = config_.pipeline;
+    if (config_.num_requests) {
+      if (stats->requests >= config_.num_requests)
+        break;
+      count = min<uint64_t>(count, config_.num_requests - stats->requests);
+    } else if (Clock::now() >= config_.deadline) {
+      break;
+    }
+
+    batch.clear();
+    for (uint32_t i = 0; i < count; ++i)
+      AppendCommand(&batch);
+
+    Clock::time_point sent = Clock::now();
+    RETURN_ON_ERR(sock_->Write(io::Buffer(batch)));
+    RETURN_ON_ERR(ReadReplies(count, sent, stats));
+
+    stats->requests += count;
+    total_requests.fetch_add(count, memory_order_relaxed);
+  }
+
+  sock_->Close();
+  return error_code{};
+}
+
+bool ParseConfig(BenchConfig* config) {
+  string protocol = GetFlag(FLAGS_protocol);
+  if (protocol == "memcache") {
+    config->protocol = Protocol::MEMCACHE;
+  } else if (protocol != "redis") {
+    LOG(ERROR) << "Unknown protocol " << protocol;
+    return false;
+  }
+
+  error_code ec;
+  auto address = boost::asio::ip::make_address(GetFlag(FLAGS_h), ec);
+  if (ec) {
+    LOG(ERROR) << "Invalid address " << GetFlag(FLAGS_h) << ": " << ec.message();
+    return false;
+  }
+  config->endpoint = {address, uint16_t(GetFlag(FLAGS_p))};
+
+  config->pipeline = max(1u, GetFlag(FLAGS_pipeline));
+  if (GetFlag(FLAGS_test_time) == 0) {
+    config->num_requests = GetFlag(FLAGS_n);
+  }
+
+  vector<string_view> ratio = absl::StrSplit(GetFlag(FLAGS_ratio), ':');
+  if (ratio.size() != 2 || !absl::SimpleAtoi(ratio[0], &config->set_ratio) ||
+      !absl::SimpleAtoi(ratio[1], &config->get_ratio) ||
+      config->set_ratio + config->get_ratio == 0) {
+    LOG(ERROR) << "Invalid ratio " << GetFlag(FLAGS_ratio);
+    return false;
+  }
+
+  config->key_prefix = GetFlag(FLAGS_key_prefix);
+  config->key_min = GetFlag(FLAGS_key_minimum);
+  config->key_max = GetFlag(FLAGS_key_maximum);
+  if (config->key_max < config->key_min) {
+    LOG(ERROR) << "key_maximum is less than key_minimum";
+    return false;
+  }
+
+  string dist = GetFlag(FLAGS_key_dist);
+  if (dist == "zipf") {
+    double alpha = GetFlag(FLAGS_zipf_alpha);
+    if (alpha <= 0 || alpha >= 1) {
+      LOG(ERROR) << "zipf_alpha must be in (0, 1)";
+      return false;
+    }
+    config->zipf.reset(new ZipfGen(config->key_max - config->key_min + 1, alpha));
+  } else if (dist != "uniform") {
+    LOG(ERROR) << "Unknown key distribution " << dist;
+    return false;
+  }
+
+  config->val_min = GetFlag(FLAGS_d);
+  config->val_max = max(config->val_min, GetFlag(FLAGS_d_max));
+  config->value.assign(config->val_max, 'x');
+
+  return true;
+}
+
+void PrintReport(const ConnStats& stats, double secs) {
+  const HdrHistogram& hist = stats.latency;
+  double avg = hist.count() ? double(hist.sum()) / hist.count() : 0;
+
+  cout << "Requests: " << stats.requests << ", errors: " << stats.errors << ", time: " << secs
+       << "s\n";
+  cout << "Throughput: " << uint64_t(stats.requests / secs) << " requests/s\n";
+  cout << "Latency usec: avg " << uint64_t(avg) << ", p50 " << hist.Percentile(50) << ", p90 "
+       << hist.Percentile(90) << ", p99 " << hist.Percentile(99) << ", p99.9 "
+       << hist.Percentile(99.9) << ", max " << hist.Percentile(100) << endl;
+}
+
+int RunBench(ProactorPool* pool, const BenchConfig& config) {
+  uint32_t num_conns = GetFlag(FLAGS_c);
+  vector<ConnStats> thread_stats(pool->size());
+  atomic_uint32_t failed{0};
+
+  // Prints the throughput every second while the connections run.
+  Clock::time_point start = Clock::now();
+  fibers::fiber report_fb = pool->GetNextProactor()->LaunchFiber([&] {
+    uint64_t prev = 0;
+    while (!stop_run.load(memory_order_relaxed)) {
+      this_fiber::sleep_for(1s);
+      uint64_t cur = total_requests.load(memory_order_relaxed);
+      cout << "\r" << cur - prev << " requests/s, total " << cur << flush;
+      prev = cur;
+    }
+    cout << endl;
+  });
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    vector<fibers::fiber> fbs(num_conns);
+    vector<ConnStats> stats(num_conns);
+    for (unsigned i = 0; i < num_conns; ++i) {
+      fbs[i] = fibers::fiber([&, i] {
+        BenchConnection conn(config, pb, index * num_conns + i + 1);
+        error_code ec = conn.Run(&stats[i]);
+        if (ec) {
+          LOG(WARNING) << "Connection failed: " << ec.message();
+          failed.fetch_add(1, memory_order_relaxed);
+        }
+      });
+    }
+    for (unsigned i = 0; i < num_conns; ++i) {
+      fbs[i].join();
+      thread_stats[index] += stats[i];
+    }
+  });
+
+  double secs = chrono::duration<double>(Clock::now() - start).count();
+  stop_run.store(true, memory_order_relaxed);
+  report_fb.join();
+
+  ConnStats total;
+  for (const auto& stats : thread_stats)
+    total += stats;
+  PrintReport(total, secs);
+
+  return failed.load(memory_order_relaxed) ? 1 : 0;
+}
+
+}  // namespace
+}  // namespace dfly
+
+using namespace dfly;
+
+int main(int argc, char* argv[]) {
+  absl::SetProgramUsageMessage(
+      R"(a load generator for dragonfly and memcached.
+
+Usage: dfly_bench [FLAGS]
+)");
+  MainInitGuard guard(&argc, &argv);
+
+  BenchConfig config;
+  if (!ParseConfig(&config))
+    return 1;
+
+  uring::UringPool pp{1024};
+  pp.Run();
+
+  if (GetFlag(FLAGS_test_time) > 0) {
+    config.deadline = Clock::now() + chrono::seconds(GetFlag(FLAGS_test_time));
+  }
+
+  int res = RunBench(&pp, config);
+  pp.Stop();
+
+  return res;
+}
@@ -17,6 +17,7 @@
 #include "base/init.h"
 #include "base/proc_util.h"  // for GetKernelVersion
 #include "facade/dragonfly_listener.h"
+#include "facade/numa.h"
 #include "io/proc_reader.h"
 #include "server/main_service.h"
 #include "server/version.h"
@@ -36,6 +37,14 @@ ABSL_FLAG(bool, use_large_pages, false, "If true - uses large memory pages for a
 ABSL_FLAG(string, bind, "",
           "Bind address. If empty - binds on all interfaces. "
           "It's not advised due to security implications.");
+ABSL_FLAG(bool, numa_bind, false,
+          "If true, pins the threads to the cpus of the host, spread over its NUMA nodes, and "
+          "allocates the memory of each thread from its node. With conn_use_incoming_cpu, "
+          "connections prefer the threads on the node of their incoming cpu");
+ABSL_FLAG(string, unixsocket, "",
+          "If set, the path of a unix socket to accept the redis connections on, in addition to "
+          "the tcp port");
+ABSL_FLAG(string, unixsocketperm, "", "Octal permissions of the unix socket, 0777 if empty");
 
 using namespace util;
 using namespace facade;
@@ -95,6 +104,31 @@ string NormalizePaths(std::string_view path) {
   return string(path);
 }
 
+// Must run before the shards are created, so that their heaps are allocated on the nodes
+// of their threads.
+void BindToNumaNodes(ProactorPool* pool) {
+  vector<vector<unsigned>> nodes = numa::ReadNodes();
+  if (nodes.size() < 2) {
+    LOG(INFO) << "Single NUMA node, numa_bind has no effect";
+    return;
+  }
+
+  vector<numa::CpuSlot> slots = numa::InterleaveCpus(nodes);
+  if (pool->size() > slots.size()) {
+    LOG(WARNING) << "More threads than cpus, some threads share a cpu";
+  }
+
+  numa::SetTopology(nodes, pool->size());
+  pool->Await([&](unsigned index, ProactorBase*) {
+    const numa::CpuSlot& slot = slots[index % slots.size()];
+    if (numa::BindThread(index, slot)) {
+      VLOG(1) << "Thread " << index << " is bound to cpu " << slot.cpu << " of node "
+              << slot.node;
+    }
+  });
+  LOG(INFO) << "Bound " << pool->size() << " threads to " << nodes.size() << " NUMA nodes";
+}
+
 bool RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
   auto maxmemory = GetFlag(FLAGS_maxmemory);
 
@@ -105,22 +139,62 @@ bool RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
 
   Service service(pool);
 
-  Listener* main_listener = new Listener{Protocol::REDIS, &service};
+  // Either a listener per connection thread or a single one, see FLAGS_conn_reuseport.
+  vector<Listener*> listeners = Listener::CreateReusePort(Protocol::REDIS, &service, pool);
+  if (listeners.empty())
+    listeners.push_back(new Listener{Protocol::REDIS, &service});
+
+  // The connections of the unix socket go through the same Connection as the tcp ones.
+  const auto& unix_path = GetFlag(FLAGS_unixsocket);
+  Listener* unix_listener = nullptr;
+  if (!unix_path.empty()) {
+    unix_listener = new Listener{Protocol::REDIS, &service};
+    listeners.push_back(unix_listener);
+  }
 
   Service::InitOpts opts;
   opts.disable_time_update = false;
-  service.Init(acceptor, main_listener, opts);
+  service.Init(acceptor, {listeners.begin(), listeners.end()}, opts);
   const auto& bind = GetFlag(FLAGS_bind);
   const char* bind_addr = bind.empty() ? nullptr : bind.c_str();
   auto port = GetFlag(FLAGS_port);
   auto mc_port = GetFlag(FLAGS_memcache_port);
 
-  error_code ec = acceptor->AddListener(bind_addr, port, main_listener);
+  for (Listener* listener : listeners) {
+    if (listener == unix_listener)
+      continue;
+    error_code ec = acceptor->AddListener(bind_addr, port, listener);
+    LOG_IF(FATAL, ec) << "Cound not open port " << port << ", error: " << ec.message();
+  }
 
-  LOG_IF(FATAL, ec) << "Cound not open port " << port << ", error: " << ec.message();
+  if (unix_listener) {
+    const auto& perm_str = GetFlag(FLAGS_unixsocketperm);
+    mode_t perm = 0777;
+    if (!perm_str.empty()) {
+      char* end = nullptr;
+      unsigned long val = strtoul(perm_str.c_str(), &end, 8);
+      if (*end != '\0' || val > 0777) {
+        LOG(ERROR) << "Invalid unixsocketperm " << perm_str;
+        exit(1);
+      }
+      perm = val;
+    }
+
+    // A socket file left by a previous run would fail the bind.
+    unlink(unix_path.c_str());
+    error_code ec = acceptor->AddUDSListener(unix_path.c_str(), perm, unix_listener);
+    LOG_IF(FATAL, ec) << "Could not open unix socket " << unix_path << ", error: "
+                      << ec.message();
+  }
 
   if (mc_port > 0) {
-    acceptor->AddListener(mc_port, new Listener{Protocol::MEMCACHE, &service});
+    vector<Listener*> mc_listeners =
+        Listener::CreateReusePort(Protocol::MEMCACHE, &service, pool);
+    if (mc_listeners.empty())
+      mc_listeners.push_back(new Listener{Protocol::MEMCACHE, &service});
+    for (Listener* listener : mc_listeners) {
+      acceptor->AddListener(mc_port, listener);
+    }
   }
 
   acceptor->Run();
@@ -207,6 +281,10 @@ Usage: dragonfly [FLAGS]
   uring::UringPool pp{1024};
   pp.Run();
 
+  if (GetFlag(FLAGS_numa_bind)) {
+    dfly::BindToNumaNodes(&pp);
+  }
+
   AcceptServer acceptor(&pp);
 
   int res = dfly::RunEngine(&pp, &acceptor) ? 0 : -1;
@@ -8,26 +8,47 @@ extern "C" {
 }
 
 #include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
 #include <absl/strings/strip.h>
 #include <gmock/gmock.h>
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
 #include "server/conn_context.h"
 #include "server/main_service.h"
+#include "server/server_state.h"
 #include "server/test_utils.h"
+#include "server/tx_stats.h"
 #include "util/uring/uring_pool.h"
 
+ABSL_DECLARE_FLAG(bool, multi_exec_squash);
+ABSL_DECLARE_FLAG(bool, lua_run_in_shard);
+ABSL_DECLARE_FLAG(uint32_t, num_shards);
+ABSL_DECLARE_FLAG(int64_t, slowlog_log_slower_than);
+ABSL_DECLARE_FLAG(string, key_analyzer_prefixes);
+ABSL_DECLARE_FLAG(uint32_t, key_analyzer_buckets);
+ABSL_DECLARE_FLAG(string, maxmemory_policy);
+ABSL_DECLARE_FLAG(uint64_t, reserve_keys);
+ABSL_DECLARE_FLAG(uint32_t, latency_monitor_threshold_usec);
+ABSL_DECLARE_FLAG(bool, change_feed_values);
+ABSL_DECLARE_FLAG(bool, optimistic_reads);
+
 namespace dfly {
 
 using namespace std;
 using namespace util;
 using absl::StrCat;
 using ::io::Result;
+using testing::Contains;
 using testing::ElementsAre;
 using testing::HasSubstr;
+using testing::IsEmpty;
 namespace this_fiber = boost::this_fiber;
 
 namespace {
@@ -123,6 +144,60 @@ TEST_F(DflyEngineTest, MultiEmpty) {
   EXPECT_EQ(resp, "foo");
 }
 
+TEST_F(DflyEngineTest, Watch) {
+  Run({"set", kKey1, "1"});
+  ASSERT_EQ(Run({"watch", kKey1, kKey4}), "OK");
+
+  Run({"multi"});
+  EXPECT_THAT(Run({"watch", kKey1}), ErrArg("WATCH inside MULTI"));
+  ASSERT_EQ(Run({"incr", kKey1}), "QUEUED");
+  EXPECT_THAT(Run({"exec"}), IntArg(2));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  // A change from another connection aborts EXEC, including the creation of a missing key.
+  auto other = [&](std::initializer_list<string_view> cmd) {
+    pp_->at(1)->Await([&] { return Run("other", cmd); });
+  };
+
+  Run({"watch", kKey1});
+  other({"set", kKey1, "5"});
+  Run({"multi"});
+  Run({"incr", kKey1});
+  EXPECT_THAT(Run({"exec"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_EQ(Run({"get", kKey1}), "5");
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  Run({"watch", kKey4});
+  other({"set", kKey4, "a"});
+  Run({"multi"});
+  EXPECT_THAT(Run({"exec"}), ArgType(RespExpr::NIL_ARRAY));
+
+  Run({"watch", kKey4});
+  other({"del", kKey4});
+  Run({"multi"});
+  Run({"get", kKey4});
+  EXPECT_THAT(Run({"exec"}), ArgType(RespExpr::NIL_ARRAY));
+
+  // EXEC, DISCARD and UNWATCH forget the keys.
+  Run({"watch", kKey1});
+  Run({"multi"});
+  Run({"discard"});
+  other({"set", kKey1, "6"});
+  Run({"multi"});
+  Run({"incr", kKey1});
+  EXPECT_THAT(Run({"exec"}), IntArg(7));
+
+  Run({"watch", kKey1});
+  ASSERT_EQ(Run({"unwatch"}), "OK");
+  other({"set", kKey1, "8"});
+  Run({"multi"});
+  Run({"incr", kKey1});
+  EXPECT_THAT(Run({"exec"}), IntArg(9));
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+}
+
 TEST_F(DflyEngineTest, MultiSeq) {
   RespExpr resp = Run({"multi"});
   ASSERT_EQ(resp, "OK");
@@ -146,6 +221,60 @@ TEST_F(DflyEngineTest, MultiSeq) {
   ASSERT_THAT(arr[2].GetVec(), ElementsAre("1", ArgType(RespExpr::NIL)));
 }
 
+TEST_F(DflyEngineTest, MultiSquash) {
+  absl::SetFlag(&FLAGS_multi_exec_squash, true);
+
+  Run({"multi"});
+  ASSERT_EQ(Run({"set", kKey1, "1"}), "QUEUED");
+  ASSERT_EQ(Run({"incr", kKey4}), "QUEUED");
+  ASSERT_EQ(Run({"incr", kKey1}), "QUEUED");
+  ASSERT_EQ(Run({"lpush", kKey4, "a"}), "QUEUED");
+  ASSERT_EQ(Run({"get", kKey1}), "QUEUED");
+  RespExpr resp = Run({"exec"});
+
+  ASSERT_THAT(resp, ArrLen(5));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("OK", IntArg(1), IntArg(2), ErrArg("WRONGTYPE"), "2"));
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsLocked(0, kKey4));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  // mget spans two shards, hence the block falls back to the regular flow.
+  Run({"multi"});
+  ASSERT_EQ(Run({"incr", kKey1}), "QUEUED");
+  ASSERT_EQ(Run({"mget", kKey1, kKey4}), "QUEUED");
+  resp = Run({"exec"});
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(3));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  // Squashed blocks stay atomic with respect to multi-shard transactions.
+  Run({"mset", kKey1, "0", kKey4, "0"});
+  auto mset_fb = pp_->at(0)->LaunchFiber([&] {
+    for (unsigned i = 0; i < 100; ++i) {
+      Run({"mset", kKey1, "0", kKey4, "0"});
+    }
+  });
+
+  pp_->at(1)->Await([&] {
+    for (unsigned i = 0; i < 100; ++i) {
+      Run({"multi"});
+      Run({"incr", kKey1});
+      Run({"incr", kKey4});
+      resp = Run({"exec"});
+      ASSERT_THAT(resp, ArrLen(2));
+      EXPECT_EQ(resp.GetVec()[0], resp.GetVec()[1]);
+    }
+  });
+  mset_fb.join();
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  absl::SetFlag(&FLAGS_multi_exec_squash, false);
+}
+
 TEST_F(DflyEngineTest, MultiConsistent) {
   auto mset_fb = pp_->at(0)->LaunchFiber([&] {
     for (size_t i = 1; i < 10; ++i) {
@@ -263,6 +392,454 @@ TEST_F(DflyEngineTest, FlushDb) {
   ASSERT_FALSE(service_->IsShardSetLocked());
 }
 
+TEST_F(DflyEngineTest, PopulateTypes) {
+  Run({"debug", "populate", "100", "h", "8", "type", "hash", "elements", "5"});
+  EXPECT_THAT(Run({"hlen", "h:7"}), IntArg(5));
+  EXPECT_EQ(Run({"hget", "h:7", "field:1"}), "value:1x");
+
+  Run({"debug", "populate", "100", "z", "type", "zset", "elements", "3", "expire", "100", "1000"});
+  EXPECT_THAT(Run({"zcard", "z:0"}), IntArg(3));
+  EXPECT_EQ(Run({"zscore", "z:0", "member:2"}), "2");
+  int64_t ttl = CheckedInt({"ttl", "z:0"});
+  EXPECT_GT(ttl, 0);
+  EXPECT_LE(ttl, 1000);
+
+  Run({"debug", "populate", "100", "l", "4", "maxsize", "16", "type", "list"});
+  EXPECT_THAT(Run({"llen", "l:3"}), IntArg(16));
+  auto resp = Run({"lindex", "l:3", "10"});
+  EXPECT_GE(resp.GetString().size(), 8u);
+  EXPECT_LE(resp.GetString().size(), 16u);
+
+  Run({"debug", "populate", "10", "s", "type", "set"});
+  EXPECT_THAT(Run({"scard", "s:3"}), IntArg(16));
+  EXPECT_THAT(Run({"dbsize"}), IntArg(310));
+
+  EXPECT_THAT(Run({"debug", "populate", "10", "type", "blob"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"debug", "populate", "10", "expire", "200", "10"}), ErrArg("not an integer"));
+}
+
+TEST_F(DflyEngineTest, FlushAllAsync) {
+  Run({"debug", "populate", "100000"});
+  EXPECT_EQ(Run({"flushall", "async"}), "OK");
+  EXPECT_THAT(Run({"dbsize"}), IntArg(0));
+
+  auto pending = [&] {
+    auto resp = Run({"info", "memory"});
+    return ToSV(resp.GetBuf()).find("flush_pending_keys:0\r\n") == string_view::npos;
+  };
+  EXPECT_TRUE(pending());
+
+  // The flushed tables are released by the heartbeat.
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 1000 && pending(); ++i) {
+    this_fiber::sleep_for(5ms);
+  }
+  EXPECT_FALSE(pending());
+
+  Run({"mset", kKey1, "1", kKey4, "2"});
+  EXPECT_EQ(Run({"flushdb", "sync"}), "OK");
+  EXPECT_THAT(Run({"exists", kKey1, kKey4}), IntArg(0));
+  EXPECT_FALSE(pending());
+
+  EXPECT_THAT(Run({"flushall", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(DflyEngineTest, CachedMetrics) {
+  Run({"set", kKey1, "1"});
+  Run({"set", kKey4, "2"});
+
+  // Without the heartbeat there are no shard snapshots, hence INFO collects the metrics.
+  auto has_keys = [&](string_view keys) {
+    auto resp = Run({"info", "keyspace"});
+    return ToSV(resp.GetBuf()).find(absl::StrCat("keys=", keys, ",")) != string_view::npos;
+  };
+  EXPECT_TRUE(has_keys("2"));
+
+  shard_set->TEST_EnableHeartBeat();
+  Run({"del", kKey1});
+  for (unsigned i = 0; i < 1000 && !has_keys("1"); ++i) {
+    this_fiber::sleep_for(5ms);
+  }
+  EXPECT_TRUE(has_keys("1"));
+
+  Metrics cached = service_->server_family().GetCachedMetrics();
+  EXPECT_EQ(1u, cached.db[0].key_count);
+  EXPECT_EQ(shard_set->size(), cached.shard_tx.size());
+}
+
+TEST_F(DflyEngineTest, ThreadMetrics) {
+  Run({"mset", kKey1, "1", kKey2, "2", kKey3, "3", kKey4, "4"});
+
+  Metrics m = service_->server_family().GetMetrics();
+  ASSERT_EQ(pp_->size(), m.thread_cpu.size());
+  uint64_t tasks = 0;
+  for (const auto& tx : m.shard_tx) {
+    tasks += tx.queue_tasks;
+  }
+  EXPECT_GT(tasks, 0u);
+  EXPECT_GT(m.thread_cpu[0].user_usec + m.thread_cpu[0].sys_usec, 0u);
+
+  string info = Run({"info", "cpu"}).GetString();
+  EXPECT_THAT(info, HasSubstr("thread0_cpu:user_usec="));
+  EXPECT_THAT(info, HasSubstr("shard0_queue:len="));
+}
+
+TEST_F(DflyEngineTest, SchedulerMetrics) {
+  auto sum = [this](auto field) {
+    Metrics m = service_->server_family().GetMetrics();
+    uint64_t res = 0;
+    for (const auto& tx : m.shard_tx)
+      res += tx.*field;
+    return res;
+  };
+
+  Run({"mset", kKey1, "1", kKey2, "2", kKey3, "3", kKey4, "4"});
+  EXPECT_GT(sum(&Metrics::ShardTxStats::schedule_attempts), 0u);
+
+  auto fb = pp_->at(1)->LaunchFiber([&] { Run({"blpop", "list", "0"}); });
+  for (unsigned i = 0; i < 100 && sum(&Metrics::ShardTxStats::blocked_txs) == 0; ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_EQ(1u, sum(&Metrics::ShardTxStats::blocked_txs));
+
+  Run({"lpush", "list", "a"});
+  fb.join();
+  EXPECT_EQ(0u, sum(&Metrics::ShardTxStats::blocked_txs));
+  EXPECT_EQ(1u, sum(&Metrics::ShardTxStats::awakened_txs));
+
+  auto resp = Run({"debug", "txstats"});
+  EXPECT_THAT(StrArray(resp), Contains(HasSubstr(",lock_conflicts=")));
+  EXPECT_THAT(StrArray(resp), Contains(HasSubstr(",fast_lane_runs=")));
+}
+
+TEST_F(DflyEngineTest, FastLane) {
+  auto sum = [this](auto field) {
+    Metrics m = service_->server_family().GetMetrics();
+    uint64_t res = 0;
+    for (const auto& tx : m.shard_tx)
+      res += tx.*field;
+    return res;
+  };
+
+  // All the keys reside in the same shard.
+  shard_by_hashtag = true;
+  Run({"set", "{s}a", "1"});
+
+  // The script holds the shard between its hops until {s}go appears.
+  const char kStall[] = R"(
+while redis.call('exists', KEYS[2]) == 0 do end
+return redis.call('get', KEYS[1])
+)";
+  RespExpr stall_resp;
+  auto stall_fb = pp_->at(1)->LaunchFiber(
+      [&] { stall_resp = Run({"eval", kStall, "2", "{s}a", "{s}go"}); });
+  for (unsigned i = 0; i < 100 && !IsLocked(0, "{s}a"); ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_TRUE(IsLocked(0, "{s}a"));
+
+  // The suspended blpop keeps the lock of {s}b until it expires.
+  auto blpop_fb = pp_->at(2)->LaunchFiber([&] { Run({"blpop", "{s}b", "0.2"}); });
+  for (unsigned i = 0; i < 100 && sum(&Metrics::ShardTxStats::blocked_txs) == 0; ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_EQ(1u, sum(&Metrics::ShardTxStats::blocked_txs));
+
+  atomic_bool a_done{false};
+  RespExpr a_resp, b_resp;
+  auto get_a_fb = pp_->at(0)->LaunchFiber([&] {
+    a_resp = Run({"get", "{s}a"});
+    a_done = true;
+  });
+  auto get_b_fb = pp_->at(3)->LaunchFiber([&] { b_resp = Run({"get", "{s}b"}); });
+  for (unsigned i = 0; i < 100 && sum(&Metrics::ShardTxStats::txq_fast_len) < 2; ++i) {
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_EQ(2u, sum(&Metrics::ShardTxStats::txq_fast_len));
+
+  // Once the blpop expires, the get of {s}b runs ahead of the stalled queue while the get of
+  // {s}a waits for the script.
+  blpop_fb.join();
+  get_b_fb.join();
+  EXPECT_THAT(b_resp, ArgType(RespExpr::NIL));
+  EXPECT_EQ(1u, sum(&Metrics::ShardTxStats::fast_lane_runs));
+  EXPECT_FALSE(a_done);
+
+  shard_set->Await(Shard("{s}go", shard_set->size()), [] {
+    EngineShard::tlocal()->db_slice().AddOrFind(0, "{s}go", PrimeValue{"1"}, 0);
+  });
+  stall_fb.join();
+  get_a_fb.join();
+  EXPECT_EQ(stall_resp, "1");
+  EXPECT_EQ(a_resp, "1");
+
+  shard_by_hashtag = false;
+}
+
+TEST_F(DflyEngineTest, HeartbeatBackoff) {
+  auto interval = [this] {
+    Metrics m = service_->server_family().GetMetrics();
+    uint32_t res = UINT32_MAX;
+    for (const auto& tx : m.shard_tx)
+      res = min(res, tx.heartbeat_interval_ms);
+    return res;
+  };
+
+  // The heartbeat slows down while there are no requests.
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 100 && interval() < 64; ++i) {
+    this_fiber::sleep_for(10ms);
+  }
+  EXPECT_GE(interval(), 64u);
+
+  Metrics m = service_->server_family().GetMetrics();
+  EXPECT_GT(m.shard_tx[0].heartbeat_ticks, 0u);
+  EXPECT_GT(m.shard_tx[0].heartbeat_idle_ticks, 0u);
+
+  // Requests restore the base rate of the shards they reach.
+  for (unsigned i = 0; i < 100 && interval() > 1; ++i) {
+    Run({"mset", kKey1, "1", kKey2, "2", kKey3, "3", kKey4, "4"});
+    this_fiber::sleep_for(1ms);
+  }
+  EXPECT_EQ(1u, interval());
+
+  auto resp = Run({"info", "cpu"});
+  EXPECT_THAT(resp.GetString(), HasSubstr("shard0_heartbeat:interval_ms="));
+}
+
+TEST_F(DflyEngineTest, LatencyMonitor) {
+  EXPECT_THAT(Run({"latency", "latest"}), ArrLen(0));
+
+  absl::SetFlag(&FLAGS_latency_monitor_threshold_usec, 1);
+  vector<string> members;
+  for (unsigned i = 0; i < 2000; ++i) {
+    members.push_back(absl::StrCat("member", i));
+  }
+  vector<string_view> args{"sadd", "s"};
+  args.insert(args.end(), members.begin(), members.end());
+  Run(absl::MakeSpan(args));
+
+  // The set is below lazy_free_threshold, so DEL frees its members inline.
+  EXPECT_THAT(Run({"del", "s"}), IntArg(1));
+  absl::SetFlag(&FLAGS_latency_monitor_threshold_usec, 0);
+
+  auto resp = Run({"latency", "latest"});
+  ASSERT_THAT(resp, ArrLen(1));
+  ASSERT_THAT(resp.GetVec()[0], ArrLen(4));
+  EXPECT_EQ(resp.GetVec()[0].GetVec()[0], "large-free");
+
+  resp = Run({"latency", "history", "large-free"});
+  ASSERT_THAT(resp, ArrLen(1));
+  EXPECT_THAT(resp.GetVec()[0], ArrLen(2));
+  EXPECT_THAT(Run({"latency", "history", "nosuchevent"}), ArrLen(0));
+
+  EXPECT_THAT(Run({"latency", "reset", "nosuchevent"}), IntArg(0));
+  EXPECT_THAT(Run({"latency", "reset"}), IntArg(1));
+  EXPECT_THAT(Run({"latency", "latest"}), ArrLen(0));
+}
+
+TEST(LatencyMonitorTest, Merge) {
+  LatencyMonitor::EventMap a, b;
+  a["e"].history = {{10, 5}, {12, 7}};
+  a["e"].max_usec = 7;
+  b["e"].history = {{11, 3}, {12, 9}};
+  b["e"].max_usec = 9;
+  b["f"].history = {{11, 1}};
+
+  LatencyMonitor::Merge(b, &a);
+  ASSERT_EQ(3u, a["e"].history.size());
+  EXPECT_EQ(11, a["e"].history[1].unix_ts);
+  EXPECT_EQ(9u, a["e"].history[2].latency_usec);
+  EXPECT_EQ(9u, a["e"].max_usec);
+  EXPECT_EQ(1u, a["f"].history.size());
+}
+
+TEST_F(DflyEngineTest, LazyFree) {
+  vector<string> members;
+  for (unsigned i = 0; i < 10000; ++i) {
+    members.push_back(absl::StrCat("member", i));
+  }
+
+  vector<string_view> args{"sadd", "s"};
+  args.insert(args.end(), members.begin(), members.end());
+  Run(absl::MakeSpan(args));
+  args[1] = "s2";
+  Run(absl::MakeSpan(args));
+  Run({"sadd", "small", "a", "b"});
+
+  auto pending = [&] {
+    auto resp = Run({"info", "memory"});
+    return ToSV(resp.GetBuf()).find("lazyfree_pending_objects:0\r\n") == string_view::npos;
+  };
+
+  // The keys are gone right away while their values are released by the heartbeat.
+  EXPECT_THAT(Run({"unlink", "s", "small"}), IntArg(2));
+  EXPECT_EQ(Run({"set", "s2", "val"}), "OK");
+  EXPECT_THAT(Run({"exists", "s", "small"}), IntArg(0));
+  EXPECT_EQ(Run({"get", "s2"}), "val");
+  EXPECT_TRUE(pending());
+
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 1000 && pending(); ++i) {
+    this_fiber::sleep_for(5ms);
+  }
+  EXPECT_FALSE(pending());
+}
+
+TEST_F(DflyEngineTest, PipelineSquash) {
+  auto resp = RunPipeline({{"set", kKey1, "1"},
+                           {"set", kKey4, "2"},
+                           {"incr", kKey1},
+                           {"get", kKey4},
+                           {"mget", kKey1, kKey4},
+                           {"getset", kKey1, "3"},
+                           {"get", kKey1},
+                           {"lpush", kKey4, "a"}});
+  EXPECT_THAT(resp, ElementsAre("+OK", "+OK", ":2", "$1", "2", "*2", "$1", "2", "$1", "2", "$1",
+                                "2", "$1", "3", HasSubstr("WRONGTYPE")));
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsLocked(0, kKey4));
+
+  // Squashed commands and regular multi-shard transactions keep each other atomic.
+  auto fb0 = pp_->at(0)->LaunchFiber([&] {
+    for (unsigned i = 0; i < 100; ++i) {
+      Run({"mset", kKey1, "1", kKey4, "1"});
+    }
+  });
+
+  pp_->at(1)->Await([&] {
+    for (unsigned i = 0; i < 100; ++i) {
+      RunPipeline({{"incr", kKey1}, {"incr", kKey4}});
+    }
+  });
+  fb0.join();
+
+  EXPECT_FALSE(service_->IsLocked(0, kKey1));
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
+TEST_F(DflyEngineTest, DebugTrace) {
+  EXPECT_THAT(Run({"debug", "trace", "start", "0"}), ErrArg("not an integer"));
+  EXPECT_EQ(Run({"debug", "trace", "start", "1"}), "OK");
+  Run({"mset", kKey1, "1", kKey4, "2"});
+  EXPECT_EQ(Run({"debug", "trace", "stop"}), "OK");
+
+  // The test connections do not parse the commands, hence they are not sampled.
+  auto resp = Run({"debug", "trace", "dump"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("\"traceEvents\":["));
+  EXPECT_THAT(Run({"debug", "trace", "pause"}), ErrArg("Unknown subcommand"));
+}
+
+TEST_F(DflyEngineTest, TxStats) {
+  Run({"set", kKey1, "1"});
+  Run({"mget", kKey1, kKey4});
+
+  auto resp = Run({"debug", "txstats"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  vector<string> stats = StrArray(resp);
+  EXPECT_THAT(stats, Contains(HasSubstr("latency_set_exec:calls=")));
+  EXPECT_THAT(stats, Contains(HasSubstr("latency_set_reply:calls=")));
+  EXPECT_THAT(stats, Contains(HasSubstr("latency_mget_schedule:calls=")));
+  EXPECT_THAT(stats, Contains(HasSubstr("latency_mget_queue:calls=")));
+  EXPECT_THAT(stats, Contains(HasSubstr("shard0_tx:txq_len=0,")));
+
+  resp = Run({"info", "latencystats"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("latency_mget_exec:calls="));
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("latency_percentiles_usec_mget:p50="));
+
+  resp = Run({"latency", "histogram", "set", "nosuchcmd"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], "set");
+  const auto& hist = resp.GetVec()[1].GetVec();
+  ASSERT_EQ(10u, hist.size());
+  EXPECT_EQ(hist[0], "calls");
+  EXPECT_THAT(hist[1], IntArg(1));
+  EXPECT_EQ(hist[8], "histogram_usec");
+  EXPECT_THAT(hist[9], ArrLen(2));
+}
+
+TEST_F(DflyEngineTest, HdrHistogram) {
+  HdrHistogram hist;
+  for (uint64_t i = 1; i <= 1000; ++i) {
+    hist.Add(i);
+  }
+
+  EXPECT_EQ(1000u, hist.count());
+  EXPECT_EQ(1u, hist.Percentile(0.1));
+
+  // Within 1/8 of the real values.
+  EXPECT_GE(hist.Percentile(50), 500u);
+  EXPECT_LE(hist.Percentile(50), 500u + 500 / 8);
+  EXPECT_GE(hist.Percentile(99), 990u);
+  EXPECT_LE(hist.Percentile(99), 990u + 990 / 8);
+
+  for (unsigned i = 1; i < HdrHistogram::kNumBuckets; ++i) {
+    ASSERT_LT(HdrHistogram::BucketMax(i - 1), HdrHistogram::BucketMax(i));
+  }
+}
+
+TEST_F(DflyEngineTest, Slowlog) {
+  absl::SetFlag(&FLAGS_slowlog_log_slower_than, 0);
+  Run({"slowlog", "reset"});
+  Run({"set", "foo", "bar"});
+
+  auto resp = Run({"slowlog", "get", "1"});
+  ASSERT_THAT(resp, ArrLen(1));
+  const auto& entry = resp.GetVec()[0];
+  ASSERT_THAT(entry, ArrLen(7));
+  EXPECT_THAT(entry.GetVec()[3].GetVec(), ElementsAre("SET", "foo", "bar"));
+  EXPECT_THAT(entry.GetVec()[6], ArrLen(unsigned(TxStage::NUM_STAGES) * 2));
+
+  // The slowlog commands are recorded as well: reset, set and get.
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(3));
+
+  absl::SetFlag(&FLAGS_slowlog_log_slower_than, 10000);
+  EXPECT_EQ(Run({"slowlog", "reset"}), "OK");
+  Run({"get", "foo"});
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(0));
+  EXPECT_THAT(Run({"slowlog", "foo"}), ErrArg("Unknown subcommand"));
+}
+
+TEST_F(DflyEngineTest, HashTagSharding) {
+  EXPECT_EQ("42", KeyHashTag("user:{42}:profile"));
+  EXPECT_EQ("b", KeyHashTag("{b}{c}"));
+  EXPECT_EQ("a{}b", KeyHashTag("a{}b"));
+  EXPECT_EQ("a{b", KeyHashTag("a{b"));
+
+  // The flag is read by EngineShardSet::Init, so we switch the mode while the db is empty.
+  shard_by_hashtag = true;
+  EXPECT_EQ(Shard("user:{42}:profile", shard_set->size()),
+            Shard("user:{42}:sessions", shard_set->size()));
+
+  Run({"set", "user:{42}:profile", "1"});
+  EXPECT_EQ(Run({"rename", "user:{42}:profile", "user:{42}:sessions"}), "OK");
+  EXPECT_EQ(1, GetDebugInfo().shards_count);
+  EXPECT_EQ(Run({"get", "user:{42}:sessions"}), "1");
+
+  Run({"sadd", "{s}a", "x"});
+  EXPECT_THAT(Run({"smove", "{s}a", "{s}b", "x"}), IntArg(1));
+  EXPECT_EQ(1, GetDebugInfo().shards_count);
+
+  shard_by_hashtag = false;
+}
+
+TEST_F(DflyEngineTest, TransactionReuse) {
+  // Transactions are recycled between commands of different kinds, none of them should
+  // observe the state of the previous one.
+  for (unsigned i = 0; i < 100; ++i) {
+    string val = StrCat(i);
+    Run({"mset", kKey1, val, kKey2, val, kKey3, val, kKey4, val});
+    auto resp = Run({"mget", kKey1, kKey2, kKey3, kKey4});
+    ASSERT_EQ(RespExpr::ARRAY, resp.type);
+    EXPECT_THAT(resp.GetVec(), ElementsAre(val, val, val, val));
+
+    EXPECT_EQ(Run({"eval", "return redis.call('get', KEYS[1])", "1", kKey4}), val);
+    EXPECT_THAT(Run({"del", kKey1}), IntArg(1));
+    EXPECT_THAT(Run({"exists", kKey1, kKey2}), IntArg(1));
+  }
+}
+
 TEST_F(DflyEngineTest, Eval) {
   auto resp = Run({"incrby", "foo", "42"});
   EXPECT_THAT(resp, IntArg(42));
@@ -300,6 +877,55 @@ TEST_F(DflyEngineTest, EvalResp) {
   resp = Run({"eval", "return {5, 'foo', 17.5}", "0"});
   ASSERT_THAT(resp, ArrLen(3));
   EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(5), "foo", "17.5"));
+
+  // The range replies are written within the shard, the scripts must still get lua tables.
+  Run({"rpush", "list", "a", "b", "c"});
+  resp = Run({"eval", "return #redis.call('lrange', KEYS[1], 0, -1)", "1", "list"});
+  EXPECT_THAT(resp, IntArg(3));
+
+  Run({"xadd", "stream", "1-1", "f", "v"});
+  resp = Run({"eval", "return redis.call('xrange', KEYS[1], '-', '+')[1][2]", "1", "stream"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("f", "v"));
+}
+
+TEST_F(DflyEngineTest, EvalInShard) {
+  absl::SetFlag(&FLAGS_lua_run_in_shard, true);
+
+  const char kLimiter[] = R"(
+local cnt = redis.call('incr', KEYS[1])
+if cnt == 1 then
+  redis.call('expire', KEYS[1], ARGV[1])
+end
+return {cnt, redis.call('ttl', KEYS[1])}
+)";
+
+  auto resp = Run({"eval", kLimiter, "1", "foo", "100"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(100)));
+
+  resp = Run({"eval", kLimiter, "1", "foo", "100"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(2));
+  EXPECT_EQ(1, GetDebugInfo().shards_count);
+
+  resp = Run({"eval", "return redis.call('get', 'bar')", "1", "foo"});
+  EXPECT_THAT(resp, ErrArg("undeclared"));
+
+  resp = Run({"eval", "return redis.call('ping')", "1", "foo"});
+  EXPECT_THAT(resp, ErrArg("not allowed"));
+
+  resp = Run({"eval", "return redis.call('lpush', KEYS[1], 'a')", "1", "foo"});
+  EXPECT_THAT(resp, ErrArg("WRONGTYPE"));
+
+  ASSERT_FALSE(service_->IsLocked(0, "foo"));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  // Keys of different shards run on the coordinator as before.
+  resp = Run({"eval", "return redis.call('exists', KEYS[2])", "2", "a", "b"});
+  EXPECT_EQ(2, GetDebugInfo().shards_count);
+  EXPECT_THAT(resp, IntArg(0));
+
+  absl::SetFlag(&FLAGS_lua_run_in_shard, false);
 }
 
 TEST_F(DflyEngineTest, EvalPublish) {
@@ -344,6 +970,13 @@ TEST_F(DflyEngineTest, EvalSha) {
 
   string sha{ToSV(resp.GetBuf())};
 
+  // The tasks of a thread run in order, so the script was preloaded once AwaitBrief returns.
+  for (unsigned i = 0; i < pp_->size(); ++i) {
+    EXPECT_TRUE(pp_->at(i)->AwaitBrief(
+        [&] { return ServerState::tlocal()->GetInterpreter().Exists(sha); }))
+        << i;
+  }
+
   resp = Run({"evalsha", sha, "0"});
   EXPECT_THAT(resp, IntArg(5));
 
@@ -361,6 +994,63 @@ TEST_F(DflyEngineTest, EvalSha) {
   EXPECT_THAT(resp, "c6459b95a0e81df97af6fdd49b1a9e0287a57363");
 }
 
+TEST_F(DflyEngineTest, ScriptStats) {
+  auto resp = Run({"script", "stats"});
+  EXPECT_THAT(resp, ArrLen(0));
+
+  resp = Run({"script", "load",
+              "redis.call('set', KEYS[1], 'v') return redis.call('get', KEYS[1])"});
+  string sha{ToSV(resp.GetBuf())};
+  for (unsigned i = 0; i < 3; ++i) {
+    EXPECT_EQ(Run({"evalsha", sha, "1", "key"}), "v");
+  }
+  Run({"eval", "return 1", "0"});
+
+  resp = Run({"script", "stats"});
+  ASSERT_THAT(resp, ArrLen(2));
+  auto scripts = resp.GetVec();
+  RespVec stats;
+  for (const auto& script : scripts) {
+    if (script.GetVec()[0] == sha)
+      stats = script.GetVec();
+  }
+  ASSERT_EQ(13u, stats.size());
+  EXPECT_THAT(stats[1], "calls");
+  EXPECT_THAT(stats[2], IntArg(3));
+  EXPECT_THAT(stats[7], "redis_calls");
+  EXPECT_THAT(stats[8], IntArg(6));
+  EXPECT_THAT(stats[9], "shards");
+  EXPECT_THAT(stats[10], IntArg(3));
+  EXPECT_GT(get<int64_t>(stats[12].u), 0);
+}
+
+TEST_F(DflyEngineTest, NonAtomicScript) {
+  const char* kScript = R"(--!df flags=disable-atomicity
+    for i, key in ipairs(KEYS) do
+      redis.call('incrby', key, ARGV[1])
+    end
+    return redis.call('mget', unpack(KEYS)))";
+
+  auto resp = Run({"eval", kScript, "3", "a", "b", "c", "2"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("2", "2", "2"));
+
+  resp = Run({"eval", "--!df flags=disable-atomicity\n return redis.call('get', 'x')", "1", "y"});
+  EXPECT_THAT(resp, ErrArg("undeclared key"));
+
+  resp = Run({"eval", "--!df flags=no-writes\n return 1", "0"});
+  EXPECT_THAT(resp, ErrArg("Unexpected flag in script shebang: no-writes"));
+  resp = Run({"script", "load", "--!df lib=x\n return 1"});
+  EXPECT_THAT(resp, ErrArg("Unknown lua shebang option"));
+
+  // Under MULTI the script remains a part of the EXEC transaction.
+  Run({"multi"});
+  Run({"eval", kScript, "2", "a", "b", "1"});
+  resp = Run({"exec"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("3", "3"));
+}
+
 TEST_F(DflyEngineTest, Hello) {
   auto resp = Run({"hello"});
   ASSERT_THAT(resp, ArrLen(12));
@@ -380,6 +1070,24 @@ TEST_F(DflyEngineTest, Hello) {
       ErrArg("ERR unknown command 'HELLO' with args beginning with: `2`, `AUTH`, `uname`, `pwd`"));
 }
 
+TEST_F(DflyEngineTest, CommandLookup) {
+  EXPECT_EQ(Run({"SeT", "key", "val"}), "OK");
+  EXPECT_EQ(Run({"get", "key"}), "val");
+  EXPECT_EQ(Run({"GET", "key"}), "val");
+  EXPECT_EQ(Run({"bf.reserve", "bf", "0.01", "100"}), "OK");
+
+  EXPECT_THAT(Run({"ge", "key"}), ErrArg("unknown command `GE`"));
+  EXPECT_THAT(Run({"gett", "key"}), ErrArg("unknown command `GETT`"));
+
+  // Hashed like "BF.ADD", but the lookup still compares the names.
+  EXPECT_THAT(Run({"bf\x0e"
+                   "add",
+                   "bf", "a"}),
+              ErrArg("unknown command"));
+
+  EXPECT_GT(CheckedInt({"command", "count"}), 100);
+}
+
 TEST_F(DflyEngineTest, Memcache) {
   using MP = MemcacheParser;
 
@@ -413,6 +1121,113 @@ TEST_F(DflyEngineTest, Memcache) {
   EXPECT_THAT(resp, ElementsAre("END"));
 }
 
+TEST_F(DflyEngineTest, MemcacheFlags) {
+  using MP = MemcacheParser;
+
+  // Short keys keep their flags inline, long ones in the flags table.
+  string long_key(40, 'k');
+  for (string_view key : {string_view{"k"}, string_view{"12345"}, string_view{long_key}}) {
+    auto resp = RunMC(MP::SET, key, "bar", 42);
+    EXPECT_THAT(resp, ElementsAre("STORED"));
+
+    resp = RunMC(MP::GET, key);
+    EXPECT_THAT(resp, ElementsAre(absl::StrCat("VALUE ", key, " 42 3"), "bar", "END"));
+
+    resp = RunMC(MP::SET, key, "bar", 7);
+    resp = RunMC(MP::GET, key);
+    EXPECT_THAT(resp, ElementsAre(absl::StrCat("VALUE ", key, " 7 3"), "bar", "END"));
+
+    resp = RunMC(MP::SET, key, "bar", 0);
+    resp = RunMC(MP::GET, key);
+    EXPECT_THAT(resp, ElementsAre(absl::StrCat("VALUE ", key, " 0 3"), "bar", "END"));
+
+    RunMC(MP::SET, key, "bar", 5);
+    ASSERT_EQ(1, CheckedInt({"del", string(key)}));
+  }
+
+  RunMC(MP::SET, long_key, "bar", 9);
+  Run({"rename", long_key, "k"});
+  auto resp = RunMC(MP::GET, "k");
+  EXPECT_THAT(resp, ElementsAre("VALUE k 9 3", "bar", "END"));
+}
+
+TEST_F(DflyEngineTest, MemcacheMeta) {
+  using MP = MemcacheParser;
+  MP parser;
+  MP::Command cmd;
+  uint32_t consumed;
+
+  auto run = [&](string_view line, string_view value = string_view{}) {
+    CHECK_EQ(MP::OK, parser.Parse(line, &consumed, &cmd)) << line;
+    return RunMC(cmd, value);
+  };
+
+  EXPECT_THAT(run("ms foo 3 F5 T100\r\n", "bar"), ElementsAre("HD"));
+  EXPECT_THAT(run("mg foo v f t s k Oab\r\n"), ElementsAre("VA 3 f5 t100 s3 kfoo Oab", "bar"));
+  EXPECT_THAT(run("mg foo q\r\n"), ElementsAre("HD"));
+
+  EXPECT_THAT(run("mg bar v\r\n"), ElementsAre("EN"));
+  EXPECT_THAT(run("mg bar v q\r\n"), IsEmpty());
+
+  EXPECT_THAT(run("ms foo 3 ME\r\n", "baz"), ElementsAre("NS"));
+  EXPECT_THAT(run("ms foo 3 q\r\n", "baz"), IsEmpty());
+  EXPECT_THAT(run("mg foo v t\r\n"), ElementsAre("VA 3 t-1", "baz"));
+
+  EXPECT_THAT(run("md foo q\r\n"), IsEmpty());
+  EXPECT_THAT(run("md foo Oxy\r\n"), ElementsAre("NF Oxy"));
+  EXPECT_THAT(run("mn\r\n"), ElementsAre("MN"));
+
+  // Classic commands are not affected.
+  EXPECT_THAT(RunMC(MP::SET, "foo", "bar", 1), ElementsAre("STORED"));
+  EXPECT_THAT(RunMC(MP::DELETE, "foo"), ElementsAre("DELETED"));
+
+  EXPECT_THAT(run("set foo 0 0 3 noreply\r\n", "bar"), IsEmpty());
+  EXPECT_THAT(run("delete foo noreply\r\n"), IsEmpty());
+  EXPECT_THAT(RunMC(MP::GET, "foo"), ElementsAre("END"));
+}
+
+TEST_F(DflyEngineTest, MemcacheCas) {
+  using MP = MemcacheParser;
+  MP parser;
+  MP::Command cmd;
+  uint32_t consumed;
+
+  auto run = [&](string_view line, string_view value = string_view{}) {
+    CHECK_EQ(MP::OK, parser.Parse(line, &consumed, &cmd)) << line;
+    return RunMC(cmd, value);
+  };
+
+  // Returns the cas unique of the VALUE line of gets.
+  auto gets = [&](string_view key) {
+    auto resp = run(StrCat("gets ", key, "\r\n"));
+    CHECK_EQ(3u, resp.size());
+    vector<string_view> parts = absl::StrSplit(resp[0], ' ');
+    CHECK_EQ(5u, parts.size()) << resp[0];
+    return string(parts[4]);
+  };
+
+  EXPECT_THAT(run("cas foo 0 0 3 1\r\n", "bar"), ElementsAre("NOT_FOUND"));
+  EXPECT_THAT(RunMC(MP::SET, "foo", "bar", 1), ElementsAre("STORED"));
+
+  string cas = gets("foo");
+  EXPECT_EQ(cas, gets("foo"));
+  EXPECT_THAT(run("mg foo c\r\n"), ElementsAre(StrCat("HD c", cas)));
+
+  EXPECT_THAT(run(StrCat("cas foo 2 0 3 ", cas, "\r\n"), "baz"), ElementsAre("STORED"));
+  EXPECT_THAT(run(StrCat("cas foo 0 0 3 ", cas, "\r\n"), "qux"), ElementsAre("EXISTS"));
+  EXPECT_THAT(RunMC(MP::GET, "foo"), ElementsAre("VALUE foo 2 3", "baz", "END"));
+
+  // Any write invalidates the unique.
+  cas = gets("foo");
+  EXPECT_THAT(RunMC(MP::APPEND, "foo", "1", 0), ElementsAre("STORED"));
+  EXPECT_THAT(run(StrCat("cas foo 0 0 3 ", cas, "\r\n"), "qux"), ElementsAre("EXISTS"));
+  EXPECT_THAT(run("cas foo 0 0 3 0\r\n", "qux"), ElementsAre("EXISTS"));
+
+  cas = gets("foo");
+  EXPECT_THAT(RunMC(MP::DELETE, "foo"), ElementsAre("DELETED"));
+  EXPECT_THAT(run(StrCat("cas foo 0 0 3 ", cas, "\r\n"), "qux"), ElementsAre("NOT_FOUND"));
+}
+
 TEST_F(DflyEngineTest, LimitMemory) {
   mi_option_enable(mi_option_limit_os_alloc);
   string blob(128, 'a');
@@ -439,6 +1254,29 @@ TEST_F(DflyEngineTest, FlushAll) {
   fb1.join();
 }
 
+TEST_F(DflyEngineTest, ShadowTables) {
+  Run({"set", "old", "1"});
+
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    db_slice.CreateShadow();
+    if (Shard("new", shard_set->size()) != shard->shard_id())
+      return;
+
+    DbSlice::ShadowScope scope{&db_slice, true};
+    db_slice.AddOrFind(0, "new", PrimeValue{"2"}, 0);
+  });
+
+  EXPECT_EQ(Run({"get", "old"}), "1");
+  EXPECT_THAT(Run({"exists", "new"}), IntArg(0));
+
+  shard_set->RunBriefInParallel([](EngineShard* shard) { shard->db_slice().CommitShadow(); });
+
+  EXPECT_EQ(Run({"get", "new"}), "2");
+  EXPECT_THAT(Run({"exists", "old"}), IntArg(0));
+  EXPECT_THAT(Run({"dbsize"}), IntArg(1));
+}
+
 TEST_F(DflyEngineTest, OOM) {
   shard_set->TEST_EnableHeartBeat();
   max_memory_limit = 0;
@@ -492,6 +1330,257 @@ TEST_F(DflyEngineTest, PSubscribe) {
   EXPECT_EQ("a*", msg.pattern);
 }
 
+TEST_F(DflyEngineTest, PSubscribeMatch) {
+  single_response_ = false;
+  auto resp = pp_->at(1)->Await(
+      [&] { return Run({"psubscribe", "a*", "ab", "a?c", "*", "abc*", "b*", "a\\*"}); });
+  EXPECT_THAT(resp, ArrLen(3));
+
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "abc", "foo"}); });
+  EXPECT_THAT(resp, IntArg(4));
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "ab", "foo"}); });
+  EXPECT_THAT(resp, IntArg(3));
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "a*", "foo"}); });
+  EXPECT_THAT(resp, IntArg(3));
+
+  pp_->at(1)->Await([&] { return Run({"punsubscribe", "a*", "*"}); });
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "abc", "foo"}); });
+  EXPECT_THAT(resp, IntArg(2));
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "ab", "foo"}); });
+  EXPECT_THAT(resp, IntArg(1));
+}
+
+TEST_F(DflyEngineTest, SSubscribe) {
+  single_response_ = false;
+  auto resp = pp_->at(1)->Await([&] { return Run({"ssubscribe", "user:1", "user:2"}); });
+  EXPECT_THAT(resp.GetVec(), ElementsAre("ssubscribe", "user:1", IntArg(1)));
+  pp_->at(1)->Await([&] { return Run({"psubscribe", "user:*"}); });
+  single_response_ = true;
+
+  // Only the sharded subscribers get the sharded messages and the other way around.
+  resp = pp_->at(0)->Await([&] { return Run({"spublish", "user:1", "foo"}); });
+  EXPECT_THAT(resp, IntArg(1));
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "user:1", "bar"}); });
+  EXPECT_THAT(resp, IntArg(1));
+  resp = pp_->at(0)->Await([&] { return Run({"spublish", "user:3", "foo"}); });
+  EXPECT_THAT(resp, IntArg(0));
+
+  ASSERT_EQ(2, SubscriberMessagesLen("IO1"));
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
+  EXPECT_EQ("user:1", msg.channel);
+  EXPECT_EQ("foo", msg.message);
+  EXPECT_TRUE(msg.sharded);
+  EXPECT_TRUE(msg.pattern.empty());
+  msg = GetPublishedMessage("IO1", 1);
+  EXPECT_EQ("bar", msg.message);
+  EXPECT_FALSE(msg.sharded);
+  EXPECT_EQ("user:*", msg.pattern);
+
+  resp = Run({"pubsub", "shardchannels"});
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("user:1", "user:2"));
+  EXPECT_THAT(Run({"pubsub", "channels"}), ArrLen(0));
+
+  single_response_ = false;
+  resp = pp_->at(1)->Await([&] { return Run({"sunsubscribe", "user:1"}); });
+  EXPECT_THAT(resp.GetVec(), ElementsAre("sunsubscribe", "user:1", IntArg(1)));
+  single_response_ = true;
+  resp = pp_->at(0)->Await([&] { return Run({"spublish", "user:1", "foo"}); });
+  EXPECT_THAT(resp, IntArg(0));
+  EXPECT_EQ("user:2", Run({"pubsub", "shardchannels"}));
+}
+
+TEST_F(DflyEngineTest, ClientTracking) {
+  auto resp = pp_->at(1)->Await([&] { return Run({"hello"}); });
+  ASSERT_THAT(resp, ArrLen(12));
+  string redirect = StrCat(get<int64_t>(resp.GetVec()[7].u));
+
+  EXPECT_THAT(Run({"client", "tracking", "on"}), ErrArg("REDIRECT"));
+  EXPECT_THAT(Run({"client", "tracking", "on", "redirect", redirect}),
+              ErrArg("not subscribed"));
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "__redis__:invalidate"}); });
+  single_response_ = true;
+
+  // Invalidations are delivered asynchronously, possibly in a message per shard.
+  auto invalidated = [&](size_t expected) {
+    vector<string> keys;
+    for (unsigned i = 0; i < 100; ++i) {
+      keys.clear();
+      for (size_t j = 0; j < SubscriberMessagesLen("IO1"); ++j) {
+        facade::Connection::PubMessage msg = GetPublishedMessage("IO1", j);
+        EXPECT_EQ(facade::Connection::kInvalidationChannel, msg.channel);
+        for (string_view key : absl::StrSplit(msg.message, ' ', absl::SkipEmpty()))
+          keys.emplace_back(key);
+      }
+      if (keys.size() >= expected)
+        break;
+      this_fiber::sleep_for(1ms);
+    }
+    sort(keys.begin(), keys.end());
+    return keys;
+  };
+
+  EXPECT_EQ(Run({"client", "tracking", "on", "redirect", redirect}), "OK");
+  Run({"mset", "a", "1", "b", "2", "c", "3"});
+  Run({"mget", "a", "b"});
+  Run({"mset", "a", "4", "b", "5", "c", "6"});
+  EXPECT_THAT(invalidated(2), ElementsAre("a", "b"));
+
+  // Keys stop being tracked once invalidated.
+  Run({"set", "a", "7"});
+  Run({"get", "c"});
+  Run({"del", "c"});
+  EXPECT_THAT(invalidated(3), ElementsAre("a", "b", "c"));
+
+  EXPECT_EQ(Run({"client", "tracking", "on", "redirect", redirect, "bcast", "prefix", "user:"}),
+            "OK");
+  Run({"set", "user:1", "1"});
+  Run({"set", "item:1", "1"});
+  EXPECT_THAT(invalidated(4), ElementsAre("a", "b", "c", "user:1"));
+
+  EXPECT_EQ(Run({"client", "tracking", "off"}), "OK");
+  Run({"set", "user:2", "1"});
+  EXPECT_THAT(invalidated(5), ElementsAre("a", "b", "c", "user:1"));
+}
+
+TEST_F(DflyEngineTest, ClientTrackingOptimistic) {
+  absl::SetFlag(&FLAGS_optimistic_reads, true);
+  auto resp = pp_->at(1)->Await([&] { return Run({"hello"}); });
+  ASSERT_THAT(resp, ArrLen(12));
+  string redirect = StrCat(get<int64_t>(resp.GetVec()[7].u));
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "__redis__:invalidate"}); });
+  single_response_ = true;
+
+  // The multi-shard reads run optimistically, outside of the tx queues.
+  EXPECT_EQ(Run({"client", "tracking", "on", "redirect", redirect}), "OK");
+  Run({"mset", "b", "1", "x", "2", "c", "3"});
+  Run({"mget", "b", "x", "c"});
+
+  atomic_uint64_t runs{0};
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { runs.fetch_add(shard->stats().optimistic_runs); });
+  EXPECT_GT(runs.load(), 0u);
+
+  Run({"mset", "b", "4", "x", "5", "c", "6"});
+  vector<string> keys;
+  for (unsigned i = 0; i < 100 && keys.size() < 3; ++i) {
+    keys.clear();
+    for (size_t j = 0; j < SubscriberMessagesLen("IO1"); ++j) {
+      for (string_view key : absl::StrSplit(GetPublishedMessage("IO1", j).message, ' ',
+                                            absl::SkipEmpty()))
+        keys.emplace_back(key);
+    }
+    this_fiber::sleep_for(1ms);
+  }
+  sort(keys.begin(), keys.end());
+  EXPECT_THAT(keys, ElementsAre("b", "c", "x"));
+
+  absl::SetFlag(&FLAGS_optimistic_reads, false);
+}
+
+TEST_F(DflyEngineTest, ChangeFeed) {
+  absl::SetFlag(&FLAGS_change_feed_values, true);
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "__changes__"}); });
+  single_response_ = true;
+
+  // The records are delivered asynchronously in a message per shard.
+  auto changes = [&](size_t expected) {
+    vector<string> records;
+    for (unsigned i = 0; i < 100; ++i) {
+      records.clear();
+      for (size_t j = 0; j < SubscriberMessagesLen("IO1"); ++j) {
+        facade::Connection::PubMessage msg = GetPublishedMessage("IO1", j);
+        EXPECT_EQ(facade::Connection::kChangesChannel, msg.channel);
+        vector<string_view> parts = absl::StrSplit(msg.message, ' ');
+        EXPECT_EQ(0u, parts.size() % 4);
+        for (size_t k = 0; k + 3 < parts.size(); k += 4)
+          records.push_back(absl::StrJoin(parts.begin() + k, parts.begin() + k + 4, " "));
+      }
+      if (records.size() >= expected)
+        break;
+      this_fiber::sleep_for(1ms);
+    }
+    return records;
+  };
+
+  Run({"set", "a", "1"});
+  Run({"hset", "h", "f", "v"});
+  EXPECT_THAT(changes(2), UnorderedElementsAre("set 0 a 1", "set 0 h "));
+
+  // A key changed several times by a command has a single record with its last value.
+  Run({"mset", "b", "2", "b", "3"});
+  Run({"del", "a"});
+  EXPECT_THAT(changes(4), IsSupersetOf({"set 0 b 3", "del 0 a "}));
+
+  Run({"flushall"});
+  EXPECT_THAT(changes(4 + shard_set->size()), Contains("flush all  "));
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(4 + shard_set->size(), metrics.events.change_feed_records);
+  EXPECT_EQ(0u, metrics.events.change_feed_dropped);
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"unsubscribe", "__changes__"}); });
+  single_response_ = true;
+  absl::SetFlag(&FLAGS_change_feed_values, false);
+
+  size_t num_messages = SubscriberMessagesLen("IO1");
+  Run({"set", "c", "1"});
+  EXPECT_EQ(num_messages, SubscriberMessagesLen("IO1"));
+}
+
+TEST_F(DflyEngineTest, KeyspaceEvents) {
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", "KEA"}), "OK");
+  EXPECT_THAT(Run({"config", "get", "notify-keyspace-events"}).GetVec(),
+              ElementsAre("notify-keyspace-events", "AKE"));
+  EXPECT_THAT(Run({"config", "set", "notify-keyspace-events", "Kq"}), ErrArg("Invalid argument"));
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"psubscribe", "__keyspace@0__:*"}); });
+  pp_->at(1)->Await([&] { return Run({"subscribe", "__keyevent@0__:expired"}); });
+  single_response_ = true;
+
+  // The events are published asynchronously, in a batch per shard.
+  auto events = [&](size_t expected) {
+    vector<string> res;
+    for (unsigned i = 0; i < 100; ++i) {
+      res.clear();
+      for (size_t j = 0; j < SubscriberMessagesLen("IO1"); ++j) {
+        facade::Connection::PubMessage msg = GetPublishedMessage("IO1", j);
+        res.push_back(StrCat(msg.channel, " ", msg.message));
+      }
+      if (res.size() >= expected)
+        break;
+      this_fiber::sleep_for(1ms);
+    }
+    return res;
+  };
+
+  Run({"set", "a", "1"});
+  Run({"hset", "h", "f", "v"});
+  Run({"del", "a"});
+  EXPECT_THAT(events(3), UnorderedElementsAre("__keyspace@0__:a set", "__keyspace@0__:h hset",
+                                              "__keyspace@0__:a del"));
+
+  Run({"set", "b", "1", "px", "10"});
+  UpdateTime(expire_now_ + 100);
+  EXPECT_THAT(Run({"get", "b"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(events(6), IsSupersetOf({"__keyspace@0__:b set", "__keyspace@0__:b expired",
+                                       "__keyevent@0__:expired b"}));
+
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", ""}), "OK");
+  Run({"set", "c", "1"});
+  EXPECT_EQ(6u, SubscriberMessagesLen("IO1"));
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"punsubscribe"}); });
+  pp_->at(1)->Await([&] { return Run({"unsubscribe"}); });
+}
+
 TEST_F(DflyEngineTest, Unsubscribe) {
   auto resp = Run({"unsubscribe", "a"});
   EXPECT_THAT(resp.GetVec(), ElementsAre("unsubscribe", "a", IntArg(0)));
@@ -510,6 +1599,26 @@ TEST_F(DflyEngineTest, Unsubscribe) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("unsubscribe", "b", IntArg(0)));
 }
 
+TEST_F(DflyEngineTest, CloseSubscriber) {
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "ab"}); });
+  pp_->at(1)->Await([&] { return Run({"psubscribe", "a*"}); });
+  pp_->at(1)->Await([&] { return Run({"ssubscribe", "ac"}); });
+  single_response_ = true;
+
+  // The publishes cache the snapshots of the channels and of the pattern.
+  auto resp = pp_->at(0)->Await([&] { return Run({"publish", "ab", "foo"}); });
+  EXPECT_THAT(resp, IntArg(2));
+  resp = pp_->at(0)->Await([&] { return Run({"spublish", "ac", "foo"}); });
+  EXPECT_THAT(resp, IntArg(1));
+
+  pp_->at(1)->Await([&] { CloseConn("IO1"); });
+
+  resp = pp_->at(0)->Await([&] { return Run({"publish", "ab", "foo"}); });
+  EXPECT_THAT(resp, IntArg(0));
+  EXPECT_THAT(Run({"pubsub", "numpat"}), IntArg(0));
+}
+
 TEST_F(DflyEngineTest, PUnsubscribe) {
   auto resp = Run({"punsubscribe", "a*"});
   EXPECT_THAT(resp.GetVec(), ElementsAre("punsubscribe", "a*", IntArg(0)));
@@ -527,8 +1636,294 @@ TEST_F(DflyEngineTest, PUnsubscribe) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("punsubscribe", "b*", IntArg(0)));
 }
 
+class NumShardsTest : public BaseFamilyTest {
+ protected:
+  NumShardsTest() {
+    num_threads_ = kPoolThreadCount;
+    absl::SetFlag(&FLAGS_num_shards, 2);
+  }
+
+  ~NumShardsTest() {
+    absl::SetFlag(&FLAGS_num_shards, 0);
+  }
+};
+
+TEST_F(NumShardsTest, FewerShards) {
+  EXPECT_EQ(2u, shard_set->size());
+
+  Run({"mset", kKey1, "1", kKey2, "2", kKey3, "3", kKey4, "4"});
+  auto resp = Run({"mget", kKey1, kKey2, kKey3, kKey4});
+  ASSERT_EQ(RespExpr::ARRAY, resp.type);
+  EXPECT_THAT(resp.GetVec(), ElementsAre("1", "2", "3", "4"));
+  EXPECT_THAT(Run({"dbsize"}), IntArg(4));
+}
+
+class ReserveKeysTest : public BaseFamilyTest {
+ protected:
+  ReserveKeysTest() {
+    absl::SetFlag(&FLAGS_reserve_keys, 100000);
+  }
+
+  ~ReserveKeysTest() {
+    absl::SetFlag(&FLAGS_reserve_keys, 0);
+  }
+};
+
+TEST_F(ReserveKeysTest, Reserve) {
+  auto get_buckets = [] {
+    return EngineShard::tlocal()->db_slice().GetTables(0).first->bucket_count();
+  };
+  size_t buckets = shard_set->Await(0, get_buckets);
+  EXPECT_GE(buckets, 100000 / shard_set->size());
+
+  // The keys fit into the reserved table.
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"set", StrCat("key", i), "v"});
+  }
+  EXPECT_EQ(buckets, shard_set->Await(0, get_buckets));
+}
+
+TEST_F(DflyEngineTest, NoEviction) {
+  Run({"set", "key", "1"});
+
+  max_memory_limit = 1000;
+  uint64_t used_mem = used_mem_current.exchange(2000, memory_order_relaxed);
+  EXPECT_THAT(Run({"set", "key", "2"}), ErrArg("Out of mem"));
+  EXPECT_EQ(Run({"get", "key"}), "1");
+  EXPECT_THAT(Run({"del", "key"}), IntArg(1));
+
+  max_memory_limit = 0;
+  used_mem_current.store(used_mem, memory_order_relaxed);
+  EXPECT_EQ(Run({"set", "key", "2"}), "OK");
+}
+
+TEST_F(DflyEngineTest, DbQuota) {
+  EXPECT_EQ(Run({"select", "1"}), "OK");
+  EXPECT_EQ(Run({"set", "a", "1"}), "OK");
+
+  // The tables alone exceed the quota.
+  EXPECT_THAT(Run({"config", "set", "db-maxmemory", "1:x"}), ErrArg("Invalid argument"));
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", "1:1"}), "OK");
+  EXPECT_THAT(Run({"config", "get", "db-maxmemory"}).GetVec(), ElementsAre("db-maxmemory", "1:1"));
+
+  EXPECT_THAT(Run({"set", "b", "1"}), ErrArg("Out of mem"));
+  EXPECT_EQ(Run({"set", "a", "2"}), "OK");
+
+  // The other dbs are not affected.
+  EXPECT_EQ(Run({"select", "0"}), "OK");
+  EXPECT_EQ(Run({"set", "b", "1"}), "OK");
+
+  auto resp = Run({"info", "keyspace"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("db1:keys=1,expires=0,avg_ttl=-1,quota="));
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("quota_evicted=0,quota_rejected=1"));
+
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", ""}), "OK");
+}
+
+TEST_F(DflyEngineTest, MemoryBudget) {
+  constexpr ssize_t kBudget = 1 << 30;
+  shard_set->RunBriefInParallel(
+      [](EngineShard* shard) { shard->db_slice().SetMemoryBudget(kBudget); });
+
+  uint64_t used_mem = used_mem_current.load(memory_order_relaxed);
+  string val(1 << 20, 'x');
+  Run({"set", "key", val});
+
+  // The budget and the server-wide counter follow the write without waiting for the heartbeat.
+  ShardId sid = Shard("key", shard_set->size());
+  auto get_budget = [] { return EngineShard::tlocal()->db_slice().memory_budget(); };
+  ssize_t budget = shard_set->Await(sid, get_budget);
+  EXPECT_LE(budget, kBudget - ssize_t(val.size()));
+  EXPECT_GE(used_mem_current.load(memory_order_relaxed), used_mem + val.size());
+
+  Run({"del", "key"});
+  budget = shard_set->Await(sid, get_budget);
+  EXPECT_GT(budget, kBudget - ssize_t(val.size()));
+}
+
+class EvictionPolicyTest : public BaseFamilyTest {
+ protected:
+  EvictionPolicyTest() {
+    absl::SetFlag(&FLAGS_maxmemory_policy, "volatile-ttl");
+  }
+
+  ~EvictionPolicyTest() {
+    absl::SetFlag(&FLAGS_maxmemory_policy, "noeviction");
+  }
+};
+
+TEST_F(EvictionPolicyTest, Volatile) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), "v"});
+    Run({"set", StrCat("temp", i), "v", "ex", StrCat(100 + i)});
+  }
+
+  // Exhaust the budgets, each eviction gives back only the memory of its key.
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    db_slice.SetMemoryBudget(0);
+    db_slice.EvictionStep(1000);
+    db_slice.SetMemoryBudget(SSIZE_MAX);
+  });
+
+  EXPECT_THAT(Run({"dbsize"}), IntArg(100));
+  EXPECT_THAT(Run({"exists", "key0", "key99"}), IntArg(2));
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(100u, metrics.events.evicted_keys);
+  EXPECT_EQ(100u,
+            metrics.events.policy_evicted_keys[size_t(EvictionPolicy::VOLATILE_TTL)]);
+}
+
+TEST_F(EvictionPolicyTest, DbQuota) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("temp", i), "v", "ex", "100"});
+  }
+  EXPECT_EQ(Run({"select", "1"}), "OK");
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("temp", i), "v", "ex", "100"});
+  }
+
+  // Only the keys of the db over its quota are evicted.
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", "1:1"}), "OK");
+  shard_set->RunBriefInParallel([](EngineShard* shard) { shard->db_slice().EvictionStep(1000); });
+  EXPECT_THAT(Run({"dbsize"}), IntArg(0));
+
+  EXPECT_EQ(Run({"select", "0"}), "OK");
+  EXPECT_THAT(Run({"dbsize"}), IntArg(100));
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(100u, metrics.db[1].quota_evicted);
+  EXPECT_EQ(100u, metrics.events.evicted_keys);
+
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", ""}), "OK");
+}
+
+TEST_F(DflyEngineTest, MallocStats) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), string(100, 'x')});
+  }
+
+  auto collected = [&] {
+    auto resp = Run({"memory", "malloc-stats"});
+    return ToSV(resp.GetBuf()).find("not collected") == string_view::npos;
+  };
+  EXPECT_FALSE(collected());
+
+  // The shards collect the stats in their heartbeats.
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 1000 && !collected(); ++i) {
+    this_fiber::sleep_for(5ms);
+  }
+  ASSERT_TRUE(collected());
+
+  auto resp = Run({"memory", "malloc-stats"});
+  EXPECT_THAT(ToSV(resp.GetBuf()), HasSubstr("block_size pages used committed utilization"));
+
+  resp = Run({"info", "memory"});
+  string_view info = ToSV(resp.GetBuf());
+  EXPECT_THAT(info, HasSubstr("malloc_committed_bytes:"));
+  EXPECT_THAT(info, HasSubstr("malloc_shard0:committed="));
+}
+
+class KeyAnalyzerTest : public BaseFamilyTest {
+ protected:
+  KeyAnalyzerTest() {
+    absl::SetFlag(&FLAGS_key_analyzer_prefixes, "user:, user:admin:,session:");
+    absl::SetFlag(&FLAGS_key_analyzer_buckets, 16);
+  }
+
+  ~KeyAnalyzerTest() {
+    absl::SetFlag(&FLAGS_key_analyzer_prefixes, "");
+    absl::SetFlag(&FLAGS_key_analyzer_buckets, 0);
+  }
+};
+
+TEST_F(KeyAnalyzerTest, KeyStats) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("user:", i), "v"});
+  }
+  Run({"set", "user:admin:1", "v"});
+  for (unsigned i = 0; i < 10; ++i) {
+    Run({"sadd", StrCat("session:", i), "1", "2"});
+  }
+  Run({"lpush", "foo", "a"});
+
+  // Consecutive lookups in a shard are sampled at a fixed rate.
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"get", "user:1"});
+  }
+
+  auto resp = Run({"debug", "keystats"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  vector<string> stats = StrArray(resp);
+  EXPECT_THAT(stats, Contains("prefix.user:.keys:100"));
+  EXPECT_THAT(stats, Contains("prefix.user:admin:.keys:1"));
+  EXPECT_THAT(stats, Contains("prefix.session:.keys:10"));
+  EXPECT_THAT(stats, Contains("prefix.other.keys:1"));
+  EXPECT_THAT(stats, Contains("type.string:raw.keys:101"));
+  EXPECT_THAT(stats, Contains("type.set:intset.keys:10"));
+  EXPECT_THAT(stats, Contains("type.list:quicklist.keys:1"));
+  EXPECT_THAT(stats, Contains(HasSubstr("type.set:intset.bytes:")));
+
+  constexpr string_view kUserOps = "prefix.user:.ops:";
+  auto it = find_if(stats.begin(), stats.end(),
+                    [&](const string& s) { return absl::StartsWith(s, kUserOps); });
+  ASSERT_NE(it, stats.end());
+  uint64_t ops = 0;
+  ASSERT_TRUE(absl::SimpleAtoi(it->substr(kUserOps.size()), &ops));
+  EXPECT_GE(ops, 960u);
+
+  // MEMORY STATS replies with the reports of the last passes.
+  resp = Run({"memory", "stats"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  const auto& vec = resp.GetVec();
+  ASSERT_EQ(0u, vec.size() % 2);
+  EXPECT_EQ(vec[4], "keys.count");
+  EXPECT_THAT(vec[5], IntArg(112));
+
+  bool found = false;
+  for (size_t i = 0; i < vec.size(); i += 2) {
+    if (vec[i] == "prefix.session:.keys") {
+      EXPECT_THAT(vec[i + 1], IntArg(10));
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
+TEST_F(KeyAnalyzerTest, HotAndBigKeys) {
+  Run({"set", "big", string(10000, 'x')});
+  Run({"set", "small", "v"});
+  for (unsigned i = 0; i < 200; ++i) {
+    Run({"hset", "hash", StrCat("field", i), string(100, 'y')});
+  }
+
+  auto resp = Run({"debug", "bigkeys"});
+  ASSERT_THAT(resp, ArrLen(3));
+  const auto& big = resp.GetVec()[0].GetVec();
+  ASSERT_EQ(3u, big.size());
+  EXPECT_EQ(big[0], "hash");
+  EXPECT_EQ(big[1], "hash:hashtable");
+  EXPECT_GE(get<int64_t>(big[2].u), 10000);
+  EXPECT_EQ(resp.GetVec()[1].GetVec()[0], "big");
+  EXPECT_EQ(resp.GetVec()[1].GetVec()[1], "string:raw");
+  EXPECT_EQ(resp.GetVec()[2].GetVec()[0], "small");
+
+  for (unsigned i = 0; i < 2000; ++i) {
+    Run({"get", "small"});
+  }
+
+  resp = Run({"debug", "hotkeys"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  ASSERT_FALSE(resp.GetVec().empty());
+  const auto& hot = resp.GetVec()[0].GetVec();
+  ASSERT_EQ(2u, hot.size());
+  EXPECT_EQ(hot[0], "small");
+  EXPECT_GE(get<int64_t>(hot[1].u), 1900);
+}
+
 // TODO: to test transactions with a single shard since then all transactions become local.
-// To consider having a parameter in dragonfly engine controlling number of shards
-// unconditionally from number of cpus. TO TEST BLPOP under multi for single/multi argument case.
+// TO TEST BLPOP under multi for single/multi argument case.
 
 }  // namespace dfly
@@ -9,9 +9,15 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
+#include <absl/strings/str_split.h>
+
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/interpreter.h"
+#include "core/str_compressor.h"
 #include "server/blocking_controller.h"
+#include "server/journal.h"
+#include "server/mapped_snapshot.h"
 #include "server/server_state.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
@@ -20,13 +26,84 @@ extern "C" {
 
 using namespace std;
 
-ABSL_FLAG(string, backing_prefix, "", "");
+ABSL_FLAG(string, backing_prefix, "",
+          "If set, enables the tiered storage. Each shard keeps the values it unloads in its own "
+          "file with this prefix. A comma-separated list of prefixes, e.g. on different drives, "
+          "assigns them to the shards round-robin.");
 
 ABSL_FLAG(uint32_t, hz, 1000,
           "Base frequency at which the server updates its expiry clock "
           "and performs other background tasks. Warning: not advised to decrease in production, "
           "because it can affect expiry precision for PSETEX etc.");
 
+ABSL_FLAG(uint32_t, hz_idle, 10,
+          "Frequency down to which the background tasks of a shard slow down while it has no "
+          "requests and no pending background work. The first request restores --hz. "
+          "0 keeps --hz at all times.");
+
+ABSL_FLAG(uint32_t, heartbeat_budget_usec, 250,
+          "Time per heartbeat tick for the background work that can be deferred, i.e. the "
+          "active expiry, the lazy free and the release of the flushed databases. Once it is "
+          "spent the rest of the work is deferred to the next tick.");
+
+ABSL_FLAG(string, table_huge_pages, "",
+          "Backs the segments of the hash tables with huge pages, separately from the other "
+          "objects. Empty - disabled, 'thp' - transparent huge pages, '2mb' or '1gb' - hugetlb "
+          "pages of that size, which must be reserved by the OS. Falls back to transparent huge "
+          "pages if hugetlb pages are not available.");
+
+ABSL_FLAG(bool, compress_values, false,
+          "If true, compresses mid-sized string values with a per-shard zstd dictionary "
+          "that is trained on sampled values. Trades cpu for memory.");
+
+ABSL_FLAG(uint32_t, dedup_values_min_size, 0,
+          "If positive, string values of at least that many bytes are stored once per shard and "
+          "shared by the keys that hold identical values. Mutations copy the value. "
+          "0 - disabled.");
+
+ABSL_FLAG(double, mem_defrag_threshold, 0,
+          "If positive, a shard moves values out of sparse heap pages once its committed heap "
+          "memory exceeds the used memory by that factor, e.g. 1.4. 0 - disabled.");
+
+ABSL_FLAG(double, mem_defrag_page_utilization, 0.8,
+          "Heap pages that are utilized below this ratio are defragmented.");
+
+ABSL_FLAG(uint32_t, malloc_stats_period, 10,
+          "Every that many seconds each shard breaks down its heap pages by their block sizes "
+          "for MEMORY MALLOC-STATS and INFO. A shard spends at most 1% of its time on that. "
+          "0 - disabled.");
+
+ABSL_FLAG(uint32_t, lazy_free_threshold, 4096,
+          "Values that consist of more allocations than that, e.g. set members or list nodes, "
+          "are released in the background when their keys are deleted or overwritten. "
+          "UNLINK releases any such container in the background. 0 - DEL and overwrites "
+          "release the values inline.");
+
+ABSL_FLAG(string, key_analyzer_prefixes, "",
+          "A comma-separated list of key prefixes, e.g. 'user:,session:'. MEMORY STATS and "
+          "/metrics break down the memory and the lookups of the keys by these prefixes.");
+
+ABSL_FLAG(uint32_t, key_analyzer_buckets, 0,
+          "If positive, each shard traverses up to that many hash table buckets every 8 "
+          "heartbeats in order to aggregate its keys by the prefixes of FLAGS_key_analyzer_prefixes "
+          "and by the value encodings. 0 - disabled.");
+
+ABSL_FLAG(uint32_t, key_aging_period, 60,
+          "Every that many seconds each shard starts a background pass over its keys that ages "
+          "the keys that were not looked up since, see OBJECT IDLETIME. 0 - disabled.");
+
+ABSL_FLAG(uint64_t, reserve_keys, 0,
+          "If positive, the shards reserve the hash tables of db 0 for that many keys in total "
+          "when they start, so that the first writes or a full sync do not go through a burst "
+          "of segment splits. 0 - the tables grow on demand.");
+
+ABSL_FLAG(uint64_t, reserve_expire_keys, 0,
+          "Like reserve_keys, for the keys with an expiry.");
+
+ABSL_FLAG(bool, shard_by_hashtag, false,
+          "If true, keys with a hash tag like user:{42}:profile are placed by the tag only, "
+          "so that the keys with the same tag are co-located in the same shard");
+
 ABSL_DECLARE_FLAG(bool, cache_mode);
 
 namespace dfly {
@@ -40,21 +117,64 @@ namespace {
 
 vector<EngineShardSet::CachedStats> cached_stats;  // initialized in EngineShardSet::Init
 
+unique_ptr<HugePageResource> CreateTableResource(pmr::memory_resource* upstream) {
+  string pages = GetFlag(FLAGS_table_huge_pages);
+  if (pages.empty())
+    return nullptr;
+
+  HugePageResource::PageMode mode = HugePageResource::THP;
+  if (pages == "2mb") {
+    mode = HugePageResource::HUGE_2MB;
+  } else if (pages == "1gb") {
+    mode = HugePageResource::HUGE_1GB;
+  } else {
+    CHECK_EQ(pages, "thp") << "Unknown table_huge_pages " << pages;
+  }
+
+  return make_unique<HugePageResource>(
+      mode, initializer_list<size_t>{PrimeTable::kSegBytes, ExpireTable::kSegBytes}, upstream);
+}
+
 }  // namespace
 
 thread_local EngineShard* EngineShard::shard_ = nullptr;
 constexpr size_t kQueueLen = 64;
+
+// Callbacks that a thread may have in flight to a shard before it falls back to the shard queue.
+constexpr size_t kBatchQueueLen = 64;
 EngineShardSet* shard_set = nullptr;
+bool shard_by_hashtag = false;
 
 EngineShard::Stats& EngineShard::Stats::operator+=(const EngineShard::Stats& o) {
   ooo_runs += o.ooo_runs;
   quick_runs += o.quick_runs;
+  txq_runs += o.txq_runs;
+  continuation_runs += o.continuation_runs;
+  awaked_runs += o.awaked_runs;
+  fast_lane_runs += o.fast_lane_runs;
+  schedule_attempts += o.schedule_attempts;
+  schedule_rejects += o.schedule_rejects;
+  lock_conflicts += o.lock_conflicts;
+  optimistic_runs += o.optimistic_runs;
+  optimistic_conflicts += o.optimistic_conflicts;
+  defrag_cycles += o.defrag_cycles;
+  defrag_moved += o.defrag_moved;
+  defrag_reclaimed_bytes += o.defrag_reclaimed_bytes;
+  lazyfree_objects += o.lazyfree_objects;
+  heartbeat_ticks += o.heartbeat_ticks;
+  heartbeat_idle_ticks += o.heartbeat_idle_ticks;
+  heartbeat_deferred += o.heartbeat_deferred;
+  heartbeat_usec += o.heartbeat_usec;
+  heap_committed += o.heap_committed;
+  heap_used += o.heap_used;
 
   return *this;
 }
 
 EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t* heap)
     : queue_(kQueueLen), txq_([](const Transaction* t) { return t->txid(); }), mi_resource_(heap),
+      key_analyzer_(GetFlag(FLAGS_key_analyzer_prefixes), GetFlag(FLAGS_key_analyzer_buckets) > 0),
+      table_resource_(CreateTableResource(&mi_resource_)),
       db_slice_(pb->GetIndex(), GetFlag(FLAGS_cache_mode), this) {
   fiber_q_ = fibers::fiber([this, index = pb->GetIndex()] {
     this_fiber::properties<FiberProps>().set_name(absl::StrCat("shard_queue", index));
@@ -66,7 +186,7 @@ EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t*
     if (clock_cycle_ms == 0)
       clock_cycle_ms = 1;
 
-    periodic_task_ = pb->AddPeriodic(clock_cycle_ms, [this] { Heartbeat(); });
+    StartHeartbeat(clock_cycle_ms);
   }
 
   tmp_str1 = sdsempty();
@@ -86,9 +206,21 @@ void EngineShard::Shutdown() {
     tiered_storage_->Shutdown();
   }
 
-  if (periodic_task_) {
-    ProactorBase::me()->CancelPeriodic(periodic_task_);
+  if (journal_) {
+    journal_->Close();
+  }
+
+  if (heartbeat_.fb.joinable()) {
+    {
+      lock_guard lk(heartbeat_.mu);
+      heartbeat_.stop = true;
+    }
+    heartbeat_.cv.notify_one();
+    heartbeat_.fb.join();
   }
+
+  used_mem_current.fetch_sub(published_used_memory_, memory_order_relaxed);
+  published_used_memory_ = 0;
 }
 
 void EngineShard::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
@@ -99,17 +231,24 @@ void EngineShard::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   shard_ = new (ptr) EngineShard(pb, update_db_time, data_heap);
 
   CompactObj::InitThreadLocal(shard_->memory_resource());
+  CompactObj::EnableCompression(GetFlag(FLAGS_compress_values));
+  CompactObj::EnableDedup(GetFlag(FLAGS_dedup_values_min_size));
   SmallString::InitThreadLocal(data_heap);
 
   string backing_prefix = GetFlag(FLAGS_backing_prefix);
-  if (!backing_prefix.empty()) {
-    string fn =
-        absl::StrCat(backing_prefix, "-", absl::Dec(pb->GetIndex(), absl::kZeroPad4), ".ssd");
+  vector<string_view> prefixes = absl::StrSplit(backing_prefix, ',', absl::SkipEmpty());
+  if (!prefixes.empty()) {
+    string_view prefix = prefixes[pb->GetIndex() % prefixes.size()];
+    string fn = absl::StrCat(prefix, "-", absl::Dec(pb->GetIndex(), absl::kZeroPad4), ".ssd");
 
     shard_->tiered_storage_.reset(new TieredStorage(&shard_->db_slice_));
     error_code ec = shard_->tiered_storage_->Open(fn);
     CHECK(!ec) << ec.message();  // TODO
   }
+
+  // The files are opened by ServerFamily, which knows the generation of the journal. Without
+  // them the journal only streams the writes to the replicas.
+  shard_->journal_.reset(new Journal(&shard_->db_slice_));
 }
 
 void EngineShard::DestroyThreadLocal() {
@@ -124,6 +263,8 @@ void EngineShard::DestroyThreadLocal() {
   shard_->~EngineShard();
   mi_free(shard_);
   shard_ = nullptr;
+  CompactObj::EnableCompression(false);  // after all the values are gone.
+  CompactObj::EnableDedup(0);
   CompactObj::InitThreadLocal(nullptr);
   mi_heap_delete(tlh);
   VLOG(1) << "Shard reset " << index;
@@ -142,6 +283,7 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
     DCHECK(continuation_trans_ == nullptr);
 
     CHECK_EQ(committed_txid_, trans->notify_txid());
+    ++stats_.awaked_runs;
     bool keep = trans->RunInShard(this);
     if (keep)
       return;
@@ -152,6 +294,7 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
       trans = nullptr;
 
     if (continuation_trans_->IsArmedInShard(sid)) {
+      ++stats_.continuation_runs;
       bool to_keep = continuation_trans_->RunInShard(this);
       DVLOG(1) << "RunContTrans: " << continuation_trans_->DebugId() << " keep: " << to_keep;
       if (!to_keep) {
@@ -198,6 +341,7 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
         dbg_id = head->DebugId();
       }
 
+      ++stats_.txq_runs;
       bool keep = head->RunInShard(this);
 
       // We should not access head from this point since RunInShard callback decrements refcount.
@@ -234,6 +378,61 @@ void EngineShard::PollExecution(const char* context, Transaction* trans) {
     bool keep = trans->RunInShard(this);
     DLOG_IF(INFO, !dbg_id.empty()) << "Eager run " << sid << ", " << dbg_id << ", keep " << keep;
   }
+
+  RunFastLane();
+}
+
+void EngineShard::RunFastLane() {
+  // Bounds the queue entries that a single poll visits.
+  constexpr unsigned kMaxVisits = 32;
+
+  ShardId sid = shard_id();
+  unsigned budget = kMaxVisits;
+  bool ran = true;
+
+  while (ran && budget > 0 && !txq_.Empty()) {
+    if (blocking_controller_ && blocking_controller_->HasAwakedTransaction())
+      return;
+
+    // The queue is stalled either by the multi-hop transaction that holds the shard between its
+    // hops, or by the head that was not armed yet. The fast lane does not wait for a slow one.
+    Transaction* stalled = continuation_trans_;
+    TxQueue::Iterator it = txq_.Head();
+    size_t pos = 0;
+    if (!stalled) {
+      stalled = absl::get<Transaction*>(txq_.Front());
+      if (stalled->IsArmedInShard(sid))
+        return;
+      it = txq_.Next(it);
+      pos = 1;
+    }
+
+    if (stalled->IsFastLane())
+      return;
+
+    // The transactions that pass CanBypassInShard touch only this shard and only the keys that
+    // none of the queued ones holds, hence they commute with all of them.
+    ran = false;
+    for (; pos < txq_.size() && budget > 0; ++pos, it = txq_.Next(it), --budget) {
+      Transaction* trans = absl::get<Transaction*>(txq_.At(it));
+      if (!trans->CanBypassInShard(this))
+        continue;
+
+      DVLOG(1) << "Fast lane run " << trans->DebugId() << " ahead of " << stalled->DebugId();
+      ++stats_.fast_lane_runs;
+      bool keep = trans->RunInShard(this);
+      DCHECK(!keep);  // a single hop transaction.
+
+      // The queue may have changed, it is visited again from the head.
+      ran = true;
+      break;
+    }
+  }
+}
+
+void EngineShard::AttachMappedSnapshot(unique_ptr<MappedSnapshot> mapped) {
+  mapped->Attach(&db_slice_);
+  mapped_snapshot_ = std::move(mapped);
 }
 
 void EngineShard::ShutdownMulti(Transaction* multi) {
@@ -280,51 +479,410 @@ bool EngineShard::HasResultConverged(TxId notifyid) const {
 }
 #endif
 
-void EngineShard::Heartbeat() {
+void EngineShard::StartHeartbeat(uint32_t base_ms) {
+  heartbeat_.fb = fibers::fiber([this, base_ms, index = ProactorBase::GetIndex()] {
+    this_fiber::properties<FiberProps>().set_name(absl::StrCat("shard_heartbeat", index));
+    HeartbeatFiber(base_ms);
+  });
+}
+
+void EngineShard::HeartbeatFiber(uint32_t base_ms) {
+  uint32_t idle_hz = GetFlag(FLAGS_hz_idle);
+  uint32_t max_ms = idle_hz > 0 ? max(base_ms, 1000 / idle_hz) : base_ms;
+  heartbeat_.interval_ms = base_ms;
+
+  uint64_t last_tasks = 0, last_version = 0;
+  while (true) {
+    {
+      unique_lock lk(heartbeat_.mu);
+      heartbeat_.cv.wait_for(lk, chrono::milliseconds(heartbeat_.interval_ms),
+                             [this] { return heartbeat_.stop || heartbeat_.wake; });
+      if (heartbeat_.stop)
+        break;
+      heartbeat_.wake = false;
+    }
+
+    stats_.heartbeat_idle_ticks += heartbeat_.idle;
+    bool deferred = Heartbeat();
+
+    // The shard is active if it ran tasks or its data changed otherwise, e.g. by a replication
+    // stream. An idle shard backs off exponentially, any activity restores the base rate.
+    uint64_t tasks = queue_stats_.done.load(memory_order_relaxed);
+    uint64_t version = db_slice_.version();
+    if (deferred || tasks != last_tasks || version != last_version) {
+      heartbeat_.interval_ms = base_ms;
+    } else {
+      heartbeat_.interval_ms = min(heartbeat_.interval_ms * 2, max_ms);
+    }
+    last_tasks = tasks;
+    last_version = version;
+    heartbeat_.idle = heartbeat_.interval_ms > base_ms;
+  }
+}
+
+void EngineShard::WakeHeartbeat() {
+  // The task must not see the clock of the last idle tick.
+  db_slice_.UpdateExpireClock(absl::GetCurrentTimeNanos() / 1000000);
+
+  heartbeat_.idle = false;
+  heartbeat_.wake = true;
+  heartbeat_.cv.notify_one();
+}
+
+bool EngineShard::Heartbeat() {
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  uint64_t deadline_ns = start_ns + GetFlag(FLAGS_heartbeat_budget_usec) * 1000ULL;
+  auto has_budget = [&] { return ProactorBase::GetMonotonicTimeNs() < deadline_ns; };
+
   // absl::GetCurrentTimeNanos() returns current time since the Unix Epoch.
   db_slice().UpdateExpireClock(absl::GetCurrentTimeNanos() / 1000000);
 
-  if (task_iters_++ % 8 == 0) {
-    CacheStats();
+  // The work that can be deferred runs in bounded steps, at least one per tick and more while
+  // the tick has budget left. A backlog keeps the heartbeat at the base rate until it is done.
+  bool deferred = false;
 
-    uint32_t traversed = GetMovingSum6(TTL_TRAVERSE);
-    uint32_t deleted = GetMovingSum6(TTL_DELETE);
-    unsigned count = 5;
-    if (deleted > 10) {
-      // deleted should leq than traversed.
-      // hence we map our delete/traversed ration into a range [0, 100).
-      count = 200.0 * double(deleted) / (double(traversed) + 10);
+  // Each segment holds up to a few thousand entries, so releasing the tables of a big flushed
+  // database takes many steps but does not stall the shard.
+  constexpr unsigned kMaxFlushedSegments = 16;
+  bool pending = db_slice_.ReleaseFlushedStep(kMaxFlushedSegments);
+  while (pending && has_budget()) {
+    pending = db_slice_.ReleaseFlushedStep(kMaxFlushedSegments);
+  }
+  deferred |= pending;
+
+  // Released values are spread over steps the same way.
+  constexpr size_t kMaxLazyFreeElements = 4096;
+  {
+    LatencyMonitor::Timer timer{"lazyfree-cycle"};
+    do {
+      lazy_free_.Step(kMaxLazyFreeElements);
+    } while (lazy_free_.pending_objects() > 0 && has_budget());
+    deferred |= lazy_free_.pending_objects() > 0;
+  }
+
+  if (tiered_storage_) {
+    tiered_storage_->UnloadStep();
+    tiered_storage_->CompactStep();
+  }
+
+  // The keys of a mapped snapshot that were not accessed yet are materialized in the
+  // background, see FLAGS_snapshot_mapped.
+  if (mapped_snapshot_) {
+    constexpr unsigned kMaxMappedEntries = 256;
+    bool pending;
+    do {
+      pending = mapped_snapshot_->WarmupStep(kMaxMappedEntries);
+    } while (pending && has_budget());
+    deferred |= pending;
+
+    if (!pending) {
+      VLOG(1) << "Materialized the mapped snapshot of shard " << shard_id();
+      mapped_snapshot_.reset();
     }
+  }
+
+  // The writes evict as well once they exhaust the budget, see Transaction::FinishWrite.
+  constexpr unsigned kMaxEvictionBuckets = 64;
+  if (db_slice_.EvictionStep(kMaxEvictionBuckets) > 0)
+    journal_->Commit();
+
+  // The stats follow the time rather than the ticks, so that they are as fresh while idle.
+  constexpr uint64_t kCacheStatsPeriodNs = 8'000'000;
+  if (start_ns - heartbeat_.last_cache_ns >= kCacheStatsPeriodNs) {
+    heartbeat_.last_cache_ns = start_ns;
+    CacheStats();
 
+    // Return memory of sparse segments, e.g. after mass expiry or deletions.
     for (unsigned i = 0; i < db_slice_.db_array_size(); ++i) {
-      if (db_slice_.IsDbValid(i)) {
-        auto [pt, expt] = db_slice_.GetTables(i);
-        if (expt->size() > pt->size() / 4) {
-          DbSlice::DeleteExpiredStats stats = db_slice_.DeleteExpired(i, count);
-
-          counter_[TTL_TRAVERSE].IncBy(stats.traversed);
-          counter_[TTL_DELETE].IncBy(stats.deleted);
-        }
+      if (db_slice_.IsDbValid(i))
+        db_slice_.ShrinkTables(i, 4);
+    }
+  }
+
+  // The other periodic tasks take turns on separate ticks, so that their costs do not add up
+  // to a latency bump every few milliseconds.
+  switch (task_iters_++ % 8) {
+    case 1:
+      if (StrCompressor* compressor = CompactObj::compressor()) {
+        compressor->Poll();
+      }
+      break;
+    case 3:
+      if (GetFlag(FLAGS_mem_defrag_threshold) > 0) {
+        DefragStep();
+      }
+      break;
+    case 5:
+      if (GetFlag(FLAGS_malloc_stats_period) > 0) {
+        MallocStatsStep();
+      }
+      break;
+    case 7:
+      if (uint32_t budget = GetFlag(FLAGS_key_analyzer_buckets); budget > 0) {
+        key_analyzer_.Step(&db_slice_, budget);
+      }
+
+      if (uint32_t period = GetFlag(FLAGS_key_aging_period); period > 0) {
+        constexpr unsigned kMaxAgingBuckets = 64;
+        db_slice_.AgeKeysStep(period * 1000ULL, kMaxAgingBuckets);
       }
+      break;
+  }
+
+  // The work is proportional to the number of due keys. It runs in chunks while the tick has
+  // budget, so that a mass expiry is spread over several ticks instead of stalling the shard.
+  constexpr unsigned kExpireIndexChunk = 128;
+  uint32_t expired = 0;
+  {
+    LatencyMonitor::Timer timer{"expire-cycle"};
+    for (unsigned i = 0; i < db_slice_.db_array_size(); ++i) {
+      if (!db_slice_.IsDbValid(i))
+        continue;
+
+      DbSlice::DeleteExpiredStats stats;
+      do {
+        stats = db_slice_.DeleteExpired(i, kExpireIndexChunk);
+        counter_[TTL_TRAVERSE].IncBy(stats.traversed);
+        counter_[TTL_DELETE].IncBy(stats.deleted);
+        expired += stats.deleted;
+      } while (stats.popped == kExpireIndexChunk && has_budget());
+      deferred |= stats.popped == kExpireIndexChunk;
+
+      do {
+        stats = db_slice_.DeleteExpiredFields(i, kExpireIndexChunk);
+        expired += stats.deleted;
+      } while (stats.popped == kExpireIndexChunk && has_budget());
+      deferred |= stats.popped == kExpireIndexChunk;
     }
   }
+
+  // Each node is a listpack of at most a few KB, see streamCompactNode.
+  constexpr unsigned kStreamNodesChunk = 32;
+  for (unsigned i = 0; i < db_slice_.db_array_size(); ++i) {
+    if (!db_slice_.IsDbValid(i))
+      continue;
+
+    unsigned popped;
+    do {
+      popped = db_slice_.CompactStreams(i, kStreamNodesChunk);
+    } while (popped == kStreamNodesChunk && has_budget());
+    deferred |= popped == kStreamNodesChunk;
+  }
+
+  // The expired keys are deleted outside of the transactions.
+  if (expired > 0)
+    journal_->Commit();
+
+  ++stats_.heartbeat_ticks;
+  stats_.heartbeat_deferred += deferred;
+  stats_.heartbeat_usec += (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000;
+
+  return deferred;
 }
 
 void EngineShard::CacheStats() {
   // mi_heap_visit_blocks(tlh, false /* visit all blocks*/, visit_cb, &sum);
   mi_stats_merge();
 
-  size_t used_mem = UsedMemory();
-  cached_stats[db_slice_.shard_id()].used_memory.store(used_mem, memory_order_relaxed);
+  PublishUsedMemory(true);
   ssize_t free_mem = max_memory_limit - used_mem_current.load(memory_order_relaxed);
   if (free_mem < 0)
     free_mem = 0;
 
   db_slice_.SetMemoryBudget(free_mem / shard_set->size());
+
+  auto snapshot = make_shared<const MetricsSnapshot>(GetMetricsSnapshot());
+  atomic_store(&cached_stats[db_slice_.shard_id()].metrics, std::move(snapshot));
+}
+
+// Only the shard thread updates the counters, hence there is no need for atomic increments.
+EngineShard::QueueStats::Timer::Timer(QueueStats* qs, uint64_t enqueued_ns)
+    : qs_(qs), start_ns_(ProactorBase::GetMonotonicTimeNs()) {
+  uint64_t wait = start_ns_ > enqueued_ns ? start_ns_ - enqueued_ns : 0;
+  qs_->wait_ns.store(qs_->wait_ns.load(memory_order_relaxed) + wait, memory_order_relaxed);
+
+  // The heartbeat ticks rarely while the shard is idle.
+  if (EngineShard* shard = EngineShard::tlocal(); shard->heartbeat_.idle)
+    shard->WakeHeartbeat();
+}
+
+EngineShard::QueueStats::Timer::~Timer() {
+  uint64_t exec = ProactorBase::GetMonotonicTimeNs() - start_ns_;
+  qs_->exec_ns.store(qs_->exec_ns.load(memory_order_relaxed) + exec, memory_order_relaxed);
+  qs_->done.store(qs_->done.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+auto EngineShard::GetMetricsSnapshot() -> MetricsSnapshot {
+  MetricsSnapshot res;
+  res.slice = db_slice_.GetStats();
+  if (tiered_storage_)
+    res.tiered = tiered_storage_->GetStats();
+  res.shard = stats_;
+  res.used_memory = UsedMemory();
+  res.txq_len = txq_.size();
+  if (!txq_.Empty()) {
+    TxQueue::Iterator it = txq_.Head();
+    for (size_t i = 0; i < res.txq_len; ++i, it = txq_.Next(it))
+      res.txq_fast_len += absl::get<Transaction*>(txq_.At(it))->IsFastLane();
+  }
+  if (blocking_controller_) {
+    res.blocked_txs = blocking_controller_->NumBlocked();
+    res.awakened_txs = blocking_controller_->num_awakened();
+  }
+
+  uint64_t done = queue_stats_.done.load(memory_order_relaxed);
+  res.queue_len = queue_stats_.enqueued.load(memory_order_relaxed) - done;
+  res.queue_tasks = done;
+  res.queue_wait_usec = queue_stats_.wait_ns.load(memory_order_relaxed) / 1000;
+  res.queue_exec_usec = queue_stats_.exec_ns.load(memory_order_relaxed) / 1000;
+  res.flush_pending_keys = db_slice_.flush_pending_keys();
+  res.lazyfree_pending_objects = lazy_free_.pending_objects();
+  res.heartbeat_interval_ms = heartbeat_.interval_ms;
+  res.traverse_ttl_sum6 = GetMovingSum6(TTL_TRAVERSE);
+  res.delete_ttl_sum6 = GetMovingSum6(TTL_DELETE);
+  res.key_report = key_analyzer_.report();
+  res.malloc_stats = malloc_stats_;
+
+  return res;
+}
+
+void EngineShard::DefragStep() {
+  // Visiting the heap takes time proportional to its size, hence we check it once in a while.
+  constexpr uint64_t kCheckIntervalNs = 2'000'000'000;
+
+  // Small heaps are not worth defragmenting.
+  constexpr size_t kMinWasteBytes = 16 << 20;
+
+  // Upper bound on the time a single step can block the shard.
+  constexpr uint64_t kStepBudgetNs = 500'000;
+
+  uint64_t now = absl::GetCurrentTimeNanos();
+  PageUsage& page_usage = defrag_.page_usage;
+  mi_heap_t* heap = mi_resource_.heap();
+
+  if (!defrag_.active) {
+    if (now < defrag_.next_check_ns)
+      return;
+    defrag_.next_check_ns = now + kCheckIntervalNs;
+
+    page_usage.Build(heap, GetFlag(FLAGS_mem_defrag_page_utilization));
+    stats_.heap_committed = page_usage.committed();
+    stats_.heap_used = page_usage.used();
+
+    size_t committed = page_usage.committed(), used = page_usage.used();
+    if (committed < used * GetFlag(FLAGS_mem_defrag_threshold) ||
+        committed < used + kMinWasteBytes || page_usage.underutilized_pages() == 0) {
+      return;
+    }
+
+    VLOG(1) << "Starting defragmentation of shard " << shard_id() << ", committed " << committed
+            << ", used " << used;
+    defrag_.active = true;
+    defrag_.db_indx = 0;
+    defrag_.cursor = PrimeTable::cursor{};
+    defrag_.start_committed = committed;
+  }
+
+  // Keys are shared by reference with the expire and mcflag tables, hence we move only values.
+  // Locked values may be read by reference from other threads, see StringFamily::GetByRef.
+  auto cb = [&](PrimeIterator it) {
+    if (it->second.HasIoPending() || db_slice_.IsLocked(defrag_.db_indx, it->first))
+      return;
+    if (it->second.DefragIfNeeded(page_usage))
+      ++stats_.defrag_moved;
+  };
+
+  unsigned iters = 0;
+  while (defrag_.db_indx < db_slice_.db_array_size()) {
+    if (!db_slice_.IsDbValid(defrag_.db_indx)) {
+      ++defrag_.db_indx;
+      continue;
+    }
+
+    PrimeTable* prime = db_slice_.GetTables(defrag_.db_indx).first;
+    defrag_.cursor = prime->Traverse(defrag_.cursor, cb);
+    if (!defrag_.cursor) {
+      ++defrag_.db_indx;
+    }
+
+    if (++iters % 16 == 0 && absl::GetCurrentTimeNanos() > now + kStepBudgetNs)
+      return;
+  }
+
+  defrag_.active = false;
+  ++stats_.defrag_cycles;
+
+  page_usage.Build(heap, GetFlag(FLAGS_mem_defrag_page_utilization));
+  stats_.heap_committed = page_usage.committed();
+  stats_.heap_used = page_usage.used();
+  if (defrag_.start_committed > page_usage.committed()) {
+    stats_.defrag_reclaimed_bytes += defrag_.start_committed - page_usage.committed();
+  }
+
+  VLOG(1) << "Finished defragmentation of shard " << shard_id() << ", committed "
+          << page_usage.committed() << ", moved " << stats_.defrag_moved;
+}
+
+void EngineShard::MallocStatsStep() {
+  uint64_t now = absl::GetCurrentTimeNanos();
+  if (now < next_malloc_stats_ns_)
+    return;
+
+  // The pass visits the pages of the heap at once, hence we bound its share of the shard time
+  // by delaying the next one.
+  auto stats = make_shared<MallocStats>();
+  stats->heap = HeapStats::Collect(mi_resource_.heap());
+  stats->segment_used = SmallString::UsedThreadLocal();
+  stats->collected_ms = now / 1000000;
+
+  uint64_t duration = absl::GetCurrentTimeNanos() - now;
+  stats->duration_usec = duration / 1000;
+  next_malloc_stats_ns_ =
+      now + max<uint64_t>(GetFlag(FLAGS_malloc_stats_period) * 1000'000'000ULL, duration * 100);
+
+  malloc_stats_ = std::move(stats);
 }
 
 size_t EngineShard::UsedMemory() const {
-  return mi_resource_.used() + zmalloc_used_memory_tl + SmallString::UsedThreadLocal();
+  size_t table_bytes = table_resource_ ? table_resource_->reserved() : 0;
+  CompactObj::Stats cobj_stats = CompactObj::GetStats();
+
+  // The interpreters of the shard thread count towards maxmemory as well.
+  return mi_resource_.used() + table_bytes + zmalloc_used_memory_tl +
+         SmallString::UsedThreadLocal() + cobj_stats.compression_dict_bytes +
+         cobj_stats.dedup_index_bytes + Interpreter::UsedThreadLocal();
+}
+
+void EngineShard::PublishUsedMemory(bool force) {
+  // Bounds the error of used_mem_current by the number of shards times this, while the shards
+  // update the shared counter rarely.
+  constexpr size_t kGranularity = 64 * 1024;
+
+  size_t used = UsedMemory();
+  size_t delta = used > published_used_memory_ ? used - published_used_memory_
+                                               : published_used_memory_ - used;
+  if (!force && delta < kGranularity)
+    return;
+
+  cached_stats[db_slice_.shard_id()].used_memory.store(used, memory_order_relaxed);
+
+  // Unsigned wrap-around subtracts if the shard uses less memory than it published.
+  used_mem_current.fetch_add(used - published_used_memory_, memory_order_relaxed);
+  published_used_memory_ = used;
+}
+
+bool EngineShard::LazyFreeIfNeeded(PrimeValue* pv, bool force) {
+  size_t cost = LazyFree::FreeCost(*pv);
+  uint32_t threshold = GetFlag(FLAGS_lazy_free_threshold);
+
+  // Values of a single allocation are released inline even by UNLINK.
+  if (cost <= 1 || !(force || (threshold > 0 && cost > threshold)))
+    return false;
+
+  lazy_free_.Add(pv);
+  ++stats_.lazyfree_objects;
+
+  return true;
 }
 
 void EngineShard::AddBlocked(Transaction* trans) {
@@ -335,8 +893,8 @@ void EngineShard::AddBlocked(Transaction* trans) {
 }
 
 void EngineShard::TEST_EnableHeartbeat() {
-  auto* pb = ProactorBase::me();
-  periodic_task_ = pb->AddPeriodic(1, [this] { Heartbeat(); });
+  if (!heartbeat_.fb.joinable())
+    StartHeartbeat(1);
 }
 
 /**
@@ -353,14 +911,61 @@ void EngineShard::TEST_EnableHeartbeat() {
 
 void EngineShardSet::Init(uint32_t sz, bool update_db_time) {
   CHECK_EQ(0u, size());
-  cached_stats.resize(sz);
+  // Drops the snapshots of the previous shards, if any.
+  cached_stats = vector<CachedStats>(sz);
   shard_queue_.resize(sz);
+  queue_stats_.resize(sz);
+  shard_by_hashtag = GetFlag(FLAGS_shard_by_hashtag);
 
+  // The shards are initialized concurrently, each by its thread, including the reservation
+  // of their tables.
+  size_t reserve_keys = GetFlag(FLAGS_reserve_keys) / sz;
+  size_t reserve_expire = GetFlag(FLAGS_reserve_expire_keys) / sz;
   pp_->AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) {
     if (index < shard_queue_.size()) {
       InitThreadLocal(pb, update_db_time);
+      if (reserve_keys || reserve_expire)
+        EngineShard::tlocal()->db_slice().Reserve(0, reserve_keys, reserve_expire);
     }
   });
+
+  batch_queues_.resize(pp_->size() * sz);
+  for (auto& q : batch_queues_) {
+    q.reset(new BatchQueue);
+  }
+}
+
+EngineShardSet::BatchQueue::BatchQueue() : ring(kBatchQueueLen) {
+}
+
+void EngineShardSet::BatchQueue::Drain() {
+  scheduled.store(false);
+
+  // Pairs with the fence in PushBatched: either we see the pushed task or the producer sees
+  // that no drain is pending and schedules another one.
+  atomic_thread_fence(memory_order_seq_cst);
+
+  BriefTask task;
+  while (ring.TryPop(&task)) {
+    task();
+  }
+}
+
+bool EngineShardSet::PushBatched(ShardId sid, const BriefTask& task) {
+  ProactorBase* pb = ProactorBase::me();
+  if (!pb || batch_queues_.empty())  // not a pool thread.
+    return false;
+
+  BatchQueue* q = batch_queues_[pb->GetIndex() * size() + sid].get();
+  if (!q->ring.TryPush(task))
+    return false;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!q->scheduled.exchange(true)) {
+    Add(sid, [q] { q->Drain(); });
+  }
+
+  return true;
 }
 
 void EngineShardSet::Shutdown() {
@@ -371,6 +976,7 @@ void EngineShardSet::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   EngineShard::InitThreadLocal(pb, update_db_time);
   EngineShard* es = EngineShard::tlocal();
   shard_queue_[es->shard_id()] = es->GetFiberQueue();
+  queue_stats_[es->shard_id()] = es->queue_stats();
 }
 
 const vector<EngineShardSet::CachedStats>& EngineShardSet::GetCachedStats() {
@@ -12,12 +12,20 @@ extern "C" {
 #include <absl/container/flat_hash_map.h>
 #include <xxhash.h>
 
+#include <boost/fiber/condition_variable.hpp>
+
 #include "base/string_view_sso.h"
 #include "core/external_alloc.h"
+#include "core/heap_stats.h"
+#include "core/huge_page_resource.h"
+#include "core/lazy_free.h"
 #include "core/mi_memory_resource.h"
+#include "core/page_usage.h"
+#include "core/spsc_queue.h"
 #include "core/tx_queue.h"
 #include "server/channel_slice.h"
 #include "server/db_slice.h"
+#include "server/key_analyzer.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers_ext.h"
 #include "util/proactor_pool.h"
@@ -28,16 +36,112 @@ namespace dfly {
 
 class TieredStorage;
 class BlockingController;
+class Journal;
+class MappedSnapshot;
 
 class EngineShard {
  public:
   struct Stats {
     uint64_t ooo_runs = 0;    // how many times transactions run as OOO.
     uint64_t quick_runs = 0;  //  how many times single shard "RunQuickie" transaction run.
+    uint64_t txq_runs = 0;    // how many times transactions run from the head of the tx queue.
+    uint64_t continuation_runs = 0;  // hops of the multi-hop transaction that holds the shard.
+    uint64_t awaked_runs = 0;        // hops of the blocking transactions that were awakened.
+    uint64_t fast_lane_runs = 0;     // fast lane transactions that ran ahead of a stalled queue.
+
+    // Attempts to schedule transactions into the tx queue, the rejected ones are retried by
+    // their coordinators with a new txid. The scheduled transactions that did not get their
+    // key locks right away wait in the queue for the conflicting ones.
+    uint64_t schedule_attempts = 0;
+    uint64_t schedule_rejects = 0;
+    uint64_t lock_conflicts = 0;
+
+    // how many times read-only transactions run without the tx queue, and how many of these
+    // runs were discarded because of concurrent writes.
+    uint64_t optimistic_runs = 0;
+    uint64_t optimistic_conflicts = 0;
+
+    uint64_t defrag_cycles = 0;           // how many times the shard heap was defragmented.
+    uint64_t defrag_moved = 0;            // how many values were moved by the defragmentation.
+    uint64_t defrag_reclaimed_bytes = 0;  // committed bytes freed by the defragmentation.
+    uint64_t lazyfree_objects = 0;        // how many values were released in the background.
+
+    // The heartbeat ticks, those of them that ran slower than --hz since the shard was idle,
+    // and those that ran out of their budget and deferred the rest of the work to the next one.
+    uint64_t heartbeat_ticks = 0;
+    uint64_t heartbeat_idle_ticks = 0;
+    uint64_t heartbeat_deferred = 0;
+    uint64_t heartbeat_usec = 0;
+
+    // Shard heap as of the last defragmentation check.
+    size_t heap_committed = 0;
+    size_t heap_used = 0;
 
     Stats& operator+=(const Stats&);
   };
 
+  // A pass over the shard heap, reported by MEMORY MALLOC-STATS and INFO.
+  struct MallocStats {
+    HeapStats heap;
+    size_t segment_used = 0;  // by the small strings, see SegmentAllocator::used().
+    uint64_t collected_ms = 0;  // epoch time.
+    uint64_t duration_usec = 0;
+  };
+
+  // The shard state reported by INFO and /metrics. It is published by the heartbeat, so that
+  // the readers do not have to dispatch into the shard, see EngineShardSet::CachedStats.
+  struct MetricsSnapshot {
+    DbSlice::Stats slice;
+    TieredStats tiered;
+    Stats shard;
+
+    size_t used_memory = 0;
+    size_t txq_len = 0;
+    size_t txq_fast_len = 0;  // of txq_len, the transactions in the fast lane.
+
+    // The transactions that are blocked on the keys of the shard, see BlockingController.
+    size_t blocked_txs = 0;
+    uint64_t awakened_txs = 0;
+
+    // The tasks of the shard queue, see QueueStats.
+    size_t queue_len = 0;
+    uint64_t queue_tasks = 0;
+    uint64_t queue_wait_usec = 0;
+    uint64_t queue_exec_usec = 0;
+    size_t flush_pending_keys = 0;
+    size_t lazyfree_pending_objects = 0;
+    uint32_t heartbeat_interval_ms = 0;  // the current interval of the heartbeat ticks.
+
+    // Moving sums over the last 6 seconds.
+    uint32_t traverse_ttl_sum6 = 0;
+    uint32_t delete_ttl_sum6 = 0;
+
+    std::shared_ptr<const KeyAnalyzer::Report> key_report;
+
+    // The last pass over the shard heap, null if there was none, see FLAGS_malloc_stats_period.
+    std::shared_ptr<const MallocStats> malloc_stats;
+  };
+
+  // The tasks that EngineShardSet dispatches into the shard queue. The producers only count the
+  // enqueued tasks, the rest is updated by the shard thread, hence on another cache line.
+  struct QueueStats {
+    alignas(64) std::atomic_uint64_t enqueued{0};
+    alignas(64) std::atomic_uint64_t done{0};
+    std::atomic_uint64_t wait_ns{0};  // from the enqueue to the start of the task.
+    std::atomic_uint64_t exec_ns{0};
+
+    // Accounts a task that was enqueued at enqueued_ns for its lifetime.
+    class Timer {
+     public:
+      Timer(QueueStats* qs, uint64_t enqueued_ns);
+      ~Timer();
+
+     private:
+      QueueStats* qs_;
+      uint64_t start_ns_;
+    };
+  };
+
   // EngineShard() is private down below.
   ~EngineShard();
 
@@ -71,10 +175,21 @@ class EngineShard {
     return &mi_resource_;
   }
 
+  // Memory resource for the segments of the prime and expire tables.
+  std::pmr::memory_resource* table_memory_resource() {
+    if (table_resource_)
+      return table_resource_.get();
+    return &mi_resource_;
+  }
+
   ::util::fibers_ext::FiberQueue* GetFiberQueue() {
     return &queue_;
   }
 
+  QueueStats* queue_stats() {
+    return &queue_stats_;
+  }
+
   // Processes TxQueue, blocked transactions or any other execution state related to that
   // shard. Tries executing the passed transaction if possible (does not guarantee though).
   void PollExecution(const char* context, Transaction* trans);
@@ -88,6 +203,16 @@ class EngineShard {
     return committed_txid_;
   }
 
+  // Incremented each time a write transaction runs in this shard. Optimistic reads compare it
+  // before and after validating their results in order to detect concurrent writes.
+  uint64_t write_epoch() const {
+    return write_epoch_;
+  }
+
+  void IncWriteEpoch() {
+    ++write_epoch_;
+  }
+
   // Signals whether shard-wide lock is active.
   // Transactions that conflict with shard locks must subscribe into pending queue.
   IntentLock* shard_lock() {
@@ -102,15 +227,65 @@ class EngineShard {
     stats_.quick_runs++;
   }
 
+  // Called for each attempt to schedule a transaction into the tx queue.
+  void RecordSchedule(bool scheduled, bool lock_granted) {
+    stats_.schedule_attempts++;
+    stats_.schedule_rejects += !scheduled;
+    stats_.lock_conflicts += scheduled && !lock_granted;
+  }
+
+  void IncOptimisticRun(bool conflict) {
+    if (conflict)
+      stats_.optimistic_conflicts++;
+    else
+      stats_.optimistic_runs++;
+  }
+
   const Stats& stats() const {
     return stats_;
   }
 
-  // Returns used memory for this shard.
+  // Returns used memory for this shard. The sum of the exact counters of its allocators.
   size_t UsedMemory() const;
 
+  // Adds the change of UsedMemory since the previous call to used_mem_current, if it exceeds
+  // a granularity or force is set. Keeps the server-wide counter that the admission of
+  // the writes checks up to date with the bursts of writes between the heartbeats.
+  void PublishUsedMemory(bool force);
+
+  MetricsSnapshot GetMetricsSnapshot();
+
+  // Detaches the value of a deleted or an overwritten key and releases it in the background
+  // if releasing it inline would stall the shard, see FLAGS_lazy_free_threshold.
+  // force is used by UNLINK to release any big container in the background.
+  // Returns true if the value was detached.
+  bool LazyFreeIfNeeded(PrimeValue* pv, bool force);
+
+  const LazyFree& lazy_free() const {
+    return lazy_free_;
+  }
+
+  // Breaks down the keys of the shard by prefixes and encodings, see FLAGS_key_analyzer_buckets.
+  KeyAnalyzer* key_analyzer() {
+    return &key_analyzer_;
+  }
+
   TieredStorage* tiered_storage() { return tiered_storage_.get(); }
 
+  // The mapped snapshot of the shard until its keys are materialized by the heartbeat, see
+  // FLAGS_snapshot_mapped. Null otherwise.
+  MappedSnapshot* mapped_snapshot() {
+    return mapped_snapshot_.get();
+  }
+
+  void AttachMappedSnapshot(std::unique_ptr<MappedSnapshot> mapped);
+
+  // The write journal of the shard. It writes to the files with FLAGS_journal and streams to
+  // the replicas.
+  Journal* journal() {
+    return journal_.get();
+  }
+
   // Adds blocked transaction to the watch-list.
   void AddBlocked(Transaction* trans);
 
@@ -142,16 +317,37 @@ class EngineShard {
   // blocks the calling fiber.
   void Shutdown();  // called before destructing EngineShard.
 
-  void Heartbeat();
+  // Runs the fast lane transactions of the tx queue that are stalled behind a slow one,
+  // see Transaction::CanBypassInShard.
+  void RunFastLane();
+
+  // Runs Heartbeat every base_ms, backing off down to --hz_idle while the shard is idle.
+  void StartHeartbeat(uint32_t base_ms);
+  void HeartbeatFiber(uint32_t base_ms);
+
+  // Called by the first task of the shard queue after an idle period.
+  void WakeHeartbeat();
+
+  // Returns true if some of the work was deferred to the next tick.
+  bool Heartbeat();
 
   void CacheStats();
 
+  // Runs a time-bounded step of the active defragmentation, see FLAGS_mem_defrag_threshold.
+  void DefragStep();
+
+  // Collects malloc_stats_ once in a while, see FLAGS_malloc_stats_period.
+  void MallocStatsStep();
 
   ::util::fibers_ext::FiberQueue queue_;
   ::boost::fibers::fiber fiber_q_;
+  QueueStats queue_stats_;
 
   TxQueue txq_;
   MiMemoryResource mi_resource_;
+  LazyFree lazy_free_;  // allocates from the shard heap, hence declared after mi_resource_.
+  KeyAnalyzer key_analyzer_;
+  std::unique_ptr<HugePageResource> table_resource_;  // must outlive db_slice_.
   DbSlice db_slice_;
   ChannelSlice channel_slice_;
 
@@ -159,12 +355,29 @@ class EngineShard {
 
   // Logical ts used to order distributed transactions.
   TxId committed_txid_ = 0;
+  uint64_t write_epoch_ = 0;
   Transaction* continuation_trans_ = nullptr;
   IntentLock shard_lock_;
 
-  uint32_t periodic_task_ = 0;
+  struct HeartbeatState {
+    ::boost::fibers::fiber fb;
+    ::boost::fibers::mutex mu;
+    ::boost::fibers::condition_variable cv;
+    bool stop = false;
+    bool wake = false;
+
+    // Whether the ticks are slower than --hz, then the first task wakes the heartbeat up.
+    bool idle = false;
+    uint32_t interval_ms = 0;
+    uint64_t last_cache_ns = 0;  // see CacheStats.
+  };
+
+  HeartbeatState heartbeat_;
   uint64_t task_iters_ = 0;
+  size_t published_used_memory_ = 0;  // see PublishUsedMemory.
   std::unique_ptr<TieredStorage> tiered_storage_;
+  std::unique_ptr<MappedSnapshot> mapped_snapshot_;
+  std::unique_ptr<Journal> journal_;
   std::unique_ptr<BlockingController> blocking_controller_;
 
   using Counter = util::SlidingCounter<7>;
@@ -172,6 +385,20 @@ class EngineShard {
   Counter counter_[COUNTER_TOTAL];
   std::vector<Counter> ttl_survivor_sum_;  // we need it per db.
 
+  struct DefragState {
+    PageUsage page_usage;
+    DbIndex db_indx = 0;
+    PrimeTable::cursor cursor;
+    bool active = false;
+    size_t start_committed = 0;
+    uint64_t next_check_ns = 0;
+  };
+
+  DefragState defrag_;
+
+  std::shared_ptr<const MallocStats> malloc_stats_;
+  uint64_t next_malloc_stats_ns_ = 0;
+
   static thread_local EngineShard* shard_;
 };
 
@@ -180,10 +407,15 @@ class EngineShardSet {
   struct CachedStats {
     std::atomic_uint64_t used_memory;
 
+    // Replaced by the heartbeat of the shard, accessed via std::atomic_load/atomic_store.
+    // Null until the first heartbeat.
+    std::shared_ptr<const EngineShard::MetricsSnapshot> metrics;
+
     CachedStats() : used_memory(0) {
     }
 
-    CachedStats(const CachedStats& o) : used_memory(o.used_memory.load()) {
+    CachedStats(const CachedStats& o)
+        : used_memory(o.used_memory.load()), metrics(std::atomic_load(&o.metrics)) {
     }
   };
 
@@ -205,13 +437,23 @@ class EngineShardSet {
 
   // Uses a shard queue to dispatch. Callback runs in a dedicated fiber.
   template <typename F> auto Await(ShardId sid, F&& f) {
-    return shard_queue_[sid]->Await(std::forward<F>(f));
+    return shard_queue_[sid]->Await(TimedTask(sid, std::forward<F>(f)));
   }
 
   // Uses a shard queue to dispatch. Callback runs in a dedicated fiber.
   template <typename F> auto Add(ShardId sid, F&& f) {
     assert(sid < shard_queue_.size());
-    return shard_queue_[sid]->Add(std::forward<F>(f));
+    return shard_queue_[sid]->Add(TimedTask(sid, std::forward<F>(f)));
+  }
+
+  // Same as Add but coalesces the callbacks that the calling thread sends to the shard.
+  // They are pushed into a lock-free ring of the (thread, shard) pair and a single shard queue
+  // task runs all the callbacks that were pushed by the time it starts, hence the shard thread
+  // is woken once per batch. Falls back to Add if the ring is full.
+  // The callback must be brief and trivially copyable, see BriefTask.
+  template <typename F> void AddBatched(ShardId sid, F&& f) {
+    if (!PushBatched(sid, BriefTask{f}))
+      Add(sid, std::forward<F>(f));
   }
 
   // Runs a brief function on all shards. Waits for it to complete.
@@ -228,10 +470,61 @@ class EngineShardSet {
   void TEST_EnableHeartBeat();
 
  private:
+  // Type-erased callback that is stored inline, so that it can be copied into a ring slot
+  // without allocations.
+  class BriefTask {
+   public:
+    BriefTask() = default;
+
+    template <typename F> explicit BriefTask(const F& f) {
+      static_assert(sizeof(F) <= sizeof(storage_) && alignof(F) <= alignof(void*));
+      static_assert(std::is_trivially_copyable_v<F>);
+
+      new (storage_) F(f);
+      invoke_ = [](void* p) { (*reinterpret_cast<F*>(p))(); };
+    }
+
+    void operator()() {
+      invoke_(storage_);
+    }
+
+   private:
+    void (*invoke_)(void*) = nullptr;
+    alignas(void*) char storage_[24];
+  };
+
+  struct BatchQueue {
+    SpscQueue<BriefTask> ring;
+    std::atomic_bool scheduled{false};  // whether a Drain task is pending in the shard queue.
+
+    BatchQueue();
+
+    // Runs in the shard thread.
+    void Drain();
+  };
+
   void InitThreadLocal(util::ProactorBase* pb, bool update_db_time);
 
+  // Wraps f so that the shard accounts the time it waited in the queue and its execution.
+  template <typename F> auto TimedTask(ShardId sid, F&& f) {
+    EngineShard::QueueStats* qs = queue_stats_[sid];
+    qs->enqueued.fetch_add(1, std::memory_order_relaxed);
+    return [qs, enqueued_ns = util::ProactorBase::GetMonotonicTimeNs(),
+            f = std::forward<F>(f)]() mutable {
+      EngineShard::QueueStats::Timer timer{qs, enqueued_ns};
+      return f();
+    };
+  }
+
+  // Returns false if the task could not be pushed.
+  bool PushBatched(ShardId sid, const BriefTask& task);
+
   util::ProactorPool* pp_;
   std::vector<util::fibers_ext::FiberQueue*> shard_queue_;
+  std::vector<EngineShard::QueueStats*> queue_stats_;  // of the shards.
+
+  // thread index * size() + shard id.
+  std::vector<std::unique_ptr<BatchQueue>> batch_queues_;
 };
 
 template <typename U, typename P>
@@ -265,7 +558,28 @@ template <typename U> void EngineShardSet::RunBlockingInParallel(U&& func) {
   bc.Wait();
 }
 
+// If true, keys that contain a hash tag are sharded by the tag only. Set upon initialization
+// from the shard_by_hashtag flag.
+extern bool shard_by_hashtag;
+
+// Returns the hash tag of the key, Redis-cluster style: the substring between the first '{'
+// and the first '}' that follows it. Returns the whole key if there is no such non-empty substring.
+inline std::string_view KeyHashTag(std::string_view key) {
+  size_t start = key.find('{');
+  if (start == std::string_view::npos)
+    return key;
+
+  size_t end = key.find('}', start + 1);
+  if (end == std::string_view::npos || end == start + 1)
+    return key;
+
+  return key.substr(start + 1, end - start - 1);
+}
+
 inline ShardId Shard(std::string_view v, ShardId shard_num) {
+  if (shard_by_hashtag)
+    v = KeyHashTag(v);
+
   XXH64_hash_t hash = XXH64(v.data(), v.size(), 120577240643ULL);
   return hash % shard_num;
 }
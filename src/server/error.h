@@ -44,6 +44,7 @@ enum errc {
   invalid_encoding = 9,
   empty_key = 10,
   out_of_memory = 11,
+  delta_mismatch = 12,
 };
 
 }  // namespace rdb
@@ -5,29 +5,292 @@
 #include "server/generic_family.h"
 
 extern "C" {
+#include "redis/crc64.h"
 #include "redis/object.h"
+#include "redis/rdb.h"
 #include "redis/util.h"
 }
 
+#include <absl/base/internal/endian.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/condition_variable.hpp>
+
 #include "base/flags.h"
 #include "base/logging.h"
+#include "facade/redis_parser.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/key_analyzer.h"
+#include "server/rdb_load.h"
+#include "server/rdb_save.h"
+#include "server/tiered_storage.h"
 #include "server/transaction.h"
+#include "util/proactor_base.h"
 #include "util/varz.h"
 
 ABSL_FLAG(uint32_t, dbnum, 16, "Number of databases");
 ABSL_FLAG(uint32_t, keys_output_limit, 8192, "Maximum number of keys output by keys command");
 
+ABSL_DECLARE_FLAG(uint32_t, key_aging_period);
+ABSL_DECLARE_FLAG(std::string, cluster_mode);
+
 namespace dfly {
 using namespace std;
 using namespace facade;
 
 namespace {
 
+constexpr char kBusyKeyErr[] = "-BUSYKEY Target key name already exists.";
+constexpr char kBadPayloadErr[] = "DUMP payload version or checksum are wrong";
+
+// A DUMP payload ends with the rdb version, 2 bytes, and the crc64 of the preceding bytes.
+constexpr size_t kDumpFooterLen = 10;
+
+// MIGRATE reads the replies once it has written that many bytes of RESTORE commands.
+constexpr size_t kMigrateBatchLen = 256 * 1024;
+
+// Serializes the value in the format of DUMP, which is the format of the Redis payloads.
+string DumpValue(EngineShard* shard, const PrimeValue& pv) {
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+
+  // Only the strings stay external, the collections are loaded back by the lookup.
+  if (pv.IsExternal()) {
+    string str;
+    error_code ec = shard->tiered_storage()->ReadValue(pv, &str);
+    CHECK(!ec) << "TBD: " << ec;
+    PrimeValue str_pv;
+    str_pv.SetString(str);
+    CHECK(!serializer.SaveValue(str_pv));
+  } else {
+    CHECK(!serializer.SaveValue(pv));
+  }
+  CHECK(!serializer.FlushMem());
+
+  string res = std::move(sfile.val);
+  uint8_t buf[8];
+  absl::little_endian::Store16(buf, RDB_VERSION);
+  res.append(reinterpret_cast<char*>(buf), 2);
+  uint64_t crc = crc64(0, reinterpret_cast<const uint8_t*>(res.data()), res.size());
+  absl::little_endian::Store64(buf, crc);
+  res.append(reinterpret_cast<char*>(buf), 8);
+  return res;
+}
+
+// Returns true if the footer of the payload is valid.
+bool VerifyDumpPayload(string_view payload) {
+  if (payload.size() < kDumpFooterLen)
+    return false;
+
+  const uint8_t* footer =
+      reinterpret_cast<const uint8_t*>(payload.data()) + payload.size() - kDumpFooterLen;
+  if (absl::little_endian::Load16(footer) > RDB_VERSION)
+    return false;
+
+  uint64_t crc = crc64(0, reinterpret_cast<const uint8_t*>(payload.data()), payload.size() - 8);
+  return crc == absl::little_endian::Load64(footer + 2);
+}
+
+void AppendBulk(string_view str, string* dest) {
+  absl::StrAppend(dest, "$", str.size(), "\r\n", str, "\r\n");
+}
+
+void AppendCommand(std::initializer_list<string_view> args, string* dest) {
+  absl::StrAppend(dest, "*", args.size(), "\r\n");
+  for (string_view arg : args)
+    AppendBulk(arg, dest);
+}
+
+// The connection of MIGRATE to the target instance. An operation fails once it waits for
+// longer than the timeout.
+class MigrateClient {
+ public:
+  explicit MigrateClient(chrono::milliseconds timeout) : timeout_(timeout) {
+  }
+
+  ~MigrateClient();
+
+  error_code Connect(const string& host, uint16_t port);
+
+  // Writes the commands of buf and reads num replies. Appends the error of each reply to
+  // errors, an empty string for a success.
+  error_code Exchange(string_view buf, size_t num, vector<string>* errors);
+
+ private:
+  void Touch() {
+    deadline_ = chrono::steady_clock::now() + timeout_;
+  }
+
+  void WatchdogFb();
+
+  chrono::milliseconds timeout_;
+  chrono::steady_clock::time_point deadline_;
+  unique_ptr<util::LinuxSocketBase> sock_;
+  base::IoBuf io_buf_{512};
+
+  ::boost::fibers::fiber watchdog_;
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
+  bool done_ = false;
+};
+
+MigrateClient::~MigrateClient() {
+  {
+    lock_guard lk(mu_);
+    done_ = true;
+  }
+  cv_.notify_one();
+  if (watchdog_.joinable())
+    watchdog_.join();
+
+  if (sock_) {
+    error_code ec = sock_->Close();
+    LOG_IF(WARNING, ec) << "Error closing the migrate socket " << ec;
+  }
+}
+
+void MigrateClient::WatchdogFb() {
+  unique_lock lk(mu_);
+  while (!done_) {
+    // The operations push the deadline forward.
+    cv_.wait_until(lk, deadline_);
+    if (!done_ && chrono::steady_clock::now() >= deadline_) {
+      sock_->Shutdown(SHUT_RDWR);
+      return;
+    }
+  }
+}
+
+error_code MigrateClient::Connect(const string& host, uint16_t port) {
+  error_code ec;
+  auto address = boost::asio::ip::make_address(host, ec);
+  if (ec) {
+    char ip_addr[INET6_ADDRSTRLEN];
+    if (ResolveDns(host, ip_addr) != 0)
+      return make_error_code(errc::host_unreachable);
+    address = boost::asio::ip::make_address(ip_addr);
+  }
+
+  sock_.reset(util::ProactorBase::me()->CreateSocket());
+  Touch();
+  watchdog_ = ::boost::fibers::fiber(&MigrateClient::WatchdogFb, this);
+  return sock_->Connect(boost::asio::ip::tcp::endpoint{address, port});
+}
+
+error_code MigrateClient::Exchange(string_view buf, size_t num, vector<string>* errors) {
+  Touch();
+  RETURN_ON_ERR(sock_->Write(io::Buffer(buf)));
+
+  RedisParser parser{false};  // client mode
+  RespVec resp;
+  while (num > 0) {
+    if (io_buf_.InputLen() > 0) {
+      uint32_t consumed = 0;
+      RedisParser::Result result = parser.Parse(io_buf_.InputBuffer(), &consumed, &resp);
+      if (result == RedisParser::OK && !resp.empty()) {
+        const RespExpr& reply = resp.front();
+        errors->emplace_back(reply.type == RespExpr::ERROR ? ToSV(reply.GetBuf()) : "");
+        io_buf_.ConsumeInput(consumed);
+        --num;
+        continue;
+      }
+      if (result != RedisParser::INPUT_PENDING)
+        return make_error_code(errc::bad_message);
+      io_buf_.ConsumeInput(consumed);
+    }
+
+    Touch();
+    io::Result<size_t> res = sock_->Recv(io_buf_.AppendBuffer());
+    if (!res)
+      return res.error();
+    if (*res == 0)
+      return make_error_code(errc::connection_reset);
+    io_buf_.CommitWrite(*res);
+  }
+  return error_code{};
+}
+
+struct MigrateItem {
+  string_view key;
+  uint64_t ttl_ms;  // 0 if the key does not expire.
+  string payload;
+  bool restored = false;
+};
+
+struct MigrateOpts {
+  bool copy = false;
+  bool replace = false;
+  vector<string_view> auth;  // the arguments of AUTH.
+};
+
+// Restores the items at the target. Returns the error to reply with, empty on success.
+string RestoreAtTarget(const string& host, uint16_t port, uint32_t db, int64_t timeout_ms,
+                       const MigrateOpts& opts, vector<vector<MigrateItem>>* items) {
+  MigrateClient client{chrono::milliseconds(timeout_ms)};
+  if (client.Connect(host, port))
+    return "-IOERR error or timeout connecting to the client";
+
+  string buf;
+  vector<string> errors;
+  if (!opts.auth.empty()) {
+    absl::StrAppend(&buf, "*", opts.auth.size() + 1, "\r\n");
+    AppendBulk("AUTH", &buf);
+    for (string_view arg : opts.auth)
+      AppendBulk(arg, &buf);
+  }
+  string db_str = absl::StrCat(db);
+  AppendCommand({"SELECT", db_str}, &buf);
+
+  // Sent ahead of the keys, so that they are not restored into the wrong database.
+  if (client.Exchange(buf, opts.auth.empty() ? 1 : 2, &errors))
+    return "-IOERR error or timeout reading to target instance";
+  for (const string& error : errors) {
+    if (!error.empty())
+      return absl::StrCat("Target instance replied with error: ", error);
+  }
+
+  string target_error;
+  vector<MigrateItem*> batch;
+  auto flush = [&]() -> error_code {
+    errors.clear();
+    RETURN_ON_ERR(client.Exchange(buf, batch.size(), &errors));
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (errors[i].empty())
+        batch[i]->restored = true;
+      else if (target_error.empty())
+        target_error = absl::StrCat("Target instance replied with error: ", errors[i]);
+    }
+    buf.clear();
+    batch.clear();
+    return error_code{};
+  };
+
+  buf.clear();
+  for (auto& shard_items : *items) {
+    for (MigrateItem& item : shard_items) {
+      string ttl = absl::StrCat(item.ttl_ms);
+      if (opts.replace)
+        AppendCommand({"RESTORE", item.key, ttl, item.payload, "REPLACE"}, &buf);
+      else
+        AppendCommand({"RESTORE", item.key, ttl, item.payload}, &buf);
+      batch.push_back(&item);
+
+      if (buf.size() >= kMigrateBatchLen && flush())
+        return "-IOERR error or timeout writing to target instance";
+    }
+  }
+
+  if (!batch.empty() && flush())
+    return "-IOERR error or timeout writing to target instance";
+  return target_error;
+}
+
 class Renamer {
  public:
   Renamer(DbIndex dind, ShardId source_id) : db_indx_(dind), src_sid_(source_id) {
@@ -57,6 +320,7 @@ class Renamer {
 
   PrimeValue pv_;
   string str_val_;
+  uint32_t mc_flag_ = 0;
 
   FindResult src_res_, dest_res_;  // index 0 for source, 1 for destination
   OpResult<void> status_;
@@ -115,6 +379,7 @@ OpStatus Renamer::MoveSrc(Transaction* t, EngineShard* es) {
     // TODO: to call PreUpdate/PostUpdate.
     auto it = es->db_slice().FindExt(db_indx_, src_res_.key).first;
     CHECK(IsValid(it));
+    mc_flag_ = es->db_slice().GetMCFlag(db_indx_, it);
 
     // We distinguish because of the SmallString that is pinned to its thread by design,
     // thus can not be accessed via another thread.
@@ -123,8 +388,11 @@ OpStatus Renamer::MoveSrc(Transaction* t, EngineShard* es) {
       it->second.GetString(&str_val_);
     } else {
       bool has_expire = it->second.HasExpire();
+      bool has_flag = it->second.HasFlag();
       pv_ = std::move(it->second);
+      pv_.SetFlag(false);
       it->second.SetExpire(has_expire);
+      it->second.SetFlag(has_flag);
     }
     CHECK(es->db_slice().Del(db_indx_, it));  // delete the entry with empty value in it.
   }
@@ -141,22 +409,28 @@ OpStatus Renamer::UpdateDest(Transaction* t, EngineShard* es) {
 
     if (IsValid(dest_it)) {
       bool has_expire = dest_it->second.HasExpire();
+      bool has_flag = dest_it->second.HasFlag();
       is_prior_list = dest_it->second.ObjType() == OBJ_LIST;
 
       if (src_res_.ref_val.ObjType() == OBJ_STRING) {
-        dest_it->second.SetString(str_val_);
+        dest_it->second.SetValueString(str_val_);
       } else {
         dest_it->second = std::move(pv_);
       }
       dest_it->second.SetExpire(has_expire);  // preserve expire flag.
+      dest_it->second.SetFlag(has_flag);
       db_slice.UpdateExpire(db_indx_, dest_it, src_res_.expire_ts);
     } else {
       if (src_res_.ref_val.ObjType() == OBJ_STRING) {
-        pv_.SetString(str_val_);
+        pv_.SetValueString(str_val_);
       }
       dest_it = db_slice.AddNew(db_indx_, dest_key, std::move(pv_), src_res_.expire_ts);
     }
 
+    // The flag of the source replaces the flag of the destination, if any.
+    if (mc_flag_ || dest_it->second.HasFlag())
+      db_slice.SetMCFlag(db_indx_, dest_it, mc_flag_);
+
     if (!is_prior_list && dest_it->second.ObjType() == OBJ_LIST && es->blocking_controller()) {
       es->blocking_controller()->AwakeWatched(db_indx_, dest_key);
     }
@@ -167,101 +441,189 @@ OpStatus Renamer::UpdateDest(Transaction* t, EngineShard* es) {
 
 struct ScanOpts {
   string_view pattern;
-  string_view type_filter;
+  bool prefix_match = false;  // pattern is a literal prefix of the keys, its '*' stripped.
+  int obj_type = -1;          // -1 matches all types.
+  bool unknown_type = false;  // TYPE matches no keys.
   size_t limit = 10;
 
   unsigned bucket_id = UINT_MAX;
+
+  void SetPattern(string_view pat);
+  void SetType(string_view name);
+
+  bool Matches(string_view key) const {
+    if (pattern.empty())
+      return true;
+    if (prefix_match)
+      return absl::StartsWith(key, pattern);
+    return stringmatchlen(pattern.data(), pattern.size(), key.data(), key.size(), 0) == 1;
+  }
 };
 
-bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, StringVec* res) {
+void ScanOpts::SetPattern(string_view pat) {
+  pattern = pat == "*" ? string_view{} : pat;
+  prefix_match = false;
+
+  // Patterns like "user:*" are common enough to skip the glob matching.
+  if (pattern.size() > 1 && pattern.back() == '*' &&
+      pattern.find_first_of("*?[\\") == pattern.size() - 1) {
+    pattern.remove_suffix(1);
+    prefix_match = true;
+  }
+}
+
+void ScanOpts::SetType(string_view name) {
+  for (int type :
+       {OBJ_STRING, OBJ_LIST, OBJ_SET, OBJ_ZSET, OBJ_HASH, OBJ_STREAM, OBJ_SBF, OBJ_JSON}) {
+    if (name == ObjTypeName(type)) {
+      obj_type = type;
+      return;
+    }
+  }
+  unknown_type = true;
+}
+
+bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, string* scratch,
+            StringVec* res) {
   auto& db_slice = op_args.shard->db_slice();
   if (it->second.HasExpire()) {
-    it = db_slice.ExpireIfNeeded(op_args.db_ind, it).first;
+    it = db_slice.ExpirePrimeIfNeeded(op_args.db_ind, it);
   }
 
   if (!IsValid(it))
     return false;
 
-  bool matches = opts.type_filter.empty() || ObjTypeName(it->second.ObjType()) == opts.type_filter;
-
-  if (!matches)
+  if (opts.obj_type >= 0 && int(it->second.ObjType()) != opts.obj_type)
     return false;
 
   if (opts.bucket_id != UINT_MAX && opts.bucket_id != it.bucket_id()) {
     return false;
   }
 
-  if (opts.pattern.empty()) {
-    res->push_back(it->first.ToString());
-  } else {
-    string str = it->first.ToString();
-    if (stringmatchlen(opts.pattern.data(), opts.pattern.size(), str.data(), str.size(), 0) != 1)
-      return false;
-
-    res->push_back(std::move(str));
-  }
+  // The key is copied out only once it matches.
+  string_view key = it->first.GetSlice(scratch);
+  if (!opts.Matches(key))
+    return false;
 
+  res->emplace_back(key);
   return true;
 }
 
-void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t* cursor,
-            StringVec* vec) {
+// The keys a shard found from the scan cursor on.
+struct ShardScan {
+  StringVec keys;
+
+  // The rank of the cursor where every traversal step that found keys started and the number
+  // of keys found by the end of the step.
+  vector<pair<uint64_t, size_t>> steps;
+
+  uint64_t cursor = 0;  // where the shard stopped, 0 if it reached the end.
+};
+
+// Dash cursors keep the segment id left aligned in 32 bits, so they denote the same point of
+// the hash space in the tables of all the shards regardless of their depth. Traverse goes
+// over the segments of a logical bucket before moving to the next one, so ranking the bucket
+// first orders the cursors by the traversal.
+uint64_t CursorRank(uint64_t cursor) {
+  return (cursor & 0xFF) << 32 | (cursor >> 8);
+}
+
+void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t cursor, ShardScan* res) {
   auto& db_slice = op_args.shard->db_slice();
   DCHECK(db_slice.IsDbValid(op_args.db_ind));
 
-  unsigned cnt = 0;
-
   VLOG(1) << "PrimeTable " << db_slice.shard_id() << "/" << op_args.db_ind << " has "
           << db_slice.DbSize(op_args.db_ind);
 
-  PrimeTable::cursor cur = *cursor;
+  string scratch;
+  PrimeTable::cursor cur = cursor;
   auto [prime_table, expire_table] = db_slice.GetTables(op_args.db_ind);
   do {
-    cur = prime_table->Traverse(
-        cur, [&](PrimeIterator it) { cnt += ScanCb(op_args, it, scan_opts, vec); });
-  } while (cur && cnt < scan_opts.limit);
+    uint64_t start_rank = CursorRank(cur.value());
+    size_t prev_cnt = res->keys.size();
+    // ScanCb matches the keys, the types of the values are inline.
+    cur = prime_table->TraversePrefetch(
+        cur, [](PrimeIterator it) { it->first.Prefetch(); },
+        [&](PrimeIterator it) { ScanCb(op_args, it, scan_opts, &scratch, &res->keys); });
+    if (res->keys.size() > prev_cnt)
+      res->steps.emplace_back(start_rank, res->keys.size());
+  } while (cur && res->keys.size() < scan_opts.limit);
 
   VLOG(1) << "OpScan " << db_slice.shard_id() << " cursor: " << cur.value();
-  *cursor = cur.value();
+  res->cursor = cur.value();
 }
 
+// All the shards traverse their tables concurrently from the same cursor, each one until it
+// finds scan_opts.limit keys. The scan resumes from the shard that stopped first, so the keys
+// other shards found beyond that point are dropped and found again by the next call.
 uint64_t ScanGeneric(uint64_t cursor, const ScanOpts& scan_opts, StringVec* keys,
                      ConnectionContext* cntx) {
-  ShardId sid = cursor % 1024;
-
-  EngineShardSet* ess = shard_set;
-  unsigned shard_count = ess->size();
-
-  // Dash table returns a cursor with its right byte empty. We will use it
-  // for encoding shard index. For now scan has a limitation of 255 shards.
-  CHECK_LT(shard_count, 1024u);
-
-  if (sid >= shard_count) {  // protection
+  // Dash cursors occupy 40 bits.
+  if (cursor >> 40 || scan_opts.unknown_type)  // protection
     return 0;
-  }
 
-  cursor >>= 10;
+  unsigned shard_count = shard_set->size();
+  vector<ShardScan> results(shard_count);
+  DbIndex db_index = cntx->conn_state.db_index;
+
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    OpArgs op_args{shard, db_index};
+    OpScan(op_args, scan_opts, cursor, &results[shard->shard_id()]);
+  });
+
+  uint64_t next_cursor = 0;
+  uint64_t stop_rank = UINT64_MAX;
+  for (const ShardScan& res : results) {
+    if (res.cursor && CursorRank(res.cursor) < stop_rank) {
+      stop_rank = CursorRank(res.cursor);
+      next_cursor = res.cursor;
+    }
+  }
 
-  do {
-    ess->Await(sid, [&] {
-      OpArgs op_args{EngineShard::tlocal(), cntx->conn_state.db_index};
-
-      OpScan(op_args, scan_opts, &cursor, keys);
-    });
-    if (cursor == 0) {
-      ++sid;
-      if (unsigned(sid) == shard_count)
+  for (ShardScan& res : results) {
+    size_t cnt = 0;
+    for (const auto& [rank, keys_end] : res.steps) {
+      if (rank >= stop_rank)
         break;
+      cnt = keys_end;
     }
-  } while (keys->size() < scan_opts.limit);
 
-  if (sid < shard_count) {
-    cursor = (cursor << 10) | sid;
-  } else {
-    DCHECK_EQ(0u, cursor);
+    keys->insert(keys->end(), make_move_iterator(res.keys.begin()),
+                 make_move_iterator(res.keys.begin() + cnt));
   }
 
-  return cursor;
+  return next_cursor;
+}
+
+// The metadata of a key that OBJECT reports.
+struct ObjectInfo {
+  unsigned type;
+  unsigned encoding;
+  unsigned freq;
+  bool freq_tracked;
+  uint64_t idle_ms;
+};
+
+// Reads the metadata without looking up the key, hence OBJECT neither resets the idle time
+// nor bumps the frequency of the key it inspects.
+OpResult<ObjectInfo> OpObject(const OpArgs& op_args, string_view key) {
+  DbSlice& db_slice = op_args.shard->db_slice();
+  if (!db_slice.IsDbValid(op_args.db_ind))
+    return OpStatus::KEY_NOTFOUND;
+
+  PrimeIterator it = db_slice.GetTables(op_args.db_ind).first->Find(key);
+  if (IsValid(it) && it->second.HasExpire())
+    it = db_slice.ExpireIfNeeded(op_args.db_ind, it).first;
+  if (!IsValid(it))
+    return OpStatus::KEY_NOTFOUND;
+
+  ObjectInfo info;
+  info.type = it->second.ObjType();
+  info.encoding = it->second.Encoding();
+  info.freq = it->first.Freq();
+  info.freq_tracked = db_slice.IsFreqTracked();
+  info.idle_ms = db_slice.IdleTimeMs(it->first);
+  return info;
 }
 
 }  // namespace
@@ -273,15 +635,23 @@ void GenericFamily::Shutdown() {
 }
 
 void GenericFamily::Del(CmdArgList args, ConnectionContext* cntx) {
+  DelGeneric(args, false, cntx);
+}
+
+void GenericFamily::Unlink(CmdArgList args, ConnectionContext* cntx) {
+  DelGeneric(args, true, cntx);
+}
+
+void GenericFamily::DelGeneric(CmdArgList args, bool unlink, ConnectionContext* cntx) {
   Transaction* transaction = cntx->transaction;
   VLOG(1) << "Del " << ArgS(args, 1);
 
   atomic_uint32_t result{0};
   bool is_mc = cntx->protocol() == Protocol::MEMCACHE;
 
-  auto cb = [&result](const Transaction* t, EngineShard* shard) {
+  auto cb = [&result, unlink](const Transaction* t, EngineShard* shard) {
     ArgSlice args = t->ShardArgsInShard(shard->shard_id());
-    auto res = OpDel(OpArgs{shard, t->db_index()}, args);
+    auto res = OpDel(OpArgs{shard, t->db_index()}, args, unlink);
     result.fetch_add(res.value_or(0), memory_order_relaxed);
 
     return OpStatus::OK;
@@ -300,7 +670,7 @@ void GenericFamily::Del(CmdArgList args, ConnectionContext* cntx) {
     if (del_cnt == 0) {
       mc_builder->SendNotFound();
     } else {
-      mc_builder->SendSimpleString("DELETED");
+      mc_builder->SendDeleted();
     }
   } else {
     (*cntx)->SendLong(del_cnt);
@@ -392,6 +762,62 @@ void GenericFamily::ExpireAt(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+// MEXPIRE seconds key [key ...]
+// Sets the same timeout on all the keys in a single multi-shard hop, every shard updates its keys
+// in a batch. Replies with an array of 1 or 0 per key, like EXPIRE.
+void GenericFamily::MExpire(CmdArgList args, ConnectionContext* cntx) {
+  string_view sec = ArgS(args, 1);
+  int64_t int_arg;
+
+  if (!absl::SimpleAtoi(sec, &int_arg)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  if (int_arg > kMaxExpireDeadlineSec || int_arg < -kMaxExpireDeadlineSec) {
+    ToLower(&args[0]);
+    return (*cntx)->SendError(InvalidExpireTime(ArgS(args, 0)));
+  }
+
+  int_arg = std::max(int_arg, -1L);
+  ExpireParams params{.ts = int_arg};
+
+  Transaction* transaction = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  vector<vector<bool>> updated(shard_count);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
+    OpArgs op_args{shard, t->db_index()};
+    vector<bool>& res = updated[shard->shard_id()];
+    res.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      res[i] = OpExpire(op_args, keys[i], params) == OpStatus::OK;
+    }
+    return OpStatus::OK;
+  };
+
+  OpStatus status = transaction->ScheduleSingleHop(std::move(cb));
+  CHECK_EQ(OpStatus::OK, status);
+
+  // The keys start at the second argument, hence their reverse indices start at 1.
+  vector<long> res(args.size() - 2);
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    const vector<bool>& shard_res = updated[sid];
+    DCHECK_EQ(transaction->ShardArgsInShard(sid).size(), shard_res.size());
+    for (size_t j = 0; j < shard_res.size(); ++j) {
+      res[transaction->ReverseArgIndex(sid, j) - 1] = shard_res[j];
+    }
+  }
+
+  (*cntx)->StartArray(res.size());
+  for (long val : res) {
+    (*cntx)->SendLong(val);
+  }
+}
+
 void GenericFamily::Keys(CmdArgList args, ConnectionContext* cntx) {
   string_view pattern(ArgS(args, 1));
   uint64_t cursor = 0;
@@ -399,7 +825,7 @@ void GenericFamily::Keys(CmdArgList args, ConnectionContext* cntx) {
   StringVec keys;
 
   ScanOpts scan_opts;
-  scan_opts.pattern = pattern;
+  scan_opts.SetPattern(pattern);
   scan_opts.limit = 512;
   auto output_limit = absl::GetFlag(FLAGS_keys_output_limit);
 
@@ -478,6 +904,49 @@ void GenericFamily::TtlGeneric(CmdArgList args, ConnectionContext* cntx, TimeUni
   }
 }
 
+// MTTL key [key ...]
+// Replies with an array of the TTL of every key in seconds, -2 and -1 as in TTL.
+void GenericFamily::MTtl(CmdArgList args, ConnectionContext* cntx) {
+  Transaction* transaction = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  vector<vector<long>> ttls(shard_count);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
+    vector<long>& res = ttls[shard->shard_id()];
+    res.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      OpResult<uint64_t> ttl = OpTtl(t, shard, keys[i]);
+      if (ttl) {
+        res[i] = (ttl.value() + 500) / 1000;
+      } else {
+        res[i] = ttl.status() == OpStatus::KEY_NOTFOUND ? -2 : -1;
+      }
+    }
+    return OpStatus::OK;
+  };
+
+  OpStatus status = transaction->ScheduleSingleHop(std::move(cb));
+  CHECK_EQ(OpStatus::OK, status);
+
+  vector<long> res(args.size() - 1);
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    const vector<long>& shard_res = ttls[sid];
+    DCHECK_EQ(transaction->ShardArgsInShard(sid).size(), shard_res.size());
+    for (size_t j = 0; j < shard_res.size(); ++j) {
+      res[transaction->ReverseArgIndex(sid, j)] = shard_res[j];
+    }
+  }
+
+  (*cntx)->StartArray(res.size());
+  for (long val : res) {
+    (*cntx)->SendLong(val);
+  }
+}
+
 void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   int64_t index;
@@ -487,6 +956,9 @@ void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   if (index < 0 || index >= absl::GetFlag(FLAGS_dbnum)) {
     return (*cntx)->SendError(kDbIndOutOfRangeErr);
   }
+  if (index != 0 && !absl::GetFlag(FLAGS_cluster_mode).empty()) {
+    return (*cntx)->SendError("SELECT is not allowed in cluster mode");
+  }
   cntx->conn_state.db_index = index;
   auto cb = [index](EngineShard* shard) {
     shard->db_slice().ActivateDb(index);
@@ -497,6 +969,163 @@ void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendOk();
 }
 
+void GenericFamily::Dump(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<string> {
+    auto it = shard->db_slice().FindExt(t->db_index(), key).first;
+    if (!IsValid(it))
+      return OpStatus::KEY_NOTFOUND;
+    return DumpValue(shard, it->second);
+  };
+
+  OpResult<string> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return (*cntx)->SendNull();
+  }
+  (*cntx)->SendBulkString(*result);
+}
+
+// RESTORE <key> <ttl> <payload> [REPLACE] [ABSTTL] [IDLETIME <seconds>] [FREQ <frequency>]
+void GenericFamily::Restore(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view payload = ArgS(args, 3);
+
+  RestoreParams params;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &params.ttl_ms) || params.ttl_ms < 0) {
+    return (*cntx)->SendError("Invalid TTL value, must be >= 0");
+  }
+
+  for (size_t i = 4; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    int64_t val;
+    if (opt == "REPLACE") {
+      params.replace = true;
+    } else if (opt == "ABSTTL") {
+      params.absolute = true;
+    } else if ((opt == "IDLETIME" || opt == "FREQ") && i + 1 < args.size()) {
+      // The lfu counters of this instance are not compatible with them.
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &val) || val < 0) {
+        return (*cntx)->SendError(opt == "IDLETIME" ? "Invalid IDLETIME value, must be >= 0"
+                                                    : "Invalid FREQ value, must be >= 0 and <= 255");
+      }
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!VerifyDumpPayload(payload)) {
+    return (*cntx)->SendError(kBadPayloadErr);
+  }
+
+  params.value = payload.substr(0, payload.size() - kDumpFooterLen);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRestore(OpArgs{shard, t->db_index()}, key, params);
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  switch (status) {
+    case OpStatus::OK:
+      return (*cntx)->SendOk();
+    case OpStatus::KEY_EXISTS:
+      return (*cntx)->SendError(kBusyKeyErr);
+    case OpStatus::INVALID_VALUE:
+      return (*cntx)->SendError("Bad data format");
+    default:
+      return (*cntx)->SendError(status);
+  }
+}
+
+// MIGRATE <host> <port> <key>|"" <db> <timeout> [COPY] [REPLACE] [AUTH <password>]
+//         [AUTH2 <username> <password>] [KEYS <key1> [<key2> ...]]
+//
+// The keys stay locked while they are restored at the target, their RESTORE commands are
+// pipelined over a single connection.
+void GenericFamily::Migrate(CmdArgList args, ConnectionContext* cntx) {
+  string host{ArgS(args, 1)};
+  uint32_t port, db;
+  int64_t timeout_ms;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &port) || port > UINT16_MAX ||
+      !absl::SimpleAtoi(ArgS(args, 4), &db) || !absl::SimpleAtoi(ArgS(args, 5), &timeout_ms)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (timeout_ms <= 0)
+    timeout_ms = 1000;
+
+  MigrateOpts opts;
+  for (size_t i = 6; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (opt == "COPY") {
+      opts.copy = true;
+    } else if (opt == "REPLACE") {
+      opts.replace = true;
+    } else if (opt == "AUTH" && i + 1 < args.size()) {
+      opts.auth = {ArgS(args, i + 1)};
+      i += 1;
+    } else if (opt == "AUTH2" && i + 2 < args.size()) {
+      opts.auth = {ArgS(args, i + 1), ArgS(args, i + 2)};
+      i += 2;
+    } else if (opt == "KEYS") {
+      if (!ArgS(args, 3).empty()) {
+        return (*cntx)->SendError(
+            "When using MIGRATE KEYS option, the key argument must be set to the empty string");
+      }
+      break;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  Transaction* transaction = cntx->transaction;
+  vector<vector<MigrateItem>> items(shard_set->size());
+  transaction->Schedule();
+  transaction->Execute(
+      [&](Transaction* t, EngineShard* shard) {
+        OpArgs op_args{shard, t->db_index()};
+        auto& db_slice = shard->db_slice();
+        for (string_view key : t->ShardArgsInShard(shard->shard_id())) {
+          auto [it, exp_it] = db_slice.FindExt(op_args.db_ind, key);
+          if (!IsValid(it))
+            continue;
+          uint64_t ttl_ms = IsValid(exp_it) ? db_slice.ExpireTime(exp_it) - db_slice.Now() : 0;
+          items[shard->shard_id()].push_back({key, ttl_ms, DumpValue(shard, it->second)});
+        }
+        return OpStatus::OK;
+      },
+      false);
+
+  size_t num_items = 0;
+  for (const auto& shard_items : items)
+    num_items += shard_items.size();
+
+  string error;
+  if (num_items > 0)
+    error = RestoreAtTarget(host, port, db, timeout_ms, opts, &items);
+
+  transaction->Execute(
+      [&](Transaction* t, EngineShard* shard) {
+        if (opts.copy)
+          return OpStatus::OK;
+        auto& db_slice = shard->db_slice();
+        for (const MigrateItem& item : items[shard->shard_id()]) {
+          if (item.restored)
+            db_slice.Del(t->db_index(), db_slice.FindExt(t->db_index(), item.key).first);
+        }
+        return OpStatus::OK;
+      },
+      true);
+
+  if (num_items == 0) {
+    return (*cntx)->SendSimpleString("NOKEY");
+  }
+  if (!error.empty()) {
+    return (*cntx)->SendError(error);
+  }
+  (*cntx)->SendOk();
+}
+
 void GenericFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
 
@@ -516,6 +1145,46 @@ void GenericFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void GenericFamily::Object(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub = ArgS(args, 1);
+  string_view key = ArgS(args, 2);
+
+  if (sub != "ENCODING" && sub != "FREQ" && sub != "IDLETIME" && sub != "REFCOUNT") {
+    return (*cntx)->SendError(UnknownSubCmd(sub, "OBJECT"));
+  }
+
+  if (args.size() != 3) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  if (sub == "IDLETIME" && absl::GetFlag(FLAGS_key_aging_period) == 0) {
+    return (*cntx)->SendError("idle times are not tracked, see --key_aging_period");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpObject(OpArgs{shard, t->db_index()}, key);
+  };
+  OpResult<ObjectInfo> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return (*cntx)->SendNull();
+  }
+
+  const ObjectInfo& info = result.value();
+  if (sub == "ENCODING") {
+    (*cntx)->SendBulkString(KeyAnalyzer::EncodingName(info.type, info.encoding));
+  } else if (sub == "FREQ") {
+    if (!info.freq_tracked)
+      return (*cntx)->SendError("frequencies are not tracked, see --cache_policy");
+    (*cntx)->SendLong(info.freq);
+  } else if (sub == "IDLETIME") {
+    (*cntx)->SendLong(info.idle_ms / 1000);
+  } else {
+    // Values are never shared between keys.
+    (*cntx)->SendLong(1);
+  }
+}
+
 OpResult<void> GenericFamily::RenameGeneric(CmdArgList args, bool skip_exist_dest,
                                             ConnectionContext* cntx) {
   string_view key[2] = {ArgS(args, 1), ArgS(args, 2)};
@@ -576,12 +1245,10 @@ void GenericFamily::Scan(CmdArgList args, ConnectionContext* cntx) {
       else if (scan_opts.limit > 4096)
         scan_opts.limit = 4096;
     } else if (opt == "MATCH") {
-      scan_opts.pattern = ArgS(args, i + 1);
-      if (scan_opts.pattern == "*")
-        scan_opts.pattern = string_view{};
+      scan_opts.SetPattern(ArgS(args, i + 1));
     } else if (opt == "TYPE") {
       ToLower(&args[i + 1]);
-      scan_opts.type_filter = ArgS(args, i + 1);
+      scan_opts.SetType(ArgS(args, i + 1));
     } else if (opt == "BUCKET") {
       if (!absl::SimpleAtoi(ArgS(args, i + 1), &scan_opts.bucket_id)) {
         return (*cntx)->SendError(kInvalidIntErr);
@@ -619,7 +1286,7 @@ OpStatus GenericFamily::OpExpire(const OpArgs& op_args, string_view key,
   if (rel_msec <= 0) {
     CHECK(db_slice.Del(op_args.db_ind, it));
   } else if (IsValid(expire_it)) {
-    expire_it->second = db_slice.FromAbsoluteTime(now_msec + rel_msec);
+    db_slice.UpdateExpireTime(op_args.db_ind, it, expire_it, now_msec + rel_msec);
   } else {
     db_slice.UpdateExpire(op_args.db_ind, it, rel_msec + now_msec);
   }
@@ -641,7 +1308,40 @@ OpResult<uint64_t> GenericFamily::OpTtl(Transaction* t, EngineShard* shard, stri
   return ttl_ms;
 }
 
-OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys) {
+OpStatus GenericFamily::OpRestore(const OpArgs& op_args, string_view key,
+                                  const RestoreParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  PrimeIterator it = db_slice.FindExt(op_args.db_ind, key).first;
+  if (IsValid(it) && !params.replace)
+    return OpStatus::KEY_EXISTS;
+
+  PrimeValue pv;
+  if (RdbLoader::LoadValue(params.value, &pv))
+    return OpStatus::INVALID_VALUE;
+
+  bool is_prior_list = false;
+  if (IsValid(it)) {
+    is_prior_list = it->second.ObjType() == OBJ_LIST;
+    CHECK(db_slice.Del(op_args.db_ind, it));
+  }
+
+  uint64_t expire_at_ms = 0;
+  if (params.ttl_ms > 0) {
+    expire_at_ms = params.absolute ? params.ttl_ms : db_slice.Now() + params.ttl_ms;
+    if (expire_at_ms <= uint64_t(db_slice.Now()))  // expired already, like the keys of a load.
+      return OpStatus::OK;
+  }
+
+  bool is_list = pv.ObjType() == OBJ_LIST;
+  db_slice.AddNew(op_args.db_ind, key, std::move(pv), expire_at_ms);
+
+  if (!is_prior_list && is_list && op_args.shard->blocking_controller()) {
+    op_args.shard->blocking_controller()->AwakeWatched(op_args.db_ind, key);
+  }
+  return OpStatus::OK;
+}
+
+OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys, bool unlink) {
   DVLOG(1) << "Del: " << keys[0];
   auto& db_slice = op_args.shard->db_slice();
 
@@ -651,7 +1351,7 @@ OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys) {
     auto fres = db_slice.FindExt(op_args.db_ind, keys[i]);
     if (!IsValid(fres.first))
       continue;
-    res += int(db_slice.Del(op_args.db_ind, fres.first));
+    res += int(db_slice.Del(op_args.db_ind, fres.first, unlink));
   }
 
   return res;
@@ -662,10 +1362,7 @@ OpResult<uint32_t> GenericFamily::OpExists(const OpArgs& op_args, ArgSlice keys)
   auto& db_slice = op_args.shard->db_slice();
   uint32_t res = 0;
 
-  for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto find_res = db_slice.FindExt(op_args.db_ind, keys[i]);
-    res += IsValid(find_res.first);
-  }
+  db_slice.FindMany(op_args.db_ind, keys, [&](unsigned, PrimeIterator it) { res += IsValid(it); });
   return res;
 }
 
@@ -687,14 +1384,19 @@ OpResult<void> GenericFamily::OpRen(const OpArgs& op_args, string_view from_key,
   }
 
   uint64_t exp_ts = db_slice.ExpireTime(from_expire);
+  uint32_t mc_flag = db_slice.GetMCFlag(op_args.db_ind, from_it);
+  bool from_has_flag = from_it->second.HasFlag();
 
   // we keep the value we want to move.
   PrimeValue from_obj = std::move(from_it->second);
+  from_obj.SetFlag(false);
 
-  // Restore the expire flag on 'from' so we could delete it from expire table.
+  // Restore the expire and flag bits on 'from' so we could delete it from both tables.
   from_it->second.SetExpire(IsValid(from_expire));
+  from_it->second.SetFlag(from_has_flag);
 
   if (IsValid(to_it)) {
+    db_slice.SetMCFlag(op_args.db_ind, to_it, 0);
     to_it->second = std::move(from_obj);
     to_it->second.SetExpire(IsValid(to_expire));  // keep the expire flag on 'to'.
 
@@ -711,6 +1413,9 @@ OpResult<void> GenericFamily::OpRen(const OpArgs& op_args, string_view from_key,
     to_it = db_slice.AddNew(op_args.db_ind, to_key, std::move(from_obj), exp_ts);
   }
 
+  if (mc_flag)
+    db_slice.SetMCFlag(op_args.db_ind, to_it, mc_flag);
+
   if (!is_prior_list && to_it->second.ObjType() == OBJ_LIST && es->blocking_controller()) {
     es->blocking_controller()->AwakeWatched(op_args.db_ind, to_key);
   }
@@ -731,19 +1436,27 @@ void GenericFamily::Register(CommandRegistry* registry) {
              * not available. */
             << CI{"PING", CO::FAST, -1, 0, 0, 0}.HFUNC(Ping)
             << CI{"ECHO", CO::LOADING | CO::FAST, 2, 0, 0, 0}.HFUNC(Echo)
+            << CI{"DUMP", CO::READONLY, 2, 1, 1, 1}.HFUNC(Dump)
             << CI{"EXISTS", CO::READONLY | CO::FAST, -2, 1, -1, 1}.HFUNC(Exists)
             << CI{"EXPIRE", CO::WRITE | CO::FAST, 3, 1, 1, 1}.HFUNC(Expire)
             << CI{"EXPIREAT", CO::WRITE | CO::FAST, 3, 1, 1, 1}.HFUNC(ExpireAt)
             << CI{"KEYS", CO::READONLY, 2, 0, 0, 0}.HFUNC(Keys)
+            << CI{"MEXPIRE", CO::WRITE | CO::FAST | CO::REVERSE_MAPPING, -3, 2, -1, 1}.HFUNC(
+                   MExpire)
+            << CI{"MIGRATE", CO::WRITE | CO::NOSCRIPT | CO::VARIADIC_KEYS, -6, 3, 3, 1}.HFUNC(
+                   Migrate)
+            << CI{"OBJECT", CO::READONLY | CO::FAST, -3, 2, 2, 1}.HFUNC(Object)
             << CI{"PEXPIREAT", CO::WRITE | CO::FAST, 3, 1, 1, 1}.HFUNC(PexpireAt)
             << CI{"RENAME", CO::WRITE, 3, 1, 2, 1}.HFUNC(Rename)
             << CI{"RENAMENX", CO::WRITE, 3, 1, 2, 1}.HFUNC(RenameNx)
+            << CI{"RESTORE", CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(Restore)
             << CI{"SELECT", kSelectOpts, 2, 0, 0, 0}.HFUNC(Select)
             << CI{"SCAN", CO::READONLY | CO::FAST | CO::LOADING, -2, 0, 0, 0}.HFUNC(Scan)
             << CI{"TTL", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(Ttl)
             << CI{"PTTL", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(Pttl)
+            << CI{"MTTL", CO::READONLY | CO::FAST | CO::REVERSE_MAPPING, -2, 1, -1, 1}.HFUNC(MTtl)
             << CI{"TYPE", CO::READONLY | CO::FAST | CO::LOADING, 2, 1, 1, 1}.HFUNC(Type)
-            << CI{"UNLINK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Del);
+            << CI{"UNLINK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Unlink);
 }
 
 }  // namespace dfly
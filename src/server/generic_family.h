@@ -38,18 +38,32 @@ class GenericFamily {
     TimeUnit unit = SEC;
   };
 
+  struct RestoreParams {
+    std::string_view value;  // the payload of DUMP without its footer.
+    int64_t ttl_ms = 0;
+    bool absolute = false;
+    bool replace = false;
+  };
+
   static void Del(CmdArgList args, ConnectionContext* cntx);
+  static void Unlink(CmdArgList args, ConnectionContext* cntx);
   static void Ping(CmdArgList args, ConnectionContext* cntx);
   static void Exists(CmdArgList args, ConnectionContext* cntx);
   static void Expire(CmdArgList args, ConnectionContext* cntx);
   static void ExpireAt(CmdArgList args, ConnectionContext* cntx);
+  static void MExpire(CmdArgList args, ConnectionContext* cntx);
   static void Keys(CmdArgList args, ConnectionContext* cntx);
+  static void Dump(CmdArgList args, ConnectionContext* cntx);
+  static void Restore(CmdArgList args, ConnectionContext* cntx);
+  static void Migrate(CmdArgList args, ConnectionContext* cntx);
+  static void Object(CmdArgList args, ConnectionContext* cntx);
   static void PexpireAt(CmdArgList args, ConnectionContext* cntx);
 
   static void Rename(CmdArgList args, ConnectionContext* cntx);
   static void RenameNx(CmdArgList args, ConnectionContext* cntx);
   static void Ttl(CmdArgList args, ConnectionContext* cntx);
   static void Pttl(CmdArgList args, ConnectionContext* cntx);
+  static void MTtl(CmdArgList args, ConnectionContext* cntx);
 
   static void Echo(CmdArgList args, ConnectionContext* cntx);
   static void Select(CmdArgList args, ConnectionContext* cntx);
@@ -60,10 +74,16 @@ class GenericFamily {
                                       ConnectionContext* cntx);
   static void TtlGeneric(CmdArgList args, ConnectionContext* cntx, TimeUnit unit);
 
+  // UNLINK releases big values in the background regardless of FLAGS_lazy_free_threshold.
+  static void DelGeneric(CmdArgList args, bool unlink, ConnectionContext* cntx);
+
   static OpStatus OpExpire(const OpArgs& op_args, std::string_view key, const ExpireParams& params);
 
+  static OpStatus OpRestore(const OpArgs& op_args, std::string_view key,
+                            const RestoreParams& params);
+
   static OpResult<uint64_t> OpTtl(Transaction* t, EngineShard* shard, std::string_view key);
-  static OpResult<uint32_t> OpDel(const OpArgs& op_args, ArgSlice keys);
+  static OpResult<uint32_t> OpDel(const OpArgs& op_args, ArgSlice keys, bool unlink);
   static OpResult<uint32_t> OpExists(const OpArgs& op_args, ArgSlice keys);
   static OpResult<void> OpRen(const OpArgs& op_args, std::string_view from, std::string_view to,
                               bool skip_exists);
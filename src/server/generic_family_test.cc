@@ -4,6 +4,8 @@
 
 #include "server/generic_family.h"
 
+#include <absl/container/flat_hash_set.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -51,6 +53,95 @@ TEST_F(GenericFamilyTest, Expire) {
   EXPECT_THAT(resp, ArgType(RespExpr::NIL));
 }
 
+TEST_F(GenericFamilyTest, ExpireInline) {
+  // Short and integer keys keep their expiry inline, long keys only in the expire table.
+  const string_view keys[] = {"k", "12345", "a_pretty_long_key_name_here"};
+  for (string_view key : keys) {
+    Run({"set", key, "val", "px", "1000"});
+  }
+  // Beyond 2^31 ms, stored in seconds when inline.
+  Run({"set", "s", "val", "ex", "3000000"});
+  Run({"set", "ms", "val", "px", "3000000001"});
+
+  for (string_view key : keys) {
+    EXPECT_EQ(1000, CheckedInt({"pttl", key})) << key;
+    EXPECT_THAT(Run({"pexpire", key, "2000"}), IntArg(1));
+  }
+  EXPECT_EQ(3000000, CheckedInt({"ttl", "s"}));
+
+  UpdateTime(expire_now_ + 1999);
+  for (string_view key : keys) {
+    EXPECT_THAT(Run({"get", key}), "val") << key;
+  }
+
+  UpdateTime(expire_now_ + 2000);
+  for (string_view key : keys) {
+    EXPECT_THAT(Run({"get", key}), ArgType(RespExpr::NIL)) << key;
+  }
+
+  UpdateTime(expire_now_ + 3000000000);
+  EXPECT_THAT(Run({"get", "ms"}), "val");
+  UpdateTime(expire_now_ + 3000000001);
+  EXPECT_THAT(Run({"get", "ms"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"get", "s"}), ArgType(RespExpr::NIL));
+}
+
+TEST_F(GenericFamilyTest, MExpire) {
+  Run({"mset", "a", "1", "b", "2", "c", "3", "d", "4"});
+  Run({"expire", "d", "50"});
+
+  auto resp = Run({"mexpire", "10", "a", "missing", "b", "c"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0), IntArg(1), IntArg(1)));
+
+  resp = Run({"mttl", "c", "d", "missing", "a", "e"});
+  EXPECT_THAT(resp.GetVec(),
+              ElementsAre(IntArg(10), IntArg(50), IntArg(-2), IntArg(10), IntArg(-2)));
+
+  Run({"set", "e", "5"});
+  resp = Run({"mttl", "e"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-1)));
+
+  UpdateTime(expire_now_ + 10000);
+  EXPECT_EQ(0, CheckedInt({"exists", "a", "b", "c"}));
+  EXPECT_EQ(1, CheckedInt({"exists", "d"}));
+
+  resp = Run({"mexpire", "-1", "d", "e"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(1)));
+  EXPECT_EQ(0, CheckedInt({"exists", "d", "e"}));
+
+  EXPECT_THAT(Run({"mexpire", "x", "a"}), ErrArg("value is not an integer"));
+}
+
+TEST_F(GenericFamilyTest, ActiveExpire) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), "val", "px", i < 90 ? "1000" : "5000"});
+  }
+
+  // Postponed deadlines are rescheduled by the active expiry.
+  for (unsigned i = 80; i < 90; ++i) {
+    Run({"pexpire", StrCat("key", i), "3000"});
+  }
+
+  atomic_uint deleted{0};
+  auto delete_expired = [&](uint64_t now) {
+    UpdateTime(now);
+    deleted = 0;
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* shard) { deleted += shard->db_slice().DeleteExpired(0, 1000).deleted; });
+    return deleted.load();
+  };
+
+  // Expire index buckets are due within ~1s after their deadlines.
+  EXPECT_EQ(80, delete_expired(expire_now_ + 2100));
+  EXPECT_EQ(20, CheckedInt({"dbsize"}));
+
+  EXPECT_EQ(10, delete_expired(expire_now_ + 4100));
+  EXPECT_EQ(10, CheckedInt({"dbsize"}));
+
+  EXPECT_EQ(10, delete_expired(expire_now_ + 6100));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+}
+
 TEST_F(GenericFamilyTest, Del) {
   for (size_t i = 0; i < 1000; ++i) {
     Run({"set", StrCat("foo", i), "1"});
@@ -182,4 +273,125 @@ TEST_F(GenericFamilyTest, Scan) {
   EXPECT_THAT(vec, Each(StartsWith("zset")));
 }
 
+TEST_F(GenericFamilyTest, ScanFull) {
+  for (unsigned i = 0; i < 1000; ++i)
+    Run({"set", absl::StrCat("key", i), "bar"});
+  Run({"sadd", "key:set", "bar"});
+
+  auto scan_all = [&](vector<string_view> opts) {
+    absl::flat_hash_set<string> keys;
+    string cursor = "0";
+    do {
+      vector<string_view> args{"scan", cursor, "count", "50"};
+      args.insert(args.end(), opts.begin(), opts.end());
+      auto resp = Run(absl::MakeSpan(args));
+      EXPECT_THAT(resp, ArrLen(2));
+      cursor = ToSV(resp.GetVec()[0].GetBuf());
+      for (const auto& key : StrArray(resp.GetVec()[1]))
+        keys.insert(key);
+    } while (cursor != "0");
+    return keys;
+  };
+
+  EXPECT_EQ(1001, scan_all({}).size());
+  EXPECT_EQ(111, scan_all({"match", "key1*"}).size());
+  EXPECT_EQ(1, scan_all({"match", "key12"}).size());
+  EXPECT_EQ(9, scan_all({"match", "key?5"}).size());
+  EXPECT_EQ(1, scan_all({"type", "set"}).size());
+  EXPECT_EQ(0, scan_all({"type", "nosuchtype"}).size());
+
+  auto resp = Run({"keys", "key9*"});
+  EXPECT_THAT(resp, ArrLen(111));
+}
+
+TEST_F(GenericFamilyTest, Object) {
+  Run({"set", "str", "bar"});
+  Run({"set", "num", "1"});
+  Run({"sadd", "set", "1", "2"});
+
+  EXPECT_EQ("raw", Run({"object", "encoding", "str"}));
+  EXPECT_EQ("int", Run({"object", "encoding", "num"}));
+  EXPECT_EQ("intset", Run({"object", "encoding", "set"}));
+  EXPECT_EQ(1, CheckedInt({"object", "refcount", "str"}));
+  EXPECT_THAT(Run({"object", "encoding", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"object", "foo", "str"}), ErrArg("Unknown subcommand"));
+
+  // Cache mode is off, hence the lookups do not count.
+  EXPECT_THAT(Run({"object", "freq", "str"}), ErrArg("not tracked"));
+
+  uint64_t now = expire_now_;
+  auto age_keys = [&](unsigned passes) {
+    for (unsigned i = 0; i < passes; ++i) {
+      now += 1000;
+      shard_set->RunBriefInParallel([&](EngineShard* shard) {
+        shard->db_slice().UpdateExpireClock(now);
+        shard->db_slice().AgeKeysStep(0, UINT32_MAX);
+      });
+    }
+  };
+
+  EXPECT_EQ(0, CheckedInt({"object", "idletime", "str"}));
+  age_keys(4);
+
+  // OBJECT does not count as a lookup.
+  int64_t idle = CheckedInt({"object", "idletime", "str"});
+  EXPECT_GE(idle, 1);
+  EXPECT_LE(idle, 4);
+  EXPECT_EQ(idle, CheckedInt({"object", "idletime", "str"}));
+
+  Run({"get", "str"});
+  EXPECT_EQ(0, CheckedInt({"object", "idletime", "str"}));
+  EXPECT_GE(CheckedInt({"object", "idletime", "num"}), 1);
+}
+
+TEST_F(GenericFamilyTest, DumpRestore) {
+  // The payload of Redis for the same value.
+  const string kRedisDump("\x00\xc0\n\t\x00\xbem\x06\x89Z(\x00\n", 13);
+  Run({"set", "num", "10"});
+  EXPECT_EQ(Run({"dump", "num"}), kRedisDump);
+  EXPECT_EQ(Run({"restore", "num2", "0", kRedisDump}), "OK");
+  EXPECT_EQ(Run({"get", "num2"}), "10");
+
+  EXPECT_THAT(Run({"dump", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"restore", "num", "0", kRedisDump}), ErrArg("BUSYKEY"));
+
+  string bad = kRedisDump;
+  bad[1] ^= 1;
+  EXPECT_THAT(Run({"restore", "num3", "0", bad}), ErrArg("checksum are wrong"));
+
+  Run({"rpush", "list", "a", "b", "c"});
+  Run({"hset", "hash", "f1", "v1", "f2", "v2"});
+  Run({"zadd", "zset", "1", "m1", "2", "m2"});
+  Run({"sadd", "set", "x", "y"});
+  for (string_view key : {"list", "hash", "zset", "set"}) {
+    string dump = Run({"dump", key}).GetString();
+    EXPECT_EQ(Run({"restore", key, "0", dump, "replace"}), "OK") << key;
+  }
+  EXPECT_THAT(Run({"lrange", "list", "0", "-1"}).GetVec(), ElementsAre("a", "b", "c"));
+  EXPECT_EQ(Run({"hget", "hash", "f2"}), "v2");
+  EXPECT_EQ(Run({"zscore", "zset", "m2"}), "2");
+  EXPECT_EQ(2, CheckedInt({"scard", "set"}));
+
+  string dump = Run({"dump", "list"}).GetString();
+  EXPECT_EQ(Run({"restore", "ttl", "5000", dump}), "OK");
+  EXPECT_EQ(5000, CheckedInt({"pttl", "ttl"}));
+
+  // An absolute ttl in the past restores nothing.
+  EXPECT_EQ(Run({"restore", "past", "1", dump, "absttl"}), "OK");
+  EXPECT_EQ(0, CheckedInt({"exists", "past"}));
+}
+
+TEST_F(GenericFamilyTest, Migrate) {
+  EXPECT_EQ(Run({"migrate", "127.0.0.1", "1", "missing", "0", "100"}), "NOKEY");
+  EXPECT_THAT(Run({"migrate", "127.0.0.1", "1", "key", "0", "100", "keys", "a"}),
+              ErrArg("must be set to the empty string"));
+  EXPECT_THAT(Run({"migrate", "127.0.0.1", "1", "", "0", "100"}), ErrArg("syntax error"));
+
+  // Nothing listens on the port, the keys stay.
+  Run({"mset", "a", "1", "b", "2"});
+  EXPECT_THAT(Run({"migrate", "127.0.0.1", "1", "", "0", "100", "copy", "keys", "a", "b"}),
+              ErrArg("IOERR"));
+  EXPECT_EQ(2, CheckedInt({"exists", "a", "b"}));
+}
+
 }  // namespace dfly
@@ -0,0 +1,250 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include "base/logging.h"
+#include "core/hyperloglog.h"
+#include "facade/error.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace facade;
+using namespace std;
+
+namespace {
+
+using CI = CommandId;
+
+constexpr char kInvalidHllErr[] = "-WRONGTYPE Key is not a valid HyperLogLog string value.";
+
+string GetString(EngineShard* shard, const PrimeValue& pv) {
+  string res;
+  if (pv.IsExternal()) {
+    error_code ec = shard->tiered_storage()->ReadValue(pv, &res);
+    CHECK(!ec) << "TBD: " << ec;
+  } else {
+    pv.GetString(&res);
+  }
+
+  return res;
+}
+
+OpResult<int> OpAdd(const OpArgs& op_args, string_view key, const vector<string_view>& elements) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+
+  string hll;
+  if (added) {
+    hll = NewHll();
+  } else {
+    if (it->second.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+    hll = GetString(op_args.shard, it->second);
+    if (!IsValidHll(hll))
+      return OpStatus::INVALID_VALUE;
+  }
+
+  int updated = HllAdd(elements, &hll);
+  if (updated < 0)
+    return OpStatus::INVALID_VALUE;
+
+  if (added) {
+    it->second.SetValueString(hll);
+    db_slice.PostUpdate(op_args.db_ind, it);
+    return 1;
+  }
+
+  if (updated) {
+    db_slice.PreUpdate(op_args.db_ind, it);
+    it->second.SetValueString(hll);
+    db_slice.PostUpdate(op_args.db_ind, it);
+  }
+  return updated;
+}
+
+OpResult<uint64_t> OpCount(const OpArgs& op_args, string_view key) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_STRING);
+  if (it_res == OpStatus::KEY_NOTFOUND)
+    return 0;
+  if (!it_res)
+    return it_res.status();
+
+  string hll = GetString(op_args.shard, it_res.value()->second);
+  if (!IsValidHll(hll))
+    return OpStatus::INVALID_VALUE;
+
+  if (auto cached = HllCachedCount(hll))
+    return *cached;
+
+  HllRegisters regs(kHllRegisters);
+  if (!HllMerge(hll, &regs))
+    return OpStatus::INVALID_VALUE;
+  return HllCount(regs);
+}
+
+// Merges the HyperLogLogs of the shard keys into regs, missing keys are empty. Sets dense if
+// one of them is dense.
+OpStatus OpMerge(const OpArgs& op_args, ArgSlice keys, HllRegisters* regs, bool* dense) {
+  auto& db_slice = op_args.shard->db_slice();
+  regs->assign(kHllRegisters, 0);
+
+  for (string_view key : keys) {
+    OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_STRING);
+    if (it_res == OpStatus::WRONG_TYPE)
+      return OpStatus::WRONG_TYPE;
+    if (!it_res)
+      continue;
+
+    string hll = GetString(op_args.shard, it_res.value()->second);
+    if (!IsValidHll(hll) || !HllMerge(hll, regs))
+      return OpStatus::INVALID_VALUE;
+    *dense |= IsDenseHll(hll);
+  }
+
+  return OpStatus::OK;
+}
+
+void SendHllError(OpStatus status, ConnectionContext* cntx) {
+  if (status == OpStatus::INVALID_VALUE)
+    return (*cntx)->SendError(kInvalidHllErr);
+  (*cntx)->SendError(status);
+}
+
+// Multiple keys are merged by their shards first, so the coordinator merges a single set of
+// registers per shard.
+void PFCountMany(ConnectionContext* cntx) {
+  Transaction* trans = cntx->transaction;
+  vector<HllRegisters> regs(shard_set->size());
+  vector<OpStatus> statuses(shard_set->size(), OpStatus::OK);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    bool shard_dense = false;
+    statuses[sid] = OpMerge(OpArgs{shard, t->db_index()}, t->ShardArgsInShard(sid), &regs[sid],
+                            &shard_dense);
+    return OpStatus::OK;
+  };
+  trans->ScheduleSingleHop(std::move(cb));
+
+  HllRegisters result(kHllRegisters);
+  for (ShardId sid = 0; sid < regs.size(); ++sid) {
+    if (statuses[sid] != OpStatus::OK)
+      return SendHllError(statuses[sid], cntx);
+    if (!regs[sid].empty())
+      MaxRegisters(regs[sid], &result);
+  }
+
+  (*cntx)->SendLong(HllCount(result));
+}
+
+}  // namespace
+
+void HllFamily::PFAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> elements(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i) {
+    elements[i - 2] = ArgS(args, i);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(OpArgs{shard, t->db_index()}, key, elements);
+  };
+
+  OpResult<int> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return SendHllError(result.status(), cntx);
+  }
+  (*cntx)->SendLong(result.value());
+}
+
+void HllFamily::PFCount(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() > 2) {
+    return PFCountMany(cntx);
+  }
+
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpCount(OpArgs{shard, t->db_index()}, key);
+  };
+
+  OpResult<uint64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return SendHllError(result.status(), cntx);
+  }
+  (*cntx)->SendLong(result.value());
+}
+
+// Runs in two hops, the first one merges the keys of every shard including the destination,
+// the second one stores the merged registers in the shard of the destination.
+void HllFamily::PFMerge(CmdArgList args, ConnectionContext* cntx) {
+  string_view dest_key = ArgS(args, 1);
+  Transaction* trans = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  vector<HllRegisters> regs(shard_count);
+  vector<OpStatus> statuses(shard_count, OpStatus::OK);
+  vector<uint8_t> dense(shard_count, 0);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    bool shard_dense = false;
+    statuses[sid] = OpMerge(OpArgs{shard, t->db_index()}, t->ShardArgsInShard(sid), &regs[sid],
+                            &shard_dense);
+    dense[sid] = shard_dense;
+    return OpStatus::OK;
+  };
+
+  trans->Schedule();
+  trans->Execute(std::move(cb), false);
+
+  HllRegisters result(kHllRegisters);
+  bool use_dense = false;
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (statuses[sid] != OpStatus::OK) {
+      trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+      return SendHllError(statuses[sid], cntx);
+    }
+    if (!regs[sid].empty())
+      MaxRegisters(regs[sid], &result);
+    use_dense |= dense[sid];
+  }
+
+  // Like in redis, the destination is dense if one of the sources is.
+  string hll = HllEncode(result, use_dense);
+  ShardId dest_shard = Shard(dest_key, shard_count);
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() != dest_shard)
+      return OpStatus::OK;
+
+    auto& db_slice = shard->db_slice();
+    auto [it, added] = db_slice.AddOrFind(t->db_index(), dest_key);
+    if (!added)
+      db_slice.PreUpdate(t->db_index(), it);
+    it->second.SetValueString(hll);
+    db_slice.PostUpdate(t->db_index(), it);
+    return OpStatus::OK;
+  };
+
+  trans->Execute(std::move(store_cb), true);
+  (*cntx)->SendOk();
+}
+
+#define HFUNC(x) SetHandler(&HllFamily::x)
+
+void HllFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"PFADD", CO::WRITE | CO::DENYOOM | CO::FAST, -2, 1, 1, 1}.HFUNC(PFAdd)
+            << CI{"PFCOUNT", CO::READONLY, -2, 1, -1, 1}.HFUNC(PFCount)
+            << CI{"PFMERGE", CO::WRITE | CO::DENYOOM, -2, 1, -1, 1}.HFUNC(PFMerge);
+}
+
+}  // namespace dfly
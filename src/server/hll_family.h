@@ -0,0 +1,24 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "server/common.h"
+
+namespace dfly {
+
+class CommandRegistry;
+class ConnectionContext;
+
+class HllFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+
+ private:
+  static void PFAdd(CmdArgList args, ConnectionContext* cntx);
+  static void PFCount(CmdArgList args, ConnectionContext* cntx);
+  static void PFMerge(CmdArgList args, ConnectionContext* cntx);
+};
+
+}  // namespace dfly
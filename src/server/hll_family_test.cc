@@ -0,0 +1,86 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using namespace facade;
+
+namespace dfly {
+
+class HllFamilyTest : public BaseFamilyTest {
+ protected:
+  // Adds the elements [start, end) to key.
+  void Add(string_view key, unsigned start, unsigned end) {
+    vector<string> elems;
+    for (unsigned i = start; i < end; ++i) {
+      elems.push_back(absl::StrCat("elem:", i));
+    }
+
+    vector<string_view> args{"pfadd", key};
+    args.insert(args.end(), elems.begin(), elems.end());
+    Run(absl::MakeSpan(args));
+  }
+};
+
+TEST_F(HllFamilyTest, Add) {
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll"}));
+  EXPECT_EQ(0, CheckedInt({"pfadd", "hll"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll", "a", "b", "c"}));
+  EXPECT_EQ(0, CheckedInt({"pfadd", "hll", "a", "c"}));
+  EXPECT_EQ(3, CheckedInt({"pfcount", "hll"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "nokey"}));
+
+  auto resp = Run({"get", "hll"});
+  EXPECT_THAT(ToSV(resp.GetBuf()).substr(0, 4), "HYLL");
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"pfadd", "str", "a"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfcount", "str"}), ErrArg("not a valid HyperLogLog"));
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"pfadd", "list", "a"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(HllFamilyTest, CountMany) {
+  Add("a", 0, 3000);
+  Add("b", 2000, 6000);
+  Add("c", 5000, 10000);
+
+  int64_t res = CheckedInt({"pfcount", "a", "b", "c", "nokey"});
+  EXPECT_NEAR(10000, res, 250);
+  res = CheckedInt({"pfcount", "a", "a"});
+  EXPECT_NEAR(3000, res, 75);
+
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"pfcount", "a", "list"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(HllFamilyTest, Merge) {
+  Add("a", 0, 3000);
+  Add("b", 2000, 6000);
+  Add("dest", 9000, 10000);
+
+  EXPECT_EQ(Run({"pfmerge", "dest", "a", "b", "nokey"}), "OK");
+  int64_t res = CheckedInt({"pfcount", "dest"});
+  EXPECT_NEAR(7000, res, 175);
+
+  EXPECT_EQ(Run({"pfmerge", "empty"}), "OK");
+  EXPECT_EQ(0, CheckedInt({"pfcount", "empty"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "empty", "x"}));
+  EXPECT_EQ(1, CheckedInt({"pfcount", "empty"}));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"pfmerge", "dest", "str"}), ErrArg("not a valid HyperLogLog"));
+}
+
+}  // namespace dfly
@@ -11,18 +11,26 @@ extern "C" {
 #include "redis/util.h"
 }
 
+#include <absl/random/random.h>
+
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/string_map.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
 #include "server/transaction.h"
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 using namespace std;
 
 namespace dfly {
 
 using namespace facade;
+using absl::GetFlag;
+using boost::intrusive_ptr;
 
 namespace {
 
@@ -49,6 +57,17 @@ string LpGetVal(uint8_t* lp_it) {
   return absl::StrCat(ele_len);
 }
 
+// Returns the value of field in lp or nullptr if lp has no such field.
+uint8_t* LpFindValue(uint8_t* lp, string_view field) {
+  uint8_t* fptr = lpFirst(lp);
+  if (!fptr)
+    return nullptr;
+
+  uint8_t* fsrc = field.empty() ? lp : (uint8_t*)field.data();
+  fptr = lpFind(lp, fptr, fsrc, field.size(), 1);
+  return fptr ? lpNext(lp, fptr) : nullptr;
+}
+
 // returns a new pointer to lp. Returns true if field was inserted or false it it already existed.
 // skip_exists controls what happens if the field already existed. If skip_exists = true,
 // then val does not override the value and listpack is not changed. Otherwise, the corresponding
@@ -92,6 +111,77 @@ pair<uint8_t*, bool> LpInsert(uint8_t* lp, string_view field, string_view val, b
   return make_pair(lp, !updated);
 }
 
+// The hashType functions of redis are called only for the listpacks, the hash tables are
+// StringMaps.
+inline StringMap* AsStrMap(const robj* hset) {
+  DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
+  return (StringMap*)hset->ptr;
+}
+
+size_t HashLen(const robj* hset) {
+  if (hset->encoding == OBJ_ENCODING_HT)
+    return AsStrMap(hset)->Size();
+  return lpLength((uint8_t*)hset->ptr) / 2;
+}
+
+// size_hint is the expected number of fields, so that the map is sized once.
+void ConvertToStrMap(robj* hset, size_t size_hint) {
+  DCHECK_EQ(OBJ_ENCODING_LISTPACK, hset->encoding);
+
+  uint8_t* lp = (uint8_t*)hset->ptr;
+  StringMap* sm = new StringMap;
+  sm->Reserve(size_hint);
+  HSetFamily::ConvertTo(lp, sm);
+  lpFree(lp);
+
+  hset->ptr = sm;
+  hset->encoding = OBJ_ENCODING_HT;
+}
+
+// Finds the hash like DbSlice::Find, after deleting its expired fields, so that the commands
+// never see them.
+OpResult<PrimeIterator> FindHash(const OpArgs& op_args, string_view key) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  if (it_res && !db_slice.ExpireFieldsIfNeeded(op_args.db_ind, *it_res))
+    return OpStatus::KEY_NOTFOUND;
+  return it_res;
+}
+
+// Parses FIELDS numfields field [field ...] at args[i], which must end the arguments.
+bool ParseFields(CmdArgList args, size_t i, CmdArgList* fields, ConnectionContext* cntx) {
+  ToUpper(&args[i]);
+  if (ArgS(args, i) != "FIELDS") {
+    (*cntx)->SendError(kSyntaxErr);
+    return false;
+  }
+
+  uint32_t num_fields;
+  if (!absl::SimpleAtoi(ArgS(args, i + 1), &num_fields) || num_fields == 0) {
+    (*cntx)->SendError("Parameter `numFields` should be greater than 0");
+    return false;
+  }
+  if (num_fields != args.size() - i - 2) {
+    (*cntx)->SendError("The `numfields` parameter must match the number of arguments");
+    return false;
+  }
+
+  *fields = args.subspan(i + 2);
+  return true;
+}
+
+void SendFieldReplies(const OpResult<vector<long>>& result, size_t num_fields,
+                      ConnectionContext* cntx) {
+  if (!result && result.status() != OpStatus::KEY_NOTFOUND)
+    return (*cntx)->SendError(result.status());
+
+  // A missing key has no fields.
+  (*cntx)->StartArray(num_fields);
+  for (size_t i = 0; i < num_fields; ++i) {
+    (*cntx)->SendLong(result ? (*result)[i] : -2);
+  }
+}
+
 }  // namespace
 
 void HSetFamily::HDel(CmdArgList args, ConnectionContext* cntx) {
@@ -130,13 +220,14 @@ void HSetFamily::HExists(CmdArgList args, ConnectionContext* cntx) {
   string_view field = ArgS(args, 2);
 
   auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<int> {
-    auto& db_slice = shard->db_slice();
-    auto it_res = db_slice.Find(t->db_index(), key, OBJ_HASH);
+    auto it_res = FindHash(OpArgs{shard, t->db_index()}, key);
 
     if (it_res) {
       robj* hset = (*it_res)->second.AsRObj();
-      shard->tmp_str1 = sdscpylen(shard->tmp_str1, field.data(), field.size());
+      if (hset->encoding == OBJ_ENCODING_HT)
+        return int(AsStrMap(hset)->Contains(field));
 
+      shard->tmp_str1 = sdscpylen(shard->tmp_str1, field.data(), field.size());
       return hashTypeExists(hset, shard->tmp_str1);
     }
     if (it_res.status() == OpStatus::KEY_NOTFOUND)
@@ -282,12 +373,28 @@ void HSetFamily::HGetAll(CmdArgList args, ConnectionContext* cntx) {
 
 void HSetFamily::HGetGeneric(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask) {
   string_view key = ArgS(args, 1);
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
+  uint32_t chunk = GetFlag(FLAGS_shard_chunk_elements);
+  if (!cntx->transaction->CanRunChunked())
+    chunk = 0;
+
+  // A large hash is left to SendAllChunked.
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<vector<string>> {
+    if (chunk) {
+      // The fields of a hash with deadlines could expire between the hops, hence its single hop.
+      auto it_res = FindHash(OpArgs{shard, t->db_index()}, key);
+      if (it_res) {
+        const robj* hset = (*it_res)->second.AsRObj();
+        bool has_expiry = hset->encoding == OBJ_ENCODING_HT && AsStrMap(hset)->next_expiry();
+        if (HashLen(hset) > chunk && !has_expiry)
+          return OpStatus::SKIPPED;
+      }
+    }
     return OpGetAll(OpArgs{shard, t->db_index()}, key, getall_mask);
   };
 
   OpResult<vector<string>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::SKIPPED)
+    return SendAllChunked(args, cntx, getall_mask, chunk);
 
   if (result) {
     (*cntx)->SendStringArr(absl::Span<const string>{*result});
@@ -384,35 +491,86 @@ void HSetFamily::HStrLen(CmdArgList args, ConnectionContext* cntx) {
 
 void HSetFamily::HRandField(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
+  int64_t count = 1;
+  bool with_values = false;
+
+  if (args.size() > 2) {
+    if (!absl::SimpleAtoi(ArgS(args, 2), &count))
+      return (*cntx)->SendError(kInvalidIntErr);
+    if (count < -int64_t(UINT32_MAX) || count > UINT32_MAX)
+      return (*cntx)->SendError(kInvalidIntErr);
+
+    if (args.size() == 4) {
+      ToUpper(&args[3]);
+      with_values = ArgS(args, 3) == "WITHVALUES";
+    }
+    if (args.size() > 4 || (args.size() == 4 && !with_values))
+      return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  // A negative count allows the same field to be returned more than once.
+  bool with_dups = count < 0;
+  uint32_t abs_count = with_dups ? -count : count;
 
   auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringVec> {
-    auto& db_slice = shard->db_slice();
-    auto it_res = db_slice.Find(t->db_index(), key, OBJ_HASH);
+    auto it_res = FindHash(OpArgs{shard, t->db_index()}, key);
 
     if (!it_res)
       return it_res.status();
 
     const PrimeValue& pv = it_res.value()->second;
     StringVec str_vec;
+    if (abs_count == 0)
+      return str_vec;
+
+    auto add_pair = [&](string_view field, string_view value) {
+      str_vec.emplace_back(field);
+      if (with_values)
+        str_vec.emplace_back(value);
+    };
 
     if (pv.Encoding() == OBJ_ENCODING_HT) {
-      dict* this_dict = (dict*)pv.RObjPtr();
-      dictEntry* de = dictGetFairRandomKey(this_dict);
-      sds key = (sds)de->key;
-      str_vec.emplace_back(key, sdslen(key));
+      const StringMap* sm = (const StringMap*)pv.RObjPtr();
+      absl::BitGen gen;
+      auto rnd = [&gen] { return absl::Uniform<uint64_t>(gen); };
+
+      if (with_dups) {
+        for (uint32_t i = 0; i < abs_count; ++i) {
+          auto [field, value] = sm->RandomPair(rnd());
+          add_pair(field, value);
+        }
+      } else {
+        sm->Sample(std::min<size_t>(abs_count, sm->Size()), rnd, add_pair);
+      }
     } else if (pv.Encoding() == OBJ_ENCODING_LISTPACK) {
       uint8_t* lp = (uint8_t*)pv.RObjPtr();
       size_t lplen = lpLength(lp);
       CHECK(lplen > 0 && lplen % 2 == 0);
 
+      // lpRandomPairs picks the indices first and collects them in a single pass,
+      // lpRandomPairsUnique selects the pairs in a single pass.
       size_t hlen = lplen / 2;
-      listpackEntry key;
-
-      lpRandomPair(lp, hlen, &key, NULL);
-      if (key.sval) {
-        str_vec.emplace_back(reinterpret_cast<char*>(key.sval), key.slen);
+      size_t num = with_dups ? abs_count : std::min<size_t>(abs_count, hlen);
+      vector<listpackEntry> fields(num), values(num);
+      if (with_dups) {
+        lpRandomPairs(lp, num, fields.data(), values.data());
+      } else if (num == hlen) {
+        uint8_t* p = lpFirst(lp);
+        for (size_t i = 0; i < num; ++i) {
+          fields[i].sval = lpGetValue(p, &fields[i].slen, &fields[i].lval);
+          p = lpNext(lp, p);
+          values[i].sval = lpGetValue(p, &values[i].slen, &values[i].lval);
+          p = lpNext(lp, p);
+        }
       } else {
-        str_vec.emplace_back(absl::StrCat(key.lval));
+        num = lpRandomPairsUnique(lp, num, fields.data(), values.data());
+      }
+
+      auto entry_str = [](const listpackEntry& e) {
+        return e.sval ? string(reinterpret_cast<char*>(e.sval), e.slen) : absl::StrCat(e.lval);
+      };
+      for (size_t i = 0; i < num; ++i) {
+        add_pair(entry_str(fields[i]), entry_str(values[i]));
       }
     } else {
       LOG(ERROR) << "Invalid encoding " << pv.Encoding();
@@ -422,14 +580,93 @@ void HSetFamily::HRandField(CmdArgList args, ConnectionContext* cntx) {
   };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (args.size() == 2) {  // HRANDFIELD key
+    if (result) {
+      CHECK_EQ(1u, result->size());
+      return (*cntx)->SendBulkString(result->front());
+    }
+    if (result.status() == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->SendNull();
+    return (*cntx)->SendError(result.status());
+  }
+
   if (result) {
-    CHECK_EQ(1u, result->size());  // TBD: to support count and withvalues.
-    (*cntx)->SendBulkString(result->front());
+    (*cntx)->SendStringArr(*result);
+  } else if (result.status() == OpStatus::KEY_NOTFOUND) {
+    (*cntx)->SendStringArr(StringVec{});
   } else {
     (*cntx)->SendError(result.status());
   }
 }
 
+// HEXPIRE key seconds [NX | XX | GT | LT] FIELDS numfields field [field ...]
+void HSetFamily::HExpire(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  int64_t seconds;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &seconds))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  if (seconds < 0 || seconds > kMaxExpireDeadlineSec) {
+    ToLower(&args[0]);
+    return (*cntx)->SendError(InvalidExpireTime(ArgS(args, 0)));
+  }
+
+  size_t i = 3;
+  ExpireCond cond = EXPIRE_ALWAYS;
+  ToUpper(&args[i]);
+  string_view opt = ArgS(args, i);
+  if (opt == "NX") {
+    cond = EXPIRE_NX;
+  } else if (opt == "XX") {
+    cond = EXPIRE_XX;
+  } else if (opt == "GT") {
+    cond = EXPIRE_GT;
+  } else if (opt == "LT") {
+    cond = EXPIRE_LT;
+  }
+  if (cond != EXPIRE_ALWAYS)
+    ++i;
+
+  CmdArgList fields;
+  if (!ParseFields(args, i, &fields, cntx))
+    return;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpExpire(OpArgs{shard, t->db_index()}, key, seconds, cond, fields);
+  };
+
+  OpResult<vector<long>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  SendFieldReplies(result, fields.size(), cntx);
+}
+
+void HSetFamily::HTtl(CmdArgList args, ConnectionContext* cntx) {
+  HTtlGeneric(args, cntx, false);
+}
+
+void HSetFamily::HPersist(CmdArgList args, ConnectionContext* cntx) {
+  HTtlGeneric(args, cntx, true);
+}
+
+// HTTL|HPERSIST key FIELDS numfields field [field ...]
+void HSetFamily::HTtlGeneric(CmdArgList args, ConnectionContext* cntx, bool persist) {
+  string_view key = ArgS(args, 1);
+  CmdArgList fields;
+  if (!ParseFields(args, 2, &fields, cntx))
+    return;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpFieldTtl(OpArgs{shard, t->db_index()}, key, fields, persist);
+  };
+
+  OpResult<vector<long>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  SendFieldReplies(result, fields.size(), cntx);
+}
+
+OpResult<uint32_t> HSetFamily::OpAddFields(const OpArgs& op_args, string_view key,
+                                           CmdArgList field_values) {
+  return OpSet(op_args, key, field_values, false);
+}
+
 OpResult<uint32_t> HSetFamily::OpSet(const OpArgs& op_args, string_view key, CmdArgList values,
                                      bool skip_if_exists) {
   DCHECK(!values.empty() && 0 == values.size() % 2);
@@ -438,6 +675,10 @@ OpResult<uint32_t> HSetFamily::OpSet(const OpArgs& op_args, string_view key, Cmd
   pair<PrimeIterator, bool> add_res;
   try {
     add_res = db_slice.AddOrFind(op_args.db_ind, key);
+
+    // The expired fields must not be updated, the hash is created anew if none is left.
+    if (!add_res.second && !db_slice.ExpireFieldsIfNeeded(op_args.db_ind, add_res.first))
+      add_res = db_slice.AddOrFind(op_args.db_ind, key);
   } catch(bad_alloc&) {
     return OpStatus::OUT_OF_MEMORY;
   }
@@ -467,9 +708,10 @@ OpResult<uint32_t> HSetFamily::OpSet(const OpArgs& op_args, string_view key, Cmd
     lp = (uint8_t*)hset->ptr;
     stats->listpack_bytes -= lpBytes(lp);
 
+    // The batch goes straight into a map that is sized for all of it.
     if (!IsGoodForListpack(values, lp)) {
       stats->listpack_blob_cnt--;
-      hashTypeConvert(hset, OBJ_ENCODING_HT);
+      ConvertToStrMap(hset, lpLength(lp) / 2 + values.size() / 2);
       lp = nullptr;
     }
   }
@@ -485,27 +727,9 @@ OpResult<uint32_t> HSetFamily::OpSet(const OpArgs& op_args, string_view key, Cmd
     hset->ptr = lp;
     stats->listpack_bytes += lpBytes(lp);
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* this_dict = (dict*)hset->ptr;
-
-    // Dictionary
+    StringMap* sm = AsStrMap(hset);
     for (size_t i = 0; i < values.size(); i += 2) {
-      sds fs = sdsnewlen(values[i].data(), values[i].size());
-      dictEntry* existing;
-      dictEntry* de = dictAddRaw(this_dict, fs, &existing);
-      if (de) {
-        ++created;
-      } else {  // already exists
-        sdsfree(fs);
-        if (skip_if_exists)
-          continue;
-
-        de = existing;
-        dictFreeVal(this_dict, existing);
-      }
-
-      sds vs = sdsnewlen(values[i + 1].data(), values[i + 1].size());
-      dictSetVal(this_dict, de, vs);
+      created += sm->Set(ArgS(values, i), ArgS(values, i + 1), skip_if_exists);
     }
   }
   it->second.SyncRObj();
@@ -518,7 +742,7 @@ OpResult<uint32_t> HSetFamily::OpDel(const OpArgs& op_args, string_view key, Cmd
   DCHECK(!values.empty());
 
   auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
 
   if (!it_res)
     return it_res.status();
@@ -535,11 +759,17 @@ OpResult<uint32_t> HSetFamily::OpDel(const OpArgs& op_args, string_view key, Cmd
   }
 
   for (auto s : values) {
-    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
+    bool removed;
+    if (hset->encoding == OBJ_ENCODING_HT) {
+      removed = AsStrMap(hset)->Remove(s);
+    } else {
+      op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
+      removed = hashTypeDelete(hset, op_args.shard->tmp_str1);
+    }
 
-    if (hashTypeDelete(hset, op_args.shard->tmp_str1)) {
+    if (removed) {
       ++deleted;
-      if (hashTypeLength(hset) == 0) {
+      if (HashLen(hset) == 0) {
         key_remove = true;
         break;
       }
@@ -565,8 +795,7 @@ auto HSetFamily::OpMGet(const OpArgs& op_args, std::string_view key, CmdArgList
     -> OpResult<vector<OptStr>> {
   DCHECK(!fields.empty());
 
-  auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
 
   if (!it_res)
     return it_res.status();
@@ -613,16 +842,11 @@ auto HSetFamily::OpMGet(const OpArgs& op_args, std::string_view key, CmdArgList
       lp_elem = lpNext(lp, lp_elem);  // switch to the next key
     } while (lp_elem);
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* d = (dict*)hset->ptr;
+    const StringMap* sm = AsStrMap(hset);
     for (size_t i = 0; i < fields.size(); ++i) {
-      op_args.shard->tmp_str1 =
-          sdscpylen(op_args.shard->tmp_str1, fields[i].data(), fields[i].size());
-      dictEntry* de = dictFind(d, op_args.shard->tmp_str1);
-      if (de) {
-        sds val = (sds)dictGetVal(de);
-        result[i].emplace(val, sdslen(val));
-      }
+      optional<string_view> val = sm->Find(ArgS(fields, i));
+      if (val)
+        result[i].emplace(*val);
     }
   }
 
@@ -630,12 +854,11 @@ auto HSetFamily::OpMGet(const OpArgs& op_args, std::string_view key, CmdArgList
 }
 
 OpResult<uint32_t> HSetFamily::OpLen(const OpArgs& op_args, string_view key) {
-  auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
 
   if (it_res) {
     robj* hset = (*it_res)->second.AsRObj();
-    return hashTypeLength(hset);
+    return HashLen(hset);
   }
   if (it_res.status() == OpStatus::KEY_NOTFOUND)
     return 0;
@@ -643,16 +866,14 @@ OpResult<uint32_t> HSetFamily::OpLen(const OpArgs& op_args, string_view key) {
 }
 
 OpResult<string> HSetFamily::OpGet(const OpArgs& op_args, string_view key, string_view field) {
-  auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
   if (!it_res)
     return it_res.status();
 
   robj* hset = (*it_res)->second.AsRObj();
 
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
-
   if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
     unsigned char* vstr = NULL;
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
@@ -668,21 +889,82 @@ OpResult<string> HSetFamily::OpGet(const OpArgs& op_args, string_view key, strin
 
     return absl::StrCat(vll);
   }
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
-
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  if (!de)
+  optional<string_view> val = AsStrMap(hset)->Find(field);
+  if (!val)
     return OpStatus::KEY_NOTFOUND;
 
-  sds val = (sds)dictGetVal(de);
+  return string{*val};
+}
+
+// The hop of the command has concluded by then, hence the key is locked by a transaction of its
+// own, see Transaction::ExecuteChunked. The array header goes first with the length of the hash,
+// which does not change while the key is locked.
+void HSetFamily::SendAllChunked(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask,
+                                uint32_t chunk) {
+  intrusive_ptr<Transaction> trans{Transaction::New(cntx->cid)};
+  OpStatus status = trans->InitByArgs(cntx->conn_state.db_index, args);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+
+  string_view key = ArgS(args, 1);
+  unsigned per_field = (getall_mask == (FIELDS | VALUES)) ? 2 : 1;
+  vector<string> res;
+  uint64_t cursor = 0;
+  size_t total = 0, sent = 0;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    auto it_res = FindHash(OpArgs{shard, t->db_index()}, key);
+    if (!it_res) {
+      status = it_res.status();
+      return false;
+    }
+
+    robj* hset = (*it_res)->second.AsRObj();
+    if (total == 0)
+      total = HashLen(hset) * per_field;
 
-  return string(val, sdslen(val));
+    if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+      OpResult<vector<string>> all = OpGetAll(OpArgs{shard, t->db_index()}, key, getall_mask);
+      res = std::move(all.value());
+      return false;
+    }
+
+    const StringMap* sm = AsStrMap(hset);
+    size_t limit = chunk * per_field;
+    do {
+      cursor = sm->Scan(cursor, [&](string_view field, string_view val) {
+        if (getall_mask & FIELDS)
+          res.emplace_back(field);
+        if (getall_mask & VALUES)
+          res.emplace_back(val);
+      });
+    } while (cursor && res.size() < limit);
+    return cursor != 0;
+  };
+
+  auto send_chunk = [&] {
+    if (status != OpStatus::OK)
+      return;
+    if (sent == 0)
+      (*cntx)->StartArray(total);
+    for (const string& s : res)
+      (*cntx)->SendBulkString(s);
+    sent += res.size();
+    res.clear();
+  };
+
+  trans->ExecuteChunked(std::move(cb), std::move(send_chunk));
+
+  if (status == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->StartArray(0);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+  DCHECK_EQ(sent, total);
 }
 
 OpResult<vector<string>> HSetFamily::OpGetAll(const OpArgs& op_args, string_view key,
                                               uint8_t mask) {
-  auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
   if (!it_res) {
     if (it_res.status() == OpStatus::KEY_NOTFOUND)
       return vector<string>{};
@@ -690,15 +972,15 @@ OpResult<vector<string>> HSetFamily::OpGetAll(const OpArgs& op_args, string_view
   }
 
   robj* hset = (*it_res)->second.AsRObj();
-  hashTypeIterator* hi = hashTypeInitIterator(hset);
 
   vector<string> res;
   bool keyval = (mask == (FIELDS | VALUES));
-  size_t len = hashTypeLength(hset);
+  size_t len = HashLen(hset);
   res.resize(keyval ? len * 2 : len);
   unsigned index = 0;
 
   if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    hashTypeIterator* hi = hashTypeInitIterator(hset);
     while (hashTypeNext(hi) != C_ERR) {
       if (mask & FIELDS) {
         res[index++] = LpGetVal(hi->fptr);
@@ -708,28 +990,25 @@ OpResult<vector<string>> HSetFamily::OpGetAll(const OpArgs& op_args, string_view
         res[index++] = LpGetVal(hi->vptr);
       }
     }
+    hashTypeReleaseIterator(hi);
   } else {
-    while (hashTypeNext(hi) != C_ERR) {
+    AsStrMap(hset)->Iterate([&](string_view field, string_view val) {
       if (mask & FIELDS) {
-        sds key = (sds)dictGetKey(hi->de);
-        res[index++].assign(key, sdslen(key));
+        res[index++].assign(field);
       }
 
       if (mask & VALUES) {
-        sds val = (sds)dictGetVal(hi->de);
-        res[index++].assign(val, sdslen(val));
+        res[index++].assign(val);
       }
-    }
+      return true;
+    });
   }
 
-  hashTypeReleaseIterator(hi);
-
   return res;
 }
 
 OpResult<size_t> HSetFamily::OpStrLen(const OpArgs& op_args, string_view key, string_view field) {
-  auto& db_slice = op_args.shard->db_slice();
-  auto it_res = db_slice.Find(op_args.db_ind, key, OBJ_HASH);
+  auto it_res = FindHash(op_args, key);
 
   if (!it_res) {
     if (it_res.status() == OpStatus::KEY_NOTFOUND)
@@ -739,9 +1018,9 @@ OpResult<size_t> HSetFamily::OpStrLen(const OpArgs& op_args, string_view key, st
 
   robj* hset = (*it_res)->second.AsRObj();
   size_t field_len = 0;
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
 
   if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
     unsigned char* vstr = NULL;
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
@@ -752,16 +1031,18 @@ OpResult<size_t> HSetFamily::OpStrLen(const OpArgs& op_args, string_view key, st
     return field_len;
   }
 
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
-
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  return de ? sdslen((sds)de->v.val) : 0;
+  optional<string_view> val = AsStrMap(hset)->Find(field);
+  return val ? val->size() : 0;
 }
 
 OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_view field,
                               IncrByParam* param) {
   auto& db_slice = op_args.shard->db_slice();
-  const auto [it, inserted] = db_slice.AddOrFind(op_args.db_ind, key);
+  auto [it, inserted] = db_slice.AddOrFind(op_args.db_ind, key);
+
+  // The expired fields must not be incremented, the hash is created anew if none is left.
+  if (!inserted && !db_slice.ExpireFieldsIfNeeded(op_args.db_ind, it))
+    std::tie(it, inserted) = db_slice.AddOrFind(op_args.db_ind, key);
 
   DbTableStats* stats = db_slice.MutableStats(op_args.db_ind);
 
@@ -786,7 +1067,7 @@ OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_vie
 
       if (lpb >= kMaxListPackLen) {
         stats->listpack_blob_cnt--;
-        hashTypeConvert(hset, OBJ_ENCODING_HT);
+        ConvertToStrMap(hset, lpLength((uint8_t*)hset->ptr) / 2 + 1);
       }
     }
   }
@@ -795,9 +1076,23 @@ OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_vie
   unsigned int vlen = UINT_MAX;
   long long old_val = 0;
 
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+  int exist_res = C_ERR;
 
-  int exist_res = hashTypeGetValue(hset, op_args.shard->tmp_str1, &vstr, &vlen, &old_val);
+  // The value of the field in the listpack, which is replaced in place below, so that the
+  // listpack is searched only once.
+  uint8_t* lp_vptr = nullptr;
+
+  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    lp_vptr = LpFindValue((uint8_t*)hset->ptr, field);
+    if (lp_vptr) {
+      vstr = lpGetValue(lp_vptr, &vlen, &old_val);
+      exist_res = C_OK;
+    }
+  } else if (optional<string_view> val = AsStrMap(hset)->Find(field); val) {
+    vstr = (unsigned char*)val->data();
+    vlen = val->size();
+    exist_res = C_OK;
+  }
 
   if (holds_alternative<double>(*param)) {
     long double value;
@@ -830,12 +1125,17 @@ OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_vie
     if (hset->encoding == OBJ_ENCODING_LISTPACK) {
       uint8_t* lp = (uint8_t*)hset->ptr;
 
-      lp = LpInsert(lp, field, sval, false).first;
+      if (lp_vptr) {
+        lp = lpReplace(lp, &lp_vptr, (uint8_t*)sval.data(), sval.size());
+      } else {
+        lp = LpInsert(lp, field, sval, false).first;
+      }
       hset->ptr = lp;
       stats->listpack_bytes += lpBytes(lp);
+    } else if (exist_res == C_OK) {
+      AsStrMap(hset)->Update(field, sval);  // keeps the deadline of the field.
     } else {
-      sds news = sdsnewlen(str, sval.size());
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
+      AsStrMap(hset)->Set(field, sval);
     }
     param->emplace<double>(value);
   } else {
@@ -857,18 +1157,25 @@ OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_vie
 
     int64_t new_val = old_val + incr;
 
+    char buf[32];
+    char* next = absl::numbers_internal::FastIntToBuffer(new_val, buf);
+    string_view sval{buf, size_t(next - buf)};
+
     if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-      char buf[32];
-      char* next = absl::numbers_internal::FastIntToBuffer(new_val, buf);
-      string_view sval{buf, size_t(next - buf)};
       uint8_t* lp = (uint8_t*)hset->ptr;
 
-      lp = LpInsert(lp, field, sval, false).first;
+      // The integer is encoded directly rather than parsed back from sval.
+      if (lp_vptr) {
+        lp = lpReplaceInteger(lp, &lp_vptr, new_val);
+      } else {
+        lp = LpInsert(lp, field, sval, false).first;
+      }
       hset->ptr = lp;
       stats->listpack_bytes += lpBytes(lp);
+    } else if (exist_res == C_OK) {
+      AsStrMap(hset)->Update(field, sval);  // keeps the deadline of the field.
     } else {
-      sds news = sdsfromlonglong(new_val);
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
+      AsStrMap(hset)->Set(field, sval);
     }
     param->emplace<int64_t>(new_val);
   }
@@ -879,9 +1186,161 @@ OpStatus HSetFamily::OpIncrBy(const OpArgs& op_args, string_view key, string_vie
   return OpStatus::OK;
 }
 
+// The replies are -2 for a missing field, 0 if the condition does not apply, 1 if the deadline
+// is set and 2 if the field is deleted.
+OpResult<vector<long>> HSetFamily::OpExpire(const OpArgs& op_args, string_view key,
+                                            uint32_t seconds, ExpireCond cond, CmdArgList fields) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto it_res = FindHash(op_args, key);
+  if (!it_res)
+    return it_res.status();
+
+  PrimeIterator it = *it_res;
+  db_slice.PreUpdate(op_args.db_ind, it);
+  robj* hset = it->second.AsRObj();
+  DbTableStats* stats = db_slice.MutableStats(op_args.db_ind);
+
+  // The deadline is rounded up, so that the fields live for at least the given time.
+  uint32_t expire_at = (db_slice.Now() + seconds * 1000ULL + 999) / 1000;
+  bool remove = seconds == 0;
+
+  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    uint8_t* lp = (uint8_t*)hset->ptr;
+    stats->listpack_bytes -= lpBytes(lp);
+
+    // Only the maps store the deadlines. The fields of a listpack have none, so XX and GT do
+    // not apply to them and the listpack is converted only if a deadline is about to be set.
+    bool convert = false;
+    if (!remove && cond != EXPIRE_XX && cond != EXPIRE_GT) {
+      for (size_t i = 0; i < fields.size() && !convert; ++i) {
+        convert = LpFindValue(lp, ArgS(fields, i)) != nullptr;
+      }
+    }
+
+    if (convert) {
+      stats->listpack_blob_cnt--;
+      ConvertToStrMap(hset, lpLength(lp) / 2);
+    }
+  }
+
+  vector<long> res(fields.size(), -2);
+  bool indexed = false;
+  for (size_t i = 0; i < fields.size(); ++i) {
+    string_view field = ArgS(fields, i);
+    optional<uint32_t> prev;
+    if (hset->encoding == OBJ_ENCODING_HT) {
+      prev = AsStrMap(hset)->FindExpiry(field);
+    } else if (LpFindValue((uint8_t*)hset->ptr, field)) {
+      prev = 0;
+    }
+
+    if (!prev)
+      continue;
+
+    // A field without a deadline never expires, hence GT never applies to it and LT always does.
+    bool applies = false;
+    switch (cond) {
+      case EXPIRE_ALWAYS:
+        applies = true;
+        break;
+      case EXPIRE_NX:
+        applies = *prev == 0;
+        break;
+      case EXPIRE_XX:
+        applies = *prev != 0;
+        break;
+      case EXPIRE_GT:
+        applies = *prev != 0 && expire_at > *prev;
+        break;
+      case EXPIRE_LT:
+        applies = *prev == 0 || expire_at < *prev;
+        break;
+    }
+
+    if (!applies) {
+      res[i] = 0;
+    } else if (remove) {
+      if (hset->encoding == OBJ_ENCODING_HT) {
+        AsStrMap(hset)->Remove(field);
+      } else {
+        op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+        hashTypeDelete(hset, op_args.shard->tmp_str1);
+      }
+      res[i] = 2;
+    } else {
+      AsStrMap(hset)->SetExpiry(field, expire_at);
+      res[i] = 1;
+      indexed = true;
+    }
+  }
+
+  it->second.SyncRObj();
+  db_slice.PostUpdate(op_args.db_ind, it);
+  if (indexed)
+    db_slice.IndexFieldExpiry(op_args.db_ind, it->first, expire_at);
+
+  if (HashLen(hset) == 0) {
+    if (hset->encoding == OBJ_ENCODING_LISTPACK)
+      stats->listpack_blob_cnt--;
+    db_slice.Del(op_args.db_ind, it);
+  } else if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    stats->listpack_bytes += lpBytes((uint8_t*)hset->ptr);
+  }
+
+  return res;
+}
+
+// The replies are -2 for a missing field and -1 for a field without a deadline. Otherwise HTTL
+// replies with the seconds left and HPERSIST with 1, as it removes the deadline.
+OpResult<vector<long>> HSetFamily::OpFieldTtl(const OpArgs& op_args, string_view key,
+                                              CmdArgList fields, bool persist) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto it_res = FindHash(op_args, key);
+  if (!it_res)
+    return it_res.status();
+
+  robj* hset = (*it_res)->second.AsRObj();
+  vector<long> res(fields.size(), -2);
+  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    for (size_t i = 0; i < fields.size(); ++i) {
+      if (LpFindValue((uint8_t*)hset->ptr, ArgS(fields, i)))
+        res[i] = -1;
+    }
+    return res;
+  }
+
+  StringMap* sm = AsStrMap(hset);
+  bool updated = false;
+  for (size_t i = 0; i < fields.size(); ++i) {
+    string_view field = ArgS(fields, i);
+    optional<uint32_t> expire_at = sm->FindExpiry(field);
+    if (!expire_at)
+      continue;
+
+    if (*expire_at == 0) {
+      res[i] = -1;
+    } else if (persist) {
+      if (!updated) {
+        db_slice.PreUpdate(op_args.db_ind, *it_res);
+        updated = true;
+      }
+      sm->SetExpiry(field, 0);
+      res[i] = 1;
+    } else {
+      // FindHash deleted the fields that are due, so the deadline is in the future.
+      res[i] = (*expire_at * 1000ULL - db_slice.Now()) / 1000;
+    }
+  }
+
+  if (updated)
+    db_slice.PostUpdate(op_args.db_ind, *it_res);
+
+  return res;
+}
+
 OpResult<StringVec> HSetFamily::OpScan(const OpArgs& op_args, std::string_view key,
                                        uint64_t* cursor) {
-  OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_HASH);
+  OpResult<PrimeIterator> find_res = FindHash(op_args, key);
 
   if (!find_res)
     return find_res.status();
@@ -909,19 +1368,15 @@ OpResult<StringVec> HSetFamily::OpScan(const OpArgs& op_args, std::string_view k
     } while (lp_elem);
     *cursor = 0;
   } else {
-    dict* ht = (dict*)hset->ptr;
+    const StringMap* sm = AsStrMap(hset);
     long maxiterations = count * 10;
-    void* privdata = &res;
-    auto scanCb = [](void* privdata, const dictEntry* de) {
-      StringVec* res = (StringVec*)privdata;
-      sds val = (sds)de->key;
-      res->emplace_back(val, sdslen(val));
-      val = (sds)de->v.val;
-      res->emplace_back(val, sdslen(val));
+    auto scan_cb = [&res](string_view field, string_view val) {
+      res.emplace_back(field);
+      res.emplace_back(val);
     };
 
     do {
-      *cursor = dictScan(ht, *cursor, scanCb, NULL, privdata);
+      *cursor = sm->Scan(*cursor, scan_cb);
     } while (*cursor && maxiterations-- && res.size() < count);
   }
 
@@ -946,16 +1401,38 @@ void HSetFamily::Register(CommandRegistry* registry) {
             << CI{"HKEYS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HKeys)
 
             // TODO: add options support
-            << CI{"HRANDFIELD", CO::READONLY, 2, 1, 1, 1}.HFUNC(HRandField)
+            << CI{"HRANDFIELD", CO::READONLY, -2, 1, 1, 1}.HFUNC(HRandField)
             << CI{"HSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(HScan)
             << CI{"HSET", CO::WRITE | CO::FAST | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(HSet)
             << CI{"HSETNX", CO::WRITE | CO::DENYOOM | CO::FAST, 4, 1, 1, 1}.HFUNC(HSetNx)
             << CI{"HSTRLEN", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(HStrLen)
-            << CI{"HVALS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HVals);
+            << CI{"HVALS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HVals)
+            << CI{"HEXPIRE", CO::WRITE | CO::FAST, -6, 1, 1, 1}.HFUNC(HExpire)
+            << CI{"HTTL", CO::READONLY | CO::FAST, -5, 1, 1, 1}.HFUNC(HTtl)
+            << CI{"HPERSIST", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(HPersist);
 }
 
 uint32_t HSetFamily::MaxListPackLen() {
   return kMaxListPackLen;
 }
 
+void HSetFamily::ConvertTo(uint8_t* src, StringMap* dest) {
+  uint8_t fbuf[LP_INTBUF_SIZE], vbuf[LP_INTBUF_SIZE];
+  int64_t flen, vlen;
+
+  dest->Reserve(lpLength(src) / 2);
+  for (uint8_t* fptr = lpFirst(src); fptr;) {
+    uint8_t* vptr = lpNext(src, fptr);
+    DCHECK(vptr);
+
+    // lpGet writes the integers into the buffers.
+    uint8_t* field = lpGet(fptr, &flen, fbuf);
+    uint8_t* val = lpGet(vptr, &vlen, vbuf);
+    CHECK(dest->Set(string_view{reinterpret_cast<char*>(field), size_t(flen)},
+                    string_view{reinterpret_cast<char*>(val), size_t(vlen)}));
+
+    fptr = lpNext(src, vptr);
+  }
+}
+
 }  // namespace dfly
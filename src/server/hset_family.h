@@ -13,6 +13,7 @@ namespace dfly {
 
 class ConnectionContext;
 class CommandRegistry;
+class StringMap;
 using facade::OpResult;
 using facade::OpStatus;
 
@@ -21,6 +22,14 @@ class HSetFamily {
   static void Register(CommandRegistry* registry);
   static uint32_t MaxListPackLen();
 
+  // Converts the listpack of a hash into an empty map.
+  static void ConvertTo(uint8_t* src, StringMap* dest);
+
+  // Sets the fields of the hash of key from the field, value pairs, creating it if needed.
+  // Must run in the shard thread of key. Returns the number of the new fields.
+  static OpResult<uint32_t> OpAddFields(const OpArgs& op_args, std::string_view key,
+                                        CmdArgList field_values);
+
  private:
   enum GetAllMode : uint8_t { FIELDS = 1, VALUES = 2 };
 
@@ -39,9 +48,19 @@ class HSetFamily {
   static void HSetNx(CmdArgList args, ConnectionContext* cntx);
   static void HStrLen(CmdArgList args, ConnectionContext* cntx);
   static void HRandField(CmdArgList args, ConnectionContext* cntx);
+  static void HExpire(CmdArgList args, ConnectionContext* cntx);
+  static void HTtl(CmdArgList args, ConnectionContext* cntx);
+  static void HPersist(CmdArgList args, ConnectionContext* cntx);
+
+  static void HTtlGeneric(CmdArgList args, ConnectionContext* cntx, bool persist);
 
   static void HGetGeneric(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask);
 
+  // Replies to HGetGeneric with a hash that is too large for a single hop. Reads it in hops of
+  // chunk fields and sends each chunk before the next hop.
+  static void SendAllChunked(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask,
+                             uint32_t chunk);
+
   static OpResult<uint32_t> OpSet(const OpArgs& op_args, std::string_view key, CmdArgList values,
                                   bool skip_if_exists);
   static OpResult<uint32_t> OpDel(const OpArgs& op_args, std::string_view key, CmdArgList values);
@@ -65,6 +84,18 @@ class HSetFamily {
                            IncrByParam* param);
 
   static OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t* cursor);
+
+  enum ExpireCond : uint8_t { EXPIRE_ALWAYS, EXPIRE_NX, EXPIRE_XX, EXPIRE_GT, EXPIRE_LT };
+
+  // Sets the deadlines of the fields to seconds from now, or deletes them if seconds is 0.
+  // Returns the reply of HEXPIRE for each field.
+  static OpResult<std::vector<long>> OpExpire(const OpArgs& op_args, std::string_view key,
+                                              uint32_t seconds, ExpireCond cond,
+                                              CmdArgList fields);
+
+  // Returns the reply of HTTL for each field, or of HPERSIST if persist.
+  static OpResult<std::vector<long>> OpFieldTtl(const OpArgs& op_args, std::string_view key,
+                                                CmdArgList fields, bool persist);
 };
 
 }  // namespace dfly
@@ -10,6 +10,9 @@ extern "C" {
 #include "redis/sds.h"
 }
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -21,6 +24,8 @@ using namespace util;
 using namespace boost;
 using namespace facade;
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 namespace dfly {
 
 class HSetFamilyTest : public BaseFamilyTest {
@@ -116,6 +121,229 @@ TEST_F(HSetFamilyTest, HIncr) {
   Run({"hset", "key", "a", " 1"});
   auto resp = Run({"hincrby", "key", "a", "10"});
   EXPECT_THAT(resp, ErrArg("hash value is not an integer"));
+
+  // The listpack values are replaced in place, also when their encoding grows or shrinks.
+  Run({"hset", "counters", "a", "x", "b", "0", "c", "y"});
+  for (string_view incr : {"1", "100", "10000", "1000000000", "-1000010101", "10000000000"}) {
+    Run({"hincrby", "counters", "b", incr});
+  }
+  EXPECT_EQ(Run({"hget", "counters", "b"}), "10000000000");
+  EXPECT_EQ(Run({"hincrbyfloat", "counters", "b", "0.5"}), "10000000000.5");
+  resp = Run({"hgetall", "counters"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "x", "b", "10000000000.5", "c", "y"));
+}
+
+TEST_F(HSetFamilyTest, SetBatch) {
+  Run({"hset", "key", "a", "1"});
+  vector<string> args{"hset", "key"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    args.push_back(absl::StrCat("f", i));
+    args.push_back(absl::StrCat(i));
+  }
+
+  vector<string_view> sv(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(1000));
+  EXPECT_EQ(1001, CheckedInt({"hlen", "key"}));
+  EXPECT_EQ(Run({"hget", "key", "f999"}), "999");
+  EXPECT_EQ(Run({"hget", "key", "a"}), "1");
+}
+
+TEST_F(HSetFamilyTest, HRandField) {
+  EXPECT_THAT(Run({"hrandfield", "nokey"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"hrandfield", "nokey", "3"}), ArrLen(0));
+
+  // Both the listpack and the hash table encodings.
+  for (unsigned num : {10u, 300u}) {
+    string key = absl::StrCat("key", num);
+    for (unsigned i = 0; i < num; ++i) {
+      Run({"hset", key, absl::StrCat("f", i), absl::StrCat(i)});
+    }
+
+    EXPECT_THAT(Run({"hrandfield", key}), ArgType(RespExpr::STRING));
+
+    auto resp = Run({"hrandfield", key, "5", "withvalues"});
+    ASSERT_THAT(resp, ArrLen(10));
+    vector<string> vec = StrArray(resp);
+    absl::flat_hash_map<string, string> pairs;
+    for (size_t i = 0; i < vec.size(); i += 2) {
+      EXPECT_EQ(absl::StrCat("f", vec[i + 1]), vec[i]);
+      pairs.emplace(vec[i], vec[i + 1]);
+    }
+    EXPECT_EQ(5u, pairs.size());
+
+    EXPECT_THAT(Run({"hrandfield", key, absl::StrCat(num + 5)}), ArrLen(num));
+    EXPECT_THAT(Run({"hrandfield", key, absl::StrCat(-int(num) - 5)}), ArrLen(num + 5));
+    EXPECT_THAT(Run({"hrandfield", key, "0"}), ArrLen(0));
+  }
+
+  EXPECT_THAT(Run({"hrandfield", "key10", "1", "foo"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"hrandfield", "key10", "a"}), ErrArg("not an integer"));
+}
+
+TEST_F(HSetFamilyTest, StrMap) {
+  // The long value converts the hash to the hash table encoding.
+  constexpr unsigned kNum = 200;
+  string long_val(100, 'v');
+  EXPECT_EQ(1, CheckedInt({"hset", "key", "long", long_val}));
+  for (unsigned i = 0; i < kNum; ++i) {
+    Run({"hset", "key", absl::StrCat("f", i), absl::StrCat(i)});
+  }
+  EXPECT_EQ(kNum + 1, CheckedInt({"hlen", "key"}));
+
+  EXPECT_EQ(Run({"hget", "key", "f7"}), "7");
+  EXPECT_EQ(100, CheckedInt({"hstrlen", "key", "long"}));
+  EXPECT_EQ(1, CheckedInt({"hexists", "key", "f9"}));
+  EXPECT_EQ(0, CheckedInt({"hsetnx", "key", "f9", "x"}));
+  EXPECT_EQ(0, CheckedInt({"hset", "key", "f9", "nine"}));
+  EXPECT_EQ(Run({"hget", "key", "f9"}), "nine");
+
+  auto resp = Run({"hmget", "key", "f1", "nokey", "long"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("1", ArgType(RespExpr::NIL), long_val));
+
+  EXPECT_EQ(15, CheckedInt({"hincrby", "key", "f10", "5"}));
+  EXPECT_EQ(Run({"hincrbyfloat", "key", "f11", "0.5"}), "11.5");
+  EXPECT_THAT(Run({"hincrby", "key", "long", "1"}), ErrArg("hash value is not an integer"));
+
+  EXPECT_EQ(2, CheckedInt({"hdel", "key", "f0", "f1", "nokey"}));
+  EXPECT_EQ(kNum - 1, CheckedInt({"hlen", "key"}));
+
+  resp = Run({"hgetall", "key"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_EQ(2 * (kNum - 1), resp.GetVec().size());
+
+  // HSCAN returns pairs and visits all the fields.
+  absl::flat_hash_map<string, string> scanned;
+  string cursor = "0";
+  do {
+    resp = Run({"hscan", "key", cursor});
+    ASSERT_THAT(resp, ArrLen(2));
+    cursor = string{ToSV(resp.GetVec()[0].GetBuf())};
+    vector<string> vec = StrArray(resp.GetVec()[1]);
+    ASSERT_EQ(0u, vec.size() % 2);
+    for (size_t i = 0; i < vec.size(); i += 2) {
+      scanned[vec[i]] = vec[i + 1];
+    }
+  } while (cursor != "0");
+  EXPECT_EQ(kNum - 1, scanned.size());
+  EXPECT_EQ("15", scanned["f10"]);
+  EXPECT_EQ(long_val, scanned["long"]);
+
+  // Removing all the fields removes the key.
+  Run({"hdel", "key", "long"});
+  for (unsigned i = 2; i < kNum; ++i) {
+    Run({"hdel", "key", absl::StrCat("f", i)});
+  }
+  EXPECT_EQ(0, CheckedInt({"exists", "key"}));
+}
+
+TEST_F(HSetFamilyTest, GetAllChunked) {
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 10);
+
+  vector<string> field_values;
+  for (unsigned i = 0; i < 500; ++i) {
+    field_values.push_back(absl::StrCat("field", i));
+    field_values.push_back(absl::StrCat("value", i));
+  }
+  vector<string_view> args{"hset", "h"};
+  args.insert(args.end(), field_values.begin(), field_values.end());
+  Run(absl::MakeSpan(args));
+
+  auto vec = Run({"hgetall", "h"}).GetVec();
+  ASSERT_EQ(1000u, vec.size());
+  absl::flat_hash_map<string, string> fields;
+  for (size_t i = 0; i < vec.size(); i += 2)
+    fields[vec[i].GetString()] = vec[i + 1].GetString();
+  EXPECT_EQ(500u, fields.size());
+  EXPECT_EQ("value42", fields["field42"]);
+
+  EXPECT_THAT(Run({"hkeys", "h"}), ArrLen(500));
+  EXPECT_THAT(Run({"hvals", "h"}), ArrLen(500));
+  EXPECT_THAT(Run({"hgetall", "nokey"}), ArrLen(0));
+
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 16384);
+}
+
+TEST_F(HSetFamilyTest, FieldExpiry) {
+  Run({"hset", "k", "f1", "v1", "f2", "v2", "f3", "v3"});
+  EXPECT_EQ("listpack", Run({"object", "encoding", "k"}));
+
+  auto resp = Run({"hexpire", "k", "100", "fields", "2", "f1", "nofield"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(-2)));
+  EXPECT_EQ("hashtable", Run({"object", "encoding", "k"}));
+  resp = Run({"httl", "k", "fields", "3", "f1", "f2", "nofield"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(100), IntArg(-1), IntArg(-2)));
+
+  resp = Run({"hexpire", "k", "50", "nx", "fields", "2", "f1", "f2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(1)));
+  resp = Run({"hexpire", "k", "200", "gt", "fields", "2", "f1", "f3"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0)));
+  resp = Run({"hexpire", "k", "10", "lt", "fields", "1", "f3"});
+  EXPECT_THAT(resp, IntArg(1));
+  resp = Run({"hpersist", "k", "fields", "2", "f3", "nofield"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(-2)));
+  EXPECT_THAT(Run({"hpersist", "k", "fields", "1", "f3"}), IntArg(-1));
+
+  // HINCRBY keeps the deadline, HSET drops it.
+  Run({"hset", "k", "n", "1"});
+  Run({"hexpire", "k", "100", "fields", "1", "n"});
+  EXPECT_EQ(2, CheckedInt({"hincrby", "k", "n", "1"}));
+  EXPECT_EQ(100, CheckedInt({"httl", "k", "fields", "1", "n"}));
+  Run({"hset", "k", "n", "5"});
+  EXPECT_EQ(-1, CheckedInt({"httl", "k", "fields", "1", "n"}));
+
+  // The fields expire lazily on access.
+  UpdateTime(expire_now_ + 51000);
+  EXPECT_THAT(Run({"hget", "k", "f2"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(3, CheckedInt({"hlen", "k"}));
+  EXPECT_THAT(Run({"hkeys", "k"}), UnorderedElementsAre("f1", "f3", "n"));
+
+  // Seconds of 0 delete the fields, the key goes with the last one.
+  resp = Run({"hexpire", "k", "0", "fields", "3", "f3", "n", "f3"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), IntArg(2), IntArg(-2)));
+  UpdateTime(expire_now_ + 201000);
+  EXPECT_EQ(0, CheckedInt({"hlen", "k"}));
+  EXPECT_EQ(0, CheckedInt({"exists", "k"}));
+
+  resp = Run({"hexpire", "nokey", "10", "fields", "2", "f1", "f2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-2), IntArg(-2)));
+  EXPECT_THAT(Run({"hexpire", "k", "10", "fields", "2", "f1"}), ErrArg("must match"));
+  EXPECT_THAT(Run({"hexpire", "k", "10", "fields", "0", "f1"}), ErrArg("greater than 0"));
+  EXPECT_THAT(Run({"hexpire", "k", "-1", "fields", "1", "f1"}), ErrArg("invalid expire time"));
+  EXPECT_THAT(Run({"httl", "k", "foo", "1", "f1"}), ErrArg("syntax error"));
+  Run({"set", "str", "v"});
+  EXPECT_THAT(Run({"httl", "str", "fields", "1", "f1"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(HSetFamilyTest, ActiveFieldExpiry) {
+  for (unsigned i = 0; i < 100; ++i) {
+    string key = absl::StrCat("k", i);
+    Run({"hset", key, "persistent", "1", "f", "2"});
+    Run({"hexpire", key, i < 50 ? "1" : "5", "fields", "1", "f"});
+  }
+  Run({"hset", "gone", "f", "1"});
+  Run({"hexpire", "gone", "1", "fields", "1", "f"});
+
+  atomic_uint deleted{0};
+  auto delete_expired = [&](uint64_t now) {
+    UpdateTime(now);
+    deleted = 0;
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      deleted += shard->db_slice().DeleteExpiredFields(0, 1000).deleted;
+    });
+    return deleted.load();
+  };
+
+  // The index buckets are due within ~1s after their deadlines.
+  EXPECT_EQ(51, delete_expired(expire_now_ + 3100));
+  EXPECT_EQ(100, CheckedInt({"dbsize"}));
+  EXPECT_EQ(-2, CheckedInt({"httl", "k0", "fields", "1", "f"}));
+  EXPECT_EQ(1, CheckedInt({"hlen", "k0"}));
+  EXPECT_EQ(2, CheckedInt({"hlen", "k99"}));
+
+  EXPECT_EQ(50, delete_expired(expire_now_ + 7100));
+  EXPECT_EQ(0, delete_expired(expire_now_ + 10000));
+  EXPECT_EQ(1, CheckedInt({"hlen", "k99"}));
 }
 
 }  // namespace dfly
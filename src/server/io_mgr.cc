@@ -5,7 +5,9 @@
 #include "server/io_mgr.h"
 
 #include <fcntl.h>
+#include <liburing.h>
 #include <mimalloc.h>
+#include <sys/stat.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
@@ -13,6 +15,9 @@
 #include "util/uring/proactor.h"
 
 ABSL_FLAG(bool, backing_file_direct, false, "If true uses O_DIRECT to open backing files");
+ABSL_FLAG(uint32_t, tiered_fixed_buffers, 64,
+          "The number of the 4KB buffers per shard that are registered with io_uring for the "
+          "writes and the reads of the backing file. 0 disables them");
 
 namespace dfly {
 
@@ -36,12 +41,19 @@ IoMgr::IoMgr() {
   flags_val = 0;
 }
 
+IoMgr::~IoMgr() {
+  mi_free(fixed_pool_);
+}
+
 constexpr size_t kInitialSize = 1UL << 28;  // 256MB
 
-error_code IoMgr::Open(const string& path) {
+error_code IoMgr::Open(const string& path, bool keep_data) {
   CHECK(!backing_file_);
 
-  int kFlags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
+  int kFlags = O_CREAT | O_RDWR | O_CLOEXEC;
+  if (!keep_data) {
+    kFlags |= O_TRUNC;
+  }
   if (absl::GetFlag(FLAGS_backing_file_direct)) {
     kFlags |= O_DIRECT;
   }
@@ -49,10 +61,16 @@ error_code IoMgr::Open(const string& path) {
   if (!res)
     return res.error();
   backing_file_ = move(res.value());
+
+  struct stat st;
+  if (fstat(backing_file_->fd(), &st) < 0)
+    return error_code{errno, system_category()};
+  size_t file_size = max<size_t>(st.st_size, kInitialSize);
+
   Proactor* proactor = (Proactor*)ProactorBase::me();
   {
     uring::FiberCall fc(proactor);
-    fc->PrepFallocate(backing_file_->fd(), 0, 0, kInitialSize);
+    fc->PrepFallocate(backing_file_->fd(), 0, 0, file_size);
     FiberCall::IoResult io_res = fc.Get();
     if (io_res < 0) {
       return error_code{-io_res, system_category()};
@@ -66,7 +84,93 @@ error_code IoMgr::Open(const string& path) {
       return error_code{-io_res, system_category()};
     }
   }
-  sz_ = kInitialSize;
+  sz_ = file_size;
+  RegisterWithRing(proactor);
+  return error_code{};
+}
+
+void IoMgr::RegisterWithRing(Proactor* proactor) {
+  io_uring* ring = proactor->ring();
+
+  // A ring has a single table of the registered files, which may belong to another user.
+  int fd = backing_file_->fd();
+  int res = io_uring_register_files(ring, &fd, 1);
+  if (res == 0) {
+    fixed_fd_ = 0;
+  } else {
+    LOG(WARNING) << "Could not register the backing file: " << util::detail::SafeErrorMessage(-res);
+  }
+
+  size_t count = absl::GetFlag(FLAGS_tiered_fixed_buffers);
+  if (count == 0)
+    return;
+
+  // The buffers are registered as a single region, so that all of them have the index 0.
+  fixed_pool_size_ = count * kFixedBufSize;
+  fixed_pool_ = (char*)mi_malloc_aligned(fixed_pool_size_, 4096);
+  iovec iov{.iov_base = fixed_pool_, .iov_len = fixed_pool_size_};
+  res = io_uring_register_buffers(ring, &iov, 1);
+  if (res < 0) {
+    // Usually RLIMIT_MEMLOCK, since the kernel pins the pages of the buffers.
+    LOG(WARNING) << "Could not register the io buffers: " << util::detail::SafeErrorMessage(-res);
+    mi_free(fixed_pool_);
+    fixed_pool_ = nullptr;
+    fixed_pool_size_ = 0;
+    return;
+  }
+
+  free_bufs_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    free_bufs_[i] = count - 1 - i;
+  }
+}
+
+char* IoMgr::AllocBuffer(size_t len) {
+  if (len <= kFixedBufSize && !free_bufs_.empty()) {
+    uint32_t index = free_bufs_.back();
+    free_bufs_.pop_back();
+    return fixed_pool_ + index * kFixedBufSize;
+  }
+  return (char*)mi_malloc_aligned(alignup(len, 4096), 4096);
+}
+
+void IoMgr::FreeBuffer(char* buf, size_t len) {
+  if (IsFixed(buf, len)) {
+    free_bufs_.push_back((buf - fixed_pool_) / kFixedBufSize);
+    return;
+  }
+  mi_free(buf);
+}
+
+void IoMgr::PrepIo(bool write, const void* buf, size_t len, size_t offset,
+                   uring::SubmitEntry* se) {
+  int fd = backing_file_->fd();
+  if (IsFixed(buf, len)) {
+    if (write) {
+      io_uring_prep_write_fixed(se->sqe(), fd, buf, len, offset, 0);
+    } else {
+      io_uring_prep_read_fixed(se->sqe(), fd, const_cast<void*>(buf), len, offset, 0);
+    }
+  } else if (write) {
+    se->PrepWrite(fd, buf, len, offset);
+  } else {
+    se->PrepRead(fd, const_cast<void*>(buf), len, offset);
+  }
+
+  if (fixed_fd_ >= 0) {
+    se->sqe()->fd = fixed_fd_;
+    se->sqe()->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+error_code IoMgr::Sync() {
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+  uring::FiberCall fc(proactor);
+  fc->PrepFSync(backing_file_->fd(), IORING_FSYNC_DATASYNC);
+  FiberCall::IoResult io_res = fc.Get();
+  if (io_res < 0) {
+    return error_code{-io_res, system_category()};
+  }
   return error_code{};
 }
 
@@ -104,11 +208,25 @@ error_code IoMgr::WriteAsync(size_t offset, string_view blob, WriteCb cb) {
   };
 
   uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
-  se.PrepWrite(backing_file_->fd(), blob.data(), blob.size(), offset);
+  PrepIo(true, blob.data(), blob.size(), offset, &se);
 
   return error_code{};
 }
 
+void IoMgr::ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb) {
+  DCHECK(!dest.empty());
+  VLOG(1) << "ReadAsync " << offset << "/" << dest.size();
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+
+  auto ring_cb = [cb = move(cb)](Proactor::IoResult res, uint32_t flags, int64_t payload) {
+    cb(res);
+  };
+
+  uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
+  PrepIo(false, dest.data(), dest.size(), offset, &se);
+}
+
 error_code IoMgr::Read(size_t offset, io::MutableBytes dest) {
   DCHECK(!dest.empty());
 
@@ -118,16 +236,12 @@ error_code IoMgr::Read(size_t offset, io::MutableBytes dest) {
     size_t space_needed = end_range - read_offs;
     DCHECK_EQ(0u, space_needed % 4096);
 
-    uint8_t* space = (uint8_t*)mi_malloc_aligned(space_needed, 4096);
+    char* space = AllocBuffer(space_needed);
     iovec v{.iov_base = space, .iov_len = space_needed};
     error_code ec = backing_file_->Read(&v, 1, read_offs, 0);
-    if (ec) {
-      mi_free(space);
-      return ec;
-    }
-
-    memcpy(dest.data(), space + offset - read_offs, dest.size());
-    mi_free_size_aligned(space, space_needed, 4096);
+    if (!ec)
+      memcpy(dest.data(), space + offset - read_offs, dest.size());
+    FreeBuffer(space, space_needed);
     return ec;
   }
 
@@ -139,6 +253,15 @@ void IoMgr::Shutdown() {
   while (flags_val) {
     this_fiber::sleep_for(200us);  // TODO: hacky for now.
   }
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+  if (fixed_fd_ >= 0) {
+    io_uring_unregister_files(proactor->ring());
+    fixed_fd_ = -1;
+  }
+  if (fixed_pool_) {
+    io_uring_unregister_buffers(proactor->ring());
+  }
 }
 
 }  // namespace dfly
@@ -6,6 +6,7 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 
 #include "util/uring/uring_file.h"
 
@@ -20,12 +21,23 @@ class IoMgr {
   // (io_res, )
   using GrowCb = std::function<void(int)>;
 
+  // The number of the bytes read or -errno.
+  using ReadCb = std::function<void(int)>;
+
+  // The size of the buffers that are registered with the ring, see AllocBuffer.
+  static constexpr size_t kFixedBufSize = 4096;
+
   IoMgr();
+  ~IoMgr();
 
   // blocks until all the pending requests are finished.
   void Shutdown();
 
-  std::error_code Open(const std::string& path);
+  // With keep_data the contents of an existing file are kept, see FLAGS_tiered_warm_restart.
+  std::error_code Open(const std::string& path, bool keep_data = false);
+
+  // Blocks until the writes so far are on the disk.
+  std::error_code Sync();
 
   // Grows file by that length. len must be divided by 1MB.
   // passing other values will check-fail.
@@ -36,6 +48,16 @@ class IoMgr {
   std::error_code WriteAsync(size_t offset, std::string_view blob, WriteCb cb);
   std::error_code Read(size_t offset, io::MutableBytes dest);
 
+  // Submits the read and returns right away, cb is called in this thread once it completes.
+  // With backing_file_direct, offset and dest must be aligned to 4KB.
+  void ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb);
+
+  // Returns a buffer of len bytes that is aligned to 4KB for the ios of this IoMgr. Up to
+  // kFixedBufSize bytes come from the buffers that are registered with the ring, whose ios skip
+  // the mapping of the pages in the kernel, unless all of them are in use.
+  char* AllocBuffer(size_t len);
+  void FreeBuffer(char* buf, size_t len);
+
   // Total file span
   size_t Span() const {
     return sz_;
@@ -46,9 +68,25 @@ class IoMgr {
   }
 
  private:
+  // Registers the backing file and the buffers of FLAGS_tiered_fixed_buffers with the ring of
+  // this thread. The ios fall back to the plain ops if the ring refuses them.
+  void RegisterWithRing(util::uring::Proactor* proactor);
+
+  bool IsFixed(const void* buf, size_t len) const {
+    return fixed_pool_ && buf >= fixed_pool_ &&
+           static_cast<const char*>(buf) + len <= fixed_pool_ + fixed_pool_size_;
+  }
+
+  void PrepIo(bool write, const void* buf, size_t len, size_t offset, util::uring::SubmitEntry* se);
+
   std::unique_ptr<util::uring::LinuxFile> backing_file_;
   size_t sz_ = 0;
 
+  int fixed_fd_ = -1;  // the index of the backing file in the registered files of the ring.
+  char* fixed_pool_ = nullptr;
+  size_t fixed_pool_size_ = 0;
+  std::vector<uint32_t> free_bufs_;  // the indices of the unused buffers of fixed_pool_.
+
   union {
     uint8_t flags_val;
     struct {
@@ -0,0 +1,506 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/strip.h>
+#include <fcntl.h>
+
+#include <filesystem>
+
+extern "C" {
+#include "redis/crc64.h"
+#include "redis/rdb.h"
+}
+
+#include "base/endian.h"
+#include "base/flags.h"
+#include "base/logging.h"
+#include "server/db_slice.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/rdb_extensions.h"
+#include "server/rdb_save.h"
+#include "server/server_state.h"
+
+ABSL_FLAG(bool, journal, false,
+          "If true, the shards journal the writes into the files in dir. The journals are "
+          "replayed on startup on top of the last snapshot, and start anew with every snapshot. "
+          "A write journals the whole value of every key it touches, hence small writes into "
+          "large lists, sets, hashes or sorted sets cost as much journal as the collections.");
+ABSL_FLAG(std::string, journal_fsync, "interval",
+          "When the journal is synced to the disk: 'always' - before the writes are acknowledged, "
+          "'interval' - every journal_fsync_interval_ms, 'os' - by the OS.");
+ABSL_FLAG(uint32_t, journal_fsync_interval_ms, 100,
+          "How often the journal is synced with journal_fsync=interval.");
+ABSL_FLAG(uint64_t, repl_backlog_size, 1ULL << 20,
+          "The bytes of the replication stream that each shard keeps once a replica has synced. "
+          "A replica that reconnects continues from its offset if all the shards still have it. "
+          "0 disables the partial resyncs.");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+namespace this_fiber = ::boost::this_fiber;
+namespace fs = std::filesystem;
+using absl::GetFlag;
+using boost::fibers::fiber;
+
+namespace {
+
+constexpr string_view kJournalPrefix = "journal-";
+constexpr string_view kJournalSuffix = ".dfj";
+
+// The opcode, the length and the crc64 of the body.
+constexpr size_t kBatchHeaderLen = 13;
+
+// The streamed batches are split between the entries once they reach that many bytes, so that
+// a replica of the Redis protocol gets them in several DFLY APPLY commands rather than in a bulk
+// string over the limit of its parser. A single entry can not be split.
+constexpr size_t kMaxStreamPiece = 1 << 20;
+
+Journal::FsyncMode ParseFsyncMode() {
+  string mode = GetFlag(FLAGS_journal_fsync);
+  if (mode == "always")
+    return Journal::FsyncMode::ALWAYS;
+  if (mode == "os")
+    return Journal::FsyncMode::OS;
+
+  LOG_IF(WARNING, mode != "interval") << "Unknown journal_fsync " << mode << ", using interval";
+  return Journal::FsyncMode::INTERVAL;
+}
+
+// The rdb epilog: EOF and the zero checksum that is not verified.
+void AppendEpilog(string* dest) {
+  dest->push_back(char(RDB_OPCODE_EOF));
+  dest->append(8, '\0');
+}
+
+}  // namespace
+
+Journal::Journal(DbSlice* slice) : db_slice_(slice), mode_(ParseFsyncMode()) {
+}
+
+Journal::~Journal() {
+  DCHECK(!writer_.joinable());
+}
+
+error_code Journal::OpenNext(const string& path) {
+  auto res = uring::OpenLinux(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+  if (!res)
+    return res.error();
+
+  auto segment = make_unique<Segment>();
+  segment->file = std::move(res.value());
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+
+  char magic[16];
+  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_VERSION);
+  CHECK_EQ(9u, sz);
+  CHECK(!serializer.WriteRaw(io::Bytes{reinterpret_cast<uint8_t*>(magic), sz}));
+
+  // The shard of the journal is needed to replay the flushes, see RdbLoader.
+  auto save_aux = [&serializer](string_view key, string_view val) {
+    CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+    CHECK(!serializer.SaveString(key));
+    CHECK(!serializer.SaveString(val));
+  };
+  save_aux("journal", "1");
+  save_aux("journal-shard", absl::StrCat(db_slice_->shard_id()));
+  save_aux("journal-shards", absl::StrCat(shard_set->size()));
+  CHECK(!serializer.FlushMem());
+
+  iovec v{sfile.val.data(), sfile.val.size()};
+  RETURN_ON_ERR(segment->file->Write(&v, 1, 0, RWF_DSYNC));
+  segment->offset = sfile.val.size();
+
+  if (next_)
+    next_->file->Close();
+  next_ = std::move(segment);
+
+  return error_code{};
+}
+
+void Journal::Rotate() {
+  CHECK(next_);
+
+  if (current_) {
+    if (has_touched_)
+      SerializeTouched();
+    AppendEpilog(&current_->pending);
+    retired_.push_back(std::move(current_));
+  }
+
+  current_ = std::move(next_);
+  current_->lsn_end = lsn_;
+
+  if (!writer_.joinable())
+    writer_ = fiber([this] { WriterFiber(); });
+  writer_ec_.notify();
+}
+
+void Journal::Close() {
+  if (current_) {
+    if (has_touched_)
+      SerializeTouched();
+    AppendEpilog(&current_->pending);
+    retired_.push_back(std::move(current_));
+  }
+
+  if (next_) {
+    next_->file->Close();
+    next_.reset();
+  }
+
+  closing_ = true;
+  writer_ec_.notify();
+  if (writer_.joinable())
+    writer_.join();
+
+  LOG_IF(ERROR, ec_) << "Journal of shard " << db_slice_->shard_id() << " failed with "
+                     << ec_.message();
+}
+
+uint64_t Journal::RegisterOnBatch(BatchCallback cb) {
+  uint64_t id = next_cb_id_++;
+  batch_cb_.emplace_back(id, std::move(cb));
+  return id;
+}
+
+void Journal::UnregisterOnBatch(uint64_t id) {
+  for (auto it = batch_cb_.begin(); it != batch_cb_.end(); ++it) {
+    if (it->first == id) {
+      batch_cb_.erase(it);
+      return;
+    }
+  }
+  LOG(DFATAL) << "Could not find " << id << " to unregister";
+}
+
+void Journal::Touch(DbIndex db_ind, string_view key) {
+  // The loaded entries are in the files that are being loaded already.
+  if (!IsActive() || ServerState::tlocal()->gstate() == GlobalState::LOADING)
+    return;
+
+  if (touched_.size() <= db_ind)
+    touched_.resize(db_ind + 1);
+  touched_[db_ind].emplace(key);
+  has_touched_ = true;
+}
+
+void Journal::RecordFlush(DbIndex db_ind) {
+  if (!IsActive() || ServerState::tlocal()->gstate() == GlobalState::LOADING)
+    return;
+
+  // The keys of the other dbs are committed before the flush.
+  for (DbIndex i = 0; i < touched_.size(); ++i) {
+    if (db_ind == DbSlice::kDbAll || db_ind == i)
+      touched_[i].clear();
+  }
+  if (has_touched_)
+    SerializeTouched();
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+  CHECK(!serializer.SaveString("journal-shard"));
+  CHECK(!serializer.SaveString(absl::StrCat(db_slice_->shard_id())));
+
+  for (DbIndex i = 0; i < db_slice_->db_array_size(); ++i) {
+    if (db_ind != DbSlice::kDbAll && db_ind != i)
+      continue;
+
+    CHECK(!serializer.SelectDb(i));
+    CHECK(!serializer.WriteOpcode(RDB_OPCODE_FLUSHED_DB));
+    if (current_)
+      current_->cur_db = i;
+  }
+  CHECK(!serializer.FlushMem());
+
+  AddBatch(sfile.val, kInvalidDbId);
+}
+
+void Journal::RecordBarrier(TxId txid, const vector<ShardId>& shards) {
+  if (!IsStreaming())
+    return;
+
+  // The barrier follows the keys of the transaction.
+  if (has_touched_)
+    SerializeTouched();
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_JOURNAL_BARRIER));
+  CHECK(!serializer.SaveLen(txid));
+  CHECK(!serializer.SaveLen(shards.size()));
+  for (ShardId sid : shards)
+    CHECK(!serializer.SaveLen(sid));
+  CHECK(!serializer.FlushMem());
+
+  StreamBatch(sfile.val);
+}
+
+void Journal::StreamBatch(string_view batch) {
+  for (const auto& k_v : batch_cb_)
+    k_v.second(batch);
+
+  size_t cap = backlog_.size();
+  if (cap) {
+    // Only the tail of a batch that is larger than the backlog fits.
+    string_view tail = batch.size() > cap ? batch.substr(batch.size() - cap) : batch;
+    uint64_t offset = stream_offset_ + batch.size() - tail.size();
+    size_t pos = offset % cap;
+    size_t first = min(tail.size(), cap - pos);
+    memcpy(backlog_.data() + pos, tail.data(), first);
+    memcpy(backlog_.data(), tail.data() + first, tail.size() - first);
+  }
+
+  stream_offset_ += batch.size();
+}
+
+void Journal::EnableBacklog() {
+  if (backlog_.empty())
+    backlog_.resize(GetFlag(FLAGS_repl_backlog_size));
+}
+
+bool Journal::BacklogHas(uint64_t offset) const {
+  if (offset > stream_offset_)
+    return false;
+
+  return offset == stream_offset_ || stream_offset_ - offset <= backlog_len();
+}
+
+void Journal::ReadBacklog(uint64_t offset, string* dest) const {
+  DCHECK(BacklogHas(offset));
+
+  size_t len = stream_offset_ - offset;
+  if (len == 0)
+    return;
+
+  size_t cap = backlog_.size();
+  size_t pos = offset % cap;
+  size_t first = min(len, cap - pos);
+  dest->append(backlog_.data() + pos, first);
+  dest->append(backlog_.data(), len - first);
+}
+
+uint64_t Journal::Commit() {
+  if (has_touched_)
+    SerializeTouched();
+
+  if (mode_ != FsyncMode::ALWAYS || !current_ || durable_lsn_.load(memory_order_relaxed) >= lsn_)
+    return 0;
+
+  return lsn_;
+}
+
+void Journal::WaitDurable(uint64_t lsn) {
+  durable_ec_.await([&] { return durable_lsn_.load(memory_order_acquire) >= lsn; });
+}
+
+// Runs atomically, i.e. it does not preempt, so the values are consistent with the
+// transactions that touched them.
+void Journal::SerializeTouched() {
+  has_touched_ = false;
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  DbIndex cur_db = current_ ? current_->cur_db : kInvalidDbId;
+  DbIndex implicit_db = kInvalidDbId;
+  bool has_entries = false;
+  bool streaming = IsStreaming();
+  vector<StreamSplit> splits;
+  size_t piece_start = 0;
+
+  for (DbIndex db_ind = 0; db_ind < touched_.size(); ++db_ind) {
+    auto& keys = touched_[db_ind];
+    if (keys.empty())
+      continue;
+
+    if (db_ind != cur_db) {
+      CHECK(!serializer.SelectDb(db_ind));
+      cur_db = db_ind;
+    } else if (!has_entries) {
+      implicit_db = db_ind;
+    }
+    has_entries = true;
+
+    // Not FindExt, it would expire the keys while we serialize them.
+    PrimeTable* prime = nullptr;
+    ExpireTable* expire = nullptr;
+    if (db_slice_->IsDbValid(db_ind))
+      tie(prime, expire) = db_slice_->GetTables(db_ind);
+
+    for (const string& key : keys) {
+      PrimeIterator it = prime ? prime->Find(key) : PrimeIterator{};
+      if (IsValid(it)) {
+        uint64_t expire_ms = 0;
+        if (it->second.HasExpire())
+          expire_ms = db_slice_->ExpireTime(expire->Find(it->first));
+        CHECK(serializer.SaveEntry(it->first, it->second, expire_ms));
+      } else {
+        CHECK(!serializer.WriteOpcode(RDB_OPCODE_DELETED_KEY));
+        CHECK(!serializer.SaveString(key));
+      }
+
+      if (streaming) {
+        CHECK(!serializer.FlushMem());
+        if (sfile.val.size() - piece_start >= kMaxStreamPiece) {
+          piece_start = sfile.val.size();
+          splits.push_back({piece_start, db_ind});
+        }
+      }
+    }
+    keys.clear();
+  }
+
+  CHECK(!serializer.FlushMem());
+  if (current_)
+    current_->cur_db = cur_db;
+
+  if (!sfile.val.empty())
+    AddBatch(sfile.val, implicit_db, splits);
+}
+
+void Journal::AddBatch(string_view body, DbIndex implicit_db,
+                       absl::Span<const StreamSplit> splits) {
+  if (IsStreaming()) {
+    // Every piece after the first one selects its db, since it may be applied on its own.
+    size_t start = 0;
+    DbIndex db = implicit_db;
+    for (size_t i = 0; i <= splits.size(); ++i) {
+      size_t end = i < splits.size() ? splits[i].offset : body.size();
+      string_view piece = body.substr(start, end - start);
+
+      if (db == kInvalidDbId) {
+        StreamBatch(piece);
+      } else if (!piece.empty()) {
+        io::StringFile sfile;
+        RdbSerializer serializer(&sfile);
+        CHECK(!serializer.SelectDb(db));
+        CHECK(!serializer.FlushMem());
+        sfile.val.append(piece);
+        StreamBatch(sfile.val);
+      }
+
+      if (i < splits.size()) {
+        start = end;
+        db = splits[i].db;
+      }
+    }
+  }
+
+  if (!current_)
+    return;
+
+  AppendBatchFrame(body, &current_->pending);
+  lsn_ += kBatchHeaderLen + body.size();
+  current_->lsn_end = lsn_;
+
+  // INTERVAL mode writes when it wakes up.
+  if (mode_ != FsyncMode::INTERVAL)
+    writer_ec_.notify();
+}
+
+void Journal::WriterFiber() {
+  uint32_t interval_ms = max(GetFlag(FLAGS_journal_fsync_interval_ms), 1u);
+
+  // The batches that are committed during a write are written together with the next one.
+  while (true) {
+    if (mode_ == FsyncMode::INTERVAL && !closing_) {
+      this_fiber::sleep_for(chrono::milliseconds(interval_ms));
+    } else {
+      writer_ec_.await([this] {
+        return closing_ || !retired_.empty() || (current_ && !current_->pending.empty());
+      });
+    }
+
+    // The keys that were changed outside of the transactions, i.e. by the active expiry.
+    if (current_ && has_touched_)
+      SerializeTouched();
+
+    while (!retired_.empty()) {
+      Segment* segment = retired_.front().get();
+      if (!segment->pending.empty())
+        WritePending(segment);
+      segment->file->Close();
+      retired_.pop_front();
+    }
+
+    if (current_ && !current_->pending.empty())
+      WritePending(current_.get());
+
+    // Close retires the current segment.
+    if (closing_ && retired_.empty())
+      break;
+  }
+}
+
+void Journal::WritePending(Segment* segment) {
+  string buf = std::move(segment->pending);
+  segment->pending.clear();
+  uint64_t lsn_end = segment->lsn_end;
+
+  iovec v{buf.data(), buf.size()};
+  unsigned flags = mode_ == FsyncMode::OS ? 0 : RWF_DSYNC;
+  error_code ec = segment->file->Write(&v, 1, segment->offset, flags);
+  segment->offset += buf.size();
+
+  // The waiters are released when the write fails as well, the error is logged.
+  if (ec && !ec_) {
+    LOG(ERROR) << "Could not write the journal: " << ec.message();
+    ec_ = ec;
+  }
+
+  durable_lsn_.store(lsn_end, memory_order_release);
+  durable_ec_.notifyAll();
+}
+
+void AppendBatchFrame(string_view body, string* dest) {
+  uint8_t header[kBatchHeaderLen];
+  header[0] = RDB_OPCODE_JOURNAL_BATCH;
+  absl::little_endian::Store32(header + 1, body.size());
+  absl::little_endian::Store64(header + 5,
+                               crc64(0, reinterpret_cast<const uint8_t*>(body.data()), body.size()));
+
+  dest->append(reinterpret_cast<char*>(header), kBatchHeaderLen).append(body);
+}
+
+string JournalFilePath(string_view dir, uint32_t gen, ShardId sid) {
+  fs::path path{dir};
+  path /= absl::StrCat(kJournalPrefix, absl::Dec(gen, absl::kZeroPad6), "-",
+                       absl::Dec(sid, absl::kZeroPad4), kJournalSuffix);
+  return path.generic_string();
+}
+
+map<uint32_t, vector<string>> ListJournalFiles(string_view dir) {
+  map<uint32_t, vector<string>> res;
+
+  error_code ec;
+  fs::path dir_path = dir.empty() ? fs::current_path() : fs::path{dir};
+  for (const auto& entry : fs::directory_iterator(dir_path, ec)) {
+    string name = entry.path().filename().generic_string();
+    string_view sv{name};
+    if (!absl::ConsumePrefix(&sv, kJournalPrefix) || !absl::ConsumeSuffix(&sv, kJournalSuffix))
+      continue;
+
+    uint32_t gen = 0;
+    size_t pos = sv.find('-');
+    if (pos == string_view::npos || !absl::SimpleAtoi(sv.substr(0, pos), &gen))
+      continue;
+
+    res[gen].push_back(entry.path().generic_string());
+  }
+
+  LOG_IF(WARNING, ec) << "Could not list " << dir_path << ": " << ec.message();
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,193 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_set.h>
+#include <absl/types/span.h>
+
+#include <atomic>
+#include <boost/fiber/fiber.hpp>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+#include "util/fibers/event_count.h"
+#include "util/uring/uring_file.h"
+
+namespace dfly {
+
+class DbSlice;
+
+// The write journal of a shard, see FLAGS_journal. Each shard appends to its own files, so the
+// journal does not synchronize the threads.
+//
+// The journal records the effects of the writes: the transactions touch keys via DbSlice, and
+// once the callback of a transaction finishes in the shard the current values of these keys are
+// serialized into a batch like in rdb, or their deletion if they are gone. A write into a large
+// collection therefore journals, and streams to the replicas, the collection in full. Batches
+// accumulate in memory and are written by a single fiber, so all the batches that were committed
+// while the previous write was in flight go to the disk with a single write (group commit).
+//
+// The files are rdb files that start with the "journal" aux field. Each batch is framed with its
+// length and crc64, so that a loader can drop the torn batch at the end of a file.
+//
+// Every shard has a journal, it records the writes only while it has a file or streams the
+// batches to the replicas, see ReplicaStream. Once a replica has synced, the streamed batches
+// are also kept in a bounded backlog, so that a replica that reconnects can continue from its
+// offset in the stream instead of syncing anew.
+class Journal {
+ public:
+  enum class FsyncMode : uint8_t {
+    ALWAYS,    // the writes are acknowledged once they are on the disk.
+    INTERVAL,  // the batches are written and synced every journal_fsync_interval_ms.
+    OS,        // the batches are written right away and synced by the OS.
+  };
+
+  // Called in the shard thread with every batch. Unlike in the files, each batch starts with
+  // the db it changes and a flush has the shard id, so that the batches of all the shards can be
+  // merged into a single stream. The batches of the callbacks also have the barriers of the
+  // transactions, see RecordBarrier.
+  using BatchCallback = std::function<void(std::string_view)>;
+
+  explicit Journal(DbSlice* slice);
+  ~Journal();
+
+  bool IsActive() const {
+    return current_ || IsStreaming();
+  }
+
+  // True if the batches go to the callbacks or the backlog.
+  bool IsStreaming() const {
+    return !batch_cb_.empty() || !backlog_.empty();
+  }
+
+  // Returns the id to pass to UnregisterOnBatch.
+  uint64_t RegisterOnBatch(BatchCallback cb);
+  void UnregisterOnBatch(uint64_t id);
+
+  // Keeps the last repl_backlog_size bytes of the streamed batches from now on. Does nothing if
+  // the backlog is already enabled or disabled by the flag.
+  void EnableBacklog();
+
+  // The number of the bytes streamed so far, i.e. the offset of the next batch.
+  uint64_t stream_offset() const {
+    return stream_offset_;
+  }
+
+  size_t backlog_capacity() const {
+    return backlog_.size();
+  }
+
+  // The number of the bytes in the backlog.
+  size_t backlog_len() const {
+    return std::min<uint64_t>(stream_offset_, backlog_.size());
+  }
+
+  // True if the backlog has the batches from offset on.
+  bool BacklogHas(uint64_t offset) const;
+
+  // Appends the batches from offset on to dest, see BacklogHas.
+  void ReadBacklog(uint64_t offset, std::string* dest) const;
+
+  // Creates the next file of the journal and writes its header. Blocks the calling fiber.
+  // The file is used after Rotate.
+  std::error_code OpenNext(const std::string& path);
+
+  // Switches to the file opened by OpenNext. Does not block: the batches that are pending for
+  // the previous file are written in the background, then the file is closed.
+  void Rotate();
+
+  // Commits the touched keys and closes the files. Blocks the calling fiber.
+  void Close();
+
+  void Touch(DbIndex db_ind, std::string_view key);
+
+  // Called when the db is flushed.
+  void RecordFlush(DbIndex db_ind);
+
+  // Called after the last write of the transaction txid in the shard, if the transaction spans
+  // the shards. Only the replicas need the barriers, so they are not written into the files.
+  void RecordBarrier(TxId txid, const std::vector<ShardId>& shards);
+
+  // Serializes the keys touched since the previous commit into a batch. Returns the position
+  // the transaction must pass to WaitDurable before it replies, 0 if it does not have to wait.
+  uint64_t Commit();
+
+  // Can be called from any thread. Blocks until the batches up to lsn are on the disk.
+  void WaitDurable(uint64_t lsn);
+
+  FsyncMode fsync_mode() const {
+    return mode_;
+  }
+
+ private:
+  struct Segment {
+    std::unique_ptr<util::uring::LinuxFile> file;
+    off_t offset = 0;
+    std::string pending;  // batches that were not written yet.
+    uint64_t lsn_end = 0;  // the position at the end of pending.
+    DbIndex cur_db = kInvalidDbId;
+  };
+
+  // A position at which the streamed body of a batch is split, see SerializeTouched.
+  struct StreamSplit {
+    size_t offset;  // in the body.
+    DbIndex db;     // of the entries that follow.
+  };
+
+  // implicit_db is the db that the body changes without selecting it, kInvalidDbId if the body
+  // starts with its db. The body is written as a single batch, but it is streamed in pieces
+  // that start at the splits.
+  void AddBatch(std::string_view body, DbIndex implicit_db,
+                absl::Span<const StreamSplit> splits = {});
+
+  // Passes the batch to the callbacks and the backlog.
+  void StreamBatch(std::string_view batch);
+  void SerializeTouched();
+  void WriterFiber();
+
+  // Writes the pending batches of the segment.
+  void WritePending(Segment* segment);
+
+  DbSlice* db_slice_;
+  FsyncMode mode_;
+
+  std::vector<absl::flat_hash_set<std::string>> touched_;  // by db index.
+  bool has_touched_ = false;
+
+  std::vector<std::pair<uint64_t, BatchCallback>> batch_cb_;
+  uint64_t next_cb_id_ = 1;
+
+  uint64_t stream_offset_ = 0;
+  std::string backlog_;  // a ring buffer, the byte at offset i is at i % size.
+
+  std::unique_ptr<Segment> current_, next_;
+  std::deque<std::unique_ptr<Segment>> retired_;  // written and closed by the writer fiber.
+
+  uint64_t lsn_ = 0;  // the number of the bytes committed into the batches.
+  std::atomic_uint64_t durable_lsn_{0};
+  util::fibers_ext::EventCount durable_ec_;
+
+  util::fibers_ext::EventCount writer_ec_;
+  ::boost::fibers::fiber writer_;
+  bool closing_ = false;
+
+  std::error_code ec_;  // the first write error.
+};
+
+// Appends the body with its length and crc, see RDB_OPCODE_JOURNAL_BATCH.
+void AppendBatchFrame(std::string_view body, std::string* dest);
+
+// Journal files of the generation gen in dir, one per shard. A new generation starts with
+// every snapshot, see ServerFamily::DoSave.
+std::string JournalFilePath(std::string_view dir, uint32_t gen, ShardId sid);
+
+// Returns the journal files in dir by generation.
+std::map<uint32_t, std::vector<std::string>> ListJournalFiles(std::string_view dir);
+
+}  // namespace dfly
@@ -0,0 +1,489 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/json_family.h"
+
+#include <absl/strings/ascii.h>
+
+#include <cmath>
+#include <optional>
+
+#include "base/logging.h"
+#include "core/json.h"
+#include "facade/error.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace facade;
+using namespace std;
+
+namespace {
+
+using CI = CommandId;
+using Node = JsonDoc::Node;
+
+constexpr char kInvalidPathErr[] = "invalid path";
+constexpr char kInvalidJsonErr[] = "invalid json";
+constexpr char kPathNotExistErr[] = "path does not exist";
+constexpr char kWrongPathTypeErr[] = "wrong type of path value";
+constexpr char kNotNumberErr[] = "result is not a number or is out of range";
+
+// The errors of the commands besides the common ones:
+// KEY_NOTFOUND - the key is missing where the command needs a document,
+// SKIPPED - a legacy path does not exist,
+// INVALID_VALUE - a legacy path matches a value of the wrong type,
+// SYNTAX_ERR - a value is not a json document,
+// INVALID_FLOAT - an increment produced a value that is not a finite double.
+void SendJsonError(OpStatus status, ConnectionContext* cntx) {
+  switch (status) {
+    case OpStatus::KEY_NOTFOUND:
+      return (*cntx)->SendError(kKeyNotFoundErr);
+    case OpStatus::SKIPPED:
+      return (*cntx)->SendError(kPathNotExistErr);
+    case OpStatus::INVALID_VALUE:
+      return (*cntx)->SendError(kWrongPathTypeErr);
+    case OpStatus::SYNTAX_ERR:
+      return (*cntx)->SendError(kInvalidJsonErr);
+    case OpStatus::INVALID_FLOAT:
+      return (*cntx)->SendError(kNotNumberErr);
+    default:
+      return (*cntx)->SendError(status);
+  }
+}
+
+enum class SetCondition { NONE, NX, XX };
+
+JsonDoc* NewDoc() {
+  pmr::memory_resource* mr = CompactObj::memory_resource();
+  return new (mr->allocate(sizeof(JsonDoc), alignof(JsonDoc))) JsonDoc(mr);
+}
+
+void DeleteDoc(JsonDoc* doc) {
+  doc->~JsonDoc();
+  CompactObj::memory_resource()->deallocate(doc, sizeof(JsonDoc), alignof(JsonDoc));
+}
+
+// A legacy path addresses the first of its matches only.
+vector<JsonPath::Match> EvaluatePath(const JsonPath& path, Node* root) {
+  vector<JsonPath::Match> matches = path.Evaluate(root);
+  if (path.legacy() && matches.size() > 1)
+    matches.resize(1);
+  return matches;
+}
+
+// Appends the matches of path to dest: the first one for a legacy path, an array of all of them
+// otherwise. Returns false if a legacy path does not exist.
+bool AppendMatches(const JsonPath& path, bool legacy, Node* root, string* dest) {
+  vector<JsonPath::Match> matches = path.Evaluate(root);
+
+  if (legacy) {
+    if (matches.empty())
+      return false;
+    JsonDoc::Serialize(*matches.front().node, dest);
+    return true;
+  }
+
+  dest->push_back('[');
+  for (size_t i = 0; i < matches.size(); ++i) {
+    if (i)
+      dest->push_back(',');
+    JsonDoc::Serialize(*matches[i].node, dest);
+  }
+  dest->push_back(']');
+  return true;
+}
+
+// Replies with the text of the values at paths. A single path replies with its values, several
+// paths with an object of the values by path. The values are in the legacy format, i.e. a single
+// value per path, only if all the paths are legacy ones.
+OpResult<string> OpGet(const OpArgs& op_args, string_view key, ArgSlice path_args,
+                       const vector<JsonPath>& paths) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_JSON);
+  if (!it_res)
+    return it_res.status();
+
+  Node* root = it_res.value()->second.GetJson()->root();
+  bool legacy = all_of(paths.begin(), paths.end(), [](const auto& path) { return path.legacy(); });
+
+  string res;
+  if (paths.size() == 1) {
+    if (!AppendMatches(paths.front(), legacy, root, &res))
+      return OpStatus::SKIPPED;
+    return res;
+  }
+
+  res.push_back('{');
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (i)
+      res.push_back(',');
+    JsonDoc::SerializeString(path_args[i], &res);
+    res.push_back(':');
+    if (!AppendMatches(paths[i], legacy, root, &res))
+      return OpStatus::SKIPPED;
+  }
+  res.push_back('}');
+  return res;
+}
+
+// Sets the values at path to text, creating the last member of the path in the objects that miss
+// it. A missing key is created only at the root. Returns false if cond prevented the write.
+OpResult<bool> OpSet(const OpArgs& op_args, string_view key, const JsonPath& path,
+                     string_view text, SetCondition cond) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, expire_it] = db_slice.FindExt(op_args.db_ind, key);
+
+  if (!IsValid(it)) {
+    if (!path.IsRoot())
+      return OpStatus::KEY_NOTFOUND;
+    if (cond == SetCondition::XX)
+      return false;
+
+    JsonDoc* doc = NewDoc();
+    if (!doc->Parse(text, doc->root())) {
+      DeleteDoc(doc);
+      return OpStatus::SYNTAX_ERR;
+    }
+
+    PrimeValue pv;
+    pv.SetJson(doc);
+    db_slice.AddNew(op_args.db_ind, key, std::move(pv), 0);
+    return true;
+  }
+
+  if (it->second.ObjType() != OBJ_JSON)
+    return OpStatus::WRONG_TYPE;
+
+  JsonDoc* doc = it->second.GetJson();
+  db_slice.PreUpdate(op_args.db_ind, it);
+
+  Node value;
+  if (!doc->Parse(text, &value)) {
+    db_slice.PostUpdate(op_args.db_ind, it);
+    return OpStatus::SYNTAX_ERR;
+  }
+
+  // The values to set, which are either the matches of the path or the members of the matches of
+  // its parent. Both are visited from the deepest ones, as adding a member moves the other members
+  // of its parent.
+  struct Target {
+    Node* node;    // the match, nullptr for a member of parent.
+    Node* parent;  // an object.
+  };
+  vector<Target> targets;
+  bool exists = false;
+
+  JsonPath parent_path;
+  string name;
+  if (path.SplitLastMember(&parent_path, &name)) {
+    vector<JsonPath::Match> parents = EvaluatePath(parent_path, doc->root());
+    for (size_t index : JsonPath::SortByDepth(parents)) {
+      Node* parent = parents[index].node;
+      if (parent->type != JsonDoc::OBJECT)
+        continue;
+      bool found = JsonDoc::FindMember(*parent, name) != nullptr;
+      exists |= found;
+      if (found || cond != SetCondition::XX)
+        targets.push_back(Target{nullptr, parent});
+    }
+  } else {
+    vector<JsonPath::Match> matches = EvaluatePath(path, doc->root());
+    for (size_t index : JsonPath::SortByDepth(matches)) {
+      targets.push_back(Target{matches[index].node, nullptr});
+    }
+    exists = !targets.empty();
+  }
+
+  if (targets.empty() || (cond == SetCondition::NX && exists)) {
+    doc->Reset(&value);
+    db_slice.PostUpdate(op_args.db_ind, it);
+    return false;
+  }
+
+  // The first target takes the parsed value, the others parse their own copies.
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Node* dest = targets[i].node;
+    if (!dest)
+      dest = JsonDoc::FindMember(*targets[i].parent, name);
+
+    if (dest)
+      doc->Reset(dest);
+    else
+      dest = doc->AddMember(targets[i].parent, name);
+
+    if (i == 0) {
+      *dest = value;
+    } else {
+      bool parsed = doc->Parse(text, dest);
+      DCHECK(parsed);
+    }
+  }
+  db_slice.PostUpdate(op_args.db_ind, it);
+  return true;
+}
+
+// Adds incr to the numbers at path. Replies with the text of the new value for a legacy path and
+// with an array of the new values, null for the values that are not numbers, otherwise.
+OpResult<string> OpNumIncrBy(const OpArgs& op_args, string_view key, const JsonPath& path,
+                             const Node& incr) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_JSON);
+  if (!it_res)
+    return it_res.status();
+
+  PrimeIterator it = *it_res;
+  vector<JsonPath::Match> matches = EvaluatePath(path, it->second.GetJson()->root());
+  if (path.legacy()) {
+    if (matches.empty())
+      return OpStatus::SKIPPED;
+    if (!matches.front().node->IsNumber())
+      return OpStatus::INVALID_VALUE;
+  }
+
+  // The new values are computed before any of them is written, so that a value that overflows
+  // fails the command as a whole.
+  vector<Node> results(matches.size());
+  for (size_t i = 0; i < matches.size(); ++i) {
+    const Node& cur = *matches[i].node;
+    if (!cur.IsNumber())
+      continue;
+
+    Node& res = results[i];
+    if (cur.type == JsonDoc::INT && incr.type == JsonDoc::INT &&
+        !__builtin_add_overflow(cur.ival, incr.ival, &res.ival)) {
+      res.type = JsonDoc::INT;
+      continue;
+    }
+
+    double a = cur.type == JsonDoc::INT ? cur.ival : cur.dval;
+    double b = incr.type == JsonDoc::INT ? incr.ival : incr.dval;
+    res.type = JsonDoc::DOUBLE;
+    res.dval = a + b;
+    if (!isfinite(res.dval))
+      return OpStatus::INVALID_FLOAT;
+  }
+
+  db_slice.PreUpdate(op_args.db_ind, it);
+  for (size_t i = 0; i < matches.size(); ++i) {
+    if (results[i].IsNumber())
+      *matches[i].node = results[i];
+  }
+  db_slice.PostUpdate(op_args.db_ind, it);
+
+  string res;
+  if (path.legacy()) {
+    JsonDoc::Serialize(results.front(), &res);
+    return res;
+  }
+
+  res.push_back('[');
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (i)
+      res.push_back(',');
+    JsonDoc::Serialize(results[i], &res);
+  }
+  res.push_back(']');
+  return res;
+}
+
+// Appends values to the arrays at path. Returns the new lengths of the arrays, nullopt for the
+// values that are not arrays.
+OpResult<vector<optional<long>>> OpArrAppend(const OpArgs& op_args, string_view key,
+                                             const JsonPath& path, ArgSlice values) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_JSON);
+  if (!it_res)
+    return it_res.status();
+
+  PrimeIterator it = *it_res;
+  JsonDoc* doc = it->second.GetJson();
+  vector<JsonPath::Match> matches = EvaluatePath(path, doc->root());
+  if (path.legacy()) {
+    if (matches.empty())
+      return OpStatus::SKIPPED;
+    if (matches.front().node->type != JsonDoc::ARRAY)
+      return OpStatus::INVALID_VALUE;
+  }
+
+  db_slice.PreUpdate(op_args.db_ind, it);
+
+  // The values are parsed before any of them is appended, so that an invalid value fails the
+  // command as a whole. The first array takes them, the others parse their own copies.
+  vector<Node> parsed(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (!doc->Parse(values[i], &parsed[i])) {
+      for (size_t j = 0; j < i; ++j)
+        doc->Reset(&parsed[j]);
+      db_slice.PostUpdate(op_args.db_ind, it);
+      return OpStatus::SYNTAX_ERR;
+    }
+  }
+
+  vector<optional<long>> res(matches.size());
+  bool moved = false;
+  for (size_t index : JsonPath::SortByDepth(matches)) {
+    Node* arr = matches[index].node;
+    if (arr->type != JsonDoc::ARRAY)
+      continue;
+
+    for (size_t i = 0; i < values.size(); ++i) {
+      Node* item = doc->AddItem(arr);
+      if (!moved) {
+        *item = parsed[i];
+      } else {
+        bool valid = doc->Parse(values[i], item);
+        DCHECK(valid);
+      }
+    }
+    moved = true;
+    res[index] = arr->len;
+  }
+
+  if (!moved) {
+    for (Node& node : parsed)
+      doc->Reset(&node);
+  }
+  db_slice.PostUpdate(op_args.db_ind, it);
+  return res;
+}
+
+}  // namespace
+
+// JSON.GET key [path ...]
+void JsonFamily::Get(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  vector<string_view> path_args;
+  for (size_t i = 2; i < args.size(); ++i)
+    path_args.push_back(ArgS(args, i));
+  if (path_args.empty())
+    path_args.push_back(".");
+
+  vector<JsonPath> paths(path_args.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!paths[i].Parse(path_args[i]))
+      return (*cntx)->SendError(kInvalidPathErr);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGet(OpArgs{shard, t->db_index()}, key, path_args, paths);
+  };
+
+  OpResult<string> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result)
+    return (*cntx)->SendBulkString(*result);
+  if (result.status() == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->SendNull();
+  SendJsonError(result.status(), cntx);
+}
+
+// JSON.SET key path value [NX | XX]
+void JsonFamily::Set(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view value = ArgS(args, 3);
+
+  JsonPath path;
+  if (!path.Parse(ArgS(args, 2)))
+    return (*cntx)->SendError(kInvalidPathErr);
+
+  SetCondition cond = SetCondition::NONE;
+  if (args.size() > 5)
+    return (*cntx)->SendError(kSyntaxErr);
+  if (args.size() == 5) {
+    ToUpper(&args[4]);
+    string_view opt = ArgS(args, 4);
+    if (opt == "NX")
+      cond = SetCondition::NX;
+    else if (opt == "XX")
+      cond = SetCondition::XX;
+    else
+      return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpSet(OpArgs{shard, t->db_index()}, key, path, value, cond);
+  };
+
+  OpResult<bool> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->SendError("new objects must be created at the root");
+  if (!result)
+    return SendJsonError(result.status(), cntx);
+  if (*result)
+    return (*cntx)->SendOk();
+  (*cntx)->SendNull();
+}
+
+// JSON.NUMINCRBY key path value
+void JsonFamily::NumIncrBy(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  JsonPath path;
+  if (!path.Parse(ArgS(args, 2)))
+    return (*cntx)->SendError(kInvalidPathErr);
+
+  // A number does not allocate, hence it is parsed with any memory resource.
+  JsonDoc incr_doc(pmr::get_default_resource());
+  Node* incr = incr_doc.root();
+  if (!incr_doc.Parse(ArgS(args, 3), incr) || !incr->IsNumber())
+    return (*cntx)->SendError(kInvalidFloatErr);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpNumIncrBy(OpArgs{shard, t->db_index()}, key, path, *incr);
+  };
+
+  // Resets the increment before the document is destroyed, which checks that nothing leaked.
+  OpResult<string> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  incr_doc.Reset(incr);
+
+  if (!result)
+    return SendJsonError(result.status(), cntx);
+  (*cntx)->SendBulkString(*result);
+}
+
+// JSON.ARRAPPEND key path value [value ...]
+void JsonFamily::ArrAppend(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  JsonPath path;
+  if (!path.Parse(ArgS(args, 2)))
+    return (*cntx)->SendError(kInvalidPathErr);
+
+  vector<string_view> values;
+  for (size_t i = 3; i < args.size(); ++i)
+    values.push_back(ArgS(args, i));
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpArrAppend(OpArgs{shard, t->db_index()}, key, path, values);
+  };
+
+  OpResult<vector<optional<long>>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return SendJsonError(result.status(), cntx);
+
+  if (path.legacy())
+    return (*cntx)->SendLong(*result->front());
+
+  (*cntx)->StartArray(result->size());
+  for (const optional<long>& len : *result) {
+    if (len)
+      (*cntx)->SendLong(*len);
+    else
+      (*cntx)->SendNull();
+  }
+}
+
+#define HFUNC(x) SetHandler(&JsonFamily::x)
+
+void JsonFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"JSON.GET", CO::READONLY | CO::FAST, -2, 1, 1, 1}.HFUNC(Get)
+            << CI{"JSON.SET", CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(Set)
+            << CI{"JSON.NUMINCRBY", CO::WRITE | CO::FAST, 4, 1, 1, 1}.HFUNC(NumIncrBy)
+            << CI{"JSON.ARRAPPEND", CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(ArrAppend);
+}
+
+}  // namespace dfly
@@ -0,0 +1,27 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "server/common.h"
+
+namespace dfly {
+
+class CommandRegistry;
+class ConnectionContext;
+
+// The document commands of RedisJSON, backed by the parsed documents of core/json.h, which are
+// read and updated at their paths without reserializing the rest of the document.
+class JsonFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+
+ private:
+  static void Get(CmdArgList args, ConnectionContext* cntx);
+  static void Set(CmdArgList args, ConnectionContext* cntx);
+  static void NumIncrBy(CmdArgList args, ConnectionContext* cntx);
+  static void ArrAppend(CmdArgList args, ConnectionContext* cntx);
+};
+
+}  // namespace dfly
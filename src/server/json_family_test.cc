@@ -0,0 +1,112 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/json_family.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using namespace facade;
+
+namespace dfly {
+
+class JsonFamilyTest : public BaseFamilyTest {};
+
+TEST_F(JsonFamilyTest, SetGet) {
+  EXPECT_EQ(Run({"json.get", "doc"}).type, RespExpr::NIL);
+  EXPECT_EQ(Run({"json.set", "doc", "$", R"({"a": 1, "b": {"c": [1, 2]}, "d": "x"})"}), "OK");
+  EXPECT_EQ(Run({"type", "doc"}), "ReJSON-RL");
+
+  EXPECT_EQ(Run({"json.get", "doc"}), R"({"a":1,"b":{"c":[1,2]},"d":"x"})");
+  EXPECT_EQ(Run({"json.get", "doc", "$.b.c[*]"}), "[1,2]");
+  EXPECT_EQ(Run({"json.get", "doc", "$..c"}), "[[1,2]]");
+  EXPECT_EQ(Run({"json.get", "doc", "$.nope"}), "[]");
+  EXPECT_EQ(Run({"json.get", "doc", ".b.c[-1]"}), "2");
+  EXPECT_THAT(Run({"json.get", "doc", ".nope"}), ErrArg("path does not exist"));
+  EXPECT_EQ(Run({"json.get", "doc", "$.a", "$.d"}), R"({"$.a":[1],"$.d":["x"]})");
+  EXPECT_EQ(Run({"json.get", "doc", ".a", "d"}), R"({".a":1,"d":"x"})");
+
+  // The last member of the path is created in the objects that miss it.
+  EXPECT_EQ(Run({"json.set", "doc", "$.b.e", "true"}), "OK");
+  EXPECT_EQ(Run({"json.set", "doc", "$.a", "{\"f\": null}"}), "OK");
+  EXPECT_EQ(Run({"json.get", "doc"}), R"({"a":{"f":null},"b":{"c":[1,2],"e":true},"d":"x"})");
+  EXPECT_EQ(Run({"json.set", "doc", "$.x.y", "1"}).type, RespExpr::NIL);
+
+  EXPECT_EQ(Run({"json.set", "doc", "$.b.e", "1", "NX"}).type, RespExpr::NIL);
+  EXPECT_EQ(Run({"json.set", "doc", "$.b.g", "1", "XX"}).type, RespExpr::NIL);
+  EXPECT_EQ(Run({"json.set", "doc", "$.b.e", "false", "XX"}), "OK");
+  EXPECT_EQ(Run({"json.get", "doc", "$.b.e"}), "[false]");
+
+  EXPECT_EQ(Run({"json.set", "doc", "$", "[1,2]"}), "OK");
+  EXPECT_EQ(Run({"json.get", "doc"}), "[1,2]");
+
+  EXPECT_THAT(Run({"json.set", "doc", "$", "{\"a\":}"}), ErrArg("invalid json"));
+  EXPECT_THAT(Run({"json.set", "doc", "$[", "1"}), ErrArg("invalid path"));
+  EXPECT_THAT(Run({"json.set", "doc", "$", "1", "YY"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"json.set", "new", "$.a", "1"}), ErrArg("at the root"));
+  EXPECT_EQ(Run({"json.set", "new", "$", "1", "XX"}).type, RespExpr::NIL);
+  EXPECT_THAT(Run({"exists", "new"}), IntArg(0));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"json.get", "str"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"json.set", "str", "$", "1"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(JsonFamilyTest, SetMany) {
+  Run({"json.set", "doc", "$", R"({"a":{"a":{"a":1}},"b":[{"a":2},{"b":3}]})"});
+
+  // The nested matches are replaced before their ancestors.
+  EXPECT_EQ(Run({"json.set", "doc", "$..a", "[0]"}), "OK");
+  EXPECT_EQ(Run({"json.get", "doc"}), R"({"a":[0],"b":[{"a":[0]},{"b":3}]})");
+
+  EXPECT_EQ(Run({"json.set", "doc", "$.b[*].c", "\"new\""}), "OK");
+  EXPECT_EQ(Run({"json.get", "doc", "$.b"}), R"([[{"a":[0],"c":"new"},{"b":3,"c":"new"}]])");
+}
+
+TEST_F(JsonFamilyTest, NumIncrBy) {
+  Run({"json.set", "doc", "$", R"({"a":1,"b":{"a":2.5},"c":"x"})"});
+
+  EXPECT_EQ(Run({"json.numincrby", "doc", "$..a", "2"}), "[3,4.5]");
+  EXPECT_EQ(Run({"json.numincrby", "doc", "$.*", "1"}), "[4,null,null]");
+  EXPECT_EQ(Run({"json.numincrby", "doc", ".a", "0.5"}), "4.5");
+  EXPECT_EQ(Run({"json.numincrby", "doc", "$.b.a", "-4.5"}), "[0.0]");
+  EXPECT_EQ(Run({"json.get", "doc"}), R"({"a":4.5,"b":{"a":0.0},"c":"x"})");
+
+  Run({"json.set", "doc", "$.a", "9223372036854775807"});
+  EXPECT_EQ(Run({"json.numincrby", "doc", "$.a", "1"}), "[9223372036854776000.0]");
+  Run({"json.set", "doc", "$.a", "1.7e308"});
+  EXPECT_THAT(Run({"json.numincrby", "doc", "$.a", "1e308"}), ErrArg("out of range"));
+  EXPECT_EQ(Run({"json.get", "doc", ".a"}), "1.7e+308");
+
+  EXPECT_THAT(Run({"json.numincrby", "doc", ".c", "1"}), ErrArg("wrong type"));
+  EXPECT_THAT(Run({"json.numincrby", "doc", ".x", "1"}), ErrArg("does not exist"));
+  EXPECT_THAT(Run({"json.numincrby", "doc", "$.a", "x"}), ErrArg("not a valid float"));
+  EXPECT_THAT(Run({"json.numincrby", "nokey", "$.a", "1"}), ErrArg("no such key"));
+}
+
+TEST_F(JsonFamilyTest, ArrAppend) {
+  Run({"json.set", "doc", "$", R"({"a":[1],"b":{"a":[]},"c":{"a":2}})"});
+
+  auto resp = Run({"json.arrappend", "doc", "$..a", "2", R"({"x":[3]})"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(3), IntArg(2), ArgType(RespExpr::NIL)));
+  EXPECT_EQ(Run({"json.get", "doc", "$..a"}), R"([[1,2,{"x":[3]}],[2,{"x":[3]}],2])");
+  EXPECT_THAT(Run({"json.arrappend", "doc", ".a", "null"}), IntArg(4));
+
+  // An array is appended to together with an array that it contains.
+  Run({"json.set", "arr", "$", R"({"a":[[1]]})"});
+  resp = Run({"json.arrappend", "arr", "$..*", "4"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), IntArg(2), ArgType(RespExpr::NIL)));
+  EXPECT_EQ(Run({"json.get", "arr"}), R"({"a":[[1,4],4]})");
+
+  EXPECT_THAT(Run({"json.arrappend", "doc", ".c", "1"}), ErrArg("wrong type"));
+  EXPECT_THAT(Run({"json.arrappend", "doc", "$.a", "1", "[}"}), ErrArg("invalid json"));
+  EXPECT_EQ(Run({"json.get", "doc", ".a"}), R"([1,2,{"x":[3]},null])");
+}
+
+}  // namespace dfly
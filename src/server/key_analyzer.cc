@@ -0,0 +1,220 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/key_analyzer.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "server/db_slice.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// Small datasets are traversed within a single step, hence we bound the rate of the passes.
+constexpr uint64_t kPassIntervalNs = 1'000'000'000;
+
+bool BiggerKey(const KeyAnalyzer::BigKey& l, const KeyAnalyzer::BigKey& r) {
+  return l.bytes > r.bytes;
+}
+
+}  // namespace
+
+KeyAnalyzer::Report& KeyAnalyzer::Report::operator+=(const Report& o) {
+  for (const auto& [prefix, entry] : o.prefixes)
+    prefixes[prefix] += entry;
+  for (const auto& [type, entry] : o.types)
+    types[type] += entry;
+  passes += o.passes;
+
+  // Keys are not shared between the shards, hence the candidates of the shards are distinct.
+  hot_keys.insert(hot_keys.end(), o.hot_keys.begin(), o.hot_keys.end());
+  sort(hot_keys.begin(), hot_keys.end(),
+       [](const auto& l, const auto& r) { return l.second > r.second; });
+  if (hot_keys.size() > kTopKeys)
+    hot_keys.resize(kTopKeys);
+
+  big_keys.insert(big_keys.end(), o.big_keys.begin(), o.big_keys.end());
+  sort(big_keys.begin(), big_keys.end(), BiggerKey);
+  if (big_keys.size() > kTopKeys)
+    big_keys.resize(kTopKeys);
+
+  return *this;
+}
+
+vector<pair<string, uint64_t>> KeyAnalyzer::Report::Items() const {
+  vector<pair<string, uint64_t>> res;
+  res.emplace_back("analyzer.passes", passes);
+
+  for (const auto& [prefix, entry] : prefixes) {
+    res.emplace_back(absl::StrCat("prefix.", prefix, ".keys"), entry.keys);
+    res.emplace_back(absl::StrCat("prefix.", prefix, ".bytes"), entry.bytes);
+    res.emplace_back(absl::StrCat("prefix.", prefix, ".ops"), entry.ops);
+  }
+
+  for (const auto& [type, entry] : types) {
+    res.emplace_back(absl::StrCat("type.", type, ".keys"), entry.keys);
+    res.emplace_back(absl::StrCat("type.", type, ".bytes"), entry.bytes);
+  }
+
+  return res;
+}
+
+KeyAnalyzer::KeyAnalyzer(string_view prefixes, bool track_ops) : track_ops_(track_ops) {
+  for (string_view prefix : absl::StrSplit(prefixes, ',', absl::SkipWhitespace())) {
+    prefixes_.emplace_back(absl::StripAsciiWhitespace(prefix));
+  }
+  ops_.resize(prefixes_.size() + 1);
+  report_ = make_shared<const Report>();
+}
+
+bool KeyAnalyzer::Step(DbSlice* db_slice, unsigned budget) {
+  if (!active_) {
+    uint64_t now = absl::GetCurrentTimeNanos();
+    if (now < next_pass_ns_)
+      return false;
+
+    next_pass_ns_ = now + kPassIntervalNs;
+    pass_ = NewPass();
+    active_ = true;
+  }
+
+  if (!Advance(db_slice, budget, &pass_))
+    return false;
+
+  active_ = false;
+  Publish(&pass_);
+  top_keys_.Decay();
+  return true;
+}
+
+void KeyAnalyzer::RunFull(DbSlice* db_slice) {
+  Pass pass = NewPass();
+  while (!Advance(db_slice, UINT32_MAX, &pass)) {
+  }
+  Publish(&pass);
+}
+
+const char* KeyAnalyzer::EncodingName(unsigned type, unsigned encoding) {
+  if (type == OBJ_SET) {
+    switch (encoding) {
+      case kEncodingIntSet:
+        return "intset";
+      case kEncodingStrMap:
+        return "hashtable";
+      case kEncodingListPack:
+        return "listpack";
+      case kEncodingRoaring:
+        return "roaring";
+    }
+  }
+  return strEncoding(encoding);
+}
+
+string KeyAnalyzer::TypeName(unsigned type, unsigned encoding) {
+  return absl::StrCat(ObjTypeName(type), ":", EncodingName(type, encoding));
+}
+
+unsigned KeyAnalyzer::MatchPrefix(string_view key) const {
+  unsigned res = prefixes_.size();
+  for (unsigned i = 0; i < prefixes_.size(); ++i) {
+    if (absl::StartsWith(key, prefixes_[i]) &&
+        (res == prefixes_.size() || prefixes_[i].size() > prefixes_[res].size())) {
+      res = i;
+    }
+  }
+  return res;
+}
+
+auto KeyAnalyzer::NewPass() const -> Pass {
+  Pass pass;
+  pass.prefixes.resize(prefixes_.size() + 1);
+  return pass;
+}
+
+void KeyAnalyzer::Visit(PrimeIterator it, Pass* pass) {
+  Entry entry;
+  entry.keys = 1;
+  entry.bytes = it->first.MallocUsed() + it->second.MallocUsed();
+
+  string_view key = it->first.GetSlice(&scratch_);
+  unsigned type = it->second.ObjType(), encoding = it->second.Encoding();
+  pass->prefixes[MatchPrefix(key)] += entry;
+  pass->types[{type, encoding}] += entry;
+
+  // The heap front is the smallest of the biggest keys, hence the keys are copied only if they
+  // are bigger than that.
+  vector<BigKey>& big_keys = pass->big_keys;
+  if (big_keys.size() == kTopKeys) {
+    if (big_keys.front().bytes >= entry.bytes)
+      return;
+    pop_heap(big_keys.begin(), big_keys.end(), BiggerKey);
+    big_keys.pop_back();
+  }
+  big_keys.push_back(BigKey{string(key), TypeName(type, encoding), entry.bytes});
+  push_heap(big_keys.begin(), big_keys.end(), BiggerKey);
+}
+
+bool KeyAnalyzer::Advance(DbSlice* db_slice, unsigned budget, Pass* pass) {
+  auto cb = [&](PrimeIterator it) { Visit(it, pass); };
+
+  unsigned iters = 0;
+  while (pass->db_indx < db_slice->db_array_size()) {
+    if (!db_slice->IsDbValid(pass->db_indx)) {
+      ++pass->db_indx;
+      continue;
+    }
+
+    if (iters++ == budget)
+      return false;
+
+    PrimeTable* prime = db_slice->GetTables(pass->db_indx).first;
+    pass->cursor = prime->Traverse(pass->cursor, cb);
+    if (!pass->cursor) {
+      ++pass->db_indx;
+    }
+  }
+
+  return true;
+}
+
+void KeyAnalyzer::Publish(Pass* pass) {
+  auto report = make_shared<Report>();
+  report->passes = ++passes_;
+
+  for (unsigned i = 0; i < pass->prefixes.size(); ++i) {
+    Entry entry = pass->prefixes[i];
+    entry.ops = ops_[i];
+    if (entry.keys == 0 && entry.ops == 0)
+      continue;
+    report->prefixes[i < prefixes_.size() ? prefixes_[i] : kOtherPrefix] = entry;
+  }
+
+  for (const auto& [type, entry] : pass->types) {
+    report->types[TypeName(type.first, type.second)] += entry;
+  }
+
+  report->hot_keys = top_keys_.GetTop();
+  report->big_keys = std::move(pass->big_keys);
+  sort(report->big_keys.begin(), report->big_keys.end(), BiggerKey);
+
+  VLOG(1) << "Key analysis pass " << passes_ << " found " << report->prefixes.size()
+          << " prefixes and " << report->types.size() << " encodings";
+  report_ = std::move(report);
+}
+
+}  // namespace dfly
@@ -0,0 +1,144 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/btree_map.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core/top_keys.h"
+#include "server/common.h"
+#include "server/table.h"
+
+namespace dfly {
+
+class DbSlice;
+
+// Aggregates the keyspace of a shard by key prefixes and by value types and encodings, so that
+// the memory of a dataset can be broken down without dumping it offline. Each pass also finds
+// the biggest keys. The keys are traversed in bounded steps by the shard heartbeat.
+// The lookups are counted per prefix too, by sampling one lookup out of kOpsSampleRate,
+// and the sampled lookups feed the detection of the hot keys. Not thread-safe.
+class KeyAnalyzer {
+ public:
+  // The bucket of the keys that do not match any of the prefixes.
+  static constexpr char kOtherPrefix[] = "other";
+  static constexpr unsigned kOpsSampleRate = 64;
+
+  // Number of the hot and of the big keys that are reported.
+  static constexpr unsigned kTopKeys = 16;
+
+  struct Entry {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;  // heap bytes of the keys and the values.
+    uint64_t ops = 0;    // estimated number of lookups, counted for prefixes only.
+
+    Entry& operator+=(const Entry& o) {
+      keys += o.keys;
+      bytes += o.bytes;
+      ops += o.ops;
+      return *this;
+    }
+  };
+
+  struct BigKey {
+    std::string key;
+    std::string type;  // "type:encoding" like in Report::types.
+    uint64_t bytes;
+  };
+
+  // The result of the last completed pass. Ordered, so that the reports are stable.
+  struct Report {
+    absl::btree_map<std::string, Entry> prefixes;
+    absl::btree_map<std::string, Entry> types;  // by "type:encoding", e.g. "set:listpack".
+    uint64_t passes = 0;
+
+    // The estimated lookups of the hot keys, decayed by half on every pass, the hottest first.
+    std::vector<std::pair<std::string, uint64_t>> hot_keys;
+    std::vector<BigKey> big_keys;  // the biggest first.
+
+    Report& operator+=(const Report& o);
+
+    // Returns the entries as name/value pairs, e.g. "prefix.user:.bytes" or "type.set:intset.keys".
+    std::vector<std::pair<std::string, uint64_t>> Items() const;
+  };
+
+  // prefixes is a comma-separated list of the key prefixes. A key is attributed to the longest
+  // prefix it starts with. If track_ops is false, RecordOp does nothing.
+  KeyAnalyzer(std::string_view prefixes, bool track_ops);
+
+  // Traverses about budget buckets of the current pass. A new pass starts at most once a
+  // second. Returns true if a pass has completed.
+  bool Step(DbSlice* db_slice, unsigned budget);
+
+  // Runs a complete pass at once, regardless of the pass in progress.
+  void RunFull(DbSlice* db_slice);
+
+  // Counts a lookup of key on behalf of its prefix.
+  void RecordOp(std::string_view key) {
+    if (track_ops_ && --ops_countdown_ == 0) {
+      ops_countdown_ = kOpsSampleRate;
+      ops_[MatchPrefix(key)] += kOpsSampleRate;
+      top_keys_.Touch(key, kOpsSampleRate);
+    }
+  }
+
+  bool track_ops() const {
+    return track_ops_;
+  }
+
+  // Returns the current candidates of the hot keys, see Report::hot_keys.
+  std::vector<std::pair<std::string, uint64_t>> GetHotKeys() const {
+    return top_keys_.GetTop();
+  }
+
+  std::shared_ptr<const Report> report() const {
+    return report_;
+  }
+
+  // Returns the name of the encoding as OBJECT ENCODING would, including the encodings of the
+  // sets that are specific to us.
+  static const char* EncodingName(unsigned type, unsigned encoding);
+
+ private:
+  struct Pass {
+    std::vector<Entry> prefixes;  // indexed like prefixes_, the last one is kOtherPrefix.
+    absl::btree_map<std::pair<unsigned, unsigned>, Entry> types;  // by type and encoding.
+    std::vector<BigKey> big_keys;  // min-heap by bytes, up to kTopKeys entries.
+    DbIndex db_indx = 0;
+    PrimeTable::cursor cursor;
+  };
+
+  // Returns the index of the longest prefix of key, prefixes_.size() if there is none.
+  unsigned MatchPrefix(std::string_view key) const;
+
+  static std::string TypeName(unsigned type, unsigned encoding);
+
+  Pass NewPass() const;
+
+  void Visit(PrimeIterator it, Pass* pass);
+
+  // Traverses up to budget buckets of pass. Returns true if the pass has reached the end.
+  bool Advance(DbSlice* db_slice, unsigned budget, Pass* pass);
+
+  void Publish(Pass* pass);
+
+  std::vector<std::string> prefixes_;
+  std::vector<uint64_t> ops_;  // indexed like Pass::prefixes.
+  TopKeys top_keys_{kTopKeys};
+  Pass pass_;
+  bool active_ = false;
+  bool track_ops_;
+  unsigned ops_countdown_ = kOpsSampleRate;
+  uint64_t next_pass_ns_ = 0;
+  uint64_t passes_ = 0;
+  std::string scratch_;
+
+  std::shared_ptr<const Report> report_;
+};
+
+}  // namespace dfly
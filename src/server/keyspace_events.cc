@@ -0,0 +1,332 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/keyspace_events.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/channel_slice.h"
+#include "server/engine_shard_set.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(std::string, notify_keyspace_events, "",
+          "The classes of the keyspace notifications, as in redis, e.g. \"KEA\". Empty disables "
+          "the notifications. Can be changed with CONFIG SET notify-keyspace-events.");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+
+namespace {
+
+constexpr pair<char, uint32_t> kClassChars[] = {
+    {'g', KeyspaceEvents::GENERIC}, {'$', KeyspaceEvents::STRING},  {'l', KeyspaceEvents::LIST},
+    {'s', KeyspaceEvents::SET},     {'h', KeyspaceEvents::HASH},    {'z', KeyspaceEvents::ZSET},
+    {'x', KeyspaceEvents::EXPIRED}, {'e', KeyspaceEvents::EVICTED}, {'t', KeyspaceEvents::STREAM},
+};
+
+// The commands whose writes are generic regardless of the types of their keys.
+constexpr string_view kGenericCommands[] = {"DEL",       "UNLINK",  "EXPIRE",   "PEXPIRE", "EXPIREAT",
+                                            "PEXPIREAT", "MEXPIRE", "PERSIST",  "RENAME",  "RENAMENX",
+                                            "MOVE",      "COPY",    "RESTORE"};
+
+uint32_t ClassOf(const char* cmd_name, const PrimeValue* pv) {
+  for (string_view generic : kGenericCommands) {
+    if (generic == cmd_name)
+      return KeyspaceEvents::GENERIC;
+  }
+
+  if (!pv)
+    return KeyspaceEvents::GENERIC;
+
+  switch (pv->ObjType()) {
+    case OBJ_STRING:
+      return KeyspaceEvents::STRING;
+    case OBJ_LIST:
+      return KeyspaceEvents::LIST;
+    case OBJ_SET:
+      return KeyspaceEvents::SET;
+    case OBJ_HASH:
+      return KeyspaceEvents::HASH;
+    case OBJ_ZSET:
+      return KeyspaceEvents::ZSET;
+    case OBJ_STREAM:
+      return KeyspaceEvents::STREAM;
+  }
+  return KeyspaceEvents::GENERIC;
+}
+
+}  // namespace
+
+KeyspaceEvents::KeyspaceEvents() {
+  string spec = absl::GetFlag(FLAGS_notify_keyspace_events);
+  if (!ParseClasses(spec, &classes_)) {
+    LOG(ERROR) << "Invalid notify_keyspace_events " << spec;
+    classes_ = 0;
+  }
+}
+
+bool KeyspaceEvents::ParseClasses(string_view spec, uint32_t* classes) {
+  uint32_t res = 0;
+  for (char c : spec) {
+    switch (c) {
+      case 'A':
+        res |= ALL;
+        continue;
+      case 'K':
+        res |= KEYSPACE;
+        continue;
+      case 'E':
+        res |= KEYEVENT;
+        continue;
+    }
+
+    auto it = find_if(begin(kClassChars), end(kClassChars), [c](auto p) { return p.first == c; });
+    if (it == end(kClassChars))
+      return false;
+    res |= it->second;
+  }
+
+  *classes = res;
+  return true;
+}
+
+string KeyspaceEvents::FormatClasses(uint32_t classes) {
+  string res;
+  if ((classes & ALL) == ALL) {
+    res.push_back('A');
+  } else {
+    for (auto [c, event_class] : kClassChars) {
+      if (classes & event_class)
+        res.push_back(c);
+    }
+  }
+  if (classes & KEYSPACE)
+    res.push_back('K');
+  if (classes & KEYEVENT)
+    res.push_back('E');
+  return res;
+}
+
+bool KeyspaceEvents::IsKeyspaceChannel(string_view channel, bool is_pattern) {
+  // The literal prefix of a pattern, which may match any channel that is compatible with it.
+  string_view prefix = channel;
+  if (is_pattern)
+    prefix = prefix.substr(0, prefix.find_first_of("*?[\\"));
+
+  for (string_view ns : {"__keyspace@"sv, "__keyevent@"sv}) {
+    if (!is_pattern && prefix.size() < ns.size())
+      continue;
+    size_t len = min(prefix.size(), ns.size());
+    if (prefix.substr(0, len) == ns.substr(0, len))
+      return true;
+  }
+  return false;
+}
+
+void KeyspaceEvents::SetClasses(uint32_t classes) {
+  classes_ = classes;
+  UpdateActive();
+}
+
+void KeyspaceEvents::AddSubscribers(int32_t count) {
+  subscribers_ += count;
+  DCHECK_GE(subscribers_, 0);
+  UpdateActive();
+}
+
+void KeyspaceEvents::UpdateActive() {
+  active_ = subscribers_ > 0 && (classes_ & (KEYSPACE | KEYEVENT)) && (classes_ & ALL);
+  if (!active_) {
+    pending_.clear();
+    committed_ = 0;
+  }
+}
+
+void KeyspaceEvents::Record(DbIndex db_ind, string_view key, const char* event,
+                            uint32_t event_class) {
+  if (!active_)
+    return;
+
+  if (!event) {
+    if (!cmd_name_)
+      return;
+
+    // A command usually reports its write of a key more than once, e.g. when it adds the key
+    // and when it updates its value.
+    if (pending_.size() > committed_) {
+      const Event& last = pending_.back();
+      if (last.event_class == 0 && last.db_ind == db_ind && last.key == key)
+        return;
+    }
+    event = cmd_name_;
+    event_class = 0;
+  }
+
+  pending_.push_back(Event{db_ind, event_class, event, string{key}});
+  ScheduleFlush();
+}
+
+void KeyspaceEvents::MarkEvicted() {
+  if (!active_ || pending_.empty())
+    return;
+
+  Event& last = pending_.back();
+  last.name = "evicted";
+  last.event_class = EVICTED;
+}
+
+void KeyspaceEvents::Commit(DbSlice* db_slice) {
+  cmd_name_ = nullptr;
+  if (active_)
+    Classify(db_slice);
+}
+
+void KeyspaceEvents::Classify(DbSlice* db_slice) {
+  for (size_t i = committed_; i < pending_.size(); ++i) {
+    Event& ev = pending_[i];
+    if (ev.event_class != 0)
+      continue;
+
+    const PrimeValue* pv = nullptr;
+    if (db_slice->IsDbValid(ev.db_ind)) {
+      PrimeIterator it = db_slice->GetTables(ev.db_ind).first->Find(ev.key);
+      if (IsValid(it))
+        pv = &it->second;
+    }
+    ev.event_class = ClassOf(ev.name, pv);
+  }
+  committed_ = pending_.size();
+}
+
+void KeyspaceEvents::ScheduleFlush() {
+  if (flush_scheduled_)
+    return;
+
+  flush_scheduled_ = true;
+
+  // Runs after the current task of the shard thread, like the client tracking invalidations.
+  ProactorBase::me()->DispatchBrief([] {
+    EngineShard* shard = EngineShard::tlocal();
+    if (shard)
+      shard->db_slice().keyspace_events().Flush();
+  });
+}
+
+void KeyspaceEvents::Flush() {
+  flush_scheduled_ = false;
+  if (!active_)
+    return;
+
+  // The command that recorded the events is still running if it was preempted.
+  Classify(&EngineShard::tlocal()->db_slice());
+
+  vector<Event> events = std::move(pending_);
+  pending_.clear();
+  committed_ = 0;
+
+  vector<shared_ptr<Batch>> by_shard(shard_set->size());
+  auto add = [&](string channel, string_view message) {
+    auto& batch = by_shard[Shard(channel, by_shard.size())];
+    if (!batch)
+      batch = make_shared<Batch>();
+    batch->push_back(std::move(channel));
+    batch->emplace_back(message);
+  };
+
+  string name;
+  for (const Event& ev : events) {
+    if ((ev.event_class & classes_) == 0)
+      continue;
+
+    name = absl::AsciiStrToLower(ev.name);
+    if (classes_ & KEYSPACE)
+      add(absl::StrCat("__keyspace@", ev.db_ind, "__:", ev.key), name);
+    if (classes_ & KEYEVENT)
+      add(absl::StrCat("__keyevent@", ev.db_ind, "__:", name), ev.key);
+  }
+
+  for (ShardId sid = 0; sid < by_shard.size(); ++sid) {
+    if (by_shard[sid])
+      shard_set->Add(sid, [batch = std::move(by_shard[sid])] { Publish(batch); });
+  }
+}
+
+void KeyspaceEvents::Publish(shared_ptr<const Batch> batch) {
+  ChannelSlice& cs = EngineShard::tlocal()->channel_slice();
+  unsigned num_threads = shard_set->pool()->size();
+
+  // The subscriber lists of the messages, they hold the borrow tokens of the subscribers until
+  // all the threads sent the messages.
+  struct Delivery {
+    size_t index;  // of the channel in the batch.
+    vector<ChannelSlice::SubscriberListPtr> lists;
+  };
+  auto deliveries = make_shared<vector<Delivery>>();
+  vector<bool> threads(num_threads, false);
+
+  for (size_t i = 0; i < batch->size(); i += 2) {
+    vector<ChannelSlice::SubscriberListPtr> lists = cs.FetchSubscribers((*batch)[i]);
+    if (lists.empty())
+      continue;
+
+    for (const auto& list : lists) {
+      for (unsigned tid = 0; tid < num_threads; ++tid) {
+        if (!list->ThreadRange(tid).empty())
+          threads[tid] = true;
+      }
+    }
+    deliveries->push_back(Delivery{i, std::move(lists)});
+  }
+
+  // Each thread with subscribers gets a single callback that sends all its messages. Unlike the
+  // lists, the strings of the batch stay alive until the connections write the messages.
+  for (unsigned tid = 0; tid < num_threads; ++tid) {
+    if (!threads[tid])
+      continue;
+
+    shard_set->pool()->at(tid)->DispatchBrief([batch, deliveries, tid] {
+      struct Holder {
+        shared_ptr<const Batch> batch;
+        deque<string> patterns;
+      };
+      auto holder = make_shared<Holder>();
+      holder->batch = batch;
+
+      for (const Delivery& delivery : *deliveries) {
+        for (const auto& list : delivery.lists) {
+          auto range = list->ThreadRange(tid);
+          if (range.empty())
+            continue;
+
+          facade::Connection::PubMessage pmsg;
+          pmsg.channel = (*batch)[delivery.index];
+          pmsg.message = (*batch)[delivery.index + 1];
+          if (!list->pattern.empty())
+            pmsg.pattern = holder->patterns.emplace_back(list->pattern);
+
+          for (const ChannelSlice::Subscriber& subscriber : range) {
+            facade::Connection* conn = subscriber.conn_cntx->owner();
+            DCHECK(conn);
+            conn->SendMsgAsync(pmsg, holder);
+          }
+        }
+      }
+    });
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,110 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+class DbSlice;
+
+// The keyspace notifications of a shard, see notify-keyspace-events in redis. They are published
+// on the channels __keyspace@<db>__:<key> with the event as the message and
+// __keyevent@<db>__:<event> with the key as the message.
+//
+// The mutation path only checks active(), which is false unless the notifications are enabled
+// and some connection is subscribed to a channel or a pattern that may match them. The events
+// are recorded as the keys and the literals of their names, the channels are formatted once the
+// shard task finishes and published in a batch per channel shard, which sends a single callback
+// to each thread with subscribers. The writes of the commands are named after them, e.g. "hset",
+// and classified by the types of their keys once the command finishes, see Commit. Expired keys
+// are reported by the expiry cycle of the heartbeat in a batch per cycle.
+class KeyspaceEvents {
+ public:
+  // The classes of notify-keyspace-events.
+  enum Class : uint32_t {
+    KEYSPACE = 1 << 0,  // K
+    KEYEVENT = 1 << 1,  // E
+    GENERIC = 1 << 2,   // g
+    STRING = 1 << 3,    // $
+    LIST = 1 << 4,      // l
+    SET = 1 << 5,       // s
+    HASH = 1 << 6,      // h
+    ZSET = 1 << 7,      // z
+    EXPIRED = 1 << 8,   // x
+    EVICTED = 1 << 9,   // e
+    STREAM = 1 << 10,   // t
+    ALL = GENERIC | STRING | LIST | SET | HASH | ZSET | EXPIRED | EVICTED | STREAM,  // A
+  };
+
+  KeyspaceEvents();
+
+  // Parses the classes as in redis, e.g. "KEA" or "Ex". Returns false on unknown characters.
+  static bool ParseClasses(std::string_view spec, uint32_t* classes);
+  static std::string FormatClasses(uint32_t classes);
+
+  // Whether the channel or the pattern may receive keyspace notifications.
+  static bool IsKeyspaceChannel(std::string_view channel, bool is_pattern);
+
+  bool active() const {
+    return active_;
+  }
+
+  void SetClasses(uint32_t classes);
+
+  // The subscriptions on IsKeyspaceChannel channels and patterns of all the threads.
+  void AddSubscribers(int32_t count);
+
+  // Called on the mutation path. event is a literal, null for a write of the running command,
+  // which is classified by Commit. The writes outside of the commands are not reported.
+  void Record(DbIndex db_ind, std::string_view key, const char* event, uint32_t event_class);
+
+  // Renames the last recorded deletion to an eviction.
+  void MarkEvicted();
+
+  // Called before and after a command writes in the shard.
+  void SetCommand(const char* cmd_name) {
+    cmd_name_ = cmd_name;
+  }
+  void Commit(DbSlice* db_slice);
+
+ private:
+  struct Event {
+    DbIndex db_ind;
+    uint32_t event_class;
+    const char* name;
+    std::string key;
+  };
+
+  // Pairs of channels and messages, all published on the channels of the same shard.
+  using Batch = std::vector<std::string>;
+
+  void UpdateActive();
+
+  // Sets the classes of the events of the commands starting at committed_.
+  void Classify(DbSlice* db_slice);
+
+  void ScheduleFlush();
+  void Flush();
+
+  // Runs in the shard of the channels of the batch.
+  static void Publish(std::shared_ptr<const Batch> batch);
+
+  uint32_t classes_ = 0;
+  int32_t subscribers_ = 0;
+  bool active_ = false;
+
+  const char* cmd_name_ = nullptr;  // of the running command.
+  std::vector<Event> pending_;
+  size_t committed_ = 0;  // the events before that index are classified.
+  bool flush_scheduled_ = false;
+};
+
+}  // namespace dfly
@@ -0,0 +1,98 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/latency_monitor.h"
+
+#include <algorithm>
+
+#include "base/flags.h"
+#include "server/server_state.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(uint32_t, latency_monitor_threshold_usec, 0,
+          "Background activities that take at least that many microseconds are recorded by "
+          "the latency monitor, see LATENCY LATEST. 0 disables the monitor.");
+
+namespace dfly {
+
+using namespace std;
+using absl::GetFlag;
+using util::ProactorBase;
+
+LatencyMonitor::Timer::Timer(const char* event) : event_(event) {
+  if (IsEnabled())
+    start_ns_ = ProactorBase::GetMonotonicTimeNs();
+}
+
+LatencyMonitor::Timer::~Timer() {
+  if (start_ns_ == 0 || event_ == nullptr)
+    return;
+
+  uint64_t usec = (ProactorBase::GetMonotonicTimeNs() - start_ns_) / 1000;
+  ServerState::tlocal()->latency_monitor.Add(event_, usec);
+}
+
+bool LatencyMonitor::IsEnabled() {
+  return GetFlag(FLAGS_latency_monitor_threshold_usec) > 0;
+}
+
+void LatencyMonitor::Add(string_view event, uint64_t latency_usec) {
+  uint32_t threshold = GetFlag(FLAGS_latency_monitor_threshold_usec);
+  if (threshold == 0 || latency_usec < threshold)
+    return;
+
+  time_t now = time(nullptr);
+  Event& ev = events_[event];
+  if (!ev.history.empty() && ev.history.back().unix_ts == now) {
+    ev.history.back().latency_usec = max(ev.history.back().latency_usec, latency_usec);
+  } else {
+    ev.history.push_back(Sample{now, latency_usec});
+    if (ev.history.size() > kHistoryLen)
+      ev.history.pop_front();
+  }
+  ev.max_usec = max(ev.max_usec, latency_usec);
+}
+
+size_t LatencyMonitor::Reset(const vector<string>& names) {
+  if (names.empty()) {
+    size_t res = events_.size();
+    events_.clear();
+    return res;
+  }
+
+  size_t res = 0;
+  for (const string& name : names) {
+    res += events_.erase(name);
+  }
+  return res;
+}
+
+void LatencyMonitor::Merge(const EventMap& src, EventMap* dest) {
+  for (const auto& [name, src_ev] : src) {
+    Event& ev = (*dest)[name];
+    ev.max_usec = max(ev.max_usec, src_ev.max_usec);
+
+    // Both histories are ordered by time, the samples of the same second keep the maximum.
+    deque<Sample> merged;
+    auto it = ev.history.begin(), src_it = src_ev.history.begin();
+    while (it != ev.history.end() || src_it != src_ev.history.end()) {
+      if (src_it == src_ev.history.end() ||
+          (it != ev.history.end() && it->unix_ts < src_it->unix_ts)) {
+        merged.push_back(*it++);
+      } else if (it == ev.history.end() || src_it->unix_ts < it->unix_ts) {
+        merged.push_back(*src_it++);
+      } else {
+        merged.push_back(Sample{it->unix_ts, max(it->latency_usec, src_it->latency_usec)});
+        ++it;
+        ++src_it;
+      }
+    }
+
+    while (merged.size() > kHistoryLen)
+      merged.pop_front();
+    ev.history = std::move(merged);
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,75 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Spikes of the background activities of a thread, e.g. the expiry cycles of the heartbeat,
+// that took at least FLAGS_latency_monitor_threshold_usec. See LATENCY LATEST.
+// Like in redis every event keeps a sample per second, the maximum of its spikes in that second.
+// Unlike redis the latencies are in microseconds, most of the spikes are shorter than 1ms.
+class LatencyMonitor {
+ public:
+  static constexpr size_t kHistoryLen = 160;
+
+  struct Sample {
+    time_t unix_ts = 0;
+    uint64_t latency_usec = 0;
+  };
+
+  struct Event {
+    std::deque<Sample> history;  // the oldest samples first.
+    uint64_t max_usec = 0;       // of all the samples since the reset, not only of the history.
+  };
+
+  using EventMap = absl::flat_hash_map<std::string, Event>;
+
+  // Measures the scope and records it as a spike of the event if it reaches the threshold.
+  // Does not read the clock while the monitor is disabled.
+  class Timer {
+   public:
+    // event is a literal, null to decide on it later with set_event.
+    explicit Timer(const char* event);
+    ~Timer();
+
+    Timer(const Timer&) = delete;
+    void operator=(const Timer&) = delete;
+
+    void set_event(const char* event) {
+      event_ = event;
+    }
+
+   private:
+    const char* event_;
+    uint64_t start_ns_ = 0;
+  };
+
+  static bool IsEnabled();
+
+  // Records the spike if it reaches the threshold.
+  void Add(std::string_view event, uint64_t latency_usec);
+
+  // Clears all the events if names is empty. Returns the number of the events that were reset.
+  size_t Reset(const std::vector<std::string>& names);
+
+  const EventMap& events() const {
+    return events_;
+  }
+
+  // Merges the events of src, e.g. of another thread, into dest.
+  static void Merge(const EventMap& src, EventMap* dest);
+
+ private:
+  EventMap events_;
+};
+
+}  // namespace dfly
@@ -10,6 +10,8 @@ extern "C" {
 
 #include <absl/strings/numbers.h>
 
+#include <optional>
+
 #include "base/flags.h"
 #include "base/logging.h"
 #include "server/blocking_controller.h"
@@ -57,11 +59,14 @@ ABSL_FLAG(int32_t, list_max_listpack_size, -2, "Maximum listpack size, default i
 
 ABSL_FLAG(int32_t, list_compress_depth, 0, "Compress depth of the list. Default is no compression");
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 namespace dfly {
 
 using namespace std;
 using namespace facade;
 using absl::GetFlag;
+using boost::intrusive_ptr;
 
 namespace {
 
@@ -186,34 +191,76 @@ OpResult<ShardFFResult> FindFirst(Transaction* trans) {
   return OpResult<ShardFFResult>{move(shard_result)};
 }
 
+OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, ListDir dir, uint32_t count,
+                          bool return_results) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_LIST);
+  if (!it_res)
+    return it_res.status();
+
+  PrimeIterator it = *it_res;
+  quicklist* ql = GetQL(it->second);
+  db_slice.PreUpdate(op_args.db_ind, it);
+
+  StringVec res;
+  if (quicklistCount(ql) < count) {
+    count = quicklistCount(ql);
+  }
+  res.reserve(count);
+
+  if (return_results) {
+    for (unsigned i = 0; i < count; ++i) {
+      res.push_back(ListPop(dir, ql));
+    }
+  } else {
+    for (unsigned i = 0; i < count; ++i) {
+      ListPop(dir, ql);
+    }
+  }
+
+  db_slice.PostUpdate(op_args.db_ind, it);
+
+  if (quicklistCount(ql) == 0) {
+    CHECK(db_slice.Del(op_args.db_ind, it));
+  }
+
+  return res;
+}
+
 class BPopper {
  public:
-  explicit BPopper(ListDir dir);
+  // Pops a single element, or up to count elements like BLMPOP does.
+  explicit BPopper(ListDir dir, uint32_t count = 1);
 
   // Returns WRONG_TYPE, OK.
-  // If OK is returned then use result() to fetch the value.
-  OpStatus Run(Transaction* t, unsigned msec);
+  // If OK is returned then use key() and values() to fetch the result.
+  // Returns TIMED_OUT right away if none of the lists exists and block is false.
+  OpStatus Run(Transaction* t, unsigned msec, bool block = true);
 
-  // returns (key, value) pair.
-  auto result() const {
-    return make_pair<string_view, string_view>(key_, value_);
+  string_view key() const {
+    return key_;
+  }
+
+  const StringVec& values() const {
+    return values_;
   }
 
  private:
   OpStatus Pop(Transaction* t, EngineShard* shard);
 
   ListDir dir_;
+  uint32_t count_;
 
   ShardFFResult ff_result_;
 
   string key_;
-  string value_;
+  StringVec values_;
 };
 
-BPopper::BPopper(ListDir dir) : dir_(dir) {
+BPopper::BPopper(ListDir dir, uint32_t count) : dir_(dir), count_(count) {
 }
 
-OpStatus BPopper::Run(Transaction* t, unsigned msec) {
+OpStatus BPopper::Run(Transaction* t, unsigned msec, bool block) {
   using time_point = Transaction::time_point;
 
   time_point tp =
@@ -228,7 +275,7 @@ OpStatus BPopper::Run(Transaction* t, unsigned msec) {
   OpResult<ShardFFResult> result = FindFirst(t);
 
   if (result.status() == OpStatus::KEY_NOTFOUND) {
-    if (is_multi) {
+    if (is_multi || !block) {
       // close transaction and return.
       auto cb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
       t->Execute(std::move(cb), true);
@@ -236,14 +283,30 @@ OpStatus BPopper::Run(Transaction* t, unsigned msec) {
       return OpStatus::TIMED_OUT;
     }
 
+    // The shard pops the elements as soon as a push makes the key ready, unless the keys span
+    // multiple shards.
+    auto consume_cb = [this, t](string_view key, PrimeIterator it) {
+      OpResult<StringVec> res =
+          OpPop(OpArgs{EngineShard::tlocal(), t->db_index()}, key, dir_, count_, true);
+      if (!res)
+        return false;
+
+      key_ = key;
+      values_ = std::move(res.value());
+      return true;
+    };
+
     // Block
     ++stats->num_blocked_clients;
-    bool wait_succeeded = t->WaitOnWatch(tp);
+    bool wait_succeeded = t->WaitOnWatch(tp, {}, std::move(consume_cb));
     --stats->num_blocked_clients;
 
     if (!wait_succeeded)
       return OpStatus::TIMED_OUT;
 
+    if (t->watch_consumed())
+      return OpStatus::OK;
+
     // Now we have something for sure.
     result = FindFirst(t);  // retry - must find something.
   }
@@ -269,24 +332,16 @@ OpStatus BPopper::Run(Transaction* t, unsigned msec) {
 OpStatus BPopper::Pop(Transaction* t, EngineShard* shard) {
   if (shard->shard_id() == ff_result_.sid) {
     ff_result_.key.GetString(&key_);
-    auto& db_slice = shard->db_slice();
-    auto it_res = db_slice.Find(t->db_index(), key_, OBJ_LIST);
-    CHECK(it_res);  // must exist and must be ok.
-    PrimeIterator it = *it_res;
-    quicklist* ql = GetQL(it->second);
-
-    db_slice.PreUpdate(t->db_index(), it);
-    value_ = ListPop(dir_, ql);
-    db_slice.PostUpdate(t->db_index(), it);
-    if (quicklistCount(ql) == 0) {
-      CHECK(shard->db_slice().Del(t->db_index(), it));
-    }
+    OpResult<StringVec> res = OpPop(OpArgs{shard, t->db_index()}, key_, dir_, count_, true);
+    CHECK(res);  // must exist and must be ok.
+    values_ = std::move(res.value());
   }
 
   return OpStatus::OK;
 }
 
-OpResult<string> OpRPopLPushSingleShard(const OpArgs& op_args, string_view src, string_view dest) {
+OpResult<string> OpMoveSingleShard(const OpArgs& op_args, string_view src, string_view dest,
+                                   ListDir src_dir, ListDir dest_dir) {
   auto& db_slice = op_args.shard->db_slice();
   auto src_res = db_slice.Find(op_args.db_ind, src, OBJ_LIST);
   if (!src_res)
@@ -294,12 +349,13 @@ OpResult<string> OpRPopLPushSingleShard(const OpArgs& op_args, string_view src,
 
   PrimeIterator src_it = *src_res;
   quicklist* src_ql = GetQL(src_it->second);
+  int dest_pos = (dest_dir == ListDir::LEFT) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
 
   if (src == dest) {  // simple case.
     db_slice.PreUpdate(op_args.db_ind, src_it);
-    string val = ListPop(ListDir::RIGHT, src_ql);
+    string val = ListPop(src_dir, src_ql);
 
-    quicklistPushHead(src_ql, val.data(), val.size());
+    quicklistPush(src_ql, val.data(), val.size(), dest_pos);
     db_slice.PostUpdate(op_args.db_ind, src_it);
 
     return val;
@@ -334,8 +390,8 @@ OpResult<string> OpRPopLPushSingleShard(const OpArgs& op_args, string_view src,
 
   db_slice.PreUpdate(op_args.db_ind, src_it);
 
-  string val = ListPop(ListDir::RIGHT, src_ql);
-  quicklistPushHead(dest_ql, val.data(), val.size());
+  string val = ListPop(src_dir, src_ql);
+  quicklistPush(dest_ql, val.data(), val.size(), dest_pos);
 
   db_slice.PostUpdate(op_args.db_ind, src_it);
   db_slice.PostUpdate(op_args.db_ind, dest_it);
@@ -344,12 +400,18 @@ OpResult<string> OpRPopLPushSingleShard(const OpArgs& op_args, string_view src,
     CHECK(db_slice.Del(op_args.db_ind, src_it));
   }
 
+  // Like OpPush, the new list may be what the blocked transactions wait for.
+  EngineShard* es = op_args.shard;
+  if (res.second && es->blocking_controller()) {
+    es->blocking_controller()->AwakeWatched(op_args.db_ind, dest);
+  }
+
   return val;
 }
 
 // Read-only peek operation that determines wether the list exists and optionally
-// returns the first from right value without popping it from the list.
-OpResult<string> RPeek(const OpArgs& op_args, string_view key, bool fetch) {
+// returns the first value from the dir end of it without popping it from the list.
+OpResult<string> Peek(const OpArgs& op_args, string_view key, ListDir dir, bool fetch) {
   auto it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_LIST);
   if (!it_res) {
     return it_res.status();
@@ -360,7 +422,8 @@ OpResult<string> RPeek(const OpArgs& op_args, string_view key, bool fetch) {
 
   quicklist* ql = GetQL(it_res.value()->second);
   quicklistEntry entry = QLEntry();
-  quicklistIter* iter = quicklistGetIterator(ql, AL_START_TAIL);
+  quicklistIter* iter =
+      quicklistGetIterator(ql, (dir == ListDir::LEFT) ? AL_START_HEAD : AL_START_TAIL);
   CHECK(quicklistNext(iter, &entry));
   quicklistReleaseIterator(iter);
 
@@ -425,44 +488,231 @@ OpResult<uint32_t> OpPush(const OpArgs& op_args, std::string_view key, ListDir d
   return quicklistCount(ql);
 }
 
-OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, ListDir dir, uint32_t count,
-                          bool return_results) {
-  auto& db_slice = op_args.shard->db_slice();
-  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_LIST);
-  if (!it_res)
-    return it_res.status();
+// Converts the indices of LRANGE into the indices of a list of llen elements. Returns false if the
+// range is empty.
+bool NormalizeRange(long llen, long* start, long* end) {
+  /* convert negative indexes */
+  if (*start < 0)
+    *start = llen + *start;
+  if (*end < 0)
+    *end = llen + *end;
+  if (*start < 0)
+    *start = 0;
 
-  PrimeIterator it = *it_res;
-  quicklist* ql = GetQL(it->second);
-  db_slice.PreUpdate(op_args.db_ind, it);
+  /* Invariant: start >= 0, so this test will be true when end < 0.
+   * The range is empty when start > end or start >= length. */
+  if (*start > *end || *start >= llen)
+    return false;
 
-  StringVec res;
-  if (quicklistCount(ql) < count) {
-    count = quicklistCount(ql);
+  if (*end >= llen)
+    *end = llen - 1;
+  return true;
+}
+
+// Writes count elements of ql from index start into rb, without the array header.
+void SendRangeItems(quicklist* ql, long start, unsigned count, RedisReplyBuilder* rb) {
+  quicklistIter* qiter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, start);
+  quicklistEntry entry = QLEntry();
+  char buf[absl::numbers_internal::kFastToBufferSize];
+
+  unsigned cnt = 0;
+  while (cnt < count && quicklistNext(qiter, &entry)) {
+    if (entry.value) {
+      rb->SendBulkString(string_view{reinterpret_cast<char*>(entry.value), entry.sz});
+    } else {
+      char* next = absl::numbers_internal::FastIntToBuffer(entry.longval, buf);
+      rb->SendBulkString(string_view{buf, size_t(next - buf)});
+    }
+    ++cnt;
   }
-  res.reserve(count);
+  quicklistReleaseIterator(qiter);
+  DCHECK_EQ(cnt, count);
+}
 
-  if (return_results) {
-    for (unsigned i = 0; i < count; ++i) {
-      res.push_back(ListPop(dir, ql));
+// Replies to LRANGE with a range that is too long for a single hop. The elements are written in
+// hops of chunk elements, see Transaction::ExecuteChunked, and each chunk is sent before the next
+// hop, so the reply is never held in full. The hop of the command has concluded by then, hence the
+// key is locked by a transaction of its own.
+void SendRangeChunked(CmdArgList args, ConnectionContext* cntx, long start, long end,
+                      uint32_t chunk) {
+  intrusive_ptr<Transaction> trans{Transaction::New(cntx->cid)};
+  OpStatus status = trans->InitByArgs(cntx->conn_state.db_index, args);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+
+  string_view key = ArgS(args, 1);
+  ::io::StringSink sink;
+  RedisReplyBuilder rb(&sink);
+  unsigned total = 0, sent = 0;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    auto res = shard->db_slice().Find(t->db_index(), key, OBJ_LIST);
+    if (!res) {
+      status = res.status();
+      return false;
     }
-  } else {
-    for (unsigned i = 0; i < count; ++i) {
-      ListPop(dir, ql);
+
+    quicklist* ql = GetQL(res.value()->second);
+    if (total == 0) {
+      if (!NormalizeRange(quicklistCount(ql), &start, &end)) {
+        rb.StartArray(0);
+        return false;
+      }
+      total = end - start + 1;
+      rb.StartArray(total);
+    }
+
+    unsigned count = min(chunk, total - sent);
+    SendRangeItems(ql, start + sent, count, &rb);
+    sent += count;
+    return sent < total;
+  };
+
+  auto send_chunk = [&] {
+    (*cntx)->SendRaw(sink.str());
+    sink.Clear();
+  };
+
+  trans->ExecuteChunked(std::move(cb), std::move(send_chunk));
+
+  if (status == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->StartArray(0);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+}
+
+// Moves an element from src into dest within a scheduled transaction. The first hop checks the
+// keys and peeks the element, which the second one pops from src and pushes into dest. If tp is
+// set and src does not exist, blocks until a push into src or until tp in between.
+OpResult<string> MoveScheduled(Transaction* t, string_view src, string_view dest, ListDir src_dir,
+                               ListDir dest_dir, optional<Transaction::time_point> tp) {
+  bool single_shard = t->unique_shard_cnt() == 1;
+  OpResult<string> find_res[2];
+
+  auto peek_cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args{shard, t->db_index()};
+    for (string_view key : t->ShardArgsInShard(shard->shard_id())) {
+      if (key == src)
+        find_res[0] = Peek(op_args, key, src_dir, !single_shard);
+      if (key == dest)
+        find_res[1] = Peek(op_args, key, src_dir, false);
     }
+    return OpStatus::OK;
+  };
+
+  t->Execute(peek_cb, false);
+
+  if (tp && find_res[0].status() == OpStatus::KEY_NOTFOUND &&
+      find_res[1].status() != OpStatus::WRONG_TYPE) {
+    auto krc = [src](string_view key, const PrimeValue& pv) {
+      return key == src && pv.ObjType() == OBJ_LIST;
+    };
+
+    // The shard moves the element as soon as a push makes src ready. It leaves the errors,
+    // like dest of a wrong type, to the transaction.
+    OpResult<string> consumed;
+    Transaction::KeyConsumer consume_cb;
+    if (single_shard) {
+      consume_cb = [&](string_view key, PrimeIterator it) {
+        consumed = OpMoveSingleShard(OpArgs{EngineShard::tlocal(), t->db_index()}, src, dest,
+                                     src_dir, dest_dir);
+        return bool(consumed);
+      };
+    }
+
+    auto* stats = ServerState::tl_connection_stats();
+    ++stats->num_blocked_clients;
+    bool wait_succeeded = t->WaitOnWatch(*tp, std::move(krc), std::move(consume_cb));
+    --stats->num_blocked_clients;
+
+    if (!wait_succeeded)
+      return OpStatus::TIMED_OUT;
+
+    if (t->watch_consumed())
+      return consumed;
+
+    t->Execute(peek_cb, false);
   }
 
-  db_slice.PostUpdate(op_args.db_ind, it);
+  if (!find_res[0] || find_res[1].status() == OpStatus::WRONG_TYPE) {
+    auto cb = [&](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
+    t->Execute(move(cb), true);
+    return find_res[0] ? find_res[1] : find_res[0];
+  }
 
-  if (quicklistCount(ql) == 0) {
-    CHECK(db_slice.Del(op_args.db_ind, it));
+  // Everything is ok, lets proceed with the mutations.
+  OpResult<string> result;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args{shard, t->db_index()};
+    if (single_shard) {
+      result = OpMoveSingleShard(op_args, src, dest, src_dir, dest_dir);
+      return OpStatus::OK;
+    }
+
+    auto args = t->ShardArgsInShard(shard->shard_id());
+    DCHECK_EQ(1u, args.size());
+    if (args.front() == dest) {
+      string_view val{find_res[0].value()};
+      absl::Span<string_view> span{&val, 1};
+      OpPush(op_args, dest, dest_dir, false, span);
+    } else {
+      OpPop(op_args, src, src_dir, 1, false);
+    }
+    return OpStatus::OK;
+  };
+  t->Execute(move(cb), true);
+
+  return single_shard ? result : find_res[0];
+}
+
+void SendMoveResult(const OpResult<string>& result, ConnectionContext* cntx) {
+  if (result) {
+    return (*cntx)->SendBulkString(*result);
   }
 
-  return res;
+  switch (result.status()) {
+    case OpStatus::KEY_NOTFOUND:
+    case OpStatus::TIMED_OUT:
+      (*cntx)->SendNull();
+      break;
+
+    default:
+      (*cntx)->SendError(result.status());
+      break;
+  }
+}
+
+// Parses LEFT or RIGHT at args[indx].
+optional<ListDir> ParseDir(CmdArgList args, size_t indx) {
+  ToUpper(&args[indx]);
+  string_view dir = ArgS(args, indx);
+  if (dir == "LEFT")
+    return ListDir::LEFT;
+  if (dir == "RIGHT")
+    return ListDir::RIGHT;
+  return nullopt;
+}
+
+// Parses the timeout of the blocking commands in seconds. Returns the error to reply with.
+const char* ParseTimeout(string_view str, unsigned* msec) {
+  float timeout;
+  if (!absl::SimpleAtof(str, &timeout)) {
+    return "timeout is not a float or out of range";
+  }
+  if (timeout < 0) {
+    return "timeout is negative";
+  }
+  *msec = unsigned(timeout * 1000);
+  return nullptr;
 }
 
 }  // namespace
 
+OpResult<uint32_t> ListFamily::OpPushBack(const OpArgs& op_args, string_view key,
+                                          absl::Span<string_view> values) {
+  return OpPush(op_args, key, ListDir::RIGHT, false, values);
+}
+
 void ListFamily::LPush(CmdArgList args, ConnectionContext* cntx) {
   return PushGeneric(ListDir::LEFT, false, std::move(args), cntx);
 }
@@ -488,77 +738,39 @@ void ListFamily::RPop(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void ListFamily::RPopLPush(CmdArgList args, ConnectionContext* cntx) {
-  string_view src = ArgS(args, 1);
-  string_view dest = ArgS(args, 2);
-
-  OpResult<string> result;
-
-  if (cntx->transaction->unique_shard_cnt() == 1) {
-    auto cb = [&](Transaction* t, EngineShard* shard) {
-      return OpRPopLPushSingleShard(OpArgs{shard, t->db_index()}, src, dest);
-    };
-
-    result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
-  } else {
-    CHECK_EQ(2u, cntx->transaction->unique_shard_cnt());
+  MoveGeneric(ArgS(args, 1), ArgS(args, 2), ListDir::RIGHT, ListDir::LEFT, cntx);
+}
 
-    OpResult<string> find_res[2];
+void ListFamily::LMove(CmdArgList args, ConnectionContext* cntx) {
+  optional<ListDir> src_dir = ParseDir(args, 3);
+  optional<ListDir> dest_dir = ParseDir(args, 4);
+  if (!src_dir || !dest_dir) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
 
-    // Transaction is comprised of 2 hops:
-    // 1 - check for entries existence, their types and if possible -
-    //     read the value we may rpop from the source list.
-    // 2.  If everything is ok, rpop from source and lpush the peeked value into
-    //     the destination.
-    //
-    cntx->transaction->Schedule();
-    auto cb = [&](Transaction* t, EngineShard* shard) {
-      auto args = t->ShardArgsInShard(shard->shard_id());
-      DCHECK_EQ(1u, args.size());
-      bool is_dest = args.front() == dest;
-      find_res[is_dest] = RPeek(OpArgs{shard, t->db_index()}, args.front(), !is_dest);
-      return OpStatus::OK;
-    };
+  MoveGeneric(ArgS(args, 1), ArgS(args, 2), *src_dir, *dest_dir, cntx);
+}
 
-    cntx->transaction->Execute(move(cb), false);
+void ListFamily::BRPopLPush(CmdArgList args, ConnectionContext* cntx) {
+  BMoveGeneric(ArgS(args, 1), ArgS(args, 2), ListDir::RIGHT, ListDir::LEFT, ArgS(args, 3), cntx);
+}
 
-    if (!find_res[0] || find_res[1].status() == OpStatus::WRONG_TYPE) {
-      auto cb = [&](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
-      cntx->transaction->Execute(move(cb), true);
-      result = find_res[0] ? find_res[1] : find_res[0];
-    } else {
-      // Everything is ok, lets proceed with the mutations.
-      auto cb = [&](Transaction* t, EngineShard* shard) {
-        auto args = t->ShardArgsInShard(shard->shard_id());
-        bool is_dest = args.front() == dest;
-        OpArgs op_args{shard, t->db_index()};
-
-        if (is_dest) {
-          string_view val{find_res[0].value()};
-          absl::Span<string_view> span{&val, 1};
-          OpPush(op_args, args.front(), ListDir::LEFT, false, span);
-        } else {
-          OpPop(op_args, args.front(), ListDir::RIGHT, 1, false);
-        }
-        return OpStatus::OK;
-      };
-      cntx->transaction->Execute(move(cb), true);
-      result = std::move(find_res[0].value());
-    }
+void ListFamily::BLMove(CmdArgList args, ConnectionContext* cntx) {
+  optional<ListDir> src_dir = ParseDir(args, 3);
+  optional<ListDir> dest_dir = ParseDir(args, 4);
+  if (!src_dir || !dest_dir) {
+    return (*cntx)->SendError(kSyntaxErr);
   }
 
-  if (result) {
-    return (*cntx)->SendBulkString(*result);
-  }
+  BMoveGeneric(ArgS(args, 1), ArgS(args, 2), *src_dir, *dest_dir, ArgS(args, 5), cntx);
+}
 
-  switch (result.status()) {
-    case OpStatus::KEY_NOTFOUND:
-      (*cntx)->SendNull();
-      break;
+void ListFamily::LMPop(CmdArgList args, ConnectionContext* cntx) {
+  MPopGeneric(false, std::move(args), cntx);
+}
 
-    default:
-      (*cntx)->SendError(result.status());
-      break;
-  }
+void ListFamily::BLMPop(CmdArgList args, ConnectionContext* cntx) {
+  MPopGeneric(true, std::move(args), cntx);
 }
 
 void ListFamily::LLen(CmdArgList args, ConnectionContext* cntx) {
@@ -657,16 +869,36 @@ void ListFamily::LRange(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
+  // The shard writes the elements straight from the nodes into the reply buffer. The replier of
+  // the scripts converts the replies into lua values, so the shard writes into it directly.
+  ::io::StringSink sink;
+  RedisReplyBuilder local_rb(&sink);
+  bool under_script = cntx->conn_state.script_info.has_value();
+  RedisReplyBuilder* rb =
+      under_script ? static_cast<RedisReplyBuilder*>(cntx->reply_builder()) : &local_rb;
+
+  // A long range is left to SendRangeChunked.
+  uint32_t chunk = UINT32_MAX;
+  if (!under_script && cntx->transaction->CanRunChunked())
+    chunk = GetFlag(FLAGS_shard_chunk_elements);
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpRange(OpArgs{shard, t->db_index()}, key, start, end);
+    return OpRange(OpArgs{shard, t->db_index()}, key, start, end, rb, chunk);
   };
 
-  auto res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
-  if (!res && res.status() != OpStatus::KEY_NOTFOUND) {
-    return (*cntx)->SendError(res.status());
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status == OpStatus::SKIPPED) {
+    return SendRangeChunked(args, cntx, start, end, chunk);
+  }
+  if (status == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->StartArray(0);
+  }
+  if (status != OpStatus::OK) {
+    return (*cntx)->SendError(status);
   }
 
-  (*cntx)->SendStringArr(*res);
+  if (!under_script)
+    (*cntx)->SendRaw(sink.str());
 }
 
 // lrem key 5 foo, will remove foo elements from the list if exists at most 5 times.
@@ -725,26 +957,20 @@ void ListFamily::BRPop(CmdArgList args, ConnectionContext* cntx) {
 void ListFamily::BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx) {
   DCHECK_GE(args.size(), 3u);
 
-  float timeout;
-  auto timeout_str = ArgS(args, args.size() - 1);
-  if (!absl::SimpleAtof(timeout_str, &timeout)) {
-    return (*cntx)->SendError("timeout is not a float or out of range");
+  unsigned msec;
+  if (const char* err = ParseTimeout(ArgS(args, args.size() - 1), &msec)) {
+    return (*cntx)->SendError(err);
   }
-  if (timeout < 0) {
-    return (*cntx)->SendError("timeout is negative");
-  }
-  VLOG(1) << "BLPop start " << timeout;
+  VLOG(1) << "BLPop start " << msec;
 
   Transaction* transaction = cntx->transaction;
   BPopper popper(dir);
-  OpStatus result = popper.Run(transaction, unsigned(timeout * 1000));
+  OpStatus result = popper.Run(transaction, msec);
 
   if (result == OpStatus::OK) {
-    auto res = popper.result();
+    VLOG(1) << "BLPop returned from " << popper.key();
 
-    VLOG(1) << "BLPop returned from " << res.first;  // key.
-
-    std::string_view str_arr[2] = {res.first, res.second};
+    std::string_view str_arr[2] = {popper.key(), popper.values().front()};
 
     return (*cntx)->SendStringArr(str_arr);
   }
@@ -760,6 +986,100 @@ void ListFamily::BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cn
   return (*cntx)->SendNullArray();
 }
 
+// LMPOP numkeys key [key ...] LEFT|RIGHT [COUNT count]
+// BLMPOP timeout numkeys key [key ...] LEFT|RIGHT [COUNT count]
+void ListFamily::MPopGeneric(bool blocking, CmdArgList args, ConnectionContext* cntx) {
+  size_t num_pos = blocking ? 2 : 1;
+  uint32_t num_keys = 0;
+  CHECK(absl::SimpleAtoi(ArgS(args, num_pos), &num_keys));  // verified by DetermineKeys.
+
+  size_t dir_pos = num_pos + 1 + num_keys;
+  if (dir_pos >= args.size()) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  optional<ListDir> dir = ParseDir(args, dir_pos);
+  if (!dir) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  uint32_t count = 1;
+  if (dir_pos + 1 < args.size()) {
+    ToUpper(&args[dir_pos + 1]);
+    if (dir_pos + 3 != args.size() || ArgS(args, dir_pos + 1) != "COUNT") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    if (!absl::SimpleAtoi(ArgS(args, dir_pos + 2), &count) || count == 0) {
+      return (*cntx)->SendError("count should be greater than 0");
+    }
+  }
+
+  unsigned msec = 0;
+  if (blocking) {
+    if (const char* err = ParseTimeout(ArgS(args, 1), &msec)) {
+      return (*cntx)->SendError(err);
+    }
+  }
+
+  BPopper popper(*dir, count);
+  OpStatus result = popper.Run(cntx->transaction, msec, blocking);
+
+  switch (result) {
+    case OpStatus::OK:
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(popper.key());
+      return (*cntx)->SendStringArr(absl::Span<const string>{popper.values()});
+    case OpStatus::WRONG_TYPE:
+      return (*cntx)->SendError(kWrongTypeErr);
+    case OpStatus::TIMED_OUT:
+      return (*cntx)->SendNullArray();
+    default:
+      LOG(ERROR) << "Unexpected error " << result;
+  }
+  return (*cntx)->SendNullArray();
+}
+
+void ListFamily::MoveGeneric(string_view src, string_view dest, ListDir src_dir, ListDir dest_dir,
+                             ConnectionContext* cntx) {
+  Transaction* transaction = cntx->transaction;
+  OpResult<string> result;
+
+  if (transaction->unique_shard_cnt() == 1) {
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      return OpMoveSingleShard(OpArgs{shard, t->db_index()}, src, dest, src_dir, dest_dir);
+    };
+
+    result = transaction->ScheduleSingleHopT(std::move(cb));
+  } else {
+    CHECK_EQ(2u, transaction->unique_shard_cnt());
+
+    transaction->Schedule();
+    result = MoveScheduled(transaction, src, dest, src_dir, dest_dir, nullopt);
+  }
+
+  SendMoveResult(result, cntx);
+}
+
+void ListFamily::BMoveGeneric(string_view src, string_view dest, ListDir src_dir,
+                              ListDir dest_dir, string_view timeout_str, ConnectionContext* cntx) {
+  unsigned msec;
+  if (const char* err = ParseTimeout(timeout_str, &msec)) {
+    return (*cntx)->SendError(err);
+  }
+
+  using time_point = Transaction::time_point;
+  Transaction* transaction = cntx->transaction;
+
+  // Like BLPOP, does not block within MULTI.
+  optional<time_point> tp;
+  if (!transaction->IsMulti()) {
+    tp = msec ? chrono::steady_clock::now() + chrono::milliseconds(msec) : time_point::max();
+    transaction->Schedule();
+  }
+
+  SendMoveResult(MoveScheduled(transaction, src, dest, src_dir, dest_dir, tp), cntx);
+}
+
 void ListFamily::PushGeneric(ListDir dir, bool skip_notexists, CmdArgList args,
                              ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
@@ -1007,49 +1327,27 @@ OpStatus ListFamily::OpTrim(const OpArgs& op_args, string_view key, long start,
   return OpStatus::OK;
 }
 
-OpResult<StringVec> ListFamily::OpRange(const OpArgs& op_args, std::string_view key, long start,
-                                        long end) {
+OpStatus ListFamily::OpRange(const OpArgs& op_args, std::string_view key, long start, long end,
+                             RedisReplyBuilder* rb, uint32_t max_len) {
   auto res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_LIST);
   if (!res)
     return res.status();
 
   quicklist* ql = GetQL(res.value()->second);
-  long llen = quicklistCount(ql);
-
-  /* convert negative indexes */
-  if (start < 0)
-    start = llen + start;
-  if (end < 0)
-    end = llen + end;
-  if (start < 0)
-    start = 0;
-
-  /* Invariant: start >= 0, so this test will be true when end < 0.
-   * The range is empty when start > end or start >= length. */
-  if (start > end || start >= llen) {
+  if (!NormalizeRange(quicklistCount(ql), &start, &end)) {
     /* Out of range start or start > end result in empty list */
-    return StringVec{};
+    rb->StartArray(0);
+    return OpStatus::OK;
   }
 
-  if (end >= llen)
-    end = llen - 1;
-
   unsigned lrange = end - start + 1;
-  quicklistIter* qiter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, start);
-  quicklistEntry entry = QLEntry();
-  StringVec str_vec;
+  if (lrange > max_len)
+    return OpStatus::SKIPPED;
 
-  unsigned cnt = 0;
-  while (cnt < lrange && quicklistNext(qiter, &entry)) {
-    if (entry.value)
-      str_vec.emplace_back(reinterpret_cast<char*>(entry.value), entry.sz);
-    else
-      str_vec.push_back(absl::StrCat(entry.longval));
-    ++cnt;
-  }
-  quicklistReleaseIterator(qiter);
+  rb->StartArray(lrange);
+  SendRangeItems(ql, start, lrange, rb);
 
-  return str_vec;
+  return OpStatus::OK;
 }
 
 using CI = CommandId;
@@ -1064,8 +1362,16 @@ void ListFamily::Register(CommandRegistry* registry) {
             << CI{"RPUSHX", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(RPushX)
             << CI{"RPOP", CO::WRITE | CO::FAST | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(RPop)
             << CI{"RPOPLPUSH", CO::WRITE | CO::FAST | CO::DENYOOM, 3, 1, 2, 1}.HFUNC(RPopLPush)
+            << CI{"LMOVE", CO::WRITE | CO::FAST | CO::DENYOOM, 5, 1, 2, 1}.HFUNC(LMove)
+            << CI{"LMPOP", CO::WRITE | CO::FAST | CO::VARIADIC_KEYS, -4, 2, 2, 1}.HFUNC(LMPop)
             << CI{"BLPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BLPop)
             << CI{"BRPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BRPop)
+            << CI{"BRPOPLPUSH", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::DENYOOM, 4, 1, 2, 1}
+                   .HFUNC(BRPopLPush)
+            << CI{"BLMOVE", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::DENYOOM, 6, 1, 2, 1}
+                   .HFUNC(BLMove)
+            << CI{"BLMPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::VARIADIC_KEYS, -5, 3, 3, 1}
+                   .HFUNC(BLMPop)
             << CI{"LLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(LLen)
             << CI{"LINDEX", CO::READONLY, 3, 1, 1, 1}.HFUNC(LIndex)
             << CI{"LINSERT", CO::WRITE, 5, 1, 1, 1}.HFUNC(LInsert)
@@ -7,6 +7,10 @@
 #include "facade/op_status.h"
 #include "server/common.h"
 
+namespace facade {
+class RedisReplyBuilder;
+}  // namespace facade
+
 namespace dfly {
 
 using facade::OpResult;
@@ -19,6 +23,11 @@ class ListFamily {
  public:
   static void Register(CommandRegistry* registry);
 
+  // Appends the values to the list of key, creating it if needed. Must run in the shard thread
+  // of key. Returns the length of the list.
+  static OpResult<uint32_t> OpPushBack(const OpArgs& op_args, std::string_view key,
+                                       absl::Span<std::string_view> values);
+
  private:
   static void LPush(CmdArgList args, ConnectionContext* cntx);
   static void LPushX(CmdArgList args, ConnectionContext* cntx);
@@ -36,12 +45,22 @@ class ListFamily {
   static void LRem(CmdArgList args, ConnectionContext* cntx);
   static void LSet(CmdArgList args, ConnectionContext* cntx);
   static void RPopLPush(CmdArgList args, ConnectionContext* cntx);
+  static void LMove(CmdArgList args, ConnectionContext* cntx);
+  static void BRPopLPush(CmdArgList args, ConnectionContext* cntx);
+  static void BLMove(CmdArgList args, ConnectionContext* cntx);
+  static void LMPop(CmdArgList args, ConnectionContext* cntx);
+  static void BLMPop(CmdArgList args, ConnectionContext* cntx);
 
   static void PopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx);
   static void PushGeneric(ListDir dir, bool skip_notexist, CmdArgList args,
                           ConnectionContext* cntx);
 
   static void BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx);
+  static void MPopGeneric(bool blocking, CmdArgList args, ConnectionContext* cntx);
+  static void MoveGeneric(std::string_view src, std::string_view dest, ListDir src_dir,
+                          ListDir dest_dir, ConnectionContext* cntx);
+  static void BMoveGeneric(std::string_view src, std::string_view dest, ListDir src_dir,
+                           ListDir dest_dir, std::string_view timeout, ConnectionContext* cntx);
 
   static OpResult<uint32_t> OpLen(const OpArgs& op_args, std::string_view key);
   static OpResult<std::string> OpIndex(const OpArgs& op_args, std::string_view key, long index);
@@ -54,8 +73,11 @@ class ListFamily {
                                 long count);
   static facade::OpStatus OpTrim(const OpArgs& op_args, std::string_view key, long start, long end);
 
-  static OpResult<StringVec> OpRange(const OpArgs& op_args, std::string_view key, long start,
-                                     long end);
+  // Writes the elements of the range as an array into rb. Returns SKIPPED and writes nothing if
+  // the range has more than max_len elements.
+  static facade::OpStatus OpRange(const OpArgs& op_args, std::string_view key, long start,
+                                  long end, facade::RedisReplyBuilder* rb,
+                                  uint32_t max_len = UINT32_MAX);
 
 };
 
@@ -5,6 +5,7 @@
 #include "server/list_family.h"
 
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -17,6 +18,8 @@
 #include "server/transaction.h"
 #include "util/uring/uring_pool.h"
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 using namespace testing;
 using namespace std;
 using namespace util;
@@ -36,6 +39,19 @@ class ListFamilyTest : public BaseFamilyTest {
       this_fiber::sleep_for(30us);
     } while (!IsLocked(0, key));
   }
+
+  size_t NumBlocked() {
+    size_t res = 0;
+    for (const auto& tx : service_->server_family().GetMetrics().shard_tx)
+      res += tx.blocked_txs;
+    return res;
+  }
+
+  void WaitForBlocked(size_t num) {
+    for (unsigned i = 0; i < 1000 && NumBlocked() != num; ++i) {
+      this_fiber::sleep_for(1ms);
+    }
+  }
 };
 
 const char kKey1[] = "x";
@@ -404,6 +420,155 @@ TEST_F(ListFamilyTest, BPopFlush) {
   pop_fb.join();
 }
 
+TEST_F(ListFamilyTest, BLPopManyWaiters) {
+  constexpr unsigned kNumWaiters = 20;
+
+  vector<RespExpr> resp(kNumWaiters);
+  vector<fibers::fiber> fbs;
+  for (unsigned i = 0; i < kNumWaiters; ++i) {
+    fbs.push_back(pp_->at(i % num_threads_)->LaunchFiber([&, i] {
+      vector<string_view> args{"blpop", kKey1, "0"};
+      resp[i] = Run(absl::StrCat("w", i), args);
+    }));
+  }
+  WaitForBlocked(kNumWaiters);
+  ASSERT_EQ(kNumWaiters, NumBlocked());
+
+  // A single push serves all the waiters but one, the last push serves the rest.
+  vector<string> vals;
+  vector<string_view> push{"rpush", kKey1};
+  for (unsigned i = 0; i < kNumWaiters; ++i) {
+    vals.push_back(absl::StrCat(i));
+  }
+  for (unsigned i = 0; i + 1 < kNumWaiters; ++i) {
+    push.push_back(vals[i]);
+  }
+  pp_->at(1)->Await([&] { Run("pusher", push); });
+  WaitForBlocked(1);
+  EXPECT_EQ(1u, NumBlocked());
+  EXPECT_EQ(0, CheckedInt({"exists", kKey1}));
+
+  EXPECT_EQ(1, CheckedInt({"rpush", kKey1, vals.back()}));
+  for (auto& fb : fbs)
+    fb.join();
+
+  vector<string> popped;
+  for (const auto& r : resp) {
+    ASSERT_THAT(r, ArrLen(2));
+    EXPECT_EQ(r.GetVec()[0], kKey1);
+    popped.push_back(r.GetVec()[1].GetString());
+  }
+  EXPECT_THAT(popped, UnorderedElementsAreArray(vals));
+  EXPECT_EQ(0u, NumBlocked());
+  ASSERT_FALSE(IsLocked(0, kKey1));
+}
+
+TEST_F(ListFamilyTest, LMove) {
+  Run({"rpush", kKey1, "a", "b", "c"});
+  EXPECT_EQ(Run({"lmove", kKey1, kKey2, "LEFT", "RIGHT"}), "a");
+  EXPECT_EQ(Run({"lmove", kKey1, kKey2, "right", "left"}), "c");
+  EXPECT_THAT(Run({"lrange", kKey2, "0", "-1"}).GetVec(), ElementsAre("c", "a"));
+
+  // Rotates the list.
+  EXPECT_EQ(Run({"lmove", kKey2, kKey2, "LEFT", "RIGHT"}), "c");
+  EXPECT_THAT(Run({"lrange", kKey2, "0", "-1"}).GetVec(), ElementsAre("a", "c"));
+
+  EXPECT_EQ(Run({"lmove", kKey1, kKey3, "LEFT", "LEFT"}), "b");
+  EXPECT_EQ(0, CheckedInt({"exists", kKey1}));
+  EXPECT_THAT(Run({"lmove", kKey1, kKey3, "LEFT", "LEFT"}), ArgType(RespExpr::NIL));
+
+  Run({"set", kKey1, "foo"});
+  EXPECT_THAT(Run({"lmove", kKey3, kKey1, "LEFT", "LEFT"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"lmove", kKey3, kKey2, "UP", "LEFT"}), ErrArg("syntax error"));
+  EXPECT_EQ(1, CheckedInt({"llen", kKey3}));
+}
+
+TEST_F(ListFamilyTest, BLMove) {
+  RespExpr resp = Run({"blmove", kKey1, kKey2, "LEFT", "RIGHT", "0.01"});
+  EXPECT_THAT(resp, ArgType(RespExpr::NIL));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+
+  Run({"rpush", kKey1, "a"});
+  EXPECT_EQ(Run({"blmove", kKey1, kKey2, "LEFT", "RIGHT", "0"}), "a");
+
+  // The moved element serves the waiter on the destination.
+  RespExpr move_resp, pop_resp;
+  auto move_fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    move_resp = Run({"blmove", "x", "y", "RIGHT", "LEFT", "0"});
+  });
+  auto pop_fb = pp_->at(1)->LaunchFiber(fibers::launch::dispatch, [&] {
+    pop_resp = Run({"blpop", "z", "0"});
+  });
+  auto chain_fb = pp_->at(2)->LaunchFiber(fibers::launch::dispatch, [&] {
+    Run({"blmove", "y", "z", "LEFT", "LEFT", "0"});
+  });
+  WaitForBlocked(3);
+  ASSERT_EQ(3u, NumBlocked());
+
+  pp_->at(3)->Await([&] { EXPECT_EQ(2, CheckedInt({"rpush", "x", "b", "c"})); });
+  move_fb.join();
+  chain_fb.join();
+  pop_fb.join();
+
+  EXPECT_EQ(move_resp, "c");
+  ASSERT_THAT(pop_resp, ArrLen(2));
+  EXPECT_THAT(pop_resp.GetVec(), ElementsAre("z", "c"));
+  EXPECT_THAT(Run({"lrange", "x", "0", "-1"}).GetVec(), ElementsAre("b"));
+  EXPECT_EQ(0, CheckedInt({"exists", "y", "z"}));
+  ASSERT_FALSE(IsLocked(0, "y"));
+}
+
+TEST_F(ListFamilyTest, LMPop) {
+  Run({"rpush", "y", "a", "b", "c"});
+  RespExpr resp = Run({"lmpop", "2", "x", "y", "LEFT", "COUNT", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], "y");
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("a", "b"));
+
+  resp = Run({"lmpop", "2", kKey3, "y", "right", "count", "5"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("c"));
+
+  EXPECT_THAT(Run({"lmpop", "1", "y", "LEFT"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"lmpop", "1", "y", "UP"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"lmpop", "1", "y", "LEFT", "COUNT", "0"}), ErrArg("greater than 0"));
+  EXPECT_THAT(Run({"lmpop", "2", "y", "LEFT"}), ErrArg("syntax error"));
+  ASSERT_FALSE(IsLocked(0, "y"));
+}
+
+TEST_F(ListFamilyTest, BLMPop) {
+  EXPECT_THAT(Run({"blmpop", "0.01", "2", kKey1, kKey2, "LEFT"}), ArgType(RespExpr::NIL_ARRAY));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+
+  RespExpr resp;
+  auto pop_fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmpop", "0", "2", "x", "y", "RIGHT", "COUNT", "5"});
+  });
+  WaitForLocked("y");
+
+  pp_->at(1)->Await([&] { EXPECT_EQ(3, CheckedInt({"rpush", "y", "1", "2", "3"})); });
+  pop_fb.join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], "y");
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("3", "2", "1"));
+  EXPECT_EQ(0, CheckedInt({"exists", "y"}));
+  ASSERT_FALSE(IsLocked(0, "x"));
+
+  // The keys of multiple shards.
+  pop_fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmpop", "0", "2", kKey1, kKey2, "LEFT"});
+  });
+  WaitForLocked(kKey1);
+
+  pp_->at(1)->Await([&] { EXPECT_EQ(2, CheckedInt({"rpush", kKey2, "a", "b"})); });
+  pop_fb.join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[0], kKey2);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("a"));
+}
+
 TEST_F(ListFamilyTest, LRem) {
   auto resp = Run({"rpush", kKey1, "a", "b", "a", "c"});
   ASSERT_THAT(resp, IntArg(4));
@@ -433,6 +598,43 @@ TEST_F(ListFamilyTest, LRange) {
 
   ASSERT_THAT(resp, ArrLen(2));
   ASSERT_THAT(resp.GetVec(), ElementsAre("1", "2"));
+
+  resp = Run({"lrange", kKey1, "5", "10"});
+  ASSERT_THAT(resp, ArrLen(0));
+
+  Run({"rpush", kKey1, "foo", "-42"});
+  resp = Run({"lrange", kKey1, "1", "-1"});
+  ASSERT_THAT(resp.GetVec(), ElementsAre("1", "2", "foo", "-42"));
+
+  Run({"set", kKey2, "bar"});
+  ASSERT_THAT(Run({"lrange", kKey2, "0", "1"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(ListFamilyTest, LRangeChunked) {
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 10);
+
+  vector<string> elems;
+  for (unsigned i = 0; i < 105; ++i) {
+    elems.push_back(absl::StrCat(i));
+  }
+  vector<string_view> args{"rpush", kKey1};
+  args.insert(args.end(), elems.begin(), elems.end());
+  Run(absl::MakeSpan(args));
+
+  auto vec = Run({"lrange", kKey1, "0", "-1"}).GetVec();
+  ASSERT_EQ(105u, vec.size());
+  for (unsigned i = 0; i < vec.size(); ++i) {
+    EXPECT_EQ(vec[i], elems[i]);
+  }
+
+  vec = Run({"lrange", kKey1, "-30", "-5"}).GetVec();
+  ASSERT_EQ(26u, vec.size());
+  EXPECT_EQ(vec.front(), "75");
+  EXPECT_EQ(vec.back(), "100");
+
+  EXPECT_THAT(Run({"lrange", kKey1, "3", "5"}).GetVec(), ElementsAre("3", "4", "5"));
+
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 16384);
 }
 
 TEST_F(ListFamilyTest, Lset) {
@@ -9,7 +9,9 @@ extern "C" {
 }
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_format.h>
 #include <xxhash.h>
 
@@ -20,10 +22,13 @@ extern "C" {
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/error.h"
+#include "server/bloom_family.h"
 #include "server/conn_context.h"
 #include "server/error.h"
 #include "server/generic_family.h"
+#include "server/hll_family.h"
 #include "server/hset_family.h"
+#include "server/json_family.h"
 #include "server/list_family.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
@@ -48,7 +53,35 @@ ABSL_FLAG(bool, cache_mode, false,
           "If true, the backend behaves like a cache, "
           "by evicting entries when getting close to maxmemory limit");
 
+ABSL_FLAG(bool, multi_exec_squash, false,
+          "If true, EXEC locks the keys of all the queued commands upfront and runs them "
+          "with a single hop per shard when each of them touches a single shard");
+
+ABSL_FLAG(bool, lua_run_in_shard, false,
+          "If true, scripts whose keys reside in a single shard run within that shard thread. "
+          "Such scripts can not call keyless commands");
+
+ABSL_FLAG(uint64_t, lua_script_max_memory, 0,
+          "Memory in bytes that a script may allocate in its interpreter beyond what it held "
+          "before the script started. A script that exceeds it fails. 0 - no limit");
+
+ABSL_FLAG(uint32_t, interpreter_per_thread, 4,
+          "Lua interpreters per thread. A script holds its interpreter while it waits for the "
+          "commands it calls, so this is how many scripts of a thread may run at once");
+
+ABSL_FLAG(uint32_t, num_shards, 0,
+          "Number of shards the keyspace is partitioned into. Shards occupy the first threads, "
+          "the rest of the threads handle connections only. 0 - one thread less than the number "
+          "of threads, capped by the number of threads");
+
+ABSL_FLAG(int64_t, slowlog_log_slower_than, 10000,
+          "Commands that take longer than this number of microseconds are logged by SLOWLOG. "
+          "Negative value disables the log, 0 logs all the commands");
+ABSL_FLAG(uint32_t, slowlog_max_len, 128,
+          "Maximal number of the SLOWLOG entries kept by each thread");
+
 ABSL_DECLARE_FLAG(string, requirepass);
+ABSL_DECLARE_FLAG(string, maxmemory_policy);
 
 namespace dfly {
 
@@ -260,6 +293,19 @@ void InterpreterReplier::StartArray(unsigned len) {
   }
 }
 
+// Accounts a run of the script in the stats of the current thread.
+void RecordScriptRun(string_view sha, uint64_t start_ns, unsigned shards,
+                     const Interpreter::RunStats& run) {
+  uint64_t usec = (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000;
+  ScriptStats& stats = ServerState::tlocal()->script_stats[sha];
+  stats.calls++;
+  stats.total_usec += usec;
+  stats.max_usec = max(stats.max_usec, usec);
+  stats.redis_calls += run.redis_calls;
+  stats.shards += shards;
+  stats.allocated_bytes += run.allocated_bytes;
+}
+
 bool IsSHA(string_view str) {
   for (auto c : str) {
     if (!absl::ascii_isxdigit(c))
@@ -339,6 +385,75 @@ void TxTable(const http::QueryArgs& args, HttpContext* send) {
   send->Invoke(std::move(resp));
 }
 
+// Returns the state of a watched key as EXEC compares it. The bucket versions only grow, even
+// when the entries move, and every update bumps the version of the bucket, hence a changed key
+// always has a different state. Changes to the neighbours of the key in its bucket are reported
+// too, which aborts EXEC needlessly but safely. The lookup does not count as an access.
+ConnectionState::WatchedKey GetWatchedKey(EngineShard* shard, DbIndex db_index,
+                                           string_view key) {
+  ConnectionState::WatchedKey res{db_index, string{key}, false, 0};
+  DbSlice& db_slice = shard->db_slice();
+  if (!db_slice.IsDbValid(db_index))
+    return res;
+
+  PrimeIterator it = db_slice.GetTables(db_index).first->Find(key);
+  if (IsValid(it) && it->second.HasExpire())
+    it = db_slice.ExpireIfNeeded(db_index, it).first;
+  if (IsValid(it)) {
+    res.exists = true;
+    res.version = it.GetVersion();
+  }
+  return res;
+}
+
+// Read commands of the connections that track keys in the default mode register their keys.
+void SetupTracking(const ConnectionState& state, const CommandId* cid, Transaction* trans) {
+  const auto& info = state.tracking_info;
+  if (info && !info->bcast && (cid->opt_mask() & CO::READONLY))
+    trans->SetTrackingTarget(info->target);
+}
+
+// Sends the message to the subscribers of the lists. Each thread with subscribers gets a single
+// callback that sends the message to all its subscribers. The counter is also held by the
+// callbacks, so that the lists stay alive until the callbacks finish. Returns the number of the
+// subscribers once all the messages are sent.
+size_t SendToSubscribers(const vector<ChannelSlice::SubscriberListPtr>& lists,
+                         const facade::Connection::PubMessage& msg) {
+  size_t published = 0;
+  fibers_ext::BlockingCounter bc{0};
+  unsigned num_threads = shard_set->pool()->size();
+
+  for (unsigned tid = 0; tid < num_threads; ++tid) {
+    size_t count = 0;
+    for (const auto& list : lists) {
+      count += list->ThreadRange(tid).size();
+    }
+    if (count == 0)
+      continue;
+
+    published += count;
+    bc.Add(count + 1);
+
+    auto publish_cb = [&lists, tid, &msg, bc]() mutable {
+      for (const auto& list : lists) {
+        for (const ChannelSlice::Subscriber& subscriber : list->ThreadRange(tid)) {
+          facade::Connection* conn = subscriber.conn_cntx->owner();
+          DCHECK(conn);
+          facade::Connection::PubMessage pmsg = msg;
+          pmsg.pattern = list->pattern;
+          conn->SendMsgVecAsync(pmsg, bc);
+        }
+      }
+      bc.Dec();
+    };
+
+    shard_set->pool()->at(tid)->DispatchBrief(std::move(publish_cb));
+  }
+
+  bc.Wait();  // Wait for all the messages to be sent.
+  return published;
+}
+
 }  // namespace
 
 Service::Service(ProactorPool* pp) : pp_(*pp), server_family_(this) {
@@ -360,19 +475,24 @@ Service::~Service() {
   shard_set = nullptr;
 }
 
-void Service::Init(util::AcceptServer* acceptor, util::ListenerInterface* main_interface,
+void Service::Init(util::AcceptServer* acceptor, std::vector<util::ListenerInterface*> listeners,
                    const InitOpts& opts) {
   InitRedisTables();
 
   pp_.AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) { ServerState::tlocal()->Init(); });
 
   uint32_t shard_num = pp_.size() > 1 ? pp_.size() - 1 : pp_.size();
+  if (uint32_t num_shards = GetFlag(FLAGS_num_shards); num_shards > 0) {
+    LOG_IF(WARNING, num_shards > pp_.size())
+        << "num_shards " << num_shards << " exceeds the number of threads " << pp_.size();
+    shard_num = min<uint32_t>(num_shards, pp_.size());
+  }
   shard_set->Init(shard_num, !opts.disable_time_update);
 
   request_latency_usec.Init(&pp_);
   StringFamily::Init(&pp_);
   GenericFamily::Init(&pp_);
-  server_family_.Init(acceptor, main_interface);
+  server_family_.Init(acceptor, std::move(listeners));
 }
 
 void Service::Shutdown() {
@@ -387,6 +507,7 @@ void Service::Shutdown() {
 
   // to shutdown all the runtime components that depend on EngineShard.
   server_family_.Shutdown();
+  cluster_family_.Shutdown();
   StringFamily::Shutdown();
   GenericFamily::Shutdown();
 
@@ -411,7 +532,8 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
   VLOG(2) << "Got: " << args;
 
   string_view cmd_str = ArgS(args, 0);
-  bool is_trans_cmd = (cmd_str == "EXEC" || cmd_str == "MULTI" || cmd_str == "DISCARD");
+  bool is_trans_cmd =
+      (cmd_str == "EXEC" || cmd_str == "MULTI" || cmd_str == "DISCARD" || cmd_str == "WATCH");
   const CommandId* cid = registry_.Find(cmd_str);
   ServerState& etl = *ServerState::tlocal();
 
@@ -474,6 +596,22 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
+  // The keys of the script calls are checked by EVAL.
+  if (cluster_family_.IsEnabled() && !dfly_cntx->is_replicating && !under_script) {
+    string error = cluster_family_.CheckKeys(cid, args, dfly_cntx);
+    if (!error.empty()) {
+      string_view type = absl::StartsWith(error, "-MOVED") ? "MOVED" : "";
+      return (*cntx)->SendError(error, type);
+    }
+  }
+
+  // The other policies free memory by evicting, see DbSlice::EvictionStep.
+  if ((cid->opt_mask() & CO::DENYOOM) && max_memory_limit > 0 && !dfly_cntx->is_replicating &&
+      used_mem_current.load(memory_order_relaxed) > max_memory_limit &&
+      !GetFlag(FLAGS_cache_mode) && GetFlag(FLAGS_maxmemory_policy) == "noeviction") {
+    return (*cntx)->SendError(kOutOfMemory);
+  }
+
   if (under_multi) {
     if (cid->opt_mask() & CO::ADMIN) {
       (*cntx)->SendError("Can not run admin commands under transactions");
@@ -507,7 +645,7 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
   // Create command transaction
   intrusive_ptr<Transaction> dist_trans;
 
-  if (under_script) {
+  if (under_script && dfly_cntx->conn_state.script_info->atomic) {
     DCHECK(dfly_cntx->transaction);
     if (IsTransactional(cid)) {
       OpResult<KeyIndex> key_index_res = DetermineKeys(cid, args);
@@ -530,11 +668,26 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     DCHECK(dfly_cntx->transaction == nullptr);
 
     if (IsTransactional(cid)) {
-      dist_trans.reset(new Transaction{cid});
+      if (under_script) {  // a call of a non-atomic script runs as a standalone command.
+        OpResult<KeyIndex> key_index_res = DetermineKeys(cid, args);
+        if (!key_index_res)
+          return (*cntx)->SendError(key_index_res.status());
+
+        for (unsigned i = key_index_res->start; i < key_index_res->end; ++i) {
+          if (!dfly_cntx->conn_state.script_info->keys.contains(ArgS(args, i))) {
+            return (*cntx)->SendError("script tried accessing undeclared key");
+          }
+        }
+      }
+
+      dist_trans.reset(Transaction::New(cid));
       OpStatus st = dist_trans->InitByArgs(dfly_cntx->conn_state.db_index, args);
       if (st != OpStatus::OK)
         return (*cntx)->SendError(st);
 
+      SetupTracking(dfly_cntx->conn_state, cid, dist_trans.get());
+      dist_trans->SetTraceId(cntx->trace_id);
+
       dfly_cntx->transaction = dist_trans.get();
       dfly_cntx->last_command_debug.shards_count = dfly_cntx->transaction->unique_shard_cnt();
     } else {
@@ -544,6 +697,7 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
 
   dfly_cntx->cid = cid;
 
+  uint64_t send_ns = cntx->reply_builder()->send_ns();
   cid->Invoke(args, dfly_cntx);
   end_usec = ProactorBase::GetMonotonicTimeNs();
 
@@ -551,10 +705,248 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
   if (dist_trans) {
     dfly_cntx->last_command_debug.clock = dist_trans->txid();
     dfly_cntx->last_command_debug.is_ooo = dist_trans->IsOOO();
+
+    if (dist_trans->unique_shard_cnt() == 1) {
+      ShardId sid = dist_trans->unique_shard_id();
+      dfly_cntx->shard_affinity.Record(sid, int32_t(sid) == ProactorBase::GetIndex());
+    }
   }
 
   if (!under_script) {
+    uint64_t duration_usec = (end_usec - start_usec) / 1000;
+    uint64_t stage_usec[size_t(TxStage::NUM_STAGES)] = {0};
+    stage_usec[size_t(TxStage::PARSE)] = cntx->parse_ns / 1000;
+    if (dist_trans) {
+      stage_usec[size_t(TxStage::SCHEDULE)] = dist_trans->schedule_ns() / 1000;
+      stage_usec[size_t(TxStage::QUEUE)] = dist_trans->queue_ns() / 1000;
+      stage_usec[size_t(TxStage::LOCK)] = dist_trans->lock_ns() / 1000;
+      stage_usec[size_t(TxStage::EXEC)] = dist_trans->exec_ns() / 1000;
+    }
+    stage_usec[size_t(TxStage::REPLY)] = (cntx->reply_builder()->send_ns() - send_ns) / 1000;
+
+    CmdLatencyStats& stats = ServerState::tlocal()->cmd_latency[cid->name()];
+    stats.total.Add(duration_usec);
+    if (cntx->parse_ns)
+      stats[TxStage::PARSE].Add(stage_usec[size_t(TxStage::PARSE)]);
+    if (dist_trans) {
+      for (TxStage stage : {TxStage::SCHEDULE, TxStage::QUEUE, TxStage::LOCK, TxStage::EXEC})
+        stats[stage].Add(stage_usec[size_t(stage)]);
+    }
+    stats[TxStage::REPLY].Add(stage_usec[size_t(TxStage::REPLY)]);
+
+    int64_t slower_than = GetFlag(FLAGS_slowlog_log_slower_than);
+    if (slower_than >= 0 && duration_usec >= uint64_t(slower_than)) {
+      SlowLogEntry entry;
+      entry.id = SlowLog::NextId();
+      entry.unix_ts = time(nullptr);
+      entry.duration_usec = duration_usec;
+      entry.args = SlowLog::TruncateArgs(args);
+      if (cntx->owner()) {
+        entry.client_addr = cntx->owner()->RemoteEndpointStr();
+        entry.client_name = cntx->owner()->GetName();
+      }
+      copy(begin(stage_usec), end(stage_usec), entry.stage_usec);
+
+      ServerState::tlocal()->slowlog.Add(std::move(entry), GetFlag(FLAGS_slowlog_max_len));
+    }
+  }
+
+  if (dist_trans)
     dfly_cntx->transaction = nullptr;
+}
+
+namespace {
+
+// Commands of a squashed batch that run within the same shard.
+struct ShardBatch {
+  ::io::StringSink sink;  // replies of the executed commands.
+  unique_ptr<ConnectionContext> cntx;
+  vector<unsigned> cmds;
+};
+
+}  // namespace
+
+struct Service::SquashedCmd {
+  const CommandId* cid;
+  CmdArgList args;
+  intrusive_ptr<Transaction> trans;
+
+  // Set if the command was executed within its shard. Its reply is stored in the reply buffer
+  // of the shard at [reply_start, reply_end).
+  bool executed = false;
+  size_t reply_start = 0;
+  size_t reply_end = 0;
+};
+
+void Service::DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                                   facade::ConnectionContext* cntx) {
+  ConnectionContext* dfly_cntx = static_cast<ConnectionContext*>(cntx);
+  vector<SquashedCmd> squashed;
+
+  for (CmdArgList args : args_list) {
+    if (cntx->reply_builder()->GetError())
+      return;
+
+    ToUpper(&args[0]);
+    const CommandId* cid = registry_.Find(ArgS(args, 0));
+    if (CanSquash(cid, args, dfly_cntx)) {
+      squashed.push_back(SquashedCmd{cid, args});
+      continue;
+    }
+
+    DispatchSquashed(absl::MakeSpan(squashed), dfly_cntx);
+    squashed.clear();
+    DispatchCommand(args, cntx);
+  }
+
+  DispatchSquashed(absl::MakeSpan(squashed), dfly_cntx);
+}
+
+bool Service::CanSquash(const CommandId* cid, CmdArgList args,
+                        const ConnectionContext* cntx) const {
+  // Blocking, global and multi-key commands need the coordination of the regular flow.
+  constexpr uint32_t kExcludedMask =
+      CO::BLOCKING | CO::GLOBAL_TRANS | CO::ADMIN | CO::VARIADIC_KEYS;
+
+  if (!cid || (cid->opt_mask() & kExcludedMask) || cid->first_key_pos() <= 0 ||
+      cid->is_multi_key()) {
+    return false;
+  }
+
+  // The checks of DispatchCommand. Failing commands are dispatched regularly to report errors.
+  if ((cid->arity() > 0 && args.size() != size_t(cid->arity())) ||
+      (cid->arity() < 0 && args.size() < size_t(-cid->arity()))) {
+    return false;
+  }
+
+  const ServerState& etl = *ServerState::tlocal();
+  if (etl.gstate() != GlobalState::ACTIVE || (cntx->req_auth && !cntx->authenticated))
+    return false;
+
+  if (!etl.is_master && (cid->opt_mask() & CO::WRITE) && !cntx->is_replicating)
+    return false;
+
+  // The commands on the slots of other nodes or on migrating ones are redirected.
+  if (cluster_family_.IsEnabled()) {
+    string_view key = ArgS(args, cid->first_key_pos());
+    if (cntx->conn_state.cluster_asking || !cluster_family_.IsKeyServed(key))
+      return false;
+  }
+
+  return cntx->conn_state.exec_state == ConnectionState::EXEC_INACTIVE &&
+         !cntx->conn_state.script_info;
+}
+
+void Service::DispatchSquashed(absl::Span<SquashedCmd> cmds, ConnectionContext* cntx) {
+  if (cmds.size() < 2) {
+    for (const SquashedCmd& cmd : cmds) {
+      DispatchCommand(cmd.args, cntx);
+    }
+    return;
+  }
+
+  vector<ShardBatch> batches(shard_set->size());
+  for (unsigned i = 0; i < cmds.size(); ++i) {
+    SquashedCmd& cmd = cmds[i];
+    cmd.trans.reset(Transaction::New(cmd.cid));
+
+    // The regular dispatch reports the error.
+    if (cmd.trans->InitByArgs(cntx->conn_state.db_index, cmd.args) != OpStatus::OK) {
+      cmd.trans.reset();
+      continue;
+    }
+
+    DCHECK_EQ(1u, cmd.trans->unique_shard_cnt());
+    SetupTracking(cntx->conn_state, cmd.cid, cmd.trans.get());
+    cmd.trans->SetInline();
+    batches[cmd.trans->unique_shard_id()].cmds.push_back(i);
+  }
+
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  fibers_ext::BlockingCounter bc{0};
+
+  for (ShardId sid = 0; sid < batches.size(); ++sid) {
+    ShardBatch& batch = batches[sid];
+    if (batch.cmds.empty())
+      continue;
+
+    batch.cntx.reset(new ConnectionContext{&batch.sink, cntx->owner()});
+    batch.cntx->conn_state.db_index = cntx->conn_state.db_index;
+
+    auto cb = [&batch, cmds, bc]() mutable {
+      EngineShard* shard = EngineShard::tlocal();
+      DbSlice& db_slice = shard->db_slice();
+
+      for (unsigned i : batch.cmds) {
+        SquashedCmd& cmd = cmds[i];
+        IntentLock::Mode mode = cmd.trans->Mode();
+        KeyLockArgs lock_args = cmd.trans->GetLockArgs(shard->shard_id());
+
+        // The command conflicts with a scheduled transaction. It and the rest of the commands
+        // of this shard are dispatched regularly, which preserves their order.
+        if (!shard->shard_lock()->Check(mode) || !db_slice.CheckLock(mode, lock_args))
+          break;
+
+        db_slice.Acquire(mode, lock_args);
+        batch.cntx->transaction = cmd.trans.get();
+        batch.cntx->cid = cmd.cid;
+
+        cmd.reply_start = batch.sink.str().size();
+        cmd.cid->Invoke(cmd.args, batch.cntx.get());
+        cmd.reply_end = batch.sink.str().size();
+        cmd.executed = true;
+
+        db_slice.Release(mode, lock_args);
+        shard->IncQuickRun();
+      }
+      batch.cntx->transaction = nullptr;
+      bc.Dec();
+    };
+
+    bc.Add(1);
+    shard_set->Add(sid, std::move(cb));
+  }
+  bc.Wait();
+
+  uint64_t cmd_usec = (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000 / cmds.size();
+  ServerState& etl = *ServerState::tlocal();
+  SinkReplyBuilder* builder = cntx->reply_builder();
+  absl::InlinedVector<string_view, 16> replies;
+
+  for (SquashedCmd& cmd : cmds) {
+    if (!cmd.executed) {
+      if (!replies.empty()) {
+        builder->SendRawVec(replies);
+        replies.clear();
+      }
+      cmd.trans.reset();
+      DispatchCommand(cmd.args, cntx);
+      continue;
+    }
+
+    const string& buf = batches[cmd.trans->unique_shard_id()].sink.str();
+    replies.emplace_back(buf.data() + cmd.reply_start, cmd.reply_end - cmd.reply_start);
+
+    etl.RecordCmd();
+    etl.connection_stats.cmd_count_map[cmd.cid->name()]++;
+    request_latency_usec.IncBy(cmd.cid->name(), cmd_usec);
+    etl.cmd_latency[cmd.cid->name()].total.Add(cmd_usec);
+    cntx->last_command_debug.shards_count = 1;
+
+    ShardId sid = cmd.trans->unique_shard_id();
+    cntx->shard_affinity.Record(sid, int32_t(sid) == ProactorBase::GetIndex());
+  }
+
+  if (!replies.empty()) {
+    builder->SendRawVec(replies);
+  }
+
+  for (const ShardBatch& batch : batches) {
+    if (!batch.cntx)
+      continue;
+    for (const auto& k_v : batch.cntx->reply_builder()->err_count()) {
+      etl.connection_stats.err_count_map[k_v.first] += k_v.second;
+    }
   }
 }
 
@@ -567,6 +959,7 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
   char ttl_op[] = "EX";
 
   MCReplyBuilder* mc_builder = static_cast<MCReplyBuilder*>(cntx->reply_builder());
+  ConnectionContext* dfly_cntx = static_cast<ConnectionContext*>(cntx);
 
   switch (cmd.type) {
     case MemcacheParser::REPLACE:
@@ -580,6 +973,10 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       strcpy(cmd_name, "SET");
       strcpy(store_opt, "NX");
       break;
+    case MemcacheParser::CAS:
+      strcpy(cmd_name, "SET");
+      dfly_cntx->conn_state.memcache_cas = cmd.cas_unique;
+      break;
     case MemcacheParser::DELETE:
       strcpy(cmd_name, "DEL");
       break;
@@ -598,6 +995,7 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       strcpy(cmd_name, "PREPEND");
       break;
     case MemcacheParser::GET:
+    case MemcacheParser::GETS:
       strcpy(cmd_name, "MGET");
       break;
     case MemcacheParser::FLUSHALL:
@@ -612,6 +1010,9 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
     case MemcacheParser::VERSION:
       mc_builder->SendSimpleString(StrCat("VERSION ", kGitTag));
       return;
+    case MemcacheParser::META_NOOP:
+      mc_builder->SendSimpleString("MN");
+      return;
     default:
       mc_builder->SendClientError("bad command line format");
       return;
@@ -624,8 +1025,6 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
     args.emplace_back(key, cmd.key.size());
   }
 
-  ConnectionContext* dfly_cntx = static_cast<ConnectionContext*>(cntx);
-
   if (MemcacheParser::IsStoreCmd(cmd.type)) {
     char* v = const_cast<char*>(value.data());
     args.emplace_back(v, value.size());
@@ -645,16 +1044,27 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       char* key = const_cast<char*>(s.data());
       args.emplace_back(key, s.size());
     }
+    if (cmd.type == MemcacheParser::GETS || (cmd.meta_flags & MemcacheParser::META_CAS))
+      dfly_cntx->conn_state.memcache_flag |= ConnectionState::FETCH_CAS_VER;
+    if (cmd.meta_flags & MemcacheParser::META_TTL)
+      dfly_cntx->conn_state.memcache_flag |= ConnectionState::FETCH_TTL;
   } else {  // write commands.
     if (store_opt[0]) {
       args.emplace_back(store_opt, strlen(store_opt));
     }
   }
 
+  if (cmd.meta)
+    mc_builder->SetMetaCommand(&cmd);
+  mc_builder->SetNoReply(cmd.no_reply);
+
   DispatchCommand(CmdArgList{args}, cntx);
 
   // Reset back.
+  mc_builder->SetMetaCommand(nullptr);
+  mc_builder->SetNoReply(false);
   dfly_cntx->conn_state.memcache_flag = 0;
+  dfly_cntx->conn_state.memcache_cas.reset();
 }
 
 facade::ConnectionContext* Service::CreateContext(util::FiberSocketBase* peer,
@@ -726,8 +1136,131 @@ void Service::Multi(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendOk();
 }
 
+void Service::EvalInShard(const EvalArgs& eval_args, const char* body, ConnectionContext* cntx) {
+  ::io::StringSink sink;  // the serialized result of the script.
+  ConnectionContext local_cntx{&sink, cntx->owner()};
+  local_cntx.conn_state.db_index = cntx->conn_state.db_index;
+  local_cntx.is_replicating = cntx->is_replicating;
+
+  const auto& keys = cntx->conn_state.script_info->keys;
+  Interpreter::RunResult result;
+  string error;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    Interpreter& interpreter = ServerState::tlocal()->GetShardInterpreter();
+    if (!interpreter.Exists(eval_args.sha)) {
+      string res;
+      CHECK_EQ(Interpreter::ADD_OK, interpreter.AddFunction(body, &res));
+      CHECK_EQ(res, eval_args.sha);
+    }
+
+    auto lk = interpreter.Lock();
+
+    interpreter.SetGlobalArray("KEYS", eval_args.keys);
+    interpreter.SetGlobalArray("ARGV", eval_args.args);
+    interpreter.SetRedisFunc([&](CmdArgList args, ObjectExplorer* reply) {
+      CallFromShard(args, keys, reply, &local_cntx);
+    });
+
+    interpreter.SetMemoryBudget(GetFlag(FLAGS_lua_script_max_memory));
+    uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+    result = interpreter.RunFunction(eval_args.sha, &error);
+    RecordScriptRun(eval_args.sha, start_ns, 1, interpreter.last_run_stats());
+
+    if (result == Interpreter::RUN_OK) {
+      EvalSerializer ser{static_cast<RedisReplyBuilder*>(local_cntx.reply_builder())};
+
+      if (!interpreter.IsResultSafe()) {
+        local_cntx->SendError("reached lua stack limit");
+      } else {
+        interpreter.SerializeResult(&ser);
+      }
+    }
+    interpreter.ResetStack();
+
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Execute(std::move(cb), true);
+
+  if (result == Interpreter::RUN_ERR) {
+    string resp = StrCat("Error running script (call to ", eval_args.sha, "): ", error);
+    return (*cntx)->SendError(resp, facade::kScriptErrType);
+  }
+
+  CHECK(result == Interpreter::RUN_OK);
+  (*cntx)->SendRaw(sink.str());
+}
+
+void Service::CallFromShard(CmdArgList args, const absl::flat_hash_set<string_view>& keys,
+                            ObjectExplorer* reply, ConnectionContext* cntx) {
+  InterpreterReplier replier(reply);
+  facade::SinkReplyBuilder* orig = cntx->Inject(&replier);
+  absl::Cleanup restore([cntx, orig] { cntx->Inject(orig); });
+
+  ToUpper(&args[0]);
+  string_view cmd_str = ArgS(args, 0);
+  const CommandId* cid = registry_.Find(cmd_str);
+
+  if (cid == nullptr) {
+    return (*cntx)->SendError(StrCat("unknown command `", cmd_str, "`"), "unknown_cmd");
+  }
+
+  if (cid->opt_mask() & CO::NOSCRIPT) {
+    return (*cntx)->SendError("This Redis command is not allowed from script");
+  }
+
+  // Keyless and global commands may hop to other shards, which blocks this one.
+  if (cid->first_key_pos() <= 0 || (cid->opt_mask() & (CO::BLOCKING | CO::GLOBAL_TRANS))) {
+    return (*cntx)->SendError("This Redis command is not allowed from script that runs in shard");
+  }
+
+  if ((cid->arity() > 0 && args.size() != size_t(cid->arity())) ||
+      (cid->arity() < 0 && args.size() < size_t(-cid->arity())) ||
+      (cid->key_arg_step() == 2 && (args.size() % 2) == 0)) {
+    return (*cntx)->SendError(facade::WrongNumArgsError(cmd_str), kSyntaxErrType);
+  }
+
+  const ServerState& etl = *ServerState::tlocal();
+  if (!etl.is_master && (cid->opt_mask() & CO::WRITE) && !cntx->is_replicating) {
+    return (*cntx)->SendError("-READONLY You can't write against a read only replica.");
+  }
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return (*cntx)->SendError(key_index.status());
+
+  auto is_declared = [&](unsigned i) { return keys.contains(ArgS(args, i)); };
+  bool declared = !key_index->bonus || is_declared(key_index->bonus);
+  for (unsigned i = key_index->start; declared && i < key_index->end; i += key_index->step) {
+    declared = is_declared(i);
+  }
+
+  if (!declared) {
+    return (*cntx)->SendError("script tried accessing undeclared key");
+  }
+
+  if (!cid->Validate(args, cntx))
+    return;
+
+  // The keys are declared, hence they are locked by the script transaction and reside here.
+  intrusive_ptr<Transaction> trans{Transaction::New(cid)};
+  OpStatus st = trans->InitByArgs(cntx->conn_state.db_index, args);
+  if (st != OpStatus::OK)
+    return (*cntx)->SendError(st);
+
+  DCHECK_EQ(1u, trans->unique_shard_cnt());
+  DCHECK_EQ(EngineShard::tlocal()->shard_id(), trans->unique_shard_id());
+  trans->SetInline();
+
+  cntx->transaction = trans.get();
+  cntx->cid = cid;
+  cid->Invoke(args, cntx);
+  cntx->transaction = nullptr;
+}
+
 void Service::CallFromScript(CmdArgList args, ObjectExplorer* reply, ConnectionContext* cntx) {
-  DCHECK(cntx->transaction);
+  DCHECK(cntx->transaction || !cntx->conn_state.script_info->atomic);
   InterpreterReplier replier(reply);
   facade::SinkReplyBuilder* orig = cntx->Inject(&replier);
 
@@ -748,11 +1281,17 @@ void Service::Eval(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendNull();
   }
 
+  string result;
+  ScriptMgr::ScriptParams params;
+  if (!ScriptMgr::ParseParams(body, &params, &result)) {
+    return (*cntx)->SendError(result);
+  }
+
   ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
+  Interpreter* script = ss->BorrowInterpreter();
+  absl::Cleanup clean = [ss, script] { ss->ReturnInterpreter(script); };
 
-  string result;
-  Interpreter::AddResult add_result = script.AddFunction(body, &result);
+  Interpreter::AddResult add_result = script->AddFunction(body, &result);
   if (add_result == Interpreter::COMPILE_ERR) {
     return (*cntx)->SendError(result, facade::kScriptErrType);
   }
@@ -765,7 +1304,7 @@ void Service::Eval(CmdArgList args, ConnectionContext* cntx) {
   eval_args.sha = result;
   eval_args.keys = args.subspan(3, num_keys);
   eval_args.args = args.subspan(3 + num_keys);
-  EvalInternal(eval_args, &script, cntx);
+  EvalInternal(eval_args, script, cntx);
 }
 
 void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
@@ -778,26 +1317,16 @@ void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
 
   string_view sha = ArgS(args, 1);
   ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
-  bool exists = script.Exists(sha);
-
-  if (!exists) {
-    const char* body = (sha.size() == 40) ? server_family_.script_mgr()->Find(sha) : nullptr;
-    if (!body) {
-      return (*cntx)->SendError(facade::kScriptNotFound);
-    }
-
-    string res;
-    CHECK_EQ(Interpreter::ADD_OK, script.AddFunction(body, &res));
-    CHECK_EQ(res, sha);
-  }
+  Interpreter* script = ss->BorrowInterpreter();
+  absl::Cleanup clean = [ss, script] { ss->ReturnInterpreter(script); };
 
+  // EvalInternal compiles the script if this interpreter has not run it yet.
   EvalArgs ev_args;
   ev_args.sha = sha;
   ev_args.keys = args.subspan(3, num_keys);
   ev_args.args = args.subspan(3 + num_keys);
 
-  EvalInternal(ev_args, &script, cntx);
+  EvalInternal(ev_args, script, cntx);
 }
 
 void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
@@ -810,9 +1339,9 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
   }
 
   bool exists = interpreter->Exists(eval_args.sha);
+  const char* body = server_family_.script_mgr()->Find(eval_args.sha);
 
   if (!exists) {
-    const char* body = server_family_.script_mgr()->Find(eval_args.sha);
     if (!body) {
       return (*cntx)->SendError(facade::kScriptNotFound);
     }
@@ -823,6 +1352,10 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
   }
 
   string error;
+  ScriptMgr::ScriptParams params;
+  if (body && !ScriptMgr::ParseParams(body, &params, &error)) {
+    return (*cntx)->SendError(error);  // a script of a snapshot is not validated when loaded.
+  }
 
   DCHECK(!cntx->conn_state.script_info);  // we should not call eval from the script.
 
@@ -835,23 +1368,49 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
   }
   DCHECK(cntx->transaction);
 
-  if (!eval_args.keys.empty())
+  // Under MULTI the script is already a part of the EXEC transaction.
+  bool atomic = params.atomic || cntx->conn_state.exec_state != ConnectionState::EXEC_INACTIVE;
+
+  // Scripts whose keys reside in a single shard run entirely within that shard.
+  if (body && atomic && GetFlag(FLAGS_lua_run_in_shard) &&
+      cntx->transaction->unique_shard_cnt() == 1 &&
+      cntx->conn_state.exec_state == ConnectionState::EXEC_INACTIVE) {
     cntx->transaction->Schedule();
+    EvalInShard(eval_args, body, cntx);
+    cntx->conn_state.script_info.reset();
+    cntx->transaction->UnlockMulti();
+    return;
+  }
 
-  auto lk = interpreter->Lock();
+  // A non-atomic script does not lock its keys, its calls run their own transactions.
+  Transaction* script_trans = cntx->transaction;
+  bool lock_keys = atomic && !eval_args.keys.empty();
+  if (lock_keys) {
+    script_trans->Schedule();
+  } else if (!atomic) {
+    cntx->conn_state.script_info->atomic = false;
+    cntx->transaction = nullptr;
+  }
 
+  // The interpreter is borrowed by this call, so it is not locked.
   interpreter->SetGlobalArray("KEYS", eval_args.keys);
   interpreter->SetGlobalArray("ARGV", eval_args.args);
   interpreter->SetRedisFunc(
       [cntx, this](CmdArgList args, ObjectExplorer* reply) { CallFromScript(args, reply, cntx); });
 
+  interpreter->SetMemoryBudget(GetFlag(FLAGS_lua_script_max_memory));
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   Interpreter::RunResult result = interpreter->RunFunction(eval_args.sha, &error);
+  RecordScriptRun(eval_args.sha, start_ns,
+                  eval_args.keys.empty() ? 0 : script_trans->unique_shard_cnt(),
+                  interpreter->last_run_stats());
 
   cntx->conn_state.script_info.reset();  // reset script_info
+  cntx->transaction = script_trans;
 
   // Conclude the transaction.
-  if (!eval_args.keys.empty())
-    cntx->transaction->UnlockMulti();
+  if (lock_keys)
+    script_trans->UnlockMulti();
 
   if (result == Interpreter::RUN_ERR) {
     string resp = StrCat("Error running script (call to ", eval_args.sha, "): ", error);
@@ -879,10 +1438,63 @@ void Service::Discard(CmdArgList args, ConnectionContext* cntx) {
 
   cntx->conn_state.exec_state = ConnectionState::EXEC_INACTIVE;
   cntx->conn_state.exec_body.clear();
+  cntx->conn_state.watched_keys.clear();
 
   rb->SendOk();
 }
 
+void Service::Watch(CmdArgList args, ConnectionContext* cntx) {
+  if (cntx->conn_state.exec_state != ConnectionState::EXEC_INACTIVE) {
+    return (*cntx)->SendError("WATCH inside MULTI is not allowed");
+  }
+
+  vector<vector<ConnectionState::WatchedKey>> sharded(shard_set->size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
+    for (string_view key : keys) {
+      sharded[shard->shard_id()].push_back(GetWatchedKey(shard, t->db_index(), key));
+    }
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  auto& watched_keys = cntx->conn_state.watched_keys;
+  for (auto& keys : sharded) {
+    watched_keys.insert(watched_keys.end(), make_move_iterator(keys.begin()),
+                        make_move_iterator(keys.end()));
+  }
+
+  return (*cntx)->SendOk();
+}
+
+void Service::Unwatch(CmdArgList args, ConnectionContext* cntx) {
+  cntx->conn_state.watched_keys.clear();
+  return (*cntx)->SendOk();
+}
+
+bool Service::CheckWatchedKeys(ConnectionContext* cntx) {
+  const auto& watched_keys = cntx->conn_state.watched_keys;
+  atomic_bool changed{false};
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    for (const auto& wk : watched_keys) {
+      if (Shard(wk.key, shard_set->size()) != shard->shard_id())
+        continue;
+
+      auto cur = GetWatchedKey(shard, wk.db_index, wk.key);
+      if (cur.exists != wk.exists || cur.version != wk.version) {
+        changed.store(true, memory_order_relaxed);
+        break;
+      }
+    }
+    return OpStatus::OK;
+  };
+
+  // Runs as the first hop of EXEC, hence the keys can not change until the commands have run.
+  cntx->transaction->Execute(std::move(cb), false);
+  return !changed.load(memory_order_relaxed);
+}
+
 void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = (*cntx).operator->();
 
@@ -890,15 +1502,47 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
     return rb->SendError("EXEC without MULTI");
   }
 
-  if (cntx->conn_state.exec_state == ConnectionState::EXEC_ERROR) {
+  absl::Cleanup exec_cleanup([cntx] {
     cntx->conn_state.exec_state = ConnectionState::EXEC_INACTIVE;
     cntx->conn_state.exec_body.clear();
+    cntx->conn_state.watched_keys.clear();
+  });
+
+  if (cntx->conn_state.exec_state == ConnectionState::EXEC_ERROR) {
     return rb->SendError("-EXECABORT Transaction discarded because of previous errors");
   }
 
+  // The watched keys are checked within the transaction of EXEC, which the squashed flow does
+  // not use.
+  bool watching = !cntx->conn_state.watched_keys.empty();
+  if (watching && !CheckWatchedKeys(cntx)) {
+    cntx->transaction->UnlockMulti();
+    return rb->SendNullArray();
+  }
+
+  // The slots of the queued commands could have moved since they were checked, e.g. by
+  // DFLYCLUSTER MIGRATE.
+  if (cluster_family_.IsEnabled()) {
+    for (auto& scmd : cntx->conn_state.exec_body) {
+      CmdArgVec str_list(scmd.cmd.size());
+      for (size_t i = 0; i < scmd.cmd.size(); ++i) {
+        str_list[i] = MutableSlice{scmd.cmd[i].data(), scmd.cmd[i].size()};
+      }
+      CmdArgList cmd_args{str_list.data(), str_list.size()};
+      string error = cluster_family_.CheckKeys(scmd.descr, cmd_args, cntx);
+      if (!error.empty()) {
+        cntx->transaction->UnlockMulti();
+        return rb->SendError(error, absl::StartsWith(error, "-MOVED") ? "MOVED" : "");
+      }
+    }
+  }
+
   VLOG(1) << "StartExec " << cntx->conn_state.exec_body.size();
   rb->StartArray(cntx->conn_state.exec_body.size());
-  if (!cntx->conn_state.exec_body.empty()) {
+  bool squashed = !watching && !cntx->conn_state.exec_body.empty() &&
+                  GetFlag(FLAGS_multi_exec_squash) && ExecSquashed(cntx);
+
+  if (!squashed && (watching || !cntx->conn_state.exec_body.empty())) {
     CmdArgVec str_list;
 
     for (auto& scmd : cntx->conn_state.exec_body) {
@@ -926,11 +1570,124 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
     cntx->transaction->UnlockMulti();
   }
 
-  cntx->conn_state.exec_state = ConnectionState::EXEC_INACTIVE;
-  cntx->conn_state.exec_body.clear();
   VLOG(1) << "Exec completed";
 }
 
+bool Service::ExecSquashed(ConnectionContext* cntx) {
+  // Commands that block or span all the shards need the hops of the regular flow.
+  constexpr uint32_t kExcludedMask =
+      CO::BLOCKING | CO::GLOBAL_TRANS | CO::ADMIN | CO::VARIADIC_KEYS;
+
+  auto& exec_body = cntx->conn_state.exec_body;
+  DbIndex db_index = cntx->conn_state.db_index;
+  vector<CmdArgVec> arg_vecs(exec_body.size());
+  vector<SquashedCmd> cmds(exec_body.size());
+  vector<ShardBatch> batches(shard_set->size());
+
+  // The first slot stands for the command name, the keys of all the commands follow.
+  CmdArgVec lock_args(1);
+  absl::flat_hash_set<string_view> uniq_keys;
+
+  // The lock mode is derived from the command, hence a write command is preferred.
+  const CommandId* lock_cid = nullptr;
+
+  for (unsigned i = 0; i < exec_body.size(); ++i) {
+    const CommandId* cid = exec_body[i].descr;
+    if ((cid->opt_mask() & kExcludedMask) || cid->first_key_pos() <= 0)
+      return false;
+
+    for (string& str : exec_body[i].cmd) {
+      arg_vecs[i].emplace_back(str.data(), str.size());
+    }
+
+    SquashedCmd& cmd = cmds[i];
+    cmd.cid = cid;
+    cmd.args = CmdArgList{arg_vecs[i].data(), arg_vecs[i].size()};
+
+    OpResult<KeyIndex> key_index = DetermineKeys(cid, cmd.args);
+    if (!key_index)
+      return false;
+
+    // A single command may touch several shards only via the regular flow.
+    cmd.trans.reset(Transaction::New(cid));
+    if (cmd.trans->InitByArgs(db_index, cmd.args) != OpStatus::OK ||
+        cmd.trans->unique_shard_cnt() != 1) {
+      return false;
+    }
+    cmd.trans->SetInline();
+    batches[cmd.trans->unique_shard_id()].cmds.push_back(i);
+
+    auto add_key = [&](unsigned pos) {
+      if (uniq_keys.insert(ArgS(cmd.args, pos)).second)
+        lock_args.push_back(cmd.args[pos]);
+    };
+
+    if (key_index->bonus)
+      add_key(key_index->bonus);
+    for (unsigned pos = key_index->start; pos < key_index->end; pos += key_index->step) {
+      add_key(pos);
+    }
+
+    if (!lock_cid || ((lock_cid->opt_mask() & CO::READONLY) && !(cid->opt_mask() & CO::READONLY)))
+      lock_cid = cid;
+  }
+
+  lock_args[0] = arg_vecs.front().front();
+
+  // Locks all the keys in one round and runs the commands of each shard in one callback.
+  intrusive_ptr<Transaction> lock_trans{Transaction::New(lock_cid)};
+  KeyIndex lock_index{0, 1, unsigned(lock_args.size()), 1};
+  OpStatus st = lock_trans->InitByArgs(db_index, CmdArgList{lock_args.data(), lock_args.size()},
+                                       lock_index);
+  DCHECK(st == OpStatus::OK);
+
+  for (ShardId sid = 0; sid < batches.size(); ++sid) {
+    ShardBatch& batch = batches[sid];
+    if (batch.cmds.empty())
+      continue;
+
+    batch.cntx.reset(new ConnectionContext{&batch.sink, cntx->owner()});
+    batch.cntx->conn_state.db_index = db_index;
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardBatch& batch = batches[shard->shard_id()];
+
+    for (unsigned i : batch.cmds) {
+      SquashedCmd& cmd = cmds[i];
+      batch.cntx->transaction = cmd.trans.get();
+      batch.cntx->cid = cmd.cid;
+
+      cmd.reply_start = batch.sink.str().size();
+      cmd.cid->Invoke(cmd.args, batch.cntx.get());
+      cmd.reply_end = batch.sink.str().size();
+    }
+    batch.cntx->transaction = nullptr;
+
+    return OpStatus::OK;
+  };
+
+  lock_trans->ScheduleSingleHop(std::move(cb));
+
+  absl::InlinedVector<string_view, 16> replies;
+  for (const SquashedCmd& cmd : cmds) {
+    const string& buf = batches[cmd.trans->unique_shard_id()].sink.str();
+    replies.emplace_back(buf.data() + cmd.reply_start, cmd.reply_end - cmd.reply_start);
+  }
+  cntx->reply_builder()->SendRawVec(replies);
+
+  ServerState& etl = *ServerState::tlocal();
+  for (const ShardBatch& batch : batches) {
+    if (!batch.cntx)
+      continue;
+    for (const auto& k_v : batch.cntx->reply_builder()->err_count()) {
+      etl.connection_stats.err_count_map[k_v.first] += k_v.second;
+    }
+  }
+
+  return true;
+}
+
 void Service::Publish(CmdArgList args, ConnectionContext* cntx) {
   string_view channel = ArgS(args, 1);
   string_view message = ArgS(args, 2);
@@ -939,58 +1696,48 @@ void Service::Publish(CmdArgList args, ConnectionContext* cntx) {
   auto cb = [&] { return EngineShard::tlocal()->channel_slice().FetchSubscribers(channel); };
 
   // How do we know that subsribers did not disappear after we fetched them?
-  // Each subscriber object hold a borrow_token.
+  // Each subscriber list holds borrow tokens of its subscribers until it is released.
   // ConnectionContext::OnClose does not reset subscribe_info before all tokens are returned.
-  vector<ChannelSlice::Subscriber> subscriber_arr = shard_set->Await(sid, std::move(cb));
-  atomic_uint32_t published{0};
+  vector<ChannelSlice::SubscriberListPtr> lists = shard_set->Await(sid, std::move(cb));
 
-  if (!subscriber_arr.empty()) {
-    sort(subscriber_arr.begin(), subscriber_arr.end(),
-         [](const auto& left, const auto& right) { return left.thread_id < right.thread_id; });
-
-    vector<unsigned> slices(shard_set->pool()->size(), UINT_MAX);
-    for (size_t i = 0; i < subscriber_arr.size(); ++i) {
-      if (slices[subscriber_arr[i].thread_id] > i) {
-        slices[subscriber_arr[i].thread_id] = i;
-      }
-    }
-
-    fibers_ext::BlockingCounter bc(subscriber_arr.size());
-
-    // We run publish_cb in each subsriber's thread.
-    auto publish_cb = [&, bc](unsigned idx, util::ProactorBase*) mutable {
-      unsigned start = slices[idx];
+  facade::Connection::PubMessage msg;
+  msg.channel = channel;
+  msg.message = message;
+  (*cntx)->SendLong(SendToSubscribers(lists, msg));
+}
 
-      for (unsigned i = start; i < subscriber_arr.size(); ++i) {
-        const ChannelSlice::Subscriber& subscriber = subscriber_arr[i];
-        if (subscriber.thread_id != idx)
-          break;
+// Unlike PUBLISH, only the SSUBSCRIBE subscribers of the channel in its shard are consulted and
+// the patterns are not matched.
+void Service::SPublish(CmdArgList args, ConnectionContext* cntx) {
+  string_view channel = ArgS(args, 1);
+  string_view message = ArgS(args, 2);
+  ShardId sid = Shard(channel, shard_count());
 
-        published.fetch_add(1, memory_order_relaxed);
+  auto cb = [&] { return EngineShard::tlocal()->channel_slice().FetchShardSubscribers(channel); };
+  ChannelSlice::SubscriberListPtr list = shard_set->Await(sid, std::move(cb));
+  if (!list)
+    return (*cntx)->SendLong(0);
 
-        facade::Connection* conn = subscriber_arr[i].conn_cntx->owner();
-        DCHECK(conn);
-        facade::Connection::PubMessage pmsg;
-        pmsg.channel = channel;
-        pmsg.message = message;
-        pmsg.pattern = subscriber.pattern;
-        conn->SendMsgVecAsync(pmsg, bc);
-      }
-    };
+  facade::Connection::PubMessage msg;
+  msg.channel = channel;
+  msg.message = message;
+  msg.sharded = true;
+  (*cntx)->SendLong(SendToSubscribers({list}, msg));
+}
 
-    shard_set->pool()->Await(publish_cb);
+void Service::SSubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
+  cntx->ChangeShardSubscription(true, true, args);
+}
 
-    bc.Wait();  // Wait for all the messages to be sent.
-  }
+void Service::SUnsubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
 
-  // If subscriber connections are closing they will wait
-  // for the tokens to be reclaimed in OnClose(). This guarantees that subscribers we gathered
-  // still exist till we finish publishing.
-  for (auto& s : subscriber_arr) {
-    s.borrow_token.Dec();
+  if (args.size() == 0) {
+    cntx->SUnsubscribeAll(true);
+  } else {
+    cntx->ChangeShardSubscription(false, true, args);
   }
-
-  (*cntx)->SendLong(published.load(memory_order_relaxed));
 }
 
 void Service::Subscribe(CmdArgList args, ConnectionContext* cntx) {
@@ -1038,11 +1785,13 @@ void Service::Function(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(err, kSyntaxErrType);
 }
 
-void Service::PubsubChannels(string_view pattern, ConnectionContext* cntx) {
+void Service::PubsubChannels(string_view pattern, bool sharded, ConnectionContext* cntx) {
   vector<vector<string>> result_set(shard_set->size());
 
   shard_set->RunBriefInParallel([&](EngineShard* shard) {
-    result_set[shard->shard_id()] = shard->channel_slice().ListChannels(pattern);
+    const ChannelSlice& cs = shard->channel_slice();
+    result_set[shard->shard_id()] =
+        sharded ? cs.ListShardChannels(pattern) : cs.ListChannels(pattern);
   });
 
   vector<string> union_set;
@@ -1076,6 +1825,8 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
         "\tReturn the currently active channels matching a <pattern> (default: '*').",
         "NUMPAT",
         "\tReturn number of subscriptions to patterns.",
+        "SHARDCHANNELS [<pattern>]",
+        "\tReturn the currently active shard level channels matching a <pattern> (default: '*').",
         "HELP",
         "\tPrints this help."};
 
@@ -1083,13 +1834,13 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  if (subcmd == "CHANNELS") {
+  if (subcmd == "CHANNELS" || subcmd == "SHARDCHANNELS") {
     string_view pattern;
     if (args.size() > 2) {
       pattern = ArgS(args, 2);
     }
 
-    PubsubChannels(pattern, cntx);
+    PubsubChannels(pattern, subcmd == "SHARDCHANNELS", cntx);
   } else if (subcmd == "NUMPAT") {
     PubsubPatterns(cntx);
   } else {
@@ -1100,7 +1851,7 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
 VarzValue::Map Service::GetVarzStats() {
   VarzValue::Map res;
 
-  Metrics m = server_family_.GetMetrics();
+  Metrics m = server_family_.GetCachedMetrics();
   DbStats db_stats;
   for (const auto& s : m.db) {
     db_stats += s;
@@ -1149,11 +1900,17 @@ void Service::RegisterCommands() {
       << CI{"EVALSHA", CO::NOSCRIPT | CO::VARIADIC_KEYS, -3, 3, 3, 1}.MFUNC(EvalSha).SetValidator(
              &EvalValidator)
       << CI{"EXEC", kExecMask, 1, 0, 0, 0}.MFUNC(Exec)
+      << CI{"WATCH", CO::READONLY | CO::NOSCRIPT | CO::FAST | CO::LOADING, -2, 1, -1, 1}.MFUNC(
+             Watch)
+      << CI{"UNWATCH", CO::NOSCRIPT | CO::FAST | CO::LOADING, 1, 0, 0, 0}.MFUNC(Unwatch)
       << CI{"PUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(Publish)
       << CI{"SUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(Subscribe)
       << CI{"UNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(Unsubscribe)
       << CI{"PSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(PSubscribe)
       << CI{"PUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(PUnsubscribe)
+      << CI{"SPUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(SPublish)
+      << CI{"SSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(SSubscribe)
+      << CI{"SUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(SUnsubscribe)
       << CI{"FUNCTION", CO::NOSCRIPT, 2, 0, 0, 0}.MFUNC(Function)
       << CI{"PUBSUB", CO::LOADING | CO::FAST, -1, 0, 0, 0}.MFUNC(Pubsub);
 
@@ -1163,9 +1920,13 @@ void Service::RegisterCommands() {
   ListFamily::Register(&registry_);
   SetFamily::Register(&registry_);
   HSetFamily::Register(&registry_);
+  HllFamily::Register(&registry_);
+  BloomFamily::Register(&registry_);
+  JsonFamily::Register(&registry_);
   ZSetFamily::Register(&registry_);
 
   server_family_.Register(&registry_);
+  cluster_family_.Register(&registry_);
 
   if (VLOG_IS_ON(1)) {
     LOG(INFO) << "Multi-key commands are: ";
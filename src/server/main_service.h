@@ -6,6 +6,7 @@
 
 #include "base/varz_value.h"
 #include "facade/service_interface.h"
+#include "server/cluster_family.h"
 #include "server/command_registry.h"
 #include "server/engine_shard_set.h"
 #include "server/server_family.h"
@@ -33,12 +34,18 @@ class Service : public facade::ServiceInterface {
   explicit Service(util::ProactorPool* pp);
   ~Service();
 
-  void Init(util::AcceptServer* acceptor, util::ListenerInterface* main_interface,
+  // listeners are the listeners of the redis port.
+  void Init(util::AcceptServer* acceptor, std::vector<util::ListenerInterface*> listeners,
             const InitOpts& opts = InitOpts{});
 
   void Shutdown();
 
   void DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx) final;
+
+  // Squashes consecutive single-shard commands: they are executed with a single hop per shard
+  // and their replies are sent in the original order. Other commands are dispatched regularly.
+  void DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                            facade::ConnectionContext* cntx) final;
   void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                   facade::ConnectionContext* cntx) final;
 
@@ -91,15 +98,20 @@ class Service : public facade::ServiceInterface {
   void Eval(CmdArgList args, ConnectionContext* cntx);
   void EvalSha(CmdArgList args, ConnectionContext* cntx);
   void Exec(CmdArgList args, ConnectionContext* cntx);
+  void Watch(CmdArgList args, ConnectionContext* cntx);
+  void Unwatch(CmdArgList args, ConnectionContext* cntx);
   void Publish(CmdArgList args, ConnectionContext* cntx);
   void Subscribe(CmdArgList args, ConnectionContext* cntx);
   void Unsubscribe(CmdArgList args, ConnectionContext* cntx);
   void PSubscribe(CmdArgList args, ConnectionContext* cntx);
   void PUnsubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SPublish(CmdArgList args, ConnectionContext* cntx);
+  void SSubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SUnsubscribe(CmdArgList args, ConnectionContext* cntx);
   void Function(CmdArgList args, ConnectionContext* cntx);
 
   void Pubsub(CmdArgList args, ConnectionContext* cntx);
-  void PubsubChannels(std::string_view pattern, ConnectionContext* cntx);
+  void PubsubChannels(std::string_view pattern, bool sharded, ConnectionContext* cntx);
   void PubsubPatterns(ConnectionContext* cntx);
 
   struct EvalArgs {
@@ -111,12 +123,34 @@ class Service : public facade::ServiceInterface {
 
   void CallFromScript(CmdArgList args, ObjectExplorer* reply, ConnectionContext* cntx);
 
+  // Runs the script within the shard of its keys, so that its calls do not hop.
+  void EvalInShard(const EvalArgs& eval_args, const char* body, ConnectionContext* cntx);
+
+  // Runs a call of EvalInShard script. cntx is the context local to the shard.
+  void CallFromShard(CmdArgList args, const absl::flat_hash_set<std::string_view>& keys,
+                     ObjectExplorer* reply, ConnectionContext* cntx);
+
+  struct SquashedCmd;
+
+  // Returns true if the command can run from within its shard as part of a squashed batch.
+  bool CanSquash(const CommandId* cid, CmdArgList args, const ConnectionContext* cntx) const;
+  void DispatchSquashed(absl::Span<SquashedCmd> cmds, ConnectionContext* cntx);
+
+  // Runs the queued commands of EXEC with a single transaction that locks all their keys
+  // upfront. Returns false without running anything if a command needs the regular flow.
+  bool ExecSquashed(ConnectionContext* cntx);
+
+  // Returns false if any of the keys that the connection watches has changed since WATCH.
+  // Schedules the transaction of EXEC.
+  bool CheckWatchedKeys(ConnectionContext* cntx);
+
   void RegisterCommands();
   base::VarzValue::Map GetVarzStats();
 
   util::ProactorPool& pp_;
 
   ServerFamily server_family_;
+  ClusterFamily cluster_family_;
   CommandRegistry registry_;
   absl::flat_hash_map<std::string, unsigned> unknown_cmds_;
 
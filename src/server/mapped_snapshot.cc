@@ -0,0 +1,343 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/mapped_snapshot.h"
+
+#include <absl/base/internal/endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "server/db_slice.h"
+#include "server/engine_shard_set.h"
+#include "server/rdb_load.h"
+
+namespace dfly {
+
+using namespace std;
+using absl::little_endian::Load16;
+using absl::little_endian::Load32;
+using absl::little_endian::Load64;
+using absl::little_endian::Store16;
+using absl::little_endian::Store32;
+using absl::little_endian::Store64;
+
+namespace {
+
+constexpr char kMagic[] = "DFLYMAP1";
+constexpr size_t kMagicLen = 8;
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderLen = 32;
+constexpr size_t kFooterLen = 32;
+constexpr size_t kEntryHeaderLen = 20;
+constexpr size_t kIndexEntryLen = 16;
+constexpr size_t kPageLen = 4096;
+
+// The writes are batched, the file is opened with O_DIRECT.
+constexpr size_t kMinWrite = 16 * kPageLen;
+
+// The entries are dispatched to their shards in batches by LoadAll.
+constexpr size_t kLoadBatch = 1024;
+
+error_code Corrupted() {
+  return make_error_code(errc::bad_message);
+}
+
+}  // namespace
+
+MappedSnapshotWriter::MappedSnapshotWriter(io::WriteFile* wf, ShardId sid, uint32_t shard_count)
+    : wf_(wf), serializer_(&sfile_) {
+  buf_.resize(kHeaderLen);
+  memcpy(buf_.data(), kMagic, kMagicLen);
+  Store32(buf_.data() + 8, kVersion);
+  Store32(buf_.data() + 12, sid);
+  Store32(buf_.data() + 16, shard_count);
+  offset_ = kHeaderLen;
+}
+
+uint8_t MappedSnapshotWriter::Add(DbIndex db_ind, const PrimeKey& pk, const PrimeValue& pv,
+                                  uint64_t expire_ms) {
+  error_code ec = serializer_.SaveValue(pv);
+  if (!ec)
+    ec = serializer_.FlushMem();
+  CHECK(!ec);  // we write to StringFile.
+
+  uint8_t rdb_type = AddValue(db_ind, pk.GetSlice(&tmp_str_), sfile_.val, expire_ms);
+  sfile_.val.clear();
+  return rdb_type;
+}
+
+uint8_t MappedSnapshotWriter::AddValue(DbIndex db_ind, string_view key, string_view value,
+                                       uint64_t expire_ms) {
+  DCHECK(!value.empty());
+  index_.push_back(IndexEntry{CompactObj::HashCode(key), offset_});
+
+  char header[kEntryHeaderLen] = {0};
+  Store32(header, key.size());
+  Store32(header + 4, value.size());
+  Store64(header + 8, expire_ms);
+  Store16(header + 16, db_ind);
+  buf_.append(header, kEntryHeaderLen);
+  buf_.append(key);
+  buf_.append(value);
+  offset_ += kEntryHeaderLen + key.size() + value.size();
+
+  return value[0];
+}
+
+error_code MappedSnapshotWriter::WritePages(size_t len) {
+  DCHECK_EQ(0u, len % kPageLen);
+  if (len == 0)
+    return error_code{};
+
+  // The buckets that change meanwhile are appended to buf_ while the write waits.
+  string pages = buf_.substr(0, len);
+  buf_.erase(0, len);
+  return wf_->Write(io::Buffer(pages));
+}
+
+error_code MappedSnapshotWriter::Flush() {
+  if (buf_.size() < kMinWrite)
+    return error_code{};
+  return WritePages(buf_.size() / kPageLen * kPageLen);
+}
+
+error_code MappedSnapshotWriter::Finish() {
+  uint64_t index_offset = offset_;
+  sort(index_.begin(), index_.end(),
+       [](const IndexEntry& a, const IndexEntry& b) { return a.hash < b.hash; });
+
+  char entry[kIndexEntryLen];
+  for (const IndexEntry& e : index_) {
+    Store64(entry, e.hash);
+    Store64(entry + 8, e.offset);
+    buf_.append(entry, kIndexEntryLen);
+  }
+  offset_ += index_.size() * kIndexEntryLen;
+
+  // The footer ends the last page.
+  size_t tail = (offset_ + kFooterLen) % kPageLen;
+  if (tail)
+    buf_.append(kPageLen - tail, '\0');
+
+  char footer[kFooterLen] = {0};
+  Store64(footer, index_.size());
+  Store64(footer + 8, index_offset);
+  memcpy(footer + 16, kMagic, kMagicLen);
+  buf_.append(footer, kFooterLen);
+
+  DCHECK_EQ(0u, buf_.size() % kPageLen);
+  return WritePages(buf_.size());
+}
+
+io::Result<unique_ptr<MappedSnapshot>> MappedSnapshot::Open(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nonstd::make_unexpected(error_code{errno, system_category()});
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    error_code ec{errno, system_category()};
+    close(fd);
+    return nonstd::make_unexpected(ec);
+  }
+
+  size_t size = st.st_size;
+  if (size < kHeaderLen + kFooterLen) {
+    close(fd);
+    return nonstd::make_unexpected(Corrupted());
+  }
+
+  void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  error_code ec = ptr == MAP_FAILED ? error_code{errno, system_category()} : error_code{};
+  close(fd);
+  if (ec)
+    return nonstd::make_unexpected(ec);
+
+  // The index is searched and the entries are read at random.
+  madvise(ptr, size, MADV_RANDOM);
+
+  unique_ptr<MappedSnapshot> res{new MappedSnapshot};
+  res->data_ = reinterpret_cast<const char*>(ptr);
+  res->size_ = size;
+
+  const char* header = res->data_;
+  const char* footer = res->data_ + size - kFooterLen;
+  if (memcmp(header, kMagic, kMagicLen) != 0 || Load32(header + 8) != kVersion ||
+      memcmp(footer + 16, kMagic, kMagicLen) != 0) {
+    return nonstd::make_unexpected(Corrupted());
+  }
+
+  res->shard_id_ = Load32(header + 12);
+  res->shard_count_ = Load32(header + 16);
+  res->num_entries_ = Load64(footer);
+  uint64_t index_offset = Load64(footer + 8);
+  if (index_offset < kHeaderLen || index_offset > size - kFooterLen ||
+      res->num_entries_ > (size - kFooterLen - index_offset) / kIndexEntryLen) {
+    return nonstd::make_unexpected(Corrupted());
+  }
+
+  res->index_ = res->data_ + index_offset;
+  res->pending_ = res->num_entries_;
+  res->consumed_.resize(res->num_entries_);
+  return res;
+}
+
+MappedSnapshot::~MappedSnapshot() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+void MappedSnapshot::Attach(DbSlice* slice) {
+  DCHECK_EQ(slice->shard_id(), shard_id_);
+  slice_ = slice;
+}
+
+uint64_t MappedSnapshot::IndexHash(size_t pos) const {
+  return Load64(index_ + pos * kIndexEntryLen);
+}
+
+bool MappedSnapshot::ReadEntry(size_t pos, Entry* entry) const {
+  uint64_t offset = Load64(index_ + pos * kIndexEntryLen + 8);
+  size_t end = index_ - data_;
+  if (offset < kHeaderLen || offset + kEntryHeaderLen > end)
+    return false;
+
+  const char* header = data_ + offset;
+  uint32_t key_len = Load32(header);
+  uint32_t value_len = Load32(header + 4);
+  if (key_len + value_len > end - offset - kEntryHeaderLen)
+    return false;
+
+  entry->expire_ms = Load64(header + 8);
+  entry->db_ind = Load16(header + 16);
+  entry->key = string_view{header + kEntryHeaderLen, key_len};
+  entry->value = string_view{header + kEntryHeaderLen + key_len, value_len};
+  return true;
+}
+
+void MappedSnapshot::MaterializeAt(size_t pos, DbSlice* slice) const {
+  Entry entry;
+  if (!ReadEntry(pos, &entry)) {
+    LOG(ERROR) << "Corrupted entry " << pos << " of the mapped snapshot of shard " << shard_id_;
+    return;
+  }
+
+  if (dropped_all_ || (entry.db_ind < dropped_dbs_.size() && dropped_dbs_[entry.db_ind]))
+    return;
+
+  PrimeValue pv;
+  if (error_code ec = RdbLoader::LoadValue(entry.value, &pv); ec) {
+    LOG(ERROR) << "Could not load '" << entry.key << "' of the mapped snapshot: " << ec.message();
+    return;
+  }
+
+  // A key that was written meanwhile, e.g. by a script that did not declare it, is newer.
+  slice->ActivateDb(entry.db_ind);
+  slice->AddOrFind(entry.db_ind, entry.key, std::move(pv), entry.expire_ms);
+}
+
+void MappedSnapshot::Consume(size_t pos) {
+  DCHECK(!consumed_[pos]);
+  consumed_[pos] = true;
+  --pending_;
+  MaterializeAt(pos, slice_);
+}
+
+void MappedSnapshot::Materialize(DbIndex db_ind, ArgSlice keys, unsigned step) {
+  if (pending_ == 0 || dropped_all_ || (db_ind < dropped_dbs_.size() && dropped_dbs_[db_ind]))
+    return;
+
+  for (size_t i = 0; i < keys.size(); i += max(step, 1u)) {
+    uint64_t hash = CompactObj::HashCode(keys[i]);
+
+    // The first position of the index with the hash.
+    size_t lo = 0, hi = num_entries_;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (IndexHash(mid) < hash) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    Entry entry;
+    for (size_t pos = lo; pos < num_entries_ && IndexHash(pos) == hash; ++pos) {
+      if (!consumed_[pos] && ReadEntry(pos, &entry) && entry.db_ind == db_ind &&
+          entry.key == keys[i]) {
+        Consume(pos);
+        break;
+      }
+    }
+  }
+}
+
+bool MappedSnapshot::WarmupStep(unsigned count) {
+  for (; count > 0 && warmup_pos_ < num_entries_; ++warmup_pos_) {
+    if (!consumed_[warmup_pos_]) {
+      Consume(warmup_pos_);
+      --count;
+    }
+  }
+  return warmup_pos_ < num_entries_;
+}
+
+void MappedSnapshot::MaterializeAll() {
+  if (pending_ == 0)
+    return;
+
+  LOG(INFO) << "Materializing " << pending_ << " keys of the mapped snapshot of shard "
+            << shard_id_;
+  while (WarmupStep(kLoadBatch)) {
+  }
+}
+
+void MappedSnapshot::Drop(DbIndex db_ind) {
+  if (db_ind == DbSlice::kDbAll) {
+    dropped_all_ = true;
+    return;
+  }
+
+  if (db_ind >= dropped_dbs_.size())
+    dropped_dbs_.resize(db_ind + 1);
+  dropped_dbs_[db_ind] = true;
+}
+
+error_code MappedSnapshot::LoadAll() {
+  vector<vector<size_t>> batches(shard_set->size());
+  auto flush = [&](ShardId sid) {
+    shard_set->Await(sid, [&] {
+      DbSlice* slice = &EngineShard::tlocal()->db_slice();
+      for (size_t pos : batches[sid])
+        MaterializeAt(pos, slice);
+    });
+    batches[sid].clear();
+  };
+
+  Entry entry;
+  for (size_t pos = 0; pos < num_entries_; ++pos) {
+    if (!ReadEntry(pos, &entry))
+      return Corrupted();
+
+    ShardId sid = Shard(entry.key, shard_set->size());
+    batches[sid].push_back(pos);
+    if (batches[sid].size() >= kLoadBatch)
+      flush(sid);
+  }
+
+  for (ShardId sid = 0; sid < batches.size(); ++sid) {
+    if (!batches[sid].empty())
+      flush(sid);
+  }
+
+  pending_ = 0;
+  return error_code{};
+}
+
+}  // namespace dfly
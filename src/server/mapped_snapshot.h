@@ -0,0 +1,141 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "io/file.h"
+#include "io/io.h"
+#include "server/common.h"
+#include "server/rdb_save.h"
+#include "server/table.h"
+
+namespace dfly {
+
+class DbSlice;
+
+// The shard files of the per-shard snapshots with FLAGS_snapshot_mapped. A file is mapped at
+// startup and the shard serves right away: the keys stay in the file until they are accessed
+// or the heartbeat materializes them in the background.
+//
+// The layout, little endian:
+//   header: the magic, the version, the shard id and the number of the shards, kHeaderLen bytes.
+//   entries: the length of the key, of the value, the expiry in ms or 0, the db index, then the
+//            key and the value as saved by RdbSerializer::SaveValue.
+//   index: the hash of the key and the offset of the entry, sorted by the hash.
+//   footer: the number of the entries, the offset of the index and the magic, in the last
+//           kFooterLen bytes of the file, which is padded to whole pages.
+class MappedSnapshotWriter {
+ public:
+  MappedSnapshotWriter(io::WriteFile* wf, ShardId sid, uint32_t shard_count);
+
+  // Appends the entry to the buffer and returns the rdb type of the value. Does not preempt,
+  // it is called while a bucket is serialized.
+  uint8_t Add(DbIndex db_ind, const PrimeKey& pk, const PrimeValue& pv, uint64_t expire_ms);
+
+  // Same as Add, for a value that RdbSerializer::SaveValue saved.
+  uint8_t AddValue(DbIndex db_ind, std::string_view key, std::string_view value,
+                   uint64_t expire_ms);
+
+  // Writes the whole pages of the buffer once it has enough of them. Blocks the calling fiber.
+  std::error_code Flush();
+
+  // Writes the rest of the entries, the index and the footer. Blocks the calling fiber.
+  std::error_code Finish();
+
+ private:
+  std::error_code WritePages(size_t len);
+
+  io::WriteFile* wf_;
+  io::StringFile sfile_;
+  RdbSerializer serializer_;
+  std::string buf_;
+  std::string tmp_str_;
+  uint64_t offset_ = 0;  // of the end of buf_ in the file.
+
+  struct IndexEntry {
+    uint64_t hash;
+    uint64_t offset;
+  };
+  std::vector<IndexEntry> index_;
+};
+
+// A mapped shard file. Not thread-safe, used by the shard thread once it is attached, except
+// for LoadAll.
+class MappedSnapshot {
+ public:
+  static io::Result<std::unique_ptr<MappedSnapshot>> Open(const std::string& path);
+
+  ~MappedSnapshot();
+
+  ShardId shard_id() const {
+    return shard_id_;
+  }
+
+  uint32_t shard_count() const {
+    return shard_count_;
+  }
+
+  // The entries that were not materialized yet.
+  size_t pending() const {
+    return pending_;
+  }
+
+  // Serves the file from the keys of slice, which must belong to the shard that saved it.
+  void Attach(DbSlice* slice);
+
+  // Materializes the keys of a command that are still in the file. keys holds a key every
+  // step args, as the arguments of the commands do.
+  void Materialize(DbIndex db_ind, ArgSlice keys, unsigned step);
+
+  // Materializes up to count entries in the order of the index. Returns true while some remain.
+  bool WarmupStep(unsigned count);
+
+  // Materializes the remaining entries, e.g. before a snapshot traverses the shard. The shard
+  // stalls meanwhile.
+  void MaterializeAll();
+
+  // The keys of the flushed db, or of all the dbs with DbSlice::kDbAll, are dropped.
+  void Drop(DbIndex db_ind);
+
+  // Loads all the entries into the shards that own them, for a file that was saved with a
+  // different number of shards. Blocks the calling fiber.
+  std::error_code LoadAll();
+
+ private:
+  struct Entry {
+    DbIndex db_ind;
+    uint64_t expire_ms;
+    std::string_view key;
+    std::string_view value;
+  };
+
+  MappedSnapshot() = default;
+
+  uint64_t IndexHash(size_t pos) const;
+  bool ReadEntry(size_t pos, Entry* entry) const;
+
+  // Adds the entry at pos of the index into slice unless its db was dropped.
+  void MaterializeAt(size_t pos, DbSlice* slice) const;
+  void Consume(size_t pos);
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  const char* index_ = nullptr;
+  size_t num_entries_ = 0;
+  ShardId shard_id_ = 0;
+  uint32_t shard_count_ = 0;
+
+  DbSlice* slice_ = nullptr;
+  std::vector<bool> consumed_;
+  std::vector<bool> dropped_dbs_;
+  bool dropped_all_ = false;
+  size_t pending_ = 0;
+  size_t warmup_pos_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,50 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+
+// Extensions of the rdb format that are not understood by redis.
+
+// A set encoded as a listpack, saved as is. Redis 7.2 uses the same type.
+constexpr uint8_t RDB_TYPE_SET_LISTPACK = 20;
+
+// A zstd frame of the serialized entries: the compressed length, the uncompressed length and
+// the frame. The frame holds whole opcodes, so a loader can splice it into its input.
+// Announced by the "compression" aux field of the header.
+constexpr uint8_t RDB_OPCODE_COMPRESSED_ZSTD_BLOB = 201;
+
+// Entries of delta snapshots, announced by the "delta-of" aux field. They precede the keys.
+// The key, a string, was deleted from the selected db since the previous snapshot.
+constexpr uint8_t RDB_OPCODE_DELETED_KEY = 202;
+
+// The selected db was flushed since the previous snapshot.
+constexpr uint8_t RDB_OPCODE_FLUSHED_DB = 203;
+
+// A batch of the entries of a journal, announced by the "journal" aux field: the 4 byte length
+// and the 8 byte crc64 of the body, little endian, and the body. A loader stops at a batch that
+// is cut short, i.e. the end of a journal of a server that did not shut down.
+constexpr uint8_t RDB_OPCODE_JOURNAL_BATCH = 204;
+
+// The end of the entries of a transaction that spans several shards, in the journal batches
+// that a master streams to its replicas: the txid and the number of the shards as lengths, then
+// their ids. A replica applies the entries past the barrier of a shard once the other shards of
+// the transaction reached it as well, see TxBarrier.
+constexpr uint8_t RDB_OPCODE_JOURNAL_BARRIER = 205;
+
+// An entry whose value stays in the backing file of the tiered storage, in the snapshots taken
+// with FLAGS_tiered_warm_restart, which have the "tiered-token" aux field: the key, then the
+// shard id, the offset, the length on disk, the raw length of a compressed string or 0 and the
+// object type as lengths. May follow RDB_OPCODE_EXPIRETIME_MS like the other entries.
+constexpr uint8_t RDB_OPCODE_TIERED_REF = 206;
+
+// A scalable bloom filter, see core/bloom.h: the grow factor and the error rate of the last
+// filter as binary doubles, then the number of the items in all but the last filter, in the
+// last filter, its capacity and the number of the filters as lengths. Then per filter, its
+// number of hashes as a length and its bits as a string.
+constexpr uint8_t RDB_TYPE_SBF = 30;
+
+// A json document, see core/json.h, as a string of its compact text.
+constexpr uint8_t RDB_TYPE_JSON = 31;
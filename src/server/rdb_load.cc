@@ -6,6 +6,7 @@
 
 extern "C" {
 
+#include "redis/crc64.h"
 #include "redis/intset.h"
 #include "redis/listpack.h"
 #include "redis/lzfP.h" /* LZF compression library */
@@ -19,16 +20,27 @@ extern "C" {
 
 #include <absl/cleanup/cleanup.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <zstd.h>
 
 #include "base/endian.h"
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/bloom.h"
+#include "core/json.h"
+#include "core/roaring_set.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/hset_family.h"
+#include "server/rdb_extensions.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
 #include "server/set_family.h"
+#include "server/tiered_storage.h"
+#include "server/zset_family.h"
 #include "strings/human_readable.h"
 
 ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
@@ -68,6 +80,8 @@ string error_category::message(int ev) const {
   switch (ev) {
     case errc::wrong_signature:
       return "Wrong signature while trying to load from rdb file";
+    case errc::delta_mismatch:
+      return "The delta snapshot does not follow the loaded snapshot";
     default:
       return absl::StrCat("Internal error when loading RDB file ", ev);
       break;
@@ -203,8 +217,14 @@ class RdbLoader::OpaqueObjLoader {
   void CreateList(const LoadTrace* ltrace);
   void CreateZSet(const LoadTrace* ltrace);
   void CreateStream(const LoadTrace* ltrace);
+  void CreateSbf(const LoadTrace* ltrace);
 
   void HandleBlob(string_view blob);
+  robj* CreateFromListPack(string_view blob);
+
+  // Takes ownership of lp.
+  robj* CreateHashFromListPack(uint8_t* lp);
+  robj* CreateZSetFromListPack(uint8_t* lp);
 
   sds ToSds(const RdbVariant& obj);
   string_view ToSV(const RdbVariant& obj);
@@ -250,6 +270,9 @@ void RdbLoader::OpaqueObjLoader::operator()(const unique_ptr<LoadTrace>& ptr) {
     case RDB_TYPE_STREAM_LISTPACKS:
       CreateStream(ptr.get());
       break;
+    case RDB_TYPE_SBF:
+      CreateSbf(ptr.get());
+      break;
     default:
       LOG(FATAL) << "Unsupported rdb type " << rdb_type_;
   }
@@ -272,13 +295,22 @@ void RdbLoader::OpaqueObjLoader::CreateSet(const LoadTrace* ltrace) {
     is_intset = false;
   }
 
+  bool keep_lp = !is_intset && len <= SetFamily::MaxListPackEntries();
+  size_t lp_size = 0;
+  for (size_t i = 0; keep_lp && i < len; i++) {
+    size_t str_len = StrLen(ltrace->arr[i].rdb_var);
+    lp_size += str_len;
+    keep_lp = str_len <= SetFamily::MaxListPackValue();
+  }
+
   robj* res = nullptr;
-  sds sdsele = nullptr;
+  uint8_t* lp = nullptr;
 
   auto cleanup = absl::MakeCleanup([&] {
-    if (sdsele)
-      sdsfree(sdsele);
-    decrRefCount(res);
+    if (lp)
+      lpFree(lp);
+    if (res)
+      decrRefCount(res);
   });
 
   if (is_intset) {
@@ -294,28 +326,78 @@ void RdbLoader::OpaqueObjLoader::CreateSet(const LoadTrace* ltrace) {
         return;
       }
     }
+  } else if (keep_lp) {
+    lp = lpNew(lp_size);
+
+    for (size_t i = 0; i < len; i++) {
+      string_view sv = ToSV(ltrace->arr[i].rdb_var);
+      if (ec_)
+        return;
+
+      uint8_t* ele = reinterpret_cast<uint8_t*>(const_cast<char*>(sv.data()));
+      uint8_t* first = lpFirst(lp);
+      if (first && lpFind(lp, first, ele, sv.size(), 0)) {
+        LOG(ERROR) << "Duplicate set members detected";
+        ec_ = RdbError(errc::duplicate_key);
+        return;
+      }
+      lp = lpAppend(lp, ele, sv.size());
+    }
+
+    res = createObject(OBJ_SET, lpShrinkToFit(lp));
+    res->encoding = OBJ_ENCODING_LISTPACK;
+    lp = nullptr;
   } else {
-    res = createSetObject();
+    // The large sets of integers are loaded into the bitmap while it is dense.
+    unique_ptr<RoaringSet> rs;
+    if (len > SetFamily::MaxIntsetEntries())
+      rs.reset(new RoaringSet);
+
+    for (size_t i = 0; rs && i < len; i++) {
+      long long llval;
+      const RdbVariant& var = ltrace->arr[i].rdb_var;
+      if (holds_alternative<long long>(var)) {
+        llval = get<long long>(var);
+      } else {
+        string_view sv = ToSV(var);
+        if (ec_)
+          return;
+        if (!string2ll(sv.data(), sv.size(), &llval)) {
+          rs.reset();
+          break;
+        }
+      }
 
-    /* It's faster to expand the dict to the right size asap in order
-     * to avoid rehashing */
-    if (len > DICT_HT_INITIAL_SIZE && dictTryExpand((dict*)res->ptr, len) != DICT_OK) {
-      LOG(ERROR) << "OOM in dictTryExpand " << len;
-      ec_ = RdbError(errc::out_of_memory);
+      if (!rs->Add(llval)) {
+        LOG(ERROR) << "Duplicate set members detected";
+        ec_ = RdbError(errc::duplicate_key);
+        return;
+      }
+    }
+
+    if (rs && rs->IsDense()) {
+      pv_->InitRobj(OBJ_SET, kEncodingRoaring, rs.release());
       return;
     }
 
+    // Sized upfront to avoid resizing.
+    unique_ptr<StringSet> ss{new StringSet};
+    ss->Reserve(len);
+
     for (size_t i = 0; i < len; i++) {
-      sdsele = ToSds(ltrace->arr[i].rdb_var);
-      if (!sdsele)
+      string_view sv = ToSV(ltrace->arr[i].rdb_var);
+      if (ec_)
         return;
 
-      if (dictAdd((dict*)res->ptr, sdsele, NULL) != DICT_OK) {
+      if (!ss->Add(sv)) {
         LOG(ERROR) << "Duplicate set members detected";
         ec_ = RdbError(errc::duplicate_key);
         return;
       }
     }
+
+    pv_->InitRobj(OBJ_SET, kEncodingStrMap, ss.release());
+    return;
   }
 
   pv_->ImportRObj(res);
@@ -361,40 +443,29 @@ void RdbLoader::OpaqueObjLoader::CreateHMap(const LoadTrace* ltrace) {
     }
 
     lp = lpShrinkToFit(lp);
-    robj* o = createObject(OBJ_HASH, lp);
-    o->encoding = OBJ_ENCODING_LISTPACK;
+    res = createObject(OBJ_HASH, lp);
+    res->encoding = OBJ_ENCODING_LISTPACK;
   } else {
-    dict* hmap = dictCreate(&hashDictType);
-
-    auto cleanup = absl::MakeCleanup([&] { dictRelease(hmap); });
-
-    if (len > DICT_HT_INITIAL_SIZE) {
-      if (dictTryExpand(hmap, len) != DICT_OK) {
-        LOG(ERROR) << "OOM in dictTryExpand " << len;
-        ec_ = RdbError(errc::out_of_memory);
-        return;
-      }
-    }
+    // Sized upfront to avoid resizing.
+    unique_ptr<StringMap> map{new StringMap};
+    map->Reserve(len);
 
     for (size_t i = 0; i < len; ++i) {
-      sds key = ToSds(ltrace->arr[i * 2].rdb_var);
-      sds val = ToSds(ltrace->arr[i * 2 + 1].rdb_var);
-
-      if (!key || !val)
+      // ToSV may return a view of a buffer that is reused by the next call.
+      string field{ToSV(ltrace->arr[i * 2].rdb_var)};
+      string_view val = ToSV(ltrace->arr[i * 2 + 1].rdb_var);
+      if (ec_)
         return;
 
-      /* Add pair to hash table */
-      int ret = dictAdd(hmap, key, val);
-      if (ret == DICT_ERR) {
+      if (!map->Set(field, val, true)) {
         LOG(ERROR) << "Duplicate hash fields detected";
         ec_ = RdbError(errc::rdb_file_corrupted);
         return;
       }
     }
 
-    res = createObject(OBJ_HASH, hmap);
+    res = createObject(OBJ_HASH, map.release());
     res->encoding = OBJ_ENCODING_HT;
-    std::move(cleanup).Cancel();
   }
 
   DCHECK(res);
@@ -469,49 +540,51 @@ void RdbLoader::OpaqueObjLoader::CreateList(const LoadTrace* ltrace) {
 }
 
 void RdbLoader::OpaqueObjLoader::CreateZSet(const LoadTrace* ltrace) {
-  robj* res = createZsetObject();
-  zset* zs = (zset*)res->ptr;
-
-  auto cleanup = absl::Cleanup([&] { decrRefCount(res); });
-
   size_t zsetlen = ltrace->arr.size();
-  if (zsetlen > DICT_HT_INITIAL_SIZE && dictTryExpand(zs->dict, zsetlen) != DICT_OK) {
-    LOG(ERROR) << "OOM in dictTryExpand " << zsetlen;
-    ec_ = RdbError(errc::out_of_memory);
-    return;
-  }
+
+  // Sized upfront to avoid resizing.
+  unique_ptr<SortedMap> zs{new SortedMap};
+  zs->Reserve(zsetlen);
 
   size_t maxelelen = 0, totelelen = 0;
 
   for (size_t i = 0; i < zsetlen; ++i) {
-    sds sdsele = ToSds(ltrace->arr[i].rdb_var);
-    if (!sdsele)
+    string_view ele = ToSV(ltrace->arr[i].rdb_var);
+    if (ec_)
       return;
 
     double score = ltrace->arr[i].score;
+    maxelelen = max(maxelelen, ele.size());
+    totelelen += ele.size();
 
-    /* Don't care about integer-encoded strings. */
-    if (sdslen(sdsele) > maxelelen)
-      maxelelen = sdslen(sdsele);
-    totelelen += sdslen(sdsele);
-
-    zskiplistNode* znode = zslInsert(zs->zsl, score, sdsele);
-    int ret = dictAdd(zs->dict, sdsele, &znode->score);
-    if (ret != DICT_OK) {
+    if (!zs->Insert(score, ele)) {
       LOG(ERROR) << "Duplicate zset fields detected";
-      sdsfree(sdsele);
       ec_ = RdbError(errc::rdb_file_corrupted);
       return;
     }
   }
 
+  robj* res = nullptr;
+
   /* Convert *after* loading, since sorted sets are not stored ordered. */
-  if (zsetLength(res) <= server.zset_max_listpack_entries &&
-      maxelelen <= server.zset_max_listpack_value && lpSafeToAdd(NULL, totelelen)) {
-    zsetConvert(res, OBJ_ENCODING_LISTPACK);
-  }
+  if (zsetlen <= server.zset_max_listpack_entries && maxelelen <= server.zset_max_listpack_value &&
+      lpSafeToAdd(NULL, totelelen)) {
+    uint8_t* lp = lpNew(totelelen + zsetlen * 16);
+    if (!zs->Empty()) {
+      sds ele = sdsempty();
+      zs->Iterate(0, zsetlen, false, [&](string_view member, double score) {
+        ele = sdscpylen(ele, member.data(), member.size());
+        lp = zzlInsertAt(lp, NULL, ele, score);
+      });
+      sdsfree(ele);
+    }
 
-  std::move(cleanup).Cancel();
+    res = createObject(OBJ_ZSET, lpShrinkToFit(lp));
+    res->encoding = OBJ_ENCODING_LISTPACK;
+  } else {
+    res = createObject(OBJ_ZSET, zs.release());
+    res->encoding = OBJ_ENCODING_SKIPLIST;
+  }
 
   pv_->ImportRObj(res);
 }
@@ -632,9 +705,38 @@ void RdbLoader::OpaqueObjLoader::CreateStream(const LoadTrace* ltrace) {
   pv_->ImportRObj(res);
 }
 
+void RdbLoader::OpaqueObjLoader::CreateSbf(const LoadTrace* ltrace) {
+  CHECK(ltrace->sbf_trace);
+  const SbfTrace& trace = *ltrace->sbf_trace;
+
+  pmr::memory_resource* mr = CompactObj::memory_resource();
+  void* ptr = mr->allocate(sizeof(SBF), alignof(SBF));
+  SBF* sbf = new (ptr) SBF(trace.grow_factor, trace.fp_prob, trace.max_capacity, trace.prev_size,
+                           trace.current_size, mr);
+  for (const auto& [hash_cnt, blob] : trace.filters) {
+    sbf->AddFilter(blob, hash_cnt);
+  }
+
+  pv_->SetSBF(sbf);
+}
+
 void RdbLoader::OpaqueObjLoader::HandleBlob(string_view blob) {
   if (rdb_type_ == RDB_TYPE_STRING) {
-    pv_->SetString(blob);
+    pv_->SetValueString(blob);
+    return;
+  }
+
+  if (rdb_type_ == RDB_TYPE_JSON) {
+    pmr::memory_resource* mr = CompactObj::memory_resource();
+    JsonDoc* doc = new (mr->allocate(sizeof(JsonDoc), alignof(JsonDoc))) JsonDoc(mr);
+    if (!doc->Parse(blob, doc->root())) {
+      LOG(ERROR) << "Invalid json document";
+      doc->~JsonDoc();
+      mr->deallocate(doc, sizeof(JsonDoc), alignof(JsonDoc));
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return;
+    }
+    pv_->SetJson(doc);
     return;
   }
 
@@ -650,21 +752,24 @@ void RdbLoader::OpaqueObjLoader::HandleBlob(string_view blob) {
 
     unsigned len = intsetLen(is);
     if (len > SetFamily::MaxIntsetEntries()) {
-      res = createSetObject();
-      if (len > DICT_HT_INITIAL_SIZE && dictTryExpand((dict*)res->ptr, len) != DICT_OK) {
-        LOG(ERROR) << "OOM in dictTryExpand " << len;
-        decrRefCount(res);
-        ec_ = RdbError(errc::out_of_memory);
+      RoaringSet* rs = new RoaringSet;
+      SetFamily::ConvertTo(is, rs);
+      if (rs->IsDense()) {
+        pv_->InitRobj(OBJ_SET, kEncodingRoaring, rs);
         return;
       }
+      delete rs;
 
-      SetFamily::ConvertTo(is, (dict*)res->ptr);
-    } else {
-      intset* mine = (intset*)zmalloc(blob.size());
-      memcpy(mine, blob.data(), blob.size());
-      res = createObject(OBJ_SET, mine);
-      res->encoding = OBJ_ENCODING_INTSET;
+      StringSet* ss = new StringSet;
+      SetFamily::ConvertTo(is, ss);
+      pv_->InitRobj(OBJ_SET, kEncodingStrMap, ss);
+      return;
     }
+
+    intset* mine = (intset*)zmalloc(blob.size());
+    memcpy(mine, blob.data(), blob.size());
+    res = createObject(OBJ_SET, mine);
+    res->encoding = OBJ_ENCODING_INTSET;
   } else if (rdb_type_ == RDB_TYPE_HASH_ZIPLIST) {
     unsigned char* lp = lpNew(blob.size());
     if (!ziplistPairsConvertAndValidateIntegrity((const uint8_t*)blob.data(), blob.size(), &lp)) {
@@ -680,13 +785,7 @@ void RdbLoader::OpaqueObjLoader::HandleBlob(string_view blob) {
       return;
     }
 
-    res = createObject(OBJ_HASH, lp);
-    res->encoding = OBJ_ENCODING_LISTPACK;
-
-    if (lpBytes(lp) > HSetFamily::MaxListPackLen())
-      hashTypeConvert(res, OBJ_ENCODING_HT);
-    else
-      res->ptr = lpShrinkToFit((uint8_t*)res->ptr);
+    res = CreateHashFromListPack(lp);
   } else if (rdb_type_ == RDB_TYPE_ZSET_ZIPLIST) {
     unsigned char* lp = lpNew(blob.size());
     if (!ziplistPairsConvertAndValidateIntegrity((uint8_t*)blob.data(), blob.size(), &lp)) {
@@ -702,13 +801,12 @@ void RdbLoader::OpaqueObjLoader::HandleBlob(string_view blob) {
       return;
     }
 
-    res = createObject(OBJ_ZSET, lp);
-    res->encoding = OBJ_ENCODING_LISTPACK;
-
-    if (lpBytes(lp) > server.zset_max_listpack_entries)
-      zsetConvert(res, OBJ_ENCODING_SKIPLIST);
-    else
-      res->ptr = lpShrinkToFit(lp);
+    res = CreateZSetFromListPack(lp);
+  } else if (rdb_type_ == RDB_TYPE_SET_LISTPACK || rdb_type_ == RDB_TYPE_HASH_LISTPACK ||
+             rdb_type_ == RDB_TYPE_ZSET_LISTPACK) {
+    res = CreateFromListPack(blob);
+    if (!res)
+      return;
   } else {
     LOG(FATAL) << "Unsupported rdb type " << rdb_type_;
   }
@@ -716,6 +814,83 @@ void RdbLoader::OpaqueObjLoader::HandleBlob(string_view blob) {
   pv_->ImportRObj(res);
 }
 
+// The listpacks of the native encoding are adopted as they are, unless they exceed the limits
+// of this server. Returns null on error, and for the large sets, which are set into pv_ directly.
+robj* RdbLoader::OpaqueObjLoader::CreateFromListPack(string_view blob) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(blob.data());
+  if (!lpValidateIntegrity(const_cast<uint8_t*>(src), blob.size(), 0, NULL, NULL)) {
+    LOG(ERROR) << "Listpack integrity check failed.";
+    ec_ = RdbError(errc::rdb_file_corrupted);
+    return nullptr;
+  }
+
+  uint8_t* lp = (uint8_t*)zmalloc(blob.size());
+  memcpy(lp, src, blob.size());
+
+  size_t lplen = lpLength(lp);
+  if (lplen == 0) {
+    lpFree(lp);
+    ec_ = RdbError(errc::empty_key);
+    return nullptr;
+  }
+
+  robj* res = nullptr;
+  if (rdb_type_ == RDB_TYPE_SET_LISTPACK) {
+    if (lplen > SetFamily::MaxListPackEntries()) {
+      StringSet* ss = new StringSet;
+      SetFamily::ConvertTo(lp, ss);
+      lpFree(lp);
+
+      // Bypasses the robj, which would hold a dict.
+      pv_->InitRobj(OBJ_SET, kEncodingStrMap, ss);
+      return nullptr;
+    } else {
+      res = createObject(OBJ_SET, lp);
+      res->encoding = OBJ_ENCODING_LISTPACK;
+    }
+  } else if (rdb_type_ == RDB_TYPE_HASH_LISTPACK) {
+    res = CreateHashFromListPack(lp);
+  } else {
+    res = CreateZSetFromListPack(lp);
+  }
+
+  return res;
+}
+
+robj* RdbLoader::OpaqueObjLoader::CreateHashFromListPack(uint8_t* lp) {
+  robj* res = nullptr;
+  if (lpBytes(lp) <= HSetFamily::MaxListPackLen()) {
+    res = createObject(OBJ_HASH, lpShrinkToFit(lp));
+    res->encoding = OBJ_ENCODING_LISTPACK;
+    return res;
+  }
+
+  StringMap* map = new StringMap;
+  HSetFamily::ConvertTo(lp, map);
+  lpFree(lp);
+
+  res = createObject(OBJ_HASH, map);
+  res->encoding = OBJ_ENCODING_HT;
+  return res;
+}
+
+robj* RdbLoader::OpaqueObjLoader::CreateZSetFromListPack(uint8_t* lp) {
+  robj* res = nullptr;
+  if (lpLength(lp) / 2 <= server.zset_max_listpack_entries) {
+    res = createObject(OBJ_ZSET, lpShrinkToFit(lp));
+    res->encoding = OBJ_ENCODING_LISTPACK;
+    return res;
+  }
+
+  SortedMap* zs = new SortedMap;
+  ZSetFamily::ConvertTo(lp, zs);
+  lpFree(lp);
+
+  res = createObject(OBJ_ZSET, zs);
+  res->encoding = OBJ_ENCODING_SKIPLIST;
+  return res;
+}
+
 sds RdbLoader::OpaqueObjLoader::ToSds(const RdbVariant& obj) {
   if (holds_alternative<long long>(obj)) {
     return sdsfromlonglong(get<long long>(obj));
@@ -909,16 +1084,30 @@ error_code RdbLoader::Load(io::Source* src) {
         return RdbError(errc::bad_db_index);
       }
 
+      if (delta_base_ && !is_delta_) {
+        LOG(ERROR) << "Expected a delta of " << delta_base_;
+        return RdbError(errc::delta_mismatch);
+      }
+
+      // The batches of a replication stream select their db even if it did not change.
+      if (db_selected_ && dbid == cur_db_index_)
+        continue;
+
       VLOG(1) << "Select DB: " << dbid;
       for (unsigned i = 0; i < shard_set->size(); ++i) {
         // we should flush pending items before switching dbid.
         FlushShardAsync(i);
 
         // Active database if not existed before.
-        shard_set->Add(i, [dbid] { EngineShard::tlocal()->db_slice().ActivateDb(dbid); });
+        shard_set->Add(i, [dbid, shadow = into_shadow_] {
+          DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+          DbSlice::ShadowScope scope{&db_slice, shadow};
+          db_slice.ActivateDb(dbid);
+        });
       }
 
       cur_db_index_ = dbid;
+      db_selected_ = true;
       continue; /* Read next opcode. */
     }
 
@@ -938,12 +1127,67 @@ error_code RdbLoader::Load(io::Source* src) {
       continue; /* Read type again. */
     }
 
+    if (type == RDB_OPCODE_DELETED_KEY) {
+      string key;
+      SET_OR_RETURN(ReadKey(), key);
+
+      ShardId sid = Shard(key, shard_set->size());
+      shard_buf_[sid].emplace_back(Item{std::move(key), OpaqueObj{}, 0, true});
+      continue; /* Read next opcode. */
+    }
+
+    if (type == RDB_OPCODE_FLUSHED_DB) {
+      if (is_journal_) {
+        FlushJournalShard();
+        continue; /* Read next opcode. */
+      }
+
+      for (unsigned i = 0; i < shard_set->size(); ++i) {
+        FlushShardAsync(i);
+        shard_set->Add(i, [dbid = cur_db_index_, shadow = into_shadow_] {
+          DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+          DbSlice::ShadowScope scope{&db_slice, shadow};
+          db_slice.FlushDb(dbid, false);
+        });
+      }
+      continue; /* Read next opcode. */
+    }
+
+    if (type == RDB_OPCODE_COMPRESSED_ZSTD_BLOB) {
+      RETURN_ON_ERR(HandleCompressedBlob());
+      continue; /* Read the opcodes of the blob. */
+    }
+
+    if (type == RDB_OPCODE_JOURNAL_BARRIER && is_journal_) {
+      RETURN_ON_ERR(HandleJournalBarrier());
+      continue; /* Read next opcode. */
+    }
+
+    if (type == RDB_OPCODE_JOURNAL_BATCH && is_journal_) {
+      error_code ec = HandleJournalBatch();
+      if (ec) {
+        // The server stopped while writing the batch.
+        LOG(WARNING) << "Journal ends with an incomplete batch after " << bytes_read_
+                     << " bytes: " << ec.message();
+        break;
+      }
+      continue; /* Read the opcodes of the batch. */
+    }
+
     if (type == RDB_OPCODE_MODULE_AUX) {
       LOG(ERROR) << "Modules are not supported";
       return RdbError(errc::feature_not_supported);
     }
 
-    if (!rdbIsObjectType(type)) {
+    if (type == RDB_OPCODE_TIERED_REF) {
+      ++keys_loaded;
+      RETURN_ON_ERR(LoadTieredRef(&settings));
+      settings.Reset();
+      continue; /* Read next opcode. */
+    }
+
+    if (!rdbIsObjectType(type) && type != RDB_TYPE_SET_LISTPACK && type != RDB_TYPE_SBF &&
+        type != RDB_TYPE_JSON) {
       return RdbError(errc::invalid_rdb_type);
     }
 
@@ -958,7 +1202,29 @@ error_code RdbLoader::Load(io::Source* src) {
   }
 
   /* Verify the checksum if RDB version is >= 5 */
-  RETURN_ON_ERR(VerifyChecksum());
+  if (!is_journal_)
+    RETURN_ON_ERR(VerifyChecksum());
+
+  WaitApplied();
+
+  absl::Duration dur = absl::Now() - start;
+  double seconds = double(absl::ToInt64Milliseconds(dur)) / 1000;
+
+  // A replica loads the journal batches of its master all the time, see DFLY APPLY.
+  if (is_journal_) {
+    VLOG(1) << "Loaded the journal of " << keys_loaded << " keys in " << seconds << "s";
+    return kOk;
+  }
+
+  LOG(INFO) << "Done loading RDB, keys loaded: " << keys_loaded;
+  LOG(INFO) << "Loading finished after " << strings::HumanReadableElapsedTime(seconds);
+
+  return kOk;
+}
+
+void RdbLoader::WaitApplied() {
+  if (streaming_)
+    FlushFrames();
 
   fibers_ext::BlockingCounter bc(shard_set->size());
   for (unsigned i = 0; i < shard_set->size(); ++i) {
@@ -969,18 +1235,18 @@ error_code RdbLoader::Load(io::Source* src) {
     shard_set->Add(i, [bc]() mutable { bc.Dec(); });
   }
   bc.Wait();  // wait for sentinels to report.
-
-  absl::Duration dur = absl::Now() - start;
-  double seconds = double(absl::ToInt64Milliseconds(dur)) / 1000;
-  LOG(INFO) << "Done loading RDB, keys loaded: " << keys_loaded;
-  LOG(INFO) << "Loading finished after " << strings::HumanReadableElapsedTime(seconds);
-
-  return kOk;
 }
 
 error_code RdbLoader::EnsureReadInternal(size_t min_sz) {
   DCHECK_LT(mem_buf_.InputLen(), min_sz);
 
+  // The master may not write for a while, the entries that arrived must not wait for it.
+  // The padding of the frames makes the loader wait only between the frames.
+  if (streaming_) {
+    CompleteFrame();
+    FlushFrames();
+  }
+
   auto out_buf = mem_buf_.AppendBuffer();
   CHECK_GT(out_buf.size(), min_sz);
 
@@ -994,8 +1260,25 @@ error_code RdbLoader::EnsureReadInternal(size_t min_sz) {
   if (!res)
     return res.error();
 
-  if (*res < min_sz)
-    return RdbError(errc::rdb_file_corrupted);
+  if (*res < min_sz) {
+    // A journal of a server that did not shut down ends without the epilog. It is added to
+    // the input, so that reading ahead of the last entries does not fail.
+    if (!is_journal_ || tail_padded_)
+      return RdbError(errc::rdb_file_corrupted);
+
+    bytes_read_ += *res;
+    mem_buf_.CommitWrite(*res);
+    tail_padded_ = true;
+
+    io::Bytes input = mem_buf_.InputBuffer();
+    string padded(reinterpret_cast<const char*>(input.data()), input.size());
+    padded.push_back(char(RDB_OPCODE_EOF));
+    padded.append(8, '\0');  // the checksum.
+    mem_buf_.ConsumeInput(input.size());
+    PrependInput(io::Buffer(padded));
+
+    return mem_buf_.InputLen() < min_sz ? RdbError(errc::rdb_file_corrupted) : kOk;
+  }
 
   bytes_read_ += *res;
 
@@ -1163,6 +1446,74 @@ error_code RdbLoader::HandleAux() {
     }
   } else if (auxkey == "redis-bits") {
     /* Just ignored. */
+  } else if (auxkey == "snapshot-id") {
+    if (!absl::SimpleAtoi(auxval, &snapshot_id_)) {
+      LOG(ERROR) << "Bad snapshot-id value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+  } else if (auxkey == "delta-of") {
+    uint64_t base_id = 0;
+    if (!absl::SimpleAtoi(auxval, &base_id) || !delta_base_ || base_id != delta_base_) {
+      LOG(ERROR) << "Expected a delta of " << delta_base_ << ", got " << auxval;
+      return RdbError(errc::delta_mismatch);
+    }
+    is_delta_ = true;
+  } else if (auxkey == "compression") {
+    if (auxval != "zstd") {
+      LOG(ERROR) << "Unsupported compression " << auxval;
+      return RdbError(errc::feature_not_supported);
+    }
+  } else if (auxkey == "journal") {
+    // The entries of a journal replace the loaded ones.
+    is_journal_ = true;
+    is_delta_ = true;
+  } else if (auxkey == "journal-offset") {
+    uint64_t offset;
+    if (!absl::SimpleAtoi(auxval, &offset)) {
+      LOG(ERROR) << "Bad journal-offset value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+    if (stream_offset_)
+      stream_offset_->store(offset, memory_order_relaxed);
+  } else if (auxkey == "tiered-token") {
+    if (!absl::SimpleAtoi(auxval, &tiered_token_)) {
+      LOG(ERROR) << "Bad tiered-token value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+  } else if (auxkey == "journal-gen") {
+    if (!absl::SimpleAtoi(auxval, &journal_gen_)) {
+      LOG(ERROR) << "Bad journal-gen value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+  } else if (auxkey == "journal-shard" || auxkey == "journal-shards") {
+    uint32_t* dest = (auxkey == "journal-shard") ? &journal_shard_ : &journal_shards_;
+    if (!absl::SimpleAtoi(auxval, dest)) {
+      LOG(ERROR) << "Bad " << auxkey << " value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+  } else if (auxkey == "shard-id" || auxkey == "shard-count") {
+    uint32_t* dest = (auxkey == "shard-id") ? &source_shard_ : &source_shards_;
+    if (!absl::SimpleAtoi(auxval, dest)) {
+      LOG(ERROR) << "Bad " << auxkey << " value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+  } else if (auxkey == "repl-id") {
+    repl_id_ = auxval;
+  } else if (auxkey == "repl-offsets") {
+    repl_offsets_.clear();
+    for (string_view offset_str : absl::StrSplit(auxval, ',', absl::SkipEmpty())) {
+      uint64_t offset;
+      if (!absl::SimpleAtoi(offset_str, &offset)) {
+        LOG(ERROR) << "Bad repl-offsets value " << auxval;
+        return RdbError(errc::rdb_file_corrupted);
+      }
+      repl_offsets_.push_back(offset);
+    }
+  } else if (auxkey == "shard-files") {
+    if (!absl::SimpleAtoi(auxval, &shard_files_)) {
+      LOG(ERROR) << "Bad shard-files value " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
   } else {
     /* We ignore fields we don't understand, as by AUX field
      * contract. */
@@ -1172,6 +1523,164 @@ error_code RdbLoader::HandleAux() {
   return kOk;
 }
 
+error_code RdbLoader::HandleCompressedBlob() {
+  uint64_t clen, ulen;
+  SET_OR_RETURN(LoadLen(nullptr), clen);
+  SET_OR_RETURN(LoadLen(nullptr), ulen);
+
+  compr_buf_.resize(clen);
+  RETURN_ON_ERR(FetchBuf(clen, compr_buf_.data()));
+
+  // The uncompressed entries are put in front of the input that was read past the blob.
+  io::Bytes input = mem_buf_.InputBuffer();
+  string tail(reinterpret_cast<const char*>(input.data()), input.size());
+  mem_buf_.ConsumeInput(input.size());
+  mem_buf_.Reserve(ulen + tail.size());
+
+  io::MutableBytes dest = mem_buf_.AppendBuffer();
+  size_t res = ZSTD_decompress(dest.data(), dest.size(), compr_buf_.data(), clen);
+  if (ZSTD_isError(res) || res != ulen) {
+    LOG(ERROR) << "Bad compressed blob " << (ZSTD_isError(res) ? ZSTD_getErrorName(res) : "");
+    return RdbError(errc::rdb_file_corrupted);
+  }
+  mem_buf_.CommitWrite(res);
+
+  dest = mem_buf_.AppendBuffer();
+  DCHECK_GE(dest.size(), tail.size());
+  ::memcpy(dest.data(), tail.data(), tail.size());
+  mem_buf_.CommitWrite(tail.size());
+
+  return kOk;
+}
+
+error_code RdbLoader::HandleJournalBatch() {
+  if (streaming_)
+    CompleteFrame();
+
+  uint32_t len;
+  uint64_t crc;
+  SET_OR_RETURN(FetchInt<uint32_t>(), len);
+  SET_OR_RETURN(FetchInt<uint64_t>(), crc);
+
+  // The whole journal is in the input once its epilog was added, otherwise the length was
+  // read from the file.
+  if (tail_padded_ && len > mem_buf_.InputLen())
+    return RdbError(errc::rdb_file_corrupted);
+
+  compr_buf_.resize(len);
+  RETURN_ON_ERR(FetchBuf(len, compr_buf_.data()));
+
+  if (crc64(0, compr_buf_.data(), len) != crc)
+    return RdbError(errc::rdb_file_corrupted);
+
+  // LoadLen reads 9 bytes ahead, which would block a stream at the end of the frame until the
+  // next one arrives. The FREQ opcodes that follow the entries are ignored.
+  if (streaming_) {
+    compr_buf_.resize(len + 10);
+    for (size_t i = len; i < len + 10; i += 2) {
+      compr_buf_[i] = RDB_OPCODE_FREQ;
+      compr_buf_[i + 1] = 0;
+    }
+    frame_len_ = len;
+  }
+
+  PrependInput(io::Bytes{compr_buf_.data(), compr_buf_.size()});
+
+  return kOk;
+}
+
+void RdbLoader::CompleteFrame() {
+  completed_len_ += frame_len_;
+  frame_len_ = 0;
+}
+
+void RdbLoader::FlushFrames() {
+  for (unsigned i = 0; i < shard_set->size(); ++i)
+    FlushShardAsync(i);
+
+  // Releases the dispatches of the items, see Replica::GetPosition.
+  if (completed_len_ && stream_offset_)
+    stream_offset_->fetch_add(completed_len_, memory_order_release);
+  completed_len_ = 0;
+}
+
+error_code RdbLoader::HandleJournalBarrier() {
+  TxId txid;
+  uint64_t count;
+  SET_OR_RETURN(LoadLen(nullptr), txid);
+  SET_OR_RETURN(LoadLen(nullptr), count);
+  if (count > journal_shards_)
+    return RdbError(errc::rdb_file_corrupted);
+
+  vector<ShardId> shards(count);
+  for (ShardId& sid : shards) {
+    SET_OR_RETURN(LoadLen(nullptr), sid);
+    if (sid >= journal_shards_)
+      return RdbError(errc::rdb_file_corrupted);
+  }
+
+  // The batches of DFLY APPLY come through a single connection, so they are already in order.
+  if (!barrier_cb_)
+    return kOk;
+
+  WaitApplied();
+  if (!barrier_cb_(txid, shards))
+    return std::make_error_code(std::errc::operation_canceled);
+
+  return kOk;
+}
+
+void RdbLoader::PrependInput(io::Bytes buf) {
+  io::Bytes input = mem_buf_.InputBuffer();
+  string tail(reinterpret_cast<const char*>(input.data()), input.size());
+  mem_buf_.ConsumeInput(input.size());
+  mem_buf_.Reserve(buf.size() + tail.size());
+
+  io::MutableBytes dest = mem_buf_.AppendBuffer();
+  DCHECK_GE(dest.size(), buf.size() + tail.size());
+  if (!buf.empty())
+    ::memcpy(dest.data(), buf.data(), buf.size());
+  ::memcpy(dest.data() + buf.size(), tail.data(), tail.size());
+  mem_buf_.CommitWrite(buf.size() + tail.size());
+}
+
+void RdbLoader::FlushJournalShard() {
+  bool same_shards = journal_shards_ == shard_set->size();
+
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    FlushShardAsync(i);
+    if (same_shards && i != journal_shard_)
+      continue;
+
+    shard_set->Add(i, [this, same_shards, db_ind = cur_db_index_] {
+      DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+      if (same_shards) {
+        db_slice.FlushDb(db_ind, false);
+        return;
+      }
+
+      // The journal was written with another number of shards, so its keys are spread.
+      if (!db_slice.IsDbValid(db_ind))
+        return;
+
+      vector<string> keys;
+      PrimeTable* prime = db_slice.GetTables(db_ind).first;
+      PrimeTable::cursor cursor;
+      do {
+        cursor = prime->Traverse(cursor, [&](PrimeIterator it) {
+          string key = it->first.ToString();
+          if (Shard(key, journal_shards_) == journal_shard_)
+            keys.push_back(std::move(key));
+        });
+      } while (cursor);
+
+      for (const string& key : keys) {
+        db_slice.Del(db_ind, db_slice.FindExt(db_ind, key).first);
+      }
+    });
+  }
+}
+
 error_code RdbLoader::VerifyChecksum() {
   uint64_t expected;
 
@@ -1198,19 +1707,58 @@ void RdbLoader::FlushShardAsync(ShardId sid) {
   shard_set->Add(sid, std::move(cb));
 }
 
+error_code RdbLoader::LoadValue(string_view blob, PrimeValue* pv) {
+  RdbLoader loader{nullptr};
+  io::BytesSource source{io::Buffer(blob)};
+  loader.src_ = &source;
+
+  int type;
+  SET_OR_RETURN(loader.FetchType(), type);
+
+  io::Result<OpaqueObj> obj = loader.ReadObj(type);
+  if (!obj)
+    return obj.error();
+
+  OpaqueObjLoader visitor(obj->rdb_type, pv);
+  std::visit(visitor, obj->obj);
+  return visitor.ec();
+}
+
 void RdbLoader::LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib) {
   DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+  DbSlice::ShadowScope scope{&db_slice, into_shadow_};
   for (const auto& item : ib) {
     std::string_view key{item.key};
+
+    // The keys in a delta replace the loaded ones.
+    if (item.deleted || is_delta_) {
+      db_slice.Del(db_ind, db_slice.FindExt(db_ind, key).first);
+      if (item.deleted)
+        continue;
+    }
+
     PrimeValue pv;
-    OpaqueObjLoader visitor(item.val.rdb_type, &pv);
-    std::visit(visitor, item.val.obj);
+    if (item.ref.sid != kInvalidSid) {
+      TieredStorage* tiered = EngineShard::tlocal()->tiered_storage();
+      const TieredRef& ref = item.ref;
+      if (!tiered || !tiered->AttachExternal(tiered_token_, ref.sid, db_ind, ref.obj_type,
+                                             ref.offset, ref.len, ref.raw_len, &pv)) {
+        LOG(ERROR) << "The backing file does not have the value of '" << key << "'";
+        lock_guard lk(mu_);
+        ec_ = RdbError(errc::rdb_file_corrupted);
+        stop_early_ = true;
+        break;
+      }
+    } else {
+      OpaqueObjLoader visitor(item.val.rdb_type, &pv);
+      std::visit(visitor, item.val.obj);
 
-    if (visitor.ec()) {
-      lock_guard lk(mu_);
-      ec_ = visitor.ec();
-      stop_early_ = true;
-      break;
+      if (visitor.ec()) {
+        lock_guard lk(mu_);
+        ec_ = visitor.ec();
+        stop_early_ = true;
+        break;
+      }
     }
 
     auto [it, added] = db_slice.AddOrFind(db_ind, key, std::move(pv), item.expire_ms);
@@ -1397,6 +1945,10 @@ auto RdbLoader::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
       return ReadIntSet();
     case RDB_TYPE_HASH_ZIPLIST:
       return ReadHZiplist();
+    case RDB_TYPE_SET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+      return ReadListPack(rdbtype);
     case RDB_TYPE_HASH:
       return ReadHMap();
     case RDB_TYPE_ZSET:
@@ -1410,6 +1962,10 @@ auto RdbLoader::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
     case RDB_TYPE_STREAM_LISTPACKS:
       return ReadStreams();
       break;
+    case RDB_TYPE_SBF:
+      return ReadSbf();
+    case RDB_TYPE_JSON:
+      return ReadJson();
   }
 
   LOG(ERROR) << "Unsupported rdb type " << rdbtype;
@@ -1537,6 +2093,17 @@ auto RdbLoader::ReadHZiplist() -> io::Result<OpaqueObj> {
   return OpaqueObj{std::move(str_obj), RDB_TYPE_HASH_ZIPLIST};
 }
 
+auto RdbLoader::ReadListPack(int rdbtype) -> io::Result<OpaqueObj> {
+  RdbVariant str_obj;
+  SET_OR_UNEXPECT(ReadStringObj(), str_obj);
+
+  if (StrLen(str_obj) == 0) {
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  return OpaqueObj{std::move(str_obj), rdbtype};
+}
+
 auto RdbLoader::ReadHMap() -> io::Result<OpaqueObj> {
   uint64_t len;
   SET_OR_UNEXPECT(LoadLen(nullptr), len);
@@ -1767,9 +2334,77 @@ auto RdbLoader::ReadStreams() -> io::Result<OpaqueObj> {
   return OpaqueObj{std::move(load_trace), RDB_TYPE_STREAM_LISTPACKS};
 }
 
+auto RdbLoader::ReadSbf() -> io::Result<OpaqueObj> {
+  unique_ptr<LoadTrace> load_trace(new LoadTrace);
+  load_trace->sbf_trace.reset(new SbfTrace);
+  SbfTrace& sbf = *load_trace->sbf_trace;
+
+  uint64_t num_filters;
+  SET_OR_UNEXPECT(FetchBinaryDouble(), sbf.grow_factor);
+  SET_OR_UNEXPECT(FetchBinaryDouble(), sbf.fp_prob);
+  SET_OR_UNEXPECT(LoadLen(nullptr), sbf.prev_size);
+  SET_OR_UNEXPECT(LoadLen(nullptr), sbf.current_size);
+  SET_OR_UNEXPECT(LoadLen(nullptr), sbf.max_capacity);
+  SET_OR_UNEXPECT(LoadLen(nullptr), num_filters);
+
+  if (!(sbf.grow_factor > 1) || !(sbf.fp_prob > 0 && sbf.fp_prob < 1) || num_filters == 0) {
+    LOG(ERROR) << "Invalid bloom filter parameters";
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  sbf.filters.resize(num_filters);
+  for (auto& [hash_cnt, blob] : sbf.filters) {
+    SET_OR_UNEXPECT(LoadLen(nullptr), hash_cnt);
+    SET_OR_UNEXPECT(FetchGenericString(), blob);
+
+    if (hash_cnt == 0 || blob.empty() || blob.size() % Bloom::kBlockBytes != 0) {
+      LOG(ERROR) << "Invalid bloom filter of " << blob.size() << " bytes";
+      return Unexpected(errc::rdb_file_corrupted);
+    }
+  }
+
+  return OpaqueObj{std::move(load_trace), RDB_TYPE_SBF};
+}
+
+auto RdbLoader::ReadJson() -> io::Result<OpaqueObj> {
+  io::Result<RdbVariant> fetch = ReadStringObj();
+  if (!fetch)
+    return make_unexpected(fetch.error());
+
+  // The text of a document that is a small integer is saved as an integer.
+  if (const long long* val = get_if<long long>(&fetch.value())) {
+    string text = absl::StrCat(*val);
+    base::PODArray<char> arr;
+    arr.resize(text.size());
+    memcpy(arr.data(), text.data(), text.size());
+    return OpaqueObj{std::move(arr), RDB_TYPE_JSON};
+  }
+
+  return OpaqueObj{std::move(*fetch), RDB_TYPE_JSON};
+}
+
 void RdbLoader::ResizeDb(size_t key_num, size_t expire_num) {
   DCHECK_LT(key_num, 1U << 31);
   DCHECK_LT(expire_num, 1U << 31);
+
+  // A file of a per-shard snapshot that was saved with the same number of shards has exactly
+  // the keys of its shard. Otherwise the keys are spread over all the shards. Files of
+  // a per-shard snapshot are loaded concurrently, hence each loader reserves its share on top of
+  // what is already there.
+  bool same_shard = source_shards_ == shard_set->size();
+  size_t shard_keys = same_shard ? key_num : key_num / shard_set->size() + 1;
+  size_t shard_expires = same_shard ? expire_num : expire_num / shard_set->size() + 1;
+
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    if (same_shard && i != source_shard_)
+      continue;
+
+    shard_set->Add(i, [db_ind = cur_db_index_, shard_keys, shard_expires, shadow = into_shadow_] {
+      DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+      DbSlice::ShadowScope scope{&db_slice, shadow};
+      db_slice.Reserve(db_ind, shard_keys, shard_expires);
+    });
+  }
 }
 
 error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
@@ -1802,22 +2437,46 @@ error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
   if (should_expire) {
     // decrRefCount(val);
   } else {
-    ShardId sid = Shard(key, shard_set->size());
-    uint64_t expire_at_ms = settings->expiretime;
-
-    auto& out_buf = shard_buf_[sid];
+    PushItem(Item{std::move(key), std::move(val), uint64_t(settings->expiretime)});
+  }
 
-    out_buf.emplace_back(Item{std::move(key), std::move(val), expire_at_ms});
+  return kOk;
+}
 
-    constexpr size_t kBufSize = 128;
-    if (out_buf.size() >= kBufSize) {
-      FlushShardAsync(sid);
-    }
+error_code RdbLoader::LoadTieredRef(ObjSettings* settings) {
+  if (!tiered_token_) {
+    LOG(ERROR) << "Tiered references without the tiered-token aux field";
+    return RdbError(errc::rdb_file_corrupted);
   }
 
+  Item item{.expire_ms = uint64_t(settings->expiretime)};
+  SET_OR_RETURN(ReadKey(), item.key);
+
+  TieredRef& ref = item.ref;
+  SET_OR_RETURN(LoadLen(nullptr), ref.sid);
+  SET_OR_RETURN(LoadLen(nullptr), ref.offset);
+  SET_OR_RETURN(LoadLen(nullptr), ref.len);
+  SET_OR_RETURN(LoadLen(nullptr), ref.raw_len);
+  SET_OR_RETURN(LoadLen(nullptr), ref.obj_type);
+  if (ref.sid == kInvalidSid || ref.len == 0)
+    return RdbError(errc::rdb_file_corrupted);
+
+  PushItem(std::move(item));
   return kOk;
 }
 
+void RdbLoader::PushItem(Item item) {
+  ShardId sid = Shard(item.key, shard_set->size());
+  auto& out_buf = shard_buf_[sid];
+
+  out_buf.push_back(std::move(item));
+
+  constexpr size_t kBufSize = 128;
+  if (out_buf.size() >= kBufSize) {
+    FlushShardAsync(sid);
+  }
+}
+
 template <typename T> io::Result<T> RdbLoader::FetchInt() {
   auto ec = EnsureRead(sizeof(T));
   if (ec)
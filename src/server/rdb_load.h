@@ -3,8 +3,11 @@
 //
 #pragma once
 
+#include <atomic>
 #include <boost/fiber/mutex.hpp>
+#include <functional>
 #include <system_error>
+#include <vector>
 
 extern "C" {
 #include "redis/object.h"
@@ -14,6 +17,7 @@ extern "C" {
 #include "base/pod_array.h"
 #include "io/io.h"
 #include "server/common.h"
+#include "server/table.h"
 
 namespace dfly {
 
@@ -27,6 +31,9 @@ class RdbLoader {
   ~RdbLoader();
 
   std::error_code Load(::io::Source* src);
+
+  // Loads a value that was saved by RdbSerializer::SaveValue into pv.
+  static std::error_code LoadValue(std::string_view blob, PrimeValue* pv);
   void set_source_limit(size_t n) {
     source_limit_ = n;
   }
@@ -38,6 +45,56 @@ class RdbLoader {
     return bytes_read_;
   }
 
+  // The number of the shard files listed by the summary of a per-shard snapshot, 0 otherwise.
+  uint32_t shard_files() const {
+    return shard_files_;
+  }
+
+  // The id of the snapshot that can be followed by deltas, 0 if it has none.
+  uint64_t snapshot_id() const {
+    return snapshot_id_;
+  }
+
+  // Makes Load accept only a delta of the snapshot with that id. The entries of a delta
+  // replace the existing keys.
+  void set_delta_base(uint64_t snapshot_id) {
+    delta_base_ = snapshot_id;
+  }
+
+  // Makes Load put the entries into the shadow tables of the shards, see DbSlice::CreateShadow.
+  void set_into_shadow(bool val) {
+    into_shadow_ = val;
+  }
+
+  // The generation of the journals that follow the snapshot, 0 if it was taken without them.
+  uint32_t journal_gen() const {
+    return journal_gen_;
+  }
+
+  // The position in the replication stream of the master of the replica that saved the
+  // snapshot, see RdbSaver::SaveReplPosition. Empty if a master saved it.
+  const std::string& repl_id() const {
+    return repl_id_;
+  }
+
+  const std::vector<uint64_t>& repl_offsets() const {
+    return repl_offsets_;
+  }
+
+  // Called at RDB_OPCODE_JOURNAL_BARRIER once the entries before it were applied. Returns
+  // false to stop the load.
+  using BarrierCb = std::function<bool(TxId txid, const std::vector<ShardId>& shards)>;
+
+  // Loads a journal stream of a single shard that does not end, i.e. a flow of a replica. The
+  // entries are applied before Load waits for more input. Load returns once the source fails or
+  // cb returns false. offset is set to the offset of the stream after the last frame that
+  // was applied, see ReplicaStream.
+  void SetStreaming(BarrierCb cb, std::atomic_uint64_t* offset) {
+    streaming_ = true;
+    barrier_cb_ = std::move(cb);
+    stream_offset_ = offset;
+  }
+
  private:
   using MutableBytes = ::io::MutableBytes;
   struct ObjSettings;
@@ -92,23 +149,64 @@ class RdbLoader {
     std::vector<StreamCGTrace> cgroup;
   };
 
+  // See RDB_TYPE_SBF.
+  struct SbfTrace {
+    double grow_factor, fp_prob;
+    size_t prev_size, current_size, max_capacity;
+    std::vector<std::pair<unsigned, std::string>> filters;  // the hash count and the bits.
+  };
+
   struct LoadTrace {
     std::vector<LoadBlob> arr;
     std::unique_ptr<StreamTrace> stream_trace;
+    std::unique_ptr<SbfTrace> sbf_trace;
   };
 
   class OpaqueObjLoader;
 
+  // A value in the backing file of the tiered storage, see RDB_OPCODE_TIERED_REF.
+  struct TieredRef {
+    ShardId sid = kInvalidSid;  // kInvalidSid if the value is not a reference.
+    unsigned obj_type = 0;
+    size_t offset = 0;
+    size_t len = 0;
+    size_t raw_len = 0;
+  };
+
   struct Item {
     std::string key;
     OpaqueObj val;
     uint64_t expire_ms;
+    bool deleted = false;  // deleted by a delta snapshot.
+    TieredRef ref;
   };
   using ItemsBuf = std::vector<Item>;
 
   void ResizeDb(size_t key_num, size_t expire_num);
   std::error_code HandleAux();
 
+  // Decompresses RDB_OPCODE_COMPRESSED_ZSTD_BLOB into the front of mem_buf_.
+  std::error_code HandleCompressedBlob();
+
+  // Verifies RDB_OPCODE_JOURNAL_BATCH and puts its body into the front of mem_buf_.
+  std::error_code HandleJournalBatch();
+
+  // Called in the streaming mode once the entries of the frame were read.
+  void CompleteFrame();
+
+  // Dispatches the pending items to the shards, then counts the completed frames in
+  // stream_offset_, so that it does not run ahead of what the shards have.
+  void FlushFrames();
+
+  // Reads RDB_OPCODE_JOURNAL_BARRIER and waits at it in the streaming mode.
+  std::error_code HandleJournalBarrier();
+
+  // Puts buf in front of the input that was read past it.
+  void PrependInput(::io::Bytes buf);
+
+  // RDB_OPCODE_FLUSHED_DB of a journal, which covers only the keys of the shard of the journal.
+  void FlushJournalShard();
+
   ::io::Result<uint8_t> FetchType() {
     return FetchInt<uint8_t>();
   }
@@ -135,11 +233,14 @@ class RdbLoader {
   ::io::Result<OpaqueObj> ReadSet();
   ::io::Result<OpaqueObj> ReadIntSet();
   ::io::Result<OpaqueObj> ReadHZiplist();
+  ::io::Result<OpaqueObj> ReadListPack(int rdbtype);
   ::io::Result<OpaqueObj> ReadHMap();
   ::io::Result<OpaqueObj> ReadZSet(int rdbtype);
   ::io::Result<OpaqueObj> ReadZSetZL();
   ::io::Result<OpaqueObj> ReadListQuicklist(int rdbtype);
   ::io::Result<OpaqueObj> ReadStreams();
+  ::io::Result<OpaqueObj> ReadSbf();
+  ::io::Result<OpaqueObj> ReadJson();
 
   std::error_code EnsureRead(size_t min_sz) {
     if (mem_buf_.InputLen() >= min_sz)
@@ -150,9 +251,16 @@ class RdbLoader {
 
   std::error_code EnsureReadInternal(size_t min_sz);
   std::error_code LoadKeyValPair(int type, ObjSettings* settings);
+  std::error_code LoadTieredRef(ObjSettings* settings);
+
+  // Queues the item for its shard.
+  void PushItem(Item item);
   std::error_code VerifyChecksum();
   void FlushShardAsync(ShardId sid);
 
+  // Flushes the pending items and blocks until the shards have applied them.
+  void WaitApplied();
+
   void LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib);
   static size_t StrLen(const RdbVariant& tset);
 
@@ -165,6 +273,27 @@ class RdbLoader {
   size_t bytes_read_ = 0;
   size_t source_limit_ = SIZE_MAX;
   DbIndex cur_db_index_ = 0;
+  uint32_t shard_files_ = 0;
+  uint64_t snapshot_id_ = 0;
+  uint64_t delta_base_ = 0;
+  uint64_t tiered_token_ = 0;
+  uint32_t journal_gen_ = 0;
+  std::string repl_id_;
+  std::vector<uint64_t> repl_offsets_;
+  uint32_t journal_shard_ = 0;
+  uint32_t journal_shards_ = 0;
+  uint32_t source_shard_ = 0;   // the shard of a per-shard snapshot file.
+  uint32_t source_shards_ = 0;  // the number of its shards, 0 if it is not a shard file.
+  bool is_delta_ = false;
+  bool is_journal_ = false;
+  bool db_selected_ = false;
+  bool tail_padded_ = false;  // the epilog was added to the input of a journal, see EnsureRead.
+  bool streaming_ = false;
+  bool into_shadow_ = false;
+  BarrierCb barrier_cb_;
+  std::atomic_uint64_t* stream_offset_ = nullptr;
+  uint32_t frame_len_ = 0;  // of the frame that is being applied.
+  uint64_t completed_len_ = 0;  // of the frames that were not counted in stream_offset_ yet.
 
   ::boost::fibers::mutex mu_;
   std::error_code ec_;  // guarded by mu_
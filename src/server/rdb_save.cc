@@ -5,8 +5,11 @@
 #include "server/rdb_save.h"
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_join.h>
+#include <zstd.h>
 
 extern "C" {
 #include "redis/intset.h"
@@ -19,14 +22,33 @@ extern "C" {
 #include "redis/zset.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/bloom.h"
+#include "core/json.h"
+#include "core/roaring_set.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/rdb_extensions.h"
 #include "server/snapshot.h"
 #include "util/fibers/simple_channel.h"
 
 namespace dfly {
 
+ABSL_FLAG(int32_t, snapshot_compression_level, 0,
+          "If positive, the entries of the snapshots are compressed with zstd at this level, "
+          "in frames of about 64KB. 0 - disabled");
+ABSL_FLAG(bool, snapshot_deltas, false,
+          "If true, the snapshots log the deleted keys, so that SAVE DELTA can save the changes "
+          "since the previous snapshot");
+ABSL_FLAG(bool, snapshot_native_encoding, false,
+          "If true, the listpacks of the small hashes, sets and sorted sets and the nodes of the "
+          "lists are saved as they are in memory. Such snapshots are loaded faster but redis "
+          "versions before 7.2 can not read them");
+
 using namespace std;
 using base::IoBuf;
 using io::Bytes;
@@ -115,29 +137,33 @@ inline unsigned SerializeLen(uint64_t len, uint8_t* buf) {
   return 1 + 8;
 }
 
-uint8_t RdbObjectType(unsigned type, unsigned encoding) {
+// native - see FLAGS_snapshot_native_encoding.
+uint8_t RdbObjectType(unsigned type, unsigned encoding, bool native) {
   switch (type) {
     case OBJ_STRING:
       return RDB_TYPE_STRING;
     case OBJ_LIST:
       if (encoding == OBJ_ENCODING_QUICKLIST)
-        return RDB_TYPE_LIST_QUICKLIST;
+        return native ? RDB_TYPE_LIST_QUICKLIST_2 : RDB_TYPE_LIST_QUICKLIST;
       break;
     case OBJ_SET:
       if (encoding == kEncodingIntSet)
         return RDB_TYPE_SET_INTSET;
-      else if (encoding == kEncodingStrMap)
+      else if (encoding == kEncodingListPack && native)
+        return RDB_TYPE_SET_LISTPACK;
+      else if (encoding == kEncodingStrMap || encoding == kEncodingListPack ||
+               encoding == kEncodingRoaring)
         return RDB_TYPE_SET;
       break;
     case OBJ_ZSET:
-      if (encoding == OBJ_ENCODING_LISTPACK)
-        return RDB_TYPE_ZSET_ZIPLIST;  // we save using the old ziplist encoding.
+      if (encoding == OBJ_ENCODING_LISTPACK)  // otherwise saved using the old ziplist encoding.
+        return native ? RDB_TYPE_ZSET_LISTPACK : RDB_TYPE_ZSET_ZIPLIST;
       else if (encoding == OBJ_ENCODING_SKIPLIST)
         return RDB_TYPE_ZSET_2;
       break;
     case OBJ_HASH:
       if (encoding == OBJ_ENCODING_LISTPACK)
-        return RDB_TYPE_HASH_ZIPLIST;
+        return native ? RDB_TYPE_HASH_LISTPACK : RDB_TYPE_HASH_ZIPLIST;
       else if (encoding == OBJ_ENCODING_HT)
         return RDB_TYPE_HASH;
       break;
@@ -145,6 +171,10 @@ uint8_t RdbObjectType(unsigned type, unsigned encoding) {
       return RDB_TYPE_STREAM_LISTPACKS;
     case OBJ_MODULE:
       return RDB_TYPE_MODULE_2;
+    case OBJ_SBF:
+      return RDB_TYPE_SBF;
+    case OBJ_JSON:
+      return RDB_TYPE_JSON;
   }
   LOG(FATAL) << "Unknown encoding " << encoding << " for type " << type;
   return 0; /* avoid warning */
@@ -155,7 +185,9 @@ constexpr size_t kAmask = 4_KB - 1;
 
 }  // namespace
 
-RdbSerializer::RdbSerializer(io::Sink* s) : sink_(s), mem_buf_{4_KB}, tmp_buf_(nullptr) {
+RdbSerializer::RdbSerializer(io::Sink* s)
+    : sink_(s), native_encoding_(GetFlag(FLAGS_snapshot_native_encoding)), mem_buf_{4_KB},
+      tmp_buf_(nullptr) {
 }
 
 RdbSerializer::RdbSerializer(AlignedBuffer* aligned_buf) : RdbSerializer((io::Sink*)nullptr) {
@@ -187,9 +219,30 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   }
 
   string_view key = pk.GetSlice(&tmp_str_);
+  if (pv.IsExternal() && tiered_sid_ != kInvalidSid) {
+    auto [offset, len] = pv.GetExternalPtr();
+    ec = WriteOpcode(RDB_OPCODE_TIERED_REF);
+    if (!ec)
+      ec = SaveString(key);
+    if (!ec)
+      ec = SaveLen(tiered_sid_);
+    if (!ec)
+      ec = SaveLen(offset);
+    if (!ec)
+      ec = SaveLen(len);
+    if (!ec)
+      ec = SaveLen(pv.IsExternalCompressed() ? pv.Size() : 0);
+    if (!ec)
+      ec = SaveLen(pv.ObjType());
+
+    if (ec)
+      return make_unexpected(ec);
+    return RDB_OPCODE_TIERED_REF;
+  }
+
   unsigned obj_type = pv.ObjType();
   unsigned encoding = pv.Encoding();
-  uint8_t rdb_type = RdbObjectType(obj_type, encoding);
+  uint8_t rdb_type = RdbObjectType(obj_type, encoding, native_encoding_);
 
   DVLOG(3) << "Saving keyval start " << key;
 
@@ -202,12 +255,7 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
     return make_unexpected(ec);
 
   if (obj_type == OBJ_STRING) {
-    auto opt_int = pv.TryGetInt();
-    if (opt_int) {
-      ec = SaveLongLongAsString(*opt_int);
-    } else {
-      ec = SaveString(pv.GetSlice(&tmp_str_));
-    }
+    ec = SaveStringObject(pv);
   } else {
     ec = SaveObject(pv);
   }
@@ -217,6 +265,50 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   return rdb_type;
 }
 
+error_code RdbSerializer::SaveStringEntry(string_view key, string_view value, uint64_t expire_ms) {
+  if (expire_ms > 0) {
+    uint8_t buf[16];
+    buf[0] = RDB_OPCODE_EXPIRETIME_MS;
+    absl::little_endian::Store64(buf + 1, expire_ms);
+    RETURN_ON_ERR(WriteRaw(Bytes{buf, 9}));
+  }
+
+  RETURN_ON_ERR(WriteOpcode(RDB_TYPE_STRING));
+  RETURN_ON_ERR(SaveString(key));
+  return SaveString(value);
+}
+
+error_code RdbSerializer::SaveValueEntry(string_view key, string_view value, uint64_t expire_ms) {
+  DCHECK(!value.empty());
+  if (expire_ms > 0) {
+    uint8_t buf[16];
+    buf[0] = RDB_OPCODE_EXPIRETIME_MS;
+    absl::little_endian::Store64(buf + 1, expire_ms);
+    RETURN_ON_ERR(WriteRaw(Bytes{buf, 9}));
+  }
+
+  // The value starts with its rdb type, which precedes the key in an entry.
+  RETURN_ON_ERR(WriteOpcode(value[0]));
+  RETURN_ON_ERR(SaveString(key));
+  value.remove_prefix(1);
+  return WriteRaw(io::Buffer(value));
+}
+
+error_code RdbSerializer::SaveValue(const PrimeValue& pv) {
+  uint8_t rdb_type = RdbObjectType(pv.ObjType(), pv.Encoding(), native_encoding_);
+  RETURN_ON_ERR(WriteOpcode(rdb_type));
+  if (pv.ObjType() == OBJ_STRING)
+    return SaveStringObject(pv);
+  return SaveObject(pv);
+}
+
+error_code RdbSerializer::SaveStringObject(const PrimeValue& pv) {
+  auto opt_int = pv.TryGetInt();
+  if (opt_int)
+    return SaveLongLongAsString(*opt_int);
+  return SaveString(pv.GetSlice(&tmp_str_));
+}
+
 error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
   unsigned obj_type = pv.ObjType();
   CHECK_NE(obj_type, OBJ_STRING);
@@ -241,6 +333,14 @@ error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
     return SaveStreamObject(pv.AsRObj());
   }
 
+  if (obj_type == OBJ_SBF) {
+    return SaveSbfObject(pv);
+  }
+
+  if (obj_type == OBJ_JSON) {
+    return SaveJsonObject(pv);
+  }
+
   LOG(ERROR) << "Not implemented " << obj_type;
   return make_error_code(errc::function_not_supported);
 }
@@ -256,7 +356,18 @@ error_code RdbSerializer::SaveListObject(const robj* obj) {
   while (node) {
     DVLOG(3) << "QL node (encoding/container/sz): " << node->encoding << "/" << node->container
              << "/" << node->sz;
-    if (QL_NODE_IS_PLAIN(node)) {
+    if (native_encoding_) {
+      // RDB_TYPE_LIST_QUICKLIST_2: the container and the node as is, compressed or not.
+      RETURN_ON_ERR(SaveLen(node->container));
+      if (quicklistNodeIsCompressed(node)) {
+        void* data;
+        size_t compress_len = quicklistGetLzf(node, &data);
+
+        RETURN_ON_ERR(SaveLzfBlob(Bytes{reinterpret_cast<uint8_t*>(data), compress_len}, node->sz));
+      } else {
+        RETURN_ON_ERR(SaveString(node->entry, node->sz));
+      }
+    } else if (QL_NODE_IS_PLAIN(node)) {
       if (quicklistNodeIsCompressed(node)) {
         void* data;
         size_t compress_len = quicklistGetLzf(node, &data);
@@ -296,19 +407,43 @@ error_code RdbSerializer::SaveListObject(const robj* obj) {
 
 error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
   if (obj.Encoding() == kEncodingStrMap) {
-    dict* set = (dict*)obj.RObjPtr();
-
-    RETURN_ON_ERR(SaveLen(dictSize(set)));
-
-    dictIterator* di = dictGetIterator(set);
-    dictEntry* de;
-    auto cleanup = absl::MakeCleanup([di] { dictReleaseIterator(di); });
-
-    while ((de = dictNext(di)) != NULL) {
-      sds ele = (sds)de->key;
-
-      RETURN_ON_ERR(SaveString(string_view{ele, sdslen(ele)}));
+    const StringSet* set = (const StringSet*)obj.RObjPtr();
+
+    RETURN_ON_ERR(SaveLen(set->Size()));
+
+    error_code ec;
+    set->Iterate([&](string_view member) {
+      ec = SaveString(member);
+      return !ec;
+    });
+    RETURN_ON_ERR(ec);
+  } else if (obj.Encoding() == kEncodingListPack && native_encoding_) {
+    uint8_t* lp = (uint8_t*)obj.RObjPtr();
+    RETURN_ON_ERR(SaveString(lp, lpBytes(lp)));
+  } else if (obj.Encoding() == kEncodingListPack) {
+    // Saved as a regular set, the loader chooses the encoding by itself.
+    uint8_t* lp = (uint8_t*)obj.RObjPtr();
+    uint8_t intbuf[LP_INTBUF_SIZE];
+
+    RETURN_ON_ERR(SaveLen(lpLength(lp)));
+
+    for (uint8_t* p = lpFirst(lp); p; p = lpNext(lp, p)) {
+      int64_t len;
+      uint8_t* ele = lpGet(p, &len, intbuf);
+      RETURN_ON_ERR(SaveString(string_view{reinterpret_cast<char*>(ele), size_t(len)}));
     }
+  } else if (obj.Encoding() == kEncodingRoaring) {
+    // Saved as a regular set of integers, which the loader moves back to the bitmap.
+    const RoaringSet* rs = (const RoaringSet*)obj.RObjPtr();
+
+    RETURN_ON_ERR(SaveLen(rs->Size()));
+
+    error_code ec;
+    rs->Iterate([&](int64_t member) {
+      ec = SaveLongLongAsString(member);
+      return !ec;
+    });
+    RETURN_ON_ERR(ec);
   } else {
     CHECK_EQ(obj.Encoding(), kEncodingIntSet);
     intset* is = (intset*)obj.RObjPtr();
@@ -323,21 +458,18 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
 error_code RdbSerializer::SaveHSetObject(const robj* obj) {
   DCHECK_EQ(OBJ_HASH, obj->type);
   if (obj->encoding == OBJ_ENCODING_HT) {
-    dict* set = (dict*)obj->ptr;
-
-    RETURN_ON_ERR(SaveLen(dictSize(set)));
-
-    dictIterator* di = dictGetIterator(set);
-    dictEntry* de;
-    auto cleanup = absl::MakeCleanup([di] { dictReleaseIterator(di); });
-
-    while ((de = dictNext(di)) != NULL) {
-      sds key = (sds)de->key;
-      sds value = (sds)de->v.val;
-
-      RETURN_ON_ERR(SaveString(string_view{key, sdslen(key)}));
-      RETURN_ON_ERR(SaveString(string_view{value, sdslen(value)}));
-    }
+    const StringMap* map = (const StringMap*)obj->ptr;
+
+    RETURN_ON_ERR(SaveLen(map->Size()));
+
+    error_code ec;
+    map->Iterate([&](string_view field, string_view value) {
+      ec = SaveString(field);
+      if (!ec)
+        ec = SaveString(value);
+      return !ec;
+    });
+    RETURN_ON_ERR(ec);
   } else {
     CHECK_EQ(unsigned(OBJ_ENCODING_LISTPACK), obj->encoding);
 
@@ -345,7 +477,10 @@ error_code RdbSerializer::SaveHSetObject(const robj* obj) {
     size_t lplen = lpLength(lp);
     CHECK(lplen > 0 && lplen % 2 == 0);  // has (key,value) pairs.
 
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    if (native_encoding_)
+      RETURN_ON_ERR(SaveString(lp, lpBytes(lp)));
+    else
+      RETURN_ON_ERR(SaveListPackAsZiplist(lp));
   }
 
   return error_code{};
@@ -354,27 +489,27 @@ error_code RdbSerializer::SaveHSetObject(const robj* obj) {
 error_code RdbSerializer::SaveZSetObject(const robj* obj) {
   DCHECK_EQ(OBJ_ZSET, obj->type);
   if (obj->encoding == OBJ_ENCODING_SKIPLIST) {
-    zset* zs = (zset*)obj->ptr;
-    zskiplist* zsl = zs->zsl;
-
-    RETURN_ON_ERR(SaveLen(zsl->length));
-
-    /* We save the skiplist elements from the greatest to the smallest
-     * (that's trivial since the elements are already ordered in the
-     * skiplist): this improves the load process, since the next loaded
-     * element will always be the smaller, so adding to the skiplist
-     * will always immediately stop at the head, making the insertion
-     * O(1) instead of O(log(N)). */
-    zskiplistNode* zn = zsl->tail;
-    while (zn != NULL) {
-      RETURN_ON_ERR(SaveString(string_view{zn->ele, sdslen(zn->ele)}));
-      RETURN_ON_ERR(SaveBinaryDouble(zn->score));
-      zn = zn->backward;
-    }
+    const SortedMap* zs = (const SortedMap*)obj->ptr;
+
+    RETURN_ON_ERR(SaveLen(zs->Size()));
+
+    /* We save the elements from the greatest to the smallest, like redis does for the skiplist,
+     * so that the redis loader adds each element at the head of its skiplist. */
+    error_code ec;
+    zs->Iterate(zs->Size() - 1, zs->Size(), true, [&](string_view member, double score) {
+      if (!ec)
+        ec = SaveString(member);
+      if (!ec)
+        ec = SaveBinaryDouble(score);
+    });
+    RETURN_ON_ERR(ec);
   } else {
     CHECK_EQ(obj->encoding, unsigned(OBJ_ENCODING_LISTPACK)) << "Unknown zset encoding";
     uint8_t* lp = (uint8_t*)obj->ptr;
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    if (native_encoding_)
+      RETURN_ON_ERR(SaveString(lp, lpBytes(lp)));
+    else
+      RETURN_ON_ERR(SaveListPackAsZiplist(lp));
   }
 
   return error_code{};
@@ -457,6 +592,31 @@ error_code RdbSerializer::SaveStreamObject(const robj* obj) {
   return error_code{};
 }
 
+error_code RdbSerializer::SaveSbfObject(const PrimeValue& pv) {
+  const SBF* sbf = pv.GetSBF();
+
+  RETURN_ON_ERR(SaveBinaryDouble(sbf->grow_factor()));
+  RETURN_ON_ERR(SaveBinaryDouble(sbf->fp_probability()));
+  RETURN_ON_ERR(SaveLen(sbf->prev_size()));
+  RETURN_ON_ERR(SaveLen(sbf->current_size()));
+  RETURN_ON_ERR(SaveLen(sbf->max_capacity()));
+  RETURN_ON_ERR(SaveLen(sbf->num_filters()));
+
+  for (size_t i = 0; i < sbf->num_filters(); ++i) {
+    const Bloom& bloom = sbf->filter(i);
+    RETURN_ON_ERR(SaveLen(bloom.hash_cnt()));
+    RETURN_ON_ERR(SaveString(bloom.data()));
+  }
+
+  return error_code{};
+}
+
+error_code RdbSerializer::SaveJsonObject(const PrimeValue& pv) {
+  string text;
+  JsonDoc::Serialize(*pv.GetJson()->root(), &text);
+  return SaveString(text);
+}
+
 /* Save a long long value as either an encoded string or a string. */
 error_code RdbSerializer::SaveLongLongAsString(int64_t value) {
   uint8_t buf[32];
@@ -732,34 +892,121 @@ struct RdbSaver::Impl {
   SliceSnapshot::RecordChannel channel;
   vector<unique_ptr<SliceSnapshot>> shard_snapshots;
 
+  // Sizes of the key and the expire tables by shard and db index as of the start of the
+  // snapshot, written as RESIZEDB hints. Not set for the deltas.
+  vector<vector<pair<size_t, size_t>>> shard_db_sizes;
+
+  // Deletions of the delta snapshots, by shard.
+  struct ShardDelta {
+    vector<DbIndex> flushed;
+    vector<SliceSnapshot::DbRecord> deleted;
+  };
+  vector<ShardDelta> shard_deltas;
+
+  // Set if the body is compressed, see FLAGS_snapshot_compression_level.
+  ZSTD_CCtx* cctx = nullptr;
+  string compress_input;
+  base::PODArray<uint8_t> compress_output;
+
   // We pass K=sz to say how many producers are pushing data in order to maintain
   // correct closing semantics - channel is closing when K producers marked it as closed.
   Impl(unsigned producers_len, AlignedBuffer* aligned_buf)
-      : serializer(aligned_buf), channel{128, producers_len}, shard_snapshots(producers_len) {
+      : serializer(aligned_buf), channel{128, producers_len}, shard_snapshots(producers_len),
+        shard_db_sizes(producers_len), shard_deltas(producers_len) {
   }
 };
 
-RdbSaver::RdbSaver(::io::Sink* sink) : aligned_buf_(kBufLen, sink) {
+RdbSaver::RdbSaver(::io::Sink* sink, bool single_shard)
+    : aligned_buf_(kBufLen, sink), single_shard_(single_shard) {
   CHECK_NOTNULL(sink);
 
-  impl_.reset(new Impl(shard_set->size(), &aligned_buf_));
+  impl_.reset(new Impl(single_shard ? 1 : shard_set->size(), &aligned_buf_));
   // impl_->serializer.set_sink(sink_);
+
+  EnableCompression(GetFlag(FLAGS_snapshot_compression_level));
 }
 
 RdbSaver::~RdbSaver() {
+  ZSTD_freeCCtx(impl_->cctx);
 }
 
-std::error_code RdbSaver::SaveHeader(const StringVec& lua_scripts) {
+void RdbSaver::EnableCompression(int32_t level) {
+  if (level <= 0)
+    return;
+
+  if (!impl_->cctx) {
+    impl_->cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(impl_->cctx, ZSTD_c_checksumFlag, 0);
+  }
+  ZSTD_CCtx_setParameter(impl_->cctx, ZSTD_c_compressionLevel, level);
+}
+
+error_code RdbSaver::WriteBody(string_view buf) {
+  if (!impl_->cctx)
+    return aligned_buf_.Write(buf);
+
+  impl_->compress_input.append(buf);
+  if (impl_->compress_input.size() < kBufLen)
+    return error_code{};
+
+  return FlushCompressed();
+}
+
+error_code RdbSaver::FlushCompressed() {
+  string& input = impl_->compress_input;
+  if (input.empty())
+    return error_code{};
+
+  auto& output = impl_->compress_output;
+  output.resize(ZSTD_compressBound(input.size()));
+  size_t res = ZSTD_compress2(impl_->cctx, output.data(), output.size(), input.data(), input.size());
+  if (ZSTD_isError(res)) {
+    LOG(ERROR) << "Compression failed " << ZSTD_getErrorName(res);
+    return make_error_code(errc::io_error);
+  }
+
+  uint8_t buf[24];
+  buf[0] = RDB_OPCODE_COMPRESSED_ZSTD_BLOB;
+  unsigned len = 1;
+  len += SerializeLen(res, buf + len);
+  len += SerializeLen(input.size(), buf + len);
+
+  RETURN_ON_ERR(aligned_buf_.Write(io::Bytes{buf, len}));
+  RETURN_ON_ERR(aligned_buf_.Write(io::Bytes{output.data(), res}));
+  input.clear();
+
+  return error_code{};
+}
+
+std::error_code RdbSaver::SaveHeader(const StringVec& lua_scripts, uint32_t shard_files) {
   char magic[16];
   size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_VERSION);
   CHECK_EQ(9u, sz);
 
   RETURN_ON_ERR(impl_->serializer.WriteRaw(Bytes{reinterpret_cast<uint8_t*>(magic), sz}));
-  RETURN_ON_ERR(SaveAux(lua_scripts));
+  RETURN_ON_ERR(SaveAux(lua_scripts, shard_files));
 
   return error_code{};
 }
 
+error_code RdbSaver::SaveChainInfo(uint64_t snapshot_id, bool delta) {
+  return SaveAuxFieldStrStr(delta ? "delta-of" : "snapshot-id", absl::StrCat(snapshot_id));
+}
+
+error_code RdbSaver::SaveJournalGen(uint32_t gen) {
+  return SaveAuxFieldStrInt("journal-gen", gen);
+}
+
+error_code RdbSaver::SaveTieredToken(uint64_t token) {
+  tiered_refs_ = true;
+  return SaveAuxFieldStrStr("tiered-token", absl::StrCat(token));
+}
+
+error_code RdbSaver::SaveReplPosition(string_view master_id, const vector<uint64_t>& flow_offsets) {
+  RETURN_ON_ERR(SaveAuxFieldStrStr("repl-id", master_id));
+  return SaveAuxFieldStrStr("repl-offsets", absl::StrJoin(flow_offsets, ","));
+}
+
 error_code RdbSaver::SaveBody(RdbTypeFreqMap* freq_map) {
   RETURN_ON_ERR(impl_->serializer.FlushMem());
   VLOG(1) << "SaveBody , snapshots count: " << impl_->shard_snapshots.size();
@@ -774,29 +1021,78 @@ error_code RdbSaver::SaveBody(RdbTypeFreqMap* freq_map) {
   auto& channel = impl_->channel;
   error_code io_error;
 
+  // The totals over the shards, each db gets its hint once, before its first entries.
+  vector<pair<size_t, size_t>> db_sizes;
+  for (const auto& sizes : impl_->shard_db_sizes) {
+    db_sizes.resize(max(db_sizes.size(), sizes.size()));
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      db_sizes[i].first += sizes[i].first;
+      db_sizes[i].second += sizes[i].second;
+    }
+  }
+
   // we can not exit on io-error since we spawn fibers that push data.
   // TODO: we may signal them to stop processing and exit asap in case of the error.
   size_t channel_bytes = 0;
 
+  auto write_record = [&](const SliceSnapshot::DbRecord& record) -> error_code {
+    if (record.db_index != last_db_index) {
+      unsigned enclen = SerializeLen(record.db_index, buf + 1);
+      char* str = (char*)buf;
+
+      RETURN_ON_ERR(WriteBody(string_view{str, enclen + 1}));
+      last_db_index = record.db_index;
+
+      // The records of a single shard come db by db, hence the loader gets the size hint
+      // before the entries of the db and reserves its tables once. The records of several
+      // shards interleave, the hint precedes the first one.
+      if (record.db_index < db_sizes.size() && db_sizes[record.db_index].first > 0) {
+        RETURN_ON_ERR(SaveResizeDb(db_sizes[record.db_index]));
+        db_sizes[record.db_index] = {0, 0};
+      }
+    }
+
+    return WriteBody(record.value);
+  };
+
+  // The deletions of a delta come first, so that the loader applies them before the entries
+  // that were added since. The flushes of all the shards precede all the keys.
+  absl::flat_hash_set<DbIndex> flushed;
+  for (const auto& delta : impl_->shard_deltas) {
+    flushed.insert(delta.flushed.begin(), delta.flushed.end());
+  }
+  for (DbIndex db_index : flushed) {
+    char opcode = RDB_OPCODE_FLUSHED_DB;
+    if (!io_error)
+      io_error = write_record({.db_index = db_index, .value = string(1, opcode)});
+  }
+  for (auto& delta : impl_->shard_deltas) {
+    for (auto& record : delta.deleted) {
+      if (!io_error)
+        io_error = write_record(record);
+    }
+    delta.deleted.clear();
+  }
+
+  // The records are released to their snapshots even on error, so that the traversals that
+  // wait for the channel to drain can finish.
+  auto release = [](SliceSnapshot::DbRecord* record) {
+    if (record->source)
+      record->source->OnRecordWritten(record->value.size());
+    record->value.clear();
+  };
+
   while (channel.Pop(record)) {
-    if (io_error)
+    if (io_error) {
+      release(&record);
       continue;
+    }
 
     do {
-      if (record.db_index != last_db_index) {
-        unsigned enclen = SerializeLen(record.db_index, buf + 1);
-        char* str = (char*)buf;
-
-        io_error = aligned_buf_.Write(string_view{str, enclen + 1});
-        if (io_error)
-          break;
-        last_db_index = record.db_index;
-      }
-
       DVLOG(2) << "Pulled " << record.id;
       channel_bytes += record.value.size();
-      io_error = aligned_buf_.Write(record.value);
-      record.value.clear();
+      io_error = write_record(record);
+      release(&record);
     } while (!io_error && channel.TryPop(record));
 
   }  // while (channel.pop)
@@ -815,6 +1111,7 @@ error_code RdbSaver::SaveBody(RdbTypeFreqMap* freq_map) {
     return io_error;
   }
 
+  RETURN_ON_ERR(FlushCompressed());
   RETURN_ON_ERR(SaveEpilog());
 
   if (freq_map) {
@@ -829,15 +1126,61 @@ error_code RdbSaver::SaveBody(RdbTypeFreqMap* freq_map) {
   return error_code{};
 }
 
-void RdbSaver::StartSnapshotInShard(EngineShard* shard) {
+void RdbSaver::StartSnapshotInShard(EngineShard* shard, uint64_t delta_base) {
   DbTableArray databases = shard->db_slice().databases();
-  auto s = make_unique<SliceSnapshot>(std::move(databases), &shard->db_slice(), &impl_->channel);
+  unsigned index = single_shard_ ? 0 : shard->shard_id();
+
+  // Taken in the same hop as the snapshot starts, so that every deletion goes either into
+  // this snapshot or into the next one.
+  vector<DbSlice::DeltaLog> delta_log;
+  if (delta_base || GetFlag(FLAGS_snapshot_deltas))
+    delta_log = shard->db_slice().TakeDeltaLog();
+
+  for (size_t db_index = 0; delta_base && db_index < delta_log.size(); ++db_index) {
+    const DbSlice::DeltaLog& log = delta_log[db_index];
+    if (log.flushed)
+      impl_->shard_deltas[index].flushed.push_back(db_index);
+    if (log.deleted_keys.empty())
+      continue;
+
+    io::StringFile sfile;
+    RdbSerializer serializer(&sfile);
+    for (const string& key : log.deleted_keys) {
+      CHECK(!serializer.WriteOpcode(RDB_OPCODE_DELETED_KEY));
+      CHECK(!serializer.SaveString(key));
+    }
+    CHECK(!serializer.FlushMem());
+
+    impl_->shard_deltas[index].deleted.push_back(
+        {.db_index = DbIndex(db_index), .value = std::move(sfile.val)});
+  }
 
+  if (!delta_base) {
+    auto& db_sizes = impl_->shard_db_sizes[index];
+    db_sizes.resize(databases.size());
+    for (size_t i = 0; i < databases.size(); ++i) {
+      if (databases[i])
+        db_sizes[i] = {databases[i]->prime.size(), databases[i]->expire.size()};
+    }
+  }
+  auto s = make_unique<SliceSnapshot>(std::move(databases), &shard->db_slice(), &impl_->channel,
+                                      delta_base);
+
+  s->set_tiered_refs(tiered_refs_ && shard->tiered_storage());
   s->Start();
-  impl_->shard_snapshots[shard->shard_id()] = move(s);
+  impl_->shard_snapshots[index] = move(s);
+}
+
+vector<uint64_t> RdbSaver::snapshot_versions() const {
+  vector<uint64_t> res;
+  for (const auto& ptr : impl_->shard_snapshots) {
+    res.push_back(ptr ? ptr->snapshot_version() : 0);
+  }
+
+  return res;
 }
 
-error_code RdbSaver::SaveAux(const StringVec& lua_scripts) {
+error_code RdbSaver::SaveAux(const StringVec& lua_scripts, uint32_t shard_files) {
   static_assert(sizeof(void*) == 8, "");
 
   int aof_preamble = false;
@@ -857,10 +1200,36 @@ error_code RdbSaver::SaveAux(const StringVec& lua_scripts) {
     RETURN_ON_ERR(SaveAuxFieldStrStr("lua", s));
   }
 
+  if (shard_files > 0) {
+    RETURN_ON_ERR(SaveAuxFieldStrInt("shard-files", shard_files));
+  }
+
+  if (impl_->cctx) {
+    RETURN_ON_ERR(SaveAuxFieldStrStr("compression", "zstd"));
+  }
+
+  // The header of a shard file is written in the thread of its shard. With the same number of
+  // shards all its keys are loaded into that shard, see RdbLoader::ResizeDb.
+  EngineShard* shard = EngineShard::tlocal();
+  if (single_shard_ && shard) {
+    RETURN_ON_ERR(SaveAuxFieldStrInt("shard-id", shard->shard_id()));
+    RETURN_ON_ERR(SaveAuxFieldStrInt("shard-count", shard_set->size()));
+  }
+
   // TODO: "repl-stream-db", "repl-id", "repl-offset"
   return error_code{};
 }
 
+error_code RdbSaver::SaveResizeDb(pair<size_t, size_t> sizes) {
+  uint8_t buf[24];
+  buf[0] = RDB_OPCODE_RESIZEDB;
+  unsigned len = 1;
+  len += SerializeLen(sizes.first, buf + len);
+  len += SerializeLen(sizes.second, buf + len);
+
+  return WriteBody(string_view{reinterpret_cast<char*>(buf), len});
+}
+
 error_code RdbSaver::SaveEpilog() {
   uint8_t buf[8];
   uint64_t chksum;
@@ -50,30 +50,69 @@ class AlignedBuffer {
 
 class RdbSaver {
  public:
-  explicit RdbSaver(::io::Sink* sink);
+  // If single_shard is true, the body has only the entries of the shard that calls
+  // StartSnapshotInShard, i.e. the sink is a file of a per-shard snapshot.
+  explicit RdbSaver(::io::Sink* sink, bool single_shard = false);
   ~RdbSaver();
 
-  std::error_code SaveHeader(const StringVec& lua_scripts);
+  // Compresses the entries of the body with zstd at level if it is positive, like
+  // FLAGS_snapshot_compression_level does for all the savers. Called before SaveHeader.
+  void EnableCompression(int32_t level);
+
+  // shard_files is set by the summary of a per-shard snapshot, see SaveEpilog.
+  std::error_code SaveHeader(const StringVec& lua_scripts, uint32_t shard_files = 0);
+
+  // Aux fields of the snapshots that can be followed by deltas, written after SaveHeader.
+  // The deltas have the id of their base snapshot.
+  std::error_code SaveChainInfo(uint64_t snapshot_id, bool delta);
+
+  // Aux field of the snapshots taken with FLAGS_journal: the journals of generation gen and
+  // later have the changes since the snapshot.
+  std::error_code SaveJournalGen(uint32_t gen);
+
+  // Aux field of the snapshots that save the external values as references, see
+  // TieredStorage::BeginSnapshot. Called before StartSnapshotInShard.
+  std::error_code SaveTieredToken(uint64_t token);
+
+  // Aux fields of the snapshots that a replica saves: the id of its master and the offsets of
+  // the flows of the master from which the replication can continue, see Replica::Position.
+  std::error_code SaveReplPosition(std::string_view master_id,
+                                   const std::vector<uint64_t>& flow_offsets);
 
   // Writes the RDB file into sink. Waits for the serialization to finish.
   // Fills freq_map with the histogram of rdb types.
   // freq_map can optionally be null.
   std::error_code SaveBody(RdbTypeFreqMap* freq_map);
 
-  // Initiates the serialization in the shard's thread.
-  void StartSnapshotInShard(EngineShard* shard);
+  // Initiates the serialization in the shard's thread. A positive delta_base makes it a delta
+  // of the snapshot of the shard with that version: only the changed buckets, the deleted keys
+  // and the flushed dbs since then are saved. See DbSlice::TakeDeltaLog.
+  void StartSnapshotInShard(EngineShard* shard, uint64_t delta_base = 0);
 
- private:
-  struct Impl;
+  // Versions of the shard snapshots that can be passed as delta_base to the next snapshot,
+  // by shard id.
+  std::vector<uint64_t> snapshot_versions() const;
 
+  // Completes the file right after its header, without a body. Used for the summary of
+  // a per-shard snapshot. Called by SaveBody otherwise.
   std::error_code SaveEpilog();
 
-  std::error_code SaveAux(const StringVec& lua_scripts);
+ private:
+  struct Impl;
+
+  std::error_code SaveAux(const StringVec& lua_scripts, uint32_t shard_files);
+  std::error_code SaveResizeDb(std::pair<size_t, size_t> sizes);
   std::error_code SaveAuxFieldStrStr(std::string_view key, std::string_view val);
   std::error_code SaveAuxFieldStrInt(std::string_view key, int64_t val);
 
+  // The entries of the body go through the compressor if it is enabled.
+  std::error_code WriteBody(std::string_view buf);
+  std::error_code FlushCompressed();
+
   AlignedBuffer aligned_buf_;
   std::unique_ptr<Impl> impl_;
+  bool single_shard_;
+  bool tiered_refs_ = false;
 };
 
 // TODO: it does not make sense that RdbSerializer will buffer into unaligned
@@ -103,6 +142,24 @@ class RdbSerializer {
   std::error_code WriteRaw(const ::io::Bytes& buf);
   std::error_code SaveString(std::string_view val);
 
+  // Saves a string entry like SaveEntry does, from its copy. Can be called in any thread.
+  std::error_code SaveStringEntry(std::string_view key, std::string_view value,
+                                  uint64_t expire_ms);
+
+  // Saves the rdb type and the value without a key, see RdbLoader::LoadValue. The value must
+  // not be external.
+  std::error_code SaveValue(const PrimeValue& pv);
+
+  // Saves an entry from a value that SaveValue saved, e.g. of an external collection, as it is.
+  // Can be called in any thread.
+  std::error_code SaveValueEntry(std::string_view key, std::string_view value,
+                                 uint64_t expire_ms);
+
+  // Makes SaveEntry save the external values of the shard sid as RDB_OPCODE_TIERED_REF.
+  void set_tiered_shard(ShardId sid) {
+    tiered_sid_ = sid;
+  }
+
   std::error_code SaveString(const uint8_t* buf, size_t len) {
     return SaveString(std::string_view{reinterpret_cast<const char*>(buf), len});
   }
@@ -114,11 +171,14 @@ class RdbSerializer {
  private:
   std::error_code SaveLzfBlob(const ::io::Bytes& src, size_t uncompressed_len);
   std::error_code SaveObject(const PrimeValue& pv);
+  std::error_code SaveStringObject(const PrimeValue& pv);
   std::error_code SaveListObject(const robj* obj);
   std::error_code SaveSetObject(const PrimeValue& pv);
   std::error_code SaveHSetObject(const robj* obj);
   std::error_code SaveZSetObject(const robj* obj);
   std::error_code SaveStreamObject(const robj* obj);
+  std::error_code SaveSbfObject(const PrimeValue& pv);
+  std::error_code SaveJsonObject(const PrimeValue& pv);
   std::error_code SaveLongLongAsString(int64_t value);
   std::error_code SaveBinaryDouble(double val);
   std::error_code SaveListPackAsZiplist(uint8_t* lp);
@@ -127,6 +187,8 @@ class RdbSerializer {
 
   ::io::Sink* sink_ = nullptr;
   AlignedBuffer* aligned_buf_ = nullptr;
+  bool native_encoding_;  // see FLAGS_snapshot_native_encoding.
+  ShardId tiered_sid_ = kInvalidSid;
 
   std::unique_ptr<LZF_HSLOT[]> lzf_;
   base::IoBuf mem_buf_;
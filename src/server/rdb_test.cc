@@ -5,19 +5,27 @@
 
 extern "C" {
 #include "redis/crc64.h"
+#include "redis/rdb.h"
 #include "redis/zmalloc.h"
 }
 
 #include <absl/flags/reflection.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 #include <mimalloc.h>
 
+#include <filesystem>
+#include <random>
+
 #include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"  // needed to find operator== for RespExpr.
 #include "io/file.h"
 #include "server/engine_shard_set.h"
+#include "server/journal.h"
 #include "server/rdb_load.h"
+#include "server/rdb_save.h"
 #include "server/test_utils.h"
 #include "util/uring/uring_pool.h"
 
@@ -25,11 +33,22 @@ using namespace testing;
 using namespace std;
 using namespace util;
 using namespace facade;
+namespace fs = std::filesystem;
 using absl::SetFlag;
 using absl::StrCat;
 
 ABSL_DECLARE_FLAG(int32, list_compress_depth);
 ABSL_DECLARE_FLAG(int32, list_max_listpack_size);
+ABSL_DECLARE_FLAG(bool, df_snapshot_format);
+ABSL_DECLARE_FLAG(bool, snapshot_mapped);
+ABSL_DECLARE_FLAG(int32, snapshot_compression_level);
+ABSL_DECLARE_FLAG(bool, snapshot_deltas);
+ABSL_DECLARE_FLAG(bool, snapshot_native_encoding);
+ABSL_DECLARE_FLAG(bool, journal);
+ABSL_DECLARE_FLAG(uint64_t, snapshot_channel_bytes);
+ABSL_DECLARE_FLAG(string, journal_fsync);
+ABSL_DECLARE_FLAG(string, dir);
+ABSL_DECLARE_FLAG(uint32_t, num_shards);
 
 namespace dfly {
 
@@ -37,6 +56,10 @@ class RdbTest : public BaseFamilyTest {
  protected:
  protected:
   io::FileSource GetSource(string name);
+
+  // Returns the body of DFLY APPLY with the batches, like a master streams them to its replicas,
+  // see ReplicaStream.
+  static string ApplyBody(absl::Span<const string> batches);
 };
 
 inline const uint8_t* to_byte(const void* s) {
@@ -51,6 +74,27 @@ io::FileSource RdbTest::GetSource(string name) {
   return io::FileSource(*open_res);
 }
 
+string RdbTest::ApplyBody(absl::Span<const string> batches) {
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  auto save_aux = [&](string_view key, string_view val) {
+    CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+    CHECK(!serializer.SaveString(key));
+    CHECK(!serializer.SaveString(val));
+  };
+  CHECK(!serializer.WriteRaw(io::Buffer(string_view{"REDIS0009"})));
+  save_aux("journal", "1");
+  save_aux("journal-shards", StrCat(shard_set->size()));
+  CHECK(!serializer.FlushMem());
+
+  string rdb = std::move(sfile.val);
+  for (const string& batch : batches)
+    rdb.append(batch);
+  rdb.push_back(char(RDB_OPCODE_EOF));
+  rdb.append(8, '\0');
+  return rdb;
+}
+
 TEST_F(RdbTest, Crc) {
   std::string_view s{"TEST"};
 
@@ -156,6 +200,7 @@ TEST_F(RdbTest, Reload) {
 
   Run({"sadd", "set_key1", "val1", "val2"});
   Run({"sadd", "intset_key", "1", "2", "3"});
+  Run({"sadd", "large_set", "val", string(100, 'S')});
   Run({"hset", "small_hset", "field1", "val1", "field2", "val2"});
   Run({"hset", "large_hset", "field1", string(510, 'V'), string(120, 'F'), "val2"});
 
@@ -170,6 +215,8 @@ TEST_F(RdbTest, Reload) {
 
   EXPECT_EQ(2, CheckedInt({"scard", "set_key1"}));
   EXPECT_EQ(3, CheckedInt({"scard", "intset_key"}));
+  EXPECT_EQ(2, CheckedInt({"scard", "large_set"}));
+  EXPECT_THAT(Run({"smembers", "set_key1"}).GetVec(), UnorderedElementsAre("val1", "val2"));
   EXPECT_EQ(2, CheckedInt({"hlen", "small_hset"}));
   EXPECT_EQ(2, CheckedInt({"hlen", "large_hset"}));
   EXPECT_EQ(4, CheckedInt({"LLEN", "list_key2"}));
@@ -177,6 +224,33 @@ TEST_F(RdbTest, Reload) {
   EXPECT_EQ(2, CheckedInt({"ZCARD", "zs2"}));
 }
 
+TEST_F(RdbTest, ReloadNativeEncoding) {
+  SetFlag(&FLAGS_snapshot_native_encoding, true);
+  SetFlag(&FLAGS_list_compress_depth, 1);
+  SetFlag(&FLAGS_list_max_listpack_size, 2);
+
+  Run({"sadd", "intset", "1", "2", "3"});
+  Run({"sadd", "lp_set", "a", "b", "c"});
+  Run({"hset", "lp_hash", "f1", "v1", "f2", "v2"});
+  Run({"zadd", "lp_zset", "1.5", "a", "-1", "b"});
+  // The inner nodes are compressed.
+  Run({"rpush", "list", "a", "b", string(500, 'x'), "c", "d", "e", "f", "tail"});
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+
+  EXPECT_EQ(3, CheckedInt({"scard", "intset"}));
+  EXPECT_THAT(Run({"smembers", "lp_set"}).GetVec(), UnorderedElementsAre("a", "b", "c"));
+  EXPECT_EQ(Run({"hget", "lp_hash", "f2"}), "v2");
+  EXPECT_EQ(Run({"zscore", "lp_zset", "a"}), "1.5");
+  EXPECT_EQ(8, CheckedInt({"llen", "list"}));
+  EXPECT_EQ(Run({"lindex", "list", "2"}), string(500, 'x'));
+  EXPECT_EQ(Run({"lindex", "list", "-1"}), "tail");
+
+  SetFlag(&FLAGS_snapshot_native_encoding, false);
+  SetFlag(&FLAGS_list_compress_depth, 0);
+  SetFlag(&FLAGS_list_max_listpack_size, -2);
+}
+
 TEST_F(RdbTest, ReloadTtl) {
   Run({"set", "key", "val"});
   Run({"expire", "key", "1000"});
@@ -184,6 +258,292 @@ TEST_F(RdbTest, ReloadTtl) {
   EXPECT_LT(990, CheckedInt({"ttl", "key"}));
 }
 
+TEST_F(RdbTest, ReloadSbf) {
+  Run({"bf.reserve", "bf", "0.001", "10", "expansion", "4"});
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"bf.add", "bf", absl::StrCat("item:", i)});
+  }
+  Run({"bf.add", "small", "a"});
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+
+  for (unsigned i = 0; i < 100; ++i) {
+    ASSERT_EQ(1, CheckedInt({"bf.exists", "bf", absl::StrCat("item:", i)})) << i;
+  }
+  EXPECT_EQ(0, CheckedInt({"bf.add", "small", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.add", "small", "b"}));
+  EXPECT_EQ(Run({"type", "bf"}), "MBbloom--");
+}
+
+TEST_F(RdbTest, ReloadJson) {
+  constexpr string_view kDoc = R"({"a":[1,2.5,"x"],"b":{"c":null,"d":true}})";
+  Run({"json.set", "doc", "$", kDoc});
+  Run({"json.set", "num", "$", "42"});
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+
+  EXPECT_EQ(Run({"json.get", "doc"}), kDoc);
+  EXPECT_EQ(Run({"json.get", "num"}), "42");
+  EXPECT_EQ(Run({"type", "doc"}), "ReJSON-RL");
+}
+
+TEST_F(RdbTest, ReloadShardFiles) {
+  SetFlag(&FLAGS_df_snapshot_format, true);
+
+  Run({"debug", "populate", "10000"});
+  pp_->at(1)->Await([&] {
+    Run({"select", "1"});
+    Run({"hset", "hkey", "field", "val"});
+  });
+
+  auto resp = Run({"debug", "reload"});
+  ASSERT_EQ(resp, "OK");
+
+  auto save_info = service_->server_family().GetLastSaveInfo();
+  EXPECT_TRUE(absl::EndsWith(save_info->file_name, "-summary.dfs")) << save_info->file_name;
+
+  auto metrics = service_->server_family().GetMetrics();
+  ASSERT_EQ(2, metrics.db.size());
+  EXPECT_EQ(10000, metrics.db[0].key_count);
+  EXPECT_EQ(1, metrics.db[1].key_count);
+
+  SetFlag(&FLAGS_df_snapshot_format, false);
+}
+
+TEST_F(RdbTest, ReloadMappedShardFiles) {
+  SetFlag(&FLAGS_df_snapshot_format, true);
+  SetFlag(&FLAGS_snapshot_mapped, true);
+
+  Run({"debug", "populate", "1000"});
+  Run({"set", "str", "foo", "ex", "1000"});
+  pp_->at(1)->Await([&] {
+    Run({"select", "1"});
+    Run({"hset", "hkey", "field", "val"});
+  });
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+
+  // The shards serve the keys from the mapped files, which materialize them on access.
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+
+  EXPECT_EQ(Run({"get", "key:7"}), "value:7");
+  EXPECT_GT(CheckedInt({"ttl", "str"}), 990);
+  EXPECT_EQ(Run({"set", "key:8", "new"}), "OK");
+  EXPECT_EQ(Run({"get", "key:8"}), "new");
+  pp_->at(1)->Await([&] {
+    Run({"select", "1"});
+    EXPECT_EQ(Run({"hget", "hkey", "field"}), "val");
+  });
+
+  // The snapshot materializes the rest of the keys first.
+  ASSERT_EQ(Run({"save"}), "OK");
+  auto metrics = service_->server_family().GetMetrics();
+  ASSERT_EQ(2, metrics.db.size());
+  EXPECT_EQ(1001, metrics.db[0].key_count);
+  EXPECT_EQ(1, metrics.db[1].key_count);
+  EXPECT_EQ(Run({"get", "key:8"}), "new");
+
+  SetFlag(&FLAGS_snapshot_mapped, false);
+  SetFlag(&FLAGS_df_snapshot_format, false);
+}
+
+TEST_F(RdbTest, ReloadCompressed) {
+  SetFlag(&FLAGS_snapshot_compression_level, 3);
+
+  Run({"debug", "populate", "50000"});
+  Run({"select", "1"});
+  Run({"sadd", "skey", "a", "b", "c"});
+
+  auto resp = Run({"debug", "reload"});
+  ASSERT_EQ(resp, "OK");
+
+  auto metrics = service_->server_family().GetMetrics();
+  ASSERT_EQ(2, metrics.db.size());
+  EXPECT_EQ(50000, metrics.db[0].key_count);
+  EXPECT_EQ(1, metrics.db[1].key_count);
+
+  Run({"select", "0"});
+  EXPECT_EQ(Run({"get", "key:1234"}), "value:1234");
+
+  SetFlag(&FLAGS_snapshot_compression_level, 0);
+}
+
+TEST_F(RdbTest, DeltaSnapshots) {
+  SetFlag(&FLAGS_snapshot_deltas, true);
+
+  EXPECT_THAT(Run({"save", "delta"}), ErrArg("a delta requires"));
+
+  Run({"debug", "populate", "1000"});
+  Run({"select", "1"});
+  Run({"set", "flushed", "val"});
+
+  ASSERT_EQ(Run({"save"}), "OK");
+  string base_path = service_->server_family().GetLastSaveInfo()->file_name;
+
+  Run({"flushdb"});
+  Run({"set", "added", "val"});
+  Run({"select", "0"});
+  Run({"set", "key:1", "changed"});
+  Run({"del", "key:2"});
+  Run({"expire", "key:3", "1000"});
+  ASSERT_EQ(Run({"save", "delta"}), "OK");
+  EXPECT_TRUE(absl::EndsWith(service_->server_family().GetLastSaveInfo()->file_name,
+                             ".delta-0001"));
+
+  Run({"set", "key:2", "back"});
+  Run({"del", "key:4"});
+  ASSERT_EQ(Run({"save", "delta"}), "OK");
+
+  ASSERT_EQ(Run({"debug", "load", base_path}), "OK");
+  EXPECT_EQ(999, CheckedInt({"dbsize"}));
+  EXPECT_EQ(Run({"get", "key:1"}), "changed");
+  EXPECT_EQ(Run({"get", "key:2"}), "back");
+  EXPECT_EQ(0, CheckedInt({"exists", "key:4"}));
+  EXPECT_GT(CheckedInt({"ttl", "key:3"}), 0);
+
+  Run({"select", "1"});
+  EXPECT_EQ(0, CheckedInt({"exists", "flushed"}));
+  EXPECT_EQ(Run({"get", "added"}), "val");
+
+  SetFlag(&FLAGS_snapshot_deltas, false);
+}
+
+TEST_F(RdbTest, JournalReplay) {
+  string dir = (fs::temp_directory_path() / "journal_test").generic_string();
+  fs::remove_all(dir);
+  SetFlag(&FLAGS_journal, true);
+  SetFlag(&FLAGS_journal_fsync, "always");
+  SetFlag(&FLAGS_dir, dir);
+
+  // Restart with the journal.
+  TearDown();
+  SetUp();
+
+  Run({"set", "kept", "val"});
+  Run({"set", "deleted", "val"});
+  Run({"del", "deleted"});
+  Run({"set", "expiring", "val"});
+  Run({"expire", "expiring", "1000"});
+  Run({"select", "1"});
+  Run({"set", "flushed", "val"});
+  Run({"flushdb"});
+  Run({"set", "added", "val"});
+  Run({"select", "0"});
+
+  TearDown();
+  SetUp();
+
+  while (Run({"dbsize"}).type == RespExpr::ERROR) {
+    usleep(100);
+  }
+
+  EXPECT_EQ(Run({"get", "kept"}), "val");
+  EXPECT_EQ(0, CheckedInt({"exists", "deleted"}));
+  EXPECT_GT(CheckedInt({"ttl", "expiring"}), 0);
+  Run({"select", "1"});
+  EXPECT_EQ(0, CheckedInt({"exists", "flushed"}));
+  EXPECT_EQ(Run({"get", "added"}), "val");
+
+  SetFlag(&FLAGS_journal, false);
+  SetFlag(&FLAGS_journal_fsync, "interval");
+  SetFlag(&FLAGS_dir, "");
+  fs::remove_all(dir);
+}
+
+TEST_F(RdbTest, ApplyJournalBatches) {
+  vector<vector<string>> batches(shard_set->size());
+  vector<uint64_t> cb_ids(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    cb_ids[sid] = shard->journal()->RegisterOnBatch(
+        [&batches, sid](string_view batch) { batches[sid].emplace_back(batch); });
+  });
+
+  Run({"set", "kept", "val"});
+  Run({"set", "deleted", "val"});
+  Run({"del", "deleted"});
+  Run({"sadd", "set", "a", "b"});
+  Run({"select", "1"});
+  Run({"set", "flushed", "val"});
+  Run({"flushdb"});
+  Run({"set", "added", "val"});
+  Run({"select", "0"});
+
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard->journal()->UnregisterOnBatch(cb_ids[shard->shard_id()]);
+  });
+
+  Run({"flushall"});
+  for (const auto& shard_batches : batches) {
+    ASSERT_EQ(Run({"dfly", "apply", ApplyBody(shard_batches)}), "OK");
+  }
+
+  EXPECT_EQ(Run({"get", "kept"}), "val");
+  EXPECT_EQ(0, CheckedInt({"exists", "deleted"}));
+  EXPECT_EQ(2, CheckedInt({"scard", "set"}));
+  Run({"select", "1"});
+  EXPECT_EQ(0, CheckedInt({"exists", "flushed"}));
+  EXPECT_EQ(Run({"get", "added"}), "val");
+}
+
+TEST_F(RdbTest, SplitJournalBatches) {
+  // All the keys reside in the same shard.
+  shard_by_hashtag = true;
+  ShardId sid = Shard("{k}", shard_set->size());
+  vector<string> batches;
+  uint64_t cb_id = shard_set->Await(sid, [&] {
+    return EngineShard::tlocal()->journal()->RegisterOnBatch(
+        [&batches](string_view batch) { batches.emplace_back(batch); });
+  });
+
+  // A single transaction writes 2MB of incompressible values into a db other than 0.
+  mt19937 gen(42);
+  string val(256 << 10, '\0');
+  for (char& c : val)
+    c = 'a' + gen() % 26;
+  vector<string> keys;
+  for (unsigned i = 0; i < 8; ++i)
+    keys.push_back(StrCat("{k}", i));
+  vector<string_view> args = {"mset"};
+  for (const string& key : keys) {
+    args.push_back(key);
+    args.push_back(val);
+  }
+  Run({"select", "1"});
+  Run(absl::MakeConstSpan(args));
+
+  shard_set->Await(sid, [&] { EngineShard::tlocal()->journal()->UnregisterOnBatch(cb_id); });
+
+  // Each piece of the batch is applied on its own.
+  ASSERT_GE(batches.size(), 2u);
+  Run({"flushall"});
+  for (const string& batch : batches) {
+    EXPECT_LT(batch.size(), (1u << 20) + val.size() + 1024);
+    ASSERT_EQ(Run({"dfly", "apply", ApplyBody({batch})}), "OK");
+  }
+
+  for (const string& key : keys) {
+    EXPECT_EQ(Run({"get", key}), val);
+  }
+  Run({"select", "0"});
+  EXPECT_THAT(Run({"dbsize"}), IntArg(0));
+  shard_by_hashtag = false;
+}
+
+TEST_F(RdbTest, ReplPosition) {
+  io::StringFile sfile;
+  RdbSaver saver(&sfile);
+  ASSERT_FALSE(saver.SaveHeader({}));
+  ASSERT_FALSE(saver.SaveReplPosition("master-id", {10, 0, 25}));
+  ASSERT_FALSE(saver.SaveEpilog());
+
+  RdbLoader loader(nullptr);
+  io::BytesSource source{io::Buffer(sfile.val)};
+  ASSERT_FALSE(loader.Load(&source));
+  EXPECT_EQ(loader.repl_id(), "master-id");
+  EXPECT_THAT(loader.repl_offsets(), ElementsAre(10, 0, 25));
+}
+
 TEST_F(RdbTest, SaveFlush) {
   Run({"debug", "populate", "500000"});
 
@@ -205,6 +565,32 @@ TEST_F(RdbTest, SaveFlush) {
   EXPECT_EQ(500000, k_v.second);
 }
 
+TEST_F(RdbTest, SaveThrottled) {
+  SetFlag(&FLAGS_snapshot_channel_bytes, 1);
+  Run({"debug", "populate", "100000"});
+
+  auto save_fb = pp_->at(1)->LaunchFiber([&] {
+    RespExpr resp = Run({"save"});
+    ASSERT_EQ(resp, "OK");
+  });
+
+  do {
+    usleep(10);
+  } while (!service_->server_family().IsSaving());
+
+  // The buckets that are saved before the changes bypass the throttled traversal.
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"set", StrCat("key:", i), "changed"});
+  }
+  save_fb.join();
+
+  auto save_info = service_->server_family().GetLastSaveInfo();
+  ASSERT_EQ(1, save_info->freq_map.size());
+  EXPECT_EQ(100000, save_info->freq_map.front().second);
+
+  SetFlag(&FLAGS_snapshot_channel_bytes, 8ULL << 20);
+}
+
 TEST_F(RdbTest, SaveManyDbs) {
   Run({"debug", "populate", "50000"});
   pp_->at(1)->Await([&] {
@@ -257,4 +643,30 @@ TEST_F(RdbTest, SaveManyDbs) {
   }
 }
 
+// The threads without shards serialize the large strings.
+class RdbOffloadTest : public RdbTest {
+ protected:
+  RdbOffloadTest() {
+    SetFlag(&FLAGS_num_shards, 2);
+  }
+
+  ~RdbOffloadTest() {
+    SetFlag(&FLAGS_num_shards, 0);
+  }
+};
+
+TEST_F(RdbOffloadTest, Reload) {
+  Run({"debug", "populate", "10000", "key", "200"});
+  Run({"set", "small", "val"});
+  Run({"set", "large", string(1000, 'x'), "ex", "1000"});
+  string value = Run({"get", "key:42"}).GetString();
+
+  Run({"debug", "reload"});
+  EXPECT_THAT(Run({"dbsize"}), IntArg(10002));
+  EXPECT_EQ(Run({"get", "key:42"}), value);
+  EXPECT_EQ(Run({"get", "small"}), "val");
+  EXPECT_EQ(Run({"get", "large"}), string(1000, 'x'));
+  EXPECT_LT(990, CheckedInt({"ttl", "large"}));
+}
+
 }  // namespace dfly
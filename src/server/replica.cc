@@ -7,20 +7,34 @@ extern "C" {
 #include "redis/rdb.h"
 }
 
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/escaping.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/strip.h>
 
 #include <boost/asio/ip/tcp.hpp>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/redis_parser.h"
+#include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/main_service.h"
 #include "server/rdb_load.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(uint32_t, replica_squash, 64,
+          "A replica of a Redis master applies up to that many consecutive commands of the stream "
+          "together, so that single-shard commands run with a single hop per shard. 0 or 1 - "
+          "one at a time.");
+ABSL_FLAG(bool, replica_compression, false,
+          "If true, a replica of a Dragonfly master asks it to compress the full sync and the "
+          "journal streams, see repl_compression_level.");
+ABSL_FLAG(bool, replica_stale_reads, false,
+          "If true, a replica keeps serving its previous data during a full sync. The sync is "
+          "loaded aside and replaces the data once it completes, which takes memory for both.");
+
 namespace dfly {
 
 using namespace std;
@@ -32,40 +46,6 @@ namespace this_fiber = ::boost::this_fiber;
 
 namespace {
 
-// TODO: 2. Use time-out on socket-reads so that we would not deadlock on unresponsive master.
-//       3. Support ipv6 at some point.
-int ResolveDns(std::string_view host, char* dest) {
-  struct addrinfo hints, *servinfo;
-
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-  hints.ai_flags = AI_ALL;
-
-  int res = getaddrinfo(host.data(), NULL, &hints, &servinfo);
-  if (res != 0)
-    return res;
-
-  static_assert(INET_ADDRSTRLEN < INET6_ADDRSTRLEN, "");
-
-  res = EAI_FAMILY;
-  for (addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
-    if (p->ai_family == AF_INET) {
-      struct sockaddr_in* ipv4 = (struct sockaddr_in*)p->ai_addr;
-      const char* inet_res = inet_ntop(p->ai_family, &ipv4->sin_addr, dest, INET6_ADDRSTRLEN);
-      CHECK_NOTNULL(inet_res);
-      res = 0;
-      break;
-    }
-    LOG(WARNING) << "Only IPv4 is supported";
-  }
-
-  freeaddrinfo(servinfo);
-
-  return res;
-}
-
 error_code Recv(FiberSocketBase* input, base::IoBuf* dest) {
   auto buf = dest->AppendBuffer();
   io::Result<size_t> exp_size = input->Recv(buf);
@@ -168,6 +148,7 @@ void Replica::Stop() {
       state_mask_ = 0;  // Specifically ~R_ENABLED.
       auto ec = sock_->Shutdown(SHUT_RDWR);
       LOG_IF(ERROR, ec) << "Could not shutdown socket " << ec;
+      flows_ec_.notify();
     });
   }
   if (sync_fb_.joinable())
@@ -199,7 +180,7 @@ void Replica::ReplicateFb() {
     }
 
     if ((state_mask_ & R_SYNC_OK) == 0) {  // has not synced
-      ec = InitiatePSync();
+      ec = num_df_flows_ ? InitiateDflySync() : InitiatePSync();
       if (ec) {
         LOG(WARNING) << "Error syncing " << ec << " " << ec.message();
         state_mask_ &= R_ENABLED;  // reset
@@ -208,6 +189,15 @@ void Replica::ReplicateFb() {
       VLOG(1) << "Replica greet ok";
     }
 
+    if (num_df_flows_) {
+      ec = ConsumeDflyStream();
+      LOG_IF(ERROR, ec && !FiberSocketBase::IsConnClosed(ec)) << "Replica flow error " << ec;
+
+      // A Dragonfly master starts a new session with every sync.
+      state_mask_ &= R_ENABLED;
+      continue;
+    }
+
     // There is a data race condition in Redis-master code, where "ACK 0" handler may be
     // triggerred
     // before Redis is ready to transition to the streaming state and it silenty ignores "ACK
@@ -294,7 +284,9 @@ error_code Replica::Greet() {
   // Announce that we are the dragonfly client.
   // Note that we currently do not support dragonfly->redis replication.
   //
-  serializer.SendCommand("REPLCONF capa dragonfly");
+  serializer.SendCommand(absl::GetFlag(FLAGS_replica_compression)
+                             ? "REPLCONF capa dragonfly capa zstd"
+                             : "REPLCONF capa dragonfly");
   RETURN_ON_ERR(serializer.ec());
   RETURN_ON_ERR(Recv(sock_.get(), &io_buf));
 
@@ -312,9 +304,25 @@ error_code Replica::Greet() {
       LOG(ERROR) << "Unexpected command " << cmd;
       return make_error_code(errc::bad_message);
     }
+  } else if (args.size() == 3) {  // Dragonfly: the master id, the sync id and the flows.
+    unsigned num_flows = num_df_flows_;
+    if (!absl::SimpleAtoi(ToSV(args[2].GetBuf()), &num_df_flows_) || num_df_flows_ == 0) {
+      LOG(ERROR) << "Bad response " << args;
+      return make_error_code(errc::bad_message);
+    }
+
+    // The offsets of another master, e.g. one that restarted, are useless.
+    if (master_repl_id_ != cmd || num_flows != num_df_flows_) {
+      flow_offsets_.reset(new atomic_uint64_t[num_df_flows_]);
+      for (unsigned i = 0; i < num_df_flows_; ++i)
+        flow_offsets_[i].store(kUnknownOffset, memory_order_relaxed);
+    }
+    master_repl_id_ = string(cmd);
+    sync_id_ = string(ToSV(args[1].GetBuf()));
+    VLOG(1) << "Dragonfly master " << master_repl_id_ << " with " << num_df_flows_ << " flows";
   } else {
-    // TODO: dragonfly
-    LOG(FATAL) << "Bad response " << args;
+    LOG(ERROR) << "Bad response " << args;
+    return make_error_code(errc::bad_message);
   }
 
   state_mask_ |= R_GREETED;
@@ -357,11 +365,25 @@ error_code Replica::InitiatePSync() {
     SocketSource ss{sock_.get()};
     io::PrefixSource ps{io_buf.InputBuffer(), &ss};
 
+    bool stale_reads = absl::GetFlag(FLAGS_replica_stale_reads);
+    if (stale_reads)
+      shard_set->RunBriefInParallel([](EngineShard* shard) { shard->db_slice().CreateShadow(); });
+
     RdbLoader loader(NULL);
     loader.set_source_limit(snapshot_size);
+    loader.set_into_shadow(stale_reads);
     // TODO: to allow registering callbacks within loader to send '\n' pings back to master.
     // Also to allow updating last_io_time_.
     error_code ec = loader.Load(&ps);
+    if (stale_reads) {
+      shard_set->RunBriefInParallel([ec](EngineShard* shard) {
+        if (ec) {
+          shard->db_slice().DropShadow();
+        } else {
+          shard->db_slice().CommitShadow();
+        }
+      });
+    }
     RETURN_ON_ERR(ec);
     VLOG(1) << "full sync completed";
 
@@ -393,6 +415,296 @@ error_code Replica::InitiatePSync() {
   return error_code{};
 }
 
+error_code Replica::InitiateDflySync() {
+  state_mask_ |= R_SYNCING;
+
+  barrier_ = make_shared<TxBarrier>(num_df_flows_);
+  flows_synced_.store(0, memory_order_relaxed);
+  flows_done_.store(0, memory_order_relaxed);
+  flows_streaming_.store(false, memory_order_relaxed);
+
+  shard_flows_.resize(num_df_flows_);
+  for (unsigned i = 0; i < num_df_flows_; ++i) {
+    shard_flows_[i].reset(new Replica(host_, port_, &service_));
+    shard_flows_[i]->master_repl_id_ = master_repl_id_;
+    shard_flows_[i]->sync_id_ = sync_id_;
+    shard_flows_[i]->flow_id_ = i;
+  }
+
+  // Each flow is read by the thread of its shard, if the replica has as many threads.
+  ProactorPool& pool = service_.proactor_pool();
+  vector<error_code> flow_ec(num_df_flows_);
+  vector<::boost::fibers::fiber> fbs(num_df_flows_);
+  for (unsigned i = 0; i < num_df_flows_; ++i) {
+    fbs[i] = pool.at(i % pool.size())->LaunchFiber(
+        [this, i, &flow_ec] { flow_ec[i] = shard_flows_[i]->StartFlow(); });
+  }
+  for (auto& fb : fbs)
+    fb.join();
+
+  for (const error_code& ec : flow_ec) {
+    if (ec) {
+      CloseFlows();
+      return ec;
+    }
+  }
+
+  // The flows continue from their offsets if the master still has them.
+  string sync_cmd = StrCat("DFLY SYNC ", sync_id_);
+  bool known_offsets = true;
+  for (unsigned i = 0; i < num_df_flows_; ++i)
+    known_offsets &= flow_offsets_[i].load(memory_order_relaxed) != kUnknownOffset;
+  for (unsigned i = 0; known_offsets && i < num_df_flows_; ++i)
+    absl::StrAppend(&sync_cmd, " ", flow_offsets_[i].load(memory_order_relaxed));
+
+  base::IoBuf io_buf{128};
+  ReqSerializer serializer{sock_.get()};
+  serializer.SendCommand(sync_cmd);
+  error_code ec = serializer.ec();
+
+  string_view line;
+  if (!ec)
+    ec = ReadLine(&io_buf, &line);
+  if (!ec && line != "+FULLRESYNC" && line != "+CONTINUE") {
+    LOG(ERROR) << "Bad SYNC reply " << line;
+    ec = make_error_code(errc::bad_message);
+  }
+  if (ec) {
+    CloseFlows();
+    return ec;
+  }
+
+  bool partial = line == "+CONTINUE";
+  LOG(INFO) << (partial ? "Continuing the replication from the offsets of the flows"
+                        : "Starting a full sync with the master");
+
+  load_shadow_ = !partial && absl::GetFlag(FLAGS_replica_stale_reads);
+  if (!partial) {
+    full_sync_ = true;
+    ++full_syncs_;
+
+    // The data of the previous sync is dropped, or served until the new one is loaded.
+    if (load_shadow_) {
+      shard_set->RunBriefInParallel([](EngineShard* shard) { shard->db_slice().CreateShadow(); });
+    } else {
+      shard_set->RunBlockingInParallel(
+          [](EngineShard* shard) { shard->db_slice().FlushDb(DbSlice::kDbAll); });
+    }
+    for (unsigned i = 0; i < num_df_flows_; ++i)
+      flow_offsets_[i].store(kUnknownOffset, memory_order_relaxed);
+  }
+
+  for (unsigned i = 0; i < num_df_flows_; ++i) {
+    Replica* flow = shard_flows_[i].get();
+    flow->sync_fb_ =
+        flow->sock_thread_->LaunchFiber([this, flow, partial] { flow->FlowFb(this, partial); });
+  }
+
+  flows_ec_.await([this] {
+    return flows_synced_.load(memory_order_relaxed) == num_df_flows_ ||
+           flows_done_.load(memory_order_relaxed) > 0 || (state_mask_ & R_ENABLED) == 0;
+  });
+
+  bool synced = flows_synced_.load(memory_order_relaxed) == num_df_flows_;
+  if (load_shadow_) {
+    shard_set->RunBriefInParallel([synced](EngineShard* shard) {
+      if (synced) {
+        shard->db_slice().CommitShadow();
+      } else {
+        shard->db_slice().DropShadow();
+      }
+    });
+  }
+
+  if (!synced) {
+    CloseFlows();
+    return make_error_code(errc::connection_aborted);
+  }
+
+  // The journals apply to the loaded snapshots.
+  full_sync_ = false;
+  flows_streaming_.store(true, memory_order_relaxed);
+  flows_ec_.notify();
+
+  VLOG(1) << "Full sync of the " << num_df_flows_ << " flows completed";
+  last_io_time_ = sock_thread_->GetMonotonicTimeNs();
+  state_mask_ &= ~R_SYNCING;
+  state_mask_ |= R_SYNC_OK;
+
+  return error_code{};
+}
+
+error_code Replica::ConsumeDflyStream() {
+  ReqSerializer serializer{sock_.get()};
+  string ack_cmd;
+  unsigned ticks = 0;
+
+  // Acknowledges the offsets every second, so that the master reports the lag of the replica.
+  while (flows_done_.load(memory_order_relaxed) == 0 && (state_mask_ & R_ENABLED)) {
+    if (ticks++ % 10 == 0) {
+      ack_cmd = StrCat("REPLCONF ACK ", FlowsOffset());
+      serializer.SendCommand(ack_cmd);
+      if (serializer.ec())
+        break;
+    }
+
+    this_fiber::sleep_for(100ms);
+  }
+
+  CloseFlows();
+  return serializer.ec() ? serializer.ec() : make_error_code(errc::connection_aborted);
+}
+
+uint64_t Replica::FlowsOffset() const {
+  uint64_t res = 0;
+  for (unsigned i = 0; flow_offsets_ && i < num_df_flows_; ++i) {
+    uint64_t offset = flow_offsets_[i].load(memory_order_relaxed);
+    if (offset != kUnknownOffset)
+      res += offset;
+  }
+  return res;
+}
+
+error_code Replica::StartFlow() {
+  sock_thread_ = ProactorBase::me();
+  RETURN_ON_ERR(ConnectSocket());
+
+  ReqSerializer serializer{sock_.get()};
+  serializer.SendCommand(StrCat("DFLY FLOW ", master_repl_id_, " ", sync_id_, " ", flow_id_));
+  RETURN_ON_ERR(serializer.ec());
+
+  // The reply is the token that follows the snapshot of the flow.
+  leftover_buf_.reset(new base::IoBuf{128});
+  string_view line;
+  RETURN_ON_ERR(ReadLine(leftover_buf_.get(), &line));
+  if (line.size() != kRdbEofMarkSize + 1 || line[0] != '+') {
+    LOG(ERROR) << "Bad FLOW reply " << line;
+    return make_error_code(errc::bad_message);
+  }
+
+  eof_token_ = string(line.substr(1));
+  leftover_buf_->ConsumeInput(line.size() + 2);
+
+  return error_code{};
+}
+
+void Replica::FlowFb(Replica* owner, bool partial) {
+  SocketSource ss{sock_.get()};
+  io::PrefixSource ps{leftover_buf_->InputBuffer(), &ss};
+
+  RdbLoader loader(nullptr);
+  loader.set_into_shadow(owner->load_shadow_);
+  error_code ec;
+  if (!partial)
+    ec = loader.Load(&ps);
+
+  uint8_t buf[kRdbEofMarkSize];
+  io::PrefixSource chained(loader.Leftover(), &ps);
+  if (!ec && !partial) {
+    io::Result<size_t> eof_res = chained.Read(io::MutableBytes{buf});
+    if (!eof_res) {
+      ec = eof_res.error();
+    } else if (*eof_res != kRdbEofMarkSize || memcmp(eof_token_.data(), buf, kRdbEofMarkSize)) {
+      LOG(ERROR) << "Bad end of the snapshot of flow " << flow_id_;
+      ec = make_error_code(errc::bad_message);
+    }
+  }
+
+  if (!ec) {
+    VLOG(1) << "Flow " << flow_id_ << " loaded the snapshot";
+    owner->flows_synced_.fetch_add(1, memory_order_relaxed);
+    owner->flows_ec_.notify();
+
+    owner->flows_ec_.await([owner] {
+      return owner->flows_streaming_.load(memory_order_relaxed) ||
+             owner->flows_done_.load(memory_order_relaxed) > 0 ||
+             (owner->state_mask_ & R_ENABLED) == 0;
+    });
+    if (!owner->flows_streaming_.load(memory_order_relaxed))
+      ec = make_error_code(errc::connection_aborted);
+  }
+
+  if (!ec) {
+    // The journal of the shard follows the token.
+    io::PrefixSource stream(chained.unused_prefix(), &ps);
+    RdbLoader journal_loader(nullptr);
+    TxBarrier* barrier = owner->barrier_.get();
+    auto barrier_cb = [this, barrier](TxId txid, const vector<ShardId>& shards) {
+      return barrier->Wait(flow_id_, txid, shards);
+    };
+    journal_loader.SetStreaming(std::move(barrier_cb), &owner->flow_offsets_[flow_id_]);
+    ec = journal_loader.Load(&stream);
+  }
+
+  LOG_IF(WARNING, !FiberSocketBase::IsConnClosed(ec))
+      << "Flow " << flow_id_ << " stopped: " << ec.message();
+  owner->flows_done_.fetch_add(1, memory_order_relaxed);
+  owner->flows_ec_.notify();
+}
+
+void Replica::CloseFlows() {
+  barrier_->Cancel();
+
+  for (auto& flow : shard_flows_) {
+    if (!flow->sock_)
+      continue;
+    flow->sock_thread_->Await([&flow] {
+      auto ec = flow->sock_->Shutdown(SHUT_RDWR);
+      LOG_IF(ERROR, ec) << "Could not shutdown socket " << ec;
+    });
+  }
+
+  for (auto& flow : shard_flows_) {
+    if (flow->sync_fb_.joinable())
+      flow->sync_fb_.join();
+
+    // The sockets are closed by their threads.
+    if (flow->sock_) {
+      flow->sock_thread_->Await([&flow] {
+        auto ec = flow->sock_->Close();
+        LOG_IF(ERROR, ec) << "Error closing flow socket " << ec;
+        flow->sock_.reset();
+      });
+    }
+  }
+  shard_flows_.clear();
+}
+
+bool TxBarrier::Wait(unsigned flow, TxId txid, const vector<ShardId>& shards) {
+  unique_lock lk(mu_);
+  barriers_[txid].arrived.push_back(flow);
+  waiting_at_[flow] = txid;
+  cv_.notify_all();
+
+  auto can_pass = [&] {
+    if (cancelled_)
+      return true;
+
+    const vector<unsigned>& arrived = barriers_[txid].arrived;
+    for (ShardId sid : shards) {
+      DCHECK_LT(sid, waiting_at_.size());
+      if (find(arrived.begin(), arrived.end(), sid) == arrived.end() && waiting_at_[sid] <= txid)
+        return false;
+    }
+    return true;
+  };
+  cv_.wait(lk, can_pass);
+  waiting_at_[flow] = 0;
+
+  // The last flow of the transaction removes its barrier.
+  auto it = barriers_.find(txid);
+  if (++it->second.passed == shards.size())
+    barriers_.erase(it);
+
+  return !cancelled_;
+}
+
+void TxBarrier::Cancel() {
+  lock_guard lk(mu_);
+  cancelled_ = true;
+  cv_.notify_all();
+}
+
 error_code Replica::ParseReplicationHeader(base::IoBuf* io_buf, PSyncResponse* dest) {
   std::string_view str;
 
@@ -561,6 +873,41 @@ auto Replica::GetInfo() const -> Info {
     res.master_link_established = (state_mask_ & R_TCP_CONNECTED);
     res.sync_in_progress = (state_mask_ & R_SYNCING);
     res.master_last_io_sec = (ProactorBase::GetMonotonicTimeNs() - last_io_time_) / 1000000000UL;
+    res.repl_offset = FlowsOffset();
+    return res;
+  });
+}
+
+uint64_t Replica::Position::offset() const {
+  uint64_t res = 0;
+  for (uint64_t offset : flow_offsets)
+    res += offset;
+  return res;
+}
+
+auto Replica::GetPosition() const -> Position {
+  // The replica did not start yet.
+  if (!sock_thread_)
+    return Position{};
+
+  return sock_thread_->AwaitBrief([this] {
+    Position res;
+    res.master_id = master_repl_id_;
+    res.dragonfly = num_df_flows_ > 0;
+    res.full_syncs = full_syncs_;
+    if (full_sync_ || num_df_flows_ == 0 || !flow_offsets_)
+      return res;
+
+    // Acquires the dispatches of the batches that the flows counted, see
+    // RdbLoader::CompleteFrame.
+    for (unsigned i = 0; i < num_df_flows_; ++i) {
+      uint64_t offset = flow_offsets_[i].load(memory_order_acquire);
+      if (offset == kUnknownOffset) {
+        res.flow_offsets.clear();
+        break;
+      }
+      res.flow_offsets.push_back(offset);
+    }
     return res;
   });
 }
@@ -578,17 +925,24 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
   ConnectionContext conn_context{&null_sink, nullptr};
   conn_context.is_replicating = true;
 
+  const size_t squash_limit = absl::GetFlag(FLAGS_replica_squash);
+
   do {
     result = parser_->Parse(io_buf->InputBuffer(), &consumed, &cmd_args_);
 
     switch (result) {
       case RedisParser::OK:
         if (!cmd_args_.empty()) {
-          VLOG(2) << "Got command " << ToSV(cmd_args_[0].GetBuf()) << ToSV(cmd_args_[1].GetBuf())
-                  << "\n consumed: " << consumed;
-          facade::RespToArgList(cmd_args_, &cmd_str_args_);
-          CmdArgList arg_list{cmd_str_args_.data(), cmd_str_args_.size()};
-          service_.DispatchCommand(arg_list, &conn_context);
+          VLOG(2) << "Got command " << ToSV(cmd_args_[0].GetBuf()) << "\n consumed: " << consumed;
+          if (squash_limit > 1) {
+            AddToBatch(cmd_args_);
+            if (batch_lens_.size() >= squash_limit)
+              DispatchBatch(&conn_context);
+          } else {
+            facade::RespToArgList(cmd_args_, &cmd_str_args_);
+            CmdArgList arg_list{cmd_str_args_.data(), cmd_str_args_.size()};
+            service_.DispatchCommand(arg_list, &conn_context);
+          }
         }
         io_buf->ConsumeInput(consumed);
       break;
@@ -601,9 +955,49 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
         return std::make_error_code(std::errc::bad_message);
     }
   } while (io_buf->InputLen() > 0 && result == RedisParser::OK);
+
+  // The commands of the batch are not held back until the next read.
+  DispatchBatch(&conn_context);
   VLOG(1) << "ParseAndExecute: " << io_buf->InputLen() << " " << ToSV(io_buf->InputBuffer());
 
   return error_code{};
 }
 
+void Replica::AddToBatch(const facade::RespVec& args) {
+  for (const auto& arg : args) {
+    string_view val = ToSV(arg.GetBuf());
+    batch_buf_.append(val);
+    batch_arg_lens_.push_back(val.size());
+  }
+  batch_lens_.push_back(args.size());
+}
+
+void Replica::DispatchBatch(ConnectionContext* cntx) {
+  if (batch_lens_.empty())
+    return;
+
+  // batch_buf_ may reallocate while it is filled, so the slices are taken once it is complete.
+  cmd_str_args_.resize(batch_arg_lens_.size());
+  char* next = batch_buf_.data();
+  for (size_t i = 0; i < batch_arg_lens_.size(); ++i) {
+    cmd_str_args_[i] = MutableSlice{next, batch_arg_lens_[i]};
+    next += batch_arg_lens_[i];
+  }
+
+  absl::InlinedVector<CmdArgList, 16> args_list;
+  size_t start = 0;
+  for (uint32_t len : batch_lens_) {
+    args_list.emplace_back(cmd_str_args_.data() + start, len);
+    start += len;
+  }
+
+  // Single-shard commands are applied with a callback per shard in their order within the
+  // shard, the rest of the commands, including the transactions, separate them like barriers.
+  service_.DispatchManyCommands(absl::MakeSpan(args_list), cntx);
+
+  batch_buf_.clear();
+  batch_arg_lens_.clear();
+  batch_lens_.clear();
+}
+
 }  // namespace dfly
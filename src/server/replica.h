@@ -3,19 +3,55 @@
 //
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
+#include <atomic>
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
 #include <variant>
 
 #include "base/io_buf.h"
 #include "facade/facade_types.h"
 #include "facade/redis_parser.h"
+#include "server/common.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/event_count.h"
 
 namespace dfly {
 
 class Service;
 class ConnectionContext;
 
+// Orders the journals of the flows of a Dragonfly master at the barriers of its transactions
+// that span the shards, see RDB_OPCODE_JOURNAL_BARRIER. A flow passes the barrier once the
+// flows of the other shards of the transaction have reached it, or wait at the barrier of a
+// later transaction. In the latter case the master ran the two transactions out of order, so
+// they do not conflict in that shard, and waiting for it could deadlock.
+class TxBarrier {
+ public:
+  explicit TxBarrier(unsigned num_flows) : waiting_at_(num_flows, 0) {
+  }
+
+  // Thread-safe, blocks the fiber of the flow. Returns false once cancelled.
+  bool Wait(unsigned flow, TxId txid, const std::vector<ShardId>& shards);
+
+  // Releases the flows, e.g. when the replication stops.
+  void Cancel();
+
+ private:
+  struct Barrier {
+    std::vector<unsigned> arrived;  // the flows that reached it.
+    unsigned passed = 0;
+  };
+
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
+  absl::flat_hash_map<TxId, Barrier> barriers_;  // guarded by mu_
+  std::vector<TxId> waiting_at_;                 // by flow, 0 if it does not wait.
+  bool cancelled_ = false;
+};
+
 class Replica {
  public:
   Replica(std::string master_host, uint16_t port, Service* se);
@@ -43,11 +79,32 @@ class Replica {
     bool master_link_established;
     bool sync_in_progress;      // snapshot sync.
     time_t master_last_io_sec;  // monotonic clock.
+    uint64_t repl_offset;       // the sum of the offsets of the flows of a Dragonfly master.
   };
 
   // Threadsafe, fiber blocking.
   Info GetInfo() const;
 
+  // The position of the data of the replica in the stream of a Dragonfly master, which tags
+  // the snapshots that the replica saves.
+  struct Position {
+    std::string master_id;
+    bool dragonfly = false;  // the master is Dragonfly, a Redis master has no flows.
+
+    // By flow, empty unless the replica holds a prefix of the streams of all the flows, i.e. it
+    // does not run a full sync and every flow knows its offset. The offsets are lower bounds:
+    // the batches before them were applied, some after them may have been applied too. The
+    // batches carry the values of the keys, so applying them again is harmless.
+    std::vector<uint64_t> flow_offsets;
+    uint64_t full_syncs = 0;  // that were started so far.
+
+    uint64_t offset() const;  // the sum of flow_offsets, like repl_offset of Info.
+  };
+
+  // Threadsafe, fiber blocking. Once it returns, the shard queues have the batches before the
+  // offsets, so a callback that is dispatched to a shard afterwards sees their changes.
+  Position GetPosition() const;
+
  private:
   // The flow is : R_ENABLED -> R_TCP_CONNECTED -> (R_SYNCING) -> R_SYNC_OK.
   // SYNCING means that the initial ack succeeded. It may be optional if we can still load from
@@ -73,11 +130,35 @@ class Replica {
   std::error_code Greet();
   std::error_code InitiatePSync();
 
+  // Syncs with a Dragonfly master via a flow per master shard, see SyncSession.
+  std::error_code InitiateDflySync();
+
+  // Blocks until a flow fails or the replication stops.
+  std::error_code ConsumeDflyStream();
+
+  // Connects the flow and joins the sync session. Runs in the thread of the flow.
+  std::error_code StartFlow();
+
+  // Loads the snapshot of the flow shard unless the flow continues from its offset, then applies
+  // its journal until the stream breaks.
+  void FlowFb(Replica* owner, bool partial);
+
+  void CloseFlows();
+
+  // The sum of the known offsets of the flows.
+  uint64_t FlowsOffset() const;
+
   std::error_code ParseReplicationHeader(base::IoBuf* io_buf, PSyncResponse* header);
   std::error_code ReadLine(base::IoBuf* io_buf, std::string_view* line);
   std::error_code ConsumeRedisStream();
   std::error_code ParseAndExecute(base::IoBuf* io_buf);
 
+  // Copies a parsed command into the batch of the stream, see FLAGS_replica_squash.
+  void AddToBatch(const facade::RespVec& args);
+
+  // Applies the commands of the batch and clears it.
+  void DispatchBatch(ConnectionContext* cntx);
+
   Service& service_;
   std::string host_;
   std::string master_repl_id_;
@@ -92,11 +173,41 @@ class Replica {
   facade::RespVec cmd_args_;
   facade::CmdArgVec cmd_str_args_;
 
+  // The commands of the Redis stream that are applied together: their arguments one after
+  // another, the length of each argument and the number of the arguments of each command.
+  std::string batch_buf_;
+  std::vector<size_t> batch_arg_lens_;
+  std::vector<uint32_t> batch_lens_;
+
   // repl_offs - till what offset we've already read from the master.
   // ack_offs_ last acknowledged offset.
   size_t repl_offs_ = 0, ack_offs_ = 0;
   uint64_t last_io_time_ = 0;  // in ns, monotonic clock.
   unsigned state_mask_ = 0;
+
+  // Set by Greet if the master is Dragonfly.
+  std::string sync_id_;
+  unsigned num_df_flows_ = 0;
+
+  // The offsets of the flows in the streams of the master shards, kept across the syncs with
+  // the same master to continue from them. kUnknownOffset until a flow has its header.
+  static constexpr uint64_t kUnknownOffset = UINT64_MAX;
+  std::unique_ptr<std::atomic_uint64_t[]> flow_offsets_;
+
+  // The flows use the members above for their connections, they are indexed by the master shard.
+  std::vector<std::unique_ptr<Replica>> shard_flows_;
+  std::shared_ptr<TxBarrier> barrier_;
+  std::atomic_uint32_t flows_synced_{0}, flows_done_{0};
+  std::atomic_bool flows_streaming_{false};  // the flows apply their journals once all synced.
+  bool load_shadow_ = false;  // the full sync is loaded aside, see FLAGS_replica_stale_reads.
+  bool full_sync_ = false;    // the data is not a prefix of the streams until the sync is done.
+  uint64_t full_syncs_ = 0;
+  util::fibers_ext::EventCount flows_ec_;
+
+  // Of a flow.
+  uint32_t flow_id_ = 0;
+  std::string eof_token_;
+  std::unique_ptr<base::IoBuf> leftover_buf_;  // read past the reply to DFLY FLOW.
 };
 
 }  // namespace dfly
@@ -0,0 +1,290 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/replica_stream.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <zstd.h>
+
+extern "C" {
+#include "redis/rdb.h"
+}
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/journal.h"
+#include "server/rdb_extensions.h"
+#include "server/rdb_save.h"
+
+ABSL_FLAG(uint64_t, replica_output_limit, 256ULL << 20,
+          "A replica is disconnected once the writes that were not sent to it exceed this many "
+          "bytes, e.g. while it loads the snapshot. It syncs again when it reconnects.");
+
+namespace dfly {
+
+using namespace std;
+using absl::GetFlag;
+
+namespace {
+
+// The RESP bulk strings are limited to 64MB, see RedisParser.
+constexpr size_t kMaxApplyLen = 1 << 20;
+
+}  // namespace
+
+// The flushes of the batches have their shard.
+string ApplyHeader(ShardId flow_sid, uint64_t offset) {
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+
+  char magic[16];
+  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_VERSION);
+  CHECK_EQ(9u, sz);
+  CHECK(!serializer.WriteRaw(io::Bytes{reinterpret_cast<uint8_t*>(magic), sz}));
+
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+  CHECK(!serializer.SaveString("journal"));
+  CHECK(!serializer.SaveString("1"));
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+  CHECK(!serializer.SaveString("journal-shards"));
+  CHECK(!serializer.SaveString(absl::StrCat(shard_set->size())));
+  if (flow_sid != kInvalidSid) {
+    CHECK(!serializer.WriteOpcode(RDB_OPCODE_AUX));
+    CHECK(!serializer.SaveString("journal-offset"));
+    CHECK(!serializer.SaveString(absl::StrCat(offset)));
+  }
+  CHECK(!serializer.FlushMem());
+
+  return std::move(sfile.val);
+}
+
+ReplicaStream::ReplicaStream(ShardId flow_sid, int32_t compression_level)
+    : flow_sid_(flow_sid), queues_(shard_set->size()),
+      max_pending_bytes_(GetFlag(FLAGS_replica_output_limit)) {
+  if (compression_level > 0 && flow_sid != kInvalidSid) {
+    cctx_ = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, compression_level);
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_checksumFlag, 0);
+  }
+}
+
+ReplicaStream::~ReplicaStream() {
+  DCHECK(!send_fb_.joinable());
+  ZSTD_freeCCtx(cctx_);
+}
+
+void ReplicaStream::Attach(EngineShard* shard) {
+  ShardId sid = shard->shard_id();
+  DCHECK_EQ(0u, queues_[sid].cb_id);
+  DCHECK(flow_sid_ == kInvalidSid || flow_sid_ == sid);
+
+  if (flow_sid_ != kInvalidSid)
+    start_offset_ = shard->journal()->stream_offset();
+  queues_[sid].cb_id =
+      shard->journal()->RegisterOnBatch([this, sid](string_view batch) { Push(sid, batch); });
+}
+
+void ReplicaStream::AttachAt(EngineShard* shard, uint64_t offset) {
+  DCHECK_EQ(flow_sid_, shard->shard_id());
+
+  string missed;
+  shard->journal()->ReadBacklog(offset, &missed);
+  Attach(shard);
+
+  start_offset_ = offset;
+  if (!missed.empty())
+    Push(flow_sid_, missed);
+}
+
+void ReplicaStream::Start(ConnectionContext* cntx) {
+  DCHECK(!send_fb_.joinable());
+  send_fb_ = ::boost::fibers::fiber([this, cntx] { SendFb(cntx); });
+}
+
+void ReplicaStream::Stop() {
+  stopping_ = true;
+  pending_ec_.notify();
+  if (send_fb_.joinable())
+    send_fb_.join();
+
+  shard_set->RunBriefInParallel(
+      [this](EngineShard* shard) {
+        ShardQueue& queue = queues_[shard->shard_id()];
+        if (queue.cb_id) {
+          shard->journal()->UnregisterOnBatch(queue.cb_id);
+          queue.cb_id = 0;
+        }
+        queue.batches.clear();
+      },
+      [this](ShardId sid) { return flow_sid_ == kInvalidSid || flow_sid_ == sid; });
+}
+
+void ReplicaStream::Push(ShardId sid, string_view batch) {
+  // The replica syncs again, the batches are not needed anymore.
+  if (overflow_.load(memory_order_relaxed))
+    return;
+
+  uint64_t pending = pending_bytes_.fetch_add(batch.size(), memory_order_relaxed) + batch.size();
+  if (pending > max_pending_bytes_) {
+    overflow_.store(true, memory_order_relaxed);
+  } else {
+    queues_[sid].batches.emplace_back(batch);
+  }
+  pending_ec_.notify();
+}
+
+void ReplicaStream::SendFb(ConnectionContext* cntx) {
+  facade::SinkReplyBuilder* builder = cntx->reply_builder();
+  vector<vector<string>> taken(queues_.size());
+
+  // The header of a flow is followed by an empty frame, so that the replica parses it without
+  // waiting for the first batch and knows its offset right away.
+  if (flow_sid_ != kInvalidSid) {
+    string header = ApplyHeader(flow_sid_, start_offset_);
+    AppendBatchFrame("", &header);
+    builder->SendRaw(header);
+  }
+
+  while (true) {
+    pending_ec_.await([this] {
+      return stopping_ || pending_bytes_.load(memory_order_relaxed) > 0 ||
+             overflow_.load(memory_order_relaxed);
+    });
+    if (stopping_)
+      break;
+
+    if (overflow_.load(memory_order_relaxed)) {
+      LOG(WARNING) << "Replica " << cntx->owner()->RemoteEndpointStr()
+                   << " fell behind by more than " << max_pending_bytes_ << " bytes";
+      cntx->owner()->ShutdownSocket();
+      break;
+    }
+
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* shard) {
+          taken[shard->shard_id()].swap(queues_[shard->shard_id()].batches);
+        },
+        [this](ShardId sid) { return flow_sid_ == kInvalidSid || flow_sid_ == sid; });
+
+    if (flow_sid_ == kInvalidSid) {
+      SendApply(&taken, builder);
+    } else {
+      SendFlow(&taken[flow_sid_], builder);
+    }
+
+    if (builder->GetError()) {
+      VLOG(1) << "Replica " << cntx->owner()->RemoteEndpointStr() << " stream failed with "
+              << builder->GetError().message();
+      break;
+    }
+  }
+}
+
+void ReplicaStream::SendApply(vector<vector<string>>* taken, facade::SinkReplyBuilder* builder) {
+  const string header = ApplyHeader();
+  string body, prefix;
+
+  for (auto& batches : *taken) {
+    for (size_t i = 0; i < batches.size();) {
+      size_t sent = 0;
+      body = header;
+      do {
+        body.append(batches[i]);
+        sent += batches[i].size();
+        ++i;
+      } while (i < batches.size() && body.size() + batches[i].size() <= kMaxApplyLen);
+
+      // The checksum is not verified for the journals.
+      body.push_back(char(RDB_OPCODE_EOF));
+      body.append(8, '\0');
+
+      prefix = absl::StrCat("*3\r\n$4\r\nDFLY\r\n$5\r\nAPPLY\r\n$", body.size(), "\r\n");
+      string_view parts[] = {prefix, body, "\r\n"};
+      builder->SendRawVec(parts);
+      pending_bytes_.fetch_sub(sent, memory_order_relaxed);
+    }
+    batches.clear();
+  }
+}
+
+void ReplicaStream::SendFlow(vector<string>* batches, facade::SinkReplyBuilder* builder) {
+  if (batches->empty())
+    return;
+
+  string frames, body, frame;
+  size_t sent = 0;
+  for (size_t i = 0; i < batches->size();) {
+    body.clear();
+    do {
+      body.append((*batches)[i]);
+      ++i;
+    } while (i < batches->size() && body.size() + (*batches)[i].size() <= kMaxApplyLen);
+
+    sent += body.size();
+    if (cctx_) {
+      frame.clear();
+      AppendBatchFrame(body, &frame);
+      AppendCompressed(frame, &frames);
+    } else {
+      AppendBatchFrame(body, &frames);
+    }
+  }
+
+  builder->SendRaw(frames);
+  pending_bytes_.fetch_sub(sent, memory_order_relaxed);
+  batches->clear();
+}
+
+void ReplicaStream::AppendCompressed(string_view frame, string* dest) {
+  compress_output_.resize(ZSTD_compressBound(frame.size()));
+  size_t res = ZSTD_compress2(cctx_, compress_output_.data(), compress_output_.size(),
+                              frame.data(), frame.size());
+
+  // Small frames, e.g. of a single write, may not compress. The loader takes both.
+  if (ZSTD_isError(res) || res + 16 >= frame.size()) {
+    dest->append(frame);
+    return;
+  }
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_COMPRESSED_ZSTD_BLOB));
+  CHECK(!serializer.SaveLen(res));
+  CHECK(!serializer.SaveLen(frame.size()));
+  CHECK(!serializer.FlushMem());
+
+  dest->append(sfile.val);
+  dest->append(compress_output_.data(), res);
+}
+
+void SyncSession::Cancel() {
+  lock_guard lk(mu);
+  if (state == WAIT_FLOWS) {
+    state = CANCELLED;
+    cv.notify_all();
+  }
+}
+
+io::Result<size_t> ReplyBuilderSink::WriteSome(const iovec* v, uint32_t len) {
+  string_view parts[8];
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; i += 8) {
+    uint32_t count = min(len - i, 8u);
+    for (uint32_t j = 0; j < count; ++j) {
+      parts[j] = string_view{reinterpret_cast<const char*>(v[i + j].iov_base), v[i + j].iov_len};
+      total += v[i + j].iov_len;
+    }
+    builder_->SendRawVec(absl::Span<const string_view>{parts, count});
+  }
+
+  if (error_code ec = builder_->GetError())
+    return nonstd::make_unexpected(ec);
+  return total;
+}
+
+}  // namespace dfly
@@ -0,0 +1,164 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <string>
+#include <vector>
+
+#include "io/io.h"
+#include "server/common.h"
+#include "util/fibers/event_count.h"
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+
+namespace facade {
+class SinkReplyBuilder;
+}  // namespace facade
+
+namespace dfly {
+
+class ConnectionContext;
+class EngineShard;
+class RdbSaver;
+
+// The beginning of the rdb of DFLY APPLY and of the flows. The entries that follow it replace
+// the loaded ones.
+std::string ApplyHeader(ShardId flow_sid = kInvalidSid, uint64_t offset = 0);
+
+// The writes that a master streams to a replica after its full sync. The stream captures the
+// journal batches of each shard from the hop that starts the snapshot of the shard, see
+// ServerFamily::SyncGeneric, and sends them once the replica has loaded the snapshot. The
+// batches have the effects of the writes, like the journal files, so the replica applies them
+// without running the commands.
+//
+// Every command of the stream is DFLY APPLY with an rdb of the batches of a shard. The batches
+// of a shard keep their order. The shards have distinct keys, so the batches are not ordered
+// across the shards.
+//
+// The stream of a flow, i.e. a connection of a Dragonfly replica for a single shard, has only
+// the batches of that shard. It is a journal rdb that does not end: its batches are framed like
+// in the journal files and are ordered with the other flows by the barriers of the transactions,
+// see RDB_OPCODE_JOURNAL_BARRIER. Its header has the offset of the first batch in the stream of
+// the shard, the replica adds the lengths of the frames it applies to continue from there after
+// a disconnect. The frames of a flow are compressed with zstd if the replica asked for it, see
+// SyncSession::compression_level, so each flow compresses its shard in its own thread.
+class ReplicaStream {
+ public:
+  explicit ReplicaStream(ShardId flow_sid = kInvalidSid, int32_t compression_level = 0);
+  ~ReplicaStream();
+
+  // Called in the shard thread, in the hop that starts the snapshot of the shard, so that the
+  // batches have exactly the writes that the snapshot misses.
+  void Attach(EngineShard* shard);
+
+  // Continues the stream of a flow from offset in the backlog of the shard, which must have it,
+  // see Journal::BacklogHas.
+  void AttachAt(EngineShard* shard, uint64_t offset);
+
+  // Spawns the fiber that sends the batches to the replica. Called in the thread of the
+  // connection once the replica has loaded the snapshot.
+  void Start(ConnectionContext* cntx);
+
+  // Stops the fiber and detaches from the shards. Blocks the calling fiber.
+  void Stop();
+
+  bool started() const {
+    return send_fb_.joinable();
+  }
+
+ private:
+  struct ShardQueue {
+    std::vector<std::string> batches;  // accessed only in the shard thread.
+    uint64_t cb_id = 0;
+  };
+
+  // Called in the shard thread.
+  void Push(ShardId sid, std::string_view batch);
+
+  void SendFb(ConnectionContext* cntx);
+
+  // Sends the batches as DFLY APPLY commands.
+  void SendApply(std::vector<std::vector<std::string>>* taken,
+                 facade::SinkReplyBuilder* builder);
+
+  // Sends the batches of the flow shard as they are.
+  void SendFlow(std::vector<std::string>* batches, facade::SinkReplyBuilder* builder);
+
+  // Appends the frame to dest as RDB_OPCODE_COMPRESSED_ZSTD_BLOB if it gets smaller.
+  void AppendCompressed(std::string_view frame, std::string* dest);
+
+  ShardId flow_sid_;
+  ZSTD_CCtx* cctx_ = nullptr;
+  std::string compress_output_;
+  uint64_t start_offset_ = 0;  // of the flow in the stream of its shard.
+  std::vector<ShardQueue> queues_;  // by shard id.
+
+  // The replica is disconnected once the batches that were not sent exceed this limit.
+  uint64_t max_pending_bytes_;
+  std::atomic_uint64_t pending_bytes_{0};
+  std::atomic_bool overflow_{false};
+  util::fibers_ext::EventCount pending_ec_;
+
+  ::boost::fibers::fiber send_fb_;
+  bool stopping_ = false;
+};
+
+// The full sync of a Dragonfly replica with a connection per shard. REPLCONF CAPA dragonfly
+// creates it on the main connection of the replica, the flows join it with DFLY FLOW and wait
+// until DFLY SYNC starts the snapshots of all the shards in the same hop.
+//
+// The replica passes the offsets of its flows to DFLY SYNC to continue after a disconnect. Then
+// the flows are streamed from the backlogs of the shards if all of them have their offsets,
+// otherwise the session does a full sync.
+struct SyncSession {
+  enum State : uint8_t { WAIT_FLOWS, FULL_SYNC, PARTIAL_SYNC, CANCELLED };
+
+  // Owned by DFLY FLOW, which blocks until the state changes.
+  struct Flow {
+    RdbSaver* saver = nullptr;
+    ReplicaStream* stream = nullptr;
+  };
+
+  SyncSession(uint32_t id, unsigned num_flows, std::string address)
+      : id(id), address(std::move(address)), flows(num_flows) {
+  }
+
+  // Releases the flows that wait for the full sync. Called when the main connection closes.
+  void Cancel();
+
+  const uint32_t id;
+  const std::string address;  // of the main connection of the replica.
+
+  // The zstd level of the snapshots and the streams of the flows, 0 if they are not compressed.
+  // Set by REPLCONF CAPA zstd.
+  int32_t compression_level = 0;
+
+  // The sum of the offsets of the flows, as acknowledged by the replica with REPLCONF ACK.
+  std::atomic_uint64_t acked_offset{0};
+  std::atomic_uint64_t ack_time{0};  // in seconds, monotonic clock.
+
+  ::boost::fibers::mutex mu;
+  ::boost::fibers::condition_variable cv;
+  State state = WAIT_FLOWS;  // guarded by mu.
+  std::vector<Flow> flows;   // by shard id, guarded by mu.
+};
+
+// Writes the snapshot for a replica into its connection.
+class ReplyBuilderSink : public ::io::Sink {
+ public:
+  explicit ReplyBuilderSink(facade::SinkReplyBuilder* builder) : builder_(builder) {
+  }
+
+  ::io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+ private:
+  facade::SinkReplyBuilder* builder_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,886 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/s3_storage.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/escaping.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#ifdef DFLY_USE_SSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/operations.hpp>
+#include <deque>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "server/common.h"
+#include "util/fibers/event_count.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(std::string, s3_endpoint, "",
+          "host[:port] of the S3 compatible storage of the s3:// snapshot paths, which is "
+          "accessed over http. Defaults to s3.<s3_region>.amazonaws.com");
+ABSL_FLAG(std::string, s3_region, "us-east-1", "The region of the s3:// snapshot paths");
+ABSL_FLAG(uint32_t, s3_part_size_mb, 8,
+          "The size of the parts of the uploads and of the ranges of the downloads of the "
+          "s3:// snapshot paths, at least 5");
+ABSL_FLAG(uint32_t, s3_max_inflight, 4,
+          "How many parts each s3:// snapshot file uploads or downloads in parallel. A file "
+          "buffers that many parts plus one");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using absl::StrCat;
+
+namespace this_fiber = ::boost::this_fiber;
+
+namespace {
+
+constexpr string_view kS3Scheme = "s3://";
+
+}  // namespace
+
+bool IsS3Path(string_view path) {
+  return absl::StartsWith(path, kS3Scheme);
+}
+
+#ifdef DFLY_USE_SSL
+
+namespace {
+
+constexpr string_view kUnsignedPayload = "UNSIGNED-PAYLOAD";
+constexpr unsigned kMaxAttempts = 3;
+
+struct S3Object {
+  string bucket;
+  string key;
+};
+
+bool ParseS3Path(string_view path, S3Object* res) {
+  if (!IsS3Path(path))
+    return false;
+  path.remove_prefix(kS3Scheme.size());
+
+  size_t pos = path.find('/');
+  res->bucket = string{path.substr(0, pos)};
+  res->key = pos == string_view::npos ? string{} : string{path.substr(pos + 1)};
+  return !res->bucket.empty();
+}
+
+size_t PartSize() {
+  return max(GetFlag(FLAGS_s3_part_size_mb), 5u) << 20;
+}
+
+unsigned MaxInflight() {
+  return max(GetFlag(FLAGS_s3_max_inflight), 1u);
+}
+
+string Sha256Hex(string_view data) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned len = 0;
+  EVP_Digest(data.data(), data.size(), md, &len, EVP_sha256(), nullptr);
+  return absl::BytesToHexString(string_view{reinterpret_cast<char*>(md), len});
+}
+
+string HmacSha256(string_view key, string_view data) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned len = 0;
+  HMAC(EVP_sha256(), key.data(), key.size(), reinterpret_cast<const uint8_t*>(data.data()),
+       data.size(), md, &len);
+  return string{reinterpret_cast<char*>(md), len};
+}
+
+// Percent-encodes all the bytes but the unreserved ones with upper case hex digits, as the
+// signatures require.
+string UriEncode(string_view str, bool keep_slash) {
+  constexpr char kHex[] = "0123456789ABCDEF";
+  string res;
+  for (char c : str) {
+    if (absl::ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        (keep_slash && c == '/')) {
+      res.push_back(c);
+    } else {
+      uint8_t u = c;
+      res.append({'%', kHex[u >> 4], kHex[u & 0xf]});
+    }
+  }
+  return res;
+}
+
+// Returns the texts of the elements tag of xml in order. The responses of S3 are simple enough
+// to do without a parser.
+vector<string> XmlValues(string_view xml, string_view tag) {
+  string open = StrCat("<", tag, ">");
+  string close = StrCat("</", tag, ">");
+  vector<string> res;
+  size_t pos = 0;
+  while ((pos = xml.find(open, pos)) != string_view::npos) {
+    pos += open.size();
+    size_t end = xml.find(close, pos);
+    if (end == string_view::npos)
+      break;
+    res.push_back(absl::StrReplaceAll(xml.substr(pos, end - pos), {{"&lt;", "<"},
+                                                                     {"&gt;", ">"},
+                                                                     {"&quot;", "\""},
+                                                                     {"&apos;", "'"},
+                                                                     {"&amp;", "&"}}));
+    pos = end + close.size();
+  }
+  return res;
+}
+
+struct HttpRequest {
+  string method;
+  string uri;                           // encoded.
+  vector<pair<string, string>> query;   // not encoded.
+  vector<pair<string, string>> headers;
+  string_view body;
+};
+
+struct HttpResponse {
+  unsigned status = 0;
+  vector<pair<string, string>> headers;  // the names are in lower case.
+  string body;
+
+  string_view Header(string_view name) const {
+    for (const auto& [k, v] : headers) {
+      if (k == name)
+        return v;
+    }
+    return string_view{};
+  }
+};
+
+struct Endpoint {
+  string host;
+  uint16_t port = 80;
+
+  // The value of the Host header.
+  string HostHeader() const {
+    return port == 80 ? host : StrCat(host, ":", port);
+  }
+};
+
+Endpoint GetEndpoint() {
+  Endpoint res;
+  string flag = GetFlag(FLAGS_s3_endpoint);
+  if (flag.empty()) {
+    res.host = StrCat("s3.", GetFlag(FLAGS_s3_region), ".amazonaws.com");
+    return res;
+  }
+
+  size_t pos = flag.rfind(':');
+  uint32_t port = 0;
+  if (pos != string::npos && absl::SimpleAtoi(string_view{flag}.substr(pos + 1), &port) &&
+      port > 0 && port <= UINT16_MAX) {
+    res.port = port;
+    flag.resize(pos);
+  }
+  res.host = std::move(flag);
+  return res;
+}
+
+// Adds the headers of AWS signature version 4 to req. The payloads are not signed, so that
+// the parts are not hashed by the serializing threads. Without credentials the requests are
+// anonymous.
+void SignRequest(const Endpoint& ep, HttpRequest* req) {
+  const char* access_key = getenv("AWS_ACCESS_KEY_ID");
+  const char* secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+  const char* token = getenv("AWS_SESSION_TOKEN");
+
+  absl::Time now = absl::Now();
+  string amz_date = absl::FormatTime("%Y%m%dT%H%M%SZ", now, absl::UTCTimeZone());
+  string date = amz_date.substr(0, 8);
+
+  req->headers.emplace_back("host", ep.HostHeader());
+  req->headers.emplace_back("x-amz-content-sha256", kUnsignedPayload);
+  req->headers.emplace_back("x-amz-date", amz_date);
+  if (token && *token)
+    req->headers.emplace_back("x-amz-security-token", token);
+
+  if (!access_key || !*access_key || !secret_key)
+    return;
+
+  sort(req->headers.begin(), req->headers.end());
+
+  vector<pair<string, string>> query;
+  for (const auto& [k, v] : req->query)
+    query.emplace_back(UriEncode(k, false), UriEncode(v, false));
+  sort(query.begin(), query.end());
+
+  string canonical = StrCat(req->method, "\n", req->uri, "\n");
+  absl::StrAppend(&canonical, absl::StrJoin(query, "&", absl::PairFormatter("=")), "\n");
+  string signed_headers;
+  for (const auto& [k, v] : req->headers) {
+    absl::StrAppend(&canonical, k, ":", absl::StripAsciiWhitespace(v), "\n");
+    absl::StrAppend(&signed_headers, signed_headers.empty() ? "" : ";", k);
+  }
+  absl::StrAppend(&canonical, "\n", signed_headers, "\n", kUnsignedPayload);
+
+  string region = GetFlag(FLAGS_s3_region);
+  string scope = StrCat(date, "/", region, "/s3/aws4_request");
+  string to_sign = StrCat("AWS4-HMAC-SHA256\n", amz_date, "\n", scope, "\n", Sha256Hex(canonical));
+
+  string key = HmacSha256(StrCat("AWS4", secret_key), date);
+  key = HmacSha256(key, region);
+  key = HmacSha256(key, "s3");
+  key = HmacSha256(key, "aws4_request");
+  string signature = absl::BytesToHexString(HmacSha256(key, to_sign));
+
+  req->headers.emplace_back("authorization",
+                            StrCat("AWS4-HMAC-SHA256 Credential=", access_key, "/", scope,
+                                   ", SignedHeaders=", signed_headers, ", Signature=", signature));
+}
+
+// A keep-alive http connection to the endpoint. The connection is opened on the first request
+// and reopened after the errors.
+class S3Conn {
+ public:
+  S3Conn() : ep_(GetEndpoint()) {
+  }
+
+  ~S3Conn() {
+    Disconnect();
+  }
+
+  // Signs and sends the request and reads its response. The requests that fail with an error
+  // of the connection or with a 5xx status are retried over a new connection.
+  error_code Send(HttpRequest* req, HttpResponse* resp);
+
+ private:
+  error_code Connect();
+  void Disconnect();
+
+  error_code SendOnce(string_view head, const HttpRequest& req, HttpResponse* resp);
+  error_code ReadResponse(bool has_body, HttpResponse* resp);
+  error_code ReadLine(string* line);
+  error_code ReadBytes(size_t len, string* dest);
+
+  // Appends the next bytes of the connection to in_.
+  error_code Fill();
+
+  Endpoint ep_;
+  unique_ptr<LinuxSocketBase> sock_;
+  string in_;
+  size_t in_pos_ = 0;
+};
+
+error_code S3Conn::Connect() {
+  char ip_addr[INET6_ADDRSTRLEN];
+  int resolve_res = ResolveDns(ep_.host, ip_addr);
+  if (resolve_res != 0) {
+    LOG(ERROR) << "Dns error of " << ep_.host << ": " << gai_strerror(resolve_res);
+    return make_error_code(errc::host_unreachable);
+  }
+
+  sock_.reset(ProactorBase::me()->CreateSocket());
+  in_.clear();
+  in_pos_ = 0;
+
+  auto address = boost::asio::ip::make_address(ip_addr);
+  error_code ec = sock_->Connect(boost::asio::ip::tcp::endpoint{address, ep_.port});
+  if (ec)
+    Disconnect();
+  return ec;
+}
+
+void S3Conn::Disconnect() {
+  if (!sock_)
+    return;
+  error_code ec = sock_->Close();
+  LOG_IF(WARNING, ec) << "Error closing the s3 socket " << ec;
+  sock_.reset();
+}
+
+error_code S3Conn::Send(HttpRequest* req, HttpResponse* resp) {
+  SignRequest(ep_, req);
+
+  string head = StrCat(req->method, " ", req->uri);
+  for (size_t i = 0; i < req->query.size(); ++i) {
+    const auto& [k, v] = req->query[i];
+    absl::StrAppend(&head, i ? "&" : "?", UriEncode(k, false), "=", UriEncode(v, false));
+  }
+  absl::StrAppend(&head, " HTTP/1.1\r\n");
+  for (const auto& [k, v] : req->headers)
+    absl::StrAppend(&head, k, ": ", v, "\r\n");
+  if (req->method == "PUT" || req->method == "POST")
+    absl::StrAppend(&head, "content-length: ", req->body.size(), "\r\n");
+  head.append("\r\n");
+
+  error_code ec;
+  for (unsigned attempt = 1;; ++attempt) {
+    ec = sock_ ? error_code{} : Connect();
+    if (!ec)
+      ec = SendOnce(head, *req, resp);
+    if (!ec && resp->status < 500)
+      return ec;
+
+    Disconnect();
+    if (attempt == kMaxAttempts)
+      break;
+
+    VLOG(1) << "Retrying " << req->method << " " << req->uri << " after "
+            << (ec ? ec.message() : StrCat("status ", resp->status));
+    this_fiber::sleep_for(chrono::milliseconds(100 << attempt));
+  }
+  return ec;
+}
+
+error_code S3Conn::SendOnce(string_view head, const HttpRequest& req, HttpResponse* resp) {
+  *resp = HttpResponse{};
+  RETURN_ON_ERR(sock_->Write(io::Buffer(head)));
+  if (!req.body.empty())
+    RETURN_ON_ERR(sock_->Write(io::Buffer(req.body)));
+
+  RETURN_ON_ERR(ReadResponse(req.method != "HEAD", resp));
+
+  string_view connection = resp->Header("connection");
+  if (absl::EqualsIgnoreCase(connection, "close"))
+    Disconnect();
+  return error_code{};
+}
+
+error_code S3Conn::ReadResponse(bool has_body, HttpResponse* resp) {
+  string line;
+  RETURN_ON_ERR(ReadLine(&line));
+
+  // HTTP/1.1 200 OK
+  vector<string_view> status = absl::StrSplit(line, absl::MaxSplits(' ', 2));
+  if (status.size() < 2 || !absl::StartsWith(status[0], "HTTP/") ||
+      !absl::SimpleAtoi(status[1], &resp->status)) {
+    return make_error_code(errc::bad_message);
+  }
+
+  while (true) {
+    RETURN_ON_ERR(ReadLine(&line));
+    if (line.empty())
+      break;
+    size_t pos = line.find(':');
+    if (pos == string::npos)
+      return make_error_code(errc::bad_message);
+    resp->headers.emplace_back(absl::AsciiStrToLower(string_view{line}.substr(0, pos)),
+                               absl::StripAsciiWhitespace(string_view{line}.substr(pos + 1)));
+  }
+
+  if (!has_body || resp->status == 204 || resp->status == 304)
+    return error_code{};
+
+  if (absl::EqualsIgnoreCase(resp->Header("transfer-encoding"), "chunked")) {
+    while (true) {
+      RETURN_ON_ERR(ReadLine(&line));
+      uint64_t len = 0;
+      string_view hex = string_view{line}.substr(0, line.find(';'));
+      if (!absl::SimpleHexAtoi(absl::StripAsciiWhitespace(hex), &len))
+        return make_error_code(errc::bad_message);
+      if (len == 0)
+        break;
+      RETURN_ON_ERR(ReadBytes(len, &resp->body));
+      RETURN_ON_ERR(ReadLine(&line));
+    }
+
+    // The trailers end with an empty line.
+    do {
+      RETURN_ON_ERR(ReadLine(&line));
+    } while (!line.empty());
+    return error_code{};
+  }
+
+  uint64_t len = 0;
+  string_view content_length = resp->Header("content-length");
+  if (!content_length.empty()) {
+    if (!absl::SimpleAtoi(content_length, &len))
+      return make_error_code(errc::bad_message);
+    return ReadBytes(len, &resp->body);
+  }
+
+  // The body ends with the connection.
+  while (true) {
+    resp->body.append(in_, in_pos_);
+    in_.clear();
+    in_pos_ = 0;
+    error_code ec = Fill();
+    if (ec == errc::connection_reset)
+      break;
+    RETURN_ON_ERR(ec);
+  }
+  Disconnect();
+  return error_code{};
+}
+
+error_code S3Conn::ReadLine(string* line) {
+  size_t pos;
+  while ((pos = in_.find("\r\n", in_pos_)) == string::npos) {
+    RETURN_ON_ERR(Fill());
+  }
+  line->assign(in_, in_pos_, pos - in_pos_);
+  in_pos_ = pos + 2;
+  return error_code{};
+}
+
+error_code S3Conn::ReadBytes(size_t len, string* dest) {
+  dest->reserve(dest->size() + len);
+  while (len > 0) {
+    if (in_pos_ == in_.size())
+      RETURN_ON_ERR(Fill());
+    size_t n = min(len, in_.size() - in_pos_);
+    dest->append(in_, in_pos_, n);
+    in_pos_ += n;
+    len -= n;
+  }
+  return error_code{};
+}
+
+error_code S3Conn::Fill() {
+  if (!sock_)
+    return make_error_code(errc::not_connected);
+
+  // The consumed bytes are dropped before the buffer grows.
+  if (in_pos_ > 0) {
+    in_.erase(0, in_pos_);
+    in_pos_ = 0;
+  }
+
+  constexpr size_t kReadSize = 1 << 16;
+  size_t prev = in_.size();
+  in_.resize(prev + kReadSize);
+  io::MutableBytes buf{reinterpret_cast<uint8_t*>(in_.data()) + prev, kReadSize};
+  io::Result<size_t> res = sock_->Recv(buf);
+  if (!res) {
+    in_.resize(prev);
+    return res.error();
+  }
+
+  in_.resize(prev + *res);
+  if (*res == 0)
+    return make_error_code(errc::connection_reset);
+  return error_code{};
+}
+
+HttpRequest MakeRequest(string_view method, const S3Object& obj) {
+  HttpRequest req;
+  req.method = string{method};
+  req.uri = StrCat("/", UriEncode(obj.bucket, false), "/", UriEncode(obj.key, true));
+  return req;
+}
+
+error_code CheckResponse(const HttpRequest& req, const HttpResponse& resp) {
+  // The failures of CompleteMultipartUpload may come with the status 200.
+  if (resp.status / 100 == 2 && !absl::StrContains(resp.body, "<Error>"))
+    return error_code{};
+
+  LOG(ERROR) << "S3 " << req.method << " " << req.uri << " failed with " << resp.status << " "
+             << string_view{resp.body}.substr(0, 512);
+  if (resp.status == 404)
+    return make_error_code(errc::no_such_file_or_directory);
+  if (resp.status == 401 || resp.status == 403)
+    return make_error_code(errc::permission_denied);
+  return make_error_code(errc::io_error);
+}
+
+error_code SendRequest(S3Conn* conn, HttpRequest* req, HttpResponse* resp) {
+  RETURN_ON_ERR(conn->Send(req, resp));
+  return CheckResponse(*req, *resp);
+}
+
+// Keeps up to s3_max_inflight parts in flight, each one over a connection of its own.
+// Errors of the uploads are reported by the following calls.
+class S3WriteFile : public io::WriteFile {
+ public:
+  S3WriteFile(string_view path, S3Object obj)
+      : WriteFile(path), obj_(std::move(obj)), part_size_(PartSize()), max_inflight_(MaxInflight()) {
+    cur_.reserve(part_size_);
+  }
+
+  ~S3WriteFile() {
+    evc_.await([this] { return inflight_ == 0; });
+    if (!upload_id_.empty() && !closed_)
+      Abort();
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  error_code Close() final;
+
+ private:
+  // Starts the upload of cur_ as the next part.
+  error_code UploadPart();
+  void UploadPartFb(unsigned num, string data, S3Conn* conn);
+
+  error_code Initiate();
+  error_code Complete();
+  void Abort();
+
+  S3Conn* TakeConn();
+  error_code Send(HttpRequest* req, HttpResponse* resp);
+
+  S3Object obj_;
+  size_t part_size_;
+  unsigned max_inflight_;
+
+  string cur_;  // the part that is being written.
+  string upload_id_;
+  vector<string> etags_;  // by part number - 1.
+
+  vector<unique_ptr<S3Conn>> conns_;
+  vector<S3Conn*> idle_;
+  unsigned inflight_ = 0;
+  bool closed_ = false;
+
+  error_code ec_;  // the first error of the uploads.
+  fibers_ext::EventCount evc_;
+};
+
+io::Result<size_t> S3WriteFile::WriteSome(const iovec* v, uint32_t len) {
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    const char* src = reinterpret_cast<const char*>(v[i].iov_base);
+    size_t left = v[i].iov_len;
+    total += left;
+
+    while (left > 0) {
+      size_t n = min(left, part_size_ - cur_.size());
+      cur_.append(src, n);
+      src += n;
+      left -= n;
+
+      if (cur_.size() == part_size_) {
+        error_code ec = UploadPart();
+        if (ec)
+          return nonstd::make_unexpected(ec);
+      }
+    }
+  }
+  return total;
+}
+
+error_code S3WriteFile::Close() {
+  closed_ = true;
+
+  // A small object does not need a multipart upload.
+  if (upload_id_.empty()) {
+    HttpRequest req = MakeRequest("PUT", obj_);
+    req.body = cur_;
+    HttpResponse resp;
+    return Send(&req, &resp);
+  }
+
+  error_code ec = cur_.empty() ? error_code{} : UploadPart();
+  evc_.await([this] { return inflight_ == 0; });
+  if (!ec)
+    ec = ec_;
+  if (!ec)
+    ec = Complete();
+  if (ec)
+    Abort();
+  return ec;
+}
+
+error_code S3WriteFile::UploadPart() {
+  if (upload_id_.empty())
+    RETURN_ON_ERR(Initiate());
+
+  evc_.await([this] { return inflight_ < max_inflight_ || ec_; });
+  if (ec_)
+    return ec_;
+
+  etags_.emplace_back();
+  unsigned num = etags_.size();
+  S3Conn* conn = TakeConn();
+  ++inflight_;
+
+  string data = std::move(cur_);
+  cur_ = string{};
+  cur_.reserve(part_size_);
+
+  ProactorBase::me()
+      ->LaunchFiber([this, num, data = std::move(data), conn]() mutable {
+        UploadPartFb(num, std::move(data), conn);
+      })
+      .detach();
+  return error_code{};
+}
+
+void S3WriteFile::UploadPartFb(unsigned num, string data, S3Conn* conn) {
+  HttpRequest req = MakeRequest("PUT", obj_);
+  req.query = {{"partNumber", StrCat(num)}, {"uploadId", upload_id_}};
+  req.body = data;
+
+  HttpResponse resp;
+  error_code ec = SendRequest(conn, &req, &resp);
+  if (!ec) {
+    etags_[num - 1] = string{resp.Header("etag")};
+    if (etags_[num - 1].empty())
+      ec = make_error_code(errc::bad_message);
+  }
+
+  idle_.push_back(conn);
+  --inflight_;
+  if (ec && !ec_)
+    ec_ = ec;
+  evc_.notify();
+}
+
+error_code S3WriteFile::Initiate() {
+  HttpRequest req = MakeRequest("POST", obj_);
+  req.query = {{"uploads", ""}};
+  HttpResponse resp;
+  RETURN_ON_ERR(Send(&req, &resp));
+
+  vector<string> ids = XmlValues(resp.body, "UploadId");
+  if (ids.empty() || ids[0].empty())
+    return make_error_code(errc::bad_message);
+  upload_id_ = std::move(ids[0]);
+  VLOG(1) << "Started the upload " << upload_id_ << " of " << obj_.key;
+  return error_code{};
+}
+
+error_code S3WriteFile::Complete() {
+  string body = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < etags_.size(); ++i) {
+    absl::StrAppend(&body, "<Part><PartNumber>", i + 1, "</PartNumber><ETag>", etags_[i],
+                    "</ETag></Part>");
+  }
+  body.append("</CompleteMultipartUpload>");
+
+  HttpRequest req = MakeRequest("POST", obj_);
+  req.query = {{"uploadId", upload_id_}};
+  req.body = body;
+  HttpResponse resp;
+  return Send(&req, &resp);
+}
+
+// The parts of an upload that is neither completed nor aborted are kept by the storage.
+void S3WriteFile::Abort() {
+  HttpRequest req = MakeRequest("DELETE", obj_);
+  req.query = {{"uploadId", upload_id_}};
+  HttpResponse resp;
+  error_code ec = Send(&req, &resp);
+  LOG_IF(WARNING, ec) << "Could not abort the upload " << upload_id_ << " of " << obj_.key;
+  upload_id_.clear();
+}
+
+S3Conn* S3WriteFile::TakeConn() {
+  if (idle_.empty()) {
+    conns_.push_back(make_unique<S3Conn>());
+    return conns_.back().get();
+  }
+  S3Conn* res = idle_.back();
+  idle_.pop_back();
+  return res;
+}
+
+// The requests that are not parts wait for their responses, their connections are idle again
+// by the time they return.
+error_code S3WriteFile::Send(HttpRequest* req, HttpResponse* resp) {
+  S3Conn* conn = TakeConn();
+  error_code ec = SendRequest(conn, req, resp);
+  idle_.push_back(conn);
+  return ec;
+}
+
+// Keeps up to s3_max_inflight ranges in flight ahead of the reader.
+class S3ReadSource : public io::Source {
+ public:
+  S3ReadSource(S3Object obj, size_t size)
+      : obj_(std::move(obj)), size_(size), range_size_(PartSize()), max_inflight_(MaxInflight()) {
+  }
+
+  ~S3ReadSource() {
+    evc_.await([this] { return inflight_ == 0; });
+  }
+
+  io::Result<size_t> ReadSome(const iovec* v, uint32_t len) final;
+
+ private:
+  struct Range {
+    string data;
+    error_code ec;
+    bool done = false;
+  };
+
+  // Starts the fetches of the next ranges.
+  void FetchAhead();
+  void FetchFb(Range* range, size_t offset, size_t len);
+
+  S3Object obj_;
+  size_t size_;
+  size_t range_size_;
+  unsigned max_inflight_;
+
+  deque<unique_ptr<Range>> ranges_;  // in the order of the object, the front one is being read.
+  size_t read_pos_ = 0;              // in the front range.
+  size_t fetch_offset_ = 0;          // of the next range to fetch.
+
+  vector<unique_ptr<S3Conn>> conns_;
+  vector<S3Conn*> idle_;
+  unsigned inflight_ = 0;
+  fibers_ext::EventCount evc_;
+};
+
+io::Result<size_t> S3ReadSource::ReadSome(const iovec* v, uint32_t len) {
+  FetchAhead();
+  if (ranges_.empty())
+    return 0;
+
+  Range* range = ranges_.front().get();
+  evc_.await([range] { return range->done; });
+  if (range->ec)
+    return nonstd::make_unexpected(range->ec);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len && read_pos_ < range->data.size(); ++i) {
+    size_t n = min(v[i].iov_len, range->data.size() - read_pos_);
+    memcpy(v[i].iov_base, range->data.data() + read_pos_, n);
+    read_pos_ += n;
+    total += n;
+  }
+
+  if (read_pos_ == range->data.size()) {
+    ranges_.pop_front();
+    read_pos_ = 0;
+    FetchAhead();
+  }
+  return total;
+}
+
+void S3ReadSource::FetchAhead() {
+  while (ranges_.size() < max_inflight_ && fetch_offset_ < size_) {
+    size_t len = min(range_size_, size_ - fetch_offset_);
+    ranges_.push_back(make_unique<Range>());
+    Range* range = ranges_.back().get();
+    ++inflight_;
+
+    ProactorBase::me()
+        ->LaunchFiber([this, range, offset = fetch_offset_, len] { FetchFb(range, offset, len); })
+        .detach();
+    fetch_offset_ += len;
+  }
+}
+
+void S3ReadSource::FetchFb(Range* range, size_t offset, size_t len) {
+  S3Conn* conn;
+  if (idle_.empty()) {
+    conns_.push_back(make_unique<S3Conn>());
+    conn = conns_.back().get();
+  } else {
+    conn = idle_.back();
+    idle_.pop_back();
+  }
+
+  HttpRequest req = MakeRequest("GET", obj_);
+  req.headers.emplace_back("range", StrCat("bytes=", offset, "-", offset + len - 1));
+  HttpResponse resp;
+  range->ec = SendRequest(conn, &req, &resp);
+  if (!range->ec) {
+    if (resp.body.size() == len) {
+      range->data = std::move(resp.body);
+    } else {
+      LOG(ERROR) << "Short read of " << obj_.key << " at " << offset << ": " << resp.body.size()
+                 << "/" << len;
+      range->ec = make_error_code(errc::io_error);
+    }
+  }
+
+  idle_.push_back(conn);
+  range->done = true;
+  --inflight_;
+  evc_.notify();
+}
+
+}  // namespace
+
+io::Result<unique_ptr<io::WriteFile>> OpenS3Write(string_view path) {
+  S3Object obj;
+  if (!ParseS3Path(path, &obj) || obj.key.empty())
+    return nonstd::make_unexpected(make_error_code(errc::invalid_argument));
+
+  unique_ptr<io::WriteFile> res = make_unique<S3WriteFile>(path, std::move(obj));
+  return res;
+}
+
+io::Result<unique_ptr<io::Source>> OpenS3Read(string_view path) {
+  S3Object obj;
+  if (!ParseS3Path(path, &obj) || obj.key.empty())
+    return nonstd::make_unexpected(make_error_code(errc::invalid_argument));
+
+  S3Conn conn;
+  HttpRequest req = MakeRequest("HEAD", obj);
+  HttpResponse resp;
+  error_code ec = SendRequest(&conn, &req, &resp);
+  if (ec)
+    return nonstd::make_unexpected(ec);
+
+  size_t size = 0;
+  if (!absl::SimpleAtoi(resp.Header("content-length"), &size))
+    return nonstd::make_unexpected(make_error_code(errc::bad_message));
+
+  unique_ptr<io::Source> res = make_unique<S3ReadSource>(std::move(obj), size);
+  return res;
+}
+
+io::Result<vector<string>> ListS3(string_view prefix) {
+  S3Object obj;
+  if (!ParseS3Path(prefix, &obj))
+    return nonstd::make_unexpected(make_error_code(errc::invalid_argument));
+
+  S3Conn conn;
+  vector<string> res;
+  string token;
+  do {
+    HttpRequest req;
+    req.method = "GET";
+    req.uri = StrCat("/", UriEncode(obj.bucket, false));
+    req.query = {{"list-type", "2"}, {"prefix", obj.key}};
+    if (!token.empty())
+      req.query.emplace_back("continuation-token", token);
+
+    HttpResponse resp;
+    error_code ec = SendRequest(&conn, &req, &resp);
+    if (ec)
+      return nonstd::make_unexpected(ec);
+
+    for (const string& key : XmlValues(resp.body, "Key"))
+      res.push_back(StrCat(kS3Scheme, obj.bucket, "/", key));
+
+    vector<string> truncated = XmlValues(resp.body, "IsTruncated");
+    vector<string> next = XmlValues(resp.body, "NextContinuationToken");
+    token = (!truncated.empty() && truncated[0] == "true" && !next.empty()) ? next[0] : string{};
+  } while (!token.empty());
+
+  sort(res.begin(), res.end());
+  return res;
+}
+
+#else
+
+io::Result<unique_ptr<io::WriteFile>> OpenS3Write(string_view path) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+io::Result<unique_ptr<io::Source>> OpenS3Read(string_view path) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+io::Result<vector<string>> ListS3(string_view prefix) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+#endif
+
+}  // namespace dfly
@@ -0,0 +1,33 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "io/file.h"
+#include "io/io.h"
+
+namespace dfly {
+
+// The snapshot files in an S3 compatible object storage, addressed as s3://bucket/key.
+// The requests go over http to s3_endpoint and are signed with AWS_ACCESS_KEY_ID,
+// AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN of the environment, see the flags in s3_storage.cc.
+bool IsS3Path(std::string_view path);
+
+// Uploads the object with a multipart upload whose parts are sent in parallel while the next
+// ones are written, up to s3_max_inflight of them. An object of a single part is sent with a
+// single PUT by Close. The object appears once Close succeeds.
+io::Result<std::unique_ptr<io::WriteFile>> OpenS3Write(std::string_view path);
+
+// Reads the object with ranged GETs, up to s3_max_inflight of them ahead of the reader.
+io::Result<std::unique_ptr<io::Source>> OpenS3Read(std::string_view path);
+
+// Returns the sorted paths of the objects that start with prefix.
+io::Result<std::vector<std::string>> ListS3(std::string_view prefix);
+
+}  // namespace dfly
@@ -4,11 +4,14 @@
 
 #include "server/script_mgr.h"
 
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 
 #include "base/logging.h"
 #include "core/interpreter.h"
 #include "facade/error.h"
+#include "server/engine_shard_set.h"
 #include "server/server_state.h"
 
 namespace dfly {
@@ -16,7 +19,11 @@ namespace dfly {
 using namespace std;
 using namespace facade;
 
-ScriptMgr::ScriptMgr() {
+ScriptMgr::ScriptMgr() : snapshot_(new ScriptMap) {
+}
+
+ScriptMgr::~ScriptMgr() {
+  delete snapshot_.load(memory_order_relaxed);
 }
 
 void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
@@ -30,6 +37,9 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
         "   Return information about the existence of the scripts in the script cache.",
         "LOAD <script>",
         "   Load a script into the scripts cache without executing it.",
+        "STATS",
+        "   Return the calls, the run times, the redis calls, the shards and the allocations",
+        "   of the scripts that ran, the most expensive first.",
         "HELP"
         "   Prints this help."};
     return (*cntx)->SendSimpleStrArr(kHelp, ABSL_ARRAYSIZE(kHelp));
@@ -51,6 +61,30 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
+  if (subcmd == "STATS" && args.size() == 1) {
+    vector<pair<string, ScriptStats>> stats;
+    for (auto& k_v : GetStats()) {
+      stats.emplace_back(std::move(k_v));
+    }
+    sort(stats.begin(), stats.end(),
+         [](const auto& l, const auto& r) { return l.second.total_usec > r.second.total_usec; });
+
+    (*cntx)->StartArray(stats.size());
+    for (const auto& [sha, st] : stats) {
+      (*cntx)->StartArray(13);
+      (*cntx)->SendBulkString(sha);
+      pair<string_view, uint64_t> fields[] = {
+          {"calls", st.calls},       {"total_usec", st.total_usec},
+          {"max_usec", st.max_usec}, {"redis_calls", st.redis_calls},
+          {"shards", st.shards},     {"allocated_bytes", st.allocated_bytes}};
+      for (const auto& [name, val] : fields) {
+        (*cntx)->SendBulkString(name);
+        (*cntx)->SendLong(val);
+      }
+    }
+    return;
+  }
+
   if (subcmd == "LOAD" && args.size() == 2) {
     string_view body = ArgS(args, 1);
 
@@ -60,6 +94,12 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
       return (*cntx)->SendBulkString(sha);
     }
 
+    ScriptParams params;
+    string error;
+    if (!ParseParams(body, &params, &error)) {
+      return (*cntx)->SendError(error);
+    }
+
     Interpreter& interpreter = ServerState::tlocal()->GetInterpreter();
     // no need to lock the interpreter since we do not mess the stack.
     string error_or_id;
@@ -87,13 +127,31 @@ bool ScriptMgr::InsertFunction(std::string_view id, std::string_view body) {
   memcpy(key.data(), id.data(), key.size());
 
   lock_guard lk(mu_);
-  auto [it, inserted] = db_.emplace(key, nullptr);
-  if (inserted) {
-    it->second.reset(new char[body.size() + 1]);
-    memcpy(it->second.get(), body.data(), body.size());
-    it->second[body.size()] = '\0';
+  const ScriptMap* prev = snapshot_.load(memory_order_relaxed);
+  if (prev->contains(key))
+    return false;
+
+  char* stored = new char[body.size() + 1];
+  memcpy(stored, body.data(), body.size());
+  stored[body.size()] = '\0';
+  bodies_.emplace_back(stored);
+
+  ScriptMap* next = new ScriptMap(*prev);
+  next->emplace(key, stored);
+  snapshot_.store(next, memory_order_release);
+
+  // The tasks of a thread run in order, hence the last one to run frees the previous snapshot.
+  util::ProactorPool* pool = shard_set->pool();
+  auto pending = make_shared<atomic_uint32_t>(pool->size());
+  for (unsigned i = 0; i < pool->size(); ++i) {
+    pool->at(i)->DispatchBrief([prev, pending, stored] {
+      ServerState::tlocal()->PreloadScript(stored);
+      if (pending->fetch_sub(1, memory_order_acq_rel) == 1)
+        delete prev;
+    });
   }
-  return inserted;
+
+  return true;
 }
 
 const char* ScriptMgr::Find(std::string_view sha) const {
@@ -103,21 +161,64 @@ const char* ScriptMgr::Find(std::string_view sha) const {
   ScriptKey key;
   memcpy(key.data(), sha.data(), key.size());
 
-  lock_guard lk(mu_);
-  auto it = db_.find(key);
-  if (it == db_.end())
+  const ScriptMap* snapshot = snapshot_.load(memory_order_acquire);
+  auto it = snapshot->find(key);
+  if (it == snapshot->end())
     return nullptr;
 
-  return it->second.get();
+  return it->second;
+}
+
+bool ScriptMgr::ParseParams(string_view body, ScriptParams* params, string* error) {
+  constexpr string_view kPrefix = "--!df";
+  if (!absl::StartsWith(body, kPrefix))
+    return true;
+
+  string_view line = body.substr(kPrefix.size());
+  line = line.substr(0, line.find('\n'));
+
+  for (string_view opt : absl::StrSplit(line, absl::ByAnyChar(" \t\r"), absl::SkipEmpty())) {
+    if (!absl::ConsumePrefix(&opt, "flags=")) {
+      *error = absl::StrCat("Unknown lua shebang option: ", opt);
+      return false;
+    }
+
+    for (string_view flag : absl::StrSplit(opt, ',', absl::SkipEmpty())) {
+      if (flag == "disable-atomicity") {
+        params->atomic = false;
+      } else {
+        *error = absl::StrCat("Unexpected flag in script shebang: ", flag);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+ScriptStatsMap ScriptMgr::GetStats() const {
+  util::ProactorPool* pool = shard_set->pool();
+  vector<ScriptStatsMap> thread_stats(pool->size());
+  pool->Await([&](unsigned index, util::ProactorBase*) {
+    thread_stats[index] = ServerState::tlocal()->script_stats;
+  });
+
+  ScriptStatsMap res;
+  for (const auto& stats : thread_stats) {
+    for (const auto& [sha, st] : stats) {
+      res[sha] += st;
+    }
+  }
+  return res;
 }
 
 vector<string> ScriptMgr::GetLuaScripts() const {
   vector<string> res;
 
-  lock_guard lk(mu_);
-  res.reserve(db_.size());
-  for (const auto& k_v : db_) {
-    res.emplace_back(k_v.second.get());
+  const ScriptMap* snapshot = snapshot_.load(memory_order_acquire);
+  res.reserve(snapshot->size());
+  for (const auto& k_v : *snapshot) {
+    res.emplace_back(k_v.second);
   }
 
   return res;
@@ -7,9 +7,11 @@
 #include <absl/container/flat_hash_map.h>
 
 #include <array>
+#include <atomic>
 #include <boost/fiber/mutex.hpp>
 
 #include "server/conn_context.h"
+#include "server/server_state.h"
 
 namespace dfly {
 
@@ -19,20 +21,44 @@ class EngineShardSet;
 class ScriptMgr {
  public:
   ScriptMgr();
+  ~ScriptMgr();
 
   void Run(CmdArgList args, ConnectionContext* cntx);
 
+  // Also compiles a new script into the interpreters of all the threads in the background,
+  // so that its first calls do not pay for it.
   bool InsertFunction(std::string_view sha, std::string_view body);
 
   // Returns body as null-terminated c-string. NULL if sha is not found.
+  // Does not lock and does not preempt.
   const char* Find(std::string_view sha) const;
 
   std::vector<std::string> GetLuaScripts() const;
 
+  // Merges the stats of the scripts of all the threads.
+  ScriptStatsMap GetStats() const;
+
+  // Set by the flags of the first line of the body, for example "--!df flags=disable-atomicity".
+  struct ScriptParams {
+    // If false, the calls of the script run as independent commands and the keys of the script
+    // are not locked while it runs.
+    bool atomic = true;
+  };
+
+  // Returns false and sets error if the body has an unknown flag.
+  static bool ParseParams(std::string_view body, ScriptParams* params, std::string* error);
+
  private:
   using ScriptKey = std::array<char, 40>;
-  absl::flat_hash_map<ScriptKey, std::unique_ptr<char[]>> db_;  // protected by mu_
-  mutable ::boost::fibers::mutex mu_;
+  using ScriptMap = absl::flat_hash_map<ScriptKey, const char*>;
+
+  // The readers look up the current snapshot of the registry without locking. A writer
+  // publishes a modified copy and frees the previous one once every thread has run a task past
+  // the publication: a reader does not preempt, hence it no longer holds the previous one.
+  std::atomic<const ScriptMap*> snapshot_;
+
+  std::vector<std::unique_ptr<char[]>> bodies_;  // protected by mu_, never freed.
+  ::boost::fibers::mutex mu_;  // serializes the writers.
 };
 
 }  // namespace dfly
@@ -6,9 +6,14 @@
 
 #include <absl/cleanup/cleanup.h>
 #include <absl/random/random.h>  // for master_id_ generation.
+#include <absl/strings/ascii.h>
 #include <absl/strings/match.h>
+#include <absl/strings/str_format.h>
 #include <absl/strings/str_join.h>
+#include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
 #include <mimalloc-types.h>
+#include <mimalloc.h>
 #include <sys/resource.h>
 
 #include <filesystem>
@@ -24,20 +29,26 @@ extern "C" {
 #include "io/proc_reader.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
+#include "server/counter_combiner.h"
 #include "server/debugcmd.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/journal.h"
 #include "server/main_service.h"
+#include "server/mapped_snapshot.h"
 #include "server/rdb_load.h"
 #include "server/rdb_save.h"
 #include "server/replica.h"
+#include "server/s3_storage.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
+#include "server/snapshot.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "server/version.h"
 #include "strings/human_readable.h"
 #include "util/accept_server.h"
+#include "util/uring/proactor.h"
 #include "util/uring/uring_file.h"
 
 using namespace std;
@@ -45,10 +56,31 @@ using namespace std;
 ABSL_FLAG(string, dir, "", "working directory");
 ABSL_FLAG(string, dbfilename, "dump", "the filename to save/load the DB");
 ABSL_FLAG(string, requirepass, "", "password for AUTH authentication");
-
+ABSL_FLAG(bool, df_snapshot_format, false,
+          "If true, SAVE writes a file per shard in parallel and a summary file instead of a "
+          "single rdb file");
+ABSL_FLAG(bool, snapshot_mapped, false,
+          "If true, the shard files of df_snapshot_format are saved in a format that is mapped "
+          "at startup. The shards serve right away and materialize the keys on their first "
+          "access or in the background. Requires a local dir.");
+ABSL_FLAG(uint32_t, snapshot_queue_depth, 8,
+          "Maximal number of concurrent writes of a snapshot file, each of up to 64KB");
+ABSL_FLAG(uint32_t, metrics_snapshot_ms, 100,
+          "Period of the thread metrics snapshots that are reported by INFO and /metrics");
+
+ABSL_FLAG(int32_t, repl_compression_level, 1,
+          "The zstd level of the full syncs and the journal streams of the Dragonfly replicas "
+          "that ask for compression, see replica_compression. 0 - they are not compressed.");
 ABSL_DECLARE_FLAG(uint32_t, port);
+ABSL_DECLARE_FLAG(std::string, notify_keyspace_events);
+ABSL_DECLARE_FLAG(std::string, db_maxmemory);
 ABSL_DECLARE_FLAG(bool, cache_mode);
+ABSL_DECLARE_FLAG(bool, snapshot_deltas);
+ABSL_DECLARE_FLAG(bool, journal);
+ABSL_DECLARE_FLAG(std::string, cache_policy);
+ABSL_DECLARE_FLAG(std::string, maxmemory_policy);
 ABSL_DECLARE_FLAG(uint32_t, hz);
+ABSL_DECLARE_FLAG(bool, tiered_warm_restart);
 
 extern "C" mi_stats_t _mi_stats_main;
 
@@ -92,6 +124,32 @@ string UnknownCmd(string cmd, CmdArgList args) {
                       StrJoin(args.begin(), args.end(), ", ", CmdArgListFormatter()));
 }
 
+// The objects are listed by the prefix of the snapshot files, whose names sort by their time.
+string InferS3LoadFile(fs::path fl_path) {
+  bool per_shard = GetFlag(FLAGS_df_snapshot_format);
+  bool infer = !fl_path.has_extension() || per_shard;
+  string exact = fl_path.generic_string();
+  if (per_shard)
+    fl_path.replace_extension();
+
+  string prefix = fl_path.generic_string();
+  io::Result<vector<string>> objects = ListS3(prefix);
+  if (!objects) {
+    LOG(WARNING) << "Could not list " << prefix << ", error " << objects.error().message();
+    return string{};
+  }
+
+  if (binary_search(objects->begin(), objects->end(), exact))
+    return exact;
+
+  string_view suffix = per_shard ? "-summary.dfs" : ".rdb";
+  for (auto it = objects->rbegin(); infer && it != objects->rend(); ++it) {
+    if (absl::EndsWith(*it, suffix))
+      return *it;
+  }
+  return string{};
+}
+
 string InferLoadFile(fs::path data_dir) {
   const auto& dbname = GetFlag(FLAGS_dbfilename);
 
@@ -100,11 +158,17 @@ string InferLoadFile(fs::path data_dir) {
 
   fs::path fl_path = data_dir.append(dbname);
 
+  if (IsS3Path(fl_path.generic_string()))
+    return InferS3LoadFile(fl_path);
+
   if (fs::exists(fl_path))
     return fl_path.generic_string();
-  if (!fl_path.has_extension()) {
+  if (!fl_path.has_extension() || GetFlag(FLAGS_df_snapshot_format)) {
+    if (GetFlag(FLAGS_df_snapshot_format))
+      fl_path.replace_extension();
+
     string glob = fl_path.generic_string();
-    glob.append("*.rdb");
+    glob.append(GetFlag(FLAGS_df_snapshot_format) ? "*-summary.dfs" : "*.rdb");
 
     io::Result<io::StatShortVec> short_vec = io::StatFiles(glob);
     if (short_vec) {
@@ -120,29 +184,300 @@ string InferLoadFile(fs::path data_dir) {
   return string{};
 }
 
+// Keeps up to snapshot_queue_depth writes in flight, so that the serialization of the next
+// buffers overlaps with the disk I/O. The data is copied into the buffers of a pool because
+// the caller reuses its buffer once WriteSome returns. Errors of the writes are reported by
+// the following calls.
 class LinuxWriteWrapper : public io::WriteFile {
  public:
-  LinuxWriteWrapper(uring::LinuxFile* lf) : WriteFile("wrapper"), lf_(lf) {
+  explicit LinuxWriteWrapper(unique_ptr<uring::LinuxFile> lf)
+      : WriteFile("wrapper"), lf_(std::move(lf)),
+        pool_(max(GetFlag(FLAGS_snapshot_queue_depth), 1u)) {
+    for (unsigned i = 0; i < pool_.size(); ++i)
+      free_.push_back(i);
   }
 
-  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
-    io::Result<size_t> res = lf_->WriteSome(v, len, offset_, 0);
-    if (res) {
-      offset_ += *res;
-    }
-
-    return res;
+  ~LinuxWriteWrapper() {
+    evc_.await([this] { return inflight_ == 0; });
+    for (const Buf& buf : pool_)
+      mi_free(buf.ptr);
   }
 
-  std::error_code Close() final {
-    return lf_->Close();
-  }
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  std::error_code Close() final;
 
  private:
-  uring::LinuxFile* lf_;
+  struct Buf {
+    char* ptr = nullptr;
+    size_t capacity = 0;
+  };
+
+  void OnWriteDone(int io_res, unsigned index, size_t len);
+
+  unique_ptr<uring::LinuxFile> lf_;
+  vector<Buf> pool_;
+  vector<unsigned> free_;  // indices of the buffers that are not in flight.
+  unsigned inflight_ = 0;
   off_t offset_ = 0;
+
+  error_code ec_;  // the first error of the writes.
+  util::fibers_ext::EventCount evc_;
 };
 
+io::Result<size_t> LinuxWriteWrapper::WriteSome(const iovec* v, uint32_t len) {
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    total += v[i].iov_len;
+
+  evc_.await([this] { return !free_.empty() || ec_; });
+  if (ec_)
+    return nonstd::make_unexpected(ec_);
+
+  unsigned index = free_.back();
+  free_.pop_back();
+
+  Buf& buf = pool_[index];
+  if (buf.capacity < total) {
+    mi_free(buf.ptr);
+    buf.capacity = (total + 4095) & ~4095ULL;
+    buf.ptr = (char*)mi_malloc_aligned(buf.capacity, 4096);
+  }
+
+  char* next = buf.ptr;
+  for (uint32_t i = 0; i < len; ++i) {
+    memcpy(next, v[i].iov_base, v[i].iov_len);
+    next += v[i].iov_len;
+  }
+
+  uring::Proactor* proactor = (uring::Proactor*)ProactorBase::me();
+  auto cb = [this, index, total](uring::Proactor::IoResult res, uint32_t, int64_t) {
+    OnWriteDone(res, index, total);
+  };
+
+  uring::SubmitEntry se = proactor->GetSubmitEntry(std::move(cb), 0);
+  se.PrepWrite(lf_->fd(), buf.ptr, total, offset_);
+  ++inflight_;
+  offset_ += total;
+
+  return total;
+}
+
+void LinuxWriteWrapper::OnWriteDone(int io_res, unsigned index, size_t len) {
+  --inflight_;
+  free_.push_back(index);
+
+  if (io_res < 0) {
+    if (!ec_)
+      ec_ = error_code{-io_res, system_category()};
+  } else if (size_t(io_res) != len && !ec_) {
+    LOG(ERROR) << "Short snapshot write " << io_res << "/" << len;
+    ec_ = make_error_code(errc::io_error);
+  }
+
+  evc_.notify();
+}
+
+error_code LinuxWriteWrapper::Close() {
+  evc_.await([this] { return inflight_ == 0; });
+  error_code ec = lf_->Close();
+
+  return ec_ ? ec_ : ec;
+}
+
+// 40 random hex characters, like the replication ids and the end of sync tokens of redis.
+string RandomReplId() {
+  absl::BitGen gen;
+  string res;
+  for (unsigned i = 0; i < 5; ++i)
+    absl::StrAppend(&res, absl::Hex(absl::Uniform<uint32_t>(gen), absl::kZeroPad8));
+  return res;
+}
+
+error_code LoadRdbFile(const string& path, RdbLoader* loader) {
+  if (IsS3Path(path)) {
+    io::Result<unique_ptr<io::Source>> src = OpenS3Read(path);
+    if (!src)
+      return src.error();
+    return loader->Load(src->get());
+  }
+
+  io::ReadonlyFileOrError res = uring::OpenRead(path);
+  if (!res)
+    return res.error();
+
+  io::FileSource fs(*res);
+  return loader->Load(&fs);
+}
+
+constexpr int kSaveFlags = O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC | O_DIRECT;
+constexpr string_view kSummarySuffix = "-summary.dfs";
+
+// The snapshot files go to the local disk or, for the s3:// paths, straight to the object
+// storage.
+io::Result<unique_ptr<io::WriteFile>> OpenSnapshotFile(const string& path) {
+  if (IsS3Path(path))
+    return OpenS3Write(path);
+
+  auto res = uring::OpenLinux(path, kSaveFlags, 0666);
+  if (!res)
+    return nonstd::make_unexpected(res.error());
+
+  unique_ptr<io::WriteFile> wf = make_unique<LinuxWriteWrapper>(std::move(res.value()));
+  return wf;
+}
+
+// Files of the per-shard snapshot, see FLAGS_df_snapshot_format.
+string SummaryFilePath(string_view base_path) {
+  return StrCat(base_path, kSummarySuffix);
+}
+
+string ShardFilePath(string_view base_path, unsigned index) {
+  return StrCat(base_path, "-", absl::Dec(index, absl::kZeroPad4), ".dfs");
+}
+
+string MappedFilePath(string_view base_path, unsigned index) {
+  return StrCat(base_path, "-", absl::Dec(index, absl::kZeroPad4), ".dfm");
+}
+
+// Attaches the mapped file to the shard that saved it. Without lazy or with a different number
+// of the shards, its entries are loaded into the shards that own them instead.
+error_code LoadMappedFile(const string& path, bool lazy) {
+  io::Result<unique_ptr<MappedSnapshot>> res = MappedSnapshot::Open(path);
+  if (!res)
+    return res.error();
+
+  unique_ptr<MappedSnapshot> mapped = std::move(res.value());
+  if (!lazy || mapped->shard_count() != shard_set->size())
+    return mapped->LoadAll();
+
+  VLOG(1) << "Mapped " << path << " with " << mapped->pending() << " keys";
+  ShardId sid = mapped->shard_id();
+  shard_set->Await(sid, [&] { EngineShard::tlocal()->AttachMappedSnapshot(std::move(mapped)); });
+  return error_code{};
+}
+
+// Deltas of the rdb file, see FLAGS_snapshot_deltas. Numbered from 1 in the order they apply.
+string DeltaFilePath(string_view base_path, unsigned index) {
+  return StrCat(base_path, ".delta-", absl::Dec(index, absl::kZeroPad4));
+}
+
+// The summary is an rdb file without entries. It holds the lua scripts and the number of
+// the shard files, and the position of a replica that saved them.
+error_code SaveSummaryFile(const string& path, const StringVec& lua_scripts,
+                           uint32_t shard_files, uint32_t journal_gen, string_view repl_id,
+                           const vector<uint64_t>& repl_offsets) {
+  auto res = OpenSnapshotFile(path);
+  if (!res)
+    return res.error();
+
+  unique_ptr<io::WriteFile> wf = std::move(res.value());
+  RdbSaver saver{wf.get()};
+
+  error_code ec = saver.SaveHeader(lua_scripts, shard_files);
+  if (!ec && journal_gen)
+    ec = saver.SaveJournalGen(journal_gen);
+  if (!ec && !repl_id.empty())
+    ec = saver.SaveReplPosition(repl_id, repl_offsets);
+  if (!ec)
+    ec = saver.SaveEpilog();
+
+  auto close_ec = wf->Close();
+  return ec ? ec : close_ec;
+}
+
+// CLIENT TRACKING ON|OFF [REDIRECT id] [BCAST] [PREFIX prefix ...]
+// Without RESP3 the invalidations are delivered only via REDIRECT to a connection that is
+// subscribed to the __redis__:invalidate channel.
+void ClientTracking(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[0]);
+  string_view mode = ArgS(args, 0);
+
+  if (mode == "OFF") {
+    cntx->DisableTracking();
+    return (*cntx)->SendOk();
+  }
+
+  if (mode != "ON")
+    return (*cntx)->SendError(kSyntaxErr);
+
+  auto info = make_unique<ConnectionState::TrackingInfo>();
+  uint32_t redirect_id = 0;
+
+  for (size_t i = 1; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    bool has_value = i + 1 < args.size();
+
+    if (opt == "BCAST") {
+      info->bcast = true;
+    } else if (opt == "REDIRECT" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &redirect_id))
+        return (*cntx)->SendError(kInvalidIntErr);
+    } else if (opt == "PREFIX" && has_value) {
+      info->prefixes.emplace_back(ArgS(args, ++i));
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!info->prefixes.empty() && !info->bcast)
+    return (*cntx)->SendError("PREFIX option requires BCAST mode to be enabled");
+
+  if (redirect_id == 0)
+    return (*cntx)->SendError("tracking without REDIRECT requires RESP3, which is not supported");
+
+  atomic_int thread_id{-1};
+  shard_set->pool()->Await([&](unsigned index, ProactorBase*) {
+    if (ServerState::tlocal()->tracking_targets.contains(redirect_id))
+      thread_id.store(index, memory_order_relaxed);
+  });
+
+  if (thread_id.load(memory_order_relaxed) < 0) {
+    return (*cntx)->SendError(
+        "The client ID you want redirect to does not exist or is not subscribed to "
+        "__redis__:invalidate");
+  }
+
+  // The new settings replace the previous ones.
+  cntx->DisableTracking();
+  info->target.client_id = redirect_id;
+  info->target.thread_id = thread_id.load(memory_order_relaxed);
+
+  if (info->bcast) {
+    if (info->prefixes.empty())
+      info->prefixes.emplace_back();
+
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      shard->db_slice().tracking().AddPrefixes(info->prefixes, info->target);
+    });
+  }
+
+  cntx->conn_state.tracking_info = std::move(info);
+  (*cntx)->SendOk();
+}
+
+// The shards whose backing files are kept across restarts, see FLAGS_tiered_warm_restart.
+bool IsWarmTiered(EngineShard* shard) {
+  return shard->tiered_storage() && shard->tiered_storage()->warm();
+}
+
+// Called once the snapshot is loaded at startup, the values that it does not reference are
+// dropped from the backing files.
+void FinishTieredRecovery() {
+  shard_set->RunBlockingInParallel([](EngineShard* shard) {
+    if (IsWarmTiered(shard))
+      shard->tiered_storage()->FinishRecovery();
+  });
+}
+
+void EndTieredSnapshot(bool success) {
+  shard_set->RunBlockingInParallel([success](EngineShard* shard) {
+    if (IsWarmTiered(shard))
+      shard->tiered_storage()->EndSnapshot(success);
+  });
+}
+
 }  // namespace
 
 ServerFamily::ServerFamily(Service* service) : service_(*service) {
@@ -150,24 +485,22 @@ ServerFamily::ServerFamily(Service* service) : service_(*service) {
   lsinfo_ = make_shared<LastSaveInfo>();
   lsinfo_->save_time = start_time_;
   script_mgr_.reset(new ScriptMgr());
+  master_id_ = RandomReplId();
 }
 
 ServerFamily::~ServerFamily() {
 }
 
-void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* main_listener) {
+void ServerFamily::Init(util::AcceptServer* acceptor,
+                        std::vector<util::ListenerInterface*> listeners) {
   CHECK(acceptor_ == nullptr);
   acceptor_ = acceptor;
-  main_listener_ = main_listener;
+  listeners_ = std::move(listeners);
 
   pb_task_ = shard_set->pool()->GetNextProactor();
+  // The shards keep used_mem_current up to date, see EngineShard::PublishUsedMemory.
   auto cache_cb = [] {
-    uint64_t sum = 0;
-    const auto& stats = EngineShardSet::GetCachedStats();
-    for (const auto& s : stats)
-      sum += s.used_memory.load(memory_order_relaxed);
-
-    used_mem_current.store(sum, memory_order_relaxed);
+    uint64_t sum = used_mem_current.load(memory_order_relaxed);
 
     // Single writer, so no races.
     if (sum > used_mem_peak.load(memory_order_relaxed))
@@ -179,10 +512,32 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
   stats_caching_task_ =
       pb_task_->AwaitBrief([&] { return pb_task_->AddPeriodic(period_ms, cache_cb); });
 
+  unsigned pool_size = service_.proactor_pool().size();
+  thread_metrics_.resize(pool_size);
+  thread_metrics_tasks_.resize(pool_size);
+  uint32_t snapshot_ms = max(1u, GetFlag(FLAGS_metrics_snapshot_ms));
+  service_.proactor_pool().AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    thread_metrics_tasks_[index] =
+        pb->AddPeriodic(snapshot_ms, [this, index] { PublishThreadMetrics(index); });
+  });
+
+  // Flush waits for the shards, so it runs in a fiber of its own.
+  CounterCombiner::Init();
+  if (CounterCombiner::Enabled()) {
+    counter_flush_tasks_.resize(pool_size);
+    service_.proactor_pool().AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+      counter_flush_tasks_[index] = pb->AddPeriodic(CounterCombiner::FlushPeriodMs(), [pb] {
+        pb->LaunchFiber([] { CounterCombiner::Flush(); }).detach();
+      });
+    });
+  }
+
   fs::path data_folder = fs::current_path();
   const auto& dir = GetFlag(FLAGS_dir);
 
-  if (!dir.empty()) {
+  if (IsS3Path(dir)) {
+    data_folder = dir;
+  } else if (!dir.empty()) {
     data_folder = dir;
 
     error_code ec;
@@ -191,9 +546,31 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
   }
 
   LOG(INFO) << "Data directory is " << data_folder;
+
+  // The journals of the previous runs are replayed, the writes go to a new generation.
+  bool has_journal = false;
+  if (GetFlag(FLAGS_journal)) {
+    CHECK(!IsS3Path(dir)) << "journal requires a local dir";
+    journal_dir_ = dir;
+    if (!dir.empty()) {
+      error_code ec = CreateDirs(dir);
+      CHECK(!ec) << "Could not create " << dir << ": " << ec.message();
+    }
+
+    auto journals = ListJournalFiles(journal_dir_);
+    has_journal = !journals.empty();
+    journal_gen_ = has_journal ? journals.rbegin()->first + 1 : 1;
+
+    error_code ec = OpenJournals(journal_gen_);
+    CHECK(!ec) << "Could not open the journal: " << ec.message();
+    shard_set->RunBlockingInParallel([](EngineShard* shard) { shard->journal()->Rotate(); });
+  }
+
   string load_path = InferLoadFile(data_folder);
-  if (!load_path.empty()) {
+  if (!load_path.empty() || has_journal) {
     Load(load_path);
+  } else {
+    FinishTieredRecovery();
   }
 }
 
@@ -203,6 +580,17 @@ void ServerFamily::Shutdown() {
   if (load_fiber_.joinable())
     load_fiber_.join();
 
+  service_.proactor_pool().AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    pb->CancelPeriodic(thread_metrics_tasks_[index]);
+    atomic_store(&thread_metrics_[index], shared_ptr<const ThreadMetrics>{});
+
+    // The last increments are applied before the shards shut down.
+    if (!counter_flush_tasks_.empty()) {
+      pb->CancelPeriodic(counter_flush_tasks_[index]);
+      CounterCombiner::Flush();
+    }
+  });
+
   pb_task_->Await([this] {
     pb_task_->CancelPeriodic(stats_caching_task_);
     stats_caching_task_ = 0;
@@ -217,18 +605,24 @@ void ServerFamily::Shutdown() {
 void ServerFamily::Load(const std::string& load_path) {
   CHECK(!load_fiber_.get_id());
 
-  error_code ec;
-  auto path = fs::canonical(load_path, ec);
-  if (ec) {
-    LOG(ERROR) << "Error loading " << load_path << " " << ec.message();
-    return;
-  }
+  // Only the journal is loaded if there is no snapshot.
+  if (!load_path.empty()) {
+    error_code ec;
+    if (!IsS3Path(load_path))
+      fs::canonical(load_path, ec);
+    if (ec) {
+      LOG(ERROR) << "Error loading " << load_path << " " << ec.message();
+      FinishTieredRecovery();
+      return;
+    }
 
-  LOG(INFO) << "Loading " << load_path;
+    LOG(INFO) << "Loading " << load_path;
+  }
 
   GlobalState new_state = service_.SwitchState(GlobalState::ACTIVE, GlobalState::LOADING);
   if (new_state != GlobalState::LOADING) {
     LOG(WARNING) << GlobalStateName(new_state) << " in progress, ignored";
+    FinishTieredRecovery();
     return;
   }
 
@@ -250,22 +644,81 @@ void ServerFamily::Load(const std::string& load_path) {
       shard_count() < pool.size() ? pool.at(shard_count()) : pool.GetNextProactor();
 
   load_fiber_ = proactor->LaunchFiber([load_path, this] {
-    auto ec = LoadRdb(load_path);
+    auto ec = LoadRdb(load_path, true);
     LOG_IF(ERROR, ec) << "Error loading file " << ec.message();
+    FinishTieredRecovery();
   });
 }
 
-error_code ServerFamily::LoadRdb(const std::string& rdb_file) {
-  io::ReadonlyFileOrError res = uring::OpenRead(rdb_file);
+error_code ServerFamily::LoadRdb(const std::string& rdb_file, bool with_journal) {
+  RdbLoader loader(script_mgr());
   error_code ec;
+  if (!rdb_file.empty())
+    ec = LoadRdbFile(rdb_file, &loader);
+  uint32_t shard_files = loader.shard_files();
+  uint32_t journal_gen = loader.journal_gen();
+
+  if (!ec && !loader.repl_id().empty()) {
+    uint64_t repl_offset = 0;
+    for (uint64_t offset : loader.repl_offsets())
+      repl_offset += offset;
+    LOG(INFO) << "The snapshot was saved by a replica of " << loader.repl_id() << " at offset "
+              << repl_offset;
+  }
 
-  if (res) {
-    io::FileSource fs(*res);
+  // The deltas are applied in order, up to the first one that fails to load.
+  for (unsigned i = 1; !ec && loader.snapshot_id(); ++i) {
+    string delta_path = DeltaFilePath(rdb_file, i);
+    if (!fs::exists(delta_path))
+      break;
+
+    VLOG(1) << "Loading " << delta_path;
+    RdbLoader delta_loader(script_mgr());
+    delta_loader.set_delta_base(loader.snapshot_id());
+    ec = LoadRdbFile(delta_path, &delta_loader);
+    journal_gen = max(journal_gen, delta_loader.journal_gen());
+  }
 
-    RdbLoader loader(script_mgr());
-    ec = loader.Load(&fs);
-  } else {
-    ec = res.error();
+  // The shard files are loaded in parallel, each of the loaders dispatches its entries to
+  // the shards that own them. Hence the number of shards may differ from the saved one.
+  if (!ec && absl::EndsWith(rdb_file, kSummarySuffix)) {
+    string_view base_path{rdb_file};
+    base_path.remove_suffix(kSummarySuffix.size());
+
+    // The journals are replayed into the materialized keys.
+    bool lazy = !(with_journal && GetFlag(FLAGS_journal));
+
+    auto& pool = service_.proactor_pool();
+    vector<error_code> errors(shard_files);
+    vector<fibers::fiber> loaders;
+    for (unsigned i = 0; i < shard_files; ++i) {
+      ProactorBase* pb = pool.at(i % pool.size());
+      loaders.push_back(pb->LaunchFiber([&, i] {
+        string mapped_path = MappedFilePath(base_path, i);
+        if (!IsS3Path(mapped_path) && fs::exists(mapped_path)) {
+          errors[i] = LoadMappedFile(mapped_path, lazy);
+          return;
+        }
+
+        RdbLoader shard_loader(script_mgr());
+        errors[i] = LoadRdbFile(ShardFilePath(base_path, i), &shard_loader);
+      }));
+    }
+
+    for (unsigned i = 0; i < shard_files; ++i) {
+      loaders[i].join();
+      if (errors[i] && !ec)
+        ec = errors[i];
+    }
+  }
+
+  // A snapshot that was taken without the journal may be newer than the journals.
+  if (!ec && with_journal && GetFlag(FLAGS_journal)) {
+    if (journal_gen || rdb_file.empty()) {
+      ec = ReplayJournals(journal_gen);
+    } else {
+      LOG(WARNING) << rdb_file << " was saved without the journal, the journals are ignored";
+    }
   }
 
   service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
@@ -310,7 +763,20 @@ void AppendLabelTupple(absl::Span<const string_view> label_names,
     if (i > 0) {
       absl::StrAppend(dest, ", ");
     }
-    absl::StrAppend(dest, label_names[i], "=\"", label_values[i], "\"");
+    absl::StrAppend(dest, label_names[i], "=\"");
+
+    // The values may be keys, hence we escape them as the text format requires.
+    for (char c : label_values[i]) {
+      if (c == '\\' || c == '"') {
+        dest->push_back('\\');
+        dest->push_back(c);
+      } else if (c == '\n') {
+        dest->append("\\n");
+      } else {
+        dest->push_back(c);
+      }
+    }
+    dest->push_back('"');
   }
 
   absl::StrAppend(dest, "}");
@@ -342,6 +808,12 @@ void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
                             MetricType::GAUGE, &resp->body());
   AppendMetricWithoutLabels("blocked_clients", "", m.conn_stats.num_blocked_clients,
                             MetricType::GAUGE, &resp->body());
+  AppendMetricWithoutLabels("throttled_clients", "", m.conn_stats.num_throttled_conns,
+                            MetricType::GAUGE, &resp->body());
+  AppendMetricWithoutLabels("client_dispatch_queue_bytes", "", m.conn_stats.dispatch_queue_bytes,
+                            MetricType::GAUGE, &resp->body());
+  AppendMetricWithoutLabels("pipeline_throttle_total", "", m.conn_stats.pipeline_throttle_cnt,
+                            MetricType::COUNTER, &resp->body());
 
   // Memory metrics
   AppendMetricWithoutLabels("memory_used_bytes", "", m.heap_used_bytes, MetricType::GAUGE,
@@ -367,6 +839,20 @@ void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
                             &resp->body());
   AppendMetricWithoutLabels("evicted_keys_total", "", m.events.evicted_keys, MetricType::COUNTER,
                             &resp->body());
+  AppendMetricHeader("evicted_keys_by_policy_total", "Keys evicted by maxmemory_policy",
+                     MetricType::COUNTER, &resp->body());
+  for (size_t i = 1; i < m.events.policy_evicted_keys.size(); ++i) {
+    AppendMetricValue("evicted_keys_by_policy_total", m.events.policy_evicted_keys[i], {"policy"},
+                      {EvictionPolicyName(EvictionPolicy(i))}, &resp->body());
+  }
+  AppendMetricWithoutLabels("active_expired_keys_total", "", m.events.active_expired_keys,
+                            MetricType::COUNTER, &resp->body());
+  AppendMetricWithoutLabels("active_expire_lag_ms_total", "", m.events.active_expire_lag_ms,
+                            MetricType::COUNTER, &resp->body());
+  AppendMetricWithoutLabels("change_feed_records_total", "", m.events.change_feed_records,
+                            MetricType::COUNTER, &resp->body());
+  AppendMetricWithoutLabels("change_feed_dropped_total", "", m.events.change_feed_dropped,
+                            MetricType::COUNTER, &resp->body());
 
   string db_key_metrics;
   string db_key_expire_metrics;
@@ -383,6 +869,305 @@ void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
 
   absl::StrAppend(&resp->body(), db_key_metrics);
   absl::StrAppend(&resp->body(), db_key_expire_metrics);
+
+  // Transaction metrics
+  string txq_metrics;
+  AppendMetricHeader("shard_txq_length", "Number of transactions in the shard tx queue",
+                     MetricType::GAUGE, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_txq_length", m.shard_tx[i].txq_len, {"shard"}, {StrCat(i)},
+                      &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_txq_lane_length",
+                     "Number of transactions in the shard tx queue by lane", MetricType::GAUGE,
+                     &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    string shard = StrCat(i);
+    AppendMetricValue("shard_txq_lane_length", tx.txq_fast_len, {"shard", "lane"},
+                      {shard, "fast"}, &txq_metrics);
+    AppendMetricValue("shard_txq_lane_length", tx.txq_len - tx.txq_fast_len, {"shard", "lane"},
+                      {shard, "slow"}, &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_tx_runs_total", "Number of transaction hops by the way they ran",
+                     MetricType::COUNTER, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    string shard = StrCat(i);
+    AppendMetricValue("shard_tx_runs_total", tx.quick_runs, {"shard", "type"}, {shard, "quick"},
+                      &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.txq_runs, {"shard", "type"}, {shard, "txq"},
+                      &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.ooo_runs, {"shard", "type"}, {shard, "ooo"},
+                      &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.optimistic_runs, {"shard", "type"},
+                      {shard, "optimistic"}, &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.continuation_runs, {"shard", "type"},
+                      {shard, "continuation"}, &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.awaked_runs, {"shard", "type"},
+                      {shard, "awaked"}, &txq_metrics);
+    AppendMetricValue("shard_tx_runs_total", tx.fast_lane_runs, {"shard", "type"},
+                      {shard, "fast_lane"}, &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_tx_schedule_attempts_total",
+                     "Attempts to schedule transactions into the shard tx queue by the result",
+                     MetricType::COUNTER, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    string shard = StrCat(i);
+    AppendMetricValue("shard_tx_schedule_attempts_total",
+                      tx.schedule_attempts - tx.schedule_rejects, {"shard", "result"},
+                      {shard, "scheduled"}, &txq_metrics);
+    AppendMetricValue("shard_tx_schedule_attempts_total", tx.schedule_rejects,
+                      {"shard", "result"}, {shard, "rejected"}, &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_tx_lock_conflicts_total",
+                     "Number of scheduled transactions that waited for the key locks",
+                     MetricType::COUNTER, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_tx_lock_conflicts_total", m.shard_tx[i].lock_conflicts, {"shard"},
+                      {StrCat(i)}, &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_blocked_transactions",
+                     "Number of transactions blocked on the keys of the shard, e.g. by BLPOP",
+                     MetricType::GAUGE, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_blocked_transactions", m.shard_tx[i].blocked_txs, {"shard"},
+                      {StrCat(i)}, &txq_metrics);
+  }
+
+  AppendMetricHeader("shard_awakened_transactions_total",
+                     "Number of blocked transactions that were notified of their keys",
+                     MetricType::COUNTER, &txq_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_awakened_transactions_total", m.shard_tx[i].awakened_txs,
+                      {"shard"}, {StrCat(i)}, &txq_metrics);
+  }
+  absl::StrAppend(&resp->body(), txq_metrics);
+
+  // Thread and shard queue metrics
+  string cpu_metrics;
+  AppendMetricHeader("thread_cpu_seconds_total", "CPU time of the thread", MetricType::COUNTER,
+                     &cpu_metrics);
+  for (size_t i = 0; i < m.thread_cpu.size(); ++i) {
+    const auto& cpu = m.thread_cpu[i];
+    string thread = StrCat(i);
+    AppendMetricValue("thread_cpu_seconds_total", cpu.user_usec * 1e-6, {"thread", "mode"},
+                      {thread, "user"}, &cpu_metrics);
+    AppendMetricValue("thread_cpu_seconds_total", cpu.sys_usec * 1e-6, {"thread", "mode"},
+                      {thread, "system"}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("thread_busy_ratio", "Share of the time the thread was on CPU recently",
+                     MetricType::GAUGE, &cpu_metrics);
+  for (size_t i = 0; i < m.thread_cpu.size(); ++i) {
+    AppendMetricValue("thread_busy_ratio", m.thread_cpu[i].busy, {"thread"}, {StrCat(i)},
+                      &cpu_metrics);
+  }
+
+  AppendMetricHeader("thread_context_switches_total", "Context switches of the thread",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.thread_cpu.size(); ++i) {
+    const auto& cpu = m.thread_cpu[i];
+    string thread = StrCat(i);
+    AppendMetricValue("thread_context_switches_total", cpu.voluntary_switches,
+                      {"thread", "type"}, {thread, "voluntary"}, &cpu_metrics);
+    AppendMetricValue("thread_context_switches_total", cpu.involuntary_switches,
+                      {"thread", "type"}, {thread, "involuntary"}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_queue_length", "Number of tasks in the shard queue",
+                     MetricType::GAUGE, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_queue_length", m.shard_tx[i].queue_len, {"shard"}, {StrCat(i)},
+                      &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_queue_tasks_total", "Number of tasks that the shard queue ran",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_queue_tasks_total", m.shard_tx[i].queue_tasks, {"shard"},
+                      {StrCat(i)}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_queue_seconds_total",
+                     "Time of the shard queue tasks by the stage, waiting or executing",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    string shard = StrCat(i);
+    AppendMetricValue("shard_queue_seconds_total", tx.queue_wait_usec * 1e-6, {"shard", "stage"},
+                      {shard, "wait"}, &cpu_metrics);
+    AppendMetricValue("shard_queue_seconds_total", tx.queue_exec_usec * 1e-6, {"shard", "stage"},
+                      {shard, "exec"}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_heartbeat_interval_seconds",
+                     "Current interval of the background ticks of the shard, longer while idle",
+                     MetricType::GAUGE, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_heartbeat_interval_seconds",
+                      m.shard_tx[i].heartbeat_interval_ms * 1e-3, {"shard"}, {StrCat(i)},
+                      &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_heartbeat_ticks_total",
+                     "Number of background ticks of the shard by the rate they ran at",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    string shard = StrCat(i);
+    AppendMetricValue("shard_heartbeat_ticks_total", tx.heartbeat_ticks - tx.heartbeat_idle_ticks,
+                      {"shard", "rate"}, {shard, "base"}, &cpu_metrics);
+    AppendMetricValue("shard_heartbeat_ticks_total", tx.heartbeat_idle_ticks, {"shard", "rate"},
+                      {shard, "idle"}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_heartbeat_deferred_total",
+                     "Number of background ticks that deferred work to the next one",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_heartbeat_deferred_total", m.shard_tx[i].heartbeat_deferred,
+                      {"shard"}, {StrCat(i)}, &cpu_metrics);
+  }
+
+  AppendMetricHeader("shard_heartbeat_seconds_total", "Time of the background ticks of the shard",
+                     MetricType::COUNTER, &cpu_metrics);
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    AppendMetricValue("shard_heartbeat_seconds_total", m.shard_tx[i].heartbeat_usec * 1e-6,
+                      {"shard"}, {StrCat(i)}, &cpu_metrics);
+  }
+  absl::StrAppend(&resp->body(), cpu_metrics);
+
+  // Key analyzer metrics, present only if the analyzer has completed a pass.
+  const KeyAnalyzer::Report& kr = m.key_report;
+  if (!kr.prefixes.empty()) {
+    string prefix_keys, prefix_bytes, prefix_ops;
+    AppendMetricHeader("prefix_keys", "Number of keys by key prefix", MetricType::GAUGE,
+                       &prefix_keys);
+    AppendMetricHeader("prefix_memory_bytes", "Memory of the keys by key prefix",
+                       MetricType::GAUGE, &prefix_bytes);
+    AppendMetricHeader("prefix_ops_total", "Sampled number of key lookups by key prefix",
+                       MetricType::COUNTER, &prefix_ops);
+    for (const auto& [prefix, entry] : kr.prefixes) {
+      AppendMetricValue("prefix_keys", entry.keys, {"prefix"}, {prefix}, &prefix_keys);
+      AppendMetricValue("prefix_memory_bytes", entry.bytes, {"prefix"}, {prefix}, &prefix_bytes);
+      AppendMetricValue("prefix_ops_total", entry.ops, {"prefix"}, {prefix}, &prefix_ops);
+    }
+    absl::StrAppend(&resp->body(), prefix_keys, prefix_bytes, prefix_ops);
+  }
+
+  if (!kr.types.empty()) {
+    string type_keys, type_bytes;
+    AppendMetricHeader("type_keys", "Number of keys by value type and encoding",
+                       MetricType::GAUGE, &type_keys);
+    AppendMetricHeader("type_memory_bytes", "Memory of the keys by value type and encoding",
+                       MetricType::GAUGE, &type_bytes);
+    for (const auto& [type, entry] : kr.types) {
+      // The types are named "type:encoding".
+      pair<string_view, string_view> labels = absl::StrSplit(type, ':');
+      AppendMetricValue("type_keys", entry.keys, {"type", "encoding"},
+                        {labels.first, labels.second}, &type_keys);
+      AppendMetricValue("type_memory_bytes", entry.bytes, {"type", "encoding"},
+                        {labels.first, labels.second}, &type_bytes);
+    }
+    absl::StrAppend(&resp->body(), type_keys, type_bytes);
+  }
+
+  if (!kr.hot_keys.empty()) {
+    string hot_keys;
+    AppendMetricHeader("hot_key_lookups", "Estimated lookups of the hottest keys, decayed over time",
+                       MetricType::GAUGE, &hot_keys);
+    for (const auto& [key, lookups] : kr.hot_keys) {
+      AppendMetricValue("hot_key_lookups", lookups, {"key"}, {key}, &hot_keys);
+    }
+    absl::StrAppend(&resp->body(), hot_keys);
+  }
+
+  if (!kr.big_keys.empty()) {
+    string big_keys;
+    AppendMetricHeader("big_key_memory_bytes", "Memory of the biggest keys", MetricType::GAUGE,
+                       &big_keys);
+    for (const auto& big_key : kr.big_keys) {
+      pair<string_view, string_view> labels = absl::StrSplit(big_key.type, ':');
+      AppendMetricValue("big_key_memory_bytes", big_key.bytes, {"key", "type", "encoding"},
+                        {big_key.key, labels.first, labels.second}, &big_keys);
+    }
+    absl::StrAppend(&resp->body(), big_keys);
+  }
+
+  string latency_metrics;
+  AppendMetricHeader("cmd_latency_usec", "Latency of commands within the server",
+                     MetricType::SUMMARY, &latency_metrics);
+  for (const auto& [cmd, stats] : m.cmd_latency) {
+    const HdrHistogram& hist = stats.total;
+    if (hist.count() == 0)
+      continue;
+
+    for (auto [quantile, p] : {pair{"0.5", 50.0}, pair{"0.99", 99.0}, pair{"0.999", 99.9}}) {
+      AppendMetricValue("cmd_latency_usec", hist.Percentile(p), {"cmd", "quantile"},
+                        {cmd, quantile}, &latency_metrics);
+    }
+    AppendMetricValue("cmd_latency_usec_sum", hist.sum(), {"cmd"}, {cmd}, &latency_metrics);
+    AppendMetricValue("cmd_latency_usec_count", hist.count(), {"cmd"}, {cmd}, &latency_metrics);
+  }
+
+  AppendMetricHeader("cmd_stage_latency_usec", "Latency of command execution stages",
+                     MetricType::HISTOGRAM, &latency_metrics);
+  for (const auto& [cmd, stats] : m.cmd_latency) {
+    for (size_t i = 0; i < size_t(TxStage::NUM_STAGES); ++i) {
+      const LatencyHistogram& hist = stats.stages[i];
+      if (hist.count() == 0)
+        continue;
+
+      string_view stage = TxStageName(TxStage(i));
+      uint64_t cumulative = 0;
+      for (unsigned j = 0; j + 1 < LatencyHistogram::kNumBuckets; ++j) {
+        cumulative += hist.bucket(j);
+        AppendMetricValue("cmd_stage_latency_usec_bucket", cumulative, {"cmd", "stage", "le"},
+                          {cmd, stage, StrCat(LatencyHistogram::BucketBound(j))},
+                          &latency_metrics);
+      }
+      AppendMetricValue("cmd_stage_latency_usec_bucket", hist.count(), {"cmd", "stage", "le"},
+                        {cmd, stage, "+Inf"}, &latency_metrics);
+      AppendMetricValue("cmd_stage_latency_usec_sum", hist.sum(), {"cmd", "stage"}, {cmd, stage},
+                        &latency_metrics);
+      AppendMetricValue("cmd_stage_latency_usec_count", hist.count(), {"cmd", "stage"},
+                        {cmd, stage}, &latency_metrics);
+    }
+  }
+  absl::StrAppend(&resp->body(), latency_metrics);
+
+  if (!m.script_stats.empty()) {
+    string script_metrics;
+    auto append_script_metric = [&](string_view name, string_view help, MetricType type,
+                                    auto getter) {
+      AppendMetricHeader(name, help, type, &script_metrics);
+      for (const auto& [sha, stats] : m.script_stats) {
+        AppendMetricValue(name, getter(stats), {"sha"}, {sha}, &script_metrics);
+      }
+    };
+
+    append_script_metric("script_calls_total", "Calls of the script", MetricType::COUNTER,
+                         [](const ScriptStats& s) { return s.calls; });
+    append_script_metric("script_duration_usec_total", "Run time of the script",
+                         MetricType::COUNTER, [](const ScriptStats& s) { return s.total_usec; });
+    append_script_metric("script_duration_max_usec", "Longest run of the script",
+                         MetricType::GAUGE, [](const ScriptStats& s) { return s.max_usec; });
+    append_script_metric("script_redis_calls_total", "Redis calls made by the script",
+                         MetricType::COUNTER, [](const ScriptStats& s) { return s.redis_calls; });
+    append_script_metric("script_shards_total", "Shards of the keys of the script runs",
+                         MetricType::COUNTER, [](const ScriptStats& s) { return s.shards; });
+    append_script_metric("script_allocated_bytes_total", "Bytes allocated by the script",
+                         MetricType::COUNTER,
+                         [](const ScriptStats& s) { return s.allocated_bytes; });
+    absl::StrAppend(&resp->body(), script_metrics);
+  }
 }
 
 void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
@@ -391,7 +1176,7 @@ void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
 
   auto cb = [this](const util::http::QueryArgs& args, util::HttpContext* send) {
     StringResponse resp = util::http::MakeStringResponse(boost::beast::http::status::ok);
-    PrintPrometheusMetrics(this->GetMetrics(), &resp);
+    PrintPrometheusMetrics(this->GetCachedMetrics(), &resp);
 
     return send->Invoke(std::move(resp));
   };
@@ -444,11 +1229,11 @@ void ServerFamily::StatsMC(std::string_view section, facade::ConnectionContext*
 #undef ADD_LINE
 }
 
-error_code ServerFamily::DoSave(Transaction* trans, string* err_details) {
+error_code ServerFamily::DoSave(Transaction* trans, string* err_details, SaveMode mode) {
   fs::path dir_path(GetFlag(FLAGS_dir));
   error_code ec;
 
-  if (!dir_path.empty()) {
+  if (!dir_path.empty() && !IsS3Path(dir_path.generic_string())) {
     ec = CreateDirs(dir_path);
     if (ec) {
       *err_details = "create-dir ";
@@ -459,11 +1244,18 @@ error_code ServerFamily::DoSave(Transaction* trans, string* err_details) {
   const auto& dbfilename = GetFlag(FLAGS_dbfilename);
   fs::path filename = dbfilename.empty() ? "dump" : dbfilename;
   fs::path path = dir_path;
+  bool per_shard = GetFlag(FLAGS_df_snapshot_format);
 
-  if (!filename.has_extension()) {
+  if (per_shard) {
+    filename.replace_extension();
+  }
+
+  if (per_shard || !filename.has_extension()) {
     absl::Time now = absl::Now();
     string ft_time = absl::FormatTime("-%Y-%m-%dT%H:%M:%S", now, absl::UTCTimeZone());
-    filename += StrCat(ft_time, ".rdb");
+    filename += ft_time;
+    if (!per_shard)
+      filename += ".rdb";
   }
   path += filename;
 
@@ -477,82 +1269,478 @@ error_code ServerFamily::DoSave(Transaction* trans, string* err_details) {
     service_.SwitchState(GlobalState::SAVING, GlobalState::ACTIVE);
   };
 
-  const auto kFlags = O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC | O_DIRECT;
-  auto res = uring::OpenLinux(path.generic_string(), kFlags, 0666);
-  if (!res) {
-    return res.error();
+  // A replica of a Dragonfly master tags the snapshot with its position in the streams of the
+  // master. The position is taken before the snapshot starts, so the snapshot has all the
+  // batches before it. See the comment in ServerFamily::Info about accessing replica_.
+  shared_ptr<Replica> replica;
+  Replica::Position repl_pos;
+  if (!ServerState::tlocal()->is_master) {
+    replica = replica_;
+    repl_pos = replica->GetPosition();
+    if (repl_pos.dragonfly && repl_pos.flow_offsets.empty()) {
+      *err_details = "the replica is syncing with the master - can not save database";
+      return make_error_code(errc::operation_in_progress);
+    }
   }
+  string_view repl_id = repl_pos.flow_offsets.empty() ? string_view{} : repl_pos.master_id;
 
-  unique_ptr<uring::LinuxFile> lf = std::move(res.value());
-  VLOG(1) << "Saving to " << path;
-  LinuxWriteWrapper wf(lf.get());
+  // A full sync that started meanwhile replaced the data of the snapshot that was tagged.
+  auto repl_changed = [&] {
+    return replica && replica->GetPosition().full_syncs != repl_pos.full_syncs;
+  };
 
-  RdbSaver saver{&wf};
+  if (mode == SaveMode::DELTA) {
+    // Evictions are not logged as deletions.
+    if (per_shard || GetFlag(FLAGS_cache_mode) || !snapshot_chain_.id) {
+      *err_details = "a delta requires a previous SAVE in the rdb format with snapshot_deltas ";
+      return make_error_code(errc::operation_not_permitted);
+    }
+    path = DeltaFilePath(snapshot_chain_.base_path, snapshot_chain_.num_deltas + 1);
 
-  VLOG(1) << "Saving to " << path;
+    // The deltas are found by probing the local files when they are loaded.
+    if (IsS3Path(snapshot_chain_.base_path)) {
+      *err_details = "deltas are not supported with an s3 dir ";
+      return make_error_code(errc::operation_not_permitted);
+    }
+
+    // The backing files keep only the values of the latest snapshot, not of its base.
+    if (GetFlag(FLAGS_tiered_warm_restart)) {
+      *err_details = "deltas are not supported with tiered_warm_restart ";
+      return make_error_code(errc::operation_not_permitted);
+    }
+  }
+
+  // The mapped files are read in place and do not have the references of the tiered storage.
+  bool mapped = per_shard && GetFlag(FLAGS_snapshot_mapped);
+  if (mapped && (IsS3Path(path.generic_string()) || GetFlag(FLAGS_tiered_warm_restart))) {
+    *err_details = "snapshot_mapped requires a local dir and no tiered_warm_restart ";
+    return make_error_code(errc::operation_not_permitted);
+  }
+
+  // The snapshot saves the external values as references into the backing files, which keep
+  // them until the next snapshot completes.
+  uint64_t tiered_token = 0;
+  if (GetFlag(FLAGS_tiered_warm_restart)) {
+    tiered_token = absl::Uniform<uint64_t>(absl::BitGen{}, 1, UINT64_MAX);
+
+    fibers::mutex mu;
+    shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+      if (!IsWarmTiered(shard))
+        return;
+      error_code shard_ec = shard->tiered_storage()->BeginSnapshot(tiered_token);
+      if (shard_ec) {
+        lock_guard lk(mu);
+        ec = shard_ec;
+      }
+    });
+
+    if (ec) {
+      EndTieredSnapshot(false);
+      *err_details = "tiered-tokens ";
+      return ec;
+    }
+  }
+
+  // The shards switch to the new journal files when their snapshots start.
+  uint32_t journal_gen = 0;
+  if (GetFlag(FLAGS_journal)) {
+    journal_gen = journal_gen_ + 1;
+    ec = OpenJournals(journal_gen);
+    if (ec) {
+      if (tiered_token)
+        EndTieredSnapshot(false);
+      *err_details = "journal ";
+      return ec;
+    }
+    journal_gen_ = journal_gen;
+  }
 
   auto start = absl::Now();
 
   RdbTypeFreqMap freq_map;
-  shared_ptr<LastSaveInfo> save_info;
   StringVec lua_scripts = script_mgr_->GetLuaScripts();
+  string base_path = path.generic_string();
 
-  ec = saver.SaveHeader(lua_scripts);
+  if (per_shard) {
+    // The shard snapshots take the logged deletions.
+    snapshot_chain_ = SnapshotChain{};
+    if (mapped) {
+      ec = SaveMappedFiles(base_path, trans, &freq_map, journal_gen);
+    } else {
+      ec = SaveShardFiles(base_path, trans, &freq_map, journal_gen, tiered_token);
+    }
 
-  if (!ec) {
-    auto cb = [&saver](Transaction* t, EngineShard* shard) {
-      saver.StartSnapshotInShard(shard);
-      return OpStatus::OK;
-    };
+    // The summary is written last, so that only complete snapshots are loaded.
+    path = SummaryFilePath(base_path);
+    if (!ec && !repl_id.empty() && repl_changed()) {
+      *err_details = "the replica started a full sync meanwhile ";
+      ec = make_error_code(errc::operation_canceled);
+    }
+    if (!ec) {
+      ec = SaveSummaryFile(path.generic_string(), lua_scripts, shard_set->size(), journal_gen,
+                           repl_id, repl_pos.flow_offsets);
+    }
+  } else {
+    ec = SaveSingleFile(base_path, lua_scripts, trans, &freq_map, mode, journal_gen,
+                        tiered_token, repl_id, repl_pos.flow_offsets);
+
+    // The local file is not loaded, the one in s3 is replaced by the next save.
+    if (!ec && !repl_id.empty() && repl_changed()) {
+      *err_details = "the replica started a full sync meanwhile ";
+      ec = make_error_code(errc::operation_canceled);
+      snapshot_chain_ = SnapshotChain{};
+      if (!IsS3Path(base_path)) {
+        error_code rm_ec;
+        fs::remove(base_path, rm_ec);
+      }
+    }
+  }
 
-    trans->ScheduleSingleHop(std::move(cb));
-    is_saving_.store(true, memory_order_relaxed);
+  if (tiered_token)
+    EndTieredSnapshot(!ec);
 
-    // perform snapshot serialization, block the current fiber until it completes.
-    RdbTypeFreqMap freq_map;
-    ec = saver.SaveBody(&freq_map);
+  absl::Duration dur = absl::Now() - start;
+  double seconds = double(absl::ToInt64Milliseconds(dur)) / 1000;
+  LOG(INFO) << "Saving " << path << " finished after "
+            << strings::HumanReadableElapsedTime(seconds);
 
-    is_saving_.store(false, memory_order_relaxed);
+  if (!ec) {
+    auto save_info = make_shared<LastSaveInfo>();
     absl::flat_hash_map<string_view, size_t> tmp_map;
     for (const auto& k_v : freq_map) {
       tmp_map[RdbTypeName(k_v.first)] += k_v.second;
     }
-    save_info = make_shared<LastSaveInfo>();
     for (const auto& k_v : tmp_map) {
       save_info->freq_map.emplace_back(k_v);
     }
+    save_info->save_time = time(NULL);
+    save_info->file_name = path.generic_string();
+    if (!repl_id.empty()) {
+      save_info->repl_master_id = repl_id;
+      save_info->repl_offset = repl_pos.offset();
+    }
+
+    lock_guard lk(save_mu_);
+    // swap - to deallocate the old version outstide of the lock.
+    lsinfo_.swap(save_info);
   }
 
-  absl::Duration dur = absl::Now() - start;
-  double seconds = double(absl::ToInt64Milliseconds(dur)) / 1000;
-  LOG(INFO) << "Saving " << path << " finished after "
-            << strings::HumanReadableElapsedTime(seconds);
+  // The snapshot has the changes of the previous journals.
+  if (!ec && journal_gen) {
+    error_code rm_ec;
+    for (const auto& gen_files : ListJournalFiles(journal_dir_)) {
+      if (gen_files.first >= journal_gen)
+        break;
+      for (const string& file : gen_files.second)
+        fs::remove(file, rm_ec);
+    }
+  }
+
+  return ec;
+}
+
+error_code ServerFamily::SaveSingleFile(const string& path, const StringVec& lua_scripts,
+                                        Transaction* trans, RdbTypeFreqMap* freq_map,
+                                        SaveMode mode, uint32_t journal_gen,
+                                        uint64_t tiered_token, string_view repl_id,
+                                        const vector<uint64_t>& repl_offsets) {
+  SnapshotChain prev_chain = std::move(snapshot_chain_);
+  snapshot_chain_ = SnapshotChain{};
+
+  auto res = OpenSnapshotFile(path);
+  if (!res) {
+    // Nothing has been taken from the shards yet.
+    snapshot_chain_ = std::move(prev_chain);
+    return res.error();
+  }
 
-  auto close_ec = wf.Close();
+  unique_ptr<io::WriteFile> wf = std::move(res.value());
+  VLOG(1) << "Saving to " << path;
+
+  bool delta = (mode == SaveMode::DELTA);
+  uint64_t chain_id = delta ? prev_chain.id : 0;
+  if (!delta && GetFlag(FLAGS_snapshot_deltas))
+    chain_id = absl::Uniform<uint64_t>(absl::BitGen{}, 1, UINT64_MAX);
+
+  RdbSaver saver{wf.get()};
+  error_code ec = saver.SaveHeader(lua_scripts);
+  if (!ec && chain_id)
+    ec = saver.SaveChainInfo(chain_id, delta);
+  if (!ec && journal_gen)
+    ec = saver.SaveJournalGen(journal_gen);
+  if (!ec && tiered_token)
+    ec = saver.SaveTieredToken(tiered_token);
+  if (!ec && !repl_id.empty())
+    ec = saver.SaveReplPosition(repl_id, repl_offsets);
+
+  if (!ec) {
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      saver.StartSnapshotInShard(shard, delta ? prev_chain.versions[shard->shard_id()] : 0);
+      if (journal_gen)
+        shard->journal()->Rotate();
+      return OpStatus::OK;
+    };
 
+    trans->ScheduleSingleHop(std::move(cb));
+    is_saving_.store(true, memory_order_relaxed);
+
+    // perform snapshot serialization, block the current fiber until it completes.
+    ec = saver.SaveBody(freq_map);
+
+    is_saving_.store(false, memory_order_relaxed);
+  }
+
+  auto close_ec = wf->Close();
   if (!ec)
     ec = close_ec;
 
-  if (!ec) {
-    save_info->save_time = time(NULL);
-    save_info->file_name = path.generic_string();
+  // A failed snapshot breaks the chain: the shards consider its changes saved.
+  if (ec || !chain_id)
+    return ec;
 
-    lock_guard lk(save_mu_);
-    // swap - to deallocate the old version outstide of the lock.
-    lsinfo_.swap(save_info);
+  snapshot_chain_.id = chain_id;
+  snapshot_chain_.versions = saver.snapshot_versions();
+  if (delta) {
+    snapshot_chain_.base_path = std::move(prev_chain.base_path);
+    snapshot_chain_.num_deltas = prev_chain.num_deltas + 1;
+    return ec;
+  }
+  snapshot_chain_.base_path = path;
+
+  // The deltas of the previous chain do not apply to the new base.
+  if (mode == SaveMode::COMPACT || prev_chain.base_path == path) {
+    error_code rm_ec;
+    for (unsigned i = 1; i <= prev_chain.num_deltas; ++i)
+      fs::remove(DeltaFilePath(prev_chain.base_path, i), rm_ec);
+    if (mode == SaveMode::COMPACT && !prev_chain.base_path.empty() &&
+        prev_chain.base_path != path)
+      fs::remove(prev_chain.base_path, rm_ec);
   }
 
   return ec;
 }
 
-error_code ServerFamily::DoFlush(Transaction* transaction, DbIndex db_ind) {
+error_code ServerFamily::SaveShardFiles(const string& base_path, Transaction* trans,
+                                        RdbTypeFreqMap* freq_map, uint32_t journal_gen,
+                                        uint64_t tiered_token) {
+  struct ShardFile {
+    unique_ptr<io::WriteFile> wf;
+    unique_ptr<RdbSaver> saver;
+    error_code ec;
+  };
+
+  vector<ShardFile> files(shard_set->size());
+  auto first_error = [&] {
+    for (const auto& file : files) {
+      if (file.ec)
+        return file.ec;
+    }
+    return error_code{};
+  };
+
+  // Each shard writes its file via the io ring of its own thread, or uploads its own object.
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    ShardFile& file = files[shard->shard_id()];
+    string path = ShardFilePath(base_path, shard->shard_id());
+
+    auto res = OpenSnapshotFile(path);
+    if (!res) {
+      file.ec = res.error();
+      return;
+    }
+
+    VLOG(1) << "Saving to " << path;
+    file.wf = std::move(res.value());
+    file.saver = make_unique<RdbSaver>(file.wf.get(), true);
+    file.ec = file.saver->SaveHeader({});
+    if (!file.ec && tiered_token)
+      file.ec = file.saver->SaveTieredToken(tiered_token);
+  });
+
+  error_code ec = first_error();
+
+  if (!ec) {
+    auto cb = [&files, journal_gen](Transaction* t, EngineShard* shard) {
+      files[shard->shard_id()].saver->StartSnapshotInShard(shard);
+      if (journal_gen)
+        shard->journal()->Rotate();
+      return OpStatus::OK;
+    };
+
+    trans->ScheduleSingleHop(std::move(cb));
+    is_saving_.store(true, memory_order_relaxed);
+  }
+
+  fibers::mutex mu;
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    ShardFile& file = files[shard->shard_id()];
+    if (!file.wf)
+      return;
+
+    RdbTypeFreqMap shard_freq;
+    if (!ec)
+      file.ec = file.saver->SaveBody(&shard_freq);
+
+    auto close_ec = file.wf->Close();
+    if (!file.ec)
+      file.ec = close_ec;
+
+    lock_guard lk(mu);
+    for (const auto& k_v : shard_freq) {
+      (*freq_map)[k_v.first] += k_v.second;
+    }
+  });
+
+  is_saving_.store(false, memory_order_relaxed);
+
+  return ec ? ec : first_error();
+}
+
+error_code ServerFamily::SaveMappedFiles(const string& base_path, Transaction* trans,
+                                         RdbTypeFreqMap* freq_map, uint32_t journal_gen) {
+  struct ShardFile {
+    unique_ptr<io::WriteFile> wf;
+    unique_ptr<MappedSnapshotWriter> writer;
+    unique_ptr<SliceSnapshot> snapshot;
+    error_code ec;
+  };
+
+  // A file of the snapshot that the shards still read may be overwritten.
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    if (MappedSnapshot* mapped = shard->mapped_snapshot())
+      mapped->MaterializeAll();
+  });
+
+  vector<ShardFile> files(shard_set->size());
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    ShardFile& file = files[shard->shard_id()];
+    string path = MappedFilePath(base_path, shard->shard_id());
+
+    auto res = OpenSnapshotFile(path);
+    if (!res) {
+      file.ec = res.error();
+      return;
+    }
+
+    VLOG(1) << "Saving to " << path;
+    file.wf = std::move(res.value());
+    file.writer = make_unique<MappedSnapshotWriter>(file.wf.get(), shard->shard_id(),
+                                                    shard_set->size());
+  });
+
+  for (const auto& file : files) {
+    if (!file.ec)
+      continue;
+
+    shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+      if (auto& wf = files[shard->shard_id()].wf)
+        wf->Close();
+    });
+    return file.ec;
+  }
+
+  auto cb = [&files, journal_gen](Transaction* t, EngineShard* shard) {
+    ShardFile& file = files[shard->shard_id()];
+    DbSlice& db_slice = shard->db_slice();
+
+    // Like the rdb shard files, the snapshot takes the logged deletions.
+    if (GetFlag(FLAGS_snapshot_deltas))
+      db_slice.TakeDeltaLog();
+
+    file.snapshot = make_unique<SliceSnapshot>(db_slice.databases(), &db_slice, nullptr);
+    file.snapshot->set_mapped_writer(file.writer.get());
+    file.snapshot->Start();
+    if (journal_gen)
+      shard->journal()->Rotate();
+    return OpStatus::OK;
+  };
+
+  trans->ScheduleSingleHop(std::move(cb));
+  is_saving_.store(true, memory_order_relaxed);
+
+  fibers::mutex mu;
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    ShardFile& file = files[shard->shard_id()];
+    file.snapshot->Join();
+    file.ec = file.snapshot->mapped_error();
+    if (!file.ec)
+      file.ec = file.writer->Finish();
+
+    auto close_ec = file.wf->Close();
+    if (!file.ec)
+      file.ec = close_ec;
+
+    lock_guard lk(mu);
+    for (const auto& k_v : file.snapshot->freq_map()) {
+      (*freq_map)[k_v.first] += k_v.second;
+    }
+  });
+
+  is_saving_.store(false, memory_order_relaxed);
+
+  for (const auto& file : files) {
+    if (file.ec)
+      return file.ec;
+  }
+  return error_code{};
+}
+
+error_code ServerFamily::OpenJournals(uint32_t gen) {
+  vector<error_code> errors(shard_set->size());
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    string path = JournalFilePath(journal_dir_, gen, shard->shard_id());
+    errors[shard->shard_id()] = shard->journal()->OpenNext(path);
+  });
+
+  for (const auto& ec : errors) {
+    if (ec)
+      return ec;
+  }
+  return error_code{};
+}
+
+// The files of a generation have distinct keys, hence they are loaded in parallel.
+// The generations are loaded in order.
+error_code ServerFamily::ReplayJournals(uint32_t from_gen) {
+  auto& pool = service_.proactor_pool();
+
+  for (const auto& gen_files : ListJournalFiles(journal_dir_)) {
+    if (gen_files.first < from_gen)
+      continue;
+    if (gen_files.first >= journal_gen_)
+      break;
+
+    const vector<string>& files = gen_files.second;
+    vector<error_code> errors(files.size());
+    vector<fibers::fiber> loaders;
+    for (unsigned i = 0; i < files.size(); ++i) {
+      ProactorBase* pb = pool.at(i % pool.size());
+      loaders.push_back(pb->LaunchFiber([&, i] {
+        LOG(INFO) << "Replaying " << files[i];
+        RdbLoader loader(script_mgr());
+        errors[i] = LoadRdbFile(files[i], &loader);
+      }));
+    }
+
+    for (auto& fb : loaders)
+      fb.join();
+    for (const auto& ec : errors) {
+      if (ec)
+        return ec;
+    }
+  }
+
+  return error_code{};
+}
+
+error_code ServerFamily::DoFlush(Transaction* transaction, DbIndex db_ind, bool async) {
   VLOG(1) << "DoFlush";
 
   transaction->Schedule();  // TODO: to convert to ScheduleSingleHop ?
 
   transaction->Execute(
-      [db_ind](Transaction* t, EngineShard* shard) {
-        shard->db_slice().FlushDb(db_ind);
+      [db_ind, async](Transaction* t, EngineShard* shard) {
+        shard->db_slice().FlushDb(db_ind, async);
         return OpStatus::OK;
       },
       true);
@@ -578,20 +1766,48 @@ void ServerFamily::DbSize(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendLong(num_keys.load(memory_order_relaxed));
 }
 
+namespace {
+
+// Parses the optional ASYNC|SYNC argument of FLUSHDB and FLUSHALL.
+// Flushes are asynchronous by default, i.e. the flushed tables are released in the background.
+optional<bool> ParseFlushMode(CmdArgList args) {
+  if (args.size() == 1)
+    return true;
+
+  if (args.size() > 2)
+    return nullopt;
+
+  ToUpper(&args[1]);
+  string_view mode = ArgS(args, 1);
+  if (mode == "ASYNC")
+    return true;
+  if (mode == "SYNC")
+    return false;
+
+  return nullopt;
+}
+
+}  // namespace
+
 void ServerFamily::FlushDb(CmdArgList args, ConnectionContext* cntx) {
+  optional<bool> async = ParseFlushMode(args);
+  if (!async) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
   DCHECK(cntx->transaction);
-  DoFlush(cntx->transaction, cntx->transaction->db_index());
+  DoFlush(cntx->transaction, cntx->transaction->db_index(), *async);
   cntx->reply_builder()->SendOk();
 }
 
 void ServerFamily::FlushAll(CmdArgList args, ConnectionContext* cntx) {
-  if (args.size() > 1) {
-    (*cntx)->SendError(kSyntaxErr);
-    return;
+  optional<bool> async = ParseFlushMode(args);
+  if (!async) {
+    return (*cntx)->SendError(kSyntaxErr);
   }
 
   DCHECK(cntx->transaction);
-  DoFlush(cntx->transaction, DbSlice::kDbAll);
+  DoFlush(cntx->transaction, DbSlice::kDbAll, *async);
   (*cntx)->SendOk();
 }
 
@@ -636,10 +1852,14 @@ void ServerFamily::Client(CmdArgList args, ConnectionContext* cntx) {
       client_info.push_back(move(info));
     };
 
-    main_listener_->TraverseConnections(cb);
+    for (util::ListenerInterface* listener : listeners_) {
+      listener->TraverseConnections(cb);
+    }
     string result = absl::StrJoin(move(client_info), "\n");
     result.append("\n");
     return (*cntx)->SendBulkString(result);
+  } else if (sub_cmd == "TRACKING" && args.size() >= 3) {
+    return ClientTracking(args.subspan(2), cntx);
   }
 
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
@@ -651,10 +1871,41 @@ void ServerFamily::Config(CmdArgList args, ConnectionContext* cntx) {
   string_view sub_cmd = ArgS(args, 1);
 
   if (sub_cmd == "SET") {
+    if (args.size() == 4 && absl::EqualsIgnoreCase(ArgS(args, 2), "notify-keyspace-events")) {
+      string spec{ArgS(args, 3)};
+      uint32_t classes = 0;
+      if (!KeyspaceEvents::ParseClasses(spec, &classes)) {
+        return (*cntx)->SendError(
+            absl::StrCat("Invalid argument '", spec, "' for CONFIG SET 'notify-keyspace-events'"));
+      }
+
+      absl::SetFlag(&FLAGS_notify_keyspace_events, spec);
+      shard_set->RunBriefInParallel(
+          [&](EngineShard* shard) { shard->db_slice().keyspace_events().SetClasses(classes); });
+    } else if (args.size() == 4 && absl::EqualsIgnoreCase(ArgS(args, 2), "db-maxmemory")) {
+      string spec{ArgS(args, 3)};
+      vector<size_t> quotas;
+      if (!DbSlice::ParseDbQuotas(spec, &quotas)) {
+        return (*cntx)->SendError(
+            absl::StrCat("Invalid argument '", spec, "' for CONFIG SET 'db-maxmemory'"));
+      }
+
+      absl::SetFlag(&FLAGS_db_maxmemory, spec);
+      shard_set->RunBriefInParallel(
+          [&](EngineShard* shard) { shard->db_slice().SetDbQuotas(quotas); });
+    }
     return (*cntx)->SendOk();
   } else if (sub_cmd == "GET" && args.size() == 3) {
     string_view param = ArgS(args, 2);
-    string_view res[2] = {param, "tbd"};
+    string value = "tbd";
+    if (absl::EqualsIgnoreCase(param, "notify-keyspace-events")) {
+      uint32_t classes = 0;
+      KeyspaceEvents::ParseClasses(absl::GetFlag(FLAGS_notify_keyspace_events), &classes);
+      value = KeyspaceEvents::FormatClasses(classes);
+    } else if (absl::EqualsIgnoreCase(param, "db-maxmemory")) {
+      value = absl::GetFlag(FLAGS_db_maxmemory);
+    }
+    string_view res[2] = {param, value};
 
     return (*cntx)->SendStringArr(res);
   } else if (sub_cmd == "RESETSTAT") {
@@ -686,14 +1937,105 @@ void ServerFamily::Memory(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendLong(1);
   }
 
+  if (sub_cmd == "STATS") {
+    return MemoryStats(cntx);
+  }
+
+  if (sub_cmd == "MALLOC-STATS") {
+    return MemoryMallocStats(cntx);
+  }
+
   string err = UnknownSubCmd(sub_cmd, "MEMORY");
   return (*cntx)->SendError(err, kSyntaxErrType);
 }
 
+// Replies with name/value pairs like redis does. The breakdown of the keys by prefixes and
+// encodings is taken from the last passes of the key analyzer, see FLAGS_key_analyzer_buckets.
+void ServerFamily::MemoryStats(ConnectionContext* cntx) {
+  Metrics m = GetCachedMetrics();
+  DbStats total;
+  for (const auto& db_stats : m.db) {
+    total += db_stats;
+  }
+
+  vector<pair<string, uint64_t>> items = {
+      {"peak.allocated", used_mem_peak.load(memory_order_relaxed)},
+      {"total.allocated", m.heap_used_bytes},
+      {"keys.count", total.key_count},
+      {"dataset.bytes", total.obj_memory_usage + m.dedup_bytes},
+      {"table.bytes", total.table_mem_usage},
+  };
+  for (auto& item : m.key_report.Items()) {
+    items.push_back(std::move(item));
+  }
+
+  (*cntx)->StartArray(items.size() * 2);
+  for (const auto& [name, value] : items) {
+    (*cntx)->SendBulkString(name);
+    (*cntx)->SendLong(value);
+  }
+}
+
+// Replies with the breakdown of the shard heaps by the block sizes of their pages, as of the
+// last passes of the shards, see FLAGS_malloc_stats_period.
+void ServerFamily::MemoryMallocStats(ConnectionContext* cntx) {
+  Metrics m = GetCachedMetrics();
+  uint64_t now_ms = absl::GetCurrentTimeNanos() / 1000000;
+
+  auto percent = [](size_t part, size_t total) { return total ? 100.0 * part / total : 0.0; };
+
+  string res;
+  for (ShardId sid = 0; sid < m.malloc_stats.size(); ++sid) {
+    const auto& stats = m.malloc_stats[sid];
+    if (!stats) {
+      absl::StrAppend(&res, "shard ", sid, ": not collected\n\n");
+      continue;
+    }
+
+    const HeapStats& heap = stats->heap;
+    absl::StrAppend(&res, "shard ", sid, ": collected ",
+                    now_ms > stats->collected_ms ? now_ms - stats->collected_ms : 0, "ms ago in ",
+                    stats->duration_usec, "us\n");
+    absl::StrAppend(&res, "committed: ", heap.committed, " used: ", heap.used,
+                    absl::StrFormat(" utilization: %.1f%%", percent(heap.used, heap.committed)),
+                    " pages: ", heap.pages, "\n");
+    absl::StrAppend(&res, "large_objects: ", heap.large_objects, " large_bytes: ", heap.large_bytes,
+                    " segment_used: ", stats->segment_used, "\n");
+    absl::StrAppend(&res, "block_size pages used committed utilization\n");
+    for (const HeapStats::SizeClass& sc : heap.size_classes) {
+      absl::StrAppend(&res, sc.block_size, " ", sc.pages, " ", sc.used, " ", sc.committed,
+                      absl::StrFormat(" %.1f%%", percent(sc.used, sc.committed)), "\n");
+    }
+    res.push_back('\n');
+  }
+
+  if (res.empty())
+    res = "malloc stats are disabled, see --malloc_stats_period\n";
+
+  return (*cntx)->SendBulkString(res);
+}
+
+// SAVE [DELTA | COMPACT]
 void ServerFamily::Save(CmdArgList args, ConnectionContext* cntx) {
   string err_detail;
+  SaveMode mode = SaveMode::FULL;
+
+  if (args.size() > 2)
+    return (*cntx)->SendError(kSyntaxErr);
+
+  if (args.size() == 2) {
+    ToUpper(&args[1]);
+    string_view sub_cmd = ArgS(args, 1);
+    if (sub_cmd == "DELTA") {
+      mode = SaveMode::DELTA;
+    } else if (sub_cmd == "COMPACT") {
+      mode = SaveMode::COMPACT;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
 
-  error_code ec = DoSave(cntx->transaction, &err_detail);
+  error_code ec = DoSave(cntx->transaction, &err_detail, mode);
 
   if (ec) {
     (*cntx)->SendError(absl::StrCat(err_detail, ec.message()));
@@ -711,44 +2053,236 @@ static void MergeInto(const DbSlice::Stats& src, Metrics* dest) {
 
   dest->events += src.events;
   dest->small_string_bytes += src.small_string_bytes;
+  dest->compressed_strings += src.compressed_strings;
+  dest->compression_dict_bytes += src.compression_dict_bytes;
+  dest->dedup_strings += src.dedup_strings;
+  dest->dedup_bytes += src.dedup_bytes;
+  dest->dedup_saved_bytes += src.dedup_saved_bytes;
+}
+
+vector<pair<string, string>> GetTxStats(const Metrics& m) {
+  vector<pair<string, string>> res;
+
+  vector<string_view> cmds;
+  for (const auto& k_v : m.cmd_latency) {
+    cmds.push_back(k_v.first);
+  }
+  sort(cmds.begin(), cmds.end());
+
+  for (string_view cmd : cmds) {
+    const CmdLatencyStats& stats = m.cmd_latency.at(cmd);
+    const HdrHistogram& total = stats.total;
+    if (total.count() > 0) {
+      res.emplace_back(StrCat("latency_percentiles_usec_", absl::AsciiStrToLower(cmd)),
+                       StrCat("p50=", total.Percentile(50), ",p99=", total.Percentile(99),
+                              ",p99.9=", total.Percentile(99.9)));
+    }
+
+    for (size_t i = 0; i < size_t(TxStage::NUM_STAGES); ++i) {
+      const LatencyHistogram& hist = stats.stages[i];
+      if (hist.count() == 0)
+        continue;
+      res.emplace_back(StrCat("latency_", absl::AsciiStrToLower(cmd), "_",
+                              TxStageName(TxStage(i))),
+                       hist.ToString());
+    }
+  }
+
+  for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+    const auto& tx = m.shard_tx[i];
+    uint64_t scheduled = tx.txq_runs + tx.ooo_runs;
+    double ooo_ratio = scheduled ? double(tx.ooo_runs) / scheduled : 0;
+    res.emplace_back(StrCat("shard", i, "_tx"),
+                     StrCat("txq_len=", tx.txq_len, ",txq_fast_len=", tx.txq_fast_len,
+                            ",quick_runs=", tx.quick_runs,
+                            ",txq_runs=", tx.txq_runs, ",ooo_runs=", tx.ooo_runs,
+                            ",ooo_ratio=", absl::StrFormat("%.2f", ooo_ratio),
+                            ",continuation_runs=", tx.continuation_runs,
+                            ",fast_lane_runs=", tx.fast_lane_runs,
+                            ",schedule_attempts=", tx.schedule_attempts,
+                            ",schedule_rejects=", tx.schedule_rejects,
+                            ",lock_conflicts=", tx.lock_conflicts, ",blocked=", tx.blocked_txs));
+  }
+
+  return res;
+}
+
+struct ServerFamily::ThreadMetrics {
+  facade::ConnectionStats conn_stats;
+  uint64_t qps_sum6 = 0;  // moving sum over the last 6 seconds.
+  size_t lua_memory_bytes = 0;
+  CmdLatencyMap cmd_latency;
+  ScriptStatsMap script_stats;
+  Metrics::ThreadCpuStats cpu;
+  uint64_t sampled_ns = 0;  // monotonic time of the snapshot.
+};
+
+// Reads the cpu usage of the calling thread, without the busy share.
+static Metrics::ThreadCpuStats ReadThreadCpu() {
+  struct rusage ru;
+  Metrics::ThreadCpuStats res;
+  if (getrusage(RUSAGE_THREAD, &ru) != 0)
+    return res;
+
+  res.user_usec = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+  res.sys_usec = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+  res.voluntary_switches = ru.ru_nvcsw;
+  res.involuntary_switches = ru.ru_nivcsw;
+  return res;
+}
+
+static void MergeShardMetrics(const EngineShard::MetricsSnapshot& src, ShardId sid,
+                              Metrics* dest) {
+  MergeInto(src.slice, dest);
+
+  dest->heap_used_bytes += src.used_memory;
+  dest->tiered_stats += src.tiered;
+  dest->shard_stats += src.shard;
+  dest->traverse_ttl_per_sec += src.traverse_ttl_sum6;
+  dest->delete_ttl_per_sec += src.delete_ttl_sum6;
+  dest->flush_pending_keys += src.flush_pending_keys;
+  dest->lazyfree_pending_objects += src.lazyfree_pending_objects;
+
+  Metrics::ShardTxStats& tx = dest->shard_tx[sid];
+  tx.txq_len = src.txq_len;
+  tx.txq_fast_len = src.txq_fast_len;
+  tx.quick_runs = src.shard.quick_runs;
+  tx.txq_runs = src.shard.txq_runs;
+  tx.ooo_runs = src.shard.ooo_runs;
+  tx.optimistic_runs = src.shard.optimistic_runs;
+  tx.continuation_runs = src.shard.continuation_runs;
+  tx.awaked_runs = src.shard.awaked_runs;
+  tx.fast_lane_runs = src.shard.fast_lane_runs;
+  tx.schedule_attempts = src.shard.schedule_attempts;
+  tx.schedule_rejects = src.shard.schedule_rejects;
+  tx.lock_conflicts = src.shard.lock_conflicts;
+  tx.blocked_txs = src.blocked_txs;
+  tx.awakened_txs = src.awakened_txs;
+  tx.queue_len = src.queue_len;
+  tx.queue_tasks = src.queue_tasks;
+  tx.queue_wait_usec = src.queue_wait_usec;
+  tx.queue_exec_usec = src.queue_exec_usec;
+  tx.heartbeat_interval_ms = src.heartbeat_interval_ms;
+  tx.heartbeat_ticks = src.shard.heartbeat_ticks;
+  tx.heartbeat_idle_ticks = src.shard.heartbeat_idle_ticks;
+  tx.heartbeat_deferred = src.shard.heartbeat_deferred;
+  tx.heartbeat_usec = src.shard.heartbeat_usec;
+
+  if (src.key_report)
+    dest->key_report += *src.key_report;
+
+  dest->malloc_stats[sid] = src.malloc_stats;
+}
+
+static void NormalizeMetrics(Metrics* m) {
+  // Moving sums over 6 seconds.
+  m->qps /= 6;
+  m->traverse_ttl_per_sec /= 6;
+  m->delete_ttl_per_sec /= 6;
 }
 
 Metrics ServerFamily::GetMetrics() const {
   Metrics result;
+  result.shard_tx.resize(shard_set->size());
+  result.malloc_stats.resize(shard_set->size());
+  result.thread_cpu.resize(service_.proactor_pool().size());
 
   fibers::mutex mu;
 
   auto cb = [&](ProactorBase* pb) {
     EngineShard* shard = EngineShard::tlocal();
     ServerState* ss = ServerState::tlocal();
+    EngineShard::MetricsSnapshot shard_metrics;
+    if (shard)
+      shard_metrics = shard->GetMetricsSnapshot();
+    result.thread_cpu[pb->GetIndex()] = ReadThreadCpu();
 
     lock_guard<fibers::mutex> lk(mu);
 
-    result.uptime = time(NULL) - this->start_time_;
     result.conn_stats += ss->connection_stats;
     result.qps += uint64_t(ss->MovingSum6());
+    result.lua_memory_bytes += Interpreter::UsedThreadLocal();
+    for (const auto& [cmd, stats] : ss->cmd_latency) {
+      result.cmd_latency[cmd] += stats;
+    }
+    for (const auto& [sha, stats] : ss->script_stats) {
+      result.script_stats[sha] += stats;
+    }
 
     if (shard) {
-      MergeInto(shard->db_slice().GetStats(), &result);
-
-      result.heap_used_bytes += shard->UsedMemory();
-      if (shard->tiered_storage()) {
-        result.tiered_stats += shard->tiered_storage()->GetStats();
-      }
-      result.shard_stats += shard->stats();
-      result.traverse_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_TRAVERSE);
-      result.delete_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_DELETE);
+      MergeShardMetrics(shard_metrics, shard->shard_id(), &result);
     }
   };
 
   service_.proactor_pool().AwaitFiberOnAll(std::move(cb));
-  result.qps /= 6;  // normalize moving average stats
-  result.traverse_ttl_per_sec /= 6;
-  result.delete_ttl_per_sec /= 6;
+  result.uptime = time(NULL) - this->start_time_;
+  NormalizeMetrics(&result);
+
+  return result;
+}
+
+Metrics ServerFamily::GetCachedMetrics() const {
+  Metrics result;
+  result.shard_tx.resize(shard_set->size());
+  result.malloc_stats.resize(shard_set->size());
+
+  const auto& cached_stats = EngineShardSet::GetCachedStats();
+  for (ShardId sid = 0; sid < cached_stats.size(); ++sid) {
+    auto snapshot = atomic_load(&cached_stats[sid].metrics);
+    if (!snapshot)
+      return GetMetrics();
+    MergeShardMetrics(*snapshot, sid, &result);
+  }
+
+  result.thread_cpu.resize(thread_metrics_.size());
+  for (size_t i = 0; i < thread_metrics_.size(); ++i) {
+    auto snapshot = atomic_load(&thread_metrics_[i]);
+    if (!snapshot)
+      return GetMetrics();
+
+    result.thread_cpu[i] = snapshot->cpu;
+
+    result.conn_stats += snapshot->conn_stats;
+    result.qps += snapshot->qps_sum6;
+    result.lua_memory_bytes += snapshot->lua_memory_bytes;
+    for (const auto& [cmd, stats] : snapshot->cmd_latency) {
+      result.cmd_latency[cmd] += stats;
+    }
+    for (const auto& [sha, stats] : snapshot->script_stats) {
+      result.script_stats[sha] += stats;
+    }
+  }
+
+  result.uptime = time(NULL) - this->start_time_;
+  NormalizeMetrics(&result);
 
   return result;
 }
 
+void ServerFamily::PublishThreadMetrics(unsigned index) {
+  ServerState* ss = ServerState::tlocal();
+
+  auto snapshot = make_shared<ThreadMetrics>();
+  snapshot->conn_stats = ss->connection_stats;
+  snapshot->qps_sum6 = ss->MovingSum6();
+  snapshot->lua_memory_bytes = Interpreter::UsedThreadLocal();
+  snapshot->cmd_latency = ss->cmd_latency;
+  snapshot->script_stats = ss->script_stats;
+
+  // The share of the time on cpu since the previous snapshot. An idle proactor sleeps in the
+  // kernel, waiting for completions, hence it does not consume cpu.
+  snapshot->cpu = ReadThreadCpu();
+  snapshot->sampled_ns = ProactorBase::GetMonotonicTimeNs();
+  auto prev = atomic_load(&thread_metrics_[index]);
+  if (prev && snapshot->sampled_ns > prev->sampled_ns) {
+    uint64_t cpu_usec = snapshot->cpu.user_usec + snapshot->cpu.sys_usec - prev->cpu.user_usec -
+                        prev->cpu.sys_usec;
+    double busy = cpu_usec * 1000.0 / (snapshot->sampled_ns - prev->sampled_ns);
+    snapshot->cpu.busy = min(busy, 1.0);
+  }
+  atomic_store(&thread_metrics_[index], shared_ptr<const ThreadMetrics>{std::move(snapshot)});
+}
+
 void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
   if (args.size() > 2) {
     return (*cntx)->SendError(kSyntaxErr);
@@ -776,7 +2310,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
   };
 
 #define ADD_HEADER(x) absl::StrAppend(&info, x "\r\n")
-  Metrics m = GetMetrics();
+  Metrics m = GetCachedMetrics();
 
   if (should_enter("SERVER")) {
     ADD_HEADER("# Server");
@@ -804,6 +2338,8 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("connected_clients", m.conn_stats.num_conns);
     append("client_read_buf_capacity", m.conn_stats.read_buf_capacity);
     append("blocked_clients", m.conn_stats.num_blocked_clients);
+    append("throttled_clients", m.conn_stats.num_throttled_conns);
+    append("client_dispatch_queue_bytes", m.conn_stats.dispatch_queue_bytes);
   }
 
   if (should_enter("MEMORY")) {
@@ -812,6 +2348,8 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("used_memory", m.heap_used_bytes);
     append("used_memory_human", HumanReadableNumBytes(m.heap_used_bytes));
     append("used_memory_peak", used_mem_peak.load(memory_order_relaxed));
+    append("used_memory_lua", m.lua_memory_bytes);
+    append("used_memory_lua_human", HumanReadableNumBytes(m.lua_memory_bytes));
 
     append("comitted_memory", _mi_stats_main.committed.current);
 
@@ -827,7 +2365,8 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     // heap. For example, strings or intsets. members of lists, sets, zsets etc
     // are not accounted for to avoid complex computations. In some cases, when number of members
     // is known we approximate their allocations by taking 16 bytes per member.
-    append("object_used_memory", total.obj_memory_usage);
+    // The shared strings are accounted per shard rather than per value.
+    append("object_used_memory", total.obj_memory_usage + m.dedup_bytes);
     append("table_used_memory", total.table_mem_usage);
     append("num_buckets", total.bucket_count);
     append("num_entries", total.key_count);
@@ -836,9 +2375,61 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("listpack_blobs", total.listpack_blob_cnt);
     append("listpack_bytes", total.listpack_bytes);
     append("small_string_bytes", m.small_string_bytes);
+    append("compressed_strings", m.compressed_strings);
+    append("flush_pending_keys", m.flush_pending_keys);
+    append("lazyfree_pending_objects", m.lazyfree_pending_objects);
+    append("compression_dict_bytes", m.compression_dict_bytes);
+    append("dedup_strings", m.dedup_strings);
+    append("dedup_bytes", m.dedup_bytes);
+    append("dedup_saved_bytes", m.dedup_saved_bytes);
+
+    // As of the last passes over the shard heaps, see MEMORY MALLOC-STATS.
+    if (any_of(m.malloc_stats.begin(), m.malloc_stats.end(), [](const auto& s) { return bool(s); })) {
+      EngineShard::MallocStats sum;
+      vector<string> per_shard;
+      for (ShardId sid = 0; sid < m.malloc_stats.size(); ++sid) {
+        if (const auto& stats = m.malloc_stats[sid]; stats) {
+          const HeapStats& heap = stats->heap;
+          sum.heap.committed += heap.committed;
+          sum.heap.used += heap.used;
+          sum.heap.pages += heap.pages;
+          sum.heap.large_objects += heap.large_objects;
+          sum.segment_used += stats->segment_used;
+          per_shard.push_back(absl::StrCat("committed=", heap.committed, ",used=", heap.used,
+                                           ",pages=", heap.pages, ",large_objects=",
+                                           heap.large_objects, ",segment_used=",
+                                           stats->segment_used));
+        } else {
+          per_shard.emplace_back();
+        }
+      }
+
+      append("malloc_committed_bytes", sum.heap.committed);
+      append("malloc_used_bytes", sum.heap.used);
+      append("malloc_pages", sum.heap.pages);
+      append("malloc_large_objects", sum.heap.large_objects);
+      append("malloc_segment_used_bytes", sum.segment_used);
+      for (ShardId sid = 0; sid < per_shard.size(); ++sid) {
+        if (!per_shard[sid].empty())
+          append(StrCat("malloc_shard", sid), per_shard[sid]);
+      }
+    }
+
+    // Heap stats are sampled only when the active defragmentation is enabled.
+    const EngineShard::Stats& shard_stats = m.shard_stats;
+    if (shard_stats.heap_used) {
+      append("mem_fragmentation_ratio", double(shard_stats.heap_committed) / shard_stats.heap_used);
+    }
+    append("defrag_cycles", shard_stats.defrag_cycles);
+    append("defrag_moved_values", shard_stats.defrag_moved);
+    append("defrag_reclaimed_bytes", shard_stats.defrag_reclaimed_bytes);
+    append("lazyfreed_objects", shard_stats.lazyfree_objects);
     append("maxmemory", max_memory_limit);
     append("maxmemory_human", HumanReadableNumBytes(max_memory_limit));
     append("cache_mode", GetFlag(FLAGS_cache_mode) ? "cache" : "store");
+    if (GetFlag(FLAGS_cache_mode))
+      append("cache_policy", GetFlag(FLAGS_cache_policy));
+    append("maxmemory_policy", GetFlag(FLAGS_maxmemory_policy));
   }
 
   if (should_enter("STATS")) {
@@ -847,6 +2438,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("instantaneous_ops_per_sec", m.qps);
     append("total_commands_processed", m.conn_stats.command_cnt);
     append("total_pipelined_commands", m.conn_stats.pipelined_cmd_cnt);
+    append("total_pipeline_throttles", m.conn_stats.pipeline_throttle_cnt);
     append("total_net_input_bytes", m.conn_stats.io_read_bytes);
     append("total_net_output_bytes", m.conn_stats.io_write_bytes);
     append("instantaneous_input_kbps", -1);
@@ -854,10 +2446,21 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("rejected_connections", -1);
     append("expired_keys", m.events.expired_keys);
     append("evicted_keys", m.events.evicted_keys);
+    for (size_t i = 1; i < m.events.policy_evicted_keys.size(); ++i) {
+      string name = absl::StrReplaceAll(EvictionPolicyName(EvictionPolicy(i)), {{"-", "_"}});
+      append(StrCat("evicted_keys_", name), m.events.policy_evicted_keys[i]);
+    }
     append("garbage_checked", m.events.garbage_checked);
     append("garbage_collected", m.events.garbage_collected);
     append("bump_ups", m.events.bumpups);
     append("stash_unloaded", m.events.stash_unloaded);
+    append("active_expired_keys", m.events.active_expired_keys);
+    append("active_expire_lag_avg_ms",
+           m.events.active_expire_lag_ms / std::max<size_t>(1, m.events.active_expired_keys));
+    append("expired_fields", m.events.expired_fields);
+    append("stream_compacted_entries", m.events.stream_compacted_entries);
+    append("change_feed_records", m.events.change_feed_records);
+    append("change_feed_dropped", m.events.change_feed_dropped);
     append("traverse_ttl_sec", m.traverse_ttl_per_sec);
     append("delete_ttl_sec", m.delete_ttl_per_sec);
     append("keyspace_hits", -1);
@@ -866,6 +2469,8 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("total_writes_processed", m.conn_stats.io_write_cnt);
     append("async_writes_count", m.conn_stats.async_writes_cnt);
     append("parser_err_count", m.conn_stats.parser_err_cnt);
+    append("optimistic_reads", m.shard_stats.optimistic_runs);
+    append("optimistic_read_conflicts", m.shard_stats.optimistic_conflicts);
   }
 
   if (should_enter("TIERED", true)) {
@@ -873,9 +2478,17 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("external_entries", total.external_entries);
     append("external_bytes", total.external_size);
     append("external_reads", m.tiered_stats.external_reads);
+    append("external_reads_coalesced", m.tiered_stats.external_reads_coalesced);
+    append("external_reads_merged", m.tiered_stats.external_reads_merged);
     append("external_writes", m.tiered_stats.external_writes);
+    append("external_promotions", m.tiered_stats.external_promotions);
+    append("external_compacted", m.tiered_stats.external_compacted);
     append("external_reserved", m.tiered_stats.storage_reserved);
     append("external_capacity", m.tiered_stats.storage_capacity);
+    if (total.external_size) {
+      append("external_fragmentation_ratio",
+             double(m.tiered_stats.storage_reserved) / total.external_size);
+    }
   }
 
   if (should_enter("PERSISTENCE", true)) {
@@ -900,6 +2513,45 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     if (etl.is_master) {
       append("role", "master");
       append("connected_slaves", m.conn_stats.num_replicas);
+
+      atomic_uint64_t offset{0}, backlog_size{0}, backlog_len{0};
+      shard_set->RunBriefInParallel([&](EngineShard* shard) {
+        Journal* journal = shard->journal();
+        offset.fetch_add(journal->stream_offset(), memory_order_relaxed);
+        backlog_size.fetch_add(journal->backlog_capacity(), memory_order_relaxed);
+        backlog_len.fetch_add(journal->backlog_len(), memory_order_relaxed);
+      });
+      uint64_t master_offset = offset.load();
+
+      // The offsets are the sums of the offsets of the shards.
+      vector<shared_ptr<SyncSession>> sessions;
+      {
+        lock_guard lk(sync_mu_);
+        for (const auto& k_v : sync_sessions_) {
+          if (auto session = k_v.second.lock())
+            sessions.push_back(std::move(session));
+        }
+      }
+
+      uint64_t now = ProactorBase::GetMonotonicTimeNs() / 1000000000;
+      unsigned index = 0;
+      for (const auto& session : sessions) {
+        uint64_t acked = session->acked_offset.load(memory_order_relaxed);
+        uint64_t ack_time = session->ack_time.load(memory_order_relaxed);
+        if (ack_time == 0)
+          continue;  // has not synced yet.
+
+        uint64_t offset_lag = master_offset - min(acked, master_offset);
+        append(StrCat("slave", index++),
+               StrCat("addr=", session->address, ",state=online,offset=", acked,
+                      ",lag=", now - ack_time, ",offset_lag=", offset_lag));
+      }
+
+      append("master_replid", master_id_);
+      append("master_repl_offset", master_offset);
+      append("repl_backlog_active", backlog_size.load() > 0);
+      append("repl_backlog_size", backlog_size.load());
+      append("repl_backlog_histlen", backlog_len.load());
     } else {
       append("role", "slave");
 
@@ -915,6 +2567,18 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       append("master_link_status", link);
       append("master_last_io_seconds_ago", rinfo.master_last_io_sec);
       append("master_sync_in_progress", rinfo.sync_in_progress);
+      append("slave_repl_offset", rinfo.repl_offset);
+
+      // The latest snapshot that the replica saved while it replicated the same master.
+      append("slave_snapshot_in_progress", is_saving_.load(memory_order_relaxed));
+      auto save_info = GetLastSaveInfo();
+      if (!save_info->repl_master_id.empty() &&
+          save_info->repl_master_id == replica_ptr->GetPosition().master_id) {
+        append("slave_snapshot_offset", save_info->repl_offset);
+        append("slave_snapshot_offset_lag",
+               rinfo.repl_offset - min(save_info->repl_offset, rinfo.repl_offset));
+        append("slave_snapshot_lag", time(NULL) - save_info->save_time);
+      }
     }
   }
 
@@ -939,14 +2603,27 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     }
   }
 
+  if (should_enter("LATENCYSTATS", true)) {
+    ADD_HEADER("# Latencystats");
+    for (const auto& [name, value] : GetTxStats(m)) {
+      append(name, value);
+    }
+  }
+
   if (should_enter("KEYSPACE")) {
     ADD_HEADER("# Keyspace");
     for (size_t i = 0; i < m.db.size(); ++i) {
       const auto& stats = m.db[i];
-      bool show = (i == 0) || (stats.key_count > 0);
+      bool show = (i == 0) || (stats.key_count > 0) || (stats.quota > 0);
       if (show) {
         string val = StrCat("keys=", stats.key_count, ",expires=", stats.expire_count,
                             ",avg_ttl=-1");  // TODO
+        if (stats.quota > 0) {
+          absl::StrAppend(&val, ",quota=", stats.quota,
+                          ",quota_used=", stats.table_mem_usage + stats.obj_memory_usage,
+                          ",quota_evicted=", stats.quota_evicted,
+                          ",quota_rejected=", stats.quota_rejected);
+        }
         append(StrCat("db", i), val);
       }
     }
@@ -964,6 +2641,31 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("used_cpu_user_children", StrCat(cu.ru_utime.tv_sec, ".", cu.ru_utime.tv_usec));
     append("used_cpu_sys_main_thread", StrCat(tu.ru_stime.tv_sec, ".", tu.ru_stime.tv_usec));
     append("used_cpu_user_main_thread", StrCat(tu.ru_utime.tv_sec, ".", tu.ru_utime.tv_usec));
+
+    for (size_t i = 0; i < m.thread_cpu.size(); ++i) {
+      const auto& cpu = m.thread_cpu[i];
+      append(StrCat("thread", i, "_cpu"),
+             StrCat("user_usec=", cpu.user_usec, ",sys_usec=", cpu.sys_usec,
+                    ",busy=", absl::StrFormat("%.2f", cpu.busy), ",ctx_switches=",
+                    cpu.voluntary_switches, ",ctx_switches_involuntary=",
+                    cpu.involuntary_switches));
+    }
+
+    // The tasks that the shards run for the other threads, e.g. the transaction hops.
+    for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+      const auto& tx = m.shard_tx[i];
+      append(StrCat("shard", i, "_queue"),
+             StrCat("len=", tx.queue_len, ",tasks=", tx.queue_tasks,
+                    ",wait_usec=", tx.queue_wait_usec, ",exec_usec=", tx.queue_exec_usec));
+    }
+
+    for (size_t i = 0; i < m.shard_tx.size(); ++i) {
+      const auto& tx = m.shard_tx[i];
+      append(StrCat("shard", i, "_heartbeat"),
+             StrCat("interval_ms=", tx.heartbeat_interval_ms, ",ticks=", tx.heartbeat_ticks,
+                    ",idle_ticks=", tx.heartbeat_idle_ticks, ",deferred=", tx.heartbeat_deferred,
+                    ",usec=", tx.heartbeat_usec));
+    }
   }
 
   (*cntx)->SendBulkString(info);
@@ -1095,14 +2797,216 @@ void ServerFamily::Latency(CmdArgList args, ConnectionContext* cntx) {
   ToUpper(&args[1]);
   string_view sub_cmd = ArgS(args, 1);
 
+  // The spikes of the background activities, see LatencyMonitor. Unlike redis the latencies
+  // are in microseconds.
+  auto collect_events = [this] {
+    LatencyMonitor::EventMap events;
+    fibers::mutex mu;
+    service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+      const auto& local = ServerState::tlocal()->latency_monitor.events();
+      lock_guard<fibers::mutex> lk(mu);
+      LatencyMonitor::Merge(local, &events);
+    });
+    return events;
+  };
+
+  // LATENCY LATEST replies with (event, the time of the last spike, its latency, the max latency)
+  // per event.
   if (sub_cmd == "LATEST") {
-    return (*cntx)->StartArray(0);
+    if (args.size() != 2)
+      return (*cntx)->SendError(kSyntaxErr);
+
+    LatencyMonitor::EventMap events = collect_events();
+    vector<string_view> names;
+    for (const auto& k_v : events) {
+      if (!k_v.second.history.empty())
+        names.push_back(k_v.first);
+    }
+    sort(names.begin(), names.end());
+
+    (*cntx)->StartArray(names.size());
+    for (string_view name : names) {
+      const LatencyMonitor::Event& ev = events.find(name)->second;
+      (*cntx)->StartArray(4);
+      (*cntx)->SendBulkString(name);
+      (*cntx)->SendLong(ev.history.back().unix_ts);
+      (*cntx)->SendLong(ev.history.back().latency_usec);
+      (*cntx)->SendLong(ev.max_usec);
+    }
+    return;
+  }
+
+  // LATENCY HISTORY <event> replies with the (time, latency) pairs of its samples, oldest first.
+  if (sub_cmd == "HISTORY") {
+    if (args.size() != 3)
+      return (*cntx)->SendError(kSyntaxErr);
+
+    LatencyMonitor::EventMap events = collect_events();
+    auto it = events.find(ArgS(args, 2));
+    if (it == events.end())
+      return (*cntx)->StartArray(0);
+
+    (*cntx)->StartArray(it->second.history.size());
+    for (const LatencyMonitor::Sample& sample : it->second.history) {
+      (*cntx)->StartArray(2);
+      (*cntx)->SendLong(sample.unix_ts);
+      (*cntx)->SendLong(sample.latency_usec);
+    }
+    return;
+  }
+
+  // LATENCY RESET [event ...] replies with the number of the events that were reset.
+  if (sub_cmd == "RESET") {
+    vector<string> names;
+    for (size_t i = 2; i < args.size(); ++i) {
+      names.emplace_back(ArgS(args, i));
+    }
+
+    // The same event may be present in several threads.
+    LatencyMonitor::EventMap events = collect_events();
+    size_t res = 0;
+    if (names.empty()) {
+      res = events.size();
+    } else {
+      for (const string& name : names)
+        res += events.contains(name);
+    }
+
+    service_.proactor_pool().AwaitFiberOnAll(
+        [&](ProactorBase* pb) { ServerState::tlocal()->latency_monitor.Reset(names); });
+    return (*cntx)->SendLong(res);
+  }
+
+  // LATENCY HISTOGRAM [command ...]
+  // Replies with calls, p50, p99, p999 and the non-empty buckets of the log-linear histogram
+  // as pairs of (the bucket upper bound in usec, the cumulative count) per command.
+  if (sub_cmd == "HISTOGRAM") {
+    CmdLatencyMap cmd_latency = GetMetrics().cmd_latency;
+    vector<string> cmds;
+    if (args.size() > 2) {
+      for (size_t i = 2; i < args.size(); ++i) {
+        ToUpper(&args[i]);
+        string cmd{ArgS(args, i)};
+        if (cmd_latency.contains(cmd))
+          cmds.push_back(std::move(cmd));
+      }
+    } else {
+      for (const auto& k_v : cmd_latency) {
+        cmds.push_back(k_v.first);
+      }
+      sort(cmds.begin(), cmds.end());
+    }
+
+    (*cntx)->StartArray(cmds.size() * 2);
+    for (const string& cmd : cmds) {
+      const HdrHistogram& hist = cmd_latency[cmd].total;
+      (*cntx)->SendBulkString(absl::AsciiStrToLower(cmd));
+      (*cntx)->StartArray(10);
+      (*cntx)->SendBulkString("calls");
+      (*cntx)->SendLong(hist.count());
+      (*cntx)->SendBulkString("p50");
+      (*cntx)->SendLong(hist.Percentile(50));
+      (*cntx)->SendBulkString("p99");
+      (*cntx)->SendLong(hist.Percentile(99));
+      (*cntx)->SendBulkString("p999");
+      (*cntx)->SendLong(hist.Percentile(99.9));
+      (*cntx)->SendBulkString("histogram_usec");
+
+      vector<pair<uint64_t, uint64_t>> buckets;
+      uint64_t cumulative = 0;
+      for (unsigned i = 0; i < HdrHistogram::kNumBuckets; ++i) {
+        if (hist.bucket(i) == 0)
+          continue;
+        cumulative += hist.bucket(i);
+        buckets.emplace_back(HdrHistogram::BucketMax(i), cumulative);
+      }
+
+      (*cntx)->StartArray(buckets.size() * 2);
+      for (const auto& [bound, count] : buckets) {
+        (*cntx)->SendLong(bound);
+        (*cntx)->SendLong(count);
+      }
+    }
+    return;
   }
 
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
   (*cntx)->SendError(kSyntaxErr);
 }
 
+void ServerFamily::Slowlog(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "RESET") {
+    if (args.size() != 2)
+      return (*cntx)->SendError(kSyntaxErr);
+
+    service_.proactor_pool().AwaitFiberOnAll(
+        [](ProactorBase* pb) { ServerState::tlocal()->slowlog.Reset(); });
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd == "LEN") {
+    if (args.size() != 2)
+      return (*cntx)->SendError(kSyntaxErr);
+
+    atomic_uint64_t len{0};
+    service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+      len.fetch_add(ServerState::tlocal()->slowlog.entries().size(), memory_order_relaxed);
+    });
+    return (*cntx)->SendLong(len.load());
+  }
+
+  // SLOWLOG GET [count], a negative count returns all the entries.
+  if (sub_cmd == "GET") {
+    if (args.size() > 3)
+      return (*cntx)->SendError(kSyntaxErr);
+
+    int64_t count = 10;
+    if (args.size() == 3 && !absl::SimpleAtoi(ArgS(args, 2), &count))
+      return (*cntx)->SendError(kInvalidIntErr);
+
+    vector<SlowLogEntry> entries;
+    fibers::mutex mu;
+    service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+      const auto& local = ServerState::tlocal()->slowlog.entries();
+      lock_guard<fibers::mutex> lk(mu);
+      entries.insert(entries.end(), local.begin(), local.end());
+    });
+
+    // Ids grow across the threads, so the newest entries come first like in redis.
+    sort(entries.begin(), entries.end(),
+         [](const SlowLogEntry& l, const SlowLogEntry& r) { return l.id > r.id; });
+    if (count >= 0 && size_t(count) < entries.size())
+      entries.resize(count);
+
+    (*cntx)->StartArray(entries.size());
+    for (const SlowLogEntry& entry : entries) {
+      (*cntx)->StartArray(7);
+      (*cntx)->SendLong(entry.id);
+      (*cntx)->SendLong(entry.unix_ts);
+      (*cntx)->SendLong(entry.duration_usec);
+      (*cntx)->StartArray(entry.args.size());
+      for (const string& arg : entry.args) {
+        (*cntx)->SendBulkString(arg);
+      }
+      (*cntx)->SendBulkString(entry.client_addr);
+      (*cntx)->SendBulkString(entry.client_name);
+
+      // Dragonfly extension: the time spent in each stage of the command.
+      (*cntx)->StartArray(unsigned(TxStage::NUM_STAGES) * 2);
+      for (unsigned i = 0; i < unsigned(TxStage::NUM_STAGES); ++i) {
+        (*cntx)->SendBulkString(TxStageName(TxStage(i)));
+        (*cntx)->SendLong(entry.stage_usec[i]);
+      }
+    }
+    return;
+  }
+
+  (*cntx)->SendError(UnknownSubCmd(sub_cmd, "SLOWLOG"), kSyntaxErrType);
+}
+
 void ServerFamily::_Shutdown(CmdArgList args, ConnectionContext* cntx) {
   CHECK_NOTNULL(acceptor_)->Stop();
   (*cntx)->SendOk();
@@ -1117,9 +3021,304 @@ void ServerFamily::SyncGeneric(std::string_view repl_master_id, uint64_t offs,
     return;
   }
 
+  if (cntx->replica_stream) {
+    (*cntx)->SendError("The replica is already synced");
+    return;
+  }
+
   cntx->replica_conn = true;
   ServerState::tl_connection_stats()->num_replicas += 1;
-  // TBD.
+
+  // The snapshot is sent without its size, it ends with the token like in the diskless sync of
+  // redis. The rdb is followed by the journal batches, which carry their own offsets. Hence
+  // the full sync always starts at offset 0.
+  string token = RandomReplId();
+  string header;
+  if (!repl_master_id.empty())
+    header = StrCat("+FULLRESYNC ", master_id_, " 0\r\n");
+  absl::StrAppend(&header, "$EOF:", token, "\r\n");
+  (*cntx)->SendRaw(header);
+
+  auto stream = make_unique<ReplicaStream>();
+  ReplyBuilderSink sink{cntx->reply_builder()};
+  RdbSaver saver{&sink};
+
+  error_code ec = saver.SaveHeader(script_mgr_->GetLuaScripts());
+  if (!ec) {
+    // The batches of the shard start with the first write that the snapshot does not have.
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      saver.StartSnapshotInShard(shard);
+      stream->Attach(shard);
+      return OpStatus::OK;
+    };
+    cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+    ec = saver.SaveBody(nullptr);
+  }
+
+  if (!ec) {
+    (*cntx)->SendRaw(token);
+    ec = cntx->reply_builder()->GetError();
+  }
+
+  if (ec) {
+    LOG(WARNING) << "Full sync of " << cntx->owner()->RemoteEndpointStr()
+                 << " failed: " << ec.message();
+    stream->Stop();
+    cntx->reply_builder()->CloseConnection();
+    return;
+  }
+
+  // The replica sends REPLCONF ACK once it has loaded the snapshot, then the batches follow.
+  cntx->replica_stream = std::move(stream);
+}
+
+void ServerFamily::ReplConf(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() % 2 == 0)
+    return (*cntx)->SendError(kSyntaxErr);
+
+  bool dragonfly = false, zstd = false;
+  for (unsigned i = 1; i < args.size(); i += 2) {
+    ToUpper(&args[i]);
+
+    // The replicas do not expect a reply to ACK.
+    if (ArgS(args, i) == "ACK") {
+      if (cntx->replica_stream && !cntx->replica_stream->started())
+        cntx->replica_stream->Start(cntx);
+
+      uint64_t offset;
+      if (cntx->sync_session && absl::SimpleAtoi(ArgS(args, i + 1), &offset)) {
+        cntx->sync_session->acked_offset.store(offset, memory_order_relaxed);
+        cntx->sync_session->ack_time.store(ProactorBase::GetMonotonicTimeNs() / 1000000000,
+                                           memory_order_relaxed);
+      }
+      return;
+    }
+
+    if (ArgS(args, i) == "CAPA") {
+      string_view capa = ArgS(args, i + 1);
+      if (absl::EqualsIgnoreCase(capa, "dragonfly")) {
+        dragonfly = true;
+      } else if (absl::EqualsIgnoreCase(capa, "zstd")) {
+        zstd = true;
+      }
+    }
+
+    // The other capabilities and the address of the replica are not used.
+  }
+
+  if (!dragonfly)
+    return (*cntx)->SendOk();
+
+  // A Dragonfly replica syncs with a connection per shard, the reply has what the connections
+  // need to join the session.
+  if (cntx->sync_session)
+    cntx->sync_session->Cancel();
+
+  {
+    lock_guard lk(sync_mu_);
+    for (auto it = sync_sessions_.begin(); it != sync_sessions_.end();) {
+      if (it->second.expired()) {
+        sync_sessions_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    cntx->sync_session = make_shared<SyncSession>(next_sync_id_++, shard_set->size(),
+                                                  cntx->owner()->RemoteEndpointStr());
+    if (zstd)
+      cntx->sync_session->compression_level = GetFlag(FLAGS_repl_compression_level);
+    sync_sessions_[cntx->sync_session->id] = cntx->sync_session;
+  }
+
+  (*cntx)->StartArray(3);
+  (*cntx)->SendBulkString(master_id_);
+  (*cntx)->SendBulkString(absl::StrCat(cntx->sync_session->id));
+  (*cntx)->SendBulkString(absl::StrCat(shard_set->size()));
+}
+
+// DFLY FLOW <master id> <sync id> <flow id>: a connection of a Dragonfly replica that gets the
+// snapshot and then the journal of the shard flow id. The reply is the token that ends the
+// snapshot, the snapshot follows once the main connection of the replica sends DFLY SYNC.
+void ServerFamily::DflyFlow(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() != 5)
+    return (*cntx)->SendError(WrongNumArgsError("DFLY FLOW"));
+
+  uint32_t sync_id, flow_id;
+  if (!absl::SimpleAtoi(ArgS(args, 3), &sync_id) || !absl::SimpleAtoi(ArgS(args, 4), &flow_id))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  if (ArgS(args, 2) != master_id_)
+    return (*cntx)->SendError("The master id does not match");
+
+  if (cntx->async_dispatch || cntx->replica_stream)
+    return (*cntx)->SendError("The flow can not be synced in this connection");
+
+  shared_ptr<SyncSession> session;
+  {
+    lock_guard lk(sync_mu_);
+    auto it = sync_sessions_.find(sync_id);
+    if (it != sync_sessions_.end())
+      session = it->second.lock();
+  }
+  if (!session || flow_id >= session->flows.size())
+    return (*cntx)->SendError("Unknown sync session or flow");
+
+  auto stream = make_unique<ReplicaStream>(flow_id, session->compression_level);
+  ReplyBuilderSink sink{cntx->reply_builder()};
+  RdbSaver saver{&sink, true};
+  saver.EnableCompression(session->compression_level);
+  string token = RandomReplId();
+  error_code ec;
+
+  unique_lock lk(session->mu);
+  SyncSession::Flow& flow = session->flows[flow_id];
+  if (session->state != SyncSession::WAIT_FLOWS || flow.saver) {
+    lk.unlock();
+    return (*cntx)->SendError("The flow can not join the sync");
+  }
+  flow.saver = &saver;
+  flow.stream = stream.get();
+  (*cntx)->SendSimpleString(token);
+
+  session->cv.wait(lk, [&] { return session->state != SyncSession::WAIT_FLOWS; });
+  bool cancelled = session->state == SyncSession::CANCELLED;
+  bool partial = session->state == SyncSession::PARTIAL_SYNC;
+  lk.unlock();
+
+  if (!cancelled && !partial) {
+    ec = saver.SaveBody(nullptr);
+    if (!ec) {
+      (*cntx)->SendRaw(token);
+      ec = cntx->reply_builder()->GetError();
+    }
+  }
+
+  if (cancelled || ec) {
+    LOG(WARNING) << "Full sync of flow " << flow_id << " of " << cntx->owner()->RemoteEndpointStr()
+                 << " failed: " << (cancelled ? "cancelled" : ec.message());
+    stream->Stop();
+    cntx->reply_builder()->CloseConnection();
+    return;
+  }
+
+  // The replica reads the journal of the shard right after the token, or right away if it
+  // continues from its offset.
+  cntx->replica_stream = std::move(stream);
+  cntx->replica_stream->Start(cntx);
+}
+
+// DFLY SYNC <sync id> [<offset of flow 0> ...]: continues the flows of the session from their
+// offsets if the backlogs of all the shards have them, otherwise starts the snapshots of all the
+// flows in the same hop, so that the replica gets a consistent snapshot of all the shards.
+void ServerFamily::DflySync(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t sync_id;
+  if (args.size() < 3 || !absl::SimpleAtoi(ArgS(args, 2), &sync_id))
+    return (*cntx)->SendError(kSyntaxErr);
+
+  shared_ptr<SyncSession> session = cntx->sync_session;
+  if (!session || session->id != sync_id)
+    return (*cntx)->SendError("Unknown sync session");
+
+  vector<uint64_t> offsets;
+  if (args.size() > 3) {
+    if (args.size() != 3 + session->flows.size())
+      return (*cntx)->SendError(WrongNumArgsError("DFLY SYNC"));
+
+    offsets.resize(session->flows.size());
+    for (unsigned i = 0; i < offsets.size(); ++i) {
+      if (!absl::SimpleAtoi(ArgS(args, 3 + i), &offsets[i]))
+        return (*cntx)->SendError(kInvalidIntErr);
+    }
+  }
+
+  unique_lock lk(session->mu);
+  if (session->state != SyncSession::WAIT_FLOWS)
+    return (*cntx)->SendError("The sync has already started");
+
+  for (unsigned i = 0; i < session->flows.size(); ++i) {
+    if (!session->flows[i].saver)
+      return (*cntx)->SendError(StrCat("The flow ", i, " did not join the sync"));
+  }
+
+  // The shards are locked between the hops, so the backlogs do not change.
+  Transaction* trans = cntx->transaction;
+  trans->Schedule();
+
+  atomic_bool partial{!offsets.empty()};
+  if (partial) {
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      if (!shard->journal()->BacklogHas(offsets[shard->shard_id()]))
+        partial.store(false, memory_order_relaxed);
+      return OpStatus::OK;
+    };
+    trans->Execute(std::move(cb), false);
+  }
+
+  // The header is written in the shard thread, so that it has the shard of the flow. The
+  // scripts go with the first flow. The journal of the shard starts with the first write that
+  // its snapshot does not have.
+  StringVec lua_scripts = script_mgr_->GetLuaScripts();
+  bool is_partial = partial.load(memory_order_relaxed);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    SyncSession::Flow& flow = session->flows[sid];
+    shard->journal()->EnableBacklog();
+
+    if (is_partial) {
+      flow.stream->AttachAt(shard, offsets[sid]);
+      return OpStatus::OK;
+    }
+
+    error_code ec = flow.saver->SaveHeader(sid == 0 ? lua_scripts : StringVec{});
+    LOG_IF(ERROR, ec) << "Could not save the header of flow " << sid << " " << ec;
+    flow.saver->StartSnapshotInShard(shard);
+    flow.stream->Attach(shard);
+    return OpStatus::OK;
+  };
+  trans->Execute(std::move(cb), true);
+
+  // The savers and the streams belong to the flows from now on.
+  session->state = is_partial ? SyncSession::PARTIAL_SYNC : SyncSession::FULL_SYNC;
+  for (SyncSession::Flow& flow : session->flows)
+    flow = SyncSession::Flow{};
+  session->cv.notify_all();
+  lk.unlock();
+
+  if (!cntx->replica_conn) {
+    cntx->replica_conn = true;
+    ServerState::tl_connection_stats()->num_replicas += 1;
+  }
+
+  VLOG(1) << (is_partial ? "Continuing" : "Full sync of") << " replica " << session->address;
+  (*cntx)->SendSimpleString(is_partial ? "CONTINUE" : "FULLRESYNC");
+}
+
+void ServerFamily::Dfly(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  // Applies the journal batches that a master streams to its replicas, see ReplicaStream.
+  if (sub_cmd == "APPLY" && args.size() == 3) {
+    string_view batches = ArgS(args, 2);
+    io::BytesSource source{io::Buffer(batches)};
+    RdbLoader loader(nullptr);
+
+    error_code ec = loader.Load(&source);
+    if (ec) {
+      LOG(ERROR) << "Could not apply the journal batches: " << ec.message();
+      return (*cntx)->SendError(ec.message());
+    }
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd == "FLOW")
+    return DflyFlow(args, cntx);
+
+  if (sub_cmd == "SYNC")
+    return DflySync(args, cntx);
+
+  (*cntx)->SendError(UnknownSubCmd(sub_cmd, "DFLY"), kSyntaxErrType);
 }
 
 #define HFUNC(x) SetHandler(HandlerFunc(this, &ServerFamily::x))
@@ -1134,18 +3333,21 @@ void ServerFamily::Register(CommandRegistry* registry) {
             << CI{"CONFIG", CO::ADMIN, -2, 0, 0, 0}.HFUNC(Config)
             << CI{"DBSIZE", CO::READONLY | CO::FAST | CO::LOADING, 1, 0, 0, 0}.HFUNC(DbSize)
             << CI{"DEBUG", CO::ADMIN | CO::LOADING, -2, 0, 0, 0}.HFUNC(Debug)
-            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(FlushDb)
+            << CI{"DFLY", CO::ADMIN | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(Dfly)
+            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushDb)
             << CI{"FLUSHALL", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushAll)
             << CI{"INFO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Info)
             << CI{"HELLO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Hello)
             << CI{"LASTSAVE", CO::LOADING | CO::FAST, 1, 0, 0, 0}.HFUNC(LastSave)
             << CI{"LATENCY", CO::NOSCRIPT | CO::LOADING | CO::FAST, -2, 0, 0, 0}.HFUNC(Latency)
             << CI{"MEMORY", kMemOpts, -2, 0, 0, 0}.HFUNC(Memory)
-            << CI{"SAVE", CO::ADMIN | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(Save)
+            << CI{"SAVE", CO::ADMIN | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(Save)
+            << CI{"SLOWLOG", CO::ADMIN | CO::LOADING | CO::FAST, -2, 0, 0, 0}.HFUNC(Slowlog)
             << CI{"SHUTDOWN", CO::ADMIN | CO::NOSCRIPT | CO::LOADING, 1, 0, 0, 0}.HFUNC(_Shutdown)
             << CI{"SLAVEOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
             << CI{"REPLICAOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
             << CI{"ROLE", CO::LOADING | CO::FAST | CO::NOSCRIPT, 1, 0, 0, 0}.HFUNC(Role)
+            << CI{"REPLCONF", CO::ADMIN | CO::LOADING, -1, 0, 0, 0}.HFUNC(ReplConf)
             << CI{"SYNC", CO::ADMIN | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(Sync)
             << CI{"PSYNC", CO::ADMIN | CO::GLOBAL_TRANS, 3, 0, 0, 0}.HFUNC(Psync)
             << CI{"SCRIPT", CO::NOSCRIPT, -2, 0, 0, 0}.HFUNC(Script);
@@ -4,9 +4,13 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
 #include "facade/conn_context.h"
 #include "facade/redis_parser.h"
 #include "server/engine_shard_set.h"
+#include "server/server_state.h"
+#include "server/tx_stats.h"
 #include "util/proactor_pool.h"
 
 namespace util {
@@ -22,6 +26,7 @@ class CommandRegistry;
 class Service;
 class Replica;
 class ScriptMgr;
+struct SyncSession;
 
 struct Metrics {
   std::vector<DbStats> db;
@@ -34,16 +39,91 @@ struct Metrics {
   size_t heap_used_bytes = 0;
   size_t heap_comitted_bytes = 0;
   size_t small_string_bytes = 0;
+  size_t compressed_strings = 0;
+  size_t compression_dict_bytes = 0;
+  size_t dedup_strings = 0;
+  size_t dedup_bytes = 0;
+  size_t dedup_saved_bytes = 0;
   uint32_t traverse_ttl_per_sec = 0;
   uint32_t delete_ttl_per_sec = 0;
+  size_t flush_pending_keys = 0;
+  size_t lazyfree_pending_objects = 0;
+  size_t lua_memory_bytes = 0;  // of the interpreters of all the threads.
 
   facade::ConnectionStats conn_stats;
+
+  // State of the transaction queue of each shard, indexed by shard id.
+  struct ShardTxStats {
+    size_t txq_len = 0;
+    size_t txq_fast_len = 0;
+    uint64_t quick_runs = 0;
+    uint64_t txq_runs = 0;
+    uint64_t ooo_runs = 0;
+    uint64_t optimistic_runs = 0;
+    uint64_t continuation_runs = 0;
+    uint64_t awaked_runs = 0;
+    uint64_t fast_lane_runs = 0;
+
+    // See EngineShard::Stats.
+    uint64_t schedule_attempts = 0;
+    uint64_t schedule_rejects = 0;
+    uint64_t lock_conflicts = 0;
+
+    size_t blocked_txs = 0;
+    uint64_t awakened_txs = 0;
+
+    // The tasks of the shard queue, see EngineShard::QueueStats.
+    size_t queue_len = 0;
+    uint64_t queue_tasks = 0;
+    uint64_t queue_wait_usec = 0;
+    uint64_t queue_exec_usec = 0;
+
+    // The background ticks of the shard, see EngineShard::Heartbeat.
+    uint32_t heartbeat_interval_ms = 0;
+    uint64_t heartbeat_ticks = 0;
+    uint64_t heartbeat_idle_ticks = 0;
+    uint64_t heartbeat_deferred = 0;
+    uint64_t heartbeat_usec = 0;
+  };
+  std::vector<ShardTxStats> shard_tx;
+
+  // The cpu usage of a thread of the pool.
+  struct ThreadCpuStats {
+    uint64_t user_usec = 0;
+    uint64_t sys_usec = 0;
+    uint64_t voluntary_switches = 0;    // mostly the waits for io when the thread is idle.
+    uint64_t involuntary_switches = 0;  // the preemptions, e.g. by other processes.
+    double busy = 0;  // the share of time on cpu during the last metrics snapshot period.
+  };
+  std::vector<ThreadCpuStats> thread_cpu;  // indexed by the proactor index.
+
+  KeyAnalyzer::Report key_report;  // merged last passes of the shards, see KeyAnalyzer.
+
+  // Indexed by shard id, null before the first pass of the shard.
+  std::vector<std::shared_ptr<const EngineShard::MallocStats>> malloc_stats;
+
+  CmdLatencyMap cmd_latency;
+  ScriptStatsMap script_stats;
 };
 
+// Returns the latency breakdown of the commands and the tx queue stats of the shards
+// as name/value pairs. Used by INFO LATENCYSTATS and DEBUG TXSTATS.
+std::vector<std::pair<std::string, std::string>> GetTxStats(const Metrics& m);
+
 struct LastSaveInfo {
   time_t save_time;        // epoch time in seconds.
   std::string file_name;  //
   std::vector<std::pair<std::string_view, size_t>> freq_map; // RDB_TYPE_xxx -> count mapping.
+
+  // Of a snapshot that a replica of a Dragonfly master saved, see Replica::Position.
+  std::string repl_master_id;
+  uint64_t repl_offset = 0;
+};
+
+enum class SaveMode : uint8_t {
+  FULL,     // starts a new chain of delta snapshots.
+  DELTA,    // saves the changes since the previous snapshot of the chain.
+  COMPACT,  // FULL that also removes the files of the previous chain.
 };
 
 class ServerFamily {
@@ -51,7 +131,7 @@ class ServerFamily {
   ServerFamily(Service* service);
   ~ServerFamily();
 
-  void Init(util::AcceptServer* acceptor, util::ListenerInterface* main_listener);
+  void Init(util::AcceptServer* acceptor, std::vector<util::ListenerInterface*> listeners);
   void Register(CommandRegistry* registry);
   void Shutdown();
 
@@ -59,20 +139,29 @@ class ServerFamily {
     return service_;
   }
 
+  // Collects the metrics from all the threads and shards.
   Metrics GetMetrics() const;
 
+  // Merges the snapshots published periodically by the threads and the heartbeats of the
+  // shards, without dispatching into them. Falls back to GetMetrics() until all of them are
+  // published. Used by INFO and /metrics.
+  Metrics GetCachedMetrics() const;
+
   ScriptMgr* script_mgr() {
     return script_mgr_.get();
   }
 
   void StatsMC(std::string_view section, facade::ConnectionContext* cntx);
 
-  std::error_code DoSave(Transaction* transaction, std::string* err_details);
-  std::error_code DoFlush(Transaction* transaction, DbIndex db_ind);
+  std::error_code DoSave(Transaction* transaction, std::string* err_details,
+                         SaveMode mode = SaveMode::FULL);
+  std::error_code DoFlush(Transaction* transaction, DbIndex db_ind, bool async = true);
 
   std::shared_ptr<const LastSaveInfo> GetLastSaveInfo() const;
 
-  std::error_code LoadRdb(const std::string& rdb_file);
+  // with_journal replays the journals that follow the snapshot, see FLAGS_journal. An empty
+  // rdb_file replays all of them.
+  std::error_code LoadRdb(const std::string& rdb_file, bool with_journal = false);
 
   // used within tests.
   bool IsSaving() const {
@@ -92,6 +181,9 @@ class ServerFamily {
   void DbSize(CmdArgList args, ConnectionContext* cntx);
   void Debug(CmdArgList args, ConnectionContext* cntx);
   void Memory(CmdArgList args, ConnectionContext* cntx);
+  void MemoryStats(ConnectionContext* cntx);
+  void MemoryMallocStats(ConnectionContext* cntx);
+  void Dfly(CmdArgList args, ConnectionContext* cntx);
   void FlushDb(CmdArgList args, ConnectionContext* cntx);
   void FlushAll(CmdArgList args, ConnectionContext* cntx);
   void Info(CmdArgList args, ConnectionContext* cntx);
@@ -99,26 +191,69 @@ class ServerFamily {
   void LastSave(CmdArgList args, ConnectionContext* cntx);
   void Latency(CmdArgList args, ConnectionContext* cntx);
   void Psync(CmdArgList args, ConnectionContext* cntx);
+  void ReplConf(CmdArgList args, ConnectionContext* cntx);
   void ReplicaOf(CmdArgList args, ConnectionContext* cntx);
   void Role(CmdArgList args, ConnectionContext* cntx);
   void Save(CmdArgList args, ConnectionContext* cntx);
   void Script(CmdArgList args, ConnectionContext* cntx);
+  void Slowlog(CmdArgList args, ConnectionContext* cntx);
   void Sync(CmdArgList args, ConnectionContext* cntx);
 
   void _Shutdown(CmdArgList args, ConnectionContext* cntx);
 
   void SyncGeneric(std::string_view repl_master_id, uint64_t offs, ConnectionContext* cntx);
 
+  // The full sync of the Dragonfly replicas, see SyncSession.
+  void DflyFlow(CmdArgList args, ConnectionContext* cntx);
+  void DflySync(CmdArgList args, ConnectionContext* cntx);
+
   void Load(const std::string& file_name);
 
+  // Extends snapshot_chain_ if the snapshot deltas are enabled.
+  // journal_gen is the generation of the journals that the save starts, 0 without the journal.
+  // A positive tiered_token saves the external values as references, see
+  // TieredStorage::BeginSnapshot. A non-empty repl_id tags the file with the position of the
+  // replica in the streams of its master.
+  std::error_code SaveSingleFile(const std::string& path, const StringVec& lua_scripts,
+                                 Transaction* trans, RdbTypeFreqMap* freq_map, SaveMode mode,
+                                 uint32_t journal_gen, uint64_t tiered_token,
+                                 std::string_view repl_id,
+                                 const std::vector<uint64_t>& repl_offsets);
+
+  // Writes a file per shard concurrently, see FLAGS_df_snapshot_format.
+  std::error_code SaveShardFiles(const std::string& base_path, Transaction* trans,
+                                 RdbTypeFreqMap* freq_map, uint32_t journal_gen,
+                                 uint64_t tiered_token);
+
+  // Saves the shard files in the mapped format, see FLAGS_snapshot_mapped.
+  std::error_code SaveMappedFiles(const std::string& base_path, Transaction* trans,
+                                  RdbTypeFreqMap* freq_map, uint32_t journal_gen);
+
+  // Opens the journal files of the generation in all the shards, they are used after
+  // Journal::Rotate.
+  std::error_code OpenJournals(uint32_t gen);
+
+  // Loads the journals from from_gen up to the current generation.
+  std::error_code ReplayJournals(uint32_t from_gen);
+
+  struct ThreadMetrics;
+
+  // Runs periodically in every thread, see FLAGS_metrics_snapshot_ms.
+  void PublishThreadMetrics(unsigned index);
+
 
   boost::fibers::fiber load_fiber_;
 
   uint32_t stats_caching_task_ = 0;
+
+  // Indexed by the proactor index, accessed via std::atomic_load/atomic_store.
+  std::vector<std::shared_ptr<const ThreadMetrics>> thread_metrics_;
+  std::vector<uint32_t> thread_metrics_tasks_;
+  std::vector<uint32_t> counter_flush_tasks_;  // see CounterCombiner.
   Service& service_;
 
   util::AcceptServer* acceptor_ = nullptr;
-  util::ListenerInterface* main_listener_ = nullptr;
+  std::vector<util::ListenerInterface*> listeners_;  // of the redis port.
   util::ProactorBase* pb_task_ = nullptr;
 
   mutable ::boost::fibers::mutex replicaof_mu_, save_mu_;
@@ -128,7 +263,29 @@ class ServerFamily {
 
   time_t start_time_ = 0;  // in seconds, epoch time.
 
+  std::string master_id_;  // the replication id of the server, sent to its replicas.
+
+  // The syncs of the Dragonfly replicas, owned by their main connections.
+  ::boost::fibers::mutex sync_mu_;
+  absl::flat_hash_map<uint32_t, std::weak_ptr<SyncSession>> sync_sessions_;  // guarded by sync_mu_
+  uint32_t next_sync_id_ = 1;                                                // guarded by sync_mu_
+
   std::shared_ptr<LastSaveInfo> lsinfo_;  // protected by save_mu_;
+
+  // The rdb snapshot that SAVE DELTA extends, see FLAGS_snapshot_deltas. Accessed only by
+  // the saving fiber.
+  struct SnapshotChain {
+    std::string base_path;
+    uint64_t id = 0;  // 0 if there is no chain.
+    std::vector<uint64_t> versions;  // of the last snapshot of the chain, by shard id.
+    unsigned num_deltas = 0;
+  };
+  SnapshotChain snapshot_chain_;
+
+  // The current generation of the journal files in journal_dir_, see FLAGS_journal.
+  std::string journal_dir_;
+  uint32_t journal_gen_ = 0;
+
   std::atomic_bool is_saving_{false};
 };
 
@@ -4,17 +4,41 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
 #include <optional>
 #include <vector>
 
 #include "core/interpreter.h"
 #include "server/common.h"
+#include "server/latency_monitor.h"
+#include "server/slowlog.h"
+#include "server/tx_stats.h"
 #include "util/sliding_counter.h"
 
 typedef struct mi_heap_s mi_heap_t;
 
+namespace facade {
+class Connection;
+}
+
 namespace dfly {
 
+// Profile of the calls of a script, see SCRIPT STATS.
+struct ScriptStats {
+  uint64_t calls = 0;
+  uint64_t total_usec = 0;
+  uint64_t max_usec = 0;
+  uint64_t redis_calls = 0;
+  uint64_t shards = 0;  // summed over the calls, of their declared keys.
+  uint64_t allocated_bytes = 0;
+
+  ScriptStats& operator+=(const ScriptStats& o);
+};
+
+// By the sha of the script.
+using ScriptStatsMap = absl::flat_hash_map<std::string, ScriptStats>;
+
 // Present in every server thread. This class differs from EngineShard. The latter manages
 // state around engine shards while the former represents coordinator/connection state.
 // There may be threads that handle engine shards but not IO, there may be threads that handle IO
@@ -43,6 +67,25 @@ class ServerState {  // public struct - to allow initialization.
 
   facade::ConnectionStats connection_stats;
 
+  // Latency breakdown of the commands that were dispatched by this thread.
+  CmdLatencyMap cmd_latency;
+
+  // The scripts that ran in this thread.
+  ScriptStatsMap script_stats;
+
+  // The slowest commands of this thread, see SLOWLOG.
+  SlowLog slowlog;
+
+  // The spikes of the background activities of this thread, see LATENCY LATEST.
+  LatencyMonitor latency_monitor;
+
+  // Connections of this thread that are subscribed to the invalidation channel of the client
+  // tracking by their client id.
+  absl::flat_hash_map<uint32_t, facade::Connection*> tracking_targets;
+
+  // Connections of this thread that are subscribed to the change feed by their client id.
+  absl::flat_hash_map<uint32_t, facade::Connection*> change_feed_targets;
+
   void TxCountInc() {
     ++live_transactions_;
   }
@@ -62,8 +105,22 @@ class ServerState {  // public struct - to allow initialization.
     gstate_ = s;
   }
 
+  // Borrows an interpreter of the pool of this thread to run a script, see InterpreterManager.
+  Interpreter* BorrowInterpreter();
+  void ReturnInterpreter(Interpreter* ir);
+
+  // An interpreter of this thread for the calls that do not run a script, e.g. compiling one.
+  // It may be borrowed.
   Interpreter& GetInterpreter();
 
+  // Interpreter of the scripts that run within the shard thread. It is kept apart from the pool
+  // since a connection fiber may hold one of the latter while waiting for this shard.
+  Interpreter& GetShardInterpreter();
+
+  // Compiles the script into the interpreters of this thread, including its shard interpreter if
+  // it has one. The interpreters that are created later compile it on the first run.
+  void PreloadScript(std::string_view body);
+
   // Returns sum of all requests in the last 6 seconds
   // (not including the current one).
   uint32_t MovingSum6() const { return qps_.SumTail(); }
@@ -82,7 +139,10 @@ class ServerState {  // public struct - to allow initialization.
   int64_t live_transactions_ = 0;
   mi_heap_t* data_heap_;
 
-  std::optional<Interpreter> interpreter_;
+  InterpreterManager& interpreters();
+
+  std::optional<InterpreterManager> interpreters_;
+  std::optional<Interpreter> shard_interpreter_;
   GlobalState gstate_ = GlobalState::ACTIVE;
 
   using Counter = util::SlidingCounter<7>;
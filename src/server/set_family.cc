@@ -6,31 +6,90 @@
 
 extern "C" {
 #include "redis/intset.h"
+#include "redis/listpack.h"
 #include "redis/object.h"
 #include "redis/redis_aux.h"
 #include "redis/util.h"
 }
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/random/random.h>
+
+#include "base/flags.h"
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "core/roaring_set.h"
+#include "core/string_set.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/transaction.h"
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 namespace dfly {
 
 using namespace std;
+using absl::GetFlag;
+using boost::intrusive_ptr;
 
 using ResultStringVec = vector<OpResult<vector<string>>>;
-using ResultSetView = OpResult<absl::flat_hash_set<std::string_view>>;
 using SvArray = vector<std::string_view>;
 
 namespace {
 
 constexpr uint32_t kMaxIntSetEntries = 256;
 
+// Sets of strings are kept in a listpack as long as they are that small. Lookups in
+// a listpack are linear, hence the size limits.
+constexpr uint32_t kMaxListPackEntries = 128;
+constexpr uint32_t kMaxListPackValue = 64;
+
+bool IsGoodForListpack(size_t len, ArgSlice vals) {
+  if (len + vals.size() > kMaxListPackEntries)
+    return false;
+
+  for (auto v : vals) {
+    if (v.size() > kMaxListPackValue)
+      return false;
+  }
+  return true;
+}
+
+// intbuf must be at least LP_INTBUF_SIZE bytes.
+string_view LpGetView(uint8_t* p, uint8_t* intbuf) {
+  int64_t len;
+  uint8_t* ptr = lpGet(p, &len, intbuf);
+  return string_view{reinterpret_cast<char*>(ptr), size_t(len)};
+}
+
+uint8_t* LpFind(uint8_t* lp, string_view member) {
+  uint8_t* p = lpFirst(lp);
+  if (!p)
+    return nullptr;
+  return lpFind(lp, p, reinterpret_cast<uint8_t*>(const_cast<char*>(member.data())),
+                member.size(), 0);
+}
+
+template <typename F> void LpIterate(uint8_t* lp, F&& f) {
+  uint8_t intbuf[LP_INTBUF_SIZE];
+  for (uint8_t* p = lpFirst(lp); p; p = lpNext(lp, p)) {
+    f(LpGetView(p, intbuf));
+  }
+}
+
+uint8_t* IntsetToListpack(const intset* is) {
+  uint8_t* lp = lpNew(0);
+  int64_t intele;
+  int ii = 0;
+
+  while (intsetGet(const_cast<intset*>(is), ii++, &intele)) {
+    lp = lpAppendInteger(lp, intele);
+  }
+  return lp;
+}
+
 intset* IntsetAddSafe(string_view val, intset* is, bool* success, bool* added) {
   long long llval;
   *added = false;
@@ -72,95 +131,213 @@ pair<unsigned, bool> RemoveSet(ArgSlice vals, CompactObj* set) {
     }
     isempty = (intsetLen(is) == 0);
     set->SetRObjPtr(is);
+  } else if (set->Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)set->RObjPtr();
+
+    for (auto member : vals) {
+      uint8_t* p = LpFind(lp, member);
+      if (p) {
+        lp = lpDelete(lp, p, NULL);
+        ++removed;
+      }
+    }
+    isempty = (lpLength(lp) == 0);
+    set->SetRObjPtr(lp);
+  } else if (set->Encoding() == kEncodingRoaring) {
+    RoaringSet* rs = (RoaringSet*)set->RObjPtr();
+    long long llval;
+
+    for (auto val : vals) {
+      if (string2ll(val.data(), val.size(), &llval))
+        removed += rs->Remove(llval);
+    }
+    isempty = rs->Empty();
   } else {
-    dict* d = (dict*)set->RObjPtr();
-    auto* shard = EngineShard::tlocal();
+    StringSet* ss = (StringSet*)set->RObjPtr();
     for (auto member : vals) {
-      shard->tmp_str1 = sdscpylen(shard->tmp_str1, member.data(), member.size());
-      int result = dictDelete(d, shard->tmp_str1);
-      removed += (result == DICT_OK);
+      removed += ss->Remove(member);
     }
-    isempty = (dictSize(d) == 0);
+    isempty = ss->Empty();
   }
   return make_pair(removed, isempty);
 }
 
-void InitSet(ArgSlice vals, CompactObj* set) {
-  bool int_set = true;
+bool AllIntegers(ArgSlice vals) {
   long long intv;
-
   for (auto v : vals) {
-    if (!string2ll(v.data(), v.size(), &intv)) {
-      int_set = false;
-      break;
-    }
+    if (!string2ll(v.data(), v.size(), &intv))
+      return false;
+  }
+  return true;
+}
+
+StringSet* NewStringSet(size_t size_hint) {
+  StringSet* ss = new StringSet;
+  ss->Reserve(size_hint);
+  return ss;
+}
+
+// Converts the overflown intset of set to the roaring bitmap, or to the hash table if its
+// members are too sparse for the containers of the bitmap. Returns the new inner object.
+void* ConvertOverflownIntset(size_t size_hint, CompactObj* set) {
+  const intset* is = (const intset*)set->RObjPtr();
+  RoaringSet* rs = new RoaringSet;
+  SetFamily::ConvertTo(is, rs);
+  if (rs->IsDense()) {
+    set->InitRobj(OBJ_SET, kEncodingRoaring, rs);  // 'is' is deleted.
+    return rs;
   }
 
-  if (int_set) {
+  delete rs;
+  StringSet* ss = NewStringSet(size_hint);
+  SetFamily::ConvertTo(is, ss);
+  set->InitRobj(OBJ_SET, kEncodingStrMap, ss);
+  return ss;
+}
+
+// Sets the encoding that can hold all the vals, so that large batches are not added to the
+// smaller encodings and converted on the way.
+void InitSet(ArgSlice vals, CompactObj* set) {
+  bool all_integers = AllIntegers(vals);
+  if (vals.size() <= kMaxIntSetEntries && all_integers) {
     intset* is = intsetNew();
     set->InitRobj(OBJ_SET, kEncodingIntSet, is);
+  } else if (IsGoodForListpack(0, vals)) {
+    set->InitRobj(OBJ_SET, kEncodingListPack, lpNew(0));
+  } else if (all_integers) {
+    set->InitRobj(OBJ_SET, kEncodingRoaring, new RoaringSet);
   } else {
-    dict* ds = dictCreate(&setDictType);
-    set->InitRobj(OBJ_SET, kEncodingStrMap, ds);
+    set->InitRobj(OBJ_SET, kEncodingStrMap, NewStringSet(vals.size()));
   }
 }
 
-vector<string> ToVec(absl::flat_hash_set<string>&& set) {
-  vector<string> result(set.size());
-  size_t i = 0;
+// Like InitSet for an existing set: converts it up front if it may outgrow its encoding with
+// vals. Some of vals may be in the set already, so its size is bounded from above.
+void ConvertForAdd(ArgSlice vals, CompactObj* set) {
+  if (set->Encoding() == kEncodingIntSet) {
+    intset* is = (intset*)set->RObjPtr();
+    size_t len = intsetLen(is);
+    bool all_integers = AllIntegers(vals);
+    if (len + vals.size() <= kMaxIntSetEntries && all_integers)
+      return;
 
-  // extract invalidates current iterator. therefore, we increment it first before extracting.
-  // hence the weird loop.
-  for (auto it = set.begin(); it != set.end();) {
-    result[i] = std::move(set.extract(it++).value());
-    ++i;
-  }
+    if (IsGoodForListpack(len, vals)) {
+      set->InitRobj(OBJ_SET, kEncodingListPack, IntsetToListpack(is));  // 'is' is deleted.
+    } else if (all_integers) {
+      ConvertOverflownIntset(len + vals.size(), set);
+    } else {
+      StringSet* ss = NewStringSet(len + vals.size());
+      SetFamily::ConvertTo(is, ss);
+      set->InitRobj(OBJ_SET, kEncodingStrMap, ss);
+    }
+  } else if (set->Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)set->RObjPtr();
+    size_t len = lpLength(lp);
+    if (IsGoodForListpack(len, vals))
+      return;
 
-  return result;
+    StringSet* ss = NewStringSet(len + vals.size());
+    SetFamily::ConvertTo(lp, ss);
+    set->InitRobj(OBJ_SET, kEncodingStrMap, ss);  // 'lp' is deleted.
+  } else if (set->Encoding() == kEncodingRoaring) {
+    if (AllIntegers(vals))
+      return;
+
+    RoaringSet* rs = (RoaringSet*)set->RObjPtr();
+    StringSet* ss = NewStringSet(rs->Size() + vals.size());
+    SetFamily::ConvertTo(rs, ss);
+    set->InitRobj(OBJ_SET, kEncodingStrMap, ss);  // 'rs' is deleted.
+  }
 }
 
-ResultSetView UnionResultVec(const ResultStringVec& result_vec) {
-  absl::flat_hash_set<std::string_view> uniques;
+// The members are unique within each shard result, so the results are hashed only if there are
+// several of them. The array points into the shard results.
+OpResult<SvArray> UnionResultVec(const ResultStringVec& result_vec) {
+  const StringVec* single = nullptr;
+  unsigned non_empty = 0;
+  size_t total = 0;
 
   for (const auto& val : result_vec) {
-    if (val || val.status() == OpStatus::SKIPPED) {
-      for (const string& s : val.value()) {
-        uniques.emplace(s);
-      }
-      continue;
+    if (!val && val.status() != OpStatus::SKIPPED && val.status() != OpStatus::KEY_NOTFOUND)
+      return val.status();
+
+    // Failed results are empty.
+    if (!val->empty()) {
+      single = &val.value();
+      ++non_empty;
+      total += val->size();
     }
+  }
 
-    if (val.status() != OpStatus::KEY_NOTFOUND) {
-      return val.status();
+  SvArray result;
+  if (non_empty <= 1) {
+    if (single)
+      result.assign(single->begin(), single->end());
+    return result;
+  }
+
+  absl::flat_hash_set<std::string_view> uniques;
+  uniques.reserve(total);
+  result.reserve(total);
+  for (const auto& val : result_vec) {
+    for (const string& s : val.value()) {
+      if (uniques.emplace(s).second)
+        result.push_back(s);
     }
   }
 
-  return uniques;
+  return result;
 }
 
-ResultSetView DiffResultVec(const ResultStringVec& result_vec, ShardId src_shard) {
+// The result of src_shard is the difference of its own sets, the other shards return the union
+// of theirs.
+OpResult<SvArray> DiffResultVec(const ResultStringVec& result_vec, ShardId src_shard) {
   for (const auto& res : result_vec) {
     if (res.status() == OpStatus::WRONG_TYPE)
       return res.status();
   }
 
-  absl::flat_hash_set<std::string_view> uniques;
+  const StringVec& src = result_vec[src_shard].value();
+  size_t others = 0;
+  for (unsigned i = 0; i < result_vec.size(); ++i) {
+    if (i != src_shard)
+      others += result_vec[i]->size();
+  }
 
-  for (const auto& val : result_vec[src_shard].value()) {
-    uniques.emplace(val);
+  SvArray result;
+  if (others == 0) {
+    result.assign(src.begin(), src.end());
+    return result;
+  }
+
+  // We hash the smaller side: either the source members, which the other results erase, or the
+  // members of the other results, which filter the source.
+  absl::flat_hash_set<std::string_view> table;
+  bool hash_src = src.size() <= others;
+  if (hash_src) {
+    table.insert(src.begin(), src.end());
+  } else {
+    table.reserve(others);
   }
 
   for (unsigned i = 0; i < result_vec.size(); ++i) {
     if (i == src_shard)
       continue;
 
-    if (result_vec[i]) {
-      for (const string& s : result_vec[i].value()) {
-        uniques.erase(s);
+    for (const string& s : result_vec[i].value()) {
+      if (hash_src) {
+        table.erase(s);
+      } else {
+        table.emplace(s);
       }
     }
   }
-  return uniques;
+
+  for (const string& s : src) {
+    if (table.contains(s) == hash_src)
+      result.push_back(s);
+  }
+  return result;
 }
 
 OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned required_shard_cnt) {
@@ -176,26 +353,33 @@ OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned req
       return OpStatus::OK;  // empty set.
   }
 
-  bool first = true;
+  // The table starts with the smallest result, the members of the other results are only
+  // counted. I do not want to add keys that I know will not stay in the set.
+  const vector<string>* smallest = nullptr;
   for (const auto& res : result_vec) {
     if (res.status() == OpStatus::SKIPPED)
       continue;
 
     DCHECK(res);  // we handled it above.
+    if (!smallest || res->size() < smallest->size())
+      smallest = &res.value();
+  }
 
-    // I use this awkward 'first' condition instead of table[s]++ deliberately.
-    // I do not want to add keys that I know will not stay in the set.
-    if (first) {
-      for (const string& s : res.value()) {
-        uniques.emplace(s, 1);
-      }
-      first = false;
-    } else {
-      for (const string& s : res.value()) {
-        auto it = uniques.find(s);
-        if (it != uniques.end()) {
-          ++it->second;
-        }
+  if (!smallest || smallest->empty())
+    return SvArray{};
+
+  for (const string& s : *smallest) {
+    uniques.emplace(s, 1);
+  }
+
+  for (const auto& res : result_vec) {
+    if (res.status() == OpStatus::SKIPPED || &res.value() == smallest)
+      continue;
+
+    for (const string& s : res.value()) {
+      auto it = uniques.find(s);
+      if (it != uniques.end()) {
+        ++it->second;
       }
     }
   }
@@ -212,13 +396,6 @@ OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned req
   return result;
 }
 
-SvArray ToSvArray(const absl::flat_hash_set<std::string_view>& set) {
-  SvArray result;
-  result.reserve(set.size());
-  copy(set.begin(), set.end(), back_inserter(result));
-  return result;
-}
-
 OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
   return OpStatus::OK;
 };
@@ -227,52 +404,50 @@ using SetType = pair<void*, unsigned>;
 
 uint32_t SetTypeLen(const SetType& set) {
   if (set.second == kEncodingStrMap) {
-    return dictSize((const dict*)set.first);
+    return ((const StringSet*)set.first)->Size();
+  }
+  if (set.second == kEncodingListPack) {
+    return lpLength((uint8_t*)set.first);
+  }
+  if (set.second == kEncodingRoaring) {
+    return ((const RoaringSet*)set.first)->Size();
   }
   DCHECK_EQ(set.second, kEncodingIntSet);
   return intsetLen((const intset*)set.first);
 };
 
-bool dictContains(const dict* d, string_view key) {
-  uint64_t h = dictGenHashFunction(key.data(), key.size());
-
-  for (unsigned table = 0; table <= 1; table++) {
-    uint64_t idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
-    dictEntry* he = d->ht_table[table][idx];
-    while (he) {
-      sds dkey = (sds)he->key;
-      if (sdslen(dkey) == key.size() && (key.empty() || memcmp(dkey, key.data(), key.size()) == 0))
-        return true;
-      he = he->next;
-    }
-    if (!dictIsRehashing(d))
-      break;
-  }
-  return false;
-}
-
 bool IsInSet(const SetType& st, int64_t val) {
   if (st.second == kEncodingIntSet)
     return intsetFind((intset*)st.first, val);
 
-  DCHECK_EQ(st.second, kEncodingStrMap);
+  if (st.second == kEncodingRoaring)
+    return ((const RoaringSet*)st.first)->Contains(val);
+
   char buf[32];
   char* next = absl::numbers_internal::FastIntToBuffer(val, buf);
+  string_view member{buf, size_t(next - buf)};
+
+  if (st.second == kEncodingListPack)
+    return LpFind((uint8_t*)st.first, member) != nullptr;
 
-  return dictContains((dict*)st.first, string_view{buf, size_t(next - buf)});
+  DCHECK_EQ(st.second, kEncodingStrMap);
+  return ((const StringSet*)st.first)->Contains(member);
 }
 
 bool IsInSet(const SetType& st, string_view member) {
-  if (st.second == kEncodingIntSet) {
+  if (st.second == kEncodingIntSet || st.second == kEncodingRoaring) {
     long long llval;
     if (!string2ll(member.data(), member.size(), &llval))
       return false;
 
-    return intsetFind((intset*)st.first, llval);
+    return IsInSet(st, int64_t(llval));
   }
-  DCHECK_EQ(st.second, kEncodingStrMap);
 
-  return dictContains((dict*)st.first, member);
+  if (st.second == kEncodingListPack)
+    return LpFind((uint8_t*)st.first, member) != nullptr;
+
+  DCHECK_EQ(st.second, kEncodingStrMap);
+  return ((const StringSet*)st.first)->Contains(member);
 }
 
 template <typename F> void FillSet(const SetType& set, F&& f) {
@@ -286,17 +461,101 @@ template <typename F> void FillSet(const SetType& set, F&& f) {
       char* next = absl::numbers_internal::FastIntToBuffer(ival, buf);
       f(string{buf, size_t(next - buf)});
     }
+  } else if (set.second == kEncodingListPack) {
+    LpIterate((uint8_t*)set.first, [&f](string_view member) { f(string{member}); });
+  } else if (set.second == kEncodingRoaring) {
+    char buf[32];
+    ((const RoaringSet*)set.first)->Iterate([&](int64_t ival) {
+      char* next = absl::numbers_internal::FastIntToBuffer(ival, buf);
+      f(string{buf, size_t(next - buf)});
+      return true;
+    });
+  } else {
+    ((const StringSet*)set.first)->Iterate([&f](string_view member) {
+      f(string{member});
+      return true;
+    });
+  }
+}
+
+// Returns count distinct indices of [0, n) in ascending order. Floyd's algorithm draws count
+// numbers, regardless of n.
+vector<uint32_t> SampleIndices(uint32_t n, uint32_t count, absl::BitGen* gen) {
+  DCHECK_LE(count, n);
+
+  absl::flat_hash_set<uint32_t> picked;
+  picked.reserve(count);
+  for (uint32_t j = n - count; j < n; ++j) {
+    uint32_t t = absl::Uniform(*gen, 0u, j + 1);
+    if (!picked.insert(t).second)
+      picked.insert(j);
+  }
+
+  vector<uint32_t> res(picked.begin(), picked.end());
+  sort(res.begin(), res.end());
+  return res;
+}
+
+// Returns count random members, distinct ones unless with_dups. A distinct sample of the
+// whole set is the whole set.
+StringVec RandMembers(const SetType& st, uint32_t count, bool with_dups, absl::BitGen* gen) {
+  uint32_t slen = SetTypeLen(st);
+  StringVec result;
+  result.reserve(count);
+
+  if (!with_dups && count >= slen) {
+    FillSet(st, [&result](string s) { result.push_back(move(s)); });
+    return result;
+  }
+
+  if (st.second == kEncodingStrMap) {
+    const StringSet* ss = (const StringSet*)st.first;
+    auto rnd = [gen] { return absl::Uniform<uint64_t>(*gen); };
+    if (with_dups) {
+      for (uint32_t i = 0; i < count; ++i)
+        result.emplace_back(ss->RandomMember(rnd()));
+    } else {
+      ss->Sample(count, rnd, [&result](string_view member) { result.emplace_back(member); });
+    }
+    return result;
+  }
+
+  // The other encodings are indexed directly.
+  vector<uint32_t> indices;
+  if (with_dups) {
+    indices.resize(count);
+    for (uint32_t& i : indices)
+      i = absl::Uniform(*gen, 0u, slen);
+  } else {
+    indices = SampleIndices(slen, count, gen);
+  }
+
+  if (st.second == kEncodingIntSet) {
+    intset* is = (intset*)st.first;
+    int64_t val = 0;
+    for (uint32_t i : indices) {
+      intsetGet(is, i, &val);
+      result.push_back(absl::StrCat(val));
+    }
+  } else if (st.second == kEncodingRoaring) {
+    const RoaringSet* rs = (const RoaringSet*)st.first;
+    for (uint32_t i : indices)
+      result.push_back(absl::StrCat(rs->Select(i)));
   } else {
-    dict* ds = (dict*)set.first;
-    string str;
-    dictIterator* di = dictGetIterator(ds);
-    dictEntry* de = nullptr;
-    while ((de = dictNext(di))) {
-      str.assign((sds)de->key, sdslen((sds)de->key));
-      f(move(str));
+    // Listpacks are not indexed, the members are located in a single pass.
+    vector<uint8_t*> members;
+    members.reserve(slen);
+    uint8_t* lp = (uint8_t*)st.first;
+    for (uint8_t* p = lpFirst(lp); p; p = lpNext(lp, p)) {
+      members.push_back(p);
     }
-    dictReleaseIterator(di);
+
+    uint8_t intbuf[LP_INTBUF_SIZE];
+    for (uint32_t i : indices)
+      result.emplace_back(LpGetView(members[i], intbuf));
   }
+
+  return result;
 }
 
 // if overwrite is true then OpAdd writes vals into the key and discards its previous value.
@@ -335,13 +594,18 @@ OpResult<uint32_t> OpAdd(const OpArgs& op_args, std::string_view key, ArgSlice v
 
   if (add_res.second || overwrite) {
     // does not store the values, merely sets the encoding.
-    // TODO: why not store the values as well?
     InitSet(vals, &co);
+  } else {
+    ConvertForAdd(vals, &co);
   }
 
   void* inner_obj = co.RObjPtr();
   uint32_t res = 0;
 
+  // Each stage below adds the members its encoding can hold and converts the set
+  // to the next encoding in the chain once it encounters a member it can not hold.
+  // The remaining members are added by the next stage, the ones that have been added already
+  // are not counted twice.
   if (co.Encoding() == kEncodingIntSet) {
     intset* is = (intset*)inner_obj;
     bool success = true;
@@ -352,12 +616,22 @@ OpResult<uint32_t> OpAdd(const OpArgs& op_args, std::string_view key, ArgSlice v
       res += added;
 
       if (!success) {
-        dict* ds = dictCreate(&setDictType);
-        SetFamily::ConvertTo(is, ds);
-
         co.SetRObjPtr(is);
-        co.InitRobj(OBJ_SET, kEncodingStrMap, ds);  // 'is' is deleted by co.
-        inner_obj = ds;
+
+        // An overflown intset holds only integers, so it moves to the bitmap. The large intsets
+        // that meet a string are converted straight to the hash table.
+        if (added) {
+          inner_obj = ConvertOverflownIntset(intsetLen(is), &co);
+        } else if (IsGoodForListpack(intsetLen(is), ArgSlice{})) {
+          uint8_t* lp = IntsetToListpack(is);
+          co.InitRobj(OBJ_SET, kEncodingListPack, lp);  // 'is' is deleted by co.
+          inner_obj = lp;
+        } else {
+          StringSet* ss = new StringSet;
+          SetFamily::ConvertTo(is, ss);
+          co.InitRobj(OBJ_SET, kEncodingStrMap, ss);  // 'is' is deleted by co.
+          inner_obj = ss;
+        }
         break;
       }
     }
@@ -366,16 +640,53 @@ OpResult<uint32_t> OpAdd(const OpArgs& op_args, std::string_view key, ArgSlice v
       co.SetRObjPtr(is);
   }
 
-  if (co.Encoding() == kEncodingStrMap) {
-    dict* ds = (dict*)inner_obj;
+  if (co.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)inner_obj;
 
-    for (auto member : vals) {
-      es->tmp_str1 = sdscpylen(es->tmp_str1, member.data(), member.size());
-      dictEntry* de = dictAddRaw(ds, es->tmp_str1, NULL);
-      if (de) {
-        de->key = sdsdup(es->tmp_str1);
+    while (!vals.empty()) {
+      string_view member = vals.front();
+      if (!LpFind(lp, member)) {
+        if (!IsGoodForListpack(lpLength(lp), ArgSlice{&member, 1}))
+          break;
+
+        lp = lpAppend(lp, reinterpret_cast<const uint8_t*>(member.data()), member.size());
         ++res;
       }
+      vals.remove_prefix(1);
+    }
+
+    co.SetRObjPtr(lp);
+    if (!vals.empty()) {
+      StringSet* ss = new StringSet;
+      SetFamily::ConvertTo(lp, ss);
+      co.InitRobj(OBJ_SET, kEncodingStrMap, ss);  // 'lp' is deleted by co.
+      inner_obj = ss;
+    }
+  }
+
+  if (co.Encoding() == kEncodingRoaring) {
+    RoaringSet* rs = (RoaringSet*)inner_obj;
+    long long llval;
+
+    while (!vals.empty() && string2ll(vals.front().data(), vals.front().size(), &llval)) {
+      res += rs->Add(llval);
+      vals.remove_prefix(1);
+    }
+
+    // The sparse sets of integers take less memory in the hash table.
+    if (!vals.empty() || !rs->IsDense()) {
+      StringSet* ss = new StringSet;
+      SetFamily::ConvertTo(rs, ss);
+      co.InitRobj(OBJ_SET, kEncodingStrMap, ss);  // 'rs' is deleted by co.
+      inner_obj = ss;
+    }
+  }
+
+  if (co.Encoding() == kEncodingStrMap) {
+    StringSet* ss = (StringSet*)inner_obj;
+
+    for (auto member : vals) {
+      res += ss->Add(member);
     }
   }
 
@@ -418,10 +729,17 @@ class Mover {
   void Find(Transaction* t);
   OpResult<unsigned> Commit(Transaction* t);
 
+  // Runs both steps within a single hop. Requires src and dest to reside in the same shard.
+  OpResult<unsigned> RunSingleShard(Transaction* t);
+
  private:
   OpStatus OpFind(Transaction* t, EngineShard* es);
   OpStatus OpMutate(Transaction* t, EngineShard* es);
 
+  // Decides on the outcome of the operation based on the Find results.
+  // Sets noop to true if there is nothing to mutate.
+  OpResult<unsigned> Decide(bool* noop) const;
+
   std::string_view src_, dest_, member_;
   OpResult<bool> found_[2];
 };
@@ -470,21 +788,25 @@ void Mover::Find(Transaction* t) {
   t->Execute([this](Transaction* t, EngineShard* es) { return this->OpFind(t, es); }, false);
 }
 
-OpResult<unsigned> Mover::Commit(Transaction* t) {
-  OpResult<unsigned> res;
-  bool noop = false;
-
+OpResult<unsigned> Mover::Decide(bool* noop) const {
   if (found_[0].status() == OpStatus::WRONG_TYPE || found_[1].status() == OpStatus::WRONG_TYPE) {
-    res = OpStatus::WRONG_TYPE;
-    noop = true;
-  } else if (!found_[0].value_or(false)) {
-    res = 0;
-    noop = true;
-  } else {
-    res = 1;
-    noop = (src_ == dest_);
+    *noop = true;
+    return OpStatus::WRONG_TYPE;
   }
 
+  if (!found_[0].value_or(false)) {
+    *noop = true;
+    return 0u;
+  }
+
+  *noop = (src_ == dest_);
+  return 1u;
+}
+
+OpResult<unsigned> Mover::Commit(Transaction* t) {
+  bool noop = false;
+  OpResult<unsigned> res = Decide(&noop);
+
   if (noop) {
     t->Execute(&NoOpCb, true);
   } else {
@@ -494,22 +816,37 @@ OpResult<unsigned> Mover::Commit(Transaction* t) {
   return res;
 }
 
-void ScanCallback(void* privdata, const dictEntry* de) {
-  StringVec* sv = (StringVec*)privdata;
-  sds key = (sds)de->key;
-  sv->push_back(string(key, sdslen(key)));
+OpResult<unsigned> Mover::RunSingleShard(Transaction* t) {
+  DCHECK_EQ(1u, t->unique_shard_cnt());
+  OpResult<unsigned> res;
+
+  auto cb = [&](Transaction* t, EngineShard* es) {
+    OpFind(t, es);
+
+    bool noop = false;
+    res = Decide(&noop);
+    return noop ? OpStatus::OK : OpMutate(t, es);
+  };
+
+  OpStatus st = t->ScheduleSingleHop(std::move(cb));
+  if (st != OpStatus::OK)
+    return st;
+
+  return res;
 }
 
 // Read-only OpUnion op on sets.
 OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
   DCHECK(!keys.empty());
-  absl::flat_hash_set<string> uniques;
+  vector<SetType> sets;
+  size_t total = 0;
 
   for (std::string_view key : keys) {
     OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_SET);
     if (find_res) {
       SetType st{find_res.value()->second.RObjPtr(), find_res.value()->second.Encoding()};
-      FillSet(st, [&uniques](string s) { uniques.emplace(move(s)); });
+      sets.push_back(st);
+      total += SetTypeLen(st);
       continue;
     }
 
@@ -518,7 +855,37 @@ OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
     }
   }
 
-  return ToVec(std::move(uniques));
+  StringVec result;
+  result.reserve(total);
+  if (sets.size() == 1) {
+    FillSet(sets.front(), [&result](string s) { result.push_back(move(s)); });
+    return result;
+  }
+
+  // The bitmaps are merged container by container, the members are unique.
+  auto is_roaring = [](const SetType& st) { return st.second == kEncodingRoaring; };
+  if (all_of(sets.begin(), sets.end(), is_roaring)) {
+    RoaringSet merged;
+    for (const SetType& st : sets)
+      merged.UnionWith(*(const RoaringSet*)st.first);
+
+    FillSet(SetType{&merged, kEncodingRoaring}, [&result](string s) { result.push_back(move(s)); });
+    return result;
+  }
+
+  // The table points into result, which is not reallocated thanks to the reservation.
+  absl::flat_hash_set<string_view> uniques;
+  uniques.reserve(total);
+  for (const SetType& st : sets) {
+    FillSet(st, [&](string s) {
+      if (uniques.contains(s))
+        return;
+      result.push_back(move(s));
+      uniques.insert(result.back());
+    });
+  }
+
+  return result;
 }
 
 // Read-only OpDiff op on sets.
@@ -532,12 +899,8 @@ OpResult<StringVec> OpDiff(const OpArgs& op_args, ArgSlice keys) {
     return find_res.status();
   }
 
-  absl::flat_hash_set<string> uniques;
   SetType st{find_res.value()->second.RObjPtr(), find_res.value()->second.Encoding()};
-
-  FillSet(st, [&uniques](string s) { uniques.insert(move(s)); });
-
-  DCHECK(!uniques.empty());  // otherwise the key would not exist.
+  vector<SetType> others;
 
   for (size_t i = 1; i < keys.size(); ++i) {
     OpResult<PrimeIterator> diff_res = es->db_slice().Find(op_args.db_ind, keys[i], OBJ_SET);
@@ -548,31 +911,166 @@ OpResult<StringVec> OpDiff(const OpArgs& op_args, ArgSlice keys) {
       continue;  // KEY_NOTFOUND
     }
 
-    SetType st2{diff_res.value()->second.RObjPtr(), diff_res.value()->second.Encoding()};
-    if (st2.second == kEncodingIntSet) {
-      int ii = 0;
-      intset* is = (intset*)st2.first;
-      int64_t intele;
-      char buf[32];
+    others.emplace_back(diff_res.value()->second.RObjPtr(), diff_res.value()->second.Encoding());
+  }
+
+  // Probing the other sets is cheaper than copying the source members and erasing them.
+  StringVec result;
+  FillSet(st, [&](string s) {
+    for (const SetType& other : others) {
+      if (IsInSet(other, s))
+        return;
+    }
+    result.push_back(move(s));
+  });
+
+  return result;
+}
+
+// Keeps the values of vals that are in is. Both are sorted, so the search of each value
+// continues from the position of the previous one, with exponentially growing steps.
+void GallopIntersect(const intset* is, vector<int64_t>* vals) {
+  intset* mis = const_cast<intset*>(is);
+  uint32_t len = intsetLen(is);
+  uint32_t pos = 0;
+  size_t out = 0;
+  int64_t cur;
+
+  for (int64_t val : *vals) {
+    uint32_t lo = pos, hi = pos, step = 1;
+    while (hi < len && intsetGet(mis, hi, &cur) && cur < val) {
+      lo = hi + 1;
+      hi += step;
+      step <<= 1;
+    }
+
+    // lower bound of val in [lo, hi).
+    hi = min(hi, len);
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      intsetGet(mis, mid, &cur);
+      if (cur < val)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    pos = lo;
+    if (pos == len)
+      break;
+    intsetGet(mis, pos, &cur);
+    if (cur == val) {
+      (*vals)[out++] = val;
+      ++pos;
+    }
+  }
+  vals->resize(out);
+}
+
+// Passes the members of the intersection of sets to f, either as int64_t or as string_view.
+// It stops once f returns false. sets must be sorted by their length.
+template <typename F> void InterSets(const vector<SetType>& sets, F&& f) {
+  auto in_others = [&](const auto& member) {
+    for (size_t j = 1; j < sets.size(); j++) {
+      if (sets[j].first != sets.front().first && !IsInSet(sets[j], member))
+        return false;
+    }
+    return true;
+  };
+
+  int encoding = sets.front().second;
+  if (encoding == kEncodingIntSet) {
+    intset* is = (intset*)sets.front().first;
+    auto is_intset = [](const SetType& st) { return st.second == kEncodingIntSet; };
+
+    // Intsets are sorted, hence their intersection is a merge. It shrinks the candidates with
+    // every set and ends as soon as there are none.
+    if (all_of(sets.begin(), sets.end(), is_intset)) {
+      vector<int64_t> vals(intsetLen(is));
+      for (uint32_t i = 0; i < vals.size(); ++i)
+        intsetGet(is, i, &vals[i]);
+
+      for (size_t j = 1; j < sets.size() && !vals.empty(); ++j) {
+        if (sets[j].first != is)
+          GallopIntersect((const intset*)sets[j].first, &vals);
+      }
 
-      while (intsetGet(is, ii++, &intele)) {
-        char* next = absl::numbers_internal::FastIntToBuffer(intele, buf);
-        uniques.erase(string_view{buf, size_t(next - buf)});
+      for (int64_t val : vals) {
+        if (!f(val))
+          break;
       }
-    } else {
-      DCHECK_EQ(kEncodingStrMap, st2.second);
-      dict* ds = (dict*)st2.first;
-      dictIterator* di = dictGetIterator(ds);
-      dictEntry* de = nullptr;
-      while ((de = dictNext(di))) {
-        sds key = (sds)de->key;
-        uniques.erase(string_view{key, sdslen(key)});
+      return;
+    }
+
+    int ii = 0;
+    int64_t intele;
+    while (intsetGet(is, ii++, &intele)) {
+      /* Only take action when all sets contain the member */
+      if (in_others(intele) && !f(intele))
+        break;
+    }
+  } else if (encoding == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)sets.front().first;
+    bool done = false;
+
+    LpIterate(lp, [&](string_view member) {
+      if (!done && in_others(member))
+        done = !f(member);
+    });
+  } else if (encoding == kEncodingRoaring) {
+    const RoaringSet* rs = (const RoaringSet*)sets.front().first;
+    auto is_roaring = [](const SetType& st) { return st.second == kEncodingRoaring; };
+
+    // The bitmaps are intersected container by container, starting with a copy of the smallest.
+    if (all_of(sets.begin(), sets.end(), is_roaring)) {
+      RoaringSet inter;
+      inter.UnionWith(*rs);
+      for (size_t j = 1; j < sets.size() && !inter.Empty(); ++j) {
+        if (sets[j].first != rs)
+          inter.IntersectWith(*(const RoaringSet*)sets[j].first);
       }
-      dictReleaseIterator(di);
+
+      inter.Iterate(f);
+      return;
     }
+
+    rs->Iterate([&](int64_t val) { return !in_others(val) || f(val); });
+  } else {
+    const StringSet* ss = (const StringSet*)sets.front().first;
+
+    /* Only take action when all sets contain the member */
+    ss->Iterate([&](string_view member) { return !in_others(member) || f(member); });
   }
+}
 
-  return ToVec(std::move(uniques));
+// Finds the sets of keys sorted by their length, smallest first.
+OpStatus FindSets(const Transaction* t, EngineShard* es, ArgSlice keys, vector<SetType>* sets) {
+  sets->resize(keys.size());
+  OpStatus status = OpStatus::OK;
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    OpResult<PrimeIterator> find_res = es->db_slice().Find(t->db_index(), keys[i], OBJ_SET);
+    if (!find_res) {
+      if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND ||
+          find_res.status() != OpStatus::KEY_NOTFOUND) {
+        status = find_res.status();
+      }
+      continue;
+    }
+    const PrimeValue& pv = find_res.value()->second;
+    void* ptr = pv.RObjPtr();
+    (*sets)[i] = make_pair(ptr, pv.Encoding());
+  }
+
+  if (status != OpStatus::OK)
+    return status;
+
+  auto comp = [](const SetType& left, const SetType& right) {
+    return SetTypeLen(left) < SetTypeLen(right);
+  };
+
+  std::sort(sets->begin(), sets->end(), comp);
+  return OpStatus::OK;
 }
 
 // Read-only OpInter op on sets.
@@ -596,78 +1094,103 @@ OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_f
   }
 
   // we must copy by value because AsRObj is temporary.
-  vector<SetType> sets(keys.size());
+  vector<SetType> sets;
+  OpStatus status = FindSets(t, es, keys, &sets);
+  if (status != OpStatus::OK)
+    return status;
 
-  OpStatus status = OpStatus::OK;
+  InterSets(sets, [&result](const auto& member) {
+    result.push_back(absl::StrCat(member));
+    return true;
+  });
 
-  for (size_t i = 0; i < keys.size(); ++i) {
-    OpResult<PrimeIterator> find_res = es->db_slice().Find(t->db_index(), keys[i], OBJ_SET);
-    if (!find_res) {
-      if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND ||
-          find_res.status() != OpStatus::KEY_NOTFOUND) {
-        status = find_res.status();
-      }
-      continue;
-    }
-    const PrimeValue& pv = find_res.value()->second;
-    void* ptr = pv.RObjPtr();
-    sets[i] = make_pair(ptr, pv.Encoding());
-  }
+  return result;
+}
 
+// Counts the intersection of the sets of the shard up to limit, 0 means no limit. Used when
+// all the keys are in the shard, so that the members are not copied.
+OpResult<uint32_t> OpInterCard(const Transaction* t, EngineShard* es, uint32_t limit) {
+  vector<SetType> sets;
+  OpStatus status = FindSets(t, es, t->ShardArgsInShard(es->shard_id()), &sets);
   if (status != OpStatus::OK)
     return status;
 
-  auto comp = [](const SetType& left, const SetType& right) {
-    return SetTypeLen(left) < SetTypeLen(right);
-  };
-
-  std::sort(sets.begin(), sets.end(), comp);
+  uint32_t cnt = 0;
+  InterSets(sets, [&](const auto&) { return ++cnt != limit; });
+  return cnt;
+}
 
-  int encoding = sets.front().second;
-  if (encoding == kEncodingIntSet) {
-    int ii = 0;
-    intset* is = (intset*)sets.front().first;
-    int64_t intele;
+// Replies with the members of the set at key, which is too large for a single hop. The members
+// are read in hops of chunk members, see Transaction::ExecuteChunked, and each chunk is sent
+// before the next hop, so the reply is never held in full. The array header goes first with the
+// size of the set, which the other transactions can not change while the key is locked. The hop
+// of the command has concluded by then, hence the key is locked by a transaction of its own.
+void SendMembersChunked(CmdArgList args, ConnectionContext* cntx, uint32_t chunk) {
+  intrusive_ptr<Transaction> trans{Transaction::New(cntx->cid)};
+  OpStatus status = trans->InitByArgs(cntx->conn_state.db_index, args);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
 
-    while (intsetGet(is, ii++, &intele)) {
-      size_t j = 1;
-      for (j = 1; j < sets.size(); j++) {
-        if (sets[j].first != is && !IsInSet(sets[j], intele))
-          break;
-      }
+  string_view key = ArgS(args, 1);
+  StringVec result;
+  uint64_t cursor = 0;
+  size_t total = 0, sent = 0;
 
-      /* Only take action when all sets contain the member */
-      if (j == sets.size()) {
-        result.push_back(absl::StrCat(intele));
-      }
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpResult<PrimeIterator> find_res = shard->db_slice().Find(t->db_index(), key, OBJ_SET);
+    if (!find_res) {
+      status = find_res.status();
+      return false;
     }
-  } else {
-    dict* ds = (dict*)sets.front().first;
-    dictIterator* di = dictGetIterator(ds);
-    dictEntry* de = nullptr;
-    while ((de = dictNext(di))) {
-      size_t j = 1;
-      sds key = (sds)de->key;
-      string_view member{key, sdslen(key)};
-
-      for (j = 1; j < sets.size(); j++) {
-        if (sets[j].first != ds && !IsInSet(sets[j], member))
-          break;
-      }
 
-      /* Only take action when all sets contain the member */
-      if (j == sets.size()) {
-        result.push_back(string(member));
-      }
+    const PrimeValue& pv = find_res.value()->second;
+    SetType st{pv.RObjPtr(), pv.Encoding()};
+    if (total == 0)
+      total = SetTypeLen(st);
+
+    if (pv.Encoding() == kEncodingRoaring) {
+      const RoaringSet* rs = (const RoaringSet*)pv.RObjPtr();
+      cursor = rs->Scan(cursor, chunk, [&](int64_t val) { result.push_back(absl::StrCat(val)); });
+    } else if (pv.Encoding() == kEncodingStrMap) {
+      const StringSet* ss = (const StringSet*)pv.RObjPtr();
+      do {
+        cursor = ss->Scan(cursor, [&](string_view member) { result.emplace_back(member); });
+      } while (cursor && result.size() < chunk);
+    } else {
+      // The small encodings are read at once.
+      FillSet(st, [&](string s) { result.push_back(move(s)); });
+      cursor = 0;
     }
-    dictReleaseIterator(di);
-  }
+    return cursor != 0;
+  };
 
-  return result;
+  auto send_chunk = [&] {
+    if (status != OpStatus::OK)
+      return;
+    if (sent == 0)
+      (*cntx)->StartArray(total);
+    for (const string& member : result)
+      (*cntx)->SendBulkString(member);
+    sent += result.size();
+    result.clear();
+  };
+
+  trans->ExecuteChunked(move(cb), move(send_chunk));
+
+  if (status == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->StartArray(0);
+  if (status != OpStatus::OK)
+    return (*cntx)->SendError(status);
+  DCHECK_EQ(sent, total);
 }
 
 }  // namespace
 
+OpResult<uint32_t> SetFamily::OpAddMembers(const OpArgs& op_args, string_view key,
+                                           ArgSlice members) {
+  return OpAdd(op_args, key, members, false);
+}
+
 void SetFamily::SAdd(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
   vector<std::string_view> vals(args.size() - 2);
@@ -719,11 +1242,16 @@ void SetFamily::SMove(CmdArgList args, ConnectionContext* cntx) {
   std::string_view member = ArgS(args, 3);
 
   Mover mover{src, dest, member};
-  cntx->transaction->Schedule();
+  OpResult<unsigned> result;
 
-  mover.Find(cntx->transaction);
+  if (cntx->transaction->unique_shard_cnt() == 1) {
+    result = mover.RunSingleShard(cntx->transaction);
+  } else {
+    cntx->transaction->Schedule();
+    mover.Find(cntx->transaction);
+    result = mover.Commit(cntx->transaction);
+  }
 
-  OpResult<unsigned> result = mover.Commit(cntx->transaction);
   if (!result) {
     return (*cntx)->SendError(result.status());
     return;
@@ -812,6 +1340,47 @@ void SetFamily::SPop(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendError(result.status());
 }
 
+void SetFamily::SRandMember(CmdArgList args, ConnectionContext* cntx) {
+  std::string_view key = ArgS(args, 1);
+  int64_t count = 1;
+  if (args.size() > 2) {
+    if (args.size() > 3)
+      return (*cntx)->SendError(kSyntaxErr);
+    if (!absl::SimpleAtoi(ArgS(args, 2), &count))
+      return (*cntx)->SendError(kInvalidIntErr);
+    if (count < -int64_t(UINT32_MAX) || count > UINT32_MAX)
+      return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  // A negative count allows the same member to be returned more than once.
+  bool with_dups = count < 0;
+  uint32_t abs_count = with_dups ? -count : count;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringVec> {
+    OpResult<PrimeIterator> find_res = shard->db_slice().Find(t->db_index(), key, OBJ_SET);
+    if (!find_res)
+      return find_res.status();
+
+    const PrimeValue& pv = find_res.value()->second;
+    absl::BitGen gen;
+    return RandMembers(SetType{pv.RObjPtr(), pv.Encoding()}, abs_count, with_dups, &gen);
+  };
+
+  OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE)
+    return (*cntx)->SendError(kWrongTypeErr);
+
+  if (args.size() == 2) {  // SRANDMEMBER key
+    if (!result || result->empty())
+      return (*cntx)->SendNull();
+    return (*cntx)->SendBulkString(result->front());
+  }
+
+  if (!result)
+    return (*cntx)->SendStringArr(StringVec{});
+  (*cntx)->SendStringArr(*result);
+}
+
 void SetFamily::SDiff(CmdArgList args, ConnectionContext* cntx) {
   ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
   std::string_view src_key = ArgS(args, 1);
@@ -830,13 +1399,13 @@ void SetFamily::SDiff(CmdArgList args, ConnectionContext* cntx) {
   };
 
   cntx->transaction->ScheduleSingleHop(std::move(cb));
-  ResultSetView rsv = DiffResultVec(result_set, src_shard);
+  OpResult<SvArray> rsv = DiffResultVec(result_set, src_shard);
   if (!rsv) {
     (*cntx)->SendError(rsv.status());
     return;
   }
 
-  SvArray arr = ToSvArray(rsv.value());
+  SvArray arr = std::move(rsv.value());
   if (cntx->conn_state.script_info) {  // sort under script
     sort(arr.begin(), arr.end());
   }
@@ -877,14 +1446,14 @@ void SetFamily::SDiffStore(CmdArgList args, ConnectionContext* cntx) {
 
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(diff_cb), false);
-  ResultSetView rsv = DiffResultVec(result_set, src_shard);
+  OpResult<SvArray> rsv = DiffResultVec(result_set, src_shard);
   if (!rsv) {
     cntx->transaction->Execute(NoOpCb, true);
     (*cntx)->SendError(rsv.status());
     return;
   }
 
-  SvArray result = ToSvArray(rsv.value());
+  SvArray result = std::move(rsv.value());
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
     if (shard->shard_id() == dest_shard) {
       OpAdd(OpArgs{shard, t->db_index()}, dest_key, result, true);
@@ -898,9 +1467,27 @@ void SetFamily::SDiffStore(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void SetFamily::SMembers(CmdArgList args, ConnectionContext* cntx) {
-  auto cb = [](Transaction* t, EngineShard* shard) { return OpInter(t, shard, false); };
+  string_view key = ArgS(args, 1);
+  uint32_t chunk = GetFlag(FLAGS_shard_chunk_elements);
+  if (!cntx->transaction->CanRunChunked())
+    chunk = 0;
+
+  // A large set is left to SendMembersChunked.
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringVec> {
+    if (chunk) {
+      OpResult<PrimeIterator> find_res = shard->db_slice().Find(t->db_index(), key, OBJ_SET);
+      if (find_res) {
+        const PrimeValue& pv = find_res.value()->second;
+        if (SetTypeLen(SetType{pv.RObjPtr(), pv.Encoding()}) > chunk)
+          return OpStatus::SKIPPED;
+      }
+    }
+    return OpInter(t, shard, false);
+  };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::SKIPPED)
+    return SendMembersChunked(args, cntx, chunk);
 
   if (result || result.status() == OpStatus::KEY_NOTFOUND) {
     StringVec& svec = result.value();
@@ -976,6 +1563,52 @@ void SetFamily::SInterStore(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendLong(result->size());
 }
 
+void SetFamily::SInterCard(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t num_keys;
+  if (!absl::SimpleAtoi(ArgS(args, 1), &num_keys))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  uint32_t limit = 0;
+  size_t limit_pos = 2 + num_keys;
+  if (args.size() > limit_pos) {
+    ToUpper(&args[limit_pos]);
+    if (args.size() != limit_pos + 2 || ArgS(args, limit_pos) != "LIMIT")
+      return (*cntx)->SendError(kSyntaxErr);
+
+    int64_t val;
+    if (!absl::SimpleAtoi(ArgS(args, limit_pos + 1), &val))
+      return (*cntx)->SendError(kInvalidIntErr);
+    if (val < 0)
+      return (*cntx)->SendError("LIMIT can't be negative");
+    limit = min<int64_t>(val, UINT32_MAX);
+  }
+
+  Transaction* trans = cntx->transaction;
+
+  // The members are compared across the shards only if the keys span them.
+  if (trans->unique_shard_cnt() == 1) {
+    auto cb = [&](Transaction* t, EngineShard* shard) { return OpInterCard(t, shard, limit); };
+    OpResult<uint32_t> result = trans->ScheduleSingleHopT(std::move(cb));
+    if (result || result.status() == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->SendLong(result ? *result : 0);
+    return (*cntx)->SendError(result.status());
+  }
+
+  ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    result_set[shard->shard_id()] = OpInter(t, shard, false);
+    return OpStatus::OK;
+  };
+
+  trans->ScheduleSingleHop(std::move(cb));
+  OpResult<SvArray> result = InterResultVec(result_set, trans->unique_shard_cnt());
+  if (!result)
+    return (*cntx)->SendError(result.status());
+
+  size_t card = result->size();
+  (*cntx)->SendLong(limit ? min<size_t>(card, limit) : card);
+}
+
 void SetFamily::SUnion(CmdArgList args, ConnectionContext* cntx) {
   ResultStringVec result_set(shard_set->size());
 
@@ -987,9 +1620,9 @@ void SetFamily::SUnion(CmdArgList args, ConnectionContext* cntx) {
 
   cntx->transaction->ScheduleSingleHop(std::move(cb));
 
-  ResultSetView unionset = UnionResultVec(result_set);
+  OpResult<SvArray> unionset = UnionResultVec(result_set);
   if (unionset) {
-    SvArray arr = ToSvArray(*unionset);
+    SvArray arr = std::move(unionset.value());
     if (cntx->conn_state.script_info) {  // sort under script
       sort(arr.begin(), arr.end());
     }
@@ -1019,14 +1652,14 @@ void SetFamily::SUnionStore(CmdArgList args, ConnectionContext* cntx) {
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(union_cb), false);
 
-  ResultSetView unionset = UnionResultVec(result_set);
+  OpResult<SvArray> unionset = UnionResultVec(result_set);
   if (!unionset) {
     cntx->transaction->Execute(NoOpCb, true);
     (*cntx)->SendError(unionset.status());
     return;
   }
 
-  SvArray result = ToSvArray(unionset.value());
+  SvArray result = std::move(unionset.value());
 
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
     if (shard->shard_id() == dest_shard) {
@@ -1093,30 +1726,59 @@ OpResult<StringVec> SetFamily::OpPop(const OpArgs& op_args, std::string_view key
     /* Delete the set as it is now empty */
     CHECK(db_slice.Del(op_args.db_ind, it));
   } else {
+    absl::BitGen gen;
     db_slice.PreUpdate(op_args.db_ind, it);
     if (st.second == kEncodingIntSet) {
       intset* is = (intset*)st.first;
       int64_t val = 0;
 
-      // copy last count values.
-      for (uint32_t i = slen - count; i < slen; ++i) {
+      vector<int64_t> vals;
+      for (uint32_t i : SampleIndices(slen, count, &gen)) {
         intsetGet(is, i, &val);
+        vals.push_back(val);
         result.push_back(absl::StrCat(val));
       }
 
-      is = intsetTrimTail(is, count);  // now remove last count items
+      for (int64_t v : vals) {
+        is = intsetRemove(is, v, nullptr);
+      }
       it->second.SetRObjPtr(is);
+    } else if (st.second == kEncodingRoaring) {
+      RoaringSet* rs = (RoaringSet*)st.first;
+
+      // The members are selected before any of them is removed, so that the ranks hold.
+      vector<int64_t> vals;
+      for (uint32_t i : SampleIndices(slen, count, &gen)) {
+        vals.push_back(rs->Select(i));
+        result.push_back(absl::StrCat(vals.back()));
+      }
+
+      for (int64_t v : vals) {
+        rs->Remove(v);
+      }
+    } else if (st.second == kEncodingListPack) {
+      uint8_t* lp = (uint8_t*)st.first;
+      uint8_t intbuf[LP_INTBUF_SIZE];
+
+      // Deletes the picked members in a single pass.
+      vector<uint32_t> indices = SampleIndices(slen, count, &gen);
+      uint8_t* p = lpFirst(lp);
+      uint32_t pos = 0;
+      for (uint32_t index : indices) {
+        for (; pos < index; ++pos)
+          p = lpNext(lp, p);
+        result.emplace_back(LpGetView(p, intbuf));
+        lp = lpDelete(lp, p, &p);
+        ++pos;
+      }
+      it->second.SetRObjPtr(lp);
     } else {
-      dict* ds = (dict*)st.first;
-      string str;
-      dictIterator* di = dictGetSafeIterator(ds);
-      for (uint32_t i = 0; i < count; ++i) {
-        dictEntry* de = dictNext(di);
-        DCHECK(de);
-        result.emplace_back((sds)de->key, sdslen((sds)de->key));
-        dictDelete(ds, de->key);
+      StringSet* ss = (StringSet*)st.first;
+      auto rnd = [&gen] { return absl::Uniform<uint64_t>(gen); };
+      ss->Sample(count, rnd, [&result](string_view member) { result.emplace_back(member); });
+      for (const string& member : result) {
+        ss->Remove(member);
       }
-      dictReleaseIterator(di);
     }
     db_slice.PostUpdate(op_args.db_ind, it);
   }
@@ -1142,14 +1804,21 @@ OpResult<StringVec> SetFamily::OpScan(const OpArgs& op_args, std::string_view ke
       res.push_back(absl::StrCat(intele));
     }
     *cursor = 0;
+  } else if (it->second.Encoding() == kEncodingListPack) {
+    LpIterate((uint8_t*)it->second.RObjPtr(),
+              [&res](string_view member) { res.emplace_back(member); });
+    *cursor = 0;
+  } else if (it->second.Encoding() == kEncodingRoaring) {
+    const RoaringSet* rs = (const RoaringSet*)it->second.RObjPtr();
+    *cursor = rs->Scan(*cursor, count, [&res](int64_t val) { res.push_back(absl::StrCat(val)); });
   } else {
     DCHECK_EQ(kEncodingStrMap, it->second.Encoding());
     long maxiterations = count * 10;
 
-    dict* ds = (dict*)it->second.RObjPtr();
+    const StringSet* ss = (const StringSet*)it->second.RObjPtr();
     uint64_t cur = *cursor;
     do {
-      cur = dictScan(ds, cur, ScanCallback, NULL, &res);
+      cur = ss->Scan(cur, [&res](string_view member) { res.emplace_back(member); });
     } while (cur && maxiterations-- && res.size() < count);
     *cursor = cur;
   }
@@ -1167,12 +1836,14 @@ void SetFamily::Register(CommandRegistry* registry) {
             << CI{"SDIFFSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SDiffStore)
             << CI{"SINTER", CO::READONLY, -2, 1, -1, 1}.HFUNC(SInter)
             << CI{"SINTERSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SInterStore)
+            << CI{"SINTERCARD", CO::READONLY | CO::VARIADIC_KEYS, -3, 2, 2, 1}.HFUNC(SInterCard)
             << CI{"SMEMBERS", CO::READONLY, 2, 1, 1, 1}.HFUNC(SMembers)
             << CI{"SISMEMBER", CO::FAST | CO::READONLY, 3, 1, 1, 1}.HFUNC(SIsMember)
             << CI{"SMOVE", CO::FAST | CO::WRITE, 4, 1, 2, 1}.HFUNC(SMove)
             << CI{"SREM", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(SRem)
             << CI{"SCARD", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(SCard)
             << CI{"SPOP", CO::WRITE | CO::FAST, -2, 1, 1, 1}.HFUNC(SPop)
+            << CI{"SRANDMEMBER", CO::READONLY, -2, 1, 1, 1}.HFUNC(SRandMember)
             << CI{"SUNION", CO::READONLY, -2, 1, -1, 1}.HFUNC(SUnion)
             << CI{"SUNIONSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SUnionStore)
             << CI{"SSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(SScan);
@@ -1182,17 +1853,48 @@ uint32_t SetFamily::MaxIntsetEntries() {
   return kMaxIntSetEntries;
 }
 
-void SetFamily::ConvertTo(const intset* src, dict* dest) {
+uint32_t SetFamily::MaxListPackEntries() {
+  return kMaxListPackEntries;
+}
+
+uint32_t SetFamily::MaxListPackValue() {
+  return kMaxListPackValue;
+}
+
+void SetFamily::ConvertTo(const intset* src, StringSet* dest) {
   int64_t intele;
   char buf[32];
 
-  /* To add the elements we extract integers and create redis objects */
+  dest->Reserve(intsetLen(src));
   int ii = 0;
   while (intsetGet(const_cast<intset*>(src), ii++, &intele)) {
     char* next = absl::numbers_internal::FastIntToBuffer(intele, buf);
-    sds s = sdsnewlen(buf, next - buf);
-    CHECK(dictAddRaw(dest, s, NULL));
+    CHECK(dest->Add(string_view{buf, size_t(next - buf)}));
   }
 }
 
+void SetFamily::ConvertTo(uint8_t* src, StringSet* dest) {
+  dest->Reserve(lpLength(src));
+  LpIterate(src, [dest](string_view member) { CHECK(dest->Add(member)); });
+}
+
+void SetFamily::ConvertTo(const intset* src, RoaringSet* dest) {
+  int64_t intele;
+  int ii = 0;
+  while (intsetGet(const_cast<intset*>(src), ii++, &intele)) {
+    dest->Add(intele);
+  }
+}
+
+void SetFamily::ConvertTo(const RoaringSet* src, StringSet* dest) {
+  char buf[32];
+
+  dest->Reserve(src->Size());
+  src->Iterate([&](int64_t intele) {
+    char* next = absl::numbers_internal::FastIntToBuffer(intele, buf);
+    CHECK(dest->Add(string_view{buf, size_t(next - buf)}));
+    return true;
+  });
+}
+
 }  // namespace dfly
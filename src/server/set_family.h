@@ -9,7 +9,6 @@
 
 
 typedef struct intset intset;
-typedef struct dict dict;
 
 namespace dfly {
 
@@ -18,6 +17,8 @@ using facade::OpResult;
 class ConnectionContext;
 class CommandRegistry;
 class EngineShard;
+class RoaringSet;
+class StringSet;
 
 class SetFamily {
  public:
@@ -25,7 +26,25 @@ class SetFamily {
 
   static uint32_t MaxIntsetEntries();
 
-  static void ConvertTo(const intset* src, dict* dest);
+  // Limits of the listpack encoding for sets of strings.
+  static uint32_t MaxListPackEntries();
+  static uint32_t MaxListPackValue();
+
+  // Converts an intset into an empty string set.
+  static void ConvertTo(const intset* src, StringSet* dest);
+
+  // Converts a listpack-encoded set.
+  static void ConvertTo(uint8_t* src, StringSet* dest);
+
+  // Converts an overflown intset into an empty roaring bitmap, which holds the large sets of
+  // integers while it is dense, see RoaringSet::IsDense.
+  static void ConvertTo(const intset* src, RoaringSet* dest);
+  static void ConvertTo(const RoaringSet* src, StringSet* dest);
+
+  // Adds the members to the set of key, creating it if needed. Must run in the shard thread
+  // of key. Returns the number of the new members.
+  static OpResult<uint32_t> OpAddMembers(const OpArgs& op_args, std::string_view key,
+                                         ArgSlice members);
 
  private:
   static void SAdd(CmdArgList args,  ConnectionContext* cntx);
@@ -33,6 +52,7 @@ class SetFamily {
   static void SRem(CmdArgList args,  ConnectionContext* cntx);
   static void SCard(CmdArgList args,  ConnectionContext* cntx);
   static void SPop(CmdArgList args,  ConnectionContext* cntx);
+  static void SRandMember(CmdArgList args,  ConnectionContext* cntx);
   static void SUnion(CmdArgList args,  ConnectionContext* cntx);
   static void SUnionStore(CmdArgList args,  ConnectionContext* cntx);
   static void SDiff(CmdArgList args,  ConnectionContext* cntx);
@@ -41,6 +61,7 @@ class SetFamily {
   static void SMove(CmdArgList args,  ConnectionContext* cntx);
   static void SInter(CmdArgList args,  ConnectionContext* cntx);
   static void SInterStore(CmdArgList args,  ConnectionContext* cntx);
+  static void SInterCard(CmdArgList args,  ConnectionContext* cntx);
   static void SScan(CmdArgList args,  ConnectionContext* cntx);
 
   // count - how many elements to pop.
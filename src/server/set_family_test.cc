@@ -4,6 +4,9 @@
 
 #include "server/set_family.h"
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -15,6 +18,8 @@ using namespace std;
 using namespace util;
 using namespace boost;
 
+ABSL_DECLARE_FLAG(uint32_t, shard_chunk_elements);
+
 namespace dfly {
 
 class SetFamilyTest : public BaseFamilyTest {
@@ -77,6 +82,26 @@ TEST_F(SetFamilyTest, SDiff) {
   EXPECT_EQ(2, CheckedInt({"SDIFFSTORE", "tar", "bar", "foo", "car"}));
 }
 
+TEST_F(SetFamilyTest, SUnionSDiffOverlap) {
+  Run({"sadd", "a", "1", "2", "3"});
+  Run({"sadd", "b", "2", "3", "x"});
+  Run({"sadd", "c", "x", "y", "1"});
+
+  auto resp = Run({"sunion", "a", "b", "a", "c"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("1", "2", "3", "x", "y"));
+  EXPECT_THAT(Run({"sunionstore", "d", "a", "b", "c", "none"}), IntArg(5));
+
+  // The source is either smaller or larger than the sets it is diffed with.
+  EXPECT_THAT(Run({"sdiff", "a", "b", "c"}), ArrLen(0));
+  resp = Run({"sdiff", "d", "a"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("x", "y"));
+  EXPECT_EQ(1, CheckedInt({"sdiffstore", "e", "d", "a", "b"}));
+  EXPECT_THAT(Run({"smembers", "e"}), "y");
+  EXPECT_THAT(Run({"sdiff", "d", "d"}), ArrLen(0));
+}
+
 TEST_F(SetFamilyTest, SInter) {
   auto resp = Run({"sadd", "a", "1", "2", "3", "4"});
   Run({"sadd", "b", "3", "5", "6", "2"});
@@ -94,6 +119,56 @@ TEST_F(SetFamilyTest, SInter) {
   EXPECT_THAT(resp, IntArg(0));
 }
 
+TEST_F(SetFamilyTest, SInterIntsets) {
+  vector<string> members;
+  for (unsigned i = 0; i < 200; ++i) {
+    members.push_back(absl::StrCat(i * 2));
+    members.push_back(absl::StrCat(i * 3));
+  }
+
+  vector<string_view> a{"sadd", "a"}, b{"sadd", "b"};
+  for (size_t i = 0; i < members.size(); i += 2) {
+    a.push_back(members[i]);
+    b.push_back(members[i + 1]);
+  }
+  Run(absl::MakeSpan(a));
+  Run(absl::MakeSpan(b));
+  Run({"sadd", "c", "0", "6", "7", "12", "1000"});
+
+  auto resp = Run({"sinter", "a", "b", "c"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("0", "6", "12"));
+  EXPECT_THAT(Run({"sinterstore", "d", "a", "b"}), IntArg(67));
+  resp = Run({"sinter", "a", "a", "c"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("0", "6", "12"));
+
+  Run({"sadd", "c", "foo"});
+  resp = Run({"sinter", "c", "a", "b"});
+  ASSERT_THAT(resp, ArgType(RespExpr::ARRAY));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("0", "6", "12"));
+}
+
+TEST_F(SetFamilyTest, SInterCard) {
+  Run({"sadd", "a", "1", "2", "3", "4"});
+  Run({"sadd", "b", "3", "5", "6", "2"});
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b"}), IntArg(2));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "limit", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "LIMIT", "0"}), IntArg(2));
+  EXPECT_THAT(Run({"sintercard", "1", "a"}), IntArg(4));
+  EXPECT_THAT(Run({"sintercard", "1", "a", "limit", "3"}), IntArg(3));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "a"}), IntArg(4));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "none"}), IntArg(0));
+
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "limit", "-1"}), ErrArg("can't be negative"));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "count", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"sintercard", "3", "a", "b"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"sintercard", "0", "a"}), ErrArg("syntax error"));
+
+  Run({"set", "y", ""});
+  EXPECT_THAT(Run({"sintercard", "2", "a", "y"}), ErrArg("WRONGTYPE"));
+}
+
 TEST_F(SetFamilyTest, SMove) {
   auto resp = Run({"sadd", "a", "1", "2", "3", "4"});
   Run({"sadd", "b", "3", "5", "6", "2"});
@@ -105,6 +180,25 @@ TEST_F(SetFamilyTest, SMove) {
   EXPECT_THAT(Run({"smove", "x", "y", "c"}), IntArg(1));
 }
 
+TEST_F(SetFamilyTest, SMoveSingleShard) {
+  string dest = "b";
+  for (unsigned i = 0; Shard(dest, shard_set->size()) != Shard("a", shard_set->size()); ++i) {
+    dest = absl::StrCat("b", i);
+  }
+
+  Run({"sadd", "a", "1", "2"});
+  EXPECT_THAT(Run({"smove", "a", dest, "1"}), IntArg(1));
+  EXPECT_EQ(1, GetDebugInfo().shards_count);
+  EXPECT_THAT(Run({"smembers", dest}), "1");
+  EXPECT_THAT(Run({"smove", "a", dest, "3"}), IntArg(0));
+  EXPECT_THAT(Run({"smove", "a", "a", "2"}), IntArg(1));
+  EXPECT_THAT(Run({"smembers", "a"}), "2");
+
+  Run({"set", dest, "foo"});
+  EXPECT_THAT(Run({"smove", "a", dest, "2"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"smembers", "a"}), "2");
+}
+
 TEST_F(SetFamilyTest, SPop) {
   auto resp = Run({"sadd", "x", "1", "2", "3"});
   resp = Run({"spop", "x", "3"});
@@ -132,9 +226,194 @@ TEST_F(SetFamilyTest, SPop) {
   EXPECT_THAT(resp.GetVec(), IsSubsetOf({"a", "b", "c"}));
 }
 
+TEST_F(SetFamilyTest, AddBatch) {
+  // A small intset that is converted by a large batch with repeated members.
+  Run({"sadd", "key", "1", "2"});
+  vector<string> args{"sadd", "key"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    args.push_back(absl::StrCat(i % 400));
+  }
+
+  vector<string_view> sv(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(398));
+  EXPECT_EQ(400, CheckedInt({"scard", "key"}));
+  EXPECT_EQ(1, CheckedInt({"sismember", "key", "399"}));
+
+  // A new set of strings.
+  args.resize(1);
+  args.push_back("strs");
+  for (unsigned i = 0; i < 1000; ++i) {
+    args.push_back(absl::StrCat("m", i));
+  }
+  sv.assign(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(1000));
+  EXPECT_EQ(1000, CheckedInt({"scard", "strs"}));
+}
+
+TEST_F(SetFamilyTest, SRandMember) {
+  EXPECT_THAT(Run({"srandmember", "x"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"srandmember", "x", "2"}), ArrLen(0));
+
+  // The intset, listpack and string set encodings.
+  vector<tuple<string, string, unsigned>> sets{{"ints", "", 20}, {"small", "m", 20},
+                                               {"large", "m", 500}};
+  for (const auto& [key, prefix, num] : sets) {
+    for (unsigned i = 0; i < num; ++i) {
+      Run({"sadd", key, absl::StrCat(prefix, i)});
+    }
+
+    auto resp = Run({"srandmember", key, "10"});
+    ASSERT_THAT(resp, ArrLen(10));
+    vector<string> vec = StrArray(resp);
+    EXPECT_EQ(10u, absl::flat_hash_set<string>(vec.begin(), vec.end()).size());
+    EXPECT_EQ(num, CheckedInt({"scard", key}));
+
+    EXPECT_THAT(Run({"srandmember", key, absl::StrCat(num + 1)}), ArrLen(num));
+    EXPECT_THAT(Run({"srandmember", key, absl::StrCat(-int(num) - 1)}), ArrLen(num + 1));
+
+    resp = Run({"spop", key, "10"});
+    ASSERT_THAT(resp, ArrLen(10));
+    vec = StrArray(resp);
+    EXPECT_EQ(10u, absl::flat_hash_set<string>(vec.begin(), vec.end()).size());
+    EXPECT_EQ(num - 10, CheckedInt({"scard", key}));
+    for (const string& member : vec) {
+      EXPECT_EQ(0, CheckedInt({"sismember", key, member}));
+    }
+  }
+}
+
+TEST_F(SetFamilyTest, ListPack) {
+  // Starts as a listpack and passes all the encodings on the way.
+  EXPECT_THAT(Run({"sadd", "x", "a", "b", "1"}), IntArg(3));
+  EXPECT_THAT(Run({"sadd", "x", "b", "c", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"sismember", "x", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"sismember", "x", "d"}), IntArg(0));
+  EXPECT_THAT(Run({"srem", "x", "a", "d"}), IntArg(1));
+  EXPECT_THAT(Run({"smembers", "x"}).GetVec(), UnorderedElementsAre("b", "c", "1"));
+
+  // Intset to listpack.
+  Run({"sadd", "y", "1", "2"});
+  EXPECT_THAT(Run({"sadd", "y", "2", "c", "3"}), IntArg(2));
+  EXPECT_THAT(Run({"sinter", "x", "y"}).GetVec(), UnorderedElementsAre("c", "1"));
+  EXPECT_THAT(Run({"sdiff", "y", "x"}).GetVec(), UnorderedElementsAre("2", "3"));
+
+  // Long members convert it to the hash table.
+  string long_member(100, 'a');
+  EXPECT_THAT(Run({"sadd", "x", "e", long_member, "b"}), IntArg(2));
+  EXPECT_EQ(5, CheckedInt({"scard", "x"}));
+  EXPECT_THAT(Run({"sismember", "x", long_member}), IntArg(1));
+  EXPECT_THAT(Run({"sismember", "x", "1"}), IntArg(1));
+
+  // So do many members.
+  vector<string> members;
+  for (unsigned i = 0; i < 200; ++i) {
+    members.push_back(absl::StrCat("m", i));
+  }
+  for (const auto& m : members) {
+    Run({"sadd", "z", m});
+  }
+  EXPECT_EQ(200, CheckedInt({"scard", "z"}));
+  EXPECT_THAT(Run({"sismember", "z", "m199"}), IntArg(1));
+
+  auto resp = Run({"spop", "y", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), IsSubsetOf({"1", "2", "c", "3"}));
+  EXPECT_EQ(2, CheckedInt({"scard", "y"}));
+}
+
+TEST_F(SetFamilyTest, Roaring) {
+  // An intset that overflows with integers moves to the bitmap.
+  for (unsigned i = 0; i < 300; ++i) {
+    Run({"sadd", "x", absl::StrCat(i * 3)});
+  }
+  EXPECT_EQ("roaring", Run({"object", "encoding", "x"}));
+  EXPECT_EQ(300, CheckedInt({"scard", "x"}));
+  EXPECT_THAT(Run({"sismember", "x", "897"}), IntArg(1));
+  EXPECT_THAT(Run({"sismember", "x", "898"}), IntArg(0));
+  EXPECT_THAT(Run({"srem", "x", "0", "1"}), IntArg(1));
+
+  // So does a large batch of integers.
+  vector<string> args{"sadd", "y"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    args.push_back(absl::StrCat(i));
+  }
+  vector<string_view> sv(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(1000));
+  EXPECT_EQ("roaring", Run({"object", "encoding", "y"}));
+
+  EXPECT_THAT(Run({"sintercard", "2", "x", "y"}), IntArg(299));
+  EXPECT_THAT(Run({"sinter", "x", "y"}), ArrLen(299));
+  EXPECT_THAT(Run({"sunionstore", "z", "x", "y"}), IntArg(1000));
+  EXPECT_EQ("roaring", Run({"object", "encoding", "z"}));
+  EXPECT_THAT(Run({"sdiff", "y", "x"}), ArrLen(701));
+
+  // SSCAN visits all the members.
+  absl::flat_hash_set<string> scanned;
+  string cursor = "0";
+  do {
+    auto resp = Run({"sscan", "x", cursor});
+    ASSERT_THAT(resp, ArrLen(2));
+    cursor = string{ToSV(resp.GetVec()[0].GetBuf())};
+    for (const string& member : StrArray(resp.GetVec()[1])) {
+      EXPECT_TRUE(scanned.insert(member).second);
+    }
+  } while (cursor != "0");
+  EXPECT_EQ(299u, scanned.size());
+
+  auto resp = Run({"spop", "x", "10"});
+  ASSERT_THAT(resp, ArrLen(10));
+  EXPECT_EQ(289, CheckedInt({"scard", "x"}));
+
+  // Strings move it to the hash table.
+  EXPECT_THAT(Run({"sadd", "x", "a"}), IntArg(1));
+  EXPECT_EQ("hashtable", Run({"object", "encoding", "x"}));
+  EXPECT_EQ(290, CheckedInt({"scard", "x"}));
+
+  // So do sparse integers, which take less memory there.
+  for (unsigned i = 0; i < 300; ++i) {
+    Run({"sadd", "w", absl::StrCat(uint64_t(i) << 32)});
+  }
+  EXPECT_EQ("hashtable", Run({"object", "encoding", "w"}));
+  EXPECT_EQ(300, CheckedInt({"scard", "w"}));
+}
+
 TEST_F(SetFamilyTest, Empty) {
   auto resp = Run({"smembers", "x"});
   ASSERT_THAT(resp, ArrLen(0));
 }
 
+TEST_F(SetFamilyTest, SMembersChunked) {
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 10);
+
+  vector<string> members;
+  for (unsigned i = 0; i < 1000; ++i) {
+    members.push_back(absl::StrCat("member", i));
+  }
+  vector<string_view> args{"sadd", "s"};
+  args.insert(args.end(), members.begin(), members.end());
+  Run(absl::MakeSpan(args));
+
+  args[1] = "r";
+  for (unsigned i = 0; i < 1000; ++i) {
+    members[i] = absl::StrCat(i * 1000);
+  }
+  args.resize(2);
+  args.insert(args.end(), members.begin(), members.end());
+  Run(absl::MakeSpan(args));
+
+  for (string_view key : {"s", "r"}) {
+    auto vec = Run({"smembers", key}).GetVec();
+    EXPECT_EQ(1000u, vec.size());
+    absl::flat_hash_set<string> unique;
+    for (const auto& member : vec)
+      unique.insert(member.GetString());
+    EXPECT_EQ(1000u, unique.size());
+  }
+
+  Run({"sadd", "small", "a", "b"});
+  EXPECT_THAT(Run({"smembers", "small"}).GetVec(), UnorderedElementsAre("a", "b"));
+
+  absl::SetFlag(&FLAGS_shard_chunk_elements, 16384);
+}
+
 }  // namespace dfly
@@ -0,0 +1,494 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/slot_migration.h"
+
+extern "C" {
+#include "redis/rdb.h"
+}
+
+#include <absl/strings/str_cat.h>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/redis_parser.h"
+#include "server/cluster_family.h"
+#include "server/engine_shard_set.h"
+#include "server/rdb_extensions.h"
+#include "server/rdb_save.h"
+#include "server/replica_stream.h"
+#include "server/transaction.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(uint32_t, migration_cutover_keys, 1000,
+          "A slot migration finishes once a round of the changed keys has at most that many keys. "
+          "The commands on the slots are retried while the last round is sent.");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using namespace facade;
+using absl::GetFlag;
+
+namespace {
+
+// The RESP bulk strings are limited to 64MB, see RedisParser.
+constexpr size_t kMaxApplyLen = 1 << 20;
+
+// The rounds of the changed keys before the cutover, even if they do not shrink.
+constexpr unsigned kMaxRounds = 16;
+
+// The keys that a hop of DeleteMovedKeys deletes.
+constexpr unsigned kDeleteBatch = 1024;
+
+error_code Recv(FiberSocketBase* input, base::IoBuf* dest) {
+  auto buf = dest->AppendBuffer();
+  io::Result<size_t> exp_size = input->Recv(buf);
+  if (!exp_size)
+    return exp_size.error();
+
+  dest->CommitWrite(*exp_size);
+  return error_code{};
+}
+
+void AppendBulk(string_view str, string* dest) {
+  absl::StrAppend(dest, "$", str.size(), "\r\n", str, "\r\n");
+}
+
+}  // namespace
+
+SlotMigration::SlotMigration(ClusterConfig::Node target, vector<ClusterConfig::SlotRange> ranges,
+                             ClusterFamily* cluster, const CommandId* cid)
+    : target_(std::move(target)), ranges_(std::move(ranges)), cluster_(cluster), cid_(cid),
+      shards_(shard_set->size()), channel_{128, shard_set->size()} {
+  for (const auto& range : ranges_) {
+    for (uint32_t slot = range.start; slot <= range.end; ++slot)
+      slots_.set(slot);
+  }
+}
+
+SlotMigration::~SlotMigration() {
+  DCHECK(!fb_.joinable());
+  if (sock_) {
+    error_code ec = sock_->Close();
+    LOG_IF(ERROR, ec) << "Error closing the migration socket " << ec;
+  }
+}
+
+void SlotMigration::Start() {
+  sock_thread_ = ProactorBase::me();
+  fb_ = ::boost::fibers::fiber(&SlotMigration::MigrateFb, this);
+}
+
+void SlotMigration::Cancel() {
+  cancelled_.store(true, memory_order_relaxed);
+  if (sock_thread_) {
+    sock_thread_->Await([this] {
+      if (sock_)
+        sock_->Shutdown(SHUT_RDWR);
+      if (fb_.joinable())
+        fb_.join();
+    });
+  }
+}
+
+const char* SlotMigration::StateName(State state) {
+  switch (state) {
+    case CONNECTING:
+      return "connecting";
+    case SYNCING:
+      return "syncing";
+    case FINISHING:
+      return "finishing";
+    case DONE:
+      return "done";
+    case FAILED:
+      return "failed";
+  }
+  return "unknown";
+}
+
+auto SlotMigration::GetInfo() const -> Info {
+  Info res;
+  res.target_id = target_.id;
+  res.slots = ClusterConfig::SlotRangesStr(ranges_);
+  res.state = state();
+  res.keys_sent = keys_sent_.load(memory_order_relaxed);
+  res.bytes_sent = bytes_sent_.load(memory_order_relaxed);
+  res.rounds = rounds_.load(memory_order_relaxed);
+
+  lock_guard lk(mu_);
+  res.error = error_;
+  return res;
+}
+
+void SlotMigration::SetError(string error) {
+  LOG(WARNING) << "Migration of slots " << ClusterConfig::SlotRangesStr(ranges_) << " to "
+               << target_.id << " failed: " << error;
+  // Keeps the first error, the following ones are its consequences.
+  lock_guard lk(mu_);
+  if (error_.empty())
+    error_ = std::move(error);
+}
+
+bool SlotMigration::HasSlot(string_view key) const {
+  return slots_.test(ClusterConfig::KeySlot(key));
+}
+
+void SlotMigration::MigrateFb() {
+  VLOG(1) << "Migrating slots " << ClusterConfig::SlotRangesStr(ranges_) << " to " << target_.id;
+
+  error_code ec = Connect();
+  if (ec) {
+    SetError(absl::StrCat("could not connect to ", target_.ip, ":", target_.port, ": ",
+                          ec.message()));
+    state_.store(FAILED, memory_order_relaxed);
+    return;
+  }
+
+  state_.store(SYNCING, memory_order_relaxed);
+  shard_set->RunBriefInParallel([this](EngineShard* shard) { StartInShard(shard); });
+  ec = StreamSnapshot();
+
+  for (unsigned round = 0; !ec && !cancelled_.load(memory_order_relaxed); ++round) {
+    size_t num_keys = 0;
+    ec = StreamChanges(&num_keys);
+    rounds_.fetch_add(1, memory_order_relaxed);
+    if (num_keys <= GetFlag(FLAGS_migration_cutover_keys) || round + 1 >= kMaxRounds)
+      break;
+  }
+
+  bool finishing = false;
+  if (!ec && !cancelled_.load(memory_order_relaxed)) {
+    finishing = cluster_->BeginCutover(ranges_, target_.id);
+    if (!finishing)
+      SetError("the slots are not served by this node anymore");
+  }
+
+  if (finishing) {
+    state_.store(FINISHING, memory_order_relaxed);
+
+    // The second transaction catches the writes that passed the slot checks right before
+    // the first one, e.g. of the scripts that were waiting for the interpreter.
+    ec = StreamFinalChanges(false);
+    if (!ec)
+      ec = StreamFinalChanges(true);
+    if (!ec)
+      ec = FlushApply();
+
+    shared_ptr<const ClusterConfig> config;
+    if (!ec) {
+      config = cluster_->MovedConfig(ranges_, target_.id);
+      if (!config)
+        SetError("the cluster config changed during the migration");
+    }
+
+    if (config) {
+      vector<string> strs;
+      for (const auto& shard : config->shards()) {
+        strs.push_back(shard.master.id);
+        strs.push_back(shard.master.ip);
+        strs.push_back(absl::StrCat(shard.master.port));
+        strs.push_back(ClusterConfig::SlotRangesStr(shard.slot_ranges));
+      }
+      vector<string_view> args{"DFLYCLUSTER", "CONFIG"};
+      args.insert(args.end(), strs.begin(), strs.end());
+      ec = SendCommand(args);
+    }
+
+    bool moved = config && !ec;
+    cluster_->EndCutover(ranges_, target_.id, moved);
+    if (moved) {
+      DeleteMovedKeys();
+      VLOG(1) << "Migrated slots " << ClusterConfig::SlotRangesStr(ranges_) << " to "
+              << target_.id;
+      state_.store(DONE, memory_order_relaxed);
+      return;
+    }
+  }
+
+  if (ec)
+    SetError(cancelled_.load(memory_order_relaxed) ? "cancelled" : ec.message());
+
+  shard_set->RunBriefInParallel([this](EngineShard* shard) { Detach(shard); });
+  state_.store(FAILED, memory_order_relaxed);
+}
+
+error_code SlotMigration::Connect() {
+  sock_.reset(sock_thread_->CreateSocket());
+
+  error_code ec;
+  auto address = boost::asio::ip::make_address(target_.ip, ec);
+  if (ec)
+    return ec;
+
+  return sock_->Connect(boost::asio::ip::tcp::endpoint{address, target_.port});
+}
+
+void SlotMigration::StartInShard(EngineShard* shard) {
+  ShardState& state = shards_[shard->shard_id()];
+  DbSlice& db_slice = shard->db_slice();
+
+  // Registered before the snapshot, so that the changes of the buckets that the snapshot
+  // saves from now on are sent after them.
+  state.change_cb = db_slice.RegisterOnChange(
+      [this](DbIndex db_index, const DbSlice::ChangeReq& req) { OnChange(db_index, req); });
+
+  state.snapshot.reset(new SliceSnapshot(db_slice.databases(), &db_slice, &channel_));
+  state.snapshot->set_key_filter([this](const PrimeKey& key) {
+    string tmp;
+    return HasSlot(key.GetSlice(&tmp));
+  });
+  state.snapshot->Start();
+}
+
+void SlotMigration::OnChange(DbIndex db_index, const DbSlice::ChangeReq& req) {
+  ShardState& state = shards_[EngineShard::tlocal()->shard_id()];
+  if (state.dirty.size() <= db_index)
+    state.dirty.resize(db_index + 1);
+  auto& dirty = state.dirty[db_index];
+
+  if (const PrimeTable::bucket_iterator* bit = req.update()) {
+    // The key that changes is not known, hence all the keys of its bucket are sent.
+    string tmp;
+    for (PrimeTable::bucket_iterator it = *bit; !it.is_done(); ++it) {
+      string_view key = it->first.GetSlice(&tmp);
+      if (HasSlot(key))
+        dirty.emplace(key);
+    }
+  } else {
+    string_view key = get<string_view>(req.change);
+    if (HasSlot(key))
+      dirty.emplace(key);
+  }
+}
+
+error_code SlotMigration::StreamSnapshot() {
+  error_code ec;
+  SliceSnapshot::DbRecord record;
+
+  // The records are released to their snapshots even on error, so that the traversals that
+  // wait for the channel to drain can finish.
+  while (channel_.Pop(record)) {
+    if (!ec && cancelled_.load(memory_order_relaxed))
+      ec = make_error_code(errc::operation_canceled);
+    if (!ec) {
+      keys_sent_.fetch_add(record.num_records, memory_order_relaxed);
+      ec = AddRecord(record.db_index, record.value);
+    }
+    record.source->OnRecordWritten(record.value.size());
+  }
+
+  for (ShardState& state : shards_) {
+    state.snapshot->Join();
+  }
+
+  return ec;
+}
+
+void SlotMigration::TakeChanges(EngineShard* shard, vector<SliceSnapshot::DbRecord>* records) {
+  ShardState& state = shards_[shard->shard_id()];
+  DbSlice& db_slice = shard->db_slice();
+
+  for (DbIndex db_index = 0; db_index < state.dirty.size(); ++db_index) {
+    if (state.dirty[db_index].empty() || !db_slice.IsDbValid(db_index))
+      continue;
+
+    // The lookups may expire the keys, which marks them again.
+    absl::flat_hash_set<string> dirty = std::move(state.dirty[db_index]);
+    state.dirty[db_index].clear();
+
+    io::StringFile sfile;
+    RdbSerializer serializer(&sfile);
+    uint32_t num_records = 0;
+    for (const string& key : dirty) {
+      auto [it, exp_it] = db_slice.FindExt(db_index, key);
+      if (IsValid(it)) {
+        time_t expire_time = IsValid(exp_it) ? db_slice.ExpireTime(exp_it) : 0;
+        CHECK(serializer.SaveEntry(it->first, it->second, expire_time));
+      } else {
+        CHECK(!serializer.WriteOpcode(RDB_OPCODE_DELETED_KEY));
+        CHECK(!serializer.SaveString(key));
+      }
+      ++num_records;
+
+      CHECK(!serializer.FlushMem());
+      if (sfile.val.size() >= kMaxApplyLen) {
+        records->push_back({.db_index = db_index, .num_records = num_records,
+                            .value = std::move(sfile.val)});
+        sfile.val.clear();
+        num_records = 0;
+      }
+    }
+
+    CHECK(!serializer.FlushMem());
+    if (num_records) {
+      records->push_back(
+          {.db_index = db_index, .num_records = num_records, .value = std::move(sfile.val)});
+    }
+  }
+}
+
+error_code SlotMigration::StreamChanges(size_t* num_keys) {
+  vector<vector<SliceSnapshot::DbRecord>> records(shards_.size());
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { TakeChanges(shard, &records[shard->shard_id()]); });
+
+  *num_keys = 0;
+  for (const auto& shard_records : records) {
+    for (const auto& record : shard_records) {
+      *num_keys += record.num_records;
+      keys_sent_.fetch_add(record.num_records, memory_order_relaxed);
+      RETURN_ON_ERR(AddRecord(record.db_index, record.value));
+    }
+  }
+
+  return FlushApply();
+}
+
+error_code SlotMigration::StreamFinalChanges(bool detach) {
+  vector<vector<SliceSnapshot::DbRecord>> records(shards_.size());
+
+  intrusive_ptr<Transaction> trans{Transaction::New(cid_)};
+  trans->InitByArgs(0, {});
+  trans->ScheduleSingleHop([&](Transaction* t, EngineShard* shard) {
+    TakeChanges(shard, &records[shard->shard_id()]);
+    if (detach)
+      Detach(shard);
+    return OpStatus::OK;
+  });
+
+  for (const auto& shard_records : records) {
+    for (const auto& record : shard_records) {
+      keys_sent_.fetch_add(record.num_records, memory_order_relaxed);
+      RETURN_ON_ERR(AddRecord(record.db_index, record.value));
+    }
+  }
+  return error_code{};
+}
+
+void SlotMigration::Detach(EngineShard* shard) {
+  ShardState& state = shards_[shard->shard_id()];
+  if (state.change_cb) {
+    shard->db_slice().UnregisterOnChange(state.change_cb);
+    state.change_cb = 0;
+  }
+  state.dirty.clear();
+}
+
+void SlotMigration::DeleteMovedKeys() {
+  // The slots are redirected, so only the global commands like SCAN see the keys meanwhile.
+  for (ShardId sid = 0; sid < shard_set->size(); ++sid) {
+    size_t deleted = 0;
+    size_t num_dbs =
+        shard_set->Await(sid, [] { return EngineShard::tlocal()->db_slice().db_array_size(); });
+    for (DbIndex db_index = 0; db_index < num_dbs; ++db_index) {
+      PrimeTable::cursor cursor;
+      do {
+        cursor = shard_set->Await(sid, [&] {
+          DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+          if (!db_slice.IsDbValid(db_index))
+            return PrimeTable::cursor{};
+
+          vector<string> keys;
+          string tmp;
+          PrimeTable* table = db_slice.GetTables(db_index).first;
+          PrimeTable::cursor next = cursor;
+          do {
+            next = table->Traverse(next, [&](PrimeIterator it) {
+              string_view key = it->first.GetSlice(&tmp);
+              if (HasSlot(key))
+                keys.emplace_back(key);
+            });
+          } while (next && keys.size() < kDeleteBatch);
+
+          for (const string& key : keys) {
+            db_slice.Del(db_index, db_slice.FindExt(db_index, key).first);
+          }
+          deleted += keys.size();
+          return next;
+        });
+      } while (cursor);
+    }
+    VLOG(1) << "Deleted " << deleted << " migrated keys of shard " << sid;
+  }
+}
+
+error_code SlotMigration::AddRecord(DbIndex db_index, string_view entries) {
+  if (apply_body_.empty())
+    apply_body_ = ApplyHeader();
+
+  if (db_index != apply_db_) {
+    io::StringFile sfile;
+    RdbSerializer serializer(&sfile);
+    CHECK(!serializer.SelectDb(db_index));
+    CHECK(!serializer.FlushMem());
+    apply_body_.append(sfile.val);
+    apply_db_ = db_index;
+  }
+
+  apply_body_.append(entries);
+  if (apply_body_.size() >= kMaxApplyLen)
+    return FlushApply();
+  return error_code{};
+}
+
+error_code SlotMigration::FlushApply() {
+  if (apply_body_.empty())
+    return error_code{};
+
+  // The checksum is not verified for the journals.
+  apply_body_.push_back(char(RDB_OPCODE_EOF));
+  apply_body_.append(8, '\0');
+
+  error_code ec = SendCommand({"DFLY", "APPLY", apply_body_});
+  bytes_sent_.fetch_add(apply_body_.size(), memory_order_relaxed);
+  apply_body_.clear();
+  apply_db_ = kInvalidDbId;
+  return ec;
+}
+
+error_code SlotMigration::SendCommand(const vector<string_view>& args) {
+  string cmd = absl::StrCat("*", args.size(), "\r\n");
+  for (string_view arg : args) {
+    AppendBulk(arg, &cmd);
+  }
+
+  RETURN_ON_ERR(sock_->Write(io::Buffer(cmd)));
+  return ReadOk();
+}
+
+error_code SlotMigration::ReadOk() {
+  RedisParser parser{false};  // client mode
+  RespVec args;
+
+  while (true) {
+    if (io_buf_.InputLen() > 0) {
+      uint32_t consumed = 0;
+      RedisParser::Result result = parser.Parse(io_buf_.InputBuffer(), &consumed, &args);
+      if (result == RedisParser::OK && !args.empty()) {
+        bool ok = args.front().type == RespExpr::STRING && ToSV(args.front().GetBuf()) == "OK";
+        if (!ok) {
+          string reply = args.front().type == RespExpr::ERROR ? string{ToSV(args.front().GetBuf())}
+                                                              : "unexpected reply";
+          io_buf_.ConsumeInput(consumed);
+          SetError(absl::StrCat("the target replied ", reply));
+          return make_error_code(errc::bad_message);
+        }
+        io_buf_.ConsumeInput(consumed);
+        return error_code{};
+      }
+      if (result != RedisParser::INPUT_PENDING)
+        return make_error_code(errc::bad_message);
+      io_buf_.ConsumeInput(consumed);
+    }
+
+    RETURN_ON_ERR(Recv(sock_.get(), &io_buf_));
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,148 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_set.h>
+
+#include <atomic>
+#include <bitset>
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/io_buf.h"
+#include "server/cluster_config.h"
+#include "server/common.h"
+#include "server/snapshot.h"
+#include "util/fiber_socket_base.h"
+
+namespace dfly {
+
+class ClusterFamily;
+class CommandId;
+class EngineShard;
+
+// Moves the keys of slot ranges to another node of the cluster while this node keeps serving
+// them, see DFLYCLUSTER MIGRATE.
+//
+// The keys are streamed to the target as DFLY APPLY commands, like the journal of a replica:
+// a SliceSnapshot per shard saves the keys of the slots, and a change callback of every shard
+// tracks the keys of the slots that change meanwhile. They are sent again, with their current
+// values or their deletion, in rounds until a round is small enough. Then the slots become
+// FINISHING, so the commands on them are retried, while global transactions send the last
+// changes. Finally the target gets the new owners with DFLYCLUSTER CONFIG, this node redirects
+// the slots to it and deletes their keys.
+class SlotMigration {
+ public:
+  enum State : uint8_t { CONNECTING, SYNCING, FINISHING, DONE, FAILED };
+
+  SlotMigration(ClusterConfig::Node target, std::vector<ClusterConfig::SlotRange> ranges,
+                ClusterFamily* cluster, const CommandId* cid);
+  ~SlotMigration();
+
+  // Spawns the fiber of the migration in the calling thread.
+  void Start();
+
+  // Fails the migration unless it's done already and waits for its fiber. Thread-safe.
+  void Cancel();
+
+  State state() const {
+    return state_.load(std::memory_order_relaxed);
+  }
+
+  bool IsRunning() const {
+    State st = state();
+    return st != DONE && st != FAILED;
+  }
+
+  static const char* StateName(State state);
+
+  struct Info {
+    std::string target_id;
+    std::string slots;
+    State state;
+    std::string error;
+    uint64_t keys_sent;
+    uint64_t bytes_sent;
+    unsigned rounds;
+  };
+
+  // Thread-safe.
+  Info GetInfo() const;
+
+ private:
+  // Accessed only in the thread of its shard.
+  struct ShardState {
+    std::unique_ptr<SliceSnapshot> snapshot;
+    uint64_t change_cb = 0;
+    std::vector<absl::flat_hash_set<std::string>> dirty;  // the changed keys, by db index.
+  };
+
+  void MigrateFb();
+
+  std::error_code Connect();
+
+  // Sends the snapshots of all the shards.
+  std::error_code StreamSnapshot();
+
+  // Sends the keys that changed since the previous call. Sets the number of the keys.
+  std::error_code StreamChanges(size_t* num_keys);
+
+  // Sends the last changes within a global transaction, so that the writes that passed the
+  // slot checks before the slots became FINISHING are included. Detaches from the shards if
+  // detach is set.
+  std::error_code StreamFinalChanges(bool detach);
+
+  // Called in the shard thread.
+  void StartInShard(EngineShard* shard);
+  void OnChange(DbIndex db_index, const DbSlice::ChangeReq& req);
+  void TakeChanges(EngineShard* shard, std::vector<SliceSnapshot::DbRecord>* records);
+  void Detach(EngineShard* shard);
+
+  // Deletes the keys of the slots from this node once they are moved.
+  void DeleteMovedKeys();
+
+  bool HasSlot(std::string_view key) const;
+
+  // Appends the entries of the db to the DFLY APPLY command that is being built and sends
+  // the command once it's big enough.
+  std::error_code AddRecord(DbIndex db_index, std::string_view entries);
+  std::error_code FlushApply();
+
+  // Sends a command of the arguments and waits for its reply, which must be OK.
+  std::error_code SendCommand(const std::vector<std::string_view>& args);
+  std::error_code ReadOk();
+
+  void SetError(std::string error);
+
+  ClusterConfig::Node target_;
+  std::vector<ClusterConfig::SlotRange> ranges_;
+  std::bitset<ClusterConfig::kNumSlots> slots_;
+  ClusterFamily* cluster_;
+  const CommandId* cid_;  // of the global transactions.
+
+  std::vector<ShardState> shards_;  // by shard id.
+  SliceSnapshot::RecordChannel channel_;
+
+  std::unique_ptr<util::LinuxSocketBase> sock_;
+  util::ProactorBase* sock_thread_ = nullptr;
+  base::IoBuf io_buf_{256};
+
+  std::string apply_body_;  // of the command that is being built.
+  DbIndex apply_db_ = kInvalidDbId;
+
+  ::boost::fibers::fiber fb_;
+  std::atomic<State> state_{CONNECTING};
+  std::atomic_bool cancelled_{false};
+  std::atomic_uint64_t keys_sent_{0}, bytes_sent_{0};
+  std::atomic_uint32_t rounds_{0};
+
+  mutable ::boost::fibers::mutex mu_;
+  std::string error_;  // guarded by mu_
+};
+
+}  // namespace dfly
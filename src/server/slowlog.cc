@@ -0,0 +1,52 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/slowlog.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <atomic>
+
+namespace dfly {
+
+using namespace std;
+
+void SlowLog::Add(SlowLogEntry entry, size_t max_len) {
+  entries_.push_front(std::move(entry));
+  while (entries_.size() > max_len) {
+    entries_.pop_back();
+  }
+}
+
+uint64_t SlowLog::NextId() {
+  static atomic_uint64_t next_id{0};
+  return next_id.fetch_add(1, memory_order_relaxed);
+}
+
+vector<string> SlowLog::TruncateArgs(CmdArgList args) {
+  vector<string> res;
+  size_t count = min(args.size(), kMaxArgs);
+
+  // The last slot describes the arguments that did not fit.
+  if (args.size() > kMaxArgs)
+    --count;
+
+  res.reserve(count + 1);
+  for (size_t i = 0; i < count; ++i) {
+    string_view arg = ArgS(args, i);
+    if (arg.size() > kMaxArgLen) {
+      res.push_back(absl::StrCat(arg.substr(0, kMaxArgLen), "... (",
+                                 arg.size() - kMaxArgLen, " more bytes)"));
+    } else {
+      res.emplace_back(arg);
+    }
+  }
+
+  if (count < args.size())
+    res.push_back(absl::StrCat("... (", args.size() - count, " more arguments)"));
+
+  return res;
+}
+
+}  // namespace dfly
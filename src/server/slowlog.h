@@ -0,0 +1,58 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+#include "server/tx_stats.h"
+
+namespace dfly {
+
+struct SlowLogEntry {
+  uint64_t id = 0;  // unique and increasing across the threads.
+  time_t unix_ts = 0;
+  uint64_t duration_usec = 0;
+
+  // Truncated arguments, see SlowLog::kMaxArgs and kMaxArgLen.
+  std::vector<std::string> args;
+  std::string client_addr;
+  std::string client_name;
+
+  // Split of the duration, see TxStage.
+  uint64_t stage_usec[size_t(TxStage::NUM_STAGES)] = {0};
+};
+
+// Ring buffer of the slowest commands of a thread, the newest entries first.
+class SlowLog {
+ public:
+  static constexpr size_t kMaxArgs = 32;
+  static constexpr size_t kMaxArgLen = 128;
+
+  // Adds the entry, evicting the oldest ones beyond max_len.
+  void Add(SlowLogEntry entry, size_t max_len);
+
+  void Reset() {
+    entries_.clear();
+  }
+
+  const std::deque<SlowLogEntry>& entries() const {
+    return entries_;
+  }
+
+  // Returns the next id of the entries, shared by all the threads.
+  static uint64_t NextId();
+
+  // Copies args trimmed like in redis: the arguments beyond kMaxArgs are replaced with
+  // a summary, long arguments are cut to kMaxArgLen.
+  static std::vector<std::string> TruncateArgs(CmdArgList args);
+
+ private:
+  std::deque<SlowLogEntry> entries_;
+};
+
+}  // namespace dfly
@@ -6,27 +6,52 @@
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/rdb.h"
 }
 
+#include <absl/base/internal/endian.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "server/db_slice.h"
+#include "server/engine_shard_set.h"
+#include "server/mapped_snapshot.h"
 #include "server/rdb_save.h"
+#include "server/server_state.h"
+#include "server/tiered_storage.h"
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(uint64_t, snapshot_channel_bytes, 8ULL << 20,
+          "Per shard limit of the serialized records of a snapshot that wait to be written. Once "
+          "it is reached, the traversal of the shard pauses until the writes catch up. 0 - no limit.");
+ABSL_FLAG(bool, snapshot_offload_encoding, true,
+          "If true and there are threads without shards, the large strings of the snapshots are "
+          "serialized and compressed in these threads, the shards only copy them.");
+
 namespace dfly {
 
 using namespace std;
 using namespace util;
 using namespace chrono_literals;
 namespace this_fiber = ::boost::this_fiber;
+using absl::GetFlag;
 using boost::fibers::fiber;
 
-SliceSnapshot::SliceSnapshot(DbTableArray db_array, DbSlice* slice, RecordChannel* dest)
-    : db_array_(db_array), db_slice_(slice), dest_(dest) {
+namespace {
+
+// The smaller strings are cheaper to serialize than to copy.
+constexpr size_t kMinOffloadLen = 64;
+constexpr size_t kRawBatchLen = 1 << 16;
+constexpr size_t kRawHeaderLen = 16;
+
+}  // namespace
+
+SliceSnapshot::SliceSnapshot(DbTableArray db_array, DbSlice* slice, RecordChannel* dest,
+                             uint64_t delta_base)
+    : db_array_(db_array), delta_base_(delta_base), db_slice_(slice), dest_(dest) {
 }
 
 SliceSnapshot::~SliceSnapshot() {
@@ -39,11 +64,26 @@ void SliceSnapshot::Start() {
     OnDbChange(db_index, req);
   };
 
+  // The traversal does not see the keys that are still in a mapped snapshot.
+  if (MappedSnapshot* mapped = EngineShard::tlocal()->mapped_snapshot())
+    mapped->MaterializeAll();
+
+  max_pending_bytes_ = GetFlag(FLAGS_snapshot_channel_bytes);
   snapshot_version_ = db_slice_->RegisterOnChange(move(on_change));
   VLOG(1) << "DbSaver::Start - saving entries with version less than " << snapshot_version_;
   sfile_.reset(new io::StringFile);
 
   rdb_serializer_.reset(new RdbSerializer(sfile_.get()));
+  if (tiered_refs_)
+    rdb_serializer_->set_tiered_shard(db_slice_->shard_id());
+
+  // The filtered snapshots of the migrations are interleaved with the changes of their keys, so
+  // their entries must be pushed in the order of the traversal.
+  ProactorPool* pool = shard_set->pool();
+  unsigned helpers = pool->size() - shard_set->size();
+  if (GetFlag(FLAGS_snapshot_offload_encoding) && helpers > 0 && !key_filter_ &&
+      !mapped_writer_)
+    encoder_ = pool->at(shard_set->size() + db_slice_->shard_id() % helpers);
 
   fb_ = fiber([this] {
     FiberFunc();
@@ -66,6 +106,36 @@ void SliceSnapshot::SerializeSingleEntry(DbIndex db_indx, const PrimeKey& pk, co
     expire_time = db_slice_->ExpireTime(eit);
   }
 
+  // Without the references, the values are copied from the backing file as they are stored.
+  if (pv.IsExternal() && !tiered_refs_) {
+    SerializeExternal(db_indx, pk, pv, expire_time);
+    return;
+  }
+
+  if (mapped_writer_) {
+    ++type_freq_map_[mapped_writer_->Add(db_indx, pk, pv, expire_time)];
+    return;
+  }
+
+  // A copy of the string is serialized by encoder_, along with the other copies of the blob.
+  if (encoder_ && serializer == rdb_serializer_.get() && pv.ObjType() == OBJ_STRING &&
+      !pv.IsExternal() && pv.Size() >= kMinOffloadLen) {
+    char header[kRawHeaderLen];
+    absl::little_endian::Store32(header, pk.Size());
+    absl::little_endian::Store32(header + 4, pv.Size());
+    absl::little_endian::Store64(header + 8, expire_time);
+    raw_.data.append(header, kRawHeaderLen);
+
+    size_t pos = raw_.data.size();
+    raw_.data.resize(pos + pk.Size() + pv.Size());
+    pk.GetString(raw_.data.data() + pos);
+    pv.GetString(raw_.data.data() + pos + pk.Size());
+    raw_.db_index = db_indx;
+    ++raw_.num_records;
+    ++type_freq_map_[RDB_TYPE_STRING];
+    return;
+  }
+
   io::Result<uint8_t> res = serializer->SaveEntry(pk, pv, expire_time);
   CHECK(res);  // we write to StringFile.
   ++type_freq_map_[*res];
@@ -76,6 +146,7 @@ void SliceSnapshot::FiberFunc() {
   this_fiber::properties<FiberProps>().set_name(
       absl::StrCat("SliceSnapshot", ProactorBase::GetIndex()));
   PrimeTable::cursor cursor;
+  TieredStorage* tiered = tiered_refs_ ? nullptr : db_slice_->shard_owner()->tiered_storage();
 
   for (DbIndex db_indx = 0; db_indx < db_array_.size(); ++db_indx) {
     if (!db_array_[db_indx])
@@ -90,12 +161,19 @@ void SliceSnapshot::FiberFunc() {
     mu_.unlock();
 
     do {
-      PrimeTable::cursor next = pt->Traverse(cursor, [this](auto it) { this->SaveCb(move(it)); });
+      // The reads of the external values of the step are merged by their pages.
+      if (tiered)
+        tiered->StartReadBatch();
+      PrimeTable::cursor next =
+          pt->TraversePrefetch(cursor, PrefetchEntry, [this](auto it) { this->SaveCb(move(it)); });
+      if (tiered)
+        tiered->SubmitReadBatch();
 
       cursor = next;
 
       // Flush if needed.
       FlushSfile(false);
+      Throttle();
       if (serialized_ >= last_yield + 100) {
         DVLOG(2) << "Before sleep " << this_fiber::properties<FiberProps>().name();
         this_fiber::yield();
@@ -112,17 +190,35 @@ void SliceSnapshot::FiberFunc() {
     FlushSfile(true);
   }  // for (dbindex)
 
+  // The external values that are still being read go into the last record.
+  pending_ec_.await([this] { return ext_in_flight_ == 0; });
+  FlushSfile(true);
+
   // stupid barrier to make sure that SerializePhysicalBucket finished.
   // Can not think of anything more elegant.
   mu_.lock();
   mu_.unlock();
-  dest_->StartClosing();
+  raw_ec_.await([this] { return raw_in_flight_ == 0; });
+  if (dest_)
+    dest_->StartClosing();
 
-  VLOG(1) << "Exit SnapshotSerializer (serialized/side_saved/cbcalls): " << serialized_ << "/"
-          << side_saved_ << "/" << savecb_calls_;
+  VLOG(1) << "Exit SnapshotSerializer (serialized/side_saved/cbcalls/throttled): " << serialized_
+          << "/" << side_saved_ << "/" << savecb_calls_ << "/" << throttle_waits_;
 }
 
 bool SliceSnapshot::FlushSfile(bool force) {
+  SerializeExternalEntries();
+
+  // The writer keeps the entries until they fill whole pages, the rest is written by Finish.
+  if (mapped_writer_) {
+    if (!mapped_ec_)
+      mapped_ec_ = mapped_writer_->Flush();
+    return false;
+  }
+
+  if (force || raw_.data.size() >= kRawBatchLen)
+    OffloadRaw();
+
   if (force) {
     auto ec = rdb_serializer_->FlushMem();
     CHECK(!ec);
@@ -141,17 +237,184 @@ bool SliceSnapshot::FlushSfile(bool force) {
   VLOG(2) << "FlushSfile " << sfile_->val.size() << " bytes";
 
   string tmp = std::move(sfile_->val);  // important to move before pushing!
-  channel_bytes_ += tmp.size();
   DbRecord rec{.db_index = savecb_current_db_,
                .id = rec_id_,
                .num_records = num_records_in_blob_,
                .value = std::move(tmp)};
+  num_records_in_blob_ = 0;
+  PushRecord(std::move(rec));
+
+  return true;
+}
+
+void SliceSnapshot::PushRecord(DbRecord rec) {
+  channel_bytes_ += rec.value.size();
+  pending_bytes_.fetch_add(rec.value.size(), memory_order_relaxed);
+  rec.source = this;
+
   DVLOG(2) << "Pushed " << rec_id_;
   ++rec_id_;
-  num_records_in_blob_ = 0;
   dest_->Push(std::move(rec));
+}
 
-  return true;
+void SliceSnapshot::OffloadRaw() {
+  if (raw_.num_records == 0)
+    return;
+
+  // The copies count towards the limit of the channel until they are serialized.
+  RawBatch* batch = new RawBatch{std::move(raw_)};
+  raw_ = RawBatch{};
+  pending_bytes_.fetch_add(batch->data.size(), memory_order_relaxed);
+  ++raw_in_flight_;
+
+  ProactorBase* shard_proactor = ProactorBase::me();
+  encoder_->DispatchBrief([this, batch, shard_proactor] {
+    fiber([this, batch, shard_proactor] {
+      EncodeRaw(batch);
+
+      // Counted down by the shard thread, so that the snapshot outlives the notification.
+      shard_proactor->DispatchBrief([this] {
+        if (--raw_in_flight_ == 0)
+          raw_ec_.notify();
+      });
+    }).detach();
+  });
+}
+
+void SliceSnapshot::EncodeRaw(RawBatch* batch) {
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+
+  string_view data = batch->data;
+  while (!data.empty()) {
+    uint32_t key_len = absl::little_endian::Load32(data.data());
+    uint32_t value_len = absl::little_endian::Load32(data.data() + 4);
+    uint64_t expire_ms = absl::little_endian::Load64(data.data() + 8);
+    data.remove_prefix(kRawHeaderLen);
+
+    error_code ec = serializer.SaveStringEntry(data.substr(0, key_len),
+                                               data.substr(key_len, value_len), expire_ms);
+    CHECK(!ec);  // we write to StringFile.
+    data.remove_prefix(key_len + value_len);
+  }
+  CHECK(!serializer.FlushMem());
+
+  DbRecord rec{.db_index = batch->db_index,
+               .id = 0,
+               .num_records = batch->num_records,
+               .value = std::move(sfile.val),
+               .source = this};
+  size_t raw_len = batch->data.size();
+  delete batch;
+
+  channel_bytes_.fetch_add(rec.value.size(), memory_order_relaxed);
+  pending_bytes_.fetch_add(rec.value.size(), memory_order_relaxed);
+  dest_->Push(std::move(rec));
+  OnRecordWritten(raw_len);
+}
+
+void SliceSnapshot::SerializeExternal(DbIndex db_index, const PrimeKey& pk, const PrimeValue& pv,
+                                      uint64_t expire_ms) {
+  TieredStorage* tiered = db_slice_->shard_owner()->tiered_storage();
+  DCHECK(tiered);
+
+  size_t read_len = pv.GetExternalPtr().second;
+  ExternalEntry* entry = new ExternalEntry{.db_index = db_index,
+                                           .expire_ms = expire_ms,
+                                           .key = pk.ToString(),
+                                           .value = {},
+                                           .read_len = read_len,
+                                           .is_string = pv.ObjType() == OBJ_STRING};
+  pending_bytes_.fetch_add(read_len, memory_order_relaxed);
+  ++ext_in_flight_;
+
+  // The read keeps the extent until it completes, even if the value is deleted meanwhile.
+  tiered->ReadValueAsync(pv, &entry->value, [this, entry](error_code ec) {
+    --ext_in_flight_;
+    if (ec) {
+      LOG(ERROR) << "Could not read the external value of " << entry->key << " for the snapshot: "
+                 << ec.message();
+      OnRecordWritten(entry->read_len);
+      delete entry;
+    } else {
+      ext_done_.emplace_back(entry);
+    }
+    pending_ec_.notify();
+  });
+}
+
+void SliceSnapshot::SerializeExternalEntries() {
+  if (ext_done_.empty())
+    return;
+
+  vector<unique_ptr<ExternalEntry>> done = std::move(ext_done_);
+  ext_done_.clear();
+
+  lock_guard lk(mu_);
+  for (const auto& entry : done) {
+    io::StringFile sfile;
+    RdbSerializer tmp_serializer(&sfile);
+
+    if (mapped_writer_) {
+      // The mapped entries hold the values as SaveValue saves them.
+      string_view value = entry->value;
+      if (entry->is_string) {
+        CHECK(!tmp_serializer.WriteOpcode(RDB_TYPE_STRING));
+        CHECK(!tmp_serializer.SaveString(entry->value));
+        CHECK(!tmp_serializer.FlushMem());
+        value = sfile.val;
+      }
+      ++type_freq_map_[mapped_writer_->AddValue(entry->db_index, entry->key, value,
+                                                entry->expire_ms)];
+    } else {
+      bool same_db = entry->db_index == savecb_current_db_;
+      RdbSerializer* serializer = same_db ? rdb_serializer_.get() : &tmp_serializer;
+      if (entry->is_string) {
+        CHECK(!serializer->SaveStringEntry(entry->key, entry->value, entry->expire_ms));
+        ++type_freq_map_[RDB_TYPE_STRING];
+      } else {
+        CHECK(!serializer->SaveValueEntry(entry->key, entry->value, entry->expire_ms));
+        ++type_freq_map_[uint8_t(entry->value[0])];
+      }
+
+      if (same_db) {
+        ++num_records_in_blob_;
+      } else {
+        CHECK(!tmp_serializer.FlushMem());
+        DbRecord rec{.db_index = entry->db_index,
+                     .id = rec_id_,
+                     .num_records = 1,
+                     .value = std::move(sfile.val)};
+        PushRecord(std::move(rec));
+      }
+    }
+    OnRecordWritten(entry->read_len);
+  }
+}
+
+void SliceSnapshot::Throttle() {
+  auto below_limit = [this] {
+    return pending_bytes_.load(memory_order_acquire) < max_pending_bytes_;
+  };
+
+  if (max_pending_bytes_ == 0 || below_limit())
+    return;
+
+  ++throttle_waits_;
+  throttled_ = true;
+
+  // The external values that are read meanwhile are serialized while the traversal waits.
+  do {
+    FlushSfile(true);
+    pending_ec_.await([&] { return below_limit() || !ext_done_.empty(); });
+  } while (!below_limit());
+  throttled_ = false;
+}
+
+void SliceSnapshot::OnRecordWritten(size_t bytes) {
+  size_t prev = pending_bytes_.fetch_sub(bytes, memory_order_acq_rel);
+  if (prev >= max_pending_bytes_ && prev - bytes < max_pending_bytes_)
+    pending_ec_.notify();
 }
 
 // The algorithm is to go over all the buckets and serialize those with
@@ -176,8 +439,9 @@ bool SliceSnapshot::SaveCb(PrimeIterator it) {
   ++savecb_calls_;
 
   uint64_t v = it.GetVersion();
-  if (v >= snapshot_version_) {
-    // either has been already serialized or added after snapshotting started.
+  if (v >= snapshot_version_ || v <= delta_base_) {
+    // either has been already serialized, added after snapshotting started or did not change
+    // since the base of the delta. Serialized buckets get the version of their snapshot.
     DVLOG(3) << "Skipped " << it.segment_id() << ":" << it.bucket_id() << ":" << it.slot_id()
              << " at " << v;
     ++skipped_;
@@ -190,19 +454,29 @@ bool SliceSnapshot::SaveCb(PrimeIterator it) {
 }
 
 void SliceSnapshot::OnDbChange(DbIndex db_index, const DbSlice::ChangeReq& req) {
+  // The write that triggered the change waits for the serialization.
+  LatencyMonitor::Timer timer{"snapshot-serialize"};
   PrimeTable* table = db_slice_->GetTables(db_index).first;
 
   if (const PrimeTable::bucket_iterator* bit = req.update()) {
-    if (bit->GetVersion() < snapshot_version_) {
+    uint64_t v = bit->GetVersion();
+    if (v < snapshot_version_ && v > delta_base_) {
       side_saved_ += SerializePhysicalBucket(db_index, *bit);
     }
   } else {
     string_view key = get<string_view>(req.change);
     table->CVCUponInsert(snapshot_version_, key, [this, db_index](PrimeTable::bucket_iterator it) {
       DCHECK_LT(it.GetVersion(), snapshot_version_);
-      side_saved_ += SerializePhysicalBucket(db_index, it);
+      if (it.GetVersion() > delta_base_)
+        side_saved_ += SerializePhysicalBucket(db_index, it);
     });
   }
+
+  // The traversal does not flush while it is throttled, so the buckets that are saved before
+  // their change go to the channel directly. Their memory is bounded by the writes themselves:
+  // each bucket is serialized once per snapshot.
+  if (throttled_)
+    FlushSfile(true);
 }
 
 unsigned SliceSnapshot::SerializePhysicalBucket(DbIndex db_index, PrimeTable::bucket_iterator it) {
@@ -214,34 +488,39 @@ unsigned SliceSnapshot::SerializePhysicalBucket(DbIndex db_index, PrimeTable::bu
 
   lock_guard lk(mu_);
 
-  if (db_index == savecb_current_db_) {
+  if (db_index == savecb_current_db_ || mapped_writer_) {
     while (!it.is_done()) {
-      ++result;
-      SerializeSingleEntry(db_index, it->first, it->second, rdb_serializer_.get());
+      if (!key_filter_ || key_filter_(it->first)) {
+        ++result;
+        SerializeSingleEntry(db_index, it->first, it->second, rdb_serializer_.get());
+      }
       ++it;
     }
     num_records_in_blob_ += result;
   } else {
     io::StringFile sfile;
     RdbSerializer tmp_serializer(&sfile);
+    if (tiered_refs_)
+      tmp_serializer.set_tiered_shard(db_slice_->shard_id());
 
     while (!it.is_done()) {
-      ++result;
-      SerializeSingleEntry(db_index, it->first, it->second, &tmp_serializer);
+      if (!key_filter_ || key_filter_(it->first)) {
+        ++result;
+        SerializeSingleEntry(db_index, it->first, it->second, &tmp_serializer);
+      }
       ++it;
     }
     error_code ec = tmp_serializer.FlushMem();
-    CHECK(!ec && !sfile.val.empty());
+    CHECK(!ec);
 
-    string tmp = std::move(sfile.val);
-    channel_bytes_ += tmp.size();
+    // The external values are serialized once they are read.
+    if (sfile.val.empty())
+      return result;
 
+    string tmp = std::move(sfile.val);
     DbRecord rec{
         .db_index = db_index, .id = rec_id_, .num_records = result, .value = std::move(tmp)};
-    DVLOG(2) << "Pushed " << rec_id_;
-    ++rec_id_;
-
-    dest_->Push(std::move(rec));
+    PushRecord(std::move(rec));
   }
   return result;
 }
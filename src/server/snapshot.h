@@ -4,15 +4,23 @@
 
 #pragma once
 
+#include <atomic>
 #include <bitset>
+#include <functional>
 
 #include "io/file.h"
 #include "server/db_slice.h"
 #include "server/table.h"
+#include "util/fibers/event_count.h"
 #include "util/fibers/simple_channel.h"
 
+namespace util {
+class ProactorBase;
+}  // namespace util
+
 namespace dfly {
 
+class MappedSnapshotWriter;
 class RdbSerializer;
 
 class SliceSnapshot {
@@ -24,17 +32,46 @@ class SliceSnapshot {
     uint64_t id;
     uint32_t num_records;
     std::string value;
+
+    // The snapshot that pushed the record, it is notified once the record is written.
+    SliceSnapshot* source = nullptr;
   };
 
   using RecordChannel =
       ::util::fibers_ext::SimpleChannel<DbRecord, base::mpmc_bounded_queue<DbRecord>>;
 
-  SliceSnapshot(DbTableArray db_array, DbSlice* slice, RecordChannel* dest);
+  // A positive delta_base makes it a delta snapshot: only the buckets that changed since the
+  // snapshot with that version are saved.
+  SliceSnapshot(DbTableArray db_array, DbSlice* slice, RecordChannel* dest,
+                uint64_t delta_base = 0);
   ~SliceSnapshot();
 
+  // Saves the external values as references into the backing file, see
+  // RdbSerializer::set_tiered_shard. Called before Start.
+  void set_tiered_refs(bool val) {
+    tiered_refs_ = val;
+  }
+
+  // Saves only the entries whose keys pass the filter, e.g. of the slots of a migration.
+  // Called before Start.
+  void set_key_filter(std::function<bool(const PrimeKey&)> filter) {
+    key_filter_ = std::move(filter);
+  }
+
+  // Saves the entries into writer instead of the channel, see FLAGS_snapshot_mapped. Then dest
+  // may be null. Called before Start.
+  void set_mapped_writer(MappedSnapshotWriter* writer) {
+    mapped_writer_ = writer;
+  }
+
   void Start();
   void Join();
 
+  // The error of the writes of mapped_writer_, once the snapshot is joined.
+  std::error_code mapped_error() const {
+    return mapped_ec_;
+  }
+
   uint64_t snapshot_version() const {
     return snapshot_version_;
   }
@@ -44,9 +81,13 @@ class SliceSnapshot {
   }
 
   size_t channel_bytes() const {
-    return channel_bytes_;
+    return channel_bytes_.load(std::memory_order_relaxed);
   }
 
+  // Called by the consumer of the channel, possibly from another thread, once the record
+  // pushed by this snapshot has been written. Resumes the throttled traversal.
+  void OnRecordWritten(size_t bytes);
+
   const RdbTypeFreqMap& freq_map() const {
     return type_freq_map_;
   }
@@ -54,6 +95,41 @@ class SliceSnapshot {
  private:
   void FiberFunc();
   bool FlushSfile(bool force);
+  void PushRecord(DbRecord rec);
+
+  // The copies of the string entries that encoder_ serializes, see SerializeSingleEntry.
+  struct RawBatch {
+    DbIndex db_index = 0;
+    uint32_t num_records = 0;
+    std::string data;  // the length of the key, of the value, the expiry, the key and the value.
+  };
+
+  // Hands raw_ over to encoder_.
+  void OffloadRaw();
+
+  // Runs in the thread of encoder_, pushes the serialized entries of batch into dest_.
+  void EncodeRaw(RawBatch* batch);
+
+  // An external value that is read from the backing file. It is saved as it is stored, without
+  // loading it into an object, see SerializeExternal.
+  struct ExternalEntry {
+    DbIndex db_index;
+    uint64_t expire_ms;
+    std::string key;
+    std::string value;  // the string or the value saved by RdbSerializer::SaveValue.
+    size_t read_len;
+    bool is_string;
+  };
+
+  // Starts to read the external value. Does not preempt, the entry is serialized by
+  // SerializeExternalEntries once the read completes.
+  void SerializeExternal(DbIndex db_index, const PrimeKey& pk, const PrimeValue& pv,
+                         uint64_t expire_ms);
+  void SerializeExternalEntries();
+
+  // Blocks the traversal while the records that were not written yet exceed
+  // FLAGS_snapshot_channel_bytes.
+  void Throttle();
   void SerializeSingleEntry(DbIndex db_index, const PrimeKey& pk, const PrimeValue& pv,
                             RdbSerializer* serializer);
 
@@ -69,16 +145,45 @@ class SliceSnapshot {
   DbTableArray db_array_;
   RdbTypeFreqMap type_freq_map_;
 
+  std::function<bool(const PrimeKey&)> key_filter_;
   std::unique_ptr<io::StringFile> sfile_;
   std::unique_ptr<RdbSerializer> rdb_serializer_;
   boost::fibers::mutex mu_;
 
   // version upper bound for entries that should be saved (not included).
   uint64_t snapshot_version_ = 0;
+
+  // lower bound for entries that should be saved (not included), see the constructor.
+  uint64_t delta_base_ = 0;
   DbSlice* db_slice_;
   DbIndex savecb_current_db_;  // used by SaveCb
   RecordChannel* dest_;
-  ::size_t channel_bytes_ = 0;
+  std::atomic_size_t channel_bytes_{0};
+
+  // A thread without a shard that serializes the large strings, which the traversal only copies
+  // into raw_. Not set if all the threads have shards.
+  util::ProactorBase* encoder_ = nullptr;
+  RawBatch raw_;
+  uint32_t raw_in_flight_ = 0;  // the batches that encoder_ has yet to push.
+  ::util::fibers_ext::EventCount raw_ec_;
+
+  // The bytes pushed into dest_ that the consumer has not written yet.
+  std::atomic_size_t pending_bytes_{0};
+  size_t max_pending_bytes_ = 0;
+  ::util::fibers_ext::EventCount pending_ec_;
+
+  // The external values whose reads completed, and the reads in flight. The reads count
+  // towards pending_bytes_ until their entries are serialized.
+  std::vector<std::unique_ptr<ExternalEntry>> ext_done_;
+  uint32_t ext_in_flight_ = 0;
+
+  // Set while the traversal waits in Throttle, then the buckets serialized by OnDbChange are
+  // pushed right away instead of waiting for the traversal to flush them.
+  bool throttled_ = false;
+  bool tiered_refs_ = false;
+  MappedSnapshotWriter* mapped_writer_ = nullptr;
+  std::error_code mapped_ec_;
+  size_t throttle_waits_ = 0;
   size_t serialized_ = 0, skipped_ = 0, side_saved_ = 0, savecb_calls_ = 0;
   uint64_t rec_id_ = 0;
   uint32_t num_records_in_blob_ = 0;
@@ -4,18 +4,23 @@
 
 #include "server/stream_family.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/redis_aux.h"
 #include "redis/stream.h"
 }
 
 #include "base/logging.h"
 #include "facade/error.h"
+#include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
+#include "server/server_state.h"
 #include "server/transaction.h"
 
 namespace dfly {
@@ -25,13 +30,6 @@ using namespace std;
 
 namespace {
 
-struct Record {
-  streamID id;
-  vector<pair<string, string>> kv_arr;
-};
-
-using RecordVec = vector<Record>;
-
 struct ParsedStreamId {
   streamID val;
   bool has_seq = false;   // Was an ID different than "ms-*" specified? for XADD only.
@@ -43,10 +41,18 @@ struct RangeId {
   bool exclude = false;
 };
 
+// MAXLEN and MINID of XADD and XTRIM.
+struct TrimOpts {
+  int strategy = TRIM_STRATEGY_NONE;
+  bool approx = false;  // "~", which trims whole nodes only.
+  uint32_t max_len = kuint32max;
+  streamID min_id{0, 0};
+  int64_t limit = -1;  // the default of the "~" trims unless LIMIT is given.
+};
+
 struct AddOpts {
   ParsedStreamId parsed_id;
-  uint32_t max_limit = kuint32max;
-  bool max_limit_approx = false;
+  TrimOpts trim;
 };
 
 struct GroupInfo {
@@ -61,6 +67,40 @@ struct RangeOpts {
   ParsedStreamId end;
   bool is_rev = false;
   uint32_t count = kuint32max;
+
+  // XREADGROUP delivers the range to the consumer of the group.
+  streamCG* group = nullptr;
+  streamConsumer* consumer = nullptr;
+  bool noack = false;
+};
+
+struct ReadOpts {
+  // The entries after the cursor are read from the stream.
+  struct Cursor {
+    streamID id{0, 0};
+
+    // "$" of XREAD that the first hop resolves to the last id of the stream, or ">" of
+    // XREADGROUP that stands for the entries not delivered to the group yet.
+    bool latest = false;
+  };
+
+  vector<Cursor> cursors;  // one per key.
+  unsigned keys_start = 0;  // the index of the first key in the arguments.
+  uint32_t count = kuint32max;
+  int64_t block_ms = -1;  // does not block if negative.
+
+  // XREADGROUP only.
+  string_view group;
+  string_view consumer;
+  bool noack = false;
+};
+
+// The entries read from a key.
+struct ReadResult {
+  OpStatus status = OpStatus::OK;
+  size_t count = 0;
+  string header;  // the key and the array header of the entries.
+  string body;    // the entries.
 };
 
 const char kInvalidStreamId[] = "Invalid stream ID specified as stream command argument";
@@ -77,6 +117,10 @@ inline string NoGroupError(string_view key, string_view cgroup) {
   return absl::StrCat("-NOGROUP No such consumer group '", cgroup, "' for key name '", key, "'");
 }
 
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
+}
+
 bool ParseID(string_view strid, bool strict, uint64_t missing_seq, ParsedStreamId* dest) {
   if (strid.empty() || strid.size() > 127)
     return false;
@@ -127,6 +171,58 @@ bool ParseID(string_view strid, bool strict, uint64_t missing_seq, ParsedStreamI
   return true;
 }
 
+// Parses the trim option at args[*indx], if it is one, and advances *indx past it.
+// Returns the error to reply with, or nullptr.
+const char* ParseTrimOpt(CmdArgList args, unsigned* indx, TrimOpts* opts, bool* parsed) {
+  string_view arg = ArgS(args, *indx);
+  *parsed = true;
+  if (arg == "LIMIT") {
+    if (*indx + 1 >= args.size())
+      return kSyntaxErr;
+    if (!absl::SimpleAtoi(ArgS(args, *indx + 1), &opts->limit) || opts->limit < 0)
+      return kInvalidIntErr;
+    *indx += 2;
+    return nullptr;
+  }
+
+  if (arg != "MAXLEN" && arg != "MINID") {
+    *parsed = false;
+    return nullptr;
+  }
+
+  if (opts->strategy != TRIM_STRATEGY_NONE)
+    return "syntax error, MAXLEN and MINID options at the same time are not compatible";
+
+  unsigned i = *indx + 1;
+  if (i < args.size() && (ArgS(args, i) == "~" || ArgS(args, i) == "=")) {
+    opts->approx = ArgS(args, i) == "~";
+    ++i;
+  }
+  if (i >= args.size())
+    return kSyntaxErr;
+
+  if (arg == "MAXLEN") {
+    opts->strategy = TRIM_STRATEGY_MAXLEN;
+    if (!absl::SimpleAtoi(ArgS(args, i), &opts->max_len))
+      return kInvalidIntErr;
+  } else {
+    ParsedStreamId parsed_id;
+    opts->strategy = TRIM_STRATEGY_MINID;
+    if (!ParseID(ArgS(args, i), true, 0, &parsed_id) || !parsed_id.id_given)
+      return kInvalidStreamId;
+    opts->min_id = parsed_id.val;
+  }
+
+  *indx = i + 1;
+  return nullptr;
+}
+
+const char* ValidateTrimOpts(const TrimOpts& opts) {
+  if (opts.limit >= 0 && !opts.approx)
+    return "syntax error, LIMIT cannot be used without the special ~ option";
+  return nullptr;
+}
+
 bool ParseRangeId(string_view id, RangeId* dest) {
   if (id.empty())
     return false;
@@ -138,6 +234,35 @@ bool ParseRangeId(string_view id, RangeId* dest) {
   return ParseID(id, dest->exclude, 0, &dest->parsed_id);
 }
 
+// Trims the stream of it. A "~" trim frees the whole nodes below the threshold without visiting
+// their entries and stops at the first node it cannot free, hence with the default limit it
+// costs little more than a lookup of the head node. An exact trim marks the entries of the
+// head node as deleted and leaves the node to the compaction, see DbSlice::CompactStreams.
+int64_t TrimStream(const OpArgs& op_args, PrimeIterator it, const TrimOpts& opts) {
+  stream* stream_inst = (stream*)it->second.RObjPtr();
+
+  streamAddTrimArgs args{};
+  args.trim_strategy = opts.strategy;
+  args.approx_trim = opts.approx;
+  args.maxlen = opts.max_len;
+  args.minid = opts.min_id;
+  if (opts.limit >= 0) {
+    args.limit = opts.limit;
+  } else if (opts.approx) {
+    args.limit = 100 * server.stream_node_max_entries;
+  }
+
+  int64_t deleted = streamTrim(stream_inst, &args);
+
+  streamID master_id;
+  if (deleted > 0 && !opts.approx && stream_inst->length > 0 &&
+      streamNodeIsSparse(stream_inst, &stream_inst->first_id, &master_id)) {
+    op_args.shard->db_slice().MarkSparseStreamNode(op_args.db_ind, it->first, master_id.ms,
+                                                   master_id.seq);
+  }
+  return deleted;
+}
+
 OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts& opts,
                          CmdArgList args) {
   DCHECK(!args.empty() && args.size() % 2 == 0);
@@ -191,58 +316,199 @@ OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts&
     return OpStatus::OUT_OF_MEMORY;
   }
 
-  if (opts.max_limit < kuint32max) {
-    /* Notify xtrim event if needed. */
-    streamTrimByLength(stream_inst, opts.max_limit, opts.max_limit_approx);
+  if (opts.trim.strategy != TRIM_STRATEGY_NONE) {
+    TrimStream(op_args, it, opts.trim);
     // TODO: when replicating, we should propagate it as exact limit in case of trimming.
   }
+
+  // The readers whose cursors are behind the new entry are awakened by the blocking controller.
+  if (auto* bc = op_args.shard->blocking_controller(); bc) {
+    bc->AwakeWatched(op_args.db_ind, key);
+  }
   return result_id;
 }
 
-OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts) {
-  auto& db_slice = op_args.shard->db_slice();
-  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_ind, key, OBJ_STREAM);
-  if (!res_it)
-    return res_it.status();
+// Advances the group past the delivered entry and adds the entry to the pending entries of the
+// consumer, unless NOACK was given.
+void Deliver(stream* s, streamID id, const RangeOpts& opts) {
+  streamCG* group = opts.group;
+  if (streamCompareID(&id, &group->last_id) > 0) {
+    if (group->entries_read != SCG_INVALID_ENTRIES_READ &&
+        !streamRangeHasTombstones(s, &id, NULL)) {
+      group->entries_read++;
+    } else if (s->entries_added) {
+      group->entries_read = streamEstimateDistanceFromFirstEverEntry(s, &id);
+    }
+    group->last_id = id;
+  }
 
-  RecordVec result;
+  if (opts.noack)
+    return;
 
-  if (opts.count == 0)
-    return result;
+  unsigned char buf[sizeof(streamID)];
+  streamEncodeID(buf, &id);
+  streamNACK* nack = streamCreateNACK(opts.consumer);
+  if (!raxTryInsert(group->pel, buf, sizeof(buf), nack, NULL)) {
+    // The entry is pending at another consumer, it is moved to this one.
+    streamFreeNACK(nack);
+    nack = (streamNACK*)raxFind(group->pel, buf, sizeof(buf));
+    raxRemove(nack->consumer->pel, buf, sizeof(buf), NULL);
+    nack->consumer = opts.consumer;
+    nack->delivery_time = mstime();
+    nack->delivery_count = 1;
+  }
+  raxInsert(opts.consumer->pel, buf, sizeof(buf), nack, NULL);
+}
 
+// Writes the entries of the range into rb and returns their number. Only counts them if rb is
+// null.
+size_t WriteRange(stream* s, const RangeOpts& opts, RedisReplyBuilder* rb) {
   streamIterator si;
   int64_t numfields;
   streamID id;
-  CompactObj& cobj = (*res_it)->second;
-  stream* s = (stream*)cobj.RObjPtr();
   streamID sstart = opts.start.val, send = opts.end.val;
+  char id_buf[2 * absl::numbers_internal::kFastToBufferSize];
+  size_t count = 0;
 
   streamIteratorStart(&si, s, &sstart, &send, opts.is_rev);
-  while (streamIteratorGetID(&si, &id, &numfields)) {
-    Record rec;
-    rec.id = id;
-    rec.kv_arr.reserve(numfields);
+  while (count < opts.count && streamIteratorGetID(&si, &id, &numfields)) {
+    ++count;
+    if (opts.group) {
+      Deliver(s, id, opts);
+    }
+
+    if (rb) {
+      char* next = absl::numbers_internal::FastIntToBuffer(id.ms, id_buf);
+      *next++ = '-';
+      next = absl::numbers_internal::FastIntToBuffer(id.seq, next);
+
+      rb->StartArray(2);
+      rb->SendBulkString(string_view{id_buf, size_t(next - id_buf)});
+      rb->StartArray(numfields * 2);
+    }
 
     /* Emit the field-value pairs. */
     while (numfields--) {
       unsigned char *key, *value;
       int64_t key_len, value_len;
       streamIteratorGetField(&si, &key, &value, &key_len, &value_len);
-      string skey(reinterpret_cast<char*>(key), key_len);
-      string sval(reinterpret_cast<char*>(value), value_len);
+      if (rb) {
+        rb->SendBulkString(string_view{reinterpret_cast<char*>(key), size_t(key_len)});
+        rb->SendBulkString(string_view{reinterpret_cast<char*>(value), size_t(value_len)});
+      }
+    }
+  }
+
+  streamIteratorStop(&si);
+  return count;
+}
 
-      rec.kv_arr.emplace_back(move(skey), move(sval));
+// Writes the entries of the range into rb and returns their number. The array header is written
+// only if with_len is set, otherwise it is up to the caller that learns the length only now.
+OpResult<size_t> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts,
+                         RedisReplyBuilder* rb, bool with_len) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_ind, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  CompactObj& cobj = (*res_it)->second;
+  stream* s = (stream*)cobj.RObjPtr();
+
+  if (with_len) {
+    rb->StartArray(WriteRange(s, opts, nullptr));
+  }
+  return WriteRange(s, opts, rb);
+}
+
+// Writes the entries pending at the consumer after start into rb and returns their number. The
+// deleted entries are written with null fields.
+size_t WritePending(stream* s, streamID start, uint32_t count, streamConsumer* consumer,
+                    RedisReplyBuilder* rb) {
+  unsigned char start_key[sizeof(streamID)];
+  streamEncodeID(start_key, &start);
+
+  raxIterator ri;
+  raxStart(&ri, consumer->pel);
+  raxSeek(&ri, ">=", start_key, sizeof(start_key));
+
+  size_t written = 0;
+  while (written < count && raxNext(&ri)) {
+    RangeOpts range;
+    streamDecodeID(ri.key, &range.start.val);
+    range.end.val = range.start.val;
+
+    if (WriteRange(s, range, rb) == 0) {
+      rb->StartArray(2);
+      rb->SendBulkString(StreamIdRepr(range.start.val));
+      rb->SendNullArray();
     }
 
-    result.push_back(move(rec));
+    streamNACK* nack = (streamNACK*)ri.data;
+    nack->delivery_time = mstime();
+    nack->delivery_count++;
+    ++written;
+  }
+  raxStop(&ri);
+
+  return written;
+}
 
-    if (opts.count == result.size())
-      break;
+// Writes the entries after the cursor into rb and returns their number.
+OpResult<size_t> OpRead(const OpArgs& op_args, string_view key, const ReadOpts& opts,
+                        ReadOpts::Cursor* cursor, RedisReplyBuilder* rb) {
+  auto* shard = op_args.shard;
+  OpResult<PrimeIterator> res_it = shard->db_slice().Find(op_args.db_ind, key, OBJ_STREAM);
+  if (!res_it) {
+    if (res_it.status() == OpStatus::KEY_NOTFOUND && opts.group.empty()) {
+      cursor->latest = false;  // "$" of a missing stream stands for 0-0.
+      return 0;
+    }
+    return res_it.status();
   }
 
-  streamIteratorStop(&si);
+  stream* s = (stream*)(*res_it)->second.RObjPtr();
+  RangeOpts range;
+  range.count = opts.count;
 
-  return result;
+  if (opts.group.empty()) {
+    if (cursor->latest) {
+      cursor->id = s->last_id;
+      cursor->latest = false;
+      return 0;
+    }
+    range.start.val = cursor->id;
+  } else {
+    shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.group.data(), opts.group.size());
+    streamCG* cg = streamLookupCG(s, shard->tmp_str1);
+    if (cg == nullptr)
+      return OpStatus::SKIPPED;
+
+    shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.consumer.data(), opts.consumer.size());
+    streamConsumer* consumer = streamLookupConsumer(cg, shard->tmp_str1, SLC_DEFAULT);
+    if (consumer == nullptr) {
+      consumer = streamCreateConsumer(cg, shard->tmp_str1, NULL, op_args.db_ind, SCC_DEFAULT);
+    }
+
+    // An explicit id reads the history of the consumer.
+    if (!cursor->latest) {
+      streamID start = cursor->id;
+      if (streamIncrID(&start) != C_OK)
+        return 0;
+      return WritePending(s, start, opts.count, consumer, rb);
+    }
+
+    range.start.val = cg->last_id;
+    range.group = cg;
+    range.consumer = consumer;
+    range.noack = opts.noack;
+  }
+
+  if (streamIncrID(&range.start.val) != C_OK)
+    return 0;
+  range.end.val = streamID{UINT64_MAX, UINT64_MAX};
+
+  return WriteRange(s, range, rb);
 }
 
 OpResult<uint32_t> OpLen(const OpArgs& op_args, string_view key) {
@@ -454,12 +720,19 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, absl::Span<stre
 
   uint32_t deleted = 0;
   bool first_entry = false;
+  streamID master_id;
 
   for (size_t j = 0; j < ids.size(); j++) {
     streamID id = ids[j];
     if (!streamDeleteItem(stream_inst, &id))
       continue;
 
+    // The tombstones of a mostly deleted node are dropped in the background.
+    if (stream_inst->length > 0 && streamNodeIsSparse(stream_inst, &id, &master_id)) {
+      db_slice.MarkSparseStreamNode(op_args.db_ind, (*res_it)->first, master_id.ms,
+                                    master_id.seq);
+    }
+
     /* We want to know if the first entry in the stream was deleted
      * so we can later set the new one. */
     if (streamCompareID(&id, &stream_inst->first_id) == 0) {
@@ -485,6 +758,19 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, absl::Span<stre
   return deleted;
 }
 
+OpResult<int64_t> OpTrim(const OpArgs& op_args, string_view key, const TrimOpts& opts) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_ind, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  db_slice.PreUpdate(op_args.db_ind, *res_it);
+  int64_t deleted = TrimStream(op_args, *res_it, opts);
+  db_slice.PostUpdate(op_args.db_ind, *res_it);
+
+  return deleted;
+}
+
 void CreateGroup(CmdArgList args, string_view key, ConnectionContext* cntx) {
   if (args.size() < 2)
     return (*cntx)->SendError(UnknownSubCmd("CREATE", "XGROUP"));
@@ -573,27 +859,18 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   unsigned id_indx = 2;
   AddOpts add_opts;
 
-  for (; id_indx < args.size(); ++id_indx) {
+  while (id_indx < args.size()) {
     ToUpper(&args[id_indx]);
-    string_view arg = ArgS(args, id_indx);
-    if (arg == "MAXLEN") {
-      if (id_indx + 2 >= args.size()) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
-      ++id_indx;
-      if (ArgS(args, id_indx) == "~") {
-        add_opts.max_limit_approx = true;
-        ++id_indx;
-      }
-      arg = ArgS(args, id_indx);
-      if (!absl::SimpleAtoi(arg, &add_opts.max_limit)) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
-    } else {
+    bool parsed;
+    if (const char* err = ParseTrimOpt(args, &id_indx, &add_opts.trim, &parsed); err)
+      return (*cntx)->SendError(err);
+    if (!parsed)
       break;
-    }
   }
 
+  if (const char* err = ValidateTrimOpts(add_opts.trim); err)
+    return (*cntx)->SendError(err);
+
   args.remove_prefix(id_indx);
   if (args.size() < 3 || args.size() % 2 == 0) {
     return (*cntx)->SendError(WrongNumArgsError("XADD"), kSyntaxErrType);
@@ -653,6 +930,37 @@ void StreamFamily::XDel(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendError(result.status());
 }
 
+void StreamFamily::XTrim(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  TrimOpts opts;
+
+  for (unsigned indx = 2; indx < args.size();) {
+    ToUpper(&args[indx]);
+    bool parsed;
+    if (const char* err = ParseTrimOpt(args, &indx, &opts, &parsed); err)
+      return (*cntx)->SendError(err);
+    if (!parsed)
+      return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  if (opts.strategy == TRIM_STRATEGY_NONE)
+    return (*cntx)->SendError(kSyntaxErr);
+  if (const char* err = ValidateTrimOpts(opts); err)
+    return (*cntx)->SendError(err);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args{shard, t->db_index()};
+    return OpTrim(op_args, key, opts);
+  };
+
+  OpResult<int64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result || result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendLong(*result);
+  }
+
+  (*cntx)->SendError(result.status());
+}
+
 void StreamFamily::XGroup(CmdArgList args, ConnectionContext* cntx) {
   ToUpper(&args[1]);
   string_view sub_cmd = ArgS(args, 1);
@@ -771,6 +1079,14 @@ void StreamFamily::XRevRange(CmdArgList args, ConnectionContext* cntx) {
   XRangeGeneric(std::move(args), true, cntx);
 }
 
+void StreamFamily::XRead(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), false, cntx);
+}
+
+void StreamFamily::XReadGroup(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), true, cntx);
+}
+
 void StreamFamily::XSetId(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view idstr = ArgS(args, 2);
@@ -834,23 +1150,27 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   range_opts.end = re.parsed_id;
   range_opts.is_rev = is_rev;
 
+  // The shard writes the entries straight from the listpacks into the reply buffer and the
+  // array header is sent ahead of it. The replier of the scripts converts the replies into lua
+  // values and needs the header first, so the range is counted before it is written there.
+  ::io::StringSink sink;
+  RedisReplyBuilder local_rb(&sink);
+  bool under_script = cntx->conn_state.script_info.has_value();
+  RedisReplyBuilder* rb =
+      under_script ? static_cast<RedisReplyBuilder*>(cntx->reply_builder()) : &local_rb;
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
     OpArgs op_args{shard, t->db_index()};
-    return OpRange(op_args, key, range_opts);
+    return OpRange(op_args, key, range_opts, rb, under_script);
   };
 
-  OpResult<RecordVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  OpResult<size_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
 
   if (result) {
-    (*cntx)->StartArray(result->size());
-    for (const auto& item : *result) {
-      (*cntx)->StartArray(2);
-      (*cntx)->SendBulkString(StreamIdRepr(item.id));
-      (*cntx)->StartArray(item.kv_arr.size() * 2);
-      for (const auto& k_v : item.kv_arr) {
-        (*cntx)->SendBulkString(k_v.first);
-        (*cntx)->SendBulkString(k_v.second);
-      }
+    if (!under_script) {
+      string header = absl::StrCat("*", *result, "\r\n");
+      string_view parts[] = {header, sink.str()};
+      (*cntx)->SendRawVec(parts);
     }
     return;
   }
@@ -861,11 +1181,194 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   return (*cntx)->SendError(result.status());
 }
 
+void StreamFamily::XReadGeneric(CmdArgList args, bool read_group, ConnectionContext* cntx) {
+  ReadOpts opts;
+  size_t id_indx = 0;
+
+  for (size_t i = 1; i < args.size() && !id_indx; ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    bool has_next = i + 1 < args.size();
+
+    if (arg == "STREAMS") {
+      size_t left = args.size() - i - 1;
+      if (left == 0 || left % 2 != 0)
+        return (*cntx)->SendError(kSyntaxErr);
+      opts.keys_start = i + 1;
+      id_indx = opts.keys_start + left / 2;
+    } else if (arg == "COUNT" && has_next) {
+      int64_t count;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &count))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (count > 0)
+        opts.count = std::min<int64_t>(count, kuint32max);
+    } else if (arg == "BLOCK" && has_next) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.block_ms))
+        return (*cntx)->SendError("timeout is not an integer or out of range");
+      if (opts.block_ms < 0)
+        return (*cntx)->SendError("timeout is negative");
+    } else if (read_group && arg == "GROUP" && i + 2 < args.size()) {
+      opts.group = ArgS(args, ++i);
+      opts.consumer = ArgS(args, ++i);
+    } else if (read_group && arg == "NOACK") {
+      opts.noack = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!id_indx)
+    return (*cntx)->SendError(kSyntaxErr);
+  if (read_group && opts.group.empty())
+    return (*cntx)->SendError("Missing GROUP option for XREADGROUP");
+
+  // Only the reads of the new entries block, the history of a consumer is served at once.
+  bool serve_history = false;
+  opts.cursors.resize(args.size() - id_indx);
+  for (size_t i = 0; i < opts.cursors.size(); ++i) {
+    string_view id = ArgS(args, id_indx + i);
+    ReadOpts::Cursor& cursor = opts.cursors[i];
+    ParsedStreamId parsed_id;
+
+    if (id == (read_group ? ">" : "$")) {
+      cursor.latest = true;
+    } else if (id == ">" || id == "$") {
+      return (*cntx)->SendError(read_group ? "The $ ID is meaningless in the context of "
+                                             "XREADGROUP"
+                                           : "The > ID can be specified only when calling "
+                                             "XREADGROUP using the GROUP <group> <consumer> "
+                                             "option.");
+    } else if (ParseID(id, true, 0, &parsed_id)) {
+      cursor.id = parsed_id.val;
+      serve_history |= read_group;
+    } else {
+      return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+    }
+  }
+
+  vector<ReadResult> results(opts.cursors.size());
+  auto read_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    ArgSlice keys = t->ShardArgsInShard(sid);
+    OpArgs op_args{shard, t->db_index()};
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+      size_t indx = t->ReverseArgIndex(sid, i) + 1 - opts.keys_start;
+      ReadResult& res = results[indx];
+
+      ::io::StringSink sink;
+      RedisReplyBuilder rb(&sink);
+      OpResult<size_t> count = OpRead(op_args, keys[i], opts, &opts.cursors[indx], &rb);
+      res.status = count.status();
+      if (count) {
+        res.count = *count;
+        res.body = sink.str();
+      }
+    }
+    return OpStatus::OK;
+  };
+
+  auto has_entries = [&] {
+    return serve_history || any_of(results.begin(), results.end(), [](const ReadResult& res) {
+             return res.count > 0 || res.status != OpStatus::OK;
+           });
+  };
+
+  Transaction* trans = cntx->transaction;
+  if (opts.block_ms < 0 || trans->IsMulti()) {
+    trans->ScheduleSingleHop(std::move(read_cb));
+  } else {
+    trans->Schedule();
+    trans->Execute(read_cb, false);
+
+    if (has_entries()) {
+      trans->Execute(NoOpCb, true);
+    } else {
+      // Wakes up only for the streams that have new entries after the cursors.
+      absl::flat_hash_map<string_view, unsigned> key_indices;
+      for (unsigned i = 0; i < opts.cursors.size(); ++i) {
+        key_indices.emplace(ArgS(args, opts.keys_start + i), i);
+      }
+
+      auto is_ready = [&](string_view key, const PrimeValue& pv) {
+        if (pv.ObjType() != OBJ_STREAM)
+          return false;
+
+        stream* s = (stream*)pv.RObjPtr();
+        if (!read_group) {
+          return streamCompareID(&s->last_id, &opts.cursors[key_indices.at(key)].id) > 0;
+        }
+
+        EngineShard* shard = EngineShard::tlocal();
+        shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.group.data(), opts.group.size());
+        streamCG* cg = streamLookupCG(s, shard->tmp_str1);
+
+        // The read reports the destroyed group.
+        return cg == nullptr || streamCompareID(&s->last_id, &cg->last_id) > 0;
+      };
+
+      Transaction::time_point tp = Transaction::time_point::max();
+      if (opts.block_ms > 0)
+        tp = chrono::steady_clock::now() + chrono::milliseconds(opts.block_ms);
+
+      auto* stats = ServerState::tl_connection_stats();
+      ++stats->num_blocked_clients;
+      bool wait_succeeded = trans->WaitOnWatch(tp, std::move(is_ready));
+      --stats->num_blocked_clients;
+
+      if (!wait_succeeded)
+        return (*cntx)->SendNullArray();
+
+      trans->Execute(read_cb, true);
+    }
+  }
+
+  size_t num_served = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    ReadResult& res = results[i];
+    string_view key = ArgS(args, opts.keys_start + i);
+
+    switch (res.status) {
+      case OpStatus::OK:
+        break;
+      case OpStatus::KEY_NOTFOUND:
+      case OpStatus::SKIPPED:
+        return (*cntx)->SendError(absl::StrCat("-NOGROUP No such key '", key,
+                                               "' or consumer group '", opts.group,
+                                               "' in XREADGROUP with GROUP option"));
+      default:
+        return (*cntx)->SendError(res.status);
+    }
+
+    if (res.count > 0 || serve_history) {
+      res.header =
+          absl::StrCat("*2\r\n$", key.size(), "\r\n", key, "\r\n*", res.count, "\r\n");
+      ++num_served;
+    }
+  }
+
+  if (num_served == 0)
+    return (*cntx)->SendNullArray();
+
+  string header = absl::StrCat("*", num_served, "\r\n");
+  vector<string_view> parts{header};
+  for (const ReadResult& res : results) {
+    if (!res.header.empty()) {
+      parts.push_back(res.header);
+      parts.push_back(res.body);
+    }
+  }
+  (*cntx)->SendRawVec(parts);
+}
+
 #define HFUNC(x) SetHandler(&StreamFamily::x)
 
 void StreamFamily::Register(CommandRegistry* registry) {
   using CI = CommandId;
 
+  // The blocking commands are not allowed in scripts, like BLPOP.
+  constexpr uint32_t kReadMask = CO::BLOCKING | CO::NOSCRIPT | CO::VARIADIC_KEYS;
+
   *registry << CI{"XADD", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(XAdd)
             << CI{"XDEL", CO::WRITE | CO::FAST, -3, 1, 1, 1}.HFUNC(XDel)
             << CI{"XGROUP", CO::WRITE | CO::DENYOOM, -2, 2, 2, 1}.HFUNC(XGroup)
@@ -873,7 +1376,10 @@ void StreamFamily::Register(CommandRegistry* registry) {
             << CI{"XLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(XLen)
             << CI{"XRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRange)
             << CI{"XREVRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRevRange)
-            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId);
+            << CI{"XREAD", kReadMask | CO::READONLY, -4, 2, 2, 1}.HFUNC(XRead)
+            << CI{"XREADGROUP", kReadMask | CO::WRITE, -7, 5, 5, 1}.HFUNC(XReadGroup)
+            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId)
+            << CI{"XTRIM", CO::WRITE | CO::FAST, -4, 1, 1, 1}.HFUNC(XTrim);
 }
 
 }  // namespace dfly
\ No newline at end of file
@@ -4,15 +4,20 @@
 
 #include "server/stream_family.h"
 
+#include <absl/strings/str_cat.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
 #include "server/command_registry.h"
+#include "server/server_family.h"
 #include "server/test_utils.h"
 
 using namespace testing;
 using namespace std;
 using namespace util;
+namespace this_fiber = ::boost::this_fiber;
+namespace fibers = ::boost::fibers;
 
 namespace dfly {
 
@@ -82,6 +87,205 @@ TEST_F(StreamFamilyTest, Range) {
   sub1 = sub_arr[1].GetVec();
   EXPECT_THAT(sub0, ElementsAre("1-1", ArrLen(2)));
   EXPECT_THAT(sub1, ElementsAre("1-0", ArrLen(2)));
+
+  resp = Run({"xrange", "key", "-", "+", "count", "1"});
+  EXPECT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("1-0", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("f1", "v1"));
+
+  resp = Run({"xrange", "key", "-", "+", "count", "0"});
+  EXPECT_THAT(resp, ArrLen(0));
+}
+
+TEST_F(StreamFamilyTest, Read) {
+  Run({"xadd", "s1", "1-0", "f1", "v1"});
+  Run({"xadd", "s1", "2-0", "f2", "v2"});
+  Run({"xadd", "s2", "3-0", "f3", "v3"});
+
+  auto resp = Run({"xread", "streams", "s1", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s1", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[1].GetVec(), ElementsAre("2-0", ArrLen(2)));
+
+  resp = Run({"xread", "count", "1", "streams", "s1", "s2", "missing", "1-0", "0", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("s1", ArrLen(1)));
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("s2", ArrLen(1)));
+
+  EXPECT_THAT(Run({"xread", "streams", "s1", "$"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"xread", "streams", "s1", "2-0"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"xread", "streams", "s1", ">"}), ErrArg("can be specified only"));
+  EXPECT_THAT(Run({"xread", "streams", "s1", "s2", "0"}), ErrArg("syntax error"));
+
+  Run({"set", "str", "1"});
+  EXPECT_THAT(Run({"xread", "streams", "str", "0"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(StreamFamilyTest, ReadGroup) {
+  Run({"xadd", "s1", "1-0", "f1", "v1"});
+  Run({"xadd", "s1", "2-0", "f2", "v2"});
+  Run({"xgroup", "create", "s1", "g", "0"});
+
+  auto resp = Run({"xreadgroup", "group", "g", "c1", "count", "1", "streams", "s1", ">"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-0", ArrLen(2)));
+
+  resp = Run({"xreadgroup", "group", "g", "c2", "noack", "streams", "s1", ">"});
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "c1", "streams", "s1", ">"}),
+              ArgType(RespExpr::NIL_ARRAY));
+
+  // The history of a consumer is its pending entries.
+  resp = Run({"xreadgroup", "group", "g", "c1", "streams", "s1", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s1", ArrLen(1)));
+  resp = Run({"xreadgroup", "group", "g", "c2", "block", "0", "streams", "s1", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s1", ArrLen(0)));
+
+  resp = Run({"xinfo", "groups", "s1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("name", "g", "consumers", "2", "pending", "1",
+                                         "last-delivered-id", "2-0"));
+
+  EXPECT_THAT(Run({"xreadgroup", "group", "h", "c1", "streams", "s1", ">"}), ErrArg("NOGROUP"));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "c1", "streams", "s2", ">"}), ErrArg("NOGROUP"));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "c1", "streams", "s1", "$"}),
+              ErrArg("meaningless"));
+}
+
+TEST_F(StreamFamilyTest, ReadBlock) {
+  Run({"xadd", "s1", "1-0", "f1", "v1"});
+  EXPECT_THAT(Run({"xread", "block", "10", "streams", "s1", "$"}), ArgType(RespExpr::NIL_ARRAY));
+  ASSERT_FALSE(IsLocked(0, "s1"));
+
+  RespExpr resp0, resp1;
+  auto fb0 = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp0 = Run({"xread", "block", "1000", "streams", "s1", "$"});
+  });
+  this_fiber::sleep_for(50us);
+
+  // The cursor of this reader is ahead of the next entry.
+  auto fb1 = pp_->at(1)->LaunchFiber([&] {
+    resp1 = Run({"xread", "block", "100", "streams", "s1", "5-0"});
+  });
+  this_fiber::sleep_for(30us);
+
+  pp_->at(1)->Await([&] { Run("B1", {"xadd", "s1", "2-0", "f2", "v2"}); });
+  fb0.join();
+  fb1.join();
+
+  ASSERT_THAT(resp0, ArrLen(2));
+  EXPECT_THAT(resp0.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+  EXPECT_THAT(resp1, ArgType(RespExpr::NIL_ARRAY));
+  ASSERT_FALSE(IsLocked(0, "s1"));
+}
+
+TEST_F(StreamFamilyTest, ReadGroupBlock) {
+  Run({"xadd", "s1", "1-0", "f1", "v1"});
+  Run({"xgroup", "create", "s1", "g", "$"});
+
+  RespExpr resp;
+  auto fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"xreadgroup", "group", "g", "c1", "block", "1000", "streams", "s1", ">"});
+  });
+  this_fiber::sleep_for(50us);
+
+  pp_->at(1)->Await([&] { Run("B1", {"xadd", "s1", "2-0", "f2", "v2"}); });
+  fb.join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+}
+
+TEST_F(StreamFamilyTest, Trim) {
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "0"}), IntArg(0));
+
+  // The nodes hold 100 entries each.
+  for (unsigned i = 1; i <= 1000; ++i) {
+    Run({"xadd", "s", absl::StrCat(i, "-0"), "f", "v"});
+  }
+
+  // The nodes below the threshold are freed as a whole, the node that holds it stays.
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "~", "250"}), IntArg(200));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(800));
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "1"}), ElementsAre("201-0", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "=", "250"}), IntArg(49));
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "1"}), ElementsAre("250-0", ArrLen(2)));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "250"}), IntArg(0));
+
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "~", "600"}), IntArg(151));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(600));
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "~", "0", "limit", "100"}), IntArg(100));
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "1"}), ElementsAre("501-0", ArrLen(2)));
+
+  auto resp = Run({"xadd", "s", "minid", "900", "*", "f", "v"});
+  ASSERT_THAT(resp, ArgType(RespExpr::STRING));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(102));
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "1"}), ElementsAre("900-0", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "1", "limit", "1"}), ErrArg("LIMIT cannot be used"));
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "1", "minid", "1"}), ErrArg("not compatible"));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "bad"}), ErrArg("Invalid stream ID"));
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "-1"}), ErrArg(kInvalidIntErr));
+  EXPECT_THAT(Run({"xtrim", "s", "foo", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"xadd", "s", "maxlen", "1", "limit", "1", "*", "f", "v"}),
+              ErrArg("LIMIT cannot be used"));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(102));
+}
+
+TEST_F(StreamFamilyTest, CompactNodes) {
+  // Every entry of s has the fields of the master entry, while the even ones of s2 do not.
+  vector<string> ids;
+  for (unsigned i = 1; i <= 100; ++i) {
+    ids.push_back(absl::StrCat(i, "-0"));
+    Run({"xadd", "s", ids.back(), "f", "v"});
+    if (i % 2) {
+      Run({"xadd", "s2", ids.back(), "b", "y", "c", "z"});
+    } else {
+      Run({"xadd", "s2", ids.back(), "a", absl::StrCat(i)});
+    }
+  }
+
+  vector<string_view> cmd = {"xdel", "s"};
+  cmd.insert(cmd.end(), ids.begin(), ids.begin() + 90);
+  EXPECT_THAT(Run(absl::MakeSpan(cmd)), IntArg(90));
+
+  cmd = {"xdel", "s2"};
+  for (unsigned i = 0; i < 100; i += 2) {
+    cmd.push_back(ids[i]);
+  }
+  EXPECT_THAT(Run(absl::MakeSpan(cmd)), IntArg(50));
+
+  auto compact = [&] {
+    atomic_uint popped{0};
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* shard) { popped += shard->db_slice().CompactStreams(0, 1000); });
+    return popped.load();
+  };
+
+  EXPECT_EQ(2u, compact());
+  EXPECT_EQ(0u, compact());
+  EXPECT_EQ(140u, service_->server_family().GetMetrics().events.stream_compacted_entries);
+
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(10));
+  auto resp = Run({"xrange", "s", "-", "+"});
+  ASSERT_THAT(resp, ArrLen(10));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("91-0", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[9].GetVec(), ElementsAre("100-0", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[9].GetVec()[1].GetVec(), ElementsAre("f", "v"));
+
+  resp = Run({"xrange", "s2", "-", "+"});
+  ASSERT_THAT(resp, ArrLen(50));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("2-0", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[0].GetVec()[1].GetVec(), ElementsAre("a", "2"));
+  EXPECT_THAT(resp.GetVec()[49].GetVec()[1].GetVec(), ElementsAre("a", "100"));
+  EXPECT_THAT(Run({"xrevrange", "s2", "50-0", "40-0"}), ArrLen(6));
+
+  // The compacted nodes take new entries and deletions as before.
+  Run({"xadd", "s", "101-0", "f", "v"});
+  EXPECT_THAT(Run({"xdel", "s", "91-0", "95-0"}), IntArg(2));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(9));
+  EXPECT_THAT(Run({"xrange", "s", "-", "+", "count", "1"}), ElementsAre("92-0", ArrLen(2)));
+  EXPECT_THAT(Run({"xrevrange", "s", "+", "-", "count", "1"}), ElementsAre("101-0", ArrLen(2)));
 }
 
-}  // namespace dfly
\ No newline at end of file
+}  // namespace dfly
@@ -4,16 +4,22 @@
 
 #include "server/string_family.h"
 
+#include <absl/flags/flag.h>
+
 extern "C" {
 #include "redis/object.h"
 }
 
 #include <absl/container/inlined_vector.h>
+#include <absl/numeric/bits.h>
+#include <absl/strings/strip.h>
 #include <double-conversion/string-to-double.h>
 
 #include "base/logging.h"
+#include "core/bitops.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
+#include "server/counter_combiner.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/io_mgr.h"
@@ -21,6 +27,11 @@ extern "C" {
 #include "server/transaction.h"
 #include "util/varz.h"
 
+ABSL_FLAG(bool, zero_copy_get, false,
+          "If true, GET replies are written directly from the shard memory instead of copying "
+          "the value in the shard thread first. Costs an additional hop per GET that releases "
+          "the key once the reply is sent, so it pays off only for large values");
+
 namespace dfly {
 
 namespace {
@@ -34,16 +45,11 @@ DEFINE_VARZ(VarzQps, set_qps);
 DEFINE_VARZ(VarzQps, get_qps);
 
 constexpr uint32_t kMaxStrLen = 1 << 28;
-constexpr uint32_t kMinTieredLen = TieredStorage::kMinBlobLen;
 
 string GetString(EngineShard* shard, const PrimeValue& pv) {
   string res;
   if (pv.IsExternal()) {
-    auto* tiered = shard->tiered_storage();
-    auto [offset, size] = pv.GetExternalPtr();
-    res.resize(size);
-
-    error_code ec = tiered->Read(offset, size, res.data());
+    error_code ec = shard->tiered_storage()->ReadValue(pv, &res);
     CHECK(!ec) << "TBD: " << ec;
   } else {
     pv.GetString(&res);
@@ -52,6 +58,32 @@ string GetString(EngineShard* shard, const PrimeValue& pv) {
   return res;
 }
 
+// Copies the value at it into dest. An external value is read without blocking the shard, its
+// read holds bc until dest has it, so the coordinator waits for bc once the hop has finished.
+void GetStringAsync(EngineShard* shard, DbIndex db_index, PrimeIterator it, string* dest,
+                    util::fibers_ext::BlockingCounter bc) {
+  const PrimeValue& pv = it->second;
+  if (!pv.IsExternal()) {
+    pv.GetString(dest);
+    return;
+  }
+
+  auto* tiered = shard->tiered_storage();
+  bc.Add(1);
+  tiered->ReadValueAsync(pv, dest, [bc](error_code ec) mutable {
+    CHECK(!ec) << "TBD: " << ec;
+    bc.Dec();
+  });
+  tiered->RecordRead(db_index, it);
+}
+
+// Returns true if pv can be read by the coordinator thread via pv.AsRef() as long as its key
+// stays locked. Expiry, eviction and tiering free values without taking the key lock, so we
+// exclude the values they could touch.
+bool CanReadByRef(EngineShard* shard, const PrimeValue& pv) {
+  return pv.IsThreadSafeRef() && !pv.HasExpire() && !shard->tiered_storage();
+}
+
 string_view GetSlice(EngineShard* shard, const PrimeValue& pv, string* tmp) {
   if (pv.IsExternal()) {
     *tmp = GetString(shard, pv);
@@ -91,7 +123,7 @@ OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t sta
     db_slice.PreUpdate(op_args.db_ind, it);
   }
   memcpy(s.data() + start, value.data(), value.size());
-  it->second.SetString(s);
+  it->second.SetValueString(s);
   db_slice.PostUpdate(op_args.db_ind, it);
 
   return it->second.Size();
@@ -123,12 +155,500 @@ OpResult<string> OpGetRange(const OpArgs& op_args, string_view key, int32_t star
   if (size_t(end) >= strlen)
     end = strlen - 1;
 
+  size_t len = end - start + 1;
+  if (co.IsExternal()) {
+    string res;
+    error_code ec = op_args.shard->tiered_storage()->ReadValueRange(co, start, len, &res);
+    CHECK(!ec) << "TBD: " << ec;
+    return res;
+  }
+
   string tmp;
-  string_view slice = GetSlice(op_args.shard, co, &tmp);
+  string_view slice = co.GetSlice(&tmp);
+
+  return string(slice.substr(start, len));
+};
+
+inline const uint8_t* U8(string_view s) {
+  return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+// Normalizes the redis range [start, end] over len units. Returns false if it is empty.
+bool NormalizeRange(int64_t len, int64_t* start, int64_t* end) {
+  if (*start < 0)
+    *start = max<int64_t>(len + *start, 0);
+  if (*end < 0)
+    *end = max<int64_t>(len + *end, 0);
+  if (*end >= len)
+    *end = len - 1;
+
+  return len > 0 && *start <= *end;
+}
+
+// Masks the bits of the byte at index i that fall out of the bit range [first, last].
+inline uint8_t MaskEdges(uint8_t b, size_t i, uint64_t first, uint64_t last) {
+  if (i == first / 8)
+    b &= 0xff >> (first % 8);
+  if (i == last / 8)
+    b &= 0xff << (7 - last % 8);
+  return b;
+}
+
+// Counts the set bits in the bit range [first, last] of s.
+uint64_t CountBitRange(string_view s, uint64_t first, uint64_t last) {
+  const uint8_t* p = U8(s);
+  size_t fb = first / 8, lb = last / 8;
+
+  uint64_t res = absl::popcount(MaskEdges(p[fb], fb, first, last));
+  if (fb == lb)
+    return res;
+
+  res += absl::popcount(MaskEdges(p[lb], lb, first, last));
+  return res + CountBits(p + fb + 1, lb - fb - 1);
+}
+
+// Returns the position of the first bit in the bit range [first, last] of s that equals bit,
+// or -1.
+int64_t FindBitRange(string_view s, uint64_t first, uint64_t last, bool bit) {
+  const uint8_t* p = U8(s);
+  size_t fb = first / 8, lb = last / 8;
+  auto edge = [&](size_t i) -> uint8_t {
+    return MaskEdges(bit ? p[i] : static_cast<uint8_t>(~p[i]), i, first, last);
+  };
+
+  if (uint8_t b = edge(fb))
+    return fb * 8 + absl::countl_zero(b);
+  if (fb == lb)
+    return -1;
+
+  int64_t pos = FindFirstBit(p + fb + 1, lb - fb - 1, bit);
+  if (pos >= 0)
+    return (fb + 1) * 8 + pos;
+
+  if (uint8_t b = edge(lb))
+    return lb * 8 + absl::countl_zero(b);
+  return -1;
+}
+
+// Returns the previous value of the bit.
+OpResult<bool> OpSetBit(const OpArgs& op_args, string_view key, uint64_t offset, bool bit) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+
+  string s;
+  if (!added) {
+    if (it->second.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+    s = GetString(op_args.shard, it->second);
+  }
+
+  size_t byte = offset / 8;
+  uint8_t mask = 0x80 >> (offset % 8);
+  if (s.size() <= byte)
+    s.resize(byte + 1);
+
+  bool prev = s[byte] & mask;
+  if (bit)
+    s[byte] |= mask;
+  else
+    s[byte] &= ~mask;
+
+  if (!added)
+    db_slice.PreUpdate(op_args.db_ind, it);
+  it->second.SetValueString(s);
+  db_slice.PostUpdate(op_args.db_ind, it);
+
+  return prev;
+}
+
+OpResult<bool> OpGetBit(const OpArgs& op_args, string_view key, uint64_t offset) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  string tmp;
+  string_view slice = GetSlice(op_args.shard, it_res.value()->second, &tmp);
+  size_t byte = offset / 8;
+  if (byte >= slice.size())
+    return false;
+
+  return bool(slice[byte] & (0x80 >> (offset % 8)));
+}
+
+struct BitRange {
+  int64_t start = 0;
+  int64_t end = -1;
+  bool end_given = false;
+  bool in_bits = false;  // BIT, otherwise the range is in bytes.
+};
+
+// Parses [start end [BYTE|BIT]] that begins at args[pos].
+OpResult<BitRange> ParseBitRange(CmdArgList args, size_t pos) {
+  BitRange range;
+  if (args.size() <= pos)
+    return range;
+
+  if (!absl::SimpleAtoi(ArgS(args, pos), &range.start))
+    return OpStatus::INVALID_INT;
+
+  if (args.size() > pos + 1) {
+    if (!absl::SimpleAtoi(ArgS(args, pos + 1), &range.end))
+      return OpStatus::INVALID_INT;
+    range.end_given = true;
+  }
+
+  if (args.size() > pos + 2) {
+    ToUpper(&args[pos + 2]);
+    string_view unit = ArgS(args, pos + 2);
+    if (args.size() > pos + 3 || (unit != "BYTE" && unit != "BIT"))
+      return OpStatus::SYNTAX_ERR;
+    range.in_bits = unit == "BIT";
+  }
+
+  return range;
+}
+
+OpResult<uint64_t> OpBitCount(const OpArgs& op_args, string_view key, BitRange range) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  string tmp;
+  string_view slice = GetSlice(op_args.shard, it_res.value()->second, &tmp);
+  int64_t len = range.in_bits ? slice.size() * 8 : slice.size();
+  if (!NormalizeRange(len, &range.start, &range.end))
+    return 0;
+
+  if (!range.in_bits) {
+    return CountBits(U8(slice) + range.start, range.end - range.start + 1);
+  }
+  return CountBitRange(slice, range.start, range.end);
+}
+
+OpResult<int64_t> OpBitPos(const OpArgs& op_args, string_view key, bool bit, BitRange range) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  string tmp;
+  string_view slice = GetSlice(op_args.shard, it_res.value()->second, &tmp);
+  int64_t len = range.in_bits ? slice.size() * 8 : slice.size();
+  if (!NormalizeRange(len, &range.start, &range.end))
+    return -1;
+
+  uint64_t first = range.start, last = range.end;
+  if (!range.in_bits) {
+    first *= 8;
+    last = last * 8 + 7;
+  }
+
+  int64_t pos = FindBitRange(slice, first, last, bit);
+
+  // Like in redis, a string is padded with zeros on the right unless the range ends explicitly.
+  if (pos < 0 && !bit && !range.end_given)
+    return last + 1;
+  return pos;
+}
+
+// Folds src into acc. Missing bytes of the shorter operand count as zeros.
+void FoldBitOp(BitOp op, string_view src, optional<string>* acc) {
+  if (!acc->has_value()) {
+    string& dest = acc->emplace(src);
+    if (op == BitOp::NOT) {
+      uint8_t* p = reinterpret_cast<uint8_t*>(dest.data());
+      ApplyBitOp(BitOp::NOT, p, dest.size(), p);
+    }
+    return;
+  }
+
+  DCHECK(op != BitOp::NOT);
+  string& dest = **acc;
+  if (dest.size() < src.size())
+    dest.resize(src.size());
+
+  ApplyBitOp(op, U8(src), src.size(), reinterpret_cast<uint8_t*>(dest.data()));
+  if (op == BitOp::AND)
+    memset(dest.data() + src.size(), 0, dest.size() - src.size());
+}
+
+// Reduces the source keys hosted by the shard. Returns nullopt if the shard has only the
+// destination key.
+OpResult<optional<string>> OpBitOpFold(BitOp op, Transaction* t, EngineShard* shard) {
+  ShardId sid = shard->shard_id();
+  ArgSlice keys = t->ShardArgsInShard(sid);
+  auto& db_slice = shard->db_slice();
+  optional<string> acc;
+
+  for (size_t j = 0; j < keys.size(); ++j) {
+    // The destination is at index 1 after {op}, it may also be passed as a source.
+    if (t->ReverseArgIndex(sid, j) == 1)
+      continue;
+
+    OpResult<PrimeIterator> it_res = db_slice.Find(t->db_index(), keys[j], OBJ_STRING);
+    if (it_res == OpStatus::WRONG_TYPE)
+      return it_res.status();
+
+    string tmp;
+    string_view src = it_res ? GetSlice(shard, it_res.value()->second, &tmp) : string_view{};
+    FoldBitOp(op, src, &acc);
+  }
+
+  return acc;
+}
+
+void OpBitOpStore(const OpArgs& op_args, string_view key, string_view value) {
+  auto& db_slice = op_args.shard->db_slice();
+  if (value.empty()) {
+    auto it = db_slice.FindExt(op_args.db_ind, key).first;
+    db_slice.Del(op_args.db_ind, it);
+    return;
+  }
+
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+  if (!added) {
+    db_slice.PreUpdate(op_args.db_ind, it);
+    op_args.shard->LazyFreeIfNeeded(&it->second, false);
+  }
+  it->second.SetValueString(value);
+  db_slice.PostUpdate(op_args.db_ind, it);
+}
+
+struct BitFieldOp {
+  enum Kind : uint8_t { GET, SET, INCRBY };
+  enum Overflow : uint8_t { WRAP, SAT, FAIL };
 
-  return string(slice.substr(start, end - start + 1));
+  Kind kind;
+  Overflow overflow;
+  bool is_signed;
+  uint8_t bits;
+  uint64_t offset;
+  int64_t value;  // SET and INCRBY argument.
 };
 
+// Reads bits from offset, the bits past the end of s are zeros.
+uint64_t GetBitField(string_view s, uint64_t offset, uint8_t bits) {
+  uint64_t res = 0;
+  for (uint8_t j = 0; j < bits; ++j, ++offset) {
+    size_t byte = offset / 8;
+    uint64_t bitval = byte < s.size() ? (uint8_t(s[byte]) >> (7 - offset % 8)) & 1 : 0;
+    res = (res << 1) | bitval;
+  }
+  return res;
+}
+
+void SetBitField(uint64_t value, uint64_t offset, uint8_t bits, string* s) {
+  for (uint8_t j = 0; j < bits; ++j, ++offset) {
+    uint8_t mask = 0x80 >> (offset % 8);
+    char& c = (*s)[offset / 8];
+    c = (value >> (bits - 1 - j)) & 1 ? (c | mask) : (c & ~mask);
+  }
+}
+
+// Returns true if value + incr does not fit into the field, in which case res is set
+// according to overflow. Otherwise res is set to the sum.
+bool CheckUnsignedOverflow(uint64_t value, int64_t incr, uint8_t bits,
+                           BitFieldOp::Overflow overflow, uint64_t* res) {
+  uint64_t max = (uint64_t(1) << bits) - 1;  // bits <= 63
+  __int128 sum = __int128(value) + incr;
+  if (sum >= 0 && sum <= max) {
+    *res = sum;
+    return false;
+  }
+
+  if (overflow == BitFieldOp::WRAP)
+    *res = uint64_t(sum) & max;
+  else if (overflow == BitFieldOp::SAT)
+    *res = sum < 0 ? 0 : max;
+  return true;
+}
+
+bool CheckSignedOverflow(int64_t value, int64_t incr, uint8_t bits, BitFieldOp::Overflow overflow,
+                         int64_t* res) {
+  int64_t max = bits == 64 ? INT64_MAX : (int64_t(1) << (bits - 1)) - 1;
+  int64_t min = -max - 1;
+  __int128 sum = __int128(value) + incr;
+  if (sum >= min && sum <= max) {
+    *res = sum;
+    return false;
+  }
+
+  if (overflow == BitFieldOp::WRAP) {
+    uint64_t c = uint64_t(sum);
+    if (bits < 64) {
+      uint64_t mask = UINT64_MAX << bits;
+      c = (c & (uint64_t(1) << (bits - 1))) ? (c | mask) : (c & ~mask);
+    }
+    *res = c;
+  } else if (overflow == BitFieldOp::SAT) {
+    *res = sum > max ? max : min;
+  }
+  return true;
+}
+
+// Runs a single BITFIELD operation over s, returns nullopt if FAIL prevented it.
+optional<int64_t> RunBitFieldOp(const BitFieldOp& op, string* s) {
+  uint64_t prev = GetBitField(*s, op.offset, op.bits);
+  int64_t sprev = prev;
+  if (op.is_signed && op.bits < 64 && (prev & (uint64_t(1) << (op.bits - 1))))
+    sprev = prev | (UINT64_MAX << op.bits);
+
+  if (op.kind == BitFieldOp::GET)
+    return op.is_signed ? sprev : int64_t(prev);
+
+  // SET stores the value as is, INCRBY adds it to the previous one.
+  bool overflow;
+  uint64_t store;
+  if (op.is_signed) {
+    int64_t res;
+    overflow = op.kind == BitFieldOp::SET
+                   ? CheckSignedOverflow(op.value, 0, op.bits, op.overflow, &res)
+                   : CheckSignedOverflow(sprev, op.value, op.bits, op.overflow, &res);
+    store = res;
+  } else {
+    overflow = op.kind == BitFieldOp::SET
+                   ? CheckUnsignedOverflow(op.value, 0, op.bits, op.overflow, &store)
+                   : CheckUnsignedOverflow(prev, op.value, op.bits, op.overflow, &store);
+  }
+
+  if (overflow && op.overflow == BitFieldOp::FAIL)
+    return nullopt;
+
+  SetBitField(store, op.offset, op.bits, s);
+  if (op.kind == BitFieldOp::SET)
+    return op.is_signed ? sprev : int64_t(prev);
+
+  // INCRBY replies with the new value, the signed one is already sign extended.
+  return int64_t(store);
+}
+
+using BitFieldResult = vector<optional<int64_t>>;
+
+OpResult<BitFieldResult> OpBitField(const OpArgs& op_args, string_view key,
+                                    const vector<BitFieldOp>& ops) {
+  auto& db_slice = op_args.shard->db_slice();
+
+  // The string is extended to the highest bit that is written to.
+  size_t min_len = 0;
+  for (const auto& op : ops) {
+    if (op.kind != BitFieldOp::GET)
+      min_len = max<size_t>(min_len, (op.offset + op.bits + 7) / 8);
+  }
+
+  string s;
+  PrimeIterator it;
+  bool added = false;
+
+  if (min_len == 0) {
+    OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_ind, key, OBJ_STRING);
+    if (it_res == OpStatus::WRONG_TYPE)
+      return it_res.status();
+    if (it_res)
+      s = GetString(op_args.shard, it_res.value()->second);
+  } else {
+    tie(it, added) = db_slice.AddOrFind(op_args.db_ind, key);
+    if (!added) {
+      if (it->second.ObjType() != OBJ_STRING)
+        return OpStatus::WRONG_TYPE;
+      s = GetString(op_args.shard, it->second);
+    }
+    if (s.size() < min_len)
+      s.resize(min_len);
+  }
+
+  BitFieldResult res(ops.size());
+  for (size_t i = 0; i < ops.size(); ++i) {
+    res[i] = RunBitFieldOp(ops[i], &s);
+  }
+
+  if (min_len > 0) {
+    if (!added)
+      db_slice.PreUpdate(op_args.db_ind, it);
+    it->second.SetValueString(s);
+    db_slice.PostUpdate(op_args.db_ind, it);
+  }
+
+  return res;
+}
+
+// The parameters of CL.THROTTLE, the intervals are in microseconds.
+struct ThrottleParams {
+  int64_t emission_interval;  // between the requests at the sustained rate.
+  int64_t tolerance;          // the burst on top of the first request.
+  int64_t increment;          // the interval of the requested quantity.
+};
+
+struct ThrottleResult {
+  bool limited;
+  int64_t remaining;
+  int64_t retry_after_us;  // -1 if the request is allowed or can never be.
+  int64_t reset_after_us;  // until the limit is fully replenished.
+};
+
+// The generic cell rate algorithm: the key holds the theoretical arrival time of the next
+// request, which advances by the interval of every allowed request. A request is allowed
+// unless it would push that time past now by more than the burst tolerance. The key expires
+// once the time passes, when the limit is fully replenished again.
+OpResult<ThrottleResult> OpThrottle(const OpArgs& op_args, string_view key,
+                                    const ThrottleParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  int64_t now = int64_t(db_slice.Now()) * 1000;
+
+  auto [it, expire_it] = db_slice.FindExt(op_args.db_ind, key);
+  int64_t tat = now;
+  if (IsValid(it)) {
+    if (it->second.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+
+    optional<int64_t> stored = it->second.TryGetInt();
+    if (!stored)
+      return OpStatus::INVALID_VALUE;
+    tat = max(*stored, now);
+  }
+
+  int64_t new_tat;
+  if (__builtin_add_overflow(tat, params.increment, &new_tat))
+    return OpStatus::OUT_OF_RANGE;
+
+  int64_t diff = now - (new_tat - params.tolerance);
+
+  ThrottleResult res{diff < 0, 0, -1, 0};
+  int64_t ttl = tat - now;
+  if (res.limited) {
+    if (params.increment <= params.tolerance)
+      res.retry_after_us = -diff;
+  } else if (new_tat > now) {
+    ttl = new_tat - now;
+    uint64_t expire_at = db_slice.Now() + (ttl + 999) / 1000;
+    if (!IsValid(it)) {
+      CompactObj cobj;
+      cobj.SetInt(new_tat);
+      try {
+        db_slice.AddNew(op_args.db_ind, key, std::move(cobj), expire_at);
+      } catch (bad_alloc&) {
+        return OpStatus::OUT_OF_MEMORY;
+      }
+    } else {
+      DCHECK(!it->second.IsExternal());
+      db_slice.PreUpdate(op_args.db_ind, it);
+      it->second.SetInt(new_tat);
+      db_slice.PostUpdate(op_args.db_ind, it);
+      if (IsValid(expire_it))
+        db_slice.UpdateExpireTime(op_args.db_ind, it, expire_it, expire_at);
+      else
+        db_slice.UpdateExpire(op_args.db_ind, it, expire_at);
+    }
+  } else if (IsValid(it)) {
+    // A request of quantity 0 at a fully replenished limit leaves nothing to remember.
+    db_slice.Del(op_args.db_ind, it);
+  }
+
+  int64_t next = params.tolerance - ttl;
+  if (next > -params.emission_interval)
+    res.remaining = next / params.emission_interval;
+  res.reset_after_us = ttl;
+  return res;
+}
+
 }  // namespace
 
 SetCmd::SetCmd(DbSlice* db_slice) : db_slice_(*db_slice) {
@@ -143,6 +663,15 @@ OpResult<void> SetCmd::Set(const SetParams& params, std::string_view key, std::s
 
   VLOG(2) << "Set " << key << "(" << db_slice_.shard_id() << ") ";
 
+  if (params.how == SET_IF_CAS) {
+    auto [it, expire_it] = db_slice_.FindExt(params.db_index, key);
+    if (!IsValid(it))
+      return OpStatus::KEY_NOTFOUND;
+    if (DbSlice::CasUnique(it) != params.cas_unique)
+      return OpStatus::KEY_EXISTS;
+    return SetExisting(params, it, expire_it, value);
+  }
+
   if (params.how == SET_IF_EXISTS) {
     auto [it, expire_it] = db_slice_.FindExt(params.db_index, key);
 
@@ -166,9 +695,7 @@ OpResult<void> SetCmd::Set(const SetParams& params, std::string_view key, std::s
   }
 
   // adding new value.
-  PrimeValue tvalue{value};
-  tvalue.SetFlag(params.memcache_flags != 0);
-  it->second = std::move(tvalue);
+  it->second.SetValueString(value);
   db_slice_.PostUpdate(params.db_index, it);
 
   if (params.expire_after_ms) {
@@ -176,15 +703,7 @@ OpResult<void> SetCmd::Set(const SetParams& params, std::string_view key, std::s
   }
 
   if (params.memcache_flags)
-    db_slice_.SetMCFlag(params.db_index, it->first.AsRef(), params.memcache_flags);
-
-  EngineShard* shard = db_slice_.shard_owner();
-
-  if (shard->tiered_storage()) {  // external storage enabled.
-    if (value.size() >= kMinTieredLen) {
-      shard->tiered_storage()->UnloadItem(params.db_index, it);
-    }
-  }
+    db_slice_.SetMCFlag(params.db_index, it, params.memcache_flags);
 
   return OpStatus::OK;
 }
@@ -205,7 +724,7 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
 
   uint64_t at_ms = params.expire_after_ms ? params.expire_after_ms + db_slice_.Now() : 0;
   if (IsValid(e_it) && at_ms) {
-    e_it->second = db_slice_.FromAbsoluteTime(at_ms);
+    db_slice_.UpdateExpireTime(params.db_index, it, e_it, at_ms);
   } else {
     bool changed = db_slice_.UpdateExpire(params.db_index, it, at_ms);
     if (changed && at_ms == 0)  // erased.
@@ -214,24 +733,14 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
 
   db_slice_.PreUpdate(params.db_index, it);
 
-  // Check whether we need to update flags table.
-  bool req_flag_update = (params.memcache_flags != 0) != prime_value.HasFlag();
-  if (req_flag_update) {
-    prime_value.SetFlag(params.memcache_flags != 0);
-    db_slice_.SetMCFlag(params.db_index, it->first.AsRef(), params.memcache_flags);
-  }
-
-  // overwrite existing entry.
-  prime_value.SetString(value);
-
-  if (value.size() >= kMinTieredLen) {  // external storage enabled.
-    EngineShard* shard = db_slice_.shard_owner();
-
-    if (shard->tiered_storage()) {
-      shard->tiered_storage()->UnloadItem(params.db_index, it);
-    }
+  if (params.memcache_flags || prime_value.HasFlag()) {
+    db_slice_.SetMCFlag(params.db_index, it, params.memcache_flags);
   }
 
+  // overwrite existing entry. A big container that is overwritten by a string is released in
+  // the background.
+  db_slice_.shard_owner()->LazyFreeIfNeeded(&prime_value, false);
+  prime_value.SetValueString(value);
   db_slice_.PostUpdate(params.db_index, it);
 
   return OpStatus::OK;
@@ -245,6 +754,10 @@ void StringFamily::Set(CmdArgList args, ConnectionContext* cntx) {
 
   SetCmd::SetParams sparams{cntx->db_index()};
   sparams.memcache_flags = cntx->conn_state.memcache_flag;
+  if (cntx->conn_state.memcache_cas) {
+    sparams.how = SetCmd::SET_IF_CAS;
+    sparams.cas_unique = *cntx->conn_state.memcache_cas;
+  }
 
   int64_t int_arg;
   SinkReplyBuilder* builder = cntx->reply_builder();
@@ -305,6 +818,15 @@ void StringFamily::Set(CmdArgList args, ConnectionContext* cntx) {
     return builder->SendError(kOutOfMemory);
   }
 
+  // Relevant only for the memcached cas.
+  if (result == OpStatus::KEY_NOTFOUND) {
+    return static_cast<MCReplyBuilder*>(builder)->SendNotFound();
+  }
+
+  if (result == OpStatus::KEY_EXISTS) {
+    return static_cast<MCReplyBuilder*>(builder)->SendExists();
+  }
+
   CHECK_EQ(result, OpStatus::SKIPPED);  // in case of NX option
 
   return builder->SendSetSkipped();
@@ -319,19 +841,32 @@ void StringFamily::Get(CmdArgList args, ConnectionContext* cntx) {
 
   std::string_view key = ArgS(args, 1);
 
+  if (absl::GetFlag(FLAGS_zero_copy_get) && !cntx->transaction->IsMulti()) {
+    GetByRef(key, cntx);
+    return;
+  }
+
+  string value;
+  util::fibers_ext::BlockingCounter read_bc{0};
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGet(OpArgs{shard, t->db_index()}, key);
+    OpResult<PrimeIterator> it_res = shard->db_slice().Find(t->db_index(), key, OBJ_STRING);
+    if (!it_res)
+      return it_res.status();
+
+    GetStringAsync(shard, t->db_index(), it_res.value(), &value, read_bc);
+    return OpStatus::OK;
   };
 
-  DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
+  DVLOG(1) << "Before Get::ScheduleSingleHop " << key;
   Transaction* trans = cntx->transaction;
-  OpResult<string> result = trans->ScheduleSingleHopT(std::move(cb));
+  OpStatus status = trans->ScheduleSingleHop(std::move(cb));
+  read_bc.Wait();
 
-  if (result) {
-    DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << result.value();
-    (*cntx)->SendBulkString(*result);
+  if (status == OpStatus::OK) {
+    DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << value;
+    (*cntx)->SendBulkString(value);
   } else {
-    switch (result.status()) {
+    switch (status) {
       case OpStatus::WRONG_TYPE:
         (*cntx)->SendError(kWrongTypeErr);
         break;
@@ -342,6 +877,51 @@ void StringFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+// Runs GET in two hops. The first one passes a reference to the value instead of copying it,
+// the second one releases the read lock on the key after the reply has been sent. The lock
+// prevents writers from mutating or deleting the value meanwhile.
+void StringFamily::GetByRef(std::string_view key, ConnectionContext* cntx) {
+  Transaction* trans = cntx->transaction;
+  PrimeValue ref;
+  string value;
+  bool by_ref = false;
+  OpStatus status = OpStatus::OK;
+  util::fibers_ext::BlockingCounter read_bc{0};
+
+  auto read_cb = [&](Transaction* t, EngineShard* shard) {
+    OpResult<PrimeIterator> it_res = shard->db_slice().Find(t->db_index(), key, OBJ_STRING);
+    if (!it_res) {
+      status = it_res.status();
+      return status;
+    }
+
+    const PrimeValue& pv = it_res.value()->second;
+    by_ref = CanReadByRef(shard, pv);
+    if (by_ref) {
+      ref = pv.AsRef();
+    } else {
+      GetStringAsync(shard, t->db_index(), it_res.value(), &value, read_bc);
+    }
+    return OpStatus::OK;
+  };
+
+  trans->Schedule();
+  trans->Execute(std::move(read_cb), false);
+  read_bc.Wait();
+
+  if (status == OpStatus::OK) {
+    // For ascii-encoded values this decodes on the coordinator thread.
+    string_view slice = by_ref ? ref.GetSlice(&value) : string_view{value};
+    (*cntx)->SendBulkString(slice);
+  } else if (status == OpStatus::WRONG_TYPE) {
+    (*cntx)->SendError(kWrongTypeErr);
+  } else {
+    (*cntx)->SendNull();
+  }
+
+  trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+}
+
 void StringFamily::GetSet(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
   std::string_view value = ArgS(args, 2);
@@ -350,16 +930,15 @@ void StringFamily::GetSet(CmdArgList args, ConnectionContext* cntx) {
   SetCmd::SetParams sparams{cntx->db_index()};
   sparams.prev_val = &prev_val;
 
-  ShardId sid = Shard(key, shard_set->size());
-  OpResult<void> result = shard_set->Await(sid, [&] {
-    EngineShard* es = EngineShard::tlocal();
-    SetCmd cmd(&es->db_slice());
-
-    return cmd.Set(sparams, key, value);
-  });
+  // Runs as a transaction since squashed pipelines execute it from within its shard.
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpStatus {
+    SetCmd cmd(&shard->db_slice());
+    return cmd.Set(sparams, key, value).status();
+  };
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
 
-  if (!result) {
-    (*cntx)->SendError(result.status());
+  if (status != OpStatus::OK) {
+    (*cntx)->SendError(status);
     return;
   }
 
@@ -443,6 +1022,16 @@ void StringFamily::Prepend(CmdArgList args, ConnectionContext* cntx) {
 void StringFamily::IncrByGeneric(std::string_view key, int64_t val, ConnectionContext* cntx) {
   bool skip_on_missing = cntx->protocol() == Protocol::MEMCACHE;
 
+  // The increments within transactions and scripts must run in order with their other commands.
+  DbIndex db = cntx->db_index();
+  bool combined = !skip_on_missing && CounterCombiner::IsCombined(key) &&
+                  cntx->conn_state.exec_state == ConnectionState::EXEC_INACTIVE &&
+                  !cntx->conn_state.script_info;
+  if (combined) {
+    if (optional<int64_t> res = CounterCombiner::TryAdd(db, key, val); res)
+      return cntx->reply_builder()->SendLong(*res);
+  }
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
     OpResult<int64_t> res = OpIncrBy(OpArgs{shard, t->db_index()}, key, val, skip_on_missing);
     return res;
@@ -454,6 +1043,8 @@ void StringFamily::IncrByGeneric(std::string_view key, int64_t val, ConnectionCo
   DVLOG(2) << "IncrByGeneric " << key << "/" << result.value();
   switch (result.status()) {
     case OpStatus::OK:
+      if (combined)
+        CounterCombiner::SetValue(db, key, result.value());
       builder->SendLong(result.value());
       break;
     case OpStatus::INVALID_VALUE:
@@ -536,26 +1127,39 @@ void StringFamily::SetExGeneric(bool seconds, CmdArgList args, ConnectionContext
 void StringFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
   DCHECK_GT(args.size(), 1U);
 
+  // Scripts need the replies parsed, so they get them the regular way.
+  if (cntx->protocol() == Protocol::REDIS && !cntx->conn_state.script_info) {
+    return MGetResp(args, cntx);
+  }
+
   Transaction* transaction = cntx->transaction;
   unsigned shard_count = shard_set->size();
   std::vector<MGetResponse> mget_resp(shard_count);
 
   ConnectionContext* dfly_cntx = static_cast<ConnectionContext*>(cntx);
   bool fetch_mcflag = cntx->protocol() == Protocol::MEMCACHE;
-  bool fetch_mcver =
-      fetch_mcflag && (dfly_cntx->conn_state.memcache_flag & ConnectionState::FETCH_CAS_VER);
+  uint32_t mc_mask = fetch_mcflag ? dfly_cntx->conn_state.memcache_flag : 0;
+
+  // If the optimistic run fails, the callbacks run again while the external reads of the first
+  // run may still be in flight, so its responses are kept until the reads finish.
+  util::fibers_ext::BlockingCounter read_bc{0};
+  std::vector<std::vector<MGetResponse>> retired(shard_count);
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
     ShardId sid = shard->shard_id();
-    mget_resp[sid] = OpMGet(fetch_mcflag, fetch_mcver, t, shard);
+    if (!mget_resp[sid].empty())
+      retired[sid].push_back(std::move(mget_resp[sid]));
+    mget_resp[sid] = OpMGet(fetch_mcflag, mc_mask, t, shard, read_bc);
     return OpStatus::OK;
   };
 
   // MGet requires locking as well. For example, if coordinator A applied W(x) and then W(y)
   // it necessarily means that whoever observed y, must observe x.
   // Without locking, mget x y could read stale x but latest y.
-  OpStatus result = transaction->ScheduleSingleHop(std::move(cb));
+  // The optimistic run preserves this by validating that no writes happened meanwhile.
+  OpStatus result = transaction->ScheduleReadOptimistic(std::move(cb));
   CHECK_EQ(OpStatus::OK, result);
+  read_bc.Wait();
 
   // reorder the responses back according to the order of their corresponding keys.
   vector<SinkReplyBuilder::OptResp> res(args.size() - 1);
@@ -582,12 +1186,77 @@ void StringFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
       dest.value = std::move(src.value);
       dest.mc_flag = src.mc_flag;
       dest.mc_ver = src.mc_ver;
+      dest.mc_ttl = src.mc_ttl;
     }
   }
 
   return cntx->reply_builder()->SendMGetResponse(res.data(), res.size());
 }
 
+void StringFamily::MGetResp(CmdArgList args, ConnectionContext* cntx) {
+  Transaction* transaction = cntx->transaction;
+  unsigned shard_count = shard_set->size();
+  std::vector<MGetShardReply> replies(shard_count);
+
+  // Like in MGet, the replies of a failed optimistic run are kept until their reads finish.
+  util::fibers_ext::BlockingCounter read_bc{0};
+  std::vector<std::vector<MGetShardReply>> retired(shard_count);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    if (!replies[sid].ends.empty())
+      retired[sid].push_back(std::move(replies[sid]));
+    replies[sid] = OpMGetResp(t, shard, read_bc);
+    return OpStatus::OK;
+  };
+
+  OpStatus result = transaction->ScheduleReadOptimistic(std::move(cb));
+  CHECK_EQ(OpStatus::OK, result);
+  read_bc.Wait();
+
+  // Maps every key back to its shard.
+  size_t num_keys = args.size() - 1;
+  std::vector<pair<ShardId, uint32_t>> loc(num_keys);
+  for (ShardId sid = 0; sid < shard_count; ++sid) {
+    if (!transaction->IsActive(sid))
+      continue;
+
+    DCHECK_EQ(transaction->ShardArgsInShard(sid).size(), replies[sid].ends.size());
+    for (uint32_t j = 0; j < replies[sid].ends.size(); ++j) {
+      loc[transaction->ReverseArgIndex(sid, j)] = {sid, j};
+    }
+  }
+
+  // The keys of a shard come in the order of their indices, so the consecutive keys of a shard
+  // are adjacent in its buffer and are sent as a single part.
+  string header = absl::StrCat("*", num_keys, "\r\n");
+  std::vector<string_view> parts{header};
+  std::vector<size_t> next_ext(shard_count, 0);
+  for (auto [sid, j] : loc) {
+    const MGetShardReply& reply = replies[sid];
+    size_t start = j ? reply.ends[j - 1] : 0;
+    string_view cur{reply.buf.data() + start, reply.ends[j] - start};
+    string_view& last = parts.back();
+    if (last.data() + last.size() == cur.data())
+      last = string_view{last.data(), last.size() + cur.size()};
+    else
+      parts.push_back(cur);
+
+    size_t& ext_pos = next_ext[sid];
+    if (ext_pos < reply.ext.size() && reply.ext[ext_pos].first == j) {
+      parts.push_back(reply.ext[ext_pos++].second);
+      parts.push_back("\r\n");
+    }
+  }
+
+  // Sent in chunks to bound the size of the io vectors.
+  constexpr size_t kMaxParts = 64;
+  for (size_t i = 0; i < parts.size(); i += kMaxParts) {
+    size_t len = std::min(kMaxParts, parts.size() - i);
+    (*cntx)->SendRawVec(absl::Span<const string_view>{parts.data() + i, len});
+  }
+}
+
 void StringFamily::MSet(CmdArgList args, ConnectionContext* cntx) {
   Transaction* transaction = cntx->transaction;
 
@@ -655,6 +1324,7 @@ void StringFamily::StrLen(CmdArgList args, ConnectionContext* cntx) {
     if (!it_res.ok())
       return it_res.status();
 
+    // The size of an external value is kept in its pointer, so it is not read.
     return it_res.value()->second.Size();
   };
 
@@ -725,38 +1395,395 @@ void StringFamily::SetRange(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void StringFamily::SetBit(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  uint64_t offset;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &offset) || offset >= uint64_t(kMaxStrLen) * 8) {
+    return (*cntx)->SendError("bit offset is not an integer or out of range");
+  }
+
+  string_view val = ArgS(args, 3);
+  if (val != "0" && val != "1") {
+    return (*cntx)->SendError("bit is not an integer or out of range");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpSetBit(OpArgs{shard, t->db_index()}, key, offset, val == "1");
+  };
+
+  OpResult<bool> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+  (*cntx)->SendLong(result.value());
+}
+
+void StringFamily::GetBit(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  uint64_t offset;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &offset) || offset >= uint64_t(kMaxStrLen) * 8) {
+    return (*cntx)->SendError("bit offset is not an integer or out of range");
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGetBit(OpArgs{shard, t->db_index()}, key, offset);
+  };
+
+  OpResult<bool> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE) {
+    return (*cntx)->SendError(result.status());
+  }
+  (*cntx)->SendLong(result.value_or(false));
+}
+
+void StringFamily::BitCount(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  // Unlike BITPOS, the range must have both of its ends.
+  if (args.size() == 3) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  OpResult<BitRange> range = ParseBitRange(args, 2);
+  if (!range) {
+    return (*cntx)->SendError(range.status());
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpBitCount(OpArgs{shard, t->db_index()}, key, *range);
+  };
+
+  OpResult<uint64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE) {
+    return (*cntx)->SendError(result.status());
+  }
+  (*cntx)->SendLong(result.value_or(0));
+}
+
+void StringFamily::BitPos(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view bit_s = ArgS(args, 2);
+  if (bit_s != "0" && bit_s != "1") {
+    return (*cntx)->SendError("The bit argument must be 1 or 0.");
+  }
+  bool bit = bit_s == "1";
+
+  OpResult<BitRange> range = ParseBitRange(args, 3);
+  if (!range) {
+    return (*cntx)->SendError(range.status());
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpBitPos(OpArgs{shard, t->db_index()}, key, bit, *range);
+  };
+
+  OpResult<int64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  switch (result.status()) {
+    case OpStatus::OK:
+      return (*cntx)->SendLong(result.value());
+    case OpStatus::KEY_NOTFOUND:
+      // A missing key is an empty string padded with zeros.
+      return (*cntx)->SendLong(bit ? -1 : 0);
+    default:
+      return (*cntx)->SendError(result.status());
+  }
+}
+
+// BITOP is executed in two hops. The first one reduces the sources of each shard into a single
+// string, the second one reduces the strings of the shards and stores the result in the shard
+// of the destination key.
+void StringFamily::BitOpCmd(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view op_s = ArgS(args, 1);
+  string_view dest_key = ArgS(args, 2);
+
+  BitOp op;
+  if (op_s == "AND") {
+    op = BitOp::AND;
+  } else if (op_s == "OR") {
+    op = BitOp::OR;
+  } else if (op_s == "XOR") {
+    op = BitOp::XOR;
+  } else if (op_s == "NOT") {
+    op = BitOp::NOT;
+    if (args.size() != 4)
+      return (*cntx)->SendError("BITOP NOT must be called with a single source key.");
+  } else {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  Transaction* trans = cntx->transaction;
+  vector<OpResult<optional<string>>> parts(shard_set->size());
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    parts[shard->shard_id()] = OpBitOpFold(op, t, shard);
+    return OpStatus::OK;
+  };
+
+  trans->Schedule();
+  trans->Execute(std::move(cb), false);
+
+  optional<string> result;
+  for (auto& part : parts) {
+    if (!part) {
+      trans->Execute([](Transaction*, EngineShard*) { return OpStatus::OK; }, true);
+      return (*cntx)->SendError(part.status());
+    }
+
+    if (!part.value())
+      continue;
+
+    // NOT has a single part that is already negated.
+    if (result)
+      FoldBitOp(op, *part.value(), &result);
+    else
+      result = std::move(part.value());
+  }
+
+  string_view value = result ? string_view{*result} : string_view{};
+  ShardId dest_shard = Shard(dest_key, parts.size());
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == dest_shard)
+      OpBitOpStore(OpArgs{shard, t->db_index()}, dest_key, value);
+    return OpStatus::OK;
+  };
+
+  trans->Execute(std::move(store_cb), true);
+
+  (*cntx)->SendLong(value.size());
+}
+
+// CL.THROTTLE key max_burst count_per_period period [quantity], as in redis-cell.
+void StringFamily::ClThrottle(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  int64_t max_burst, count, period, quantity = 1;
+
+  if (!absl::SimpleAtoi(ArgS(args, 2), &max_burst) || !absl::SimpleAtoi(ArgS(args, 3), &count) ||
+      !absl::SimpleAtoi(ArgS(args, 4), &period) ||
+      (args.size() > 5 && !absl::SimpleAtoi(ArgS(args, 5), &quantity))) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  if (max_burst < 0 || count <= 0 || period <= 0 || quantity < 0)
+    return (*cntx)->SendError("invalid rate limit");
+
+  // The period is in seconds, the intervals in microseconds.
+  ThrottleParams params;
+  int64_t period_us;
+  if (__builtin_mul_overflow(period, 1000000, &period_us) || period_us / count == 0)
+    return (*cntx)->SendError("invalid rate limit");
+
+  params.emission_interval = period_us / count;
+  if (__builtin_mul_overflow(params.emission_interval, max_burst, &params.tolerance) ||
+      __builtin_add_overflow(params.tolerance, params.emission_interval, &params.tolerance) ||
+      __builtin_mul_overflow(params.emission_interval, quantity, &params.increment)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpThrottle(OpArgs{shard, t->db_index()}, key, params);
+  };
+
+  OpResult<ThrottleResult> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::INVALID_VALUE)
+    return (*cntx)->SendError(kInvalidIntErr);
+  if (!result)
+    return (*cntx)->SendError(result.status());
+
+  // The intervals are rounded up to seconds.
+  auto to_sec = [](int64_t us) { return us < 0 ? us : (us + 999999) / 1000000; };
+  (*cntx)->StartArray(5);
+  (*cntx)->SendLong(result->limited);
+  (*cntx)->SendLong(max_burst + 1);
+  (*cntx)->SendLong(result->remaining);
+  (*cntx)->SendLong(to_sec(result->retry_after_us));
+  (*cntx)->SendLong(to_sec(result->reset_after_us));
+}
+
+void StringFamily::BitField(CmdArgList args, ConnectionContext* cntx) {
+  BitFieldGeneric(std::move(args), false, cntx);
+}
+
+void StringFamily::BitFieldRo(CmdArgList args, ConnectionContext* cntx) {
+  BitFieldGeneric(std::move(args), true, cntx);
+}
+
+void StringFamily::BitFieldGeneric(CmdArgList args, bool read_only, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<BitFieldOp> ops;
+  BitFieldOp::Overflow overflow = BitFieldOp::WRAP;
+
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view cmd = ArgS(args, i);
+
+    if (cmd == "OVERFLOW") {
+      if (read_only || i + 1 >= args.size()) {
+        return (*cntx)->SendError(kSyntaxErr);
+      }
+
+      ToUpper(&args[++i]);
+      string_view type = ArgS(args, i);
+      if (type == "WRAP") {
+        overflow = BitFieldOp::WRAP;
+      } else if (type == "SAT") {
+        overflow = BitFieldOp::SAT;
+      } else if (type == "FAIL") {
+        overflow = BitFieldOp::FAIL;
+      } else {
+        return (*cntx)->SendError("Invalid OVERFLOW type specified");
+      }
+      continue;
+    }
+
+    BitFieldOp op{BitFieldOp::GET, overflow, false, 0, 0, 0};
+    if (cmd == "SET") {
+      op.kind = BitFieldOp::SET;
+    } else if (cmd == "INCRBY") {
+      op.kind = BitFieldOp::INCRBY;
+    } else if (cmd != "GET") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    if (read_only && op.kind != BitFieldOp::GET) {
+      return (*cntx)->SendError("BITFIELD_RO only supports the GET subcommand");
+    }
+
+    unsigned num_args = op.kind == BitFieldOp::GET ? 2 : 3;
+    if (i + num_args >= args.size()) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    // The type is i1..i64 or u1..u63.
+    string_view type = ArgS(args, i + 1);
+    unsigned bits = 0;
+    if (type.size() < 2 || (type[0] != 'i' && type[0] != 'u') ||
+        !absl::SimpleAtoi(type.substr(1), &bits) || bits < 1 || bits > (type[0] == 'i' ? 64 : 63)) {
+      return (*cntx)->SendError(
+          "Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but "
+          "i64 is.");
+    }
+    op.is_signed = type[0] == 'i';
+    op.bits = bits;
+
+    // #N offsets are in the units of the type.
+    string_view offset = ArgS(args, i + 2);
+    bool in_units = absl::ConsumePrefix(&offset, "#");
+    if (!absl::SimpleAtoi(offset, &op.offset) ||
+        op.offset > (uint64_t(kMaxStrLen) * 8 - bits) / (in_units ? bits : 1)) {
+      return (*cntx)->SendError("bit offset is not an integer or out of range");
+    }
+    if (in_units)
+      op.offset *= bits;
+
+    if (num_args == 3 && !absl::SimpleAtoi(ArgS(args, i + 3), &op.value)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+
+    ops.push_back(op);
+    i += num_args;
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpBitField(OpArgs{shard, t->db_index()}, key, ops);
+  };
+
+  OpResult<BitFieldResult> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& val : *result) {
+    if (val)
+      (*cntx)->SendLong(*val);
+    else
+      (*cntx)->SendNull();
+  }
+}
+
 void StringFamily::PSetEx(CmdArgList args, ConnectionContext* cntx) {
   SetExGeneric(false, std::move(args), cntx);
 }
 
-auto StringFamily::OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction* t,
-                          EngineShard* shard) -> MGetResponse {
+auto StringFamily::OpMGet(bool fetch_mcflag, uint32_t mc_mask, const Transaction* t,
+                          EngineShard* shard, util::fibers_ext::BlockingCounter read_bc)
+    -> MGetResponse {
   auto args = t->ShardArgsInShard(shard->shard_id());
   DCHECK(!args.empty());
 
   MGetResponse response(args.size());
 
   auto& db_slice = shard->db_slice();
-  for (size_t i = 0; i < args.size(); ++i) {
-    OpResult<PrimeIterator> it_res = db_slice.Find(t->db_index(), args[i], OBJ_STRING);
-    if (!it_res)
-      continue;
+  auto cb = [&](unsigned i, PrimeIterator it) {
+    if (!IsValid(it) || it->second.ObjType() != OBJ_STRING)
+      return;
 
-    const PrimeIterator& it = *it_res;
     auto& dest = response[i].emplace();
 
-    dest.value = GetString(shard, it->second);
+    GetStringAsync(shard, t->db_index(), it, &dest.value, read_bc);
     if (fetch_mcflag) {
-      dest.mc_flag = db_slice.GetMCFlag(t->db_index(), it->first);
-      if (fetch_mcver) {
-        dest.mc_ver = it.GetVersion();
+      dest.mc_flag = db_slice.GetMCFlag(t->db_index(), it);
+      if (mc_mask & ConnectionState::FETCH_CAS_VER) {
+        dest.mc_ver = DbSlice::CasUnique(it);
+      }
+      if ((mc_mask & ConnectionState::FETCH_TTL) && it->second.HasExpire()) {
+        auto expire_it = db_slice.ExpireIfNeeded(t->db_index(), it).second;
+        dest.mc_ttl = (db_slice.ExpireTime(expire_it) - db_slice.Now() + 500) / 1000;
       }
     }
-  }
+  };
+
+  // The external values are read with as few ios as possible.
+  TieredStorage* tiered = shard->tiered_storage();
+  if (tiered)
+    tiered->StartReadBatch();
+  db_slice.FindMany(t->db_index(), args, cb);
+  if (tiered)
+    tiered->SubmitReadBatch();
 
   return response;
 }
 
+auto StringFamily::OpMGetResp(const Transaction* t, EngineShard* shard,
+                              util::fibers_ext::BlockingCounter read_bc) -> MGetShardReply {
+  auto args = t->ShardArgsInShard(shard->shard_id());
+  DCHECK(!args.empty());
+
+  MGetShardReply reply;
+  reply.ends.resize(args.size());
+  string& buf = reply.buf;
+
+  auto cb = [&](unsigned i, PrimeIterator it) {
+    if (!IsValid(it) || it->second.ObjType() != OBJ_STRING) {
+      buf.append("$-1\r\n");
+    } else {
+      const PrimeValue& pv = it->second;
+      size_t len = pv.Size();
+      absl::StrAppend(&buf, "$", len, "\r\n");
+      if (pv.IsExternal()) {
+        auto& dest = reply.ext.emplace_back(i, string{});
+        GetStringAsync(shard, t->db_index(), it, &dest.second, read_bc);
+      } else {
+        size_t pos = buf.size();
+        buf.resize(pos + len);
+        pv.GetString(buf.data() + pos);
+        buf.append("\r\n");
+      }
+    }
+    reply.ends[i] = buf.size();
+  };
+
+  TieredStorage* tiered = shard->tiered_storage();
+  if (tiered)
+    tiered->StartReadBatch();
+  shard->db_slice().FindMany(t->db_index(), args, cb);
+  if (tiered)
+    tiered->SubmitReadBatch();
+
+  return reply;
+}
+
 OpStatus StringFamily::OpMSet(const OpArgs& op_args, ArgSlice args) {
   DCHECK(!args.empty() && args.size() % 2 == 0);
 
@@ -870,7 +1897,7 @@ OpResult<uint32_t> StringFamily::ExtendOrSet(const OpArgs& op_args, std::string_
   auto& db_slice = op_args.shard->db_slice();
   auto [it, inserted] = db_slice.AddOrFind(op_args.db_ind, key);
   if (inserted) {
-    it->second.SetString(val);
+    it->second.SetValueString(val);
     db_slice.PostUpdate(op_args.db_ind, it);
 
     return val.size();
@@ -887,7 +1914,7 @@ OpResult<uint32_t> StringFamily::ExtendOrSet(const OpArgs& op_args, std::string_
     new_val = absl::StrCat(slice, val);
 
   db_slice.PreUpdate(op_args.db_ind, it);
-  it->second.SetString(new_val);
+  it->second.SetValueString(new_val);
   db_slice.PostUpdate(op_args.db_ind, it);
 
   return new_val.size();
@@ -911,22 +1938,12 @@ OpResult<bool> StringFamily::ExtendOrSkip(const OpArgs& op_args, std::string_vie
     new_val = absl::StrCat(slice, val);
 
   db_slice.PreUpdate(op_args.db_ind, *it_res);
-  cobj.SetString(new_val);
+  cobj.SetValueString(new_val);
   db_slice.PostUpdate(op_args.db_ind, *it_res);
 
   return new_val.size();
 }
 
-OpResult<string> StringFamily::OpGet(const OpArgs& op_args, string_view key) {
-  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_STRING);
-  if (!it_res.ok())
-    return it_res.status();
-
-  const PrimeValue& pv = it_res.value()->second;
-
-  return GetString(op_args.shard, pv);
-}
-
 void StringFamily::Init(util::ProactorPool* pp) {
   set_qps.Init(pp);
   get_qps.Init(pp);
@@ -959,7 +1976,16 @@ void StringFamily::Register(CommandRegistry* registry) {
             << CI{"GETRANGE", CO::READONLY | CO::FAST, 4, 1, 1, 1}.HFUNC(GetRange)
             << CI{"SUBSTR", CO::READONLY | CO::FAST, 4, 1, 1, 1}.HFUNC(
                    GetRange)  // Alias for GetRange
-            << CI{"SETRANGE", CO::WRITE | CO::FAST | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetRange);
+            << CI{"SETRANGE", CO::WRITE | CO::FAST | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetRange)
+            << CI{"SETBIT", CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetBit)
+            << CI{"GETBIT", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(GetBit)
+            << CI{"BITCOUNT", CO::READONLY, -2, 1, 1, 1}.HFUNC(BitCount)
+            << CI{"BITPOS", CO::READONLY, -3, 1, 1, 1}.HFUNC(BitPos)
+            << CI{"BITOP", CO::WRITE | CO::DENYOOM | CO::REVERSE_MAPPING, -4, 2, -1, 1}.HFUNC(
+                   BitOpCmd)
+            << CI{"BITFIELD", CO::WRITE | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(BitField)
+            << CI{"BITFIELD_RO", CO::READONLY, -2, 1, 1, 1}.HFUNC(BitFieldRo)
+            << CI{"CL.THROTTLE", CO::WRITE | CO::DENYOOM | CO::FAST, -5, 1, 1, 1}.HFUNC(ClThrottle);
 }
 
 }  // namespace dfly
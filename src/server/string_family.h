@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <deque>
+
 #include "server/common.h"
 #include "server/engine_shard_set.h"
 #include "util/proactor_pool.h"
@@ -22,13 +24,15 @@ class SetCmd {
   explicit SetCmd(DbSlice* db_slice);
   ~SetCmd();
 
-  enum SetHow { SET_ALWAYS, SET_IF_NOTEXIST, SET_IF_EXISTS };
+  // SET_IF_CAS sets only if the entry still has cas_unique, see DbSlice::CasUnique.
+  enum SetHow { SET_ALWAYS, SET_IF_NOTEXIST, SET_IF_EXISTS, SET_IF_CAS };
 
   struct SetParams {
     SetHow how = SET_ALWAYS;
     DbIndex db_index;
 
     uint32_t memcache_flags = 0;
+    uint64_t cas_unique = 0;
     // Relative value based on now. 0 means no expiration.
     uint64_t expire_after_ms = 0;
     mutable std::optional<std::string>* prev_val = nullptr;  // GETSET option
@@ -72,20 +76,51 @@ class StringFamily {
   static void StrLen(CmdArgList args, ConnectionContext* cntx);
   static void Prepend(CmdArgList args, ConnectionContext* cntx);
   static void PSetEx(CmdArgList args, ConnectionContext* cntx);
-
+  static void SetBit(CmdArgList args, ConnectionContext* cntx);
+  static void GetBit(CmdArgList args, ConnectionContext* cntx);
+  static void BitCount(CmdArgList args, ConnectionContext* cntx);
+  static void BitPos(CmdArgList args, ConnectionContext* cntx);
+  static void BitOpCmd(CmdArgList args, ConnectionContext* cntx);
+  static void BitField(CmdArgList args, ConnectionContext* cntx);
+  static void BitFieldRo(CmdArgList args, ConnectionContext* cntx);
+  static void ClThrottle(CmdArgList args, ConnectionContext* cntx);
+
+  static void GetByRef(std::string_view key, ConnectionContext* cntx);
+  static void MGetResp(CmdArgList args, ConnectionContext* cntx);
   static void IncrByGeneric(std::string_view key, int64_t val, ConnectionContext* cntx);
   static void ExtendGeneric(CmdArgList args, bool prepend, ConnectionContext* cntx);
   static void SetExGeneric(bool seconds, CmdArgList args, ConnectionContext* cntx);
+  static void BitFieldGeneric(CmdArgList args, bool read_only, ConnectionContext* cntx);
 
   struct GetResp {
     std::string value;
     uint64_t mc_ver = 0;  // 0 means we do not output it (i.e has not been requested).
+    int64_t mc_ttl = -1;
     uint32_t mc_flag = 0;
   };
 
   using MGetResponse = std::vector<std::optional<GetResp>>;
-  static MGetResponse OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction* t,
-                             EngineShard* shard);
+
+  // mc_mask is a mask of ConnectionState::MCGetMask values, used if fetch_mcflag is set.
+  // The external values are read in the background, read_bc is held until the response has
+  // them.
+  static MGetResponse OpMGet(bool fetch_mcflag, uint32_t mc_mask, const Transaction* t,
+                             EngineShard* shard, util::fibers_ext::BlockingCounter read_bc);
+
+  // The RESP replies of the keys of a shard, in the order of its keys.
+  struct MGetShardReply {
+    std::string buf;
+    std::vector<size_t> ends;  // The reply of the j-th key ends at ends[j] in buf.
+
+    // The external values are read in the background. The reply of such a key ends with its
+    // bulk header in buf and continues with the value in ext and CRLF.
+    std::deque<std::pair<uint32_t, std::string>> ext;
+  };
+
+  // Serializes the values of the shard keys straight into the reply, so that the coordinator
+  // only stitches the replies of the shards together.
+  static MGetShardReply OpMGetResp(const Transaction* t, EngineShard* shard,
+                                   util::fibers_ext::BlockingCounter read_bc);
 
   // Returns true if keys were set, false otherwise.
   static OpStatus OpMSet(const OpArgs& op_args, ArgSlice args);
@@ -102,8 +137,6 @@ class StringFamily {
   // Returns true if was extended, false if the key was not found.
   static OpResult<bool> ExtendOrSkip(const OpArgs& op_args, std::string_view key,
                                      std::string_view val, bool prepend);
-
-  static OpResult<std::string> OpGet(const OpArgs& op_args, std::string_view key);
 };
 
 }  // namespace dfly
@@ -4,6 +4,7 @@
 
 #include "server/string_family.h"
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -20,12 +21,42 @@ using namespace std;
 using namespace util;
 using absl::StrCat;
 
+ABSL_DECLARE_FLAG(bool, zero_copy_get);
+ABSL_DECLARE_FLAG(bool, optimistic_reads);
+ABSL_DECLARE_FLAG(uint32_t, dedup_values_min_size);
+ABSL_DECLARE_FLAG(std::string, combined_counters);
+
 namespace dfly {
 
 class StringFamilyTest : public BaseFamilyTest {
  protected:
 };
 
+class StringDedupTest : public BaseFamilyTest {
+ protected:
+  StringDedupTest() {
+    absl::SetFlag(&FLAGS_dedup_values_min_size, 256);
+  }
+
+  ~StringDedupTest() {
+    absl::SetFlag(&FLAGS_dedup_values_min_size, 0);
+  }
+
+  CompactObj::Stats GetCobjStats() {
+    atomic_uint64_t strings{0}, saved_bytes{0};
+    shard_set->RunBriefInParallel([&](EngineShard*) {
+      CompactObj::Stats stats = CompactObj::GetStats();
+      strings.fetch_add(stats.dedup_strings);
+      saved_bytes.fetch_add(stats.dedup_saved_bytes);
+    });
+
+    CompactObj::Stats res;
+    res.dedup_strings = strings.load();
+    res.dedup_saved_bytes = saved_bytes.load();
+    return res;
+  }
+};
+
 vector<int64_t> ToIntArr(const RespExpr& e) {
   vector<int64_t> res;
   CHECK_EQ(e.type, RespExpr::ARRAY);
@@ -52,6 +83,38 @@ TEST_F(StringFamilyTest, SetGet) {
   EXPECT_EQ(Run({"get", "key"}), "2");
 }
 
+TEST_F(StringFamilyTest, GetByRef) {
+  absl::SetFlag(&FLAGS_zero_copy_get, true);
+
+  // Raw, ascii-encoded, inline and integer values are read by reference.
+  string raw(40000, '\xff');
+  string ascii(40000, 'x');
+  Run({"set", "raw", raw});
+  Run({"set", "ascii", ascii});
+  Run({"set", "inline", "val"});
+  Run({"set", "int", "1234"});
+  EXPECT_EQ(Run({"get", "raw"}), raw);
+  EXPECT_EQ(Run({"get", "ascii"}), ascii);
+  EXPECT_EQ(Run({"get", "inline"}), "val");
+  EXPECT_EQ(Run({"get", "int"}), "1234");
+
+  // Small strings and values with expiry are copied.
+  Run({"set", "small", string(100, 'y')});
+  Run({"set", "expire", ascii, "ex", "100"});
+  EXPECT_EQ(Run({"get", "small"}), string(100, 'y'));
+  EXPECT_EQ(Run({"get", "expire"}), ascii);
+
+  EXPECT_THAT(Run({"get", "missing"}), ArgType(RespExpr::NIL));
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"get", "list"}), ErrArg("WRONGTYPE"));
+
+  // The key is released after the reply.
+  Run({"set", "raw", "new"});
+  EXPECT_EQ(Run({"get", "raw"}), "new");
+
+  absl::SetFlag(&FLAGS_zero_copy_get, false);
+}
+
 TEST_F(StringFamilyTest, Incr) {
   ASSERT_EQ(Run({"set", "key", "0"}), "OK");
   ASSERT_THAT(Run({"incr", "key"}), IntArg(1));
@@ -151,6 +214,50 @@ TEST_F(StringFamilyTest, MGetSet) {
   set_fb.join();
 }
 
+TEST_F(StringFamilyTest, MGetOptimistic) {
+  absl::SetFlag(&FLAGS_optimistic_reads, true);
+
+  Run({"mset", "x", "0", "b", "0"});
+  auto resp = Run({"mget", "b", "x", "c"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("0", "0", ArgType(RespExpr::NIL)));
+
+  atomic_uint64_t runs{0};
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { runs.fetch_add(shard->stats().optimistic_runs); });
+  EXPECT_GT(runs.load(), 0u);
+
+  // Writes that are applied in order stay ordered for the readers.
+  auto mget_fb = pp_->at(0)->LaunchFiber([&] {
+    for (size_t i = 0; i < 1000; ++i) {
+      RespExpr resp = Run({"mget", "b", "x"});
+      ASSERT_EQ(RespExpr::ARRAY, resp.type);
+      auto ivec = ToIntArr(resp);
+
+      ASSERT_GE(ivec[1], ivec[0]);
+    }
+  });
+
+  auto set_fb = pp_->at(1)->LaunchFiber([&] {
+    for (size_t i = 1; i < 2000; ++i) {
+      if (i % 2) {
+        Run({"set", "x", StrCat(i)});
+        Run({"set", "b", StrCat(i)});
+      } else {
+        Run({"mset", "x", StrCat(i), "b", StrCat(i)});
+      }
+    }
+  });
+
+  mget_fb.join();
+  set_fb.join();
+
+  EXPECT_FALSE(service_->IsLocked(0, "x"));
+  EXPECT_FALSE(service_->IsLocked(0, "b"));
+
+  absl::SetFlag(&FLAGS_optimistic_reads, false);
+}
+
 TEST_F(StringFamilyTest, MSetGet) {
   Run({"mset", "x", "0", "y", "0", "a", "0", "b", "0"});
   ASSERT_EQ(2, GetDebugInfo().shards_count);
@@ -239,6 +346,48 @@ TEST_F(StringFamilyTest, SingleShard) {
   mget_fb.join();
 }
 
+TEST_F(StringFamilyTest, MGetMany) {
+  // Spans multiple lookup batches. Contains missing and repeated keys.
+  vector<string> keys{"mget"};
+  for (unsigned i = 0; i < 100; ++i) {
+    if (i % 3 == 0)
+      Run({"set", StrCat("k", i), StrCat(i)});
+    keys.push_back(StrCat("k", i));
+    keys.push_back(StrCat("k", i % 10));
+  }
+
+  vector<string_view> args(keys.begin(), keys.end());
+  auto resp = Run(absl::MakeSpan(args));
+  ASSERT_EQ(RespExpr::ARRAY, resp.type);
+  const RespVec& vec = *get<RespVec*>(resp.u);
+  ASSERT_EQ(200, vec.size());
+
+  auto expect_val = [](const RespExpr& e, unsigned key_id) {
+    if (key_id % 3 == 0) {
+      EXPECT_EQ(e, StrCat(key_id)) << key_id;
+    } else {
+      EXPECT_EQ(RespExpr::NIL, e.type) << key_id;
+    }
+  };
+
+  for (unsigned i = 0; i < 100; ++i) {
+    expect_val(vec[2 * i], i);
+    expect_val(vec[2 * i + 1], i % 10);
+  }
+}
+
+TEST_F(StringFamilyTest, MGetValues) {
+  Run({"set", "empty", ""});
+  Run({"set", "crlf", "a\r\nb"});
+  Run({"set", "num", "123"});
+  Run({"lpush", "list", "a"});
+
+  auto resp = Run({"mget", "empty", "list", "crlf", "num", "nokey", "crlf"});
+  ASSERT_THAT(resp, ArrLen(6));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("", ArgType(RespExpr::NIL), "a\r\nb", "123",
+                                         ArgType(RespExpr::NIL), "a\r\nb"));
+}
+
 TEST_F(StringFamilyTest, MSetIncr) {
   /*  serializable orders
    init: x=z=0
@@ -328,4 +477,249 @@ TEST_F(StringFamilyTest, IncrByFloat) {
   EXPECT_EQ(resp, "3.566");
 }
 
+TEST_F(StringFamilyTest, SetGetBit) {
+  EXPECT_EQ(0, CheckedInt({"setbit", "key", "7", "1"}));
+  EXPECT_EQ(1, CheckedInt({"setbit", "key", "7", "0"}));
+  EXPECT_EQ(0, CheckedInt({"setbit", "key", "100", "1"}));
+  EXPECT_EQ(13, CheckedInt({"strlen", "key"}));
+  EXPECT_EQ(1, CheckedInt({"getbit", "key", "100"}));
+  EXPECT_EQ(0, CheckedInt({"getbit", "key", "7"}));
+  EXPECT_EQ(0, CheckedInt({"getbit", "key", "100000"}));
+  EXPECT_EQ(0, CheckedInt({"getbit", "nokey", "1"}));
+
+  Run({"set", "str", "a"});  // 0x61
+  EXPECT_EQ(1, CheckedInt({"getbit", "str", "1"}));
+  EXPECT_EQ(0, CheckedInt({"setbit", "str", "6", "1"}));
+  EXPECT_EQ(Run({"get", "str"}), "c");
+
+  EXPECT_THAT(Run({"setbit", "key", "-1", "1"}), ErrArg("bit offset is not an integer"));
+  EXPECT_THAT(Run({"setbit", "key", "1", "2"}), ErrArg("bit is not an integer"));
+
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"setbit", "list", "1", "1"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(StringFamilyTest, BitCount) {
+  Run({"set", "key", "foobar"});
+  EXPECT_EQ(26, CheckedInt({"bitcount", "key"}));
+  EXPECT_EQ(4, CheckedInt({"bitcount", "key", "0", "0"}));
+  EXPECT_EQ(6, CheckedInt({"bitcount", "key", "1", "1"}));
+  EXPECT_EQ(6, CheckedInt({"bitcount", "key", "-5", "-5"}));
+  EXPECT_EQ(17, CheckedInt({"bitcount", "key", "5", "30", "BIT"}));
+  EXPECT_EQ(0, CheckedInt({"bitcount", "key", "3", "1"}));
+  EXPECT_EQ(0, CheckedInt({"bitcount", "nokey"}));
+
+  string val(1000, '\xff');
+  Run({"set", "big", val});
+  EXPECT_EQ(8000, CheckedInt({"bitcount", "big"}));
+  EXPECT_EQ(7990, CheckedInt({"bitcount", "big", "5", "-6", "bit"}));
+
+  EXPECT_THAT(Run({"bitcount", "key", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"bitcount", "key", "1", "2", "bits"}), ErrArg("syntax error"));
+}
+
+TEST_F(StringFamilyTest, BitPos) {
+  Run({"set", "key", "\xff\xf0"});
+  EXPECT_EQ(12, CheckedInt({"bitpos", "key", "0"}));
+  EXPECT_EQ(12, CheckedInt({"bitpos", "key", "0", "0", "-1"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "key", "1"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "key", "1", "2"}));
+  EXPECT_EQ(7, CheckedInt({"bitpos", "key", "1", "7", "15", "BIT"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "key", "1", "12", "-1", "BIT"}));
+
+  Run({"set", "ones", "\xff\xff"});
+  EXPECT_EQ(16, CheckedInt({"bitpos", "ones", "0"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "ones", "0", "0", "-1"}));
+
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "nokey", "1"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "nokey", "0"}));
+  EXPECT_THAT(Run({"bitpos", "key", "2"}), ErrArg("The bit argument must be 1 or 0."));
+}
+
+TEST_F(StringFamilyTest, BitOp) {
+  Run({"set", "a", "foobar"});
+  Run({"set", "b", "abcdef"});
+  Run({"set", "c", "\x0f"});
+
+  EXPECT_EQ(6, CheckedInt({"bitop", "and", "dest", "a", "b"}));
+  EXPECT_EQ(Run({"get", "dest"}), "`bc`ab");
+  EXPECT_EQ(6, CheckedInt({"bitop", "or", "dest", "a", "b"}));
+  EXPECT_EQ(Run({"get", "dest"}), "goofev");
+
+  // The shorter operands are padded with zeros.
+  EXPECT_EQ(6, CheckedInt({"bitop", "and", "dest", "a", "c"}));
+  EXPECT_EQ(Run({"get", "dest"}), string("\x06\0\0\0\0\0", 6));
+  EXPECT_EQ(6, CheckedInt({"bitop", "xor", "dest", "a", "a", "nokey"}));
+  EXPECT_EQ(Run({"get", "dest"}), string(6, '\0'));
+
+  // The destination can be a source as well.
+  EXPECT_EQ(1, CheckedInt({"bitop", "not", "c", "c"}));
+  EXPECT_EQ(Run({"get", "c"}), "\xf0");
+
+  EXPECT_EQ(0, CheckedInt({"bitop", "or", "dest", "nokey"}));
+  EXPECT_EQ(0, CheckedInt({"exists", "dest"}));
+
+  EXPECT_THAT(Run({"bitop", "not", "dest", "a", "b"}), ErrArg("BITOP NOT must be called"));
+  EXPECT_THAT(Run({"bitop", "nand", "dest", "a"}), ErrArg("syntax error"));
+
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"bitop", "or", "dest", "a", "list"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(StringFamilyTest, BitField) {
+  auto resp = Run({"bitfield", "key", "set", "i8", "0", "100", "get", "u4", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(6)));
+
+  resp = Run({"bitfield", "key", "incrby", "i8", "0", "100", "get", "i8", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-56), IntArg(-56)));
+
+  resp = Run({"bitfield", "key", "overflow", "sat", "incrby", "i8", "0", "-100", "overflow",
+              "fail", "incrby", "i8", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-128), ArgType(RespExpr::NIL)));
+
+  resp = Run({"bitfield", "key", "set", "u8", "#1", "255", "incrby", "u8", "#1", "10"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(9)));
+  EXPECT_EQ(2, CheckedInt({"strlen", "key"}));
+
+  resp = Run({"bitfield_ro", "key", "get", "u8", "8", "get", "i64", "100"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(9), IntArg(0)));
+
+  EXPECT_THAT(Run({"bitfield", "key", "get", "u64", "0"}), ErrArg("Invalid bitfield type"));
+  EXPECT_THAT(Run({"bitfield", "key", "overflow", "foo"}), ErrArg("Invalid OVERFLOW type"));
+  EXPECT_THAT(Run({"bitfield_ro", "key", "set", "u8", "0", "1"}),
+              ErrArg("BITFIELD_RO only supports the GET subcommand"));
+}
+
+TEST_F(StringFamilyTest, ClThrottle) {
+  // A burst of 2 on top of 1 request per second.
+  auto throttle = [&] { return Run({"cl.throttle", "key", "2", "10", "10"}).GetVec(); };
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(0), IntArg(3), IntArg(2), IntArg(-1), IntArg(1)));
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(0), IntArg(3), IntArg(1), IntArg(-1), IntArg(2)));
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(0), IntArg(3), IntArg(0), IntArg(-1), IntArg(3)));
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(1), IntArg(3), IntArg(0), IntArg(1), IntArg(3)));
+  EXPECT_EQ(3000, CheckedInt({"pttl", "key"}));
+
+  // The limit replenishes at the sustained rate.
+  UpdateTime(expire_now_ + 1000);
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(0), IntArg(3), IntArg(0), IntArg(-1), IntArg(3)));
+
+  // More than the burst is never allowed.
+  auto resp = Run({"cl.throttle", "key", "2", "10", "10", "4"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(3), IntArg(0), IntArg(-1), IntArg(3)));
+
+  // The key expires once the limit is fully replenished.
+  UpdateTime(expire_now_ + 4000);
+  EXPECT_EQ(0, CheckedInt({"exists", "key"}));
+  EXPECT_THAT(throttle(), ElementsAre(IntArg(0), IntArg(3), IntArg(2), IntArg(-1), IntArg(1)));
+
+  EXPECT_THAT(Run({"cl.throttle", "key", "2", "0", "10"}), ErrArg("invalid rate limit"));
+  EXPECT_THAT(Run({"cl.throttle", "key", "a", "10", "10"}), ErrArg(kInvalidIntErr));
+  Run({"lpush", "list", "a"});
+  EXPECT_THAT(Run({"cl.throttle", "list", "2", "10", "10"}), ErrArg("WRONGTYPE"));
+}
+
+class CombinedCounterTest : public BaseFamilyTest {
+ protected:
+  CombinedCounterTest() {
+    absl::SetFlag(&FLAGS_combined_counters, "hits,quota:*");
+  }
+
+  ~CombinedCounterTest() {
+    absl::SetFlag(&FLAGS_combined_counters, "");
+  }
+
+  // Waits for the combined increments to be applied.
+  bool WaitForValue(string_view key, string_view expected) {
+    for (unsigned i = 0; i < 200; ++i) {
+      if (Run({"get", key}) == expected)
+        return true;
+      boost::this_fiber::sleep_for(5ms);
+    }
+    return false;
+  }
+};
+
+TEST_F(StringDedupTest, SharedValues) {
+  string val(1024, 'v');
+  constexpr unsigned kNumKeys = 64;
+  for (unsigned i = 0; i < kNumKeys; ++i) {
+    Run({"set", StrCat("key", i), val});
+  }
+
+  // One copy per shard.
+  CompactObj::Stats stats = GetCobjStats();
+  EXPECT_LE(stats.dedup_strings, shard_set->size());
+  EXPECT_GE(stats.dedup_saved_bytes, (kNumKeys - shard_set->size()) * val.size());
+
+  // The mutations copy the value.
+  EXPECT_THAT(Run({"append", "key0", "x"}), IntArg(val.size() + 1));
+  EXPECT_THAT(Run({"setrange", "key1", "0", "abc"}), IntArg(val.size()));
+  EXPECT_EQ(Run({"get", "key0"}), val + "x");
+  EXPECT_EQ(Run({"get", "key1"}), "abc" + val.substr(3));
+  EXPECT_EQ(Run({"get", "key2"}), val);
+
+  for (unsigned i = 0; i < kNumKeys; ++i) {
+    Run({"del", StrCat("key", i)});
+  }
+  stats = GetCobjStats();
+  EXPECT_EQ(0u, stats.dedup_strings);
+  EXPECT_EQ(0u, stats.dedup_saved_bytes);
+}
+
+TEST_F(StringDedupTest, SharedValueMemory) {
+  auto object_memory = [this] {
+    auto resp = Run({"info", "memory"});
+    string_view info = ToSV(resp.GetBuf());
+    size_t pos = info.find("object_used_memory:");
+    CHECK_NE(pos, string_view::npos);
+    info.remove_prefix(pos + strlen("object_used_memory:"));
+    size_t res = 0;
+    CHECK(absl::SimpleAtoi(info.substr(0, info.find('\r')), &res));
+    return res;
+  };
+
+  // The value stays accounted after the key that allocated it is gone.
+  shard_by_hashtag = true;
+  string val(1024, 'v');
+  Run({"set", "{k}key", val});
+  Run({"set", "{k}copy", val});
+  Run({"del", "{k}key"});
+  EXPECT_EQ(Run({"get", "{k}copy"}), val);
+  EXPECT_GE(object_memory(), val.size());
+
+  Run({"del", "{k}copy"});
+  EXPECT_LT(object_memory(), val.size());
+  shard_by_hashtag = false;
+}
+
+TEST_F(CombinedCounterTest, IncrBy) {
+  // The first increment of a thread runs in the shard, the next ones are combined.
+  EXPECT_THAT(Run({"incrby", "hits", "5"}), IntArg(5));
+  EXPECT_THAT(Run({"incr", "hits"}), IntArg(6));
+  EXPECT_THAT(Run({"decrby", "hits", "2"}), IntArg(4));
+  EXPECT_TRUE(WaitForValue("hits", "4"));
+
+  EXPECT_THAT(Run({"incr", "quota:1"}), IntArg(1));
+  EXPECT_THAT(Run({"incrby", "quota:1", "10"}), IntArg(11));
+  EXPECT_TRUE(WaitForValue("quota:1", "11"));
+
+  // The increments of a transaction are not combined.
+  Run({"multi"});
+  Run({"incr", "hits"});
+  EXPECT_THAT(Run({"exec"}), IntArg(5));
+
+  EXPECT_THAT(Run({"incrby", "hits", "9223372036854775807"}), ErrArg("overflow"));
+
+  // The failed increment is dropped and the next one reports the error.
+  Run({"set", "hits", "foo"});
+  RespExpr resp;
+  for (unsigned i = 0; i < 200; ++i) {
+    resp = Run({"incr", "hits"});
+    if (resp.type == RespExpr::ERROR)
+      break;
+    boost::this_fiber::sleep_for(5ms);
+  }
+  EXPECT_THAT(resp, ErrArg(kInvalidIntErr));
+}
+
 }  // namespace dfly
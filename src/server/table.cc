@@ -8,6 +8,9 @@
 
 namespace dfly {
 
+// ~1s buckets, it bounds how late active expiry collects the keys.
+constexpr unsigned kExpireIndexResolutionLog = 10;
+
 #define ADD(x) (x) += o.x
 
 DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
@@ -25,10 +28,11 @@ DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
   return *this;
 }
 
-DbTable::DbTable(std::pmr::memory_resource* mr)
-    : prime(2, detail::PrimeTablePolicy{}, mr),
-      expire(0, detail::ExpireTablePolicy{}, mr),
-      mcflag(0, detail::ExpireTablePolicy{}, mr) {
+DbTable::DbTable(std::pmr::memory_resource* mr, std::pmr::memory_resource* table_mr)
+    : prime(2, detail::PrimeTablePolicy{}, table_mr),
+      expire(0, detail::ExpireTablePolicy{}, table_mr),
+      mcflag(0, detail::ExpireTablePolicy{}, mr), expire_index(kExpireIndexResolutionLog, mr),
+      field_expire_index(kExpireIndexResolutionLog, mr) {
 }
 
 DbTable::~DbTable() {
@@ -39,13 +43,40 @@ void DbTable::Clear() {
   prime.Clear();
   expire.Clear();
   mcflag.Clear();
+  expire_index.Clear();
+  field_expire_index.Clear();
+  sparse_stream_nodes.clear();
+  stats = DbTableStats{};
+}
+
+bool DbTable::ClearStep(unsigned count) {
+  for (; count > 0; --count) {
+    if (prime.size()) {
+      clear_cursor = prime.ClearStep(clear_cursor);
+    } else if (expire.size()) {
+      clear_cursor = expire.ClearStep(clear_cursor);
+    } else if (mcflag.size()) {
+      clear_cursor = mcflag.ClearStep(clear_cursor);
+    } else {
+      break;
+    }
+  }
+
+  if (prime.size() || expire.size() || mcflag.size())
+    return true;
+
+  expire_index.Clear();
+  field_expire_index.Clear();
+  sparse_stream_nodes.clear();
   stats = DbTableStats{};
+
+  return false;
 }
 
 void DbTable::Release(IntentLock::Mode mode, std::string_view key, unsigned count) {
   DVLOG(1) << "Release " << IntentLock::ModeName(mode) << " " << count << " for " << key;
 
-  auto it = trans_locks.find(key);
+  auto it = trans_locks.find(KeyLockFp(key));
   CHECK(it != trans_locks.end()) << key;
   it->second.Release(mode, count);
   if (it->second.IsFree()) {
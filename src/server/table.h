@@ -9,6 +9,7 @@
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
+#include "core/deadline_index.h"
 #include "core/expire_period.h"
 #include "core/intent_lock.h"
 #include "server/detail/table.h"
@@ -34,6 +35,13 @@ inline bool IsValid(ExpireIterator it) {
   return !it.is_done();
 }
 
+// Prefetches the heap parts of the key and the value, the prefetch callback of
+// PrimeTable::TraversePrefetch for the passes that read both.
+inline void PrefetchEntry(PrimeIterator it) {
+  it->first.Prefetch();
+  it->second.Prefetch();
+}
+
 struct DbTableStats {
   // Number of inline keys.
   uint64_t inline_keys = 0;
@@ -50,7 +58,22 @@ struct DbTableStats {
   DbTableStats& operator+=(const DbTableStats& o);
 };
 
-using LockTable = absl::flat_hash_map<std::string, IntentLock>;
+// Transaction locks are keyed by fingerprints of the keys, so that taking a lock does not
+// allocate. A fingerprint collision only makes the colliding keys share the lock.
+using LockFp = uint64_t;
+using LockTable = absl::flat_hash_map<LockFp, IntentLock>;
+
+inline LockFp KeyLockFp(std::string_view key) {
+  return CompactObj::HashCode(key);
+}
+
+// A node of a stream that is mostly deleted entries, by the hash of the key and the master id of
+// the node, see DbSlice::CompactStreams.
+struct SparseStreamNode {
+  uint64_t key_hash;
+  uint64_t ms;
+  uint64_t seq;
+};
 
 // A single Db table that represents a table that can be chosen with "SELECT" command.
 struct DbTable : boost::intrusive_ref_counter<DbTable, boost::thread_unsafe_counter> {
@@ -61,13 +84,36 @@ struct DbTable : boost::intrusive_ref_counter<DbTable, boost::thread_unsafe_coun
   // Contains transaction locks
   LockTable trans_locks;
 
+  // Hashes of the keys with expiry by their deadlines. Drives active expiry, see
+  // DbSlice::DeleteExpired.
+  DeadlineIndex expire_index;
+
+  // Hashes of the keys of the hashes whose fields have deadlines, by the earliest one.
+  // Drives the active expiry of the fields, see DbSlice::DeleteExpiredFields.
+  DeadlineIndex field_expire_index;
+
+  // Drives the compaction of the streams, see DbSlice::MarkSparseStreamNode.
+  std::vector<SparseStreamNode> sparse_stream_nodes;
+
   mutable DbTableStats stats;
-  ExpireTable::cursor expire_cursor;
 
-  explicit DbTable(std::pmr::memory_resource* mr);
+  // Directory positions to continue merging segments from, see DbSlice::ShrinkTables.
+  uint32_t prime_merge_cursor = 0;
+  uint32_t expire_merge_cursor = 0;
+
+  // Directory position to continue clearing segments from, see ClearStep.
+  uint32_t clear_cursor = 0;
+
+  // The segments of prime and expire tables are allocated from table_mr.
+  DbTable(std::pmr::memory_resource* mr, std::pmr::memory_resource* table_mr);
   ~DbTable();
 
   void Clear();
+
+  // Destroys the entries of up to count segments of the tables. Returns false once all
+  // the tables are empty. Used to release flushed tables in bounded steps.
+  bool ClearStep(unsigned count);
+
   void Release(IntentLock::Mode mode, std::string_view key, unsigned count);
 };
 
@@ -9,6 +9,7 @@ extern "C" {
 }
 
 #include <absl/strings/match.h>
+#include <absl/strings/str_join.h>
 #include <absl/strings/str_split.h>
 #include <mimalloc.h>
 
@@ -45,6 +46,7 @@ void TestConnection::SendMsgVecAsync(const PubMessage& pmsg, util::fibers_ext::B
   backing_str_.emplace_back(new string(pmsg.channel));
   PubMessage dest;
   dest.channel = *backing_str_.back();
+  dest.sharded = pmsg.sharded;
 
   backing_str_.emplace_back(new string(pmsg.message));
   dest.message = *backing_str_.back();
@@ -58,6 +60,28 @@ void TestConnection::SendMsgVecAsync(const PubMessage& pmsg, util::fibers_ext::B
   bc.Dec();
 }
 
+void TestConnection::SendMsgAsync(const PubMessage& pmsg, shared_ptr<const void> holder) {
+  SendMsgVecAsync(pmsg, util::fibers_ext::BlockingCounter{1});
+}
+
+void TestConnection::SendInvalidationAsync(vector<string> keys) {
+  sort(keys.begin(), keys.end());
+
+  PubMessage dest;
+  dest.channel = kInvalidationChannel;
+  backing_str_.emplace_back(new string(absl::StrJoin(keys, " ")));
+  dest.message = *backing_str_.back();
+  messages.push_back(dest);
+}
+
+void TestConnection::SendChangesAsync(vector<string> records) {
+  PubMessage dest;
+  dest.channel = kChangesChannel;
+  backing_str_.emplace_back(new string(absl::StrJoin(records, " ")));
+  dest.message = *backing_str_.back();
+  messages.push_back(dest);
+}
+
 class BaseFamilyTest::TestConnWrapper {
  public:
   TestConnWrapper(Protocol proto);
@@ -124,7 +148,7 @@ void BaseFamilyTest::SetUp() {
 
   Service::InitOpts opts;
   opts.disable_time_update = true;
-  service_->Init(nullptr, nullptr, opts);
+  service_->Init(nullptr, {}, opts);
 
   expire_now_ = absl::GetCurrentTimeNanos() / 1000000;
   auto cb = [&](EngineShard* s) {
@@ -188,6 +212,29 @@ RespExpr BaseFamilyTest::Run(std::string_view id, ArgSlice slice) {
   return e;
 }
 
+vector<string> BaseFamilyTest::RunPipeline(const vector<vector<string>>& cmds) {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunPipeline(cmds); });
+  }
+
+  TestConnWrapper* conn_wrapper = AddFindConn(Protocol::REDIS, GetId());
+
+  vector<CmdArgVec> args_vec;
+  for (const auto& cmd : cmds) {
+    vector<string_view> list(cmd.begin(), cmd.end());
+    args_vec.push_back(conn_wrapper->Args(ArgSlice{list.data(), list.size()}));
+  }
+
+  vector<CmdArgList> args_list(args_vec.begin(), args_vec.end());
+  auto* context = conn_wrapper->cmd_cntx();
+
+  service_->DispatchManyCommands(absl::MakeSpan(args_list), context);
+
+  DCHECK(context->transaction == nullptr);
+
+  return conn_wrapper->SplitLines();
+}
+
 auto BaseFamilyTest::RunMC(MP::CmdType cmd_type, string_view key, string_view value, uint32_t flags,
                            chrono::seconds ttl) -> MCResponse {
   if (!ProactorBase::IsProactorThread()) {
@@ -257,6 +304,18 @@ auto BaseFamilyTest::GetMC(MP::CmdType cmd_type, std::initializer_list<std::stri
   return conn->SplitLines();
 }
 
+auto BaseFamilyTest::RunMC(const MP::Command& cmd, std::string_view value) -> MCResponse {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunMC(cmd, value); });
+  }
+
+  TestConnWrapper* conn = AddFindConn(Protocol::MEMCACHE, GetId());
+
+  service_->DispatchMC(cmd, value, conn->cmd_cntx());
+
+  return conn->SplitLines();
+}
+
 int64_t BaseFamilyTest::CheckedInt(std::initializer_list<std::string_view> list) {
   RespExpr resp = Run(list);
   if (resp.type == RespExpr::INT64) {
@@ -336,6 +395,12 @@ string BaseFamilyTest::GetId() const {
   return absl::StrCat("IO", id);
 }
 
+void BaseFamilyTest::CloseConn(string_view conn_id) {
+  auto it = connections_.find(conn_id);
+  CHECK(it != connections_.end());
+  it->second->cmd_cntx()->OnClose();
+}
+
 size_t BaseFamilyTest::SubscriberMessagesLen(string_view conn_id) const {
   auto it = connections_.find(conn_id);
   if (it == connections_.end())
@@ -23,6 +23,11 @@ class TestConnection : public facade::Connection {
 
   void SendMsgVecAsync(const PubMessage& pmsg, util::fibers_ext::BlockingCounter bc) final;
 
+  // Recorded as a message of kInvalidationChannel with space separated keys.
+  void SendMsgAsync(const PubMessage& pmsg, std::shared_ptr<const void> holder) final;
+  void SendInvalidationAsync(std::vector<std::string> keys) final;
+  void SendChangesAsync(std::vector<std::string> records) final;
+
   std::vector<PubMessage> messages;
 
  private:
@@ -50,12 +55,19 @@ class BaseFamilyTest : public ::testing::Test {
 
   RespExpr Run(std::string_view id, ArgSlice list);
 
+  // Dispatches the commands as a single pipeline, see Service::DispatchManyCommands.
+  // Returns the lines of the replies.
+  std::vector<std::string> RunPipeline(const std::vector<std::vector<std::string>>& cmds);
+
   using MCResponse = std::vector<std::string>;
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key, std::string_view value,
                    uint32_t flags = 0, std::chrono::seconds ttl = std::chrono::seconds{});
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key = std::string_view{});
   MCResponse GetMC(MemcacheParser::CmdType cmd_type, std::initializer_list<std::string_view> list);
 
+  // Dispatches a parsed memcache command, e.g. a meta command.
+  MCResponse RunMC(const MemcacheParser::Command& cmd, std::string_view value = std::string_view{});
+
   int64_t CheckedInt(std::initializer_list<std::string_view> list);
 
   bool IsLocked(DbIndex db_index, std::string_view key) const;
@@ -74,6 +86,10 @@ class BaseFamilyTest : public ::testing::Test {
   std::string GetId() const;
   size_t SubscriberMessagesLen(std::string_view conn_id) const;
 
+  // Runs the close handler of the connection like a disconnect does, on the thread of the
+  // connection.
+  void CloseConn(std::string_view conn_id);
+
   // Returns message parts as returned by RESP:
   // pmessage, pattern, channel, message
   facade::Connection::PubMessage GetPublishedMessage(std::string_view conn_id, size_t index) const;
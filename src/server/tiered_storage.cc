@@ -8,15 +8,51 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/base/internal/endian.h>
+#include <absl/strings/str_cat.h>
+#include <absl/time/clock.h>
+#include <fcntl.h>
 #include <mimalloc.h>
+#include <zstd.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
 #include "server/db_slice.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/rdb_load.h"
+#include "server/rdb_save.h"
+#include "server/server_state.h"
+#include "util/fibers/fibers_ext.h"
 #include "util/proactor_base.h"
+#include "util/uring/uring_file.h"
 
 ABSL_FLAG(uint32_t, tiered_storage_max_pending_writes, 32,
           "Maximal number of pending writes per thread");
+ABSL_FLAG(int32_t, tiered_compression_level, 0,
+          "If positive, the string values are compressed with zstd at this level before they "
+          "are written into the backing file, so that more of them fit into a page. 0 disables "
+          "the compression.");
+ABSL_FLAG(uint32_t, tiered_promote_reads, 8,
+          "An external value is moved back into memory once it is read this many times while "
+          "the shard has spare memory. 0 disables the promotion.");
+ABSL_FLAG(double, tiered_high_watermark, 0.9,
+          "Values are unloaded into the backing file once the shard uses more than this share "
+          "of its part of maxmemory, until it uses less than tiered_low_watermark.");
+ABSL_FLAG(double, tiered_low_watermark, 0.8, "See tiered_high_watermark.");
+ABSL_FLAG(uint32_t, tiered_collection_min_bytes, 8192,
+          "Lists, sets, hashes and sorted sets that use fewer bytes stay in memory.");
+ABSL_FLAG(double, tiered_compact_utilization, 0.25,
+          "Batches of the backing file that are utilized below this ratio are rewritten, so that "
+          "their pages are released. 0 disables the compaction.");
+ABSL_FLAG(double, tiered_grow_watermark, 0.85,
+          "The backing file is extended by tiered_grow_mb once this share of it is allocated.");
+ABSL_FLAG(uint32_t, tiered_grow_mb, 256, "By how many megabytes the backing file is extended.");
+ABSL_FLAG(bool, tiered_warm_restart, false,
+          "If true, the backing files are kept across restarts and the snapshots save the "
+          "external values as references into them, so that these values stay on disk when "
+          "the snapshot is loaded. The space of the values that the latest snapshot references "
+          "is reused only once the next snapshot completes.");
 
 namespace dfly {
 using namespace std;
@@ -56,31 +92,40 @@ struct EntryHash {
 const size_t kBatchSize = 4096;
 const size_t kPageAlignment = 4096;
 
+// The file of the tokens of the warm restart: the magic, then the tokens of the committed and
+// of the pending snapshot, little endian.
+constexpr char kTokensMagic[] = "DFTOKENS";
+constexpr size_t kTokensLen = 24;
+
+// The limit of the read counters per shard, see TieredStorage::read_hits_.
+const size_t kMaxReadHits = 1 << 16;
+
 struct TieredStorage::ActiveIoRequest {
   size_t file_offset;
 
   size_t batch_offs;
   char* block_ptr;
 
-  // entry -> offset
-  /*absl::flat_hash_map<IndexKey, size_t, EntryHash, std::equal_to<>,
-                      mi_stl_allocator<std::pair<const IndexKey, size_t>>>*/
-  absl::flat_hash_map<IndexKey, size_t, EntryHash, std::equal_to<>> entries;
+  struct Entry {
+    size_t offset;
+    uint32_t len;      // in the batch.
+    uint32_t raw_len;  // of the value if it is compressed, 0 otherwise.
+  };
 
-  explicit ActiveIoRequest(size_t file_offs) : file_offset(file_offs), batch_offs(0) {
-    block_ptr = (char*)mi_malloc_aligned(kBatchSize, kPageAlignment);
-    DCHECK_EQ(0u, intptr_t(block_ptr) % kPageAlignment);
-  }
+  /*absl::flat_hash_map<IndexKey, Entry, EntryHash, std::equal_to<>,
+                      mi_stl_allocator<std::pair<const IndexKey, Entry>>>*/
+  absl::flat_hash_map<IndexKey, Entry, EntryHash, std::equal_to<>> entries;
 
-  ~ActiveIoRequest() {
-    mi_free(block_ptr);
+  // block is a buffer of kBatchSize bytes of IoMgr::AllocBuffer, which the owner frees.
+  ActiveIoRequest(size_t file_offs, char* block)
+      : file_offset(file_offs), batch_offs(0), block_ptr(block) {
+    DCHECK_EQ(0u, intptr_t(block_ptr) % kPageAlignment);
   }
 
-  bool CanAccommodate(size_t length) const {
-    return batch_offs + length <= kBatchSize;
-  }
+  bool CanAccommodate(size_t length) const;
 
-  void Serialize(IndexKey ikey, const CompactObj& co);
+  // blob is the value of co as it is stored, see TieredStorage::EncodeValue.
+  void Serialize(IndexKey ikey, const CompactObj& co, std::string_view blob, size_t raw_len);
 };
 
 // we need to support migration of keys to other pages.
@@ -90,10 +135,16 @@ struct TieredStorage::ActiveIoRequest {
 // we will need 56*8=448 bytes header for hash entries.
 constexpr size_t kHeaderSize = 448;
 
-void TieredStorage::ActiveIoRequest::Serialize(IndexKey ikey, const CompactObj& co) {
+bool TieredStorage::ActiveIoRequest::CanAccommodate(size_t length) const {
+  // The compressed values are smaller, so the header may fill up before the batch does.
+  return batch_offs + length <= kBatchSize && entries.size() < kHeaderSize / 8;
+}
+
+void TieredStorage::ActiveIoRequest::Serialize(IndexKey ikey, const CompactObj& co,
+                                               string_view blob, size_t raw_len) {
   DCHECK(!co.HasIoPending());
 
-  size_t item_size = co.Size();
+  size_t item_size = blob.size();
   DCHECK_LE(item_size + batch_offs, kBatchSize);
   bool single_item = false;
   if (batch_offs == 0) {
@@ -105,9 +156,10 @@ void TieredStorage::ActiveIoRequest::Serialize(IndexKey ikey, const CompactObj&
       single_item = true;
     }
   }
-  co.GetString(block_ptr + batch_offs);
+  memcpy(block_ptr + batch_offs, blob.data(), item_size);
 
-  bool added = entries.emplace(move(ikey), file_offset + batch_offs).second;
+  Entry entry{file_offset + batch_offs, uint32_t(item_size), uint32_t(raw_len)};
+  bool added = entries.emplace(move(ikey), entry).second;
   CHECK(added);
   if (single_item) {
     batch_offs = kBatchSize;
@@ -119,31 +171,260 @@ void TieredStorage::ActiveIoRequest::Serialize(IndexKey ikey, const CompactObj&
   }
 }
 
+// A read of whole pages that serves all the values in them that are requested while it is in
+// flight. The pages are aligned in memory as well, so that it works with O_DIRECT.
+struct TieredStorage::PageRead {
+  struct Waiter {
+    size_t offset;
+    size_t len;
+    char* dest;
+    ReadCb cb;
+  };
+
+  struct DeferredFree {
+    size_t offset;
+    size_t len;
+  };
+
+  size_t file_offset;
+  size_t len;
+  uint8_t* buf = nullptr;  // of IoMgr::AllocBuffer, allocated once the read is submitted.
+  uint64_t submit_ns = 0;  // set while the latency monitor is enabled.
+
+  std::vector<Waiter> waiters;
+  std::vector<DeferredFree> frees;
+
+  PageRead(size_t offs, size_t sz) : file_offset(offs), len(sz) {
+  }
+
+  bool Covers(size_t offset, size_t sz) const {
+    return offset >= file_offset && offset + sz <= file_offset + len;
+  }
+};
+
 TieredStorage::TieredStorage(DbSlice* db_slice) : db_slice_(*db_slice), pending_req_(256) {
+  if (GetFlag(FLAGS_tiered_compression_level) > 0)
+    cctx_ = ZSTD_createCCtx();
+  dctx_ = ZSTD_createDCtx();
 }
 
 TieredStorage::~TieredStorage() {
-  for (auto* db : db_arr_)
-    delete db;
+  ZSTD_freeCCtx(cctx_);
+  ZSTD_freeDCtx(dctx_);
 }
 
 error_code TieredStorage::Open(const string& path) {
-  error_code ec = io_mgr_.Open(path);
-  if (!ec) {
+  warm_ = GetFlag(FLAGS_tiered_warm_restart);
+  error_code ec = io_mgr_.Open(path, warm_);
+  if (ec)
+    return ec;
+
+  if (!warm_) {
     if (io_mgr_.Span()) {  // Add initial storage.
       alloc_.AddStorage(0, io_mgr_.Span());
     }
+    return ec;
+  }
+
+  // The storage is added by FinishRecovery, once the attached values are known.
+  tokens_path_ = absl::StrCat(path, ".tokens");
+  recovering_ = true;
+  recovered_span_ = io_mgr_.Span();
+
+  auto res = util::uring::OpenLinux(tokens_path_, O_RDONLY | O_CLOEXEC, 0);
+  if (!res)
+    return error_code{};  // the file was not used with the warm restart.
+
+  char buf[kTokensLen] = {0};
+  iovec v{.iov_base = buf, .iov_len = sizeof(buf)};
+  ec = res.value()->Read(&v, 1, 0, 0);
+  res.value()->Close();
+  if (!ec && memcmp(buf, kTokensMagic, 8) == 0) {
+    file_tokens_[0] = absl::little_endian::Load64(buf + 8);
+    file_tokens_[1] = absl::little_endian::Load64(buf + 16);
   }
   return ec;
 }
 
-std::error_code TieredStorage::Read(size_t offset, size_t len, char* dest) {
+void TieredStorage::ReadAsync(size_t offset, size_t len, char* dest, ReadCb cb) {
   stats_.external_reads++;
 
-  return io_mgr_.Read(offset, io::MutableBytes{reinterpret_cast<uint8_t*>(dest), len});
+  size_t page = offset / kPageAlignment;
+  auto [it, inserted] = page_reads_.emplace(page, nullptr);
+  if (!inserted && it->second->Covers(offset, len)) {
+    stats_.external_reads_coalesced++;
+    it->second->waiters.push_back(PageRead::Waiter{offset, len, dest, std::move(cb)});
+    return;
+  }
+
+  size_t start = page * kPageAlignment;
+  size_t end = (offset + len + kPageAlignment - 1) / kPageAlignment * kPageAlignment;
+  PageRead* read = new PageRead{start, end - start};
+  read->waiters.push_back(PageRead::Waiter{offset, len, dest, std::move(cb)});
+
+  // The pages that another read already covers stay with it.
+  if (inserted)
+    it->second = read;
+  for (size_t p = page + 1; p < end / kPageAlignment; ++p)
+    page_reads_.emplace(p, read);
+
+  if (batch_reads_) {
+    queued_reads_.push_back(read);
+  } else {
+    SubmitPageRead(read);
+  }
+}
+
+void TieredStorage::StartReadBatch() {
+  DCHECK(queued_reads_.empty());
+  batch_reads_ = true;
+}
+
+void TieredStorage::SubmitReadBatch() {
+  batch_reads_ = false;
+  FlushQueuedReads();
+}
+
+void TieredStorage::FlushQueuedReads() {
+  if (queued_reads_.empty())
+    return;
+
+  // Bounds the memory of a merged read.
+  constexpr size_t kMaxMergedLen = 256 << 10;
+
+  sort(queued_reads_.begin(), queued_reads_.end(),
+       [](const PageRead* l, const PageRead* r) { return l->file_offset < r->file_offset; });
+
+  // The reads of adjacent or overlapping pages are merged into one.
+  PageRead* merged = nullptr;
+  for (PageRead* read : queued_reads_) {
+    size_t merged_end = merged ? merged->file_offset + merged->len : 0;
+    size_t read_end = read->file_offset + read->len;
+
+    if (merged && read->file_offset <= merged_end &&
+        max(merged_end, read_end) - merged->file_offset <= kMaxMergedLen) {
+      merged->len = max(merged_end, read_end) - merged->file_offset;
+      for (PageRead::Waiter& waiter : read->waiters)
+        merged->waiters.push_back(std::move(waiter));
+      merged->frees.insert(merged->frees.end(), read->frees.begin(), read->frees.end());
+      for (size_t p = read->file_offset / kPageAlignment; p < read_end / kPageAlignment; ++p) {
+        auto it = page_reads_.find(p);
+        if (it != page_reads_.end() && it->second == read)
+          it->second = merged;
+      }
+
+      stats_.external_reads_merged++;
+      delete read;
+      continue;
+    }
+
+    if (merged)
+      SubmitPageRead(merged);
+    merged = read;
+  }
+  SubmitPageRead(merged);
+
+  queued_reads_.clear();
+}
+
+void TieredStorage::SubmitPageRead(PageRead* read) {
+  read->buf = (uint8_t*)io_mgr_.AllocBuffer(read->len);
+
+  ++num_page_reads_;
+  if (LatencyMonitor::IsEnabled())
+    read->submit_ns = util::ProactorBase::GetMonotonicTimeNs();
+  io_mgr_.ReadAsync(read->file_offset, io::MutableBytes{read->buf, read->len},
+                    [this, read](int io_res) { FinishPageRead(io_res, read); });
+}
+
+void TieredStorage::FinishPageRead(int io_res, PageRead* read) {
+  error_code ec;
+  if (io_res < 0) {
+    ec = error_code{-io_res, system_category()};
+  } else if (size_t(io_res) < read->len) {
+    ec = make_error_code(errc::io_error);
+  }
+
+  // The waiters of the values were blocked on the read.
+  if (read->submit_ns) {
+    uint64_t usec = (util::ProactorBase::GetMonotonicTimeNs() - read->submit_ns) / 1000;
+    ServerState::tlocal()->latency_monitor.Add("tiered-read", usec);
+  }
+
+  for (size_t p = read->file_offset / kPageAlignment;
+       p < (read->file_offset + read->len) / kPageAlignment; ++p) {
+    auto it = page_reads_.find(p);
+    if (it != page_reads_.end() && it->second == read)
+      page_reads_.erase(it);
+  }
+
+  for (PageRead::Waiter& waiter : read->waiters) {
+    if (!ec)
+      memcpy(waiter.dest, read->buf + waiter.offset - read->file_offset, waiter.len);
+    waiter.cb(ec);
+  }
+
+  for (const PageRead::DeferredFree& df : read->frees) {
+    ReleaseExtent(df.offset, df.len);
+  }
+
+  io_mgr_.FreeBuffer((char*)read->buf, read->len);
+  delete read;
+  if (--num_page_reads_ == 0)
+    page_reads_ec_.notifyAll();
+}
+
+error_code TieredStorage::Read(size_t offset, size_t len, char* dest) {
+  error_code ec;
+  util::fibers_ext::BlockingCounter bc{1};
+  ReadAsync(offset, len, dest, [&ec, bc](error_code res) mutable {
+    ec = res;
+    bc.Dec();
+  });
+  FlushQueuedReads();
+  bc.Wait();
+
+  return ec;
 }
 
 void TieredStorage::Free(DbIndex db_indx, size_t offset, size_t len) {
+  read_hits_.erase(offset);
+
+  auto* stats = db_slice_.MutableStats(db_indx);
+  stats->external_entries -= 1;
+  stats->external_size -= len;
+
+  // A snapshot may reference the value, see FLAGS_tiered_warm_restart.
+  if (recovering_ || committed_token_ || pending_token_) {
+    pinned_frees_.push_back(PinnedFree{offset, len});
+    return;
+  }
+
+  ReleaseExtent(offset, len);
+}
+
+void TieredStorage::ReleaseExtent(size_t offset, size_t len) {
+  // The page must not be reused before the reads in flight copied the value.
+  auto read_it = page_reads_.find(offset / kPageAlignment);
+  if (read_it != page_reads_.end()) {
+    read_it->second->frees.push_back(PageRead::DeferredFree{offset, len});
+    return;
+  }
+
+  size_t segment = offset / ExternalAllocator::kExtAlignment;
+  auto rec_it = recovered_.find(segment);
+  if (rec_it != recovered_.end()) {
+    DCHECK_GE(rec_it->second, len);
+    recovered_bytes_ -= len;
+    rec_it->second -= len;
+    if (rec_it->second == 0) {
+      size_t start = segment * ExternalAllocator::kExtAlignment;
+      alloc_.AddStorage(start, min(ExternalAllocator::kExtAlignment, recovered_span_ - start));
+      recovered_.erase(rec_it);
+    }
+    return;
+  }
+
   if (offset % 4096 == 0) {
     alloc_.Free(offset, len);
   } else {
@@ -157,22 +438,407 @@ void TieredStorage::Free(DbIndex db_indx, size_t offset, size_t len) {
       alloc_.Free(offs_page * 4096, ExternalAllocator::kMinBlockSize);
       VLOG(1) << "multi_cnt_ erase " << it->first;
       multi_cnt_.erase(it);
+      compact_.pages.erase(offs_page);
     }
   }
+}
 
-  auto* stats = db_slice_.MutableStats(db_indx);
-  stats->external_entries -= 1;
-  stats->external_size -= len;
+error_code TieredStorage::BeginSnapshot(uint64_t token) {
+  DCHECK(warm_ && !pending_token_);
+
+  pending_token_ = token;
+  pinned_before_ = pinned_frees_.size();
+  return WriteTokens();
+}
+
+void TieredStorage::EndSnapshot(bool success) {
+  DCHECK(warm_);
+
+  size_t release_cnt = 0;
+  if (success) {
+    // The values of the snapshot must be on the disk before it replaces the previous one.
+    error_code ec = io_mgr_.Sync();
+    if (!ec) {
+      committed_token_ = pending_token_;
+      release_cnt = pinned_before_;
+    } else {
+      LOG(ERROR) << "Could not sync the backing file: " << ec.message();
+    }
+  }
+  pending_token_ = 0;
+  if (!committed_token_)
+    release_cnt = pinned_frees_.size();
+
+  error_code ec = WriteTokens();
+  LOG_IF(ERROR, ec) << "Could not write " << tokens_path_ << ": " << ec.message();
+
+  // The frees before the start of the committed snapshot are not referenced anymore.
+  for (size_t i = 0; i < release_cnt; ++i) {
+    ReleaseExtent(pinned_frees_[i].offset, pinned_frees_[i].len);
+  }
+  pinned_frees_.erase(pinned_frees_.begin(), pinned_frees_.begin() + release_cnt);
+}
+
+bool TieredStorage::AttachExternal(uint64_t token, ShardId sid, DbIndex db_index,
+                                   unsigned obj_type, size_t offset, size_t len, size_t raw_len,
+                                   PrimeValue* dest) {
+  if (!recovering_ || sid != db_slice_.shard_id() || offset + len > recovered_span_)
+    return false;
+
+  if (token == 0 || (token != file_tokens_[0] && token != file_tokens_[1]))
+    return false;
+
+  // The loaded snapshot becomes the committed one.
+  committed_token_ = token;
+
+  recovered_[offset / ExternalAllocator::kExtAlignment] += len;
+  recovered_bytes_ += len;
+
+  dest->ImportExternal(obj_type, offset, len, raw_len);
+
+  auto* stats = db_slice_.MutableStats(db_index);
+  stats->external_entries += 1;
+  stats->external_size += len;
+  return true;
+}
+
+void TieredStorage::FinishRecovery() {
+  if (!recovering_)
+    return;
+  recovering_ = false;
+
+  for (size_t start = 0; start < recovered_span_; start += ExternalAllocator::kExtAlignment) {
+    if (!recovered_.contains(start / ExternalAllocator::kExtAlignment)) {
+      alloc_.AddStorage(start, min(ExternalAllocator::kExtAlignment, recovered_span_ - start));
+    }
+  }
+
+  // The frees of the values that were attached stay pinned by the loaded snapshot.
+  if (!committed_token_) {
+    for (const PinnedFree& pf : pinned_frees_)
+      ReleaseExtent(pf.offset, pf.len);
+    pinned_frees_.clear();
+  }
+
+  error_code ec = WriteTokens();
+  LOG_IF(ERROR, ec) << "Could not write " << tokens_path_ << ": " << ec.message();
+}
+
+error_code TieredStorage::WriteTokens() {
+  char buf[kTokensLen];
+  memcpy(buf, kTokensMagic, 8);
+  absl::little_endian::Store64(buf + 8, committed_token_);
+  absl::little_endian::Store64(buf + 16, pending_token_);
+
+  // The file is replaced at once, so that a crash leaves either of the versions.
+  string tmp_path = absl::StrCat(tokens_path_, ".tmp");
+  auto res = util::uring::OpenLinux(tmp_path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+  if (!res)
+    return res.error();
+
+  iovec v{.iov_base = buf, .iov_len = sizeof(buf)};
+  error_code ec = res.value()->Write(&v, 1, 0, RWF_DSYNC);
+  error_code close_ec = res.value()->Close();
+  if (ec || close_ec)
+    return ec ? ec : close_ec;
+
+  if (rename(tmp_path.c_str(), tokens_path_.c_str()) < 0)
+    return error_code{errno, system_category()};
+  return ec;
+}
+
+void TieredStorage::RecordRead(DbIndex db_index, PrimeIterator it) {
+  uint32_t promote_reads = GetFlag(FLAGS_tiered_promote_reads);
+  if (promote_reads == 0)
+    return;
+
+  auto [offset, len] = it->second.GetExternalPtr();
+  if (read_hits_.size() >= kMaxReadHits)
+    read_hits_.clear();
+
+  uint32_t& hits = read_hits_[offset];
+  if (++hits < promote_reads)
+    return;
+
+  // Keep a quarter of the share of the shard in maxmemory free for the writes.
+  ssize_t reserve = max_memory_limit / shard_set->size() / 4;
+  if (db_slice_.memory_budget() - ssize_t(len) < reserve)
+    return;
+
+  read_hits_.erase(offset);
+
+  // The read is usually served by the io of the read that counted it.
+  auto value = make_shared<string>(len, '\0');
+  ReadAsync(offset, len, value->data(),
+            [this, db_index, key = it->first.ToString(), offset = offset, value](error_code ec) {
+              if (!ec && !Materialize(db_index, key, offset, *value).is_done())
+                ++stats_.external_promotions;
+            });
+}
+
+PrimeIterator TieredStorage::Materialize(DbIndex db_index, string_view key, size_t offset,
+                                         string_view value) {
+  if (!db_slice_.IsDbValid(db_index))
+    return PrimeIterator{};
+
+  // The key could be deleted, rewritten or unloaded elsewhere while the value was read.
+  PrimeIterator it = db_slice_.GetTables(db_index).first->Find(key);
+  if (it.is_done() || !it->second.IsExternal() ||
+      it->second.GetExternalPtr() != pair{offset, value.size()}) {
+    return PrimeIterator{};
+  }
+
+  PrimeValue& pv = it->second;
+  auto* stats = db_slice_.MutableStats(db_index);
+  if (pv.ObjType() == OBJ_STRING) {
+    string decoded;
+    error_code ec = DecodeValue(value, pv.IsExternalCompressed() ? pv.Size() : 0, &decoded);
+    CHECK(!ec) << "Corrupted external value of " << key << ": " << ec;
+    pv.SetValueString(decoded);
+    stats->strval_memory_usage += pv.MallocUsed();
+  } else {
+    PrimeValue loaded;
+    error_code ec = RdbLoader::LoadValue(value, &loaded);
+    CHECK(!ec) << "Corrupted external value of " << key << ": " << ec;
+
+    bool has_expire = pv.HasExpire();
+    bool has_flag = pv.HasFlag();
+    pv = std::move(loaded);
+    pv.SetExpire(has_expire);
+    pv.SetFlag(has_flag);
+  }
+  stats->obj_memory_usage += pv.MallocUsed();
+
+  Free(db_index, offset, value.size());
+  return it;
+}
+
+void TieredStorage::LoadCollection(DbIndex db_index, string_view key) {
+  PrimeIterator it = db_slice_.GetTables(db_index).first->Find(key);
+  DCHECK(IsValid(it) && it->second.IsExternal());
+
+  auto [offset, len] = it->second.GetExternalPtr();
+  string blob(len, '\0');
+  error_code ec = Read(offset, len, blob.data());
+  CHECK(!ec) << "TBD: " << ec;
+
+  // Does nothing if another fiber has loaded the value while this one was reading it.
+  Materialize(db_index, key, offset, blob);
+}
+
+bool IsCollectionFitToUnload(const PrimeValue& pv) {
+  unsigned obj_type = pv.ObjType();
+  return (obj_type == OBJ_LIST || obj_type == OBJ_SET || obj_type == OBJ_HASH ||
+          obj_type == OBJ_ZSET) &&
+         !pv.IsExternal() && !pv.HasIoPending() &&
+         pv.MallocUsed() >= GetFlag(FLAGS_tiered_collection_min_bytes);
+}
+
+// A collection is written on its own pages, unlike the strings, which are batched.
+struct TieredStorage::CollectionWrite {
+  DbIndex db_indx;
+  string key;
+  uint64_t version;  // of the bucket of the key when the value was serialized.
+  size_t offset;
+  size_t len;
+  char* buf;
+
+  // buf is of IoMgr::AllocBuffer, which the owner frees.
+  CollectionWrite(size_t offs, string_view blob, char* dest)
+      : offset(offs), len(blob.size()), buf(dest) {
+    memcpy(buf, blob.data(), len);
+  }
+
+  string_view aligned_blob() const {
+    return string_view{buf, (len + kPageAlignment - 1) / kPageAlignment * kPageAlignment};
+  }
+};
+
+error_code TieredStorage::UnloadCollection(DbIndex db_index, PrimeIterator it) {
+  DCHECK(IsCollectionFitToUnload(it->second));
+
+  io::StringFile sfile;
+  RdbSerializer serializer(&sfile);
+  RETURN_ON_ERR(serializer.SaveValue(it->second));
+  RETURN_ON_ERR(serializer.FlushMem());
+
+  int64_t res = alloc_.Malloc(sfile.val.size());
+  if (res < 0) {
+    InitiateGrow(-res);
+    return make_error_code(errc::no_space_on_device);
+  }
+
+  size_t aligned_len = (sfile.val.size() + kPageAlignment - 1) / kPageAlignment * kPageAlignment;
+  CollectionWrite* req =
+      new CollectionWrite{size_t(res), sfile.val, io_mgr_.AllocBuffer(aligned_len)};
+  req->db_indx = db_index;
+  req->key = it->first.ToString();
+  req->version = it.GetVersion();
+
+  // The bit keeps the value from being unloaded twice, see IsCollectionFitToUnload.
+  it->second.SetIoPending(true);
+
+  ++num_active_requests_;
+  ++stats_.external_writes;
+  io_mgr_.WriteAsync(req->offset, req->aligned_blob(),
+                     [this, req](int io_res) { FinishCollectionWrite(io_res, req); });
+
+  return error_code{};
+}
+
+void TieredStorage::FinishCollectionWrite(int io_res, CollectionWrite* req) {
+  PrimeIterator it;
+  if (db_slice_.IsDbValid(req->db_indx))
+    it = db_slice_.GetTables(req->db_indx).first->Find(req->key);
+
+  bool unchanged = IsValid(it) && it.GetVersion() == req->version;
+  if (IsValid(it))
+    it->second.SetIoPending(false);
+
+  if (io_res < 0) {
+    LOG(ERROR) << "Error writing into ssd file: " << util::detail::SafeErrorMessage(-io_res);
+  }
+
+  // The value was modified, or the bucket was, while it was written. It stays in memory.
+  if (io_res < 0 || !unchanged || it->second.IsExternal()) {
+    alloc_.Free(req->offset, req->len);
+  } else {
+    PrimeValue& pv = it->second;
+    auto* stats = db_slice_.MutableStats(req->db_indx);
+    stats->obj_memory_usage -= pv.MallocUsed();
+
+    db_slice_.shard_owner()->LazyFreeIfNeeded(&pv, false);
+    pv.SetExternal(req->offset, req->len);
+
+    stats->external_entries += 1;
+    stats->external_size += req->len;
+  }
+
+  io_mgr_.FreeBuffer(req->buf, req->aligned_blob().size());
+  delete req;
+  --num_active_requests_;
+  if (num_active_requests_ == GetFlag(FLAGS_tiered_storage_max_pending_writes) ||
+      num_active_requests_ == 0) {
+    active_req_sem_.notifyAll();
+  }
+}
+
+void TieredStorage::CompactStep() {
+  double utilization = GetFlag(FLAGS_tiered_compact_utilization);
+  if (utilization <= 0)
+    return;
+
+  // Scanning the batches takes time proportional to their number.
+  constexpr uint64_t kCheckIntervalNs = 2'000'000'000;
+
+  // Small files are not worth compacting.
+  constexpr size_t kMinWasteBytes = 4 << 20;
+
+  // Bounds the memory of the values that are read back and the time of a step.
+  constexpr uint32_t kMaxCompactReads = 64;
+  constexpr uint64_t kStepBudgetNs = 500'000;
+
+  // The rewritten values are flushed from here rather than from the io callbacks. The last ones
+  // are flushed once the pass has read all of them.
+  if (compact_.queued && !pending_req_.empty() &&
+      (ShouldFlush() || (!compact_.active && compact_.reads == 0))) {
+    compact_.queued = false;
+    FlushPending();
+  }
+
+  uint64_t now = absl::GetCurrentTimeNanos();
+  if (!compact_.active) {
+    if (now < compact_.next_check_ns)
+      return;
+    compact_.next_check_ns = now + kCheckIntervalNs;
+
+    size_t waste = 0;
+    compact_.pages.clear();
+    for (const auto& [page, mb] : multi_cnt_) {
+      if (mb.used < kBatchSize * utilization) {
+        compact_.pages.insert(page);
+        waste += kBatchSize - mb.used;
+      }
+    }
+
+    if (waste < kMinWasteBytes) {
+      compact_.pages.clear();
+      return;
+    }
+
+    VLOG(1) << "Starting compaction of " << compact_.pages.size() << " batches, " << waste
+            << " bytes wasted";
+    compact_.active = true;
+    compact_.db_indx = 0;
+    compact_.cursor = PrimeTable::cursor{};
+  }
+
+  auto cb = [&](PrimeIterator it) {
+    const PrimeValue& pv = it->second;
+    if (!pv.IsExternal())
+      return;
+
+    auto [offset, len] = pv.GetExternalPtr();
+    if (!compact_.pages.contains(offset / kPageAlignment))
+      return;
+
+    // Once read, the value is queued for the unloading like by UnloadItem, and the next
+    // flush packs it into a fresh batch.
+    ++compact_.reads;
+    auto value = make_shared<string>(len, '\0');
+    ReadAsync(offset, len, value->data(),
+              [this, db_index = compact_.db_indx, key = it->first.ToString(), offset = offset,
+               value](error_code ec) {
+                --compact_.reads;
+                if (ec)
+                  return;
+                PrimeIterator dest = Materialize(db_index, key, offset, *value);
+                if (!dest.is_done()) {
+                  ++stats_.external_compacted;
+                  compact_.queued = true;
+                  pending_req_.EmplaceOrOverride(
+                      PendingReq{dest.bucket_cursor().value(), db_index});
+                }
+              });
+  };
+
+  unsigned iters = 0;
+  while (compact_.db_indx < db_slice_.db_array_size()) {
+    if (compact_.reads >= kMaxCompactReads)
+      return;
+
+    if (!db_slice_.IsDbValid(compact_.db_indx)) {
+      ++compact_.db_indx;
+      continue;
+    }
+
+    PrimeTable* prime = db_slice_.GetTables(compact_.db_indx).first;
+    compact_.cursor = prime->Traverse(compact_.cursor, cb);
+    if (!compact_.cursor) {
+      compact_.cursor = PrimeTable::cursor{};
+      ++compact_.db_indx;
+    }
+
+    if (++iters % 16 == 0 && absl::GetCurrentTimeNanos() > now + kStepBudgetNs)
+      return;
+  }
+
+  compact_.active = false;
+  compact_.pages.clear();
+  VLOG(1) << "Finished compaction, " << stats_.external_compacted << " values rewritten";
 }
 
 void TieredStorage::Shutdown() {
+  page_reads_ec_.await([this] { return num_page_reads_ == 0; });
+  // The buffers of the writes are unregistered from the ring by IoMgr::Shutdown.
+  active_req_sem_.await([this] { return num_active_requests_ == 0; });
   io_mgr_.Shutdown();
 }
 
 TieredStats TieredStorage::GetStats() const {
   TieredStats res = stats_;
   res.storage_capacity = alloc_.capacity();
-  res.storage_reserved = alloc_.allocated_bytes();
+  res.storage_reserved = alloc_.allocated_bytes() + recovered_bytes_;
 
   return res;
 }
@@ -205,54 +871,165 @@ void TieredStorage::FinishIoRequest(int io_res, ActiveIoRequest* req) {
       PrimeIterator it = pt->Find(ikey.key);
       CHECK(it->second.HasIoPending());
       it->second.SetIoPending(false);
+      pending_writes_.erase(pair{ikey.db_indx, it->first.ToString()});
     }
+  } else if (req->entries.empty()) {
+    // All the values were overwritten or deleted while the batch was written, see CancelIo.
+    alloc_.Free(req->file_offset, ExternalAllocator::kMinBlockSize);
   } else {
     uint16_t used_total = 0;
 
+    // The entries that were cancelled are not in the batch anymore, so the page is released
+    // once the values that are left are freed.
     for (const auto& k_v : req->entries) {
       const IndexKey& ikey = k_v.first;
+      const ActiveIoRequest::Entry& entry = k_v.second;
 
-      size_t item_offset = k_v.second;
-      CHECK_EQ(item_offset / 4096, req->file_offset / 4096);
+      CHECK_EQ(entry.offset / 4096, req->file_offset / 4096);
       PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
       PrimeIterator it = pt->Find(ikey.key);
-      CHECK(!it.is_done()) << "TBD";
+      CHECK(!it.is_done());
       CHECK(it->second.HasIoPending());
 
       it->second.SetIoPending(false);
-      size_t item_size = it->second.Size();
-      SetExternal(ikey.db_indx, item_offset, &it->second);
-      used_total += item_size;
+      pending_writes_.erase(pair{ikey.db_indx, it->first.ToString()});
+      SetExternal(ikey.db_indx, entry.offset, entry.len, entry.raw_len, &it->second);
+      used_total += entry.len;
     }
 
-    CHECK_GT(req->entries.size(), 1u);  // multi-item batch
     MultiBatch mb{used_total};
     VLOG(1) << "multi_cnt_ emplace " << req->file_offset / 4096;
     multi_cnt_.emplace(req->file_offset / 4096, mb);
   }
 
+  io_mgr_.FreeBuffer(req->block_ptr, kBatchSize);
   delete req;
   --num_active_requests_;
-  if (num_active_requests_ == GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
+  if (num_active_requests_ == GetFlag(FLAGS_tiered_storage_max_pending_writes) ||
+      num_active_requests_ == 0) {
     active_req_sem_.notifyAll();
   }
 
   VLOG_IF(1, num_active_requests_ == 0) << "Finished active requests";
 }
 
-void TieredStorage::SetExternal(DbIndex db_index, size_t item_offset, PrimeValue* dest) {
+void TieredStorage::CancelIo(DbIndex db_index, PrimeIterator it) {
+  DCHECK(it->second.HasIoPending());
+
+  // A collection is written on its own, its write is dropped by the version check of
+  // FinishCollectionWrite.
+  if (it->second.ObjType() != OBJ_STRING)
+    return;
+
+  auto node = pending_writes_.extract(pair{db_index, it->first.ToString()});
+  CHECK(!node.empty());
+  CHECK_EQ(1u, node.mapped()->entries.erase(IndexKey{db_index, it->first.AsRef()}));
+  it->second.SetIoPending(false);
+}
+
+void TieredStorage::CancelIo(DbIndex db_index) {
+  for (auto it = pending_writes_.begin(); it != pending_writes_.end();) {
+    const auto& [db_indx, key] = it->first;
+    if (db_index != kDbAll && db_index != db_indx) {
+      ++it;
+      continue;
+    }
+
+    CHECK_EQ(1u, it->second->entries.erase(IndexKey{db_indx, PrimeKey{key}}));
+    pending_writes_.erase(it++);
+  }
+}
+
+void TieredStorage::SetExternal(DbIndex db_index, size_t item_offset, size_t len,
+                                size_t raw_len, PrimeValue* dest) {
   auto* stats = db_slice_.MutableStats(db_index);
 
   size_t heap_size = dest->MallocUsed();
-  size_t item_size = dest->Size();
 
   stats->obj_memory_usage -= heap_size;
   stats->strval_memory_usage -= heap_size;
 
-  dest->SetExternal(item_offset, item_size);
+  dest->SetExternal(item_offset, len, raw_len);
 
   stats->external_entries += 1;
-  stats->external_size += item_size;
+  stats->external_size += len;
+}
+
+size_t TieredStorage::EncodeValue(const PrimeValue& pv, string* dest) {
+  pv.GetString(dest);
+
+  // Only the values that fit into the batches are compressed, see CompactObj::SetExternal.
+  size_t size = dest->size();
+  if (!cctx_ || size >= kBatchSize)
+    return 0;
+
+  compress_buf_.resize(ZSTD_compressBound(size));
+  size_t res = ZSTD_compressCCtx(cctx_, compress_buf_.data(), compress_buf_.size(), dest->data(),
+                                 size, GetFlag(FLAGS_tiered_compression_level));
+  if (ZSTD_isError(res) || res + size / 8 >= size)
+    return 0;
+
+  dest->assign(compress_buf_.data(), res);
+  return size;
+}
+
+error_code TieredStorage::DecodeValue(string_view stored, size_t raw_len, string* dest) {
+  if (raw_len == 0) {
+    dest->assign(stored);
+    return error_code{};
+  }
+
+  dest->resize(raw_len);
+  size_t res = ZSTD_decompressDCtx(dctx_, dest->data(), dest->size(), stored.data(),
+                                   stored.size());
+  if (ZSTD_isError(res) || res != dest->size())
+    return make_error_code(errc::illegal_byte_sequence);
+  return error_code{};
+}
+
+void TieredStorage::ReadValueAsync(const PrimeValue& pv, string* dest, ReadCb cb) {
+  auto [offset, len] = pv.GetExternalPtr();
+  if (!pv.IsExternalCompressed()) {
+    dest->resize(len);
+    ReadAsync(offset, len, dest->data(), std::move(cb));
+    return;
+  }
+
+  auto stored = make_shared<string>(len, '\0');
+  ReadAsync(offset, len, stored->data(),
+            [this, raw_len = pv.Size(), stored, dest, cb = std::move(cb)](error_code ec) {
+              if (!ec)
+                ec = DecodeValue(*stored, raw_len, dest);
+              cb(ec);
+            });
+}
+
+error_code TieredStorage::ReadValue(const PrimeValue& pv, string* dest) {
+  error_code ec;
+  util::fibers_ext::BlockingCounter bc{1};
+  ReadValueAsync(pv, dest, [&ec, bc](error_code res) mutable {
+    ec = res;
+    bc.Dec();
+  });
+  FlushQueuedReads();
+  bc.Wait();
+
+  return ec;
+}
+
+error_code TieredStorage::ReadValueRange(const PrimeValue& pv, size_t start, size_t len,
+                                         string* dest) {
+  DCHECK_LE(start + len, pv.Size());
+  if (pv.IsExternalCompressed()) {
+    string val;
+    error_code ec = ReadValue(pv, &val);
+    if (!ec)
+      dest->assign(val, start, len);
+    return ec;
+  }
+
+  dest->resize(len);
+  return Read(pv.GetExternalPtr().first + start, len, dest->data());
 }
 
 bool TieredStorage::ShouldFlush() {
@@ -275,26 +1052,91 @@ error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
   pending_req_.EmplaceOrOverride(PendingReq{it.bucket_cursor().value(), db_index});
   // db->pending_upload[it.bucket_cursor().value()] += blob_len;
 
-  // size_t grow_size = 0;
-
   if (ShouldFlush()) {
     FlushPending();
   }
-
-  // if we reached high utilization of the file range - try to grow the file.
-  if (alloc_.allocated_bytes() > size_t(alloc_.capacity() * 0.85)) {
-    InitiateGrow(1ULL << 28);
-  }
+  GrowIfNeeded();
 
   return ec;
 }
 
+// Unloading a shared string saves memory only once all of its holders are unloaded.
 bool IsObjFitToUnload(const PrimeValue& pv) {
-  return pv.ObjType() == OBJ_STRING && !pv.IsExternal() && pv.Size() >= 64 && !pv.HasIoPending();
+  return pv.ObjType() == OBJ_STRING && !pv.IsExternal() && !pv.IsDedup() && pv.Size() >= 64 &&
+         !pv.HasIoPending();
 };
 
+// The read counter of the key serves as the reference bit of a clock: the unloading passes
+// over the values that were read, decaying them, and takes them on a later pass.
+bool IsColdToUnload(const PrimeKey& pk, const PrimeValue& pv) {
+  return IsObjFitToUnload(pv) && pk.Freq() == 0;
+}
+
+void TieredStorage::UnloadStep() {
+  // Bounds the time the step blocks the shard.
+  constexpr unsigned kMaxTraverse = 64;
+
+  ssize_t share = max_memory_limit / shard_set->size();
+  ssize_t used = share - db_slice_.memory_budget();
+  if (unload_.active) {
+    unload_.active = used > share * GetFlag(FLAGS_tiered_low_watermark);
+  } else if (used > share * GetFlag(FLAGS_tiered_high_watermark)) {
+    VLOG(1) << "Starting to unload, " << used << " bytes used out of " << share;
+    unload_.active = true;
+  }
+
+  if (!unload_.active || OutOfSpace())
+    return;
+
+  GrowIfNeeded();
+
+  bool has_cold = false;
+  auto cb = [&](PrimeIterator it) {
+    bool is_string = IsObjFitToUnload(it->second);
+    if (!is_string && !IsCollectionFitToUnload(it->second))
+      return;
+
+    unsigned freq = it->first.Freq();
+    if (freq > 0) {
+      it->first.SetFreq(freq - 1);
+    } else if (is_string) {
+      has_cold = true;
+    } else {
+      UnloadCollection(unload_.db_indx, it);
+    }
+  };
+
+  for (unsigned i = 0; i < kMaxTraverse; ++i) {
+    if (num_active_requests_ >= GetFlag(FLAGS_tiered_storage_max_pending_writes))
+      return;
+
+    if (unload_.db_indx >= db_slice_.db_array_size())
+      unload_.db_indx = 0;
+
+    if (!db_slice_.IsDbValid(unload_.db_indx)) {
+      ++unload_.db_indx;
+      continue;
+    }
+
+    PrimeTable* prime = db_slice_.GetTables(unload_.db_indx).first;
+    PrimeTable::cursor bucket = unload_.cursor;
+    has_cold = false;
+    unload_.cursor = prime->Traverse(bucket, cb);
+    if (has_cold) {
+      pending_req_.EmplaceOrOverride(PendingReq{bucket.value(), unload_.db_indx});
+      if (ShouldFlush())
+        FlushPending();
+    }
+
+    if (!unload_.cursor) {
+      unload_.cursor = PrimeTable::cursor{};
+      ++unload_.db_indx;
+    }
+  }
+}
+
 void TieredStorage::FlushPending() {
-  DCHECK(!io_mgr_.grow_pending() && !pending_req_.empty());
+  DCHECK(!pending_req_.empty());
 
   vector<pair<DbIndex, uint64_t>> canonic_req;
   canonic_req.reserve(pending_req_.size());
@@ -311,95 +1153,157 @@ void TieredStorage::FlushPending() {
     canonic_req.resize(it - canonic_req.begin());
   }
 
-  // TODO: we could add item size and sort from largest to smallest before
-  // the aggregation.
-  constexpr size_t kMaxBatchLen = 64;
-  PrimeTable::iterator single_batch[kMaxBatchLen];
-  unsigned batch_len = 0;
-
-  auto tr_cb = [&](PrimeTable::iterator it) {
-    if (IsObjFitToUnload(it->second)) {
-      CHECK_LT(batch_len, kMaxBatchLen);
-      single_batch[batch_len++] = it;
-    }
+  // The values are packed before any of the batches is sent, since sending may suspend the
+  // fiber, which invalidates the iterators.
+  struct Candidate {
+    DbIndex db_indx;
+    uint64_t cursor;
+    PrimeIterator it;
+    string blob;  // as it is stored, see EncodeValue.
+    size_t raw_len;
   };
+  vector<Candidate> candidates;
+
+  for (const auto& [db_ind, cursor_val] : canonic_req) {
+    auto tr_cb = [&, db_ind = db_ind, cursor_val = cursor_val](PrimeTable::iterator it) {
+      if (!IsColdToUnload(it->first, it->second))
+        return;
+
+      Candidate& c = candidates.emplace_back();
+      c.db_indx = db_ind;
+      c.cursor = cursor_val;
+      c.it = it;
+      c.raw_len = EncodeValue(it->second, &c.blob);
+
+      // A bigger value would need a batch of its own, which is not supported yet.
+      if (c.blob.size() >= kBatchSize / 2)
+        candidates.pop_back();
+    };
+    db_slice_.GetTables(db_ind).first->Traverse(PrimeTable::cursor{cursor_val}, tr_cb);
+  }
 
-  ActiveIoRequest* active_req = nullptr;
-
-  for (size_t i = 0; i < canonic_req.size(); ++i) {
-    DbIndex db_ind = canonic_req[i].first;
-    uint64_t cursor_val = canonic_req[i].second;
-    PrimeTable::cursor curs(cursor_val);
-    db_slice_.GetTables(db_ind).first->Traverse(curs, tr_cb);
-
-    for (unsigned j = 0; j < batch_len; ++j) {
-      PrimeIterator it = single_batch[j];
-      size_t item_size = it->second.Size();
-      DCHECK_GT(item_size, 0u);
+  // First fit decreasing over a few open batches: the big values are placed first and the
+  // small ones fill the gaps that are left.
+  sort(candidates.begin(), candidates.end(),
+       [](const Candidate& l, const Candidate& r) { return l.blob.size() > r.blob.size(); });
+
+  constexpr size_t kMaxOpenBatches = 4;
+  vector<ActiveIoRequest*> open_reqs, full_reqs;
+  size_t packed = 0;
+
+  for (; packed < candidates.size(); ++packed) {
+    Candidate& c = candidates[packed];
+    size_t item_size = c.blob.size();
+    DCHECK_GT(item_size, 0u);
+
+    auto fit_it = find_if(open_reqs.begin(), open_reqs.end(),
+                          [&](ActiveIoRequest* req) { return req->CanAccommodate(item_size); });
+    ActiveIoRequest* active_req;
+    if (fit_it != open_reqs.end()) {
+      active_req = *fit_it;
+    } else {
+      if (open_reqs.size() == kMaxOpenBatches) {
+        // The fullest batch is the least likely to take more values.
+        auto fullest = max_element(open_reqs.begin(), open_reqs.end(),
+                                   [](ActiveIoRequest* l, ActiveIoRequest* r) {
+                                     return l->batch_offs < r->batch_offs;
+                                   });
+        full_reqs.push_back(*fullest);
+        open_reqs.erase(fullest);
+      }
 
-      if (!active_req || !active_req->CanAccommodate(item_size)) {
-        if (active_req) {  // need to close
-          // save the block asynchronously.
-          ++submitted_io_writes_;
-          submitted_io_write_size_ += kBatchSize;
+      int64_t res = alloc_.Malloc(kBatchSize);
+      if (res < 0) {
+        InitiateGrow(-res);
+        break;
+      }
 
-          SendIoRequest(active_req);
-          active_req = nullptr;
-        }
+      active_req = new ActiveIoRequest(res, io_mgr_.AllocBuffer(kBatchSize));
+      open_reqs.push_back(active_req);
+    }
 
-        int64_t res = alloc_.Malloc(item_size);
-        if (res < 0) {
-          InitiateGrow(-res);
-          return;
-        }
+    active_req->Serialize(IndexKey{c.db_indx, c.it->first.AsRef()}, c.it->second, c.blob,
+                          c.raw_len);
+    c.it->second.SetIoPending(true);
+    pending_writes_[pair{c.db_indx, c.it->first.ToString()}] = active_req;
+  }
 
-        size_t batch_size = ExternalAllocator::GoodSize(item_size);
-        DCHECK_EQ(batch_size, ExternalAllocator::GoodSize(batch_size));
+  // The values that were not packed are flushed with the next batches.
+  for (size_t i = packed; i < candidates.size(); ++i) {
+    pending_req_.EmplaceOrOverride(PendingReq{candidates[i].cursor, candidates[i].db_indx});
+  }
 
-        active_req = new ActiveIoRequest(res);
-      }
+  for (ActiveIoRequest* active_req : open_reqs) {
+    if (active_req->batch_offs >= kBatchSize / 2) {
+      full_reqs.push_back(active_req);
+      continue;
+    }
 
-      active_req->Serialize(IndexKey{db_ind, it->first.AsRef()}, it->second);
-      it->second.SetIoPending(true);
+    // Not enough data to fill the page, so we roll back the pending bit and queue the
+    // values again.
+    for (auto& k_v : active_req->entries) {
+      const IndexKey& ikey = k_v.first;
+      PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
+      PrimeIterator it = pt->Find(ikey.key);
+      it->second.SetIoPending(false);
+      pending_writes_.erase(pair{ikey.db_indx, it->first.ToString()});
+      pending_req_.EmplaceOrOverride(PendingReq{it.bucket_cursor().value(), ikey.db_indx});
     }
-    batch_len = 0;
+    alloc_.Free(active_req->file_offset, ExternalAllocator::kMinBlockSize);
+    io_mgr_.FreeBuffer(active_req->block_ptr, kBatchSize);
+    delete active_req;
   }
 
-  if (active_req) {
-    if (active_req->batch_offs >= kBatchSize / 2) {
-      SendIoRequest(active_req);
-    } else {
-      // not enough data to fill the page.
-      // rollback the pending bit.
-      for (auto& k_v : active_req->entries) {
-        const IndexKey& ikey = k_v.first;
-        PrimeTable* pt = db_slice_.GetTables(ikey.db_indx).first;
-        PrimeIterator it = pt->Find(ikey.key);
-        it->second.SetIoPending(false);
-        // TODO: we could enqueue those back to pending_req.
-      }
-      delete active_req;
-    }
+  for (ActiveIoRequest* active_req : full_reqs) {
+    // save the block asynchronously.
+    ++submitted_io_writes_;
+    submitted_io_write_size_ += kBatchSize;
+
+    SendIoRequest(active_req);
   }
 }
 
+void TieredStorage::GrowIfNeeded() {
+  size_t watermark = alloc_.capacity() * GetFlag(FLAGS_tiered_grow_watermark);
+  if (alloc_.allocated_bytes() > watermark)
+    InitiateGrow(0);
+}
+
+bool TieredStorage::OutOfSpace() const {
+  size_t watermark = alloc_.capacity() * GetFlag(FLAGS_tiered_grow_watermark);
+  return grow_retry_ns_ > uint64_t(absl::GetCurrentTimeNanos()) &&
+         alloc_.allocated_bytes() > watermark;
+}
+
 void TieredStorage::InitiateGrow(size_t grow_size) {
-  if (io_mgr_.grow_pending())
+  // Retrying a failed extension right away would most likely fail as well.
+  constexpr uint64_t kRetryDelayNs = 10'000'000'000;
+
+  if (io_mgr_.grow_pending() || grow_retry_ns_ > uint64_t(absl::GetCurrentTimeNanos()))
     return;
-  DCHECK_GT(grow_size, 0u);
+
+  // The extensions must be multiples of 1MB, see IoMgr::GrowAsync.
+  size_t chunk = size_t(max(GetFlag(FLAGS_tiered_grow_mb), 1u)) << 20;
+  grow_size = max(chunk, (grow_size + (1 << 20) - 1) >> 20 << 20);
 
   size_t start = io_mgr_.Span();
 
   auto cb = [start, grow_size, this](int io_res) {
     if (io_res == 0) {
       alloc_.AddStorage(start, grow_size);
+      grow_retry_ns_ = 0;
     } else {
-      LOG_FIRST_N(ERROR, 10) << "Error enlarging storage " << io_res;
+      LOG_FIRST_N(ERROR, 10) << "Error enlarging storage: "
+                             << util::detail::SafeErrorMessage(-io_res);
+      grow_retry_ns_ = absl::GetCurrentTimeNanos() + kRetryDelayNs;
     }
   };
 
   error_code ec = io_mgr_.GrowAsync(grow_size, move(cb));
-  CHECK(!ec) << "TBD";  // TODO
+  if (ec) {
+    LOG_FIRST_N(ERROR, 10) << "Could not enlarge storage: " << ec.message();
+    grow_retry_ns_ = absl::GetCurrentTimeNanos() + kRetryDelayNs;
+  }
 }
 
 }  // namespace dfly
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
 #include "base/ring_buffer.h"
 #include "core/external_alloc.h"
@@ -12,6 +13,9 @@
 #include "server/table.h"
 #include "util/fibers/event_count.h"
 
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
 namespace dfly {
 
 class DbSlice;
@@ -25,46 +29,161 @@ class TieredStorage {
 
   std::error_code Open(const std::string& path);
 
+  using ReadCb = std::function<void(std::error_code)>;
+
+  // Reads the external value at offset into dest without blocking the shard: cb is called in
+  // the shard thread once dest has it. The concurrent reads of a page share a single io.
+  // The extents that are freed meanwhile are released once the reads of their page complete.
+  void ReadAsync(size_t offset, size_t len, char* dest, ReadCb cb);
+
+  // Until SubmitReadBatch, the reads are only queued, so that the reads of adjacent pages are
+  // merged into a single io. Used by the commands that read many values at once, e.g. MGET.
+  // The blocking reads submit the queued ones as well.
+  void StartReadBatch();
+  void SubmitReadBatch();
+
+  // Suspends the calling fiber until the value is read, see ReadAsync.
   std::error_code Read(size_t offset, size_t len, char* dest);
 
+  // Reads the external string pv into dest and decompresses it if needed, see ReadAsync.
+  // dest must stay alive until cb is called.
+  void ReadValueAsync(const PrimeValue& pv, std::string* dest, ReadCb cb);
+  std::error_code ReadValue(const PrimeValue& pv, std::string* dest);
+
+  // Reads len bytes from start of the external string pv into dest. Only the pages of the range
+  // are read, unless the value is compressed. Blocks the calling fiber.
+  std::error_code ReadValueRange(const PrimeValue& pv, size_t start, size_t len,
+                                 std::string* dest);
+
+  // Queues the bucket of it for the unloading, its cold values are written with the next flush.
   std::error_code UnloadItem(DbIndex db_index, PrimeIterator it);
+
+  // Reads back the external collection of key, which is replaced by the loaded value. Blocks
+  // the calling fiber.
+  void LoadCollection(DbIndex db_index, std::string_view key);
+
+  // Runs a step of the unloading once the shard memory exceeds the high watermark, until it
+  // falls below the low one, see FLAGS_tiered_high_watermark. The values that were not read
+  // since the previous pass over their bucket are unloaded first.
+  void UnloadStep();
+
+  // Counts a read of the external value at it. Once the value is read tiered_promote_reads
+  // times and the shard has spare memory, it is moved back into memory in the background.
+  void RecordRead(DbIndex db_index, PrimeIterator it);
+
   void Free(DbIndex db_indx, size_t offset, size_t len);
 
+  // A string stays in memory while its batch is being written, so it is read from memory until
+  // the write completes. Drops the string at it from its batch before the value is overwritten
+  // or deleted, so that the write does not replace the new value with the old one. The page
+  // stays allocated only for the other values of the batch. Requires: it has an io pending.
+  void CancelIo(DbIndex db_index, PrimeIterator it);
+
+  // Drops all the strings of the db, or of all the dbs with kDbAll, from the batches before
+  // their tables are flushed.
+  void CancelIo(DbIndex db_index);
+
+  // Warm restart, see FLAGS_tiered_warm_restart. The snapshots save the external values as
+  // references into the backing file, so the file keeps the extents that the latest snapshot
+  // references until the next one completes. The tokens of these snapshots are kept next to
+  // the file, so that only their references are attached at startup.
+  bool warm() const {
+    return warm_;
+  }
+
+  // Called before and after a snapshot that saves references with token. Block the calling
+  // fiber.
+  std::error_code BeginSnapshot(uint64_t token);
+  void EndSnapshot(bool success);
+
+  // Called by the loader at startup. Attaches the external value of a reference saved by the
+  // shard sid in the snapshot with token to dest. Returns false if the backing file does not
+  // have the values of that snapshot.
+  bool AttachExternal(uint64_t token, ShardId sid, DbIndex db_index, unsigned obj_type,
+                      size_t offset, size_t len, size_t raw_len, PrimeValue* dest);
+
+  // Passes the parts of the backing file that are not referenced by the attached values to the
+  // allocator. Called once the load at startup finished, blocks the calling fiber.
+  void FinishRecovery();
+
+  // Runs a time-bounded step of the compaction of the backing file, see
+  // FLAGS_tiered_compact_utilization. The live values of the sparse batches are read back and
+  // unloaded again into fresh batches, so that the sparse batches are released.
+  void CompactStep();
+
   void Shutdown();
 
   TieredStats GetStats() const;
 
  private:
   struct ActiveIoRequest;
+  struct PageRead;
+  struct CollectionWrite;
+
+  // Returns the extent to the allocator once the reads of its page complete.
+  void ReleaseExtent(size_t offset, size_t len);
+
+  // Writes the tokens of the snapshots whose references are in the backing file.
+  std::error_code WriteTokens();
 
   bool ShouldFlush();
 
+  void FlushQueuedReads();
+  void SubmitPageRead(PageRead* read);
+  void FinishPageRead(int io_res, PageRead* read);
+
   void FlushPending();
+
+  // Starts to extend the backing file once the share of it that is allocated passes
+  // tiered_grow_watermark, so that the unloading does not wait for the space.
+  void GrowIfNeeded();
+
+  // Extends the backing file by at least size bytes, unless it is being extended already or
+  // the previous extension failed recently, see grow_retry_ns_.
   void InitiateGrow(size_t size);
+
+  // True while the backing file can not be extended and is about to fill up, in which case
+  // the values stay in memory.
+  bool OutOfSpace() const;
+
   void SendIoRequest(ActiveIoRequest* req);
   void FinishIoRequest(int io_res, ActiveIoRequest* req);
-  void SetExternal(DbIndex db_index, size_t item_offset, PrimeValue* dest);
+  // raw_len is the length of the value if it is stored compressed in len bytes, 0 otherwise.
+  void SetExternal(DbIndex db_index, size_t item_offset, size_t len, size_t raw_len,
+                   PrimeValue* dest);
+
+  // Puts the string pv into dest as it is stored, compressed if tiered_compression_level is
+  // set and that makes it smaller. Returns the length of the value if it is compressed, 0
+  // otherwise.
+  size_t EncodeValue(const PrimeValue& pv, std::string* dest);
+  std::error_code DecodeValue(std::string_view stored, size_t raw_len, std::string* dest);
+
+  // Serializes the collection at it into its own pages. The value is replaced by its external
+  // pointer once the write completes, unless its bucket was modified meanwhile.
+  std::error_code UnloadCollection(DbIndex db_index, PrimeIterator it);
+  void FinishCollectionWrite(int io_res, CollectionWrite* req);
+
+  // Replaces the external value of key with value and frees its extent if it is still at
+  // offset. A collection is loaded from its serialized value, see RdbSerializer::SaveValue.
+  // Returns the entry of the key or a done iterator if the value has changed.
+  PrimeIterator Materialize(DbIndex db_index, std::string_view key, size_t offset,
+                            std::string_view value);
 
   DbSlice& db_slice_;
   IoMgr io_mgr_;
   ExternalAllocator alloc_;
 
+  ZSTD_CCtx* cctx_ = nullptr;
+  ZSTD_DCtx* dctx_ = nullptr;
+  std::string compress_buf_;
+
   size_t submitted_io_writes_ = 0;
   size_t submitted_io_write_size_ = 0;
   uint32_t num_active_requests_ = 0;
   util::fibers_ext::EventCount active_req_sem_;
 
-  struct Hasher {
-    size_t operator()(const PrimeKey& o) const {
-      return o.HashCode();
-    }
-  };
-
-  struct PerDb {
-    absl::flat_hash_map<PrimeKey, ActiveIoRequest*, Hasher> active_requests;
-  };
-
-  std::vector<PerDb*> db_arr_;
+  // The batches of the strings that are being written, see CancelIo.
+  absl::flat_hash_map<std::pair<DbIndex, std::string>, ActiveIoRequest*> pending_writes_;
 
   struct PendingReq {
     uint64_t cursor;
@@ -89,6 +208,62 @@ class TieredStorage {
   };
   absl::flat_hash_map<uint32_t, MultiBatch> multi_cnt_;
 
+  // The reads that are queued or in flight by their pages. A page belongs to the first read
+  // that covers it.
+  absl::flat_hash_map<size_t, PageRead*> page_reads_;
+  uint32_t num_page_reads_ = 0;  // the submitted ones, including those not in page_reads_.
+  std::vector<PageRead*> queued_reads_;  // see StartReadBatch.
+  bool batch_reads_ = false;
+  util::fibers_ext::EventCount page_reads_ec_;
+
+  // The reads of the external values by their offset. The counters are reset once there are
+  // too many of them, so that only the values that are read often in a while are promoted.
+  absl::flat_hash_map<size_t, uint32_t> read_hits_;
+
+  struct CompactState {
+    absl::flat_hash_set<uint32_t> pages;  // the sparse batches of the pass by page.
+    DbIndex db_indx = 0;
+    PrimeTable::cursor cursor;
+    bool active = false;
+    uint32_t reads = 0;   // the values of the pass that are being read back.
+    bool queued = false;  // some of them wait in pending_req_ for a flush.
+    uint64_t next_check_ns = 0;
+  };
+
+  CompactState compact_;
+
+  struct UnloadState {
+    DbIndex db_indx = 0;
+    PrimeTable::cursor cursor;
+    bool active = false;  // from the high watermark down to the low one.
+  };
+
+  UnloadState unload_;
+
+  // Once an extension of the backing file fails, the next one is attempted from this time on.
+  uint64_t grow_retry_ns_ = 0;
+
+  // See FLAGS_tiered_warm_restart.
+  struct PinnedFree {
+    size_t offset;
+    size_t len;
+  };
+
+  std::string tokens_path_;
+  bool warm_ = false;
+  bool recovering_ = false;  // until FinishRecovery.
+  uint64_t committed_token_ = 0;  // of the latest snapshot that completed.
+  uint64_t pending_token_ = 0;    // of the snapshot in progress.
+  uint64_t file_tokens_[2] = {0, 0};  // found next to the backing file at startup.
+  std::vector<PinnedFree> pinned_frees_;
+  size_t pinned_before_ = 0;  // pinned_frees_ that precede the snapshot in progress.
+
+  // Live bytes of the attached values by segment, i.e. ExternalAllocator::kExtAlignment. A
+  // segment is passed to the allocator once its values are freed.
+  absl::flat_hash_map<size_t, size_t> recovered_;
+  size_t recovered_bytes_ = 0;
+  size_t recovered_span_ = 0;  // of the backing file at startup.
+
   TieredStats stats_;
 };
 
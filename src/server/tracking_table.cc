@@ -0,0 +1,139 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tracking_table.h"
+
+#include <absl/strings/match.h>
+
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/engine_shard_set.h"
+#include "server/server_state.h"
+#include "util/proactor_base.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+
+void TrackingTable::Track(ArgSlice args, unsigned step, const Target& target) {
+  DCHECK_GT(step, 0u);
+
+  for (size_t i = 0; i < args.size(); i += step) {
+    keys_.try_emplace(args[i]).first->second.insert(target);
+  }
+}
+
+void TrackingTable::AddPrefixes(const vector<string>& prefixes, const Target& target) {
+  for (const auto& prefix : prefixes) {
+    prefixes_[prefix].insert(target);
+  }
+}
+
+void TrackingTable::RemovePrefixes(const vector<string>& prefixes, const Target& target) {
+  for (const auto& prefix : prefixes) {
+    auto it = prefixes_.find(prefix);
+    if (it == prefixes_.end())
+      continue;
+
+    it->second.erase(target);
+    if (it->second.empty())
+      prefixes_.erase(it);
+  }
+}
+
+void TrackingTable::Invalidate(string_view key) {
+  // Clients track the key again when they read it after the invalidation.
+  auto it = keys_.find(key);
+  if (it != keys_.end()) {
+    for (const Target& target : it->second) {
+      AddPending(target, key);
+    }
+    keys_.erase(it);
+  }
+
+  for (const auto& [prefix, targets] : prefixes_) {
+    if (absl::StartsWith(key, prefix)) {
+      for (const Target& target : targets) {
+        AddPending(target, key);
+      }
+    }
+  }
+}
+
+void TrackingTable::InvalidateAll() {
+  auto add = [this](const TargetSet& targets) {
+    for (const Target& target : targets) {
+      Invalidation& inv = pending_[target.thread_id][target.client_id];
+      inv.all = true;
+      inv.keys.clear();
+    }
+  };
+
+  for (const auto& k_v : keys_) {
+    add(k_v.second);
+  }
+  for (const auto& k_v : prefixes_) {
+    add(k_v.second);
+  }
+
+  keys_.clear();
+  if (!pending_.empty())
+    ScheduleFlush();
+}
+
+void TrackingTable::AddPending(const Target& target, string_view key) {
+  Invalidation& inv = pending_[target.thread_id][target.client_id];
+  if (!inv.all)
+    inv.keys.emplace(key);
+
+  ScheduleFlush();
+}
+
+void TrackingTable::ScheduleFlush() {
+  if (flush_scheduled_)
+    return;
+
+  flush_scheduled_ = true;
+
+  // Runs after the current task of the shard thread, so that the invalidations of all the
+  // writes of the task are sent together.
+  ProactorBase::me()->DispatchBrief([] {
+    EngineShard* shard = EngineShard::tlocal();
+    if (shard)
+      shard->db_slice().tracking().Flush();
+  });
+}
+
+void TrackingTable::Flush() {
+  flush_scheduled_ = false;
+
+  for (auto& [thread_id, batch] : pending_) {
+    auto shared_batch = make_shared<ClientBatch>(std::move(batch));
+    shard_set->pool()->at(thread_id)->DispatchBrief(
+        [shared_batch] { Deliver(shared_batch.get()); });
+  }
+
+  pending_.clear();
+}
+
+void TrackingTable::Deliver(ClientBatch* batch) {
+  const auto& targets = ServerState::tlocal()->tracking_targets;
+
+  for (auto& [client_id, inv] : *batch) {
+    // The target has unsubscribed or closed since.
+    auto it = targets.find(client_id);
+    if (it == targets.end())
+      continue;
+
+    // Empty keys invalidate the whole cache.
+    vector<string> keys;
+    if (!inv.all)
+      keys.assign(inv.keys.begin(), inv.keys.end());
+
+    it->second->SendInvalidationAsync(std::move(keys));
+  }
+}
+
+}  // namespace dfly
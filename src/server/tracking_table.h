@@ -0,0 +1,85 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// Keys and prefixes that are tracked by the clients that enabled CLIENT TRACKING, one table
+// per shard. Keys read in the default mode are tracked until they are invalidated once, prefixes
+// of the broadcasting mode until the client disables tracking.
+//
+// Invalidations are gathered per thread of the receiving connections and sent once the running
+// shard task finishes, so that a burst of writes produces a single message per client.
+class TrackingTable {
+ public:
+  // The connection that receives the invalidations.
+  struct Target {
+    uint32_t client_id = 0;
+    uint32_t thread_id = 0;
+
+    bool operator==(const Target& o) const {
+      return client_id == o.client_id && thread_id == o.thread_id;
+    }
+
+    template <typename H> friend H AbslHashValue(H h, const Target& t) {
+      return H::combine(std::move(h), t.client_id, t.thread_id);
+    }
+  };
+
+  bool empty() const {
+    return keys_.empty() && prefixes_.empty();
+  }
+
+  // Tracks every step-th argument of args, i.e. the keys of a read command.
+  void Track(ArgSlice args, unsigned step, const Target& target);
+
+  // Broadcasting mode. The empty prefix matches all the keys.
+  void AddPrefixes(const std::vector<std::string>& prefixes, const Target& target);
+  void RemovePrefixes(const std::vector<std::string>& prefixes, const Target& target);
+
+  // Called when the key is changed or deleted.
+  void Invalidate(std::string_view key);
+
+  // Called when the databases are flushed. All the clients are told to drop their caches.
+  void InvalidateAll();
+
+  size_t tracked_keys() const {
+    return keys_.size();
+  }
+
+ private:
+  using TargetSet = absl::flat_hash_set<Target>;
+
+  struct Invalidation {
+    absl::flat_hash_set<std::string> keys;
+    bool all = false;
+  };
+
+  // Pending invalidations of a thread by client id.
+  using ClientBatch = absl::flat_hash_map<uint32_t, Invalidation>;
+
+  void AddPending(const Target& target, std::string_view key);
+  void ScheduleFlush();
+  void Flush();
+
+  // Runs in the thread of the connections of the batch.
+  static void Deliver(ClientBatch* batch);
+
+  absl::flat_hash_map<std::string, TargetSet> keys_;
+  absl::flat_hash_map<std::string, TargetSet> prefixes_;
+
+  absl::flat_hash_map<uint32_t, ClientBatch> pending_;  // by thread id.
+  bool flush_scheduled_ = false;
+};
+
+}  // namespace dfly
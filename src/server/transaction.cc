@@ -5,20 +5,36 @@
 #include "server/transaction.h"
 
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "facade/request_tracer.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/db_slice.h"
 #include "server/engine_shard_set.h"
+#include "server/journal.h"
+#include "server/mapped_snapshot.h"
+
+ABSL_FLAG(bool, optimistic_reads, false,
+          "If true, read-only multi-shard commands like MGET first try to run without entering "
+          "the transaction queues and fall back to the regular scheduling when they conflict "
+          "with writes");
+ABSL_FLAG(uint32_t, shard_chunk_elements, 16384,
+          "SMEMBERS, HGETALL, HKEYS and HVALS read the values with more elements in hops of about "
+          "this many elements, between which their shards run the transactions on the other "
+          "keys. 0 - the values are read in a single hop");
 
 namespace dfly {
 
 using namespace std;
 using namespace util;
+using absl::GetFlag;
 using absl::StrCat;
 
 thread_local Transaction::TLTmpSpace Transaction::tmp_space;
+thread_local Transaction::TLPool Transaction::tl_pool;
 
 namespace {
 
@@ -26,6 +42,12 @@ std::atomic_uint64_t op_seq{1};
 
 [[maybe_unused]] constexpr size_t kTransSize = sizeof(Transaction);
 
+void UpdateMax(uint64_t val, atomic_uint64_t* dest) {
+  uint64_t cur = dest->load(memory_order_relaxed);
+  while (cur < val && !dest->compare_exchange_weak(cur, val, memory_order_relaxed)) {
+  }
+}
+
 }  // namespace
 
 IntentLock::Mode Transaction::Mode() const {
@@ -56,6 +78,63 @@ Transaction::~Transaction() {
            << " destroyed";
 }
 
+Transaction::TLPool::~TLPool() {
+  for (Transaction* trans : items) {
+    delete trans;
+  }
+}
+
+Transaction* Transaction::New(const CommandId* cid) {
+  auto& items = tl_pool.items;
+  if (items.empty())
+    return new Transaction{cid};
+
+  Transaction* trans = items.back();
+  items.pop_back();
+  trans->Reinit(cid);
+
+  return trans;
+}
+
+void Transaction::Recycle(Transaction* trans) {
+  // Enough to serve the concurrent commands of a thread. Transactions are usually released by
+  // the thread that created them, hence the pools do not drift much.
+  constexpr size_t kMaxPooled = 256;
+
+  auto& items = tl_pool.items;
+  if (items.size() >= kMaxPooled) {
+    delete trans;
+    return;
+  }
+
+  // Release what the transaction references right away.
+  trans->cb_ = nullptr;
+  trans->key_ready_checker_ = nullptr;
+  trans->key_consumer_ = nullptr;
+  trans->multi_.reset();
+  items.push_back(trans);
+}
+
+void Transaction::Reinit(const CommandId* cid) {
+  DCHECK_EQ(0u, use_count());
+
+  auto shard_data = std::move(shard_data_);
+  auto args = std::move(args_);
+  auto reverse_index = std::move(reverse_index_);
+
+  // Reconstruct rather than reset the fields one by one, so that no state leaks into the
+  // next command.
+  this->~Transaction();
+  new (this) Transaction{cid};
+
+  shard_data.clear();
+  args.clear();
+  reverse_index.clear();
+  shard_data_ = std::move(shard_data);
+  args_ = std::move(args);
+  reverse_index_ = std::move(reverse_index);
+}
+
 /**
  *
  * There are 4 options that we consider here:
@@ -100,6 +179,14 @@ OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
     return OpStatus::OK;
   }
 
+  return InitByArgs(index, args, key_index);
+}
+
+OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args, const KeyIndex& key_index) {
+  db_index_ = index;
+
+  DCHECK_EQ(unique_shard_cnt_, 0u);
+  DCHECK(args_.empty());
   DCHECK_LT(key_index.start, args.size());
   DCHECK_GT(key_index.start, 0u);
 
@@ -334,9 +421,23 @@ bool Transaction::RunInShard(EngineShard* shard) {
 
   /*************************************************************************/
   // Actually running the callback.
+  if (mode == IntentLock::EXCLUSIVE)
+    shard->db_slice().keyspace_events().SetCommand(Name());
+
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   try {
+    if (!was_suspended && shard->mapped_snapshot())
+      MaterializeKeys(shard);
+
     // if transaction is suspended (blocked in watched queue), then it's a noop.
     OpStatus status = was_suspended ? OpStatus::OK : cb_(this, shard);
+    if (mode == IntentLock::EXCLUSIVE) {
+      FinishWrite(shard, idx);
+      if (should_release && unique_shard_cnt_ > 1)
+        RecordJournalBarrier(shard, nullptr);
+    }
+    if (tracking_target_.client_id)
+      TrackKeys(shard);
 
     if (unique_shard_cnt_ == 1) {
       cb_ = nullptr;  // We can do it because only a single thread runs the callback.
@@ -355,6 +456,7 @@ bool Transaction::RunInShard(EngineShard* shard) {
   } catch (std::exception& e) {
     LOG(FATAL) << "Unexpected exception " << e.what();
   }
+  RecordHopLatency(start_ns, sd.pickup_ns);
 
   /*************************************************************************/
 
@@ -412,6 +514,8 @@ void Transaction::ScheduleInternal() {
   DCHECK_EQ(0u, txid_);
   DCHECK_EQ(0, coordinator_state_ & (COORD_SCHED | COORD_OOO));
 
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+
   bool span_all = IsGlobal();
   bool single_hop = (coordinator_state_ & COORD_EXEC_CONCLUDING);
 
@@ -448,6 +552,7 @@ void Transaction::ScheduleInternal() {
 
     auto cb = [&](EngineShard* shard) {
       pair<bool, bool> res = ScheduleInShard(shard);
+      shard->RecordSchedule(res.first, res.second);
       success.fetch_add(res.first, memory_order_relaxed);
       lock_granted_cnt.fetch_add(res.second, memory_order_relaxed);
     };
@@ -508,6 +613,10 @@ void Transaction::ScheduleInternal() {
       sd.local_mask |= OUT_OF_ORDER;
     }
   }
+
+  uint64_t end_ns = ProactorBase::GetMonotonicTimeNs();
+  schedule_ns_ += end_ns - start_ns;
+  facade::RequestTracer::Record(trace_id_, "schedule", start_ns, end_ns);
 }
 
 // Optimized "Schedule and execute" function for the most common use-case of a single hop
@@ -521,6 +630,12 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
   // single hop -> concluding.
   coordinator_state_ |= (COORD_EXEC | COORD_EXEC_CONCLUDING);
 
+  if (coordinator_state_ & COORD_INLINE) {
+    RunInline();
+    WaitForJournal();
+    return local_result_;
+  }
+
   if (!multi_) {  // for non-multi transactions we schedule exactly once.
     DCHECK_EQ(0, coordinator_state_ & COORD_SCHED);
   }
@@ -531,6 +646,7 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
     DCHECK_EQ(1u, shard_data_.size());
 
     shard_data_[0].local_mask |= ARMED;
+    hop_start_ns_ = ProactorBase::GetMonotonicTimeNs();
 
     // memory_order_release because we do not want it to be reordered with shard_data writes
     // above.
@@ -564,12 +680,114 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
   DVLOG(1) << "ScheduleSingleHop before Wait " << DebugId() << " " << run_count_.load();
   WaitForShardCallbacks();
   DVLOG(1) << "ScheduleSingleHop after Wait " << DebugId();
+  CollectHopLatency();
+  WaitForJournal();
 
   cb_ = nullptr;
 
   return local_result_;
 }
 
+void Transaction::ExecuteChunked(std::function<bool(Transaction* t, EngineShard*)> cb,
+                                 std::function<void()> after_hop) {
+  DCHECK(CanRunChunked());
+  Schedule();
+
+  // Execute waits for all the shards, which orders the stores before the loads.
+  atomic_bool more{true};
+  while (more.load(memory_order_relaxed)) {
+    more.store(false, memory_order_relaxed);
+    Execute(
+        [&](Transaction* t, EngineShard* shard) {
+          if (cb(t, shard))
+            more.store(true, memory_order_relaxed);
+          return OpStatus::OK;
+        },
+        false);
+    if (after_hop)
+      after_hop();
+  }
+
+  Execute([](Transaction* t, EngineShard* shard) { return OpStatus::OK; }, true);
+}
+
+OpStatus Transaction::ScheduleReadOptimistic(RunnableType cb) {
+  bool optimistic = GetFlag(FLAGS_optimistic_reads) && !multi_ && !IsGlobal() &&
+                    unique_shard_cnt_ > 1 && Mode() == IntentLock::SHARED &&
+                    (coordinator_state_ & COORD_INLINE) == 0;
+
+  if (optimistic) {
+    cb_ = cb;
+    optimistic = RunOptimistic();
+    cb_ = nullptr;
+
+    if (optimistic)
+      return OpStatus::OK;
+  }
+
+  return ScheduleSingleHop(std::move(cb));
+}
+
+// Runs in the coordinator fiber.
+// The transaction reads its keys in each shard while nobody holds their exclusive locks, and
+// then validates that no write transaction has run in these shards since. Writers that span
+// multiple shards keep their locks until they run in the last of them, therefore the results
+// correspond to the state of the db at the moment between the two phases.
+bool Transaction::RunOptimistic() {
+  DCHECK_GT(unique_shard_cnt_, 1u);
+
+  auto is_active = [this](uint32_t i) { return shard_data_[i].arg_count > 0; };
+  auto no_conflict = [this](EngineShard* shard) {
+    return shard->shard_lock()->Check(IntentLock::SHARED) &&
+           shard->db_slice().CheckLock(IntentLock::SHARED, GetLockArgs(shard->shard_id()));
+  };
+
+  vector<uint64_t> epochs(shard_data_.size());
+  atomic_bool conflict{false};
+
+  // The callbacks may block on io, hence they run via the shard queues and not as brief tasks.
+  fibers_ext::BlockingCounter bc{0};
+  for (ShardId i = 0; i < shard_data_.size(); ++i) {
+    if (!is_active(i))
+      continue;
+
+    bc.Add(1);
+    shard_set->Add(i, [&, bc]() mutable {
+      EngineShard* shard = EngineShard::tlocal();
+      if (no_conflict(shard)) {
+        if (cb_(this, shard) != OpStatus::OK)
+          conflict.store(true, memory_order_relaxed);
+        epochs[shard->shard_id()] = shard->write_epoch();
+
+        // The keys are tracked as they are read, a write after the read invalidates them even
+        // if the validation fails and the read is repeated.
+        if (tracking_target_.client_id)
+          TrackKeys(shard);
+      } else {
+        shard->IncOptimisticRun(true);
+        conflict.store(true, memory_order_relaxed);
+      }
+      bc.Dec();
+    });
+  }
+  bc.Wait();
+
+  if (!conflict.load(memory_order_relaxed)) {
+    auto validate = [&](EngineShard* shard) {
+      ShardId sid = shard->shard_id();
+      bool ok = epochs[sid] == shard->write_epoch() && no_conflict(shard);
+      shard->IncOptimisticRun(!ok);
+      if (!ok)
+        conflict.store(true, memory_order_relaxed);
+    };
+    shard_set->RunBriefInParallel(std::move(validate), is_active);
+  }
+
+  DVLOG(1) << "RunOptimistic " << DebugId() << " conflict: " << conflict.load();
+
+  return !conflict.load(memory_order_relaxed);
+}
+
 // Runs in the coordinator fiber.
 void Transaction::UnlockMulti() {
   VLOG(1) << "UnlockMulti " << DebugId();
@@ -611,11 +829,19 @@ void Transaction::Execute(RunnableType cb, bool conclude) {
     coordinator_state_ &= ~COORD_EXEC_CONCLUDING;
   }
 
+  if (coordinator_state_ & COORD_INLINE) {
+    RunInline();
+    WaitForJournal();
+    return;
+  }
+
   ExecuteAsync();
 
   DVLOG(1) << "Wait on Exec " << DebugId();
   WaitForShardCallbacks();
   DVLOG(1) << "Wait on Exec " << DebugId() << " completed";
+  CollectHopLatency();
+  WaitForJournal();
 
   cb_ = nullptr;
 }
@@ -649,6 +875,7 @@ void Transaction::ExecuteAsync() {
   }
 
   uint32_t seq = seqlock_.load(memory_order_relaxed);
+  hop_start_ns_ = ProactorBase::GetMonotonicTimeNs();
 
   // this fence prevents that a read or write operation before a release fence will be reordered
   // with a write operation after a release fence. Specifically no writes below will be reordered
@@ -676,6 +903,8 @@ void Transaction::ExecuteAsync() {
     // Otherwise, this callback is redundant. We may still call PollExecution but
     // we should not pass this to it since it can be in undefined state for this callback.
     if (should_poll) {
+      shard_data_[SidToId(shard->shard_id())].pickup_ns = ProactorBase::GetMonotonicTimeNs();
+
       // shard->PollExecution(this) does not necessarily execute this transaction.
       // Therefore, everything that should be handled during the callback execution
       // should go into RunInShard.
@@ -687,14 +916,15 @@ void Transaction::ExecuteAsync() {
   };
 
   // IsArmedInShard is the protector of non-thread safe data.
+  // The callbacks of concurrent transactions of this thread are batched per shard.
   if (!is_global && unique_shard_cnt_ == 1) {
-    shard_set->Add(unique_shard_id_, std::move(cb));  // serves as a barrier.
+    shard_set->AddBatched(unique_shard_id_, cb);  // serves as a barrier.
   } else {
     for (ShardId i = 0; i < shard_data_.size(); ++i) {
       auto& sd = shard_data_[i];
       if (!is_global && sd.arg_count == 0)
         continue;
-      shard_set->Add(i, cb);  // serves as a barrier.
+      shard_set->AddBatched(i, cb);  // serves as a barrier.
     }
   }
 }
@@ -712,20 +942,169 @@ void Transaction::RunQuickie(EngineShard* shard) {
   DVLOG(1) << "RunQuickSingle " << DebugId() << " " << shard->shard_id() << " " << args_[0];
   CHECK(cb_) << DebugId() << " " << shard->shard_id() << " " << args_[0];
 
+  if (Mode() == IntentLock::EXCLUSIVE)
+    shard->db_slice().keyspace_events().SetCommand(Name());
+
   // Calling the callback in somewhat safe way
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   try {
+    if (shard->mapped_snapshot())
+      MaterializeKeys(shard);
     local_result_ = cb_(this, shard);
+    if (Mode() == IntentLock::EXCLUSIVE) {
+      FinishWrite(shard, 0);
+    }
+    if (tracking_target_.client_id)
+      TrackKeys(shard);
   } catch (std::bad_alloc&) {
     LOG_FIRST_N(ERROR, 16) << " out of memory";
     local_result_ = OpStatus::OUT_OF_MEMORY;
   } catch (std::exception& e) {
     LOG(FATAL) << "Unexpected exception " << e.what();
   }
+  RecordHopLatency(start_ns);
 
   sd.local_mask &= ~ARMED;
   cb_ = nullptr;  // We can do it because only a single shard runs the callback.
 }
 
+void Transaction::SetInline() {
+  DCHECK(!multi_);
+  DCHECK(!IsGlobal());
+  DCHECK_EQ(1u, unique_shard_cnt_);
+  DCHECK_EQ(0, coordinator_state_ & COORD_SCHED);
+
+  coordinator_state_ |= COORD_INLINE;
+}
+
+void Transaction::RunInline() {
+  EngineShard* shard = EngineShard::tlocal();
+  DCHECK(shard && shard->shard_id() == unique_shard_id_);
+
+  DVLOG(1) << "RunInline " << DebugId() << " " << args_[0];
+
+  try {
+    if (shard->mapped_snapshot())
+      MaterializeKeys(shard);
+    local_result_ = cb_(this, shard);
+    if (Mode() == IntentLock::EXCLUSIVE) {
+      FinishWrite(shard, SidToId(shard->shard_id()));
+    }
+    if (tracking_target_.client_id)
+      TrackKeys(shard);
+  } catch (std::bad_alloc&) {
+    LOG_FIRST_N(ERROR, 16) << " out of memory";
+    local_result_ = OpStatus::OUT_OF_MEMORY;
+  } catch (std::exception& e) {
+    LOG(FATAL) << "Unexpected exception " << e.what();
+  }
+
+  cb_ = nullptr;
+}
+
+void Transaction::TrackKeys(EngineShard* shard) {
+  ArgSlice keys = ShardArgsInShard(shard->shard_id());
+  shard->db_slice().tracking().Track(keys, cid_->key_arg_step(), tracking_target_);
+}
+
+void Transaction::MaterializeKeys(EngineShard* shard) {
+  if (IsGlobal() || args_.empty())
+    return;
+
+  ArgSlice keys = ShardArgsInShard(shard->shard_id());
+  shard->mapped_snapshot()->Materialize(db_index_, keys, cid_->key_arg_step());
+}
+
+void Transaction::RecordHopLatency(uint64_t start_ns, uint64_t pickup_ns) {
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+
+  // hop_start_ns_ is written before the hop is dispatched to the shard queues. The hop may run
+  // before its own callback is picked up, when another transaction polls the tx queue, then
+  // pickup_ns is stale and the hop did not wait for the locks.
+  if (pickup_ns == 0 || pickup_ns < hop_start_ns_ || pickup_ns > start_ns)
+    pickup_ns = start_ns;
+
+  if (pickup_ns > hop_start_ns_)
+    UpdateMax(pickup_ns - hop_start_ns_, &hop_queue_ns_);
+  UpdateMax(start_ns - pickup_ns, &hop_lock_ns_);
+  UpdateMax(now - start_ns, &hop_exec_ns_);
+
+  if (trace_id_) {
+    string shard = absl::StrCat("shard ", EngineShard::tlocal()->shard_id());
+    facade::RequestTracer::Record(trace_id_, "tx_queue", min(hop_start_ns_, pickup_ns), pickup_ns,
+                                  shard);
+    facade::RequestTracer::Record(trace_id_, "lock_wait", pickup_ns, start_ns, shard);
+    facade::RequestTracer::Record(trace_id_, "shard_exec", start_ns, now, shard);
+  }
+}
+
+void Transaction::CollectHopLatency() {
+  queue_ns_ += hop_queue_ns_.exchange(0, memory_order_relaxed);
+  lock_ns_ += hop_lock_ns_.exchange(0, memory_order_relaxed);
+  exec_ns_ += hop_exec_ns_.exchange(0, memory_order_relaxed);
+}
+
+void Transaction::FinishWrite(EngineShard* shard, unsigned idx) {
+  shard->IncWriteEpoch();
+
+  // Evicting within the callback could invalidate the entries it references. The evictions are
+  // committed into the journal together with the writes.
+  DbSlice& db_slice = shard->db_slice();
+  if (db_slice.eviction_pending()) {
+    constexpr unsigned kMaxEvictionBuckets = 8;
+    db_slice.EvictionStep(kMaxEvictionBuckets);
+  }
+  shard->PublishUsedMemory(false);
+
+  db_slice.keyspace_events().Commit(&db_slice);
+  CommitJournal(shard, idx);
+}
+
+void Transaction::CommitJournal(EngineShard* shard, unsigned idx) {
+  Journal* journal = shard->journal();
+  if (!journal)
+    return;
+
+  // The lsn is read by the coordinator once the hop has finished.
+  auto& sd = shard_data_[idx];
+  sd.journal = journal;
+  sd.journal_lsn = journal->Commit();
+}
+
+void Transaction::RecordJournalBarrier(EngineShard* shard,
+                                       const std::vector<KeyList>* sharded_keys) {
+  Journal* journal = shard->journal();
+  if (!journal || !journal->IsStreaming() || txid_ == 0)
+    return;
+
+  // Every shard of the transaction computes the same list.
+  vector<ShardId> shards;
+  for (ShardId sid = 0; sid < shard_set->size(); ++sid) {
+    bool writes = false;
+    if (sharded_keys) {
+      writes = (multi_->multi_opts & CO::GLOBAL_TRANS) ||
+               any_of((*sharded_keys)[sid].begin(), (*sharded_keys)[sid].end(),
+                      [](const auto& k_v) { return k_v.second.cnt[IntentLock::EXCLUSIVE] > 0; });
+    } else {
+      writes = IsGlobal() || IsActive(sid);
+    }
+    if (writes)
+      shards.push_back(sid);
+  }
+
+  if (shards.size() > 1 && find(shards.begin(), shards.end(), shard->shard_id()) != shards.end())
+    journal->RecordBarrier(txid_, shards);
+}
+
+void Transaction::WaitForJournal() {
+  for (auto& sd : shard_data_) {
+    if (sd.journal_lsn) {
+      sd.journal->WaitDurable(sd.journal_lsn);
+      sd.journal_lsn = 0;
+    }
+  }
+}
+
 // runs in coordinator thread.
 // Marks the transaction as expired and removes it from the waiting queue.
 void Transaction::ExpireBlocking() {
@@ -792,6 +1171,7 @@ bool Transaction::ScheduleUniqueShard(EngineShard* shard) {
   // we can do it because only a single thread writes into txid_ and sd.
   txid_ = op_seq.fetch_add(1, std::memory_order_relaxed);
   sd.pq_pos = shard->txq()->Insert(this);
+  shard->RecordSchedule(true, false);
 
   DCHECK_EQ(0, sd.local_mask & KEYLOCK_ACQUIRED);
   bool lock_acquired = shard->db_slice().Acquire(mode, lock_args);
@@ -925,7 +1305,14 @@ size_t Transaction::ReverseArgIndex(ShardId shard_id, size_t arg_index) const {
   return reverse_index_[sd.arg_start + arg_index];
 }
 
-bool Transaction::WaitOnWatch(const time_point& tp) {
+bool Transaction::WaitOnWatch(const time_point& tp, KeyReadyChecker krc, KeyConsumer kc) {
+  DCHECK_EQ(0, coordinator_state_ & COORD_INLINE) << "Can not block inline";
+  key_ready_checker_ = move(krc);
+
+  // The keys of multiple shards are consumed atomically only by the transaction itself.
+  if (unique_shard_cnt_ == 1)
+    key_consumer_ = move(kc);
+
   // Assumes that transaction is pending and scheduled. TODO: To verify it with state machine.
   VLOG(2) << "WaitOnWatch Start use_count(" << use_count() << ")";
   using namespace chrono;
@@ -957,7 +1344,13 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
   if ((coordinator_state_ & COORD_CANCELLED) || status == cv_status::timeout) {
     ExpireBlocking();
     coordinator_state_ &= ~COORD_BLOCKED;
-    return false;
+
+    // The shard could consume the key right before the expiry.
+    if (!watch_consumed())
+      return false;
+
+    WaitForJournal();
+    return true;
   }
 
 #if 0
@@ -987,6 +1380,10 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
   // Lift blocking mask.
   coordinator_state_ &= ~COORD_BLOCKED;
 
+  // The consumer wrote in the shard in place of the concluding hop.
+  if (watch_consumed())
+    WaitForJournal();
+
   return true;
 }
 
@@ -1006,26 +1403,34 @@ OpStatus Transaction::AddToWatchedShardCb(EngineShard* shard) {
 }
 
 void Transaction::ExpireShardCb(EngineShard* shard) {
-  auto lock_args = GetLockArgs(shard->shard_id());
-  shard->db_slice().Release(Mode(), lock_args);
-
   unsigned sd_idx = SidToId(shard->shard_id());
   auto& sd = shard_data_[sd_idx];
-  sd.local_mask |= EXPIRED_Q;
-  sd.local_mask &= ~KEYLOCK_ACQUIRED;
 
-  shard->blocking_controller()->RemoveWatched(this);
+  // ConsumeOnWatch() has already released the locks and removed the transaction from the
+  // watch queues.
+  if ((sd.local_mask & CONSUMED_Q) == 0) {
+    auto lock_args = GetLockArgs(shard->shard_id());
+    shard->db_slice().Release(Mode(), lock_args);
 
-  // Need to see why I decided to call this.
-  // My guess - probably to trigger the run of stalled transactions in case
-  // this shard concurrently awoke this transaction and stalled the processing
-  // of TxQueue.
-  shard->PollExecution("expirecb", nullptr);
+    sd.local_mask |= EXPIRED_Q;
+    sd.local_mask &= ~KEYLOCK_ACQUIRED;
+
+    shard->blocking_controller()->RemoveWatched(this);
+
+    // Need to see why I decided to call this.
+    // My guess - probably to trigger the run of stalled transactions in case
+    // this shard concurrently awoke this transaction and stalled the processing
+    // of TxQueue.
+    shard->PollExecution("expirecb", nullptr);
+  }
 
   CHECK_GE(DecreaseRunCnt(), 1u);
 }
 
 void Transaction::UnlockMultiShardCb(const std::vector<KeyList>& sharded_keys, EngineShard* shard) {
+  // The barrier is recorded while the keys are still locked.
+  RecordJournalBarrier(shard, &sharded_keys);
+
   if (multi_->multi_opts & CO::GLOBAL_TRANS) {
     shard->shard_lock()->Release(IntentLock::EXCLUSIVE);
   }
@@ -1107,6 +1512,30 @@ bool Transaction::IsGlobal() const {
   return (cid_->opt_mask() & CO::GLOBAL_TRANS) != 0;
 }
 
+bool Transaction::IsFastLane() const {
+  uint32_t mask = cid_->opt_mask();
+  return (mask & CO::FAST) && !(mask & (CO::ADMIN | CO::BLOCKING | CO::GLOBAL_TRANS)) && !multi_ &&
+         unique_shard_cnt_ == 1;
+}
+
+bool Transaction::CanBypassInShard(EngineShard* shard) const {
+  ShardId sid = shard->shard_id();
+  if (!IsFastLane() || !IsArmedInShard(sid))
+    return false;
+
+  // The armed flag is published after the coordinator state, see IsArmedInShard.
+  if (!(coordinator_state_ & COORD_EXEC_CONCLUDING))
+    return false;
+
+  KeyLockArgs lock_args = GetLockArgs(sid);
+  if (lock_args.args.empty() || !(GetLocalMask(sid) & KEYLOCK_ACQUIRED))
+    return false;
+
+  // The shard lock covers the global transactions that may have run some hops already.
+  IntentLock::Mode mode = Mode();
+  return shard->shard_lock()->Check(mode) && shard->db_slice().CheckOwnLock(mode, lock_args);
+}
+
 // Runs only in the shard thread.
 // Returns true if the transacton has changed its state from suspended to awakened,
 // false, otherwise.
@@ -1145,6 +1574,40 @@ bool Transaction::NotifySuspended(TxId committed_txid, ShardId sid) {
   return false;
 }
 
+// Runs only in the shard thread.
+bool Transaction::ConsumeOnWatch(EngineShard* shard, string_view key, PrimeIterator it) {
+  unsigned idx = SidToId(shard->shard_id());
+  auto& sd = shard_data_[idx];
+
+  // Neither awakened nor expired transactions are consumed, and neither are the transactions
+  // without a consumer, which are those that span multiple shards.
+  if ((sd.local_mask & (SUSPENDED_Q | EXPIRED_Q)) != SUSPENDED_Q || !key_consumer_)
+    return false;
+
+  DbSlice& db_slice = shard->db_slice();
+  db_slice.keyspace_events().SetCommand(Name());
+  if (!key_consumer_(key, it))
+    return false;
+
+  DVLOG(1) << "ConsumeOnWatch " << DebugId() << " key " << key;
+  FinishWrite(shard, idx);
+
+  // The suspended transaction has kept its locks since AddToWatchedShardCb().
+  db_slice.Release(Mode(), GetLockArgs(shard->shard_id()));
+  sd.local_mask &= ~(SUSPENDED_Q | KEYLOCK_ACQUIRED);
+  sd.local_mask |= EXPIRED_Q | CONSUMED_Q;
+
+  return true;
+}
+
+// Runs only in the shard thread. The coordinator may destroy the transaction right after.
+void Transaction::NotifyConsumed(EngineShard* shard) {
+  DCHECK(GetLocalMask(shard->shard_id()) & CONSUMED_Q);
+
+  notify_txid_.store(shard->committed_txid(), memory_order_relaxed);
+  blocking_ec_.notify();  // release barrier.
+}
+
 void Transaction::BreakOnClose() {
   if (coordinator_state_ & COORD_BLOCKED) {
     coordinator_state_ |= COORD_CANCELLED;
@@ -1166,14 +1629,65 @@ OpResult<KeyIndex> DetermineKeys(const CommandId* cid, CmdArgList args) {
 
     string_view name{cid->name()};
 
-    if (!absl::StartsWith(name, "EVAL")) {
+    // XREAD[GROUP] ... STREAMS <key1> [<key2> ...] <id1> [<id2> ...]
+    if (absl::StartsWith(name, "XREAD")) {
+      for (size_t i = cid->first_key_pos() - 1; i < args.size(); ++i) {
+        if (!absl::EqualsIgnoreCase(ArgS(args, i), "STREAMS"))
+          continue;
+
+        size_t left = args.size() - i - 1;
+        if (left == 0 || left % 2 != 0)
+          return OpStatus::SYNTAX_ERR;
+
+        key_index.start = i + 1;
+        key_index.end = key_index.start + left / 2;
+        key_index.step = 1;
+        return key_index;
+      }
+      return OpStatus::SYNTAX_ERR;
+    }
+
+    // MIGRATE <host> <port> <key>|"" <db> <timeout> [COPY] [REPLACE] [AUTH <password>]
+    //         [AUTH2 <username> <password>] [KEYS <key1> [<key2> ...]]
+    if (name == "MIGRATE") {
+      if (!ArgS(args, 3).empty()) {
+        key_index.start = 3;
+        key_index.end = 4;
+        key_index.step = 1;
+        return key_index;
+      }
+
+      for (size_t i = 6; i < args.size(); ++i) {
+        string_view opt = ArgS(args, i);
+        if (absl::EqualsIgnoreCase(opt, "AUTH")) {
+          i += 1;
+        } else if (absl::EqualsIgnoreCase(opt, "AUTH2")) {
+          i += 2;
+        } else if (absl::EqualsIgnoreCase(opt, "KEYS") && i + 1 < args.size()) {
+          key_index.start = i + 1;
+          key_index.end = args.size();
+          key_index.step = 1;
+          return key_index;
+        }
+      }
+      return OpStatus::SYNTAX_ERR;
+    }
+
+    if (absl::EndsWith(name, "STORE")) {
       key_index.bonus = 1;  // Z<xxx>STORE commands
     }
-    string_view num(ArgS(args, 2));
+
+    // numkeys precedes the keys.
+    unsigned num_pos = cid->first_key_pos() - 1;
+    string_view num(ArgS(args, num_pos));
     if (!absl::SimpleAtoi(num, &num_custom_keys) || num_custom_keys < 0)
       return OpStatus::INVALID_INT;
 
-    if (size_t(num_custom_keys) + 3 > args.size())
+    // Only EVAL may have no keys, the STORE commands still have the destination.
+    if (num_custom_keys == 0 && !key_index.bonus && !absl::StartsWith(name, "EVAL"))
+      return OpStatus::SYNTAX_ERR;
+
+    if (size_t(num_custom_keys) + num_pos + 1 > args.size())
       return OpStatus::SYNTAX_ERR;
   }
 
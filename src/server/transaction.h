@@ -17,12 +17,14 @@
 #include "facade/op_status.h"
 #include "server/common.h"
 #include "server/table.h"
+#include "server/tracking_table.h"
 #include "util/fibers/fibers_ext.h"
 
 namespace dfly {
 
 class EngineShard;
 class BlockingController;
+class Journal;
 
 using facade::OpStatus;
 using facade::OpResult;
@@ -43,7 +45,7 @@ class Transaction {
   friend void intrusive_ptr_release(Transaction* trans) noexcept {
     if (1 == trans->use_count_.fetch_sub(1, std::memory_order_release)) {
       std::atomic_thread_fence(std::memory_order_acquire);
-      delete trans;
+      Recycle(trans);
     }
   }
 
@@ -51,6 +53,13 @@ class Transaction {
   using RunnableType = std::function<OpStatus(Transaction* t, EngineShard*)>;
   using time_point = ::std::chrono::steady_clock::time_point;
 
+  // Tells in the shard thread whether the watched key is ready for the blocked transaction.
+  using KeyReadyChecker = std::function<bool(std::string_view key, const PrimeValue& pv)>;
+
+  // Runs in the shard thread when the watched key becomes ready and completes the blocked
+  // command right there, like popping its elements. Returns false if it did not consume anything.
+  using KeyConsumer = std::function<bool(std::string_view key, PrimeIterator it)>;
+
   enum LocalMask : uint16_t {
     ARMED = 1,  // Transaction was armed with the callback
     OUT_OF_ORDER = 2,
@@ -58,12 +67,22 @@ class Transaction {
     SUSPENDED_Q = 0x10,  // added by the coordination flow (via WaitBlocked()).
     AWAKED_Q = 0x20,     // awaked by condition (lpush etc)
     EXPIRED_Q = 0x40,    // timed-out and should be garbage collected from the blocking queue.
+    CONSUMED_Q = 0x80,   // completed by its key consumer in the shard, see WaitOnWatch().
   };
 
   explicit Transaction(const CommandId* cid);
 
+  // Same as new Transaction{cid} but reuses a transaction that was released by this thread
+  // if there is one. Reused transactions keep the capacity of their argument arrays, so that
+  // a command usually runs without allocating its transaction.
+  static Transaction* New(const CommandId* cid);
+
   OpStatus InitByArgs(DbIndex index, CmdArgList args);
 
+  // Same as above but with key_index given by the caller instead of the command spec.
+  // Used to lock the keys of several commands with a single transaction, see Service::Exec.
+  OpStatus InitByArgs(DbIndex index, CmdArgList args, const KeyIndex& key_index);
+
   void SetExecCmd(const CommandId* cid);
 
   std::string DebugId() const;
@@ -102,7 +121,11 @@ class Transaction {
   // Schedules a transaction. Usually used for multi-hop transactions like Rename or BLPOP.
   // For single hop, use ScheduleSingleHop instead.
   void Schedule() {
-    ScheduleInternal();
+    if (coordinator_state_ & COORD_INLINE) {
+      coordinator_state_ |= COORD_SCHED;  // inline transactions run under the caller's locks.
+    } else {
+      ScheduleInternal();
+    }
   }
 
   // if conclude is true, removes the transaction from the pending queue.
@@ -112,6 +135,25 @@ class Transaction {
   // will be ill-defined.
   OpStatus ScheduleSingleHop(RunnableType cb);
 
+  // Schedules the transaction and runs cb in hops until it returns false in all the shards, then
+  // concludes. The keys stay locked between the hops, while the shards run the transactions on
+  // their other keys. Fits the reads of the large values, which would stall the shards if they
+  // ran in a single hop, see FLAGS_shard_chunk_elements. after_hop runs in the coordinator after
+  // each hop of cb, e.g. to send the part of the reply that the hop produced.
+  // Requires: CanRunChunked().
+  void ExecuteChunked(std::function<bool(Transaction* t, EngineShard*)> cb,
+                      std::function<void()> after_hop = {});
+
+  // The hops of the multi and the inline transactions run under the locks of their callers.
+  bool CanRunChunked() const {
+    return !multi_ && (coordinator_state_ & COORD_INLINE) == 0;
+  }
+
+  // Same as ScheduleSingleHop but read-only multi-shard transactions first try to run without
+  // entering the tx queues, see RunOptimistic(). If they conflict with writes, they are scheduled
+  // regularly and cb runs again. Therefore cb must assign its results rather than accumulate them.
+  OpStatus ScheduleReadOptimistic(RunnableType cb);
+
   // Fits only for single key scenarios because it writes into shared variable res from
   // potentially multiple threads.
   template <typename F> auto ScheduleSingleHopT(F&& f) -> decltype(f(this, nullptr)) {
@@ -143,6 +185,30 @@ class Transaction {
     return unique_shard_cnt_;
   }
 
+  // Valid if unique_shard_cnt() == 1.
+  ShardId unique_shard_id() const {
+    return unique_shard_id_;
+  }
+
+  // Runs the hops of the transaction right away in the calling shard thread instead of
+  // dispatching them via the shard queue. Used by the pipeline squashing that runs single-shard
+  // commands from within their shard, see Service::DispatchManyCommands.
+  // The caller must hold the locks of the transaction keys.
+  // Requires: non-multi, non-global transaction that spans a single shard.
+  void SetInline();
+
+  // Registers the keys of the transaction in the tracking tables of their shards once its
+  // callback runs, see CLIENT TRACKING.
+  void SetTrackingTarget(const TrackingTable::Target& target) {
+    tracking_target_ = target;
+  }
+
+  // Records the stages of the transaction in the trace of the sampled command, see
+  // facade::RequestTracer.
+  void SetTraceId(uint64_t trace_id) {
+    trace_id_ = trace_id;
+  }
+
   TxId notify_txid() const {
     return notify_txid_.load(std::memory_order_relaxed);
   }
@@ -157,11 +223,54 @@ class Transaction {
     return coordinator_state_ & COORD_OOO;
   }
 
+  // The transactions of the FAST commands that span a single shard form the fast lane of the
+  // tx queue, the rest are in the slow lane, see EngineShard::PollExecution.
+  bool IsFastLane() const;
+
+  // Latency breakdown of the transaction in nanoseconds, accumulated over all its hops.
+  // See TxStage for the meaning of the stages.
+  uint64_t schedule_ns() const {
+    return schedule_ns_;
+  }
+
+  uint64_t queue_ns() const {
+    return queue_ns_;
+  }
+
+  uint64_t lock_ns() const {
+    return lock_ns_;
+  }
+
+  uint64_t exec_ns() const {
+    return exec_ns_;
+  }
+
   // Registers transaction into watched queue and blocks until a) either notification is received.
   // or b) tp is reached. If tp is time_point::max() then waits indefinitely.
   // Expects that the transaction had been scheduled before, and uses Execute(.., true) to register.
   // Returns false if timeout ocurred, true if was notified by one of the keys.
-  bool WaitOnWatch(const time_point& tp);
+  // The transaction is notified only about the keys that krc accepts, by default about the
+  // lists.
+  // If kc is set and the transaction spans a single shard, the shard runs kc on the ready key
+  // instead of waking the transaction up, and the transaction concludes without another hop.
+  // Then watch_consumed() is true, and WaitOnWatch returns true even if tp has been reached
+  // meanwhile.
+  bool WaitOnWatch(const time_point& tp, KeyReadyChecker krc = {}, KeyConsumer kc = {});
+
+  // Called by the coordinator once WaitOnWatch() has returned.
+  bool watch_consumed() const {
+    return key_consumer_ && (shard_data_[SidToId(unique_shard_id_)].local_mask & CONSUMED_Q);
+  }
+
+  // Runs in the shard thread. Returns true if the consumer of the suspended transaction
+  // consumed key. Then the transaction is not watched anymore and must be passed to
+  // NotifyConsumed() once the blocking controller has removed it from its watch queues.
+  bool ConsumeOnWatch(EngineShard* shard, std::string_view key, PrimeIterator it);
+  void NotifyConsumed(EngineShard* shard);
+
+  const KeyReadyChecker& key_ready_checker() const {
+    return key_ready_checker_;
+  }
 
   // Returns true if transaction is awaked, false if it's timed-out and can be removed from the
   // blocking queue. NotifySuspended may be called from (multiple) shard threads and
@@ -179,6 +288,11 @@ class Transaction {
   //! Runs in the shard thread.
   KeyLockArgs GetLockArgs(ShardId sid) const;
 
+  //! Returns true if the fast lane transaction is armed for its last hop and none of the
+  //! transactions queued before it holds its keys, so it can run ahead of them.
+  //! Runs in the shard thread.
+  bool CanBypassInShard(EngineShard* shard) const;
+
  private:
 
   struct LockCnt {
@@ -199,6 +313,13 @@ class Transaction {
   // Optimized version of RunInShard for single shard uncontended cases.
   void RunQuickie(EngineShard* shard);
 
+  // Runs cb_ in the calling thread. See SetInline().
+  void RunInline();
+
+  // Runs cb_ in all the shards of the transaction without scheduling it.
+  // Returns false if the results must be discarded due to concurrent writes.
+  bool RunOptimistic();
+
   //! Returns true if transaction run out-of-order during the scheduling phase.
   bool ScheduleUniqueShard(EngineShard* shard);
 
@@ -225,6 +346,45 @@ class Transaction {
     seqlock_.fetch_add(1, std::memory_order_relaxed);
   }
 
+  // Runs in the shard thread. Records the queue, lock and execution latencies of the current hop
+  // given the time when the hop callback started running and the time when the shard picked up
+  // the hop from its task queue, 0 if not known.
+  void RecordHopLatency(uint64_t start_ns, uint64_t pickup_ns = 0);
+
+  // Runs in the shard thread after the callback if the transaction has a tracking target.
+  void TrackKeys(EngineShard* shard);
+
+  // Runs in the shard thread before the callback. Materializes the keys of the hop that are
+  // still in the mapped snapshot of the shard, see FLAGS_snapshot_mapped.
+  void MaterializeKeys(EngineShard* shard);
+
+  // Runs in the coordinator thread after the hop has finished. Adds the latencies of the slowest
+  // shard of the hop to the totals.
+  void CollectHopLatency();
+
+  // Runs in the shard thread after a write callback. Evicts the keys if the writes exhausted
+  // the memory budget of the shard, see DbSlice::EvictionStep, publishes the used memory and
+  // commits the changes. idx is the index of the shard in shard_data_.
+  void FinishWrite(EngineShard* shard, unsigned idx);
+
+  // Commits the changes into the journal of the shard, if it is enabled.
+  void CommitJournal(EngineShard* shard, unsigned idx);
+
+  // Runs in the shard thread after the last write of a transaction that spans the shards, so
+  // that the replicas apply its writes on all the shards together. sharded_keys are the locks
+  // of a multi transaction, null otherwise.
+  void RecordJournalBarrier(EngineShard* shard, const std::vector<KeyList>* sharded_keys);
+
+  // Runs in the coordinator thread after the hop has finished. Blocks until the journals
+  // with journal_fsync=always have the changes of the hop on the disk.
+  void WaitForJournal();
+
+  // Puts trans into the pool of this thread or deletes it if the pool is full.
+  static void Recycle(Transaction* trans);
+
+  // Brings the transaction to its freshly constructed state.
+  void Reinit(const CommandId* cid);
+
   // Returns the previous value of run count.
   uint32_t DecreaseRunCnt();
 
@@ -244,6 +404,13 @@ class Transaction {
     // tx queue.
     uint32_t pq_pos = TxQueue::kEnd;
 
+    // When the shard thread picked up the current hop from its task queue.
+    uint64_t pickup_ns = 0;
+
+    // Set by CommitJournal if the coordinator must wait for the journal.
+    Journal* journal = nullptr;
+    uint64_t journal_lsn = 0;
+
     PerShardData(PerShardData&&) noexcept {
     }
 
@@ -278,6 +445,8 @@ class Transaction {
   std::vector<uint32_t> reverse_index_;
 
   RunnableType cb_;
+  KeyReadyChecker key_ready_checker_;  // Set by WaitOnWatch().
+  KeyConsumer key_consumer_;           // Set by WaitOnWatch().
   std::unique_ptr<Multi> multi_;  // Initialized when the transaction is multi/exec.
 
   const CommandId* cid_;
@@ -293,9 +462,18 @@ class Transaction {
   ShardId unique_shard_id_{kInvalidSid};
   DbIndex db_index_ = 0;
 
+  TrackingTable::Target tracking_target_;  // client_id 0 - the keys are not tracked.
+
   // Used for single-hop transactions with unique_shards_ == 1, hence no data-race.
   OpStatus local_result_ = OpStatus::OK;
 
+  // Latency breakdown, see schedule_ns() etc. hop_start_ns_ is written by the coordinator before
+  // the hop is dispatched, the hop maximums are updated by the shard threads.
+  uint64_t schedule_ns_ = 0, queue_ns_ = 0, lock_ns_ = 0, exec_ns_ = 0;
+  uint64_t hop_start_ns_ = 0;
+  uint64_t trace_id_ = 0;  // of the sampled command, read by the shard threads.
+  std::atomic_uint64_t hop_queue_ns_{0}, hop_lock_ns_{0}, hop_exec_ns_{0};
+
   enum CoordinatorState : uint8_t {
     COORD_SCHED = 1,
     COORD_EXEC = 2,
@@ -305,6 +483,7 @@ class Transaction {
     COORD_BLOCKED = 8,
     COORD_CANCELLED = 0x10,
     COORD_OOO = 0x20,
+    COORD_INLINE = 0x40,
   };
 
   // Transaction coordinator state, written and read by coordinator thread.
@@ -329,6 +508,14 @@ class Transaction {
   };
 
   static thread_local TLTmpSpace tmp_space;
+
+  struct TLPool {
+    std::vector<Transaction*> items;
+
+    ~TLPool();
+  };
+
+  static thread_local TLPool tl_pool;
 };
 
 inline uint16_t trans_id(const Transaction* ptr) {
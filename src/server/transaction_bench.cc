@@ -0,0 +1,281 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Measures the overhead of scheduling the transactions on the shards. The callbacks of the hops
+// do nothing, so the times are those of the coordination between the threads, the transaction
+// queues and the key locks, except for MULTI/EXEC that runs the commands via the Service.
+
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <mimalloc.h>
+
+#include <boost/fiber/fiber.hpp>
+#include <chrono>
+#include <iostream>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "io/io.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/main_service.h"
+#include "server/transaction.h"
+#include "server/tx_stats.h"
+#include "util/uring/uring_pool.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+ABSL_DECLARE_FLAG(uint32_t, num_shards);
+ABSL_DECLARE_FLAG(std::string, dbfilename);
+
+ABSL_FLAG(uint32_t, threads, 8, "The threads of the pool, at least the largest number of shards");
+ABSL_FLAG(std::string, shards, "2,8", "A comma-separated list of the numbers of shards to run");
+ABSL_FLAG(uint32_t, fibers, 4, "The fibers per thread that run transactions concurrently");
+ABSL_FLAG(uint32_t, n, 20000, "The transactions per fiber");
+ABSL_FLAG(uint32_t, hops, 4, "The hops of the multi-hop transactions");
+ABSL_FLAG(std::string, bench, "", "If set, runs only the benchmarks whose names contain it");
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using absl::StrCat;
+namespace fibers = ::boost::fibers;
+
+namespace dfly {
+namespace {
+
+using Clock = chrono::steady_clock;
+
+class BenchConn : public facade::Connection {
+ public:
+  BenchConn() : facade::Connection(facade::Protocol::REDIS, nullptr, nullptr, nullptr) {
+  }
+};
+
+// The context of a benchmark fiber, the replies of the dispatched commands go to the sink.
+struct FiberCtx {
+  BenchConn conn;
+  io::StringSink sink;
+  ConnectionContext cntx{&sink, &conn};
+  unsigned index = 0;  // of the fiber among all the fibers.
+  vector<string> keys;  // of the fiber, one per shard.
+};
+
+// Runs a transaction for the iteration i of a fiber and returns the hops it made.
+using TxFunc = function<unsigned(FiberCtx* ctx, unsigned i)>;
+
+struct BenchResult {
+  HdrHistogram latency;  // of the transactions.
+  uint64_t txs = 0;
+  uint64_t hops = 0;
+};
+
+class TxBench {
+ public:
+  TxBench(ProactorPool* pp, Service* service) : pp_(pp), service_(service) {
+  }
+
+  void RunAll();
+
+ private:
+  void Run(string_view name, const TxFunc& func);
+
+  CmdArgVec Args(const vector<string>& args, vector<string>* storage) const;
+
+  // Schedules a transaction of cid on args, every hop runs a no-op callback.
+  unsigned RunHops(string_view cmd, const vector<string>& args, unsigned num_hops);
+
+  // Runs the command like a connection does.
+  void Dispatch(FiberCtx* ctx, const vector<string>& args);
+
+  // Keys of distinct shards, at least one per shard.
+  vector<string> ShardKeys(unsigned fiber_index) const;
+
+  ProactorPool* pp_;
+  Service* service_;
+};
+
+CmdArgVec TxBench::Args(const vector<string>& args, vector<string>* storage) const {
+  *storage = args;
+  CmdArgVec res;
+  for (string& arg : *storage) {
+    res.emplace_back(arg.data(), arg.size());
+  }
+  return res;
+}
+
+unsigned TxBench::RunHops(string_view cmd, const vector<string>& args, unsigned num_hops) {
+  const CommandId* cid = service_->FindCmd(cmd);
+  CHECK(cid) << cmd;
+
+  vector<string> storage;
+  CmdArgVec arg_vec = Args(args, &storage);
+  boost::intrusive_ptr<Transaction> trans{Transaction::New(cid)};
+  CHECK(trans->InitByArgs(0, CmdArgList{arg_vec}) == OpStatus::OK);
+
+  auto noop = [](Transaction*, EngineShard*) { return OpStatus::OK; };
+  if (num_hops == 1) {
+    trans->ScheduleSingleHop(noop);
+    return 1;
+  }
+
+  trans->Schedule();
+  for (unsigned i = 1; i < num_hops; ++i) {
+    trans->Execute(noop, false);
+  }
+  trans->Execute(noop, true);
+  return num_hops;
+}
+
+void TxBench::Dispatch(FiberCtx* ctx, const vector<string>& args) {
+  vector<string> storage;
+  CmdArgVec arg_vec = Args(args, &storage);
+  service_->DispatchCommand(CmdArgList{arg_vec}, &ctx->cntx);
+  ctx->sink.Clear();
+}
+
+vector<string> TxBench::ShardKeys(unsigned fiber_index) const {
+  vector<string> keys(shard_set->size());
+  vector<bool> found(shard_set->size(), false);
+  unsigned left = shard_set->size();
+  for (unsigned i = 0; left > 0; ++i) {
+    string key = StrCat("key:", fiber_index, ":", i);
+    ShardId sid = Shard(key, shard_set->size());
+    if (!found[sid]) {
+      found[sid] = true;
+      keys[sid] = std::move(key);
+      --left;
+    }
+  }
+  return keys;
+}
+
+void TxBench::Run(string_view name, const TxFunc& func) {
+  if (!absl::StrContains(name, GetFlag(FLAGS_bench)))
+    return;
+
+  unsigned num_fibers = GetFlag(FLAGS_fibers);
+  unsigned num_txs = GetFlag(FLAGS_n);
+  vector<BenchResult> results(pp_->size());
+
+  Clock::time_point start = Clock::now();
+  pp_->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    vector<fibers::fiber> fbs(num_fibers);
+    for (unsigned f = 0; f < num_fibers; ++f) {
+      fbs[f] = fibers::fiber([&, f] {
+        FiberCtx ctx;
+        ctx.index = index * num_fibers + f;
+        ctx.keys = ShardKeys(ctx.index);
+        for (unsigned i = 0; i < num_txs; ++i) {
+          Clock::time_point tx_start = Clock::now();
+          unsigned hops = func(&ctx, i);
+          auto usec = chrono::duration_cast<chrono::microseconds>(Clock::now() - tx_start);
+          BenchResult& res = results[index];
+          res.latency.Add(usec.count());
+          res.txs += 1;
+          res.hops += hops;
+        }
+      });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+  });
+  double secs = chrono::duration<double>(Clock::now() - start).count();
+
+  BenchResult total;
+  for (const auto& res : results) {
+    total.latency += res.latency;
+    total.txs += res.txs;
+    total.hops += res.hops;
+  }
+
+  double hop_usec = total.hops ? double(total.latency.sum()) / total.hops : 0;
+  cout << name << " shards=" << shard_set->size() << ": " << uint64_t(total.txs / secs)
+       << " tx/s, " << uint64_t(total.hops / secs) << " hops/s, latency usec p50 "
+       << total.latency.Percentile(50) << " p99 " << total.latency.Percentile(99)
+       << ", per hop " << hop_usec << endl;
+}
+
+void TxBench::RunAll() {
+  // Every fiber has its own key, so the shard is usually free and the quick path runs it.
+  Run("single_hop", [this](FiberCtx* ctx, unsigned) {
+    return RunHops("GET", {"GET", StrCat("key:", ctx->index)}, 1);
+  });
+
+  // All the fibers write the same key, so the transactions wait in the queue of its shard.
+  Run("single_hop_contended",
+      [this](FiberCtx*, unsigned) { return RunHops("SET", {"SET", "hot", "v"}, 1); });
+
+  Run("mget_all_shards", [this](FiberCtx* ctx, unsigned) {
+    vector<string> args{"MGET"};
+    args.insert(args.end(), ctx->keys.begin(), ctx->keys.end());
+    return RunHops("MGET", args, 1);
+  });
+
+  Run("mset_all_shards", [this](FiberCtx* ctx, unsigned) {
+    vector<string> args{"MSET"};
+    for (const string& key : ctx->keys) {
+      args.push_back(key);
+      args.push_back("v");
+    }
+    return RunHops("MSET", args, 1);
+  });
+
+  // RENAME is a multi-hop command of two keys, the hops are the Execute calls.
+  unsigned num_hops = max(2u, GetFlag(FLAGS_hops));
+  Run("multi_hop", [this, num_hops](FiberCtx* ctx, unsigned) {
+    return RunHops("RENAME", {"RENAME", ctx->keys.front(), ctx->keys.back()}, num_hops);
+  });
+
+  // Counted as a single hop, the commands are scheduled once by EXEC.
+  Run("multi_exec", [this](FiberCtx* ctx, unsigned) {
+    Dispatch(ctx, {"MULTI"});
+    Dispatch(ctx, {"SET", ctx->keys.front(), "v"});
+    Dispatch(ctx, {"GET", ctx->keys.back()});
+    Dispatch(ctx, {"EXEC"});
+    return 1u;
+  });
+}
+
+void RunShards(unsigned num_shards) {
+  unsigned num_threads = max(num_shards, GetFlag(FLAGS_threads));
+  absl::SetFlag(&FLAGS_num_shards, num_shards);
+
+  uring::UringPool pp{16, num_threads};
+  pp.Run();
+
+  Service service{&pp};
+  Service::InitOpts opts;
+  opts.disable_time_update = true;
+  service.Init(nullptr, {}, opts);
+
+  TxBench bench{&pp, &service};
+  bench.RunAll();
+
+  service.Shutdown();
+  pp.Stop();
+}
+
+}  // namespace
+}  // namespace dfly
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  absl::SetFlag(&FLAGS_dbfilename, "");
+  init_zmalloc_threadlocal(mi_heap_get_backing());
+
+  for (string_view str : absl::StrSplit(GetFlag(FLAGS_shards), ',', absl::SkipEmpty())) {
+    unsigned num_shards = 0;
+    CHECK(absl::SimpleAtoi(str, &num_shards) && num_shards > 0) << "Invalid shards " << str;
+    dfly::RunShards(num_shards);
+  }
+
+  return 0;
+}
@@ -0,0 +1,135 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tx_stats.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+
+namespace dfly {
+using namespace std;
+
+const char* TxStageName(TxStage stage) {
+  switch (stage) {
+    case TxStage::PARSE:
+      return "parse";
+    case TxStage::SCHEDULE:
+      return "schedule";
+    case TxStage::QUEUE:
+      return "queue";
+    case TxStage::LOCK:
+      return "lock";
+    case TxStage::EXEC:
+      return "exec";
+    case TxStage::REPLY:
+      return "reply";
+    case TxStage::NUM_STAGES:
+      break;
+  }
+  return "unknown";
+}
+
+void LatencyHistogram::Add(uint64_t usec) {
+  unsigned indx = usec ? 64 - __builtin_clzll(usec) : 0;
+  ++buckets_[min(indx, kNumBuckets - 1)];
+  ++count_;
+  sum_ += usec;
+}
+
+LatencyHistogram& LatencyHistogram::operator+=(const LatencyHistogram& o) {
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] += o.buckets_[i];
+  }
+  count_ += o.count_;
+  sum_ += o.sum_;
+
+  return *this;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  // The rank of the percentile, starting from 1.
+  uint64_t rank = max<uint64_t>(1, uint64_t(p * count_ / 100 + 0.5));
+  uint64_t cnt = 0;
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    cnt += buckets_[i];
+    if (cnt >= rank)
+      return BucketBound(i);
+  }
+
+  return BucketBound(kNumBuckets - 1);
+}
+
+string LatencyHistogram::ToString() const {
+  return absl::StrCat("calls=", count_, ",avg=", count_ ? sum_ / count_ : 0,
+                      ",p50=", Percentile(50), ",p99=", Percentile(99),
+                      ",p99.9=", Percentile(99.9));
+}
+
+unsigned HdrHistogram::BucketIndex(uint64_t usec) {
+  if (usec < kSubBuckets)
+    return usec;
+
+  unsigned msb = 63 - __builtin_clzll(usec);
+  if (msb >= kMaxBits)
+    return kNumBuckets - 1;
+
+  // The kSubBits bits that follow the most significant one select the linear bucket.
+  unsigned shift = msb - kSubBits;
+  return (shift + 1) * kSubBuckets + ((usec >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t HdrHistogram::BucketMax(unsigned i) {
+  if (i < kSubBuckets)
+    return i;
+
+  unsigned shift = i / kSubBuckets - 1;
+  uint64_t sub = i % kSubBuckets;
+  return ((kSubBuckets + sub + 1) << shift) - 1;
+}
+
+void HdrHistogram::Add(uint64_t usec) {
+  ++buckets_[BucketIndex(usec)];
+  ++count_;
+  sum_ += usec;
+}
+
+HdrHistogram& HdrHistogram::operator+=(const HdrHistogram& o) {
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] += o.buckets_[i];
+  }
+  count_ += o.count_;
+  sum_ += o.sum_;
+
+  return *this;
+}
+
+uint64_t HdrHistogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  uint64_t rank = max<uint64_t>(1, uint64_t(p * count_ / 100 + 0.5));
+  uint64_t cnt = 0;
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    cnt += buckets_[i];
+    if (cnt >= rank)
+      return BucketMax(i);
+  }
+
+  return BucketMax(kNumBuckets - 1);
+}
+
+CmdLatencyStats& CmdLatencyStats::operator+=(const CmdLatencyStats& o) {
+  for (size_t i = 0; i < size_t(TxStage::NUM_STAGES); ++i) {
+    stages[i] += o.stages[i];
+  }
+  total += o.total;
+
+  return *this;
+}
+
+}  // namespace dfly
@@ -0,0 +1,126 @@
+// Copyright 2022, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <string>
+
+namespace dfly {
+
+// Stages of a command execution whose latencies are tracked separately.
+enum class TxStage : uint8_t {
+  PARSE,     // parsing of the request by the connection.
+  SCHEDULE,  // scheduling of the transaction into the tx queues of its shards.
+  QUEUE,     // waiting for the shard threads to pick up the hops from their task queues.
+  LOCK,      // waiting in the tx queues behind the conflicting transactions.
+  EXEC,      // running the hop callbacks in the shard threads.
+  REPLY,     // writing the reply into the socket.
+  NUM_STAGES
+};
+
+const char* TxStageName(TxStage stage);
+
+// Latency histogram with power of 2 buckets of microseconds. Bucket i holds the latencies
+// that are less than 2^i usec, and the last bucket holds all the rest.
+class LatencyHistogram {
+ public:
+  static constexpr unsigned kNumBuckets = 24;
+
+  void Add(uint64_t usec);
+
+  LatencyHistogram& operator+=(const LatencyHistogram& o);
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  // Sum of the latencies in usec.
+  uint64_t sum() const {
+    return sum_;
+  }
+
+  uint64_t bucket(unsigned i) const {
+    return buckets_[i];
+  }
+
+  // The exclusive upper bound of bucket i in usec.
+  static uint64_t BucketBound(unsigned i) {
+    return 1ULL << i;
+  }
+
+  // Returns the upper bound of the bucket that holds the p-th percentile, p is in [0, 100].
+  uint64_t Percentile(double p) const;
+
+  // Returns the summary like "calls=10,avg=5,p50=4,p99=16,p99.9=16".
+  std::string ToString() const;
+
+ private:
+  uint64_t buckets_[kNumBuckets] = {0};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+};
+
+// HDR-style log-linear histogram of microseconds. Each power of 2 range is split into
+// kSubBuckets linear buckets, hence the percentiles are within 1/kSubBuckets of the real values
+// up to 2^kMaxBits usec. Latencies below kSubBuckets usec are exact.
+class HdrHistogram {
+ public:
+  static constexpr unsigned kSubBits = 3;
+  static constexpr unsigned kSubBuckets = 1u << kSubBits;
+  static constexpr unsigned kMaxBits = 36;  // about 19 hours.
+  static constexpr unsigned kNumBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  void Add(uint64_t usec);
+
+  HdrHistogram& operator+=(const HdrHistogram& o);
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  uint64_t sum() const {
+    return sum_;
+  }
+
+  uint64_t bucket(unsigned i) const {
+    return buckets_[i];
+  }
+
+  // The inclusive upper bound of bucket i in usec.
+  static uint64_t BucketMax(unsigned i);
+
+  // Returns the upper bound of the bucket that holds the p-th percentile, p is in [0, 100].
+  uint64_t Percentile(double p) const;
+
+ private:
+  static unsigned BucketIndex(uint64_t usec);
+
+  uint64_t buckets_[kNumBuckets] = {0};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+};
+
+struct CmdLatencyStats {
+  LatencyHistogram stages[size_t(TxStage::NUM_STAGES)];
+
+  // End to end latency of the command within the server.
+  HdrHistogram total;
+
+  LatencyHistogram& operator[](TxStage stage) {
+    return stages[size_t(stage)];
+  }
+
+  const LatencyHistogram& operator[](TxStage stage) const {
+    return stages[size_t(stage)];
+  }
+
+  CmdLatencyStats& operator+=(const CmdLatencyStats& o);
+};
+
+// Maps command names to the latency breakdown of their executions.
+using CmdLatencyMap = absl::flat_hash_map<std::string, CmdLatencyStats>;
+
+}  // namespace dfly
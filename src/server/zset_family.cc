@@ -7,14 +7,20 @@
 extern "C" {
 #include "redis/listpack.h"
 #include "redis/object.h"
+#include "redis/redis_aux.h"
 #include "redis/util.h"
 #include "redis/zset.h"
 }
 
+#include <absl/container/flat_hash_set.h>
 #include <absl/strings/charconv.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_format.h>
 
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "core/geohash.h"
+#include "core/sorted_map.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
@@ -78,6 +84,60 @@ zlexrangespec GetLexRange(bool reverse, const ZSetFamily::LexInterval& li) {
   return range;
 }
 
+// The zset functions of redis are called only for the listpacks, the skiplist encoding holds
+// a SortedMap.
+inline SortedMap* AsSortedMap(const robj* zobj) {
+  DCHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj->encoding);
+  return (SortedMap*)zobj->ptr;
+}
+
+size_t ZsetLen(const robj* zobj) {
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST)
+    return AsSortedMap(zobj)->Size();
+  return zsetLength(zobj);
+}
+
+robj* CreateSortedMapObject() {
+  robj* res = createObject(OBJ_ZSET, new SortedMap);
+  res->encoding = OBJ_ENCODING_SKIPLIST;
+  return res;
+}
+
+// size_hint is the expected number of members, so that the map is sized once.
+void ConvertToSortedMap(robj* zobj, size_t size_hint = 0) {
+  DCHECK_EQ(OBJ_ENCODING_LISTPACK, zobj->encoding);
+
+  uint8_t* lp = (uint8_t*)zobj->ptr;
+  SortedMap* sm = new SortedMap;
+  sm->Reserve(size_hint);
+  ZSetFamily::ConvertTo(lp, sm);
+  lpFree(lp);
+
+  zobj->ptr = sm;
+  zobj->encoding = OBJ_ENCODING_SKIPLIST;
+}
+
+// Like zsetAdd, but a listpack that outgrows the limits is converted into a SortedMap.
+// tmp_str is the buffer of the member for the listpack functions.
+bool ZsetAdd(robj* zobj, double score, string_view member, int in_flags, int* out_flags,
+             double* newscore, sds* tmp_str) {
+  if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+    uint8_t* zl = (uint8_t*)zobj->ptr;
+    *tmp_str = sdscpylen(*tmp_str, member.data(), member.size());
+
+    double curscore;
+    bool fits = zsetLength(zobj) < server.zset_max_listpack_entries &&
+                member.size() <= server.zset_max_listpack_value &&
+                lpSafeToAdd(zl, member.size());
+    if (fits || (in_flags & ZADD_IN_XX) || zsetScore(zobj, *tmp_str, &curscore) == C_OK)
+      return zsetAdd(zobj, score, *tmp_str, in_flags, out_flags, newscore);
+
+    ConvertToSortedMap(zobj);
+  }
+
+  return AsSortedMap(zobj)->Add(score, member, in_flags, out_flags, newscore);
+}
+
 struct ZParams {
   unsigned flags = 0;  // mask of ZADD_IN_ macros.
   bool ch = false;     // Corresponds to CH option.
@@ -104,7 +164,7 @@ OpResult<PrimeIterator> FindZEntry(const ZParams& zparams, const OpArgs& op_args
     robj* zobj = nullptr;
 
     if (member_len > kMaxListPackValue) {
-      zobj = createZsetObject();
+      zobj = CreateSortedMapObject();
     } else {
       zobj = createZsetListpackObject();
     }
@@ -150,10 +210,10 @@ class IntervalVisitor {
 
  private:
   void ExtractListPack(const zrangespec& range);
-  void ExtractSkipList(const zrangespec& range);
-
   void ExtractListPack(const zlexrangespec& range);
-  void ExtractSkipList(const zlexrangespec& range);
+
+  // Extracts the members of the ranks [start, end) with the offset and the limit of the params.
+  void ExtractSortedMap(std::pair<size_t, size_t> ranks);
 
   void ActionRange(unsigned start, unsigned end);  // rank
   void ActionRange(const zrangespec& range);       // score
@@ -171,10 +231,6 @@ class IntervalVisitor {
     }
   }
 
-  zskiplistNode* Next(zskiplistNode* ln) const {
-    return params_.reverse ? ln->backward : ln->level[0].forward;
-  }
-
   bool IsUnder(double score, const zrangespec& spec) const {
     return params_.reverse ? zslValueGteMin(score, &spec) : zslValueLteMax(score, &spec);
   }
@@ -190,7 +246,7 @@ class IntervalVisitor {
 };
 
 void IntervalVisitor::operator()(const ZSetFamily::IndexInterval& ii) {
-  unsigned long llen = zsetLength(zobj_);
+  unsigned long llen = ZsetLen(zobj_);
   int32_t start = ii.first;
   int32_t end = ii.second;
 
@@ -276,29 +332,13 @@ void IntervalVisitor::ActionRange(unsigned start, unsigned end) {
       Next(zl, &eptr, &sptr);
     }
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    zset* zs = (zset*)zobj_->ptr;
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* ln;
-
-    /* Check if starting point is trivial, before doing log(N) lookup. */
-    if (params_.reverse) {
-      ln = zsl->tail;
-      unsigned long llen = zsetLength(zobj_);
-      if (start > 0)
-        ln = zslGetElementByRank(zsl, llen - start);
-    } else {
-      ln = zsl->header->level[0].forward;
-      if (start > 0)
-        ln = zslGetElementByRank(zsl, start + 1);
-    }
+    const SortedMap* sm = AsSortedMap(zobj_);
+    if (params_.reverse)
+      start = sm->Size() - 1 - start;
 
-    while (rangelen--) {
-      DCHECK(ln != NULL);
-      sds ele = ln->ele;
-      result_.emplace_back(string(ele, sdslen(ele)), ln->score);
-      ln = Next(ln);
-    }
+    sm->Iterate(start, rangelen, params_.reverse, [this](string_view member, double score) {
+      result_.emplace_back(string{member}, score);
+    });
   }
 }
 
@@ -306,8 +346,7 @@ void IntervalVisitor::ActionRange(const zrangespec& range) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
     ExtractListPack(range);
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    ExtractSkipList(range);
+    ExtractSortedMap(AsSortedMap(zobj_)->GetRankRange(range));
   }
 }
 
@@ -315,8 +354,7 @@ void IntervalVisitor::ActionRange(const zlexrangespec& range) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
     ExtractListPack(range);
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    ExtractSkipList(range);
+    ExtractSortedMap(AsSortedMap(zobj_)->GetRankRange(range));
   }
 }
 
@@ -328,9 +366,7 @@ void IntervalVisitor::ActionRem(unsigned start, unsigned end) {
     zl = lpDeleteRange(zl, 2 * start, 2 * removed_);
     zobj_->ptr = zl;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByRank(zs->zsl, start + 1, end + 1, zs->dict);
+    removed_ = AsSortedMap(zobj_)->DeleteRange(start, end + 1);
   }
 }
 
@@ -342,9 +378,9 @@ void IntervalVisitor::ActionRem(const zrangespec& range) {
     zobj_->ptr = zl;
     removed_ = deleted;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByScore(zs->zsl, &range, zs->dict);
+    SortedMap* sm = AsSortedMap(zobj_);
+    auto [start, end] = sm->GetRankRange(range);
+    removed_ = sm->DeleteRange(start, end);
   }
 }
 
@@ -356,9 +392,9 @@ void IntervalVisitor::ActionRem(const zlexrangespec& range) {
     zobj_->ptr = zl;
     removed_ = deleted;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByLex(zs->zsl, &range, zs->dict);
+    SortedMap* sm = AsSortedMap(zobj_);
+    auto [start, end] = sm->GetRankRange(range);
+    removed_ = sm->DeleteRange(start, end);
   }
 }
 
@@ -406,38 +442,6 @@ void IntervalVisitor::ExtractListPack(const zrangespec& range) {
   }
 }
 
-void IntervalVisitor::ExtractSkipList(const zrangespec& range) {
-  zset* zs = (zset*)zobj_->ptr;
-  zskiplist* zsl = zs->zsl;
-  zskiplistNode* ln;
-  unsigned offset = params_.offset;
-  unsigned limit = params_.limit;
-
-  /* If reversed, get the last node in range as starting point. */
-  if (params_.reverse) {
-    ln = zslLastInRange(zsl, &range);
-  } else {
-    ln = zslFirstInRange(zsl, &range);
-  }
-
-  /* If there is an offset, just traverse the number of elements without
-   * checking the score because that is done in the next loop. */
-  while (ln && offset--) {
-    ln = Next(ln);
-  }
-
-  while (ln && limit--) {
-    /* Abort when the node is no longer in range. */
-    if (!IsUnder(ln->score, range))
-      break;
-
-    result_.emplace_back(string{ln->ele, sdslen(ln->ele)}, ln->score);
-
-    /* Move to next node */
-    ln = Next(ln);
-  }
-}
-
 void IntervalVisitor::ExtractListPack(const zlexrangespec& range) {
   uint8_t* zl = (uint8_t*)zobj_->ptr;
   uint8_t *eptr, *sptr = nullptr;
@@ -486,41 +490,19 @@ void IntervalVisitor::ExtractListPack(const zlexrangespec& range) {
   }
 }
 
-void IntervalVisitor::ExtractSkipList(const zlexrangespec& range) {
-  zset* zs = (zset*)zobj_->ptr;
-  zskiplist* zsl = zs->zsl;
-  zskiplistNode* ln;
-  unsigned offset = params_.offset;
-  unsigned limit = params_.limit;
-
-  /* If reversed, get the last node in range as starting point. */
-  if (params_.reverse) {
-    ln = zslLastInLexRange(zsl, &range);
-  } else {
-    ln = zslFirstInLexRange(zsl, &range);
-  }
-
-  /* If there is an offset, just traverse the number of elements without
-   * checking the score because that is done in the next loop. */
-  while (ln && offset--) {
-    ln = Next(ln);
-  }
-
-  while (ln && limit--) {
-    /* Abort when the node is no longer in range. */
-    if (params_.reverse) {
-      if (!zslLexValueGteMin(ln->ele, &range))
-        break;
-    } else {
-      if (!zslLexValueLteMax(ln->ele, &range))
-        break;
-    }
+void IntervalVisitor::ExtractSortedMap(pair<size_t, size_t> ranks) {
+  auto [start, end] = ranks;
+  if (end - start <= params_.offset)
+    return;
 
-    result_.emplace_back(string{ln->ele, sdslen(ln->ele)}, ln->score);
+  // The ranges are read from their end if reversed.
+  size_t len = min<size_t>(end - start - params_.offset, params_.limit);
+  size_t first = params_.reverse ? end - 1 - params_.offset : start + params_.offset;
 
-    /* Move to next node */
-    ln = Next(ln);
-  }
+  AsSortedMap(zobj_)->Iterate(first, len, params_.reverse,
+                              [this](string_view member, double score) {
+                                result_.emplace_back(string{member}, score);
+                              });
 }
 
 void IntervalVisitor::AddResult(const uint8_t* vstr, unsigned vlen, long long vlong, double score) {
@@ -582,6 +564,10 @@ bool ParseLexBound(string_view src, ZSetFamily::LexBound* bound) {
   return true;
 }
 
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
+}
+
 void SendAtLeastOneKeyError(ConnectionContext* cntx) {
   string name = cntx->cid->name();
   absl::AsciiStrToLower(&name);
@@ -590,30 +576,17 @@ void SendAtLeastOneKeyError(ConnectionContext* cntx) {
 
 enum class AggType : uint8_t { SUM, MIN, MAX };
 using ScoredMap = absl::flat_hash_map<std::string, double>;
+using ScoredMemberView = ZSetFamily::ScoredMemberView;
+using ScoredMemberSpan = ZSetFamily::ScoredMemberSpan;
 
-ScoredMap FromObject(const CompactObj& co, double weight) {
-  robj* obj = co.AsRObj();
-  ZSetFamily::RangeParams params;
-  params.with_scores = true;
-  IntervalVisitor vis(Action::RANGE, params, obj);
-  vis(ZSetFamily::IndexInterval(0, -1));
-
-  ZSetFamily::ScoredArray arr = vis.PopResult();
-  ScoredMap res;
-  res.reserve(arr.size());
-
-  for (auto& elem : arr) {
-    elem.second *= weight;
-    res.emplace(move(elem));
-  }
-
-  return res;
-}
 
 double Aggregate(double v1, double v2, AggType atype) {
   switch (atype) {
-    case AggType::SUM:
-      return v1 + v2;
+    case AggType::SUM: {
+      // Like redis, -inf + inf sums to zero.
+      double res = v1 + v2;
+      return isnan(res) ? 0 : res;
+    }
     case AggType::MAX:
       return max(v1, v2);
     case AggType::MIN:
@@ -622,6 +595,72 @@ double Aggregate(double v1, double v2, AggType atype) {
   return 0;
 }
 
+// Calls cb(member, score) for all the members of the sorted set in the order of the scores.
+template <typename F> void IterateZset(const robj* zobj, F&& cb) {
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    const SortedMap* sm = AsSortedMap(zobj);
+    if (!sm->Empty())
+      sm->Iterate(0, sm->Size(), false, cb);
+    return;
+  }
+
+  uint8_t* zl = (uint8_t*)zobj->ptr;
+  uint8_t buf[LP_INTBUF_SIZE];
+  int64_t len;
+
+  for (uint8_t* eptr = lpFirst(zl); eptr;) {
+    uint8_t* sptr = lpNext(zl, eptr);
+    DCHECK(sptr);
+
+    // lpGet writes the integers into the buffer.
+    uint8_t* member = lpGet(eptr, &len, buf);
+    cb(string_view{reinterpret_cast<char*>(member), size_t(len)}, zzlGetScore(sptr));
+    eptr = lpNext(zl, sptr);
+  }
+}
+
+// Like redis, 0 * inf weighs zero.
+inline double Weigh(double score, double weight) {
+  double res = score * weight;
+  return isnan(res) ? 0 : res;
+}
+
+// Aggregates the weighted scores of the sorted set into dest.
+void UnionObject(const robj* zobj, double weight, AggType agg_type, ScoredMap* dest) {
+  dest->reserve(max(dest->size(), ZsetLen(zobj)));
+  IterateZset(zobj, [&](string_view member, double score) {
+    score = Weigh(score, weight);
+    auto [it, inserted] = dest->try_emplace(member, score);
+    if (!inserted)
+      it->second = Aggregate(it->second, score, agg_type);
+  });
+}
+
+// Keeps in dest only the members of the sorted set and aggregates their weighted scores.
+void InterObject(const robj* zobj, double weight, AggType agg_type, ScoredMap* dest) {
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    const SortedMap* sm = AsSortedMap(zobj);
+    for (auto it = dest->begin(); it != dest->end();) {
+      optional<double> score = sm->GetScore(it->first);
+      if (score) {
+        it->second = Aggregate(it->second, Weigh(*score, weight), agg_type);
+        ++it;
+      } else {
+        dest->erase(it++);
+      }
+    }
+    return;
+  }
+
+  ScoredMap res;
+  IterateZset(zobj, [&](string_view member, double score) {
+    auto it = dest->find(member);
+    if (it != dest->end())
+      res.emplace(it->first, Aggregate(it->second, Weigh(score, weight), agg_type));
+  });
+  dest->swap(res);
+}
+
 // the result is in the destination.
 void UnionScoredMap(ScoredMap* dest, ScoredMap* src, AggType agg_type) {
   ScoredMap* target = dest;
@@ -695,16 +734,12 @@ OpResult<ScoredMap> OpUnion(EngineShard* shard, Transaction* t, string_view dest
     it_arr[src_indx] = {*it_res, weights[windex]};
   }
 
+  // The sources of the shard are aggregated into a single map, so only one map per shard
+  // reaches the final merge.
   ScoredMap result;
   for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done())
-      continue;
-
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      UnionScoredMap(&result, &sm, agg_type);
+    if (!it->first.is_done())
+      UnionObject(it->first->second.AsRObj(), it->second, agg_type, &result);
   }
 
   return result;
@@ -742,27 +777,77 @@ OpResult<ScoredMap> OpInter(EngineShard* shard, Transaction* t, string_view dest
     it_arr[src_indx] = {*it_res, weights[windex]};
   }
 
-  ScoredMap result;
-  for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done()) {
+  for (const auto& [it, weight] : it_arr) {
+    if (it.is_done())
       return ScoredMap{};
-    }
+  }
 
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      InterScoredMap(&result, &sm, agg_type);
+  // Starting from the smallest source bounds the map by its size.
+  sort(it_arr.begin(), it_arr.end(), [](const auto& a, const auto& b) {
+    return ZsetLen(a.first->second.AsRObj()) < ZsetLen(b.first->second.AsRObj());
+  });
 
-    if (result.empty())
-      return result;
+  ScoredMap result;
+  UnionObject(it_arr.front().first->second.AsRObj(), it_arr.front().second, agg_type, &result);
+  for (auto it = it_arr.begin() + 1; it != it_arr.end() && !result.empty(); ++it) {
+    InterObject(it->first->second.AsRObj(), it->second, agg_type, &result);
   }
 
   return result;
 }
 
-using ScoredMemberView = std::pair<double, std::string_view>;
-using ScoredMemberSpan = absl::Span<ScoredMemberView>;
+// Replaces the key with the sorted set of the result. The object is built in one pass: small
+// results become a listpack ordered by the scores, the rest a SortedMap.
+void OpStore(const OpArgs& op_args, string_view key, ScoredMap result) {
+  auto& db_slice = op_args.shard->db_slice();
+  if (result.empty()) {
+    auto it = db_slice.FindExt(op_args.db_ind, key).first;
+    db_slice.Del(op_args.db_ind, it);
+    return;
+  }
+
+  size_t maxelelen = 0, totelelen = 0;
+  for (const auto& [member, score] : result) {
+    maxelelen = max(maxelelen, member.size());
+    totelelen += member.size();
+  }
+
+  robj* zobj = nullptr;
+  if (result.size() <= server.zset_max_listpack_entries &&
+      maxelelen <= server.zset_max_listpack_value && lpSafeToAdd(NULL, totelelen)) {
+    vector<ScoredMemberView> members;
+    members.reserve(result.size());
+    for (const auto& [member, score] : result) {
+      members.emplace_back(score, member);
+    }
+    sort(members.begin(), members.end());
+
+    uint8_t* lp = lpNew(totelelen + result.size() * 16);
+    sds& ele = op_args.shard->tmp_str1;
+    for (const auto& [score, member] : members) {
+      ele = sdscpylen(ele, member.data(), member.size());
+      lp = zzlInsertAt(lp, NULL, ele, score);
+    }
+    zobj = createObject(OBJ_ZSET, lpShrinkToFit(lp));
+    zobj->encoding = OBJ_ENCODING_LISTPACK;
+  } else {
+    // The map is filled in the order of the hash table, random inserts keep its nodes fuller
+    // than the sorted ones.
+    zobj = CreateSortedMapObject();
+    SortedMap* sm = AsSortedMap(zobj);
+    sm->Reserve(result.size());
+    for (const auto& [member, score] : result) {
+      sm->Insert(score, member);
+    }
+  }
+
+  auto [it, added] = db_slice.AddOrFind(op_args.db_ind, key);
+  if (!added) {
+    db_slice.PreUpdate(op_args.db_ind, it);
+  }
+  it->second.ImportRObj(zobj);
+  db_slice.PostUpdate(op_args.db_ind, it);
+}
 
 struct AddResult {
   double new_score = 0;
@@ -771,6 +856,41 @@ struct AddResult {
   bool is_nan = false;
 };
 
+// Converts a listpack that may outgrow its limits with the members up front, so that a large
+// batch is added to a SortedMap that is sized for it rather than converted on the way. Some of
+// the members may be in the set already, so its size is bounded from above.
+void ConvertForAdd(ScoredMemberSpan members, robj* zobj) {
+  if (zobj->encoding != OBJ_ENCODING_LISTPACK)
+    return;
+
+  size_t len = zsetLength(zobj);
+  bool fits = len + members.size() <= server.zset_max_listpack_entries;
+  for (size_t i = 0; fits && i < members.size(); ++i) {
+    fits = members[i].second.size() <= server.zset_max_listpack_value;
+  }
+
+  if (!fits)
+    ConvertToSortedMap(zobj, len + members.size());
+}
+
+// Large batches are inserted in the order of their scores, so that consecutive insertions
+// descend the same path of the tree. The order of a batch matters only if it repeats a member.
+void SortForAdd(ScoredMemberSpan members) {
+  constexpr size_t kMinSortedBatch = 64;
+  if (members.size() < kMinSortedBatch)
+    return;
+
+  absl::flat_hash_set<string_view> uniq;
+  uniq.reserve(members.size());
+  for (const auto& m : members) {
+    if (!uniq.insert(m.second).second)
+      return;
+  }
+
+  sort(members.begin(), members.end(),
+       [](const ScoredMemberView& a, const ScoredMemberView& b) { return a.first < b.first; });
+}
+
 OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_view key,
                           ScoredMemberSpan members) {
   DCHECK(!members.empty() || zparams.override);
@@ -789,11 +909,16 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
 
   robj* zobj = res_it.value()->second.AsRObj();
 
+  // INCR has a single member and XX adds none.
+  if (!(zparams.flags & (ZADD_IN_INCR | ZADD_IN_XX)))
+    ConvertForAdd(members, zobj);
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST && !(zparams.flags & ZADD_IN_INCR))
+    SortForAdd(members);
+
   unsigned added = 0;
   unsigned updated = 0;
   unsigned processed = 0;
 
-  sds& tmp_str = op_args.shard->tmp_str1;
   double new_score = 0;
   int retflags = 0;
 
@@ -802,12 +927,11 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
 
   for (size_t j = 0; j < members.size(); j++) {
     const auto& m = members[j];
-    tmp_str = sdscpylen(tmp_str, m.second.data(), m.second.size());
-
-    int retval = zsetAdd(zobj, m.first, tmp_str, zparams.flags, &retflags, &new_score);
+    bool retval = ZsetAdd(zobj, m.first, m.second, zparams.flags, &retflags, &new_score,
+                          &op_args.shard->tmp_str1);
 
     if (zparams.flags & ZADD_IN_INCR) {
-      if (retval == 0) {
+      if (!retval) {
         CHECK_EQ(1u, members.size());
 
         aresult.is_nan = true;
@@ -899,8 +1023,355 @@ OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
   return store_args;
 };
 
+// Calls cb(member, score) for the members with the scores in [min, max) in the order of their
+// scores, until cb returns false.
+template <typename F> void IterateScoreRange(const robj* zobj, double min, double max, F&& cb) {
+  zrangespec range;
+  range.min = min;
+  range.max = max;
+  range.minex = 0;
+  range.maxex = 1;
+
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    const SortedMap* sm = AsSortedMap(zobj);
+    auto [start, end] = sm->GetRankRange(range);
+
+    // Iterate does not stop midway, so the ranks are visited in batches.
+    constexpr size_t kBatch = 128;
+    bool done = false;
+    for (size_t rank = start; rank < end && !done; rank += kBatch) {
+      sm->Iterate(rank, std::min(kBatch, end - rank), false,
+                  [&](string_view member, double score) {
+                    if (!done)
+                      done = !cb(member, score);
+                  });
+    }
+    return;
+  }
+
+  uint8_t* zl = (uint8_t*)zobj->ptr;
+  uint8_t buf[LP_INTBUF_SIZE];
+  int64_t len;
+
+  for (uint8_t* eptr = zzlFirstInRange(zl, &range); eptr;) {
+    uint8_t* sptr = lpNext(zl, eptr);
+    double score = zzlGetScore(sptr);
+    if (score >= max)
+      break;
+
+    // lpGet writes the integers into the buffer.
+    uint8_t* member = lpGet(eptr, &len, buf);
+    if (!cb(string_view{reinterpret_cast<char*>(member), size_t(len)}, score))
+      break;
+    eptr = lpNext(zl, sptr);
+  }
+}
+
+optional<double> GetZScore(robj* zobj, string_view member, sds* tmp_str) {
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST)
+    return AsSortedMap(zobj)->GetScore(member);
+
+  *tmp_str = sdscpylen(*tmp_str, member.data(), member.size());
+  double score;
+  if (zsetScore(zobj, *tmp_str, &score) != C_OK)
+    return nullopt;
+  return score;
+}
+
+// Returns the scores of the members, nullopt for the missing ones.
+OpResult<vector<optional<double>>> OpGetScores(const OpArgs& op_args, string_view key,
+                                               CmdArgList members) {
+  OpResult<PrimeIterator> res_it = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_ZSET);
+  if (!res_it)
+    return res_it.status();
+
+  robj* zobj = res_it.value()->second.AsRObj();
+  vector<optional<double>> res(members.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    res[i] = GetZScore(zobj, ArgS(members, i), &op_args.shard->tmp_str1);
+  }
+  return res;
+}
+
+constexpr char kGeoUnitErr[] = "unsupported unit provided. please use M, KM, FT, MI";
+constexpr char kGeoMemberErr[] = "could not decode requested zset member";
+
+// Returns the meters in the unit or 0 if it is not one of the units of redis.
+double GeoUnit(string_view unit) {
+  if (absl::EqualsIgnoreCase(unit, "m"))
+    return 1;
+  if (absl::EqualsIgnoreCase(unit, "km"))
+    return 1000;
+  if (absl::EqualsIgnoreCase(unit, "ft"))
+    return 0.3048;
+  if (absl::EqualsIgnoreCase(unit, "mi"))
+    return 1609.34;
+  return 0;
+}
+
+// Formats a coordinate like redis does: with 17 decimals but without the trailing zeroes.
+string FormatGeoCoord(double val) {
+  string res = absl::StrFormat("%.17f", val);
+  res.erase(res.find_last_not_of('0') + 1);
+  if (res.back() == '.')
+    res.pop_back();
+  return res;
+}
+
+string FormatGeoDist(double dist) {
+  return absl::StrFormat("%.4f", dist);
+}
+
+bool ParseGeoPoint(string_view lon, string_view lat, GeoPoint* dest, ConnectionContext* cntx) {
+  if (!absl::SimpleAtod(lon, &dest->lon) || !absl::SimpleAtod(lat, &dest->lat)) {
+    (*cntx)->SendError(kInvalidFloatErr);
+    return false;
+  }
+  if (!GeoHash::IsValid(*dest)) {
+    (*cntx)->SendError(
+        absl::StrFormat("invalid longitude,latitude pair %f,%f", dest->lon, dest->lat));
+    return false;
+  }
+  return true;
+}
+
+// Parses a distance and its unit into meters and the meters of the unit.
+bool ParseGeoDist(string_view val, string_view unit, double* meters, double* unit_meters,
+                  ConnectionContext* cntx) {
+  double dist;
+  if (!absl::SimpleAtod(val, &dist)) {
+    (*cntx)->SendError("need numeric radius");
+    return false;
+  }
+  if (dist < 0) {
+    (*cntx)->SendError("radius cannot be negative");
+    return false;
+  }
+
+  *unit_meters = GeoUnit(unit);
+  if (*unit_meters == 0) {
+    (*cntx)->SendError(kGeoUnitErr);
+    return false;
+  }
+  *meters = dist * *unit_meters;
+  return true;
+}
+
+struct GeoSearchParams {
+  optional<string_view> from_member;
+  GeoPoint from{0, 0};
+
+  // The box of the search in meters, whose width and height are the diameter for a radius.
+  bool by_box = false;
+  double width = 0, height = 0, radius = 0;
+  double unit = 1;  // in meters, of the distances of the reply.
+
+  uint32_t count = 0;  // 0 for all the matches.
+  bool any = false;
+  int order = 0;  // 1 for ASC and -1 for DESC.
+  bool with_coord = false, with_dist = false, with_hash = false;
+};
+
+// Parses the options of the searches from args[i], which include the center and the shape of
+// the search if the command is GEOSEARCH.
+bool ParseGeoSearch(CmdArgList args, size_t i, bool is_search, GeoSearchParams* params,
+                    ConnectionContext* cntx) {
+  unsigned num_from = 0, num_by = 0;
+  bool has_count = false;
+
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    size_t left = args.size() - i - 1;
+
+    if (arg == "WITHCOORD") {
+      params->with_coord = true;
+    } else if (arg == "WITHDIST") {
+      params->with_dist = true;
+    } else if (arg == "WITHHASH") {
+      params->with_hash = true;
+    } else if (arg == "ASC") {
+      params->order = 1;
+    } else if (arg == "DESC") {
+      params->order = -1;
+    } else if (arg == "ANY") {
+      params->any = true;
+    } else if (arg == "COUNT" && left >= 1) {
+      int64_t count;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &count)) {
+        (*cntx)->SendError(kInvalidIntErr);
+        return false;
+      }
+      if (count <= 0) {
+        (*cntx)->SendError("COUNT must be > 0");
+        return false;
+      }
+      params->count = std::min<int64_t>(count, UINT32_MAX);
+      has_count = true;
+    } else if (is_search && arg == "FROMMEMBER" && left >= 1) {
+      params->from_member = ArgS(args, ++i);
+      ++num_from;
+    } else if (is_search && arg == "FROMLONLAT" && left >= 2) {
+      if (!ParseGeoPoint(ArgS(args, i + 1), ArgS(args, i + 2), &params->from, cntx))
+        return false;
+      i += 2;
+      ++num_from;
+    } else if (is_search && arg == "BYRADIUS" && left >= 2) {
+      if (!ParseGeoDist(ArgS(args, i + 1), ArgS(args, i + 2), &params->radius, &params->unit,
+                        cntx)) {
+        return false;
+      }
+      params->width = params->height = params->radius * 2;
+      i += 2;
+      ++num_by;
+    } else if (is_search && arg == "BYBOX" && left >= 3) {
+      if (!ParseGeoDist(ArgS(args, i + 1), ArgS(args, i + 3), &params->width, &params->unit,
+                        cntx) ||
+          !ParseGeoDist(ArgS(args, i + 2), ArgS(args, i + 3), &params->height, &params->unit,
+                        cntx)) {
+        return false;
+      }
+      params->by_box = true;
+      i += 3;
+      ++num_by;
+    } else {
+      (*cntx)->SendError(kSyntaxErr);
+      return false;
+    }
+  }
+
+  if (params->any && !has_count) {
+    (*cntx)->SendError("the ANY argument requires COUNT argument");
+    return false;
+  }
+  if (is_search && num_from != 1) {
+    (*cntx)->SendError("exactly one of FROMMEMBER or FROMLONLAT can be specified for GEOSEARCH");
+    return false;
+  }
+  if (is_search && num_by != 1) {
+    (*cntx)->SendError("exactly one of BYRADIUS and BYBOX can be specified for GEOSEARCH");
+    return false;
+  }
+  return true;
+}
+
+struct GeoMatch {
+  string member;
+  double dist;  // in meters.
+  uint64_t hash;
+};
+
+// Scans the cells that cover the box of the search and filters their points by the shape of the
+// search. With ANY, stops at COUNT matches, otherwise COUNT takes the nearest matches.
+OpResult<vector<GeoMatch>> OpGeoSearch(const OpArgs& op_args, string_view key,
+                                       const GeoSearchParams& params) {
+  OpResult<PrimeIterator> res_it = op_args.shard->db_slice().Find(op_args.db_ind, key, OBJ_ZSET);
+  if (!res_it)
+    return res_it.status();
+
+  robj* zobj = res_it.value()->second.AsRObj();
+  GeoPoint center = params.from;
+  if (params.from_member) {
+    optional<double> score = GetZScore(zobj, *params.from_member, &op_args.shard->tmp_str1);
+    if (!score)
+      return OpStatus::SKIPPED;  // replied with kGeoMemberErr.
+    center = GeoHash::Decode(uint64_t(*score));
+  }
+
+  vector<GeoMatch> matches;
+  auto visit = [&](string_view member, double score) {
+    uint64_t hash = uint64_t(score);
+    GeoPoint point = GeoHash::Decode(hash);
+
+    // The distance along the meridian rejects the points outside of the box of the search
+    // without any trigonometry.
+    if (GeoHash::LatDistance(center.lat, point.lat) > params.height / 2)
+      return true;
+
+    double dist = GeoHash::Distance(center, point);
+    if (params.by_box) {
+      if (GeoHash::Distance(GeoPoint{center.lon, point.lat}, point) > params.width / 2)
+        return true;
+    } else if (dist > params.radius) {
+      return true;
+    }
+
+    matches.push_back(GeoMatch{string{member}, dist, hash});
+    return !params.any || matches.size() < params.count;
+  };
+
+  for (const GeoHash::Range& range : GeoHash::CoverBox(center, params.width, params.height)) {
+    IterateScoreRange(zobj, double(range.min), double(range.max), visit);
+    if (params.any && matches.size() >= params.count)
+      break;
+  }
+
+  int order = params.order;
+  if (order == 0 && params.count && !params.any)
+    order = 1;
+
+  if (order != 0) {
+    auto less = [order](const GeoMatch& a, const GeoMatch& b) {
+      return order > 0 ? a.dist < b.dist : a.dist > b.dist;
+    };
+    if (params.count && params.count < matches.size()) {
+      partial_sort(matches.begin(), matches.begin() + params.count, matches.end(), less);
+    } else {
+      sort(matches.begin(), matches.end(), less);
+    }
+  }
+
+  if (params.count && matches.size() > params.count)
+    matches.resize(params.count);
+  return matches;
+}
+
+void GeoSearchGeneric(string_view key, const GeoSearchParams& params, ConnectionContext* cntx) {
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGeoSearch(OpArgs{shard, t->db_index()}, key, params);
+  };
+
+  OpResult<vector<GeoMatch>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::KEY_NOTFOUND)
+    return (*cntx)->StartArray(0);
+  if (result.status() == OpStatus::SKIPPED)
+    return (*cntx)->SendError(kGeoMemberErr);
+  if (!result)
+    return (*cntx)->SendError(result.status());
+
+  unsigned extra = params.with_dist + params.with_hash + params.with_coord;
+  (*cntx)->StartArray(result->size());
+  for (const GeoMatch& match : *result) {
+    if (extra == 0) {
+      (*cntx)->SendBulkString(match.member);
+      continue;
+    }
+
+    (*cntx)->StartArray(extra + 1);
+    (*cntx)->SendBulkString(match.member);
+    if (params.with_dist)
+      (*cntx)->SendBulkString(FormatGeoDist(match.dist / params.unit));
+    if (params.with_hash)
+      (*cntx)->SendLong(match.hash);
+    if (params.with_coord) {
+      GeoPoint point = GeoHash::Decode(match.hash);
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(FormatGeoCoord(point.lon));
+      (*cntx)->SendBulkString(FormatGeoCoord(point.lat));
+    }
+  }
+}
+
 }  // namespace
 
+OpResult<uint32_t> ZSetFamily::OpAddMembers(const OpArgs& op_args, string_view key,
+                                            ScoredMemberSpan members) {
+  OpResult<AddResult> res = OpAdd(op_args, ZParams{}, key, members);
+  if (!res)
+    return res.status();
+  return res->num_updated;
+}
+
 void ZSetFamily::ZAdd(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
 
@@ -1007,7 +1478,7 @@ void ZSetFamily::ZCard(CmdArgList args, ConnectionContext* cntx) {
       return find_res.status();
     }
 
-    return zsetLength(find_res.value()->second.AsRObj());
+    return ZsetLen(find_res.value()->second.AsRObj());
   };
 
   OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -1111,42 +1582,40 @@ void ZSetFamily::ZInterStore(CmdArgList args, ConnectionContext* cntx) {
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(cb), false);
 
-  ScoredMap result;
-  for (auto& op_res : maps) {
-    if (op_res.status() == OpStatus::SKIPPED)
-      continue;
-
-    if (!op_res)
+  for (const auto& op_res : maps) {
+    if (!op_res && op_res.status() != OpStatus::SKIPPED) {
+      cntx->transaction->Execute(NoOpCb, true);
       return (*cntx)->SendError(op_res.status());
-
-    if (result.empty())
-      result.swap(op_res.value());
-    else
-      InterScoredMap(&result, &op_res.value(), store_args.agg_type);
-    if (result.empty())
-      break;
+    }
   }
 
+  // The maps are merged and stored by the destination shard.
   ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
-  vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
-    smvec.emplace_back(elem.second, elem.first);
-  }
-
+  size_t result_size = 0;
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
     if (shard->shard_id() == dest_shard) {
-      ZParams zparams;
-      zparams.override = true;
-      add_result =
-          OpAdd(OpArgs{shard, t->db_index()}, zparams, dest_key, ScoredMemberSpan{smvec}).value();
+      ScoredMap result;
+      bool first = true;
+      for (auto& op_res : maps) {
+        if (op_res.status() == OpStatus::SKIPPED)
+          continue;
+        if (first)
+          result.swap(op_res.value());
+        else
+          InterScoredMap(&result, &op_res.value(), store_args.agg_type);
+        first = false;
+        if (result.empty())
+          break;
+      }
+      result_size = result.size();
+      OpStore(OpArgs{shard, t->db_index()}, dest_key, std::move(result));
     }
     return OpStatus::OK;
   };
 
   cntx->transaction->Execute(std::move(store_cb), true);
 
-  (*cntx)->SendLong(smvec.size());
+  (*cntx)->SendLong(result_size);
 }
 
 void ZSetFamily::ZLexCount(CmdArgList args, ConnectionContext* cntx) {
@@ -1406,35 +1875,190 @@ void ZSetFamily::ZUnionStore(CmdArgList args, ConnectionContext* cntx) {
   };
 
   cntx->transaction->Schedule();
-
   cntx->transaction->Execute(std::move(cb), false);
-  ScoredMap result;
 
-  for (auto& op_res : maps) {
-    if (!op_res)
+  for (const auto& op_res : maps) {
+    if (!op_res) {
+      cntx->transaction->Execute(NoOpCb, true);
       return (*cntx)->SendError(op_res.status());
-    UnionScoredMap(&result, &op_res.value(), store_args.agg_type);
-  }
-  ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
-  vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
-    smvec.emplace_back(elem.second, elem.first);
+    }
   }
 
+  // The maps are merged and stored by the destination shard.
+  ShardId dest_shard = Shard(dest_key, maps.size());
+  size_t result_size = 0;
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
     if (shard->shard_id() == dest_shard) {
-      ZParams zparams;
-      zparams.override = true;
-      add_result =
-          OpAdd(OpArgs{shard, t->db_index()}, zparams, dest_key, ScoredMemberSpan{smvec}).value();
+      ScoredMap result;
+      for (auto& op_res : maps) {
+        UnionScoredMap(&result, &op_res.value(), store_args.agg_type);
+      }
+      result_size = result.size();
+      OpStore(OpArgs{shard, t->db_index()}, dest_key, std::move(result));
     }
     return OpStatus::OK;
   };
 
   cntx->transaction->Execute(std::move(store_cb), true);
 
-  (*cntx)->SendLong(smvec.size());
+  (*cntx)->SendLong(result_size);
+}
+
+void ZSetFamily::GeoAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  ZParams zparams;
+  size_t i = 2;
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view cur_arg = ArgS(args, i);
+
+    if (cur_arg == "XX") {
+      zparams.flags |= ZADD_IN_XX;
+    } else if (cur_arg == "NX") {
+      zparams.flags |= ZADD_IN_NX;
+    } else if (cur_arg == "CH") {
+      zparams.ch = true;
+    } else {
+      break;
+    }
+  }
+
+  if (i == args.size() || (args.size() - i) % 3 != 0) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+  if ((zparams.flags & (ZADD_IN_NX | ZADD_IN_XX)) == (ZADD_IN_NX | ZADD_IN_XX)) {
+    return (*cntx)->SendError(kNxXxErr);
+  }
+
+  absl::InlinedVector<ScoredMemberView, 4> members;
+  for (; i < args.size(); i += 3) {
+    GeoPoint point;
+    if (!ParseGeoPoint(ArgS(args, i), ArgS(args, i + 1), &point, cntx))
+      return;
+    members.emplace_back(double(GeoHash::Encode(point)), ArgS(args, i + 2));
+  }
+
+  absl::Span memb_sp{members.data(), members.size()};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args{shard, t->db_index()};
+    return OpAdd(op_args, zparams, key, memb_sp);
+  };
+
+  OpResult<AddResult> add_result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (base::_in(add_result.status(), {OpStatus::WRONG_TYPE, OpStatus::OUT_OF_MEMORY})) {
+    return (*cntx)->SendError(add_result.status());
+  }
+
+  // KEY_NOTFOUND may happen in case of XX flag.
+  (*cntx)->SendLong(add_result ? add_result->num_updated : 0);
+}
+
+void ZSetFamily::GeoDist(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() > 5) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  double unit = args.size() == 5 ? GeoUnit(ArgS(args, 4)) : 1;
+  if (unit == 0) {
+    return (*cntx)->SendError(kGeoUnitErr);
+  }
+
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGetScores(OpArgs{shard, t->db_index()}, key, args.subspan(2, 2));
+  };
+
+  OpResult<vector<optional<double>>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE) {
+    return (*cntx)->SendError(kWrongTypeErr);
+  }
+  if (!result || !(*result)[0] || !(*result)[1]) {
+    return (*cntx)->SendNull();
+  }
+
+  double dist = GeoHash::Distance(GeoHash::Decode(uint64_t(*(*result)[0])),
+                                  GeoHash::Decode(uint64_t(*(*result)[1])));
+  (*cntx)->SendBulkString(FormatGeoDist(dist / unit));
+}
+
+void ZSetFamily::GeoHashes(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGetScores(OpArgs{shard, t->db_index()}, key, args.subspan(2));
+  };
+
+  OpResult<vector<optional<double>>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE) {
+    return (*cntx)->SendError(kWrongTypeErr);
+  }
+
+  (*cntx)->StartArray(args.size() - 2);
+  for (size_t i = 0; i < args.size() - 2; ++i) {
+    if (result && (*result)[i]) {
+      (*cntx)->SendBulkString(GeoHash::ToBase32(uint64_t(*(*result)[i])));
+    } else {
+      (*cntx)->SendNull();
+    }
+  }
+}
+
+void ZSetFamily::GeoPos(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGetScores(OpArgs{shard, t->db_index()}, key, args.subspan(2));
+  };
+
+  OpResult<vector<optional<double>>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::WRONG_TYPE) {
+    return (*cntx)->SendError(kWrongTypeErr);
+  }
+
+  (*cntx)->StartArray(args.size() - 2);
+  for (size_t i = 0; i < args.size() - 2; ++i) {
+    if (result && (*result)[i]) {
+      GeoPoint point = GeoHash::Decode(uint64_t(*(*result)[i]));
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(FormatGeoCoord(point.lon));
+      (*cntx)->SendBulkString(FormatGeoCoord(point.lat));
+    } else {
+      (*cntx)->SendNullArray();
+    }
+  }
+}
+
+// GEORADIUS key longitude latitude radius unit [options], without STORE.
+void ZSetFamily::GeoRadius(CmdArgList args, ConnectionContext* cntx) {
+  GeoSearchParams params;
+  if (!ParseGeoPoint(ArgS(args, 2), ArgS(args, 3), &params.from, cntx) ||
+      !ParseGeoDist(ArgS(args, 4), ArgS(args, 5), &params.radius, &params.unit, cntx) ||
+      !ParseGeoSearch(args, 6, false, &params, cntx)) {
+    return;
+  }
+  params.width = params.height = params.radius * 2;
+
+  GeoSearchGeneric(ArgS(args, 1), params, cntx);
+}
+
+// GEORADIUSBYMEMBER key member radius unit [options], without STORE.
+void ZSetFamily::GeoRadiusByMember(CmdArgList args, ConnectionContext* cntx) {
+  GeoSearchParams params;
+  params.from_member = ArgS(args, 2);
+  if (!ParseGeoDist(ArgS(args, 3), ArgS(args, 4), &params.radius, &params.unit, cntx) ||
+      !ParseGeoSearch(args, 5, false, &params, cntx)) {
+    return;
+  }
+  params.width = params.height = params.radius * 2;
+
+  GeoSearchGeneric(ArgS(args, 1), params, cntx);
+}
+
+void ZSetFamily::GeoSearch(CmdArgList args, ConnectionContext* cntx) {
+  GeoSearchParams params;
+  if (!ParseGeoSearch(args, 2, true, &params, cntx))
+    return;
+
+  GeoSearchGeneric(ArgS(args, 1), params, cntx);
 }
 
 void ZSetFamily::ZRangeByScoreInternal(string_view key, string_view min_s, string_view max_s,
@@ -1612,31 +2236,17 @@ OpResult<StringVec> ZSetFamily::OpScan(const OpArgs& op_args, std::string_view k
     }
     *cursor = 0;
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_SKIPLIST), zobj->encoding);
     uint32_t count = 20;
-    zset* zs = (zset*)zobj->ptr;
-
-    dict* ht = zs->dict;
+    const SortedMap* sm = AsSortedMap(zobj);
     long maxiterations = count * 10;
 
-    struct ScanArgs {
-      char* sbuf;
-      StringVec* res;
-    } sargs = {buf, &res};
-
-    auto scanCb = [](void* privdata, const dictEntry* de) {
-      ScanArgs* sargs = (ScanArgs*)privdata;
-
-      sds key = (sds)de->key;
-      double score = *(double*)dictGetVal(de);
-
-      sargs->res->emplace_back(key, sdslen(key));
-      char* str = RedisReplyBuilder::FormatDouble(score, sargs->sbuf, sizeof(buf));
-      sargs->res->emplace_back(str);
+    auto scan_cb = [&](string_view member, double score) {
+      res.emplace_back(member);
+      res.emplace_back(RedisReplyBuilder::FormatDouble(score, buf, sizeof(buf)));
     };
 
     do {
-      *cursor = dictScan(ht, *cursor, scanCb, NULL, &sargs);
+      *cursor = sm->Scan(*cursor, scan_cb);
     } while (*cursor && maxiterations-- && res.size() < count);
   }
 
@@ -1654,10 +2264,14 @@ OpResult<unsigned> ZSetFamily::OpRem(const OpArgs& op_args, string_view key, Arg
   sds& tmp_str = op_args.shard->tmp_str1;
   unsigned deleted = 0;
   for (string_view member : members) {
-    tmp_str = sdscpylen(tmp_str, member.data(), member.size());
-    deleted += zsetDel(zobj, tmp_str);
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+      deleted += AsSortedMap(zobj)->Delete(member);
+    } else {
+      tmp_str = sdscpylen(tmp_str, member.data(), member.size());
+      deleted += zsetDel(zobj, tmp_str);
+    }
   }
-  auto zlen = zsetLength(zobj);
+  auto zlen = ZsetLen(zobj);
   res_it.value()->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_ind, *res_it);
 
@@ -1674,6 +2288,13 @@ OpResult<double> ZSetFamily::OpScore(const OpArgs& op_args, string_view key, str
     return res_it.status();
 
   robj* zobj = res_it.value()->second.AsRObj();
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    optional<double> score = AsSortedMap(zobj)->GetScore(member);
+    if (!score)
+      return OpStatus::KEY_NOTFOUND;
+    return *score;
+  }
+
   sds& tmp_str = op_args.shard->tmp_str1;
   tmp_str = sdscpylen(tmp_str, member.data(), member.size());
   double score;
@@ -1715,7 +2336,7 @@ OpResult<unsigned> ZSetFamily::OpRemRange(const OpArgs& op_args, string_view key
   res_it.value()->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_ind, *res_it);
 
-  auto zlen = zsetLength(zobj);
+  auto zlen = ZsetLen(zobj);
   if (zlen == 0) {
     CHECK(op_args.shard->db_slice().Del(op_args.db_ind, res_it.value()));
   }
@@ -1730,6 +2351,13 @@ OpResult<unsigned> ZSetFamily::OpRank(const OpArgs& op_args, string_view key, st
     return res_it.status();
 
   robj* zobj = res_it.value()->second.AsRObj();
+  if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    optional<size_t> rank = AsSortedMap(zobj)->GetRank(member, reverse);
+    if (!rank)
+      return OpStatus::KEY_NOTFOUND;
+    return *rank;
+  }
+
   op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, member.data(), member.size());
 
   long res = zsetRank(zobj, op_args.shard->tmp_str1, reverse);
@@ -1780,30 +2408,8 @@ OpResult<unsigned> ZSetFamily::OpCount(const OpArgs& op_args, std::string_view k
       }
     }
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_SKIPLIST), zobj->encoding);
-    zset* zs = (zset*)zobj->ptr;
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* zn;
-    unsigned long rank;
-
-    /* Find first element in range */
-    zn = zslFirstInRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn == NULL)
-      return 0;
-
-    rank = zslGetRank(zsl, zn->score, zn->ele);
-    count = (zsl->length - (rank - 1));
-
-    /* Find last element in range */
-    zn = zslLastInRange(zsl, &range);
-
-    /* Use rank of last element, if any, to determine the actual count */
-    if (zn != NULL) {
-      rank = zslGetRank(zsl, zn->score, zn->ele);
-      count -= (zsl->length - rank);
-    }
+    auto [start, end] = AsSortedMap(zobj)->GetRankRange(range);
+    count = end - start;
   }
 
   return count;
@@ -1843,35 +2449,32 @@ OpResult<unsigned> ZSetFamily::OpLexCount(const OpArgs& op_args, string_view key
       }
     }
   } else {
-    DCHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj->encoding);
-    zset* zs = (zset*)zobj->ptr;
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* zn;
-    unsigned long rank;
-
-    /* Find first element in range */
-    zn = zslFirstInLexRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn != NULL) {
-      rank = zslGetRank(zsl, zn->score, zn->ele);
-      count = (zsl->length - (rank - 1));
-
-      /* Find last element in range */
-      zn = zslLastInLexRange(zsl, &range);
-
-      /* Use rank of last element, if any, to determine the actual count */
-      if (zn != NULL) {
-        rank = zslGetRank(zsl, zn->score, zn->ele);
-        count -= (zsl->length - rank);
-      }
-    }
+    auto [start, end] = AsSortedMap(zobj)->GetRankRange(range);
+    count = end - start;
   }
 
   zslFreeLexRange(&range);
   return count;
 }
 
+void ZSetFamily::ConvertTo(uint8_t* src, SortedMap* dest) {
+  uint8_t buf[LP_INTBUF_SIZE];
+  int64_t len;
+
+  dest->Reserve(lpLength(src) / 2);
+  for (uint8_t* eptr = lpFirst(src); eptr;) {
+    uint8_t* sptr = lpNext(src, eptr);
+    DCHECK(sptr);
+
+    // lpGet writes the integers into the buffer.
+    uint8_t* member = lpGet(eptr, &len, buf);
+    CHECK(dest->Insert(zzlGetScore(sptr),
+                       string_view{reinterpret_cast<char*>(member), size_t(len)}));
+
+    eptr = lpNext(src, sptr);
+  }
+}
+
 #define HFUNC(x) SetHandler(&ZSetFamily::x)
 
 void ZSetFamily::Register(CommandRegistry* registry) {
@@ -1896,7 +2499,14 @@ void ZSetFamily::Register(CommandRegistry* registry) {
             << CI{"ZREVRANGEBYSCORE", CO::READONLY, -4, 1, 1, 1}.HFUNC(ZRevRangeByScore)
             << CI{"ZREVRANK", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(ZRevRank)
             << CI{"ZSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(ZScan)
-            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore);
+            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore)
+            << CI{"GEOADD", CO::FAST | CO::WRITE | CO::DENYOOM, -5, 1, 1, 1}.HFUNC(GeoAdd)
+            << CI{"GEODIST", CO::READONLY, -4, 1, 1, 1}.HFUNC(GeoDist)
+            << CI{"GEOHASH", CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoHashes)
+            << CI{"GEOPOS", CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoPos)
+            << CI{"GEORADIUS", CO::READONLY, -6, 1, 1, 1}.HFUNC(GeoRadius)
+            << CI{"GEORADIUSBYMEMBER", CO::READONLY, -5, 1, 1, 1}.HFUNC(GeoRadiusByMember)
+            << CI{"GEOSEARCH", CO::READONLY, -7, 1, 1, 1}.HFUNC(GeoSearch);
 }
 
 }  // namespace dfly
@@ -13,11 +13,15 @@ namespace dfly {
 
 class ConnectionContext;
 class CommandRegistry;
+class SortedMap;
 
 class ZSetFamily {
  public:
   static void Register(CommandRegistry* registry);
 
+  // Converts the listpack of a sorted set into an empty map.
+  static void ConvertTo(uint8_t* src, SortedMap* dest);
+
   using IndexInterval = std::pair<int32_t, int32_t>;
 
   struct Bound {
@@ -48,6 +52,13 @@ class ZSetFamily {
 
   using ScoredMember = std::pair<std::string, double>;
   using ScoredArray = std::vector<ScoredMember>;
+  using ScoredMemberView = std::pair<double, std::string_view>;
+  using ScoredMemberSpan = absl::Span<ScoredMemberView>;
+
+  // Adds the members to the sorted set of key, creating it if needed. Must run in the shard
+  // thread of key. Returns the number of the new members.
+  static facade::OpResult<uint32_t> OpAddMembers(const OpArgs& op_args, std::string_view key,
+                                                 ScoredMemberSpan members);
 
  private:
   template <typename T> using OpResult = facade::OpResult<T>;
@@ -73,6 +84,15 @@ class ZSetFamily {
   static void ZScan(CmdArgList args, ConnectionContext* cntx);
   static void ZUnionStore(CmdArgList args, ConnectionContext* cntx);
 
+  // The GEO commands, whose points are the members of sorted sets scored by their geohashes.
+  static void GeoAdd(CmdArgList args, ConnectionContext* cntx);
+  static void GeoDist(CmdArgList args, ConnectionContext* cntx);
+  static void GeoHashes(CmdArgList args, ConnectionContext* cntx);
+  static void GeoPos(CmdArgList args, ConnectionContext* cntx);
+  static void GeoRadius(CmdArgList args, ConnectionContext* cntx);
+  static void GeoRadiusByMember(CmdArgList args, ConnectionContext* cntx);
+  static void GeoSearch(CmdArgList args, ConnectionContext* cntx);
+
   static void ZRangeByScoreInternal(std::string_view key, std::string_view min_s,
                                     std::string_view max_s, const RangeParams& params,
                                     ConnectionContext* cntx);
@@ -4,6 +4,8 @@
 
 #include "server/zset_family.h"
 
+#include <absl/strings/str_cat.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -51,6 +53,35 @@ TEST_F(ZSetFamilyTest, Add) {
   EXPECT_EQ(0.79028573343077946, 0.7902857334307795);
 }
 
+TEST_F(ZSetFamilyTest, AddBatch) {
+  // Added to a small set, in descending scores and with a repeated member.
+  Run({"zadd", "key", "5", "a"});
+  vector<string> args{"zadd", "key"};
+  for (unsigned i = 0; i < 500; ++i) {
+    args.push_back(absl::StrCat(1000 - i));
+    args.push_back(absl::StrCat("m", i));
+  }
+  args.insert(args.end(), {"1", "m0"});
+
+  vector<string_view> sv(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(500));
+  EXPECT_EQ(501, CheckedInt({"zcard", "key"}));
+  EXPECT_EQ(Run({"zscore", "key", "m0"}), "1");
+  EXPECT_THAT(Run({"zrange", "key", "0", "2"}).GetVec(), ElementsAre("m0", "a", "m499"));
+
+  // Without repeated members the batch is sorted before it is added.
+  args.resize(2);
+  for (unsigned i = 0; i < 500; ++i) {
+    args.push_back(absl::StrCat(i));
+    args.push_back(absl::StrCat("n", i));
+  }
+  sv.assign(args.begin(), args.end());
+  EXPECT_THAT(Run(absl::MakeSpan(sv)), IntArg(500));
+  EXPECT_EQ(Run({"zscore", "key", "n7"}), "7");
+  EXPECT_EQ(1001, CheckedInt({"zcard", "key"}));
+  EXPECT_EQ(2, CheckedInt({"zrank", "key", "n1"}));
+}
+
 TEST_F(ZSetFamilyTest, ZRem) {
   auto resp = Run({"zadd", "x", "1.1", "b", "2.1", "a"});
   EXPECT_THAT(resp, IntArg(2));
@@ -243,9 +274,150 @@ TEST_F(ZSetFamilyTest, ZInterStore) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("b", "4"));
 }
 
+TEST_F(ZSetFamilyTest, StoreLarge) {
+  // z1 and z2 are sorted maps, z3 is a listpack.
+  constexpr unsigned kNum = 300;
+  for (unsigned i = 0; i < kNum; ++i) {
+    Run({"zadd", "z1", absl::StrCat(i), absl::StrCat("m", i)});
+    Run({"zadd", "z2", absl::StrCat(i), absl::StrCat("m", i + kNum / 2)});
+  }
+  EXPECT_EQ(2, CheckedInt({"zadd", "z3", "1", "m200", "1", "m0"}));
+
+  EXPECT_EQ(kNum * 3 / 2, CheckedInt({"zunionstore", "u", "2", "z1", "z2", "weights", "2", "1"}));
+  EXPECT_EQ(Run({"zscore", "u", "m200"}), "450");
+  EXPECT_EQ(0, CheckedInt({"zrank", "u", "m0"}));
+
+  EXPECT_EQ(kNum / 2, CheckedInt({"zinterstore", "i", "2", "z1", "z2", "aggregate", "min"}));
+  EXPECT_EQ(Run({"zscore", "i", "m200"}), "50");
+  EXPECT_EQ(0, CheckedInt({"zrank", "i", "m150"}));
+
+  auto resp = Run({"zinterstore", "i", "3", "z1", "z2", "z3"});
+  EXPECT_THAT(resp, IntArg(1));
+  resp = Run({"zrange", "i", "0", "-1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m200", "251"));
+
+  Run({"set", "foo", "bar"});
+  resp = Run({"zunionstore", "u", "2", "z1", "foo"});
+  EXPECT_THAT(resp, ErrArg("WRONGTYPE"));
+  EXPECT_EQ(kNum * 3 / 2, CheckedInt({"zcard", "u"}));
+}
+
+TEST_F(ZSetFamilyTest, ZIncrByListpack) {
+  Run({"zadd", "key", "1", "a", "2", "b", "3", "c", "3", "d"});
+
+  // The scores that keep the order are replaced in place.
+  EXPECT_EQ(Run({"zincrby", "key", "0.5", "b"}), "2.5");
+  EXPECT_EQ(Run({"zincrby", "key", "0.5", "b"}), "3");
+  auto resp = Run({"zrange", "key", "0", "-1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "b", "3", "c", "3", "d", "3"));
+
+  // The others move.
+  EXPECT_EQ(Run({"zincrby", "key", "1000", "a"}), "1001");
+  EXPECT_EQ(Run({"zincrby", "key", "-10", "d"}), "-7");
+  resp = Run({"zrange", "key", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("d", "b", "c", "a"));
+}
+
 TEST_F(ZSetFamilyTest, ZAddBug148) {
   auto resp = Run({"zadd", "key", "1", "9fe9f1eb"});
   EXPECT_THAT(resp, IntArg(1));
 }
 
+TEST_F(ZSetFamilyTest, SortedMap) {
+  // More members than a listpack holds, so the set converts to the skiplist encoding.
+  constexpr unsigned kNum = 300;
+  for (unsigned i = 0; i < kNum; ++i) {
+    Run({"zadd", "key", absl::StrCat(i / 2), absl::StrCat("m", i)});
+  }
+  EXPECT_EQ(kNum, CheckedInt({"zcard", "key"}));
+  EXPECT_EQ(Run({"zscore", "key", "m7"}), "3");
+  EXPECT_EQ(7, CheckedInt({"zrank", "key", "m7"}));
+  EXPECT_EQ(kNum - 8, CheckedInt({"zrevrank", "key", "m7"}));
+  EXPECT_EQ(0, CheckedInt({"zadd", "key", "nx", "100", "m7"}));
+  EXPECT_EQ(Run({"zincrby", "key", "0.5", "m7"}), "3.5");
+  EXPECT_EQ(7, CheckedInt({"zrank", "key", "m7"}));
+
+  auto resp = Run({"zrange", "key", "1", "2", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m1", "0", "m2", "1"));
+  resp = Run({"zrevrange", "key", "0", "1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m299", "m298"));
+  resp = Run({"zrangebyscore", "key", "(1", "3", "limit", "1", "10"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m5", "m6"));
+  resp = Run({"zrevrangebyscore", "key", "3", "(1", "limit", "1", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m5", "m4"));
+  EXPECT_EQ(4, CheckedInt({"zcount", "key", "(1", "3.5"}));
+
+  EXPECT_EQ(2, CheckedInt({"zrem", "key", "m0", "m1", "m1"}));
+  EXPECT_EQ(10, CheckedInt({"zremrangebyrank", "key", "0", "9"}));
+  EXPECT_EQ(2, CheckedInt({"zremrangebyscore", "key", "6", "6"}));
+  EXPECT_EQ(kNum - 14, CheckedInt({"zcard", "key"}));
+  EXPECT_EQ(0, CheckedInt({"zrank", "key", "m14"}));
+
+  // The lex ranges assume equal scores.
+  for (char c = 'a'; c <= 'z'; ++c) {
+    Run({"zadd", "lex", "0", string(100, c)});
+  }
+  EXPECT_EQ(3, CheckedInt({"zlexcount", "lex", absl::StrCat("[", string(100, 'b')),
+                           absl::StrCat("(", string(100, 'e'))}));
+  EXPECT_EQ(24, CheckedInt({"zremrangebylex", "lex", "(a", "(z"}));
+  EXPECT_EQ(2, CheckedInt({"zcard", "lex"}));
+}
+
+TEST_F(ZSetFamilyTest, Geo) {
+  EXPECT_EQ(2, CheckedInt({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo", "15.087269",
+                           "37.502669", "Catania"}));
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania"}), "166274.1516");
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania", "km"}), "166.2742");
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "foo"}), ArgType(RespExpr::NIL));
+
+  auto resp = Run({"geohash", "Sicily", "Palermo", "Catania", "foo"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_EQ(resp.GetVec()[0], "sqc8b49rny0");
+  EXPECT_EQ(resp.GetVec()[1], "sqdtr74hyu0");
+  EXPECT_THAT(resp.GetVec()[2], ArgType(RespExpr::NIL));
+
+  resp = Run({"geopos", "Sicily", "Palermo", "foo"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(),
+              ElementsAre("13.36138933897018433", "38.11555639549629859"));
+  EXPECT_THAT(resp.GetVec()[1], ArgType(RespExpr::NIL_ARRAY));
+
+  resp = Run({"geosearch", "Sicily", "fromlonlat", "15", "37", "byradius", "200", "km", "asc",
+              "withdist"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("Catania", "56.4413"));
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("Palermo", "190.4424"));
+
+  resp = Run({"georadius", "Sicily", "15", "37", "100", "km"});
+  EXPECT_EQ(resp, "Catania");
+  resp = Run({"geosearch", "Sicily", "frommember", "Palermo", "bybox", "400", "400", "km", "desc"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("Catania", "Palermo"));
+  resp = Run({"georadiusbymember", "Sicily", "Palermo", "500", "km", "count", "1", "any"});
+  EXPECT_THAT(resp, ArgType(RespExpr::STRING));
+  EXPECT_THAT(Run({"georadius", "foo", "15", "37", "100", "km"}), ArrLen(0));
+
+  EXPECT_THAT(Run({"geoadd", "Sicily", "200", "37", "foo"}),
+              ErrArg("invalid longitude,latitude pair 200.000000,37.000000"));
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "Catania", "yd"}), ErrArg("unsupported unit"));
+  EXPECT_THAT(Run({"georadiusbymember", "Sicily", "foo", "100", "km"}),
+              ErrArg("could not decode requested zset member"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "byradius", "100", "km"}), ErrArg("syntax error"));
+}
+
+TEST_F(ZSetFamilyTest, GeoSortedMap) {
+  // More points than a listpack holds, 85 meters apart along the parallel.
+  for (unsigned i = 0; i < 200; ++i) {
+    Run({"geoadd", "key", absl::StrCat(10 + i * 0.001), "40", absl::StrCat("m", i)});
+  }
+  EXPECT_EQ(200, CheckedInt({"zcard", "key"}));
+
+  auto resp = Run({"georadius", "key", "10", "40", "1", "km"});
+  EXPECT_THAT(resp, ArrLen(12));
+  resp = Run({"georadius", "key", "10", "40", "1", "km", "count", "3"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m0", "m1", "m2"));
+  resp = Run({"geosearch", "key", "frommember", "m100", "bybox", "1", "1", "km", "asc"});
+  EXPECT_THAT(resp, ArrLen(11));
+  EXPECT_EQ(resp.GetVec()[0], "m100");
+}
+
 }  // namespace dfly
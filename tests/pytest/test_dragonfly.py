@@ -44,3 +44,26 @@ def test_blpop_multiple_keys(client : redis.Redis, index):
     client.lpush('list2{t}', 'b')
     assert wt_blpop.wait(2)
     assert wt_blpop.result[1] == 'b'
+
+
+def test_active_connection_keeps_read_buffer(client : redis.Redis):
+    conn = redis.Redis(decode_responses=True)
+    conn.client_setname('buf-keeper')
+
+    def read_buf_free():
+        for info in client.client_list():
+            if info['name'] == 'buf-keeper':
+                return int(info['qbuf-free'])
+        return 0
+
+    # A long pipeline grows the read buffer, which is kept while the connection is busy,
+    # see conn_buf_idle_sec.
+    pipe = conn.pipeline(transaction=False)
+    for i in range(2000):
+        pipe.set(f'buf:{i}', 'x' * 16)
+    pipe.execute()
+    assert read_buf_free() > 256
+
+    for i in range(10):
+        assert conn.get(f'buf:{i}') == 'x' * 16
+    assert read_buf_free() > 256